@@ -116,10 +116,14 @@ bool CBanDB::Read(banmap_t& banSet)
 CAddrDB::CAddrDB()
 {
     pathAddr = GetDataDir() / "peers.dat";
+    pathJournal = GetDataDir() / "peers.log";
 }
 
-bool CAddrDB::Write(const CAddrMan& addr)
+bool CAddrDB::Write(CAddrMan& addr)
 {
+    // Whatever changed up to here is part of the snapshot
+    addr.ClearJournal();
+
     // Generate random temporary filename
     unsigned short randv = 0;
     GetRandBytes((unsigned char*)&randv, sizeof(randv));
@@ -153,6 +157,140 @@ bool CAddrDB::Write(const CAddrMan& addr)
     if (!RenameOver(pathTmp, pathAddr))
         return error("%s: Rename-into-place failed", __func__);
 
+    // The journal is for the previous snapshot; if removing it fails, its
+    // batches are ignored on load anyway.
+    boost::system::error_code ec;
+    boost::filesystem::remove(pathJournal, ec);
+
+    return true;
+}
+
+bool CAddrDB::ReadSnapshotHash(uint256& hashSnapshot)
+{
+    FILE *file = fopen(pathAddr.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    if (fseek(filein.Get(), -(long)sizeof(uint256), SEEK_END) != 0)
+        return false;
+    try {
+        filein >> hashSnapshot;
+    }
+    catch (const std::exception& e) {
+        return false;
+    }
+    return true;
+}
+
+bool CAddrDB::Dump(CAddrMan& addr)
+{
+    uint256 hashSnapshot;
+    if (!ReadSnapshotHash(hashSnapshot))
+        return Write(addr);
+
+    boost::system::error_code ec;
+    uint64_t nJournalSize = boost::filesystem::file_size(pathJournal, ec);
+    if (!ec && nJournalSize > ADDRDB_JOURNAL_COMPACT_MIN_SIZE &&
+            nJournalSize > boost::filesystem::file_size(pathAddr, ec) / ADDRDB_JOURNAL_COMPACT_RATIO) {
+        LogPrint("addrman", "Compacting %u bytes of peers.log into peers.dat\n", nJournalSize);
+        return Write(addr);
+    }
+
+    if (addr.JournalSize() == 0)
+        return true;
+    if (!AppendJournal(addr, hashSnapshot)) {
+        // The changes are gone from the journal; keep them in a snapshot instead
+        return Write(addr);
+    }
+    return true;
+}
+
+bool CAddrDB::AppendJournal(CAddrMan& addr, const uint256& hashSnapshot)
+{
+    // batch: magic, payload size, payload (snapshot checksum and entries), payload checksum
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    ssPayload << hashSnapshot;
+    ssPayload << addr.GetJournal();
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+
+    FILE *file = fopen(pathJournal.string().c_str(), "ab");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: Failed to open file %s", __func__, pathJournal.string());
+
+    try {
+        fileout << FLATDATA(Params().MessageStart());
+        fileout << (uint32_t)ssPayload.size();
+        fileout.write(&ssPayload[0], ssPayload.size());
+        fileout << hash;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    return true;
+}
+
+bool CAddrDB::ReadJournal(CAddrMan& addr, const uint256& hashSnapshot)
+{
+    FILE *file = fopen(pathJournal.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return true; // no changes since the snapshot
+
+    int nBatches = 0, nEntries = 0;
+    while (true) {
+        unsigned char pchMsgTmp[4];
+        uint32_t nPayloadSize;
+        CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+        uint256 hashIn;
+        try {
+            filein >> FLATDATA(pchMsgTmp);
+        }
+        catch (const std::exception& e) {
+            break; // end of the journal
+        }
+        try {
+            filein >> nPayloadSize;
+            if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) || nPayloadSize > MAX_SIZE) {
+                LogPrintf("%s: Invalid batch in peers.log, ignoring the rest\n", __func__);
+                break;
+            }
+            ssPayload.resize(nPayloadSize);
+            filein.read(&ssPayload[0], nPayloadSize);
+            filein >> hashIn;
+        }
+        catch (const std::exception& e) {
+            // A dump interrupted by a crash leaves a truncated last batch
+            LogPrintf("%s: Truncated batch in peers.log, ignoring it\n", __func__);
+            break;
+        }
+        if (hashIn != Hash(ssPayload.begin(), ssPayload.end())) {
+            LogPrintf("%s: Checksum mismatch in peers.log, ignoring the rest\n", __func__);
+            break;
+        }
+
+        uint256 hashBatchSnapshot;
+        std::vector<CAddrJournalEntry> vEntries;
+        try {
+            ssPayload >> hashBatchSnapshot;
+            if (hashBatchSnapshot != hashSnapshot)
+                continue; // written for an older snapshot
+            ssPayload >> vEntries;
+        }
+        catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize error in peers.log, ignoring the rest - %s\n", __func__, e.what());
+            break;
+        }
+        addr.ApplyJournal(vEntries);
+        nBatches++;
+        nEntries += vEntries.size();
+    }
+    // Replayed changes are on disk already
+    addr.ClearJournal();
+    if (nBatches > 0)
+        LogPrint("addrman", "Replayed %d changes in %d batches from peers.log\n", nEntries, nBatches);
     return true;
 }
 
@@ -170,13 +308,14 @@ bool CAddrDB::Read(CAddrMan& addr)
     // Don't try to resize to a negative number if file is small
     if (fileSize >= sizeof(uint256))
         dataSize = fileSize - sizeof(uint256);
-    std::vector<unsigned char> vchData;
-    vchData.resize(dataSize);
+    // read straight into the stream we deserialize from, without an intermediate copy
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers.resize(dataSize);
     uint256 hashIn;
 
     // read data and checksum from file
     try {
-        filein.read((char *)&vchData[0], dataSize);
+        filein.read(&ssPeers[0], dataSize);
         filein >> hashIn;
     }
     catch (const std::exception& e) {
@@ -184,14 +323,15 @@ bool CAddrDB::Read(CAddrMan& addr)
     }
     filein.fclose();
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
-
     // verify stored checksum matches input data
     uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
     if (hashIn != hashTmp)
         return error("%s: Checksum mismatch, data corrupted", __func__);
 
-    return Read(addr, ssPeers);
+    if (!Read(addr, ssPeers))
+        return false;
+
+    return ReadJournal(addr, hashIn);
 }
 
 bool CAddrDB::Read(CAddrMan& addr, CDataStream& ssPeers)
@@ -15,6 +15,12 @@
 class CSubNet;
 class CAddrMan;
 class CDataStream;
+class uint256;
+
+/** peers.log is folded into a new peers.dat once larger than this... */
+static const uint64_t ADDRDB_JOURNAL_COMPACT_MIN_SIZE = 256 * 1024;
+/** ...and larger than 1/ADDRDB_JOURNAL_COMPACT_RATIO of peers.dat */
+static const uint64_t ADDRDB_JOURNAL_COMPACT_RATIO = 2;
 
 typedef enum BanReason
 {
@@ -76,14 +82,31 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
-/** Access to the (IP) address database (peers.dat) */
+/**
+ * Access to the (IP) address database (peers.dat)
+ *
+ * peers.dat holds a full snapshot of the address manager. Changes made since
+ * are appended to a journal (peers.log) in checksummed batches, each tagged
+ * with the checksum of the snapshot it applies to, so a periodic dump only
+ * writes what changed. Once the journal grows too large it is compacted into
+ * a new snapshot.
+ */
 class CAddrDB
 {
 private:
     boost::filesystem::path pathAddr;
+    boost::filesystem::path pathJournal;
+
+    bool ReadSnapshotHash(uint256& hashSnapshot);
+    bool AppendJournal(CAddrMan& addr, const uint256& hashSnapshot);
+    bool ReadJournal(CAddrMan& addr, const uint256& hashSnapshot);
 public:
     CAddrDB();
-    bool Write(const CAddrMan& addr);
+    //! Write a full snapshot and discard the journal
+    bool Write(CAddrMan& addr);
+    //! Append the changes since the last dump to the journal, or compact into a new snapshot
+    bool Dump(CAddrMan& addr);
+    //! Read the snapshot and replay the journal on top of it
     bool Read(CAddrMan& addr);
     bool Read(CAddrMan& addr, CDataStream& ssPeers);
 };
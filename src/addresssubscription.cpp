@@ -0,0 +1,217 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addresssubscription.h"
+
+#include "addressindex.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <chrono>
+
+CAddressSubscriptions addressSubscriptions;
+
+CAddressSubscriptions::CAddressSubscriptions() : fActive(false), fInterrupted(false)
+{
+}
+
+void CAddressSubscriptions::AddAddressesLocked(const std::string& id, CSubscription& sub, const std::vector<std::pair<uint160, int> >& addresses)
+{
+    for (const std::pair<uint160, int>& address : addresses) {
+        Address key(address.second, address.first);
+        if (sub.setAddresses.insert(key).second)
+            mapAddressSubscribers[key].insert(id);
+    }
+}
+
+void CAddressSubscriptions::EraseLocked(std::map<std::string, CSubscription>::iterator it)
+{
+    for (const Address& address : it->second.setAddresses) {
+        std::map<Address, std::set<std::string> >::iterator itAddr = mapAddressSubscribers.find(address);
+        if (itAddr == mapAddressSubscribers.end())
+            continue;
+        itAddr->second.erase(it->first);
+        if (itAddr->second.empty())
+            mapAddressSubscribers.erase(itAddr);
+    }
+    mapSubscriptions.erase(it);
+    fActive = !mapSubscriptions.empty();
+    cond.notify_all();
+}
+
+void CAddressSubscriptions::ExpireLocked()
+{
+    int64_t nExpire = GetTime() - ADDRESS_SUBSCRIPTION_EXPIRY;
+    for (std::map<std::string, CSubscription>::iterator it = mapSubscriptions.begin(); it != mapSubscriptions.end(); ) {
+        if (it->second.nWaiters == 0 && it->second.nLastPoll < nExpire) {
+            LogPrint("rpc", "Dropping address subscription %s, not polled for %d seconds\n", it->first, ADDRESS_SUBSCRIPTION_EXPIRY);
+            EraseLocked(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::string CAddressSubscriptions::Subscribe(const std::vector<std::pair<uint160, int> >& addresses)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    ExpireLocked();
+    if (mapSubscriptions.size() >= MAX_ADDRESS_SUBSCRIPTIONS)
+        return "";
+
+    std::string id = GetRandHash().GetHex().substr(0, 32);
+    CSubscription& sub = mapSubscriptions[id];
+    sub.nLastPoll = GetTime();
+    AddAddressesLocked(id, sub, addresses);
+    fActive = true;
+    return id;
+}
+
+bool CAddressSubscriptions::AddAddresses(const std::string& id, const std::vector<std::pair<uint160, int> >& addresses)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    std::map<std::string, CSubscription>::iterator it = mapSubscriptions.find(id);
+    if (it == mapSubscriptions.end())
+        return false;
+    it->second.nLastPoll = GetTime();
+    AddAddressesLocked(id, it->second, addresses);
+    return true;
+}
+
+bool CAddressSubscriptions::Unsubscribe(const std::string& id)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    std::map<std::string, CSubscription>::iterator it = mapSubscriptions.find(id);
+    if (it == mapSubscriptions.end())
+        return false;
+    EraseLocked(it);
+    return true;
+}
+
+bool CAddressSubscriptions::Wait(const std::string& id, int64_t nTimeoutMillis, size_t nMaxCount,
+                                 std::vector<CAddressSubscriptionDelta>& vDeltas, bool& fOverflow)
+{
+    std::unique_lock<std::mutex> lock(cs);
+    std::map<std::string, CSubscription>::iterator it = mapSubscriptions.find(id);
+    if (it == mapSubscriptions.end())
+        return false;
+
+    if (it->second.deltas.empty() && nTimeoutMillis > 0 && !fInterrupted) {
+        // Subscriptions are only erased under the lock, which waiting
+        // releases, so look this one up again afterwards
+        it->second.nWaiters++;
+        cond.wait_for(lock, std::chrono::milliseconds(nTimeoutMillis), [this, &id]{
+            std::map<std::string, CSubscription>::const_iterator itWait = mapSubscriptions.find(id);
+            return fInterrupted || itWait == mapSubscriptions.end() || !itWait->second.deltas.empty();
+        });
+        it = mapSubscriptions.find(id);
+        if (it == mapSubscriptions.end())
+            return false;
+        it->second.nWaiters--;
+    }
+
+    CSubscription& sub = it->second;
+    sub.nLastPoll = GetTime();
+    size_t nCount = std::min(nMaxCount, sub.deltas.size());
+    vDeltas.assign(sub.deltas.begin(), sub.deltas.begin() + nCount);
+    sub.deltas.erase(sub.deltas.begin(), sub.deltas.begin() + nCount);
+    fOverflow = sub.fOverflow;
+    sub.fOverflow = false;
+    return true;
+}
+
+void CAddressSubscriptions::PushLocked(const CAddressSubscriptionDelta& delta)
+{
+    std::map<Address, std::set<std::string> >::const_iterator itAddr = mapAddressSubscribers.find(Address(delta.type, delta.hashBytes));
+    if (itAddr == mapAddressSubscribers.end())
+        return;
+    for (const std::string& id : itAddr->second) {
+        CSubscription& sub = mapSubscriptions[id];
+        if (sub.deltas.size() >= MAX_ADDRESS_SUBSCRIPTION_DELTAS) {
+            sub.deltas.pop_front();
+            sub.fOverflow = true;
+        }
+        sub.deltas.push_back(delta);
+    }
+}
+
+void CAddressSubscriptions::NotifyMempool(const std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >& deltas)
+{
+    if (!fActive)
+        return;
+
+    std::lock_guard<std::mutex> lock(cs);
+    bool fPushed = false;
+    for (const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& entry : deltas) {
+        if (!mapAddressSubscribers.count(Address(entry.first.type, entry.first.addressBytes)))
+            continue;
+        CAddressSubscriptionDelta delta;
+        delta.type = entry.first.type;
+        delta.hashBytes = entry.first.addressBytes;
+        delta.txhash = entry.first.txhash;
+        delta.index = entry.first.index;
+        delta.spending = entry.first.spending != 0;
+        delta.satoshis = entry.second.amount;
+        delta.nTime = entry.second.time;
+        delta.prevhash = entry.second.prevhash;
+        delta.prevout = entry.second.prevout;
+        PushLocked(delta);
+        fPushed = true;
+    }
+    if (fPushed)
+        cond.notify_all();
+}
+
+void CAddressSubscriptions::NotifyBlock(const std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, bool fDisconnect)
+{
+    if (!fActive)
+        return;
+
+    std::lock_guard<std::mutex> lock(cs);
+    ExpireLocked();
+    bool fPushed = false;
+    for (const std::pair<CAddressIndexKey, CAmount>& entry : addressIndex) {
+        if (!mapAddressSubscribers.count(Address(entry.first.type, entry.first.hashBytes)))
+            continue;
+        CAddressSubscriptionDelta delta;
+        delta.type = entry.first.type;
+        delta.hashBytes = entry.first.hashBytes;
+        delta.txhash = entry.first.txhash;
+        delta.index = entry.first.index;
+        delta.spending = entry.first.spending;
+        delta.satoshis = entry.second;
+        delta.blockHeight = entry.first.blockHeight;
+        delta.txindex = entry.first.txindex;
+        delta.fDisconnected = fDisconnect;
+        PushLocked(delta);
+        fPushed = true;
+    }
+    if (fPushed)
+        cond.notify_all();
+}
+
+void CAddressSubscriptions::Interrupt()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    fInterrupted = true;
+    cond.notify_all();
+}
+
+size_t CAddressSubscriptions::Count() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return mapSubscriptions.size();
+}
+
+void CAddressSubscriptions::Clear()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    mapSubscriptions.clear();
+    mapAddressSubscribers.clear();
+    fActive = false;
+    fInterrupted = false;
+    cond.notify_all();
+}
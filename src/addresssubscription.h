@@ -0,0 +1,130 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSSUBSCRIPTION_H
+#define BITCOIN_ADDRESSSUBSCRIPTION_H
+
+#include "amount.h"
+#include "uint256.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+struct CAddressIndexKey;
+struct CMempoolAddressDelta;
+struct CMempoolAddressDeltaKey;
+
+/** Maximum number of subscriptions at once */
+static const size_t MAX_ADDRESS_SUBSCRIPTIONS = 64;
+/** Maximum number of deltas a subscription holds between polls; older ones are dropped beyond this */
+static const size_t MAX_ADDRESS_SUBSCRIPTION_DELTAS = 100000;
+/** Subscriptions that have not been polled for this many seconds are dropped */
+static const int64_t ADDRESS_SUBSCRIPTION_EXPIRY = 10 * 60;
+
+/** A change to the balance of a subscribed address */
+struct CAddressSubscriptionDelta
+{
+    int type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int index;
+    bool spending;
+    CAmount satoshis;
+    //! Height of the block the change is in, or -1 for a mempool transaction
+    int blockHeight;
+    //! Position of the transaction in its block
+    unsigned int txindex;
+    //! Whether the block was disconnected, taking the change back out
+    bool fDisconnected;
+    //! Time a mempool transaction was accepted
+    int64_t nTime;
+    //! For mempool spends, the output spent
+    uint256 prevhash;
+    unsigned int prevout;
+
+    CAddressSubscriptionDelta() : type(0), index(0), spending(false), satoshis(0), blockHeight(-1),
+                                  txindex(0), fDisconnected(false), nTime(0), prevout(0) {}
+};
+
+/**
+ * Address sets that clients subscribed to, and the address index deltas for
+ * them that arrived since each client last asked. This is fed the same
+ * entries the address index is built from, as blocks are connected and
+ * disconnected and transactions enter the mempool, so a client can wait for
+ * activity instead of polling the index for every address it watches.
+ */
+class CAddressSubscriptions
+{
+public:
+    typedef std::pair<int, uint160> Address;
+
+    CAddressSubscriptions();
+
+    /** Subscribe to addresses and return the new subscription's id, or an empty string if there are too many */
+    std::string Subscribe(const std::vector<std::pair<uint160, int> >& addresses);
+
+    /** Add addresses to a subscription. Returns false if there is no such subscription. */
+    bool AddAddresses(const std::string& id, const std::vector<std::pair<uint160, int> >& addresses);
+
+    /** Drop a subscription, waking anyone waiting on it. Returns false if there is no such subscription. */
+    bool Unsubscribe(const std::string& id);
+
+    /**
+     * Move up to nMaxCount pending deltas of a subscription into vDeltas,
+     * waiting up to nTimeoutMillis for one if there are none. fOverflow is
+     * set if deltas were dropped since the last call. Returns false if there
+     * is no such subscription.
+     */
+    bool Wait(const std::string& id, int64_t nTimeoutMillis, size_t nMaxCount,
+              std::vector<CAddressSubscriptionDelta>& vDeltas, bool& fOverflow);
+
+    /** Queue the address index deltas of a transaction accepted to the mempool */
+    void NotifyMempool(const std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >& deltas);
+
+    /** Queue the address index entries of a block being connected, or disconnected with fDisconnect */
+    void NotifyBlock(const std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, bool fDisconnect);
+
+    /** Wake all waiters and stop waiting from now on, for shutdown */
+    void Interrupt();
+
+    /** Number of subscriptions */
+    size_t Count() const;
+
+    void Clear();
+
+private:
+    struct CSubscription {
+        std::set<Address> setAddresses;
+        std::deque<CAddressSubscriptionDelta> deltas;
+        bool fOverflow;
+        int64_t nLastPoll;
+        int nWaiters;
+
+        CSubscription() : fOverflow(false), nLastPoll(0), nWaiters(0) {}
+    };
+
+    void AddAddressesLocked(const std::string& id, CSubscription& sub, const std::vector<std::pair<uint160, int> >& addresses);
+    void EraseLocked(std::map<std::string, CSubscription>::iterator it);
+    void ExpireLocked();
+    void PushLocked(const CAddressSubscriptionDelta& delta);
+
+    mutable std::mutex cs;
+    std::condition_variable cond;
+    std::map<std::string, CSubscription> mapSubscriptions;
+    //! The subscriptions each address belongs to
+    std::map<Address, std::set<std::string> > mapAddressSubscribers;
+    //! Whether anyone subscribed, so the validation hooks skip the lock otherwise
+    std::atomic<bool> fActive;
+    bool fInterrupted;
+};
+
+extern CAddressSubscriptions addressSubscriptions;
+
+#endif // BITCOIN_ADDRESSSUBSCRIPTION_H
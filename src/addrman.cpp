@@ -117,6 +117,7 @@ void CAddrMan::Delete(int nId)
     assert(!info.fInTried);
     assert(info.nRefCount == 0);
 
+    Journal(info);
     SwapRandom(info.nRandomPos, vRandom.size() - 1);
     vRandom.pop_back();
     mapAddr.erase(info);
@@ -165,6 +166,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
         CAddrInfo& infoOld = mapInfo[nIdEvict];
 
         // Remove the to-be-evicted item from the tried set.
+        Journal(infoOld);
         infoOld.fInTried = false;
         vvTried[nKBucket][nKBucketPos] = -1;
         nTried--;
@@ -185,6 +187,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     vvTried[nKBucket][nKBucketPos] = nId;
     nTried++;
     info.fInTried = true;
+    Journal(info);
 }
 
 void CAddrMan::Good_(const CService& addr, int64_t nTime)
@@ -209,6 +212,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    Journal(info);
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -257,11 +261,16 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         // periodically update nTime
         bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
         int64_t nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty))
+        if (addr.nTime && (!pinfo->nTime || pinfo->nTime < addr.nTime - nUpdateInterval - nTimePenalty)) {
             pinfo->nTime = std::max((int64_t)0, addr.nTime - nTimePenalty);
+            Journal(*pinfo);
+        }
 
         // add services
-        pinfo->nServices = ServiceFlags(pinfo->nServices | addr.nServices);
+        if ((pinfo->nServices | addr.nServices) != pinfo->nServices) {
+            pinfo->nServices = ServiceFlags(pinfo->nServices | addr.nServices);
+            Journal(*pinfo);
+        }
 
         // do not update if no new information is present
         if (!addr.nTime || (pinfo->nTime && addr.nTime <= pinfo->nTime))
@@ -286,6 +295,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         pinfo->nTime = std::max((int64_t)0, (int64_t)pinfo->nTime - nTimePenalty);
         nNew++;
         fNew = true;
+        Journal(*pinfo);
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
@@ -331,6 +341,7 @@ void CAddrMan::Attempt_(const CService& addr, bool fCountFailure, int64_t nTime)
     if (fCountFailure && info.nLastCountAttempt < nLastGood) {
         info.nLastCountAttempt = nTime;
         info.nAttempts++;
+        Journal(info);
     }
 }
 
@@ -496,8 +507,10 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
-    if (nTime - info.nTime > nUpdateInterval)
+    if (nTime - info.nTime > nUpdateInterval) {
         info.nTime = nTime;
+        Journal(info);
+    }
 }
 
 void CAddrMan::SetServices_(const CService& addr, ServiceFlags nServices)
@@ -516,6 +529,61 @@ void CAddrMan::SetServices_(const CService& addr, ServiceFlags nServices)
 
     // update info
     info.nServices = nServices;
+    Journal(info);
+}
+
+void CAddrMan::ApplyJournal_(const CAddrJournalEntry& entry)
+{
+    int nId;
+    CAddrInfo* pinfo = Find(entry.info, &nId);
+
+    if (entry.nType == CAddrJournalEntry::REMOVED) {
+        if (!pinfo)
+            return;
+        if (pinfo->fInTried) {
+            int nKBucket = pinfo->GetTriedBucket(nKey);
+            int nKBucketPos = pinfo->GetBucketPosition(nKey, false, nKBucket);
+            if (vvTried[nKBucket][nKBucketPos] == nId)
+                vvTried[nKBucket][nKBucketPos] = -1;
+            pinfo->fInTried = false;
+            nTried--;
+            nNew++; // Delete() accounts it as a new entry
+        } else {
+            for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT && pinfo->nRefCount > 0; bucket++) {
+                int pos = pinfo->GetBucketPosition(nKey, true, bucket);
+                if (vvNew[bucket][pos] == nId) {
+                    vvNew[bucket][pos] = -1;
+                    pinfo->nRefCount--;
+                }
+            }
+        }
+        pinfo->nRefCount = 0;
+        Delete(nId);
+        return;
+    }
+
+    if (!pinfo) {
+        // Place it in the new bucket for its original source, unless that spot is taken
+        pinfo = Create(entry.info, entry.info.source, &nId);
+        nNew++;
+        int nUBucket = pinfo->GetNewBucket(nKey);
+        int nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+        if (vvNew[nUBucket][nUBucketPos] != -1 && !mapInfo[vvNew[nUBucket][nUBucketPos]].IsTerrible()) {
+            Delete(nId);
+            return;
+        }
+        ClearNew(nUBucket, nUBucketPos);
+        pinfo->nRefCount = 1;
+        vvNew[nUBucket][nUBucketPos] = nId;
+    }
+
+    pinfo->nTime = entry.info.nTime;
+    pinfo->nServices = entry.info.nServices;
+    pinfo->nLastSuccess = entry.info.nLastSuccess;
+    pinfo->nAttempts = entry.info.nAttempts;
+
+    if (entry.nType == CAddrJournalEntry::TRIED && !pinfo->fInTried)
+        MakeTried(*pinfo, nId);
 }
 
 int CAddrMan::RandomInt(int nMax){
@@ -109,6 +109,34 @@ public:
 
 };
 
+/**
+ * The latest state of one address, as appended to the peers.dat journal:
+ * the entry was removed, or is in the new or in the tried table.
+ */
+class CAddrJournalEntry
+{
+public:
+    enum : uint8_t {
+        REMOVED = 0,
+        NEW = 1,
+        TRIED = 2,
+    };
+
+    uint8_t nType;
+    CAddrInfo info;
+
+    CAddrJournalEntry() : nType(REMOVED) {}
+    CAddrJournalEntry(uint8_t nTypeIn, const CAddrInfo& infoIn) : nType(nTypeIn), info(infoIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nType);
+        READWRITE(info);
+    }
+};
+
 /** Stochastic address manager
  *
  * Design goals:
@@ -207,6 +235,9 @@ private:
     //! last time Good was called (memory only)
     int64_t nLastGood;
 
+    //! addresses changed since the journal was last taken or cleared
+    std::set<CNetAddr> setJournal;
+
 protected:
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -262,6 +293,12 @@ protected:
     //! Update an entry's service bits.
     void SetServices_(const CService &addr, ServiceFlags nServices);
 
+    //! Record that an entry changed, for the next GetJournal().
+    void Journal(const CNetAddr &addr) { setJournal.insert(addr); }
+
+    //! Bring an entry to the state recorded in a journal entry.
+    void ApplyJournal_(const CAddrJournalEntry &entry);
+
 public:
     /**
      * serialized format:
@@ -467,6 +504,7 @@ public:
         nTried = 0;
         nNew = 0;
         nLastGood = 1; //Initially at 1 so that "never" is strictly worse.
+        setJournal.clear();
     }
 
     CAddrMan()
@@ -589,6 +627,47 @@ public:
         Check();
     }
 
+    //! Number of addresses changed since the journal was last taken or cleared.
+    size_t JournalSize() const
+    {
+        LOCK(cs);
+        return setJournal.size();
+    }
+
+    //! Return the current state of all changed addresses, and start a new journal.
+    std::vector<CAddrJournalEntry> GetJournal()
+    {
+        LOCK(cs);
+        std::vector<CAddrJournalEntry> vEntries;
+        vEntries.reserve(setJournal.size());
+        for (const CNetAddr& addr : setJournal) {
+            const CAddrInfo* pinfo = Find(addr);
+            if (pinfo)
+                vEntries.emplace_back(pinfo->fInTried ? CAddrJournalEntry::TRIED : CAddrJournalEntry::NEW, *pinfo);
+            else
+                vEntries.emplace_back(CAddrJournalEntry::REMOVED, CAddrInfo(CAddress(CService(addr, 0), NODE_NONE), CNetAddr()));
+        }
+        setJournal.clear();
+        return vEntries;
+    }
+
+    //! Forget the changed addresses, as they are part of a full snapshot now.
+    void ClearJournal()
+    {
+        LOCK(cs);
+        setJournal.clear();
+    }
+
+    //! Replay journal entries on top of a snapshot.
+    void ApplyJournal(const std::vector<CAddrJournalEntry> &vEntries)
+    {
+        LOCK(cs);
+        Check();
+        for (const CAddrJournalEntry& entry : vEntries)
+            ApplyJournal_(entry);
+        Check();
+    }
+
 };
 
 #endif // BITCOIN_ADDRMAN_H
@@ -7,7 +7,10 @@
 #include "hash.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <list>
+#include <mutex>
 #include <stdint.h>
 #include <string.h>
 #include <vector>
@@ -68,43 +71,54 @@ bool DecodeBase58(const char* psz, std::vector<unsigned char>& vch)
     return true;
 }
 
+/** 58^5, the base of the limbs EncodeBase58 works in: five digits to a limb */
+static const uint32_t BASE58_LIMB = 58 * 58 * 58 * 58 * 58;
+
 std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
     // Skip & count leading zeroes.
     int zeroes = 0;
-    int length = 0;
     while (pbegin != pend && *pbegin == 0) {
         pbegin++;
         zeroes++;
     }
-    // Allocate enough space in big-endian base58 representation.
-    int size = (pend - pbegin) * 138 / 100 + 1; // log(256) / log(58), rounded up.
-    std::vector<unsigned char> b58(size);
-    // Process the bytes.
+    // The number in limbs of five base58 digits, least significant first.
+    // Taking in three bytes per pass over them, rather than dividing by 58
+    // once per digit and byte, cuts the divisions about fifteenfold; a limb
+    // times 2^24 plus the carry still fits in 64 bits.
+    std::vector<uint32_t> limbs;
+    limbs.reserve((pend - pbegin) * 138 / 500 + 2); // log(256) / log(58^5), rounded up.
     while (pbegin != pend) {
-        int carry = *pbegin;
-        int i = 0;
-        // Apply "b58 = b58 * 256 + ch".
-        for (std::vector<unsigned char>::reverse_iterator it = b58.rbegin(); (carry != 0 || i < length) && (it != b58.rend()); it++, i++) {
-            carry += 256 * (*it);
-            *it = carry % 58;
-            carry /= 58;
+        int nBytes = std::min<ptrdiff_t>(3, pend - pbegin);
+        uint64_t carry = 0;
+        for (int i = 0; i < nBytes; i++)
+            carry = (carry << 8) | *(pbegin++);
+        // Apply "limbs = limbs * 256^nBytes + carry".
+        for (uint32_t& limb : limbs) {
+            carry += (uint64_t)limb << (8 * nBytes);
+            limb = carry % BASE58_LIMB;
+            carry /= BASE58_LIMB;
         }
-
-        assert(carry == 0);
-        length = i;
-        pbegin++;
+        for (; carry != 0; carry /= BASE58_LIMB)
+            limbs.push_back(carry % BASE58_LIMB);
     }
-    // Skip leading zeroes in base58 result.
-    std::vector<unsigned char>::iterator it = b58.begin() + (size - length);
-    while (it != b58.end() && *it == 0)
-        it++;
-    // Translate the result into a string.
+    // Translate the result into a string, without the leading zeroes of
+    // the most significant limb.
     std::string str;
-    str.reserve(zeroes + (b58.end() - it));
+    str.reserve(zeroes + 5 * limbs.size());
     str.assign(zeroes, '1');
-    while (it != b58.end())
-        str += pszBase58[*(it++)];
+    for (size_t n = limbs.size(); n-- > 0; ) {
+        char digits[5];
+        uint32_t limb = limbs[n];
+        for (int i = 4; i >= 0; i--) {
+            digits[i] = pszBase58[limb % 58];
+            limb /= 58;
+        }
+        int nSkip = 0;
+        while (n == limbs.size() - 1 && nSkip < 4 && digits[nSkip] == '1')
+            nSkip++;
+        str.append(digits + nSkip, 5 - nSkip);
+    }
     return str;
 }
 
@@ -251,6 +265,58 @@ bool CBitcoinAddress::Set(const CTxDestination& dest, CChainParams::Base58Type t
     return boost::apply_visitor(CBitcoinAddressVisitor(this, type), dest);
 }
 
+/** The shared address encoding cache, most recently used first, and the prefixes it was filled under */
+static std::mutex csAddressCache;
+static std::list<std::pair<CTxDestination, std::string> > listAddressCache;
+static std::map<CTxDestination, std::list<std::pair<CTxDestination, std::string> >::iterator> mapAddressCache;
+static std::vector<unsigned char> vchAddressCachePrefixes;
+
+std::string EncodeAddress(const CTxDestination& dest)
+{
+    if (boost::get<CNoDestination>(&dest))
+        return CBitcoinAddress(dest).ToString();
+
+    std::vector<unsigned char> vchPrefixes = Params().Base58Prefix(CChainParams::PUBKEY_ADDRESS);
+    const std::vector<unsigned char>& vchScriptPrefix = Params().Base58Prefix(CChainParams::SCRIPT_ADDRESS);
+    vchPrefixes.insert(vchPrefixes.end(), vchScriptPrefix.begin(), vchScriptPrefix.end());
+    {
+        std::lock_guard<std::mutex> lock(csAddressCache);
+        // Addresses encoded for another network are of no use
+        if (vchPrefixes != vchAddressCachePrefixes) {
+            listAddressCache.clear();
+            mapAddressCache.clear();
+            vchAddressCachePrefixes = vchPrefixes;
+        }
+        auto it = mapAddressCache.find(dest);
+        if (it != mapAddressCache.end()) {
+            listAddressCache.splice(listAddressCache.begin(), listAddressCache, it->second);
+            return it->second->second;
+        }
+    }
+
+    std::string str = CBitcoinAddress(dest).ToString();
+    std::lock_guard<std::mutex> lock(csAddressCache);
+    if (vchPrefixes == vchAddressCachePrefixes && !mapAddressCache.count(dest)) {
+        listAddressCache.push_front(std::make_pair(dest, str));
+        mapAddressCache[dest] = listAddressCache.begin();
+        if (listAddressCache.size() > ADDRESS_ENCODING_CACHE_SIZE) {
+            mapAddressCache.erase(listAddressCache.back().first);
+            listAddressCache.pop_back();
+        }
+    }
+    return str;
+}
+
+std::string CAddressEncoder::Encode(const CTxDestination& dest)
+{
+    std::map<CTxDestination, std::string>::const_iterator it = mapEncoded.find(dest);
+    if (it != mapEncoded.end())
+        return it->second;
+    if (mapEncoded.size() >= ADDRESS_ENCODER_SIZE)
+        mapEncoded.clear();
+    return mapEncoded[dest] = EncodeAddress(dest);
+}
+
 bool CBitcoinAddress::IsValid() const
 {
     return IsValid(Params());
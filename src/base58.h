@@ -21,6 +21,7 @@
 #include "script/standard.h"
 #include "support/allocators/zeroafterfree.h"
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -120,6 +121,32 @@ public:
     bool IsScript() const;
 };
 
+/** Most addresses the shared address encoding cache keeps */
+static const size_t ADDRESS_ENCODING_CACHE_SIZE = 4096;
+/** Most addresses a CAddressEncoder keeps */
+static const size_t ADDRESS_ENCODER_SIZE = 1024;
+
+/**
+ * Encode dest as CBitcoinAddress(dest).ToString() does, through a cache of
+ * the addresses encoded lately that all threads share: the index and
+ * transaction RPCs turn the same addresses into strings over and over.
+ */
+std::string EncodeAddress(const CTxDestination& dest);
+
+/**
+ * Keeps the addresses encoded for one reply in front of the shared cache,
+ * so that the rows repeating an address neither encode it again nor take
+ * the shared cache's lock.
+ */
+class CAddressEncoder
+{
+public:
+    std::string Encode(const CTxDestination& dest);
+
+private:
+    std::map<CTxDestination, std::string> mapEncoded;
+};
+
 /**
  * A base58-encoded secret key
  */
@@ -6,8 +6,8 @@
 #include "validation.h"
 #include "utiltime.h"
 
-// Sanity test: this should loop ten times, and
-// min/max/average should be close to 100ms.
+// Sanity test: min, median and max should be close to 100ms,
+// with one iteration per evaluation.
 static void Sleep100ms(benchmark::State& state)
 {
     while (state.KeepRunning()) {
@@ -6,6 +6,7 @@
 
 #include "validation.h"
 #include "base58.h"
+#include "chainparams.h"
 
 #include <vector>
 #include <string>
@@ -51,6 +52,47 @@ static void Base58Decode(benchmark::State& state)
 }
 
 
+/** The same address over and over, as index RPC replies repeat it */
+static CKeyID BenchKeyID()
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<unsigned char> vch(20);
+    for (size_t i = 0; i < vch.size(); i++)
+        vch[i] = 37 * i + 1;
+    return CKeyID(uint160(vch));
+}
+
+static void Base58AddressEncode(benchmark::State& state)
+{
+    CKeyID keyID = BenchKeyID();
+    while (state.KeepRunning()) {
+        CBitcoinAddress(keyID).ToString();
+    }
+}
+
+
+static void Base58AddressEncodeShared(benchmark::State& state)
+{
+    CKeyID keyID = BenchKeyID();
+    while (state.KeepRunning()) {
+        EncodeAddress(keyID);
+    }
+}
+
+
+static void Base58AddressEncodeReply(benchmark::State& state)
+{
+    CKeyID keyID = BenchKeyID();
+    CAddressEncoder encoder;
+    while (state.KeepRunning()) {
+        encoder.Encode(keyID);
+    }
+}
+
+
 BENCHMARK(Base58Encode);
 BENCHMARK(Base58CheckEncode);
 BENCHMARK(Base58Decode);
+BENCHMARK(Base58AddressEncode);
+BENCHMARK(Base58AddressEncodeShared);
+BENCHMARK(Base58AddressEncodeReply);
@@ -5,10 +5,17 @@
 #include "bench.h"
 #include "perf.h"
 
+#include <univalue.h>
+
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <regex>
 #include <sys/time.h>
 
+static_assert(benchmark::NUM_COUNTERS == PERF_NUM_COUNTERS, "benchmark counters must match the perf ones");
+
 benchmark::BenchRunner::BenchmarkMap &benchmark::BenchRunner::benchmarks() {
     static std::map<std::string, benchmark::BenchFunction> benchmarks_map;
     return benchmarks_map;
@@ -20,83 +27,260 @@ static double gettimedouble(void) {
     return tv.tv_usec * 0.000001 + tv.tv_sec;
 }
 
-benchmark::BenchRunner::BenchRunner(std::string name, benchmark::BenchFunction func)
+const char* benchmark::CounterName(Counter counter)
 {
-    benchmarks().insert(std::make_pair(name, func));
+    switch (counter) {
+    case COUNTER_INSTRUCTIONS: return "instructions";
+    case COUNTER_CACHE_MISSES: return "cache_misses";
+    case COUNTER_BRANCH_MISSES: return "branch_misses";
+    default: return "unknown";
+    }
 }
 
-void
-benchmark::BenchRunner::RunAll(double elapsedTimeForOne)
+double benchmark::Percentile(std::vector<double> vValues, double p)
 {
-    perf_init();
-    std::cout << "#Benchmark" << "," << "count" << "," << "min" << "," << "max" << "," << "average" << ","
-              << "min_cycles" << "," << "max_cycles" << "," << "average_cycles" << "\n";
+    if (vValues.empty())
+        return 0;
+    std::sort(vValues.begin(), vValues.end());
+    double rank = std::max(0.0, std::min(100.0, p)) / 100 * (vValues.size() - 1);
+    size_t lower = (size_t)rank;
+    if (lower + 1 >= vValues.size())
+        return vValues.back();
+    return vValues[lower] + (rank - lower) * (vValues[lower + 1] - vValues[lower]);
+}
 
-    for (const auto &p: benchmarks()) {
-        State state(p.first, elapsedTimeForOne);
-        p.second(state);
+namespace {
+
+class ConsolePrinter : public benchmark::Printer
+{
+    bool fCounters;
+public:
+    void Header(const benchmark::Options& options) override
+    {
+        fCounters = options.fPerfCounters;
+        std::cout << std::left << std::setw(32) << "# Benchmark" << std::right
+                  << std::setw(7) << "evals" << std::setw(12) << "iterations"
+                  << std::setw(14) << "min ns/it" << std::setw(14) << "median" << std::setw(14) << "p90" << std::setw(14) << "max"
+                  << std::setw(14) << "cycles/it";
+        if (fCounters) {
+            for (int i = 0; i < benchmark::NUM_COUNTERS; i++)
+                std::cout << std::setw(16) << benchmark::CounterName((benchmark::Counter)i);
+        }
+        std::cout << "\n";
     }
-    perf_fini();
+
+    void Add(const benchmark::Result& result) override
+    {
+        std::cout << std::left << std::setw(32) << result.name << std::right
+                  << std::setw(7) << result.vTime.size() << std::setw(12) << result.nIterations
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(14) << benchmark::Percentile(result.vTime, 0) * 1e9
+                  << std::setw(14) << benchmark::Percentile(result.vTime, 50) * 1e9
+                  << std::setw(14) << benchmark::Percentile(result.vTime, 90) * 1e9
+                  << std::setw(14) << benchmark::Percentile(result.vTime, 100) * 1e9
+                  << std::setw(14) << benchmark::Percentile(result.vCycles, 50);
+        if (fCounters) {
+            for (int i = 0; i < benchmark::NUM_COUNTERS; i++) {
+                if (result.vCounters[i].empty())
+                    std::cout << std::setw(16) << "-";
+                else
+                    std::cout << std::setw(16) << benchmark::Percentile(result.vCounters[i], 50);
+            }
+        }
+        std::cout << "\n";
+    }
+};
+
+/** One line per benchmark, times in seconds per iteration and counters as medians */
+class CsvPrinter : public benchmark::Printer
+{
+public:
+    void Header(const benchmark::Options& options) override
+    {
+        std::cout << "#Benchmark,evals,iterations,min,median,p90,max,average,min_cycles,median_cycles,max_cycles";
+        for (int i = 0; i < benchmark::NUM_COUNTERS; i++)
+            std::cout << "," << benchmark::CounterName((benchmark::Counter)i);
+        std::cout << "\n";
+    }
+
+    void Add(const benchmark::Result& result) override
+    {
+        double average = 0;
+        for (double time : result.vTime)
+            average += time / result.vTime.size();
+        std::cout << std::fixed << std::setprecision(15) << result.name << "," << result.vTime.size() << "," << result.nIterations << ","
+                  << benchmark::Percentile(result.vTime, 0) << "," << benchmark::Percentile(result.vTime, 50) << ","
+                  << benchmark::Percentile(result.vTime, 90) << "," << benchmark::Percentile(result.vTime, 100) << "," << average << ","
+                  << std::setprecision(1)
+                  << benchmark::Percentile(result.vCycles, 0) << "," << benchmark::Percentile(result.vCycles, 50) << ","
+                  << benchmark::Percentile(result.vCycles, 100);
+        for (int i = 0; i < benchmark::NUM_COUNTERS; i++) {
+            std::cout << ",";
+            if (!result.vCounters[i].empty())
+                std::cout << benchmark::Percentile(result.vCounters[i], 50);
+        }
+        std::cout << "\n";
+    }
+};
+
+/** All results in one document, with every evaluation so dashboards can compute their own statistics */
+class JsonPrinter : public benchmark::Printer
+{
+    UniValue results;
+    UniValue settings;
+
+    static UniValue ToArray(const std::vector<double>& vValues)
+    {
+        UniValue array(UniValue::VARR);
+        for (double value : vValues)
+            array.push_back(value);
+        return array;
+    }
+public:
+    JsonPrinter() : results(UniValue::VARR), settings(UniValue::VOBJ) {}
+
+    void Header(const benchmark::Options& options) override
+    {
+        settings.push_back(Pair("filter", options.strFilter));
+        settings.push_back(Pair("evals", options.nEvals));
+        settings.push_back(Pair("warmup", options.nWarmup));
+        settings.push_back(Pair("iterations", (uint64_t)options.nIterations));
+        settings.push_back(Pair("evaltime", options.dMinEvalTime));
+    }
+
+    void Add(const benchmark::Result& result) override
+    {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", result.name));
+        obj.push_back(Pair("iterations", (uint64_t)result.nIterations));
+        obj.push_back(Pair("min", benchmark::Percentile(result.vTime, 0)));
+        obj.push_back(Pair("median", benchmark::Percentile(result.vTime, 50)));
+        obj.push_back(Pair("p90", benchmark::Percentile(result.vTime, 90)));
+        obj.push_back(Pair("max", benchmark::Percentile(result.vTime, 100)));
+        obj.push_back(Pair("times", ToArray(result.vTime)));
+        obj.push_back(Pair("cycles", ToArray(result.vCycles)));
+        for (int i = 0; i < benchmark::NUM_COUNTERS; i++) {
+            if (!result.vCounters[i].empty())
+                obj.push_back(Pair(benchmark::CounterName((benchmark::Counter)i), ToArray(result.vCounters[i])));
+        }
+        results.push_back(obj);
+    }
+
+    void Footer() override
+    {
+        UniValue doc(UniValue::VOBJ);
+        doc.push_back(Pair("settings", settings));
+        doc.push_back(Pair("benchmarks", results));
+        std::cout << doc.write(2) << "\n";
+    }
+};
+
+} // anon namespace
+
+benchmark::BenchRunner::BenchRunner(std::string name, benchmark::BenchFunction func)
+{
+    benchmarks().insert(std::make_pair(name, func));
 }
 
-bool benchmark::State::KeepRunning()
+bool
+benchmark::BenchRunner::RunAll(const Options& options)
 {
-    if (count & countMask) {
-      ++count;
-      return true;
+    std::regex filter;
+    try {
+        filter = std::regex(options.strFilter);
+    } catch (const std::regex_error& e) {
+        std::cerr << "Invalid -filter " << options.strFilter << ": " << e.what() << "\n";
+        return false;
     }
-    double now;
-    uint64_t nowCycles;
-    if (count == 0) {
-        lastTime = beginTime = now = gettimedouble();
-        lastCycles = beginCycles = nowCycles = perf_cpucycles();
+    if (options.nEvals < 1 || options.nWarmup < 0 || options.dMinEvalTime <= 0) {
+        std::cerr << "-evals must be at least 1, -warmup at least 0 and -evaltime positive\n";
+        return false;
     }
+
+    std::unique_ptr<Printer> printer;
+    if (options.strPrinter == "console")
+        printer.reset(new ConsolePrinter());
+    else if (options.strPrinter == "csv")
+        printer.reset(new CsvPrinter());
+    else if (options.strPrinter == "json")
+        printer.reset(new JsonPrinter());
     else {
-        now = gettimedouble();
-        double elapsed = now - lastTime;
-        double elapsedOne = elapsed * countMaskInv;
-        if (elapsedOne < minTime) minTime = elapsedOne;
-        if (elapsedOne > maxTime) maxTime = elapsedOne;
-
-        // We only use relative values, so don't have to handle 64-bit wrap-around specially
-        nowCycles = perf_cpucycles();
-        uint64_t elapsedOneCycles = (nowCycles - lastCycles) * countMaskInv;
-        if (elapsedOneCycles < minCycles) minCycles = elapsedOneCycles;
-        if (elapsedOneCycles > maxCycles) maxCycles = elapsedOneCycles;
-
-        if (elapsed*128 < maxElapsed) {
-          // If the execution was much too fast (1/128th of maxElapsed), increase the count mask by 8x and restart timing.
-          // The restart avoids including the overhead of this code in the measurement.
-          countMask = ((countMask<<3)|7) & ((1LL<<60)-1);
-          countMaskInv = 1./(countMask+1);
-          count = 0;
-          minTime = std::numeric_limits<double>::max();
-          maxTime = std::numeric_limits<double>::min();
-          minCycles = std::numeric_limits<uint64_t>::max();
-          maxCycles = std::numeric_limits<uint64_t>::min();
-          return true;
-        }
-        if (elapsed*16 < maxElapsed) {
-          uint64_t newCountMask = ((countMask<<1)|1) & ((1LL<<60)-1);
-          if ((count & newCountMask)==0) {
-              countMask = newCountMask;
-              countMaskInv = 1./(countMask+1);
-          }
+        std::cerr << "Unknown -printer " << options.strPrinter << "\n";
+        return false;
+    }
+
+    if (options.fList) {
+        for (const auto &p: benchmarks()) {
+            if (std::regex_match(p.first, filter))
+                std::cout << p.first << "\n";
         }
+        return true;
     }
-    lastTime = now;
-    lastCycles = nowCycles;
-    ++count;
 
-    if (now - beginTime < maxElapsed) return true; // Keep going
+    perf_init();
+    if (options.fPerfCounters && !perf_counters_open())
+        std::cerr << "Hardware event counters are not available; check /proc/sys/kernel/perf_event_paranoid\n";
+
+    printer->Header(options);
+    for (const auto &p: benchmarks()) {
+        if (!std::regex_match(p.first, filter))
+            continue;
+        Result result;
+        result.name = p.first;
+        State state(options, result);
+        p.second(state);
+        printer->Add(result);
+    }
+    printer->Footer();
+
+    perf_counters_close();
+    perf_fini();
+    return true;
+}
 
-    --count;
+benchmark::State::State(const Options& _options, Result& _result) : options(_options), result(_result), nLeft(0), fStarted(false)
+{
+    fCalibrating = options.nIterations == 0;
+    nWarmupLeft = options.nWarmup;
+    result.nIterations = fCalibrating ? 1 : options.nIterations;
+}
 
-    // Output results
-    double average = (now-beginTime)/count;
-    int64_t averageCycles = (nowCycles-beginCycles)/count;
-    std::cout << std::fixed << std::setprecision(15) << name << "," << count << "," << minTime << "," << maxTime << "," << average << ","
-              << minCycles << "," << maxCycles << "," << averageCycles << "\n";
+bool benchmark::State::UpdateTimer()
+{
+    // Read the clocks before anything else, so bookkeeping is not measured
+    double now = gettimedouble();
+    uint64_t nowCycles = perf_cpucycles();
+    uint64_t nowCounters[NUM_COUNTERS];
+    bool fCounters = options.fPerfCounters && perf_counters_read(nowCounters);
+
+    if (fStarted) {
+        double elapsed = now - beginTime;
+        if (fCalibrating) {
+            // Double the iterations until one evaluation takes long enough for the clock
+            if (elapsed < options.dMinEvalTime && result.nIterations < (1ULL << 40))
+                result.nIterations *= 2;
+            else
+                fCalibrating = false;
+        } else if (nWarmupLeft > 0) {
+            --nWarmupLeft;
+        } else {
+            // We only use relative values, so don't have to handle 64-bit wrap-around specially
+            result.vTime.push_back(elapsed / result.nIterations);
+            result.vCycles.push_back((double)(nowCycles - beginCycles) / result.nIterations);
+            if (fCounters) {
+                for (int i = 0; i < NUM_COUNTERS; i++)
+                    result.vCounters[i].push_back((double)(nowCounters[i] - beginCounters[i]) / result.nIterations);
+            }
+            if (result.vTime.size() >= (size_t)options.nEvals)
+                return false;
+        }
+    }
 
-    return false;
+    fStarted = true;
+    nLeft = result.nIterations - 1;
+    if (options.fPerfCounters)
+        perf_counters_read(beginCounters);
+    beginCycles = perf_cpucycles();
+    beginTime = gettimedouble();
+    return true;
 }
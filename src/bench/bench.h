@@ -5,8 +5,12 @@
 #ifndef BITCOIN_BENCH_BENCH_H
 #define BITCOIN_BENCH_BENCH_H
 
+#include <limits>
 #include <map>
 #include <string>
+#include <vector>
+
+#include <stdint.h>
 
 #include <boost/function.hpp>
 #include <boost/preprocessor/cat.hpp>
@@ -36,31 +40,88 @@ BENCHMARK(CODE_TO_TIME);
  
 namespace benchmark {
 
-    class State {
+    //! Hardware events counted with -perfcounters where the platform allows it
+    enum Counter {
+        COUNTER_INSTRUCTIONS,
+        COUNTER_CACHE_MISSES,
+        COUNTER_BRANCH_MISSES,
+        NUM_COUNTERS
+    };
+
+    const char* CounterName(Counter counter);
+
+    struct Options {
+        //! Only run the benchmarks whose name matches this regular expression
+        std::string strFilter;
+        //! Measured evaluations per benchmark
+        int nEvals;
+        //! Evaluations run before the measured ones and discarded
+        int nWarmup;
+        //! Iterations per evaluation; 0 picks the count that makes one take dMinEvalTime
+        uint64_t nIterations;
+        //! Seconds an evaluation should take when the iteration count is picked
+        double dMinEvalTime;
+        //! "console", "csv" or "json"
+        std::string strPrinter;
+        bool fPerfCounters;
+        //! Print the names of the selected benchmarks instead of running them
+        bool fList;
+
+        Options() : strFilter(".*"), nEvals(5), nWarmup(1), nIterations(0), dMinEvalTime(0.1), strPrinter("console"), fPerfCounters(false), fList(false) {}
+    };
+
+    /** Per-iteration figures of each measured evaluation of one benchmark */
+    struct Result {
         std::string name;
-        double maxElapsed;
+        uint64_t nIterations;
+        std::vector<double> vTime;
+        std::vector<double> vCycles;
+        //! Empty if counters are off or could not be opened
+        std::vector<double> vCounters[NUM_COUNTERS];
+
+        Result() : nIterations(0) {}
+    };
+
+    /** p-th percentile (0-100) of vValues, interpolating between the closest ranks */
+    double Percentile(std::vector<double> vValues, double p);
+
+    class State {
+        const Options& options;
+        Result& result;
+        uint64_t nLeft;
+        bool fStarted;
+        bool fCalibrating;
+        int nWarmupLeft;
         double beginTime;
-        double lastTime, minTime, maxTime, countMaskInv;
-        uint64_t count;
-        uint64_t countMask;
         uint64_t beginCycles;
-        uint64_t lastCycles;
-        uint64_t minCycles;
-        uint64_t maxCycles;
+        uint64_t beginCounters[NUM_COUNTERS];
+
+        bool UpdateTimer();
     public:
-        State(std::string _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), count(0) {
-            minTime = std::numeric_limits<double>::max();
-            maxTime = std::numeric_limits<double>::min();
-            minCycles = std::numeric_limits<uint64_t>::max();
-            maxCycles = std::numeric_limits<uint64_t>::min();
-            countMask = 1;
-            countMaskInv = 1./(countMask + 1);
+        State(const Options& _options, Result& _result);
+
+        bool KeepRunning()
+        {
+            if (nLeft > 0) {
+                --nLeft;
+                return true;
+            }
+            return UpdateTimer();
         }
-        bool KeepRunning();
     };
 
     typedef boost::function<void(State&)> BenchFunction;
 
+    /** Writes the results of a run in one of the -printer formats */
+    class Printer
+    {
+    public:
+        virtual ~Printer() {}
+        virtual void Header(const Options& options) {}
+        virtual void Add(const Result& result) = 0;
+        virtual void Footer() {}
+    };
+
     class BenchRunner
     {
         typedef std::map<std::string, BenchFunction> BenchmarkMap;
@@ -69,7 +130,8 @@ namespace benchmark {
     public:
         BenchRunner(std::string name, BenchFunction func);
 
-        static void RunAll(double elapsedTimeForOne=1.0);
+        //! Returns false if the options are invalid
+        static bool RunAll(const Options& options);
     };
 }
 
@@ -3,19 +3,135 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "bench.h"
+#include "mempoolload.h"
+#include "messagereplay.h"
+#include "replay.h"
 
+#include "chainparamsbase.h"
+#include "crypto/aes.h"
+#include "crypto/sha256.h"
 #include "key.h"
 #include "validation.h"
 #include "util.h"
+#include "utilstrencodings.h"
+
+#include <iostream>
+
+static std::string HelpMessage()
+{
+    benchmark::Options defaults;
+    std::string strUsage = "Usage: bench_jbcoin [options]\n\nOptions:\n";
+    strUsage += HelpMessageOpt("-?", _("This help message"));
+    strUsage += HelpMessageOpt("-list", _("List the benchmarks -filter selects and exit"));
+    strUsage += HelpMessageOpt("-filter=<regex>", strprintf(_("Run the benchmarks whose whole name matches <regex> (default: %s)"), defaults.strFilter));
+    strUsage += HelpMessageOpt("-evals=<n>", strprintf(_("Measured evaluations of each benchmark (default: %u)"), defaults.nEvals));
+    strUsage += HelpMessageOpt("-warmup=<n>", strprintf(_("Evaluations run and discarded before the measured ones (default: %u)"), defaults.nWarmup));
+    strUsage += HelpMessageOpt("-iterations=<n>", _("Iterations per evaluation (default: enough for one to take -evaltime)"));
+    strUsage += HelpMessageOpt("-evaltime=<ms>", strprintf(_("Milliseconds an evaluation should take when -iterations is not set (default: %u)"), (int)(defaults.dMinEvalTime * 1000)));
+    strUsage += HelpMessageOpt("-printer=<format>", strprintf(_("Output format: console, csv or json (default: %s)"), defaults.strPrinter));
+    strUsage += HelpMessageOpt("-perfcounters", _("Also report instructions, cache misses and branch misses per iteration, counted by Linux perf_event"));
+
+    benchmark::ReplayOptions replayDefaults;
+    strUsage += "\nBlock replay options:\n";
+    strUsage += HelpMessageOpt("-replay=<file>", _("Instead of the benchmarks, sync a temporary datadir from the blocks of <file>, in block file format and starting at the genesis block, and report the time taken by each phase (can be given several times, read in order)"));
+    strUsage += HelpMessageOpt("-replaychain=<chain>", strprintf(_("Chain the replayed blocks belong to (default: %s)"), CBaseChainParams::MAIN));
+    strUsage += HelpMessageOpt("-replaymax=<n>", _("Stop after replaying <n> blocks (default: all)"));
+    strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Database cache size in megabytes for the replay (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, replayDefaults.nDbCacheMiB));
+    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Script verification threads for the replay (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -GetNumCores(), MAX_SCRIPTCHECK_THREADS, replayDefaults.nScriptCheckThreads));
+
+    benchmark::MempoolLoadOptions loadDefaults;
+    strUsage += "\nMempool load options:\n";
+    strUsage += HelpMessageOpt("-mempoolload", _("Instead of the benchmarks, accept signed transactions into the mempool of a temporary regtest chain and mine them, and report the accept rate, the cost of the address and spent indexes, the cost of removing mined transactions and the memory used (-dbcache and -par apply)"));
+    strUsage += HelpMessageOpt("-loadtxs=<n>", strprintf(_("Transactions to accept (default: %d)"), loadDefaults.nTransactions));
+    strUsage += HelpMessageOpt("-loadfanout=<n>", strprintf(_("Outputs of each fan-out transaction, each spent by a child (default: %d)"), loadDefaults.nFanOut));
+    strUsage += HelpMessageOpt("-loadchain=<n>", strprintf(_("Length of each chain of transactions (default: %d)"), loadDefaults.nChainLength));
+    strUsage += HelpMessageOpt("-loadkeys=<n>", strprintf(_("Addresses the outputs are spread over (default: %d)"), loadDefaults.nKeys));
+    strUsage += HelpMessageOpt("-loadindexes", strprintf(_("Maintain the mempool address and spent indexes (default: %u)"), loadDefaults.fIndexes));
+
+    strUsage += "\nMessage replay options:\n";
+    strUsage += HelpMessageOpt("-messages=<file>", _("Instead of the benchmarks, process the network messages a node recorded to <file> with -capturemessages, on a temporary datadir of the network they came from, and report the time taken by each command (-dbcache and -par apply)"));
+    strUsage += HelpMessageOpt("-messagesmax=<n>", _("Stop after <n> messages (default: all)"));
+    strUsage += HelpMessageOpt("-messagesfuzz=<n>", _("Flip a random bit in 1 of every <n> messages, the same ones on every run (default: 0, none)"));
+    return strUsage;
+}
 
 int
 main(int argc, char** argv)
 {
+    ParseParameters(argc, argv);
+    if (IsArgSet("-?") || IsArgSet("-h") || IsArgSet("-help")) {
+        std::cout << HelpMessage();
+        return 0;
+    }
+
+    benchmark::Options options;
+    options.strFilter = GetArg("-filter", options.strFilter);
+    options.nEvals = GetArg("-evals", options.nEvals);
+    options.nWarmup = GetArg("-warmup", options.nWarmup);
+    options.nIterations = std::max<int64_t>(0, GetArg("-iterations", 0));
+    options.dMinEvalTime = GetArg("-evaltime", (int64_t)(options.dMinEvalTime * 1000)) / 1000.0;
+    options.strPrinter = GetArg("-printer", options.strPrinter);
+    options.fPerfCounters = GetBoolArg("-perfcounters", false);
+    options.fList = GetBoolArg("-list", false);
+
+    SHA256AutoDetect();
+    AESAutoDetect();
     ECC_Start();
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug.log file
 
-    benchmark::BenchRunner::RunAll();
+    bool fRet;
+    if (GetBoolArg("-mempoolload", false)) {
+        benchmark::MempoolLoadOptions loadOptions;
+        loadOptions.nTransactions = GetArg("-loadtxs", loadOptions.nTransactions);
+        loadOptions.nFanOut = GetArg("-loadfanout", loadOptions.nFanOut);
+        loadOptions.nChainLength = GetArg("-loadchain", loadOptions.nChainLength);
+        loadOptions.nKeys = GetArg("-loadkeys", loadOptions.nKeys);
+        loadOptions.fIndexes = GetBoolArg("-loadindexes", loadOptions.fIndexes);
+        loadOptions.nDbCacheMiB = GetArg("-dbcache", loadOptions.nDbCacheMiB);
+        loadOptions.nScriptCheckThreads = GetArg("-par", loadOptions.nScriptCheckThreads);
+
+        benchmark::MempoolLoadResult result;
+        std::string strError;
+        fRet = benchmark::RunMempoolLoad(loadOptions, result, strError);
+        if (fRet)
+            benchmark::PrintMempoolLoadResult(result, options.strPrinter);
+        else
+            std::cerr << "Mempool load failed after " << result.nTransactions << " transactions: " << strError << "\n";
+    } else if (IsArgSet("-messages")) {
+        benchmark::MessageReplayOptions messageOptions;
+        messageOptions.strFile = GetArg("-messages", "");
+        messageOptions.nMaxMessages = std::max<int64_t>(0, GetArg("-messagesmax", 0));
+        messageOptions.nFuzzInterval = std::max<int64_t>(0, GetArg("-messagesfuzz", 0));
+        messageOptions.nDbCacheMiB = GetArg("-dbcache", messageOptions.nDbCacheMiB);
+        messageOptions.nScriptCheckThreads = GetArg("-par", messageOptions.nScriptCheckThreads);
+
+        benchmark::MessageReplayResult result;
+        std::string strError;
+        fRet = benchmark::ReplayMessages(messageOptions, result, strError);
+        if (fRet)
+            benchmark::PrintMessageReplayResult(result, options.strPrinter);
+        else
+            std::cerr << "Message replay failed: " << strError << "\n";
+    } else if (IsArgSet("-replay")) {
+        benchmark::ReplayOptions replayOptions;
+        replayOptions.vFiles = mapMultiArgs.at("-replay");
+        replayOptions.strChain = GetArg("-replaychain", CBaseChainParams::MAIN);
+        replayOptions.nMaxBlocks = std::max<int64_t>(0, GetArg("-replaymax", 0));
+        replayOptions.nDbCacheMiB = GetArg("-dbcache", replayOptions.nDbCacheMiB);
+        replayOptions.nScriptCheckThreads = GetArg("-par", replayOptions.nScriptCheckThreads);
+
+        benchmark::ReplayResult result;
+        std::string strError;
+        fRet = benchmark::ReplayBlocks(replayOptions, result, strError);
+        if (fRet)
+            benchmark::PrintReplayResult(result, options.strPrinter);
+        else
+            std::cerr << "Replay failed after " << result.nBlocks << " blocks: " << strError << "\n";
+    } else {
+        fRet = benchmark::BenchRunner::RunAll(options);
+    }
 
     ECC_Stop();
+    return fRet ? 0 : 1;
 }
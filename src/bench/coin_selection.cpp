@@ -57,4 +57,52 @@ static void CoinSelection(benchmark::State& state)
     }
 }
 
+// Staking wallets collect many small outputs of similar size. Selecting
+// from 100k of them exercises the exact-match search and the bounded
+// stochastic fallback.
+static void CoinSelectionLarge(benchmark::State& state, const std::vector<CAmount>& vValues, const CAmount& nTarget)
+{
+    const CWallet wallet;
+    std::vector<COutput> vCoins;
+    LOCK(wallet.cs_wallet);
+
+    BOOST_FOREACH (const CAmount& nValue, vValues)
+        addCoin(nValue, wallet, vCoins);
+
+    while (state.KeepRunning()) {
+        std::set<std::pair<const CWalletTx*, unsigned int> > setCoinsRet;
+        CAmount nValueRet;
+        bool success = wallet.SelectCoinsMinConf(nTarget, 1, 6, 0, vCoins, setCoinsRet, nValueRet);
+        assert(success);
+        assert(nValueRet >= nTarget);
+    }
+
+    BOOST_FOREACH (COutput output, vCoins)
+        delete output.tx;
+}
+
+static void CoinSelectionLargeEqual(benchmark::State& state)
+{
+    // 100k stake outputs of the same size; an exact multiple is found by taking from one bucket
+    CoinSelectionLarge(state, std::vector<CAmount>(100000, 10 * COIN), 12340 * COIN);
+}
+
+static void CoinSelectionLargeVaried(benchmark::State& state)
+{
+    // 100k outputs between 0.01 and 10 coins
+    std::vector<CAmount> vValues;
+    for (int i = 0; i < 100000; i++)
+        vValues.push_back((1 + (i * 7919) % 1000) * CENT);
+    CoinSelectionLarge(state, vValues, 12345 * COIN + 67 * CENT);
+}
+
+static void CoinSelectionLargeNoExact(benchmark::State& state)
+{
+    // 100k outputs that cannot add up to the target, leaving it to the stochastic search
+    CoinSelectionLarge(state, std::vector<CAmount>(100000, 10 * COIN), 12345 * COIN);
+}
+
 BENCHMARK(CoinSelection);
+BENCHMARK(CoinSelectionLargeEqual);
+BENCHMARK(CoinSelectionLargeVaried);
+BENCHMARK(CoinSelectionLargeNoExact);
@@ -7,6 +7,7 @@
 #include "support/lockedpool.h"
 
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #define ASIZE 2048
@@ -43,5 +44,32 @@ static void LockedPool(benchmark::State& state)
     addr.clear();
 }
 
+#define TTHREADS 4
+#define TITER 2000
+#define TKEYS 8
+
+/** Threads allocating and freeing key-sized chunks of the live pool at once, as parallel signing does */
+static void LockedPoolThreads(benchmark::State& state)
+{
+    LockedPoolManager& pool = LockedPoolManager::Instance();
+    while (state.KeepRunning()) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < TTHREADS; ++t) {
+            threads.emplace_back([&pool]() {
+                void *keys[TKEYS];
+                for (int x = 0; x < TITER; ++x) {
+                    for (int k = 0; k < TKEYS; ++k)
+                        keys[k] = pool.alloc(32);
+                    for (int k = 0; k < TKEYS; ++k)
+                        pool.free(keys[k], 32);
+                }
+            });
+        }
+        for (std::thread& thread: threads)
+            thread.join();
+    }
+}
+
 BENCHMARK(LockedPool);
+BENCHMARK(LockedPoolThreads);
 
@@ -0,0 +1,68 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "coins.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static CScript AddressScript(int i)
+{
+    return CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, (unsigned char)i) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+static CTransactionRef Spend(const std::vector<COutPoint>& vPrevouts, CAmount nValueOut, int nOutputs, int nAddress)
+{
+    CMutableTransaction tx;
+    for (const COutPoint& prevout : vPrevouts)
+        tx.vin.push_back(CTxIn(prevout, CScript() << OP_TRUE));
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout.push_back(CTxOut(nValueOut / nOutputs, AddressScript(nAddress + i)));
+    return MakeTransactionRef(tx);
+}
+
+// Transactions between P2PKH addresses entering the mempool the way
+// AcceptToMemoryPool adds them with -addressindex -spentindex, then leaving
+// it with the block that confirms them: a fan-out to 50 addresses whose
+// outputs are each spent on, and a chain of 25.
+static void MempoolAddressIndex(benchmark::State& state)
+{
+    CCoinsView dummy;
+    CCoinsViewCache coins(&dummy);
+    std::vector<COutPoint> vFunding;
+    for (int i = 0; i < 2; i++) {
+        vFunding.push_back(COutPoint(GetRandHash(), 0));
+        coins.AddCoin(vFunding.back(), Coin(CTxOut(100 * COIN, AddressScript(200 + i)), 1, false, false, 0), false);
+    }
+
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(Spend(std::vector<COutPoint>(1, vFunding[0]), 99 * COIN, 50, 0));
+    const uint256 hashFanOut = vtx.back()->GetHash();
+    for (int i = 0; i < 50; i++)
+        vtx.push_back(Spend(std::vector<COutPoint>(1, COutPoint(hashFanOut, i)), COIN, 1, 50 + i));
+    COutPoint prevout = vFunding[1];
+    for (int i = 0; i < 25; i++) {
+        vtx.push_back(Spend(std::vector<COutPoint>(1, prevout), (99 - i) * COIN, 1, 100 + i % 8));
+        prevout = COutPoint(vtx.back()->GetHash(), 0);
+    }
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        CCoinsViewMemPool viewMemPool(&coins, pool);
+        CCoinsViewCache view(&viewMemPool);
+        for (const CTransactionRef& tx : vtx) {
+            LockPoints lp;
+            CTxMemPoolEntry entry(tx, 10000, 0, 0, 1, 0, false, 4, lp);
+            pool.addUnchecked(tx->GetHash(), entry);
+            pool.addAddressIndex(entry, view);
+            pool.addSpentIndex(entry, view);
+        }
+        pool.removeForBlock(vtx, 2);
+    }
+}
+
+BENCHMARK(MempoolAddressIndex);
@@ -0,0 +1,275 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mempoolload.h"
+#include "tempnode.h"
+
+#include "chainparams.h"
+#include "chainparamsbase.h"
+#include "consensus/consensus.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "keystore.h"
+#include "miner.h"
+#include "pow.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "timedata.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <univalue.h>
+
+#include <iomanip>
+#include <iostream>
+
+namespace {
+
+//! Fee each transaction pays, well above the minimum relay fee for the largest fan-out allowed
+static const CAmount MEMPOOL_LOAD_FEE = COIN / 1000;
+
+/** Mine a proof-of-work block on the tip with what the mempool has to offer, as TestChain100Setup does */
+bool MineBlock(const CChainParams& chainparams, const CScript& scriptPubKey, CBlock& block, double& dCreateNewBlock)
+{
+    int64_t nStart = GetTimeMicros();
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey);
+    dCreateNewBlock += (GetTimeMicros() - nStart) * 0.000001;
+    if (!pblocktemplate)
+        return false;
+    block = pblocktemplate->block;
+    unsigned int nExtraNonce = 0;
+    {
+        LOCK(cs_main);
+        IncrementExtraNonce(&block, chainActive.Tip(), nExtraNonce);
+    }
+    while (!CheckProofOfWork(block.GetPoWHash(), block.nBits, chainparams.GetConsensus()))
+        ++block.nNonce;
+
+    if (!ProcessNewBlock(chainparams, std::make_shared<const CBlock>(block), true, NULL))
+        return false;
+    LOCK(cs_main);
+    return chainActive.Tip()->GetBlockHash() == block.GetHash();
+}
+
+/** Builds and signs the transactions spending each funding coin */
+class CLoadBuilder
+{
+    const CBasicKeyStore& keystore;
+    const std::vector<CScript>& vScripts;
+    size_t nNextScript;
+
+    const CScript& NextScript()
+    {
+        return vScripts[nNextScript++ % vScripts.size()];
+    }
+
+public:
+    std::vector<CTransactionRef> vtx;
+
+    CLoadBuilder(const CBasicKeyStore& keystoreIn, const std::vector<CScript>& vScriptsIn) :
+        keystore(keystoreIn), vScripts(vScriptsIn), nNextScript(0) {}
+
+    bool Spend(const CTxOut& prevout, const COutPoint& outpoint, uint32_t nTime, int nOutputs)
+    {
+        CMutableTransaction tx;
+        tx.nTime = nTime;
+        tx.vin.push_back(CTxIn(outpoint));
+        for (int i = 0; i < nOutputs; i++)
+            tx.vout.push_back(CTxOut((prevout.nValue - MEMPOOL_LOAD_FEE) / nOutputs, NextScript()));
+        if (!SignSignature(keystore, prevout.scriptPubKey, tx, 0, prevout.nValue, SIGHASH_ALL))
+            return false;
+        vtx.push_back(MakeTransactionRef(std::move(tx)));
+        return true;
+    }
+
+    //! One transaction to nFanOut addresses, then one spending each of its outputs
+    bool FanOut(const CTxOut& prevout, const COutPoint& outpoint, uint32_t nTime, int nFanOut)
+    {
+        if (!Spend(prevout, outpoint, nTime, nFanOut))
+            return false;
+        CTransactionRef parent = vtx.back();
+        for (int i = 0; i < nFanOut; i++) {
+            if (!Spend(parent->vout[i], COutPoint(parent->GetHash(), i), nTime, 1))
+                return false;
+        }
+        return true;
+    }
+
+    //! nLength transactions, each spending the one before
+    bool Chain(const CTxOut& prevout, const COutPoint& outpoint, uint32_t nTime, int nLength)
+    {
+        if (!Spend(prevout, outpoint, nTime, 1))
+            return false;
+        for (int i = 1; i < nLength; i++) {
+            CTransactionRef parent = vtx.back();
+            if (!Spend(parent->vout[0], COutPoint(parent->GetHash(), 0), nTime, 1))
+                return false;
+        }
+        return true;
+    }
+};
+
+} // anon namespace
+
+bool benchmark::RunMempoolLoad(const MempoolLoadOptions& options, MempoolLoadResult& result, std::string& strError)
+{
+    if (options.nFanOut < 1 || options.nFanOut >= GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT)) {
+        strError = "The fan-out must be at least 1 and below -limitdescendantcount";
+        return false;
+    }
+    if (options.nChainLength < 1 || options.nChainLength > GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT)) {
+        strError = "The chain length must be at least 1 and at most -limitancestorcount";
+        return false;
+    }
+    if (options.nKeys < 1 || options.nTransactions < 1) {
+        strError = "The transaction and key counts must be at least 1";
+        return false;
+    }
+
+    ForceSetArg("-addressindex", options.fIndexes ? "1" : "0");
+    ForceSetArg("-spentindex", options.fIndexes ? "1" : "0");
+    TempNode node("mempoolload", options.nDbCacheMiB, options.nScriptCheckThreads);
+    if (!node.Init(CBaseChainParams::REGTEST, strError))
+        return false;
+    const CChainParams& chainparams = Params();
+
+    CBasicKeyStore keystore;
+    std::vector<CScript> vScripts;
+    for (int i = 0; i < options.nKeys; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        vScripts.push_back(GetScriptForDestination(key.GetPubKey().GetID()));
+    }
+
+    // Fan-outs and chains take turns, each funded by a coinbase of its own
+    int nUnits = 0;
+    for (int nTx = 0; nTx < options.nTransactions; nUnits++)
+        nTx += nUnits % 2 == 0 ? options.nFanOut + 1 : options.nChainLength;
+
+    double dIgnored = 0;
+    std::vector<CTransactionRef> vCoinbases;
+    for (int i = 0; i < nUnits + COINBASE_MATURITY; i++) {
+        CBlock block;
+        if (!MineBlock(chainparams, vScripts[0], block, dIgnored)) {
+            strError = strprintf("Cannot mine funding block %d", i + 1);
+            return false;
+        }
+        if (i < nUnits)
+            vCoinbases.push_back(block.vtx[0]);
+    }
+
+    CLoadBuilder builder(keystore, vScripts);
+    for (int i = 0; i < nUnits; i++) {
+        const CTxOut& prevout = vCoinbases[i]->vout[0];
+        COutPoint outpoint(vCoinbases[i]->GetHash(), 0);
+        uint32_t nTime = std::max((uint32_t)GetAdjustedTime(), vCoinbases[i]->nTime);
+        if (prevout.nValue <= MEMPOOL_LOAD_FEE * (options.nChainLength + 2)) {
+            strError = "Funding coinbase too small";
+            return false;
+        }
+        bool fOk = i % 2 == 0 ? builder.FanOut(prevout, outpoint, nTime, options.nFanOut) : builder.Chain(prevout, outpoint, nTime, options.nChainLength);
+        if (!fOk) {
+            strError = "Cannot sign the load transactions";
+            return false;
+        }
+    }
+
+    size_t nUsageStart = mempool.DynamicMemoryUsage();
+    for (const CTransactionRef& tx : builder.vtx) {
+        LOCK(cs_main);
+        CValidationState state;
+        int64_t nStart = GetTimeMicros();
+        bool fAccepted = AcceptToMemoryPool(mempool, state, tx, false, NULL, NULL, true, 0);
+        result.dAccept += (GetTimeMicros() - nStart) * 0.000001;
+        if (!fAccepted) {
+            strError = strprintf("Transaction %s was rejected: %s", tx->GetHash().ToString(), FormatStateMessage(state));
+            return false;
+        }
+        result.nTransactions++;
+    }
+    result.nMempoolUsage = mempool.DynamicMemoryUsage() - nUsageStart;
+    MemPoolMemoryUsage usage = mempool.GetMemoryUsage();
+    result.nAddressIndexUsage = usage.addressIndex.nUsage;
+    result.nSpentIndexUsage = usage.spentIndex.nUsage;
+
+    // The indexes' share of the accept time, by taking everything out of them and putting it back
+    if (options.fIndexes) {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        CCoinsViewCache view(&viewMemPool);
+        int64_t nStart = GetTimeMicros();
+        for (const CTransactionRef& tx : builder.vtx) {
+            mempool.removeAddressIndex(tx->GetHash());
+            mempool.removeSpentIndex(tx->GetHash());
+        }
+        int64_t nMid = GetTimeMicros();
+        for (const CTransactionRef& tx : builder.vtx) {
+            CTxMemPool::txiter it = mempool.mapTx.find(tx->GetHash());
+            mempool.addAddressIndex(*it, view);
+            mempool.addSpentIndex(*it, view);
+        }
+        result.dIndexRemove = (nMid - nStart) * 0.000001;
+        result.dIndexAdd = (GetTimeMicros() - nMid) * 0.000001;
+    }
+
+    while (mempool.size() > 0) {
+        CBlock block;
+        if (!MineBlock(chainparams, vScripts[0], block, result.dCreateNewBlock)) {
+            strError = "Cannot mine the load transactions";
+            return false;
+        }
+        if (block.vtx.size() == 1) {
+            strError = strprintf("%u transactions were left out of every block", mempool.size());
+            return false;
+        }
+        result.nBlocks++;
+        CBlockConnectStats stats;
+        if (GetBlockConnectStats(block.GetHash(), stats))
+            result.dRemoveForBlock += stats.nTimePostConnect * 0.000001;
+    }
+    result.nPeakRSSKiB = GetPeakRSSKiB();
+    return true;
+}
+
+void benchmark::PrintMempoolLoadResult(const MempoolLoadResult& result, const std::string& strPrinter)
+{
+    double dTxPerSec = result.dAccept > 0 ? result.nTransactions / result.dAccept : 0;
+    // Per transaction, in microseconds
+    double dMicrosPerTx = std::max(1, result.nTransactions) * 0.000001;
+    if (strPrinter == "json") {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("transactions", result.nTransactions));
+        obj.push_back(Pair("accept", result.dAccept));
+        obj.push_back(Pair("accepttxpersec", dTxPerSec));
+        obj.push_back(Pair("indexremove", result.dIndexRemove));
+        obj.push_back(Pair("indexadd", result.dIndexAdd));
+        obj.push_back(Pair("blocks", result.nBlocks));
+        obj.push_back(Pair("createnewblock", result.dCreateNewBlock));
+        obj.push_back(Pair("removeforblock", result.dRemoveForBlock));
+        obj.push_back(Pair("mempoolusage", result.nMempoolUsage));
+        obj.push_back(Pair("addressindexusage", result.nAddressIndexUsage));
+        obj.push_back(Pair("spentindexusage", result.nSpentIndexUsage));
+        obj.push_back(Pair("peakrsskib", result.nPeakRSSKiB));
+        std::cout << obj.write(2) << "\n";
+    } else if (strPrinter == "csv") {
+        std::cout << "#transactions,accept,accepttxpersec,indexremove,indexadd,blocks,createnewblock,removeforblock,mempoolusage,addressindexusage,spentindexusage,peakrsskib\n";
+        std::cout << std::fixed << std::setprecision(6) << result.nTransactions << "," << result.dAccept << "," << dTxPerSec << ","
+                  << result.dIndexRemove << "," << result.dIndexAdd << "," << result.nBlocks << "," << result.dCreateNewBlock << ","
+                  << result.dRemoveForBlock << "," << result.nMempoolUsage << "," << result.nAddressIndexUsage << ","
+                  << result.nSpentIndexUsage << "," << result.nPeakRSSKiB << "\n";
+    } else {
+        std::cout << std::fixed << std::setprecision(2)
+                  << "Accepted " << result.nTransactions << " transactions in " << result.dAccept << "s, " << dTxPerSec << " tx/s\n"
+                  << "  " << std::left << std::setw(16) << "indexremove" << std::right << std::setw(10) << result.dIndexRemove / dMicrosPerTx << "us/tx\n"
+                  << "  " << std::left << std::setw(16) << "indexadd" << std::right << std::setw(10) << result.dIndexAdd / dMicrosPerTx << "us/tx\n"
+                  << "Mined them in " << result.nBlocks << " blocks\n"
+                  << "  " << std::left << std::setw(16) << "createnewblock" << std::right << std::setw(10) << result.dCreateNewBlock / dMicrosPerTx << "us/tx\n"
+                  << "  " << std::left << std::setw(16) << "removeforblock" << std::right << std::setw(10) << result.dRemoveForBlock / dMicrosPerTx << "us/tx\n"
+                  << "Mempool usage " << result.nMempoolUsage / 1024 << "KiB (address index " << result.nAddressIndexUsage / 1024
+                  << "KiB, spent index " << result.nSpentIndexUsage / 1024 << "KiB), peak RSS " << result.nPeakRSSKiB / 1024 << "MiB\n";
+    }
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_MEMPOOLLOAD_H
+#define BITCOIN_BENCH_MEMPOOLLOAD_H
+
+#include "validation.h"
+
+#include <stdint.h>
+#include <string>
+
+namespace benchmark {
+
+    /**
+     * -mempoolload: mine funding blocks on a fresh regtest chain, push a
+     * load of signed transactions between P2PKH addresses through
+     * AcceptToMemoryPool with the mempool address and spent indexes on, and
+     * mine them out again, the way a block explorer's node sees them.
+     */
+    struct MempoolLoadOptions {
+        //! Transactions to accept, about; they come in whole fan-outs and chains
+        int nTransactions;
+        //! Outputs of a fan-out transaction, each spent on by a child of its own
+        int nFanOut;
+        //! Length of a chain of transactions each spending the last
+        int nChainLength;
+        //! Addresses the outputs are spread over
+        int nKeys;
+        //! Maintain the address and spent indexes, as -addressindex -spentindex would
+        bool fIndexes;
+        int64_t nDbCacheMiB;
+        int nScriptCheckThreads;
+
+        MempoolLoadOptions() : nTransactions(10000), nFanOut(20), nChainLength(20), nKeys(100), fIndexes(true),
+                               nDbCacheMiB(nDefaultDbCache), nScriptCheckThreads(DEFAULT_SCRIPTCHECK_THREADS) {}
+    };
+
+    struct MempoolLoadResult {
+        int nTransactions;
+        //! Seconds spent in AcceptToMemoryPool for all of them
+        double dAccept;
+        //! Seconds to take all of them out of the address and spent indexes and put them back in
+        double dIndexRemove;
+        double dIndexAdd;
+        //! Blocks it took to mine them, and the seconds spent in CreateNewBlock and in ConnectTip's postconnect phase, which is mostly removeForBlock
+        int nBlocks;
+        double dCreateNewBlock;
+        double dRemoveForBlock;
+        //! Mempool usage by the accepted transactions, in bytes, and the part of it the indexes have
+        int64_t nMempoolUsage;
+        int64_t nAddressIndexUsage;
+        int64_t nSpentIndexUsage;
+        int64_t nPeakRSSKiB;
+
+        MempoolLoadResult() : nTransactions(0), dAccept(0), dIndexRemove(0), dIndexAdd(0), nBlocks(0), dCreateNewBlock(0), dRemoveForBlock(0),
+                              nMempoolUsage(0), nAddressIndexUsage(0), nSpentIndexUsage(0), nPeakRSSKiB(0) {}
+    };
+
+    bool RunMempoolLoad(const MempoolLoadOptions& options, MempoolLoadResult& result, std::string& strError);
+
+    /** Write result in one of the -printer formats */
+    void PrintMempoolLoadResult(const MempoolLoadResult& result, const std::string& strPrinter);
+}
+
+#endif // BITCOIN_BENCH_MEMPOOLLOAD_H
@@ -0,0 +1,260 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "messagereplay.h"
+#include "bench.h"
+#include "tempnode.h"
+
+#include "chainparams.h"
+#include "chainparamsbase.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "net.h"
+#include "net_processing.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <univalue.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <set>
+
+#include <stdio.h>
+
+namespace {
+
+/** An address of 10.0.0.0/8 for each peer of the capture */
+CAddress PeerAddress(NodeId id)
+{
+    struct in_addr s;
+    s.s_addr = htonl(0x0a000000 | (id & 0xffffff));
+    return CAddress(CService(CNetAddr(s), Params().GetDefaultPort()), NODE_NONE);
+}
+
+/** Queue captured for processing by pnode, as the socket handler would have */
+void QueueMessage(CNode* pnode, const CCapturedMessage& captured)
+{
+    CMessageHeader hdr(Params().MessageStart(), captured.strCommand.c_str(), captured.vPayload.size());
+    uint256 hash = Hash(captured.vPayload.begin(), captured.vPayload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+
+    LOCK(pnode->cs_vProcessMsg);
+    pnode->vProcessMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    CNetMessage& msg = pnode->vProcessMsg.back();
+    msg.readHeader(ssHeader.data(), ssHeader.size());
+    if (!captured.vPayload.empty())
+        msg.readData((const char*)captured.vPayload.data(), captured.vPayload.size());
+    msg.nTime = GetTimeMicros();
+    pnode->nProcessQueueSize += captured.vPayload.size() + CMessageHeader::HEADER_SIZE;
+}
+
+/** Drop what the node queued for a peer that has no socket, so it never pauses sending */
+void DiscardSent(CNode* pnode)
+{
+    LOCK(pnode->cs_vSend);
+    pnode->vSendMsg.clear();
+    pnode->vSendMsgPriority.clear();
+    pnode->nSendSize = 0;
+    pnode->nSendOffset = 0;
+    pnode->fPauseSend = false;
+}
+
+bool ChainFromMessageStart(const char* pchMessageStart, std::string& strChain)
+{
+    const std::string vChains[] = {CBaseChainParams::MAIN, CBaseChainParams::TESTNET, CBaseChainParams::REGTEST};
+    for (const std::string& chain : vChains) {
+        if (memcmp(Params(chain).MessageStart(), pchMessageStart, CMessageHeader::MESSAGE_START_SIZE) == 0) {
+            strChain = chain;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // anon namespace
+
+bool benchmark::ReplayMessages(const MessageReplayOptions& options, MessageReplayResult& result, std::string& strError)
+{
+    CAutoFile filein(fopen(options.strFile.c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        strError = "Cannot open " + options.strFile;
+        return false;
+    }
+    std::string strChain;
+    try {
+        char pchMessageStart[CMessageHeader::MESSAGE_START_SIZE];
+        uint32_t nVersion;
+        filein.read(pchMessageStart, sizeof(pchMessageStart));
+        filein >> nVersion;
+        if (nVersion != MESSAGE_CAPTURE_VERSION) {
+            strError = strprintf("%s is of capture version %u, not %u", options.strFile, nVersion, MESSAGE_CAPTURE_VERSION);
+            return false;
+        }
+        if (!ChainFromMessageStart(pchMessageStart, strChain)) {
+            strError = options.strFile + " was captured on an unknown network";
+            return false;
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Cannot read %s: %s", options.strFile, e.what());
+        return false;
+    }
+
+    TempNode node("messages", options.nDbCacheMiB, options.nScriptCheckThreads);
+    if (!node.Init(strChain, strError))
+        return false;
+
+    CConnman connman(0x1337, 0x1337);
+    RegisterNodeSignals(GetNodeSignals());
+    std::atomic<bool> flagInterrupt(false);
+    std::map<NodeId, std::unique_ptr<CNode> > mapPeers;
+    std::set<NodeId> setDisconnected;
+    FastRandomContext rng(true);
+    NodeId nNextId = 0;
+
+    int64_t nStart = GetTimeMicros();
+    while (options.nMaxMessages == 0 || result.nMessages < options.nMaxMessages) {
+        // A capture ends wherever the node stopped, possibly in the middle of a record
+        int c = fgetc(filein.Get());
+        if (c == EOF)
+            break;
+        ungetc(c, filein.Get());
+        CCapturedMessage captured;
+        try {
+            filein >> captured;
+        } catch (const std::exception&) {
+            LogPrintf("%s: %s ends in a partial record\n", __func__, options.strFile);
+            break;
+        }
+
+        if (setDisconnected.count(captured.nPeer)) {
+            result.nSkipped++;
+            continue;
+        }
+        std::unique_ptr<CNode>& ppeer = mapPeers[captured.nPeer];
+        if (!ppeer) {
+            ppeer.reset(new CNode(nNextId++, NODE_NETWORK, 0, INVALID_SOCKET, PeerAddress(captured.nPeer), 0, 0, "", captured.fInbound));
+            GetNodeSignals().InitializeNode(ppeer.get(), connman);
+            DiscardSent(ppeer.get());
+            result.nPeers++;
+        }
+        CNode* pnode = ppeer.get();
+
+        if (options.nFuzzInterval > 0 && !captured.vPayload.empty() && rng.rand32() % options.nFuzzInterval == 0) {
+            captured.vPayload[rng.rand32() % captured.vPayload.size()] ^= 1 << (rng.rand32() % 8);
+            result.nFuzzed++;
+        }
+        QueueMessage(pnode, captured);
+
+        int64_t nProcessStart = GetTimeMicros();
+        bool fMoreWork;
+        do {
+            fMoreWork = ProcessMessages(pnode, connman, flagInterrupt);
+            DiscardSent(pnode);
+        } while (fMoreWork && !pnode->fDisconnect);
+        int64_t nProcessEnd = GetTimeMicros();
+        if (!pnode->fDisconnect)
+            SendMessages(pnode, connman, flagInterrupt);
+        DiscardSent(pnode);
+        result.vSendMessagesTimes.push_back(GetTimeMicros() - nProcessEnd);
+        result.mapTimes[captured.strCommand].push_back(nProcessEnd - nProcessStart);
+        result.mapBytes[captured.strCommand] += captured.vPayload.size();
+        result.nMessages++;
+
+        if (pnode->fDisconnect) {
+            bool fUpdateConnectionTime = false;
+            GetNodeSignals().FinalizeNode(pnode->GetId(), fUpdateConnectionTime);
+            ppeer.reset();
+            mapPeers.erase(captured.nPeer);
+            setDisconnected.insert(captured.nPeer);
+            result.nDisconnected++;
+        }
+    }
+    result.dElapsed = (GetTimeMicros() - nStart) * 0.000001;
+
+    for (std::pair<const NodeId, std::unique_ptr<CNode> >& peer : mapPeers) {
+        bool fUpdateConnectionTime = false;
+        GetNodeSignals().FinalizeNode(peer.second->GetId(), fUpdateConnectionTime);
+    }
+    mapPeers.clear();
+    UnregisterNodeSignals(GetNodeSignals());
+    result.nPeakRSSKiB = GetPeakRSSKiB();
+    {
+        LOCK(cs_main);
+        result.nHeight = chainActive.Height();
+    }
+    return true;
+}
+
+void benchmark::PrintMessageReplayResult(const MessageReplayResult& result, const std::string& strPrinter)
+{
+    // Per command, then SendMessages as a command of its own
+    std::vector<std::pair<std::string, const std::vector<double>*> > vRows;
+    for (const std::pair<const std::string, std::vector<double> >& item : result.mapTimes)
+        vRows.emplace_back(item.first, &item.second);
+    vRows.emplace_back("(sendmessages)", &result.vSendMessagesTimes);
+
+    if (strPrinter == "json") {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("messages", result.nMessages));
+        obj.push_back(Pair("peers", result.nPeers));
+        obj.push_back(Pair("disconnected", result.nDisconnected));
+        obj.push_back(Pair("skipped", result.nSkipped));
+        obj.push_back(Pair("fuzzed", result.nFuzzed));
+        obj.push_back(Pair("height", result.nHeight));
+        obj.push_back(Pair("elapsed", result.dElapsed));
+        UniValue commands(UniValue::VOBJ);
+        for (const std::pair<std::string, const std::vector<double>*>& row : vRows) {
+            const std::vector<double>& vTimes = *row.second;
+            UniValue command(UniValue::VOBJ);
+            command.push_back(Pair("count", (uint64_t)vTimes.size()));
+            auto itBytes = result.mapBytes.find(row.first);
+            command.push_back(Pair("bytes", itBytes == result.mapBytes.end() ? 0 : itBytes->second));
+            command.push_back(Pair("total", std::accumulate(vTimes.begin(), vTimes.end(), 0.0) * 0.000001));
+            command.push_back(Pair("median", Percentile(vTimes, 50) * 0.000001));
+            command.push_back(Pair("p95", Percentile(vTimes, 95) * 0.000001));
+            command.push_back(Pair("max", Percentile(vTimes, 100) * 0.000001));
+            commands.push_back(Pair(row.first, command));
+        }
+        obj.push_back(Pair("commands", commands));
+        obj.push_back(Pair("peakrsskib", result.nPeakRSSKiB));
+        std::cout << obj.write(2) << "\n";
+        return;
+    }
+
+    bool fCsv = strPrinter == "csv";
+    if (fCsv) {
+        std::cout << "#command,count,bytes,total,median,p95,max\n";
+    } else {
+        std::cout << std::fixed << std::setprecision(2)
+                  << "Replayed " << result.nMessages << " messages from " << result.nPeers << " peers to height " << result.nHeight
+                  << " in " << result.dElapsed << "s (" << result.nDisconnected << " peers disconnected, " << result.nSkipped
+                  << " messages skipped, " << result.nFuzzed << " fuzzed)\n"
+                  << "  " << std::left << std::setw(16) << "command" << std::right << std::setw(9) << "count" << std::setw(12) << "bytes"
+                  << std::setw(12) << "total(ms)" << std::setw(12) << "median(us)" << std::setw(12) << "p95(us)" << std::setw(12) << "max(us)" << "\n";
+    }
+    for (const std::pair<std::string, const std::vector<double>*>& row : vRows) {
+        const std::vector<double>& vTimes = *row.second;
+        auto itBytes = result.mapBytes.find(row.first);
+        uint64_t nBytes = itBytes == result.mapBytes.end() ? 0 : itBytes->second;
+        double dTotal = std::accumulate(vTimes.begin(), vTimes.end(), 0.0);
+        if (fCsv) {
+            std::cout << std::fixed << std::setprecision(6) << row.first << "," << vTimes.size() << "," << nBytes << "," << dTotal * 0.000001 << ","
+                      << Percentile(vTimes, 50) * 0.000001 << "," << Percentile(vTimes, 95) * 0.000001 << "," << Percentile(vTimes, 100) * 0.000001 << "\n";
+        } else {
+            std::cout << "  " << std::left << std::setw(16) << row.first << std::right << std::setw(9) << vTimes.size() << std::setw(12) << nBytes
+                      << std::setw(12) << dTotal * 0.001 << std::setw(12) << Percentile(vTimes, 50) << std::setw(12) << Percentile(vTimes, 95)
+                      << std::setw(12) << Percentile(vTimes, 100) << "\n";
+        }
+    }
+    if (!fCsv)
+        std::cout << "Peak RSS " << result.nPeakRSSKiB / 1024 << "MiB\n";
+}
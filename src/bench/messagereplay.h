@@ -0,0 +1,59 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_MESSAGEREPLAY_H
+#define BITCOIN_BENCH_MESSAGEREPLAY_H
+
+#include "validation.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace benchmark {
+
+    /**
+     * -messages: feed the messages a node recorded with -capturemessages to
+     * ProcessMessages on a fresh temporary datadir, one synthetic peer for
+     * each peer of the capture, and time them by command.
+     */
+    struct MessageReplayOptions {
+        std::string strFile;
+        //! Stop after this many messages; 0 replays them all
+        int nMaxMessages;
+        //! Flip a random bit in the payload of 1 of every this many messages; 0 leaves them intact
+        int nFuzzInterval;
+        int64_t nDbCacheMiB;
+        int nScriptCheckThreads;
+
+        MessageReplayOptions() : nMaxMessages(0), nFuzzInterval(0), nDbCacheMiB(nDefaultDbCache), nScriptCheckThreads(DEFAULT_SCRIPTCHECK_THREADS) {}
+    };
+
+    struct MessageReplayResult {
+        //! Microseconds each message of a command took to process, with the getdata responses it queued
+        std::map<std::string, std::vector<double> > mapTimes;
+        std::map<std::string, uint64_t> mapBytes;
+        //! Microseconds of each SendMessages call made after processing a message
+        std::vector<double> vSendMessagesTimes;
+        int nMessages;
+        int nPeers;
+        //! Peers the node disconnected, whose later messages were skipped
+        int nDisconnected;
+        int nSkipped;
+        int nFuzzed;
+        int nHeight;
+        double dElapsed;
+        int64_t nPeakRSSKiB;
+
+        MessageReplayResult() : nMessages(0), nPeers(0), nDisconnected(0), nSkipped(0), nFuzzed(0), nHeight(0), dElapsed(0), nPeakRSSKiB(0) {}
+    };
+
+    bool ReplayMessages(const MessageReplayOptions& options, MessageReplayResult& result, std::string& strError);
+
+    /** Write result in one of the -printer formats */
+    void PrintMessageReplayResult(const MessageReplayResult& result, const std::string& strPrinter);
+}
+
+#endif // BITCOIN_BENCH_MESSAGEREPLAY_H
@@ -51,3 +51,64 @@ void perf_fini(void) { }
 uint64_t perf_cpucycles(void) { return 0; }
 
 #endif
+
+#if defined(__linux__)
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int counter_fds[PERF_NUM_COUNTERS] = {-1, -1, -1};
+
+bool perf_counters_open(void)
+{
+    static const uint64_t configs[PERF_NUM_COUNTERS] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counter_fds[i] == -1) {
+            perf_counters_close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void perf_counters_close(void)
+{
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counter_fds[i] != -1) {
+            close(counter_fds[i]);
+            counter_fds[i] = -1;
+        }
+    }
+}
+
+bool perf_counters_read(uint64_t* values)
+{
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counter_fds[i] == -1 || read(counter_fds[i], &values[i], sizeof(values[i])) < (ssize_t)sizeof(values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+
+bool perf_counters_open(void) { return false; }
+void perf_counters_close(void) { }
+bool perf_counters_read(uint64_t* values) { return false; }
+
+#endif
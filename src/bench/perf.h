@@ -34,4 +34,13 @@ uint64_t perf_cpucycles(void);
 void perf_init(void);
 void perf_fini(void);
 
+/** Instructions, cache misses and branch misses, counted by the kernel on Linux */
+#define PERF_NUM_COUNTERS 3
+
+/** Start counting the events of this thread; false if the platform or kernel does not allow it */
+bool perf_counters_open(void);
+void perf_counters_close(void);
+/** Store the current counts in values[PERF_NUM_COUNTERS]; false if they are not open */
+bool perf_counters_read(uint64_t* values);
+
 #endif // H_PERF
@@ -0,0 +1,169 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "keystore.h"
+#include "pos.h"
+#include "script/sign.h"
+#include "validation.h"
+
+#include <vector>
+
+// Synthetic stake: a P2PK coin confirmed at height 10 of a 100 block chain,
+// old enough to stake at the tip.
+struct StakeSetup
+{
+    std::vector<CBlockIndex> vBlocks;
+    CBasicKeyStore keystore;
+    CKey key;
+    CMutableTransaction txPrev;
+    CMutableTransaction txStake;
+    CCoinsView viewDummy;
+    CCoinsViewCache view;
+    unsigned int nBits;
+
+    StakeSetup() : vBlocks(100), view(&viewDummy), nBits(0x207fffff)
+    {
+        SelectParams(CBaseChainParams::MAIN);
+        const Consensus::Params& params = Params().GetConsensus();
+
+        for (unsigned int i = 0; i < vBlocks.size(); i++) {
+            vBlocks[i].nHeight = i;
+            vBlocks[i].nTime = 1500000000 + i * 64;
+            vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+            vBlocks[i].BuildSkip();
+            vBlocks[i].nStakeModifier = ComputeStakeModifier(vBlocks[i].pprev, ArithToUint256(arith_uint256(i)));
+        }
+
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+
+        txPrev.nTime = vBlocks[10].nTime;
+        txPrev.vin.resize(1);
+        txPrev.vin[0].prevout = COutPoint(ArithToUint256(arith_uint256(1)), 0);
+        txPrev.vout.resize(1);
+        txPrev.vout[0].nValue = 10000 * COIN;
+        txPrev.vout[0].scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+        AddCoins(view, txPrev, 10);
+
+        txStake.nTime = vBlocks[10].nTime + params.nStakeMinAge + 64 * 100;
+        txStake.vin.resize(1);
+        txStake.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+        txStake.vout.resize(2);
+        txStake.vout[0].SetEmpty();
+        txStake.vout[1].nValue = txPrev.vout[0].nValue;
+        txStake.vout[1].scriptPubKey = txPrev.vout[0].scriptPubKey;
+        bool fSigned = SignSignature(keystore, txPrev, txStake, 0, SIGHASH_ALL);
+        assert(fSigned);
+    }
+
+    CBlockIndex* Tip() { return &vBlocks.back(); }
+};
+
+static void StakeKernelHash(benchmark::State& state)
+{
+    StakeSetup setup;
+    const COutPoint prevout(setup.txPrev.GetHash(), 0);
+    uint32_t nTimeTx = setup.txStake.nTime;
+    while (state.KeepRunning()) {
+        CheckStakeKernelHash(setup.Tip(), setup.nBits, setup.vBlocks[10].nTime, setup.txPrev.nTime,
+                             setup.txPrev.vout[0].nValue, prevout, nTimeTx++);
+    }
+}
+
+static void StakeModifier(benchmark::State& state)
+{
+    StakeSetup setup;
+    uint256 kernel = setup.txPrev.GetHash();
+    while (state.KeepRunning()) {
+        kernel = ComputeStakeModifier(setup.Tip(), kernel);
+    }
+}
+
+static void StakeCheckProofOfStake(benchmark::State& state)
+{
+    StakeSetup setup;
+    const CTransaction txStake(setup.txStake);
+    while (state.KeepRunning()) {
+        CValidationState validationState;
+        bool fValid = CheckProofOfStake(setup.Tip(), txStake, setup.nBits, validationState, setup.view);
+        assert(fValid);
+    }
+}
+
+static void StakeCheckBlockSignature(benchmark::State& state)
+{
+    StakeSetup setup;
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.nTime = setup.txStake.nTime;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << 100 << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+
+    CBlock block;
+    block.nTime = setup.txStake.nTime;
+    block.nBits = setup.nBits;
+    block.hashPrevBlock = setup.Tip()->nStakeModifier;
+    block.vtx.push_back(MakeTransactionRef(txCoinBase));
+    block.vtx.push_back(MakeTransactionRef(setup.txStake));
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    bool fSigned = setup.key.Sign(block.GetHash(), block.vchBlockSig);
+    assert(fSigned);
+
+    const Consensus::Params& params = Params().GetConsensus();
+    while (state.KeepRunning()) {
+        // Skipping the merkle root keeps CheckBlock from caching fChecked
+        CValidationState validationState;
+        bool fValid = CheckBlock(block, validationState, params, false, false, true);
+        assert(fValid);
+    }
+}
+
+// Kernel search over the staking coins of a wallet, one timestamp per coin
+// per round as in FindStakeKernel; the coins are loaded into the stake cache
+// the way CWallet::UpdateStakeCache leaves them after warm-up.
+static void StakeSearch(benchmark::State& state, unsigned int nCoins)
+{
+    StakeSetup setup;
+    std::vector<COutPoint> vPrevouts;
+    std::map<COutPoint, CStakeCache> cache;
+    for (unsigned int i = 0; i < nCoins; i++) {
+        COutPoint prevout(ArithToUint256(arith_uint256(i + 1)), i % 4);
+        vPrevouts.push_back(prevout);
+        cache.insert(std::make_pair(prevout, CStakeCache(setup.vBlocks[10].nTime, setup.vBlocks[10].nTime, 100 * COIN)));
+    }
+
+    // A realistic target keeps the search from stopping at the first coin
+    unsigned int nBits = 0x1d00ffff;
+    uint32_t nTimeTx = setup.txStake.nTime;
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < vPrevouts.size(); i++) {
+            uint32_t nTimeFound;
+            SearchKernel(setup.Tip(), nBits, nTimeTx, 1, vPrevouts[i], cache, nTimeFound);
+        }
+        nTimeTx += 16;
+    }
+}
+
+static void StakeSearch1k(benchmark::State& state) { StakeSearch(state, 1000); }
+static void StakeSearch10k(benchmark::State& state) { StakeSearch(state, 10000); }
+static void StakeSearch100k(benchmark::State& state) { StakeSearch(state, 100000); }
+
+BENCHMARK(StakeKernelHash);
+BENCHMARK(StakeModifier);
+BENCHMARK(StakeCheckProofOfStake);
+BENCHMARK(StakeCheckBlockSignature);
+BENCHMARK(StakeSearch1k);
+BENCHMARK(StakeSearch10k);
+BENCHMARK(StakeSearch100k);
@@ -0,0 +1,209 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "replay.h"
+#include "tempnode.h"
+
+#include "chainparams.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <univalue.h>
+
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+#include <stdio.h>
+
+namespace {
+
+/** Feeds blocks to ProcessNewBlock, holding back those whose parent has not come yet */
+class CReplayer
+{
+    const CChainParams& chainparams;
+    benchmark::ReplayResult& result;
+    const int nMaxBlocks;
+    std::multimap<uint256, std::shared_ptr<const CBlock> > mapUnknownParent;
+
+    bool Process(const std::shared_ptr<const CBlock>& pblock)
+    {
+        int64_t nStart = GetTimeMicros();
+        bool fOk = ProcessNewBlock(chainparams, pblock, true, NULL);
+        result.dProcess += (GetTimeMicros() - nStart) * 0.000001;
+        if (!fOk)
+            return error("%s: block %s was not accepted", __func__, pblock->GetHash().ToString());
+        result.nBlocks++;
+        if (pblock->IsProofOfStake())
+            result.nProofOfStake++;
+        result.nTransactions += pblock->vtx.size();
+        return true;
+    }
+
+public:
+    CReplayer(const CChainParams& chainparamsIn, benchmark::ReplayResult& resultIn, int nMaxBlocksIn) :
+        chainparams(chainparamsIn), result(resultIn), nMaxBlocks(nMaxBlocksIn) {}
+
+    bool Done() const { return nMaxBlocks > 0 && result.nBlocks >= nMaxBlocks; }
+
+    //! Returns false if a block is rejected
+    bool Add(const std::shared_ptr<const CBlock>& pblock, const uint256& hash)
+    {
+        {
+            LOCK(cs_main);
+            if (mapBlockIndex.count(hash))
+                return true; // The genesis block, or a duplicate
+            if (!mapBlockIndex.count(pblock->hashPrevBlock)) {
+                mapUnknownParent.insert(std::make_pair(pblock->hashPrevBlock, pblock));
+                return true;
+            }
+        }
+        if (!Process(pblock))
+            return false;
+
+        // Then the blocks that were waiting for it, and for them
+        std::vector<uint256> vQueue(1, hash);
+        while (!vQueue.empty() && !Done()) {
+            uint256 hashParent = vQueue.back();
+            vQueue.pop_back();
+            std::pair<std::multimap<uint256, std::shared_ptr<const CBlock> >::iterator, std::multimap<uint256, std::shared_ptr<const CBlock> >::iterator> range = mapUnknownParent.equal_range(hashParent);
+            std::vector<std::shared_ptr<const CBlock> > vChildren;
+            for (auto it = range.first; it != range.second; ++it)
+                vChildren.push_back(it->second);
+            mapUnknownParent.erase(range.first, range.second);
+            for (const std::shared_ptr<const CBlock>& pchild : vChildren) {
+                if (Done())
+                    break;
+                if (!Process(pchild))
+                    return false;
+                vQueue.push_back(pchild->GetHash());
+            }
+        }
+        return true;
+    }
+
+    size_t Unconnected() const { return mapUnknownParent.size(); }
+};
+
+CBlockConnectTimes operator-(const CBlockConnectTimes& a, const CBlockConnectTimes& b)
+{
+    CBlockConnectTimes d;
+    d.nCheck = a.nCheck - b.nCheck;
+    d.nForks = a.nForks - b.nForks;
+    d.nConnect = a.nConnect - b.nConnect;
+    d.nVerify = a.nVerify - b.nVerify;
+    d.nIndex = a.nIndex - b.nIndex;
+    d.nCallbacks = a.nCallbacks - b.nCallbacks;
+    d.nReadFromDisk = a.nReadFromDisk - b.nReadFromDisk;
+    d.nConnectTotal = a.nConnectTotal - b.nConnectTotal;
+    d.nFlush = a.nFlush - b.nFlush;
+    d.nChainState = a.nChainState - b.nChainState;
+    d.nPostConnect = a.nPostConnect - b.nPostConnect;
+    d.nTotal = a.nTotal - b.nTotal;
+    return d;
+}
+
+std::vector<std::pair<std::string, int64_t> > PhaseTimes(const CBlockConnectTimes& times)
+{
+    std::vector<std::pair<std::string, int64_t> > vPhases;
+    vPhases.emplace_back("check", times.nCheck);
+    vPhases.emplace_back("forks", times.nForks);
+    vPhases.emplace_back("connect", times.nConnect);
+    vPhases.emplace_back("verify", times.nVerify);
+    vPhases.emplace_back("index", times.nIndex);
+    vPhases.emplace_back("callbacks", times.nCallbacks);
+    vPhases.emplace_back("readfromdisk", times.nReadFromDisk);
+    vPhases.emplace_back("connecttotal", times.nConnectTotal);
+    vPhases.emplace_back("flush", times.nFlush);
+    vPhases.emplace_back("chainstate", times.nChainState);
+    vPhases.emplace_back("postconnect", times.nPostConnect);
+    vPhases.emplace_back("total", times.nTotal);
+    return vPhases;
+}
+
+} // anon namespace
+
+bool benchmark::ReplayBlocks(const ReplayOptions& options, ReplayResult& result, std::string& strError)
+{
+    TempNode node("replay", options.nDbCacheMiB, options.nScriptCheckThreads);
+    if (!node.Init(options.strChain, strError))
+        return false;
+    const CChainParams& chainparams = Params();
+    bool fOk = true;
+
+    CBlockConnectTimes timesStart = GetBlockConnectTimes();
+    int64_t nStart = GetTimeMicros();
+    CReplayer replayer(chainparams, result, options.nMaxBlocks);
+    for (size_t i = 0; fOk && i < options.vFiles.size() && !replayer.Done(); i++) {
+        FILE* file = fopen(options.vFiles[i].c_str(), "rb");
+        if (!file) {
+            strError = "Cannot open " + options.vFiles[i];
+            fOk = false;
+            break;
+        }
+        ScanExternalBlockFile(chainparams, file, NULL, [&](const std::shared_ptr<CBlock>& pblock, const uint256& hash) {
+            if (!replayer.Add(pblock, hash)) {
+                strError = strprintf("Block %s of %s was rejected", hash.ToString(), options.vFiles[i]);
+                fOk = false;
+            }
+            return fOk && !replayer.Done();
+        });
+    }
+    // A synced node writes its coins cache out eventually too
+    if (fOk)
+        FlushStateToDisk();
+    result.dElapsed = (GetTimeMicros() - nStart) * 0.000001;
+    result.times = GetBlockConnectTimes() - timesStart;
+    result.nPeakRSSKiB = GetPeakRSSKiB();
+    {
+        LOCK(cs_main);
+        result.nHeight = chainActive.Height();
+    }
+    if (fOk && replayer.Unconnected() > 0)
+        LogPrintf("%s: %u blocks never found their parent\n", __func__, replayer.Unconnected());
+
+    return fOk;
+}
+
+void benchmark::PrintReplayResult(const ReplayResult& result, const std::string& strPrinter)
+{
+    double dBlocksPerSec = result.dElapsed > 0 ? result.nBlocks / result.dElapsed : 0;
+    std::vector<std::pair<std::string, int64_t> > vPhases = PhaseTimes(result.times);
+    if (strPrinter == "json") {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("blocks", result.nBlocks));
+        obj.push_back(Pair("proofofstake", result.nProofOfStake));
+        obj.push_back(Pair("transactions", (uint64_t)result.nTransactions));
+        obj.push_back(Pair("height", result.nHeight));
+        obj.push_back(Pair("elapsed", result.dElapsed));
+        obj.push_back(Pair("process", result.dProcess));
+        obj.push_back(Pair("blockspersec", dBlocksPerSec));
+        UniValue phases(UniValue::VOBJ);
+        for (const std::pair<std::string, int64_t>& phase : vPhases)
+            phases.push_back(Pair(phase.first, phase.second * 0.000001));
+        obj.push_back(Pair("phases", phases));
+        obj.push_back(Pair("peakrsskib", result.nPeakRSSKiB));
+        std::cout << obj.write(2) << "\n";
+    } else if (strPrinter == "csv") {
+        std::cout << "#blocks,proofofstake,transactions,height,elapsed,process,blockspersec";
+        for (const std::pair<std::string, int64_t>& phase : vPhases)
+            std::cout << "," << phase.first;
+        std::cout << ",peakrsskib\n";
+        std::cout << std::fixed << std::setprecision(6) << result.nBlocks << "," << result.nProofOfStake << "," << result.nTransactions << ","
+                  << result.nHeight << "," << result.dElapsed << "," << result.dProcess << "," << dBlocksPerSec;
+        for (const std::pair<std::string, int64_t>& phase : vPhases)
+            std::cout << "," << phase.second * 0.000001;
+        std::cout << "," << result.nPeakRSSKiB << "\n";
+    } else {
+        std::cout << std::fixed << std::setprecision(2)
+                  << "Replayed " << result.nBlocks << " blocks (" << result.nProofOfStake << " proof-of-stake, "
+                  << result.nTransactions << " transactions) to height " << result.nHeight << "\n"
+                  << "Elapsed " << result.dElapsed << "s, " << result.dProcess << "s in ProcessNewBlock, "
+                  << dBlocksPerSec << " blocks/s\n";
+        for (const std::pair<std::string, int64_t>& phase : vPhases)
+            std::cout << "  " << std::left << std::setw(14) << phase.first << std::right << std::setw(12) << phase.second * 0.001 << "ms\n";
+        std::cout << "Peak RSS " << result.nPeakRSSKiB / 1024 << "MiB\n";
+    }
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_REPLAY_H
+#define BITCOIN_BENCH_REPLAY_H
+
+#include "validation.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace benchmark {
+
+    /**
+     * -replay: sync a fresh temporary datadir from recorded blocks, such as
+     * the output of contrib/linearize or a node's blk?????.dat files, the way
+     * a node in initial block download does.
+     */
+    struct ReplayOptions {
+        //! Files in block file format, read in order; the first must start at the genesis block's children
+        std::vector<std::string> vFiles;
+        std::string strChain;
+        //! Stop after this many blocks; 0 replays them all
+        int nMaxBlocks;
+        int64_t nDbCacheMiB;
+        //! Script verification threads, counted like -par
+        int nScriptCheckThreads;
+
+        ReplayOptions() : nMaxBlocks(0), nDbCacheMiB(nDefaultDbCache), nScriptCheckThreads(DEFAULT_SCRIPTCHECK_THREADS) {}
+    };
+
+    struct ReplayResult {
+        int nBlocks;
+        int nProofOfStake;
+        uint64_t nTransactions;
+        int nHeight;
+        //! Seconds for the whole replay, and the part of it spent in ProcessNewBlock
+        double dElapsed;
+        double dProcess;
+        //! Difference of GetBlockConnectTimes() over the replay
+        CBlockConnectTimes times;
+        int64_t nPeakRSSKiB;
+
+        ReplayResult() : nBlocks(0), nProofOfStake(0), nTransactions(0), nHeight(0), dElapsed(0), dProcess(0), nPeakRSSKiB(0) {}
+    };
+
+    bool ReplayBlocks(const ReplayOptions& options, ReplayResult& result, std::string& strError);
+
+    /** Write result in one of the -printer formats */
+    void PrintReplayResult(const ReplayResult& result, const std::string& strPrinter);
+}
+
+#endif // BITCOIN_BENCH_REPLAY_H
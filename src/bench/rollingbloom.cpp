@@ -6,6 +6,8 @@
 
 #include "bench.h"
 #include "bloom.h"
+#include "coins.h"
+#include "limitedmap.h"
 #include "utiltime.h"
 
 static void RollingBloom(benchmark::State& state)
@@ -40,4 +42,46 @@ static void RollingBloom(benchmark::State& state)
     }
 }
 
+/** As filterInventoryKnown is used: a hash announced by a peer is looked up, then added */
+static void RollingBloomInventory(benchmark::State& state)
+{
+    CRollingBloomFilter filter(50000, 0.000001);
+    uint256 hash;
+    uint64_t count = 0;
+    uint64_t match = 0;
+    while (state.KeepRunning()) {
+        count++;
+        memcpy(hash.begin(), &count, sizeof(count));
+        match += filter.contains(hash);
+        filter.insert(hash);
+    }
+}
+
+/** As mapAlreadyAskedFor is used: hashes are asked for, some again later, and dropped once received */
+static void LimitedMapAskFor(benchmark::State& state)
+{
+    limitedmap<uint256, int64_t, SaltedTxidHasher> map(50000);
+    uint256 hash;
+    uint64_t count = 0;
+    while (state.KeepRunning()) {
+        count++;
+        memcpy(hash.begin(), &count, sizeof(count));
+        map.insert(std::make_pair(hash, (int64_t)count));
+        if (count % 7 == 0) {
+            uint64_t nAgain = count - 1000;
+            memcpy(hash.begin(), &nAgain, sizeof(nAgain));
+            limitedmap<uint256, int64_t, SaltedTxidHasher>::const_iterator it = map.find(hash);
+            if (it != map.end())
+                map.update(it, count);
+        }
+        if (count % 3 == 0) {
+            uint64_t nReceived = count - 2000;
+            memcpy(hash.begin(), &nReceived, sizeof(nReceived));
+            map.erase(hash);
+        }
+    }
+}
+
 BENCHMARK(RollingBloom);
+BENCHMARK(RollingBloomInventory);
+BENCHMARK(LimitedMapAskFor);
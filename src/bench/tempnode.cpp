@@ -0,0 +1,98 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "tempnode.h"
+
+#include "chainparams.h"
+#include "noui.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <sys/resource.h>
+
+#include <boost/filesystem.hpp>
+
+benchmark::TempNode::TempNode(const std::string& strName, int64_t nDbCacheMiB, int nScriptCheckThreadsIn)
+{
+    SetupNetworking();
+    InitSignatureCache();
+    InitScriptExecutionCache();
+    noui_connect();
+
+    pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_jbcoin_%s_%lu_%i", strName, (unsigned long)GetTime(), (int)GetRand(100000));
+    boost::filesystem::create_directories(pathTemp);
+    ForceSetArg("-datadir", pathTemp.string());
+    ClearDatadirCache();
+
+    // The split init.cpp makes of -dbcache, with the indexes given their share only if enabled
+    int64_t nTotalCache = std::max(nMinDbCache, std::min(nMaxDbCache, nDbCacheMiB)) << 20;
+    int64_t nBlockTreeDBCache = std::min(nTotalCache / 8, nMaxBlockDBCache << 20);
+    int64_t nIndexesDBCache = (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) || GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) ? nTotalCache * 5 / 8 : std::min(nTotalCache / 8, nMaxIndexesDBCache << 20);
+    nTotalCache -= nBlockTreeDBCache + nIndexesDBCache;
+    int64_t nCoinDBCache = std::min(std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)), nMaxCoinsDBCache << 20);
+    nCoinCacheUsage = nTotalCache - nCoinDBCache;
+
+    pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, true);
+    pindexesdb = new CIndexesDB(nIndexesDBCache, false, true);
+    pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, true);
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+
+    nScriptCheckThreads = nScriptCheckThreadsIn;
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += GetNumCores();
+    nScriptCheckThreads = std::min(nScriptCheckThreads, MAX_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadScriptCheck);
+}
+
+benchmark::TempNode::~TempNode()
+{
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    mempool.clear();
+    UnloadBlockIndex();
+    delete pcoinsTip;
+    pcoinsTip = NULL;
+    delete pcoinsdbview;
+    pcoinsdbview = NULL;
+    delete pindexesdb;
+    pindexesdb = NULL;
+    delete pblocktree;
+    pblocktree = NULL;
+    boost::filesystem::remove_all(pathTemp);
+}
+
+bool benchmark::TempNode::Init(const std::string& strChain, std::string& strError)
+{
+    try {
+        SelectParams(strChain);
+    } catch (const std::exception& e) {
+        strError = e.what();
+        return false;
+    }
+    if (!InitBlockIndex(Params())) {
+        strError = "Cannot initialize the block index";
+        return false;
+    }
+    return true;
+}
+
+int64_t benchmark::GetPeakRSSKiB()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_TEMPNODE_H
+#define BITCOIN_BENCH_TEMPNODE_H
+
+#include "pubkey.h"
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace benchmark {
+
+    /**
+     * The chain state of a node in a fresh temporary datadir, for the tools
+     * of bench_jbcoin that drive validation directly: the databases, the
+     * script check threads and the genesis block. The indexes are enabled
+     * by -addressindex, -spentindex and -timestampindex, as for a node.
+     */
+    class TempNode
+    {
+        ECCVerifyHandle verifyHandle;
+        boost::filesystem::path pathTemp;
+        boost::thread_group threadGroup;
+
+    public:
+        //! nScriptCheckThreads is counted like -par; strName goes into the datadir's name
+        TempNode(const std::string& strName, int64_t nDbCacheMiB, int nScriptCheckThreads);
+        ~TempNode();
+
+        //! Select strChain and create its genesis block
+        bool Init(const std::string& strChain, std::string& strError);
+    };
+
+    /** Most memory the process has had resident so far, in KiB */
+    int64_t GetPeakRSSKiB();
+}
+
+#endif // BITCOIN_BENCH_TEMPNODE_H
@@ -9,6 +9,7 @@
 #endif
 #include "script/script.h"
 #include "script/sign.h"
+#include "script/standard.h"
 #include "streams.h"
 
 // FIXME: Dedup with BuildCreditingTransaction in test/script_tests.cpp.
@@ -100,3 +101,88 @@ static void VerifyScriptBench(benchmark::State& state)
 }
 
 BENCHMARK(VerifyScriptBench);
+
+/** Accepts every signature, so the benchmarks using it time the script handling alone */
+class AcceptingSignatureChecker : public BaseSignatureChecker
+{
+public:
+    bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    {
+        return true;
+    }
+};
+
+static void VerifyStandardScript(benchmark::State& state, bool fPayToPubKey, bool fP2SH, bool fCheckSig)
+{
+    const int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_LOW_S |
+                      SCRIPT_VERIFY_NULLFAIL | SCRIPT_VERIFY_MINIMALDATA | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK;
+
+    CKey key;
+    const unsigned char vchKey[32] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    key.Set(vchKey, vchKey + 32, true);
+    CPubKey pubkey = key.GetPubKey();
+
+    // A coinstake output pays to the staker's pubkey, most other outputs to its hash
+    CScript script;
+    if (fPayToPubKey)
+        script << ToByteVector(pubkey) << OP_CHECKSIG;
+    else
+        script << OP_DUP << OP_HASH160 << ToByteVector(pubkey.GetID()) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptPubKey = fP2SH ? GetScriptForDestination(CScriptID(script)) : script;
+    CTransaction txCredit = BuildCreditingTransaction(scriptPubKey);
+    CMutableTransaction txSpend = BuildSpendingTransaction(CScript(), txCredit);
+    std::vector<unsigned char> vchSig;
+    key.Sign(SignatureHash(script, txSpend, 0, SIGHASH_ALL, txCredit.vout[0].nValue, SIGVERSION_BASE), vchSig);
+    vchSig.push_back(static_cast<unsigned char>(SIGHASH_ALL));
+    CScript& scriptSig = txSpend.vin[0].scriptSig;
+    scriptSig << vchSig;
+    if (!fPayToPubKey)
+        scriptSig << ToByteVector(pubkey);
+    if (fP2SH)
+        scriptSig << std::vector<unsigned char>(script.begin(), script.end());
+
+    const MutableTransactionSignatureChecker checker(&txSpend, 0, txCredit.vout[0].nValue);
+    const AcceptingSignatureChecker acceptingChecker;
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool success = VerifyScript(scriptSig, scriptPubKey, &txSpend.vin[0].scriptWitness, flags,
+                                    fCheckSig ? (const BaseSignatureChecker&)checker : acceptingChecker, &err);
+        assert(err == SCRIPT_ERR_OK);
+        assert(success);
+    }
+}
+
+// Spends of P2PK coinstake outputs, P2PKH and P2SH-wrapped P2PKH outputs,
+// with the signature checked and, to time the script handling alone, without
+static void VerifyScriptP2PKBench(benchmark::State& state) { VerifyStandardScript(state, true, false, true); }
+static void VerifyScriptP2PKHBench(benchmark::State& state) { VerifyStandardScript(state, false, false, true); }
+static void VerifyScriptP2PKNoSigBench(benchmark::State& state) { VerifyStandardScript(state, true, false, false); }
+static void VerifyScriptP2PKHNoSigBench(benchmark::State& state) { VerifyStandardScript(state, false, false, false); }
+static void VerifyScriptP2SHNoSigBench(benchmark::State& state) { VerifyStandardScript(state, false, true, false); }
+
+BENCHMARK(VerifyScriptP2PKBench);
+BENCHMARK(VerifyScriptP2PKHBench);
+BENCHMARK(VerifyScriptP2PKNoSigBench);
+BENCHMARK(VerifyScriptP2PKHNoSigBench);
+BENCHMARK(VerifyScriptP2SHNoSigBench);
+
+// Throughput of a bare ECDSA verification, which dominates script checks and
+// proof-of-stake block signatures. Compare builds with and without
+// --enable-fast-ecdsa-verify.
+static void VerifyECDSABench(benchmark::State& state)
+{
+    CKey key;
+    const unsigned char vchKey[32] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    key.Set(vchKey, vchKey + 32, true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = Hash(vchKey, vchKey + 32);
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+
+    while (state.KeepRunning()) {
+        bool success = pubkey.Verify(hash, vchSig);
+        assert(success);
+    }
+}
+
+BENCHMARK(VerifyECDSABench);
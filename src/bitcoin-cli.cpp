@@ -26,6 +26,7 @@
 static const char DEFAULT_RPCCONNECT[] = "127.0.0.1";
 static const int DEFAULT_HTTP_CLIENT_TIMEOUT=900;
 static const bool DEFAULT_NAMED=false;
+static const int DEFAULT_BATCH_SIZE=100;
 static const int CONTINUE_EXECUTION=-1;
 
 std::string HelpMessageCli()
@@ -44,6 +45,8 @@ std::string HelpMessageCli()
     strUsage += HelpMessageOpt("-rpcpassword=<pw>", _("Password for JSON-RPC connections"));
     strUsage += HelpMessageOpt("-rpcclienttimeout=<n>", strprintf(_("Timeout during HTTP requests (default: %d)"), DEFAULT_HTTP_CLIENT_TIMEOUT));
     strUsage += HelpMessageOpt("-stdin", _("Read extra arguments from standard input, one per line until EOF/Ctrl-D (recommended for sensitive information such as passphrases)"));
+    strUsage += HelpMessageOpt("-batch", _("Read commands from standard input, one per line with arguments as on the command line, send them over one connection and print each reply as a line of JSON as it arrives"));
+    strUsage += HelpMessageOpt("-batchsize=<n>", strprintf(_("Number of commands sent in each JSON-RPC batch request with -batch (default: %d)"), DEFAULT_BATCH_SIZE));
 
     return strUsage;
 }
@@ -84,7 +87,8 @@ static int AppInitRPC(int argc, char* argv[])
                   "  jbcoin-cli [options] <command> [params]  " + strprintf(_("Send command to %s"), _(PACKAGE_NAME)) + "\n" +
                   "  jbcoin-cli [options] -named <command> [name=value] ... " + strprintf(_("Send command to %s (with named arguments)"), _(PACKAGE_NAME)) + "\n" +
                   "  jbcoin-cli [options] help                " + _("List commands") + "\n" +
-                  "  jbcoin-cli [options] help <command>      " + _("Get help for a command") + "\n";
+                  "  jbcoin-cli [options] help <command>      " + _("Get help for a command") + "\n" +
+                  "  jbcoin-cli [options] -batch < commands   " + _("Send commands read from standard input") + "\n";
 
             strUsage += "\n" + HelpMessageCli();
         }
@@ -125,11 +129,13 @@ static int AppInitRPC(int argc, char* argv[])
 /** Reply structure for request_done to fill in */
 struct HTTPReply
 {
-    HTTPReply(): status(0), error(-1) {}
+    HTTPReply(struct event_base* baseIn = NULL): status(0), error(-1), base(baseIn) {}
 
     int status;
     int error;
     std::string body;
+    //! Event loop to stop once the reply is in, as a kept-alive connection keeps it busy
+    struct event_base* base;
 };
 
 const char *http_errorstring(int code)
@@ -163,6 +169,8 @@ static void http_request_done(struct evhttp_request *req, void *ctx)
          * error code will have been passed to http_error_cb.
          */
         reply->status = 0;
+        if (reply->base)
+            event_base_loopbreak(reply->base);
         return;
     }
 
@@ -177,6 +185,8 @@ static void http_request_done(struct evhttp_request *req, void *ctx)
             reply->body = std::string(data, size);
         evbuffer_drain(buf, size);
     }
+    if (reply->base)
+        event_base_loopbreak(reply->base);
 }
 
 #if LIBEVENT_VERSION_NUMBER >= 0x02010300
@@ -187,73 +197,99 @@ static void http_error_cb(enum evhttp_request_error err, void *ctx)
 }
 #endif
 
-UniValue CallRPC(const std::string& strMethod, const UniValue& params)
+/**
+ * Connection to the RPC server. With fKeepAlive it stays open across calls
+ * (libevent reconnects if the server closed it in between), otherwise the
+ * server is asked to close it after the first.
+ */
+class CRPCConnection
 {
-    std::string host = GetArg("-rpcconnect", DEFAULT_RPCCONNECT);
-    int port = GetArg("-rpcport", BaseParams().RPCPort());
+public:
+    explicit CRPCConnection(bool fKeepAliveIn) :
+        host(GetArg("-rpcconnect", DEFAULT_RPCCONNECT)),
+        port(GetArg("-rpcport", BaseParams().RPCPort())),
+        fKeepAlive(fKeepAliveIn),
+        // Synchronously look up hostname
+        base(obtain_event_base()),
+        evcon(obtain_evhttp_connection_base(base.get(), host, port))
+    {
+        evhttp_connection_set_timeout(evcon.get(), GetArg("-rpcclienttimeout", DEFAULT_HTTP_CLIENT_TIMEOUT));
 
-    // Obtain event base
-    raii_event_base base = obtain_event_base();
+        // Get credentials
+        if (GetArg("-rpcpassword", "") == "") {
+            // Try fall back to cookie-based authentication if no password is provided
+            if (!GetAuthCookie(&strRPCUserColonPass)) {
+                throw std::runtime_error(strprintf(
+                    _("Could not locate RPC credentials. No authentication cookie could be found, and no rpcpassword is set in the configuration file (%s)"),
+                        GetConfigFile(GetArg("-conf", BITCOIN_CONF_FILENAME)).string().c_str()));
 
-    // Synchronously look up hostname
-    raii_evhttp_connection evcon = obtain_evhttp_connection_base(base.get(), host, port);
-    evhttp_connection_set_timeout(evcon.get(), GetArg("-rpcclienttimeout", DEFAULT_HTTP_CLIENT_TIMEOUT));
+            }
+        } else {
+            strRPCUserColonPass = GetArg("-rpcuser", "") + ":" + GetArg("-rpcpassword", "");
+        }
+    }
 
-    HTTPReply response;
-    raii_evhttp_request req = obtain_evhttp_request(http_request_done, (void*)&response);
-    if (req == NULL)
-        throw std::runtime_error("create http request failed");
+    /** Send a request object, or an array of them as a batch, and return the parsed reply */
+    UniValue Call(const UniValue& request)
+    {
+        HTTPReply response(base.get());
+        raii_evhttp_request req = obtain_evhttp_request(http_request_done, (void*)&response);
+        if (req == NULL)
+            throw std::runtime_error("create http request failed");
 #if LIBEVENT_VERSION_NUMBER >= 0x02010300
-    evhttp_request_set_error_cb(req.get(), http_error_cb);
+        evhttp_request_set_error_cb(req.get(), http_error_cb);
 #endif
 
-    // Get credentials
-    std::string strRPCUserColonPass;
-    if (GetArg("-rpcpassword", "") == "") {
-        // Try fall back to cookie-based authentication if no password is provided
-        if (!GetAuthCookie(&strRPCUserColonPass)) {
-            throw std::runtime_error(strprintf(
-                _("Could not locate RPC credentials. No authentication cookie could be found, and no rpcpassword is set in the configuration file (%s)"),
-                    GetConfigFile(GetArg("-conf", BITCOIN_CONF_FILENAME)).string().c_str()));
-
+        struct evkeyvalq* output_headers = evhttp_request_get_output_headers(req.get());
+        assert(output_headers);
+        evhttp_add_header(output_headers, "Host", host.c_str());
+        if (!fKeepAlive)
+            evhttp_add_header(output_headers, "Connection", "close");
+        evhttp_add_header(output_headers, "Authorization", (std::string("Basic ") + EncodeBase64(strRPCUserColonPass)).c_str());
+
+        // Attach request data
+        std::string strRequest = request.write() + "\n";
+        struct evbuffer* output_buffer = evhttp_request_get_output_buffer(req.get());
+        assert(output_buffer);
+        evbuffer_add(output_buffer, strRequest.data(), strRequest.size());
+
+        int r = evhttp_make_request(evcon.get(), req.get(), EVHTTP_REQ_POST, "/");
+        req.release(); // ownership moved to evcon in above call
+        if (r != 0) {
+            throw CConnectionFailed("send http request failed");
         }
-    } else {
-        strRPCUserColonPass = GetArg("-rpcuser", "") + ":" + GetArg("-rpcpassword", "");
-    }
 
-    struct evkeyvalq* output_headers = evhttp_request_get_output_headers(req.get());
-    assert(output_headers);
-    evhttp_add_header(output_headers, "Host", host.c_str());
-    evhttp_add_header(output_headers, "Connection", "close");
-    evhttp_add_header(output_headers, "Authorization", (std::string("Basic ") + EncodeBase64(strRPCUserColonPass)).c_str());
-
-    // Attach request data
-    std::string strRequest = JSONRPCRequestObj(strMethod, params, 1).write() + "\n";
-    struct evbuffer* output_buffer = evhttp_request_get_output_buffer(req.get());
-    assert(output_buffer);
-    evbuffer_add(output_buffer, strRequest.data(), strRequest.size());
-
-    int r = evhttp_make_request(evcon.get(), req.get(), EVHTTP_REQ_POST, "/");
-    req.release(); // ownership moved to evcon in above call
-    if (r != 0) {
-        throw CConnectionFailed("send http request failed");
+        event_base_dispatch(base.get());
+
+        if (response.status == 0)
+            throw CConnectionFailed(strprintf("couldn't connect to server: %s (code %d)\n(make sure server is running and you are connecting to the correct RPC port)", http_errorstring(response.error), response.error));
+        else if (response.status == HTTP_UNAUTHORIZED)
+            throw std::runtime_error("incorrect rpcuser or rpcpassword (authorization failed)");
+        else if (response.status >= 400 && response.status != HTTP_BAD_REQUEST && response.status != HTTP_NOT_FOUND && response.status != HTTP_INTERNAL_SERVER_ERROR)
+            throw std::runtime_error(strprintf("server returned HTTP error %d", response.status));
+        else if (response.body.empty())
+            throw std::runtime_error("no response from server");
+
+        // Parse reply
+        UniValue valReply(UniValue::VSTR);
+        if (!valReply.read(response.body))
+            throw std::runtime_error("couldn't parse reply from server");
+        return valReply;
     }
 
-    event_base_dispatch(base.get());
-
-    if (response.status == 0)
-        throw CConnectionFailed(strprintf("couldn't connect to server: %s (code %d)\n(make sure server is running and you are connecting to the correct RPC port)", http_errorstring(response.error), response.error));
-    else if (response.status == HTTP_UNAUTHORIZED)
-        throw std::runtime_error("incorrect rpcuser or rpcpassword (authorization failed)");
-    else if (response.status >= 400 && response.status != HTTP_BAD_REQUEST && response.status != HTTP_NOT_FOUND && response.status != HTTP_INTERNAL_SERVER_ERROR)
-        throw std::runtime_error(strprintf("server returned HTTP error %d", response.status));
-    else if (response.body.empty())
-        throw std::runtime_error("no response from server");
-
-    // Parse reply
-    UniValue valReply(UniValue::VSTR);
-    if (!valReply.read(response.body))
-        throw std::runtime_error("couldn't parse reply from server");
+private:
+    const std::string host;
+    const int port;
+    const bool fKeepAlive;
+    raii_event_base base;
+    raii_evhttp_connection evcon;
+    std::string strRPCUserColonPass;
+};
+
+UniValue CallRPC(const std::string& strMethod, const UniValue& params)
+{
+    CRPCConnection conn(false);
+    const UniValue valReply = conn.Call(JSONRPCRequestObj(strMethod, params, 1));
     const UniValue& reply = valReply.get_obj();
     if (reply.empty())
         throw std::runtime_error("expected reply to have result, error and id properties");
@@ -261,6 +297,144 @@ UniValue CallRPC(const std::string& strMethod, const UniValue& params)
     return reply;
 }
 
+/**
+ * Split a line of -batch input into arguments at whitespace, as a shell
+ * would: text in single quotes is taken as it is, in double quotes a
+ * backslash escapes a double quote or backslash, and outside quotes a
+ * backslash escapes any character.
+ */
+static std::vector<std::string> SplitCommandLine(const std::string& strLine)
+{
+    std::vector<std::string> args;
+    std::string strArg;
+    bool fInArg = false;
+    char chQuote = 0;
+    for (size_t i = 0; i < strLine.size(); i++) {
+        char ch = strLine[i];
+        if (chQuote == '\'') {
+            if (ch == '\'')
+                chQuote = 0;
+            else
+                strArg += ch;
+        } else if (chQuote == '"') {
+            if (ch == '"')
+                chQuote = 0;
+            else if (ch == '\\' && i + 1 < strLine.size() && (strLine[i + 1] == '"' || strLine[i + 1] == '\\'))
+                strArg += strLine[++i];
+            else
+                strArg += ch;
+        } else if (ch == ' ' || ch == '\t' || ch == '\r') {
+            if (fInArg)
+                args.push_back(strArg);
+            strArg.clear();
+            fInArg = false;
+        } else {
+            fInArg = true;
+            if (ch == '\'' || ch == '"')
+                chQuote = ch;
+            else if (ch == '\\' && i + 1 < strLine.size())
+                strArg += strLine[++i];
+            else
+                strArg += ch;
+        }
+    }
+    if (chQuote)
+        throw std::runtime_error("unterminated quote");
+    if (fInArg)
+        args.push_back(strArg);
+    return args;
+}
+
+/**
+ * Run the commands read from stdin over one kept-alive connection,
+ * -batchsize of them per JSON-RPC batch request. libevent sends the requests
+ * of a connection one after the other, so batching is what saves the round
+ * trips. Each reply is printed as a line of JSON as soon as its batch is
+ * done, with the line number of its command as id. Blank lines and lines
+ * starting with # are skipped.
+ */
+static int CommandLineRPCBatch()
+{
+    const size_t nBatchSize = std::max<int64_t>(GetArg("-batchsize", DEFAULT_BATCH_SIZE), 1);
+    const bool fNamed = GetBoolArg("-named", DEFAULT_NAMED);
+    const bool fWait = GetBoolArg("-rpcwait", false);
+    int nRet = 0;
+    try {
+        CRPCConnection conn(true);
+
+        int64_t nLine = 0;
+        bool fEOF = false;
+        while (!fEOF) {
+            // The replies of this batch in order; commands that could not be
+            // converted get theirs right away
+            std::vector<UniValue> vReplies;
+            UniValue requests(UniValue::VARR);
+            std::string line;
+            while (requests.size() < nBatchSize) {
+                if (!std::getline(std::cin, line)) {
+                    fEOF = true;
+                    break;
+                }
+                nLine++;
+                try {
+                    std::vector<std::string> args = SplitCommandLine(line);
+                    if (args.empty() || args[0][0] == '#')
+                        continue;
+                    std::string strMethod = args[0];
+                    args.erase(args.begin());
+                    UniValue params = fNamed ? RPCConvertNamedValues(strMethod, args) : RPCConvertValues(strMethod, args);
+                    requests.push_back(JSONRPCRequestObj(strMethod, params, nLine));
+                    vReplies.push_back(NullUniValue);
+                } catch (const std::exception& e) {
+                    vReplies.push_back(JSONRPCReplyObj(NullUniValue, JSONRPCError(RPC_INVALID_PARAMS, e.what()), nLine));
+                }
+            }
+
+            if (!requests.empty()) {
+                UniValue valReply;
+                while (true) {
+                    try {
+                        valReply = conn.Call(nBatchSize == 1 ? requests[0] : requests);
+                        break;
+                    } catch (const CConnectionFailed&) {
+                        if (!fWait)
+                            throw;
+                        MilliSleep(1000);
+                    }
+                }
+                if (nBatchSize == 1) {
+                    UniValue batch(UniValue::VARR);
+                    batch.push_back(valReply);
+                    valReply = batch;
+                }
+                if (!valReply.isArray() || valReply.size() != requests.size())
+                    throw std::runtime_error("server sent a reply that does not match the batch");
+                // Replies come in the order of the requests
+                size_t nReply = 0;
+                for (UniValue& reply : vReplies) {
+                    if (reply.isNull())
+                        reply = valReply[nReply++];
+                }
+            }
+
+            for (const UniValue& reply : vReplies) {
+                if (!find_value(reply, "error").isNull())
+                    nRet = EXIT_FAILURE;
+                fprintf(stdout, "%s\n", reply.write().c_str());
+            }
+            fflush(stdout);
+        }
+    }
+    catch (const boost::thread_interrupted&) {
+        throw;
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        nRet = EXIT_FAILURE;
+    }
+    return nRet;
+}
+
 int CommandLineRPC(int argc, char *argv[])
 {
     std::string strPrint;
@@ -377,7 +551,10 @@ int main(int argc, char* argv[])
 
     int ret = EXIT_FAILURE;
     try {
-        ret = CommandLineRPC(argc, argv);
+        if (GetBoolArg("-batch", false))
+            ret = CommandLineRPCBatch();
+        else
+            ret = CommandLineRPC(argc, argv);
     }
     catch (const std::exception& e) {
         PrintExceptionContinue(&e, "CommandLineRPC()");
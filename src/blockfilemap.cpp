@@ -0,0 +1,117 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "util.h"
+#include "validation.h"
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileMap blockFileMap(DEFAULT_MAPPED_BLOCK_FILES);
+
+CBlockFileMap::Mapping::~Mapping()
+{
+#ifndef WIN32
+    munmap(const_cast<unsigned char*>(pdata), nSize);
+#endif
+}
+
+CBlockFileMap::CBlockFileMap(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn)
+{
+}
+
+CBlockFileMap::MappingRef CBlockFileMap::Map(const boost::filesystem::path& path, size_t nEnd)
+{
+#ifdef WIN32
+    return MappingRef();
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return MappingRef();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size < nEnd) {
+        close(fd);
+        return MappingRef();
+    }
+    size_t nSize = st.st_size;
+    void* pdata = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, 0);
+    int nErr = errno;
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (pdata == MAP_FAILED) {
+        LogPrintf("%s: mmap of %s failed: %s\n", __func__, path.string(), strerror(nErr));
+        return MappingRef();
+    }
+    return std::make_shared<const Mapping>((const unsigned char*)pdata, nSize);
+#endif
+}
+
+void CBlockFileMap::LimitSize()
+{
+    AssertLockHeld(cs);
+    while (lru.size() > nMaxFiles)
+        lru.pop_back();
+}
+
+void CBlockFileMap::SetMaxFiles(size_t nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    LimitSize();
+}
+
+CBlockFileMap::MappingRef CBlockFileMap::Get(int nFile, size_t nEnd)
+{
+    LOCK(cs);
+    if (nMaxFiles == 0)
+        return MappingRef();
+    for (EntryList::iterator it = lru.begin(); it != lru.end(); ++it) {
+        if (it->first != nFile)
+            continue;
+        if (it->second->size() >= nEnd) {
+            lru.splice(lru.begin(), lru, it);
+            return it->second;
+        }
+        // The file has grown past the mapping; map it again below
+        lru.erase(it);
+        break;
+    }
+    MappingRef mapping = Map(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"), nEnd);
+    if (!mapping)
+        return MappingRef();
+    lru.emplace_front(nFile, mapping);
+    LimitSize();
+    return mapping;
+}
+
+void CBlockFileMap::Invalidate(int nFile)
+{
+    LOCK(cs);
+    for (EntryList::iterator it = lru.begin(); it != lru.end(); ++it) {
+        if (it->first == nFile) {
+            lru.erase(it);
+            return;
+        }
+    }
+}
+
+void CBlockFileMap::Clear()
+{
+    LOCK(cs);
+    lru.clear();
+}
+
+size_t CBlockFileMap::Count() const
+{
+    LOCK(cs);
+    return lru.size();
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <list>
+#include <memory>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+
+/** Default for -mappedblockfiles; 32-bit address space is too scarce to map 128 MiB files */
+static const unsigned int DEFAULT_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 8 : 0;
+
+/**
+ * Least recently used set of read only memory mappings of blk?????.dat
+ * files, so that repeated block reads are served from the page cache
+ * without a syscall each.
+ *
+ * Only bytes that lie within blocks already written may be accessed
+ * through a mapping: a file truncated below the mapped length raises
+ * SIGBUS on access past its new end. Not available on Windows, where
+ * Get always fails and callers fall back to reading the file.
+ */
+class CBlockFileMap
+{
+public:
+    /** A mapping of the first size() bytes of a file, unmapped when the last holder releases it */
+    class Mapping
+    {
+    public:
+        Mapping(const unsigned char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+        ~Mapping();
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        const unsigned char* data() const { return pdata; }
+        size_t size() const { return nSize; }
+
+    private:
+        const unsigned char* pdata;
+        size_t nSize;
+    };
+    typedef std::shared_ptr<const Mapping> MappingRef;
+
+    CBlockFileMap(size_t nMaxFilesIn);
+
+    /** Set the number of files kept mapped, unmapping as needed. 0 disables mapping. */
+    void SetMaxFiles(size_t nMaxFilesIn);
+
+    /**
+     * A mapping of block file nFile covering at least its first nEnd bytes,
+     * remapping it if it has grown since it was mapped. Null if the file is
+     * shorter than that, cannot be mapped, or mapping is disabled.
+     */
+    MappingRef Get(int nFile, size_t nEnd);
+
+    /** Drop the mapping of nFile, as when it is truncated or deleted */
+    void Invalidate(int nFile);
+
+    void Clear();
+
+    /** Number of files mapped */
+    size_t Count() const;
+
+private:
+    typedef std::list<std::pair<int, MappingRef> > EntryList;
+
+    static MappingRef Map(const boost::filesystem::path& path, size_t nEnd);
+    void LimitSize();
+
+    mutable CCriticalSection cs;
+    //! Most recently used first; few enough entries that a list scan is cheapest
+    EntryList lru;
+    size_t nMaxFiles;
+};
+
+extern CBlockFileMap blockFileMap;
+
+#endif // BITCOIN_BLOCKFILEMAP_H
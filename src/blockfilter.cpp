@@ -0,0 +1,215 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "undo.h"
+
+#include <algorithm>
+
+namespace {
+
+/** Appends bits to a byte vector, most significant first */
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    unsigned char nBuffer;
+    int nOffset;
+
+public:
+    explicit CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nOffset(0) {}
+
+    //! Write the low nBits bits of data
+    void Write(uint64_t data, int nBits)
+    {
+        while (nBits > 0) {
+            int nTake = std::min(8 - nOffset, nBits);
+            unsigned char bits = (data >> (nBits - nTake)) & ((1 << nTake) - 1);
+            nBuffer |= bits << (8 - nOffset - nTake);
+            nOffset += nTake;
+            nBits -= nTake;
+            if (nOffset == 8)
+                Flush();
+        }
+    }
+
+    //! Write out a partly filled last byte
+    void Flush()
+    {
+        if (nOffset == 0)
+            return;
+        vch.push_back(nBuffer);
+        nBuffer = 0;
+        nOffset = 0;
+    }
+};
+
+/** Reads bits written by CBitWriter */
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos;
+    unsigned char nBuffer;
+    int nOffset;
+
+public:
+    explicit CBitReader(const std::vector<unsigned char>& vchIn) : vch(vchIn), nPos(0), nBuffer(0), nOffset(8) {}
+
+    bool Read(int nBits, uint64_t& data)
+    {
+        data = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                if (nPos >= vch.size())
+                    return false;
+                nBuffer = vch[nPos++];
+                nOffset = 0;
+            }
+            int nTake = std::min(8 - nOffset, nBits);
+            data = (data << nTake) | ((nBuffer >> (8 - nOffset - nTake)) & ((1 << nTake) - 1));
+            nOffset += nTake;
+            nBits -= nTake;
+        }
+        return true;
+    }
+};
+
+void GolombRiceEncode(CBitWriter& writer, int nP, uint64_t value)
+{
+    // Quotient in unary, one bits ended by a zero
+    for (uint64_t q = value >> nP; q > 0; q--)
+        writer.Write(1, 1);
+    writer.Write(0, 1);
+    writer.Write(value, nP);
+}
+
+bool GolombRiceDecode(CBitReader& reader, int nP, uint64_t& value)
+{
+    uint64_t q = 0, bit;
+    while (true) {
+        if (!reader.Read(1, bit))
+            return false;
+        if (!bit)
+            break;
+        q++;
+    }
+    uint64_t r;
+    if (!reader.Read(nP, r))
+        return false;
+    value = (q << nP) + r;
+    return true;
+}
+
+/** The high 64 bits of x * n, mapping x uniformly into [0, n) */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+#else
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    uint64_t ac = x_hi * n_hi, ad = x_hi * n_lo, bc = x_lo * n_hi, bd = x_lo * n_lo;
+    uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF);
+    return ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+#endif
+}
+
+} // anonymous namespace
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const CBlock& block, const CBlockUndo& blockundo) : hashBlock(hashBlockIn), nElements(0)
+{
+    ElementSet elements;
+    for (const CTransactionRef& tx : block.vtx) {
+        for (const CTxOut& txout : tx->vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(Element(script.begin(), script.end()));
+        }
+    }
+    for (const CTxUndo& txundo : blockundo.vtxundo) {
+        for (const Coin& prevout : txundo.vprevout) {
+            const CScript& script = prevout.out.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(Element(script.begin(), script.end()));
+        }
+    }
+    Build(elements);
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const ElementSet& elements) : hashBlock(hashBlockIn), nElements(0)
+{
+    Build(elements);
+}
+
+uint64_t CBlockFilter::HashToRange(const Element& element) const
+{
+    uint64_t hash = CSipHasher(hashBlock.GetUint64(0), hashBlock.GetUint64(1))
+        .Write(element.data(), element.size())
+        .Finalize();
+    return MapIntoRange(hash, (uint64_t)nElements * FILTER_M);
+}
+
+void CBlockFilter::Build(const ElementSet& elements)
+{
+    nElements = elements.size();
+    vchData.clear();
+
+    std::vector<uint64_t> vHashes;
+    vHashes.reserve(elements.size());
+    for (const Element& element : elements)
+        vHashes.push_back(HashToRange(element));
+    std::sort(vHashes.begin(), vHashes.end());
+
+    CBitWriter writer(vchData);
+    uint64_t nLast = 0;
+    for (uint64_t hash : vHashes) {
+        GolombRiceEncode(writer, FILTER_P, hash - nLast);
+        nLast = hash;
+    }
+    writer.Flush();
+}
+
+bool CBlockFilter::MatchSorted(const std::vector<uint64_t>& vQueries) const
+{
+    CBitReader reader(vchData);
+    uint64_t value = 0;
+    std::vector<uint64_t>::const_iterator it = vQueries.begin();
+    for (uint32_t i = 0; i < nElements && it != vQueries.end(); i++) {
+        uint64_t delta;
+        if (!GolombRiceDecode(reader, FILTER_P, delta))
+            return true; // Corrupt, so it cannot rule anything out
+        value += delta;
+        while (it != vQueries.end() && *it < value)
+            ++it;
+        if (it != vQueries.end() && *it == value)
+            return true;
+    }
+    return false;
+}
+
+bool CBlockFilter::Match(const Element& element) const
+{
+    if (nElements == 0)
+        return false;
+    return MatchSorted(std::vector<uint64_t>(1, HashToRange(element)));
+}
+
+bool CBlockFilter::MatchAny(const ElementSet& elements) const
+{
+    if (nElements == 0 || elements.empty())
+        return false;
+    std::vector<uint64_t> vQueries;
+    vQueries.reserve(elements.size());
+    for (const Element& element : elements)
+        vQueries.push_back(HashToRange(element));
+    std::sort(vQueries.begin(), vQueries.end());
+    return MatchSorted(vQueries);
+}
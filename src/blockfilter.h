@@ -0,0 +1,74 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * Compact filter over the scripts a block touches: the scripts of its
+ * outputs and of the outputs its transactions spend. It is a Golomb-coded
+ * set as in BIP 158's basic filter; each script is hashed with SipHash,
+ * keyed by the block hash, into [0, N * M), and the sorted hashes are
+ * stored as Golomb-Rice coded differences of P bits. A query matches every
+ * script in the block, and any other script with probability 1/M.
+ *
+ * Spent scripts rather than spent outpoints are included so a wallet can
+ * test a block with the fixed set of scripts it owns, without knowing the
+ * outputs it will find earlier in the same scan.
+ */
+class CBlockFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    //! Bits of each coded difference kept as is
+    static const int FILTER_P = 19;
+    //! Inverse false positive rate
+    static const uint32_t FILTER_M = 784931;
+
+    CBlockFilter() : nElements(0) {}
+    CBlockFilter(const uint256& hashBlockIn, const CBlock& block, const CBlockUndo& blockundo);
+    CBlockFilter(const uint256& hashBlockIn, const ElementSet& elements);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    uint32_t GetElementCount() const { return nElements; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchData; }
+
+    //! Whether the element may be in the block
+    bool Match(const Element& element) const;
+    //! Whether any of the elements may be in the block
+    bool MatchAny(const ElementSet& elements) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hashBlock);
+        READWRITE(nElements);
+        READWRITE(vchData);
+    }
+
+private:
+    uint256 hashBlock;
+    uint32_t nElements;
+    std::vector<unsigned char> vchData;
+
+    void Build(const ElementSet& elements);
+    uint64_t HashToRange(const Element& element) const;
+    //! Whether any of the sorted hashes is in the set
+    bool MatchSorted(const std::vector<uint64_t>& vQueries) const;
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -4,21 +4,117 @@
 
 #include "bloom.h"
 
+#include "coins.h"
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
 #include "streams.h"
+#include "sync.h"
 
+#include <list>
 #include <math.h>
 #include <stdlib.h>
+#include <unordered_map>
 
 #include <boost/foreach.hpp>
 
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
 #define LN2 0.6931471805599453094172321214581765680755001343602552
 
+//! Transactions whose elements GetBloomTxElements keeps
+static const size_t BLOOM_ELEMENTS_CACHE_SIZE = 5000;
+
+CBloomTxElements::CBloomTxElements(const CTransaction& tx) :
+    hash(tx.GetHash()), nOutputs(tx.vout.size())
+{
+    vTxoBegin.reserve(tx.vout.size() + tx.vin.size() + 1);
+    vPubKeyOutput.reserve(tx.vout.size());
+    for (const CTxOut& txout : tx.vout) {
+        vTxoBegin.push_back(vElementBegin.size());
+        AddScriptElements(txout.scriptPubKey);
+        txnouttype type;
+        std::vector<std::vector<unsigned char> > vSolutions;
+        vPubKeyOutput.push_back(Solver(txout.scriptPubKey, type, vSolutions) &&
+                                (type == TX_PUBKEY || type == TX_MULTISIG));
+    }
+    for (const CTxIn& txin : tx.vin) {
+        vTxoBegin.push_back(vElementBegin.size());
+        vElementBegin.push_back(vchData.size());
+        CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, vchData, vchData.size()) << txin.prevout;
+        AddScriptElements(txin.scriptSig);
+    }
+    vTxoBegin.push_back(vElementBegin.size());
+    vElementBegin.push_back(vchData.size());
+}
+
+void CBloomTxElements::AddScriptElements(const CScript& script)
+{
+    CScript::const_iterator pc = script.begin();
+    std::vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0) {
+            vElementBegin.push_back(vchData.size());
+            vchData.insert(vchData.end(), data.begin(), data.end());
+        }
+    }
+}
+
+namespace {
+
+/** Least recently used CBloomTxElements, by txid */
+class CBloomElementsCache
+{
+private:
+    typedef std::list<CBloomTxElementsRef> EntryList;
+
+    CCriticalSection cs;
+    //! Most recently used first
+    EntryList lru;
+    std::unordered_map<uint256, EntryList::iterator, SaltedTxidHasher> mapEntries;
+
+public:
+    CBloomTxElementsRef Get(const CTransaction& tx)
+    {
+        {
+            LOCK(cs);
+            auto it = mapEntries.find(tx.GetHash());
+            if (it != mapEntries.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                return *it->second;
+            }
+        }
+
+        // Parse outside the lock; two threads parsing the same one is harmless
+        CBloomTxElementsRef elements = std::make_shared<const CBloomTxElements>(tx);
+        LOCK(cs);
+        if (mapEntries.count(elements->hash))
+            return elements;
+        lru.push_front(elements);
+        mapEntries.emplace(elements->hash, lru.begin());
+        while (lru.size() > BLOOM_ELEMENTS_CACHE_SIZE) {
+            mapEntries.erase(lru.back()->hash);
+            lru.pop_back();
+        }
+        return elements;
+    }
+};
+
+CBloomElementsCache bloomElementsCache;
+
+} // anon namespace
+
+CBloomTxElementsRef GetBloomTxElements(const CTransaction& tx)
+{
+    return bloomElementsCache.Get(tx);
+}
+
 CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn, unsigned char nFlagsIn) :
     /**
      * The ideal size for a bloom filter with a given number of elements and false positive rate is:
@@ -84,17 +180,31 @@ void CBloomFilter::insert(const uint256& hash)
 }
 
 bool CBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
+bool CBloomFilter::contains(const unsigned char* pch, size_t nLen) const
 {
     if (isFull)
         return true;
     if (isEmpty)
         return false;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    // Four hash functions at a time, see MurmurHash3x4
+    for (unsigned int i = 0; i < nHashFuncs; i += 4)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Checks bit nIndex of vData
-        if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
-            return false;
+        uint32_t nSeeds[4], nHashes[4];
+        for (unsigned int j = 0; j < 4; j++)
+            // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
+            nSeeds[j] = (i + j) * 0xFBA4C795 + nTweak;
+        MurmurHash3x4(nSeeds, pch, nLen, nHashes);
+        for (unsigned int j = 0; j < 4 && i + j < nHashFuncs; j++)
+        {
+            unsigned int nIndex = nHashes[j] % (vData.size() * 8);
+            // Checks bit nIndex of vData
+            if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+                return false;
+        }
     }
     return true;
 }
@@ -131,7 +241,21 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+size_t CBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(vData);
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -140,37 +264,27 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         return true;
     if (isEmpty)
         return false;
-    const uint256& hash = tx.GetHash();
+    const uint256& hash = elements.hash;
     if (contains(hash))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    const unsigned char* pchData = elements.vchData.data();
+    const std::vector<uint32_t>& vBegin = elements.vElementBegin;
+    for (unsigned int i = 0; i < elements.nOutputs; i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        std::vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        for (uint32_t e = elements.vTxoBegin[i]; e < elements.vTxoBegin[i + 1]; e++)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(pchData + vBegin[e], vBegin[e + 1] - vBegin[e]))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
                     insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    std::vector<std::vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && elements.vPubKeyOutput[i])
+                    insert(COutPoint(hash, i));
                 break;
             }
         }
@@ -179,21 +293,14 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    for (unsigned int i = elements.nOutputs; i + 1 < elements.vTxoBegin.size(); i++)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
-            return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        std::vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
+        // Match if the filter contains an outpoint tx spends, the first
+        // element of an input, or any arbitrary script data element in any
+        // scriptSig in tx
+        for (uint32_t e = elements.vTxoBegin[i]; e < elements.vTxoBegin[i + 1]; e++)
         {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(pchData + vBegin[e], vBegin[e + 1] - vBegin[e]))
                 return true;
         }
     }
@@ -214,12 +321,50 @@ void CBloomFilter::UpdateEmptyFull()
     isEmpty = empty;
 }
 
+/** A block is one cache line: four pairs of generation words, 256 positions */
+static const unsigned int ROLLING_BLOOM_BLOCK_WORDS = 8;
+static const unsigned int ROLLING_BLOOM_BLOCK_POSITIONS = 256;
+static const int ROLLING_BLOOM_MAX_BLOCK_HASHES = 5;
+
+/** Number of the nHashFuncs positions of an element that go in its nBlock'th block */
+static inline int RollingBloomHashesInBlock(int nBlock, int nHashFuncs, int nBlockHashes)
+{
+    return (nBlock + 1) * nHashFuncs / nBlockHashes - nBlock * nHashFuncs / nBlockHashes;
+}
+
+/* The false positive rate of one block for an element setting nHashes of its
+ * positions, when blocks hold dLoad elements on average. Blocks fill unevenly,
+ * so sum the rate of a block holding x elements over the Poisson distribution
+ * of x. */
+static double RollingBloomBlockFPRate(double dLoad, int nHashes)
+{
+    double dUnset = pow(1.0 - 1.0 / ROLLING_BLOOM_BLOCK_POSITIONS, nHashes);
+    double dProb = exp(-dLoad), dUnsetX = 1.0, dRate = 0.0;
+    double dMax = dLoad + 20 * sqrt(dLoad) + 30;
+    for (int x = 0; x <= dMax; x++) {
+        dRate += dProb * pow(1.0 - dUnsetX, nHashes);
+        dProb *= dLoad / (x + 1);
+        dUnsetX *= dUnset;
+    }
+    return dRate;
+}
+
+static double RollingBloomFPRate(uint32_t nBlocks, uint32_t nMaxElements, int nHashFuncs, int nBlockHashes)
+{
+    double dLoad = (double)nMaxElements * nBlockHashes / nBlocks;
+    double dRate = 1.0;
+    for (int i = 0; i < nBlockHashes; i++)
+        dRate *= RollingBloomBlockFPRate(dLoad, RollingBloomHashesInBlock(i, nHashFuncs, nBlockHashes));
+    return dRate;
+}
+
 CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
 {
     double logFpRate = log(fpRate);
     /* The optimal number of hash functions is log(fpRate) / log(0.5), but
      * restrict it to the range 1-50. */
     nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
+    nBlockHashes = (nHashFuncs + ROLLING_BLOOM_MAX_BLOCK_HASHES - 1) / ROLLING_BLOOM_MAX_BLOCK_HASHES;
     /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
     nEntriesPerGeneration = (nElements + 1) / 2;
     uint32_t nMaxElements = nEntriesPerGeneration * 3;
@@ -231,22 +376,43 @@ CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
      * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs))
      */
     uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    /* That is the size with every position anywhere in the filter. Keeping
+     * them in blocks needs a little more, so search upwards from it for the
+     * fewest blocks that still give fpRate. */
+    uint32_t nMinBlocks = std::max(1U, (nFilterBits + ROLLING_BLOOM_BLOCK_POSITIONS - 1) / ROLLING_BLOOM_BLOCK_POSITIONS);
+    uint32_t nMaxBlocks = nMinBlocks;
+    while (RollingBloomFPRate(nMaxBlocks, nMaxElements, nHashFuncs, nBlockHashes) > fpRate) {
+        nMinBlocks = nMaxBlocks + 1;
+        nMaxBlocks *= 2;
+    }
+    while (nMinBlocks < nMaxBlocks) {
+        uint32_t nMid = nMinBlocks + (nMaxBlocks - nMinBlocks) / 2;
+        if (RollingBloomFPRate(nMid, nMaxElements, nHashFuncs, nBlockHashes) > fpRate)
+            nMinBlocks = nMid + 1;
+        else
+            nMaxBlocks = nMid;
+    }
+    nBlocks = nMaxBlocks;
     data.clear();
     /* For each data element we need to store 2 bits. If both bits are 0, the
      * bit is treated as unset. If the bits are (01), (10), or (11), the bit is
      * treated as set in generation 1, 2, or 3 respectively.
-     * These bits are stored in separate integers: position P corresponds to bit
-     * (P & 63) of the integers data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]. */
-    data.resize(((nFilterBits + 63) / 64) << 1);
+     * These bits are stored in separate integers: position P of a block
+     * corresponds to bit (P & 63) of its words (P >> 6) * 2 and (P >> 6) * 2 + 1.
+     * One block more than needed leaves room to start the first at a cache line. */
+    data.resize(ROLLING_BLOOM_BLOCK_WORDS * (nBlocks + 1));
+    nOffset = (ROLLING_BLOOM_BLOCK_WORDS - ((uintptr_t)data.data() / sizeof(uint64_t)) % ROLLING_BLOOM_BLOCK_WORDS) % ROLLING_BLOOM_BLOCK_WORDS;
     reset();
 }
 
-/* Similar to CBloomFilter::Hash */
-static inline uint32_t RollingBloomHash(unsigned int nHashNum, uint32_t nTweak, const std::vector<unsigned char>& vDataToHash) {
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash);
+/** One step of the 64 bit LCG from Knuth's MMIX, which spreads the hash of an element over its blocks and positions */
+static inline uint64_t RollingBloomNext(uint64_t& state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state;
 }
 
-void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+void CRollingBloomFilter::insertHash(uint64_t hash)
 {
     if (nEntriesThisGeneration == nEntriesPerGeneration) {
         nEntriesThisGeneration = 0;
@@ -257,7 +423,7 @@ void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
         uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
         uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
         /* Wipe old entries that used this generation number. */
-        for (uint32_t p = 0; p < data.size(); p += 2) {
+        for (uint32_t p = nOffset; p < nOffset + ROLLING_BLOOM_BLOCK_WORDS * nBlocks; p += 2) {
             uint64_t p1 = data[p], p2 = data[p + 1];
             uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
             data[p] = p1 & mask;
@@ -266,48 +432,78 @@ void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
     }
     nEntriesThisGeneration++;
 
-    for (int n = 0; n < nHashFuncs; n++) {
-        uint32_t h = RollingBloomHash(n, nTweak, vKey);
-        int bit = h & 0x3F;
-        uint32_t pos = (h >> 6) % data.size();
-        /* The lowest bit of pos is ignored, and set to zero for the first bit, and to one for the second. */
-        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
-        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+    uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+    uint64_t state = hash;
+    for (int i = 0; i < nBlockHashes; i++) {
+        uint64_t* block = &data[nOffset + ROLLING_BLOOM_BLOCK_WORDS * (((RollingBloomNext(state) >> 32) * nBlocks) >> 32)];
+        uint64_t vMask[ROLLING_BLOOM_BLOCK_WORDS / 2] = {0, 0, 0, 0};
+        for (int n = RollingBloomHashesInBlock(i, nHashFuncs, nBlockHashes); n > 0; n--) {
+            uint32_t pos = RollingBloomNext(state) >> 56;
+            vMask[pos >> 6] |= ((uint64_t)1) << (pos & 63);
+        }
+        /* Set the positions of the block to this generation a pair of words
+         * at a time, without branches, so the loop vectorizes. */
+        for (unsigned int j = 0; j < ROLLING_BLOOM_BLOCK_WORDS / 2; j++) {
+            block[2 * j] = (block[2 * j] & ~vMask[j]) | (vMask[j] & nGenerationMask1);
+            block[2 * j + 1] = (block[2 * j + 1] & ~vMask[j]) | (vMask[j] & nGenerationMask2);
+        }
     }
 }
 
+bool CRollingBloomFilter::containsHash(uint64_t hash) const
+{
+    uint64_t state = hash;
+    for (int i = 0; i < nBlockHashes; i++) {
+        const uint64_t* block = &data[nOffset + ROLLING_BLOOM_BLOCK_WORDS * (((RollingBloomNext(state) >> 32) * nBlocks) >> 32)];
+        uint64_t vMask[ROLLING_BLOOM_BLOCK_WORDS / 2] = {0, 0, 0, 0};
+        for (int n = RollingBloomHashesInBlock(i, nHashFuncs, nBlockHashes); n > 0; n--) {
+            uint32_t pos = RollingBloomNext(state) >> 56;
+            vMask[pos >> 6] |= ((uint64_t)1) << (pos & 63);
+        }
+        /* A position set in neither word of its pair is not in the filter */
+        uint64_t nMissing = 0;
+        for (unsigned int j = 0; j < ROLLING_BLOOM_BLOCK_WORDS / 2; j++)
+            nMissing |= vMask[j] & ~(block[2 * j] | block[2 * j + 1]);
+        if (nMissing)
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insertHash(CSipHasher(nTweak0, nTweak1).Write(vKey.data(), vKey.size()).Finalize());
+}
+
 void CRollingBloomFilter::insert(const uint256& hash)
 {
-    std::vector<unsigned char> vData(hash.begin(), hash.end());
-    insert(vData);
+    // The same hash as of the 32 bytes through CSipHasher, without copying them
+    insertHash(SipHashUint256(nTweak0, nTweak1, hash));
 }
 
 bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
 {
-    for (int n = 0; n < nHashFuncs; n++) {
-        uint32_t h = RollingBloomHash(n, nTweak, vKey);
-        int bit = h & 0x3F;
-        uint32_t pos = (h >> 6) % data.size();
-        /* If the relevant bit is not set in either data[pos & ~1] or data[pos | 1], the filter does not contain vKey */
-        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1)) {
-            return false;
-        }
-    }
-    return true;
+    return containsHash(CSipHasher(nTweak0, nTweak1).Write(vKey.data(), vKey.size()).Finalize());
 }
 
 bool CRollingBloomFilter::contains(const uint256& hash) const
 {
-    std::vector<unsigned char> vData(hash.begin(), hash.end());
-    return contains(vData);
+    return containsHash(SipHashUint256(nTweak0, nTweak1, hash));
 }
 
 void CRollingBloomFilter::reset()
 {
-    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nTweak0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nTweak1 = GetRand(std::numeric_limits<uint64_t>::max());
     nEntriesThisGeneration = 0;
     nGeneration = 1;
     for (std::vector<uint64_t>::iterator it = data.begin(); it != data.end(); it++) {
         *it = 0;
     }
 }
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
+}
@@ -6,12 +6,14 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
+#include <memory>
 #include <vector>
 
 class COutPoint;
+class CScript;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -30,6 +32,42 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that CBloomFilter::IsRelevantAndUpdate
+ * matches: the data pushes of its scripts and the outpoints it spends,
+ * back to back in one buffer. Filters hash with their own tweak, so each
+ * hashes the elements itself, but the scripts are parsed once for the
+ * filters of all peers.
+ */
+class CBloomTxElements
+{
+public:
+    explicit CBloomTxElements(const CTransaction& tx);
+
+    uint256 hash;
+    std::vector<unsigned char> vchData;
+    //! Offset in vchData of each element, and of the end of the last one
+    std::vector<uint32_t> vElementBegin;
+    //! First element of each output, then of each input, and the end of the last one.
+    //! The first element of an input is its serialized prevout.
+    std::vector<uint32_t> vTxoBegin;
+    //! Outputs BLOOM_UPDATE_P2PUBKEY_ONLY adds to the filter when matched
+    std::vector<bool> vPubKeyOutput;
+    unsigned int nOutputs;
+
+private:
+    void AddScriptElements(const CScript& script);
+};
+
+typedef std::shared_ptr<const CBloomTxElements> CBloomTxElementsRef;
+
+/**
+ * Elements of tx, from a cache of the most recent transactions so that
+ * relaying a transaction, or serving a merkleblock, to many SPV peers parses
+ * it once. Thread safe.
+ */
+CBloomTxElementsRef GetBloomTxElements(const CTransaction& tx);
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -52,6 +90,7 @@ private:
     unsigned char nFlags;
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    bool contains(const unsigned char* pch, size_t nLen) const;
 
     // Private constructor for CRollingBloomFilter, no restrictions on size
     CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
@@ -97,9 +136,12 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
+
+    size_t DynamicMemoryUsage() const;
 };
 
 /**
@@ -114,7 +156,12 @@ public:
  * insert()'ed ... but may also return true for items that were not inserted.
  *
  * It needs around 1.8 bytes per element per factor 0.1 of false positive rate.
- * (More accurately: 3/(log(256)*log(2)) * log(1/fpRate) * nElements bytes)
+ * (More accurately: 3/(log(256)*log(2)) * log(1/fpRate) * nElements bytes,
+ * plus a few percent for keeping the positions of an element together.)
+ *
+ * The positions of an element are split over a few blocks of one cache line,
+ * at most five to a block, and all come from a single SipHash of the element,
+ * so insert() and contains() touch a handful of cache lines and hash once.
  */
 class CRollingBloomFilter
 {
@@ -131,13 +178,24 @@ public:
 
     void reset();
 
+    size_t DynamicMemoryUsage() const;
+
 private:
     int nEntriesPerGeneration;
     int nEntriesThisGeneration;
     int nGeneration;
+    //! Blocks of ROLLING_BLOOM_BLOCK_WORDS words from data[nOffset], aligned to a cache line
     std::vector<uint64_t> data;
-    unsigned int nTweak;
+    uint32_t nBlocks;
+    uint32_t nOffset;
+    uint64_t nTweak0;
+    uint64_t nTweak1;
     int nHashFuncs;
+    //! Number of blocks the nHashFuncs positions of an element are split over
+    int nBlockHashes;
+
+    void insertHash(uint64_t hash);
+    bool containsHash(uint64_t hash) const;
 };
 
 #endif // BITCOIN_BLOOM_H
@@ -120,6 +120,15 @@ void CBlockIndex::BuildSkip()
 {
     if (pprev)
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+    UpdatePrevTypes();
+}
+
+void CBlockIndex::UpdatePrevTypes()
+{
+    if (pprev) {
+        pprevWork = (pprev->IsProofOfWork() || !pprev->pprev) ? pprev : pprev->pprevWork.get();
+        pprevStake = (pprev->IsProofOfStake() || !pprev->pprev) ? pprev : pprev->pprevStake.get();
+    }
 }
 
 arith_uint256 GetBlockProof(const CBlockIndex& block)
@@ -157,8 +166,29 @@ int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& fr
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
 {
     while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake)) {
-        pindex = pindex->pprev;
+        // A block only ever turns from proof-of-work into proof-of-stake, so
+        // pprevWork never skips a proof-of-work block, while pprevStake may
+        // skip one connected since it was built unless the walk is on blocks
+        // whose types are all known
+        const CBlockIndex* pindexJump = fProofOfStake ? (pindex->IsValid(BLOCK_VALID_SCRIPTS) ? pindex->pprevStake.get() : NULL) : pindex->pprevWork.get();
+        pindex = pindexJump ? pindexJump : pindex->pprev;
     }
-    
     return pindex;
 }
+
+const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex* pb) {
+    if (pa->nHeight > pb->nHeight) {
+        pa = pa->GetAncestor(pb->nHeight);
+    } else if (pb->nHeight > pa->nHeight) {
+        pb = pb->GetAncestor(pa->nHeight);
+    }
+
+    while (pa != pb && pa && pb) {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+
+    // Eventually all chain branches meet at the genesis block.
+    assert(pa == pb);
+    return pa;
+}
@@ -12,6 +12,7 @@
 #include "tinyformat.h"
 #include "uint256.h"
 #include "utilmoneystr.h"
+#include <atomic>
 #include <vector>
 
 class CBlockFileInfo
@@ -161,6 +162,29 @@ enum BlockStatus : uint32_t {
     
 };
 
+class CBlockIndex;
+
+/**
+ * A block index pointer that is rewritten after the entry holding it has
+ * been published, while other threads may follow it without a lock.
+ * Unlike std::atomic it can be copied, as CBlockIndex is.
+ */
+class CAtomicBlockIndexPtr
+{
+private:
+    std::atomic<CBlockIndex*> ptr;
+
+public:
+    explicit CAtomicBlockIndexPtr(CBlockIndex* p = NULL) : ptr(p) {}
+    CAtomicBlockIndexPtr(const CAtomicBlockIndexPtr& other) : ptr(other.get()) {}
+
+    CAtomicBlockIndexPtr& operator=(CBlockIndex* p) { ptr.store(p, std::memory_order_relaxed); return *this; }
+    CAtomicBlockIndexPtr& operator=(const CAtomicBlockIndexPtr& other) { return *this = other.get(); }
+
+    CBlockIndex* get() const { return ptr.load(std::memory_order_relaxed); }
+    operator CBlockIndex*() const { return get(); }
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -178,6 +202,14 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
+    //! pointers to the last proof-of-work and proof-of-stake predecessors of
+    //! this block, or to the genesis block where there is none. Headers are
+    //! taken as proof-of-work until their block is connected, so these are
+    //! only exact once the block is valid up to BLOCK_VALID_SCRIPTS, and are
+    //! updated while lock-free readers may be following them
+    CAtomicBlockIndexPtr pprevWork;
+    CAtomicBlockIndexPtr pprevStake;
+
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -202,14 +234,12 @@ public:
     //! Change to 64-bit type when necessary; won't happen before 2030
     unsigned int nChainTx;
     int64_t nMoneySupply;
-    COutPoint prevoutStake;
     //! Verification status of this block. See enum BlockStatus
     unsigned int nStatus;
     uint256 nStakeModifier;
     //! block header
     int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nStakeTime;
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
@@ -220,11 +250,16 @@ public:
     //! (memory only) Maximum nTime in the chain upto and including this block.
     unsigned int nTimeMax;
 
+    //! (memory only) Timestamp index logical time, set when the block is connected; 0 until then
+    unsigned int nLogicalTime;
+
     void SetNull()
     {
         phashBlock = NULL;
         pprev = NULL;
         pskip = NULL;
+        pprevWork = NULL;
+        pprevStake = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -234,9 +269,9 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nStakeModifier = uint256();
-        prevoutStake.SetNull();
         nSequenceId = 0;
         nTimeMax = 0;
+        nLogicalTime = 0;
 
         nVersion = 0;
         hashMerkleRoot = uint256();
@@ -258,14 +293,7 @@ public:
         SetNull();
 
         if (block.IsProofOfStake())
-        {
             SetProofOfStake();
-            prevoutStake = block.vtx[1]->vin[0].prevout;
-        }
-        else
-        {
-            prevoutStake.SetNull();
-        }
         nVersion = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
         nTime = block.nTime;
@@ -393,9 +421,13 @@ public:
         return false;
     }
 
-    //! Build the skiplist pointer for this entry.
+    //! Build the skiplist pointer, and the last proof-of-work and proof-of-stake pointers, for this entry.
+    //! Only for an entry that is not published yet, as pskip is not atomic.
     void BuildSkip();
 
+    //! Bring the last proof-of-work and proof-of-stake pointers up to date with the types of the ancestors.
+    void UpdatePrevTypes();
+
     //! Efficiently find an ancestor of this block.
     CBlockIndex* GetAncestor(int height);
     const CBlockIndex* GetAncestor(int height) const;
@@ -405,11 +437,17 @@ arith_uint256 GetBlockProof(const CBlockIndex& block);
 /** Return the time it would take to redo the work difference between from and to, assuming the current hashrate corresponds to the difficulty at tip, in seconds. */
 int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params&);
 
+/** Find the last common ancestor two blocks have.
+ *  Both pa and pb must be non-NULL. */
+const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex* pb);
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
+    //! Kept in the record format only; the stake input is read from the block itself when needed
+    COutPoint prevoutStake;
 
     CDiskBlockIndex()
     {
@@ -544,5 +582,6 @@ public:
     CBlockIndex* FindEarliestAtLeast(int64_t nTime) const;
 };
 
+/** Return the last block of the given type up to and including pindex, or the genesis block where there is none */
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 #endif // BITCOIN_CHAIN_H
@@ -108,6 +108,11 @@ static CBlock CreateGenesisBlock(uint32_t nTime, uint32_t nNonce, uint32_t nBits
  *   (no blocks before with a timestamp after, none after with
  *    timestamp before)
  * + Contains no strange transactions
+ *
+ * Checkpoints may be dense: headers up to the last one are pinned to them
+ * and skip their contextual checks until the full block arrives. A stake
+ * modifier given for a checkpoint is checked when the block is connected
+ * and when a UTXO snapshot supplies it.
  */
 
 class CMainParams : public CChainParams {
@@ -194,7 +199,9 @@ public:
         checkpointData = (CCheckpointData) {
             boost::assign::map_list_of
             (  0, uint256S("0xbf36a3266be55cff28ff429bc066ac80fc2d05cb395ecef14dbb72d221395bbe"))
-            (  70000, uint256S("0xc40402d16ab1df7cc0a527b297e9e2754c8f9f902d7d696af56fe446066af824"))
+            (  70000, uint256S("0xc40402d16ab1df7cc0a527b297e9e2754c8f9f902d7d696af56fe446066af824")),
+            boost::assign::map_list_of
+            (  0, uint256())
         };
 
         chainTxData = ChainTxData{
@@ -291,7 +298,9 @@ public:
 
         checkpointData = (CCheckpointData) {
             boost::assign::map_list_of
-            (  0, uint256S("0x096ce3bbe32a7d43e1242feb97f517cd4506ec3eb03126dc6e8c34e6d3b18e20"))
+            (  0, uint256S("0x096ce3bbe32a7d43e1242feb97f517cd4506ec3eb03126dc6e8c34e6d3b18e20")),
+            boost::assign::map_list_of
+            (  0, uint256())
         };
 
         chainTxData = ChainTxData{
@@ -371,7 +380,9 @@ public:
 
         checkpointData = (CCheckpointData){
             boost::assign::map_list_of
-            ( 0, uint256S("0xa31f431eceadaa4be8056c888a5e53ff9f88aadb51f337f323a9b6fd3ceb4505"))
+            ( 0, uint256S("0xa31f431eceadaa4be8056c888a5e53ff9f88aadb51f337f323a9b6fd3ceb4505")),
+            boost::assign::map_list_of
+            ( 0, uint256())
         };
 
         chainTxData = ChainTxData{
@@ -25,9 +25,12 @@ struct SeedSpec6 {
 };
 
 typedef std::map<int, uint256> MapCheckpoints;
+typedef std::map<int, uint256> MapStakeModifierCheckpoints;
 
 struct CCheckpointData {
     MapCheckpoints mapCheckpoints;
+    //! Stake modifiers of checkpointed blocks, by height; each must also be in mapCheckpoints
+    MapStakeModifierCheckpoints mapStakeModifiers;
 };
 
 struct ChainTxData {
@@ -0,0 +1,59 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainsnapshot.h"
+
+#include "chain.h"
+
+#include <mutex>
+
+static std::mutex cs_chainSnapshot;
+static ChainSnapshotRef chainSnapshot = std::make_shared<const CChainSnapshot>(nullptr);
+
+CChainSnapshot::CChainSnapshot(const CBlockIndex* pindexTipIn) :
+    pindexTip(pindexTipIn),
+    nHeight(pindexTipIn ? pindexTipIn->nHeight : -1),
+    nMoneySupply(pindexTipIn ? pindexTipIn->nMoneySupply : 0),
+    nStakeModifier(pindexTipIn ? pindexTipIn->nStakeModifier : uint256())
+{
+}
+
+const CBlockIndex* CChainSnapshot::operator[](int nHeightIn) const
+{
+    if (nHeightIn < 0 || nHeightIn > nHeight)
+        return NULL;
+    return pindexTip->GetAncestor(nHeightIn);
+}
+
+bool CChainSnapshot::Contains(const CBlockIndex* pindex) const
+{
+    return pindex && (*this)[pindex->nHeight] == pindex;
+}
+
+const CBlockIndex* CChainSnapshot::Next(const CBlockIndex* pindex) const
+{
+    if (Contains(pindex))
+        return (*this)[pindex->nHeight + 1];
+    return NULL;
+}
+
+int CChainSnapshot::Confirmations(const CBlockIndex* pindex) const
+{
+    if (!Contains(pindex))
+        return -1;
+    return nHeight - pindex->nHeight + 1;
+}
+
+ChainSnapshotRef GetChainSnapshot()
+{
+    std::lock_guard<std::mutex> lock(cs_chainSnapshot);
+    return chainSnapshot;
+}
+
+void UpdateChainSnapshot(const CBlockIndex* pindexTip)
+{
+    ChainSnapshotRef snapshot = std::make_shared<const CChainSnapshot>(pindexTip);
+    std::lock_guard<std::mutex> lock(cs_chainSnapshot);
+    chainSnapshot.swap(snapshot);
+}
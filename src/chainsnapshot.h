@@ -0,0 +1,66 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CHAINSNAPSHOT_H
+#define BITCOIN_CHAINSNAPSHOT_H
+
+#include "amount.h"
+#include "uint256.h"
+
+#include <memory>
+
+class CBlockIndex;
+
+/**
+ * Immutable view of the active chain as of one tip, which read-only RPCs
+ * use instead of chainActive so they need not take cs_main.
+ *
+ * Heights are resolved with the skip list of the tip (CBlockIndex::GetAncestor)
+ * rather than a copy of chainActive's vector, so publishing a snapshot is
+ * O(1). Block index entries are never freed while the node runs, and the
+ * fields read through a snapshot (header fields, pprev, pskip, chain work,
+ * money supply, stake modifier) are set before a block can become the tip,
+ * so they are safe to read without cs_main.
+ */
+class CChainSnapshot
+{
+public:
+    explicit CChainSnapshot(const CBlockIndex* pindexTipIn);
+
+    /** The tip, or NULL before the chain is loaded */
+    const CBlockIndex* Tip() const { return pindexTip; }
+
+    /** Height of the tip, -1 before the chain is loaded */
+    int Height() const { return nHeight; }
+
+    /** The block at nHeightIn, or NULL if out of range */
+    const CBlockIndex* operator[](int nHeightIn) const;
+
+    bool Contains(const CBlockIndex* pindex) const;
+
+    /** The successor of pindex in this chain, or NULL */
+    const CBlockIndex* Next(const CBlockIndex* pindex) const;
+
+    /** Confirmations of pindex in this chain, -1 if it is not in it */
+    int Confirmations(const CBlockIndex* pindex) const;
+
+    CAmount MoneySupply() const { return nMoneySupply; }
+    const uint256& StakeModifier() const { return nStakeModifier; }
+
+private:
+    const CBlockIndex* pindexTip;
+    int nHeight;
+    CAmount nMoneySupply;
+    uint256 nStakeModifier;
+};
+
+typedef std::shared_ptr<const CChainSnapshot> ChainSnapshotRef;
+
+/** The latest snapshot of the active chain. Never NULL. */
+ChainSnapshotRef GetChainSnapshot();
+
+/** Publish a snapshot of a new tip. Called with cs_main held whenever chainActive's tip changes. */
+void UpdateChainSnapshot(const CBlockIndex* pindexTip);
+
+#endif // BITCOIN_CHAINSNAPSHOT_H
@@ -15,6 +15,35 @@
 
 namespace Checkpoints {
 
+    bool CheckBlock(const CCheckpointData& data, int nHeight, const uint256& hash)
+    {
+        const MapCheckpoints& checkpoints = data.mapCheckpoints;
+
+        MapCheckpoints::const_iterator i = checkpoints.find(nHeight);
+        if (i == checkpoints.end())
+            return true;
+        return hash == i->second;
+    }
+
+    bool CheckStakeModifier(const CCheckpointData& data, int nHeight, const uint256& nStakeModifier)
+    {
+        const MapStakeModifierCheckpoints& modifiers = data.mapStakeModifiers;
+
+        MapStakeModifierCheckpoints::const_iterator i = modifiers.find(nHeight);
+        if (i == modifiers.end())
+            return true;
+        return nStakeModifier == i->second;
+    }
+
+    int GetLastCheckpointHeight(const CCheckpointData& data)
+    {
+        const MapCheckpoints& checkpoints = data.mapCheckpoints;
+
+        if (checkpoints.empty())
+            return 0;
+        return checkpoints.rbegin()->first;
+    }
+
     CBlockIndex* GetLastCheckpoint(const CCheckpointData& data)
     {
         const MapCheckpoints& checkpoints = data.mapCheckpoints;
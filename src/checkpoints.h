@@ -19,6 +19,15 @@ struct CCheckpointData;
 namespace Checkpoints
 {
 
+//! Returns true if a block at nHeight with hash is not ruled out by a checkpoint
+bool CheckBlock(const CCheckpointData& data, int nHeight, const uint256& hash);
+
+//! Returns true if the stake modifier of a block at nHeight agrees with its checkpoint, if any
+bool CheckStakeModifier(const CCheckpointData& data, int nHeight, const uint256& nStakeModifier);
+
+//! Height of the last checkpoint, whether or not its block is known yet
+int GetLastCheckpointHeight(const CCheckpointData& data);
+
 //! Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
 CBlockIndex* GetLastCheckpoint(const CCheckpointData& data);
 
@@ -6,9 +6,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 
-#include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,12 +27,23 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker has a deque of its own, which Add spreads the checks over.
+  * A worker takes from the back of its own deque and, once that is empty,
+  * steals from the front of the others'. The shared mutex is only taken to
+  * sleep and wake, so the workers do not serialize on it.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! The checks of one worker slot, with the mutex guarding them
+    struct WorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    //! Mutex to protect the worker registration and sleeping
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,96 +52,114 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Worker slots; slot 0 is the master's, workers beyond the last slot share one.
+    //! The set never changes after construction, so it is read without locking.
+    std::vector<std::unique_ptr<WorkerQueue> > vQueues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of worker threads started (excluding the master), protected by mutex.
+    unsigned int nWorkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The slot the next Add starts spreading its checks from, protected by mutex.
+    unsigned int nNextQueue;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Number of verifications still in the deques. Only increased under mutex,
+    //! so a worker that saw it zero under mutex is woken by the next Add.
+    std::atomic<unsigned int> nQueued;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /** Move a batch of checks out of a slot: from the back of its own, or the front of another when stealing. */
+    unsigned int Take(WorkerQueue& slot, std::vector<T>& vChecks, bool fOwn)
+    {
+        boost::unique_lock<boost::mutex> lock(slot.mutex);
+        if (slot.queue.empty())
+            return 0;
+        // Leave half behind for others to steal, so all workers finish approximately simultaneously
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)slot.queue.size() / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // We want the lock on the mutex to be as short as possible, so swap jobs from the
+            // deque to the local batch vector instead of copying.
+            if (fOwn) {
+                vChecks[i].swap(slot.queue.back());
+                slot.queue.pop_back();
+            } else {
+                vChecks[i].swap(slot.queue.front());
+                slot.queue.pop_front();
+            }
+        }
+        nQueued -= nNow;
+        return nNow;
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        unsigned int nSlot = 0;
+        if (!fMaster) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nSlot = 1 + nWorkers++ % (vQueues.size() - 1);
+        }
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
+        while (true) {
+            unsigned int nNow = Take(*vQueues[nSlot], vChecks, true);
+            for (unsigned int i = 1; nNow == 0 && i < vQueues.size(); i++)
+                nNow = Take(*vQueues[(nSlot + i) % vQueues.size()], vChecks, false);
+
+            if (nNow == 0) {
                 boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
+                while (nQueued == 0) {
+                    if (fMaster && nTodo == 0) {
+                        // return the current status, and reset it for new work later
                         bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
+                        fAllOk = true;
                         return fRet;
                     }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+                    (fMaster ? condMaster : condWorker).wait(lock);
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
+
+            // Check whether we need to do work at all
+            bool fOk = fAllOk;
+            for (T& check : vChecks)
                 if (fOk)
                     fOk = check();
+            // Destroy the checks before reporting them done, the master may not return before
             vChecks.clear();
-        } while (true);
+            if (!fOk)
+                fAllOk = false;
+            if ((nTodo -= nNow) == 0 && !fMaster) {
+                // We processed the last element; inform the master it can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_one();
+            }
+        }
     }
 
 public:
+    //! Mutex to ensure only one concurrent CCheckQueueControl
+    boost::mutex ControlMutex;
+
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nQueuesIn = 64) : nWorkers(0), nNextQueue(0), fAllOk(true), nTodo(0), nQueued(0), nBatchSize(nBatchSizeIn)
+    {
+        vQueues.resize(std::max(2U, nQueuesIn));
+        for (std::unique_ptr<WorkerQueue>& slot : vQueues)
+            slot.reset(new WorkerQueue());
+    }
 
     //! Worker thread
     void Thread()
@@ -145,15 +176,26 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
+        if (vChecks.empty())
+            return;
         boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        // Spread the checks in even runs over the slots that have a thread (the master's included)
+        unsigned int nSlots = std::min((unsigned int)vQueues.size(), nWorkers + 1);
+        unsigned int nRun = std::max(1U, std::min(nBatchSize, (unsigned int)vChecks.size() / nSlots));
+        for (size_t i = 0; i < vChecks.size(); ) {
+            WorkerQueue& slot = *vQueues[nNextQueue];
+            nNextQueue = (nNextQueue + 1) % nSlots;
+            boost::unique_lock<boost::mutex> lockSlot(slot.mutex);
+            for (size_t nEnd = std::min(vChecks.size(), i + nRun); i < nEnd; i++) {
+                slot.queue.push_back(T());
+                vChecks[i].swap(slot.queue.back());
+            }
         }
         nTodo += vChecks.size();
+        nQueued += vChecks.size();
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
@@ -161,12 +203,6 @@ public:
     {
     }
 
-    bool IsIdle()
-    {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
-    }
-
 };
 
 /** 
@@ -184,10 +220,8 @@ public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
         // passed queue is supposed to be unused, or NULL
-        if (pqueue != NULL) {
-            bool isIdle = pqueue->IsIdle();
-            assert(isIdle);
-        }
+        if (pqueue != NULL)
+            pqueue->ControlMutex.lock();
     }
 
     bool Wait()
@@ -209,6 +243,8 @@ public:
     {
         if (!fDone)
             Wait();
+        if (pqueue != NULL)
+            pqueue->ControlMutex.unlock();
     }
 };
 
@@ -12,10 +12,17 @@
 #include "primitives/block.h"
 #include "uint256.h"
 
-uint256 ComputeMerkleRoot(const std::vector<uint256>& leaves, bool* mutated = NULL);
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated = NULL);
 std::vector<uint256> ComputeMerkleBranch(const std::vector<uint256>& leaves, uint32_t position);
 uint256 ComputeMerkleRootFromBranch(const uint256& leaf, const std::vector<uint256>& branch, uint32_t position);
 
+/*
+ * Compute every level of the Merkle tree over leaves: the leaves themselves
+ * first, the root last. An odd last hash is paired with itself, so level i
+ * holds ceil(leaves.size() / 2^i) hashes.
+ */
+std::vector<std::vector<uint256> > ComputeMerkleLevels(const std::vector<uint256>& leaves);
+
 /*
  * Compute the Merkle root of the transactions in a block.
  * *mutated is set to true if a duplicated subtree was found.
@@ -90,11 +90,10 @@ CScript ParseScript(const std::string& s)
 
 bool DecodeHexTx(CMutableTransaction& tx, const std::string& strHexTx, bool fTryNoWitness)
 {
-    if (!IsHex(strHexTx))
+    std::vector<unsigned char> txData;
+    if (!DecodeHex(strHexTx, txData))
         return false;
 
-    std::vector<unsigned char> txData(ParseHex(strHexTx));
-
     if (fTryNoWitness) {
         CDataStream ssData(txData, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
         try {
@@ -123,10 +122,9 @@ bool DecodeHexTx(CMutableTransaction& tx, const std::string& strHexTx, bool fTry
 
 bool DecodeHexBlk(CBlock& block, const std::string& strHexBlk)
 {
-    if (!IsHex(strHexBlk))
+    std::vector<unsigned char> blockData;
+    if (!DecodeHex(strHexBlk, blockData))
         return false;
-
-    std::vector<unsigned char> blockData(ParseHex(strHexBlk));
     CDataStream ssBlock(blockData, SER_NETWORK, PROTOCOL_VERSION);
     try {
         ssBlock >> block;
@@ -158,10 +156,8 @@ uint256 ParseHashStr(const std::string& strHex, const std::string& strName)
 
 std::vector<unsigned char> ParseHexUV(const UniValue& v, const std::string& strName)
 {
-    std::string strHex;
-    if (v.isStr())
-        strHex = v.getValStr();
-    if (!IsHex(strHex))
-        throw std::runtime_error(strName + " must be hexadecimal string (not '" + strHex + "')");
-    return ParseHex(strHex);
+    std::vector<unsigned char> vch;
+    if (!v.isStr() || !DecodeHex(v.getValStr(), vch))
+        throw std::runtime_error(strName + " must be hexadecimal string (not '" + (v.isStr() ? v.getValStr() : "") + "')");
+    return vch;
 }
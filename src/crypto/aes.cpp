@@ -12,6 +12,34 @@ extern "C" {
 #include "crypto/ctaes/ctaes.c"
 }
 
+#if defined(ENABLE_AESNI)
+#include <cpuid.h>
+namespace aes_aesni
+{
+void ExpandEncrypt256(unsigned char rk[240], const unsigned char key[32]);
+void ExpandDecrypt256(unsigned char rk[240], const unsigned char key[32]);
+void Encrypt256(const unsigned char rk[240], unsigned char out[16], const unsigned char in[16]);
+void Decrypt256(const unsigned char rk[240], unsigned char out[16], const unsigned char in[16]);
+}
+#endif
+
+namespace
+{
+bool use_aesni = false;
+} // namespace
+
+std::string AESAutoDetect()
+{
+#if defined(ENABLE_AESNI)
+    uint32_t eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && ((ecx >> 25) & 1)) {
+        use_aesni = true;
+        return "aesni";
+    }
+#endif
+    return "ctaes";
+}
+
 AES128Encrypt::AES128Encrypt(const unsigned char key[16])
 {
     AES128_init(&ctx, key);
@@ -42,33 +70,63 @@ void AES128Decrypt::Decrypt(unsigned char plaintext[16], const unsigned char cip
     AES128_decrypt(&ctx, 1, plaintext, ciphertext);
 }
 
-AES256Encrypt::AES256Encrypt(const unsigned char key[32])
+AES256Encrypt::AES256Encrypt(const unsigned char key[32]) : fAESNI(use_aesni)
 {
+#if defined(ENABLE_AESNI)
+    if (fAESNI) {
+        aes_aesni::ExpandEncrypt256(rk, key);
+        return;
+    }
+#endif
     AES256_init(&ctx, key);
 }
 
 AES256Encrypt::~AES256Encrypt()
 {
-    memset(&ctx, 0, sizeof(ctx));
+    if (fAESNI)
+        memset(rk, 0, sizeof(rk));
+    else
+        memset(&ctx, 0, sizeof(ctx));
 }
 
 void AES256Encrypt::Encrypt(unsigned char ciphertext[16], const unsigned char plaintext[16]) const
 {
+#if defined(ENABLE_AESNI)
+    if (fAESNI) {
+        aes_aesni::Encrypt256(rk, ciphertext, plaintext);
+        return;
+    }
+#endif
     AES256_encrypt(&ctx, 1, ciphertext, plaintext);
 }
 
-AES256Decrypt::AES256Decrypt(const unsigned char key[32])
+AES256Decrypt::AES256Decrypt(const unsigned char key[32]) : fAESNI(use_aesni)
 {
+#if defined(ENABLE_AESNI)
+    if (fAESNI) {
+        aes_aesni::ExpandDecrypt256(rk, key);
+        return;
+    }
+#endif
     AES256_init(&ctx, key);
 }
 
 AES256Decrypt::~AES256Decrypt()
 {
-    memset(&ctx, 0, sizeof(ctx));
+    if (fAESNI)
+        memset(rk, 0, sizeof(rk));
+    else
+        memset(&ctx, 0, sizeof(ctx));
 }
 
 void AES256Decrypt::Decrypt(unsigned char plaintext[16], const unsigned char ciphertext[16]) const
 {
+#if defined(ENABLE_AESNI)
+    if (fAESNI) {
+        aes_aesni::Decrypt256(rk, plaintext, ciphertext);
+        return;
+    }
+#endif
     AES256_decrypt(&ctx, 1, plaintext, ciphertext);
 }
 
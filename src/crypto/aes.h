@@ -11,9 +11,15 @@ extern "C" {
 #include "crypto/ctaes/ctaes.h"
 }
 
+#include <string>
+
 static const int AES_BLOCKSIZE = 16;
 static const int AES128_KEYSIZE = 16;
 static const int AES256_KEYSIZE = 32;
+static const int AES256_ROUNDKEYS_SIZE = 15 * AES_BLOCKSIZE;
+
+/** Use AES-NI for AES-256 where the CPU has it, and return the implementation in use. */
+std::string AESAutoDetect();
 
 /** An encryption class for AES-128. */
 class AES128Encrypt
@@ -44,6 +50,9 @@ class AES256Encrypt
 {
 private:
     AES256_ctx ctx;
+    //! Round keys for AES-NI, used instead of ctx when it was detected
+    unsigned char rk[AES256_ROUNDKEYS_SIZE];
+    bool fAESNI;
 
 public:
     AES256Encrypt(const unsigned char key[32]);
@@ -56,6 +65,9 @@ class AES256Decrypt
 {
 private:
     AES256_ctx ctx;
+    //! Round keys for AES-NI, used instead of ctx when it was detected
+    unsigned char rk[AES256_ROUNDKEYS_SIZE];
+    bool fAESNI;
 
 public:
     AES256Decrypt(const unsigned char key[32]);
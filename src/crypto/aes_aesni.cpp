@@ -0,0 +1,104 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// AES-256 with the AES-NI instructions, after Intel's "Advanced Encryption
+// Standard (AES) New Instructions Set" white paper. The instructions take
+// the same time for any key and data, like ctaes. Only called when CPUID
+// reports AES-NI.
+
+#ifndef ENABLE_AESNI
+#error "aes_aesni.cpp is only built into libbitcoin_crypto_aesni, with ENABLE_AESNI defined"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <wmmintrin.h>
+
+namespace
+{
+/** a xor'ed with each of its shifts left by 4, 8 and 12 bytes, then with t. */
+inline __m128i Mix(__m128i a, __m128i t)
+{
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 8));
+    return _mm_xor_si128(a, t);
+}
+
+/** The next even round key from the previous two, with round constant rcon. */
+template <int rcon>
+inline __m128i NextEven(__m128i prev2, __m128i prev1)
+{
+    return Mix(prev2, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev1, rcon), 0xff));
+}
+
+/** The next odd round key from the previous two. */
+inline __m128i NextOdd(__m128i prev2, __m128i prev1)
+{
+    return Mix(prev2, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev1, 0), 0xaa));
+}
+
+void Expand(__m128i* k, const unsigned char key[32])
+{
+    k[0] = _mm_loadu_si128((const __m128i*)key);
+    k[1] = _mm_loadu_si128((const __m128i*)(key + 16));
+    k[2] = NextEven<0x01>(k[0], k[1]);
+    k[3] = NextOdd(k[1], k[2]);
+    k[4] = NextEven<0x02>(k[2], k[3]);
+    k[5] = NextOdd(k[3], k[4]);
+    k[6] = NextEven<0x04>(k[4], k[5]);
+    k[7] = NextOdd(k[5], k[6]);
+    k[8] = NextEven<0x08>(k[6], k[7]);
+    k[9] = NextOdd(k[7], k[8]);
+    k[10] = NextEven<0x10>(k[8], k[9]);
+    k[11] = NextOdd(k[9], k[10]);
+    k[12] = NextEven<0x20>(k[10], k[11]);
+    k[13] = NextOdd(k[11], k[12]);
+    k[14] = NextEven<0x40>(k[12], k[13]);
+}
+} // namespace
+
+namespace aes_aesni
+{
+void ExpandEncrypt256(unsigned char rk[240], const unsigned char key[32])
+{
+    __m128i k[15];
+    Expand(k, key);
+    for (int i = 0; i < 15; i++) {
+        _mm_storeu_si128((__m128i*)(rk + 16 * i), k[i]);
+        k[i] = _mm_setzero_si128();
+    }
+}
+
+void ExpandDecrypt256(unsigned char rk[240], const unsigned char key[32])
+{
+    // The equivalent inverse cipher: the round keys in reverse, all but the
+    // first and last through InvMixColumns
+    __m128i k[15];
+    Expand(k, key);
+    _mm_storeu_si128((__m128i*)rk, k[14]);
+    for (int i = 1; i < 14; i++)
+        _mm_storeu_si128((__m128i*)(rk + 16 * i), _mm_aesimc_si128(k[14 - i]));
+    _mm_storeu_si128((__m128i*)(rk + 16 * 14), k[0]);
+    for (int i = 0; i < 15; i++)
+        k[i] = _mm_setzero_si128();
+}
+
+void Encrypt256(const unsigned char rk[240], unsigned char out[16], const unsigned char in[16])
+{
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)rk));
+    for (int i = 1; i < 14; i++)
+        x = _mm_aesenc_si128(x, _mm_loadu_si128((const __m128i*)(rk + 16 * i)));
+    x = _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i*)(rk + 16 * 14)));
+    _mm_storeu_si128((__m128i*)out, x);
+}
+
+void Decrypt256(const unsigned char rk[240], unsigned char out[16], const unsigned char in[16])
+{
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)in), _mm_loadu_si128((const __m128i*)rk));
+    for (int i = 1; i < 14; i++)
+        x = _mm_aesdec_si128(x, _mm_loadu_si128((const __m128i*)(rk + 16 * i)));
+    x = _mm_aesdeclast_si128(x, _mm_loadu_si128((const __m128i*)(rk + 16 * 14)));
+    _mm_storeu_si128((__m128i*)out, x);
+}
+} // namespace aes_aesni
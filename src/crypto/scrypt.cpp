@@ -34,6 +34,18 @@
 #include <string.h>
 #include <openssl/sha.h>
 
+#include <algorithm>
+#include <memory>
+
+#if defined(ENABLE_AVX2)
+#include <cpuid.h>
+namespace scrypt_avx2
+{
+/** The mixing loop of eight hashes, X holding their 32-word states one after another */
+void ROMix_8way(uint32_t* X, char* scratchpad);
+}
+#endif
+
 #if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
 #ifdef _MSC_VER
 // MSVC 64bit is unable to use inline asm
@@ -312,7 +324,7 @@ std::string scrypt_detect_sse2()
     if (cpuid_edx & 1<<26)
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_sse2;
-        ret = "scrypt: using scrypt-sse2 as detected");
+        ret = "scrypt: using scrypt-sse2 as detected";
     }
     else
     {
@@ -324,6 +336,94 @@ std::string scrypt_detect_sse2()
 }
 #endif
 
+#if defined(ENABLE_AVX2)
+// Set by scrypt_detect_avx2(), NULL until then
+static void (*scrypt_romix_8way)(uint32_t* X, char* scratchpad) = NULL;
+
+// Fewer hashes than this are cheaper one at a time than in eight lanes
+static const size_t SCRYPT_MIN_8WAY = 3;
+
+static void scrypt_1024_1_1_256_sp_8way(const char *input, char *output, size_t count, char *scratchpad)
+{
+	uint8_t B[128];
+	uint32_t X[8 * 32];
+	size_t i, k;
+
+	memset(X, 0, sizeof(X));
+	for (i = 0; i < count; i++) {
+		PBKDF2_SHA256((const uint8_t *)(input + 80 * i), 80, (const uint8_t *)(input + 80 * i), 80, 1, B, 128);
+		for (k = 0; k < 32; k++)
+			X[i * 32 + k] = le32dec(&B[4 * k]);
+	}
+
+	scrypt_romix_8way(X, scratchpad);
+
+	for (i = 0; i < count; i++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[4 * k], X[i * 32 + k]);
+		PBKDF2_SHA256((const uint8_t *)(input + 80 * i), 80, B, 128, 1, (uint8_t *)(output + 32 * i), 32);
+	}
+}
+#endif
+
+std::string scrypt_detect_avx2()
+{
+#if defined(ENABLE_AVX2)
+	unsigned int eax, ebx, ecx, edx;
+	bool fAVX = false;
+	// AVX needs OSXSAVE, and the OS saving the AVX registers, as well as CPU support
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 27)) && (ecx & (1 << 28))) {
+		uint32_t a, d;
+		__asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+		fAVX = (a & 6) == 6;
+	}
+	if (fAVX && __get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		if (ebx & (1 << 5)) {
+			scrypt_romix_8way = &scrypt_avx2::ROMix_8way;
+			return "scrypt: using 8-way scrypt-avx2 for batches as detected";
+		}
+	}
+	scrypt_romix_8way = NULL;
+	return "scrypt: hashing batches one at a time, AVX2 unavailable";
+#else
+	return "scrypt: hashing batches one at a time, built without AVX2";
+#endif
+}
+
+size_t scrypt_multi_lanes()
+{
+#if defined(ENABLE_AVX2)
+	if (scrypt_romix_8way)
+		return 8;
+#endif
+	return 1;
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t count)
+{
+#if defined(ENABLE_AVX2)
+	if (scrypt_romix_8way && count >= SCRYPT_MIN_8WAY) {
+		std::unique_ptr<char[]> scratchpad(new char[8 * 131072 + 63]);
+		while (count >= SCRYPT_MIN_8WAY) {
+			size_t n = std::min(count, (size_t)8);
+			scrypt_1024_1_1_256_sp_8way(input, output, n, scratchpad.get());
+			input += 80 * n;
+			output += 32 * n;
+			count -= n;
+		}
+	}
+#endif
+	if (count == 0)
+		return;
+	std::unique_ptr<char[]> scratchpad(new char[SCRYPT_SCRATCHPAD_SIZE]);
+	for (; count > 0; count--) {
+		scrypt_1024_1_1_256_sp(input, output, scratchpad.get());
+		input += 80;
+		output += 32;
+	}
+}
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
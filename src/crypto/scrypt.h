@@ -2,6 +2,7 @@
 #define SCRYPT_H
 #include <stdlib.h>
 #include <stdint.h>
+#include <string>
 
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
@@ -9,7 +10,6 @@ void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
 #if defined(USE_SSE2)
-#include <string>
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
 #define USE_SSE2_ALWAYS 1
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_sse2((input), (output), (scratchpad))
@@ -24,6 +24,17 @@ extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output,
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
 #endif
 
+/**
+ * scrypt of count consecutive 80-byte inputs into count consecutive 32-byte
+ * outputs. Eight at a time in AVX2 registers once scrypt_detect_avx2() has
+ * found it, otherwise one at a time; either way with one heap scratchpad for
+ * the whole batch rather than one on the stack per hash.
+ */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t count);
+/** How many hashes scrypt_1024_1_1_256_multi computes at once */
+size_t scrypt_multi_lanes();
+std::string scrypt_detect_avx2();
+
 void
 PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
     size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen);
@@ -0,0 +1,97 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// The scrypt(1024, 1, 1) mixing loop of eight independent hashes at once,
+// one per 32-bit lane of the AVX2 registers. Only called when CPUID reports
+// AVX2.
+
+#ifndef ENABLE_AVX2
+#error "scrypt_avx2.cpp is only built into libbitcoin_crypto_avx2, with ENABLE_AVX2 defined"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+namespace
+{
+/** Eight 32-bit words, one of each of eight hashes. */
+typedef uint32_t Word8 __attribute__((vector_size(32)));
+
+#define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+/** Salsa20/8 core of crypto/scrypt.cpp, on eight states at once. */
+inline void xor_salsa8(Word8 B[16], const Word8 Bx[16])
+{
+    Word8 x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = (B[i] ^= Bx[i]);
+    for (int i = 0; i < 8; i += 2) {
+        // Operate on columns
+        x[ 4] ^= ROTL(x[ 0] + x[12],  7);  x[ 9] ^= ROTL(x[ 5] + x[ 1],  7);
+        x[14] ^= ROTL(x[10] + x[ 6],  7);  x[ 3] ^= ROTL(x[15] + x[11],  7);
+
+        x[ 8] ^= ROTL(x[ 4] + x[ 0],  9);  x[13] ^= ROTL(x[ 9] + x[ 5],  9);
+        x[ 2] ^= ROTL(x[14] + x[10],  9);  x[ 7] ^= ROTL(x[ 3] + x[15],  9);
+
+        x[12] ^= ROTL(x[ 8] + x[ 4], 13);  x[ 1] ^= ROTL(x[13] + x[ 9], 13);
+        x[ 6] ^= ROTL(x[ 2] + x[14], 13);  x[11] ^= ROTL(x[ 7] + x[ 3], 13);
+
+        x[ 0] ^= ROTL(x[12] + x[ 8], 18);  x[ 5] ^= ROTL(x[ 1] + x[13], 18);
+        x[10] ^= ROTL(x[ 6] + x[ 2], 18);  x[15] ^= ROTL(x[11] + x[ 7], 18);
+
+        // Operate on rows
+        x[ 1] ^= ROTL(x[ 0] + x[ 3],  7);  x[ 6] ^= ROTL(x[ 5] + x[ 4],  7);
+        x[11] ^= ROTL(x[10] + x[ 9],  7);  x[12] ^= ROTL(x[15] + x[14],  7);
+
+        x[ 2] ^= ROTL(x[ 1] + x[ 0],  9);  x[ 7] ^= ROTL(x[ 6] + x[ 5],  9);
+        x[ 8] ^= ROTL(x[11] + x[10],  9);  x[13] ^= ROTL(x[12] + x[15],  9);
+
+        x[ 3] ^= ROTL(x[ 2] + x[ 1], 13);  x[ 4] ^= ROTL(x[ 7] + x[ 6], 13);
+        x[ 9] ^= ROTL(x[ 8] + x[11], 13);  x[14] ^= ROTL(x[13] + x[12], 13);
+
+        x[ 0] ^= ROTL(x[ 3] + x[ 2], 18);  x[ 5] ^= ROTL(x[ 4] + x[ 7], 18);
+        x[10] ^= ROTL(x[ 9] + x[ 8], 18);  x[15] ^= ROTL(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++)
+        B[i] += x[i];
+}
+
+#undef ROTL
+} // namespace
+
+namespace scrypt_avx2
+{
+void ROMix_8way(uint32_t* X, char* scratchpad)
+{
+    Word8* V = (Word8*)(((uintptr_t)(scratchpad) + 63) & ~(uintptr_t)(63));
+    Word8 B[32];
+    for (int k = 0; k < 32; k++)
+        for (int l = 0; l < 8; l++)
+            B[k][l] = X[l * 32 + k];
+
+    for (int i = 0; i < 1024; i++) {
+        memcpy(&V[i * 32], B, sizeof(B));
+        xor_salsa8(&B[0], &B[16]);
+        xor_salsa8(&B[16], &B[0]);
+    }
+
+    // Each lane reads its own row of V: word k of lane l of row j is the
+    // 32-bit element (j * 32 + k) * 8 + l
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i = 0; i < 1024; i++) {
+        __m256i idx = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256((__m256i)B[16], _mm256_set1_epi32(1023)), 8), lanes);
+        for (int k = 0; k < 32; k++) {
+            B[k] ^= (Word8)_mm256_i32gather_epi32((const int*)V, idx, 4);
+            idx = _mm256_add_epi32(idx, _mm256_set1_epi32(8));
+        }
+        xor_salsa8(&B[0], &B[16]);
+        xor_salsa8(&B[16], &B[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        for (int l = 0; l < 8; l++)
+            X[l * 32 + k] = B[k][l];
+}
+} // namespace scrypt_avx2
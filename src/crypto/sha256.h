@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,14 @@ public:
     CSHA256& Reset();
 };
 
+/** Select the fastest SHA256 implementations this CPU supports, and return a
+ *  description of them. Call it once at startup, before any other threads
+ *  hash. */
+std::string SHA256AutoDetect();
+
+/** Compute the double-SHA256 of each of blocks consecutive 64-byte inputs into
+ *  blocks consecutive 32-byte outputs, several at a time with SIMD where the
+ *  compiler supports it. out may be the same as in (merkle tree levels). */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
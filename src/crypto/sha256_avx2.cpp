@@ -0,0 +1,46 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Eight double-SHA256 hashes of 64-byte inputs at once, in AVX2 registers.
+// This is the portable compression function of sha256_rounds.h over a vector
+// of eight words, compiled with -mavx2. Only called when CPUID reports AVX2.
+
+#ifndef ENABLE_AVX2
+#error "sha256_avx2.cpp is only built into libbitcoin_crypto_avx2, with ENABLE_AVX2 defined"
+#endif
+
+#include "crypto/common.h"
+
+#include <stdint.h>
+
+namespace
+{
+namespace sha256
+{
+typedef uint32_t Word8 __attribute__((vector_size(32)));
+
+inline void Read(Word8& w, const unsigned char* in)
+{
+    Word8 r = {ReadBE32(in), ReadBE32(in + 64), ReadBE32(in + 128), ReadBE32(in + 192),
+               ReadBE32(in + 256), ReadBE32(in + 320), ReadBE32(in + 384), ReadBE32(in + 448)};
+    w = r;
+}
+
+inline void Write(unsigned char* out, Word8 w)
+{
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 32 * i, w[i]);
+}
+} // namespace sha256
+} // namespace
+
+#include "crypto/sha256_rounds.h"
+
+namespace sha256_avx2
+{
+void TransformD64_8way(unsigned char* out, const unsigned char* in)
+{
+    sha256::TransformD64<sha256::Word8>(out, in);
+}
+} // namespace sha256_avx2
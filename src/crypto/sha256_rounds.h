@@ -0,0 +1,180 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_SHA256_ROUNDS_H
+#define BITCOIN_CRYPTO_SHA256_ROUNDS_H
+
+/**
+ * The SHA-256 compression function over a generic word type, shared by the
+ * portable code in sha256.cpp and the implementations compiled with extra
+ * instruction sets. Internal to the crypto library; every file including it
+ * gets its own copy. Read and Write for a vector word type must be declared
+ * before the include, so TransformD64 finds them.
+ */
+
+#include "crypto/common.h"
+
+#include <stdint.h>
+
+namespace
+{
+namespace sha256
+{
+template <typename W> W inline Ch(W x, W y, W z) { return z ^ (x & (y ^ z)); }
+template <typename W> W inline Maj(W x, W y, W z) { return (x & y) | (z & (x | y)); }
+template <typename W> W inline Sigma0(W x) { return (x >> 2 | x << 30) ^ (x >> 13 | x << 19) ^ (x >> 22 | x << 10); }
+template <typename W> W inline Sigma1(W x) { return (x >> 6 | x << 26) ^ (x >> 11 | x << 21) ^ (x >> 25 | x << 7); }
+template <typename W> W inline sigma0(W x) { return (x >> 7 | x << 25) ^ (x >> 18 | x << 14) ^ (x >> 3); }
+template <typename W> W inline sigma1(W x) { return (x >> 17 | x << 15) ^ (x >> 19 | x << 13) ^ (x >> 10); }
+
+/** One round of SHA-256. W is a 32-bit word, or a vector of them for several hashes at once. */
+template <typename W>
+void inline Round(W a, W b, W c, W& d, W e, W f, W g, W& h, uint32_t k, W w)
+{
+    W t1 = h + Sigma1(e) + Ch(e, f, g) + k + w;
+    W t2 = Sigma0(a) + Maj(a, b, c);
+    d += t1;
+    h = t1 + t2;
+}
+
+/** Initialize SHA-256 state. */
+template <typename W>
+void inline Initialize(W* s)
+{
+    s[0] = W() + 0x6a09e667ul;
+    s[1] = W() + 0xbb67ae85ul;
+    s[2] = W() + 0x3c6ef372ul;
+    s[3] = W() + 0xa54ff53aul;
+    s[4] = W() + 0x510e527ful;
+    s[5] = W() + 0x9b05688cul;
+    s[6] = W() + 0x1f83d9abul;
+    s[7] = W() + 0x5be0cd19ul;
+}
+
+/** Perform one SHA-256 transformation on the 16 big-endian words of a 64-byte chunk. */
+template <typename W>
+void inline Compress(W* s, const W* chunk)
+{
+    W a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    W w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+
+    Round(a, b, c, d, e, f, g, h, 0x428a2f98, w0 = chunk[0]);
+    Round(h, a, b, c, d, e, f, g, 0x71374491, w1 = chunk[1]);
+    Round(g, h, a, b, c, d, e, f, 0xb5c0fbcf, w2 = chunk[2]);
+    Round(f, g, h, a, b, c, d, e, 0xe9b5dba5, w3 = chunk[3]);
+    Round(e, f, g, h, a, b, c, d, 0x3956c25b, w4 = chunk[4]);
+    Round(d, e, f, g, h, a, b, c, 0x59f111f1, w5 = chunk[5]);
+    Round(c, d, e, f, g, h, a, b, 0x923f82a4, w6 = chunk[6]);
+    Round(b, c, d, e, f, g, h, a, 0xab1c5ed5, w7 = chunk[7]);
+    Round(a, b, c, d, e, f, g, h, 0xd807aa98, w8 = chunk[8]);
+    Round(h, a, b, c, d, e, f, g, 0x12835b01, w9 = chunk[9]);
+    Round(g, h, a, b, c, d, e, f, 0x243185be, w10 = chunk[10]);
+    Round(f, g, h, a, b, c, d, e, 0x550c7dc3, w11 = chunk[11]);
+    Round(e, f, g, h, a, b, c, d, 0x72be5d74, w12 = chunk[12]);
+    Round(d, e, f, g, h, a, b, c, 0x80deb1fe, w13 = chunk[13]);
+    Round(c, d, e, f, g, h, a, b, 0x9bdc06a7, w14 = chunk[14]);
+    Round(b, c, d, e, f, g, h, a, 0xc19bf174, w15 = chunk[15]);
+
+    Round(a, b, c, d, e, f, g, h, 0xe49b69c1, w0 += sigma1(w14) + w9 + sigma0(w1));
+    Round(h, a, b, c, d, e, f, g, 0xefbe4786, w1 += sigma1(w15) + w10 + sigma0(w2));
+    Round(g, h, a, b, c, d, e, f, 0x0fc19dc6, w2 += sigma1(w0) + w11 + sigma0(w3));
+    Round(f, g, h, a, b, c, d, e, 0x240ca1cc, w3 += sigma1(w1) + w12 + sigma0(w4));
+    Round(e, f, g, h, a, b, c, d, 0x2de92c6f, w4 += sigma1(w2) + w13 + sigma0(w5));
+    Round(d, e, f, g, h, a, b, c, 0x4a7484aa, w5 += sigma1(w3) + w14 + sigma0(w6));
+    Round(c, d, e, f, g, h, a, b, 0x5cb0a9dc, w6 += sigma1(w4) + w15 + sigma0(w7));
+    Round(b, c, d, e, f, g, h, a, 0x76f988da, w7 += sigma1(w5) + w0 + sigma0(w8));
+    Round(a, b, c, d, e, f, g, h, 0x983e5152, w8 += sigma1(w6) + w1 + sigma0(w9));
+    Round(h, a, b, c, d, e, f, g, 0xa831c66d, w9 += sigma1(w7) + w2 + sigma0(w10));
+    Round(g, h, a, b, c, d, e, f, 0xb00327c8, w10 += sigma1(w8) + w3 + sigma0(w11));
+    Round(f, g, h, a, b, c, d, e, 0xbf597fc7, w11 += sigma1(w9) + w4 + sigma0(w12));
+    Round(e, f, g, h, a, b, c, d, 0xc6e00bf3, w12 += sigma1(w10) + w5 + sigma0(w13));
+    Round(d, e, f, g, h, a, b, c, 0xd5a79147, w13 += sigma1(w11) + w6 + sigma0(w14));
+    Round(c, d, e, f, g, h, a, b, 0x06ca6351, w14 += sigma1(w12) + w7 + sigma0(w15));
+    Round(b, c, d, e, f, g, h, a, 0x14292967, w15 += sigma1(w13) + w8 + sigma0(w0));
+
+    Round(a, b, c, d, e, f, g, h, 0x27b70a85, w0 += sigma1(w14) + w9 + sigma0(w1));
+    Round(h, a, b, c, d, e, f, g, 0x2e1b2138, w1 += sigma1(w15) + w10 + sigma0(w2));
+    Round(g, h, a, b, c, d, e, f, 0x4d2c6dfc, w2 += sigma1(w0) + w11 + sigma0(w3));
+    Round(f, g, h, a, b, c, d, e, 0x53380d13, w3 += sigma1(w1) + w12 + sigma0(w4));
+    Round(e, f, g, h, a, b, c, d, 0x650a7354, w4 += sigma1(w2) + w13 + sigma0(w5));
+    Round(d, e, f, g, h, a, b, c, 0x766a0abb, w5 += sigma1(w3) + w14 + sigma0(w6));
+    Round(c, d, e, f, g, h, a, b, 0x81c2c92e, w6 += sigma1(w4) + w15 + sigma0(w7));
+    Round(b, c, d, e, f, g, h, a, 0x92722c85, w7 += sigma1(w5) + w0 + sigma0(w8));
+    Round(a, b, c, d, e, f, g, h, 0xa2bfe8a1, w8 += sigma1(w6) + w1 + sigma0(w9));
+    Round(h, a, b, c, d, e, f, g, 0xa81a664b, w9 += sigma1(w7) + w2 + sigma0(w10));
+    Round(g, h, a, b, c, d, e, f, 0xc24b8b70, w10 += sigma1(w8) + w3 + sigma0(w11));
+    Round(f, g, h, a, b, c, d, e, 0xc76c51a3, w11 += sigma1(w9) + w4 + sigma0(w12));
+    Round(e, f, g, h, a, b, c, d, 0xd192e819, w12 += sigma1(w10) + w5 + sigma0(w13));
+    Round(d, e, f, g, h, a, b, c, 0xd6990624, w13 += sigma1(w11) + w6 + sigma0(w14));
+    Round(c, d, e, f, g, h, a, b, 0xf40e3585, w14 += sigma1(w12) + w7 + sigma0(w15));
+    Round(b, c, d, e, f, g, h, a, 0x106aa070, w15 += sigma1(w13) + w8 + sigma0(w0));
+
+    Round(a, b, c, d, e, f, g, h, 0x19a4c116, w0 += sigma1(w14) + w9 + sigma0(w1));
+    Round(h, a, b, c, d, e, f, g, 0x1e376c08, w1 += sigma1(w15) + w10 + sigma0(w2));
+    Round(g, h, a, b, c, d, e, f, 0x2748774c, w2 += sigma1(w0) + w11 + sigma0(w3));
+    Round(f, g, h, a, b, c, d, e, 0x34b0bcb5, w3 += sigma1(w1) + w12 + sigma0(w4));
+    Round(e, f, g, h, a, b, c, d, 0x391c0cb3, w4 += sigma1(w2) + w13 + sigma0(w5));
+    Round(d, e, f, g, h, a, b, c, 0x4ed8aa4a, w5 += sigma1(w3) + w14 + sigma0(w6));
+    Round(c, d, e, f, g, h, a, b, 0x5b9cca4f, w6 += sigma1(w4) + w15 + sigma0(w7));
+    Round(b, c, d, e, f, g, h, a, 0x682e6ff3, w7 += sigma1(w5) + w0 + sigma0(w8));
+    Round(a, b, c, d, e, f, g, h, 0x748f82ee, w8 += sigma1(w6) + w1 + sigma0(w9));
+    Round(h, a, b, c, d, e, f, g, 0x78a5636f, w9 += sigma1(w7) + w2 + sigma0(w10));
+    Round(g, h, a, b, c, d, e, f, 0x84c87814, w10 += sigma1(w8) + w3 + sigma0(w11));
+    Round(f, g, h, a, b, c, d, e, 0x8cc70208, w11 += sigma1(w9) + w4 + sigma0(w12));
+    Round(e, f, g, h, a, b, c, d, 0x90befffa, w12 += sigma1(w10) + w5 + sigma0(w13));
+    Round(d, e, f, g, h, a, b, c, 0xa4506ceb, w13 += sigma1(w11) + w6 + sigma0(w14));
+    Round(c, d, e, f, g, h, a, b, 0xbef9a3f7, w14 + sigma1(w12) + w7 + sigma0(w15));
+    Round(b, c, d, e, f, g, h, a, 0xc67178f2, w15 + sigma1(w13) + w8 + sigma0(w0));
+
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+}
+
+inline void Read(uint32_t& w, const unsigned char* in) { w = ReadBE32(in); }
+inline void Write(unsigned char* out, uint32_t w) { WriteBE32(out, w); }
+
+/**
+ * Double-SHA256 of 64-byte inputs, as many at once as W holds words: the
+ * inputs are 64 bytes apart in in, the outputs 32 bytes apart in out. All
+ * input is read before any output is written, so out may be in.
+ */
+template <typename W>
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    W s[8], w[16];
+    Initialize(s);
+    for (int i = 0; i < 16; i++)
+        Read(w[i], in + 4 * i);
+    Compress(s, w);
+
+    // The padding block of a 64-byte message
+    for (int i = 0; i < 16; i++)
+        w[i] = W();
+    w[0] += 0x80000000ul;
+    w[15] += 512;
+    Compress(s, w);
+
+    // The second hash, of the 32-byte digest
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = W() + 0x80000000ul;
+    for (int i = 9; i < 15; i++)
+        w[i] = W();
+    w[15] = W() + 256;
+    Initialize(s);
+    Compress(s, w);
+    for (int i = 0; i < 8; i++)
+        Write(out + 4 * i, s[i]);
+}
+
+} // namespace sha256
+} // namespace
+
+#endif // BITCOIN_CRYPTO_SHA256_ROUNDS_H
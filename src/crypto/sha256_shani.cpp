@@ -0,0 +1,94 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// SHA-256 with the Intel SHA extensions, after Intel's "Intel SHA
+// Extensions" white paper. Only called when CPUID reports SHA and SSE4.1.
+
+#ifndef ENABLE_SHANI
+#error "sha256_shani.cpp is only built into libbitcoin_crypto_shani, with ENABLE_SHANI defined"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+namespace
+{
+/** Four rounds on the message words m and round constants k. */
+inline void QuadRound(__m128i& state0, __m128i& state1, __m128i m, uint64_t k1, uint64_t k0)
+{
+    __m128i msg = _mm_add_epi32(m, _mm_set_epi64x(k1, k0));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+/** The next four message words from the previous sixteen, m0 the oldest. */
+inline __m128i Schedule(__m128i m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4));
+    return _mm_sha256msg2_epu32(t, m3);
+}
+
+/** Four big-endian message words. */
+inline __m128i Load(const unsigned char* in)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), mask);
+}
+} // namespace
+
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    // The instructions keep the state as ABEF and CDGH
+    __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(t, state1, 8);
+    state1 = _mm_blend_epi16(state1, t, 0xf0);
+
+    while (blocks--) {
+        __m128i save0 = state0, save1 = state1;
+        __m128i m0 = Load(chunk), m1 = Load(chunk + 16), m2 = Load(chunk + 32), m3 = Load(chunk + 48);
+
+        QuadRound(state0, state1, m0, 0xe9b5dba5b5c0fbcfull, 0x71374491428a2f98ull);
+        QuadRound(state0, state1, m1, 0xab1c5ed5923f82a4ull, 0x59f111f13956c25bull);
+        QuadRound(state0, state1, m2, 0x550c7dc3243185beull, 0x12835b01d807aa98ull);
+        QuadRound(state0, state1, m3, 0xc19bf1749bdc06a7ull, 0x80deb1fe72be5d74ull);
+        m0 = Schedule(m0, m1, m2, m3);
+        QuadRound(state0, state1, m0, 0x240ca1cc0fc19dc6ull, 0xefbe4786e49b69c1ull);
+        m1 = Schedule(m1, m2, m3, m0);
+        QuadRound(state0, state1, m1, 0x76f988da5cb0a9dcull, 0x4a7484aa2de92c6full);
+        m2 = Schedule(m2, m3, m0, m1);
+        QuadRound(state0, state1, m2, 0xbf597fc7b00327c8ull, 0xa831c66d983e5152ull);
+        m3 = Schedule(m3, m0, m1, m2);
+        QuadRound(state0, state1, m3, 0x1429296706ca6351ull, 0xd5a79147c6e00bf3ull);
+        m0 = Schedule(m0, m1, m2, m3);
+        QuadRound(state0, state1, m0, 0x53380d134d2c6dfcull, 0x2e1b213827b70a85ull);
+        m1 = Schedule(m1, m2, m3, m0);
+        QuadRound(state0, state1, m1, 0x92722c8581c2c92eull, 0x766a0abb650a7354ull);
+        m2 = Schedule(m2, m3, m0, m1);
+        QuadRound(state0, state1, m2, 0xc76c51a3c24b8b70ull, 0xa81a664ba2bfe8a1ull);
+        m3 = Schedule(m3, m0, m1, m2);
+        QuadRound(state0, state1, m3, 0x106aa070f40e3585ull, 0xd6990624d192e819ull);
+        m0 = Schedule(m0, m1, m2, m3);
+        QuadRound(state0, state1, m0, 0x34b0bcb52748774cull, 0x1e376c0819a4c116ull);
+        m1 = Schedule(m1, m2, m3, m0);
+        QuadRound(state0, state1, m1, 0x682e6ff35b9cca4full, 0x4ed8aa4a391c0cb3ull);
+        m2 = Schedule(m2, m3, m0, m1);
+        QuadRound(state0, state1, m2, 0x8cc7020884c87814ull, 0x78a5636f748f82eeull);
+        m3 = Schedule(m3, m0, m1, m2);
+        QuadRound(state0, state1, m3, 0xc67178f2bef9a3f7ull, 0xa4506ceb90befffaull);
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+        chunk += 64;
+    }
+
+    t = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t, state1, 0xf0));
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(state1, t, 8));
+}
+} // namespace sha256_shani
@@ -345,6 +345,12 @@ public:
         return setup(bytes/sizeof(Element));
     }
 
+    /** Memory allocated for the table and the collection and epoch flags, in bytes */
+    size_t memory_usage() const
+    {
+        return table.capacity() * sizeof(Element) + 2 * (((size_t)size + 7) / 8);
+    }
+
     /** insert loops at most depth_limit times trying to insert a hash
      * at various locations in the table via a variant of the Cuckoo Algorithm
      * with eight hash locations.
@@ -451,6 +457,21 @@ public:
             }
         return false;
     }
+
+    /** for_each calls f on every element that is not marked for garbage
+     * collection, for example to save them and insert them again later.
+     *
+     * Like insert, it must not run concurrently with insert.
+     *
+     * @param f called with each element
+     */
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (uint32_t i = 0; i < size; ++i)
+            if (!collection_flags.bit_is_set(i))
+                f(table[i]);
+    }
 };
 } // namespace CuckooCache
 
@@ -6,6 +6,8 @@
 
 #include "util.h"
 #include "random.h"
+#include "replication.h"
+#include "utilstrencodings.h"
 
 #include <boost/filesystem.hpp>
 
@@ -15,14 +17,71 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+size_t CDBOptions::GetWriteBufferSize(size_t nCacheSize) const
+{
+    if (nWriteBufferSize == 0 || nWriteBufferSize > nCacheSize / 2)
+        return nCacheSize / 4;
+    return nWriteBufferSize;
+}
+
+size_t CDBOptions::GetBlockCacheSize(size_t nCacheSize) const
+{
+    return nCacheSize - 2 * GetWriteBufferSize(nCacheSize);
+}
+
+bool CDBOptions::ParseArgs(const std::string& strName, std::string& strError)
+{
+    if (!mapMultiArgs.count("-dboption"))
+        return true;
+    const std::string strPrefix = strName + ".";
+    for (const std::string& strOption : mapMultiArgs.at("-dboption")) {
+        if (strOption.compare(0, strPrefix.size(), strPrefix) != 0)
+            continue;
+        size_t nEquals = strOption.find('=');
+        if (nEquals == std::string::npos) {
+            strError = strprintf("-dboption=%s: expected <db>.<key>=<value>", strOption);
+            return false;
+        }
+        const std::string strKey = strOption.substr(strPrefix.size(), nEquals - strPrefix.size());
+        int64_t nValue;
+        if (!ParseInt64(strOption.substr(nEquals + 1), &nValue) || nValue < 0) {
+            strError = strprintf("-dboption=%s: value must be a non-negative integer", strOption);
+            return false;
+        }
+        if (strKey == "writebuffer")
+            nWriteBufferSize = nValue << 20;
+        else if (strKey == "bloombits")
+            nBloomBitsPerKey = std::min<int64_t>(nValue, 64);
+        else if (strKey == "maxopenfiles")
+            nMaxOpenFiles = std::max<int64_t>(std::min<int64_t>(nValue, 1 << 20), 20);
+        else if (strKey == "compression")
+            fCompression = nValue != 0;
+        else {
+            strError = strprintf("-dboption=%s: unknown key %s", strOption, strKey);
+            return false;
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<leveldb::Cache> NewSharedBlockCache(size_t nSize)
+{
+    return std::shared_ptr<leveldb::Cache>(leveldb::NewLRUCache(nSize));
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBOptions& dbOptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    size_t nWriteBufferSize = dbOptions.GetWriteBufferSize(nCacheSize);
+    // up to two write buffers may be held in memory simultaneously, the rest is block cache
+    if (dbOptions.sharedBlockCache)
+        options.block_cache = dbOptions.sharedBlockCache.get();
+    else
+        options.block_cache = leveldb::NewLRUCache(dbOptions.GetBlockCacheSize(nCacheSize));
+    options.write_buffer_size = nWriteBufferSize;
+    options.filter_policy = dbOptions.nBloomBitsPerKey > 0 ? leveldb::NewBloomFilterPolicy(dbOptions.nBloomBitsPerKey) : NULL;
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +90,15 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBOptions& dbOptions) :
+    sharedBlockCache(dbOptions.sharedBlockCache), nReads(0), nBatches(0), nBatchBytes(0), nWriteMicros(0), nStalledWrites(0), nStallMicros(0), preplicationlog(NULL)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dbOptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -82,7 +142,8 @@ CDBWrapper::~CDBWrapper()
     pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
-    delete options.block_cache;
+    if (!sharedBlockCache)
+        delete options.block_cache;
     options.block_cache = NULL;
     delete penv;
     options.env = NULL;
@@ -90,11 +151,60 @@ CDBWrapper::~CDBWrapper()
 
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
+    if (preplicationlog && batch.SizeEstimate() > 0)
+        return preplicationlog->WriteBatch(*this, batch, fSync);
+    return WriteBatchUnlogged(batch, fSync);
+}
+
+bool CDBWrapper::WriteBatchUnlogged(CDBBatch& batch, bool fSync)
+{
+    int64_t nTimeStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    int64_t nTime = GetTimeMicros() - nTimeStart;
+    nBatches++;
+    nBatchBytes += batch.SizeEstimate();
+    nWriteMicros += nTime;
+    if (!fSync && nTime >= DB_WRITE_STALL_MICROS) {
+        nStalledWrites++;
+        nStallMicros += nTime;
+    }
     dbwrapper_private::HandleError(status);
     return true;
 }
 
+std::string CDBWrapper::GetProperty(const std::string& strName) const
+{
+    std::string strValue;
+    if (!pdb->GetProperty(strName, &strValue))
+        return std::string();
+    return strValue;
+}
+
+size_t CDBWrapper::GetBlockCacheUsage() const
+{
+    return options.block_cache->TotalCharge();
+}
+
+size_t CDBWrapper::GetWriteBufferUsage() const
+{
+    // The property counts the block cache in as well
+    int64_t nUsage = 0;
+    ParseInt64(GetProperty("leveldb.approximate-memory-usage"), &nUsage);
+    return std::max(nUsage - (int64_t)GetBlockCacheUsage(), (int64_t)0);
+}
+
+CDBStats CDBWrapper::GetStats() const
+{
+    CDBStats stats;
+    stats.nReads = nReads;
+    stats.nBatches = nBatches;
+    stats.nBatchBytes = nBatchBytes;
+    stats.nWriteMicros = nWriteMicros;
+    stats.nStalledWrites = nStalledWrites;
+    stats.nStallMicros = nStallMicros;
+    return stats;
+}
+
 // Prefixed with null character to avoid collisions with other keys
 //
 // We must use a string constructor which specifies length so that we copy
@@ -122,6 +232,15 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+CDBSnapshot::CDBSnapshot(const CDBWrapper &_parent) : parent(_parent), psnapshot(_parent.pdb->GetSnapshot())
+{
+}
+
+CDBSnapshot::~CDBSnapshot()
+{
+    parent.pdb->ReleaseSnapshot(psnapshot);
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
@@ -148,4 +267,23 @@ const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w)
     return w.obfuscate_key;
 }
 
+bool IsObfuscated(const CDBWrapper &w)
+{
+    for (unsigned char c : GetObfuscateKey(w))
+        if (c != 0)
+            return true;
+    return false;
+}
+
+void Xor(char* pch, size_t nSize, const std::vector<unsigned char>& key)
+{
+    if (key.empty())
+        return;
+    for (size_t i = 0, j = 0; i != nSize; i++) {
+        pch[i] ^= key[j++];
+        if (j == key.size())
+            j = 0;
+    }
+}
+
 };
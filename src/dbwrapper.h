@@ -12,6 +12,9 @@
 #include "utilstrencodings.h"
 #include "version.h"
 
+#include <atomic>
+#include <memory>
+
 #include <boost/filesystem/path.hpp>
 
 #include <leveldb/db.h>
@@ -28,6 +31,55 @@ public:
 
 class CDBWrapper;
 
+//! Writes taking at least this long, other than synced ones, are counted as stalled (us)
+static const int64_t DB_WRITE_STALL_MICROS = 1000;
+
+/** Operations done through a CDBWrapper since it was opened */
+struct CDBStats
+{
+    uint64_t nReads;
+    uint64_t nBatches;
+    uint64_t nBatchBytes;
+    uint64_t nWriteMicros;
+    //! Unsynced writes that took DB_WRITE_STALL_MICROS or more, which is
+    //! how LevelDB throttling writers behind compaction shows up
+    uint64_t nStalledWrites;
+    uint64_t nStallMicros;
+};
+
+/** LevelDB tuning of one database */
+struct CDBOptions
+{
+    //! Size of each write buffer; 0 uses a quarter of the cache size
+    size_t nWriteBufferSize;
+    //! Bloom filter bits per key, or 0 to disable the filter
+    int nBloomBitsPerKey;
+    //! Most table files LevelDB keeps open at once
+    int nMaxOpenFiles;
+    //! Snappy compress table blocks written from now on; only effective in builds with Snappy
+    bool fCompression;
+    //! Block cache shared with other databases, used instead of a private one
+    std::shared_ptr<leveldb::Cache> sharedBlockCache;
+
+    CDBOptions() : nWriteBufferSize(0), nBloomBitsPerKey(10), nMaxOpenFiles(64), fCompression(false) {}
+
+    /** Size of each write buffer for a database given nCacheSize */
+    size_t GetWriteBufferSize(size_t nCacheSize) const;
+
+    /** Block cache share of nCacheSize: all but the two write buffers that may be in memory at once */
+    size_t GetBlockCacheSize(size_t nCacheSize) const;
+
+    /**
+     * Apply the "-dboption=<strName>.<key>=<value>" arguments for database
+     * strName, where key is writebuffer (MiB), bloombits, maxopenfiles or
+     * compression. Returns false with strError on an unknown key or bad value.
+     */
+    bool ParseArgs(const std::string& strName, std::string& strError);
+};
+
+/** A LevelDB block cache that several databases can share through CDBOptions::sharedBlockCache */
+std::shared_ptr<leveldb::Cache> NewSharedBlockCache(size_t nSize);
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -42,12 +94,19 @@ void HandleError(const leveldb::Status& status);
  */
 const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
+/** Whether the obfuscation key of w changes anything */
+bool IsObfuscated(const CDBWrapper &w);
+
+/** Undo (or apply) the obfuscation of nSize bytes at pch in place, as CDataStream::Xor does */
+void Xor(char* pch, size_t nSize, const std::vector<unsigned char>& key);
+
 };
 
 /** Batch of changes queued to be written to a CDBWrapper */
 class CDBBatch
 {
     friend class CDBWrapper;
+    friend class CReplicationLog;
 
 private:
     const CDBWrapper &parent;
@@ -56,11 +115,19 @@ private:
     CDataStream ssKey;
     CDataStream ssValue;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -75,6 +142,13 @@ public:
         leveldb::Slice slValue(ssValue.data(), ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
         ssKey.clear();
         ssValue.clear();
     }
@@ -87,8 +161,28 @@ public:
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
         ssKey.clear();
     }
+
+    //! Put a key and value as they are stored, as a replica copies them from its primary
+    void WriteRaw(const std::string& strKey, const std::string& strValue)
+    {
+        batch.Put(strKey, strValue);
+        size_estimate += 3 + (strKey.size() > 127) + strKey.size() + (strValue.size() > 127) + strValue.size();
+    }
+
+    void EraseRaw(const std::string& strKey)
+    {
+        batch.Delete(strKey);
+        size_estimate += 2 + (strKey.size() > 127) + strKey.size();
+    }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -124,7 +218,7 @@ public:
     template<typename K> bool GetKey(K& key) {
         leveldb::Slice slKey = piter->key();
         try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            CSpanReader ssKey(SER_DISK, CLIENT_VERSION, (const unsigned char*)slKey.data(), slKey.size());
             ssKey >> key;
         } catch (const std::exception&) {
             return false;
@@ -139,8 +233,15 @@ public:
     template<typename V> bool GetValue(V& value) {
         leveldb::Slice slValue = piter->value();
         try {
-            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
+            if (!dbwrapper_private::IsObfuscated(parent)) {
+                // Read straight out of the table block the iterator points into
+                CSpanReader ssValue(SER_DISK, CLIENT_VERSION, (const unsigned char*)slValue.data(), slValue.size());
+                ssValue >> value;
+                return true;
+            }
+            std::string strValue(slValue.data(), slValue.size());
+            dbwrapper_private::Xor(&strValue[0], strValue.size(), dbwrapper_private::GetObfuscateKey(parent));
+            CSpanReader ssValue(SER_DISK, CLIENT_VERSION, (const unsigned char*)strValue.data(), strValue.size());
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -154,9 +255,33 @@ public:
 
 };
 
+/**
+ * The state of a CDBWrapper at the time this was created, kept for reads
+ * until it is destroyed. Iterators over it from several threads see the
+ * same data regardless of writes in between.
+ */
+class CDBSnapshot
+{
+private:
+    const CDBWrapper &parent;
+    const leveldb::Snapshot *psnapshot;
+
+    friend class CDBWrapper;
+
+public:
+    CDBSnapshot(const CDBWrapper &_parent);
+    ~CDBSnapshot();
+    CDBSnapshot(const CDBSnapshot&) = delete;
+    CDBSnapshot& operator=(const CDBSnapshot&) = delete;
+};
+
+class CReplicationLog;
+
 class CDBWrapper
 {
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
+    friend class CDBSnapshot;
+    friend class CReplicationLog;
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
@@ -164,6 +289,17 @@ private:
     //! database options used
     leveldb::Options options;
 
+    //! keeps options.block_cache alive when it is shared with other databases
+    std::shared_ptr<leveldb::Cache> sharedBlockCache;
+
+    //! operation counters reported by GetStats
+    mutable std::atomic<uint64_t> nReads;
+    std::atomic<uint64_t> nBatches;
+    std::atomic<uint64_t> nBatchBytes;
+    std::atomic<uint64_t> nWriteMicros;
+    std::atomic<uint64_t> nStalledWrites;
+    std::atomic<uint64_t> nStallMicros;
+
     //! options used when reading from the database
     leveldb::ReadOptions readoptions;
 
@@ -190,6 +326,12 @@ private:
 
     std::vector<unsigned char> CreateObfuscateKey() const;
 
+    //! the log every batch also goes to on a replication primary, and this database's name in it
+    CReplicationLog* preplicationlog;
+    std::string strReplicationName;
+
+    bool WriteBatchUnlogged(CDBBatch& batch, bool fSync);
+
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
@@ -198,20 +340,26 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] dbOptions   LevelDB tuning; with a shared block cache, nCacheSize only sizes the write buffers.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false,
+               const CDBOptions& dbOptions = CDBOptions());
     ~CDBWrapper();
 
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const
+    bool Read(const K& key, V& value, const CDBSnapshot* psnapshot = NULL) const
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
         ssKey << key;
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        if (psnapshot)
+            options.snapshot = psnapshot->psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        nReads.fetch_add(1, std::memory_order_relaxed);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -219,8 +367,9 @@ public:
             dbwrapper_private::HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(obfuscate_key);
+            // strValue is ours already: deobfuscate and read it in place
+            dbwrapper_private::Xor(&strValue[0], strValue.size(), obfuscate_key);
+            CSpanReader ssValue(SER_DISK, CLIENT_VERSION, (const unsigned char*)strValue.data(), strValue.size());
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -245,6 +394,7 @@ public:
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
         std::string strValue;
+        nReads.fetch_add(1, std::memory_order_relaxed);
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
@@ -265,6 +415,13 @@ public:
 
     bool WriteBatch(CDBBatch& batch, bool fSync = false);
 
+    //! Log every batch written from now on to plog under strName (see replication.h)
+    void SetReplicationLog(CReplicationLog* plog, const std::string& strName)
+    {
+        preplicationlog = plog;
+        strReplicationName = strName;
+    }
+
     // not available for LevelDB; provide for compatibility with BDB
     bool Flush()
     {
@@ -282,10 +439,48 @@ public:
         return new CDBIterator(*this, pdb->NewIterator(iteroptions));
     }
 
+    //! Iterate the database as it was when snapshot was taken
+    CDBIterator *NewIterator(const CDBSnapshot& snapshot) const
+    {
+        assert(&snapshot.parent == this);
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot.psnapshot;
+        return new CDBIterator(*this, pdb->NewIterator(options));
+    }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /** LevelDB property strName, such as leveldb.stats or leveldb.sstables; empty if unknown */
+    std::string GetProperty(const std::string& strName) const;
+
+    /** The block cache, which may be shared with other databases */
+    const leveldb::Cache* GetBlockCache() const { return options.block_cache; }
+    /** Memory taken by the block cache, counting in other databases' blocks if it is shared */
+    size_t GetBlockCacheUsage() const;
+    /** Memory taken by the write buffers (memtables) not yet written to table files */
+    size_t GetWriteBufferUsage() const;
+
+    /** Approximate file system space taken by the keys in [key_begin, key_end) */
+    template<typename K>
+    size_t EstimateSize(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(ssKey1.data(), ssKey1.size());
+        leveldb::Slice slKey2(ssKey2.data(), ssKey2.size());
+        uint64_t size = 0;
+        leveldb::Range range(slKey1, slKey2);
+        pdb->GetApproximateSizes(&range, 1, &size);
+        return size;
+    }
+
+    CDBStats GetStats() const;
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -169,7 +169,60 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
+/**
+ * A writer stream (for serialization) that computes a 256-bit hash of
+ * fixed-layout objects of at most N serialized bytes, such as block headers.
+ * The fields are copied into a buffer on the stack and hashed in one go,
+ * rather than passed to the hasher one by one.
+ */
+template<size_t N>
+class CFixedHashWriter
+{
+private:
+    unsigned char buf[N];
+    size_t nPos;
+
+    const int nType;
+    const int nVersion;
+public:
+
+    CFixedHashWriter(int nTypeIn, int nVersionIn) : nPos(0), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    void write(const char *pch, size_t size) {
+        if (size > N - nPos)
+            throw std::ios_base::failure("CFixedHashWriter::write(): object larger than the buffer");
+        memcpy(buf + nPos, pch, size);
+        nPos += size;
+    }
+
+    uint256 GetHash() const {
+        return Hash(buf, buf + nPos);
+    }
+
+    template<typename T>
+    CFixedHashWriter& operator<<(const T& obj) {
+        // Serialize to this stream
+        ::Serialize(*this, obj);
+        return (*this);
+    }
+};
+
+/** Compute the 256-bit hash of the serialization of an object of at most N bytes. */
+template<size_t N, typename T>
+uint256 SerializeHashFixed(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
+{
+    CFixedHashWriter<N> ss(nType, nVersion);
+    ss << obj;
+    return ss.GetHash();
+}
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pDataToHash, size_t nDataLen);
+/** MurmurHash3 of the same data under four seeds at once, as a bloom filter's hash functions need */
+void MurmurHash3x4(const uint32_t nHashSeeds[4], const unsigned char* pDataToHash, size_t nDataLen, uint32_t nHashesOut[4]);
 
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
@@ -206,5 +259,6 @@ public:
  *      .Finalize()
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
 
 #endif // BITCOIN_HASH_H
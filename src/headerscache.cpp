@@ -0,0 +1,119 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headerscache.h"
+
+#include "chain.h"
+#include "chainsnapshot.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "version.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+CHeadersCache headersCache;
+
+static void WriteHeader(const CBlockIndex* pindex, std::vector<unsigned char>& vData)
+{
+    // As a CBlock, so the empty transaction count and block signature go with it
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, vData, vData.size(), CBlock(pindex->GetBlockHeader()));
+}
+
+/** Size of one serialized header; the same for all of them, as none carries transactions or a signature */
+static size_t HeaderSize()
+{
+    static const size_t nSize = ::GetSerializeSize(CBlock(), SER_NETWORK, PROTOCOL_VERSION);
+    return nSize;
+}
+
+CHeadersCache::ChunkRef CHeadersCache::GetChunk(const CChainSnapshot& chain, int nChunk)
+{
+    const int nFirst = nChunk * HEADERS_CACHE_CHUNK_SIZE;
+    const int nLast = nFirst + HEADERS_CACHE_CHUNK_SIZE - 1;
+    assert(nLast <= chain.Height());
+
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        std::map<int, Chunk>::iterator it = mapChunks.find(nChunk);
+        if (it != mapChunks.end() && chain.Contains(it->second.pindexLast)) {
+            it->second.nLastUsed = ++nUseCounter;
+            return it->second.data;
+        }
+    }
+
+    // Serialize it without holding the lock; two threads may both do so, which is harmless
+    std::shared_ptr<std::vector<unsigned char> > data = std::make_shared<std::vector<unsigned char> >();
+    data->reserve(HEADERS_CACHE_CHUNK_SIZE * HeaderSize());
+    for (int nHeight = nFirst; nHeight <= nLast; nHeight++)
+        WriteHeader(chain[nHeight], *data);
+    assert(data->size() == HEADERS_CACHE_CHUNK_SIZE * HeaderSize());
+
+    std::lock_guard<std::mutex> lock(cs);
+    if (!mapChunks.count(nChunk) && mapChunks.size() >= MAX_HEADERS_CACHE_CHUNKS) {
+        std::map<int, Chunk>::iterator itOldest = mapChunks.begin();
+        for (std::map<int, Chunk>::iterator it = mapChunks.begin(); it != mapChunks.end(); ++it) {
+            if (it->second.nLastUsed < itOldest->second.nLastUsed)
+                itOldest = it;
+        }
+        mapChunks.erase(itOldest);
+    }
+    Chunk& chunk = mapChunks[nChunk];
+    chunk.pindexLast = chain[nLast];
+    chunk.data = data;
+    chunk.nLastUsed = ++nUseCounter;
+    return chunk.data;
+}
+
+const CBlockIndex* CHeadersCache::WriteHeaders(const CChainSnapshot& chain, const CBlockIndex* pindexStart, const CBlockIndex* pindexStop, int nLimit, std::vector<unsigned char>& vData)
+{
+    vData.clear();
+    CVectorWriter writer(SER_NETWORK, PROTOCOL_VERSION, vData, 0);
+    if (!pindexStart || nLimit <= 0) {
+        WriteCompactSize(writer, 0);
+        return NULL;
+    }
+    if (!chain.Contains(pindexStart)) {
+        WriteCompactSize(writer, 1);
+        WriteHeader(pindexStart, vData);
+        return pindexStart;
+    }
+
+    const int nStart = pindexStart->nHeight;
+    int nEnd = std::min(chain.Height(), nStart + nLimit - 1);
+    if (pindexStop && pindexStop->nHeight >= nStart && pindexStop->nHeight < nEnd && chain.Contains(pindexStop))
+        nEnd = pindexStop->nHeight;
+    WriteCompactSize(writer, nEnd - nStart + 1);
+    vData.reserve(vData.size() + (nEnd - nStart + 1) * HeaderSize());
+
+    for (int nHeight = nStart; nHeight <= nEnd; ) {
+        const int nChunk = nHeight / HEADERS_CACHE_CHUNK_SIZE;
+        const int nChunkFirst = nChunk * HEADERS_CACHE_CHUNK_SIZE;
+        const int nChunkLast = nChunkFirst + HEADERS_CACHE_CHUNK_SIZE - 1;
+        const int nTo = std::min(nEnd, nChunkLast);
+        if (nChunkLast <= chain.Height()) {
+            ChunkRef data = GetChunk(chain, nChunk);
+            vData.insert(vData.end(), data->begin() + (nHeight - nChunkFirst) * HeaderSize(), data->begin() + (nTo - nChunkFirst + 1) * HeaderSize());
+        } else {
+            // The part of the chain that does not fill a chunk yet
+            for (int n = nHeight; n <= nTo; n++)
+                WriteHeader(chain[n], vData);
+        }
+        nHeight = nTo + 1;
+    }
+    return chain[nEnd];
+}
+
+size_t CHeadersCache::GetChunkCount() const
+{
+    std::lock_guard<std::mutex> lock(cs);
+    return mapChunks.size();
+}
+
+void CHeadersCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(cs);
+    mapChunks.clear();
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HEADERSCACHE_H
+#define BITCOIN_HEADERSCACHE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+class CBlockIndex;
+class CChainSnapshot;
+
+/** Blocks of the active chain per chunk of the headers cache */
+static const int HEADERS_CACHE_CHUNK_SIZE = 2000;
+/** Most chunks the headers cache keeps, about 160 KiB each */
+static const size_t MAX_HEADERS_CACHE_CHUNKS = 64;
+
+/**
+ * The headers of the active chain as serialized in a headers message, in
+ * chunks of HEADERS_CACHE_CHUNK_SIZE blocks starting at a multiple of it.
+ *
+ * Syncing peers ask for the same stretches of the chain over and over, so
+ * rather than serializing up to MAX_HEADERS_RESULTS headers for each of
+ * them, the full chunks below the tip are serialized once and a reply is
+ * copied together from them. A chunk remembers its last block and is only
+ * used while that block is in the chain it is asked for, so a reorg makes
+ * the chunks above the fork stale without having to tell the cache. The
+ * chunks used least recently are dropped once there are too many of them.
+ */
+class CHeadersCache
+{
+public:
+    CHeadersCache() : nUseCounter(0) {}
+
+    /**
+     * Write the payload of a headers message to vData: the headers of chain
+     * from pindexStart on, at most nLimit of them, up to and including
+     * pindexStop if it is in the chain. A pindexStart that is not in the
+     * chain is sent on its own. Returns the last header written, NULL if none.
+     */
+    const CBlockIndex* WriteHeaders(const CChainSnapshot& chain, const CBlockIndex* pindexStart, const CBlockIndex* pindexStop, int nLimit, std::vector<unsigned char>& vData);
+
+    size_t GetChunkCount() const;
+    void Clear();
+
+private:
+    typedef std::shared_ptr<const std::vector<unsigned char> > ChunkRef;
+
+    struct Chunk
+    {
+        const CBlockIndex* pindexLast;
+        ChunkRef data;
+        uint64_t nLastUsed;
+    };
+
+    mutable std::mutex cs;
+    std::map<int, Chunk> mapChunks;
+    uint64_t nUseCounter;
+
+    //! Chunk nChunk of chain, which must be below its tip, from the cache or serialized anew
+    ChunkRef GetChunk(const CChainSnapshot& chain, int nChunk);
+};
+
+/** The headers cache getheaders is served from */
+extern CHeadersCache headersCache;
+
+#endif // BITCOIN_HEADERSCACHE_H
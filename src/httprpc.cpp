@@ -7,6 +7,8 @@
 #include "base58.h"
 #include "chainparams.h"
 #include "httpserver.h"
+#include "rpc/cbor.h"
+#include "rpc/jsonstream.h"
 #include "rpc/protocol.h"
 #include "rpc/server.h"
 #include "random.h"
@@ -83,6 +85,15 @@ static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const Uni
     req->WriteReply(nStatus, strReply);
 }
 
+/**
+ * Methods whose non-verbose result is a hex string of serialized data, which
+ * CBOR replies carry as a byte string instead.
+ */
+static bool IsRawDataMethod(const std::string& strMethod)
+{
+    return strMethod == "getblock" || strMethod == "getrawtransaction" || strMethod == "getblockheader";
+}
+
 //This function checks username and password against -rpcauth
 //entries from config file.
 static bool multiUserAuthorized(std::string strUserPass)
@@ -147,14 +158,9 @@ static bool RPCAuthorized(const std::string& strAuth, std::string& strAuthUserna
     return multiUserAuthorized(strUserPass);
 }
 
-static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
+/** Check the RPC credentials of req, replying HTTP_UNAUTHORIZED if they are missing or wrong */
+static bool HTTPReq_Authorized(HTTPRequest* req, std::string& strAuthUsernameOut)
 {
-    // JSONRPC handles only POST
-    if (req->GetRequestMethod() != HTTPRequest::POST) {
-        req->WriteReply(HTTP_BAD_METHOD, "JSONRPC server handles only POST requests");
-        return false;
-    }
-    // Check authorization
     std::pair<bool, std::string> authHeader = req->GetHeader("authorization");
     if (!authHeader.first) {
         req->WriteHeader("WWW-Authenticate", WWW_AUTH_HEADER_DATA);
@@ -162,8 +168,7 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         return false;
     }
 
-    JSONRPCRequest jreq;
-    if (!RPCAuthorized(authHeader.second, jreq.authUser)) {
+    if (!RPCAuthorized(authHeader.second, strAuthUsernameOut)) {
         LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", req->GetPeer().ToString());
 
         /* Deter brute-forcing
@@ -175,6 +180,20 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         req->WriteReply(HTTP_UNAUTHORIZED);
         return false;
     }
+    return true;
+}
+
+static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
+{
+    // JSONRPC handles only POST
+    if (req->GetRequestMethod() != HTTPRequest::POST) {
+        req->WriteReply(HTTP_BAD_METHOD, "JSONRPC server handles only POST requests");
+        return false;
+    }
+    // Check authorization
+    JSONRPCRequest jreq;
+    if (!HTTPReq_Authorized(req, jreq.authUser))
+        return false;
 
     try {
         // Parse request
@@ -192,17 +211,44 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
 
             UniValue result = tableRPC.execute(jreq);
 
-            // Send reply
-            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
+            std::pair<bool, std::string> accept = req->GetHeader("Accept");
+            if (accept.first && AcceptsCBOR(accept.second)) {
+                CBORWriter writer([req](const std::string& strData) { req->WriteReplyBody(strData); });
+                writer.BeginMap(3);
+                writer.Text("result");
+                writer.Value(result, IsRawDataMethod(jreq.strMethod));
+                writer.Text("error");
+                writer.Value(NullUniValue);
+                writer.Text("id");
+                writer.Value(jreq.id);
+                writer.Flush();
+                req->WriteHeader("Content-Type", "application/cbor");
+                req->WriteReply(HTTP_OK);
+                return true;
+            }
+
+            // Stream the reply into the reply buffer, rather than copying
+            // the result into a reply object and rendering that to a string
+            JSONStreamWriter writer([req](const std::string& strData) { req->WriteReplyBody(strData); });
+            writer.BeginObject();
+            writer.Key("result");
+            writer.Value(result);
+            writer.Key("error");
+            writer.Value(NullUniValue);
+            writer.Key("id");
+            writer.Value(jreq.id);
+            writer.EndObject();
+            writer.Flush();
+            strReply = "\n";
 
         // array of requests
         } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
+            strReply = JSONRPCExecBatch(valRequest.get_array(), QueueHTTPWork, GetArg("-rpcthreads", DEFAULT_HTTP_THREADS) - 1);
         else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strReply);
+        req->WriteReply(HTTP_OK, std::move(strReply));
     } catch (const UniValue& objError) {
         JSONErrorReply(req, objError, jreq.id);
         return false;
@@ -213,6 +259,72 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
     return true;
 }
 
+static void AppendMetric(std::string& strOut, const std::string& strName, const std::string& strType, const std::string& strHelp)
+{
+    strOut += "# HELP " + strName + " " + strHelp + "\n";
+    strOut += "# TYPE " + strName + " " + strType + "\n";
+}
+
+static std::string MicrosToSeconds(int64_t nMicros)
+{
+    return strprintf("%d.%06d", nMicros / 1000000, nMicros % 1000000);
+}
+
+/** Serve getrpcstats in the Prometheus text exposition format */
+static bool HTTPReq_Metrics(HTTPRequest* req, const std::string &)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BAD_METHOD, "Metrics are served to GET requests only");
+        return false;
+    }
+    std::string strAuthUser;
+    if (!HTTPReq_Authorized(req, strAuthUser))
+        return false;
+
+    const std::map<std::string, CRPCMethodStats> mapStats = GetRPCStats();
+    std::string strOut;
+
+    AppendMetric(strOut, "jbcoin_rpc_calls_total", "counter", "RPC calls per method");
+    for (const auto& entry : mapStats)
+        strOut += strprintf("jbcoin_rpc_calls_total{method=\"%s\"} %d\n", entry.first, entry.second.nCalls);
+    AppendMetric(strOut, "jbcoin_rpc_errors_total", "counter", "RPC calls per method that failed");
+    for (const auto& entry : mapStats)
+        strOut += strprintf("jbcoin_rpc_errors_total{method=\"%s\"} %d\n", entry.first, entry.second.nErrors);
+    AppendMetric(strOut, "jbcoin_rpc_cs_main_wait_seconds_total", "counter", "Time RPC calls spent blocked waiting for cs_main");
+    for (const auto& entry : mapStats)
+        strOut += strprintf("jbcoin_rpc_cs_main_wait_seconds_total{method=\"%s\"} %s\n", entry.first, MicrosToSeconds(entry.second.nLockWaitMicros));
+    AppendMetric(strOut, "jbcoin_rpc_duration_seconds", "histogram", "RPC call latency");
+    for (const auto& entry : mapStats) {
+        const CRPCMethodStats& stats = entry.second;
+        uint64_t nCumulative = 0;
+        for (size_t i = 0; i < RPC_LATENCY_BUCKET_COUNT; i++) {
+            nCumulative += stats.vBuckets[i];
+            std::string strBound = i + 1 < RPC_LATENCY_BUCKET_COUNT ? MicrosToSeconds(RPC_LATENCY_BUCKETS[i]) : "+Inf";
+            strOut += strprintf("jbcoin_rpc_duration_seconds_bucket{method=\"%s\",le=\"%s\"} %d\n", entry.first, strBound, nCumulative);
+        }
+        strOut += strprintf("jbcoin_rpc_duration_seconds_sum{method=\"%s\"} %s\n", entry.first, MicrosToSeconds(stats.nTotalMicros));
+        strOut += strprintf("jbcoin_rpc_duration_seconds_count{method=\"%s\"} %d\n", entry.first, stats.nCalls);
+    }
+
+    HTTPWorkQueueStats queueStats;
+    if (GetHTTPWorkQueueStats(queueStats)) {
+        AppendMetric(strOut, "jbcoin_http_workqueue_depth", "gauge", "HTTP requests waiting for a worker thread");
+        strOut += strprintf("jbcoin_http_workqueue_depth %d\n", queueStats.nDepth);
+        AppendMetric(strOut, "jbcoin_http_workqueue_max_depth", "gauge", "Depth at which HTTP requests are rejected");
+        strOut += strprintf("jbcoin_http_workqueue_max_depth %d\n", queueStats.nMaxDepth);
+        AppendMetric(strOut, "jbcoin_http_workqueue_high_water", "gauge", "Deepest the HTTP work queue has been");
+        strOut += strprintf("jbcoin_http_workqueue_high_water %d\n", queueStats.nHighWater);
+        AppendMetric(strOut, "jbcoin_http_workqueue_rejected_total", "counter", "HTTP requests rejected because the work queue was full");
+        strOut += strprintf("jbcoin_http_workqueue_rejected_total %d\n", queueStats.nRejected);
+        AppendMetric(strOut, "jbcoin_http_workqueue_threads", "gauge", "HTTP worker threads");
+        strOut += strprintf("jbcoin_http_workqueue_threads %d\n", queueStats.nThreads);
+    }
+
+    req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+    req->WriteReply(HTTP_OK, strOut);
+    return true;
+}
+
 static bool InitRPCAuthentication()
 {
     if (GetArg("-rpcpassword", "") == "")
@@ -238,6 +350,8 @@ bool StartHTTPRPC()
         return false;
 
     RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    if (GetBoolArg("-rpcmetrics", DEFAULT_RPC_METRICS))
+        RegisterHTTPHandler("/metrics", true, HTTPReq_Metrics);
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
@@ -254,6 +368,7 @@ void StopHTTPRPC()
 {
     LogPrint("rpc", "Stopping HTTP RPC server\n");
     UnregisterHTTPHandler("/", true);
+    UnregisterHTTPHandler("/metrics", true);
     if (httpRPCTimerInterface) {
         RPCUnsetTimerInterface(httpRPCTimerInterface);
         delete httpRPCTimerInterface;
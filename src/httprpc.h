@@ -10,6 +10,9 @@
 
 class HTTPRequest;
 
+/** Default for -rpcmetrics */
+static const bool DEFAULT_RPC_METRICS = false;
+
 /** Start HTTP RPC subsystem.
  * Precondition; HTTP and RPC has been started.
  */
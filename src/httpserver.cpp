@@ -10,6 +10,7 @@
 #include "netbase.h"
 #include "rpc/protocol.h" // For HTTP status codes
 #include "sync.h"
+#include "threadplacement.h"
 #include "ui_interface.h"
 
 #include <stdio.h>
@@ -20,6 +21,8 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <future>
+#include <map>
+#include <mutex>
 
 #include <event2/event.h>
 #include <event2/http.h>
@@ -35,27 +38,85 @@
 #endif
 #endif
 
+#include <boost/algorithm/string.hpp>
+
 /** Maximum size of http request (request line + headers) */
 static const size_t MAX_HEADERS_SIZE = 8192;
 
+//! Requests each client address has queued or running, for -rpcclientconcurrency
+static std::mutex csClientRequests;
+static std::map<CNetAddr, int> mapClientRequests;
+static int nClientConcurrency = DEFAULT_HTTP_CLIENT_CONCURRENCY;
+
+/** Count a request from client against its concurrency limit, or return false if it is at the limit */
+static bool AcquireClientSlot(const CNetAddr& client)
+{
+    std::lock_guard<std::mutex> lock(csClientRequests);
+    int& nRequests = mapClientRequests[client];
+    if (nRequests >= nClientConcurrency) {
+        if (nRequests == 0)
+            mapClientRequests.erase(client);
+        return false;
+    }
+    nRequests++;
+    return true;
+}
+
+static void ReleaseClientSlot(const CNetAddr& client)
+{
+    std::lock_guard<std::mutex> lock(csClientRequests);
+    std::map<CNetAddr, int>::iterator it = mapClientRequests.find(client);
+    if (it != mapClientRequests.end() && --it->second <= 0)
+        mapClientRequests.erase(it);
+}
+
 /** HTTP request work item */
 class HTTPWorkItem : public HTTPClosure
 {
 public:
     HTTPWorkItem(std::unique_ptr<HTTPRequest> _req, const std::string &_path, const HTTPRequestHandler& _func):
-        req(std::move(_req)), path(_path), func(_func)
+        req(std::move(_req)), path(_path), func(_func), fClientSlot(false)
     {
     }
+    ~HTTPWorkItem()
+    {
+        if (fClientSlot)
+            ReleaseClientSlot(client);
+    }
     void operator()()
     {
         func(req.get(), path);
     }
+    /** Hold a slot taken with AcquireClientSlot until the item is done */
+    void SetClientSlot(const CNetAddr& _client)
+    {
+        client = _client;
+        fClientSlot = true;
+    }
 
     std::unique_ptr<HTTPRequest> req;
 
 private:
     std::string path;
     HTTPRequestHandler func;
+    CNetAddr client;
+    bool fClientSlot;
+};
+
+/** Work item running an arbitrary function, see QueueHTTPWork() */
+class HTTPFunctionWorkItem : public HTTPClosure
+{
+public:
+    HTTPFunctionWorkItem(const std::function<void()>& _func): func(_func)
+    {
+    }
+    void operator()()
+    {
+        func();
+    }
+
+private:
+    std::function<void()> func;
 };
 
 /** Simple work queue for distributing work over multiple threads.
@@ -72,6 +133,10 @@ private:
     bool running;
     size_t maxDepth;
     int numThreads;
+    /** Deepest the queue has been */
+    size_t highWater;
+    /** Items turned away because the queue was full */
+    uint64_t rejected;
 
     /** RAII object to keep track of number of running worker threads */
     class ThreadCounter
@@ -94,7 +159,9 @@ private:
 public:
     WorkQueue(size_t _maxDepth) : running(true),
                                  maxDepth(_maxDepth),
-                                 numThreads(0)
+                                 numThreads(0),
+                                 highWater(0),
+                                 rejected(0)
     {
     }
     /** Precondition: worker threads have all stopped
@@ -103,14 +170,18 @@ public:
     ~WorkQueue()
     {
     }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    /** Enqueue a work item, keeping nHeadroom slots of the queue free */
+    bool Enqueue(WorkItem* item, size_t nHeadroom = 0)
     {
         std::unique_lock<std::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
+        if (queue.size() + nHeadroom >= maxDepth) {
+            // Only count requests turned away, not declined extra help
+            if (nHeadroom == 0)
+                rejected++;
             return false;
         }
         queue.emplace_back(std::unique_ptr<WorkItem>(item));
+        highWater = std::max(highWater, queue.size());
         cond.notify_one();
         return true;
     }
@@ -153,6 +224,20 @@ public:
         std::unique_lock<std::mutex> lock(cs);
         return queue.size();
     }
+    /** Return the maximum depth of the queue */
+    size_t MaxDepth() const
+    {
+        return maxDepth;
+    }
+    void GetStats(HTTPWorkQueueStats& stats)
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        stats.nDepth = queue.size();
+        stats.nMaxDepth = maxDepth;
+        stats.nHighWater = highWater;
+        stats.nRejected = rejected;
+        stats.nThreads = numThreads;
+    }
 };
 
 struct HTTPPathHandler
@@ -245,6 +330,42 @@ static std::string RequestMethodString(HTTPRequest::RequestMethod m)
     }
 }
 
+//! Requests served so far on each open connection, only used from the event loop thread
+static std::map<struct evhttp_connection*, int> mapConnectionRequests;
+static int nKeepAliveRequests = DEFAULT_HTTP_KEEPALIVE_REQUESTS;
+static int nServerTimeout = DEFAULT_HTTP_SERVER_TIMEOUT;
+
+static void http_connection_close_cb(struct evhttp_connection* evcon, void*)
+{
+    mapConnectionRequests.erase(evcon);
+}
+
+/**
+ * Tell the client whether its connection stays open after this request, so
+ * proxies can reuse it instead of reconnecting, and close it once it has
+ * served -rpckeepalive requests.
+ */
+static void HTTPKeepAlive(struct evhttp_request* req)
+{
+    struct evkeyvalq* headers = evhttp_request_get_output_headers(req);
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (!evcon || !headers)
+        return;
+
+    std::map<struct evhttp_connection*, int>::iterator it = mapConnectionRequests.find(evcon);
+    if (it == mapConnectionRequests.end()) {
+        it = mapConnectionRequests.insert(std::make_pair(evcon, 0)).first;
+        evhttp_connection_set_closecb(evcon, http_connection_close_cb, NULL);
+    }
+    int nServed = ++it->second;
+    if (nServed >= nKeepAliveRequests) {
+        evhttp_add_header(headers, "Connection", "close");
+        mapConnectionRequests.erase(it);
+    } else {
+        evhttp_add_header(headers, "Keep-Alive", strprintf("timeout=%d, max=%d", nServerTimeout, nKeepAliveRequests - nServed).c_str());
+    }
+}
+
 /** HTTP request callback */
 static void http_request_cb(struct evhttp_request* req, void* arg)
 {
@@ -282,9 +403,19 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
         }
     }
 
+    HTTPKeepAlive(req);
+
     // Dispatch to worker thread
     if (i != iend) {
+        CNetAddr client = hreq->GetPeer();
+        if (nClientConcurrency > 0 && !AcquireClientSlot(client)) {
+            LogPrint("http", "Rejecting request from %s, which already has %d requests in progress\n", client.ToString(), nClientConcurrency);
+            hreq->WriteReply(HTTP_SERVICE_UNAVAILABLE, "Too many concurrent requests from this client");
+            return;
+        }
         std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(std::move(hreq), path, i->handler));
+        if (nClientConcurrency > 0)
+            item->SetClientSlot(client);
         assert(workQueue);
         if (workQueue->Enqueue(item.get()))
             item.release(); /* if true, queue took ownership */
@@ -308,6 +439,7 @@ static void http_reject_request_cb(struct evhttp_request* req, void*)
 static bool ThreadHTTP(struct event_base* base, struct evhttp* http)
 {
     RenameThread("bitcoin-http");
+    PlaceThread("http");
     LogPrint("http", "Entering http event loop\n");
     event_base_dispatch(base);
     // Event loop will be interrupted by InterruptHTTPServer()
@@ -358,6 +490,7 @@ static bool HTTPBindAddresses(struct evhttp* http)
 static void HTTPWorkQueueRun(WorkQueue<HTTPClosure>* queue)
 {
     RenameThread("bitcoin-httpworker");
+    PlaceThread("http");
     queue->Run();
 }
 
@@ -419,7 +552,10 @@ bool InitHTTPServer()
         return false;
     }
 
-    evhttp_set_timeout(http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
+    nServerTimeout = GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT);
+    nKeepAliveRequests = std::max((int)GetArg("-rpckeepalive", DEFAULT_HTTP_KEEPALIVE_REQUESTS), 0);
+    nClientConcurrency = std::max((int)GetArg("-rpcclientconcurrency", DEFAULT_HTTP_CLIENT_CONCURRENCY), 0);
+    evhttp_set_timeout(http, nServerTimeout);
     evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
     evhttp_set_max_body_size(http, MAX_SIZE);
     evhttp_set_gencb(http, http_request_cb, NULL);
@@ -501,6 +637,7 @@ void StopHTTPServer()
         evhttp_free(eventHTTP);
         eventHTTP = 0;
     }
+    mapConnectionRequests.clear();
     if (eventBase) {
         event_base_free(eventBase);
         eventBase = 0;
@@ -513,6 +650,26 @@ struct event_base* EventBase()
     return eventBase;
 }
 
+bool QueueHTTPWork(const std::function<void()>& func)
+{
+    if (!workQueue)
+        return false;
+    // Keep half the queue for incoming requests
+    std::unique_ptr<HTTPFunctionWorkItem> item(new HTTPFunctionWorkItem(func));
+    if (!workQueue->Enqueue(item.get(), workQueue->MaxDepth() / 2))
+        return false;
+    item.release(); /* queue took ownership */
+    return true;
+}
+
+bool GetHTTPWorkQueueStats(HTTPWorkQueueStats& stats)
+{
+    if (!workQueue)
+        return false;
+    workQueue->GetStats(stats);
+    return true;
+}
+
 static void httpevent_callback_fn(evutil_socket_t, short, void* data)
 {
     // Static handler: simply call inner handler
@@ -564,6 +721,25 @@ std::pair<bool, std::string> HTTPRequest::GetHeader(const std::string& hdr)
         return std::make_pair(false, "");
 }
 
+bool HTTPRequest::CheckETag(const std::string& strETag)
+{
+    WriteHeader("ETag", strETag);
+    std::pair<bool, std::string> ifNoneMatch = GetHeader("If-None-Match");
+    if (!ifNoneMatch.first)
+        return false;
+    std::vector<std::string> vTags;
+    boost::split(vTags, ifNoneMatch.second, boost::is_any_of(","));
+    for (std::string& tag : vTags) {
+        boost::trim(tag);
+        // Weak comparison, as If-None-Match asks for
+        if (tag.compare(0, 2, "W/") == 0)
+            tag.erase(0, 2);
+        if (tag == "*" || tag == strETag)
+            return true;
+    }
+    return false;
+}
+
 std::string HTTPRequest::ReadBody()
 {
     struct evbuffer* buf = evhttp_request_get_input_buffer(req);
@@ -591,18 +767,76 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
     evhttp_add_header(headers, hdr.c_str(), value.c_str());
 }
 
+void HTTPRequest::WriteReplyBody(const std::string& strData)
+{
+    assert(!replySent && req);
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    evbuffer_add(evb, strData.data(), strData.size());
+}
+
+void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
+{
+    assert(!replySent && req);
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    evbuffer_add(evb, strReply.data(), strReply.size());
+    SendReply(nStatus);
+}
+
+/** evbuffer cleanup callbacks freeing what a reply passed by reference kept alive */
+static void http_reply_string_cleanup(const void*, size_t, void* arg)
+{
+    delete (std::string*)arg;
+}
+
+static void http_reply_shared_cleanup(const void*, size_t, void* arg)
+{
+    delete (std::shared_ptr<const std::string>*)arg;
+}
+
+void HTTPRequest::WriteReply(int nStatus, std::string&& strReply)
+{
+    assert(!replySent && req);
+    if (strReply.size() < HTTP_REPLY_REFERENCE_THRESHOLD) {
+        WriteReply(nStatus, static_cast<const std::string&>(strReply));
+        return;
+    }
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    std::string* pReply = new std::string(std::move(strReply));
+    if (evbuffer_add_reference(evb, pReply->data(), pReply->size(), http_reply_string_cleanup, pReply) != 0) {
+        evbuffer_add(evb, pReply->data(), pReply->size());
+        delete pReply;
+    }
+    SendReply(nStatus);
+}
+
+void HTTPRequest::WriteReply(int nStatus, const std::shared_ptr<const std::string>& pReply)
+{
+    assert(!replySent && req && pReply);
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    if (pReply->size() < HTTP_REPLY_REFERENCE_THRESHOLD) {
+        evbuffer_add(evb, pReply->data(), pReply->size());
+    } else {
+        std::shared_ptr<const std::string>* pRef = new std::shared_ptr<const std::string>(pReply);
+        if (evbuffer_add_reference(evb, pReply->data(), pReply->size(), http_reply_shared_cleanup, pRef) != 0) {
+            evbuffer_add(evb, pReply->data(), pReply->size());
+            delete pRef;
+        }
+    }
+    SendReply(nStatus);
+}
+
 /** Closure sent to main thread to request a reply to be sent to
  * a HTTP request.
  * Replies must be sent in the main loop in the main http thread,
  * this cannot be done from worker threads.
  */
-void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
+void HTTPRequest::SendReply(int nStatus)
 {
-    assert(!replySent && req);
     // Send event to main http thread to send reply message
-    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
-    assert(evb);
-    evbuffer_add(evb, strReply.data(), strReply.size());
     HTTPEvent* ev = new HTTPEvent(eventBase, true,
         std::bind(evhttp_send_reply, req, nStatus, (const char*)NULL, (struct evbuffer *)NULL));
     ev->trigger(0);
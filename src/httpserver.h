@@ -8,10 +8,17 @@
 #include <string>
 #include <stdint.h>
 #include <functional>
+#include <memory>
 
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+//! Requests served on one connection before it is closed, 0 to close after every request
+static const int DEFAULT_HTTP_KEEPALIVE_REQUESTS=1000;
+//! Requests one client address may have in the work queue or running at once, 0 for no limit
+static const int DEFAULT_HTTP_CLIENT_CONCURRENCY=0;
+//! Replies at least this large are handed to libevent by reference instead of being copied
+static const size_t HTTP_REPLY_REFERENCE_THRESHOLD = 16 * 1024;
 
 struct evhttp_request;
 struct event_base;
@@ -47,6 +54,26 @@ void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
  */
 struct event_base* EventBase();
 
+/** Queue a function to run on an HTTP worker thread, as extra help for a
+ * request being handled. Fails if that would fill more than half the work
+ * queue, so requests from other clients are not rejected.
+ */
+bool QueueHTTPWork(const std::function<void()>& func);
+
+/** Depth of the HTTP work queue since startup */
+struct HTTPWorkQueueStats
+{
+    size_t nDepth;
+    size_t nMaxDepth;
+    size_t nHighWater;
+    //! Requests turned away because the queue was full
+    uint64_t nRejected;
+    int nThreads;
+};
+
+/** Fill in the work queue statistics, or return false if the HTTP server is not running */
+bool GetHTTPWorkQueueStats(HTTPWorkQueueStats& stats);
+
 /** In-flight HTTP request.
  * Thin C++ wrapper around evhttp_request.
  */
@@ -56,6 +83,9 @@ private:
     struct evhttp_request* req;
     bool replySent;
 
+    /** Hand the request with its reply body back to the event loop thread */
+    void SendReply(int nStatus);
+
 public:
     HTTPRequest(struct evhttp_request* req);
     ~HTTPRequest();
@@ -101,15 +131,41 @@ public:
      */
     void WriteHeader(const std::string& hdr, const std::string& value);
 
+    /**
+     * Tag the reply with an entity tag, and return whether the client sent
+     * a matching If-None-Match, in which case it should get
+     * HTTP_NOT_MODIFIED instead of the body. strETag includes its quotes.
+     */
+    bool CheckETag(const std::string& strETag);
+
+    /**
+     * Append to the body of the reply, ahead of WriteReply. This lets a
+     * large body be produced in pieces rather than as one string.
+     */
+    void WriteReplyBody(const std::string& strData);
+
     /**
      * Write HTTP reply.
      * nStatus is the HTTP status code to send.
-     * strReply is the body of the reply. Keep it empty to send a standard message.
+     * strReply is the body of the reply, appended to anything passed to
+     * WriteReplyBody. Keep both empty to send a standard message.
      *
      * @note Can be called only once. As this will give the request back to the
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Write HTTP reply, taking over strReply. A large reply is handed to
+     * libevent without copying it.
+     */
+    void WriteReply(int nStatus, std::string&& strReply);
+
+    /**
+     * Write HTTP reply from a shared buffer, such as a cached response.
+     * libevent references it until it has been sent, without copying.
+     */
+    void WriteReply(int nStatus, const std::shared_ptr<const std::string>& pReply);
 };
 
 /** Event handler closure.
@@ -10,27 +10,39 @@
 #include "init.h"
 
 #include "addrman.h"
+#include "addresssubscription.h"
 #include "amount.h"
+#include "blockfilemap.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
+#include "crypto/scrypt.h"
+#include "crypto/aes.h"
+#include "crypto/sha256.h"
 #include "httpserver.h"
 #include "httprpc.h"
 #include "key.h"
 #include "validation.h"
 #include "miner.h"
 #include "netbase.h"
+#include "notifypipe.h"
 #include "net.h"
 #include "net_processing.h"
+#include "policy/fees.h"
 #include "policy/policy.h"
+#include "pos.h"
+#include "replication.h"
+#include "responsecache.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
 #include "script/standard.h"
 #include "script/sigcache.h"
 #include "scheduler.h"
+#include "threadplacement.h"
 #include "timedata.h"
+#include "txcache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "torcontrol.h"
@@ -44,6 +56,7 @@
 #include "warnings.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <future>
 #include <memory>
 
 #ifndef WIN32
@@ -51,6 +64,7 @@
 #endif
 
 #include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -65,9 +79,6 @@
 #include "zmq/zmqnotificationinterface.h"
 #endif
 
-#ifdef USE_SSE2
-#include "crypto/scrypt.h"
-#endif
 
 bool fFeeEstimatesInitialized = false;
 static const bool DEFAULT_PROXYRANDOMIZE = true;
@@ -100,6 +111,50 @@ enum BindFlags {
 };
 
 static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
+static const char* FEE_ESTIMATES_JOURNAL_FILENAME="fee_estimates.log";
+/** Seconds between appends of new blocks to the fee estimates journal */
+static const int64_t FEE_ESTIMATES_JOURNAL_INTERVAL = 15 * 60;
+
+/** Write all fee estimates, which makes the journal redundant */
+static void WriteFeeEstimates()
+{
+    boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
+    CAutoFile est_fileout(fopen(est_path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (est_fileout.IsNull()) {
+        LogPrintf("%s: Failed to write fee estimates to %s\n", __func__, est_path.string());
+        return;
+    }
+    if (mempool.WriteFeeEstimates(est_fileout)) {
+        FileCommit(est_fileout.Get());
+        est_fileout.fclose();
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetDataDir() / FEE_ESTIMATES_JOURNAL_FILENAME, ec);
+    }
+}
+
+/** Append the blocks seen since the last write to the fee estimates journal */
+static void CheckpointFeeEstimates()
+{
+    // The journal is only read on top of a full write
+    std::vector<CFeeEstimatorBlock> vBlocks;
+    if (boost::filesystem::exists(GetDataDir() / FEE_ESTIMATES_FILENAME) && mempool.TakeFeeEstimatesJournal(vBlocks)) {
+        if (vBlocks.empty())
+            return;
+        boost::filesystem::path journal_path = GetDataDir() / FEE_ESTIMATES_JOURNAL_FILENAME;
+        CAutoFile journal_fileout(fopen(journal_path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+        if (!journal_fileout.IsNull()) {
+            try {
+                journal_fileout << vBlocks;
+                FileCommit(journal_fileout.Get());
+                return;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Failed to append to %s: %s\n", __func__, journal_path.string(), e.what());
+            }
+        }
+    }
+    // Too many blocks to journal, or the blocks taken could not be appended
+    WriteFeeEstimates();
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -152,9 +207,9 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -168,7 +223,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static std::unique_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -212,19 +266,20 @@ void Shutdown()
     peerLogic.reset();
     g_connman.reset();
 
+    // Nothing is left to validate, so deliver the events still queued for
+    // the wallet and other listeners before they are flushed
+    GetMainSignals().FlushBackgroundCallbacks();
+
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
-    if (fDumpMempoolLater)
+    if (fDumpMempoolLater) {
         DumpMempool();
+        DumpSignatureCache();
+    }
 
     if (fFeeEstimatesInitialized)
     {
-        boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
-        CAutoFile est_fileout(fopen(est_path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
-        if (!est_fileout.IsNull())
-            mempool.WriteFeeEstimates(est_fileout);
-        else
-            LogPrintf("%s: Failed to write fee estimates to %s\n", __func__, est_path.string());
+        WriteFeeEstimates();
         fFeeEstimatesInitialized = false;
     }
 
@@ -232,15 +287,21 @@ void Shutdown()
         LOCK(cs_main);
         if (pcoinsTip != NULL) {
             FlushStateToDisk();
+            WriteBlockIndexSnapshot();
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
+        delete pcoinsprefetch;
+        pcoinsprefetch = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        delete pindexesdb;
+        pindexesdb = NULL;
+        StopReplicationLog();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -254,6 +315,7 @@ void Shutdown()
         pzmqNotificationInterface = NULL;
     }
 #endif
+    StopNotifyPipe();
 
 #ifndef WIN32
     try {
@@ -262,9 +324,12 @@ void Shutdown()
         LogPrintf("%s: Unable to remove pidfile: %s\n", __func__, e.what());
     }
 #endif
+    GetMainSignals().UnregisterBackgroundSignalScheduler();
     UnregisterAllValidationInterfaces();
 #ifdef ENABLE_WALLET
-    delete pwalletMain;
+    for (CWallet* pwallet : vpwallets)
+        delete pwallet;
+    vpwallets.clear();
     pwalletMain = NULL;
 #endif
     globalVerifyHandle.reset();
@@ -306,6 +371,7 @@ void OnRPCStopped()
     uiInterface.NotifyBlockTip.disconnect(&RPCNotifyBlockChange);
     RPCNotifyBlockChange(false, nullptr);
     cvBlockChange.notify_all();
+    addressSubscriptions.Interrupt();
     LogPrint("rpc", "RPC stopped.\n");
 }
 
@@ -316,6 +382,10 @@ void OnRPCPreCommand(const CRPCCommand& cmd)
     if (strWarning != "" && !GetBoolArg("-disablesafemode", DEFAULT_DISABLE_SAFEMODE) &&
         !cmd.okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, std::string("Safe mode: ") + strWarning);
+
+    // A replica's databases only change with its primary's
+    if (IsReplica() && !IsReplicaSafeCommand(cmd.name))
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("%s is not available on a read-only replica", cmd.name));
 }
 
 std::string HelpMessage(HelpMessageMode mode)
@@ -328,7 +398,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the chainstate to disk on a background thread when the coin cache is flushed; uses up to twice -dbcache while a write is in progress (default: %u)"), DEFAULT_ASYNC_FLUSH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
+    strUsage += HelpMessageOpt("-notifypipe=<cmd>", _("Start command once and write a line to its standard input for each event: \"block <hash>\" when the best block changes and \"wallettx <txid>\" when a wallet transaction changes"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
     strUsage +=HelpMessageOpt("-assumevalid=<hex>", strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s)"), Params(CBaseChainParams::MAIN).GetConsensus().defaultAssumeValid.GetHex(), Params(CBaseChainParams::TESTNET).GetConsensus().defaultAssumeValid.GetHex()));
@@ -341,27 +413,52 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    if (showDebug) {
+        strUsage += HelpMessageOpt("-dboption=<db>.<key>=<n>", "Tune LevelDB database <db> (chainstate, blockindex or indexes): writebuffer (MiB), bloombits, maxopenfiles or compression (0 or 1, needs a build with Snappy). Can be specified multiple times");
+        strUsage += HelpMessageOpt("-dbsharedcache", strprintf("Pool the LevelDB block caches of all databases, so each database's share of -dbcache serves whichever is read most (default: %u)", DEFAULT_DB_SHARED_CACHE));
+    }
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphantxsize=<n>", strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-mappedblockfiles=<n>", strprintf(_("Keep up to <n> block files memory mapped to serve block reads, 0 to disable (default: %u)"), DEFAULT_MAPPED_BLOCK_FILES));
+    strUsage += HelpMessageOpt("-txcachesize=<n>", strprintf(_("Keep up to <n> MiB of confirmed transactions recently read from block files in memory for transaction lookups, 0 to disable (default: %u)"), DEFAULT_TX_CACHE_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
+    strUsage += HelpMessageOpt("-blockreconstructionrecentblocks=<n>", strprintf(_("Recently connected or disconnected blocks whose transactions are kept in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_RECENT_BLOCKS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+#ifdef __linux__
+    strUsage += HelpMessageOpt("-threadaffinity=<class>:<cpus>", strprintf(_("Run the threads of a class (%s) only on the given CPUs, a list like 0-7,16 or node<n> for the CPUs of NUMA node n, whose memory the threads then prefer. Can be specified multiple times"),
+        boost::algorithm::join(GetThreadClasses(), ", ")));
+#endif
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
-    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex and -rescan. "
+    strUsage += HelpMessageOpt("-powverifythreads=<n>", strprintf(_("Set the number of threads checking the proof of work of the loaded block index in the background after startup, once per block (0 to skip, default: %d)"), DEFAULT_POW_VERIFY_THREADS));
+    strUsage += HelpMessageOpt("-prefetchthreads=<n>", strprintf(_("Set the number of threads looking up the inputs of received blocks ahead of connecting them (0 to disable, max %d, default: %d)"),
+        MAX_PREFETCH_THREADS, DEFAULT_PREFETCH_THREADS));
+    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex and -rescan, and turns off the default -txindex; staking still works. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-replicaof=<dir>", _("Run as a read-only replica of the node with data directory <dir>, serving RPC and REST from a copy of its databases that follows its -replicationlog, without connecting to peers or validating. Start from a copy of that data directory taken while the node was stopped"));
+    strUsage += HelpMessageOpt("-replicationlog=<n>", strprintf(_("Log every database write for -replicaof replicas, keeping about <n> MiB of the log (default: %u)"), DEFAULT_REPLICATION_LOG_SIZE));
+    strUsage += HelpMessageOpt("-schedulerthreads=<n>", strprintf(_("Set the number of threads running background tasks (1 to %d, default: %d)"), MAX_SCHEDULER_THREADS, DEFAULT_SCHEDULER_THREADS));
+    strUsage += HelpMessageOpt("-stakeweightwindow=<n>", strprintf(_("Number of proof-of-stake blocks the network stake weight is averaged over (default: %u)"), DEFAULT_STAKE_WEIGHT_WINDOW));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-compacttxindex", strprintf(_("Key the transaction index by 8 bytes of the txid and store block heights instead of file positions, for a smaller index at the cost of a disk read to confirm a lookup (default: %u)"), DEFAULT_COMPACT_TXINDEX));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Write a compact filter of the scripts each connected block pays and spends, letting wallet rescans skip blocks without reading them (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
+    strUsage += HelpMessageOpt("-compactundo", strprintf(_("Write the undo data of new blocks in a smaller columnar format that older versions cannot read; existing undo data stays readable either way (default: %u)"), DEFAULT_COMPACT_UNDO));
+    strUsage += HelpMessageOpt("-compactaddressindex", strprintf(_("Store the address and unspent indexes in a compact format without txids or standard scripts; converts an existing index once and cannot be undone without -reindex (default: %u)"), DEFAULT_COMPACT_ADDRESSINDEX));
+    strUsage += HelpMessageOpt("-addressindexthreads=<n>", strprintf(_("Set the number of threads sharing the address index lookups of a multi-address RPC call (default: %d)"), DEFAULT_ADDRESSINDEX_THREADS));
+    strUsage += HelpMessageOpt("-indexbuildthreads=<n>", strprintf(_("Set the number of threads reading blocks when -addressindex, -spentindex or -timestampindex is turned on for an existing chain (default: %d)"), DEFAULT_INDEXBUILD_THREADS));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -379,11 +476,14 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), DEFAULT_MAX_PEER_CONNECTIONS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXRECEIVEBUFFER));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), DEFAULT_MAXSENDBUFFER));
+    strUsage += HelpMessageOpt("-msghandthreads=<n>", strprintf(_("Number of threads to process peer messages on, each serving a share of the peers (1 to %d, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS));
     strUsage += HelpMessageOpt("-maxtimeadjustment", strprintf(_("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)"), DEFAULT_MAX_TIME_ADJUSTMENT));
+    strUsage += HelpMessageOpt("-merkleblockthreads=<n>", strprintf(_("Number of threads to read and filter blocks requested by SPV peers on, 0 to do it while holding the chain lock (default: %d)"), DEFAULT_MERKLEBLOCK_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Socket events mode, which must be one of: %s (default: %s)"), GetSocketEventsModes(), DEFAULT_SOCKETEVENTS));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), Params(CBaseChainParams::MAIN).GetDefaultPort(), Params(CBaseChainParams::TESTNET).GetDefaultPort()));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
@@ -405,6 +505,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-whitelistrelay", strprintf(_("Accept relayed transactions received from whitelisted peers even when not relaying transactions (default: %d)"), DEFAULT_WHITELISTRELAY));
     strUsage += HelpMessageOpt("-whitelistforcerelay", strprintf(_("Force relay of transactions from whitelisted peers even if they violate local relay policy (default: %d)"), DEFAULT_WHITELISTFORCERELAY));
     strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
+    strUsage += HelpMessageOpt("-maxuploadrate=<n>", strprintf(_("Limit outbound traffic to <n>*1000 bytes per second, sending new blocks first, then relayed transactions, then blocks to syncing peers, 0 = no limit (default: %u)"), DEFAULT_MAX_UPLOAD_RATE));
 
 #ifdef ENABLE_WALLET
     strUsage += CWallet::GetWalletHelpString(showDebug);
@@ -416,6 +517,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubhashtx=<address>", _("Enable publish hash transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubhashstake=<address>", _("Enable publish coinstake hash of new proof-of-stake tips in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubrawtxdelta=<address>", _("Enable publish raw transaction once per address it pays or spends in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubconnectstats=<address>", _("Enable publish the connection timings of each block connected in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubsequence=<address>", _("Enable publish mempool additions and removals with their mempool sequence in <address>"));
+    strUsage += HelpMessageOpt("-zmqqueuesize=<n>", strprintf(_("Maximum number of ZMQ messages waiting to be sent before new ones are dropped (default: %u)"), DEFAULT_ZMQ_QUEUE_SIZE));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
@@ -424,11 +530,13 @@ std::string HelpMessage(HelpMessageMode mode)
     {
         strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
         strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
+        strUsage += HelpMessageOpt("-checkblocksbackground", strprintf(_("Verify the -checkblocks blocks on a low priority thread after startup, up to level 2, resuming after the last block a previous run verified (default: %u)"), DEFAULT_CHECKBLOCKS_BACKGROUND));
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", DEFAULT_CHECKPOINTS_ENABLED));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", DEFAULT_DISABLE_SAFEMODE));
         strUsage += HelpMessageOpt("-testsafemode", strprintf("Force safe mode (default: %u)", DEFAULT_TESTSAFEMODE));
+        strUsage += HelpMessageOpt("-capturemessages=<file>", "Record every network message received to <file>, relative to the data directory, for bench_jbcoin -messages to replay");
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", "Randomly drop 1 of every <n> network messages");
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", "Randomly fuzz 1 of every <n> network messages");
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf("Stop running after importing blocks from disk (default: %u)", DEFAULT_STOPAFTERBLOCKIMPORT));
@@ -454,8 +562,9 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit sum of signature cache and script execution cache sizes to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
+        strUsage += HelpMessageOpt("-lockstats", strprintf("Record wait and hold times of every lock call site, reported by getlockstats (default: %u)", DEFAULT_LOCKSTATS));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for relaying, mining and transaction creation (default: %s)"),
         CURRENCY_UNIT, FormatMoney(DEFAULT_MIN_RELAY_TX_FEE)));
@@ -488,10 +597,17 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-blockmintxfee=<amt>", strprintf(_("Set lowest fee rate (in %s/kB) for transactions to be included in block creation. (default: %s)"), CURRENCY_UNIT, FormatMoney(DEFAULT_BLOCK_MIN_TX_FEE)));
     if (showDebug)
         strUsage += HelpMessageOpt("-blockversion=<n>", "Override block version to test forking scenarios");
+    strUsage += HelpMessageOpt("-genproclimit=<n>", strprintf(_("Set the number of threads the generate RPCs search for proof-of-work on, 0 = one per core (default: %d)"), DEFAULT_GENERATE_THREADS));
+#ifdef ENABLE_WALLET
+    strUsage += HelpMessageOpt("-stakethreads=<n>", strprintf(_("Set the number of threads searching for proof-of-stake kernels (default: %d)"), DEFAULT_STAKE_THREADS));
+    strUsage += HelpMessageOpt("-stakeforecast=<n>", strprintf(_("Search the next <n> seconds of stake timestamps in one pass on each new block and wait for the earliest kernel (default: %u)"), DEFAULT_STAKE_FORECAST));
+#endif
 
     strUsage += HelpMessageGroup(_("RPC server options:"));
     strUsage += HelpMessageOpt("-server", _("Accept command line and JSON-RPC commands"));
     strUsage += HelpMessageOpt("-rest", strprintf(_("Accept public REST requests (default: %u)"), DEFAULT_REST_ENABLE));
+    strUsage += HelpMessageOpt("-responsecachesize=<n>", strprintf(_("Keep up to <n> MiB of serialized blocks buried at least %d deep in memory for REST and RPC replies, 0 to disable (default: %u)"), RESPONSE_CACHE_MIN_DEPTH, DEFAULT_RESPONSE_CACHE_SIZE));
+    strUsage += HelpMessageOpt("-rpcmetrics", strprintf(_("Serve RPC call and work queue statistics in Prometheus format at /metrics, to clients with RPC credentials (default: %u)"), DEFAULT_RPC_METRICS));
     strUsage += HelpMessageOpt("-rpcbind=<addr>", _("Bind to given address to listen for JSON-RPC connections. Use [host]:port notation for IPv6. This option can be specified multiple times (default: bind to all interfaces)"));
     strUsage += HelpMessageOpt("-rpccookiefile=<loc>", _("Location of the auth cookie (default: data dir)"));
     strUsage += HelpMessageOpt("-rpcuser=<user>", _("Username for JSON-RPC connections"));
@@ -500,6 +616,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-rpcport=<port>", strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), BaseParams(CBaseChainParams::MAIN).RPCPort(), BaseParams(CBaseChainParams::TESTNET).RPCPort()));
     strUsage += HelpMessageOpt("-rpcallowip=<ip>", _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times"));
     strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_HTTP_THREADS));
+    strUsage += HelpMessageOpt("-rpckeepalive=<n>", strprintf(_("Close an RPC connection after it served <n> requests, 0 to close after each one (default: %d)"), DEFAULT_HTTP_KEEPALIVE_REQUESTS));
+    strUsage += HelpMessageOpt("-rpcclientconcurrency=<n>", strprintf(_("Reject RPC requests from a client address that already has <n> requests in progress, 0 for no limit (default: %d)"), DEFAULT_HTTP_CLIENT_CONCURRENCY));
     if (showDebug) {
         strUsage += HelpMessageOpt("-rpcworkqueue=<n>", strprintf("Set the depth of the work queue to service RPC calls (default: %d)", DEFAULT_HTTP_WORKQUEUE));
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
@@ -541,6 +659,14 @@ static void BlockNotifyCallback(bool initialSync, const CBlockIndex *pBlockIndex
     boost::thread t(runCommand, strCmd); // thread runs free
 }
 
+static void NotifyPipeBlockCallback(bool initialSync, const CBlockIndex *pBlockIndex)
+{
+    if (initialSync || !pBlockIndex)
+        return;
+
+    PushNotifyPipe("block " + pBlockIndex->GetBlockHash().GetHex());
+}
+
 static bool fHaveGenesis = false;
 static boost::mutex cs_GenesisWait;
 static CConditionVariable condvar_GenesisWait;
@@ -556,6 +682,37 @@ static void BlockNotifyGenesisWait(bool, const CBlockIndex *pBlockIndex)
     }
 }
 
+static CCriticalSection cs_initStages;
+static std::vector<std::pair<std::string, int64_t> > vInitStageTimes;
+
+static void RecordInitStage(const std::string& strName, int64_t nMillis)
+{
+    LogPrintf(" %-11s %15dms\n", strName, nMillis);
+    LOCK(cs_initStages);
+    vInitStageTimes.push_back(std::make_pair(strName, nMillis));
+}
+
+std::vector<std::pair<std::string, int64_t> > GetInitStageTimes()
+{
+    LOCK(cs_initStages);
+    return vInitStageTimes;
+}
+
+/**
+ * Run a startup stage that does not depend on the ones running meanwhile on
+ * a thread of its own. The caller waits on the future before it needs the
+ * stage's result; it throws whatever the stage threw.
+ */
+static std::future<void> StartInitStage(const std::string& strName, std::function<void()> func)
+{
+    return std::async(std::launch::async, [strName, func] {
+        RenameThread(("jbcoin-init-" + strName).c_str());
+        int64_t nStart = GetTimeMillis();
+        func();
+        RecordInitStage(strName, GetTimeMillis() - nStart);
+    });
+}
+
 struct CImportingNow
 {
     CImportingNow() {
@@ -622,18 +779,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 
     // -reindex
     if (fReindex) {
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
-        }
+        ReindexBlockFiles(chainparams);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -678,7 +824,9 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         StartShutdown();
     }
     } // End scope of CImportingNow
+    int64_t nStart = GetTimeMillis();
     LoadMempool();
+    RecordInitStage("mempool", GetTimeMillis() - nStart);
     fDumpMempoolLater = !fRequestShutdown;
 }
 
@@ -703,6 +851,8 @@ bool AppInitServers(boost::thread_group& threadGroup)
     RPCServer::OnStarted(&OnRPCStarted);
     RPCServer::OnStopped(&OnRPCStopped);
     RPCServer::OnPreCommand(&OnRPCPreCommand);
+    responseCache.SetMaxSize(std::max<int64_t>(0, GetArg("-responsecachesize", DEFAULT_RESPONSE_CACHE_SIZE)) << 20);
+    txCache.SetMaxSize(std::max<int64_t>(0, GetArg("-txcachesize", DEFAULT_TX_CACHE_SIZE)) << 20);
     if (!InitHTTPServer())
         return false;
     if (!StartRPC())
@@ -767,6 +917,16 @@ void InitParameterInteraction()
             LogPrintf("%s: parameter interaction: -externalip set -> setting -discover=0\n", __func__);
     }
 
+    // a replica only follows its primary's databases
+    if (IsArgSet("-replicaof")) {
+        if (SoftSetBoolArg("-listen", false))
+            LogPrintf("%s: parameter interaction: -replicaof set -> setting -listen=0\n", __func__);
+        if (SoftSetBoolArg("-disablewallet", true))
+            LogPrintf("%s: parameter interaction: -replicaof set -> setting -disablewallet=1\n", __func__);
+        if (SoftSetArg("-prefetchthreads", "0"))
+            LogPrintf("%s: parameter interaction: -replicaof set -> setting -prefetchthreads=0\n", __func__);
+    }
+
     // disable whitelistrelay in blocksonly mode
     if (GetBoolArg("-blocksonly", DEFAULT_BLOCKSONLY)) {
         if (SoftSetBoolArg("-whitelistrelay", false))
@@ -803,6 +963,7 @@ int nMaxConnections;
 int nUserMaxConnections;
 int nFD;
 ServiceFlags nLocalServices = NODE_NETWORK;
+SocketEventsMode socketEventsMode = SOCKETEVENTS_SELECT;
 
 }
 
@@ -884,12 +1045,30 @@ bool AppInitParameterInteraction()
 
     // also see: InitParameterInteraction()
 
-    // if using block pruning, then disallow txindex
+    // if using block pruning, then disallow txindex. Staking reads kernel
+    // inputs and coin age from the UTXO set, so it does not need it.
     if (GetArg("-prune", 0)) {
+        if (SoftSetBoolArg("-txindex", false))
+            LogPrintf("%s: parameter interaction: -prune set -> setting -txindex=0\n", __func__);
         if (GetBoolArg("-txindex", DEFAULT_TXINDEX))
             return InitError(_("Prune mode is incompatible with -txindex."));
     }
 
+    if (IsArgSet("-replicaof")) {
+        boost::filesystem::path pathPrimary(GetArg("-replicaof", ""));
+        if (!boost::filesystem::is_directory(pathPrimary / "blocks"))
+            return InitError(strprintf(_("-replicaof directory %s is not a data directory"), pathPrimary.string()));
+        if (GetArg("-prune", 0) || GetBoolArg("-reindex", false) || GetBoolArg("-reindex-chainstate", false))
+            return InitError(_("A -replicaof replica cannot prune or reindex; its primary does that."));
+        if (GetArg("-replicationlog", DEFAULT_REPLICATION_LOG_SIZE) > 0)
+            return InitError(_("A -replicaof replica cannot write a -replicationlog of its own."));
+#ifdef ENABLE_WALLET
+        if (!GetBoolArg("-disablewallet", DEFAULT_DISABLE_WALLET))
+            return InitError(_("A -replicaof replica cannot load a wallet."));
+#endif
+        InitReplica(pathPrimary);
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max(
                 (mapMultiArgs.count("-bind") ? mapMultiArgs.at("-bind").size() : 0) +
@@ -897,8 +1076,13 @@ bool AppInitParameterInteraction()
     nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
+    std::string strSocketEventsMode = GetArg("-socketevents", DEFAULT_SOCKETEVENTS);
+    if (!ParseSocketEventsMode(strSocketEventsMode, socketEventsMode))
+        return InitError(strprintf(_("Invalid -socketevents ('%s') specified. Only these modes are supported: %s"), strSocketEventsMode, GetSocketEventsModes()));
+
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS)), 0);
+    if (socketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS)), 0);
     nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + MAX_ADDNODE_CONNECTIONS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -974,6 +1158,14 @@ bool AppInitParameterInteraction()
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    std::string strPlacementError;
+    if (!InitThreadPlacement(mapMultiArgs.count("-threadaffinity") ? mapMultiArgs.at("-threadaffinity") : std::vector<std::string>(), strPlacementError))
+        return InitError(strprintf(_("Invalid -threadaffinity: %s"), strPlacementError));
+
+    stakeWeightWindow.SetWindow(GetArg("-stakeweightwindow", DEFAULT_STAKE_WEIGHT_WINDOW));
+    blockFileMap.SetMaxFiles(std::max<int64_t>(0, GetArg("-mappedblockfiles", DEFAULT_MAPPED_BLOCK_FILES)));
+    fCompactUndo = GetBoolArg("-compactundo", DEFAULT_COMPACT_UNDO);
+
     // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
     int64_t nPruneArg = GetArg("-prune", 0);
     if (nPruneArg < 0) {
@@ -1050,6 +1242,7 @@ bool AppInitParameterInteraction()
 #endif
 
     fIsBareMultisigStd = GetBoolArg("-permitbaremultisig", DEFAULT_PERMIT_BAREMULTISIG);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
     fAcceptDatacarrier = GetBoolArg("-datacarrier", DEFAULT_ACCEPT_DATACARRIER);
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
 
@@ -1066,6 +1259,7 @@ bool AppInitParameterInteraction()
         return InitError("unknown rpcserialversion requested.");
 
     nMaxTipAge = GetArg("-maxtipage", DEFAULT_MAX_TIP_AGE);
+    fLockStats = GetBoolArg("-lockstats", DEFAULT_LOCKSTATS);
 
     fEnableReplacement = GetBoolArg("-mempoolreplacement", DEFAULT_ENABLE_REPLACEMENT);
     if ((!fEnableReplacement) && IsArgSet("-mempoolreplacement")) {
@@ -1140,6 +1334,12 @@ bool AppInitSanityChecks()
 {
     // ********************************************************* Step 4: sanity checks
 
+    // Select the SHA256 implementation before any other thread hashes
+    std::string sha256_algo = SHA256AutoDetect();
+    LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
+    std::string aes_algo = AESAutoDetect();
+    LogPrintf("Using the '%s' AES implementation\n", aes_algo);
+
     // Initialize elliptic curve code
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
@@ -1184,6 +1384,8 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i automatic connections (%i file descriptors available)\n", nMaxConnections, nFD);
 
     InitSignatureCache();
+    LoadSignatureCache();
+    InitScriptExecutionCache();
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
@@ -1191,9 +1393,12 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
-    // Start the lightweight task scheduler thread
+    // Start the lightweight task scheduler threads
+    int nSchedulerThreads = std::max(1, std::min<int>(GetArg("-schedulerthreads", DEFAULT_SCHEDULER_THREADS), MAX_SCHEDULER_THREADS));
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
-    threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+    for (int i = 0; i < nSchedulerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+    GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
 
     /* Start the RPC server already.  It will be started in "warmup" mode
      * and not really process calls already (but it will signify connections
@@ -1213,6 +1418,7 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     std::string sse2detect = scrypt_detect_sse2();
     LogPrintf("%s\n", sse2detect);
 #endif
+    LogPrintf("%s\n", scrypt_detect_avx2());
 
     // ********************************************************* Step 5: verify wallet database integrity
 #ifdef ENABLE_WALLET
@@ -1232,6 +1438,8 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     peerLogic.reset(new PeerLogicValidation(&connman));
     RegisterValidationInterface(peerLogic.get());
     RegisterNodeSignals(GetNodeSignals());
+    if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
+        StartMerkleBlockThreads(threadGroup, std::max(0, (int)GetArg("-merkleblockthreads", DEFAULT_MERKLEBLOCK_THREADS)));
 
     // sanitize comments per BIP-0014, format user agent and check total size
     std::vector<std::string> uacomments;
@@ -1367,6 +1575,11 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         RegisterValidationInterface(pzmqNotificationInterface);
     }
 #endif
+
+    // Started before the wallet loads so transactions found by a rescan are reported too
+    if (IsArgSet("-notifypipe") && !StartNotifyPipe(GetArg("-notifypipe", "")))
+        return InitError(strprintf(_("Unable to start -notifypipe command %s"), GetArg("-notifypipe", "")));
+
     uint64_t nMaxOutboundLimit = 0; //unlimited unless -maxuploadtarget is set
     uint64_t nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
 
@@ -1376,6 +1589,22 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // ********************************************************* Step 7: load block chain
 
+    // Stages that need no chain state run while the block index loads
+    std::future<void> feeEstimatesStage = StartInitStage("feeestimates", [] {
+        boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
+        CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        // Allowed to fail as this file IS missing on first startup.
+        if (!est_filein.IsNull() && mempool.ReadFeeEstimates(est_filein)) {
+            CAutoFile journal_filein(fopen((GetDataDir() / FEE_ESTIMATES_JOURNAL_FILENAME).string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+            if (!journal_filein.IsNull())
+                mempool.ReadFeeEstimatesJournal(journal_filein);
+        }
+    });
+    std::future<void> addressesStage = StartInitStage("addresses", [] { g_connman->LoadAddresses(); });
+#ifdef ENABLE_WALLET
+    std::future<void> walletStage = StartInitStage("walletfile", &CWallet::PreloadWallet);
+#endif
+
     fReindex = GetBoolArg("-reindex", false);
     bool fReindexChainState = GetBoolArg("-reindex-chainstate", false);
 
@@ -1411,25 +1640,63 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
     int64_t nBlockTreeDBCache = nTotalCache / 8;
-    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) || GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
-        // enable 3/4 of the cache if addressindex and/or spentindex is enabled
-        nBlockTreeDBCache = nTotalCache * 3 / 4;
+    nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
+    int64_t nIndexesDBCache = nTotalCache / 8;
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) || GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) || GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX)) {
+        // give the explorer indexes 5/8 of the cache if any of them is enabled
+        nIndexesDBCache = nTotalCache * 5 / 8;
     } else {
-        nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
+        nIndexesDBCache = std::min(nIndexesDBCache, nMaxIndexesDBCache << 20);
+    }
+    int64_t nAddressIndexCache = 0;
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+        // an eighth of that goes to whole address index runs kept in memory
+        nAddressIndexCache = nIndexesDBCache / 8;
     }
-
-    
     nTotalCache -= nBlockTreeDBCache;
+    nTotalCache -= nIndexesDBCache;
+    nIndexesDBCache -= nAddressIndexCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
+    int nPrefetchThreads = std::max(0, std::min((int)GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS), MAX_PREFETCH_THREADS));
+    int64_t nCoinsPrefetchCache = 0;
+    if (nPrefetchThreads > 0) {
+        nCoinsPrefetchCache = std::min(nTotalCache / 8, nMaxCoinsPrefetchCache << 20);
+        nTotalCache -= nCoinsPrefetchCache;
+    }
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for explorer indexes database\n", nIndexesDBCache * (1.0 / 1024 / 1024));
+    if (nAddressIndexCache > 0)
+        LogPrintf("* Using %.1fMiB for address index lookup cache\n", nAddressIndexCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
+    if (nCoinsPrefetchCache > 0)
+        LogPrintf("* Using %.1fMiB for block inputs looked up ahead\n", nCoinsPrefetchCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set (plus up to %.1fMiB of unused mempool space)\n", nCoinCacheUsage * (1.0 / 1024 / 1024), nMempoolSizeMax * (1.0 / 1024 / 1024));
 
+    CDBOptions blockTreeDBOptions, indexesDBOptions = CIndexesDB::DefaultOptions(nIndexesDBCache), coinsDBOptions;
+    std::string strDBOptionError;
+    if (!blockTreeDBOptions.ParseArgs("blockindex", strDBOptionError) ||
+        !indexesDBOptions.ParseArgs("indexes", strDBOptionError) ||
+        !coinsDBOptions.ParseArgs("chainstate", strDBOptionError))
+        return InitError(strDBOptionError);
+#ifndef USE_SNAPPY
+    if (blockTreeDBOptions.fCompression || indexesDBOptions.fCompression || coinsDBOptions.fCompression)
+        InitWarning(_("Database compression was requested, but this build has no Snappy support; data is stored uncompressed"));
+#endif
+    if (GetBoolArg("-dbsharedcache", DEFAULT_DB_SHARED_CACHE)) {
+        // Each database puts its block cache share into one pool
+        size_t nSharedBlockCache = blockTreeDBOptions.GetBlockCacheSize(nBlockTreeDBCache) +
+                                   indexesDBOptions.GetBlockCacheSize(nIndexesDBCache) +
+                                   coinsDBOptions.GetBlockCacheSize(nCoinDBCache);
+        std::shared_ptr<leveldb::Cache> sharedBlockCache = NewSharedBlockCache(nSharedBlockCache);
+        blockTreeDBOptions.sharedBlockCache = indexesDBOptions.sharedBlockCache = coinsDBOptions.sharedBlockCache = sharedBlockCache;
+        LogPrintf("* Using %.1fMiB of those as a shared database block cache\n", nSharedBlockCache * (1.0 / 1024 / 1024));
+    }
+
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
@@ -1442,14 +1709,34 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsprefetch;
+                pcoinsprefetch = NULL;
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete pindexesdb;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, blockTreeDBOptions);
+                pindexesdb = new CIndexesDB(nIndexesDBCache, false, fReindex, nAddressIndexCache, indexesDBOptions);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState, coinsDBOptions);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                if (nPrefetchThreads > 0) {
+                    pcoinsprefetch = new CCoinsViewPrefetch(pcoinscatcher, nCoinsPrefetchCache);
+                    pcoinsTip = new CCoinsViewCache(pcoinsprefetch);
+                } else {
+                    pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                }
+
+                // Chainstates written by older versions keep one record per transaction
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                if (!fReindex && !pindexesdb->MigrateFromBlockTree(*pblocktree)) {
+                    strLoadError = _("Error moving the explorer indexes to their own database");
+                    break;
+                }
 
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
@@ -1479,6 +1766,26 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                     strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -txindex");
                     break;
                 }
+                if (fTxIndex && fCompactTxIndex != GetBoolArg("-compacttxindex", DEFAULT_COMPACT_TXINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -compacttxindex");
+                    break;
+                }
+
+                // Explorer indexes turned on for an existing chain are built in the background
+                if (!fReindex && !PrepareIndexBuild(GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX), GetBoolArg("-spentindex", DEFAULT_SPENTINDEX), GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX))) {
+                    strLoadError = _("Error preparing the background build of the explorer indexes");
+                    break;
+                }
+
+                if (!pindexesdb->UpgradeAddressIndex(GetBoolArg("-compactaddressindex", DEFAULT_COMPACT_ADDRESSINDEX))) {
+                    strLoadError = _("Error converting the address index to the compact format");
+                    break;
+                }
+
+                if (fAddressIndex && !pindexesdb->BuildAddressBalances()) {
+                    strLoadError = _("Error building the address balances");
+                    break;
+                }
 
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
@@ -1487,6 +1794,14 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                // A loadtxoutset that did not finish leaves coins without a matching best block
+                bool fSnapshotLoad = false;
+                pblocktree->ReadFlag("utxosnapshotload", fSnapshotLoad);
+                if (fSnapshotLoad) {
+                    strLoadError = _("Loading a UTXO snapshot was interrupted. You need to rebuild the database using -reindex");
+                    break;
+                }
+
                 if (!fReindex && chainActive.Tip() != NULL) {
                     uiInterface.InitMessage(_("Rewinding blocks..."));
                     if (!RewindBlockIndex(chainparams)) {
@@ -1513,11 +1828,14 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                     }
                 }
 
-                if (!CVerifyDB().VerifyDB(chainparams, pcoinsdbview, GetArg("-checklevel", DEFAULT_CHECKLEVEL),
+                int64_t nVerifyStart = GetTimeMillis();
+                if (!GetBoolArg("-checkblocksbackground", DEFAULT_CHECKBLOCKS_BACKGROUND) &&
+                    !CVerifyDB().VerifyDB(chainparams, pcoinsdbview, GetArg("-checklevel", DEFAULT_CHECKLEVEL),
                               GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+                RecordInitStage("verifydb", GetTimeMillis() - nVerifyStart);
             } catch (const std::exception& e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -1555,19 +1873,25 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         LogPrintf("Shutdown requested. Exiting.\n");
         return false;
     }
-    LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
+    RecordInitStage("block index", GetTimeMillis() - nStart);
 
-    boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
-    CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
-    // Allowed to fail as this file IS missing on first startup.
-    if (!est_filein.IsNull())
-        mempool.ReadFeeEstimates(est_filein);
+    if (IsReplica() && chainActive.Tip() == NULL)
+        return InitError(_("A -replicaof replica needs a copy of its primary's data directory to start from."));
+    int64_t nReplicationLog = GetArg("-replicationlog", DEFAULT_REPLICATION_LOG_SIZE);
+    if (nReplicationLog > 0 && !StartReplicationLog(nReplicationLog << 20))
+        return InitError(_("Unable to start the replication log"));
+
+    feeEstimatesStage.get();
     fFeeEstimatesInitialized = true;
+    scheduler.scheduleEvery(&CheckpointFeeEstimates, FEE_ESTIMATES_JOURNAL_INTERVAL, CScheduler::PRIORITY_LOW, "CheckpointFeeEstimates");
 
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
+    walletStage.get();
+    nStart = GetTimeMillis();
     if (!CWallet::InitLoadWallet())
         return false;
+    RecordInitStage("wallet", GetTimeMillis() - nStart);
 #else
     LogPrintf("No wallet support compiled in!\n");
 #endif
@@ -1612,6 +1936,8 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     if (IsArgSet("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
+    if (IsArgSet("-notifypipe"))
+        uiInterface.NotifyBlockTip.connect(NotifyPipeBlockCallback);
 
     std::vector<boost::filesystem::path> vImportFiles;
     if (mapMultiArgs.count("-loadblock"))
@@ -1620,7 +1946,24 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
 
-    threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (IsReplica()) {
+        // Everything a replica has comes through its primary's log
+        threadGroup.create_thread(&ThreadReplicaFollow);
+    } else {
+        if (GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH)) {
+            LOCK(cs_main);
+            pcoinsdbview->SetQueueWrites(true);
+            threadGroup.create_thread(&ThreadCoinsWriter);
+        }
+        if (pcoinsprefetch) {
+            for (int i = 0; i < nPrefetchThreads; i++)
+                threadGroup.create_thread(&ThreadCoinsPrefetch);
+        }
+        threadGroup.create_thread(&ThreadIndexWriter);
+        threadGroup.create_thread(&ThreadIndexBuilder);
+        threadGroup.create_thread(&ThreadPoWVerifier);
+        threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    }
 
     // Wait for genesis block to be processed
     {
@@ -1631,6 +1974,9 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         uiInterface.NotifyBlockTip.disconnect(BlockNotifyGenesisWait);
     }
 
+    if (GetBoolArg("-checkblocksbackground", DEFAULT_CHECKBLOCKS_BACKGROUND) && !fReindex && !IsReplica())
+        threadGroup.create_thread(boost::bind(&ThreadVerifyDB, boost::cref(chainparams), (int)GetArg("-checklevel", DEFAULT_CHECKLEVEL), (int)GetArg("-checkblocks", DEFAULT_CHECKBLOCKS)));
+
     // ********************************************************* Step 11: start node
 
     //// debug print
@@ -1656,20 +2002,39 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     connOptions.uiInterface = &uiInterface;
     connOptions.nSendBufferMaxSize = 1000*GetArg("-maxsendbuffer", DEFAULT_MAXSENDBUFFER);
     connOptions.nReceiveFloodSize = 1000*GetArg("-maxreceivebuffer", DEFAULT_MAXRECEIVEBUFFER);
+    connOptions.nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS);
+    connOptions.socketEventsMode = socketEventsMode;
+    if (IsArgSet("-capturemessages")) {
+        boost::filesystem::path pathCapture(GetArg("-capturemessages", ""));
+        if (!pathCapture.is_complete())
+            pathCapture = GetDataDir() / pathCapture;
+        connOptions.strCaptureFile = pathCapture.string();
+    }
 
     connOptions.nMaxOutboundTimeframe = nMaxOutboundTimeframe;
     connOptions.nMaxOutboundLimit = nMaxOutboundLimit;
+    connOptions.nMaxUploadRate = 1000 * std::max((int64_t)0, GetArg("-maxuploadrate", DEFAULT_MAX_UPLOAD_RATE));
 
-    if (!connman.Start(scheduler, strNodeError, connOptions))
+    addressesStage.get();
+    if (IsReplica())
+        LogPrintf("Read-only replica of %s, not connecting to peers\n", GetReplicaPrimaryDir().string());
+    else if (!connman.Start(scheduler, strNodeError, connOptions))
         return InitError(strNodeError);
 #ifdef ENABLE_WALLET
     // Mine proof-of-stake blocks in the background
     
     if (!GetBoolArg("-staking", !GetBoolArg("-server", false)))
         LogPrintf("Staking disabled\n");
-    else if (pwalletMain) { 
-        LogPrintf("Staking enabled.\n");
-    	threadGroup.create_thread(boost::bind(&ThreadStakeMiner, pwalletMain, chainparams));
+    else if (!vpwallets.empty()) {
+        LogPrintf("Staking enabled for %u wallets.\n", vpwallets.size());
+        threadGroup.create_thread(boost::bind(&ThreadStakeMiner, vpwallets, chainparams));
+    }
+
+    // Keep the staking outputs in shape
+    int64_t nStakeMaintenance = GetArg("-stakemaintenance", DEFAULT_STAKE_MAINTENANCE);
+    if (nStakeMaintenance > 0) {
+        for (CWallet* pwallet : vpwallets)
+            scheduler.scheduleEvery(boost::bind(&CWallet::MaintainStakeOutputs, pwallet, &connman), nStakeMaintenance * 60, CScheduler::PRIORITY_LOW, "MaintainStakeOutputs");
     }
 
 #endif
@@ -1679,8 +2044,8 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     uiInterface.InitMessage(_("Done loading"));
 
 #ifdef ENABLE_WALLET
-    if (pwalletMain)
-        pwalletMain->postInitProcess(threadGroup);
+    for (CWallet* pwallet : vpwallets)
+        pwallet->postInitProcess(threadGroup);
 #endif
     // exit(0);
     return !fRequestShutdown;
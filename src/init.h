@@ -6,7 +6,10 @@
 #ifndef BITCOIN_INIT_H
 #define BITCOIN_INIT_H
 
+#include <stdint.h>
 #include <string>
+#include <utility>
+#include <vector>
 
 class CScheduler;
 class CWallet;
@@ -50,6 +53,9 @@ bool AppInitSanityChecks();
  */
 bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler);
 
+/** How long each startup stage took (ms), in the order they finished */
+std::vector<std::pair<std::string, int64_t> > GetInitStageTimes();
+
 /** The help message mode determines what help message to show */
 enum HelpMessageMode {
     HMM_BITCOIND,
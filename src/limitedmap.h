@@ -6,95 +6,206 @@
 #define BITCOIN_LIMITEDMAP_H
 
 #include <assert.h>
-#include <map>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
 
-/** STL-like map container that only keeps the N elements with the highest value. */
-template <typename K, typename V>
+/**
+ * STL-like map container that only keeps the N elements with the highest value.
+ *
+ * Entries live in a pool of nodes, linked in order of value (entries of equal
+ * value newest first) so the lowest is the one to drop, and are found through
+ * an open-addressed table of node indexes with linear probing. Values are
+ * typically times that only grow, so inserting and updating link at the end
+ * of the list in constant time. Iteration is in order of value, and iterators
+ * stay valid until their own entry is erased or dropped.
+ */
+template <typename K, typename V, typename Hasher = std::hash<K> >
 class limitedmap
 {
 public:
     typedef K key_type;
     typedef V mapped_type;
     typedef std::pair<const key_type, mapped_type> value_type;
-    typedef typename std::map<K, V>::const_iterator const_iterator;
-    typedef typename std::map<K, V>::size_type size_type;
-
-protected:
-    std::map<K, V> map;
-    typedef typename std::map<K, V>::iterator iterator;
-    std::multimap<V, iterator> rmap;
-    typedef typename std::multimap<V, iterator>::iterator rmap_iterator;
+    typedef size_t size_type;
+
+private:
+    static const uint32_t NONE = (uint32_t)-1;
+
+    struct Node {
+        std::pair<key_type, mapped_type> item;
+        uint32_t nPrev;
+        //! Next by value, or next free node
+        uint32_t nNext;
+    };
+
+    std::vector<Node> vNodes;
+    //! Node index of each table slot, or NONE
+    std::vector<uint32_t> vSlots;
+    uint32_t nHead;
+    uint32_t nTail;
+    uint32_t nFree;
+    size_type nSize;
     size_type nMaxSize;
+    Hasher hasher;
+
+    size_t SlotOf(const key_type& k) const { return hasher(k) & (vSlots.size() - 1); }
+
+    /** The slot holding k, or the empty slot that ends its probe sequence */
+    size_t FindSlot(const key_type& k) const
+    {
+        size_t nSlot = SlotOf(k);
+        while (vSlots[nSlot] != NONE && !(vNodes[vSlots[nSlot]].item.first == k))
+            nSlot = (nSlot + 1) & (vSlots.size() - 1);
+        return nSlot;
+    }
+
+    /** Empty a slot, moving later entries of its probe sequence back so no tombstone is needed */
+    void EraseSlot(size_t nSlot)
+    {
+        size_t nMask = vSlots.size() - 1;
+        size_t nNext = nSlot;
+        while (true) {
+            nNext = (nNext + 1) & nMask;
+            if (vSlots[nNext] == NONE)
+                break;
+            // An entry can move back to nSlot unless its home slot lies cyclically in (nSlot, nNext]
+            size_t nHome = SlotOf(vNodes[vSlots[nNext]].item.first);
+            if (((nNext - nHome) & nMask) >= ((nNext - nSlot) & nMask)) {
+                vSlots[nSlot] = vSlots[nNext];
+                nSlot = nNext;
+            }
+        }
+        vSlots[nSlot] = NONE;
+    }
+
+    /** Keep the table at most half full */
+    void Reserve(size_type nEntries)
+    {
+        if (nEntries * 2 <= vSlots.size())
+            return;
+        size_t nSlots = vSlots.empty() ? 16 : vSlots.size();
+        while (nEntries * 2 > nSlots)
+            nSlots *= 2;
+        vSlots.assign(nSlots, NONE);
+        for (uint32_t n = nHead; n != NONE; n = vNodes[n].nNext)
+            vSlots[FindSlot(vNodes[n].item.first)] = n;
+    }
+
+    void Unlink(uint32_t n)
+    {
+        Node& node = vNodes[n];
+        (node.nPrev == NONE ? nHead : vNodes[node.nPrev].nNext) = node.nNext;
+        (node.nNext == NONE ? nTail : vNodes[node.nNext].nPrev) = node.nPrev;
+    }
+
+    /** Link n after the entries of higher value, searching from the end of the list */
+    void LinkByValue(uint32_t n)
+    {
+        Node& node = vNodes[n];
+        uint32_t nAfter = nTail;
+        while (nAfter != NONE && !(vNodes[nAfter].item.second < node.item.second))
+            nAfter = vNodes[nAfter].nPrev;
+        node.nPrev = nAfter;
+        node.nNext = nAfter == NONE ? nHead : vNodes[nAfter].nNext;
+        (node.nPrev == NONE ? nHead : vNodes[node.nPrev].nNext) = n;
+        (node.nNext == NONE ? nTail : vNodes[node.nNext].nPrev) = n;
+    }
+
+    void EraseNode(uint32_t n)
+    {
+        EraseSlot(FindSlot(vNodes[n].item.first));
+        Unlink(n);
+        vNodes[n].nNext = nFree;
+        nFree = n;
+        nSize--;
+    }
 
 public:
-    limitedmap(size_type nMaxSizeIn)
+    class const_iterator
+    {
+        const limitedmap* pmap;
+        uint32_t n;
+        friend class limitedmap;
+
+    public:
+        const_iterator(const limitedmap* pmapIn, uint32_t nIn) : pmap(pmapIn), n(nIn) {}
+        const std::pair<key_type, mapped_type>& operator*() const { return pmap->vNodes[n].item; }
+        const std::pair<key_type, mapped_type>* operator->() const { return &pmap->vNodes[n].item; }
+        const_iterator& operator++() { n = pmap->vNodes[n].nNext; return *this; }
+        const_iterator operator++(int) { const_iterator ret = *this; ++*this; return ret; }
+        bool operator==(const const_iterator& other) const { return n == other.n; }
+        bool operator!=(const const_iterator& other) const { return n != other.n; }
+    };
+
+    limitedmap(size_type nMaxSizeIn) : nHead(NONE), nTail(NONE), nFree(NONE), nSize(0)
     {
         assert(nMaxSizeIn > 0);
         nMaxSize = nMaxSizeIn;
     }
-    const_iterator begin() const { return map.begin(); }
-    const_iterator end() const { return map.end(); }
-    size_type size() const { return map.size(); }
-    bool empty() const { return map.empty(); }
-    const_iterator find(const key_type& k) const { return map.find(k); }
-    size_type count(const key_type& k) const { return map.count(k); }
+    const_iterator begin() const { return const_iterator(this, nHead); }
+    const_iterator end() const { return const_iterator(this, NONE); }
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    const_iterator find(const key_type& k) const
+    {
+        if (nSize == 0)
+            return end();
+        return const_iterator(this, vSlots[FindSlot(k)]);
+    }
+    size_type count(const key_type& k) const { return find(k) != end() ? 1 : 0; }
     void insert(const value_type& x)
     {
-        std::pair<iterator, bool> ret = map.insert(x);
-        if (ret.second) {
-            if (map.size() > nMaxSize) {
-                map.erase(rmap.begin()->second);
-                rmap.erase(rmap.begin());
-            }
-            rmap.insert(make_pair(x.second, ret.first));
+        Reserve(nSize + 1);
+        size_t nSlot = FindSlot(x.first);
+        if (vSlots[nSlot] != NONE)
+            return;
+        uint32_t n;
+        if (nFree != NONE) {
+            n = nFree;
+            nFree = vNodes[n].nNext;
+            vNodes[n].item = x;
+        } else {
+            n = vNodes.size();
+            vNodes.push_back(Node{x, NONE, NONE});
         }
+        vSlots[nSlot] = n;
+        nSize++;
+        // The lowest entry is dropped before linking, so a new entry is kept even if lower
+        if (nSize > nMaxSize)
+            EraseNode(nHead);
+        LinkByValue(n);
     }
     void erase(const key_type& k)
     {
-        iterator itTarget = map.find(k);
-        if (itTarget == map.end())
+        if (nSize == 0)
             return;
-        std::pair<rmap_iterator, rmap_iterator> itPair = rmap.equal_range(itTarget->second);
-        for (rmap_iterator it = itPair.first; it != itPair.second; ++it)
-            if (it->second == itTarget) {
-                rmap.erase(it);
-                map.erase(itTarget);
-                return;
-            }
-        // Shouldn't ever get here
-        assert(0);
+        uint32_t n = vSlots[FindSlot(k)];
+        if (n != NONE)
+            EraseNode(n);
     }
     void update(const_iterator itIn, const mapped_type& v)
     {
-        // Using map::erase() with empty range instead of map::find() to get a non-const iterator,
-        // since it is a constant time operation in C++11. For more details, see
-        // https://stackoverflow.com/questions/765148/how-to-remove-constness-of-const-iterator
-        iterator itTarget = map.erase(itIn, itIn);
-        
-        if (itTarget == map.end())
+        if (itIn == end())
             return;
-        std::pair<rmap_iterator, rmap_iterator> itPair = rmap.equal_range(itTarget->second);
-        for (rmap_iterator it = itPair.first; it != itPair.second; ++it)
-            if (it->second == itTarget) {
-                rmap.erase(it);
-                itTarget->second = v;
-                rmap.insert(make_pair(v, itTarget));
-                return;
-            }
-        // Shouldn't ever get here
-        assert(0);
+        Unlink(itIn.n);
+        vNodes[itIn.n].item.second = v;
+        LinkByValue(itIn.n);
     }
     size_type max_size() const { return nMaxSize; }
     size_type max_size(size_type s)
     {
         assert(s > 0);
-        while (map.size() > s) {
-            map.erase(rmap.begin()->second);
-            rmap.erase(rmap.begin());
-        }
+        while (nSize > s)
+            EraseNode(nHead);
         nMaxSize = s;
         return nMaxSize;
     }
 };
 
+template <typename K, typename V, typename Hasher>
+const uint32_t limitedmap<K, V, Hasher>::NONE;
+
 #endif // BITCOIN_LIMITEDMAP_H
@@ -7,32 +7,45 @@
 
 #include "hash.h"
 #include "consensus/consensus.h"
+#include "consensus/merkle.h"
+#include "sync.h"
 #include "utilstrencodings.h"
 
+#include <list>
+#include <map>
+
+//! Blocks whose merkle levels GetBlockMerkleLevels keeps
+static const size_t MERKLE_LEVELS_CACHE_SIZE = 100;
+
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
+{
+    std::vector<uint256> vHashes;
+    vHashes.reserve(block.vtx.size());
+    for (const CTransactionRef& tx : block.vtx)
+        vHashes.push_back(tx->GetHash());
+    *this = CMerkleBlock(block, filter, ComputeMerkleLevels(vHashes));
+}
+
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<std::vector<uint256> >& vLevels)
 {
     header = block.GetBlockHeader();
 
     std::vector<bool> vMatch;
-    std::vector<uint256> vHashes;
-
     vMatch.reserve(block.vtx.size());
-    vHashes.reserve(block.vtx.size());
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const uint256& hash = block.vtx[i]->GetHash();
-        if (filter.IsRelevantAndUpdate(*block.vtx[i]))
+        if (filter.IsRelevantAndUpdate(*GetBloomTxElements(*block.vtx[i])))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(std::make_pair(i, hash));
         }
         else
             vMatch.push_back(false);
-        vHashes.push_back(hash);
     }
 
-    txn = CPartialMerkleTree(vHashes, vMatch);
+    txn = CPartialMerkleTree(vLevels, vMatch);
 }
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
@@ -58,24 +71,7 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
-uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid) {
-    if (height == 0) {
-        // hash at height 0 is the txids themself
-        return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height-1, pos*2, vTxid), right;
-        // calculate right hash if not beyond the end of the array - copy left hash otherwise1
-        if (pos*2+1 < CalcTreeWidth(height-1))
-            right = CalcHash(height-1, pos*2+1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
-    }
-}
-
-void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<std::vector<uint256> > &vLevels, const std::vector<bool> &vMatch) {
     // determine whether this node is the parent of at least one matched txid
     bool fParentOfMatch = false;
     for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
@@ -84,12 +80,12 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     vBits.push_back(fParentOfMatch);
     if (height==0 || !fParentOfMatch) {
         // if at height 0, or nothing interesting below, store hash and stop
-        vHash.push_back(CalcHash(height, pos, vTxid));
+        vHash.push_back(vLevels[height][pos]);
     } else {
         // otherwise, don't store any hash, but descend into the subtrees
-        TraverseAndBuild(height-1, pos*2, vTxid, vMatch);
+        TraverseAndBuild(height-1, pos*2, vLevels, vMatch);
         if (pos*2+1 < CalcTreeWidth(height-1))
-            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch);
+            TraverseAndBuild(height-1, pos*2+1, vLevels, vMatch);
     }
 }
 
@@ -131,7 +127,11 @@ uint256 CPartialMerkleTree::TraverseAndExtract(int height, unsigned int pos, uns
     }
 }
 
-CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) : nTransactions(vTxid.size()), fBad(false) {
+// hash all levels of the tree at once, rather than each node on the way down
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) :
+    CPartialMerkleTree(ComputeMerkleLevels(vTxid), vMatch) {}
+
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<std::vector<uint256> > &vLevels, const std::vector<bool> &vMatch) : nTransactions(vLevels[0].size()), fBad(false) {
     // reset state
     vBits.clear();
     vHash.clear();
@@ -142,7 +142,7 @@ CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const
         nHeight++;
 
     // traverse the partial tree
-    TraverseAndBuild(nHeight, 0, vTxid, vMatch);
+    TraverseAndBuild(nHeight, 0, vLevels, vMatch);
 }
 
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
@@ -179,3 +179,58 @@ uint256 CPartialMerkleTree::ExtractMatches(std::vector<uint256> &vMatch, std::ve
         return uint256();
     return hashMerkleRoot;
 }
+
+namespace {
+
+/** Least recently used merkle levels, by block hash */
+class CMerkleLevelsCache
+{
+private:
+    typedef std::list<std::pair<uint256, MerkleLevelsRef> > EntryList;
+
+    CCriticalSection cs;
+    //! Most recently used first
+    EntryList lru;
+    std::map<uint256, EntryList::iterator> mapEntries;
+
+public:
+    MerkleLevelsRef Get(const CBlock& block)
+    {
+        const uint256 hash = block.GetHash();
+        {
+            LOCK(cs);
+            auto it = mapEntries.find(hash);
+            if (it != mapEntries.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->second;
+            }
+        }
+
+        // Hash outside the lock; two threads hashing the same block is harmless
+        std::vector<uint256> vHashes;
+        vHashes.reserve(block.vtx.size());
+        for (const CTransactionRef& tx : block.vtx)
+            vHashes.push_back(tx->GetHash());
+        MerkleLevelsRef levels = std::make_shared<const std::vector<std::vector<uint256> > >(ComputeMerkleLevels(vHashes));
+
+        LOCK(cs);
+        if (mapEntries.count(hash))
+            return levels;
+        lru.push_front(std::make_pair(hash, levels));
+        mapEntries.emplace(hash, lru.begin());
+        while (lru.size() > MERKLE_LEVELS_CACHE_SIZE) {
+            mapEntries.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return levels;
+    }
+};
+
+CMerkleLevelsCache merkleLevelsCache;
+
+} // anon namespace
+
+MerkleLevelsRef GetBlockMerkleLevels(const CBlock& block)
+{
+    return merkleLevelsCache.Get(block);
+}
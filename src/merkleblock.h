@@ -11,6 +11,7 @@
 #include "primitives/block.h"
 #include "bloom.h"
 
+#include <memory>
 #include <vector>
 
 /** Data structure that represents a partial merkle tree.
@@ -67,11 +68,11 @@ protected:
         return (nTransactions+(1 << height)-1) >> height;
     }
 
-    /** calculate the hash of a node in the merkle tree (at leaf level: the txid's themselves) */
-    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
-
-    /** recursive function that traverses tree nodes, storing the data as bits and hashes */
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    /**
+     * recursive function that traverses tree nodes, storing the data as bits and hashes.
+     * vLevels holds the hashes of every level of the tree, from ComputeMerkleLevels.
+     */
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<std::vector<uint256> > &vLevels, const std::vector<bool> &vMatch);
 
     /**
      * recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
@@ -107,6 +108,9 @@ public:
     /** Construct a partial merkle tree from a list of transaction ids, and a mask that selects a subset of them */
     CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    /** Same, from every level of the full tree as ComputeMerkleLevels returns them */
+    CPartialMerkleTree(const std::vector<std::vector<uint256> > &vLevels, const std::vector<bool> &vMatch);
+
     CPartialMerkleTree();
 
     /**
@@ -140,6 +144,9 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    /** Same, with the merkle levels of block from GetBlockMerkleLevels */
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<std::vector<uint256> >& vLevels);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
@@ -154,4 +161,13 @@ public:
     }
 };
 
+typedef std::shared_ptr<const std::vector<std::vector<uint256> > > MerkleLevelsRef;
+
+/**
+ * Every level of the merkle tree of block, from a bounded cache of recently
+ * filtered blocks, so that SPV peers syncing the same history share the
+ * hashing. Thread safe.
+ */
+MerkleLevelsRef GetBlockMerkleLevels(const CBlock& block);
+
 #endif // BITCOIN_MERKLEBLOCK_H
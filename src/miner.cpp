@@ -6,6 +6,7 @@
 #include "miner.h"
 
 #include "amount.h"
+#include "arith_uint256.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "coins.h"
@@ -18,6 +19,7 @@
 #include "net.h"
 #include "policy/policy.h"
 #include "pow.h"
+#include "threadplacement.h"
 #include "primitives/transaction.h"
 #include "script/standard.h"
 #include "timedata.h"
@@ -27,6 +29,9 @@
 #include "validationinterface.h"
 #include "pos.h"
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <limits>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -47,9 +52,13 @@
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 uint64_t nLastBlockWeight = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
 
-unsigned int nMinerSleep = 1000;//5초
+// Transactions of the most recent block templates, by template id
+static CCriticalSection cs_templateHistory;
+static uint64_t nLastTemplateId = 0;
+static std::deque<std::pair<uint64_t, std::vector<uint256> > > templateHistory;
+std::atomic<int64_t> nLastCoinStakeSearchInterval(0);
+
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams, const uint256& hash);
 class ScoreCompare
 {
@@ -238,9 +247,37 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     LogPrint("bench", "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
+    recordTemplate();
+
     return std::move(pblocktemplate);
 }
 
+void BlockAssembler::recordTemplate()
+{
+    std::vector<uint256> vTxHashes;
+    vTxHashes.reserve(pblock->vtx.size() - 1);
+    for (unsigned int i = 1; i < pblock->vtx.size(); i++)
+        vTxHashes.push_back(pblock->vtx[i]->GetHash());
+
+    LOCK(cs_templateHistory);
+    pblocktemplate->nTemplateId = ++nLastTemplateId;
+    templateHistory.emplace_back(nLastTemplateId, std::move(vTxHashes));
+    while (templateHistory.size() > BLOCK_TEMPLATE_HISTORY)
+        templateHistory.pop_front();
+}
+
+bool BlockAssembler::GetTemplateTransactions(uint64_t nTemplateId, std::vector<uint256>& vTxHashes)
+{
+    LOCK(cs_templateHistory);
+    for (const auto& entry : templateHistory) {
+        if (entry.first == nTemplateId) {
+            vTxHashes = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
 {
     BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
@@ -367,11 +404,8 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 
     bool fPrintPriority = GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
     if (fPrintPriority) {
-        double dPriority = iter->GetPriority(nHeight);
-        CAmount dummy;
-        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
         LogPrintf("priority %.1f fee %s txid %s\n",
-                  dPriority,
+                  iter->GetCachedPriority(),
                   CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
                   iter->GetTx().GetHash().ToString());
     }
@@ -586,30 +620,33 @@ void BlockAssembler::addPriorityTxs(bool fProofOfStake, int blockTime)
     bool fSizeAccounting = fNeedSizeAccounting;
     fNeedSizeAccounting = true;
 
-    // This vector will be sorted into a priority queue:
+    // The mempool keeps entries ordered by priority; walk that order,
+    // merging in the transactions that waited for a parent to be added,
+    // which are kept in this priority queue:
+    mempool.UpdatePriorities(nHeight);
+    CTxMemPool::indexed_transaction_set::index<priority_score>::type::iterator mi = mempool.mapTx.get<priority_score>().begin();
     std::vector<TxCoinAgePriority> vecPriority;
     TxCoinAgePriorityCompare pricomparer;
     std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
     typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
     double actualPriority = -1;
 
-    vecPriority.reserve(mempool.mapTx.size());
-    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-         mi != mempool.mapTx.end(); ++mi)
-    {
-        double dPriority = mi->GetPriority(nHeight);
-        CAmount dummy;
-        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
-        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
-    }
-    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-
     CTxMemPool::txiter iter;
-    while (!vecPriority.empty() && !blockFinished) { // add a tx from priority queue to fill the blockprioritysize
-        iter = vecPriority.front().second;
-        actualPriority = vecPriority.front().first;
-        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
-        vecPriority.pop_back();
+    while (!blockFinished) { // add the next tx by priority to fill the blockprioritysize
+        bool fWalkDone = mi == mempool.mapTx.get<priority_score>().end();
+        if (!vecPriority.empty() && (fWalkDone ||
+                !pricomparer(vecPriority.front(), TxCoinAgePriority(mi->GetCachedPriority(), mempool.mapTx.project<0>(mi))))) {
+            iter = vecPriority.front().second;
+            actualPriority = vecPriority.front().first;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+        } else if (!fWalkDone) {
+            iter = mempool.mapTx.project<0>(mi);
+            actualPriority = mi->GetCachedPriority();
+            ++mi;
+        } else {
+            break;
+        }
 
         // If tx already in block, skip
         if (inBlock.count(iter)) {
@@ -675,9 +712,87 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
+// Hash every nShards-th nonce from nNonceBegin + nShard until any shard finds a proof-of-work
+static void ScanPoWNonceShard(CBlockHeader header, uint32_t nNonceBegin, uint32_t nNonceEnd, uint32_t nShard, uint32_t nShards,
+                              const arith_uint256& bnTarget, std::atomic<bool>& fFound, CCriticalSection& cs, uint32_t& nNonceRet)
+{
+    // Reusing one scratchpad avoids the 128KB stack frame of scrypt_1024_1_1_256 per hash
+    std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+    uint256 hash;
+    for (uint64_t nNonce = (uint64_t)nNonceBegin + nShard; nNonce < nNonceEnd && !fFound; nNonce += nShards)
+    {
+        header.nNonce = nNonce;
+        scrypt_1024_1_1_256_sp(BEGIN(header.nVersion), BEGIN(hash), &scratchpad[0]);
+        if (UintToArith256(hash) > bnTarget)
+            continue;
+
+        LOCK(cs);
+        if (!fFound || header.nNonce < nNonceRet) {
+            nNonceRet = header.nNonce;
+            fFound = true;
+        }
+        return;
+    }
+}
+
+bool ScanPoWNonces(CBlockHeader* pblock, uint32_t nNonceEnd, int nThreads, const Consensus::Params& consensusParams)
+{
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(pblock->nBits, &fNegative, &fOverflow);
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > UintToArith256(consensusParams.powLimit) || pblock->nNonce >= nNonceEnd) {
+        pblock->nNonce = std::max(pblock->nNonce, nNonceEnd);
+        return false;
+    }
+
+    const uint32_t nNonceBegin = pblock->nNonce;
+    uint32_t nShards = std::max(1, std::min(nThreads, (int)std::min<uint32_t>(nNonceEnd - nNonceBegin, std::numeric_limits<int>::max())));
+    std::atomic<bool> fFound(false);
+    CCriticalSection cs;
+    uint32_t nNonceFound = 0;
+
+    boost::thread_group threadGroup;
+    for (uint32_t nShard = 1; nShard < nShards; nShard++) {
+        threadGroup.create_thread([&, nShard]() {
+            RenameThread("bitcoin-pow");
+            ScanPoWNonceShard(*pblock, nNonceBegin, nNonceEnd, nShard, nShards, bnTarget, fFound, cs, nNonceFound);
+        });
+    }
+    ScanPoWNonceShard(*pblock, nNonceBegin, nNonceEnd, 0, nShards, bnTarget, fFound, cs, nNonceFound);
+    threadGroup.join_all();
+
+    pblock->nNonce = fFound ? nNonceFound : nNonceEnd;
+    return fFound;
+}
 
 // novacoin: attempt to generate suitable proof-of-stake
-bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
+bool AssembleStakeBlock(CBlock& block, const CTransactionRef& txCoinStake)
+{
+    // if have other tx allow time limit zero else allow time is pow block limit 
+    if (( block.vtx.size()>1&&txCoinStake->nTime >= pindexBestHeader->GetPastTimeLimit()+1)||txCoinStake->nTime >= pindexBestHeader->GetPastTimeLimit() + 60)
+    {
+        DbgMsg("tx:%d, limit:%d gap:%d",txCoinStake->nTime , pindexBestHeader->GetPastTimeLimit(), ( txCoinStake->nTime - pindexBestHeader->GetPastTimeLimit()));
+        // make sure coinstake would meet timestamp protocol
+        //    as it would be the same as the block timestamp
+        CMutableTransaction txCoinBase(*block.vtx[0]);
+        txCoinBase.nTime = block.nTime = txCoinStake->nTime;
+        block.vtx[0] = MakeTransactionRef(txCoinBase);
+
+        // we have to make sure that we have no future timestamps in
+        //    our transactions set
+        for (std::vector<CTransactionRef>::iterator it = block.vtx.begin(); it != block.vtx.end();)
+            if ((*it)->nTime > block.nTime) { it = block.vtx.erase(it); } else { ++it; }
+
+        block.vtx.insert(block.vtx.begin() + 1, txCoinStake);
+
+        block.hashMerkleRoot = BlockMerkleRoot(block);
+        return true;
+    }
+    return false;
+}
+
+bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees, const CStakeKernel& kernel)
 {
     // if we are trying to sign
     //    something except proof-of-stake block template
@@ -694,67 +809,181 @@ bool SignBlock(CBlock& block, CWallet& wallet, int64_t& nFees)
     	return true;
     }
 
-
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
-
     CKey key;
-    CMutableTransaction txCoinBase(*block.vtx[0]);
     CMutableTransaction txCoinStake;
-    txCoinStake.nTime = GetAdjustedTime();
-    int64_t time = txCoinStake.nTime;
-    txCoinStake.nTime &= ~Params().GetConsensus().nStakeTimestampMask;
-    int64_t nSearchTime = txCoinStake.nTime; // search to current time
+    txCoinStake.nTime = kernel.nTime;
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
+    if (wallet.CreateCoinStake(wallet, kernel, nFees, txCoinStake, key))
     {
-        // 목표 비트로 n( 1에서 60?으로 수정) 번 코인을 찾는다.
-        // int64_t nSearchInterval = nBestHeight+1 > 0 ? 1 : nSearchTime - nLastCoinStakeSearchTime;
-        if (wallet.CreateCoinStake(wallet, block.nBits, 1, nFees, txCoinStake, key))
+        if (AssembleStakeBlock(block, MakeTransactionRef(txCoinStake)))
         {
-            // if have other tx allow time limit zero else allow time is pow block limit 
-            if (( block.vtx.size()>1&&txCoinStake.nTime >= pindexBestHeader->GetPastTimeLimit()+1)||txCoinStake.nTime >= pindexBestHeader->GetPastTimeLimit() + 60)
-            {
-                DbgMsg("tx:%d, limit:%d gap:%d",txCoinStake.nTime , pindexBestHeader->GetPastTimeLimit(), ( txCoinStake.nTime - pindexBestHeader->GetPastTimeLimit()));
-                // make sure coinstake would meet timestamp protocol
-                //    as it would be the same as the block timestamp
-            	txCoinBase.nTime = block.nTime = txCoinStake.nTime;
-            	block.vtx[0] = MakeTransactionRef(txCoinBase);
-
-                // we have to make sure that we have no future timestamps in
-                //    our transactions set
-                for (vector<CTransactionRef>::iterator it = block.vtx.begin(); it != block.vtx.end();)
-                    if ((*it)->nTime > block.nTime) { it = block.vtx.erase(it); } else { ++it; }
-
-                block.vtx.insert(block.vtx.begin() + 1, MakeTransactionRef(txCoinStake));
-
-                block.hashMerkleRoot = BlockMerkleRoot(block);
-                // append a signature to our block
-                return key.Sign(block.GetHash(), block.vchBlockSig);
-            }
+            // append a signature to our block
+            return key.Sign(block.GetHash(), block.vchBlockSig);
         }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-        nLastCoinStakeSearchTime = nSearchTime;
     }
 
     return false;
 }
 
-void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams)
+/**
+ * Wakes the stake miner when the chain tip changes, so that a search on the
+ * new stake modifier starts right away instead of at the next poll.
+ */
+class CStakeMinerNotifier : public CValidationInterface
 {
-    LogPrintf("staking start....");
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    uint64_t nTipSequence;
 
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+public:
+    CStakeMinerNotifier() : nTipSequence(0) {}
 
-    // Make this thread recognisable as the mining thread
-    RenameThread("blackcoin-miner");
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nTipSequence++;
+        cond.notify_all();
+    }
+
+    uint64_t GetSequence()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nTipSequence;
+    }
+
+    /** Sleep until the tip changes after nSequence was read, or nMilliseconds pass; an interruption point */
+    void Wait(uint64_t nSequence, int64_t nMilliseconds)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        cond.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds), [&]() { return nTipSequence != nSequence; });
+    }
+};
 
-    CReserveKey reservekey(pwallet);
+static CStakeMinerNotifier stakeMinerNotifier;
+
+// Milliseconds until the next stake timestamp boundary, when a new kernel timestamp can be searched
+static int64_t GetStakeWaitMillis(const Consensus::Params& params)
+{
+    int64_t nNowMillis = GetTimeMillis() + GetTimeOffset() * 1000;
+    int64_t nNext = (nNowMillis / 1000 | params.nStakeTimestampMask) + 1;
+    return nNext * 1000 - nNowMillis;
+}
+
+/**
+ * The stake miner's block template, built ahead of the kernel search so a
+ * found kernel only needs the coinstake and signature. It is rebuilt on a new
+ * tip, and once the mempool changed (as counted by
+ * CTxMemPool::GetTransactionsUpdated, like getblocktemplate does) after
+ * STAKE_TEMPLATE_REFRESH_INTERVAL.
+ */
+struct CStakeTemplateCache
+{
+    std::unique_ptr<CBlockTemplate> ptemplate;
+    CAmount nFees;
+    unsigned int nTransactionsUpdated;
+    int64_t nTimeBuilt;
+
+    CStakeTemplateCache() : nFees(0), nTransactionsUpdated(0), nTimeBuilt(0) {}
+
+    bool IsFor(const CBlockIndex* pindexPrev) const
+    {
+        return ptemplate && ptemplate->block.hashPrevBlock == pindexPrev->GetBlockHash();
+    }
+
+    /** Make sure there is a template for pindexPrev. Returns false if one could not be built. */
+    bool Refresh(const CBlockIndex* pindexPrev, const CScript& scriptPubKey, const CChainParams& chainparams)
+    {
+        if (IsFor(pindexPrev) && (mempool.GetTransactionsUpdated() == nTransactionsUpdated ||
+                GetTime() - nTimeBuilt < STAKE_TEMPLATE_REFRESH_INTERVAL))
+            return true;
+
+        int64_t nTimeStart = GetTimeMicros();
+        nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        nTimeBuilt = GetTime();
+        ptemplate = BlockAssembler(chainparams).CreateNewBlock(scriptPubKey, true, true, &nFees);
+        stakingStats.nCreateBlockMicros += GetTimeMicros() - nTimeStart;
+        if (!ptemplate)
+            return false;
+        stakingStats.nTemplatesBuilt++;
+        return true;
+    }
+};
+
+/**
+ * -stakeforecast: a kernel depends only on the tip's stake modifier and the
+ * timestamp, so the stake timestamps of the next window are searched in one
+ * pass when the tip changes, and the miner sleeps until the earliest kernel
+ * instead of searching each timestamp as it comes. Coins that become
+ * stakeable during a window are searched from the next tip or window.
+ */
+struct CStakeForecast
+{
+    const CBlockIndex* pindexPrev;
+    uint32_t nTimeNext;    //!< earliest timestamp of the window not searched yet
+    uint32_t nTimeEnd;     //!< last timestamp of the window
+    bool fFound;
+    CStakeKernel kernel;   //!< the earliest kernel, when fFound
+    uint256 hashKernelTx;
+
+    CStakeForecast() : pindexPrev(NULL), nTimeNext(0), nTimeEnd(0), fFound(false) {}
+
+    /** Search whatever is left of the window on pindex, or a new window once it ran out */
+    void Update(const std::vector<CWallet*>& vpwalletsIn, CBlockIndex* pindex, unsigned int nBits, uint32_t nSearchTime,
+                int64_t nWindow, int nThreads, const Consensus::Params& params)
+    {
+        uint32_t nStep = params.nStakeTimestampMask + 1;
+        if (pindex != pindexPrev) {
+            pindexPrev = pindex;
+            fFound = false;
+            nTimeNext = nSearchTime;
+            nTimeEnd = (nSearchTime + nWindow) & ~params.nStakeTimestampMask;
+        } else if (fFound) {
+            return;
+        } else if (nTimeNext > nTimeEnd) {
+            if (nSearchTime <= nTimeEnd)
+                return;
+            nTimeNext = nSearchTime;
+            nTimeEnd = (nSearchTime + nWindow) & ~params.nStakeTimestampMask;
+        }
+        fFound = CWallet::ForecastStakeKernel(vpwalletsIn, pindex, nBits, std::max(nTimeNext, nSearchTime), nTimeEnd, nStep, kernel, nThreads);
+        if (fFound)
+            hashKernelTx = kernel.pcoin->GetHash();
+        nTimeNext = (fFound ? kernel.nTime : nTimeEnd) + nStep;
+        nLastCoinStakeSearchInterval = nWindow;
+    }
+
+    /** The timestamp to wake up at: the kernel's, or the start of the next window */
+    uint32_t GetWakeTime() const
+    {
+        return fFound ? kernel.nTime : nTimeNext;
+    }
+
+    /** Hand out the forecast kernel once; false if its coin left the wallet meanwhile */
+    bool Take(CStakeKernel& kernelRet)
+    {
+        fFound = false;
+        kernelRet = kernel;
+        kernelRet.pcoin = kernel.pwallet->GetWalletTx(hashKernelTx);
+        return kernelRet.pcoin != NULL;
+    }
+};
+
+static void StakeMinerLoop(const std::vector<CWallet*>& vpwalletsIn, const CChainParams& chainparams)
+{
+    // A proof-of-stake template's coinbase pays nothing, so one serves all wallets
+    CReserveKey reservekey(vpwalletsIn[0]);
+    CStakeTemplateCache templateCache;
 
     bool fTryToSync = true;
-    
-    int nCount =0;
+    int nStakeThreads = std::max(1, (int)GetArg("-stakethreads", DEFAULT_STAKE_THREADS));
+    int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
+    const CBlockIndex* pindexLastSearch = NULL;
+    int64_t nForecastWindow = std::max((int64_t)0, GetArg("-stakeforecast", DEFAULT_STAKE_FORECAST));
+    CStakeForecast forecast;
+
     while (true){
-        while (pwallet->IsLocked()){
+        while (std::all_of(vpwalletsIn.begin(), vpwalletsIn.end(), [](const CWallet* pwallet) { return pwallet->IsLocked(); })){
             nLastCoinStakeSearchInterval = 0;
             MilliSleep(1000);
         }
@@ -774,39 +1003,117 @@ void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams)
                 continue;
             }
         }
-        if(!pwallet->HaveAvailableCoinsForStaking()) {
-            MilliSleep(nMinerSleep);
+
+        // Read the tip sequence first, so a block arriving from here on cuts the wait short
+        uint64_t nTipSequence = stakeMinerNotifier.GetSequence();
+        // Stake from a wallet that has seen the blocks validated so far
+        SyncWithValidationInterfaceQueue();
+        if (std::none_of(vpwalletsIn.begin(), vpwalletsIn.end(), [](const CWallet* pwallet) { return !pwallet->IsLocked() && pwallet->HaveAvailableCoinsForStaking(); })) {
+            stakeMinerNotifier.Wait(nTipSequence, GetStakeWaitMillis(chainparams.GetConsensus()));
             continue;
         }
+
+        // Search for a kernel first; the block template is only worth
+        // building and signing once we know we can stake on this tip.
+        // Every timestamp is searched once per tip, and a new tip gets a
+        // fresh search at the current timestamp since its modifier differs.
+        CBlockIndex* pindexPrev = pindexBestHeader;
+        int64_t nSearchTime = GetAdjustedTime() & ~chainparams.GetConsensus().nStakeTimestampMask;
+        unsigned int nBits;
+        CStakeKernel kernel;
+        if (nForecastWindow > 0) {
+            if (nSearchTime <= pindexPrev->GetPastTimeLimit()) {
+                stakeMinerNotifier.Wait(nTipSequence, GetStakeWaitMillis(chainparams.GetConsensus()));
+                continue;
+            }
+            nBits = GetNextWorkRequired(pindexPrev, NULL, true, chainparams.GetConsensus());
+            forecast.Update(vpwalletsIn, pindexPrev, nBits, nSearchTime, nForecastWindow, nStakeThreads, chainparams.GetConsensus());
+            if (!forecast.fFound || forecast.kernel.nTime > nSearchTime) {
+                // Sleep through to the kernel, with the template ready for it
+                if (forecast.fFound && !templateCache.Refresh(pindexPrev, reservekey.reserveScript, chainparams))
+                    return;
+                int64_t nNowMillis = GetTimeMillis() + GetTimeOffset() * 1000;
+                stakeMinerNotifier.Wait(nTipSequence, std::max((int64_t)forecast.GetWakeTime() * 1000 - nNowMillis, (int64_t)1));
+                continue;
+            }
+            if (!forecast.Take(kernel))
+                continue;
+            if (!templateCache.Refresh(pindexPrev, reservekey.reserveScript, chainparams))
+                return;
+        } else {
+            if ((nSearchTime <= nLastCoinStakeSearchTime && pindexPrev == pindexLastSearch) || nSearchTime <= pindexPrev->GetPastTimeLimit()) {
+                stakeMinerNotifier.Wait(nTipSequence, GetStakeWaitMillis(chainparams.GetConsensus()));
+                continue;
+            }
+            // Get the template ready while nothing is found yet
+            if (!templateCache.Refresh(pindexPrev, reservekey.reserveScript, chainparams))
+                return;
+
+            nBits = GetNextWorkRequired(pindexPrev, NULL, true, chainparams.GetConsensus());
+            bool fKernelFound = CWallet::FindStakeKernel(vpwalletsIn, pindexPrev, nBits, nSearchTime, 1, kernel, nStakeThreads);
+            if (nSearchTime > nLastCoinStakeSearchTime) {
+                nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+                nLastCoinStakeSearchTime = nSearchTime;
+            }
+            pindexLastSearch = pindexPrev;
+            if (!fKernelFound)
+                continue;
+        }
+
         //
-        // Create new block
+        // Sign a copy of the cached template; the cached one stays pristine
+        // for the next kernel on this tip
         //
-        int64_t nFees;
-        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock( reservekey.reserveScript,true,true, &nFees));
-        //std::unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(chainparams, reservekey.reserveScript, &nFees, true));
-        if (!pblocktemplate.get())
-             return;
+        if (!templateCache.IsFor(pindexPrev) || templateCache.ptemplate->block.nBits != nBits) {
+            // the tip moved while we were searching, the kernel is stale
+            stakingStats.nTemplatesDiscarded++;
+            continue;
+        }
+        int64_t nTimeCreated = GetTimeMicros();
+        std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate(*templateCache.ptemplate));
+        int64_t nFees = templateCache.nFees;
+        stakingStats.nTemplatesReused++;
 
         CBlock *pblock = &pblocktemplate->block;
         // Trying to sign a block
-        if (SignBlock(*pblock, *pwallet, nFees))
+        bool fSigned = SignBlock(*pblock, *kernel.pwallet, nFees, kernel);
+        stakingStats.nSignBlockMicros += GetTimeMicros() - nTimeCreated;
+        if (fSigned)
         {
             SetThreadPriority(THREAD_PRIORITY_NORMAL);
             if (chainActive.Tip()->GetBlockHash() != pblock->hashPrevBlock) {
                 //another block was received while building ours, scrap progress
                 LogPrintf("ThreadStakeMiner(): Valid future PoS block was orphaned before becoming valid");
+                stakingStats.nOrphanedStakes++;
                 continue;
             }
-            CheckStake(pblock, *pwallet, chainparams);
+            if (CheckStake(pblock, *kernel.pwallet, chainparams))
+                stakingStats.nBlocksStaked++;
             SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            MilliSleep(nMinerSleep );
-        }
-        else { 
-            MilliSleep(nMinerSleep );
         }
     }
 }
 
+void ThreadStakeMiner(std::vector<CWallet*> vpwalletsIn, const CChainParams& chainparams)
+{
+    LogPrintf("staking start....");
+
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+    // Make this thread recognisable as the mining thread
+    RenameThread("blackcoin-miner");
+    PlaceThread("stake");
+
+    RegisterValidationInterface(&stakeMinerNotifier);
+    try {
+        StakeMinerLoop(vpwalletsIn, chainparams);
+    } catch (...) {
+        UnregisterValidationInterface(&stakeMinerNotifier);
+        throw;
+    }
+    UnregisterValidationInterface(&stakeMinerNotifier);
+}
+
 bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams)
 {
     uint256 hashBlock = pblock->GetHash();
@@ -814,21 +1121,22 @@ bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams
     if(!pblock->IsProofOfStake())
         return error("CheckStake() : %s is not a proof-of-stake block", hashBlock.GetHex());
 
-    CValidationState state;
-    // verify hash target and signature of coinstake tx
-    if (!CheckProofOfStake(mapBlockIndex[pblock->hashPrevBlock], *pblock->vtx[1], pblock->nBits, state))
-        return error("CheckStake() : proof-of-stake checking failed");
-
-    //// debug print
-    LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("out %s\n", FormatMoney(pblock->vtx[1]->GetValueOut()));
-
     // Found a solution
     {
         LOCK(cs_main);
         if (pblock->hashPrevBlock != chainActive.Tip()->GetBlockHash())
             return error("CheckStake() : generated block is stale");
 
+        // verify hash target and signature of coinstake tx; the tip matches
+        // hashPrevBlock, so pcoinsTip holds the kernel input
+        CValidationState state;
+        if (!CheckProofOfStake(chainActive.Tip(), *pblock->vtx[1], pblock->nBits, state, *pcoinsTip))
+            return error("CheckStake() : proof-of-stake checking failed");
+
+        //// debug print
+        LogPrintf("%s\n", pblock->ToString());
+        LogPrintf("out %s\n", FormatMoney(pblock->vtx[1]->GetValueOut()));
+
         // Track how many getdata requests this block gets
         {
             LOCK(wallet.cs_wallet);
@@ -23,6 +23,16 @@ class CScript;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -stakethreads, the number of threads searching for stake kernels */
+static const int DEFAULT_STAKE_THREADS = 1;
+/** Default for -stakeforecast, the seconds of stake timestamps searched ahead on each new tip (0 = search each timestamp as it comes) */
+static const int64_t DEFAULT_STAKE_FORECAST = 0;
+/** Seconds the stake miner keeps using its block template after the mempool changed */
+static const int64_t STAKE_TEMPLATE_REFRESH_INTERVAL = 10;
+/** Default for -genproclimit, the number of threads the generate RPCs search for proof-of-work on (0 = one per core) */
+static const int DEFAULT_GENERATE_THREADS = 0;
+/** Number of recent block templates whose transaction lists are kept for getblocktemplate deltas */
+static const unsigned int BLOCK_TEMPLATE_HISTORY = 16;
 
 struct CBlockTemplate
 {
@@ -30,9 +40,18 @@ struct CBlockTemplate
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOpsCost;
     std::vector<unsigned char> vchCoinbaseCommitment;
+    // Id assigned by BlockAssembler, used to describe later templates as a delta
+    uint64_t nTemplateId;
 };
 bool CheckStake(CBlock* pblock, CWallet& wallet, const CChainParams& chainparams);
-void ThreadStakeMiner(CWallet *pwallet, const CChainParams& chainparams);
+/**
+ * Put txCoinStake into a proof-of-stake template as the stake miner does before signing:
+ * block and coinbase take the coinstake time, later transactions are dropped and the
+ * merkle root is recomputed. Returns false if the coinstake time is too early for the tip.
+ */
+bool AssembleStakeBlock(CBlock& block, const CTransactionRef& txCoinStake);
+/** Stake the coins of all of vpwalletsIn, searching them for kernels together */
+void ThreadStakeMiner(std::vector<CWallet*> vpwalletsIn, const CChainParams& chainparams);
 // Container for tracking updates to ancestor feerate as we include (parent)
 // transactions in a block
 struct CTxMemPoolModifiedEntry {
@@ -167,11 +186,19 @@ public:
     BlockAssembler(const CChainParams& chainparams);
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, bool fMineWitnessTx=true,bool fProofOfStake=false,CAmount* pFees = NULL);
+    /**
+     * Look up the transactions (excluding the coinbase) of one of the last
+     * BLOCK_TEMPLATE_HISTORY templates created, by its nTemplateId.
+     * Returns false if the template is unknown or has been forgotten.
+     */
+    static bool GetTemplateTransactions(uint64_t nTemplateId, std::vector<uint256>& vTxHashes);
 
 private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
     void resetBlock();
+    /** Assign the finished template an id and remember its transactions */
+    void recordTemplate();
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
 
@@ -213,5 +240,12 @@ private:
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
+/**
+ * Search the nonces from pblock->nNonce up to nNonceEnd for a proof-of-work,
+ * on nThreads threads that each hash with their own scrypt scratchpad.
+ * Leaves pblock->nNonce at the solution and returns true, or leaves it at
+ * nNonceEnd and returns false.
+ */
+bool ScanPoWNonces(CBlockHeader* pblock, uint32_t nNonceEnd, int nThreads, const Consensus::Params& consensusParams);
 
 #endif // BITCOIN_MINER_H
@@ -16,9 +16,11 @@
 #include "crypto/common.h"
 #include "crypto/sha256.h"
 #include "hash.h"
+#include "memusage.h"
 #include "primitives/transaction.h"
 #include "netbase.h"
 #include "scheduler.h"
+#include "threadplacement.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
 
@@ -26,6 +28,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -74,7 +81,7 @@ std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfLimited[NET_MAX] = {};
 std::string strSubVersion;
 
-limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+limitedmap<uint256, int64_t, SaltedTxidHasher> mapAlreadyAskedFor(MAX_INV_SZ);
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -361,7 +368,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -679,6 +686,53 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+void CNode::addMemoryUsage(CNodeMemoryUsage &usage)
+{
+    usage.nNodes++;
+    {
+        LOCK(cs_vRecv);
+        for (const CNetMessage& msg : vRecvMsg)
+            usage.nRecv += msg.hdrbuf.size() + msg.vRecv.size();
+    }
+    {
+        LOCK(cs_vProcessMsg);
+        usage.nRecv += nProcessQueueSize;
+    }
+    {
+        LOCK(cs_vSend);
+        for (const std::vector<unsigned char>& vMsg : vSendMsg)
+            usage.nSend += memusage::DynamicUsage(vMsg);
+        for (const std::vector<unsigned char>& vBuffer : vSendBufferPool)
+            usage.nSend += memusage::DynamicUsage(vBuffer);
+    }
+    {
+        LOCK(cs_filter);
+        if (pfilter)
+            usage.nFilters += memusage::MallocUsage(sizeof(CBloomFilter)) + pfilter->DynamicMemoryUsage();
+    }
+    {
+        LOCK(cs_addrSend);
+        usage.nFilters += addrKnown.DynamicMemoryUsage();
+        usage.nRelay += memusage::DynamicUsage(vAddrToSend);
+    }
+    {
+        LOCK(cs_inventory);
+        usage.nFilters += filterInventoryKnown.DynamicMemoryUsage();
+        usage.nRelay += memusage::DynamicUsage(setInventoryTxToSend) + memusage::DynamicUsage(vInventoryBlockToSend);
+    }
+}
+
+/** Payloads at least this big take a buffer from the pool */
+static const unsigned int RECV_BUFFER_POOL_MIN_SIZE = 256 * 1024;
+/** Number of large receive buffers kept for reuse */
+static const size_t RECV_BUFFER_POOL_SIZE = 8;
+/** Payload still missing for the rest of a message to be received into its own buffer */
+static const unsigned int DIRECT_RECV_MIN_SIZE = 0x10000;
+
+/** Buffers of finished large messages, so the next one needs no reallocation */
+static std::mutex cs_recvBufferPool;
+static std::vector<CSerializeData> vRecvBufferPool;
+
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete)
 {
     complete = false;
@@ -714,16 +768,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         nBytes -= handled;
 
         if (msg.complete()) {
-
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
-
-            msg.nTime = nTimeMicros;
+            MessageComplete(msg, nTimeMicros);
             complete = true;
         }
     }
@@ -731,6 +776,45 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+void CNode::MessageComplete(CNetMessage& msg, int64_t nTimeMicros)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = nTimeMicros;
+}
+
+char* CNode::GetDirectRecvBuffer(unsigned int& nBytes)
+{
+    LOCK(cs_vRecv);
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < DIRECT_RECV_MIN_SIZE)
+        return NULL;
+    return msg.GetDataBuffer(nBytes);
+}
+
+void CNode::ReceivedDirect(unsigned int nBytes, bool& complete)
+{
+    complete = false;
+    int64_t nTimeMicros = GetTimeMicros();
+    LOCK(cs_vRecv);
+    nLastRecv = nTimeMicros / 1000000;
+    nRecvBytes += nBytes;
+    CNetMessage& msg = vRecvMsg.back();
+    msg.DataReceived(nBytes);
+    if (msg.complete()) {
+        MessageComplete(msg, nTimeMicros);
+        complete = true;
+    }
+}
+
 void CNode::SetSendVersion(int nVersionIn)
 {
     // Send version may only be changed in the version message, and
@@ -786,24 +870,58 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Large payloads reuse the buffer of an earlier one
+    if (hdr.nMessageSize >= RECV_BUFFER_POOL_MIN_SIZE) {
+        std::lock_guard<std::mutex> lock(cs_recvBufferPool);
+        if (!vRecvBufferPool.empty()) {
+            vRecv.swap(vRecvBufferPool.back());
+            vRecvBufferPool.pop_back();
+            vRecv.clear();
+        }
+    }
+
     return nCopy;
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nCopy = nBytes;
+    char* pchDest = GetDataBuffer(nCopy);
+    memcpy(pchDest, pch, nCopy);
+    DataReceived(nCopy);
+
+    return nCopy;
+}
+
+char* CNetMessage::GetDataBuffer(unsigned int& nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    nBytes = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nBytes) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024));
     }
 
-    hasher.Write((const unsigned char*)pch, nCopy);
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return vRecv.data() + nDataPos;
+}
 
-    return nCopy;
+void CNetMessage::DataReceived(unsigned int nBytes)
+{
+    hasher.Write((const unsigned char*)vRecv.data() + nDataPos, nBytes);
+    nDataPos += nBytes;
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData vch;
+    vRecv.swap(vch);
+    if (vch.capacity() < RECV_BUFFER_POOL_MIN_SIZE)
+        return;
+    vch.clear();
+    std::lock_guard<std::mutex> lock(cs_recvBufferPool);
+    if (vRecvBufferPool.size() < RECV_BUFFER_POOL_SIZE)
+        vRecvBufferPool.push_back(std::move(vch));
 }
 
 const uint256& CNetMessage::GetMessageHash() const
@@ -822,34 +940,85 @@ const uint256& CNetMessage::GetMessageHash() const
 
 
 
+/** Most queued messages handed to one sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+/** Sent buffers up to this size are kept for reuse as message headers */
+static const size_t MAX_POOLED_SEND_BUFFER = 256;
+static const size_t SEND_BUFFER_POOL_SIZE = 16;
+
 // requires LOCK(cs_vSend)
-size_t CConnman::SocketSendData(CNode *pnode) const
+void CConnman::CaptureMessage(const CNode* pnode, const CNetMessage& msg)
+{
+    CCapturedMessage captured;
+    captured.nTime = msg.nTime;
+    captured.nPeer = pnode->GetId();
+    captured.fInbound = pnode->fInbound;
+    captured.strCommand = msg.hdr.GetCommand();
+    captured.vPayload.assign(msg.vRecv.begin(), msg.vRecv.end());
+    try {
+        *fileCapture << captured;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s, no longer capturing messages\n", __func__, e.what());
+        fileCapture.reset();
+    }
+}
+
+size_t CConnman::SocketSendData(CNode *pnode, size_t nMaxBytes) const
 {
     auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+    while (it != pnode->vSendMsg.end() && nSentSize < nMaxBytes) {
         int nBytes = 0;
+        size_t nOffered = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
-            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#ifdef WIN32
+            const auto &data = *it;
+            assert(data.size() > pnode->nSendOffset);
+            nOffered = std::min(data.size() - pnode->nSendOffset, nMaxBytes - nSentSize);
+            nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, nOffered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Hand the kernel as many queued messages as fit in one call
+            struct iovec iov[MAX_SEND_IOVECS];
+            int nIov = 0;
+            size_t nOffset = pnode->nSendOffset;
+            for (auto itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS && nOffered < nMaxBytes - nSentSize; ++itIov, ++nIov) {
+                assert(itIov->size() > nOffset);
+                iov[nIov].iov_base = const_cast<unsigned char*>(itIov->data()) + nOffset;
+                iov[nIov].iov_len = std::min(itIov->size() - nOffset, nMaxBytes - nSentSize - nOffered);
+                nOffered += iov[nIov].iov_len;
+                nOffset = 0;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nIov;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Retire the messages that went out in full
+            size_t nLeft = nBytes;
+            while (it != pnode->vSendMsg.end() && nLeft >= it->size() - pnode->nSendOffset) {
+                nLeft -= it->size() - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+                pnode->nSendSize -= it->size();
+                if (it->capacity() <= MAX_POOLED_SEND_BUFFER && pnode->vSendBufferPool.size() < SEND_BUFFER_POOL_SIZE) {
+                    it->clear();
+                    pnode->vSendBufferPool.push_back(std::move(*it));
+                }
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            pnode->nSendOffset += nLeft;
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nOffered) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -871,6 +1040,7 @@ size_t CConnman::SocketSendData(CNode *pnode) const
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
+    pnode->vSendMsgPriority.erase(pnode->vSendMsgPriority.begin(), pnode->vSendMsgPriority.begin() + (it - pnode->vSendMsg.begin()));
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
     return nSentSize;
 }
@@ -1055,7 +1225,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (socketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1104,8 +1274,321 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode)
+{
+    if (strMode == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifndef WIN32
+    if (strMode == "poll") {
+        mode = SOCKETEVENTS_POLL;
+        return true;
+    }
+#endif
+#ifdef __linux__
+    if (strMode == "epoll") {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetSocketEventsModes()
+{
+    std::string strModes = "select";
+#ifndef WIN32
+    strModes += ", poll";
+#endif
+#ifdef __linux__
+    strModes += ", epoll";
+#endif
+    return strModes;
+}
+
+/**
+ * The class the send queue of pnode is due in. Past the message going out the
+ * queue is in class order, so a message of a higher class than it raises the
+ * whole queue to that class, having to follow it out. The queue must not be
+ * empty, and pnode->cs_vSend must be held, here and in GetSendDemand.
+ */
+static SendPriority GetSendClass(const CNode* pnode, size_t* pnNext = NULL)
+{
+    size_t nNext = 1;
+    while (nNext < pnode->vSendMsg.size() && (pnode->vSendMsgPriority[nNext] & SEND_PAYLOAD))
+        nNext++;
+    if (pnNext)
+        *pnNext = nNext;
+    uint8_t nPriority = pnode->vSendMsgPriority[0] & ~SEND_PAYLOAD;
+    if (nNext < pnode->vSendMsg.size())
+        nPriority = std::min(nPriority, pnode->vSendMsgPriority[nNext]);
+    return (SendPriority)nPriority;
+}
+
+/** The class the send queue of pnode is due in, and its bytes up to the end of the last message of that class */
+static std::pair<SendPriority, uint64_t> GetSendDemand(const CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        return std::make_pair(SEND_PRIORITY_BLOCK, (uint64_t)0);
+    size_t nNext;
+    SendPriority nPriority = GetSendClass(pnode, &nNext);
+    uint64_t nBytes = 0;
+    for (size_t i = 0; i < pnode->vSendMsg.size(); i++) {
+        if (i >= nNext && (pnode->vSendMsgPriority[i] & ~SEND_PAYLOAD) > nPriority)
+            break;
+        nBytes += pnode->vSendMsg[i].size();
+    }
+    return std::make_pair(nPriority, nBytes - pnode->nSendOffset);
+}
+
+void CConnman::GenerateSelectSet(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set, std::map<SOCKET, NodeId>& mapOwners)
+{
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        recv_set.insert(hListenSocket.socket);
+        mapOwners[hListenSocket.socket] = -1;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is space left in the receive buffer, select() for
+            //   receiving data.
+            // * Hand off all complete messages to the processor, to be handled without
+            //   blocking here.
+
+            bool select_recv = !pnode->fPauseRecv;
+            bool select_send;
+            {
+                // Under -maxuploadrate, wait for tokens rather than for the socket
+                LOCK(pnode->cs_vSend);
+                select_send = !pnode->vSendMsg.empty() && uploadScheduler.MaySend(GetSendClass(pnode));
+            }
+
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            error_set.insert(pnode->hSocket);
+            mapOwners[pnode->hSocket] = pnode->GetId();
+            if (select_send) {
+                send_set.insert(pnode->hSocket);
+                continue;
+            }
+            if (select_recv) {
+                recv_set.insert(pnode->hSocket);
+            }
+        }
+    }
+}
+
+void CConnman::SocketEvents(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    std::set<SOCKET> recv_select_set, send_select_set, error_select_set;
+    std::map<SOCKET, NodeId> mapOwners;
+    GenerateSelectSet(recv_select_set, send_select_set, error_select_set, mapOwners);
+
+    switch (socketEventsMode) {
+    case SOCKETEVENTS_EPOLL:
+        SocketEventsEpoll(recv_select_set, send_select_set, error_select_set, mapOwners, recv_set, send_set, error_set);
+        break;
+    case SOCKETEVENTS_POLL:
+        SocketEventsPoll(recv_select_set, send_select_set, error_select_set, recv_set, send_set, error_set);
+        break;
+    default:
+        SocketEventsSelect(recv_select_set, send_select_set, error_select_set, recv_set, send_set, error_set);
+        break;
+    }
+}
+
+void CConnman::SocketEventsSelect(const std::set<SOCKET>& recv_select_set, const std::set<SOCKET>& send_select_set, const std::set<SOCKET>& error_select_set,
+                                  std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT_MILLISECONDS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    for (SOCKET hSocket : recv_select_set) {
+        FD_SET(hSocket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hSocket);
+        have_fds = true;
+    }
+    for (SOCKET hSocket : send_select_set) {
+        FD_SET(hSocket, &fdsetSend);
+        hSocketMax = std::max(hSocketMax, hSocket);
+        have_fds = true;
+    }
+    for (SOCKET hSocket : error_select_set) {
+        FD_SET(hSocket, &fdsetError);
+        hSocketMax = std::max(hSocketMax, hSocket);
+        have_fds = true;
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (interruptNet)
+        return;
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            // Try to receive on everything
+            recv_set.insert(recv_select_set.begin(), recv_select_set.end());
+            recv_set.insert(send_select_set.begin(), send_select_set.end());
+            recv_set.insert(error_select_set.begin(), error_select_set.end());
+        }
+        interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_EVENTS_TIMEOUT_MILLISECONDS));
+        return;
+    }
+
+    for (SOCKET hSocket : recv_select_set) {
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            recv_set.insert(hSocket);
+    }
+    for (SOCKET hSocket : send_select_set) {
+        if (FD_ISSET(hSocket, &fdsetSend))
+            send_set.insert(hSocket);
+    }
+    for (SOCKET hSocket : error_select_set) {
+        if (FD_ISSET(hSocket, &fdsetError))
+            error_set.insert(hSocket);
+    }
+}
+
+void CConnman::SocketEventsPoll(const std::set<SOCKET>& recv_select_set, const std::set<SOCKET>& send_select_set, const std::set<SOCKET>& error_select_set,
+                                std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+#ifdef WIN32
+    SocketEventsSelect(recv_select_set, send_select_set, error_select_set, recv_set, send_set, error_set);
+#else
+    std::map<SOCKET, struct pollfd> mapPollFds;
+    for (SOCKET hSocket : recv_select_set) {
+        mapPollFds[hSocket].fd = hSocket;
+        mapPollFds[hSocket].events |= POLLIN;
+    }
+    for (SOCKET hSocket : send_select_set) {
+        mapPollFds[hSocket].fd = hSocket;
+        mapPollFds[hSocket].events |= POLLOUT;
+    }
+    for (SOCKET hSocket : error_select_set) {
+        // Errors and hangups are always reported
+        mapPollFds[hSocket].fd = hSocket;
+    }
+
+    std::vector<struct pollfd> vPollFds;
+    vPollFds.reserve(mapPollFds.size());
+    for (const std::pair<const SOCKET, struct pollfd>& item : mapPollFds)
+        vPollFds.push_back(item.second);
+
+    if (poll(vPollFds.data(), vPollFds.size(), SOCKET_EVENTS_TIMEOUT_MILLISECONDS) < 0) {
+        LogPrintf("socket poll error %s\n", NetworkErrorString(WSAGetLastError()));
+        interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_EVENTS_TIMEOUT_MILLISECONDS));
+        return;
+    }
+    if (interruptNet)
+        return;
+
+    for (const struct pollfd& pollFd : vPollFds) {
+        if (pollFd.revents & POLLIN)
+            recv_set.insert(pollFd.fd);
+        if (pollFd.revents & POLLOUT)
+            send_set.insert(pollFd.fd);
+        if (pollFd.revents & (POLLERR | POLLHUP))
+            error_set.insert(pollFd.fd);
+    }
+#endif
+}
+
+void CConnman::SocketEventsEpoll(const std::set<SOCKET>& recv_select_set, const std::set<SOCKET>& send_select_set, const std::set<SOCKET>& error_select_set,
+                                 const std::map<SOCKET, NodeId>& mapOwners, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set)
+{
+#ifndef __linux__
+    SocketEventsPoll(recv_select_set, send_select_set, error_select_set, recv_set, send_set, error_set);
+#else
+    // Bring the registrations in line with what we wait for now. Only
+    // changes cost a system call, so an idle pass over many peers is cheap.
+    std::map<SOCKET, uint32_t> mapWanted;
+    for (SOCKET hSocket : recv_select_set)
+        mapWanted[hSocket] |= EPOLLIN;
+    for (SOCKET hSocket : send_select_set)
+        mapWanted[hSocket] |= EPOLLOUT;
+    for (SOCKET hSocket : error_select_set)
+        mapWanted[hSocket] |= 0; // EPOLLERR and EPOLLHUP are always reported
+
+    for (auto it = mapEpollEvents.begin(); it != mapEpollEvents.end(); ) {
+        if (!mapWanted.count(it->first)) {
+            // Fails harmlessly if the socket is already closed
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, it->first, NULL);
+            mapEpollEvents.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    for (const std::pair<const SOCKET, uint32_t>& wanted : mapWanted) {
+        std::map<SOCKET, NodeId>::const_iterator itOwner = mapOwners.find(wanted.first);
+        NodeId owner = itOwner != mapOwners.end() ? itOwner->second : -1;
+        auto it = mapEpollEvents.find(wanted.first);
+        if (it != mapEpollEvents.end() && it->second.first == owner && it->second.second == wanted.second)
+            continue;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = wanted.second;
+        event.data.fd = wanted.first;
+        // A closed socket leaves the epoll set by itself, and its number may
+        // since have been reused by another peer, hence the owner check and
+        // the fallback from MOD to ADD
+        if (epoll_ctl(hEpoll, EPOLL_CTL_MOD, wanted.first, &event) != 0 &&
+            epoll_ctl(hEpoll, EPOLL_CTL_ADD, wanted.first, &event) != 0) {
+            LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+            continue;
+        }
+        mapEpollEvents[wanted.first] = std::make_pair(owner, wanted.second);
+    }
+
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpoll, events, sizeof(events) / sizeof(events[0]), SOCKET_EVENTS_TIMEOUT_MILLISECONDS);
+    if (nEvents < 0) {
+        if (WSAGetLastError() != WSAEINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(WSAGetLastError()));
+        interruptNet.sleep_for(std::chrono::milliseconds(SOCKET_EVENTS_TIMEOUT_MILLISECONDS));
+        return;
+    }
+    if (interruptNet)
+        return;
+
+    for (int i = 0; i < nEvents; i++) {
+        if (events[i].events & EPOLLIN)
+            recv_set.insert(events[i].data.fd);
+        if (events[i].events & EPOLLOUT)
+            send_set.insert(events[i].data.fd);
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            error_set.insert(events[i].data.fd);
+    }
+#endif
+}
+
 void CConnman::ThreadSocketHandler()
 {
+    PlaceThread("net");
     unsigned int nPrevNodeCount = 0;
     while (!interruptNet)
     {
@@ -1170,94 +1653,18 @@ void CConnman::ThreadSocketHandler()
                 clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
-
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        std::set<SOCKET> recv_set, send_set, error_set;
+        uploadScheduler.Refill(GetTimeMicros());
+        SocketEvents(recv_set, send_set, error_set);
         if (interruptNet)
             return;
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
-                return;
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && recv_set.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1266,6 +1673,8 @@ void CConnman::ThreadSocketHandler()
         //
         // Service each socket
         //
+        bool fUploadLimited = uploadScheduler.IsLimited();
+        std::vector<CNode*> vSendReady;
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1288,9 +1697,9 @@ void CConnman::ThreadSocketHandler()
                 LOCK(pnode->cs_hSocket);
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+                recvSet = recv_set.count(pnode->hSocket) > 0;
+                sendSet = send_set.count(pnode->hSocket) > 0;
+                errorSet = error_set.count(pnode->hSocket) > 0;
             }
             if (recvSet || errorSet)
             {
@@ -1299,16 +1708,24 @@ void CConnman::ThreadSocketHandler()
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = 0;
+                        // The rest of a large payload goes straight into its message
+                        unsigned int nDirect = sizeof(pchBuf);
+                        char* pchDirect = pnode->GetDirectRecvBuffer(nDirect);
                         {
                             LOCK(pnode->cs_hSocket);
                             if (pnode->hSocket == INVALID_SOCKET)
                                 continue;
-                            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                            if (pchDirect)
+                                nBytes = recv(pnode->hSocket, pchDirect, nDirect, MSG_DONTWAIT);
+                            else
+                                nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         }
                         if (nBytes > 0)
                         {
                             bool notify = false;
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+                            if (pchDirect)
+                                pnode->ReceivedDirect(nBytes, notify);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
                                 pnode->CloseSocketDisconnect();
                             RecordBytesRecv(nBytes);
                             if (notify) {
@@ -1318,6 +1735,8 @@ void CConnman::ThreadSocketHandler()
                                     if (!it->complete())
                                         break;
                                     nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+                                    if (fileCapture)
+                                        CaptureMessage(pnode, *it);
                                 }
                                 {
                                     LOCK(pnode->cs_vProcessMsg);
@@ -1353,7 +1772,11 @@ void CConnman::ThreadSocketHandler()
             //
             // Send
             //
-            if (sendSet)
+            if (sendSet && fUploadLimited)
+            {
+                vSendReady.push_back(pnode);
+            }
+            else if (sendSet)
             {
                 LOCK(pnode->cs_vSend);
                 size_t nBytes = SocketSendData(pnode);
@@ -1395,6 +1818,8 @@ void CConnman::ThreadSocketHandler()
                 }
             }
         }
+        if (!vSendReady.empty())
+            ScheduleSends(vSendReady);
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1403,13 +1828,36 @@ void CConnman::ThreadSocketHandler()
     }
 }
 
+void CConnman::ScheduleSends(const std::vector<CNode*>& vSendReady)
+{
+    std::vector<std::pair<SendPriority, uint64_t> > vPeers;
+    for (CNode* pnode : vSendReady) {
+        LOCK(pnode->cs_vSend);
+        vPeers.push_back(GetSendDemand(pnode));
+    }
+    std::vector<uint64_t> vAllowance = uploadScheduler.Allocate(vPeers);
+    for (size_t i = 0; i < vSendReady.size(); i++) {
+        if (vAllowance[i] == 0)
+            continue;
+        size_t nBytes;
+        {
+            LOCK(vSendReady[i]->cs_vSend);
+            nBytes = SocketSendData(vSendReady[i], vAllowance[i]);
+        }
+        if (nBytes) {
+            uploadScheduler.Consume(nBytes);
+            RecordBytesSent(nBytes);
+        }
+    }
+}
+
 void CConnman::WakeMessageHandler()
 {
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+        nMsgProcWake++;
     }
-    condMsgProc.notify_one();
+    condMsgProc.notify_all();
 }
 
 
@@ -1633,7 +2081,7 @@ void CConnman::DumpAddresses()
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    adb.Dump(addrman);
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1965,16 +2413,28 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
     return true;
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int nShard)
 {
+    PlaceThread("msghand");
+    uint64_t nWakeSeen;
+    {
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        nWakeSeen = nMsgProcWake;
+    }
+
     while (!flagInterruptMsgProc)
     {
+        // Each handler serves the peers of its own shard, so a peer's
+        // messages are always processed in order and by one thread
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            vNodesCopy.reserve(vNodes.size() / nMessageHandlerThreads + 1);
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads != nShard)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -2008,9 +2468,9 @@ void CConnman::ThreadMessageHandler()
 
         std::unique_lock<std::mutex> lock(mutexMsgProc);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this, nWakeSeen] { return nMsgProcWake != nWakeSeen; });
         }
-        fMsgProcWake = false;
+        nWakeSeen = nMsgProcWake;
     }
 }
 
@@ -2018,7 +2478,6 @@ void CConnman::ThreadMessageHandler()
 
 
 
-
 bool CConnman::BindListenPort(const CService &addrBind, std::string& strError, bool fWhitelisted)
 {
     strError = "";
@@ -2194,6 +2653,7 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     fNetworkActive = true;
     setBannedIsDirty = false;
     fAddressesInitialized = false;
+    fAddressesLoaded = false;
     nLastNodeId = 0;
     nSendBufferMaxSize = 0;
     nReceiveFloodSize = 0;
@@ -2202,6 +2662,9 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     nMaxConnections = 0;
     nMaxOutbound = 0;
     nMaxAddnode = 0;
+    nMessageHandlerThreads = DEFAULT_MSGHAND_THREADS;
+    socketEventsMode = SOCKETEVENTS_SELECT;
+    hEpoll = -1;
     nBestHeight = 0;
     clientInterface = NULL;
     flagInterruptMsgProc = false;
@@ -2212,31 +2675,11 @@ NodeId CConnman::GetNewNodeId()
     return nLastNodeId.fetch_add(1, std::memory_order_relaxed);
 }
 
-bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options connOptions)
+void CConnman::LoadAddresses()
 {
-    nTotalBytesRecv = 0;
-    nTotalBytesSent = 0;
-    nMaxOutboundTotalBytesSentInCycle = 0;
-    nMaxOutboundCycleStartTime = 0;
-
-    nRelevantServices = connOptions.nRelevantServices;
-    nLocalServices = connOptions.nLocalServices;
-    nMaxConnections = connOptions.nMaxConnections;
-    nMaxOutbound = std::min((connOptions.nMaxOutbound), nMaxConnections);
-    nMaxAddnode = connOptions.nMaxAddnode;
-    nMaxFeeler = connOptions.nMaxFeeler;
-
-    nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
-    nReceiveFloodSize = connOptions.nReceiveFloodSize;
-
-    nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
-    nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
-
-    SetBestHeight(connOptions.nBestHeight);
+    if (fAddressesLoaded)
+        return;
 
-    clientInterface = connOptions.uiInterface;
-    if (clientInterface)
-        clientInterface->InitMessage(_("Loading addresses..."));
     // Load addresses from peers.dat
     int64_t nStart = GetTimeMillis();
     {
@@ -2246,11 +2689,9 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
         else {
             addrman.Clear(); // Addrman can be in an inconsistent state after failure, reset it
             LogPrintf("Invalid or missing peers.dat; recreating\n");
-            DumpAddresses();
+            adb.Write(addrman);
         }
     }
-    if (clientInterface)
-        clientInterface->InitMessage(_("Loading banlist..."));
     // Load addresses from banlist.dat
     nStart = GetTimeMillis();
     CBanDB bandb;
@@ -2268,6 +2709,62 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
         DumpBanlist();
     }
 
+    fAddressesLoaded = true;
+}
+
+bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options connOptions)
+{
+    nTotalBytesRecv = 0;
+    nTotalBytesSent = 0;
+    nMaxOutboundTotalBytesSentInCycle = 0;
+    nMaxOutboundCycleStartTime = 0;
+
+    nRelevantServices = connOptions.nRelevantServices;
+    nLocalServices = connOptions.nLocalServices;
+    nMaxConnections = connOptions.nMaxConnections;
+    nMaxOutbound = std::min((connOptions.nMaxOutbound), nMaxConnections);
+    nMaxAddnode = connOptions.nMaxAddnode;
+    nMaxFeeler = connOptions.nMaxFeeler;
+    nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MSGHAND_THREADS));
+    socketEventsMode = connOptions.socketEventsMode;
+#ifdef __linux__
+    if (socketEventsMode == SOCKETEVENTS_EPOLL) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("Failed to create epoll instance (%s), using poll instead\n", NetworkErrorString(WSAGetLastError()));
+            socketEventsMode = SOCKETEVENTS_POLL;
+        }
+    }
+#endif
+
+    nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
+    nReceiveFloodSize = connOptions.nReceiveFloodSize;
+
+    if (!connOptions.strCaptureFile.empty()) {
+        FILE* file = fopen(connOptions.strCaptureFile.c_str(), "wb");
+        if (!file) {
+            strNodeError = strprintf(_("Cannot open %s to capture messages to"), connOptions.strCaptureFile);
+            return false;
+        }
+        fileCapture.reset(new CAutoFile(file, SER_DISK, CLIENT_VERSION));
+        fileCapture->write((const char*)Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+        *fileCapture << MESSAGE_CAPTURE_VERSION;
+        LogPrintf("Capturing received messages to %s\n", connOptions.strCaptureFile);
+    }
+
+    nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
+    uploadScheduler.SetRate(connOptions.nMaxUploadRate);
+    nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
+
+    SetBestHeight(connOptions.nBestHeight);
+
+    clientInterface = connOptions.uiInterface;
+    if (!fAddressesLoaded) {
+        if (clientInterface)
+            clientInterface->InitMessage(_("Loading addresses..."));
+        LoadAddresses();
+    }
+
     uiInterface.InitMessage(_("Starting network threads..."));
 
     fAddressesInitialized = true;
@@ -2290,7 +2787,7 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
 
     {
         std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+        nMsgProcWake = 0;
     }
 
     // Send and receive from sockets, accept connections
@@ -2309,10 +2806,11 @@ bool CConnman::Start(CScheduler& scheduler, std::string& strNodeError, Options c
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadMessageHandlers.push_back(std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i))));
 
     // Dump network addresses
-    scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
+    scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL, CScheduler::PRIORITY_LOW, "DumpData");
 
     return true;
 }
@@ -2358,8 +2856,11 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (std::thread& thread : threadMessageHandlers) {
+        if (thread.joinable())
+            thread.join();
+    }
+    threadMessageHandlers.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2368,6 +2869,15 @@ void CConnman::Stop()
         threadDNSAddressSeed.join();
     if (threadSocketHandler.joinable())
         threadSocketHandler.join();
+    fileCapture.reset();
+
+#ifdef __linux__
+    if (hEpoll != -1) {
+        close(hEpoll);
+        hEpoll = -1;
+    }
+#endif
+    mapEpollEvents.clear();
 
     if (fAddressesInitialized)
     {
@@ -2495,6 +3005,15 @@ void CConnman::GetNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+CNodeMemoryUsage CConnman::GetNodeMemoryUsage()
+{
+    CNodeMemoryUsage usage;
+    LOCK(cs_vNodes);
+    for (CNode* pnode : vNodes)
+        pnode->addMemoryUsage(usage);
+    return usage;
+}
+
 bool CConnman::DisconnectNode(const std::string& strNode)
 {
     LOCK(cs_vNodes);
@@ -2701,6 +3220,7 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nextSendTimeFeeFilter = 0;
     fPauseRecv = false;
     fPauseSend = false;
+    fGetDataPending = false;
     nProcessQueueSize = 0;
 
     BOOST_FOREACH(const std::string &msg, getAllNetMessageTypes())
@@ -2732,7 +3252,7 @@ void CNode::AskFor(const CInv& inv)
     // We're using mapAskFor as a priority queue,
     // the key is the earliest time the request can be sent
     int64_t nRequestTime;
-    limitedmap<uint256, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv.hash);
+    limitedmap<uint256, int64_t, SaltedTxidHasher>::const_iterator it = mapAlreadyAskedFor.find(inv.hash);
     if (it != mapAlreadyAskedFor.end())
         nRequestTime = it->second;
     else
@@ -2761,40 +3281,69 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
 }
 
 void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    SendPriority nPriority = GetSendPriority(msg.command);
+    PushMessage(pnode, std::move(msg), nPriority);
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg, SendPriority nPriority)
 {
     size_t nMessageSize = msg.data.size();
     size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
     LogPrint("net", "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->id);
 
-    std::vector<unsigned char> serializedHeader;
-    serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
     uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
     CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
-    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
-
     size_t nBytesSent = 0;
     {
         LOCK(pnode->cs_vSend);
         bool optimisticSend(pnode->vSendMsg.empty());
 
+        std::vector<unsigned char> serializedHeader;
+        if (!pnode->vSendBufferPool.empty()) {
+            serializedHeader.swap(pnode->vSendBufferPool.back());
+            pnode->vSendBufferPool.pop_back();
+        } else {
+            serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
+        }
+        CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+
         //log total amount of bytes per command
         pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
         pnode->nSendSize += nTotalSize;
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+
+        // Go ahead of the messages of a lower class, short of one partly sent
+        size_t nPos = pnode->vSendMsg.size();
+        while (nPos > 0) {
+            size_t nStart = nPos - 1;
+            while (nStart > 0 && (pnode->vSendMsgPriority[nStart] & SEND_PAYLOAD))
+                nStart--;
+            if (nStart == 0 && (pnode->nSendOffset > 0 || (pnode->vSendMsgPriority[0] & SEND_PAYLOAD)))
+                break;
+            if (pnode->vSendMsgPriority[nStart] <= nPriority)
+                break;
+            nPos = nStart;
+        }
+        pnode->vSendMsg.insert(pnode->vSendMsg.begin() + nPos, std::move(serializedHeader));
+        pnode->vSendMsgPriority.insert(pnode->vSendMsgPriority.begin() + nPos, nPriority);
+        if (nMessageSize) {
+            pnode->vSendMsg.insert(pnode->vSendMsg.begin() + nPos + 1, std::move(msg.data));
+            pnode->vSendMsgPriority.insert(pnode->vSendMsgPriority.begin() + nPos + 1, nPriority | SEND_PAYLOAD);
+        }
 
         // If write queue empty, attempt "optimistic write"
-        if (optimisticSend == true)
+        if (optimisticSend == true && (nPriority == SEND_PRIORITY_BLOCK || !uploadScheduler.IsLimited()))
             nBytesSent = SocketSendData(pnode);
     }
-    if (nBytesSent)
+    if (nBytesSent) {
+        uploadScheduler.Consume(nBytesSent);
         RecordBytesSent(nBytesSent);
+    }
 }
 
 bool CConnman::ForNode(NodeId id, std::function<bool(CNode* pnode)> func)
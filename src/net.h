@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "amount.h"
 #include "bloom.h"
+#include "coins.h"
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
@@ -20,9 +21,11 @@
 #include "sync.h"
 #include "uint256.h"
 #include "threadinterrupt.h"
+#include "uploadscheduler.h"
 
 #include <atomic>
 #include <deque>
+#include <limits>
 #include <stdint.h>
 #include <thread>
 #include <memory>
@@ -39,6 +42,7 @@
 class CAddrMan;
 class CScheduler;
 class CNode;
+class CNetMessage;
 
 namespace boost {
     class thread_group;
@@ -76,6 +80,27 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** Default number of message handler threads; peers are split between them by id */
+static const int DEFAULT_MSGHAND_THREADS = 1;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
+/** Default for -socketevents */
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+/** Longest wait for socket events in one pass of the socket handler */
+static const int SOCKET_EVENTS_TIMEOUT_MILLISECONDS = 50;
+
+/** How the socket handler waits for sockets to become ready */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_POLL,   //!< not on Windows
+    SOCKETEVENTS_EPOLL,  //!< Linux only
+};
+
+/** Parse a -socketevents value; false if unknown or not available on this platform */
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode);
+/** Comma separated -socketevents values available on this platform */
+std::string GetSocketEventsModes();
+
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 /** The default timeframe for -maxuploadtarget. 1 day. */
@@ -86,6 +111,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** Flag on the vSendMsgPriority entries of message payloads, which must follow their header out */
+static const uint8_t SEND_PAYLOAD = 0x80;
+/** The default for -maxuploadrate, in units of 1000 bytes per second; 0 = no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_RATE = 0;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -104,6 +133,7 @@ struct AddedNodeInfo
 
 class CTransaction;
 class CNodeStats;
+struct CNodeMemoryUsage;
 class CClientUIInterface;
 
 struct CSerializedNetMsg
@@ -145,10 +175,19 @@ public:
         unsigned int nReceiveFloodSize = 0;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
+        //! Bytes per second all sends are held to, 0 for no limit
+        uint64_t nMaxUploadRate = 0;
+        int nMessageHandlerThreads = DEFAULT_MSGHAND_THREADS;
+        SocketEventsMode socketEventsMode = SOCKETEVENTS_SELECT;
+        //! File to record every message received to, as CCapturedMessage; none if empty
+        std::string strCaptureFile;
     };
     CConnman(uint64_t seed0, uint64_t seed1);
     ~CConnman();
     bool Start(CScheduler& scheduler, std::string& strNodeError, Options options);
+    //! Read peers.dat and banlist.dat. Start does it if this was not called
+    //! before, which may be done on another thread while the node initializes.
+    void LoadAddresses();
     void Stop();
     void Interrupt();
     bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
@@ -160,6 +199,8 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    //! Queue msg ahead of any of a lower class that have not started going out
+    void PushMessage(CNode* pnode, CSerializedNetMsg&& msg, SendPriority nPriority);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -244,6 +285,7 @@ public:
 
     size_t GetNodeCount(NumConnections num);
     void GetNodeStats(std::vector<CNodeStats>& vstats);
+    CNodeMemoryUsage GetNodeMemoryUsage();
     bool DisconnectNode(const std::string& node);
     bool DisconnectNode(NodeId id);
 
@@ -297,8 +339,18 @@ private:
     void ThreadOpenAddedConnections();
     void ProcessOneShot();
     void ThreadOpenConnections();
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int nShard);
     void AcceptConnection(const ListenSocket& hListenSocket);
+    //! Sockets to wait on, with the owning node id (-1 for listen sockets) of each
+    void GenerateSelectSet(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set, std::map<SOCKET, NodeId>& mapOwners);
+    //! Wait up to SOCKET_EVENTS_TIMEOUT_MILLISECONDS and return the ready sockets
+    void SocketEvents(std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+    void SocketEventsSelect(const std::set<SOCKET>& recv_select_set, const std::set<SOCKET>& send_select_set, const std::set<SOCKET>& error_select_set,
+                            std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+    void SocketEventsPoll(const std::set<SOCKET>& recv_select_set, const std::set<SOCKET>& send_select_set, const std::set<SOCKET>& error_select_set,
+                          std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
+    void SocketEventsEpoll(const std::set<SOCKET>& recv_select_set, const std::set<SOCKET>& send_select_set, const std::set<SOCKET>& error_select_set,
+                           const std::map<SOCKET, NodeId>& mapOwners, std::set<SOCKET>& recv_set, std::set<SOCKET>& send_set, std::set<SOCKET>& error_set);
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -317,7 +369,11 @@ private:
 
     NodeId GetNewNodeId();
 
-    size_t SocketSendData(CNode *pnode) const;
+    size_t SocketSendData(CNode *pnode, size_t nMaxBytes = std::numeric_limits<size_t>::max()) const;
+    //! Send for the nodes in vSendReady, as much of their data as uploadScheduler allows each
+    void ScheduleSends(const std::vector<CNode*>& vSendReady);
+    //! Append msg, just received complete from pnode, to the -capturemessages file
+    void CaptureMessage(const CNode* pnode, const CNetMessage& msg);
     //!check is the banlist has unwritten changes
     bool BannedSetIsDirty();
     //!set the "dirty" flag for the banlist
@@ -347,6 +403,9 @@ private:
     uint64_t nMaxOutboundLimit;
     uint64_t nMaxOutboundTimeframe;
 
+    //! Holds sends to -maxuploadrate
+    CUploadScheduler uploadScheduler;
+
     // Whitelisted ranges. Any node connecting from these is automatically
     // whitelisted (as well as those connecting to whitelisted binds).
     std::vector<CSubNet> vWhitelistedRange;
@@ -361,6 +420,7 @@ private:
     CCriticalSection cs_setBanned;
     bool setBannedIsDirty;
     bool fAddressesInitialized;
+    std::atomic<bool> fAddressesLoaded;
     CAddrMan addrman;
     std::deque<std::string> vOneShots;
     CCriticalSection cs_vOneShots;
@@ -389,8 +449,17 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    SocketEventsMode socketEventsMode;
+    //! epoll instance and what each socket is registered for (socket handler thread only)
+    int hEpoll;
+    std::map<SOCKET, std::pair<NodeId, uint32_t> > mapEpollEvents;
+
+    /** Bumped for waking the message processors; each remembers the last value it saw. */
+    uint64_t nMsgProcWake;
+    int nMessageHandlerThreads;
+
+    //! -capturemessages file (socket handler thread only)
+    std::unique_ptr<CAutoFile> fileCapture;
 
     std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
@@ -402,7 +471,7 @@ private:
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
+    std::vector<std::thread> threadMessageHandlers;
 };
 extern std::unique_ptr<CConnman> g_connman;
 void Discover(boost::thread_group& threadGroup);
@@ -469,7 +538,7 @@ extern bool fDiscover;
 extern bool fListen;
 extern bool fRelayTxes;
 
-extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
+extern limitedmap<uint256, int64_t, SaltedTxidHasher> mapAlreadyAskedFor;
 
 /** Subversion as sent to the P2P network in `version` messages */
 extern std::string strSubVersion;
@@ -511,6 +580,18 @@ public:
     CAddress addr;
 };
 
+/** Memory peers hold for their messages and relay state, summed over all peers */
+struct CNodeMemoryUsage
+{
+    size_t nNodes;
+    size_t nRecv;    //!< Messages being received or waiting to be processed
+    size_t nSend;    //!< Messages waiting to be sent
+    size_t nFilters; //!< BIP37 filters and the known address and inventory filters
+    size_t nRelay;   //!< Addresses and inventory waiting to be announced
+
+    CNodeMemoryUsage() : nNodes(0), nRecv(0), nSend(0), nFilters(0), nRelay(0) {}
+};
+
 
 
 
@@ -537,6 +618,8 @@ public:
         nDataPos = 0;
         nTime = 0;
     }
+    //! Hands a large payload buffer back to the receive buffer pool
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -555,6 +638,39 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    //! Room for up to nBytes more payload, at most what the message still lacks
+    char* GetDataBuffer(unsigned int& nBytes);
+    //! Account for nBytes written into the GetDataBuffer buffer
+    void DataReceived(unsigned int nBytes);
+};
+
+/** Format version of -capturemessages files, written after the network's message start */
+static const uint32_t MESSAGE_CAPTURE_VERSION = 1;
+
+/** A message as a peer sent it, the records of a -capturemessages file */
+struct CCapturedMessage
+{
+    //! Time of receipt, in microseconds
+    int64_t nTime;
+    NodeId nPeer;
+    bool fInbound;
+    std::string strCommand;
+    std::vector<unsigned char> vPayload;
+
+    CCapturedMessage() : nTime(0), nPeer(-1), fInbound(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(nTime);
+        READWRITE(nPeer);
+        READWRITE(fInbound);
+        READWRITE(strCommand);
+        READWRITE(vPayload);
+    }
 };
 
 
@@ -571,6 +687,9 @@ public:
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
     std::deque<std::vector<unsigned char>> vSendMsg;
+    //! SendPriority of each vSendMsg entry, with SEND_PAYLOAD set on message payloads
+    std::deque<uint8_t> vSendMsgPriority;
+    std::vector<std::vector<unsigned char>> vSendBufferPool; // small sent buffers kept for message headers
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -582,6 +701,8 @@ public:
     CCriticalSection cs_sendProcessing;
 
     std::deque<CInv> vRecvGetData;
+    //! A merkleblock thread is answering the last getdata request served; later ones wait for it
+    std::atomic_bool fGetDataPending;
     uint64_t nRecvBytes;
     std::atomic<int> nRecvVersion;
 
@@ -630,6 +751,9 @@ public:
     std::atomic<int> nStartingHeight;
 
     // flood relay
+    // Other peers' message handlers relay addresses to this peer, so these two
+    // are protected by cs_addrSend
+    CCriticalSection cs_addrSend;
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -700,6 +824,9 @@ private:
 
     CService addrLocal;
     mutable CCriticalSection cs_addrLocal;
+
+    //! Per-command accounting once a message is complete (requires cs_vRecv)
+    void MessageComplete(CNetMessage& msg, int64_t nTimeMicros);
 public:
 
     NodeId GetId() const {
@@ -721,6 +848,10 @@ public:
     }
 
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
+    //! Buffer to recv() the payload of a large message into directly, or NULL
+    char* GetDirectRecvBuffer(unsigned int& nBytes);
+    //! Account for nBytes received into the GetDirectRecvBuffer buffer
+    void ReceivedDirect(unsigned int nBytes, bool& complete);
 
     void SetRecvVersion(int nVersionIn)
     {
@@ -752,11 +883,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -801,6 +934,7 @@ public:
     void CloseSocketDisconnect();
 
     void copyStats(CNodeStats &stats);
+    void addMemoryUsage(CNodeMemoryUsage &usage);
 
     ServiceFlags GetLocalServices() const
     {
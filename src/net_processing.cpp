@@ -9,8 +9,10 @@
 #include "arith_uint256.h"
 #include "blockencodings.h"
 #include "chainparams.h"
+#include "chainsnapshot.h"
 #include "consensus/validation.h"
 #include "hash.h"
+#include "headerscache.h"
 #include "init.h"
 #include "validation.h"
 #include "merkleblock.h"
@@ -22,7 +24,10 @@
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "random.h"
+#include "scheduler.h"
 #include "tinyformat.h"
+#include "trace.h"
+#include "txintern.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -30,6 +35,8 @@
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <deque>
+
 #include <boost/thread.hpp>
 
 #if defined(NDEBUG)
@@ -38,27 +45,13 @@
 
 std::atomic<int64_t> nTimeBestReceived(0); // Used only to inform the wallet of when we last received a block
 
-struct IteratorComparator
-{
-    template<typename I>
-    bool operator()(const I& a, const I& b)
-    {
-        return &(*a) < &(*b);
-    }
-};
-
-struct COrphanTx {
-    // When modifying, adapt the copy of this definition in tests/DoS_tests.
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+static CTxOrphanage orphanage(DEFAULT_MAX_ORPHAN_TRANSACTIONS, DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE * 1000);
 
 static size_t vExtraTxnForCompactIt = 0;
 static std::vector<std::pair<uint256, CTransactionRef>> vExtraTxnForCompact GUARDED_BY(cs_main);
+/** Txn of the last few blocks connected or disconnected. A competing block
+ *  at the same height mostly shares them, but they have left the mempool. */
+static std::deque<std::vector<std::pair<uint256, CTransactionRef>>> vRecentBlockTxnForCompact GUARDED_BY(cs_main);
 
 static const uint64_t RANDOMIZER_ID_ADDRESS_RELAY = 0x3cac0035b5866b90ULL; // SHA256("main address relay")[0:8]
 
@@ -108,6 +101,24 @@ namespace {
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    /**
+     * Requested blocks that arrived before their parent was stored, kept in memory
+     * rather than written out of order, until the parent has been processed (or
+     * BLOCK_DOWNLOAD_BUFFER_TIMEOUT has passed). Connecting them straight from memory
+     * then saves reading them back from disk. In arrival order, protected by cs_main.
+     */
+    struct BufferedBlock {
+        std::shared_ptr<const CBlock> pblock;
+        NodeId nodeid;
+        int64_t nTime;
+        size_t nBytes;
+    };
+    std::list<BufferedBlock> lBlocksBuffered;
+    std::map<uint256, std::list<BufferedBlock>::iterator> mapBlocksBuffered;
+    //! Buffered blocks by the hash of their parent
+    std::multimap<uint256, std::list<BufferedBlock>::iterator> mapBlocksBufferedByPrev;
+    size_t nBlocksBufferedBytes = 0;
+
     /** Stack of nodes which we have set to announce using compact blocks */
     std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
 
@@ -117,11 +128,27 @@ namespace {
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
 
+    /** Moving average of the serialized size of the blocks we downloaded, protected by cs_main. 0 until known. */
+    double dAvgBlockSize = 0;
+
     /** Relay map, protected by cs_main. */
     typedef std::map<uint256, CTransactionRef> MapRelay;
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /**
+     * Transactions to announce to every peer, protected by cs_main.
+     * RelayTransaction() only collects them in vTxAnnouncePending. Once per
+     * INVENTORY_BROADCAST_BATCH_INTERVAL they are sorted in one go and moved
+     * to vTxAnnounceQueue, which each peer reads from its own cursor
+     * (CNodeState::nTxAnnounceCursor, a sequence number). nTxAnnounceQueueStart
+     * is the sequence number of the first queued entry.
+     */
+    std::vector<uint256> vTxAnnouncePending;
+    std::deque<uint256> vTxAnnounceQueue;
+    uint64_t nTxAnnounceQueueStart = 0;
+    int64_t nNextTxAnnounceBatch = 0;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -175,6 +202,12 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! When the current block download throughput sample from this peer started (in microseconds), or 0.
+    int64_t nBlockRateSampleStart;
+    //! Bytes of requested blocks received from this peer in the current throughput sample.
+    uint64_t nBlockRateSampleBytes;
+    //! Moving average of the block download throughput from this peer, in bytes per second. 0 until known.
+    double dBlockBytesPerSec;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -196,6 +229,18 @@ struct CNodeState {
      * otherwise: whether this peer sends non-witnesses in cmpctblocks/blocktxns.
      */
     bool fSupportsDesiredCmpctVersion;
+    //! Compact blocks from this peer we tried to reconstruct
+    uint64_t nCmpctBlocks;
+    //! ...of which we could reconstruct without a getblocktxn round trip
+    uint64_t nCmpctBlocksReconstructed;
+    //! Txn we had to request with getblocktxn for this peer's compact blocks
+    uint64_t nCmpctTxnRequested;
+    //! Sequence number of the next entry of vTxAnnounceQueue to announce to this peer
+    uint64_t nTxAnnounceCursor;
+    //! Txn we announced to this peer
+    uint64_t nTxInvSent;
+    //! Txn we did not need to announce, as the peer already knew them
+    uint64_t nTxInvSkipped;
 
     CNodeState(CAddress addrIn, std::string addrNameIn) : address(addrIn), name(addrNameIn) {
         fCurrentlyConnected = false;
@@ -211,6 +256,9 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockRateSampleStart = 0;
+        nBlockRateSampleBytes = 0;
+        dBlockBytesPerSec = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -218,6 +266,12 @@ struct CNodeState {
         fHaveWitness = false;
         fWantsCmpctWitness = false;
         fSupportsDesiredCmpctVersion = false;
+        nCmpctBlocks = 0;
+        nCmpctBlocksReconstructed = 0;
+        nCmpctTxnRequested = 0;
+        nTxAnnounceCursor = 0;
+        nTxInvSent = 0;
+        nTxInvSkipped = 0;
     }
 };
 
@@ -268,7 +322,9 @@ void InitializeNode(CNode *pnode, CConnman& connman) {
     NodeId nodeid = pnode->GetId();
     {
         LOCK(cs_main);
-        mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName)));
+        auto it = mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName)));
+        // Only transactions relayed from now on get announced to the new peer
+        it->second.nTxAnnounceCursor = nTxAnnounceQueueStart + vTxAnnounceQueue.size();
     }
     if(!pnode->fInbound)
         PushNodeVersion(pnode, connman, GetTime());
@@ -289,7 +345,7 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
+    orphanage.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -304,10 +360,29 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
     }
 }
 
+// Requires cs_main.
+// Fold nBytes of a block we requested and just received into the peer's throughput
+// sample, and into the average block size. A sample ends after a second or when the
+// peer has nothing in flight anymore, so idle time between batches is not counted.
+void UpdateBlockDownloadRate(CNodeState *state, size_t nBytes) {
+    dAvgBlockSize = dAvgBlockSize == 0 ? nBytes : 0.95 * dAvgBlockSize + 0.05 * nBytes;
+    if (state->nBlockRateSampleStart == 0)
+        return;
+    state->nBlockRateSampleBytes += nBytes;
+    int64_t nElapsed = GetTimeMicros() - state->nBlockRateSampleStart;
+    if (nElapsed < 1000000 && (state->nBlocksInFlight > 0 || nElapsed < 100000))
+        return;
+    double dRate = state->nBlockRateSampleBytes * 1000000.0 / nElapsed;
+    state->dBlockBytesPerSec = state->dBlockBytesPerSec == 0 ? dRate : 0.5 * (state->dBlockBytesPerSec + dRate);
+    state->nBlockRateSampleStart = state->nBlocksInFlight > 0 ? GetTimeMicros() : 0;
+    state->nBlockRateSampleBytes = 0;
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
-bool MarkBlockAsReceived(const uint256& hash) {
+// If the block was in flight from nodeFrom, nBytes (its size) counts towards that peer's throughput.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, size_t nBytes = 0) {
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
@@ -323,6 +398,12 @@ bool MarkBlockAsReceived(const uint256& hash) {
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
+        if (nBytes > 0 && itInFlight->second.first == nodeFrom) {
+            UpdateBlockDownloadRate(state, nBytes);
+        } else if (state->nBlocksInFlight == 0) {
+            state->nBlockRateSampleStart = 0;
+            state->nBlockRateSampleBytes = 0;
+        }
         mapBlocksInFlight.erase(itInFlight);
         return true;
     }
@@ -353,6 +434,8 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     if (state->nBlocksInFlight == 1) {
         // We're starting a block download (batch) from this peer.
         state->nDownloadingSince = GetTimeMicros();
+        if (state->nBlockRateSampleStart == 0)
+            state->nBlockRateSampleStart = state->nDownloadingSince;
     }
     if (state->nBlocksInFlightValidHeaders == 1 && pindex != NULL) {
         nPeersWithValidatedDownloads++;
@@ -363,6 +446,107 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     return true;
 }
 
+// Requires cs_main.
+// Keep a block we requested in the download buffer if its parent is not stored yet and
+// there is room. Returns whether the block was taken (or was already buffered).
+bool BufferBlock(const std::shared_ptr<const CBlock>& pblock, NodeId nodeid, size_t nBytes) {
+    const uint256 hash = pblock->GetHash();
+    if (mapBlocksBuffered.count(hash))
+        return true;
+    if (nBlocksBufferedBytes + nBytes > MAX_BLOCK_DOWNLOAD_BUFFER_BYTES)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        return false;
+    const CBlockIndex* pindex = mi->second;
+    if (!pindex->IsValid(BLOCK_VALID_TREE) || pindex->nStatus & BLOCK_HAVE_DATA || pindex->pprev == NULL || pindex->pprev->nStatus & BLOCK_HAVE_DATA)
+        return false;
+    std::list<BufferedBlock>::iterator it = lBlocksBuffered.insert(lBlocksBuffered.end(), {pblock, nodeid, GetTimeMicros(), nBytes});
+    mapBlocksBuffered.emplace(hash, it);
+    mapBlocksBufferedByPrev.emplace(pblock->hashPrevBlock, it);
+    nBlocksBufferedBytes += nBytes;
+    return true;
+}
+
+// Requires cs_main.
+// Take the next block to process out of the download buffer: a child of the most recent
+// entry of vParents that has one (entries without are popped), else one that has waited
+// too long for its parent. Returns NULL if there is none.
+std::shared_ptr<const CBlock> TakeBufferedBlock(std::vector<uint256>& vParents, int64_t nNow) {
+    std::list<BufferedBlock>::iterator it = lBlocksBuffered.end();
+    while (!vParents.empty() && it == lBlocksBuffered.end()) {
+        std::multimap<uint256, std::list<BufferedBlock>::iterator>::iterator itChild = mapBlocksBufferedByPrev.find(vParents.back());
+        if (itChild != mapBlocksBufferedByPrev.end())
+            it = itChild->second;
+        else
+            vParents.pop_back();
+    }
+    if (it == lBlocksBuffered.end()) {
+        if (lBlocksBuffered.empty() || lBlocksBuffered.front().nTime > nNow - 1000000 * (int64_t)BLOCK_DOWNLOAD_BUFFER_TIMEOUT)
+            return std::shared_ptr<const CBlock>();
+        it = lBlocksBuffered.begin();
+    }
+    std::shared_ptr<const CBlock> pblock = it->pblock;
+    const uint256 hash = pblock->GetHash();
+    std::pair<std::multimap<uint256, std::list<BufferedBlock>::iterator>::iterator,
+              std::multimap<uint256, std::list<BufferedBlock>::iterator>::iterator> range = mapBlocksBufferedByPrev.equal_range(pblock->hashPrevBlock);
+    for (std::multimap<uint256, std::list<BufferedBlock>::iterator>::iterator itPrev = range.first; itPrev != range.second; ++itPrev) {
+        if (itPrev->second == it) {
+            mapBlocksBufferedByPrev.erase(itPrev);
+            break;
+        }
+    }
+    mapBlocksBuffered.erase(hash);
+    // Its source is only known now that it goes to validation
+    mapBlockSource.emplace(hash, std::make_pair(it->nodeid, true));
+    nBlocksBufferedBytes -= it->nBytes;
+    lBlocksBuffered.erase(it);
+    return pblock;
+}
+
+/** Hand a block to ProcessNewBlock, followed by the buffered blocks that were waiting for
+ *  it (and theirs in turn) and those that waited too long. Must not hold cs_main. */
+void ProcessNewBlockAndBuffered(const CChainParams& chainparams, const std::shared_ptr<const CBlock>& pblock, bool fForceProcessing, bool *fNewBlock) {
+    ProcessNewBlock(chainparams, pblock, fForceProcessing, fNewBlock);
+    std::vector<uint256> vParents(1, pblock->GetHash());
+    while (true) {
+        std::shared_ptr<const CBlock> pblockNext;
+        {
+            LOCK(cs_main);
+            pblockNext = TakeBufferedBlock(vParents, GetTimeMicros());
+        }
+        if (!pblockNext)
+            break;
+        // We requested it, so process it even if it does not extend our best chain
+        ProcessNewBlock(chainparams, pblockNext, true, NULL);
+        vParents.push_back(pblockNext->GetHash());
+    }
+}
+
+// Requires cs_main.
+/** How many blocks we may have in flight from a peer at once. We aim for twice the
+ *  bandwidth-delay product of the peer, as measured by its block throughput and ping
+ *  time: as long as the number of blocks in flight is what limits the throughput, that
+ *  doubles the limit with every sample, until the link becomes the bottleneck. */
+int GetBlocksInTransitLimit(const CNodeState *state, const CNode *pnode) {
+    int64_t nPingUsec = pnode->nMinPingUsecTime;
+    if (state->dBlockBytesPerSec == 0 || dAvgBlockSize == 0 || nPingUsec <= 0 || nPingUsec == std::numeric_limits<int64_t>::max())
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    double dBytes = std::min<double>(2 * state->dBlockBytesPerSec * nPingUsec / 1000000.0, MAX_BLOCK_BYTES_IN_TRANSIT_PER_PEER);
+    double dBlocks = dBytes / dAvgBlockSize;
+    return std::max(MAX_BLOCKS_IN_TRANSIT_PER_PEER, (int)std::min<double>(dBlocks, MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE));
+}
+
+// Requires cs_main.
+/** How far ahead of the last block we have in common with a peer we fetch: at least
+ *  BLOCK_DOWNLOAD_WINDOW blocks, more when blocks are small. */
+int GetBlockDownloadWindow() {
+    if (dAvgBlockSize == 0)
+        return BLOCK_DOWNLOAD_WINDOW;
+    double dWindow = BLOCK_DOWNLOAD_WINDOW_BYTES / dAvgBlockSize;
+    return std::max<int>(BLOCK_DOWNLOAD_WINDOW, (int)std::min<double>(dWindow, MAX_BLOCK_DOWNLOAD_WINDOW));
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -416,12 +600,27 @@ void MaybeSetPeerAsAnnouncingHeaderAndIDs(NodeId nodeid, CConnman& connman) {
             uint64_t nCMPCTBLOCKVersion = (pfrom->GetLocalServices() & NODE_WITNESS) ? 2 : 1;
             if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
                 // As per BIP152, we only get 3 of our peers to announce
-                // blocks using compact encodings.
-                connman.ForNode(lNodesAnnouncingHeaderAndIDs.front(), [&connman, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion](CNode* pnodeStop){
+                // blocks using compact encodings. Make room by dropping the
+                // one furthest away (by minimum ping), so that blocks reach
+                // us, and stakers building on them, with the least latency.
+                std::list<NodeId>::iterator itStop = lNodesAnnouncingHeaderAndIDs.begin();
+                int64_t nMaxMinPing = -1;
+                for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+                    int64_t nMinPing = std::numeric_limits<int64_t>::max();
+                    connman.ForNode(*it, [&nMinPing](CNode* pnode){
+                        nMinPing = pnode->nMinPingUsecTime;
+                        return true;
+                    });
+                    if (nMinPing > nMaxMinPing) {
+                        nMaxMinPing = nMinPing;
+                        itStop = it;
+                    }
+                }
+                connman.ForNode(*itStop, [&connman, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion](CNode* pnodeStop){
                     connman.PushMessage(pnodeStop, CNetMsgMaker(pnodeStop->GetSendVersion()).Make(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion));
                     return true;
                 });
-                lNodesAnnouncingHeaderAndIDs.pop_front();
+                lNodesAnnouncingHeaderAndIDs.erase(itStop);
             }
             fAnnounceUsingCMPCTBLOCK = true;
             connman.PushMessage(pfrom, CNetMsgMaker(pfrom->GetSendVersion()).Make(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion));
@@ -447,28 +646,10 @@ bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex)
     return false;
 }
 
-/** Find the last common ancestor two blocks have.
- *  Both pa and pb must be non-NULL. */
-const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex* pb) {
-    if (pa->nHeight > pb->nHeight) {
-        pa = pa->GetAncestor(pb->nHeight);
-    } else if (pb->nHeight > pa->nHeight) {
-        pb = pb->GetAncestor(pa->nHeight);
-    }
-
-    while (pa != pb && pa && pb) {
-        pa = pa->pprev;
-        pb = pb->pprev;
-    }
-
-    // Eventually all chain branches meet at the genesis block.
-    assert(pa == pb);
-    return pa;
-}
-
-/** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
+/** Update pindexLastCommonBlock and add not-in-flight, not buffered missing successors to vBlocks,
+ *  until it has at most count entries. If the window holds nothing to fetch, nodeStaller and
+ *  pindexStaller are set to the peer and the block that hold it up. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStaller, const Consensus::Params& consensusParams) {
     if (count == 0)
         return;
 
@@ -498,12 +679,13 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
 
     std::vector<const CBlockIndex*> vToFetch;
     const CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
-    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // Never fetch further than the best block we know the peer has, or more than the block download window + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + GetBlockDownloadWindow();
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -532,6 +714,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksBuffered.count(pindex->GetBlockHash())) {
+                // Downloaded, waiting in memory for its parent.
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -539,6 +724,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStaller = pindexWaitingFor;
                     }
                     return;
                 }
@@ -549,6 +735,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -568,9 +755,20 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nCmpctBlocks = state->nCmpctBlocks;
+    stats.nCmpctBlocksReconstructed = state->nCmpctBlocksReconstructed;
+    stats.nCmpctTxnRequested = state->nCmpctTxnRequested;
+    stats.nTxInvSent = state->nTxInvSent;
+    stats.nTxInvSkipped = state->nTxInvSkipped;
     return true;
 }
 
+size_t GetOrphanMemoryUsage(size_t& nCount)
+{
+    nCount = orphanage.Size();
+    return orphanage.DynamicMemoryUsage();
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
@@ -589,7 +787,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// mapOrphanTransactions
+// Orphan and compact block extra transactions
 //
 
 void AddToCompactExtraTransactions(const CTransactionRef& tx)
@@ -603,107 +801,40 @@ void AddToCompactExtraTransactions(const CTransactionRef& tx)
     vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
 }
 
-bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    const uint256& hash = tx->GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 100 orphans, each of which is at most 99,999 bytes big is
-    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
-    unsigned int sz = GetTransactionWeight(*tx);
-    if (sz >= MAX_STANDARD_TX_WEIGHT)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
-    assert(ret.second);
-    BOOST_FOREACH(const CTxIn& txin, tx->vin) {
-        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
-    }
-
-    AddToCompactExtraTransactions(tx);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+void AddToCompactRecentBlocks(const CBlock& block) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return 0;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
-    {
-        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
+    size_t max_recent_blocks = GetArg("-blockreconstructionrecentblocks", DEFAULT_BLOCK_RECONSTRUCTION_RECENT_BLOCKS);
+    if (max_recent_blocks <= 0)
+        return;
+    std::vector<std::pair<uint256, CTransactionRef>> vtx;
+    vtx.reserve(block.vtx.size());
+    for (const CTransactionRef& tx : block.vtx) {
+        // The coinbase is always prefilled
+        if (tx->IsCoinBase())
             continue;
-        itPrev->second.erase(it);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
+        vtx.emplace_back(tx->GetWitnessHash(), tx);
     }
-    mapOrphanTransactions.erase(it);
-    return 1;
+    vRecentBlockTxnForCompact.push_back(std::move(vtx));
+    while (vRecentBlockTxnForCompact.size() > max_recent_blocks)
+        vRecentBlockTxnForCompact.pop_front();
 }
 
-void EraseOrphansFor(NodeId peer)
+/** All txn besides the mempool to try for compact block reconstruction */
+std::vector<std::pair<uint256, CTransactionRef>> GetCompactExtraTransactions() EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    int nErased = 0;
-    std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        std::map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer=%d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
-    int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
-        int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            std::map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
-            }
-        }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
-        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
-    }
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
+    size_t nSize = vExtraTxnForCompact.size();
+    for (const auto& vtx : vRecentBlockTxnForCompact)
+        nSize += vtx.size();
+    std::vector<std::pair<uint256, CTransactionRef>> extra_txn;
+    extra_txn.reserve(nSize);
+    for (const auto& entry : vExtraTxnForCompact) {
+        // Skip the slots of a ring buffer that has not filled up yet
+        if (entry.second)
+            extra_txn.push_back(entry);
+    }
+    for (const auto& vtx : vRecentBlockTxnForCompact)
+        extra_txn.insert(extra_txn.end(), vtx.begin(), vtx.end());
+    return extra_txn;
 }
 
 // Requires cs_main.
@@ -741,34 +872,30 @@ void Misbehaving(NodeId pnode, int howmuch)
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn) : connman(connmanIn) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    orphanage.SetLimits((unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS)),
+                        (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000);
 }
 
 void PeerLogicValidation::SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, int nPosInBlock) {
     if (nPosInBlock == CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK)
         return;
 
-    LOCK(cs_main);
-
-    std::vector<uint256> vOrphanErase;
-    // Which orphan pool entries must we evict?
-    for (size_t j = 0; j < tx.vin.size(); j++) {
-        auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
-        if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-            const CTransaction& orphanTx = *(*mi)->second.tx;
-            const uint256& orphanHash = orphanTx.GetHash();
-            vOrphanErase.push_back(orphanHash);
-        }
-    }
-
     // Erase orphan transactions include or precluded by this block
-    if (vOrphanErase.size()) {
-        int nErased = 0;
-        BOOST_FOREACH(uint256 &orphanHash, vOrphanErase) {
-            nErased += EraseOrphanTx(orphanHash);
-        }
+    int nErased = orphanage.EraseForBlockTx(tx);
+    if (nErased > 0)
         LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
-    }
+}
+
+void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex) {
+    LOCK(cs_main);
+    if (IsInitialBlockDownload())
+        return;
+    AddToCompactRecentBlocks(*pblock);
+}
+
+void PeerLogicValidation::BlockDisconnected(const std::shared_ptr<const CBlock>& pblock) {
+    LOCK(cs_main);
+    AddToCompactRecentBlocks(*pblock);
 }
 
 static CCriticalSection cs_most_recent_block;
@@ -797,23 +924,39 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         most_recent_compact_block = pcmpctblock;
     }
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
-        // TODO: Avoid the repeated-serialization here
+    // A block no peer gave us was staked here (or submitted over RPC). It
+    // must reach the network before its time window closes, so it goes to
+    // every peer that takes compact blocks, not just those that asked for
+    // high-bandwidth announcements, and to the closest ones first.
+    const bool fLocalBlock = !mapBlockSource.count(hashBlock);
+
+    std::vector<std::pair<int64_t, NodeId>> vAnnounceTo;
+    connman->ForEachNode([pindex, fWitnessEnabled, fLocalBlock, &vAnnounceTo](CNode* pnode) {
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
         CNodeState &state = *State(pnode->GetId());
         // If the peer has, or we announced to them the previous block already,
         // but we don't think they have this one, go ahead and announce it
-        if (state.fPreferHeaderAndIDs && (!fWitnessEnabled || state.fWantsCmpctWitness) &&
+        if ((state.fPreferHeaderAndIDs || (fLocalBlock && state.fProvidesHeaderAndIDs && state.fSupportsDesiredCmpctVersion)) &&
+                (!fWitnessEnabled || state.fWantsCmpctWitness) &&
                 !PeerHasHeader(&state, pindex) && PeerHasHeader(&state, pindex->pprev)) {
+            vAnnounceTo.push_back(std::make_pair(pnode->nMinPingUsecTime.load(), pnode->GetId()));
+        }
+    });
+    if (fLocalBlock)
+        std::sort(vAnnounceTo.begin(), vAnnounceTo.end());
 
+    for (const std::pair<int64_t, NodeId>& announce : vAnnounceTo) {
+        connman->ForNode(announce.second, [this, &pcmpctblock, pindex, &msgMaker, &hashBlock](CNode* pnode) {
+            // TODO: Avoid the repeated-serialization here
             LogPrint("net", "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->id);
             connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
-            state.pindexBestHeaderSent = pindex;
-        }
-    });
+            State(pnode->GetId())->pindexBestHeaderSent = pindex;
+            return true;
+        });
+    }
 }
 
 void PeerLogicValidation::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) {
@@ -904,12 +1047,14 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
-            // requesting or processing some txs which have already been included in a block
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
+            // requesting or processing some txs which have already been included in a block.
+            // Best effort: only the first two outputs are probed.
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+                   orphanage.HaveTx(inv.hash) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -921,11 +1066,37 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
 static void RelayTransaction(const CTransaction& tx, CConnman& connman)
 {
-    CInv inv(MSG_TX, tx.GetHash());
-    connman.ForEachNode([&inv](CNode* pnode)
-    {
-        pnode->PushInventory(inv);
+    // Peers pick it up from vTxAnnounceQueue on their next trickle
+    vTxAnnouncePending.push_back(tx.GetHash());
+}
+
+/** Move the pending relayed txn, sorted, to the announcement queue, and trim what all peers are past. Requires cs_main. */
+void static QueueTxAnnouncements(int64_t nNow)
+{
+    if (vTxAnnouncePending.empty() || nNow < nNextTxAnnounceBatch)
+        return;
+    nNextTxAnnounceBatch = nNow + INVENTORY_BROADCAST_BATCH_INTERVAL * 1000000;
+
+    std::sort(vTxAnnouncePending.begin(), vTxAnnouncePending.end());
+    vTxAnnouncePending.erase(std::unique(vTxAnnouncePending.begin(), vTxAnnouncePending.end()), vTxAnnouncePending.end());
+    // Topologically and fee-rate sort the inventory we send for privacy and
+    // priority reasons, once for all peers
+    std::sort(vTxAnnouncePending.begin(), vTxAnnouncePending.end(), [](const uint256& a, const uint256& b) {
+        return mempool.CompareDepthAndScore(a, b);
     });
+    vTxAnnounceQueue.insert(vTxAnnounceQueue.end(), vTxAnnouncePending.begin(), vTxAnnouncePending.end());
+    vTxAnnouncePending.clear();
+
+    // Drop the entries every peer is past. Beyond that, peers falling far
+    // behind lose the oldest entries rather than holding up the queue.
+    uint64_t nMinCursor = nTxAnnounceQueueStart + vTxAnnounceQueue.size();
+    for (const auto& entry : mapNodeState)
+        nMinCursor = std::min(nMinCursor, entry.second.nTxAnnounceCursor);
+    size_t nDrop = nMinCursor > nTxAnnounceQueueStart ? nMinCursor - nTxAnnounceQueueStart : 0;
+    if (vTxAnnounceQueue.size() - nDrop > MAX_INVENTORY_BROADCAST_QUEUE)
+        nDrop = vTxAnnounceQueue.size() - MAX_INVENTORY_BROADCAST_QUEUE;
+    vTxAnnounceQueue.erase(vTxAnnounceQueue.begin(), vTxAnnounceQueue.begin() + nDrop);
+    nTxAnnounceQueueStart += nDrop;
 }
 
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman& connman)
@@ -964,6 +1135,81 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman& connma
     connman.ForEachNodeThen(std::move(sortfunc), std::move(pushfunc));
 }
 
+/** Reply to a MSG_FILTERED_BLOCK request for block with a merkleblock and the matched transactions */
+static void SendMerkleBlock(CNode* pfrom, const CBlock& block, CConnman& connman)
+{
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    MerkleLevelsRef levels = GetBlockMerkleLevels(block);
+    bool sendMerkleBlock = false;
+    CMerkleBlock merkleBlock;
+    {
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter) {
+            sendMerkleBlock = true;
+            merkleBlock = CMerkleBlock(block, *pfrom->pfilter, *levels);
+        }
+    }
+    if (sendMerkleBlock) {
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+        // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+        // This avoids hurting performance by pointlessly requiring a round-trip
+        // Note that there is currently no way for a node to request any single transactions we didn't send here -
+        // they must either disconnect and retry or request the full block.
+        // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+        // however we MUST always provide at least what the remote peer needs
+        typedef std::pair<unsigned int, uint256> PairType;
+        // The transactions go in the class of the merkleblock, so nothing can be queued between them
+        BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+            connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]), GetSendPriority(NetMsgType::MERKLEBLOCK));
+    }
+    // else
+        // no response
+}
+
+/** Threads that read blocks and build merkleblocks for SPV peers, without cs_main */
+static CScheduler merkleBlockScheduler;
+static std::atomic<int> nMerkleBlockThreads(0);
+
+/**
+ * Serve a filtered block request on a merkleblock thread. The request holds
+ * a reference to pfrom, and its fGetDataPending keeps the peer's later
+ * requests from being answered before it.
+ */
+static void ServeMerkleBlock(CNode* pfrom, CDiskBlockPos pos, uint256 hashBlock, uint256 hashContinueInv, CConnman* connman)
+{
+    CBlock block;
+    // The block may have been pruned since the request was accepted
+    bool fRead = ReadBlockFromDisk(block, pos, Params().GetConsensus()) && block.GetHash() == hashBlock;
+    {
+        // Keep SendMessages from putting anything between the merkleblock
+        // and its transactions, which clients take as the end of the block
+        LOCK(pfrom->cs_sendProcessing);
+        if (fRead)
+            SendMerkleBlock(pfrom, block, *connman);
+        else
+            LogPrint("net", "%s: block %s is no longer available for peer=%d\n", __func__, hashBlock.ToString(), pfrom->GetId());
+
+        if (!hashContinueInv.IsNull()) {
+            // See ProcessGetData
+            std::vector<CInv> vInv;
+            vInv.push_back(CInv(MSG_BLOCK, hashContinueInv));
+            connman->PushMessage(pfrom, CNetMsgMaker(pfrom->GetSendVersion()).Make(NetMsgType::INV, vInv));
+        }
+    }
+
+    pfrom->fGetDataPending = false;
+    pfrom->Release();
+    connman->WakeMessageHandler();
+}
+
+void StartMerkleBlockThreads(boost::thread_group& threadGroup, int nThreads)
+{
+    CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &merkleBlockScheduler);
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "merkleblock", serviceLoop));
+    nMerkleBlockThreads = nThreads;
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -1032,42 +1278,40 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 }
                 // Pruned nodes may have deleted the block, so check whether
                 // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA) && inv.type == MSG_FILTERED_BLOCK && nMerkleBlockThreads > 0)
+                {
+                    // Read the block and filter it on a merkleblock thread, so
+                    // that neither cs_main nor this thread waits for it
+                    uint256 hashContinueInv;
+                    if (inv.hash == pfrom->hashContinue) {
+                        hashContinueInv = chainActive.Tip()->GetBlockHash();
+                        pfrom->hashContinue.SetNull();
+                    }
+                    pfrom->fGetDataPending = true;
+                    merkleBlockScheduler.schedule(boost::bind(&ServeMerkleBlock, pfrom->AddRef(), mi->second->GetBlockPos(), inv.hash, hashContinueInv, &connman),
+                                                  boost::chrono::system_clock::now(), CScheduler::PRIORITY_HIGH, "merkleblock");
+                }
+                else if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
+                    // Blocks well behind the tip go to peers syncing the
+                    // chain, after new blocks and transaction relay
+                    SendPriority nBlockPriority = mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH ? SEND_PRIORITY_HISTORICAL : SEND_PRIORITY_BLOCK;
+                    // Send block from disk. Full blocks go out as stored
+                    // when that is their wire form, without being parsed.
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    const int nBlockSendFlags = inv.type == MSG_BLOCK ? SERIALIZE_TRANSACTION_NO_WITNESS : 0;
+                    if ((inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK) && IsRawBlockSerialization(mi->second, nBlockSendFlags, consensusParams)) {
+                        std::vector<unsigned char> vchBlock;
+                        if (!ReadRawBlockFromDisk(vchBlock, (*mi).second, Params().MessageStart()))
+                            assert(!"cannot load block from disk");
+                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, CFlatData(vchBlock)), nBlockPriority);
+                    }
+                    else if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block));
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, block));
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+                        connman.PushMessage(pfrom, msgMaker.Make(nBlockSendFlags, NetMsgType::BLOCK, block), nBlockPriority);
                     else if (inv.type == MSG_FILTERED_BLOCK)
-                    {
-                        bool sendMerkleBlock = false;
-                        CMerkleBlock merkleBlock;
-                        {
-                            LOCK(pfrom->cs_filter);
-                            if (pfrom->pfilter) {
-                                sendMerkleBlock = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
-                            }
-                        }
-                        if (sendMerkleBlock) {
-                            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]));
-                        }
-                        // else
-                            // no response
-                    }
+                        SendMerkleBlock(pfrom, block, connman);
                     else if (inv.type == MSG_CMPCT_BLOCK)
                     {
                         // If a peer is asking for old blocks, we're almost guaranteed
@@ -1080,7 +1324,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
                             connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
                         } else
-                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block));
+                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block), nBlockPriority);
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -1088,10 +1332,11 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
-                        // wait for other stuff first.
+                        // wait for other stuff first. In the class of the block,
+                        // so it cannot overtake it.
                         std::vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv), nBlockPriority);
                         pfrom->hashContinue.SetNull();
                     }
                 }
@@ -1717,45 +1962,40 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         uint256 hashStop;
         vRecv >> locator >> hashStop;
         DbgMsg("getHeaders");
-        LOCK(cs_main);
         if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
             LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
             return true;
         }
 
-        CNodeState *nodestate = State(pfrom->GetId());
+        // Serve the headers from a snapshot of the active chain, so this
+        // does not wait for cs_main while blocks are being connected
+        ChainSnapshotRef chain = GetChainSnapshot();
         const CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
+            pindex = LookupBlockIndex(hashStop);
+            if (!pindex)
                 return true;
-            pindex = (*mi).second;
         }
         else
         {
             // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
+            pindex = FindForkInSnapshot(*chain, locator);
             if (pindex)
-                pindex = chainActive.Next(pindex);
+                pindex = chain->Next(pindex);
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        std::vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.IsNull() ? "end" : hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
-        {
-            CBlockHeader header = pindex->GetBlockHeader();
-            vHeaders.push_back(header);
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
-        }
-        // pindex can be NULL either if we sent chainActive.Tip() OR
-        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // The headers are copied from the cache of serialized chunks of the chain
+        CSerializedNetMsg msgHeaders;
+        msgHeaders.command = NetMsgType::HEADERS;
+        const CBlockIndex* pindexLast = headersCache.WriteHeaders(*chain, pindex, hashStop.IsNull() ? NULL : LookupBlockIndex(hashStop), MAX_HEADERS_RESULTS, msgHeaders.data);
+        pindex = chain->Contains(pindexLast) ? pindexLast : NULL;
+        // pindex can be NULL either if we sent the snapshot's tip OR
+        // if our peer has it (and thus we are sending an empty
         // headers message). In both cases it's safe to update
-        // pindexBestHeaderSent to be our tip.
+        // pindexBestHeaderSent to be that tip.
         //
         // It is important that we simply reset the BestHeaderSent value here,
         // and not max(BestHeaderSent, newHeaderSent). We might have announced
@@ -1764,8 +2004,11 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         // without the new block. By resetting the BestHeaderSent, we ensure we
         // will re-announce the new block via headers (or compact blocks again)
         // in the SendMessages logic.
-        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
+        {
+            LOCK(cs_main);
+            State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chain->Tip();
+        }
+        connman.PushMessage(pfrom, std::move(msgHeaders));
     }
 
 
@@ -1779,10 +2022,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             return true;
         }
 
-        std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
         CTransactionRef ptx;
         vRecv >> ptx;
+        // Share the copy a wallet or the orphan pool may already hold
+        ptx = InternTransaction(ptx);
         const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
@@ -1801,9 +2044,6 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs, &lRemovedTxn)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx, connman);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
 
             pfrom->nLastTXTime = GetTime();
 
@@ -1812,66 +2052,9 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
-                    const CTransaction& orphanTx = *porphanTx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2, &lRemovedTxn)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for witness transactions or
-                            // witness-stripped transactions, as they can have been malleated.
-                            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Orphans that depended on this one are reconsidered one at a
+            // time from ProcessMessages, in between this peer's messages
+            orphanage.AddChildrenToWorkSet(tx, pfrom->GetId());
         }
         else if (fMissingInputs)
         {
@@ -1889,13 +2072,13 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                     pfrom->AddInventoryKnown(_inv);
                     if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
                 }
-                AddOrphanTx(ptx, pfrom->GetId());
+                if (orphanage.AddTx(ptx, pfrom->GetId()))
+                    AddToCompactExtraTransactions(ptx);
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                // DoS prevention: do not allow the orphan pool to grow unbounded
+                unsigned int nEvicted = orphanage.LimitOrphans();
                 if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+                    LogPrint("mempool", "orphan pool overflow, removed %u tx\n", nEvicted);
             } else {
                 LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
                 // We will continue to reject this tx since it has rejected
@@ -2054,7 +2237,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 }
 
                 PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                ReadStatus status = partialBlock.InitData(cmpctblock, GetCompactExtraTransactions());
                 if (status == READ_STATUS_INVALID) {
                     MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
                     Misbehaving(pfrom->GetId(), 100);
@@ -2073,7 +2256,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                     if (!partialBlock.IsTxAvailable(i))
                         req.indexes.push_back(i);
                 }
+                nodestate->nCmpctBlocks++;
+                nodestate->nCmpctTxnRequested += req.indexes.size();
                 if (req.indexes.empty()) {
+                    nodestate->nCmpctBlocksReconstructed++;
                     // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
                     BlockTransactions txn;
                     txn.blockhash = cmpctblock.header.GetHash();
@@ -2090,14 +2276,16 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 // Optimistically try to reconstruct anyway since we might be
                 // able to without any round trips.
                 PartiallyDownloadedBlock tempBlock(&mempool);
-                ReadStatus status = tempBlock.InitData(cmpctblock, vExtraTxnForCompact);
+                ReadStatus status = tempBlock.InitData(cmpctblock, GetCompactExtraTransactions());
                 if (status != READ_STATUS_OK) {
                     // TODO: don't ignore failures
                     return true;
                 }
+                nodestate->nCmpctBlocks++;
                 std::vector<CTransactionRef> dummy;
                 status = tempBlock.FillBlock(*pblock, dummy);
                 if (status == READ_STATUS_OK) {
+                    nodestate->nCmpctBlocksReconstructed++;
                     fBlockReconstructed = true;
                 }
             }
@@ -2134,7 +2322,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 mapBlockSource.emplace(pblock->GetHash(), std::make_pair(pfrom->GetId(), false));
             }
             bool fNewBlock = false;
-            ProcessNewBlock(chainparams, pblock, true, &fNewBlock);
+            ProcessNewBlockAndBuffered(chainparams, pblock, true, &fNewBlock);
             if (fNewBlock)
                 pfrom->nLastBlockTime = GetTime();
 
@@ -2211,7 +2399,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             bool fNewBlock = false;
             // Since we requested this block (it was in mapBlocksInFlight), force it to be processed,
             // even if it would not be a candidate for new tip (missing previous block, chain not long enough, etc)
-            ProcessNewBlock(chainparams, pblock, true, &fNewBlock);
+            ProcessNewBlockAndBuffered(chainparams, pblock, true, &fNewBlock);
             if (fNewBlock)
                 pfrom->nLastBlockTime = GetTime();
         }
@@ -2323,8 +2511,9 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         if (fCanDirectFetch && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
             std::vector<const CBlockIndex*> vToFetch;
             const CBlockIndex *pindexWalk = pindexLast;
+            const int nMaxInFlight = GetBlocksInTransitLimit(nodestate, pfrom);
             // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
-            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (size_t)nMaxInFlight) {
                 if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
                         !mapBlocksInFlight.count(pindexWalk->GetBlockHash()) &&
                         (!IsWitnessEnabled(pindexWalk->pprev, chainparams.GetConsensus()) || State(pfrom->GetId())->fHaveWitness)) {
@@ -2345,7 +2534,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 std::vector<CInv> vGetData;
                 // Download as much as possible, from earliest to latest.
                 BOOST_REVERSE_FOREACH(const CBlockIndex *pindex, vToFetch) {
-                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    if (nodestate->nBlocksInFlight >= nMaxInFlight) {
                         // Can't download any more from this peer
                         break;
                     }
@@ -2373,8 +2562,9 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        const size_t nBlockSize = vRecv.size();
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-        vRecv >> *pblock;
+        WithArena(&vRecv) >> *pblock;
 
         LogPrint("net", "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->id);
 
@@ -2388,13 +2578,19 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             LOCK(cs_main);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
-            forceProcessing |= MarkBlockAsReceived(hash);
+            bool fRequested = MarkBlockAsReceived(hash, pfrom->GetId(), nBlockSize);
+            forceProcessing |= fRequested;
+            // A requested block that arrived ahead of its parent waits for it in memory.
+            if (fRequested && BufferBlock(pblock, pfrom->GetId(), nBlockSize)) {
+                LogPrint("net", "buffered block %s until its parent arrives peer=%d\n", hash.ToString(), pfrom->id);
+                return true;
+            }
             // mapBlockSource is only used for sending reject messages and DoS scores,
             // so the race between here and cs_main in ProcessNewBlock is fine.
             mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
         }
         bool fNewBlock = false;
-        ProcessNewBlock(chainparams, pblock, forceProcessing, &fNewBlock);
+        ProcessNewBlockAndBuffered(chainparams, pblock, forceProcessing, &fNewBlock);
         if (fNewBlock)
             pfrom->nLastBlockTime = GetTime();
     }
@@ -2420,7 +2616,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman.GetAddresses();
         FastRandomContext insecure_rand;
         BOOST_FOREACH(const CAddress &addr, vAddr)
@@ -2642,6 +2841,62 @@ static bool SendRejectsAndCheckIfBanned(CNode* pnode, CConnman& connman)
     return false;
 }
 
+/**
+ * Reconsider one orphan queued on behalf of pfrom after one of its parents
+ * was accepted. Long chains of orphans are worked through a step at a time
+ * in between other messages, instead of all at once while holding cs_main.
+ */
+void static ProcessOrphanTx(CNode* pfrom, CConnman& connman)
+{
+    LOCK(cs_main);
+
+    NodeId fromPeer = -1;
+    CTransactionRef porphanTx = orphanage.GetTxToReconsider(pfrom->GetId(), fromPeer);
+    if (!porphanTx)
+        return;
+    const CTransaction& orphanTx = *porphanTx;
+    const uint256& orphanHash = orphanTx.GetHash();
+
+    bool fMissingInputs2 = false;
+    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+    // anyone relaying LegitTxX banned)
+    CValidationState stateDummy;
+    std::list<CTransactionRef> lRemovedTxn;
+
+    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs2, &lRemovedTxn)) {
+        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+        RelayTransaction(orphanTx, connman);
+        orphanage.AddChildrenToWorkSet(orphanTx, pfrom->GetId());
+        orphanage.EraseTx(orphanHash);
+    }
+    else if (!fMissingInputs2)
+    {
+        int nDos = 0;
+        if (stateDummy.IsInvalid(nDos) && nDos > 0)
+        {
+            // Punish peer that gave us an invalid orphan tx
+            Misbehaving(fromPeer, nDos);
+            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+        }
+        // Has inputs but not accepted to mempool
+        // Probably non-standard or insufficient fee/priority
+        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+        if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
+            // Do not use rejection cache for witness transactions or
+            // witness-stripped transactions, as they can have been malleated.
+            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        orphanage.EraseTx(orphanHash);
+    }
+    mempool.check(pcoinsTip);
+
+    for (const CTransactionRef& removedTx : lRemovedTxn)
+        AddToCompactExtraTransactions(removedTx);
+}
+
 bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     const CChainParams& chainparams = Params();
@@ -2655,6 +2910,10 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
     //
     bool fMoreWork = false;
 
+    // A merkleblock thread is answering an earlier request; it wakes us when done
+    if (pfrom->fGetDataPending)
+        return false;
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus(), connman, interruptMsgProc);
 
@@ -2664,6 +2923,12 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return true;
 
+    if (orphanage.HaveTxToReconsider(pfrom->GetId())) {
+        ProcessOrphanTx(pfrom, connman);
+        // this keeps the orphan work set from growing unbounded
+        if (orphanage.HaveTxToReconsider(pfrom->GetId())) return true;
+    }
+
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->fPauseSend)
             return false;
@@ -2714,13 +2979,14 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
         }
 
         // Process message
+        TRACE4(net, inbound_message, pfrom->GetId(), strCommand.c_str(), nMessageSize, msg.nTime);
         bool fRet = false;
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc);
             if (interruptMsgProc)
                 return false;
-            if (!pfrom->vRecvGetData.empty())
+            if (!pfrom->vRecvGetData.empty() || orphanage.HaveTxToReconsider(pfrom->GetId()))
                 fMoreWork = true;
         }
         catch (const std::ios_base::failure& e)
@@ -2840,6 +3106,7 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -3065,8 +3332,12 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
 
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
+                QueueTxAnnouncements(nNow);
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) {
+                    pto->setInventoryTxToSend.clear();
+                    state.nTxAnnounceCursor = nTxAnnounceQueueStart + vTxAnnounceQueue.size();
+                }
             }
 
             // Respond to BIP35 mempool requests
@@ -3090,7 +3361,7 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                             continue;
                     }
                     if (pto->pfilter) {
-                        if (!pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                        if (!pto->pfilter->IsRelevantAndUpdate(*GetBloomTxElements(*txinfo.tx))) continue;
                     }
                     pto->filterInventoryKnown.insert(hash);
                     vInv.push_back(inv);
@@ -3104,49 +3375,34 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
+                auto announce = [&](const uint256& hash) {
                     // Check if not in the filter already
                     if (pto->filterInventoryKnown.contains(hash)) {
-                        continue;
+                        state.nTxInvSkipped++;
+                        return;
                     }
                     // Not in the mempool anymore? don't bother sending it.
                     auto txinfo = mempool.info(hash);
                     if (!txinfo.tx) {
-                        continue;
+                        return;
                     }
                     if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
-                        continue;
+                        return;
                     }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*GetBloomTxElements(*txinfo.tx))) return;
                     // Send
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
+                    state.nTxInvSent++;
                     {
                         // Expire old relay messages
                         while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
@@ -3165,6 +3421,38 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                         vInv.clear();
                     }
                     pto->filterInventoryKnown.insert(hash);
+                };
+
+                // Txn pushed to this peer alone, from the wallet or RPC, go first
+                if (!pto->setInventoryTxToSend.empty()) {
+                    // Produce a vector with all candidates for sending
+                    std::vector<std::set<uint256>::iterator> vInvTx;
+                    vInvTx.reserve(pto->setInventoryTxToSend.size());
+                    for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
+                        vInvTx.push_back(it);
+                    }
+                    // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
+                    // A heap is used so that not all items need sorting if only a few are being sent.
+                    CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
+                    std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                    while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                        // Fetch the top element from the heap
+                        std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                        std::set<uint256>::iterator it = vInvTx.back();
+                        vInvTx.pop_back();
+                        uint256 hash = *it;
+                        // Remove it from the to-be-sent set
+                        pto->setInventoryTxToSend.erase(it);
+                        announce(hash);
+                    }
+                }
+
+                // Then the relayed txn this peer has not seen announced yet
+                if (state.nTxAnnounceCursor < nTxAnnounceQueueStart)
+                    state.nTxAnnounceCursor = nTxAnnounceQueueStart;
+                const uint64_t nQueueEnd = nTxAnnounceQueueStart + vTxAnnounceQueue.size();
+                while (state.nTxAnnounceCursor < nQueueEnd && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                    announce(vTxAnnounceQueue[state.nTxAnnounceCursor++ - nTxAnnounceQueueStart]);
                 }
             }
         }
@@ -3200,10 +3488,12 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        const int nMaxInFlight = GetBlocksInTransitLimit(&state, pto);
+        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nMaxInFlight) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStaller = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nMaxInFlight - state.nBlocksInFlight, vToDownload, staller, pindexStaller, consensusParams);
             BOOST_FOREACH(const CBlockIndex *pindex, vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -3212,9 +3502,19 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState *stateStaller = State(staller);
+                if (stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
+                } else if (stateStaller->nStallingSince < nNow - BLOCK_STALLING_REASSIGN_TIMEOUT && !pto->fInbound &&
+                           state.dBlockBytesPerSec > stateStaller->dBlockBytesPerSec) {
+                    // We are idle and have been faster than the peer holding up the window, so take over
+                    // the block it is stuck on rather than waiting to disconnect it. This also ends its stall.
+                    uint32_t nFetchFlags = GetFetchFlags(pto, pindexStaller->pprev, consensusParams);
+                    vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindexStaller->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStaller->GetBlockHash(), consensusParams, pindexStaller);
+                    LogPrint("net", "Reassigning block %s (%d) from stalling peer=%d to peer=%d\n", pindexStaller->GetBlockHash().ToString(),
+                        pindexStaller->nHeight, staller, pto->id);
                 }
             }
         }
@@ -3282,7 +3582,6 @@ public:
     CNetProcessingCleanup() {}
     ~CNetProcessingCleanup() {
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanage.Clear();
     }
 } instance_of_cnetprocessingcleanup;
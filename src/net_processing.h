@@ -7,16 +7,20 @@
 #define BITCOIN_NET_PROCESSING_H
 
 #include "net.h"
+#include "txorphanage.h"
 #include "validationinterface.h"
 
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
-/** Expiration time for orphan transactions in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
-/** Minimum time between orphan transactions expire time checks in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Default for -maxorphantxsize, maximum total size in kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 5000;
 /** Default number of orphan+recently-replaced txn to keep around for block reconstruction */
 static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
+/** Default number of recently connected or disconnected blocks whose txn are kept around for block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_RECENT_BLOCKS = 3;
+
+/** Default for -merkleblockthreads, threads building merkleblocks for SPV peers; 0 builds them under cs_main */
+static const int DEFAULT_MERKLEBLOCK_THREADS = 2;
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -34,6 +38,8 @@ public:
     virtual void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload);
     virtual void BlockChecked(const CBlock& block, const CValidationState& state);
     virtual void NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock);
+    virtual void BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex *pindex);
+    virtual void BlockDisconnected(const std::shared_ptr<const CBlock>& pblock);
 };
 
 struct CNodeStateStats {
@@ -41,12 +47,22 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    uint64_t nCmpctBlocks;
+    uint64_t nCmpctBlocksReconstructed;
+    uint64_t nCmpctTxnRequested;
+    uint64_t nTxInvSent;
+    uint64_t nTxInvSkipped;
 };
 
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
+/** Number of orphan transactions held, and the memory they use */
+size_t GetOrphanMemoryUsage(size_t& nCount);
+
+/** Start the threads that serve filtered block requests */
+void StartMerkleBlockThreads(boost::thread_group& threadGroup, int nThreads);
 
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& interrupt);
@@ -0,0 +1,124 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notifypipe.h"
+
+#include "util.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+namespace {
+
+std::mutex mutexNotifyPipe;
+std::condition_variable condNotifyPipe;
+//! Lines waiting to be written, protected by mutexNotifyPipe
+std::vector<std::string> vNotifyQueue;
+//! Lines dropped since the last write, protected by mutexNotifyPipe
+size_t nNotifyDropped = 0;
+//! Whether lines are accepted, protected by mutexNotifyPipe
+bool fNotifyRunning = false;
+bool fNotifyStop = false;
+
+FILE* pipeNotify = NULL;
+std::thread threadNotifyPipe;
+
+void ThreadNotifyPipe()
+{
+    RenameThread("bitcoin-notifypipe");
+    std::vector<std::string> vLines;
+    while (true) {
+        size_t nDropped;
+        bool fStop;
+        {
+            std::unique_lock<std::mutex> lock(mutexNotifyPipe);
+            condNotifyPipe.wait(lock, []{ return fNotifyStop || !vNotifyQueue.empty() || nNotifyDropped > 0; });
+            vLines.swap(vNotifyQueue);
+            nDropped = nNotifyDropped;
+            nNotifyDropped = 0;
+            fStop = fNotifyStop;
+        }
+
+        // Everything that piled up while the last batch was written goes out in one write
+        std::string strBatch;
+        for (const std::string& strLine : vLines)
+            strBatch += strLine + "\n";
+        if (nDropped > 0)
+            strBatch += strprintf("dropped %u\n", nDropped);
+        vLines.clear();
+        if (!strBatch.empty() && (fwrite(strBatch.data(), 1, strBatch.size(), pipeNotify) != strBatch.size() || fflush(pipeNotify) != 0)) {
+            LogPrintf("%s: writing to -notifypipe command failed, no more events will be sent to it\n", __func__);
+            std::lock_guard<std::mutex> lock(mutexNotifyPipe);
+            fNotifyRunning = false;
+            vNotifyQueue.clear();
+            nNotifyDropped = 0;
+            return;
+        }
+        if (fStop)
+            return;
+    }
+}
+
+} // anon namespace
+
+bool StartNotifyPipe(const std::string& strCommand)
+{
+    assert(pipeNotify == NULL);
+    pipeNotify = popen(strCommand.c_str(), "w");
+    if (pipeNotify == NULL)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(mutexNotifyPipe);
+        fNotifyRunning = true;
+        fNotifyStop = false;
+    }
+    threadNotifyPipe = std::thread(ThreadNotifyPipe);
+    return true;
+}
+
+void StopNotifyPipe()
+{
+    if (pipeNotify == NULL)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutexNotifyPipe);
+        fNotifyStop = true;
+    }
+    condNotifyPipe.notify_one();
+    threadNotifyPipe.join();
+    {
+        std::lock_guard<std::mutex> lock(mutexNotifyPipe);
+        fNotifyRunning = false;
+        vNotifyQueue.clear();
+    }
+    // Closing its input tells the command to finish
+    int nErr = pclose(pipeNotify);
+    if (nErr)
+        LogPrintf("%s: -notifypipe command returned %d\n", __func__, nErr);
+    pipeNotify = NULL;
+}
+
+void PushNotifyPipe(const std::string& strLine)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexNotifyPipe);
+        if (!fNotifyRunning)
+            return;
+        if (vNotifyQueue.size() >= MAX_NOTIFY_PIPE_QUEUE)
+            nNotifyDropped++;
+        else
+            vNotifyQueue.push_back(strLine);
+    }
+    condNotifyPipe.notify_one();
+}
@@ -0,0 +1,31 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NOTIFYPIPE_H
+#define BITCOIN_NOTIFYPIPE_H
+
+#include <string>
+
+/** Most event lines queued for the -notifypipe command before new ones are dropped */
+static const size_t MAX_NOTIFY_PIPE_QUEUE = 100000;
+
+/**
+ * -notifypipe: a single long-lived command that gets events written to its
+ * standard input, one per line, instead of a process per event as with
+ * -blocknotify and -walletnotify. Lines are queued and written in batches
+ * by a background thread, so a slow reader never holds up the caller; if
+ * MAX_NOTIFY_PIPE_QUEUE lines are waiting, further ones are dropped and a
+ * "dropped <n>" line tells the reader how many.
+ */
+
+/** Start strCommand and the thread that writes to it. Returns false if it could not be started. */
+bool StartNotifyPipe(const std::string& strCommand);
+
+/** Write out what is queued, close the pipe and wait for the command to exit */
+void StopNotifyPipe();
+
+/** Queue an event line (without newline) for the command, if one is running */
+void PushNotifyPipe(const std::string& strLine);
+
+#endif // BITCOIN_NOTIFYPIPE_H
@@ -14,40 +14,58 @@
 #include "util.h"
 
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay)
+                                unsigned int _maxConfirms, double _decay)
 {
     decay = _decay;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
-    }
+    scale = 1;
+    maxConfirms = _maxConfirms;
+    buckets = defaultBuckets;
+    confAvg.assign(maxConfirms * buckets.size(), 0);
+    txCtAvg.assign(buckets.size(), 0);
+    avg.assign(buckets.size(), 0);
+    ResizeUnconfirmed();
+}
+
+void TxConfirmStats::ResizeUnconfirmed()
+{
+    unconfTxs.assign(maxConfirms * buckets.size(), 0);
+    oldUnconfTxs.assign(buckets.size(), 0);
+}
 
-    oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
-    txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-    avg.resize(buckets.size());
+unsigned int TxConfirmStats::FindBucket(double val) const
+{
+    std::vector<double>::const_iterator it = std::lower_bound(buckets.begin(), buckets.end(), val);
+    if (it == buckets.end())
+        return buckets.size() - 1;
+    return it - buckets.begin();
+}
+
+void TxConfirmStats::Rescale()
+{
+    double invScale = 1 / scale;
+    for (double& val : confAvg)
+        val *= invScale;
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        avg[j] *= invScale;
+        txCtAvg[j] *= invScale;
+    }
+    scale = 1;
 }
 
-// Zero out the data for the current block
+// Start counting for the new block
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        oldUnconfTxs[j] += unconfTxs[blockIndex * buckets.size() + j];
+        unconfTxs[blockIndex * buckets.size() + j] = 0;
     }
+
+    // Growing the weight of everything recorded from now on is the same as
+    // decaying everything recorded so far
+    scale /= decay;
+    if (scale > 1e100)
+        Rescale();
 }
 
 
@@ -56,22 +74,12 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
-    curBlockTxCt[bucketindex]++;
-    curBlockVal[bucketindex] += val;
-}
-
-void TxConfirmStats::UpdateMovingAverages()
-{
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
-        avg[j] = avg[j] * decay + curBlockVal[j];
-        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+    unsigned int bucketindex = FindBucket(val);
+    for (size_t i = blocksToConfirm; i <= maxConfirms; i++) {
+        confAvg[(i - 1) * buckets.size() + bucketindex] += scale;
     }
+    txCtAvg[bucketindex] += scale;
+    avg[bucketindex] += val * scale;
 }
 
 // returns -1 on error conditions
@@ -104,15 +112,15 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
+    double invScale = 1 / scale;
 
     // Start counting from highest(default) or lowest feerate transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
+        nConf += confAvg[(confTarget - 1) * buckets.size() + bucket] * invScale;
+        totalNum += txCtAvg[bucket] * invScale;
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
+            extraNum += unconfTxs[((nBlockHeight - confct) % maxConfirms) * buckets.size() + bucket];
         extraNum += oldUnconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
@@ -175,11 +183,25 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout)
 {
+    // The file holds the averages themselves, in per-target rows
+    double invScale = 1 / scale;
+    std::vector<double> fileAvg(avg.size());
+    std::vector<double> fileTxCtAvg(txCtAvg.size());
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        fileAvg[j] = avg[j] * invScale;
+        fileTxCtAvg[j] = txCtAvg[j] * invScale;
+    }
+    std::vector<std::vector<double> > fileConfAvg(maxConfirms, std::vector<double>(buckets.size()));
+    for (unsigned int i = 0; i < maxConfirms; i++) {
+        for (unsigned int j = 0; j < buckets.size(); j++)
+            fileConfAvg[i][j] = confAvg[i * buckets.size() + j] * invScale;
+    }
+
     fileout << decay;
     fileout << buckets;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
+    fileout << fileAvg;
+    fileout << fileTxCtAvg;
+    fileout << fileConfAvg;
 }
 
 void TxConfirmStats::Read(CAutoFile& filein)
@@ -217,29 +239,19 @@ void TxConfirmStats::Read(CAutoFile& filein)
     // Now that we've processed the entire feerate estimate data file and not
     // thrown any errors, we can copy it to our data structures
     decay = fileDecay;
+    scale = 1;
     buckets = fileBuckets;
     avg = fileAvg;
-    confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
-
-    // Resize the current block variables which aren't stored in the data file
-    // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
-    unconfTxs.resize(maxConfirms);
+    this->maxConfirms = maxConfirms;
+    confAvg.resize(maxConfirms * numBuckets);
     for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
+        std::copy(fileConfAvg[i].begin(), fileConfAvg[i].end(), confAvg.begin() + i * numBuckets);
     }
-    oldUnconfTxs.resize(buckets.size());
 
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    // Resize the mempool counts which aren't stored in the data file
+    // to match the number of confirms and buckets
+    ResizeUnconfirmed();
 
     LogPrint("estimatefee", "Reading estimates: %u buckets counting confirms up to %u blocks\n",
              numBuckets, maxConfirms);
@@ -247,9 +259,9 @@ void TxConfirmStats::Read(CAutoFile& filein)
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
+    unsigned int bucketindex = FindBucket(val);
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
+    unconfTxs[blockIndex * buckets.size() + bucketindex]++;
     return bucketindex;
 }
 
@@ -264,7 +276,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)maxConfirms) {
         if (oldUnconfTxs[bucketindex] > 0)
             oldUnconfTxs[bucketindex]--;
         else
@@ -272,9 +284,9 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
                      bucketindex);
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int blockIndex = entryHeight % maxConfirms;
+        if (unconfTxs[blockIndex * buckets.size() + bucketindex] > 0)
+            unconfTxs[blockIndex * buckets.size() + bucketindex]--;
         else
             LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
@@ -288,6 +300,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
 // of no harm to try to remove them again.
 bool CBlockPolicyEstimator::removeTx(uint256 hash)
 {
+    LOCK(cs);
     std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
     if (pos != mapMemPoolTxs.end()) {
         feeStats.removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
@@ -299,7 +312,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash)
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0), trackedTxs(0), untrackedTxs(0)
+    : nBestSeenHeight(0), trackedTxs(0), untrackedTxs(0), fJournalOverflow(false)
 {
     static_assert(MIN_FEERATE > 0, "Min feerate must be nonzero");
     minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
@@ -313,6 +326,7 @@ CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
 
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool validFeeEstimate)
 {
+    LOCK(cs);
     unsigned int txHeight = entry.GetHeight();
     uint256 hash = entry.GetTx().GetHash();
     if (mapMemPoolTxs.count(hash)) {
@@ -344,8 +358,9 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
 }
 
-bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry)
+bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry, CFeeEstimatorBlock& block)
 {
+    LOCK(cs);
     if (!removeTx(entry->GetTx().GetHash())) {
         // This transaction wasn't being tracked for fee estimation
         return false;
@@ -366,12 +381,23 @@ bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
     CFeeRate feeRate(entry->GetFee(), entry->GetTxSize());
 
     feeStats.Record(blocksToConfirm, (double)feeRate.GetFeePerK());
+    block.vConfirmed.push_back(std::make_pair(blocksToConfirm, (double)feeRate.GetFeePerK()));
     return true;
 }
 
+void CBlockPolicyEstimator::ApplyBlock(const CFeeEstimatorBlock& block)
+{
+    nBestSeenHeight = block.nHeight;
+    feeStats.ClearCurrent(block.nHeight);
+    for (const std::pair<int, double>& confirmed : block.vConfirmed) {
+        feeStats.Record(confirmed.first, confirmed.second);
+    }
+}
+
 void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
                                          std::vector<const CTxMemPoolEntry*>& entries)
 {
+    LOCK(cs);
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
         // they don't affect the estimate.
@@ -386,18 +412,25 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     // of unconfirmed txs to remove from tracking.
     nBestSeenHeight = nBlockHeight;
 
-    // Clear the current block state and update unconfirmed circular buffer
+    // Decay the moving averages and update unconfirmed circular buffer
     feeStats.ClearCurrent(nBlockHeight);
 
+    CFeeEstimatorBlock block;
+    block.nHeight = nBlockHeight;
     unsigned int countedTxs = 0;
-    // Repopulate the current block states
     for (unsigned int i = 0; i < entries.size(); i++) {
-        if (processBlockTx(nBlockHeight, entries[i]))
+        if (processBlockTx(nBlockHeight, entries[i], block))
             countedTxs++;
     }
 
-    // Update all exponential averages with the current block state
-    feeStats.UpdateMovingAverages();
+    if (!fJournalOverflow) {
+        if (vJournal.size() < FEE_JOURNAL_MAX_BLOCKS) {
+            vJournal.push_back(std::move(block));
+        } else {
+            vJournal.clear();
+            fJournalOverflow = true;
+        }
+    }
 
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u of %u txs in block, since last block %u of %u tracked, new mempool map size %u\n",
              countedTxs, entries.size(), trackedTxs, trackedTxs + untrackedTxs, mapMemPoolTxs.size());
@@ -408,6 +441,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
+    LOCK(cs);
     // Return failure if trying to analyze a target we're not tracking
     // It's not possible to get reasonable estimates for confTarget of 1
     if (confTarget <= 1 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
@@ -423,6 +457,10 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    // Taken before our lock, which is never held while taking the mempool's
+    CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
+
+    LOCK(cs);
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
@@ -442,7 +480,6 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
         *answerFoundAtTarget = confTarget - 1;
 
     // If mempool is limiting txs , return at least the min feerate from the mempool
-    CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
     if (minPoolFee > 0 && minPoolFee > median)
         return CFeeRate(minPoolFee);
 
@@ -472,12 +509,16 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
 
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
 {
+    LOCK(cs);
     fileout << nBestSeenHeight;
     feeStats.Write(fileout);
+    vJournal.clear();
+    fJournalOverflow = false;
 }
 
 void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
 {
+    LOCK(cs);
     int nFileBestSeenHeight;
     filein >> nFileBestSeenHeight;
     feeStats.Read(filein);
@@ -488,6 +529,39 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
     }
 }
 
+bool CBlockPolicyEstimator::TakeJournal(std::vector<CFeeEstimatorBlock>& vBlocks)
+{
+    LOCK(cs);
+    if (fJournalOverflow)
+        return false;
+    vBlocks.swap(vJournal);
+    vJournal.clear();
+    return true;
+}
+
+void CBlockPolicyEstimator::ReadJournal(CAutoFile& filein)
+{
+    LOCK(cs);
+    unsigned int nBlocks = 0;
+    try {
+        while (true) {
+            std::vector<CFeeEstimatorBlock> vBlocks;
+            filein >> vBlocks;
+            for (const CFeeEstimatorBlock& block : vBlocks) {
+                // Blocks from before the last full write may still be in
+                // the journal if it could not be truncated
+                if (block.nHeight <= nBestSeenHeight)
+                    continue;
+                ApplyBlock(block);
+                nBlocks++;
+            }
+        }
+    } catch (const std::exception&) {
+        // End of file, or an append cut short
+    }
+    LogPrint("estimatefee", "Replayed %u blocks from the fee estimates journal\n", nBlocks);
+}
+
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
 {
     CAmount minFeeLimit = std::max(CAmount(1), minIncrementalFee.GetFeePerK() / 2);
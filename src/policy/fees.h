@@ -8,6 +8,8 @@
 #include "amount.h"
 #include "uint256.h"
 #include "random.h"
+#include "serialize.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -72,26 +74,24 @@ class TxConfirmStats
 private:
     //Define the buckets we will group transactions into
     std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+
+    // All moving averages are kept multiplied by scale, which grows by
+    // 1/decay every block, so decaying them is a single multiplication on
+    // scale rather than one per bucket and target. Reads divide scale out.
+    double scale;
 
     // For each bucket X:
     // Count the total # of txs in each bucket
     // Track the historical moving average of this total over blocks
     std::vector<double> txCtAvg;
-    // and calculate the total for the current block to update the moving average
-    std::vector<int> curBlockTxCt;
 
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calculate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
+    std::vector<double> confAvg; // confAvg[Y * buckets.size() + X]
 
     // Sum the total feerate of all tx's in each bucket
     // Track the historical moving average of this total over blocks
     std::vector<double> avg;
-    // and calculate the total for the current block to update the moving average
-    std::vector<double> curBlockVal;
 
     // Combine the conf counts with tx counts to calculate the confirmation % for each Y,X
     // Combine the total value with the tx counts to calculate the avg feerate per bucket
@@ -101,10 +101,19 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    std::vector<int> unconfTxs;  //unconfTxs[Y * buckets.size() + X]
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    unsigned int maxConfirms;
+
+    /** Index of the bucket val falls in */
+    unsigned int FindBucket(double val) const;
+    /** Resize the mempool counts to buckets and maxConfirms */
+    void ResizeUnconfirmed();
+    /** Bring scale back to 1, before the averages it multiplies lose precision */
+    void Rescale();
+
 public:
     /**
      * Initialize the data structures.  This is called by BlockPolicyEstimator's
@@ -115,11 +124,14 @@ public:
      */
     void Initialize(std::vector<double>& defaultBuckets, unsigned int maxConfirms, double decay);
 
-    /** Clear the state of the curBlock variables to start counting for the new block */
+    /**
+     * Start counting for a new block: decay the historical moving averages
+     * and move the oldest mempool counts into oldUnconfTxs
+     */
     void ClearCurrent(unsigned int nBlockHeight);
 
     /**
-     * Record a new transaction data point in the current block stats
+     * Record a new transaction data point in the moving averages for the current block
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
      * @param val the feerate of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
@@ -133,10 +145,6 @@ public:
     void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
                   unsigned int bucketIndex);
 
-    /** Update our estimates by decaying our historical moving average and updating
-        with the data gathered from the current block */
-    void UpdateMovingAverages();
-
     /**
      * Calculate a feerate estimate.  Find the lowest value bucket (or range of buckets
      * to make sure we have enough data points) whose transactions still have sufficient likelihood
@@ -152,7 +160,7 @@ public:
                              double minSuccess, bool requireGreater, unsigned int nBlockHeight);
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return maxConfirms; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout);
@@ -190,6 +198,27 @@ static const double INF_PRIORITY = 1e9 * MAX_MONEY;
 /** Spacing of FeeRate buckets */
 static const double FEE_SPACING = 1.1;
 
+/** Confirmed blocks kept for the journal before giving up on it until the next full write */
+static const unsigned int FEE_JOURNAL_MAX_BLOCKS = 1000;
+
+/** The fee estimator input from one block, as appended to the journal */
+struct CFeeEstimatorBlock
+{
+    unsigned int nHeight;
+    //! Blocks to confirm and feerate of each tracked transaction in the block
+    std::vector<std::pair<int, double> > vConfirmed;
+
+    CFeeEstimatorBlock() : nHeight(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nHeight);
+        READWRITE(vConfirmed);
+    }
+};
+
 /**
  *  We want to be able to estimate feerates that are needed on tx's to be included in
  * a certain number of blocks.  Every time a block is added to the best chain, this class records
@@ -205,8 +234,8 @@ public:
     void processBlock(unsigned int nBlockHeight,
                       std::vector<const CTxMemPoolEntry*>& entries);
 
-    /** Process a transaction confirmed in a block*/
-    bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
+    /** Process a transaction confirmed in a block, adding it to the block's journal record */
+    bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry, CFeeEstimatorBlock& block);
 
     /** Process a transaction accepted to the mempool*/
     void processTransaction(const CTxMemPoolEntry& entry, bool validFeeEstimate);
@@ -237,13 +266,25 @@ public:
      */
     double estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool);
 
-    /** Write estimation data to a file */
+    /** Write estimation data to a file. This starts a new journal. */
     void Write(CAutoFile& fileout);
 
     /** Read estimation data from a file */
     void Read(CAutoFile& filein, int nFileVersion);
 
+    /**
+     * Take the blocks processed since the last Write() or TakeJournal(), to
+     * be appended to the journal. Returns false if there were too many to
+     * keep, in which case a full Write() is needed instead.
+     */
+    bool TakeJournal(std::vector<CFeeEstimatorBlock>& vBlocks);
+
+    /** Replay blocks read back from the journal on top of the last Write() */
+    void ReadJournal(CAutoFile& filein);
+
 private:
+    /** Estimator state is guarded by its own lock, not the mempool's */
+    mutable CCriticalSection cs;
     CFeeRate minTrackedFee;    //!< Passed to constructor to avoid dependency on main
     unsigned int nBestSeenHeight;
     struct TxStatsInfo
@@ -261,6 +302,13 @@ private:
 
     unsigned int trackedTxs;
     unsigned int untrackedTxs;
+
+    //! Blocks processed since the last Write() or TakeJournal()
+    std::vector<CFeeEstimatorBlock> vJournal;
+    bool fJournalOverflow;
+
+    /** Apply the confirmations of a block to the stats */
+    void ApplyBlock(const CFeeEstimatorBlock& block);
 };
 
 class FeeFilterRounder
@@ -7,16 +7,18 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "chainsnapshot.h"
 #include "clientversion.h"
 #include "coins.h"
 #include "hash.h"
 #include "primitives/transaction.h"
+#include "trace.h"
 #include "uint256.h"
 #include "util.h"
 #include "validation.h"
 #include <stdio.h>
 #include "consensus/consensus.h"
-#include "wallet/wallet.h"
+#include "crypto/common.h"
 
 // Stake Modifier (hash modifier of proof-of-stake):
 // The purpose of stake modifier is to prevent a txout (coin) owner from
@@ -28,9 +30,22 @@ uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kerne
     if (!pindexPrev)
         return uint256(); // genesis block's modifier is 0
 
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << kernel << pindexPrev->nStakeModifier;
-    return ss.GetHash();
+    unsigned char vch[64];
+    memcpy(vch, kernel.begin(), 32);
+    memcpy(vch + 32, pindexPrev->nStakeModifier.begin(), 32);
+    return Hash(vch, vch + sizeof(vch));
+}
+
+uint256 GetStakeKernelHash(const CBlockIndex* pindexPrev, uint32_t nTxPrevTime, const COutPoint& prevout, uint32_t nTimeTx)
+{
+    // Same bytes as serializing nStakeModifier, nTxPrevTime, prevout and nTimeTx into a CHashWriter
+    unsigned char vch[76];
+    memcpy(vch, pindexPrev->nStakeModifier.begin(), 32);
+    WriteLE32(vch + 32, nTxPrevTime);
+    memcpy(vch + 36, prevout.hash.begin(), 32);
+    WriteLE32(vch + 68, prevout.n);
+    WriteLE32(vch + 72, nTimeTx);
+    return Hash(vch, vch + sizeof(vch));
 }
 
 // Check whether the coinstake timestamp meets protocol
@@ -72,18 +87,18 @@ bool CheckStakeBlockTimestamp(int64_t nTimeBlock)
 //
 bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, 
                             unsigned int nBits,  
-                            CBlockIndex& blockFrom, 
-                            const CCoins* txPrev, 
+                            uint32_t nBlockFromTime, 
+                            uint32_t nTxPrevTime, 
+                            CAmount nValueIn, 
                             const COutPoint& prevout, 
                             unsigned int nTimeTx)
 {
     // Weight
-    int64_t nValueIn = txPrev->vout[prevout.n].nValue;
     if (nValueIn == 0)
         return false;
-    if (blockFrom.GetBlockTime() + Params().GetConsensus().nStakeMinAge > nTimeTx){ // Min age requirement
-        DbgMsg("too early? %d %d %d gap:%d" , blockFrom.GetBlockTime() ,Params().GetConsensus().nStakeMinAge ,nTimeTx,
-                blockFrom.GetBlockTime() + Params().GetConsensus().nStakeMinAge - nTimeTx);
+    if (nBlockFromTime + Params().GetConsensus().nStakeMinAge > nTimeTx){ // Min age requirement
+        DbgMsg("too early? %d %d %d gap:%d" , nBlockFromTime ,Params().GetConsensus().nStakeMinAge ,nTimeTx,
+                nBlockFromTime + Params().GetConsensus().nStakeMinAge - nTimeTx);
         return error("CheckStakeKernelHash() : min age violation");
     }
     // Base target
@@ -91,9 +106,7 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev,
     bnTarget.SetCompact(nBits);
 
     // Calculate hash
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << pindexPrev->nStakeModifier << txPrev->nTime << prevout.hash << prevout.n << nTimeTx;
-    uint256 hashProofOfStake = ss.GetHash();
+    uint256 hashProofOfStake = GetStakeKernelHash(pindexPrev, nTxPrevTime, prevout, nTimeTx);
 
     // Now check if proof-of-stake hash meets target protocol
     if (UintToArith256(hashProofOfStake) / nValueIn > bnTarget)
@@ -102,47 +115,142 @@ bool CheckStakeKernelHash(const CBlockIndex* pindexPrev,
     return true;
 }
 
-bool IsConfirmedInNPrevBlocks(const CDiskTxPos& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth)
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev,
+                            unsigned int nBits,
+                            const Coin& coin,
+                            const COutPoint& prevout,
+                            unsigned int nTimeTx)
+{
+    if (coin.IsSpent())
+        return error("CheckStakeKernelHash() : kernel input %s spent or missing", prevout.ToString());
+
+    // The coin is tracked on the chain of pindexPrev, so the block that
+    // confirmed it is its ancestor at coin.nHeight
+    const CBlockIndex* pindexFrom = pindexPrev->GetAncestor(coin.nHeight);
+    if (!pindexFrom)
+        return error("CheckStakeKernelHash() : no block at height %d for kernel input %s", coin.nHeight, prevout.ToString());
+
+    return CheckStakeKernelHash(pindexPrev, nBits, pindexFrom->GetBlockTime(), coin.nTime,
+                                coin.out.nValue, prevout, nTimeTx);
+}
+
+CKernelSearch::CKernelSearch(const CBlockIndex* pindexPrev, unsigned int nBits, const CStakeCache& stake, const COutPoint& prevout)
+{
+    // Kernel layout: nStakeModifier(32) nTxPrevTime(4) prevout.hash(32) prevout.n(4) nTimeTx(4)
+    unsigned char vchPrefix[64];
+    memcpy(vchPrefix, pindexPrev->nStakeModifier.begin(), 32);
+    WriteLE32(vchPrefix + 32, stake.nTxTime);
+    memcpy(vchPrefix + 36, prevout.hash.begin(), 28);
+    hasherPrefix.Write(vchPrefix, sizeof(vchPrefix));
+    memcpy(vchTail, prevout.hash.begin() + 28, 4);
+    WriteLE32(vchTail + 4, prevout.n);
+
+    nMinTimeTx = (int64_t)stake.nBlockTime + Params().GetConsensus().nStakeMinAge;
+    fNoWeight = stake.nValue == 0;
+
+    // hash / nValueIn <= target  <=>  hash < (target + 1) * nValueIn
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits);
+    const arith_uint256 bnMax = ~arith_uint256();
+    fAnyHash = false;
+    if (bnTarget == bnMax) {
+        fAnyHash = true;
+    } else if (!fNoWeight) {
+        arith_uint256 bnValue((uint64_t)stake.nValue);
+        bnTarget += 1;
+        if (bnTarget > bnMax / bnValue)
+            fAnyHash = true;
+        else
+            bnWeightedTarget = bnTarget * bnValue;
+    }
+}
+
+bool CKernelSearch::Check(uint32_t nTimeTx) const
 {
-    for (const CBlockIndex* pindex = pindexFrom; pindex && pindexFrom->nHeight - pindex->nHeight < nMaxDepth; pindex = pindex->pprev) {
-        if (pindex->nDataPos == txindex.nPos && pindex->nFile == txindex.nFile) {
-            nActualDepth = pindexFrom->nHeight - pindex->nHeight;
+    if (fNoWeight || nTimeTx < nMinTimeTx)
+        return false;
+    if (fAnyHash)
+        return true;
+
+    unsigned char vchTime[4];
+    WriteLE32(vchTime, nTimeTx);
+    uint256 hashProofOfStake;
+    CSHA256(hasherPrefix).Write(vchTail, sizeof(vchTail)).Write(vchTime, sizeof(vchTime)).Finalize(hashProofOfStake.begin());
+    CSHA256().Write(hashProofOfStake.begin(), CSHA256::OUTPUT_SIZE).Finalize(hashProofOfStake.begin());
+
+    return UintToArith256(hashProofOfStake) < bnWeightedTarget;
+}
+
+bool CKernelSearch::Search(uint32_t nTimeFrom, unsigned int nCount, uint32_t& nTimeFound, unsigned int* pnHashes) const
+{
+    if (fNoWeight)
+        return false;
+    for (unsigned int n = 0; n < nCount && nTimeFrom - n >= nMinTimeTx; n++) {
+        if (pnHashes)
+            (*pnHashes)++;
+        if (Check(nTimeFrom - n)) {
+            nTimeFound = nTimeFrom - n;
             return true;
         }
     }
+    return false;
+}
 
+bool CKernelSearch::SearchForward(uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep, uint32_t& nTimeFound, unsigned int* pnHashes) const
+{
+    if (fNoWeight)
+        return false;
+    // Timestamps before the coin's min stake age never qualify
+    int64_t nTime = nTimeFrom;
+    if (nTime < nMinTimeTx)
+        nTime += (nMinTimeTx - nTime + nStep - 1) / nStep * nStep;
+    for (; nTime <= nTimeTo; nTime += nStep) {
+        if (pnHashes)
+            (*pnHashes)++;
+        if (Check(nTime)) {
+            nTimeFound = nTime;
+            return true;
+        }
+    }
     return false;
 }
 
-// Check kernel hash target and coinstake signature
-bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState& state)
+bool IsConfirmedInNPrevBlocks(const Coin& coin, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth)
+{
+    // The coin's height leads straight to its block through the skip list,
+    // instead of walking back comparing block positions
+    if (coin.IsSpent() || !pindexFrom)
+        return false;
+    const CBlockIndex* pindex = pindexFrom->GetAncestor(coin.nHeight);
+    if (!pindex || pindexFrom->nHeight - pindex->nHeight >= nMaxDepth)
+        return false;
+    nActualDepth = pindexFrom->nHeight - pindex->nHeight;
+    return true;
+}
+
+// Check kernel hash target and coinstake signature against the UTXO set,
+// so that validation does not depend on -txindex or read block files
+bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState& state, const CCoinsViewCache& view)
 {
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
-    
-    
-    CTransactionRef txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed %s",txin.prevout.hash.GetHex());
-    
 
-    CDiskTxPos txindex;
+    const Coin& coin = view.AccessCoin(txin.prevout);
+    if (coin.IsSpent())
+        return state.DoS(100, error("CheckProofOfStake() : kernel input unavailable %s", txin.prevout.ToString()),
+                         REJECT_INVALID, "bad-cs-kernel");
 
     // Verify signature
-    if (!VerifySignature(*txPrev, tx, 0, SCRIPT_VERIFY_NONE, 0))
+    const CTxOut& txout = coin.out;
+    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, &txin.scriptWitness, SCRIPT_VERIFY_NONE, TransactionSignatureChecker(&tx, 0, txout.nValue), NULL))
         return state.DoS(100, error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString()));
- 
 
-    if (mapBlockIndex.count(hashBlock) == 0)
-        return fDebug? error("CheckProofOfStake() : read block failed") : false; // unable to read block of previous transaction
-
-    
-    CBlockIndex* pblockindex = mapBlockIndex[hashBlock];
-    if (!CheckStakeKernelHash(pindexPrev, nBits, *pblockindex , new CCoins(*txPrev, pindexPrev->nHeight), txin.prevout, tx.nTime))
+    bool fKernel = CheckStakeKernelHash(pindexPrev, nBits, coin, txin.prevout, tx.nTime);
+    TRACE4(staking, check_proof_of_stake, tx.GetHash().begin(), pindexPrev->nHeight + 1, coin.out.nValue, fKernel);
+    if (!fKernel)
         return state.DoS(1, error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s", tx.GetHash().ToString())); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -163,52 +271,203 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
 }
  
 
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, uint32_t* pBlockTime)
+// Resolve the kernel inputs of prevout from the UTXO set and the block index,
+// as CheckProofOfStake() does, so that staking works without -txindex and on
+// pruned nodes; this is the slow path of stake search
+static bool GetKernelInputs(const COutPoint& prevout, uint32_t& nBlockTime, uint32_t& nTxTime, CAmount& nValue)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
-    
-    CTransactionRef txPrev;
-    uint256 hashBlock = uint256();
-    if (!GetTransaction(prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true)){
-        LogPrintf("CheckKernel : Could not find previous transaction %s\n",prevout.hash.ToString());
+    Coin coin;
+    {
+        LOCK(cs_main);
+        coin = pcoinsTip->AccessCoin(prevout);
+    }
+    if (coin.IsSpent()) {
+        LogPrint("coinstake", "CheckKernel : kernel input %s spent or missing\n", prevout.ToString());
         return false;
     }
-    
-    if (mapBlockIndex.count(hashBlock) == 0){
-        LogPrintf("CheckKernel : Could not find block of previous transaction %s\n",hashBlock.ToString());
+
+    // Only the coin needs cs_main, the block it was confirmed in comes from a chain snapshot
+    const CBlockIndex* pindexFrom = (*GetChainSnapshot())[coin.nHeight];
+    if (!pindexFrom) {
+        LogPrintf("CheckKernel : Could not find block at height %d of kernel input %s\n", coin.nHeight, prevout.ToString());
         return false;
     }
 
-    CBlockIndex* pblockindex = mapBlockIndex[hashBlock];
+    nBlockTime = pindexFrom->GetBlockTime();
+    nTxTime = coin.nTime;
+    nValue = coin.out.nValue;
+    return true;
+}
 
-    if (pblockindex->GetBlockTime() + Params().GetConsensus().nStakeMinAge > nTime)
+static bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, const CStakeCache& stake, uint32_t* pBlockTime)
+{
+    if (stake.nBlockTime + Params().GetConsensus().nStakeMinAge > nTime)
         return false;
 
     if (pBlockTime)
-        *pBlockTime = pblockindex->GetBlockTime();
-    if (!pwalletMain->mapWallet.count(prevout.hash))
-        return("CheckProofOfStake(): Couldn't get Tx Index");
-    return CheckStakeKernelHash(pindexPrev, nBits,*pblockindex, new CCoins(*txPrev, pindexPrev->nHeight), prevout, nTime);
-    
+        *pBlockTime = stake.nBlockTime;
+    return CheckStakeKernelHash(pindexPrev, nBits, stake.nBlockTime, stake.nTxTime, stake.nValue, prevout, nTime);
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, uint32_t* pBlockTime)
+{
+    uint32_t nBlockTime, nTxTime;
+    CAmount nValue;
+    if (!GetKernelInputs(prevout, nBlockTime, nTxTime, nValue))
+        return false;
+
+    return CheckKernel(pindexPrev, nBits, nTime, prevout, CStakeCache(nBlockTime, nTxTime, nValue), pBlockTime);
 }
 
-void CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout)
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache, uint32_t* pBlockTime)
+{
+    std::map<COutPoint, CStakeCache>::const_iterator it = cache.find(prevout);
+    if (it == cache.end())
+        return CheckKernel(pindexPrev, nBits, nTime, prevout, pBlockTime);
+
+    return CheckKernel(pindexPrev, nBits, nTime, prevout, it->second, pBlockTime);
+}
+
+bool SearchKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, unsigned int nCount, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache, uint32_t& nTimeFound, unsigned int* pnHashes)
+{
+    std::map<COutPoint, CStakeCache>::const_iterator it = cache.find(prevout);
+    if (it != cache.end())
+        return CKernelSearch(pindexPrev, nBits, it->second, prevout).Search(nTimeFrom, nCount, nTimeFound, pnHashes);
+
+    uint32_t nBlockTime, nTxTime;
+    CAmount nValue;
+    if (!GetKernelInputs(prevout, nBlockTime, nTxTime, nValue))
+        return false;
+
+    return CKernelSearch(pindexPrev, nBits, CStakeCache(nBlockTime, nTxTime, nValue), prevout).Search(nTimeFrom, nCount, nTimeFound, pnHashes);
+}
+
+bool SearchKernelForward(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache, uint32_t& nTimeFound, unsigned int* pnHashes)
+{
+    std::map<COutPoint, CStakeCache>::const_iterator it = cache.find(prevout);
+    if (it != cache.end())
+        return CKernelSearch(pindexPrev, nBits, it->second, prevout).SearchForward(nTimeFrom, nTimeTo, nStep, nTimeFound, pnHashes);
+
+    uint32_t nBlockTime, nTxTime;
+    CAmount nValue;
+    if (!GetKernelInputs(prevout, nBlockTime, nTxTime, nValue))
+        return false;
+
+    return CKernelSearch(pindexPrev, nBits, CStakeCache(nBlockTime, nTxTime, nValue), prevout).SearchForward(nTimeFrom, nTimeTo, nStep, nTimeFound, pnHashes);
+}
+
+bool CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout)
 {
     if (cache.find(prevout) != cache.end()) {
         //already in cache
-        return;
+        return true;
+    }
+
+    uint32_t nBlockTime, nTxTime;
+    CAmount nValue;
+    if (!GetKernelInputs(prevout, nBlockTime, nTxTime, nValue))
+        return false;
+
+    cache.insert(std::make_pair(prevout, CStakeCache(nBlockTime, nTxTime, nValue)));
+    return true;
+}
+
+CStakeWeightWindow stakeWeightWindow(DEFAULT_STAKE_WEIGHT_WINDOW);
+CStakingStats stakingStats;
+CStakingStatus stakingStatus;
+
+// Kernels tried for one PoS block: its difficulty, on the scale of GetDifficulty(), times 2^32
+static double GetKernelsTried(const CBlockIndex* pindex)
+{
+    int nShift = (pindex->nBits >> 24) & 0xff;
+    double dDiff = (double)0x0000ffff / (double)(pindex->nBits & 0x00ffffff);
+    while (nShift < 29) {
+        dDiff *= 256.0;
+        nShift++;
+    }
+    while (nShift > 29) {
+        dDiff /= 256.0;
+        nShift--;
     }
-    
-    CMutableTransaction tmpPrevTx;
-    CDiskTxPos txindex;
-    if (!ReadFromDisk(tmpPrevTx, txindex, *pblocktree, prevout))
+    return dDiff * 4294967296.0;
+}
+
+CStakeWeightWindow::CStakeWeightWindow(unsigned int nWindowIn) : pindexTip(NULL), nWindow(std::max(nWindowIn, 1u)), dKernelsTried(0)
+{
+}
+
+void CStakeWeightWindow::Rebuild(const CBlockIndex* pindexNew)
+{
+    vStakes.clear();
+    dKernelsTried = 0;
+    pindexTip = pindexNew;
+    for (const CBlockIndex* pindex = pindexNew; pindex && vStakes.size() <= nWindow; pindex = pindex->pprev) {
+        if (!pindex->IsProofOfStake())
+            continue;
+        if (!vStakes.empty())
+            dKernelsTried += GetKernelsTried(vStakes.front());
+        vStakes.push_front(pindex);
+    }
+}
+
+void CStakeWeightWindow::Refill()
+{
+    if (vStakes.empty())
         return;
-    CTransaction txPrev(tmpPrevTx);
-    // Read block
-    CBlock block;
-    const CDiskBlockPos& pos = CDiskBlockPos(txindex.nFile, txindex.nPos);
-    if (!ReadBlockFromDisk(block, pos, Params().GetConsensus()))
+    for (const CBlockIndex* pindex = vStakes.front()->pprev; pindex && vStakes.size() <= nWindow; pindex = pindex->pprev) {
+        if (!pindex->IsProofOfStake())
+            continue;
+        dKernelsTried += GetKernelsTried(vStakes.front());
+        vStakes.push_front(pindex);
+    }
+}
+
+void CStakeWeightWindow::SetTip(const CBlockIndex* pindexNew)
+{
+    if (pindexNew == pindexTip)
         return;
-    CStakeCache c(block, txindex, txPrev);
-    cache.insert({prevout, c});
+
+    if (pindexTip && pindexNew && pindexNew->pprev == pindexTip) {
+        // Connected one block
+        pindexTip = pindexNew;
+        if (!pindexNew->IsProofOfStake())
+            return;
+        if (!vStakes.empty())
+            dKernelsTried += GetKernelsTried(pindexNew);
+        vStakes.push_back(pindexNew);
+        while (vStakes.size() > nWindow + 1) {
+            vStakes.pop_front();
+            dKernelsTried -= GetKernelsTried(vStakes.front());
+        }
+    } else if (pindexTip && pindexNew && pindexNew == pindexTip->pprev) {
+        // Disconnected one block
+        if (!vStakes.empty() && vStakes.back() == pindexTip) {
+            vStakes.pop_back();
+            if (vStakes.empty()) {
+                Rebuild(pindexNew);
+                return;
+            }
+            dKernelsTried -= GetKernelsTried(pindexTip);
+            Refill();
+        }
+        pindexTip = pindexNew;
+    } else {
+        Rebuild(pindexNew);
+    }
+}
+
+void CStakeWeightWindow::SetWindow(unsigned int nWindowIn)
+{
+    nWindow = std::max(nWindowIn, 1u);
+    Rebuild(pindexTip);
+}
+
+double CStakeWeightWindow::GetKernelsPerSecond() const
+{
+    if (vStakes.size() < 2)
+        return 0;
+    int64_t nStakesTime = vStakes.back()->GetBlockTime() - vStakes.front()->GetBlockTime();
+    if (!nStakesTime)
+        return 0;
+    return dKernelsTried / nStakesTime * 16;
 }
@@ -5,7 +5,6 @@
 #ifndef BLACKCOIN_POS_H
 #define BLACKCOIN_POS_H
 
-#include "pos.h"
 #include "txdb.h"
 #include "validation.h"
 #include "arith_uint256.h"
@@ -13,31 +12,164 @@
 #include "hash.h"
 #include "timedata.h"
 #include "chainparams.h"
+#include "crypto/sha256.h"
 #include "script/sign.h"
 #include <stdint.h>
+#include <atomic>
+#include <deque>
 
-using namespace std;
+/** Default for -stakeweightwindow, the number of PoS blocks the network weight is averaged over */
+static const unsigned int DEFAULT_STAKE_WEIGHT_WINDOW = 72;
 
 /** Compute the hash modifier for proof-of-stake */
 uint256 ComputeStakeModifier(const CBlockIndex* pindexPrev, const uint256& kernel);
 
+/**
+ * Kernel hash of prevout at nTimeTx on top of pindexPrev. The layout is
+ * fixed-size, so the bytes are laid out in place and hashed directly rather
+ * than streamed through a CHashWriter.
+ */
+uint256 GetStakeKernelHash(const CBlockIndex* pindexPrev, uint32_t nTxPrevTime, const COutPoint& prevout, uint32_t nTimeTx);
+
+/** Kernel inputs of a staking prevout, cached so that stake search does no disk I/O after warm-up */
 struct CStakeCache{
-    CStakeCache(CBlockHeader blockFrom_, CDiskTxPos txindex_, const CTransaction txPrev_) : blockFrom(blockFrom_), txindex(txindex_), txPrev(txPrev_){
+    CStakeCache(uint32_t nBlockTime_, uint32_t nTxTime_, CAmount nValue_) : nBlockTime(nBlockTime_), nTxTime(nTxTime_), nValue(nValue_){
     }
-    CBlockHeader blockFrom;
-    CDiskTxPos txindex;
-    const CTransaction txPrev;
+    uint32_t nBlockTime;  //!< time of the block that confirmed the prevout
+    uint32_t nTxTime;     //!< nTime of the prevout transaction
+    CAmount nValue;       //!< value of the prevout
+};
+
+/**
+ * Evaluates the kernel of one staking prevout over many timestamps.
+ * The first 64 bytes of the kernel (stake modifier, tx time and most of the
+ * prevout hash) are absorbed once and the weighted target is computed once,
+ * so each probed timestamp costs two SHA256 compressions and a 256-bit
+ * compare instead of a CHashWriter pass and a 256-bit division.
+ */
+class CKernelSearch
+{
+private:
+    CSHA256 hasherPrefix;          //!< midstate after the fixed 64-byte prefix
+    unsigned char vchTail[8];      //!< rest of prevout.hash and prevout.n
+    arith_uint256 bnWeightedTarget; //!< (target + 1) * nValueIn
+    bool fAnyHash;                 //!< weighted target exceeds 2^256: every hash qualifies
+    bool fNoWeight;                //!< nValueIn == 0: no hash qualifies
+    int64_t nMinTimeTx;            //!< earliest timestamp satisfying min stake age
+
+public:
+    CKernelSearch(const CBlockIndex* pindexPrev, unsigned int nBits, const CStakeCache& stake, const COutPoint& prevout);
+
+    /** Same result as CheckStakeKernelHash() for nTimeTx, without logging */
+    bool Check(uint32_t nTimeTx) const;
+    /**
+     * Probe nTimeFrom, nTimeFrom - 1, ... for nCount timestamps; return the first that meets the target.
+     * The number of kernels hashed is added to *pnHashes when given.
+     */
+    bool Search(uint32_t nTimeFrom, unsigned int nCount, uint32_t& nTimeFound, unsigned int* pnHashes = NULL) const;
+    /** Probe nTimeFrom, nTimeFrom + nStep, ... up to nTimeTo; return the first (earliest) that meets the target */
+    bool SearchForward(uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep, uint32_t& nTimeFound, unsigned int* pnHashes = NULL) const;
 };
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 bool CheckStakeBlockTimestamp(int64_t nTimeBlock);
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, uint32_t* pBlockTime = NULL);
+/** Same as CheckKernel() but reads the prevout from cache when present; falls back to the uncached lookup otherwise */
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTime, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache, uint32_t* pBlockTime = NULL);
+
+/** Search the kernel of prevout over nCount timestamps going back from nTimeFrom (see CKernelSearch) */
+bool SearchKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, unsigned int nCount, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache, uint32_t& nTimeFound, unsigned int* pnHashes = NULL);
+/** Find the earliest kernel of prevout among the timestamps nTimeFrom + k * nStep up to nTimeTo (see CKernelSearch::SearchForward) */
+bool SearchKernelForward(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep, const COutPoint& prevout, const std::map<COutPoint, CStakeCache>& cache, uint32_t& nTimeFound, unsigned int* pnHashes = NULL);
+
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nBlockFromTime, uint32_t nTxPrevTime, CAmount nValueIn, const COutPoint& prevout, unsigned int nTimeTx);
+/** Kernel check from the UTXO set: value and tx time from the coin, block time from the ancestor of pindexPrev at coin.nHeight */
+bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, const Coin& coin, const COutPoint& prevout, unsigned int nTimeTx);
+/**
+ * Whether an unspent coin of the UTXO set at pindexFrom was confirmed in one
+ * of the nMaxDepth blocks up to pindexFrom; nActualDepth is set to how many
+ * blocks back. O(log n) through GetAncestor at the coin's height.
+ */
+bool IsConfirmedInNPrevBlocks(const Coin& coin, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
+bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state, const CCoinsViewCache& view);
+/** Look up prevout once (UTXO set + block index) and remember its kernel inputs; returns false if it is spent or missing */
+bool CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout);
+/**
+ * Network stake weight averaged over the last nWindow proof-of-stake blocks
+ * of the active chain. SetTip() follows the tip one block at a time, so a
+ * block connect or disconnect and a query are each O(1); any other tip
+ * change rebuilds the window. Protected by cs_main.
+ */
+class CStakeWeightWindow
+{
+private:
+    std::deque<const CBlockIndex*> vStakes; //!< last nWindow + 1 PoS blocks, oldest first
+    const CBlockIndex* pindexTip;          //!< tip the window reflects
+    unsigned int nWindow;
+    double dKernelsTried;                  //!< difficulty * 2^32 summed over all but the oldest entry
+
+    void Rebuild(const CBlockIndex* pindexNew);
+    //! Prepend older PoS blocks until the window is full or the chain runs out
+    void Refill();
+
+public:
+    CStakeWeightWindow(unsigned int nWindowIn);
+
+    void SetTip(const CBlockIndex* pindexNew);
+    void SetWindow(unsigned int nWindowIn);
+    unsigned int GetWindow() const { return nWindow; }
+    //! Kernels tried per second by the network, in the units of GetPoSKernelPS()
+    double GetKernelsPerSecond() const;
+};
+
+extern CStakeWeightWindow stakeWeightWindow;
+
+/**
+ * Stake search counters, bumped without locks by the wallet and the staking
+ * thread and reported by getstakingstats. Times are in microseconds.
+ */
+struct CStakingStats
+{
+    std::atomic<uint64_t> nSearches;           //!< kernel searches run
+    std::atomic<uint64_t> nCoinsEvaluated;     //!< prevouts whose kernel was searched
+    std::atomic<uint64_t> nKernelsHashed;      //!< kernel hashes computed
+    std::atomic<uint64_t> nKernelsFound;
+    std::atomic<uint64_t> nLastSearchHashes;   //!< kernel hashes of the most recent search
+    std::atomic<uint64_t> nLastSearchMicros;   //!< duration of the most recent search
+    std::atomic<uint64_t> nSelectCoinsMicros;  //!< choosing coins and refreshing the stake cache
+    std::atomic<uint64_t> nHashMicros;         //!< hashing kernels
+    std::atomic<uint64_t> nCreateBlockMicros;  //!< building block templates
+    std::atomic<uint64_t> nSignBlockMicros;    //!< building the coinstake and signing the block
+    std::atomic<uint64_t> nTemplatesBuilt;
+    std::atomic<uint64_t> nTemplatesReused;    //!< stakes signed on a cached template instead of a fresh one
+    std::atomic<uint64_t> nTemplatesDiscarded; //!< templates dropped because the tip or nBits moved
+    std::atomic<uint64_t> nOrphanedStakes;     //!< signed blocks orphaned before they could be submitted
+    std::atomic<uint64_t> nBlocksStaked;       //!< blocks that passed CheckStake
+
+    CStakingStats() : nSearches(0), nCoinsEvaluated(0), nKernelsHashed(0), nKernelsFound(0),
+        nLastSearchHashes(0), nLastSearchMicros(0), nSelectCoinsMicros(0), nHashMicros(0),
+        nCreateBlockMicros(0), nSignBlockMicros(0), nTemplatesBuilt(0), nTemplatesReused(0), nTemplatesDiscarded(0),
+        nOrphanedStakes(0), nBlocksStaked(0) {}
+};
+
+extern CStakingStats stakingStats;
+
+/**
+ * What the staking indicator of the GUI and getstakinginfo show, kept up to
+ * date by the stake miner and on new tips so reading it takes no locks and
+ * scans neither the wallet nor the chain.
+ */
+struct CStakingStatus
+{
+    std::atomic<uint64_t> nWeight;        //!< the wallet's mature stake weight, as of its last search or tip
+    std::atomic<uint64_t> nNetworkWeight; //!< GetPoSKernelPS() at the tip
+
+    CStakingStatus() : nWeight(0), nNetworkWeight(0) {}
+};
+
+extern CStakingStatus stakingStatus;
 
-bool CheckStakeKernelHash(const CBlockIndex* pindexPrev, unsigned int nBits, CBlockIndex& blockFrom,  const CCoins* txPrev, const COutPoint& prevout, unsigned int nTimeTx);
-bool IsConfirmedInNPrevBlocks(const CDiskTxPos& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
-bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, CValidationState &state);
-void CacheKernel(std::map<COutPoint, CStakeCache>& cache, const COutPoint& prevout);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
 
@@ -13,7 +13,7 @@
 
 uint256 CBlockHeader::GetHash() const
 {
-    return SerializeHash(*this);
+    return SerializeHashFixed<80>(*this);
 }
 
 uint256 CBlockHeader::GetPoWHash() const
@@ -23,6 +23,18 @@ uint256 CBlockHeader::GetPoWHash() const
     return thash;
 }
 
+std::vector<uint256> GetPoWHashes(const std::vector<const CBlockHeader*>& vpheader)
+{
+    // The serialized header is the 80 bytes from nVersion on
+    std::vector<char> vInput(80 * vpheader.size());
+    for (size_t i = 0; i < vpheader.size(); i++)
+        memcpy(&vInput[80 * i], BEGIN(vpheader[i]->nVersion), 80);
+    std::vector<uint256> vHashes(vpheader.size());
+    if (!vpheader.empty())
+        scrypt_1024_1_1_256_multi(vInput.data(), BEGIN(vHashes[0]), vpheader.size());
+    return vHashes;
+}
+
 std::string CBlockHeader::ToString() const
 {
     std::stringstream s;
@@ -95,6 +95,8 @@ public:
     std::vector<unsigned char> vchBlockSig;
     // memory only
     mutable bool fChecked;
+    //! Whether fChecked includes the block signature, which assumed-valid blocks skip
+    mutable bool fCheckedSig;
 
     CBlock()
     {
@@ -122,6 +124,7 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         fChecked = false;
+        fCheckedSig = false;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -186,6 +189,9 @@ struct CBlockLocator
     }
 };
 
+/** Compute the scrypt proof-of-work hashes of many headers, several at once where the CPU allows. */
+std::vector<uint256> GetPoWHashes(const std::vector<const CBlockHeader*>& vpheader);
+
 /** Compute the consensus-critical block weight (see BIP 141). */
 int64_t GetBlockWeight(const CBlock& tx);
 
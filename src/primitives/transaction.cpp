@@ -68,6 +68,16 @@ uint256 CTransaction::ComputeHash() const
     return SerializeHash(*this, SER_GETHASH, SERIALIZE_TRANSACTION_NO_WITNESS);
 }
 
+unsigned int CTransaction::ComputeLegacySigOps() const
+{
+    unsigned int nSigOps = 0;
+    for (const auto& txin : vin)
+        nSigOps += txin.scriptSig.GetSigOpCount(false);
+    for (const auto& txout : vout)
+        nSigOps += txout.scriptPubKey.GetSigOpCount(false);
+    return nSigOps;
+}
+
 uint256 CTransaction::GetWitnessHash() const
 {
     if (!HasWitness()) {
@@ -77,9 +87,9 @@ uint256 CTransaction::GetWitnessHash() const
 }
 
 /* For backward compatibility, the hash is initialized to 0. TODO: remove the need for this default constructor entirely. */
-CTransaction::CTransaction() : nVersion(CTransaction::CURRENT_VERSION), nTime(0), vin(), vout(), nLockTime(0), hash() {}
-CTransaction::CTransaction(const CMutableTransaction &tx) : nVersion(tx.nVersion),nTime(tx.nTime),  vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime), hash(ComputeHash()) {}
-CTransaction::CTransaction(CMutableTransaction &&tx) : nVersion(tx.nVersion), nTime(tx.nTime), vin(std::move(tx.vin)), vout(std::move(tx.vout)), nLockTime(tx.nLockTime), hash(ComputeHash()) {}
+CTransaction::CTransaction() : nVersion(CTransaction::CURRENT_VERSION), nTime(0), vin(), vout(), nLockTime(0), hash(), nLegacySigOps(0) {}
+CTransaction::CTransaction(const CMutableTransaction &tx) : nVersion(tx.nVersion),nTime(tx.nTime),  vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime), hash(ComputeHash()), nLegacySigOps(ComputeLegacySigOps()) {}
+CTransaction::CTransaction(CMutableTransaction &&tx) : nVersion(tx.nVersion), nTime(tx.nTime), vin(std::move(tx.vin)), vout(std::move(tx.vout)), nLockTime(tx.nLockTime), hash(ComputeHash()), nLegacySigOps(ComputeLegacySigOps()) {}
 
 CAmount CTransaction::GetValueOut() const
 {
@@ -336,8 +336,11 @@ public:
 private:
     /** Memory only. */
     const uint256 hash;
+    /** Memory only: sigops in the scriptSigs and scriptPubKeys, counted the legacy way */
+    const unsigned int nLegacySigOps;
 
     uint256 ComputeHash() const;
+    unsigned int ComputeLegacySigOps() const;
 
 public:
     /** Construct a CTransaction that qualifies as IsNull() */
@@ -366,6 +369,11 @@ public:
         return hash;
     }
 
+    /** Sigops of the scriptSigs and scriptPubKeys, counted the legacy (inaccurate) way */
+    unsigned int GetLegacySigOpCount() const {
+        return nLegacySigOps;
+    }
+
     // Compute a hash that includes both transaction and witness data
     uint256 GetWitnessHash() const;
 
@@ -19,6 +19,7 @@
 #include "optionsdialog.h"
 #include "optionsmodel.h"
 #include "platformstyle.h"
+#include "pos.h"
 #include "rpcconsole.h"
 #include "utilitydialog.h"
 #include "validation.h"
@@ -81,8 +82,6 @@ const std::string BitcoinGUI::DEFAULT_UIPLATFORM =
  * collisions in the future with additional wallets */
 const QString BitcoinGUI::DEFAULT_WALLET = "~Default";
 
-extern int64_t nLastCoinStakeSearchInterval;
-double GetPoSKernelPS();
 BitcoinGUI::BitcoinGUI(const PlatformStyle *_platformStyle, const NetworkStyle *networkStyle, QWidget *parent) :
     QMainWindow(parent),
     enableWallet(false),
@@ -1301,35 +1300,14 @@ void UnitDisplayStatusBarControl::onMenuSelection(QAction* action)
     }
 }
 
-
-void BitcoinGUI::updateWeight()
-{
-    if(!pwalletMain)
-        return;
-
-    TRY_LOCK(cs_main, lockMain);
-    if (!lockMain)
-        return;
-
-    TRY_LOCK(pwalletMain->cs_wallet, lockWallet);
-    if (!lockWallet)
-        return;
-
-#ifdef ENABLE_WALLET
-    if (pwalletMain &&!GetBoolArg("-staking", !GetBoolArg("-server", false)))
-        nWeight = pwalletMain->GetStakeWeight();
-#endif
-}
-
-
 void BitcoinGUI::updateStakingIcon()
 {
-	updateWeight();
+    // Kept up to date by the stake miner and on new tips, so this takes no locks
+    uint64_t nWeight = pwalletMain ? stakingStatus.nWeight.load() : 0;
 
     if (nLastCoinStakeSearchInterval && nWeight)
     {
-    	uint64_t nWeight = this->nWeight;
-    	uint64_t nNetworkWeight = 1.1429 * GetPoSKernelPS();
+    	uint64_t nNetworkWeight = 1.1429 * stakingStatus.nNetworkWeight;
     	unsigned nEstimateTime = 1.0455 * 64 * nNetworkWeight / nWeight;
 
         QString text;
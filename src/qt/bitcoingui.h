@@ -128,7 +128,6 @@ private:
     int prevBlocks;
     int spinnerFrame;
 
-    uint64_t nWeight;
     const PlatformStyle *platformStyle;
 
     /** Create the main UI actions. */
@@ -234,8 +233,6 @@ private Q_SLOTS:
     /** Simply calls showNormalIfMinimized(true) for use in SLOT() macro */
     void toggleHidden();
 
-	void updateWeight();
-
     void updateStakingIcon();
 
     /** called by a timer to check if fRequestShutdown has been set **/
@@ -12,10 +12,11 @@
 #include <QDialog>
 #include <QList>
 #include <QMenu>
+#include <QModelIndex>
 #include <QPoint>
 #include <QString>
-#include <QTreeWidgetItem>
 
+class CoinControlModel;
 class PlatformStyle;
 class WalletModel;
 
@@ -28,17 +29,6 @@ namespace Ui {
 
 #define ASYMP_UTF8 "\xE2\x89\x88"
 
-class CCoinControlWidgetItem : public QTreeWidgetItem
-{
-public:
-    CCoinControlWidgetItem(QTreeWidget *parent, int type = Type) : QTreeWidgetItem(parent, type) {}
-    CCoinControlWidgetItem(int type = Type) : QTreeWidgetItem(type) {}
-    CCoinControlWidgetItem(QTreeWidgetItem *parent, int type = Type) : QTreeWidgetItem(parent, type) {}
-
-    bool operator<(const QTreeWidgetItem &other) const;
-};
-
-
 class CoinControlDialog : public QDialog
 {
     Q_OBJECT
@@ -59,11 +49,12 @@ public:
 private:
     Ui::CoinControlDialog *ui;
     WalletModel *model;
+    CoinControlModel *coinModel;
     int sortColumn;
     Qt::SortOrder sortOrder;
 
     QMenu *contextMenu;
-    QTreeWidgetItem *contextMenuItem;
+    QModelIndex contextMenuIndex;
     QAction *copyTransactionHashAction;
     QAction *lockAction;
     QAction *unlockAction;
@@ -71,20 +62,7 @@ private:
     const PlatformStyle *platformStyle;
 
     void sortView(int, Qt::SortOrder);
-    void updateView();
-
-    enum
-    {
-        COLUMN_CHECKBOX = 0,
-        COLUMN_AMOUNT,
-        COLUMN_LABEL,
-        COLUMN_ADDRESS,
-        COLUMN_DATE,
-        COLUMN_CONFIRMATIONS,
-        COLUMN_TXHASH,
-        COLUMN_VOUT_INDEX,
-    };
-    friend class CCoinControlWidgetItem;
+    void expandPartiallySelected();
 
 private Q_SLOTS:
     void showMenu(const QPoint &);
@@ -103,7 +81,8 @@ private Q_SLOTS:
     void clipboardChange();
     void radioTreeMode(bool);
     void radioListMode(bool);
-    void viewItemChanged(QTreeWidgetItem*, int);
+    void coinsLoaded();
+    void coinSelectionChanged();
     void headerSectionClicked(int);
     void buttonBoxClicked(QAbstractButton*);
     void buttonSelectAllClicked();
@@ -0,0 +1,566 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coincontrolmodel.h"
+
+#include "bitcoinunits.h"
+#include "guiutil.h"
+#include "optionsmodel.h"
+#include "walletmodel.h"
+
+#include "wallet/coincontrol.h"
+
+#include <algorithm>
+
+#include <QHash>
+
+/** Top level rows handed to the view at a time */
+static const int COIN_CONTROL_FETCH_SIZE = 1000;
+
+/* Reads the coins of the wallet, away from the GUI thread.
+ */
+class CoinControlLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    CoinControlLoader(WalletModel *_walletModel) : walletModel(_walletModel) {}
+
+public Q_SLOTS:
+    void load()
+    {
+        QList<CoinControlRecord> records;
+        walletModel->listCoins(records);
+        Q_EMIT loaded(records);
+    }
+
+Q_SIGNALS:
+    void loaded(const QList<CoinControlRecord> &records);
+
+private:
+    WalletModel *walletModel;
+};
+
+#include "coincontrolmodel.moc"
+
+template <typename T>
+static int Compare(const T &a, const T &b)
+{
+    return a < b ? -1 : (b < a ? 1 : 0);
+}
+
+CoinControlModel::CoinControlModel(WalletModel *_walletModel, CCoinControl *_coinControl, const QIcon &_lockedIcon, QObject *parent) :
+    QAbstractItemModel(parent),
+    walletModel(_walletModel),
+    coinControl(_coinControl),
+    lockedIcon(_lockedIcon),
+    nDisplayUnit(_walletModel->getOptionsModel()->getDisplayUnit()),
+    fTreeMode(false),
+    nSortColumn(Amount),
+    sortOrder(Qt::DescendingOrder),
+    nFetched(0),
+    loader(0)
+{
+    strChange = tr("(change)");
+    strNoLabel = tr("(no label)");
+}
+
+CoinControlModel::~CoinControlModel()
+{
+    loaderThread.quit();
+    loaderThread.wait();
+}
+
+void CoinControlModel::load()
+{
+    if (loader)
+        return;
+    qRegisterMetaType< QList<CoinControlRecord> >("QList<CoinControlRecord>");
+    loader = new CoinControlLoader(walletModel);
+    loader->moveToThread(&loaderThread);
+    connect(loader, SIGNAL(loaded(QList<CoinControlRecord>)), this, SLOT(setCoins(QList<CoinControlRecord>)));
+    connect(&loaderThread, SIGNAL(finished()), loader, SLOT(deleteLater()), Qt::DirectConnection);
+    loaderThread.start(QThread::LowPriority);
+    QMetaObject::invokeMethod(loader, "load", Qt::QueuedConnection);
+}
+
+void CoinControlModel::setCoins(const QList<CoinControlRecord> &records)
+{
+    // The loader deletes itself when its thread finishes
+    loaderThread.quit();
+    loaderThread.wait();
+    loader = 0;
+
+    beginResetModel();
+    coins = records;
+    vSelected.assign(coins.size(), false);
+    vCoinGroup.assign(coins.size(), 0);
+    groups.clear();
+    QHash<QString, int> mapGroups;
+    for (int i = 0; i < coins.size(); i++)
+    {
+        const CoinControlRecord &rec = coins[i];
+        QHash<QString, int>::iterator it = mapGroups.find(rec.groupAddress);
+        if (it == mapGroups.end())
+        {
+            it = mapGroups.insert(rec.groupAddress, groups.size());
+            groups.push_back(Group());
+            groups.back().address = rec.groupAddress;
+            groups.back().label = rec.groupLabel;
+            groups.back().nDepth = rec.nDepth;
+        }
+        Group &g = groups[it.value()];
+        vCoinGroup[i] = it.value();
+        g.vCoins.push_back(i);
+        g.nSum += rec.nValue;
+        g.nTime = std::max(g.nTime, rec.nTime);
+        g.nDepth = std::min(g.nDepth, rec.nDepth);
+        if (rec.fLocked)
+        {
+            coinControl->UnSelect(rec.outpoint); // just to be sure
+            g.nLocked++;
+        }
+        else if (coinControl->IsSelected(rec.outpoint))
+        {
+            vSelected[i] = true;
+            g.nSelected++;
+        }
+    }
+    vCoinRow.assign(coins.size(), 0);
+    vGroupRow.assign(groups.size(), 0);
+    sortRows();
+    nFetched = std::min<int>(vTop.size(), COIN_CONTROL_FETCH_SIZE);
+    endResetModel();
+    Q_EMIT loaded();
+}
+
+void CoinControlModel::setTreeMode(bool _fTreeMode)
+{
+    if (fTreeMode == _fTreeMode)
+        return;
+    beginResetModel();
+    fTreeMode = _fTreeMode;
+    sortRows();
+    nFetched = std::min<int>(vTop.size(), COIN_CONTROL_FETCH_SIZE);
+    endResetModel();
+}
+
+int CoinControlModel::rowCount(const QModelIndex &parent) const
+{
+    if (!parent.isValid())
+        return nFetched;
+    if (parent.column() == Checkbox && isGroup(parent))
+        return group(parent).vCoins.size();
+    return 0;
+}
+
+int CoinControlModel::columnCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent);
+    return Confirmations + 1;
+}
+
+QModelIndex CoinControlModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if (row < 0 || column < 0 || column > Confirmations)
+        return QModelIndex();
+    if (!parent.isValid())
+    {
+        if (row >= nFetched)
+            return QModelIndex();
+        return createIndex(row, column, quintptr(0));
+    }
+    if (!isGroup(parent))
+        return QModelIndex();
+    int nGroup = vTop[parent.row()];
+    if (row >= (int)groups[nGroup].vCoins.size())
+        return QModelIndex();
+    // The id of a coin in tree mode is its group's plus one
+    return createIndex(row, column, quintptr(nGroup + 1));
+}
+
+QModelIndex CoinControlModel::parent(const QModelIndex &index) const
+{
+    if (!index.isValid() || index.internalId() == 0)
+        return QModelIndex();
+    return createIndex(vGroupRow[index.internalId() - 1], 0, quintptr(0));
+}
+
+bool CoinControlModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && nFetched < (int)vTop.size();
+}
+
+void CoinControlModel::fetchMore(const QModelIndex &parent)
+{
+    if (parent.isValid())
+        return;
+    int nMore = std::min<int>(vTop.size() - nFetched, COIN_CONTROL_FETCH_SIZE);
+    if (nMore <= 0)
+        return;
+    beginInsertRows(QModelIndex(), nFetched, nFetched + nMore - 1);
+    nFetched += nMore;
+    endInsertRows();
+}
+
+bool CoinControlModel::isGroup(const QModelIndex &index) const
+{
+    return fTreeMode && index.isValid() && index.internalId() == 0;
+}
+
+const CoinControlModel::Group &CoinControlModel::group(const QModelIndex &index) const
+{
+    return groups[vTop[index.row()]];
+}
+
+int CoinControlModel::coinId(const QModelIndex &index) const
+{
+    if (!index.isValid() || isGroup(index))
+        return -1;
+    if (index.internalId() == 0)
+        return vTop[index.row()];
+    return groups[index.internalId() - 1].vCoins[index.row()];
+}
+
+QModelIndex CoinControlModel::coinIndex(int nCoin, int column) const
+{
+    if (!fTreeMode)
+        return vCoinRow[nCoin] < nFetched ? createIndex(vCoinRow[nCoin], column, quintptr(0)) : QModelIndex();
+    int nGroup = vCoinGroup[nCoin];
+    if (vGroupRow[nGroup] >= nFetched)
+        return QModelIndex();
+    return createIndex(vCoinRow[nCoin], column, quintptr(nGroup + 1));
+}
+
+QModelIndex CoinControlModel::groupIndex(int nGroup, int column) const
+{
+    if (!fTreeMode || vGroupRow[nGroup] >= nFetched)
+        return QModelIndex();
+    return createIndex(vGroupRow[nGroup], column, quintptr(0));
+}
+
+const CoinControlRecord *CoinControlModel::coin(const QModelIndex &index) const
+{
+    int nCoin = coinId(index);
+    return nCoin < 0 ? 0 : &coins[nCoin];
+}
+
+Qt::CheckState CoinControlModel::groupCheckState(const Group &g) const
+{
+    if (g.nSelected == 0)
+        return Qt::Unchecked;
+    if (g.nSelected + g.nLocked == (int)g.vCoins.size())
+        return Qt::Checked;
+    return Qt::PartiallyChecked;
+}
+
+QVariant CoinControlModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid())
+        return QVariant();
+    int column = index.column();
+
+    if (isGroup(index))
+    {
+        const Group &g = group(index);
+        if (role == Qt::DisplayRole)
+        {
+            switch (column)
+            {
+            case Checkbox:
+                return "(" + QString::number(g.vCoins.size()) + ")";
+            case Amount:
+                return BitcoinUnits::format(nDisplayUnit, g.nSum);
+            case Label:
+                return g.label.isEmpty() ? strNoLabel : g.label;
+            case Address:
+                return g.address;
+            }
+        }
+        else if (role == Qt::CheckStateRole && column == Checkbox)
+            return groupCheckState(g);
+        return QVariant();
+    }
+
+    int nCoin = coinId(index);
+    const CoinControlRecord &rec = coins[nCoin];
+    switch (role)
+    {
+    case Qt::DisplayRole:
+        switch (column)
+        {
+        case Amount:
+            return BitcoinUnits::format(nDisplayUnit, rec.nValue);
+        case Label:
+            if (rec.isChange())
+                return strChange;
+            if (!fTreeMode)
+                return rec.label.isEmpty() ? strNoLabel : rec.label;
+            break;
+        case Address:
+            // In tree mode the address is not shown again for the group's own coins
+            if (!fTreeMode || rec.isChange())
+                return rec.address;
+            break;
+        case Date:
+            return GUIUtil::dateTimeStr(rec.nTime);
+        case Confirmations:
+            return QString::number(rec.nDepth);
+        }
+        break;
+    case Qt::ToolTipRole:
+        // tooltip from where the change comes from
+        if (column == Label && rec.isChange())
+            return tr("change from %1 (%2)").arg(rec.groupLabel.isEmpty() ? strNoLabel : rec.groupLabel).arg(rec.groupAddress);
+        break;
+    case Qt::CheckStateRole:
+        if (column == Checkbox)
+            return vSelected[nCoin] ? Qt::Checked : Qt::Unchecked;
+        break;
+    case Qt::DecorationRole:
+        if (column == Checkbox && rec.fLocked)
+            return lockedIcon;
+        break;
+    }
+    return QVariant();
+}
+
+bool CoinControlModel::setData(const QModelIndex &index, const QVariant &value, int role)
+{
+    if (!index.isValid() || role != Qt::CheckStateRole || index.column() != Checkbox)
+        return false;
+    bool fSelected = value.toInt() != Qt::Unchecked;
+
+    if (isGroup(index))
+    {
+        const Group &g = group(index);
+        for (int nCoin : g.vCoins)
+            setSelected(nCoin, fSelected);
+        if (!g.vCoins.empty())
+            Q_EMIT dataChanged(this->index(0, Checkbox, index), this->index(g.vCoins.size() - 1, Checkbox, index));
+        Q_EMIT dataChanged(index, index);
+    }
+    else
+    {
+        int nCoin = coinId(index);
+        if (coins[nCoin].fLocked)
+            return false;
+        setSelected(nCoin, fSelected);
+        emitCoinChanged(nCoin);
+    }
+    Q_EMIT selectionChanged();
+    return true;
+}
+
+QVariant CoinControlModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (orientation != Qt::Horizontal)
+        return QVariant();
+    if (role == Qt::DisplayRole)
+    {
+        switch (section)
+        {
+        case Amount:
+            return tr("Amount");
+        case Label:
+            return tr("Received with label");
+        case Address:
+            return tr("Received with address");
+        case Date:
+            return tr("Date");
+        case Confirmations:
+            return tr("Confirmations");
+        }
+    }
+    else if (role == Qt::ToolTipRole && section == Confirmations)
+        return tr("Confirmed");
+    return QVariant();
+}
+
+Qt::ItemFlags CoinControlModel::flags(const QModelIndex &index) const
+{
+    if (!index.isValid())
+        return 0;
+    if (isGroup(index))
+    {
+        Qt::ItemFlags retval = Qt::ItemIsSelectable | Qt::ItemIsEnabled;
+        const Group &g = group(index);
+        if (g.nLocked < (int)g.vCoins.size())
+            retval |= Qt::ItemIsUserCheckable;
+        return retval;
+    }
+    // Locked coins are shown disabled
+    if (coins[coinId(index)].fLocked)
+        return Qt::ItemIsSelectable | Qt::ItemIsUserCheckable;
+    return Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable;
+}
+
+bool CoinControlModel::lessThan(int a, int b, bool fGroups) const
+{
+    int nCmp = 0;
+    if (fGroups)
+    {
+        const Group &ga = groups[a], &gb = groups[b];
+        switch (nSortColumn)
+        {
+        case Amount: nCmp = Compare(ga.nSum, gb.nSum); break;
+        case Label: nCmp = Compare(ga.label, gb.label); break;
+        case Address: nCmp = Compare(ga.address, gb.address); break;
+        case Date: nCmp = Compare(ga.nTime, gb.nTime); break;
+        case Confirmations: nCmp = Compare(ga.nDepth, gb.nDepth); break;
+        }
+    }
+    else
+    {
+        const CoinControlRecord &ca = coins[a], &cb = coins[b];
+        switch (nSortColumn)
+        {
+        case Amount: nCmp = Compare(ca.nValue, cb.nValue); break;
+        case Label:
+            nCmp = Compare(ca.isChange() ? strChange : ca.label.isEmpty() ? strNoLabel : ca.label,
+                           cb.isChange() ? strChange : cb.label.isEmpty() ? strNoLabel : cb.label);
+            break;
+        case Address: nCmp = Compare(ca.address, cb.address); break;
+        case Date: nCmp = Compare(ca.nTime, cb.nTime); break;
+        case Confirmations: nCmp = Compare(ca.nDepth, cb.nDepth); break;
+        }
+    }
+    // Equal keys keep the order the wallet listed them in
+    if (nCmp == 0)
+        return a < b;
+    return sortOrder == Qt::AscendingOrder ? nCmp < 0 : nCmp > 0;
+}
+
+void CoinControlModel::sortRows()
+{
+    vTop.clear();
+    if (fTreeMode)
+    {
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            std::vector<int> &vCoins = groups[i].vCoins;
+            std::sort(vCoins.begin(), vCoins.end(), [this](int a, int b) { return lessThan(a, b, false); });
+            for (size_t j = 0; j < vCoins.size(); j++)
+                vCoinRow[vCoins[j]] = j;
+            vTop.push_back(i);
+        }
+        std::sort(vTop.begin(), vTop.end(), [this](int a, int b) { return lessThan(a, b, true); });
+        for (size_t i = 0; i < vTop.size(); i++)
+            vGroupRow[vTop[i]] = i;
+    }
+    else
+    {
+        for (int i = 0; i < coins.size(); i++)
+            vTop.push_back(i);
+        std::sort(vTop.begin(), vTop.end(), [this](int a, int b) { return lessThan(a, b, false); });
+        for (size_t i = 0; i < vTop.size(); i++)
+            vCoinRow[vTop[i]] = i;
+    }
+}
+
+void CoinControlModel::sort(int column, Qt::SortOrder order)
+{
+    nSortColumn = column;
+    sortOrder = order;
+    if (coins.isEmpty())
+        return;
+
+    Q_EMIT layoutAboutToBeChanged();
+    // Remember the coin or group each persistent index is on, to move it along
+    QModelIndexList oldIndexes = persistentIndexList();
+    std::vector<std::pair<int, bool> > vTargets;
+    vTargets.reserve(oldIndexes.size());
+    Q_FOREACH(const QModelIndex &index, oldIndexes)
+    {
+        if (isGroup(index))
+            vTargets.push_back(std::make_pair(vTop[index.row()], true));
+        else
+            vTargets.push_back(std::make_pair(coinId(index), false));
+    }
+    sortRows();
+    QModelIndexList newIndexes;
+    for (int i = 0; i < oldIndexes.size(); i++)
+    {
+        int nColumn = oldIndexes[i].column();
+        if (vTargets[i].second)
+            newIndexes.append(groupIndex(vTargets[i].first, nColumn));
+        else
+            newIndexes.append(coinIndex(vTargets[i].first, nColumn));
+    }
+    changePersistentIndexList(oldIndexes, newIndexes);
+    Q_EMIT layoutChanged();
+}
+
+void CoinControlModel::setSelected(int nCoin, bool fSelected)
+{
+    if (vSelected[nCoin] == fSelected || (fSelected && coins[nCoin].fLocked))
+        return;
+    vSelected[nCoin] = fSelected;
+    groups[vCoinGroup[nCoin]].nSelected += fSelected ? 1 : -1;
+    if (fSelected)
+        coinControl->Select(coins[nCoin].outpoint);
+    else
+        coinControl->UnSelect(coins[nCoin].outpoint);
+}
+
+void CoinControlModel::emitCoinChanged(int nCoin)
+{
+    QModelIndex index = coinIndex(nCoin, Checkbox);
+    if (index.isValid())
+        Q_EMIT dataChanged(index, coinIndex(nCoin, Confirmations));
+    index = groupIndex(vCoinGroup[nCoin], Checkbox);
+    if (index.isValid())
+        Q_EMIT dataChanged(index, index);
+}
+
+bool CoinControlModel::hasSelected() const
+{
+    for (size_t i = 0; i < groups.size(); i++)
+        if (groups[i].nSelected > 0)
+            return true;
+    return false;
+}
+
+void CoinControlModel::setAllSelected(bool fSelected)
+{
+    for (int i = 0; i < coins.size(); i++)
+        setSelected(i, fSelected);
+    if (!fSelected)
+        coinControl->UnSelectAll(); // just to be sure
+    if (nFetched > 0)
+    {
+        Q_EMIT dataChanged(index(0, Checkbox), index(nFetched - 1, Checkbox));
+        if (fTreeMode)
+        {
+            for (int i = 0; i < nFetched; i++)
+            {
+                QModelIndex parent = index(i, Checkbox);
+                int nChildren = groups[vTop[i]].vCoins.size();
+                Q_EMIT dataChanged(index(0, Checkbox, parent), index(nChildren - 1, Checkbox, parent));
+            }
+        }
+    }
+    Q_EMIT selectionChanged();
+}
+
+void CoinControlModel::setLocked(const QModelIndex &index, bool fLocked)
+{
+    int nCoin = coinId(index);
+    if (nCoin < 0 || coins[nCoin].fLocked == fLocked)
+        return;
+    COutPoint outpoint = coins[nCoin].outpoint;
+    bool fWasSelected = vSelected[nCoin];
+    if (fLocked)
+    {
+        setSelected(nCoin, false);
+        walletModel->lockCoin(outpoint);
+    }
+    else
+        walletModel->unlockCoin(outpoint);
+    coins[nCoin].fLocked = fLocked;
+    groups[vCoinGroup[nCoin]].nLocked += fLocked ? 1 : -1;
+    emitCoinChanged(nCoin);
+    if (fWasSelected)
+        Q_EMIT selectionChanged();
+}
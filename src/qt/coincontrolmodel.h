@@ -0,0 +1,160 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_QT_COINCONTROLMODEL_H
+#define BITCOIN_QT_COINCONTROLMODEL_H
+
+#include "amount.h"
+#include "primitives/transaction.h"
+
+#include <vector>
+
+#include <QAbstractItemModel>
+#include <QIcon>
+#include <QList>
+#include <QString>
+#include <QThread>
+
+class CoinControlLoader;
+class WalletModel;
+
+class CCoinControl;
+
+/** A coin of the wallet as shown by coin control, read from the wallet once */
+struct CoinControlRecord
+{
+    COutPoint outpoint;
+    CAmount nValue;
+    qint64 nTime;
+    int nDepth;
+    bool fLocked;
+    /** Address the coin was received with, empty if it has none */
+    QString address;
+    QString label;
+    /** Address the coin is grouped under: its own, or for change the one it came from */
+    QString groupAddress;
+    QString groupLabel;
+
+    CoinControlRecord() : nValue(0), nTime(0), nDepth(0), fLocked(false) {}
+
+    bool isChange() const { return address != groupAddress; }
+};
+
+/** Model of the coins of a wallet for the coin control dialog.
+ *
+ * Shows the coins as a flat list, or in tree mode grouped under the address
+ * they were received with, change under the address it came from. The coins
+ * are read in the background; sorting works on keys taken when they are
+ * read, and a group's totals are kept up to date as coins are (un)selected,
+ * so neither walks the wallet again. Top level rows are handed to the view a
+ * batch at a time as it scrolls down.
+ */
+class CoinControlModel : public QAbstractItemModel
+{
+    Q_OBJECT
+
+public:
+    explicit CoinControlModel(WalletModel *walletModel, CCoinControl *coinControl, const QIcon &lockedIcon, QObject *parent = 0);
+    ~CoinControlModel();
+
+    enum ColumnIndex {
+        Checkbox = 0,
+        Amount,
+        Label,
+        Address,
+        Date,
+        Confirmations
+    };
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role) const;
+    bool setData(const QModelIndex &index, const QVariant &value, int role);
+    QVariant headerData(int section, Qt::Orientation orientation, int role) const;
+    Qt::ItemFlags flags(const QModelIndex &index) const;
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const;
+    QModelIndex parent(const QModelIndex &index) const;
+    bool canFetchMore(const QModelIndex &parent) const;
+    void fetchMore(const QModelIndex &parent);
+    void sort(int column, Qt::SortOrder order = Qt::AscendingOrder);
+
+    /** (Re)read the coins of the wallet in the background; loaded() follows */
+    void load();
+    bool isLoading() const { return loader != 0; }
+
+    void setTreeMode(bool fTreeMode);
+
+    /** The coin of a row, 0 for an address row in tree mode */
+    const CoinControlRecord *coin(const QModelIndex &index) const;
+    /** Lock or unlock the coin of a row in the wallet */
+    void setLocked(const QModelIndex &index, bool fLocked);
+    /** Whether any coin is selected */
+    bool hasSelected() const;
+    /** Select all coins that are not locked, or unselect all */
+    void setAllSelected(bool fSelected);
+
+Q_SIGNALS:
+    /** The coins were read and are shown */
+    void loaded();
+    /** The user (un)selected coins */
+    void selectionChanged();
+
+private Q_SLOTS:
+    void setCoins(const QList<CoinControlRecord> &records);
+
+private:
+    /** Coins that share a group address, in the order shown */
+    struct Group
+    {
+        QString address;
+        QString label;
+        CAmount nSum;
+        qint64 nTime;
+        int nDepth;
+        int nLocked;
+        int nSelected;
+        std::vector<int> vCoins;
+
+        Group() : nSum(0), nTime(0), nDepth(0), nLocked(0), nSelected(0) {}
+    };
+
+    WalletModel *walletModel;
+    CCoinControl *coinControl;
+    QIcon lockedIcon;
+    QString strChange;
+    QString strNoLabel;
+    int nDisplayUnit;
+    bool fTreeMode;
+    int nSortColumn;
+    Qt::SortOrder sortOrder;
+
+    QList<CoinControlRecord> coins;
+    std::vector<bool> vSelected;
+    //! Group of each coin
+    std::vector<int> vCoinGroup;
+    std::vector<Group> groups;
+    //! Top level rows: coins in list mode, groups in tree mode
+    std::vector<int> vTop;
+    //! Row of each coin and group among its siblings
+    std::vector<int> vCoinRow;
+    std::vector<int> vGroupRow;
+    //! Top level rows handed to the view so far
+    int nFetched;
+
+    CoinControlLoader *loader;
+    QThread loaderThread;
+
+    bool isGroup(const QModelIndex &index) const;
+    const Group &group(const QModelIndex &index) const;
+    int coinId(const QModelIndex &index) const;
+    QModelIndex coinIndex(int nCoin, int column) const;
+    QModelIndex groupIndex(int nGroup, int column) const;
+    Qt::CheckState groupCheckState(const Group &g) const;
+    bool lessThan(int a, int b, bool fGroups) const;
+    void sortRows();
+    void setSelected(int nCoin, bool fSelected);
+    void emitCoinChanged(int nCoin);
+};
+
+#endif // BITCOIN_QT_COINCONTROLMODEL_H
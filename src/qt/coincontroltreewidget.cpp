@@ -4,9 +4,10 @@
 
 #include "coincontroltreewidget.h"
 #include "coincontroldialog.h"
+#include "coincontrolmodel.h"
 
 CoinControlTreeWidget::CoinControlTreeWidget(QWidget *parent) :
-    QTreeWidget(parent)
+    QTreeView(parent)
 {
 
 }
@@ -16,9 +17,9 @@ void CoinControlTreeWidget::keyPressEvent(QKeyEvent *event)
     if (event->key() == Qt::Key_Space) // press spacebar -> select checkbox
     {
         event->ignore();
-        int COLUMN_CHECKBOX = 0;
-        if(this->currentItem())
-            this->currentItem()->setCheckState(COLUMN_CHECKBOX, ((this->currentItem()->checkState(COLUMN_CHECKBOX) == Qt::Checked) ? Qt::Unchecked : Qt::Checked));
+        QModelIndex index = currentIndex().sibling(currentIndex().row(), CoinControlModel::Checkbox);
+        if (index.isValid() && (index.flags() & Qt::ItemIsEnabled) && (index.flags() & Qt::ItemIsUserCheckable))
+            model()->setData(index, ((index.data(Qt::CheckStateRole).toInt() == Qt::Checked) ? Qt::Unchecked : Qt::Checked), Qt::CheckStateRole);
     }
     else if (event->key() == Qt::Key_Escape) // press esc -> close dialog
     {
@@ -28,6 +29,6 @@ void CoinControlTreeWidget::keyPressEvent(QKeyEvent *event)
     }
     else
     {
-        this->QTreeWidget::keyPressEvent(event);
+        this->QTreeView::keyPressEvent(event);
     }
 }
@@ -29,7 +29,7 @@ static UniValue rpcNestedTest_rpc(const JSONRPCRequest& request)
 
 static const CRPCCommand vRPCCommands[] =
 {
-    { "test", "rpcNestedTest", &rpcNestedTest_rpc, true, {} },
+    { "test", "rpcNestedTest", &rpcNestedTest_rpc, true, {}, false },
 };
 
 void RPCNestedTests::rpcNestedTests()
@@ -48,6 +48,7 @@ void RPCNestedTests::rpcNestedTests()
     ForceSetArg("-datadir", path);
     //mempool.setSanityCheck(1.0);
     pblocktree = new CBlockTreeDB(1 << 20, true);
+    pindexesdb = new CIndexesDB(1 << 20, true);
     pcoinsdbview = new CCoinsViewDB(1 << 23, true);
     pcoinsTip = new CCoinsViewCache(pcoinsdbview);
     InitBlockIndex(chainparams);
@@ -151,6 +152,7 @@ void RPCNestedTests::rpcNestedTests()
     delete pcoinsTip;
     delete pcoinsdbview;
     delete pblocktree;
+    delete pindexesdb;
 
     boost::filesystem::remove_all(boost::filesystem::path(path));
 }
@@ -25,6 +25,11 @@
 #include <QDebug>
 #include <QIcon>
 #include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QTimer>
+
+#include <atomic>
 
 #include <boost/foreach.hpp>
 
@@ -55,13 +60,86 @@ struct TxLessThan
     }
 };
 
+/** Wallet transactions read per page. The model reads the first page itself;
+ * the loader thread reads the rest, holding the locks for one page at a time
+ * so that neither the GUI nor the node waits on it for long.
+ */
+static const int TRANSACTION_LOAD_PAGE_SIZE = 1000;
+
+/** Batches of more transaction notifications than this are a burst */
+static const unsigned int TRANSACTION_NOTIFY_BURST = 10;
+
+/* Decomposes the wallet transactions following a given one, a page at a time.
+ */
+class TransactionTableLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    TransactionTableLoader(CWallet *_wallet) : wallet(_wallet), fInterrupt(false) {}
+
+    /* Decompose the page of transactions after hashAfter (from the first if
+     * fFromStart) into records, counting them in nRead. Returns false once the
+     * end of the wallet is reached. Must be called with cs_main and cs_wallet held.
+     */
+    static bool loadPage(CWallet *wallet, bool fFromStart, uint256 &hashAfter, size_t &nRead, QList<TransactionRecord> &records, int &nProgress)
+    {
+        std::map<uint256, CWalletTx>::iterator it = fFromStart ? wallet->mapWallet.begin() : wallet->mapWallet.upper_bound(hashAfter);
+        for (int n = 0; n < TRANSACTION_LOAD_PAGE_SIZE && it != wallet->mapWallet.end(); ++n, ++it)
+        {
+            if(TransactionRecord::showTransaction(it->second))
+                records.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+            hashAfter = it->first;
+            nRead++;
+        }
+        if (it == wallet->mapWallet.end())
+        {
+            nProgress = 100;
+            return false;
+        }
+        nProgress = std::min<size_t>(99, nRead * 100 / wallet->mapWallet.size());
+        return true;
+    }
+
+    void interrupt() { fInterrupt = true; }
+
+public Q_SLOTS:
+    void load(const QString &hashStart, int nStartRead)
+    {
+        uint256 hashAfter;
+        hashAfter.SetHex(hashStart.toStdString());
+        size_t nRead = nStartRead;
+        bool fMore = true;
+        while (fMore && !fInterrupt)
+        {
+            QList<TransactionRecord> records;
+            int nProgress;
+            LOCK2(cs_main, wallet->cs_wallet);
+            fMore = loadPage(wallet, false, hashAfter, nRead, records, nProgress);
+            // Emitted with cs_wallet held, so that it reaches the model before
+            // any change to the wallet made after the page was read.
+            Q_EMIT loaded(records, QString::fromStdString(hashAfter.GetHex()), nProgress);
+        }
+    }
+
+Q_SIGNALS:
+    void loaded(const QList<TransactionRecord> &records, const QString &hashLast, int nProgress);
+
+private:
+    CWallet *wallet;
+    std::atomic<bool> fInterrupt;
+};
+
+#include "transactiontablemodel.moc"
+
 // Private implementation
 class TransactionTablePriv
 {
 public:
     TransactionTablePriv(CWallet *_wallet, TransactionTableModel *_parent) :
         wallet(_wallet),
-        parent(_parent)
+        parent(_parent),
+        loadProgress(100)
     {
     }
 
@@ -74,20 +152,41 @@ public:
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    /* Until loadProgress reaches 100, the cache only holds the transactions up
+     * to hashLoaded; the loader reads the others later, so updates to those are
+     * left to it.
      */
-    void refreshWallet()
+    uint256 hashLoaded;
+    int loadProgress;
+
+    /* Query the first page of the wallet anew from core. Returns whether
+     * the loader has more to read after hashLoaded.
+     */
+    bool refreshWallet()
     {
         qDebug() << "TransactionTablePriv::refreshWallet";
         cachedWallet.clear();
+        bool fMore;
         {
             LOCK2(cs_main, wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
-            {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
-            }
+            size_t nRead = 0;
+            fMore = TransactionTableLoader::loadPage(wallet, true, hashLoaded, nRead, cachedWallet, loadProgress);
+        }
+        return fMore;
+    }
+
+    /* Append a page read by the loader, which follows everything in the cache.
+     */
+    void appendLoaded(const QList<TransactionRecord> &records, const uint256 &hashLast, int nProgress)
+    {
+        if(!records.isEmpty())
+        {
+            parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size() + records.size() - 1);
+            cachedWallet.append(records);
+            parent->endInsertRows();
         }
+        hashLoaded = hashLast;
+        loadProgress = nProgress;
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -99,6 +198,12 @@ public:
     {
         qDebug() << "TransactionTablePriv::updateWallet: " + QString::fromStdString(hash.ToString()) + " " + QString::number(status);
 
+        if(loadProgress < 100 && hashLoaded < hash)
+        {
+            qDebug() << "    not loaded yet, left to the loader";
+            return;
+        }
+
         // Find bounds of this transaction in model
         QList<TransactionRecord>::iterator lower = qLowerBound(
             cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
@@ -241,22 +346,66 @@ TransactionTableModel::TransactionTableModel(const PlatformStyle *_platformStyle
         walletModel(parent),
         priv(new TransactionTablePriv(_wallet, this)),
         fProcessingQueuedTransactions(false),
-        platformStyle(_platformStyle)
+        platformStyle(_platformStyle),
+        loader(0),
+        notifications(new TransactionNotificationBatch()),
+        notifyTimer(new QTimer(this))
 {
     columns << QString() << QString() << tr("Date") << tr("Type") << tr("Label") << BitcoinUnits::getAmountColumnTitle(walletModel->getOptionsModel()->getDisplayUnit());
-    priv->refreshWallet();
+    bool fMore = priv->refreshWallet();
 
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
 
+    notifyTimer->setSingleShot(true);
+    connect(notifyTimer, SIGNAL(timeout()), this, SLOT(endNotificationWindow()));
+
     subscribeToCoreSignals();
+
+    if (fMore)
+    {
+        // Large wallet: load the rest in the background
+        qRegisterMetaType< QList<TransactionRecord> >("QList<TransactionRecord>");
+        loader = new TransactionTableLoader(wallet);
+        loader->moveToThread(&loaderThread);
+        connect(loader, SIGNAL(loaded(QList<TransactionRecord>,QString,int)), this, SLOT(appendLoaded(QList<TransactionRecord>,QString,int)));
+        connect(&loaderThread, SIGNAL(finished()), loader, SLOT(deleteLater()), Qt::DirectConnection);
+        loaderThread.start(QThread::LowPriority);
+        QMetaObject::invokeMethod(loader, "load", Qt::QueuedConnection,
+                                  Q_ARG(QString, QString::fromStdString(priv->hashLoaded.GetHex())),
+                                  Q_ARG(int, TRANSACTION_LOAD_PAGE_SIZE));
+    }
 }
 
 TransactionTableModel::~TransactionTableModel()
 {
     unsubscribeFromCoreSignals();
+    if (loader)
+        loader->interrupt();
+    loaderThread.quit();
+    loaderThread.wait();
+    delete notifications;
     delete priv;
 }
 
+bool TransactionTableModel::isLoading() const
+{
+    return priv->loadProgress < 100;
+}
+
+void TransactionTableModel::appendLoaded(const QList<TransactionRecord> &records, const QString &hashLast, int nProgress)
+{
+    uint256 hash;
+    hash.SetHex(hashLast.toStdString());
+    priv->appendLoaded(records, hash, nProgress);
+    Q_EMIT loadingProgress(nProgress);
+    if (nProgress == 100)
+    {
+        // The loader deletes itself when its thread finishes
+        loaderThread.quit();
+        loader = 0;
+    }
+}
+
 /** Updates the column title to "Amount (DisplayUnit)" and emits headerDataChanged() signal for table headers to react. */
 void TransactionTableModel::updateAmountColumnTitle()
 {
@@ -709,33 +858,122 @@ void TransactionTableModel::updateDisplayUnit()
     Q_EMIT dataChanged(index(0, Amount), index(priv->size()-1, Amount));
 }
 
-// queue notifications to show a non freezing progress dialog e.g. for rescan
 struct TransactionNotification
 {
-public:
-    TransactionNotification() {}
-    TransactionNotification(uint256 _hash, ChangeType _status, bool _showTransaction):
+    TransactionNotification(const uint256 &_hash, ChangeType _status, bool _showTransaction):
         hash(_hash), status(_status), showTransaction(_showTransaction) {}
 
-    void invoke(QObject *ttm)
-    {
-        QString strHash = QString::fromStdString(hash.GetHex());
-        qDebug() << "NotifyTransactionChanged: " + strHash + " status= " + QString::number(status);
-        QMetaObject::invokeMethod(ttm, "updateTransaction", Qt::QueuedConnection,
-                                  Q_ARG(QString, strHash),
-                                  Q_ARG(int, status),
-                                  Q_ARG(bool, showTransaction));
-    }
-private:
     uint256 hash;
     ChangeType status;
     bool showTransaction;
 };
 
-static bool fQueueNotifications = false;
-static std::vector< TransactionNotification > vQueueNotifications;
+/**
+ * Transaction notifications from the core on their way to the GUI thread.
+ * They are handed over in batches, a transaction notified several times
+ * before its batch is applied appearing in it once. During a rescan they
+ * are held until it ends, so the progress dialog does not freeze.
+ */
+class TransactionNotificationBatch
+{
+public:
+    TransactionNotificationBatch(): fScheduled(false), fHeld(false) {}
+
+    /** Add a notification; returns whether the caller has to schedule the batch for processing */
+    bool push(const TransactionNotification &notification)
+    {
+        QMutexLocker locker(&mutex);
+        std::map<uint256, size_t>::iterator it = mapIndex.find(notification.hash);
+        if (it != mapIndex.end())
+        {
+            // updateWallet works out from showTransaction whether to add, keep or remove
+            // the transaction, so the latest one stands for all of them
+            vPending[it->second].status = CT_UPDATED;
+            vPending[it->second].showTransaction = notification.showTransaction;
+            return false;
+        }
+        mapIndex.insert(std::make_pair(notification.hash, vPending.size()));
+        vPending.push_back(notification);
+        return schedule();
+    }
+
+    /** Hold notifications back, or release them; returns whether the caller has to schedule the batch */
+    bool hold(bool fHold)
+    {
+        QMutexLocker locker(&mutex);
+        fHeld = fHold;
+        return !vPending.empty() && schedule();
+    }
+
+    /** Take the notifications received so far, in the order they first arrived */
+    std::vector<TransactionNotification> take()
+    {
+        QMutexLocker locker(&mutex);
+        std::vector<TransactionNotification> vTaken;
+        vTaken.swap(vPending);
+        mapIndex.clear();
+        return vTaken;
+    }
+
+    /** The window after a batch ended; returns whether another batch is waiting */
+    bool endWindow()
+    {
+        QMutexLocker locker(&mutex);
+        if (vPending.empty() || fHeld)
+        {
+            fScheduled = false;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    QMutex mutex;
+    //! A batch is posted to the GUI thread, or the window after one is open
+    bool fScheduled;
+    bool fHeld;
+    std::vector<TransactionNotification> vPending;
+    std::map<uint256, size_t> mapIndex;
+
+    bool schedule()
+    {
+        if (fScheduled || fHeld)
+            return false;
+        fScheduled = true;
+        return true;
+    }
+};
+
+void TransactionTableModel::processNotifications()
+{
+    std::vector<TransactionNotification> vBatch = notifications->take();
+    if (vBatch.size() > TRANSACTION_NOTIFY_BURST) // prevent balloon spam, show maximum 10 balloons
+        setProcessingQueuedTransactions(true);
+    for (unsigned int i = 0; i < vBatch.size(); ++i)
+    {
+        if (vBatch.size() - i <= TRANSACTION_NOTIFY_BURST)
+            setProcessingQueuedTransactions(false);
+
+        qDebug() << "NotifyTransactionChanged: " + QString::fromStdString(vBatch[i].hash.GetHex()) + " status= " + QString::number(vBatch[i].status);
+        priv->updateWallet(vBatch[i].hash, vBatch[i].status, vBatch[i].showTransaction);
+    }
+
+    // Notifications are applied as soon as the GUI thread gets to them, those
+    // that came in meanwhile together. After a burst, as during staking or a
+    // rescan, collect them for a while before the next batch.
+    if (vBatch.size() > TRANSACTION_NOTIFY_BURST)
+        notifyTimer->start(TRANSACTION_NOTIFY_DELAY);
+    else
+        endNotificationWindow();
+}
+
+void TransactionTableModel::endNotificationWindow()
+{
+    if (notifications->endWindow())
+        QMetaObject::invokeMethod(this, "processNotifications", Qt::QueuedConnection);
+}
 
-static void NotifyTransactionChanged(TransactionTableModel *ttm, CWallet *wallet, const uint256 &hash, ChangeType status)
+static void NotifyTransactionChanged(TransactionTableModel *ttm, TransactionNotificationBatch *notifications, CWallet *wallet, const uint256 &hash, ChangeType status)
 {
     // Find transaction in wallet
     std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
@@ -743,47 +981,30 @@ static void NotifyTransactionChanged(TransactionTableModel *ttm, CWallet *wallet
     bool inWallet = mi != wallet->mapWallet.end();
     bool showTransaction = (inWallet && TransactionRecord::showTransaction(mi->second));
 
-    TransactionNotification notification(hash, status, showTransaction);
-
-    if (fQueueNotifications)
-    {
-        vQueueNotifications.push_back(notification);
-        return;
-    }
-    notification.invoke(ttm);
+    if (notifications->push(TransactionNotification(hash, status, showTransaction)))
+        QMetaObject::invokeMethod(ttm, "processNotifications", Qt::QueuedConnection);
 }
 
-static void ShowProgress(TransactionTableModel *ttm, const std::string &title, int nProgress)
+static void ShowProgress(TransactionTableModel *ttm, TransactionNotificationBatch *notifications, const std::string &title, int nProgress)
 {
+    // queue notifications to show a non freezing progress dialog e.g. for rescan
     if (nProgress == 0)
-        fQueueNotifications = true;
+        notifications->hold(true);
 
-    if (nProgress == 100)
-    {
-        fQueueNotifications = false;
-        if (vQueueNotifications.size() > 10) // prevent balloon spam, show maximum 10 balloons
-            QMetaObject::invokeMethod(ttm, "setProcessingQueuedTransactions", Qt::QueuedConnection, Q_ARG(bool, true));
-        for (unsigned int i = 0; i < vQueueNotifications.size(); ++i)
-        {
-            if (vQueueNotifications.size() - i <= 10)
-                QMetaObject::invokeMethod(ttm, "setProcessingQueuedTransactions", Qt::QueuedConnection, Q_ARG(bool, false));
-
-            vQueueNotifications[i].invoke(ttm);
-        }
-        std::vector<TransactionNotification >().swap(vQueueNotifications); // clear
-    }
+    if (nProgress == 100 && notifications->hold(false))
+        QMetaObject::invokeMethod(ttm, "processNotifications", Qt::QueuedConnection);
 }
 
 void TransactionTableModel::subscribeToCoreSignals()
 {
     // Connect signals to wallet
-    wallet->NotifyTransactionChanged.connect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
-    wallet->ShowProgress.connect(boost::bind(ShowProgress, this, _1, _2));
+    wallet->NotifyTransactionChanged.connect(boost::bind(NotifyTransactionChanged, this, notifications, _1, _2, _3));
+    wallet->ShowProgress.connect(boost::bind(ShowProgress, this, notifications, _1, _2));
 }
 
 void TransactionTableModel::unsubscribeFromCoreSignals()
 {
     // Disconnect signals from wallet
-    wallet->NotifyTransactionChanged.disconnect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
-    wallet->ShowProgress.disconnect(boost::bind(ShowProgress, this, _1, _2));
+    wallet->NotifyTransactionChanged.disconnect(boost::bind(NotifyTransactionChanged, this, notifications, _1, _2, _3));
+    wallet->ShowProgress.disconnect(boost::bind(ShowProgress, this, notifications, _1, _2));
 }
@@ -9,14 +9,21 @@
 
 #include <QAbstractTableModel>
 #include <QStringList>
+#include <QThread>
 
 class PlatformStyle;
+class TransactionNotificationBatch;
 class TransactionRecord;
+class TransactionTableLoader;
 class TransactionTablePriv;
 class WalletModel;
 
 class CWallet;
 
+QT_BEGIN_NAMESPACE
+class QTimer;
+QT_END_NAMESPACE
+
 /** UI model for the transaction table of a wallet.
  */
 class TransactionTableModel : public QAbstractTableModel
@@ -80,6 +87,8 @@ public:
     QVariant headerData(int section, Qt::Orientation orientation, int role) const;
     QModelIndex index(int row, int column, const QModelIndex & parent = QModelIndex()) const;
     bool processingQueuedTransactions() { return fProcessingQueuedTransactions; }
+    /** Whether transactions are still being loaded in the background, see loadingProgress() */
+    bool isLoading() const;
 
 private:
     CWallet* wallet;
@@ -88,6 +97,13 @@ private:
     TransactionTablePriv *priv;
     bool fProcessingQueuedTransactions;
     const PlatformStyle *platformStyle;
+    /** Loads the rest of a large wallet after the first page; 0 when done */
+    TransactionTableLoader *loader;
+    QThread loaderThread;
+    /** Transaction notifications from the core not applied yet */
+    TransactionNotificationBatch *notifications;
+    /** Runs while notifications are collected between two batches */
+    QTimer *notifyTimer;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -104,6 +120,10 @@ private:
     QVariant txWatchonlyDecoration(const TransactionRecord *wtx) const;
     QVariant txAddressDecoration(const TransactionRecord *wtx) const;
 
+Q_SIGNALS:
+    /** Percentage of the wallet loaded; 100 once it all is */
+    void loadingProgress(int nProgress);
+
 public Q_SLOTS:
     /* New transaction, or transaction changed status */
     void updateTransaction(const QString &hash, int status, bool showTransaction);
@@ -113,6 +133,11 @@ public Q_SLOTS:
     void updateAmountColumnTitle();
     /* Needed to update fProcessingQueuedTransactions through a QueuedConnection */
     void setProcessingQueuedTransactions(bool value) { fProcessingQueuedTransactions = value; }
+    /* A page of transactions from the loader, up to and including hashLast */
+    void appendLoaded(const QList<TransactionRecord> &records, const QString &hashLast, int nProgress);
+    /* Apply the transaction notifications received since the last batch */
+    void processNotifications();
+    void endNotificationWindow();
 
     friend class TransactionTablePriv;
 };
@@ -29,6 +29,7 @@
 #include <QLineEdit>
 #include <QMenu>
 #include <QPoint>
+#include <QProgressBar>
 #include <QScrollBar>
 #include <QSignalMapper>
 #include <QTableView>
@@ -115,9 +116,15 @@ TransactionView::TransactionView(const PlatformStyle *platformStyle, QWidget *pa
     vlayout->setContentsMargins(0,0,0,0);
     vlayout->setSpacing(0);
 
+    // Shown while a large wallet is still being loaded
+    loadingBar = new QProgressBar(this);
+    loadingBar->setFormat(tr("Loading transactions... %p%"));
+    loadingBar->setVisible(false);
+
     QTableView *view = new QTableView(this);
     vlayout->addLayout(hlayout);
     vlayout->addWidget(createDateRangeWidget());
+    vlayout->addWidget(loadingBar);
     vlayout->addWidget(view);
     vlayout->setSpacing(0);
     int width = view->verticalScrollBar()->sizeHint().width();
@@ -238,9 +245,18 @@ void TransactionView::setModel(WalletModel *_model)
 
         // Watch-only signal
         connect(_model, SIGNAL(notifyWatchonlyChanged(bool)), this, SLOT(updateWatchOnlyColumn(bool)));
+
+        connect(_model->getTransactionTableModel(), SIGNAL(loadingProgress(int)), this, SLOT(updateLoadingProgress(int)));
+        updateLoadingProgress(_model->getTransactionTableModel()->isLoading() ? 0 : 100);
     }
 }
 
+void TransactionView::updateLoadingProgress(int nProgress)
+{
+    loadingBar->setValue(nProgress);
+    loadingBar->setVisible(nProgress < 100);
+}
+
 void TransactionView::chooseDate(int idx)
 {
     if(!transactionProxyModel)
@@ -21,6 +21,7 @@ class QFrame;
 class QLineEdit;
 class QMenu;
 class QModelIndex;
+class QProgressBar;
 class QSignalMapper;
 class QTableView;
 QT_END_NAMESPACE
@@ -76,6 +77,7 @@ private:
     QDateTimeEdit *dateFrom;
     QDateTimeEdit *dateTo;
     QAction *abandonAction;
+    QProgressBar *loadingBar;
 
     QWidget *createDateRangeWidget();
 
@@ -99,6 +101,7 @@ private Q_SLOTS:
     void openThirdPartyTxUrl(QString url);
     void updateWatchOnlyColumn(bool fHaveWatchOnly);
     void abandonTx();
+    void updateLoadingProgress(int nProgress);
 
 Q_SIGNALS:
     void doubleClicked(const QModelIndex&);
@@ -5,6 +5,7 @@
 #include "walletmodel.h"
 
 #include "addresstablemodel.h"
+#include "coincontrolmodel.h"
 #include "consensus/validation.h"
 #include "guiconstants.h"
 #include "guiutil.h"
@@ -151,20 +152,22 @@ void WalletModel::pollBalanceChanged()
 
 void WalletModel::checkBalanceChanged()
 {
-    CAmount newBalance = getBalance();
-    CAmount newUnconfirmedBalance = getUnconfirmedBalance();
-    CAmount newImmatureBalance = getImmatureBalance();
-    CAmount newStake = getStake();
+    // One pass over the wallet's balance totals rather than one for each balance
+    CWalletBalances balances = wallet->GetBalances();
+    CAmount newBalance = balances.nBalance;
+    CAmount newUnconfirmedBalance = balances.nUnconfirmed;
+    CAmount newImmatureBalance = balances.nImmature;
+    CAmount newStake = balances.nStake;
     CAmount newWatchOnlyBalance = 0;
     CAmount newWatchUnconfBalance = 0;
     CAmount newWatchImmatureBalance = 0;
     CAmount newWatchOnlyStake = 0;
     if (haveWatchOnly())
     {
-        newWatchOnlyBalance = getWatchBalance();
-        newWatchUnconfBalance = getWatchUnconfirmedBalance();
-        newWatchImmatureBalance = getWatchImmatureBalance();
-        newWatchOnlyStake = getWatchStake();
+        newWatchOnlyBalance = balances.nWatchOnlyBalance;
+        newWatchUnconfBalance = balances.nUnconfirmedWatchOnly;
+        newWatchImmatureBalance = balances.nImmatureWatchOnly;
+        newWatchOnlyStake = balances.nWatchOnlyStake;
     }
 
     if(cachedBalance != newBalance || cachedUnconfirmedBalance != newUnconfirmedBalance || cachedImmatureBalance != newImmatureBalance ||
@@ -498,7 +501,8 @@ static void NotifyTransactionChanged(WalletModel *walletmodel, CWallet *wallet,
     Q_UNUSED(wallet);
     Q_UNUSED(hash);
     Q_UNUSED(status);
-    QMetaObject::invokeMethod(walletmodel, "updateTransaction", Qt::QueuedConnection);
+    // Only marks the balance for the next poll, so no need to go through the event loop
+    walletmodel->updateTransaction();
 }
 
 static void ShowProgress(WalletModel *walletmodel, const std::string &title, int nProgress)
@@ -613,15 +617,16 @@ bool WalletModel::isSpent(const COutPoint& outpoint) const
     return wallet->IsSpent(outpoint.hash, outpoint.n);
 }
 
-// AvailableCoins + LockedCoins grouped by wallet address (put change in one group with wallet address)
-void WalletModel::listCoins(std::map<QString, std::vector<COutput> >& mapCoins) const
+// AvailableCoins + LockedCoins, each with the wallet address it is grouped under (change with the address it came from)
+void WalletModel::listCoins(QList<CoinControlRecord>& records) const
 {
     std::vector<COutput> vCoins;
     wallet->AvailableCoins(vCoins);
 
-    LOCK2(cs_main, wallet->cs_wallet); // ListLockedCoins, mapWallet
+    LOCK2(cs_main, wallet->cs_wallet); // ListLockedCoins, mapWallet, mapAddressBook
     std::vector<COutPoint> vLockedCoins;
     wallet->ListLockedCoins(vLockedCoins);
+    size_t nAvailable = vCoins.size();
 
     // add locked coins
     BOOST_FOREACH(const COutPoint& outpoint, vLockedCoins)
@@ -634,8 +639,10 @@ void WalletModel::listCoins(std::map<QString, std::vector<COutput> >& mapCoins)
             vCoins.push_back(out);
     }
 
-    BOOST_FOREACH(const COutput& out, vCoins)
+    records.reserve(vCoins.size());
+    for (size_t i = 0; i < vCoins.size(); i++)
     {
+        const COutput& out = vCoins[i];
         COutput cout = out;
 
         while (wallet->IsChange(cout.tx->tx->vout[cout.i]) && cout.tx->tx->vin.size() > 0 && wallet->IsMine(cout.tx->tx->vin[0]))
@@ -644,10 +651,38 @@ void WalletModel::listCoins(std::map<QString, std::vector<COutput> >& mapCoins)
             cout = COutput(&wallet->mapWallet[cout.tx->tx->vin[0].prevout.hash], cout.tx->tx->vin[0].prevout.n, 0, true, true);
         }
 
-        CTxDestination address;
-        if(!out.fSpendable || !ExtractDestination(cout.tx->tx->vout[cout.i].scriptPubKey, address))
+        CTxDestination groupAddress;
+        if(!out.fSpendable || !ExtractDestination(cout.tx->tx->vout[cout.i].scriptPubKey, groupAddress))
             continue;
-        mapCoins[QString::fromStdString(CBitcoinAddress(address).ToString())].push_back(out);
+
+        CoinControlRecord rec;
+        const CTxOut& txout = out.tx->tx->vout[out.i];
+        rec.outpoint = COutPoint(out.tx->GetHash(), out.i);
+        rec.nValue = txout.nValue;
+        rec.nTime = out.tx->GetTxTime();
+        rec.nDepth = out.nDepth;
+        rec.fLocked = i >= nAvailable; // AvailableCoins leaves the locked ones out
+        rec.groupAddress = QString::fromStdString(CBitcoinAddress(groupAddress).ToString());
+        std::map<CTxDestination, CAddressBookData>::const_iterator mi = wallet->mapAddressBook.find(groupAddress);
+        if (mi != wallet->mapAddressBook.end())
+            rec.groupLabel = QString::fromStdString(mi->second.name);
+        CTxDestination address;
+        if (ExtractDestination(txout.scriptPubKey, address))
+        {
+            if (address == groupAddress)
+            {
+                rec.address = rec.groupAddress;
+                rec.label = rec.groupLabel;
+            }
+            else
+            {
+                rec.address = QString::fromStdString(CBitcoinAddress(address).ToString());
+                mi = wallet->mapAddressBook.find(address);
+                if (mi != wallet->mapAddressBook.end())
+                    rec.label = QString::fromStdString(mi->second.name);
+            }
+        }
+        records.append(rec);
     }
 }
 
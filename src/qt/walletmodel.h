@@ -10,12 +10,15 @@
 
 #include "support/allocators/secure.h"
 
+#include <atomic>
 #include <map>
 #include <vector>
 
+#include <QList>
 #include <QObject>
 
 class AddressTableModel;
+struct CoinControlRecord;
 class OptionsModel;
 class PlatformStyle;
 class RecentRequestsTableModel;
@@ -195,7 +198,8 @@ public:
     bool getPrivKey(const CKeyID &address, CKey& vchPrivKeyOut) const;
     void getOutputs(const std::vector<COutPoint>& vOutpoints, std::vector<COutput>& vOutputs);
     bool isSpent(const COutPoint& outpoint) const;
-    void listCoins(std::map<QString, std::vector<COutput> >& mapCoins) const;
+    //! Thread safe, the coin control dialog reads the coins in the background
+    void listCoins(QList<CoinControlRecord>& records) const;
 
     bool isLockedCoin(uint256 hash, unsigned int n) const;
     void lockCoin(COutPoint& output);
@@ -217,7 +221,8 @@ public:
 private:
     CWallet *wallet;
     bool fHaveWatchOnly;
-    bool fForceCheckBalanceChanged;
+    //! Set from the core thread when a wallet transaction changed
+    std::atomic<bool> fForceCheckBalanceChanged;
 
     // Wallet has an options model for wallet-specific options
     // (transaction fee, for example)
@@ -273,7 +278,7 @@ Q_SIGNALS:
 public Q_SLOTS:
     /* Wallet status might have changed */
     void updateStatus();
-    /* New transaction, or transaction changed status */
+    /* New transaction, or transaction changed status; safe to call from any thread */
     void updateTransaction();
     /* New, updated or removed address book entry */
     void updateAddressBook(const QString &address, const QString &label, bool isMine, const QString &purpose, int status);
@@ -0,0 +1,397 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "replication.h"
+
+#include "chain.h"
+#include "crypto/common.h"
+#include "dbwrapper.h"
+#include "hash.h"
+#include "streams.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+#include "validationinterface.h"
+#include "warnings.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+CReplicationLog* preplicationlog = NULL;
+
+static bool fReplica = false;
+static boost::filesystem::path pathReplicaPrimary;
+
+//! Key each database keeps the sequence number of the last logged batch written to it under
+static const std::string REPLICATION_SEQ_KEY("\000replication_seq", 16);
+
+//! Names of the replicated databases in the log
+static const char* const REPLICATED_BLOCK_INDEX = "blockindex";
+static const char* const REPLICATED_INDEXES = "indexes";
+static const char* const REPLICATED_CHAINSTATE = "chainstate";
+
+/** Collects the puts and erases of a LevelDB batch */
+class CReplicationOpCollector : public leveldb::WriteBatch::Handler
+{
+public:
+    std::vector<CReplicationOp>& vOps;
+
+    explicit CReplicationOpCollector(std::vector<CReplicationOp>& vOpsIn) : vOps(vOpsIn) {}
+
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+    {
+        vOps.push_back(CReplicationOp());
+        vOps.back().strKey = key.ToString();
+        vOps.back().strValue = value.ToString();
+    }
+
+    void Delete(const leveldb::Slice& key)
+    {
+        vOps.push_back(CReplicationOp());
+        vOps.back().fErase = true;
+        vOps.back().strKey = key.ToString();
+    }
+};
+
+static boost::filesystem::path GetSegmentPath(const boost::filesystem::path& path, uint64_t nSeq)
+{
+    return path / strprintf("%016x.log", nSeq);
+}
+
+/** First sequence numbers of the log segments in path, in order */
+static std::vector<uint64_t> ListSegments(const boost::filesystem::path& path)
+{
+    std::vector<uint64_t> vSeqs;
+    try {
+        for (boost::filesystem::directory_iterator it(path); it != boost::filesystem::directory_iterator(); ++it) {
+            std::string strName = it->path().filename().string();
+            if (strName.size() == 20 && strName.compare(16, 4, ".log") == 0 && IsHex(strName.substr(0, 16)))
+                vSeqs.push_back(strtoull(strName.substr(0, 16).c_str(), NULL, 16));
+        }
+    } catch (const boost::filesystem::filesystem_error& e) {
+        LogPrintf("%s: cannot list %s: %s\n", __func__, path.string(), e.what());
+    }
+    std::sort(vSeqs.begin(), vSeqs.end());
+    return vSeqs;
+}
+
+uint64_t GetReplicationSeq(const CDBWrapper& db)
+{
+    uint64_t nSeq = 0;
+    db.Read(REPLICATION_SEQ_KEY, nSeq);
+    return nSeq;
+}
+
+CReplicationLog::CReplicationLog(const boost::filesystem::path& pathIn, uint64_t nMaxSizeIn) :
+    path(pathIn), nMaxSize(nMaxSizeIn), nNextSeq(1), file(NULL), nSegmentSize(0)
+{
+}
+
+CReplicationLog::~CReplicationLog()
+{
+    if (file)
+        fclose(file);
+}
+
+bool CReplicationLog::Open(const std::vector<std::pair<std::string, CDBWrapper*> >& vDBs)
+{
+    LOCK(cs);
+    TryCreateDirectory(path);
+    // Batches are logged after they are written, so no database is behind the log
+    uint64_t nLastSeq = 0;
+    for (const std::pair<std::string, CDBWrapper*>& db : vDBs)
+        nLastSeq = std::max(nLastSeq, GetReplicationSeq(*db.second));
+    nNextSeq = nLastSeq + 1;
+    for (const std::pair<std::string, CDBWrapper*>& db : vDBs)
+        db.second->SetReplicationLog(this, db.first);
+    LogPrintf("Replication log in %s continues at record %d\n", path.string(), nNextSeq);
+    return true;
+}
+
+bool CReplicationLog::StartSegment(uint64_t nFirstSeq)
+{
+    boost::filesystem::path pathSegment = GetSegmentPath(path, nFirstSeq);
+    file = fopen(pathSegment.string().c_str(), "ab");
+    if (!file)
+        return error("%s: cannot open %s", __func__, pathSegment.string());
+    nSegmentSize = boost::filesystem::file_size(pathSegment);
+    return true;
+}
+
+void CReplicationLog::PruneSegments()
+{
+    std::vector<uint64_t> vSeqs = ListSegments(path);
+    std::vector<uint64_t> vSizes;
+    uint64_t nTotal = 0;
+    for (uint64_t nSeq : vSeqs) {
+        boost::system::error_code ec;
+        vSizes.push_back(boost::filesystem::file_size(GetSegmentPath(path, nSeq), ec));
+        nTotal += ec ? 0 : vSizes.back();
+    }
+    // The newest segment is the one being written
+    for (size_t i = 0; i + 1 < vSeqs.size() && nTotal > nMaxSize; i++) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetSegmentPath(path, vSeqs[i]), ec);
+        nTotal -= std::min(nTotal, vSizes[i]);
+    }
+}
+
+bool CReplicationLog::WriteBatch(CDBWrapper& db, CDBBatch& batch, bool fSync)
+{
+    LOCK(cs);
+    uint64_t nSeq = nNextSeq++;
+    batch.Write(REPLICATION_SEQ_KEY, nSeq);
+    db.WriteBatchUnlogged(batch, fSync);
+
+    CReplicationRecord record;
+    record.nSeq = nSeq;
+    record.strDB = db.strReplicationName;
+    CReplicationOpCollector collector(record.vOps);
+    batch.batch.Iterate(&collector);
+
+    // Size and checksum, then the record, written at once so a reader never
+    // sees a record cut short anywhere but at the end of the file
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord << record;
+    if (ssRecord.size() > std::numeric_limits<uint32_t>::max())
+        throw dbwrapper_error(strprintf("Replication log record %d too large", nSeq));
+    std::vector<unsigned char> vData(8);
+    WriteLE32(&vData[0], ssRecord.size());
+    WriteLE32(&vData[4], ReadLE32(Hash(ssRecord.begin(), ssRecord.end()).begin()));
+    vData.insert(vData.end(), ssRecord.begin(), ssRecord.end());
+
+    if (!file && !StartSegment(nSeq))
+        throw dbwrapper_error("Failed to open the replication log");
+    if (fwrite(vData.data(), 1, vData.size(), file) != vData.size() || fflush(file) != 0)
+        throw dbwrapper_error("Failed to write to the replication log");
+    if (fSync)
+        FileCommit(file);
+    nSegmentSize += vData.size();
+    if (nSegmentSize >= REPLICATION_SEGMENT_SIZE) {
+        fclose(file);
+        file = NULL;
+        PruneSegments();
+    }
+    return true;
+}
+
+CReplicationLogReader::CReplicationLogReader(const boost::filesystem::path& pathIn, uint64_t nSeqAfter) :
+    path(pathIn), nLastSeq(nSeqAfter), file(NULL), nSegmentSeq(0)
+{
+}
+
+CReplicationLogReader::~CReplicationLogReader()
+{
+    if (file)
+        fclose(file);
+}
+
+bool CReplicationLogReader::OpenSegment(std::string& strError)
+{
+    std::vector<uint64_t> vSeqs = ListSegments(path);
+    if (vSeqs.empty())
+        return false;
+    // The last segment starting at or before the next record holds it
+    std::vector<uint64_t>::iterator it = std::upper_bound(vSeqs.begin(), vSeqs.end(), nLastSeq + 1);
+    if (it == vSeqs.begin()) {
+        strError = strprintf("the replication log starts at record %d, after record %d this replica needs", vSeqs.front(), nLastSeq + 1);
+        return false;
+    }
+    nSegmentSeq = *(--it);
+    boost::filesystem::path pathSegment = GetSegmentPath(path, nSegmentSeq);
+    file = fopen(pathSegment.string().c_str(), "rb");
+    if (!file) {
+        strError = strprintf("cannot open %s", pathSegment.string());
+        return false;
+    }
+    return true;
+}
+
+bool CReplicationLogReader::Next(CReplicationRecord& record, std::string& strError)
+{
+    while (true) {
+        if (!file && !OpenSegment(strError))
+            return false;
+
+        long nPos = ftell(file);
+        unsigned char header[8];
+        std::vector<char> vData;
+        bool fComplete = false;
+        if (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+            vData.resize(ReadLE32(header));
+            if (fread(vData.data(), 1, vData.size(), file) == vData.size()) {
+                fComplete = ReadLE32(Hash(vData.begin(), vData.end()).begin()) == ReadLE32(header + 4);
+                if (!fComplete && fgetc(file) != EOF) {
+                    strError = strprintf("corrupt record in replication log segment %016x", nSegmentSeq);
+                    return false;
+                }
+            }
+        }
+
+        if (!fComplete) {
+            clearerr(file);
+            fseek(file, nPos, SEEK_SET);
+            // The primary only starts a new segment once it is done with
+            // this one, so with a later one there this one is read to the end
+            std::vector<uint64_t> vSeqs = ListSegments(path);
+            std::vector<uint64_t>::iterator it = std::upper_bound(vSeqs.begin(), vSeqs.end(), nSegmentSeq);
+            if (it == vSeqs.end())
+                return false;
+            if (*it != nLastSeq + 1) {
+                strError = strprintf("the replication log has a gap after record %d", nLastSeq);
+                return false;
+            }
+            fclose(file);
+            file = NULL;
+            continue;
+        }
+
+        try {
+            CDataStream ssRecord(vData.data(), vData.data() + vData.size(), SER_DISK, CLIENT_VERSION);
+            ssRecord >> record;
+        } catch (const std::exception& e) {
+            strError = strprintf("cannot read record in replication log segment %016x: %s", nSegmentSeq, e.what());
+            return false;
+        }
+        if (record.nSeq <= nLastSeq)
+            continue;
+        if (record.nSeq != nLastSeq + 1) {
+            strError = strprintf("the replication log has a gap after record %d", nLastSeq);
+            return false;
+        }
+        nLastSeq = record.nSeq;
+        return true;
+    }
+}
+
+bool StartReplicationLog(uint64_t nMaxSize)
+{
+    std::vector<std::pair<std::string, CDBWrapper*> > vDBs;
+    vDBs.push_back(std::make_pair(REPLICATED_BLOCK_INDEX, pblocktree));
+    vDBs.push_back(std::make_pair(REPLICATED_INDEXES, pindexesdb));
+    vDBs.push_back(std::make_pair(REPLICATED_CHAINSTATE, &pcoinsdbview->GetDB()));
+    preplicationlog = new CReplicationLog(GetDataDir() / "replication", nMaxSize);
+    return preplicationlog->Open(vDBs);
+}
+
+void StopReplicationLog()
+{
+    delete preplicationlog;
+    preplicationlog = NULL;
+}
+
+bool IsReplica()
+{
+    return fReplica;
+}
+
+void InitReplica(const boost::filesystem::path& pathPrimary)
+{
+    fReplica = true;
+    pathReplicaPrimary = pathPrimary;
+}
+
+const boost::filesystem::path& GetReplicaPrimaryDir()
+{
+    return pathReplicaPrimary;
+}
+
+bool IsReplicaSafeCommand(const std::string& strMethod)
+{
+    static const std::set<std::string> setUnsafe = {
+        "generate", "generatetoaddress", "invalidateblock", "loadtxoutset", "preciousblock",
+        "prioritisetransaction", "pruneblockchain", "reconsiderblock", "sendrawtransaction",
+        "sendrawtransactions", "submitblock", "submitstakeblock",
+    };
+    return !setUnsafe.count(strMethod);
+}
+
+void ThreadReplicaFollow()
+{
+    RenameThread("jbcoin-replica");
+
+    std::map<std::string, CDBWrapper*> mapDBs;
+    mapDBs[REPLICATED_BLOCK_INDEX] = pblocktree;
+    mapDBs[REPLICATED_INDEXES] = pindexesdb;
+    mapDBs[REPLICATED_CHAINSTATE] = &pcoinsdbview->GetDB();
+    // Records are applied, as they were written on the primary, one after
+    // the other, so every record up to the highest one a database holds is
+    // in its database already; a database a batch is written to less often
+    // just holds an older one
+    uint64_t nStartSeq = 0;
+    for (const auto& db : mapDBs)
+        nStartSeq = std::max(nStartSeq, GetReplicationSeq(*db.second));
+    CReplicationLogReader reader(GetReplicaPrimaryDir() / "replication", nStartSeq);
+    LogPrintf("%s: following %s after record %d\n", __func__, GetReplicaPrimaryDir().string(), nStartSeq);
+
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            std::set<uint256> setBlockIndexChanged;
+            bool fIndexesChanged = false;
+            unsigned int nRecords = 0;
+            CReplicationRecord record;
+            std::string strError;
+            while (nRecords < REPLICA_MAX_RECORDS_PER_UPDATE && reader.Next(record, strError)) {
+                nRecords++;
+                std::map<std::string, CDBWrapper*>::iterator it = mapDBs.find(record.strDB);
+                if (it == mapDBs.end())
+                    continue;
+                CDBBatch batch(*it->second);
+                for (const CReplicationOp& op : record.vOps) {
+                    uint256 hash;
+                    if (op.fErase) {
+                        batch.EraseRaw(op.strKey);
+                    } else {
+                        batch.WriteRaw(op.strKey, op.strValue);
+                        if (record.strDB == REPLICATED_BLOCK_INDEX && CBlockTreeDB::ParseBlockIndexKey(op.strKey, hash))
+                            setBlockIndexChanged.insert(hash);
+                    }
+                }
+                it->second->WriteBatch(batch);
+                fIndexesChanged |= record.strDB == REPLICATED_INDEXES;
+            }
+            if (!strError.empty()) {
+                std::string strMessage = strprintf(_("Replication stopped: %s. Seed this replica again from a copy of the primary's data directory."), strError);
+                LogPrintf("%s: %s\n", __func__, strMessage);
+                SetMiscWarning(strMessage);
+                return;
+            }
+            if (nRecords == 0) {
+                MilliSleep(REPLICA_POLL_MILLIS);
+                continue;
+            }
+
+            if (fIndexesChanged)
+                pindexesdb->ClearCache();
+            CBlockIndex* pindexNewTip = NULL;
+            const CBlockIndex* pindexFork = NULL;
+            {
+                LOCK(cs_main);
+                if (!UpdateReplicaState(setBlockIndexChanged, pindexNewTip, pindexFork)) {
+                    SetMiscWarning(_("Replication stopped: the replicated block index could not be loaded."));
+                    return;
+                }
+            }
+            if (pindexNewTip) {
+                GetMainSignals().UpdatedBlockTip(pindexNewTip, pindexFork, false);
+                uiInterface.NotifyBlockTip(false, pindexNewTip);
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        LogPrintf("%s: interrupted\n", __func__);
+        throw;
+    } catch (const std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadReplicaFollow()");
+        SetMiscWarning(strprintf(_("Replication stopped: %s"), e.what()));
+    }
+}
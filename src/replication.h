@@ -0,0 +1,169 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_REPLICATION_H
+#define BITCOIN_REPLICATION_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+class CDBBatch;
+class CDBWrapper;
+
+/** MiB of replication log a primary keeps by default (-replicationlog, 0 to write none) */
+static const unsigned int DEFAULT_REPLICATION_LOG_SIZE = 0;
+/** A log segment is closed and a new one started once it reaches this size */
+static const uint64_t REPLICATION_SEGMENT_SIZE = 64 << 20;
+/** How often a replica looks for new records once it has caught up */
+static const int64_t REPLICA_POLL_MILLIS = 250;
+/** Most records a replica applies before it brings its in-memory state up to date */
+static const unsigned int REPLICA_MAX_RECORDS_PER_UPDATE = 1000;
+
+/**
+ * Read-only replicas (-replicaof).
+ *
+ * LevelDB databases cannot be opened by two processes, so a replica does not
+ * share its primary's databases but keeps a copy of them: it starts from a
+ * copy of the primary's data directory, taken while the primary was stopped,
+ * and replays the batches the primary writes after that. A primary started
+ * with -replicationlog appends every batch written to its block index,
+ * chainstate and explorer index databases, in the order written, to
+ * segment files in <datadir>/replication. Each batch also stores its
+ * sequence number under a key of its own in the database it goes to, so a
+ * replica knows where each of its databases is up to in the log.
+ *
+ * The replica reads the block and undo files straight from the primary's
+ * blocks directory, does not connect to peers or validate anything, and
+ * refuses the RPC calls that would change its state. A gap in the log (the
+ * primary crashed between writing a batch and logging it, or the replica
+ * fell behind the part of the log still kept) stops replication; the
+ * replica then has to be seeded again from a fresh copy.
+ */
+
+/** One put or erase of a replicated batch, key and value as stored */
+struct CReplicationOp
+{
+    bool fErase;
+    std::string strKey;
+    std::string strValue;
+
+    CReplicationOp() : fErase(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(fErase);
+        READWRITE(strKey);
+        if (!fErase)
+            READWRITE(strValue);
+    }
+};
+
+/** A batch written to one of the replicated databases */
+struct CReplicationRecord
+{
+    uint64_t nSeq;
+    std::string strDB;
+    std::vector<CReplicationOp> vOps;
+
+    CReplicationRecord() : nSeq(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(nSeq);
+        READWRITE(strDB);
+        READWRITE(vOps);
+    }
+};
+
+/** The primary's side: logs the batches of the databases attached to it */
+class CReplicationLog
+{
+public:
+    /** Log to segment files in pathIn, keeping about nMaxSizeIn bytes of them */
+    CReplicationLog(const boost::filesystem::path& pathIn, uint64_t nMaxSizeIn);
+    ~CReplicationLog();
+
+    /** Attach the databases under their names, continuing after the highest sequence number they hold */
+    bool Open(const std::vector<std::pair<std::string, CDBWrapper*> >& vDBs);
+
+    /** Write a batch of an attached database and log it (called by CDBWrapper::WriteBatch) */
+    bool WriteBatch(CDBWrapper& db, CDBBatch& batch, bool fSync);
+
+private:
+    //! Held from taking a sequence number until its batch is logged, so the log is in order
+    CCriticalSection cs;
+    const boost::filesystem::path path;
+    const uint64_t nMaxSize;
+    uint64_t nNextSeq;
+    FILE* file;
+    uint64_t nSegmentSize;
+
+    //! Open a new segment, named after the first record that goes into it
+    bool StartSegment(uint64_t nFirstSeq);
+    void PruneSegments();
+};
+
+/** The log the databases are attached to on a primary, if any */
+extern CReplicationLog* preplicationlog;
+
+/** Start logging the batches of the block index, explorer index and chainstate databases */
+bool StartReplicationLog(uint64_t nMaxSize);
+/** Close the log, once the databases attached to it are closed */
+void StopReplicationLog();
+
+/** Sequence number of the last logged batch a database holds, 0 if none */
+uint64_t GetReplicationSeq(const CDBWrapper& db);
+
+/** The replica's side: reads the records of a primary's log in order */
+class CReplicationLogReader
+{
+public:
+    /** Read the log in pathIn, starting after record nSeqAfter */
+    CReplicationLogReader(const boost::filesystem::path& pathIn, uint64_t nSeqAfter);
+    ~CReplicationLogReader();
+
+    /**
+     * Read the next record. Returns false if there is none yet; strError is
+     * set as well if there never will be, because the log has a gap or no
+     * longer reaches back far enough.
+     */
+    bool Next(CReplicationRecord& record, std::string& strError);
+
+private:
+    const boost::filesystem::path path;
+    uint64_t nLastSeq;
+    FILE* file;
+    //! First sequence number of the open segment
+    uint64_t nSegmentSeq;
+
+    bool OpenSegment(std::string& strError);
+};
+
+/** Whether this node is a read-only replica */
+bool IsReplica();
+/** Set up replica mode for the primary data directory given with -replicaof */
+void InitReplica(const boost::filesystem::path& pathPrimary);
+/** The data directory of the primary a replica follows */
+const boost::filesystem::path& GetReplicaPrimaryDir();
+/** Whether an RPC command leaves a replica's state alone */
+bool IsReplicaSafeCommand(const std::string& strMethod);
+
+/** Replay the primary's log on the replica's databases, bringing the in-memory state up to date as it goes */
+void ThreadReplicaFollow();
+
+#endif // BITCOIN_REPLICATION_H
@@ -0,0 +1,118 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "responsecache.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "rpc/server.h"
+#include "streams.h"
+#include "validation.h"
+#include "version.h"
+
+CResponseCache responseCache(DEFAULT_RESPONSE_CACHE_SIZE << 20);
+
+CResponseCache::CResponseCache(size_t nMaxSizeIn) : nSize(0), nMaxSize(nMaxSizeIn)
+{
+}
+
+size_t CResponseCache::EntrySize(const std::string& key, const Value& value)
+{
+    // Rough allowance for the list node, the map node and the shared_ptr block
+    return 2 * key.size() + value->size() + 128;
+}
+
+void CResponseCache::LimitSize()
+{
+    AssertLockHeld(cs);
+    while (nSize > nMaxSize && !lru.empty()) {
+        nSize -= EntrySize(lru.back().first, lru.back().second);
+        mapEntries.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+void CResponseCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    LimitSize();
+}
+
+CResponseCache::Value CResponseCache::Get(const std::string& key)
+{
+    LOCK(cs);
+    auto it = mapEntries.find(key);
+    if (it == mapEntries.end())
+        return Value();
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+void CResponseCache::Put(const std::string& key, const Value& value)
+{
+    LOCK(cs);
+    if (EntrySize(key, value) > nMaxSize || mapEntries.count(key))
+        return;
+    lru.emplace_front(key, value);
+    mapEntries.emplace(key, lru.begin());
+    nSize += EntrySize(key, value);
+    LimitSize();
+}
+
+void CResponseCache::Clear()
+{
+    LOCK(cs);
+    lru.clear();
+    mapEntries.clear();
+    nSize = 0;
+}
+
+size_t CResponseCache::Count() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+size_t CResponseCache::DynamicSize() const
+{
+    LOCK(cs);
+    return nSize;
+}
+
+bool IsCacheableBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    return chainActive.Contains(pindex) && chainActive.Height() - pindex->nHeight + 1 >= RESPONSE_CACHE_MIN_DEPTH;
+}
+
+CResponseCache::Value ReadSerializedBlock(const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    AssertLockHeld(cs_main);
+    const bool fCacheable = IsCacheableBlock(pindex);
+    const std::string key = "block/" + pindex->GetBlockHash().GetHex();
+    if (fCacheable) {
+        CResponseCache::Value value = responseCache.Get(key);
+        if (value)
+            return value;
+    }
+
+    CResponseCache::Value value;
+    if (IsRawBlockSerialization(pindex, RPCSerializationFlags(), consensusParams)) {
+        std::vector<unsigned char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, pindex, Params().MessageStart()))
+            return CResponseCache::Value();
+        value = std::make_shared<const std::string>(vchBlock.begin(), vchBlock.end());
+    } else {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex, consensusParams))
+            return CResponseCache::Value();
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+        ssBlock << block;
+        value = std::make_shared<const std::string>(ssBlock.begin(), ssBlock.end());
+    }
+    if (fCacheable)
+        responseCache.Put(key, value);
+    return value;
+}
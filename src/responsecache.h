@@ -0,0 +1,86 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RESPONSECACHE_H
+#define BITCOIN_RESPONSECACHE_H
+
+#include "sync.h"
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+class CBlockIndex;
+
+namespace Consensus { struct Params; }
+
+/** Default for -responsecachesize, in MiB */
+static const unsigned int DEFAULT_RESPONSE_CACHE_SIZE = 32;
+/** Blocks with fewer confirmations than this are never cached, nor given an ETag */
+static const int RESPONSE_CACHE_MIN_DEPTH = 10;
+
+/**
+ * Least recently used cache of immutable reply data, such as serialized
+ * blocks and transactions, bounded by the total size of keys and values.
+ *
+ * Values are shared and never modified, so a reader keeps its copy alive
+ * after it is evicted. The cache has its own lock; cs_main must not be
+ * taken while holding it.
+ */
+class CResponseCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Value;
+
+    CResponseCache(size_t nMaxSizeIn);
+
+    /** Set the size bound, evicting as needed. 0 disables the cache. */
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    /** The value stored under key, or null */
+    Value Get(const std::string& key);
+
+    /** Store value under key, unless it alone exceeds the size bound */
+    void Put(const std::string& key, const Value& value);
+
+    void Clear();
+
+    /** Number of entries */
+    size_t Count() const;
+
+    /** Accounted size of all entries, in bytes */
+    size_t DynamicSize() const;
+
+private:
+    typedef std::list<std::pair<std::string, Value> > EntryList;
+
+    static size_t EntrySize(const std::string& key, const Value& value);
+    void LimitSize();
+
+    mutable CCriticalSection cs;
+    //! Most recently used first
+    EntryList lru;
+    std::unordered_map<std::string, EntryList::iterator> mapEntries;
+    size_t nSize;
+    size_t nMaxSize;
+};
+
+extern CResponseCache responseCache;
+
+/**
+ * Whether replies about pindex may be cached: it must be in the active
+ * chain with at least RESPONSE_CACHE_MIN_DEPTH confirmations, so a reorg
+ * cannot reasonably drop it. cs_main must be held.
+ */
+bool IsCacheableBlock(const CBlockIndex* pindex);
+
+/**
+ * The block at pindex as serialized for RPC and REST replies, read through
+ * responseCache if the block is cacheable. Returns null if the block cannot
+ * be read from disk. cs_main must be held.
+ */
+CResponseCache::Value ReadSerializedBlock(const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+
+#endif // BITCOIN_RESPONSECACHE_H
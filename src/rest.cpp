@@ -3,15 +3,19 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "base58.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "responsecache.h"
 #include "validation.h"
 #include "httpserver.h"
+#include "rpc/jsonstream.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "utilstrencodings.h"
 #include "version.h"
@@ -21,6 +25,11 @@
 #include <univalue.h>
 
 static const size_t MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+//! Outpoints /rest/getutxosbatch looks up at once
+static const size_t MAX_GETUTXOS_BATCH_OUTPOINTS = 10000;
+//! Bytes of a /rest/getutxosbatch reply serialized before they are added to the body
+static const size_t GETUTXOS_BATCH_CHUNK_SIZE = 64 * 1024;
+static const size_t MAX_REST_ADDRESSES = 16; //allow a max of 16 addresses to be queried at once
 
 enum RetFormat {
     RF_UNDEF,
@@ -40,16 +49,19 @@ static const struct {
 };
 
 struct CCoin {
-    uint32_t nTxVer; // Don't call this nVersion, that name has a special meaning inside IMPLEMENT_SERIALIZE
     uint32_t nHeight;
     CTxOut out;
 
     ADD_SERIALIZE_METHODS;
 
+    CCoin() : nHeight(0) {}
+    CCoin(Coin&& in) : nHeight(in.nHeight), out(std::move(in.out)) {}
+
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action)
     {
-        READWRITE(nTxVer);
+        uint32_t nTxVerDummy = 0;
+        READWRITE(nTxVerDummy);
         READWRITE(nHeight);
         READWRITE(out);
     }
@@ -59,8 +71,22 @@ extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue&
 extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
 extern UniValue mempoolInfoToJSON();
 extern UniValue mempoolToJSON(bool fVerbose = false);
+extern void blockToJSON(JSONStreamWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool txDetails);
+extern void mempoolToJSON(JSONStreamWriter& writer);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
+extern UniValue getaddressutxos(const JSONRPCRequest& request);
+extern UniValue getaddressdeltas(const JSONRPCRequest& request);
+extern UniValue getaddressbalance(const JSONRPCRequest& request);
+extern UniValue getblockhashes(const JSONRPCRequest& request);
+extern bool heightSort(std::pair<CAddressUnspentKey, CAddressUnspentValue> a,
+                       std::pair<CAddressUnspentKey, CAddressUnspentValue> b);
+
+/** Writes a JSON reply body straight into the reply buffer */
+static JSONStreamWriter::Sink ReplySink(HTTPRequest* req)
+{
+    return [req](const std::string& strData) { req->WriteReplyBody(strData); };
+}
 
 static bool RESTERR(HTTPRequest* req, enum HTTPStatusCode status, std::string message)
 {
@@ -168,14 +194,14 @@ static bool rest_headers(HTTPRequest* req,
     case RF_BINARY: {
         std::string binaryHeader = ssHeader.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryHeader);
+        req->WriteReply(HTTP_OK, std::move(binaryHeader));
         return true;
     }
 
     case RF_HEX: {
         std::string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        req->WriteReply(HTTP_OK, std::move(strHex));
         return true;
     }
     case RF_JSON: {
@@ -185,7 +211,7 @@ static bool rest_headers(HTTPRequest* req,
         }
         std::string strJSON = jsonHeaders.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, std::move(strJSON));
         return true;
     }
     default: {
@@ -212,6 +238,7 @@ static bool rest_block(HTTPRequest* req,
 
     CBlock block;
     CBlockIndex* pblockindex = NULL;
+    CResponseCache::Value serialized;
     {
         LOCK(cs_main);
         if (mapBlockIndex.count(hash) == 0)
@@ -221,33 +248,42 @@ static bool rest_block(HTTPRequest* req,
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        if (rf == RF_BINARY || rf == RF_HEX) {
+            // The serialized form of a buried block never changes, so it can
+            // be tagged and served from the cache. JSON carries the live
+            // confirmation count and is always rendered afresh.
+            if (IsCacheableBlock(pblockindex) && req->CheckETag("\"" + hashStr + (rf == RF_BINARY ? ".bin\"" : ".hex\""))) {
+                req->WriteReply(HTTP_NOT_MODIFIED);
+                return true;
+            }
+            serialized = ReadSerializedBlock(pblockindex, Params().GetConsensus());
+            if (!serialized)
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        } else if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus())) {
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        }
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
-        std::string binaryBlock = ssBlock.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryBlock);
+        req->WriteReply(HTTP_OK, serialized);
         return true;
     }
 
     case RF_HEX: {
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+        std::string strHex = HexStr(serialized->begin(), serialized->end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        req->WriteReply(HTTP_OK, std::move(strHex));
         return true;
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        std::string strJSON = objBlock.write() + "\n";
+        JSONStreamWriter writer(ReplySink(req));
+        blockToJSON(writer, block, pblockindex, showTxDetails);
+        writer.Flush();
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, "\n");
         return true;
     }
 
@@ -287,7 +323,7 @@ static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
         UniValue chainInfoObject = getblockchaininfo(jsonRequest);
         std::string strJSON = chainInfoObject.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, std::move(strJSON));
         return true;
     }
     default: {
@@ -312,7 +348,7 @@ static bool rest_mempool_info(HTTPRequest* req, const std::string& strURIPart)
 
         std::string strJSON = mempoolInfoObject.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, std::move(strJSON));
         return true;
     }
     default: {
@@ -333,11 +369,11 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
 
     switch (rf) {
     case RF_JSON: {
-        UniValue mempoolObject = mempoolToJSON(true);
-
-        std::string strJSON = mempoolObject.write() + "\n";
+        JSONStreamWriter writer(ReplySink(req));
+        mempoolToJSON(writer);
+        writer.Flush();
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, "\n");
         return true;
     }
     default: {
@@ -372,14 +408,14 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     case RF_BINARY: {
         std::string binaryTx = ssTx.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryTx);
+        req->WriteReply(HTTP_OK, std::move(binaryTx));
         return true;
     }
 
     case RF_HEX: {
         std::string strHex = HexStr(ssTx.begin(), ssTx.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        req->WriteReply(HTTP_OK, std::move(strHex));
         return true;
     }
 
@@ -388,7 +424,7 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
         TxToJSON(*tx, hashBlock, objTx);
         std::string strJSON = objTx.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, std::move(strJSON));
         return true;
     }
 
@@ -469,8 +505,8 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
                 if (fInputParsed) //don't allow sending input over URI and HTTP RAW DATA
                     return RESTERR(req, HTTP_BAD_REQUEST, "Combination of URI scheme inputs and raw post data is not allowed");
 
-                CDataStream oss(SER_NETWORK, PROTOCOL_VERSION);
-                oss << strRequestMutable;
+                // Read the posted bytes in place; they are not a serialized string
+                CSpanReader oss(SER_NETWORK, PROTOCOL_VERSION, (const unsigned char*)strRequestMutable.data(), strRequestMutable.size());
                 oss >> fCheckMemPool;
                 oss >> vOutPoints;
             }
@@ -514,22 +550,11 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
             view.SetBackend(viewMempool); // switch cache backend to db+mempool in case user likes to query mempool
 
         for (size_t i = 0; i < vOutPoints.size(); i++) {
-            CCoins coins;
-            uint256 hash = vOutPoints[i].hash;
             bool hit = false;
-            if (view.GetCoins(hash, coins)) {
-                mempool.pruneSpent(hash, coins);
-                if (coins.IsAvailable(vOutPoints[i].n)) {
-                    hit = true;
-                    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
-                    // n is valid but points to an already spent output (IsNull).
-                    CCoin coin;
-                    coin.nTxVer = coins.nVersion;
-                    coin.nHeight = coins.nHeight;
-                    coin.out = coins.vout.at(vOutPoints[i].n);
-                    assert(!coin.out.IsNull());
-                    outs.push_back(coin);
-                }
+            Coin coin;
+            if (view.GetCoin(vOutPoints[i], coin) && !mempool.isSpent(vOutPoints[i])) {
+                hit = true;
+                outs.emplace_back(std::move(coin));
             }
 
             hits.push_back(hit);
@@ -547,7 +572,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
         std::string ssGetUTXOResponseString = ssGetUTXOResponse.str();
 
         req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, ssGetUTXOResponseString);
+        req->WriteReply(HTTP_OK, std::move(ssGetUTXOResponseString));
         return true;
     }
 
@@ -557,7 +582,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
         std::string strHex = HexStr(ssGetUTXOResponse.begin(), ssGetUTXOResponse.end()) + "\n";
 
         req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        req->WriteReply(HTTP_OK, std::move(strHex));
         return true;
     }
 
@@ -573,7 +598,6 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
         UniValue utxos(UniValue::VARR);
         BOOST_FOREACH (const CCoin& coin, outs) {
             UniValue utxo(UniValue::VOBJ);
-            utxo.push_back(Pair("txvers", (int32_t)coin.nTxVer));
             utxo.push_back(Pair("height", (int32_t)coin.nHeight));
             utxo.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
 
@@ -588,7 +612,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
         // return json string
         std::string strJSON = objGetUTXOResponse.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteReply(HTTP_OK, std::move(strJSON));
         return true;
     }
     default: {
@@ -600,6 +624,400 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+/** Reply with serialized index data in the binary or hex format */
+
+/**
+ * /rest/getutxosbatch: BIP64 getutxos for many outpoints, posted in binary or
+ * hex. The coins cache answers what it holds; the rest are read from the coin
+ * database together, in key order, without filling the cache. The reply is
+ * written into the body a chunk of coins at a time.
+ */
+static bool rest_getutxos_batch(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    if (rf != RF_BINARY && rf != RF_HEX)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: bin, hex)");
+    if (!param.empty())
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/getutxosbatch.<bin|hex>");
+
+    std::string strRequest = req->ReadBody();
+    if (rf == RF_HEX) {
+        std::vector<unsigned char> vchRequest = ParseHex(strRequest);
+        strRequest.assign(vchRequest.begin(), vchRequest.end());
+    }
+    bool fCheckMemPool = false;
+    std::vector<COutPoint> vOutPoints;
+    try {
+        CSpanReader oss(SER_NETWORK, PROTOCOL_VERSION, (const unsigned char*)strRequest.data(), strRequest.size());
+        oss >> fCheckMemPool;
+        oss >> vOutPoints;
+    } catch (const std::ios_base::failure& e) {
+        return RESTERR(req, HTTP_BAD_REQUEST, "Parse error");
+    }
+    if (vOutPoints.empty())
+        return RESTERR(req, HTTP_BAD_REQUEST, "Error: empty request");
+    if (vOutPoints.size() > MAX_GETUTXOS_BATCH_OUTPOINTS)
+        return RESTERR(req, HTTP_BAD_REQUEST, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", MAX_GETUTXOS_BATCH_OUTPOINTS, vOutPoints.size()));
+
+    std::vector<Coin> vCoins(vOutPoints.size());
+    std::vector<unsigned char> bitmap((vOutPoints.size() + 7) / 8);
+    uint64_t nHits = 0;
+    int nHeight;
+    uint256 hashTip;
+    {
+        LOCK2(cs_main, mempool.cs);
+        nHeight = chainActive.Height();
+        hashTip = chainActive.Tip()->GetBlockHash();
+
+        std::vector<COutPoint> vMissed;
+        std::vector<size_t> vMissedPos;
+        for (size_t i = 0; i < vOutPoints.size(); i++) {
+            const COutPoint& outpoint = vOutPoints[i];
+            if (fCheckMemPool) {
+                // As CCoinsViewMemPool: a mempool transaction is never pruned
+                CTransactionRef ptx = mempool.get(outpoint.hash);
+                if (ptx) {
+                    if (outpoint.n < ptx->vout.size())
+                        vCoins[i] = Coin(ptx->vout[outpoint.n], MEMPOOL_HEIGHT, false, ptx->IsCoinStake(), ptx->nTime);
+                    continue;
+                }
+            }
+            if (!pcoinsTip->GetCoinInCache(outpoint, vCoins[i])) {
+                vMissed.push_back(outpoint);
+                vMissedPos.push_back(i);
+            }
+        }
+        if (!vMissed.empty()) {
+            std::vector<Coin> vRead;
+            pcoinsdbview->GetCoins(vMissed, vRead);
+            for (size_t j = 0; j < vMissed.size(); j++)
+                vCoins[vMissedPos[j]] = std::move(vRead[j]);
+        }
+
+        for (size_t i = 0; i < vOutPoints.size(); i++) {
+            if (vCoins[i].IsSpent() || mempool.isSpent(vOutPoints[i])) {
+                vCoins[i].Clear();
+                continue;
+            }
+            bitmap[i / 8] |= 1 << (i % 8);
+            nHits++;
+        }
+    }
+
+    // Same serialization as /rest/getutxos: height, tip, bitmap, then the hits as a vector of CCoin
+    const bool fHex = rf == RF_HEX;
+    CDataStream ssChunk(SER_NETWORK, PROTOCOL_VERSION);
+    auto writeChunk = [req, fHex, &ssChunk]() {
+        req->WriteReplyBody(fHex ? HexStr(ssChunk.begin(), ssChunk.end()) : ssChunk.str());
+        ssChunk.clear();
+    };
+    ssChunk << nHeight << hashTip << bitmap;
+    WriteCompactSize(ssChunk, nHits);
+    for (Coin& coin : vCoins) {
+        if (coin.IsSpent())
+            continue;
+        ssChunk << CCoin(std::move(coin));
+        if (ssChunk.size() >= GETUTXOS_BATCH_CHUNK_SIZE)
+            writeChunk();
+    }
+    writeChunk();
+
+    req->WriteHeader("Content-Type", fHex ? "text/plain" : "application/octet-stream");
+    req->WriteReply(HTTP_OK, fHex ? "\n" : "");
+    return true;
+}
+
+static bool RESTSerializedReply(HTTPRequest* req, enum RetFormat rf, const CDataStream& ss)
+{
+    if (rf == RF_BINARY) {
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, ss.str());
+    } else {
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, HexStr(ss.begin(), ss.end()) + "\n");
+    }
+    return true;
+}
+
+/**
+ * Reply with the JSON result of an index RPC, so the REST and RPC views of
+ * the indexes never drift apart. RPC errors become plain text REST errors.
+ */
+static bool RESTIndexRPCReply(HTTPRequest* req, rpcfn_type actor, const UniValue& params)
+{
+    JSONRPCRequest jreq;
+    jreq.params = params;
+    UniValue result;
+    try {
+        result = actor(jreq);
+    } catch (const UniValue& objError) {
+        int code = find_value(objError, "code").get_int();
+        return RESTERR(req, code == RPC_INVALID_ADDRESS_OR_KEY ? HTTP_NOT_FOUND : HTTP_BAD_REQUEST,
+                       find_value(objError, "message").get_str());
+    } catch (const std::exception& e) {
+        return RESTERR(req, HTTP_BAD_REQUEST, e.what());
+    }
+
+    JSONStreamWriter writer(ReplySink(req));
+    writer.Value(result);
+    writer.Flush();
+    req->WriteHeader("Content-Type", "application/json");
+    req->WriteReply(HTTP_OK, "\n");
+    return true;
+}
+
+/** Parse a comma separated list of addresses into address index keys */
+static bool ParseRESTAddresses(HTTPRequest* req, const std::string& strAddresses,
+                               std::vector<std::pair<uint160, int> >& addresses, UniValue& addressValues)
+{
+    std::vector<std::string> vStr;
+    boost::split(vStr, strAddresses, boost::is_any_of(","));
+    if (vStr.size() > MAX_REST_ADDRESSES)
+        return RESTERR(req, HTTP_BAD_REQUEST, strprintf("Error: max addresses exceeded (max: %d, tried: %d)", MAX_REST_ADDRESSES, vStr.size()));
+
+    for (const std::string& strAddress : vStr) {
+        uint160 hashBytes;
+        int type = 0;
+        if (!CBitcoinAddress(strAddress).GetIndexKey(hashBytes, type))
+            return RESTERR(req, HTTP_BAD_REQUEST, "Invalid address: " + strAddress);
+        addresses.push_back(std::make_pair(hashBytes, type));
+        addressValues.push_back(strAddress);
+    }
+    return true;
+}
+
+static bool rest_address_utxos(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    UniValue addressValues(UniValue::VARR);
+    if (!ParseRESTAddresses(req, param, addresses, addressValues))
+        return false;
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+        if (!GetAddressUnspent(addresses, unspentOutputs))
+            return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << unspentOutputs;
+        return RESTSerializedReply(req, rf, ss);
+    }
+
+    case RF_JSON: {
+        UniValue query(UniValue::VOBJ);
+        query.push_back(Pair("addresses", addressValues));
+        UniValue params(UniValue::VARR);
+        params.push_back(query);
+        return RESTIndexRPCReply(req, getaddressutxos, params);
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+static bool rest_address_deltas(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    // <addresses>[/<start>/<end>]
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    int start = 0;
+    int end = 0;
+    if (path.size() == 3) {
+        if (!ParseInt32(path[1], &start) || !ParseInt32(path[2], &end) || start <= 0 || end < start)
+            return RESTERR(req, HTTP_BAD_REQUEST, "Invalid height range: " + path[1] + "/" + path[2]);
+    } else if (path.size() != 1) {
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/address/deltas/<addresses>[/<start>/<end>].<ext>");
+    }
+
+    std::vector<std::pair<uint160, int> > addresses;
+    UniValue addressValues(UniValue::VARR);
+    if (!ParseRESTAddresses(req, path[0], addresses, addressValues))
+        return false;
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > deltas;
+        auto addDelta = [&](const CAddressIndexKey& key, CAmount satoshis) -> bool {
+            deltas.push_back(std::make_pair(key, satoshis));
+            return true;
+        };
+        if (!ScanAddressIndex(addresses, start, end, NULL, addDelta))
+            return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << deltas;
+        return RESTSerializedReply(req, rf, ss);
+    }
+
+    case RF_JSON: {
+        UniValue query(UniValue::VOBJ);
+        query.push_back(Pair("addresses", addressValues));
+        if (start > 0) {
+            query.push_back(Pair("start", start));
+            query.push_back(Pair("end", end));
+        }
+        UniValue params(UniValue::VARR);
+        params.push_back(query);
+        return RESTIndexRPCReply(req, getaddressdeltas, params);
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+static bool rest_address_balance(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    std::vector<std::pair<uint160, int> > addresses;
+    UniValue addressValues(UniValue::VARR);
+    if (!ParseRESTAddresses(req, param, addresses, addressValues))
+        return false;
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        std::vector<CAddressBalance> balances;
+        if (!GetAddressBalances(addresses, balances))
+            return RESTERR(req, HTTP_NOT_FOUND, "No information available for address");
+
+        // Summed over the addresses, like getaddressbalance
+        CAddressBalance total;
+        for (const CAddressBalance& balance : balances) {
+            total.nBalance += balance.nBalance;
+            total.nReceived += balance.nReceived;
+            total.nTxCount += balance.nTxCount;
+        }
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << total;
+        return RESTSerializedReply(req, rf, ss);
+    }
+
+    case RF_JSON: {
+        UniValue query(UniValue::VOBJ);
+        query.push_back(Pair("addresses", addressValues));
+        UniValue params(UniValue::VARR);
+        params.push_back(query);
+        return RESTIndexRPCReply(req, getaddressbalance, params);
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+static bool rest_spentinfo(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    // <txid>/<n>
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    int nOutput;
+    CSpentIndexKey key;
+    if (path.size() != 2 || !ParseHashStr(path[0], key.txid) || !ParseInt32(path[1], &nOutput) || nOutput < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/spentinfo/<txid>/<n>.<ext>");
+    key.outputIndex = nOutput;
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(key, value))
+        return RESTERR(req, HTTP_NOT_FOUND, "Unable to get spent info");
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << value;
+        return RESTSerializedReply(req, rf, ss);
+    }
+
+    case RF_JSON: {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("txid", value.txid.GetHex()));
+        obj.push_back(Pair("index", (int)value.inputIndex));
+        obj.push_back(Pair("height", value.blockHeight));
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, obj.write() + "\n");
+        return true;
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+static bool rest_blockhashes(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    // <high>/<low>
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    int high, low;
+    if (path.size() != 2 || !ParseInt32(path[0], &high) || !ParseInt32(path[1], &low) || high < 0 || low < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/blockhashes/<high>/<low>.<ext>");
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        std::vector<std::pair<uint256, unsigned int> > blockHashes;
+        if (!GetTimestampIndex(high, low, false, blockHashes))
+            return RESTERR(req, HTTP_NOT_FOUND, "No information available for block hashes");
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << blockHashes;
+        return RESTSerializedReply(req, rf, ss);
+    }
+
+    case RF_JSON: {
+        UniValue options(UniValue::VOBJ);
+        options.push_back(Pair("logicalTimes", true));
+        UniValue params(UniValue::VARR);
+        params.push_back(high);
+        params.push_back(low);
+        params.push_back(options);
+        return RESTIndexRPCReply(req, getblockhashes, params);
+    }
+
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(HTTPRequest* req, const std::string& strReq);
@@ -611,7 +1029,13 @@ static const struct {
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/getutxosbatch", rest_getutxos_batch},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/address/utxos/", rest_address_utxos},
+      {"/rest/address/deltas/", rest_address_deltas},
+      {"/rest/address/balance/", rest_address_balance},
+      {"/rest/spentinfo/", rest_spentinfo},
+      {"/rest/blockhashes/", rest_blockhashes},
 };
 
 bool StartREST()
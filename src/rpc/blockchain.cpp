@@ -4,20 +4,28 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "amount.h"
+#include "base58.h"
 #include "chain.h"
 #include "chainparams.h"
+#include "chainsnapshot.h"
 #include "checkpoints.h"
 #include "coins.h"
 #include "consensus/validation.h"
+#include "init.h"
 #include "validation.h"
 #include "policy/policy.h"
+#include "pos.h"
 #include "primitives/transaction.h"
+#include "responsecache.h"
+#include "rpc/jsonstream.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "undo.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utxosnapshot.h"
 #include "hash.h"
 
 #include "txdb.h"
@@ -25,6 +33,7 @@
 
 #include <univalue.h>
 
+#include <boost/filesystem.hpp>
 #include <boost/thread/thread.hpp> // boost::thread::interrupt
 
 #include <mutex>
@@ -50,10 +59,9 @@ double GetDifficulty(const CBlockIndex* blockindex)
     // minimum difficulty = 1.0.
     if (blockindex == NULL)
     {
-        if (chainActive.Tip() == NULL)
+        blockindex = GetChainSnapshot()->Tip();
+        if (blockindex == NULL)
             return 1.0;
-        else
-            blockindex = chainActive.Tip();
     }
 
     int nShift = (blockindex->nBits >> 24) & 0xff;
@@ -78,48 +86,21 @@ double GetDifficulty(const CBlockIndex* blockindex)
 
 double GetPoSKernelPS()
 {
-    int nPoSInterval = 72;
-    double dStakeKernelsTriedAvg = 0;
-    int nStakesHandled = 0, nStakesTime = 0;
-
-    CBlockIndex* pindex = chainActive.Tip();;
-    CBlockIndex* pindexPrevStake = NULL;
-
-    while (pindex && nStakesHandled < nPoSInterval)
-    {
-        if (pindex->IsProofOfStake())
-        {
-            if (pindexPrevStake)
-            {
-                dStakeKernelsTriedAvg += GetDifficulty(pindexPrevStake) * 4294967296.0;
-                nStakesTime += pindexPrevStake->nTime - pindex->nTime;
-                nStakesHandled++;
-            }
-            pindexPrevStake = pindex;
-        }
-
-        pindex = pindex->pprev;
-    }
-
-    double result = 0;
-
-    if (nStakesTime)
-        result = dStakeKernelsTriedAvg / nStakesTime;
-
-    result *= 16;
-
-    return result;
+    LOCK(cs_main);
+    // The window follows the tip, so this only catches up after setstakeweightwindow
+    stakeWeightWindow.SetTip(chainActive.Tip());
+    double dKernelsPerSecond = stakeWeightWindow.GetKernelsPerSecond();
+    stakingStatus.nNetworkWeight = dKernelsPerSecond;
+    return dKernelsPerSecond;
 }
 
 UniValue blockheaderToJSON(const CBlockIndex* blockindex)
 {
+    ChainSnapshotRef chain = GetChainSnapshot();
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
-    int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
+    result.push_back(Pair("confirmations", chain->Confirmations(blockindex)));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", blockindex->nVersion));
     result.push_back(Pair("versionHex", strprintf("%08x", blockindex->nVersion)));
@@ -133,21 +114,18 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("modifier", blockindex->nStakeModifier.GetHex()));
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    const CBlockIndex* pnext = chain->Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+// The fields of blockToJSON before and after the transactions
+static void blockFieldsBeforeTxToJSON(UniValue& result, const CBlock& block, const CBlockIndex* blockindex)
 {
-    UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", blockindex->GetBlockHash().GetHex()));
-    int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
+    result.push_back(Pair("confirmations", GetChainSnapshot()->Confirmations(blockindex)));
     result.push_back(Pair("strippedsize", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS)));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("weight", (int)::GetBlockWeight(block)));
@@ -155,19 +133,10 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("versionHex", strprintf("%08x", block.nVersion)));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    UniValue txs(UniValue::VARR);
-    for(const auto& tx : block.vtx)
-    {
-        if(txDetails)
-        {
-            UniValue objTx(UniValue::VOBJ);
-            TxToJSON(*tx, uint256(), objTx);
-            txs.push_back(objTx);
-        }
-        else
-            txs.push_back(tx->GetHash().GetHex());
-    }
-    result.push_back(Pair("tx", txs));
+}
+
+static void blockFieldsAfterTxToJSON(UniValue& result, const CBlock& block, const CBlockIndex* blockindex)
+{
     result.push_back(Pair("time", block.GetBlockTime()));
     result.push_back(Pair("mediantime", (int64_t)blockindex->GetMedianTimePast()));
     result.push_back(Pair("nonce", (uint64_t)block.nNonce));
@@ -177,16 +146,54 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+    const CBlockIndex* pnext = GetChainSnapshot()->Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     result.push_back(Pair("flags", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work"));
     result.push_back(Pair("modifier", blockindex->nStakeModifier.GetHex()));
     if (block.IsProofOfStake())
     	result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
+}
+
+static UniValue blockTxToJSON(const CTransaction& tx, bool txDetails)
+{
+    if (!txDetails)
+        return tx.GetHash().GetHex();
+    UniValue objTx(UniValue::VOBJ);
+    TxToJSON(tx, uint256(), objTx);
+    return objTx;
+}
+
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    UniValue result(UniValue::VOBJ);
+    blockFieldsBeforeTxToJSON(result, block, blockindex);
+    UniValue txs(UniValue::VARR);
+    for(const auto& tx : block.vtx)
+        txs.push_back(blockTxToJSON(*tx, txDetails));
+    result.push_back(Pair("tx", txs));
+    blockFieldsAfterTxToJSON(result, block, blockindex);
     return result;
 }
 
+void blockToJSON(JSONStreamWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool txDetails)
+{
+    UniValue before(UniValue::VOBJ);
+    blockFieldsBeforeTxToJSON(before, block, blockindex);
+    UniValue after(UniValue::VOBJ);
+    blockFieldsAfterTxToJSON(after, block, blockindex);
+
+    writer.BeginObject();
+    writer.Fields(before);
+    writer.Key("tx");
+    writer.BeginArray();
+    for (const auto& tx : block.vtx)
+        writer.Value(blockTxToJSON(*tx, txDetails));
+    writer.EndArray();
+    writer.Fields(after);
+    writer.EndObject();
+}
+
 UniValue getblockcount(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 0)
@@ -200,8 +207,7 @@ UniValue getblockcount(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainSnapshot()->Height();
 }
 
 UniValue getbestblockhash(const JSONRPCRequest& request)
@@ -217,8 +223,7 @@ UniValue getbestblockhash(const JSONRPCRequest& request)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainSnapshot()->Tip()->GetBlockHash().GetHex();
 }
 
 void RPCNotifyBlockChange(bool ibd, const CBlockIndex * pindex)
@@ -366,7 +371,6 @@ UniValue getdifficulty(const JSONRPCRequest& request)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    LOCK(cs_main);
     return GetDifficulty();
 }
 
@@ -452,6 +456,20 @@ UniValue mempoolToJSON(bool fVerbose = false)
     }
 }
 
+void mempoolToJSON(JSONStreamWriter& writer)
+{
+    LOCK(mempool.cs);
+    writer.BeginObject();
+    BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+    {
+        UniValue info(UniValue::VOBJ);
+        entryToJSON(info, e);
+        writer.Key(e.GetTx().GetHash().ToString());
+        writer.Value(info);
+    }
+    writer.EndObject();
+}
+
 UniValue getrawmempool(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() > 1)
@@ -483,6 +501,73 @@ UniValue getrawmempool(const JSONRPCRequest& request)
     return mempoolToJSON(fVerbose);
 }
 
+UniValue getmempoolchanges(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+            "getmempoolchanges sequence ( verbose )\n"
+            "\nReturns the transactions added to and removed from the memory pool since a mempool sequence,\n"
+            "for keeping a copy of the pool up to date without fetching all of it each time.\n"
+            "The sequence is bumped by every transaction added or removed, and published on the zmq sequence topic.\n"
+            "If the pool no longer remembers the changes since the sequence given, \"complete\" is false and\n"
+            "\"added\" holds the whole pool, which replaces the copy.\n"
+            "\nArguments:\n"
+            "1. sequence   (numeric, required) The \"sequence\" of the previous call, or 0 for the whole pool\n"
+            "2. verbose    (boolean, optional, default=false) Give the entries of added transactions, as getrawmempool does\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sequence\": n,       (numeric) The mempool sequence the changes run to\n"
+            "  \"complete\": true|false, (boolean) Whether the changes are since the sequence given\n"
+            "  \"added\": [          (json array, or object of entries for verbose) Transactions in the pool that were added since\n"
+            "    \"transactionid\"\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"removed\": [        (json array) Transactions no longer in the pool\n"
+            "    \"transactionid\"\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmempoolchanges", "0")
+            + HelpExampleCli("getmempoolchanges", "1234 true")
+            + HelpExampleRpc("getmempoolchanges", "1234, true")
+        );
+
+    const int64_t nSequence = request.params[0].get_int64();
+    if (nSequence < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative sequence");
+    bool fVerbose = false;
+    if (request.params.size() > 1)
+        fVerbose = request.params[1].get_bool();
+
+    LOCK(mempool.cs);
+    std::vector<uint256> vAdded, vRemoved;
+    const bool fComplete = mempool.GetChangesSince(nSequence, vAdded, vRemoved);
+    if (!fComplete)
+        mempool.queryHashes(vAdded);
+
+    UniValue added(fVerbose ? UniValue::VOBJ : UniValue::VARR);
+    for (const uint256& hash : vAdded) {
+        if (fVerbose) {
+            UniValue info(UniValue::VOBJ);
+            entryToJSON(info, *mempool.mapTx.find(hash));
+            added.push_back(Pair(hash.ToString(), info));
+        } else {
+            added.push_back(hash.ToString());
+        }
+    }
+    UniValue removed(UniValue::VARR);
+    for (const uint256& hash : vRemoved)
+        removed.push_back(hash.ToString());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("sequence", (int64_t)mempool.GetSequence()));
+    ret.push_back(Pair("complete", fComplete));
+    ret.push_back(Pair("added", added));
+    ret.push_back(Pair("removed", removed));
+    return ret;
+}
+
 UniValue getmempoolancestors(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1 || request.params.size() > 2) {
@@ -694,9 +779,6 @@ UniValue fTimestampIndex(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<uint256, unsigned int> > blockHashes;
 
-    if (fActiveOnly)
-        LOCK(cs_main);
-
     if (!GetTimestampIndex(high, low, fActiveOnly, blockHashes)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
     }
@@ -731,13 +813,11 @@ UniValue getblockhash(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockhash", "1000")
         );
 
-    LOCK(cs_main);
-
     int nHeight = request.params[0].get_int();
-    if (nHeight < 0 || nHeight > chainActive.Height())
+    const CBlockIndex* pblockindex = (*GetChainSnapshot())[nHeight];
+    if (!pblockindex)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
 
-    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->GetBlockHash().GetHex();
 }
 
@@ -754,6 +834,8 @@ UniValue getblockhashes(const JSONRPCRequest& request )//const UniValue& params,
             "    {\n"
             "      \"noOrphans\":true   (boolean) will only include blocks on the main chain\n"
             "      \"logicalTimes\":true   (boolean) will include logical timestamps with hashes\n"
+            "      \"limit\":n   (numeric) return at most this many blocks, with a cursor for the rest\n"
+            "      \"cursor\":\"cursor\"   (string) continue after the blocks of the page that returned it\n"
             "    }\n"
             "\nResult:\n"
             "[\n"
@@ -765,38 +847,65 @@ UniValue getblockhashes(const JSONRPCRequest& request )//const UniValue& params,
             "    \"logicalts\": (numeric) The logical timestamp\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit or cursor):\n"
+            "{\n"
+            "  \"hashes\": [...]  (array) The blocks of this page, as above\n"
+            "  \"cursor\": \"cursor\"  (string) Pass back for the next page; absent on the last page\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockhashes", "1231614698 1231024505")
             + HelpExampleRpc("getblockhashes", "1231614698, 1231024505")
             + HelpExampleCli("getblockhashes", "1231614698 1231024505 '{\"noOrphans\":false, \"logicalTimes\":true}'")
+            + HelpExampleCli("getblockhashes", "1231614698 1231024505 '{\"noOrphans\":true, \"limit\":1000}'")
             );
 
     unsigned int high = request.params[0].get_int();
     unsigned int low = request.params[1].get_int();
     bool fActiveOnly = false;
     bool fLogicalTS = false;
+    size_t nLimit = 0;
+    bool fHaveCursor = false;
+    CTimestampIndexKey keyAfter;
 
     if (request.params.size() > 2) {
         if (request.params[2].isObject()) {
             UniValue noOrphans = find_value(request.params[2].get_obj(), "noOrphans");
             UniValue returnLogical = find_value(request.params[2].get_obj(), "logicalTimes");
+            UniValue limitValue = find_value(request.params[2].get_obj(), "limit");
+            UniValue cursorValue = find_value(request.params[2].get_obj(), "cursor");
 
             if (noOrphans.isBool())
                 fActiveOnly = noOrphans.get_bool();
 
             if (returnLogical.isBool())
                 fLogicalTS = returnLogical.get_bool();
+
+            if (limitValue.isNum()) {
+                if (limitValue.get_int() <= 0)
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+                nLimit = limitValue.get_int();
+            }
+
+            if (cursorValue.isStr()) {
+                std::vector<unsigned char> data(ParseHex(cursorValue.get_str()));
+                if (!IsHex(cursorValue.get_str()) || data.size() != keyAfter.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION))
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+                CDataStream ssKey(data, SER_NETWORK, PROTOCOL_VERSION);
+                ssKey >> keyAfter;
+                fHaveCursor = true;
+            }
         }
     }
 
     std::vector<std::pair<uint256, unsigned int> > blockHashes;
 
-    if (fActiveOnly)
-        LOCK(cs_main);
-
-    if (!GetTimestampIndex(high, low, fActiveOnly, blockHashes)) {
+    // One more than the page, to tell whether there is another
+    if (!GetTimestampIndex(high, low, fActiveOnly, blockHashes, nLimit > 0 ? nLimit + 1 : 0, fHaveCursor ? &keyAfter : NULL)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
     }
+    bool fMore = nLimit > 0 && blockHashes.size() > nLimit;
+    if (fMore)
+        blockHashes.pop_back();
 
     UniValue result(UniValue::VARR);
 
@@ -811,8 +920,221 @@ UniValue getblockhashes(const JSONRPCRequest& request )//const UniValue& params,
         }
     }
 
+    if (nLimit == 0 && !fHaveCursor)
+        return result;
+
+    UniValue page(UniValue::VOBJ);
+    page.push_back(Pair("hashes", result));
+    if (fMore) {
+        CDataStream ssKey(SER_NETWORK, PROTOCOL_VERSION);
+        ssKey << CTimestampIndexKey(blockHashes.back().second, blockHashes.back().first);
+        page.push_back(Pair("cursor", HexStr(ssKey.begin(), ssKey.end())));
+    }
+    return page;
+}
+
+static CSpentIndexKey SpentIndexKeyFromParam(const UniValue& output)
+{
+    if (!output.isObject())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an object with txid and index");
+    RPCTypeCheckObj(output.get_obj(),
+        {
+            {"txid", UniValueType(UniValue::VSTR)},
+            {"index", UniValueType(UniValue::VNUM)},
+        });
+    int nIndex = find_value(output, "index").get_int();
+    if (nIndex < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid index");
+    return CSpentIndexKey(ParseHashO(output, "txid"), nIndex);
+}
+
+static UniValue SpentInfoToJSON(const CSpentIndexValue& value)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("txid", value.txid.GetHex()));
+    obj.push_back(Pair("index", (int)value.inputIndex));
+    obj.push_back(Pair("height", value.blockHeight));
+    return obj;
+}
+
+UniValue getspentinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "getspentinfo {\"txid\":\"id\",\"index\":n} | [{\"txid\":\"id\",\"index\":n},...]\n"
+            "\nReturns the txid and input index spending an output (requires spentindex to be enabled).\n"
+            "Given an array of outputs, looks them all up together and returns an array in the same order,\n"
+            "with null for outputs that are unspent or unknown.\n"
+            "\nArguments:\n"
+            "1. \"outputs\"   (object or array, required) An output, or an array of them\n"
+            "    {\n"
+            "      \"txid\" (string) The hex string of the txid\n"
+            "      \"index\" (number) The output number\n"
+            "    }\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\"  (string) The transaction id\n"
+            "  \"index\"  (number) The spending input index\n"
+            "  \"height\"  (number) The height of the block spending it, -1 if in the mempool\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'")
+            + HelpExampleRpc("getspentinfo", "[{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}]")
+        );
+
+    std::vector<CSpentIndexKey> keys;
+    bool fBatch = request.params[0].isArray();
+    if (fBatch) {
+        const UniValue& outputs = request.params[0].get_array();
+        for (size_t i = 0; i < outputs.size(); i++)
+            keys.push_back(SpentIndexKeyFromParam(outputs[i]));
+    } else {
+        keys.push_back(SpentIndexKeyFromParam(request.params[0]));
+    }
+
+    std::vector<CSpentIndexValue> values;
+    if (!GetSpentIndexes(keys, values))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    if (!fBatch) {
+        if (values[0].IsNull())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+        return SpentInfoToJSON(values[0]);
+    }
+
+    UniValue result(UniValue::VARR);
+    for (const CSpentIndexValue& value : values)
+        result.push_back(value.IsNull() ? NullUniValue : SpentInfoToJSON(value));
+    return result;
+}
+
+/** Append the address index entry of script to obj, as getaddressdeltas names it; false if it has none */
+static bool PushDeltaAddress(UniValue& obj, const CScript& script, CAddressEncoder& encoder)
+{
+    int type;
+    uint160 hashBytes;
+    GetIndexAddress(script, type, hashBytes);
+    if (type == 2)
+        obj.push_back(Pair("address", encoder.Encode(CScriptID(hashBytes))));
+    else if (type == 1)
+        obj.push_back(Pair("address", encoder.Encode(CKeyID(hashBytes))));
+    else
+        return false;
+    return true;
+}
+
+UniValue getblockdeltas(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "getblockdeltas \"blockhash\"\n"
+            "\nReturns the amounts each transaction of a block takes from and pays to each address,\n"
+            "with the spent outputs read from the block's undo data rather than looked up one by one.\n"
+            "Outputs to scripts without an address are left out.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"          (string, required) The block hash\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"hash\" : \"hash\",     (string) the block hash\n"
+            "  ...                    as for getblock, with \"deltas\" in place of \"tx\"\n"
+            "  \"deltas\" : [\n"
+            "    {\n"
+            "      \"txid\" : \"id\",      (string) The transaction id\n"
+            "      \"index\" : n,        (numeric) The position of the transaction in the block\n"
+            "      \"inputs\" : [\n"
+            "        {\n"
+            "          \"address\" : \"address\",  (string) The address spent from\n"
+            "          \"satoshis\" : n,         (numeric) The amount spent, negative\n"
+            "          \"index\" : n,            (numeric) The input number\n"
+            "          \"prevtxid\" : \"id\",     (string) The txid of the spent output\n"
+            "          \"prevout\" : n           (numeric) The output number of the spent output\n"
+            "        }\n"
+            "        ,...\n"
+            "      ],\n"
+            "      \"outputs\" : [\n"
+            "        {\n"
+            "          \"address\" : \"address\",  (string) The address paid to\n"
+            "          \"satoshis\" : n,         (numeric) The amount paid\n"
+            "          \"index\" : n             (numeric) The output number\n"
+            "        }\n"
+            "        ,...\n"
+            "      ]\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockdeltas", "\"e2acdf2dd19a702e5d12a925f1e984b01e47a933562ca893656d4afb38b44ee3\"")
+            + HelpExampleRpc("getblockdeltas", "\"e2acdf2dd19a702e5d12a925f1e984b01e47a933562ca893656d4afb38b44ee3\"")
+        );
+
+    LOCK(cs_main);
+
+    uint256 hash(ParseHashV(request.params[0], "blockhash"));
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    CBlockIndex* pblockindex = mapBlockIndex[hash];
+
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    // The genesis block spends nothing and has no undo data
+    CBlockUndo blockundo;
+    if (pblockindex->pprev && !ReadBlockUndoFromDisk(blockundo, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read undo data from disk");
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block and undo data inconsistent");
+
+    UniValue deltas(UniValue::VARR);
+    CAddressEncoder encoder;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        UniValue inputs(UniValue::VARR);
+        if (i > 0) {
+            const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+            if (txundo.vprevout.size() != tx.vin.size())
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Transaction and undo data inconsistent");
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CTxOut& prevout = txundo.vprevout[j].out;
+                UniValue delta(UniValue::VOBJ);
+                if (!PushDeltaAddress(delta, prevout.scriptPubKey, encoder))
+                    continue;
+                delta.push_back(Pair("satoshis", -prevout.nValue));
+                delta.push_back(Pair("index", (int)j));
+                delta.push_back(Pair("prevtxid", tx.vin[j].prevout.hash.GetHex()));
+                delta.push_back(Pair("prevout", (int)tx.vin[j].prevout.n));
+                inputs.push_back(delta);
+            }
+        }
+        UniValue outputs(UniValue::VARR);
+        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+            UniValue delta(UniValue::VOBJ);
+            if (!PushDeltaAddress(delta, tx.vout[k].scriptPubKey, encoder))
+                continue;
+            delta.push_back(Pair("satoshis", tx.vout[k].nValue));
+            delta.push_back(Pair("index", (int)k));
+            outputs.push_back(delta);
+        }
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("txid", tx.GetHash().GetHex()));
+        entry.push_back(Pair("index", (int)i));
+        entry.push_back(Pair("inputs", inputs));
+        entry.push_back(Pair("outputs", outputs));
+        deltas.push_back(entry);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    blockFieldsBeforeTxToJSON(result, block, pblockindex);
+    result.push_back(Pair("deltas", deltas));
+    blockFieldsAfterTxToJSON(result, block, pblockindex);
     return result;
 }
+
 UniValue getblockheader(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
@@ -847,8 +1169,6 @@ UniValue getblockheader(const JSONRPCRequest& request)
             + HelpExampleRpc("getblockheader", "\"e2acdf2dd19a702e5d12a925f1e984b01e47a933562ca893656d4afb38b44ee3\"")
         );
 
-    LOCK(cs_main);
-
     std::string strHash = request.params[0].get_str();
     uint256 hash(uint256S(strHash));
 
@@ -856,11 +1176,11 @@ UniValue getblockheader(const JSONRPCRequest& request)
     if (request.params.size() > 1)
         fVerbose = request.params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
+    // The header fields never change, so this needs no cs_main
+    CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    if (!pblockindex)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -933,72 +1253,18 @@ UniValue getblock(const JSONRPCRequest& request)
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
-
     if (!fVerbose)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        CResponseCache::Value serialized = ReadSerializedBlock(pblockindex, Params().GetConsensus());
+        if (!serialized)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        return HexStr(serialized->begin(), serialized->end());
     }
 
-    return blockToJSON(block, pblockindex);
-}
-
-struct CCoinsStats
-{
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
-    uint256 hashSerialized;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
-};
-
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
-{
-    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
-    }
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
-            }
-            stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
-        } else {
-            return error("%s: unable to read value", __func__);
-        }
-        pcursor->Next();
-    }
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
-    return true;
+    return blockToJSON(block, pblockindex);
 }
 
 UniValue pruneblockchain(const JSONRPCRequest& request)
@@ -1052,44 +1318,315 @@ UniValue pruneblockchain(const JSONRPCRequest& request)
 
 UniValue gettxoutsetinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time, unless hash_type is \"none\" and the running totals are known.\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"  (string, optional, default=\"hash_serialized\") \"hash_serialized\" to scan and hash the set, or\n"
+            "                \"none\" for the count, amount and size kept up to date as blocks connect. These are\n"
+            "                counted with a scan once, when not known from before.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (hash_serialized only)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size (hash_serialized only)\n"
+            "  \"bogosize\": n,          (numeric) A database independent size of the set\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (hash_serialized only)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"none\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fHash = true;
+    if (request.params.size() > 0 && !request.params[0].isNull()) {
+        std::string strHashType = request.params[0].get_str();
+        if (strHashType == "none")
+            fHash = false;
+        else if (strHashType != "hash_serialized")
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "hash_type must be \"hash_serialized\" or \"none\"");
+    }
+
     UniValue ret(UniValue::VOBJ);
+    if (!fHash) {
+        LOCK(cs_main);
+        CCoinsTotals totals;
+        uint256 hashBlock;
+        if (GetCoinsTipTotals(totals, hashBlock)) {
+            ret.push_back(Pair("height", (int64_t)chainActive.Height()));
+            ret.push_back(Pair("bestblock", hashBlock.GetHex()));
+            ret.push_back(Pair("txouts", totals.nTransactionOutputs));
+            ret.push_back(Pair("bogosize", totals.nBogoSize));
+            ret.push_back(Pair("total_amount", ValueFromAmount(totals.nTotalAmount)));
+            return ret;
+        }
+    }
 
     CCoinsStats stats;
     FlushStateToDisk();
-    if (GetUTXOStats(pcoinsTip, stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    if (!pcoinsdbview->GetStats(stats, fHash, GetNumCores()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(stats.hashBlock);
+        if (it == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Best block of the UTXO set is not in the block index");
+        stats.nHeight = it->second->nHeight;
+        // The scan gives the running totals a starting point, if the tip is still where it was
+        CCoinsTotals totals;
+        totals.nTransactionOutputs = stats.nTransactionOutputs;
+        totals.nTotalAmount = stats.nTotalAmount;
+        totals.nBogoSize = stats.nBogoSize;
+        SetCoinsTipTotals(totals, stats.hashBlock);
+    }
+    ret.push_back(Pair("height", (int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    if (fHash)
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    if (fHash)
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+    ret.push_back(Pair("bogosize", (int64_t)stats.nBogoSize));
+    if (fHash)
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
-    } else {
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
+static UniValue SnapshotMetadataToJSON(const CUTXOSnapshotMetadata& metadata, const boost::filesystem::path& path)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("base_hash", metadata.hashBase.GetHex()));
+    ret.push_back(Pair("base_height", metadata.nHeight));
+    ret.push_back(Pair("coins", (int64_t)metadata.nCoins));
+    ret.push_back(Pair("snapshot_hash", metadata.hashSnapshot.GetHex()));
+    ret.push_back(Pair("path", path.string()));
+    return ret;
+}
+
+UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the UTXO set, with the stake modifiers and money supply of the chain up to its best block, to a snapshot file.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) Path of the file to write, absolute or relative to the data directory. It must not exist.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"base_hash\": \"hash\",      (string) The block the snapshot is at\n"
+            "  \"base_height\": n,         (numeric) Its height\n"
+            "  \"coins\": n,               (numeric) The number of unspent outputs written\n"
+            "  \"snapshot_hash\": \"hash\",  (string) The hash loadtxoutset expects of the file\n"
+            "  \"path\": \"path\"            (string) The file written\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(request.params[0].get_str(), GetDataDir());
+    CUTXOSnapshotMetadata metadata;
+    std::string strError;
+    if (!DumpUTXOSnapshot(path, metadata, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    return SnapshotMetadataToJSON(metadata, path);
+}
+
+UniValue loadtxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" \"snapshot_hash\"\n"
+            "\nReplace the chainstate of a new pruned node with a snapshot written by dumptxoutset and continue syncing\n"
+            "from its base block. The blocks before it are not downloaded or validated: the snapshot is trusted as far as\n"
+            "its hash is. The headers must have synced up to the base block, no block past genesis may be connected yet,\n"
+            "and no index may be enabled. An interrupted load needs -reindex.\n"
+            "\nArguments:\n"
+            "1. \"path\"           (string, required) Path of the snapshot, absolute or relative to the data directory\n"
+            "2. \"snapshot_hash\"  (string, required) The hash of the snapshot, as reported by dumptxoutset on a trusted node\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"base_hash\": \"hash\",      (string) The block the snapshot is at, now the tip\n"
+            "  \"base_height\": n,         (numeric) Its height\n"
+            "  \"coins\": n,               (numeric) The number of unspent outputs loaded\n"
+            "  \"snapshot_hash\": \"hash\",  (string) The hash of the file\n"
+            "  \"path\": \"path\"            (string) The file read\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\" \"3b2f...\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\", \"3b2f...\"")
+        );
+
+    boost::filesystem::path path = boost::filesystem::absolute(request.params[0].get_str(), GetDataDir());
+    uint256 hashExpected = ParseHashV(request.params[1], "snapshot_hash");
+    CUTXOSnapshotMetadata metadata;
+    std::string strError;
+    if (!LoadUTXOSnapshot(path, hashExpected, metadata, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    // Connect the blocks already received past the base
+    CValidationState state;
+    if (!ActivateBestChain(state, Params()))
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+    return SnapshotMetadataToJSON(metadata, path);
+}
+
+static UniValue DBStatsToJSON(const CDBWrapper& db, bool fVerbose)
+{
+    UniValue ret(UniValue::VOBJ);
+    CDBStats stats = db.GetStats();
+    ret.push_back(Pair("reads", (uint64_t)stats.nReads));
+    ret.push_back(Pair("batches", (uint64_t)stats.nBatches));
+    ret.push_back(Pair("batch_bytes", (uint64_t)stats.nBatchBytes));
+    ret.push_back(Pair("write_time", stats.nWriteMicros * 0.000001));
+    ret.push_back(Pair("stalled_writes", (uint64_t)stats.nStalledWrites));
+    ret.push_back(Pair("stall_time", stats.nStallMicros * 0.000001));
+    UniValue files(UniValue::VARR);
+    for (int nLevel = 0; nLevel < 7; nLevel++) {
+        int64_t nFiles = 0;
+        ParseInt64(db.GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel)), &nFiles);
+        files.push_back(nFiles);
+    }
+    ret.push_back(Pair("files_per_level", files));
+    UniValue sizes(UniValue::VOBJ);
+    for (const std::pair<char, uint64_t>& size : GetDBPrefixSizes(db))
+        sizes.push_back(Pair(std::string(1, size.first), size.second));
+    ret.push_back(Pair("prefix_sizes", sizes));
+    ret.push_back(Pair("stats", db.GetProperty("leveldb.stats")));
+    if (fVerbose)
+        ret.push_back(Pair("sstables", db.GetProperty("leveldb.sstables")));
+    return ret;
+}
+
+UniValue getblockconnectstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "getblockconnectstats ( nblocks )\n"
+            "\nReturns how long each of the last blocks connected to the active chain took, phase by phase.\n"
+            "Times are in microseconds; the phases are those logged under -debug=bench.\n"
+            "\nArguments:\n"
+            "1. nblocks         (numeric, optional, default=10) Number of blocks, up to " + std::to_string(BLOCK_CONNECT_STATS_SIZE) + "\n"
+            "\nResult:\n"
+            "[                  (json array, oldest first)\n"
+            "  {\n"
+            "    \"hash\": \"hash\",        (string) The block hash\n"
+            "    \"height\": n,           (numeric) The block height\n"
+            "    \"time\": n,             (numeric) When it was connected, in seconds since epoch (Jan 1 1970 GMT)\n"
+            "    \"txs\": n,              (numeric) Number of transactions\n"
+            "    \"inputs\": n,           (numeric) Number of transaction inputs\n"
+            "    \"check\": n,            (numeric) ConnectBlock: sanity and proof-of-stake checks\n"
+            "    \"forks\": n,            (numeric) ConnectBlock: duplicate transaction and soft fork checks\n"
+            "    \"connect\": n,          (numeric) ConnectBlock: updating the coins of the transactions\n"
+            "    \"verify\": n,           (numeric) ConnectBlock: updating the coins and verifying the scripts\n"
+            "    \"index\": n,            (numeric) ConnectBlock: writing the undo data and indexes\n"
+            "    \"callbacks\": n,        (numeric) ConnectBlock: notifications\n"
+            "    \"readfromdisk\": n,     (numeric) Reading the block, if it was not in memory\n"
+            "    \"connecttotal\": n,     (numeric) All of ConnectBlock\n"
+            "    \"flush\": n,            (numeric) Writing the block's coins to the coins cache\n"
+            "    \"chainstate\": n,       (numeric) Writing the chainstate to disk, when due\n"
+            "    \"postconnect\": n,      (numeric) Mempool update and tip change\n"
+            "    \"total\": n,            (numeric) All of the above\n"
+            "    \"cachehits\": n,        (numeric) Coin lookups the coins cache answered\n"
+            "    \"cachemisses\": n,      (numeric) Coin lookups that went to the coins database\n"
+            "    \"cachehitratio\": x.xxx (numeric) cachehits over all lookups, 1 if there were none\n"
+            "  }, ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockconnectstats", "")
+            + HelpExampleCli("getblockconnectstats", "100")
+            + HelpExampleRpc("getblockconnectstats", "100")
+        );
+
+    int nBlocks = 10;
+    if (request.params.size() > 0)
+        nBlocks = request.params[0].get_int();
+    if (nBlocks < 0 || nBlocks > (int)BLOCK_CONNECT_STATS_SIZE)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("nblocks must be between 0 and %u", BLOCK_CONNECT_STATS_SIZE));
+
+    UniValue ret(UniValue::VARR);
+    for (const CBlockConnectStats& stats : GetRecentBlockConnectStats(nBlocks)) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("hash", stats.hash.GetHex()));
+        obj.push_back(Pair("height", stats.nHeight));
+        obj.push_back(Pair("time", stats.nTime));
+        obj.push_back(Pair("txs", (uint64_t)stats.nTx));
+        obj.push_back(Pair("inputs", (uint64_t)stats.nInputs));
+        obj.push_back(Pair("check", stats.nTimeCheck));
+        obj.push_back(Pair("forks", stats.nTimeForks));
+        obj.push_back(Pair("connect", stats.nTimeConnect));
+        obj.push_back(Pair("verify", stats.nTimeVerify));
+        obj.push_back(Pair("index", stats.nTimeIndex));
+        obj.push_back(Pair("callbacks", stats.nTimeCallbacks));
+        obj.push_back(Pair("readfromdisk", stats.nTimeReadFromDisk));
+        obj.push_back(Pair("connecttotal", stats.nTimeConnectTotal));
+        obj.push_back(Pair("flush", stats.nTimeFlush));
+        obj.push_back(Pair("chainstate", stats.nTimeChainState));
+        obj.push_back(Pair("postconnect", stats.nTimePostConnect));
+        obj.push_back(Pair("total", stats.nTimeTotal));
+        obj.push_back(Pair("cachehits", stats.nCacheHits));
+        obj.push_back(Pair("cachemisses", stats.nCacheMisses));
+        uint64_t nLookups = stats.nCacheHits + stats.nCacheMisses;
+        obj.push_back(Pair("cachehitratio", nLookups ? (double)stats.nCacheHits / nLookups : 1.0));
+        ret.push_back(obj);
     }
     return ret;
 }
 
+UniValue getdbstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "getdbstats ( verbose )\n"
+            "\nReturns LevelDB statistics of the chainstate, block index and explorer indexes databases.\n"
+            "\nArguments:\n"
+            "1. verbose      (boolean, optional, default=false) Also list the table files of each level\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {         (json object) Statistics of the chainstate database\n"
+            "    \"reads\": n,            (numeric) Reads since the database was opened\n"
+            "    \"batches\": n,          (numeric) Batches written, including single writes and erases\n"
+            "    \"batch_bytes\": n,      (numeric) Approximate size of the batches written\n"
+            "    \"write_time\": x.xxx,   (numeric) Seconds spent writing batches\n"
+            "    \"stalled_writes\": n,   (numeric) Unsynced writes that took 1ms or more, as when compaction falls behind\n"
+            "    \"stall_time\": x.xxx,   (numeric) Seconds spent in those writes\n"
+            "    \"files_per_level\": [n,...], (array) Number of table files at each level\n"
+            "    \"prefix_sizes\": {      (json object) Approximate bytes on disk per record key prefix, such as\n"
+            "                              c and C (coins), b (block index), t (txindex), a, A, u and U (address\n"
+            "                              and unspent indexes), p (spent index), s (timestamp index)\n"
+            "      \"x\": n, ...\n"
+            "    },\n"
+            "    \"stats\": \"...\",        (string) LevelDB's compaction statistics\n"
+            "    \"sstables\": \"...\"      (string) LevelDB's table file listing, if verbose\n"
+            "  },\n"
+            "  \"blockindex\": {...},    (json object) The same for the block index database\n"
+            "  \"indexes\": {...}        (json object) The same for the explorer indexes database\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "true")
+        );
+
+    bool fVerbose = request.params.size() > 0 && request.params[0].get_bool();
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    if (pcoinsdbview)
+        ret.push_back(Pair("chainstate", DBStatsToJSON(pcoinsdbview->GetDB(), fVerbose)));
+    if (pblocktree)
+        ret.push_back(Pair("blockindex", DBStatsToJSON(*pblocktree, fVerbose)));
+    if (pindexesdb)
+        ret.push_back(Pair("indexes", DBStatsToJSON(*pindexesdb, fVerbose)));
+    return ret;
+}
+
 UniValue gettxout(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 2 || request.params.size() > 3)
@@ -1115,7 +1652,6 @@ UniValue gettxout(const JSONRPCRequest& request)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -1139,38 +1675,62 @@ UniValue gettxout(const JSONRPCRequest& request)
     if (request.params.size() > 2)
         fMempool = request.params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
-    ret.push_back(Pair("coinstake", coins.fCoinStake));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
+    ret.push_back(Pair("coinstake", coin.fCoinStake));
 
     return ret;
 }
 
+UniValue setstakeweightwindow(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "setstakeweightwindow nblocks\n"
+            "\nSet the number of proof-of-stake blocks the network stake weight is averaged over.\n"
+            "\nArguments:\n"
+            "1. nblocks      (numeric, required) The window size in PoS blocks.\n"
+            "\nResult:\n"
+            "n               (numeric) The network stake weight over the new window\n"
+            "\nExamples:\n"
+            + HelpExampleCli("setstakeweightwindow", "288")
+            + HelpExampleRpc("setstakeweightwindow", "288")
+        );
+
+    int nWindow = request.params[0].get_int();
+    if (nWindow < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Window must be at least one block");
+
+    LOCK(cs_main);
+    stakeWeightWindow.SetWindow(nWindow);
+    return (uint64_t)GetPoSKernelPS();
+}
+
 UniValue verifychain(const JSONRPCRequest& request)
 {
     int nCheckLevel = GetArg("-checklevel", DEFAULT_CHECKLEVEL);
@@ -1294,6 +1854,9 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
             "        \"timeout\": xx,         (numeric) the median time past of a block at which the deployment is considered failed if not yet locked in\n"
             "        \"since\": xx            (numeric) height of the first block to which the status applies\n"
             "     }\n"
+            "  },\n"
+            "  \"startup\": {                (object) milliseconds each startup stage took, in the order they finished\n"
+            "     \"xxxx\" : xx,              (numeric) e.g. \"block index\", \"verifydb\", \"wallet\", \"addresses\", \"mempool\"\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -1334,6 +1897,11 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
 
         obj.push_back(Pair("pruneheight",        block->nHeight));
     }
+
+    UniValue startup(UniValue::VOBJ);
+    for (const std::pair<std::string, int64_t>& stage : GetInitStageTimes())
+        startup.push_back(Pair(stage.first, stage.second));
+    obj.push_back(Pair("startup", startup));
     return obj;
 }
 
@@ -1387,44 +1955,19 @@ UniValue getchaintips(const JSONRPCRequest& request)
 
     LOCK(cs_main);
 
-    /*
-     * Idea:  the set of chain tips is chainActive.tip, plus orphan blocks which do not have another orphan building off of them. 
-     * Algorithm:
-     *  - Make one pass through mapBlockIndex, picking out the orphan blocks, and also storing a set of the orphan block's pprev pointers.
-     *  - Iterate through the orphan blocks. If the block isn't pointed to by another orphan, it is a chain tip.
-     *  - add chainActive.Tip()
-     */
-    std::set<const CBlockIndex*, CompareBlocksByHeight> setTips;
-    std::set<const CBlockIndex*> setOrphans;
-    std::set<const CBlockIndex*> setPrevs;
-
-    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        if (!chainActive.Contains(item.second)) {
-            setOrphans.insert(item.second);
-            setPrevs.insert(item.second->pprev);
-        }
-    }
-
-    for (std::set<const CBlockIndex*>::iterator it = setOrphans.begin(); it != setOrphans.end(); ++it)
-    {
-        if (setPrevs.erase(*it) == 0) {
-            setTips.insert(*it);
-        }
-    }
-
-    // Always report the currently active tip.
-    setTips.insert(chainActive.Tip());
+    std::vector<std::pair<const CBlockIndex*, const CBlockIndex*> > vTips = GetChainTips();
+    std::map<const CBlockIndex*, const CBlockIndex*, CompareBlocksByHeight> mapTips(vTips.begin(), vTips.end());
 
     /* Construct the output array.  */
     UniValue res(UniValue::VARR);
-    BOOST_FOREACH(const CBlockIndex* block, setTips)
+    for (const std::pair<const CBlockIndex* const, const CBlockIndex*>& tip : mapTips)
     {
+        const CBlockIndex* block = tip.first;
         UniValue obj(UniValue::VOBJ);
         obj.push_back(Pair("height", block->nHeight));
         obj.push_back(Pair("hash", block->phashBlock->GetHex()));
 
-        const int branchLen = block->nHeight - chainActive.FindFork(block)->nHeight;
+        const int branchLen = block->nHeight - tip.second->nHeight;
         obj.push_back(Pair("branchlen", branchLen));
 
         string status;
@@ -1464,30 +2007,72 @@ UniValue mempoolInfoToJSON()
     size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    ret.push_back(Pair("sequence", (int64_t)mempool.GetSequence()));
+
+    return ret;
+}
 
+static UniValue MemPoolComponentToJSON(const MemPoolComponentUsage& component, bool fChurn)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("count", (int64_t)component.nCount));
+    ret.push_back(Pair("usage", (int64_t)component.nUsage));
+    if (fChurn) {
+        ret.push_back(Pair("added", component.nAdded));
+        ret.push_back(Pair("removed", component.nRemoved));
+    }
+    return ret;
+}
+
+UniValue mempoolMemoryToJSON()
+{
+    MemPoolMemoryUsage usage = mempool.GetMemoryUsage();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("transactions", MemPoolComponentToJSON(usage.tx, true)));
+    ret.push_back(Pair("links", MemPoolComponentToJSON(usage.links, false)));
+    ret.push_back(Pair("nexttx", MemPoolComponentToJSON(usage.nextTx, true)));
+    ret.push_back(Pair("deltas", MemPoolComponentToJSON(usage.deltas, false)));
+    ret.push_back(Pair("txhashes", MemPoolComponentToJSON(usage.txHashes, false)));
+    ret.push_back(Pair("addressindex", MemPoolComponentToJSON(usage.addressIndex, true)));
+    ret.push_back(Pair("spentindex", MemPoolComponentToJSON(usage.spentIndex, true)));
     return ret;
 }
 
 UniValue getmempoolinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 1)
         throw runtime_error(
-            "getmempoolinfo\n"
+            "getmempoolinfo ( verbose )\n"
             "\nReturns details on the active state of the TX memory pool.\n"
+            "\nArguments:\n"
+            "1. verbose           (boolean, optional, default=false) Also break the memory usage down by structure\n"
             "\nResult:\n"
             "{\n"
             "  \"size\": xxxxx,               (numeric) Current tx count\n"
             "  \"bytes\": xxxxx,              (numeric) Sum of all virtual transaction sizes as defined in BIP 141. Differs from actual serialized size because witness data is discounted\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
-            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"mempoolminfee\": xxxxx,      (numeric) Minimum fee for tx to be accepted\n"
+            "  \"sequence\": xxxxx,           (numeric) Mempool sequence, see getmempoolchanges\n"
+            "  \"memory\": {                 (json object, verbose only) Memory usage of each structure, summing to 'usage'\n"
+            "    \"name\": {                 (json object) One of transactions, links, nexttx, deltas, txhashes, addressindex, spentindex\n"
+            "      \"count\": xxxxx,          (numeric) Number of elements (address deltas and spent outputs for the indexes)\n"
+            "      \"usage\": xxxxx,          (numeric) Estimated memory usage in bytes\n"
+            "      \"added\": xxxxx,          (numeric, where tracked) Elements inserted since startup\n"
+            "      \"removed\": xxxxx         (numeric, where tracked) Elements erased since startup\n"
+            "    }, ...\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
+            + HelpExampleCli("getmempoolinfo", "true")
             + HelpExampleRpc("getmempoolinfo", "")
         );
 
-    return mempoolInfoToJSON();
+    UniValue ret = mempoolInfoToJSON();
+    if (request.params.size() > 0 && request.params[0].get_bool())
+        ret.push_back(Pair("memory", mempoolMemoryToJSON()));
+    return ret;
 }
 
 UniValue preciousblock(const JSONRPCRequest& request)
@@ -1604,35 +2189,43 @@ UniValue reconsiderblock(const JSONRPCRequest& request)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafe argNames
-  //  --------------------- ------------------------  -----------------------  ------ ----------
-    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,  {} },
-    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,  {} },
-    { "blockchain",         "getblockcount",          &getblockcount,          true,  {} },
-    { "blockchain",         "getblock",               &getblock,               true,  {"blockhash","verbose"} },
-    { "blockchain",         "getblockhash",           &getblockhash,           true,  {"height"} },
-    { "blockchain",         "getblockhashes",         &getblockhashes,         true,  {"start","end"} },
-    { "blockchain",         "getblockheader",         &getblockheader,         true,  {"blockhash","verbose"} },
-    { "blockchain",         "getchaintips",           &getchaintips,           true,  {} },
-    { "blockchain",         "getdifficulty",          &getdifficulty,          true,  {} },
-    { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true,  {"txid","verbose"} },
-    { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true,  {"txid","verbose"} },
-    { "blockchain",         "getmempoolentry",        &getmempoolentry,        true,  {"txid"} },
-    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,  {} },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true,  {"verbose"} },
-    { "blockchain",         "gettxout",               &gettxout,               true,  {"txid","n","include_mempool"} },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  {} },
-    { "blockchain",         "pruneblockchain",        &pruneblockchain,        true,  {"height"} },
-    { "blockchain",         "verifychain",            &verifychain,            true,  {"checklevel","nblocks"} },
-
-    { "blockchain",         "preciousblock",          &preciousblock,          true,  {"blockhash"} },
+{ //  category              name                      actor (function)         okSafe argNames  parallelSafe
+  //  --------------------- ------------------------  -----------------------  ------ ----------  ------------
+    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,  {}, false },
+    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,  {}, true },
+    { "blockchain",         "getblockcount",          &getblockcount,          true,  {}, true },
+    { "blockchain",         "getblock",               &getblock,               true,  {"blockhash","verbose"}, true },
+    { "blockchain",         "getblockhash",           &getblockhash,           true,  {"height"}, true },
+    { "blockchain",         "getblockhashes",         &getblockhashes,         true,  {"start","end"}, true },
+    { "blockchain",         "getblockheader",         &getblockheader,         true,  {"blockhash","verbose"}, true },
+    { "blockchain",         "getspentinfo",           &getspentinfo,           true,  {"outputs"}, true },
+    { "blockchain",         "getblockdeltas",         &getblockdeltas,         true,  {"blockhash"}, true },
+    { "blockchain",         "getblockconnectstats",   &getblockconnectstats,   true,  {"nblocks"}, false },
+    { "blockchain",         "getchaintips",           &getchaintips,           true,  {}, false },
+    { "blockchain",         "getdifficulty",          &getdifficulty,          true,  {}, false },
+    { "blockchain",         "getdbstats",             &getdbstats,             true,  {"verbose"}, false },
+    { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true,  {"txid","verbose"}, true },
+    { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true,  {"txid","verbose"}, true },
+    { "blockchain",         "getmempoolentry",        &getmempoolentry,        true,  {"txid"}, true },
+    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,  {"verbose"}, false },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,  {"verbose"}, false },
+    { "blockchain",         "getmempoolchanges",      &getmempoolchanges,      true,  {"sequence","verbose"}, false },
+    { "blockchain",         "gettxout",               &gettxout,               true,  {"txid","n","include_mempool"}, true },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  {"hash_type"}, false },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true,  {"path"}, false },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           true,  {"path","snapshot_hash"}, false },
+    { "blockchain",         "pruneblockchain",        &pruneblockchain,        true,  {"height"}, false },
+    { "blockchain",         "setstakeweightwindow",   &setstakeweightwindow,   false, {"nblocks"}, false },
+    { "blockchain",         "verifychain",            &verifychain,            true,  {"checklevel","nblocks"}, false },
+
+    { "blockchain",         "preciousblock",          &preciousblock,          true,  {"blockhash"}, false },
 
     /* Not shown in help */
-    { "hidden",             "invalidateblock",        &invalidateblock,        true,  {"blockhash"} },
-    { "hidden",             "reconsiderblock",        &reconsiderblock,        true,  {"blockhash"} },
-    { "hidden",             "waitfornewblock",        &waitfornewblock,        true,  {"timeout"} },
-    { "hidden",             "waitforblock",           &waitforblock,           true,  {"blockhash","timeout"} },
-    { "hidden",             "waitforblockheight",     &waitforblockheight,     true,  {"height","timeout"} },
+    { "hidden",             "invalidateblock",        &invalidateblock,        true,  {"blockhash"}, false },
+    { "hidden",             "reconsiderblock",        &reconsiderblock,        true,  {"blockhash"}, false },
+    { "hidden",             "waitfornewblock",        &waitfornewblock,        true,  {"timeout"}, false },
+    { "hidden",             "waitforblock",           &waitforblock,           true,  {"blockhash","timeout"}, false },
+    { "hidden",             "waitforblockheight",     &waitforblockheight,     true,  {"height","timeout"}, false },
 };
 
 void RegisterBlockchainRPCCommands(CRPCTable &t)
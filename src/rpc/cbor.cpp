@@ -0,0 +1,165 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpc/cbor.h"
+
+#include "utilstrencodings.h"
+
+#include <locale>
+#include <sstream>
+#include <string.h>
+
+#include <univalue.h>
+
+enum CBORMajorType : unsigned char {
+    CBOR_UNSIGNED = 0,
+    CBOR_NEGATIVE = 1,
+    CBOR_BYTES = 2,
+    CBOR_TEXT = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP = 5,
+    CBOR_SIMPLE = 7,
+};
+
+static const unsigned char CBOR_FALSE = 0xf4;
+static const unsigned char CBOR_TRUE = 0xf5;
+static const unsigned char CBOR_NULL = 0xf6;
+static const unsigned char CBOR_FLOAT64 = 0xfb;
+
+CBORWriter::CBORWriter(const Sink& sinkIn) : sink(sinkIn)
+{
+    buf.reserve(CBOR_STREAM_FLUSH_SIZE + 1024);
+}
+
+void CBORWriter::MaybeFlush()
+{
+    if (buf.size() >= CBOR_STREAM_FLUSH_SIZE)
+        Flush();
+}
+
+void CBORWriter::Flush()
+{
+    if (!buf.empty()) {
+        sink(buf);
+        buf.clear();
+    }
+}
+
+void CBORWriter::Head(unsigned char nMajor, uint64_t nArg)
+{
+    unsigned char nType = nMajor << 5;
+    int nBytes;
+    if (nArg < 24) {
+        buf += (char)(nType | nArg);
+        return;
+    } else if (nArg <= 0xff) {
+        buf += (char)(nType | 24);
+        nBytes = 1;
+    } else if (nArg <= 0xffff) {
+        buf += (char)(nType | 25);
+        nBytes = 2;
+    } else if (nArg <= 0xffffffff) {
+        buf += (char)(nType | 26);
+        nBytes = 4;
+    } else {
+        buf += (char)(nType | 27);
+        nBytes = 8;
+    }
+    for (int i = nBytes - 1; i >= 0; i--)
+        buf += (char)((nArg >> (8 * i)) & 0xff);
+}
+
+void CBORWriter::BeginMap(uint64_t nPairs)
+{
+    Head(CBOR_MAP, nPairs);
+}
+
+void CBORWriter::BeginArray(uint64_t nItems)
+{
+    Head(CBOR_ARRAY, nItems);
+}
+
+void CBORWriter::Text(const std::string& str)
+{
+    Head(CBOR_TEXT, str.size());
+    buf += str;
+    MaybeFlush();
+}
+
+void CBORWriter::Bytes(const unsigned char* pbegin, size_t nSize)
+{
+    Head(CBOR_BYTES, nSize);
+    buf.append((const char*)pbegin, nSize);
+    MaybeFlush();
+}
+
+void CBORWriter::Number(const std::string& str)
+{
+    // UniValue keeps numbers as their JSON text; integers that fit in 64
+    // bits stay integers, everything else becomes a double
+    bool fNegative = !str.empty() && str[0] == '-';
+    uint64_t n;
+    if (str.find_first_of(".eE") == std::string::npos && ParseUInt64(fNegative ? str.substr(1) : str, &n) &&
+            !(fNegative && n == 0)) {
+        Head(fNegative ? CBOR_NEGATIVE : CBOR_UNSIGNED, fNegative ? n - 1 : n);
+        return;
+    }
+
+    std::istringstream stream(str);
+    stream.imbue(std::locale::classic());
+    double d = 0;
+    stream >> d;
+    uint64_t nBits;
+    static_assert(sizeof(d) == sizeof(nBits), "double must be 64 bits");
+    memcpy(&nBits, &d, sizeof(nBits));
+    buf += (char)CBOR_FLOAT64;
+    for (int i = 7; i >= 0; i--)
+        buf += (char)((nBits >> (8 * i)) & 0xff);
+}
+
+void CBORWriter::Value(const UniValue& val, bool fHexAsBytes)
+{
+    switch (val.getType()) {
+    case UniValue::VNULL:
+        buf += (char)CBOR_NULL;
+        break;
+    case UniValue::VBOOL:
+        buf += (char)(val.get_bool() ? CBOR_TRUE : CBOR_FALSE);
+        break;
+    case UniValue::VNUM:
+        Number(val.getValStr());
+        break;
+    case UniValue::VSTR:
+        if (fHexAsBytes && IsHex(val.get_str())) {
+            std::vector<unsigned char> vch = ParseHex(val.get_str());
+            Bytes(vch.data(), vch.size());
+        } else {
+            Text(val.get_str());
+        }
+        break;
+    case UniValue::VARR:
+        BeginArray(val.size());
+        for (size_t i = 0; i < val.size(); i++)
+            Value(val[i]);
+        break;
+    case UniValue::VOBJ: {
+        const std::vector<std::string>& keys = val.getKeys();
+        const std::vector<UniValue>& values = val.getValues();
+        BeginMap(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            Text(keys[i]);
+            Value(values[i], keys[i] == "hex" || keys[i] == "script");
+        }
+        break;
+    }
+    }
+    MaybeFlush();
+}
+
+bool AcceptsCBOR(const std::string& strAccept)
+{
+    // A plain substring match is enough: JSON stays the default and we
+    // only switch when the client names CBOR explicitly
+    return strAccept.find("application/cbor") != std::string::npos;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPC_CBOR_H
+#define BITCOIN_RPC_CBOR_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+class UniValue;
+
+/** Size at which CBORWriter hands its buffered output to the sink */
+static const size_t CBOR_STREAM_FLUSH_SIZE = 64 * 1024;
+
+/**
+ * Writes RPC replies as CBOR (RFC 7049) for clients that ask for
+ * application/cbor, so they can skip JSON parsing and hex decoding.
+ *
+ * Values map onto CBOR the obvious way: integers to integers, other numbers
+ * to doubles, objects to maps with text keys. Hex strings under a "hex" or
+ * "script" key (raw transactions and scripts) are sent as byte strings, and
+ * so is any value written with fHexAsBytes. All items use definite lengths, so a
+ * caller writing a map or array by hand gives its size up front.
+ */
+class CBORWriter
+{
+public:
+    typedef std::function<void(const std::string&)> Sink;
+
+    CBORWriter(const Sink& sinkIn);
+
+    void BeginMap(uint64_t nPairs);
+    void BeginArray(uint64_t nItems);
+    void Text(const std::string& str);
+    void Bytes(const unsigned char* pbegin, size_t nSize);
+
+    /** Write a value, recursing into arrays and objects */
+    void Value(const UniValue& val, bool fHexAsBytes = false);
+
+    /** Hand everything written so far to the sink */
+    void Flush();
+
+private:
+    void Head(unsigned char nMajor, uint64_t nArg);
+    void Number(const std::string& str);
+    void MaybeFlush();
+
+    Sink sink;
+    std::string buf;
+};
+
+/** Whether an Accept header value asks for CBOR replies */
+bool AcceptsCBOR(const std::string& strAccept);
+
+#endif // BITCOIN_RPC_CBOR_H
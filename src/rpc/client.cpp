@@ -52,6 +52,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getbalance", 1, "minconf" },
     { "getbalance", 2, "include_watchonly" },
     { "getblockhash", 0, "height" },
+    { "setstakeweightwindow", 0, "nblocks" },
     { "waitforblockheight", 0, "height" },
     { "waitforblockheight", 1, "timeout" },
     { "waitforblock", 1, "timeout" },
@@ -63,10 +64,14 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "listtransactions", 1, "count" },
     { "listtransactions", 2, "skip" },
     { "listtransactions", 3, "include_watchonly" },
+    { "listtransactions", 4, "cursor" },
     { "listaccounts", 0, "minconf" },
     { "listaccounts", 1, "include_watchonly" },
     { "walletpassphrase", 1, "timeout" },
     { "getblocktemplate", 0, "template_request" },
+    { "findstakekernels", 0, "outputs" },
+    { "findstakekernels", 1, "timefrom" },
+    { "findstakekernels", 2, "count" },
     { "listsinceblock", 1, "target_confirmations" },
     { "listsinceblock", 2, "include_watchonly" },
     { "sendmany", 1, "amounts" },
@@ -81,6 +86,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "listunspent", 2, "addresses" },
     { "getblock", 1, "verbose" },
     { "getblockheader", 1, "verbose" },
+    { "getdbstats", 0, "verbose" },
     { "gettransaction", 1, "include_watchonly" },
     { "getrawtransaction", 1, "verbose" },
     { "createrawtransaction", 0, "inputs" },
@@ -89,6 +95,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "signrawtransaction", 1, "prevtxs" },
     { "signrawtransaction", 2, "privkeys" },
     { "sendrawtransaction", 1, "allowhighfees" },
+    { "sendrawtransactions", 0, "hexstrings" },
+    { "sendrawtransactions", 1, "allowhighfees" },
     { "fundrawtransaction", 1, "options" },
     { "gettxout", 1, "n" },
     { "gettxout", 2, "include_mempool" },
@@ -106,6 +114,13 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "pruneblockchain", 0, "height" },
     { "keypoolrefill", 0, "newsize" },
     { "getrawmempool", 0, "verbose" },
+    { "getmempoolchanges", 0, "sequence" },
+    { "getmempoolchanges", 1, "verbose" },
+    { "getmempoolinfo", 0, "verbose" },
+    { "getblockconnectstats", 0, "nblocks" },
+    { "getlockstats", 0, "reset" },
+    { "removeorphanedtxs", 0, "include_abandoned" },
+    { "getmemoryinfo", 0, "verbose" },
     { "estimatefee", 0, "nblocks" },
     { "estimatepriority", 0, "nblocks" },
     { "estimatesmartfee", 0, "nblocks" },
@@ -117,12 +132,15 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblockhashes", 0 ,"arg0"},
     { "getblockhashes", 1 ,"arg0"},
     { "getblockhashes", 2 ,"arg0"},
-    { "getspentinfo", 0,"arg0"},
+    { "getspentinfo", 0, "outputs" },
     { "getaddresstxids", 0,"arg0"},
     { "getaddressbalance", 0,"arg0"},
     { "getaddressdeltas", 0,"arg0"},
     { "getaddressutxos", 0,"arg0"},
     { "getaddressmempool", 0,"arg0"},
+    { "subscribeaddresses", 0,"arg0"},
+    { "waitforaddressdeltas", 1,"arg1"},
+    { "waitforaddressdeltas", 2,"arg2"},
     { "setnetworkactive", 0, "state" },
     { "getmempoolancestors", 1, "verbose" },
     { "getmempooldescendants", 1, "verbose" },
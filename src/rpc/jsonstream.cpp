@@ -0,0 +1,108 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpc/jsonstream.h"
+
+#include <assert.h>
+
+#include <univalue.h>
+
+JSONStreamWriter::JSONStreamWriter(const Sink& sinkIn) : sink(sinkIn), fAfterKey(false)
+{
+    buf.reserve(JSON_STREAM_FLUSH_SIZE + 1024);
+}
+
+void JSONStreamWriter::Separator()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (!vFirst.empty()) {
+        if (!vFirst.back())
+            buf += ',';
+        vFirst.back() = false;
+    }
+}
+
+void JSONStreamWriter::MaybeFlush()
+{
+    if (buf.size() >= JSON_STREAM_FLUSH_SIZE)
+        Flush();
+}
+
+void JSONStreamWriter::BeginObject()
+{
+    Separator();
+    buf += '{';
+    vFirst.push_back(true);
+}
+
+void JSONStreamWriter::EndObject()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    buf += '}';
+    MaybeFlush();
+}
+
+void JSONStreamWriter::BeginArray()
+{
+    Separator();
+    buf += '[';
+    vFirst.push_back(true);
+}
+
+void JSONStreamWriter::EndArray()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    buf += ']';
+    MaybeFlush();
+}
+
+void JSONStreamWriter::Key(const std::string& key)
+{
+    assert(!fAfterKey);
+    Separator();
+    buf += UniValue(key).write();
+    buf += ':';
+    fAfterKey = true;
+}
+
+void JSONStreamWriter::Value(const UniValue& val)
+{
+    if (val.isObject()) {
+        BeginObject();
+        Fields(val);
+        EndObject();
+    } else if (val.isArray()) {
+        BeginArray();
+        for (const UniValue& elem : val.getValues())
+            Value(elem);
+        EndArray();
+    } else {
+        Separator();
+        buf += val.write();
+        MaybeFlush();
+    }
+}
+
+void JSONStreamWriter::Fields(const UniValue& obj)
+{
+    const std::vector<std::string>& keys = obj.getKeys();
+    const std::vector<UniValue>& values = obj.getValues();
+    for (size_t i = 0; i < keys.size(); i++) {
+        Key(keys[i]);
+        Value(values[i]);
+    }
+}
+
+void JSONStreamWriter::Flush()
+{
+    if (buf.empty())
+        return;
+    sink(buf);
+    buf.clear();
+}
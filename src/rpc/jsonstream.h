@@ -0,0 +1,62 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPC_JSONSTREAM_H
+#define BITCOIN_RPC_JSONSTREAM_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class UniValue;
+
+/** Size at which JSONStreamWriter hands its buffered output to the sink */
+static const size_t JSON_STREAM_FLUSH_SIZE = 64 * 1024;
+
+/**
+ * Writes a JSON document piecewise, so large replies never exist as one
+ * UniValue tree or one string. Output is handed to the sink in pieces of
+ * about JSON_STREAM_FLUSH_SIZE and is byte for byte what UniValue::write()
+ * would have produced for the same document. Strings are escaped by
+ * UniValue itself.
+ *
+ * Commas and colons are inserted as needed; the caller only has to nest
+ * Begin/End calls properly and call Flush() at the end.
+ */
+class JSONStreamWriter
+{
+public:
+    typedef std::function<void(const std::string&)> Sink;
+
+    JSONStreamWriter(const Sink& sinkIn);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+
+    /** Write the key of the next value in the current object */
+    void Key(const std::string& key);
+
+    /** Write a value, recursing into arrays and objects */
+    void Value(const UniValue& val);
+
+    /** Write all keys and values of obj into the current object */
+    void Fields(const UniValue& obj);
+
+    /** Hand everything written so far to the sink */
+    void Flush();
+
+private:
+    void Separator();
+    void MaybeFlush();
+
+    Sink sink;
+    std::string buf;
+    //! For each open array or object, whether nothing has been written into it yet
+    std::vector<bool> vFirst;
+    bool fAfterKey;
+};
+
+#endif // BITCOIN_RPC_JSONSTREAM_H
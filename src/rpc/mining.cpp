@@ -15,8 +15,10 @@
 #include "validation.h"
 #include "miner.h"
 #include "net.h"
+#include "pos.h"
 #include "pow.h"
 #include "rpc/server.h"
+#include "timedata.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -99,6 +101,12 @@ UniValue getnetworkhashps(const JSONRPCRequest& request)
 UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript)
 {
     static const int nInnerLoopCount = 0x1000000;
+    // Nonces each thread hashes between checks of the chain tip
+    static const int nNonceBatch = 0x1000;
+    int nThreads = GetArg("-genproclimit", DEFAULT_GENERATE_THREADS);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
+    nThreads = std::max(1, nThreads);
     int nHeightStart = 0;
     int nHeightEnd = 0;
     int nHeight = 0;
@@ -129,34 +137,37 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
             LOCK(cs_main);
             IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
         }
-        DbgMsg("=-============================== > ");
         bool isFail = false;
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus())) {
-            if(nMaxTries%10000==0){
-                DbgMsg("Search %u \n%s" ,nMaxTries,pblock->ToString() );
-            }
-            CBlockIndex* pindexPrev = chainActive.Tip();
-            if(pindexPrev->GetBlockHash()!= pblock->hashPrevBlock){
-                DbgMsg("Best chain is changed...");
-                isFail =true;
-                break;
+        bool fFound = false;
+        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount) {
+            {
+                LOCK(cs_main);
+                CBlockIndex* pindexPrev = chainActive.Tip();
+                if (pindexPrev->GetBlockHash() != pblock->hashPrevBlock) {
+                    DbgMsg("Best chain is changed...");
+                    isFail = true;
+                    break;
+                }
+                if (GetNextWorkRequired(pindexPrev, pblock, false, Params().GetConsensus()) != pblock->nBits) {
+                    DbgMsg("Chained nBIT======================> ");
+                    isFail = true;
+                    break;
+                }
             }
-            uint32_t nBit        = GetNextWorkRequired( pindexPrev, pblock, false,Params().GetConsensus());
-            if(nBit != pblock->nBits){
-                isFail =true;
-                DbgMsg("Chained nBIT======================> ");
+            // Hash a batch of nonces on all threads, then recheck the tip
+            uint32_t nNonceStart = pblock->nNonce;
+            uint32_t nNonceEnd = std::min<uint64_t>(nInnerLoopCount, std::min<uint64_t>(nNonceStart + (uint64_t)nThreads * nNonceBatch, nNonceStart + nMaxTries));
+            fFound = ScanPoWNonces(pblock, nNonceEnd, nThreads, Params().GetConsensus());
+            nMaxTries -= pblock->nNonce - nNonceStart;
+            if (fFound)
                 break;
-            }
-            ++pblock->nNonce;
-            --nMaxTries;
         }
         if(isFail){
             continue;
         }
-        if (nMaxTries == 0) {
-            break;
-        }
-        if (pblock->nNonce == nInnerLoopCount) {
+        if (!fFound) {
+            if (nMaxTries == 0)
+                break;
             continue;
         }
         std::shared_ptr<const CBlock> shared_pblock = std::make_shared<const CBlock>(*pblock);
@@ -371,7 +382,9 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             "       \"rules\":[            (array, optional) A list of strings\n"
             "           \"support\"          (string) client side supported softfork deployment\n"
             "           ,...\n"
-            "       ]\n"
+            "       ],\n"
+            "       \"templateid\":n       (numeric, optional) templateid of a previously returned template; transactions already\n"
+            "                              in it are then returned without their data (see 'basetemplateid' below)\n"
             "     }\n"
             "\n"
 
@@ -385,9 +398,12 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             "  },\n"
             "  \"vbrequired\" : n,                 (numeric) bit mask of versionbits the server requires set in submissions\n"
             "  \"previousblockhash\" : \"xxxx\",     (string) The hash of current highest block\n"
+            "  \"templateid\" : n,                 (numeric) id of this template, to pass as 'templateid' in a later request\n"
+            "  \"basetemplateid\" : n,             (numeric) if present, the requested previous template; transactions it already contained carry no 'data'\n"
+            "  \"transactionsremoved\" : [ \"xxxx\", ... ], (array of strings) if 'basetemplateid' is present, txids in that template but not in this one\n"
             "  \"transactions\" : [                (array) contents of non-coinbase transactions that should be included in the next block\n"
             "      {\n"
-            "         \"data\" : \"xxxx\",             (string) transaction data encoded in hexadecimal (byte-for-byte)\n"
+            "         \"data\" : \"xxxx\",             (string) transaction data encoded in hexadecimal (byte-for-byte); omitted if in 'basetemplateid'\n"
             "         \"txid\" : \"xxxx\",             (string) transaction id encoded in little-endian hexadecimal\n"
             "         \"hash\" : \"xxxx\",             (string) hash encoded in little-endian hexadecimal (including witness data)\n"
             "         \"depends\" : [                (array) array of numbers \n"
@@ -432,6 +448,7 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     UniValue lpval = NullUniValue;
     std::set<std::string> setClientRules;
     int64_t nMaxVersionPreVB = -1;
+    UniValue templateidval = NullUniValue;
     if (request.params.size() > 0)
     {
         const UniValue& oparam = request.params[0].get_obj();
@@ -445,6 +462,9 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
         lpval = find_value(oparam, "longpollid");
+        templateidval = find_value(oparam, "templateid");
+        if (!templateidval.isNull() && !templateidval.isNum())
+            throw JSONRPCError(RPC_TYPE_ERROR, "templateid must be a number");
 
         if (strMode == "proposal")
         {
@@ -596,7 +616,16 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     // NOTE: If at some point we support pre-segwit miners post-segwit-activation, this needs to take segwit support into consideration
     const bool fPreSegWit = (THRESHOLD_ACTIVE != VersionBitsState(pindexPrev, consensusParams, Consensus::DEPLOYMENT_SEGWIT, versionbitscache));
 
-    UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
+    UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal"); aCaps.push_back("delta");
+
+    // Transactions of the template the caller already has, if we still know it
+    std::set<uint256> setBaseTx;
+    bool fDelta = false;
+    if (!templateidval.isNull()) {
+        std::vector<uint256> vBaseTx;
+        fDelta = BlockAssembler::GetTemplateTransactions(templateidval.get_int64(), vBaseTx);
+        setBaseTx.insert(vBaseTx.begin(), vBaseTx.end());
+    }
 
     UniValue transactions(UniValue::VARR);
     map<uint256, int64_t> setTxIndex;
@@ -611,7 +640,8 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
         UniValue entry(UniValue::VOBJ);
 
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
+        if (!fDelta || !setBaseTx.erase(txHash))
+            entry.push_back(Pair("data", EncodeHexTx(tx)));
         entry.push_back(Pair("txid", txHash.GetHex()));
         entry.push_back(Pair("hash", tx.GetWitnessHash().GetHex()));
 
@@ -705,6 +735,15 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     }
 
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
+    result.push_back(Pair("templateid", pblocktemplate->nTemplateId));
+    if (fDelta) {
+        // Whatever is left of the base template is no longer included
+        UniValue removed(UniValue::VARR);
+        for (const uint256& hash : setBaseTx)
+            removed.push_back(hash.GetHex());
+        result.push_back(Pair("basetemplateid", templateidval.get_int64()));
+        result.push_back(Pair("transactionsremoved", removed));
+    }
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0]->vout[0].nValue));
@@ -754,36 +793,10 @@ protected:
     }
 };
 
-UniValue submitblock(const JSONRPCRequest& request)
+/** Process a decoded block as submitblock does and return its BIP22 result */
+static UniValue SubmitBlock(const std::shared_ptr<CBlock>& blockptr)
 {
-    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
-        throw runtime_error(
-            "submitblock \"hexdata\" ( \"jsonparametersobject\" )\n"
-            "\nAttempts to submit new block to network.\n"
-            "The 'jsonparametersobject' parameter is currently ignored.\n"
-            "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.\n"
-
-            "\nArguments\n"
-            "1. \"hexdata\"        (string, required) the hex-encoded block data to submit\n"
-            "2. \"parameters\"     (string, optional) object of optional parameters\n"
-            "    {\n"
-            "      \"workid\" : \"id\"    (string, optional) if the server provided a workid, it MUST be included with submissions\n"
-            "    }\n"
-            "\nResult:\n"
-            "\nExamples:\n"
-            + HelpExampleCli("submitblock", "\"mydata\"")
-            + HelpExampleRpc("submitblock", "\"mydata\"")
-        );
-
-    std::shared_ptr<CBlock> blockptr = std::make_shared<CBlock>();
     CBlock& block = *blockptr;
-    if (!DecodeHexBlk(block, request.params[0].get_str()))
-        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block decode failed");
-
-    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase()) {
-        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block does not start with a coinbase");
-    }
-
     uint256 hash = block.GetHash();
     bool fBlockPresent = false;
     {
@@ -823,6 +836,232 @@ UniValue submitblock(const JSONRPCRequest& request)
     return BIP22ValidationResult(sc.state);
 }
 
+UniValue submitblock(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+            "submitblock \"hexdata\" ( \"jsonparametersobject\" )\n"
+            "\nAttempts to submit new block to network.\n"
+            "The 'jsonparametersobject' parameter is currently ignored.\n"
+            "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.\n"
+
+            "\nArguments\n"
+            "1. \"hexdata\"        (string, required) the hex-encoded block data to submit\n"
+            "2. \"parameters\"     (string, optional) object of optional parameters\n"
+            "    {\n"
+            "      \"workid\" : \"id\"    (string, optional) if the server provided a workid, it MUST be included with submissions\n"
+            "    }\n"
+            "\nResult:\n"
+            "\nExamples:\n"
+            + HelpExampleCli("submitblock", "\"mydata\"")
+            + HelpExampleRpc("submitblock", "\"mydata\"")
+        );
+
+    std::shared_ptr<CBlock> blockptr = std::make_shared<CBlock>();
+    CBlock& block = *blockptr;
+    if (!DecodeHexBlk(block, request.params[0].get_str()))
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block decode failed");
+
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase()) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block does not start with a coinbase");
+    }
+
+    return SubmitBlock(blockptr);
+}
+
+/** Most stake timestamps findstakekernels probes for each outpoint */
+static const int MAX_STAKE_KERNEL_SEARCH = 10000;
+
+UniValue findstakekernels(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw runtime_error(
+            "findstakekernels [{\"txid\":\"id\",\"vout\":n},...] ( timefrom count )\n"
+            "\nSearches the stake kernels of the given outputs on the current tip, for a signer that keeps\n"
+            "the staking keys outside this node. Use createstakeblock and submitstakeblock with a coinstake\n"
+            "spending a winning output at the time found.\n"
+            "\nArguments:\n"
+            "1. \"outputs\"      (array, required) The unspent outputs to search\n"
+            "     [\n"
+            "       {\n"
+            "         \"txid\":\"id\",  (string, required) The transaction id\n"
+            "         \"vout\":n       (numeric, required) The output number\n"
+            "       }\n"
+            "       ,...\n"
+            "     ]\n"
+            "2. timefrom       (numeric, optional) The latest stake timestamp to try, default the current adjusted time\n"
+            "3. count          (numeric, optional, default=1) The number of stake timestamps to try going back from timefrom\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\" : n,                (numeric) The height of the block to stake\n"
+            "  \"previousblockhash\" : \"hash\", (string) The tip the kernels were searched on\n"
+            "  \"bits\" : \"xxxxxxxx\",         (string) The proof-of-stake target of the block to stake\n"
+            "  \"kernels\" : [                (array) The winning outputs, each with its latest winning timestamps first\n"
+            "    {\n"
+            "      \"txid\" : \"id\",          (string) The transaction id\n"
+            "      \"vout\" : n,             (numeric) The output number\n"
+            "      \"time\" : n              (numeric) The coinstake and block timestamp\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"unknown\" : [                (array) The outputs that are spent or not in the UTXO set\n"
+            "    { \"txid\" : \"id\", \"vout\" : n }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("findstakekernels", "\"[{\\\"txid\\\":\\\"myid\\\",\\\"vout\\\":0}]\" 1500000000 60")
+            + HelpExampleRpc("findstakekernels", "[{\"txid\":\"myid\",\"vout\":0}], 1500000000, 60")
+        );
+
+    RPCTypeCheck(request.params, boost::assign::list_of(UniValue::VARR)(UniValue::VNUM)(UniValue::VNUM), true);
+
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    int64_t nTimeFrom = GetAdjustedTime();
+    if (request.params.size() > 1 && !request.params[1].isNull())
+        nTimeFrom = request.params[1].get_int64();
+    nTimeFrom &= ~consensusParams.nStakeTimestampMask;
+    int nCount = 1;
+    if (request.params.size() > 2 && !request.params[2].isNull())
+        nCount = request.params[2].get_int();
+    if (nCount < 1 || nCount > MAX_STAKE_KERNEL_SEARCH)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("count must be between 1 and %d", MAX_STAKE_KERNEL_SEARCH));
+    if (nTimeFrom < 0 || nTimeFrom > std::numeric_limits<uint32_t>::max())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "timefrom out of range");
+
+    std::vector<COutPoint> vOutpoints;
+    const UniValue& outputs = request.params[0].get_array();
+    for (unsigned int i = 0; i < outputs.size(); i++) {
+        const UniValue& output = outputs[i].get_obj();
+        RPCTypeCheckObj(output,
+            {
+                {"txid", UniValueType(UniValue::VSTR)},
+                {"vout", UniValueType(UniValue::VNUM)},
+            });
+        int nOutput = find_value(output, "vout").get_int();
+        if (nOutput < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, vout must be positive");
+        vOutpoints.push_back(COutPoint(ParseHashO(output, "txid"), nOutput));
+    }
+
+    CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        pindexPrev = chainActive.Tip();
+    }
+    unsigned int nBits = GetNextWorkRequired(pindexPrev, NULL, true, consensusParams);
+
+    // One kernel search per output: its midstate and weighted target are
+    // computed once, then each timestamp costs two compressions
+    std::map<COutPoint, CStakeCache> cache;
+    UniValue kernels(UniValue::VARR);
+    UniValue unknown(UniValue::VARR);
+    for (const COutPoint& prevout : vOutpoints) {
+        if (!cache.count(prevout) && !CacheKernel(cache, prevout)) {
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair("txid", prevout.hash.GetHex()));
+            entry.push_back(Pair("vout", (int)prevout.n));
+            unknown.push_back(entry);
+            continue;
+        }
+        CKernelSearch search(pindexPrev, nBits, cache.at(prevout), prevout);
+        for (int n = 0; n < nCount; n++) {
+            int64_t nTime = nTimeFrom - (int64_t)n * (consensusParams.nStakeTimestampMask + 1);
+            uint32_t nTimeFound;
+            if (nTime <= pindexPrev->GetPastTimeLimit())
+                break;
+            if (!search.Search(nTime, 1, nTimeFound))
+                continue;
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair("txid", prevout.hash.GetHex()));
+            entry.push_back(Pair("vout", (int)prevout.n));
+            entry.push_back(Pair("time", (int64_t)nTimeFound));
+            kernels.push_back(entry);
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("height", pindexPrev->nHeight + 1));
+    result.push_back(Pair("previousblockhash", pindexPrev->GetBlockHash().GetHex()));
+    result.push_back(Pair("bits", strprintf("%08x", nBits)));
+    result.push_back(Pair("kernels", kernels));
+    result.push_back(Pair("unknown", unknown));
+    return result;
+}
+
+UniValue createstakeblock(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "createstakeblock \"coinstakehex\"\n"
+            "\nBuilds a proof-of-stake block on the current tip around a coinstake signed outside this node,\n"
+            "for example spending a kernel found by findstakekernels. The block must then be signed by the\n"
+            "key of the first coinstake output and passed to submitstakeblock.\n"
+            "\nArguments:\n"
+            "1. \"coinstakehex\"    (string, required) The hex-encoded signed coinstake transaction\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"hash\" : \"hash\",   (string) The block hash to sign\n"
+            "  \"hex\" : \"xxxx\",    (string) The hex-encoded unsigned block\n"
+            "  \"fees\" : n         (numeric) The fees of the block's transactions, in " + CURRENCY_UNIT + "\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("createstakeblock", "\"mycoinstake\"")
+            + HelpExampleRpc("createstakeblock", "\"mycoinstake\"")
+        );
+
+    CMutableTransaction mtx;
+    if (!DecodeHexTx(mtx, request.params[0].get_str(), true))
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
+    CTransactionRef txCoinStake = MakeTransactionRef(std::move(mtx));
+    if (!txCoinStake->IsCoinStake())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Transaction is not a coinstake");
+
+    CAmount nFees = 0;
+    std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(CScript(), true, true, &nFees));
+    if (!pblocktemplate)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    CBlock& block = pblocktemplate->block;
+    if (!AssembleStakeBlock(block, txCoinStake))
+        throw JSONRPCError(RPC_VERIFY_ERROR, "Coinstake time is too early for the current tip");
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+    ssBlock << block;
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.push_back(Pair("hex", HexStr(ssBlock.begin(), ssBlock.end())));
+    result.push_back(Pair("fees", ValueFromAmount(nFees)));
+    return result;
+}
+
+UniValue submitstakeblock(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 2)
+        throw runtime_error(
+            "submitstakeblock \"hexdata\" \"signature\"\n"
+            "\nSigns a block from createstakeblock with a signature made outside this node and submits it.\n"
+            "\nArguments:\n"
+            "1. \"hexdata\"      (string, required) The hex-encoded block returned by createstakeblock\n"
+            "2. \"signature\"    (string, required) The hex-encoded DER signature of the block hash\n"
+            "\nResult:\n"
+            "Nothing if the block was accepted, else the BIP22 reason it was not, as submitblock\n"
+            "\nExamples:\n"
+            + HelpExampleCli("submitstakeblock", "\"mydata\" \"mysignature\"")
+            + HelpExampleRpc("submitstakeblock", "\"mydata\", \"mysignature\"")
+        );
+
+    std::shared_ptr<CBlock> blockptr = std::make_shared<CBlock>();
+    CBlock& block = *blockptr;
+    if (!DecodeHexBlk(block, request.params[0].get_str()))
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block decode failed");
+
+    if (!block.IsProofOfStake())
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block is not proof-of-stake");
+
+    block.vchBlockSig = ParseHexV(request.params[1], "signature");
+    return SubmitBlock(blockptr);
+}
+
 UniValue estimatefee(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -958,21 +1197,24 @@ UniValue estimatesmartpriority(const JSONRPCRequest& request)
 }
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,  {"nblocks","height"} },
-    { "mining",             "getmininginfo",          &getmininginfo,          true,  {} },
-    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,  {"txid","priority_delta","fee_delta"} },
-    { "mining",             "getblocktemplate",       &getblocktemplate,       true,  {"template_request"} },
-    { "mining",             "submitblock",            &submitblock,            true,  {"hexdata","parameters"} },
-
-    { "generating",         "generate",               &generate,               true,  {"nblocks","maxtries"} },
-    { "generating",         "generatetoaddress",      &generatetoaddress,      true,  {"nblocks","address","maxtries"} },
-
-    { "util",               "estimatefee",            &estimatefee,            true,  {"nblocks"} },
-    { "util",               "estimatepriority",       &estimatepriority,       true,  {"nblocks"} },
-    { "util",               "estimatesmartfee",       &estimatesmartfee,       true,  {"nblocks"} },
-    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true,  {"nblocks"} },
+{ //  category              name                      actor (function)         okSafeMode argNames  parallelSafe
+  //  --------------------- ------------------------  -----------------------  ---------- --------  ------------
+    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,  {"nblocks","height"}, false },
+    { "mining",             "getmininginfo",          &getmininginfo,          true,  {}, false },
+    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,  {"txid","priority_delta","fee_delta"}, false },
+    { "mining",             "getblocktemplate",       &getblocktemplate,       true,  {"template_request"}, false },
+    { "mining",             "submitblock",            &submitblock,            true,  {"hexdata","parameters"}, false },
+    { "mining",             "findstakekernels",       &findstakekernels,       true,  {"outputs","timefrom","count"}, false },
+    { "mining",             "createstakeblock",       &createstakeblock,       true,  {"coinstakehex"}, false },
+    { "mining",             "submitstakeblock",       &submitstakeblock,       true,  {"hexdata","signature"}, false },
+
+    { "generating",         "generate",               &generate,               true,  {"nblocks","maxtries"}, false },
+    { "generating",         "generatetoaddress",      &generatetoaddress,      true,  {"nblocks","address","maxtries"}, false },
+
+    { "util",               "estimatefee",            &estimatefee,            true,  {"nblocks"}, false },
+    { "util",               "estimatepriority",       &estimatepriority,       true,  {"nblocks"}, false },
+    { "util",               "estimatesmartfee",       &estimatesmartfee,       true,  {"nblocks"}, false },
+    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true,  {"nblocks"}, false },
 };
 
 void RegisterMiningRPCCommands(CRPCTable &t)
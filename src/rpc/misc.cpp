@@ -4,13 +4,21 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "base58.h"
+#include "chainsnapshot.h"
 #include "clientversion.h"
+#include "httpserver.h"
 #include "init.h"
 #include "validation.h"
 #include "net.h"
 #include "netbase.h"
+#include "net_processing.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
+#include "sync.h"
+#include "threadplacement.h"
 #include "timedata.h"
+#include "txcache.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -19,6 +27,7 @@
 #include "wallet/walletdb.h"
 #endif
 #include "addressindex.h"
+#include "addresssubscription.h"
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -227,12 +236,12 @@ UniValue validateaddress(const JSONRPCRequest& request)
     return ret;
 }
 
-bool getAddressFromIndex(const int &type, const uint160 &hash, std::string &address)
+bool getAddressFromIndex(const int &type, const uint160 &hash, std::string &address, CAddressEncoder &encoder)
 {
     if (type == 2) {
-        address = CBitcoinAddress(CScriptID(hash)).ToString();
+        address = encoder.Encode(CScriptID(hash));
     } else if (type == 1) {
-        address = CBitcoinAddress(CKeyID(hash)).ToString();
+        address = encoder.Encode(CKeyID(hash));
     } else {
         return false;
     }
@@ -274,6 +283,42 @@ bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint16
 
     return true;
 }
+
+/** Read the optional "limit" and "cursor" of a paged address index query.
+ *  Returns whether the caller asked for a page. */
+bool getAddressIndexPageFromParams(const UniValue& params, size_t &limit, bool &fHaveCursor, CAddressIndexKey &keyAfter)
+{
+    limit = 0;
+    fHaveCursor = false;
+    if (!params[0].isObject())
+        return false;
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (limitValue.isNum()) {
+        if (limitValue.get_int() <= 0) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+        }
+        limit = limitValue.get_int();
+    }
+    if (cursorValue.isStr()) {
+        std::vector<unsigned char> data(ParseHex(cursorValue.get_str()));
+        if (!IsHex(cursorValue.get_str()) || data.size() != keyAfter.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION)) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        CDataStream ssKey(data, SER_NETWORK, PROTOCOL_VERSION);
+        ssKey >> keyAfter;
+        fHaveCursor = true;
+    }
+    return limit > 0 || fHaveCursor;
+}
+
+std::string getAddressIndexCursor(const CAddressIndexKey &key)
+{
+    CDataStream ssKey(SER_NETWORK, PROTOCOL_VERSION);
+    ssKey << key;
+    return HexStr(ssKey.begin(), ssKey.end());
+}
 /**
  * Used by addmultisigaddress / createmultisig:
  */
@@ -517,15 +562,114 @@ static UniValue RPCLockedMemoryInfo()
     return obj;
 }
 
+extern UniValue mempoolMemoryToJSON();
+
+static UniValue MemoryUsageToJSON(size_t nCount, size_t nUsage)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", (uint64_t)nCount));
+    obj.push_back(Pair("usage", (uint64_t)nUsage));
+    return obj;
+}
+
+static UniValue RPCSubsystemMemoryInfo()
+{
+    UniValue obj(UniValue::VOBJ);
+    size_t nTotal = 0;
+    {
+        LOCK(cs_main);
+        size_t nCoins = pcoinsTip->DynamicMemoryUsage();
+        obj.push_back(Pair("coinstip", MemoryUsageToJSON(pcoinsTip->GetCacheSize(), nCoins)));
+        size_t nBlockIndex = GetBlockIndexMemoryUsage();
+        obj.push_back(Pair("blockindex", MemoryUsageToJSON(mapBlockIndex.size(), nBlockIndex)));
+        nTotal += nCoins + nBlockIndex;
+
+        // Databases sharing a block cache count it once
+        UniValue leveldb(UniValue::VOBJ);
+        std::set<const leveldb::Cache*> setCaches;
+        size_t nBlockCaches = 0;
+        std::vector<std::pair<std::string, const CDBWrapper*> > vDBs;
+        if (pcoinsdbview)
+            vDBs.push_back(std::make_pair("chainstate", &pcoinsdbview->GetDB()));
+        if (pblocktree)
+            vDBs.push_back(std::make_pair("blockindex", pblocktree));
+        if (pindexesdb)
+            vDBs.push_back(std::make_pair("indexes", pindexesdb));
+        for (const std::pair<std::string, const CDBWrapper*>& db : vDBs) {
+            size_t nWriteBuffers = db.second->GetWriteBufferUsage();
+            leveldb.push_back(Pair(db.first + "_writebuffers", (uint64_t)nWriteBuffers));
+            nTotal += nWriteBuffers;
+            if (setCaches.insert(db.second->GetBlockCache()).second)
+                nBlockCaches += db.second->GetBlockCacheUsage();
+        }
+        leveldb.push_back(Pair("blockcaches", (uint64_t)nBlockCaches));
+        nTotal += nBlockCaches;
+        if (pindexesdb) {
+            size_t nAddressCache = pindexesdb->GetAddressCacheUsage();
+            leveldb.push_back(Pair("addresscache", (uint64_t)nAddressCache));
+            nTotal += nAddressCache;
+        }
+        obj.push_back(Pair("leveldb", leveldb));
+    }
+
+    UniValue mempoolUsage(UniValue::VOBJ);
+    size_t nMempool = mempool.DynamicMemoryUsage();
+    mempoolUsage.push_back(Pair("usage", (uint64_t)nMempool));
+    mempoolUsage.pushKVs(mempoolMemoryToJSON());
+    obj.push_back(Pair("mempool", mempoolUsage));
+    nTotal += nMempool;
+
+    size_t nSigCache = GetSignatureCacheMemoryUsage();
+    size_t nScriptCache = GetScriptExecutionCacheMemoryUsage();
+    obj.push_back(Pair("sigcache", (uint64_t)nSigCache));
+    obj.push_back(Pair("scriptcache", (uint64_t)nScriptCache));
+    nTotal += nSigCache + nScriptCache;
+
+    size_t nTxCache = txCache.DynamicSize();
+    obj.push_back(Pair("txcache", MemoryUsageToJSON(txCache.Count(), nTxCache)));
+    nTotal += nTxCache;
+
+    size_t nOrphans = 0;
+    size_t nOrphanUsage = GetOrphanMemoryUsage(nOrphans);
+    obj.push_back(Pair("orphans", MemoryUsageToJSON(nOrphans, nOrphanUsage)));
+    nTotal += nOrphanUsage;
+
+    if (g_connman) {
+        CNodeMemoryUsage peers = g_connman->GetNodeMemoryUsage();
+        UniValue peersUsage(UniValue::VOBJ);
+        peersUsage.push_back(Pair("count", (uint64_t)peers.nNodes));
+        peersUsage.push_back(Pair("recv", (uint64_t)peers.nRecv));
+        peersUsage.push_back(Pair("send", (uint64_t)peers.nSend));
+        peersUsage.push_back(Pair("filters", (uint64_t)peers.nFilters));
+        peersUsage.push_back(Pair("relay", (uint64_t)peers.nRelay));
+        obj.push_back(Pair("peers", peersUsage));
+        nTotal += peers.nRecv + peers.nSend + peers.nFilters + peers.nRelay;
+    }
+
+#ifdef ENABLE_WALLET
+    if (pwalletMain) {
+        LOCK(pwalletMain->cs_wallet);
+        size_t nWallet = pwalletMain->GetWalletTxMemoryUsage();
+        obj.push_back(Pair("wallet", MemoryUsageToJSON(pwalletMain->mapWallet.size(), nWallet)));
+        nTotal += nWallet;
+    }
+#endif
+
+    obj.push_back(Pair("total", (uint64_t)nTotal));
+    return obj;
+}
+
 UniValue getmemoryinfo(const JSONRPCRequest& request)
 {
     /* Please, avoid using the word "pool" here in the RPC interface or help,
      * as users will undoubtedly confuse it with the other "memory pool"
      */
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 1)
         throw runtime_error(
-            "getmemoryinfo\n"
+            "getmemoryinfo ( verbose )\n"
             "Returns an object containing information about memory usage.\n"
+            "\nArguments:\n"
+            "1. verbose           (boolean, optional, default=false) Also estimate the memory each subsystem uses\n"
             "\nResult:\n"
             "{\n"
             "  \"locked\": {               (json object) Information about locked memory manager\n"
@@ -535,17 +679,246 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
             "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
             "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
             "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  },\n"
+            "  \"usage\": {                (json object, verbose only) Estimated bytes of heap each subsystem holds;\n"
+            "                              allocator overhead is estimated, fragmentation is not counted\n"
+            "    \"coinstip\": { \"count\": n, \"usage\": n },    (json object) Coins cache: coins held, bytes\n"
+            "    \"blockindex\": { \"count\": n, \"usage\": n },  (json object) Block index entries, with the chain and candidate sets\n"
+            "    \"leveldb\": {            (json object) LevelDB memory outside the coins cache\n"
+            "      \"chainstate_writebuffers\": n,  (numeric) Write buffers of each database not yet in table files\n"
+            "      \"blockindex_writebuffers\": n,\n"
+            "      \"indexes_writebuffers\": n,\n"
+            "      \"blockcaches\": n,     (numeric) Block caches, those shared between databases counted once\n"
+            "      \"addresscache\": n     (numeric) Cached address index runs\n"
+            "    },\n"
+            "    \"mempool\": {            (json object) Mempool: total \"usage\", then each structure as in getmempoolinfo true\n"
+            "      \"usage\": n,\n"
+            "      ...\n"
+            "    },\n"
+            "    \"sigcache\": n,          (numeric) Signature cache, allocated at startup\n"
+            "    \"scriptcache\": n,       (numeric) Script execution cache, allocated at startup\n"
+            "    \"txcache\": { \"count\": n, \"usage\": n },     (json object) Confirmed transactions cached for lookups\n"
+            "    \"orphans\": { \"count\": n, \"usage\": n },     (json object) Orphan transactions\n"
+            "    \"peers\": {              (json object) Summed over all peers\n"
+            "      \"count\": n,           (numeric) Number of peers\n"
+            "      \"recv\": n,            (numeric) Messages being received or waiting to be processed\n"
+            "      \"send\": n,            (numeric) Messages waiting to be sent\n"
+            "      \"filters\": n,         (numeric) BIP37 filters and the known address and inventory filters\n"
+            "      \"relay\": n            (numeric) Addresses and inventory waiting to be announced\n"
+            "    },\n"
+            "    \"wallet\": { \"count\": n, \"usage\": n },      (json object) Wallet transactions\n"
+            "    \"total\": n              (numeric) Sum of the above\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmemoryinfo", "")
+            + HelpExampleCli("getmemoryinfo", "true")
             + HelpExampleRpc("getmemoryinfo", "")
         );
     UniValue obj(UniValue::VOBJ);
     obj.push_back(Pair("locked", RPCLockedMemoryInfo()));
+    if (request.params.size() > 0 && request.params[0].get_bool())
+        obj.push_back(Pair("usage", RPCSubsystemMemoryInfo()));
+    return obj;
+}
+
+UniValue getrpcstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "Returns call statistics of every RPC method called since startup, and the state of the HTTP work queue.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"latency_buckets_us\": [ n, ... ],  (json array) Upper bounds of the latency histogram buckets in microseconds,\n"
+            "                                      slower calls go in one more bucket\n"
+            "  \"methods\": {\n"
+            "    \"method\": {\n"
+            "      \"calls\": n,                     (numeric) Number of calls\n"
+            "      \"errors\": n,                    (numeric) Number of calls that failed\n"
+            "      \"time_us\": n,                   (numeric) Total time spent in calls, in microseconds\n"
+            "      \"max_us\": n,                    (numeric) Slowest call, in microseconds\n"
+            "      \"cs_main_wait_us\": n,           (numeric) Total time calls spent blocked waiting for cs_main, in microseconds\n"
+            "      \"latency_histogram\": [ n, ... ] (json array) Number of calls per latency bucket\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"workqueue\": {                    (json object) Only when the HTTP server is running\n"
+            "    \"depth\": n,                       (numeric) Requests waiting for a worker thread\n"
+            "    \"max_depth\": n,                   (numeric) Depth at which requests are rejected (-rpcworkqueue)\n"
+            "    \"high_water\": n,                  (numeric) Deepest the queue has been\n"
+            "    \"rejected\": n,                    (numeric) Requests rejected because the queue was full\n"
+            "    \"threads\": n                      (numeric) Worker threads\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcstats", "")
+            + HelpExampleRpc("getrpcstats", "")
+        );
+
+    UniValue buckets(UniValue::VARR);
+    for (int64_t nBound : RPC_LATENCY_BUCKETS)
+        buckets.push_back(nBound);
+
+    UniValue methods(UniValue::VOBJ);
+    for (const auto& entry : GetRPCStats()) {
+        const CRPCMethodStats& stats = entry.second;
+        UniValue histogram(UniValue::VARR);
+        for (uint64_t nCount : stats.vBuckets)
+            histogram.push_back(nCount);
+
+        UniValue method(UniValue::VOBJ);
+        method.push_back(Pair("calls", stats.nCalls));
+        method.push_back(Pair("errors", stats.nErrors));
+        method.push_back(Pair("time_us", stats.nTotalMicros));
+        method.push_back(Pair("max_us", stats.nMaxMicros));
+        method.push_back(Pair("cs_main_wait_us", stats.nLockWaitMicros));
+        method.push_back(Pair("latency_histogram", histogram));
+        methods.push_back(Pair(entry.first, method));
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("latency_buckets_us", buckets));
+    obj.push_back(Pair("methods", methods));
+
+    HTTPWorkQueueStats queueStats;
+    if (GetHTTPWorkQueueStats(queueStats)) {
+        UniValue queue(UniValue::VOBJ);
+        queue.push_back(Pair("depth", (uint64_t)queueStats.nDepth));
+        queue.push_back(Pair("max_depth", (uint64_t)queueStats.nMaxDepth));
+        queue.push_back(Pair("high_water", (uint64_t)queueStats.nHighWater));
+        queue.push_back(Pair("rejected", queueStats.nRejected));
+        queue.push_back(Pair("threads", queueStats.nThreads));
+        obj.push_back(Pair("workqueue", queue));
+    }
     return obj;
 }
 
+/** The lock a LOCK expression names: "pwalletMain->cs_wallet" and "cs_wallet" are both "cs_wallet" */
+static std::string LockStatsName(const std::string& strExpr)
+{
+    size_t nPos = strExpr.find_last_of(".>:");
+    if (nPos != std::string::npos && strExpr.compare(nPos + 1, 3, "cs_") == 0)
+        return strExpr.substr(nPos + 1);
+    return strExpr;
+}
+
+static UniValue LockStatsToJSON(const CLockSiteStats& stats)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("acquisitions", stats.nAcquired));
+    obj.push_back(Pair("contentions", stats.nContended));
+    obj.push_back(Pair("wait_us", stats.nWaitMicros));
+    obj.push_back(Pair("max_wait_us", stats.nMaxWaitMicros));
+    obj.push_back(Pair("hold_us", stats.nHoldMicros));
+    obj.push_back(Pair("max_hold_us", stats.nMaxHoldMicros));
+    return obj;
+}
+
+UniValue getlockstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "getlockstats ( reset )\n"
+            "Returns how long LOCK, LOCK2 and TRY_LOCK call sites waited for and held their locks.\n"
+            "Statistics are only collected while the node runs with -lockstats.\n"
+            "\nArguments:\n"
+            "1. reset    (boolean, optional, default=false) Clear the statistics after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,           (boolean) Whether statistics are being collected\n"
+            "  \"locks\": {                       (json object) Totals per lock, e.g. cs_main, cs_wallet, cs, cs_vNodes\n"
+            "    \"name\": {\n"
+            "      \"acquisitions\": n,             (numeric) Number of times the lock was taken\n"
+            "      \"contentions\": n,              (numeric) Acquisitions that had to wait, and TRY_LOCKs that found it taken\n"
+            "      \"wait_us\": n,                  (numeric) Total time spent waiting for it, in microseconds\n"
+            "      \"max_wait_us\": n,              (numeric) Longest wait, in microseconds\n"
+            "      \"hold_us\": n,                  (numeric) Total time it was held, in microseconds\n"
+            "      \"max_hold_us\": n               (numeric) Longest hold, in microseconds\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"sites\": [                       (json array) Call sites, those that waited longest first\n"
+            "    {\n"
+            "      \"lock\": \"expr\",               (string) The expression passed to LOCK\n"
+            "      \"file\": \"file\",               (string) Source file of the call site\n"
+            "      \"line\": n,                     (numeric) Source line of the call site\n"
+            "      ...                             The same fields as for locks\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockstats", "")
+            + HelpExampleCli("getlockstats", "true")
+            + HelpExampleRpc("getlockstats", "")
+        );
+
+    std::vector<CLockSiteInfo> vSites = GetLockStats();
+    if (request.params.size() > 0 && request.params[0].get_bool())
+        ResetLockStats();
+    std::sort(vSites.begin(), vSites.end(), [](const CLockSiteInfo& a, const CLockSiteInfo& b) {
+        return a.stats.nWaitMicros > b.stats.nWaitMicros;
+    });
+
+    std::map<std::string, CLockSiteStats> mapLocks;
+    UniValue sites(UniValue::VARR);
+    for (const CLockSiteInfo& site : vSites) {
+        mapLocks[LockStatsName(site.strName)].Add(site.stats);
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("lock", site.strName));
+        obj.push_back(Pair("file", site.strFile));
+        obj.push_back(Pair("line", site.nLine));
+        obj.pushKVs(LockStatsToJSON(site.stats));
+        sites.push_back(obj);
+    }
+
+    UniValue locks(UniValue::VOBJ);
+    for (const auto& lock : mapLocks)
+        locks.push_back(Pair(lock.first, LockStatsToJSON(lock.second)));
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("enabled", fLockStats.load()));
+    obj.push_back(Pair("locks", locks));
+    obj.push_back(Pair("sites", sites));
+    return obj;
+}
+
+UniValue getthreadplacement(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "getthreadplacement\n"
+            "Returns the CPUs and NUMA node each class of threads was placed on with -threadaffinity.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"class\": \"name\",      (string) scriptcheck, msghand, net, http or stake\n"
+            "    \"cpus\": [ n, ... ],    (json array) CPUs its threads run on, empty if the class is not placed\n"
+            "    \"node\": n,             (numeric, optional) NUMA node whose memory its threads prefer\n"
+            "    \"placed\": n,           (numeric) Threads placed so far\n"
+            "    \"failed\": n            (numeric) Threads that could not be placed, see the debug log\n"
+            "  }, ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getthreadplacement", "")
+            + HelpExampleRpc("getthreadplacement", "")
+        );
+
+    UniValue result(UniValue::VARR);
+    for (const CThreadPlacementInfo& info : GetThreadPlacementInfo()) {
+        UniValue cpus(UniValue::VARR);
+        for (int nCPU : info.vCPUs)
+            cpus.push_back(nCPU);
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("class", info.strClass));
+        obj.push_back(Pair("cpus", cpus));
+        if (info.nNode >= 0)
+            obj.push_back(Pair("node", info.nNode));
+        obj.push_back(Pair("placed", info.nPlaced));
+        obj.push_back(Pair("failed", info.nFailed));
+        result.push_back(obj);
+    }
+    return result;
+}
+
 UniValue echo(const JSONRPCRequest& request)
 {
     if (request.fHelp)
@@ -615,12 +988,13 @@ UniValue getaddressmempool(const JSONRPCRequest& request)
     std::sort(indexes.begin(), indexes.end(), timestampSort);
 
     UniValue result(UniValue::VARR);
+    CAddressEncoder encoder;
 
     for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::iterator it = indexes.begin();
          it != indexes.end(); it++) {
 
         std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.addressBytes, address)) {
+        if (!getAddressFromIndex(it->first.type, it->first.addressBytes, address, encoder)) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
         }
 
@@ -641,6 +1015,155 @@ UniValue getaddressmempool(const JSONRPCRequest& request)
     return result;
 }
 
+/** Longest a single waitforaddressdeltas call may wait, in milliseconds */
+static const int64_t MAX_ADDRESS_DELTAS_WAIT = 120 * 1000;
+
+UniValue subscribeaddresses(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+            "subscribeaddresses\n"
+            "\nSubscribe to the activity of a set of addresses (requires addressindex to be enabled).\n"
+            "Deltas for them are then collected as blocks are connected and disconnected and\n"
+            "transactions are accepted to the mempool, and are fetched with waitforaddressdeltas.\n"
+            "Subscriptions that are not polled for 10 minutes are dropped.\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "  \"addresses\"\n"
+            "    [\n"
+            "      \"address\"  (string) The base58check encoded address\n"
+            "      ,...\n"
+            "    ]\n"
+            "}\n"
+            "2. \"id\"         (string, optional) Add the addresses to this subscription instead of creating one\n"
+            "\nResult:\n"
+            "\"id\"            (string) The subscription id\n"
+            "\nExamples:\n"
+            + HelpExampleCli("subscribeaddresses", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleRpc("subscribeaddresses", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
+        );
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+
+    std::vector<std::pair<uint160, int> > addresses;
+    if (!getAddressesFromParams(request.params, addresses)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+    }
+
+    if (request.params.size() > 1) {
+        std::string id = request.params[1].get_str();
+        if (!addressSubscriptions.AddAddresses(id, addresses))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown subscription");
+        return id;
+    }
+
+    std::string id = addressSubscriptions.Subscribe(addresses);
+    if (id.empty())
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Too many address subscriptions (maximum %u)", MAX_ADDRESS_SUBSCRIPTIONS));
+    return id;
+}
+
+UniValue unsubscribeaddresses(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "unsubscribeaddresses \"id\"\n"
+            "\nDrop an address subscription.\n"
+            "\nArguments:\n"
+            "1. \"id\"         (string, required) The subscription id\n"
+            "\nExamples:\n"
+            + HelpExampleCli("unsubscribeaddresses", "\"id\"")
+            + HelpExampleRpc("unsubscribeaddresses", "\"id\"")
+        );
+
+    if (!addressSubscriptions.Unsubscribe(request.params[0].get_str()))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown subscription");
+    return NullUniValue;
+}
+
+UniValue waitforaddressdeltas(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw runtime_error(
+            "waitforaddressdeltas \"id\" (timeout count)\n"
+            "\nReturns the deltas of a subscription's addresses since the last call, waiting for\n"
+            "some if there are none yet.\n"
+            "\nArguments:\n"
+            "1. \"id\"         (string, required) The subscription id\n"
+            "2. timeout      (int, optional, default=30000) Time in milliseconds to wait for a delta, at most 120000\n"
+            "3. count        (int, optional, default=1000) The maximum number of deltas to return\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"deltas\": [\n"
+            "    {\n"
+            "      \"address\"  (string) The base58check encoded address\n"
+            "      \"txid\"  (string) The related txid\n"
+            "      \"index\"  (number) The related input or output index\n"
+            "      \"satoshis\"  (number) The difference of satoshis\n"
+            "      \"height\"  (number) The block height, or -1 for a mempool transaction\n"
+            "      \"blockindex\"  (number) The index of the transaction in the block, for block deltas\n"
+            "      \"disconnected\"  (boolean) Whether the block was disconnected, undoing the delta, for block deltas\n"
+            "      \"timestamp\"  (number) The time the transaction entered the mempool, for mempool deltas\n"
+            "      \"prevtxid\"  (string) The previous txid, for mempool spends\n"
+            "      \"prevout\"  (string) The previous transaction output index, for mempool spends\n"
+            "    }\n"
+            "  ],\n"
+            "  \"overflow\": true|false  (boolean) Whether deltas were dropped since the last call; resync with getaddressdeltas if so\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("waitforaddressdeltas", "\"id\" 30000")
+            + HelpExampleRpc("waitforaddressdeltas", "\"id\", 30000")
+        );
+
+    std::string id = request.params[0].get_str();
+    int64_t nTimeout = 30 * 1000;
+    if (request.params.size() > 1)
+        nTimeout = std::max<int64_t>(0, std::min<int64_t>(request.params[1].get_int64(), MAX_ADDRESS_DELTAS_WAIT));
+    int nCount = 1000;
+    if (request.params.size() > 2)
+        nCount = request.params[2].get_int();
+    if (nCount <= 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count must be positive");
+
+    std::vector<CAddressSubscriptionDelta> vDeltas;
+    bool fOverflow = false;
+    if (!addressSubscriptions.Wait(id, nTimeout, nCount, vDeltas, fOverflow))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown subscription");
+
+    UniValue deltas(UniValue::VARR);
+    CAddressEncoder encoder;
+    for (const CAddressSubscriptionDelta& entry : vDeltas) {
+        std::string address;
+        if (!getAddressFromIndex(entry.type, entry.hashBytes, address, encoder)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
+        }
+
+        UniValue delta(UniValue::VOBJ);
+        delta.push_back(Pair("address", address));
+        delta.push_back(Pair("txid", entry.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)entry.index));
+        delta.push_back(Pair("satoshis", entry.satoshis));
+        delta.push_back(Pair("height", entry.blockHeight));
+        if (entry.blockHeight >= 0) {
+            delta.push_back(Pair("blockindex", (int)entry.txindex));
+            delta.push_back(Pair("disconnected", entry.fDisconnected));
+        } else {
+            delta.push_back(Pair("timestamp", entry.nTime));
+            if (entry.satoshis < 0) {
+                delta.push_back(Pair("prevtxid", entry.prevhash.GetHex()));
+                delta.push_back(Pair("prevout", (int)entry.prevout));
+            }
+        }
+        deltas.push_back(delta);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("deltas", deltas));
+    result.push_back(Pair("overflow", fOverflow));
+    return result;
+}
+
 UniValue getaddressutxos(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -688,20 +1211,19 @@ UniValue getaddressutxos(const JSONRPCRequest& request)
 
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
+    if (!GetAddressUnspent(addresses, unspentOutputs)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
     std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
 
     UniValue utxos(UniValue::VARR);
+    CAddressEncoder encoder;
 
     for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=unspentOutputs.begin(); it!=unspentOutputs.end(); it++) {
         UniValue output(UniValue::VOBJ);
         std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
+        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address, encoder)) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
         }
 
@@ -719,9 +1241,9 @@ UniValue getaddressutxos(const JSONRPCRequest& request)
         UniValue result(UniValue::VOBJ);
         result.push_back(Pair("utxos", utxos));
 
-        LOCK(cs_main);
-        result.push_back(Pair("hash", chainActive.Tip()->GetBlockHash().GetHex()));
-        result.push_back(Pair("height", (int)chainActive.Height()));
+        ChainSnapshotRef chain = GetChainSnapshot();
+        result.push_back(Pair("hash", chain->Tip()->GetBlockHash().GetHex()));
+        result.push_back(Pair("height", chain->Height()));
         return result;
     } else {
         return utxos;
@@ -744,6 +1266,8 @@ UniValue getaddressdeltas(const JSONRPCRequest& request)
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
             "  \"chainInfo\" (boolean) Include chain info in results, only applies if start and end specified\n"
+            "  \"limit\" (number) Return at most this many deltas\n"
+            "  \"cursor\" (string) Continue after the page that returned this cursor\n"
             "}\n"
             "\nResult:\n"
             "[\n"
@@ -755,6 +1279,8 @@ UniValue getaddressdeltas(const JSONRPCRequest& request)
             "    \"address\"  (string) The base58check encoded address\n"
             "  }\n"
             "]\n"
+            "\nDeltas are in chain order. With limit or cursor, or with chainInfo, the result is an object holding\n"
+            "them in \"deltas\", and \"cursor\" is set when more deltas follow.\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
@@ -790,49 +1316,62 @@ UniValue getaddressdeltas(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        }
-    }
+    size_t limit;
+    bool fHaveCursor;
+    CAddressIndexKey keyAfter;
+    bool fPaged = getAddressIndexPageFromParams(request.params, limit, fHaveCursor, keyAfter);
 
     UniValue deltas(UniValue::VARR);
+    CAddressIndexKey keyLast;
+    bool fMore = false;
+    CAddressEncoder encoder;
+
+    // Deltas go straight from the index cursor into the reply
+    auto addDelta = [&](const CAddressIndexKey& key, CAmount satoshis) -> bool {
+        if (limit > 0 && deltas.size() == limit) {
+            fMore = true;
+            return false;
+        }
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
         std::string address;
-        if (!getAddressFromIndex(it->first.type, it->first.hashBytes, address)) {
+        if (!getAddressFromIndex(key.type, key.hashBytes, address, encoder)) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown address type");
         }
 
         UniValue delta(UniValue::VOBJ);
-        delta.push_back(Pair("satoshis", it->second));
-        delta.push_back(Pair("txid", it->first.txhash.GetHex()));
-        delta.push_back(Pair("index", (int)it->first.index));
-        delta.push_back(Pair("blockindex", (int)it->first.txindex));
-        delta.push_back(Pair("height", it->first.blockHeight));
+        delta.push_back(Pair("satoshis", satoshis));
+        delta.push_back(Pair("txid", key.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)key.index));
+        delta.push_back(Pair("blockindex", (int)key.txindex));
+        delta.push_back(Pair("height", key.blockHeight));
         delta.push_back(Pair("address", address));
         deltas.push_back(delta);
+        keyLast = key;
+        return true;
+    };
+
+    if (!ScanAddressIndex(addresses, start, end, fHaveCursor ? &keyAfter : NULL, addDelta)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
     UniValue result(UniValue::VOBJ);
 
+    if (fPaged) {
+        result.push_back(Pair("deltas", deltas));
+        if (fMore) {
+            result.push_back(Pair("cursor", getAddressIndexCursor(keyLast)));
+        }
+    }
+
     if (includeChainInfo && start > 0 && end > 0) {
-        LOCK(cs_main);
+        ChainSnapshotRef chain = GetChainSnapshot();
 
-        if (start > chainActive.Height() || end > chainActive.Height()) {
+        if (start > chain->Height() || end > chain->Height()) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Start or end is outside chain range");
         }
 
-        CBlockIndex* startIndex = chainActive[start];
-        CBlockIndex* endIndex = chainActive[end];
+        const CBlockIndex* startIndex = (*chain)[start];
+        const CBlockIndex* endIndex = (*chain)[end];
 
         UniValue startInfo(UniValue::VOBJ);
         UniValue endInfo(UniValue::VOBJ);
@@ -843,10 +1382,14 @@ UniValue getaddressdeltas(const JSONRPCRequest& request)
         endInfo.push_back(Pair("hash", endIndex->GetBlockHash().GetHex()));
         endInfo.push_back(Pair("height", end));
 
-        result.push_back(Pair("deltas", deltas));
+        if (!fPaged) {
+            result.push_back(Pair("deltas", deltas));
+        }
         result.push_back(Pair("start", startInfo));
         result.push_back(Pair("end", endInfo));
 
+        return result;
+    } else if (fPaged) {
         return result;
     } else {
         return deltas;
@@ -871,6 +1414,7 @@ UniValue getaddressbalance(const JSONRPCRequest& request)
             "{\n"
             "  \"balance\"  (string) The current balance in satoshis\n"
             "  \"received\"  (string) The total number of satoshis received (including change)\n"
+            "  \"txcount\"  (numeric) The number of transactions involving each address, summed over the addresses\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
@@ -883,27 +1427,26 @@ UniValue getaddressbalance(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<CAddressBalance> addressBalances;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
+    if (!GetAddressBalances(addresses, addressBalances)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
     }
 
     CAmount balance = 0;
     CAmount received = 0;
+    uint64_t txcount = 0;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
-        }
-        balance += it->second;
+    for (std::vector<CAddressBalance>::const_iterator it = addressBalances.begin(); it != addressBalances.end(); it++) {
+        balance += it->nBalance;
+        received += it->nReceived;
+        txcount += it->nTxCount;
     }
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("balance", balance));
     result.push_back(Pair("received", received));
+    result.push_back(Pair("txcount", txcount));
 
     return result;
 
@@ -923,12 +1466,16 @@ UniValue getaddresstxids(const JSONRPCRequest& request)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number) Return at most this many txids\n"
+            "  \"cursor\" (string) Continue after the page that returned this cursor\n"
             "}\n"
             "\nResult:\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nTxids are in chain order. With limit or cursor the result is an object holding them in \"txids\",\n"
+            "and \"cursor\" is set when more txids follow.\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
@@ -951,66 +1498,73 @@ UniValue getaddresstxids(const JSONRPCRequest& request)
         }
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    size_t limit;
+    bool fHaveCursor;
+    CAddressIndexKey keyAfter;
+    bool fPaged = getAddressIndexPageFromParams(request.params, limit, fHaveCursor, keyAfter);
+
+    UniValue txids(UniValue::VARR);
+    CAddressIndexKey keyLast;
+    bool fMore = false;
+
+    // Entries of one transaction are adjacent in chain order, so comparing
+    // with the last key is enough to list each txid once
+    auto addTxid = [&](const CAddressIndexKey& key, CAmount satoshis) -> bool {
+        if (txids.size() == 0 || key.txhash != keyLast.txhash) {
+            if (limit > 0 && txids.size() == limit) {
+                fMore = true;
+                return false;
             }
+            txids.push_back(key.txhash.GetHex());
         }
-    }
+        keyLast = key;
+        return true;
+    };
 
-    std::set<std::pair<int, std::string> > txids;
-    UniValue result(UniValue::VARR);
-
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        int height = it->first.blockHeight;
-        std::string txid = it->first.txhash.GetHex();
+    if (!ScanAddressIndex(addresses, start, end, fHaveCursor ? &keyAfter : NULL, addTxid)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
 
-        if (addresses.size() > 1) {
-            txids.insert(std::make_pair(height, txid));
-        } else {
-            if (txids.insert(std::make_pair(height, txid)).second) {
-                result.push_back(txid);
-            }
-        }
+    if (!fPaged) {
+        return txids;
     }
 
-    if (addresses.size() > 1) {
-        for (std::set<std::pair<int, std::string> >::const_iterator it=txids.begin(); it!=txids.end(); it++) {
-            result.push_back(it->second);
-        }
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txids", txids));
+    if (fMore) {
+        result.push_back(Pair("cursor", getAddressIndexCursor(keyLast)));
     }
 
     return result;
 
 }
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "control",            "getinfo",                &getinfo,                true,  {} }, /* uses wallet if enabled */
-    { "control",            "getmemoryinfo",          &getmemoryinfo,          true,  {} },
-    { "util",               "validateaddress",        &validateaddress,        true,  {"address"} }, /* uses wallet if enabled */
-    { "util",               "createmultisig",         &createmultisig,         true,  {"nrequired","keys"} },
-    { "util",               "verifymessage",          &verifymessage,          true,  {"address","signature","message"} },
-    { "util",               "signmessagewithprivkey", &signmessagewithprivkey, true,  {"privkey","message"} },
+{ //  category              name                      actor (function)         okSafeMode argNames  parallelSafe
+  //  --------------------- ------------------------  -----------------------  ---------- --------  ------------
+    { "control",            "getinfo",                &getinfo,                true,  {}, false }, /* uses wallet if enabled */
+    { "control",            "getmemoryinfo",          &getmemoryinfo,          true,  {"verbose"}, false },
+    { "control",            "getrpcstats",            &getrpcstats,            true,  {}, false },
+    { "control",            "getlockstats",           &getlockstats,           true,  {"reset"}, false },
+    { "control",            "getthreadplacement",     &getthreadplacement,     true,  {}, false },
+    { "util",               "validateaddress",        &validateaddress,        true,  {"address"}, false }, /* uses wallet if enabled */
+    { "util",               "createmultisig",         &createmultisig,         true,  {"nrequired","keys"}, false },
+    { "util",               "verifymessage",          &verifymessage,          true,  {"address","signature","message"}, false },
+    { "util",               "signmessagewithprivkey", &signmessagewithprivkey, true,  {"privkey","message"}, false },
 
      /* Address index */
-     { "hidden",       "getaddressmempool",      &getaddressmempool,      true  },
-     { "hidden",       "getaddressutxos",        &getaddressutxos,        false },
-     { "hidden",       "getaddressdeltas",       &getaddressdeltas,       false },
-     { "hidden",       "getaddresstxids",        &getaddresstxids,        false },
-     { "hidden",       "getaddressbalance",      &getaddressbalance,      false },
+     { "hidden",       "getaddressmempool",      &getaddressmempool,      true, {}, true },
+     { "hidden",       "getaddressutxos",        &getaddressutxos,        false, {}, true },
+     { "hidden",       "getaddressdeltas",       &getaddressdeltas,       false, {}, true },
+     { "hidden",       "getaddresstxids",        &getaddresstxids,        false, {}, true },
+     { "hidden",       "getaddressbalance",      &getaddressbalance,      false, {}, true },
+     { "hidden",       "subscribeaddresses",     &subscribeaddresses,     true, {}, true },
+     { "hidden",       "unsubscribeaddresses",   &unsubscribeaddresses,   true, {}, true },
+     { "hidden",       "waitforaddressdeltas",   &waitforaddressdeltas,   true, {}, true },
 
     /* Not shown in help */
-    { "hidden",             "setmocktime",            &setmocktime,            true,  {"timestamp"}},
-    { "hidden",             "echo",                   &echo,                   true,  {"arg0","arg1","arg2","arg3","arg4","arg5","arg6","arg7","arg8","arg9"}},
-    { "hidden",             "echojson",               &echo,                  true,  {"arg0","arg1","arg2","arg3","arg4","arg5","arg6","arg7","arg8","arg9"}},
+    { "hidden",             "setmocktime",            &setmocktime,            true,  {"timestamp"}, false},
+    { "hidden",             "echo",                   &echo,                   true,  {"arg0","arg1","arg2","arg3","arg4","arg5","arg6","arg7","arg8","arg9"}, false},
+    { "hidden",             "echojson",               &echo,                  true,  {"arg0","arg1","arg2","arg3","arg4","arg5","arg6","arg7","arg8","arg9"}, false},
 };
 
 void RegisterMiscRPCCommands(CRPCTable &t)
@@ -11,6 +11,7 @@
 #include "net_processing.h"
 #include "netbase.h"
 #include "policy/policy.h"
+#include "pos.h"
 #include "protocol.h"
 #include "sync.h"
 #include "timedata.h"
@@ -25,7 +26,7 @@
 #include <univalue.h>
 
 using namespace std;
-double GetPoSKernelPS();
+
 UniValue getconnectioncount(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 0)
@@ -103,6 +104,12 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"cmpctblocks\": n,          (numeric) The compact blocks from this peer we tried to reconstruct\n"
+            "    \"cmpctblocks_reconstructed\": n, (numeric) How many of them needed no getblocktxn round trip\n"
+            "    \"cmpctblocks_txnrequested\": n,  (numeric) The transactions we had to request for them\n"
+            "    \"txinv_sent\": n,           (numeric) The transactions we announced to this peer\n"
+            "    \"txinv_skipped\": n,        (numeric) The transactions we did not announce, as the peer already knew them\n"
+            "    \"txinv_bytes_saved\": n,    (numeric) The inv bytes that skipping those saved\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"					
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -167,6 +174,12 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("cmpctblocks", statestats.nCmpctBlocks));
+            obj.push_back(Pair("cmpctblocks_reconstructed", statestats.nCmpctBlocksReconstructed));
+            obj.push_back(Pair("cmpctblocks_txnrequested", statestats.nCmpctTxnRequested));
+            obj.push_back(Pair("txinv_sent", statestats.nTxInvSent));
+            obj.push_back(Pair("txinv_skipped", statestats.nTxInvSkipped));
+            obj.push_back(Pair("txinv_bytes_saved", statestats.nTxInvSkipped * ::GetSerializeSize(CInv(), SER_NETWORK, PROTOCOL_VERSION)));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -613,11 +626,8 @@ UniValue getstakinginfo(const JSONRPCRequest& request)
             "Returns an object containing staking-related information.");
     }
 
-    uint64_t nWeight = 0;
-    if (pwalletMain)
-        nWeight = pwalletMain->GetStakeWeight();
-
-    uint64_t nNetworkWeight = GetPoSKernelPS();
+    uint64_t nWeight = pwalletMain ? stakingStatus.nWeight.load() : 0;
+    uint64_t nNetworkWeight = stakingStatus.nNetworkWeight;
     bool staking = nLastCoinStakeSearchInterval && nWeight;
     uint64_t nExpectedTime = staking ? (Params().GetConsensus().nPowTargetSpacing * nNetworkWeight / nWeight) : 0;
 
@@ -635,32 +645,89 @@ UniValue getstakinginfo(const JSONRPCRequest& request)
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
+    {
+        LOCK(cs_main);
+        obj.push_back(Pair("netstakeweightwindow", (uint64_t)stakeWeightWindow.GetWindow()));
+    }
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
 
     return obj;
 }
+
+UniValue getstakingstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0) {
+        throw runtime_error(
+            "getstakingstats\n"
+            "Returns counters of the stake search since startup, to show where staking time goes.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"searches\": n,               (numeric) kernel searches run\n"
+            "  \"coinsevaluated\": n,         (numeric) coins whose kernel was searched\n"
+            "  \"kernelshashed\": n,          (numeric) kernel hashes computed\n"
+            "  \"kernelsfound\": n,           (numeric) searches that found a kernel\n"
+            "  \"kernelspersecond\": x.x,     (numeric) kernel hashes per second of hashing time\n"
+            "  \"lastkernelspersecond\": x.x, (numeric) kernel hashes per second in the most recent search\n"
+            "  \"selectcoinstime\": x.x,      (numeric) seconds spent choosing coins and refreshing the stake cache\n"
+            "  \"hashtime\": x.x,             (numeric) seconds spent hashing kernels\n"
+            "  \"createblocktime\": x.x,      (numeric) seconds spent building block templates\n"
+            "  \"signblocktime\": x.x,        (numeric) seconds spent building coinstakes and signing blocks\n"
+            "  \"templatesbuilt\": n,         (numeric) block templates built\n"
+            "  \"templatesreused\": n,        (numeric) stakes signed on a cached template\n"
+            "  \"templatesdiscarded\": n,     (numeric) templates dropped because the tip moved during the search\n"
+            "  \"orphanedstakes\": n,         (numeric) signed blocks orphaned before they could be submitted\n"
+            "  \"blocksstaked\": n            (numeric) staked blocks submitted\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getstakingstats", "")
+            + HelpExampleRpc("getstakingstats", ""));
+    }
+
+    uint64_t nHashMicros = stakingStats.nHashMicros;
+    uint64_t nLastSearchMicros = stakingStats.nLastSearchMicros;
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("searches", (uint64_t)stakingStats.nSearches));
+    obj.push_back(Pair("coinsevaluated", (uint64_t)stakingStats.nCoinsEvaluated));
+    obj.push_back(Pair("kernelshashed", (uint64_t)stakingStats.nKernelsHashed));
+    obj.push_back(Pair("kernelsfound", (uint64_t)stakingStats.nKernelsFound));
+    obj.push_back(Pair("kernelspersecond", nHashMicros ? stakingStats.nKernelsHashed * 1000000.0 / nHashMicros : 0.0));
+    obj.push_back(Pair("lastkernelspersecond", nLastSearchMicros ? stakingStats.nLastSearchHashes * 1000000.0 / nLastSearchMicros : 0.0));
+    obj.push_back(Pair("selectcoinstime", stakingStats.nSelectCoinsMicros * 0.000001));
+    obj.push_back(Pair("hashtime", nHashMicros * 0.000001));
+    obj.push_back(Pair("createblocktime", stakingStats.nCreateBlockMicros * 0.000001));
+    obj.push_back(Pair("signblocktime", stakingStats.nSignBlockMicros * 0.000001));
+    obj.push_back(Pair("templatesbuilt", (uint64_t)stakingStats.nTemplatesBuilt));
+    obj.push_back(Pair("templatesreused", (uint64_t)stakingStats.nTemplatesReused));
+    obj.push_back(Pair("templatesdiscarded", (uint64_t)stakingStats.nTemplatesDiscarded));
+    obj.push_back(Pair("orphanedstakes", (uint64_t)stakingStats.nOrphanedStakes));
+    obj.push_back(Pair("blocksstaked", (uint64_t)stakingStats.nBlocksStaked));
+
+    return obj;
+}
  
 
 
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "network",            "getconnectioncount",     &getconnectioncount,     true,  {} },
+{ //  category              name                      actor (function)         okSafeMode argNames  parallelSafe
+  //  --------------------- ------------------------  -----------------------  ---------- --------  ------------
+    { "network",            "getconnectioncount",     &getconnectioncount,     true,  {}, false },
     
-    { "network",            "getstakinginfo",         &getstakinginfo,         true,  {}  },
+    { "network",            "getstakinginfo",         &getstakinginfo,         true,  {}, false  },
+    { "network",            "getstakingstats",        &getstakingstats,        true,  {}, false  },
     
-    { "network",            "ping",                   &ping,                   true,  {} },
-    { "network",            "getpeerinfo",            &getpeerinfo,            true,  {} },
-    { "network",            "addnode",                &addnode,                true,  {"node","command"} },
-    { "network",            "disconnectnode",         &disconnectnode,         true,  {"address"} },
-    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,  {"node"} },
-    { "network",            "getnettotals",           &getnettotals,           true,  {} },
-    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,  {} },
-    { "network",            "setban",                 &setban,                 true,  {"subnet", "command", "bantime", "absolute"} },
-    { "network",            "listbanned",             &listbanned,             true,  {} },
-    { "network",            "clearbanned",            &clearbanned,            true,  {} },
-    { "network",            "setnetworkactive",       &setnetworkactive,       true,  {"state"} },
+    { "network",            "ping",                   &ping,                   true,  {}, false },
+    { "network",            "getpeerinfo",            &getpeerinfo,            true,  {}, false },
+    { "network",            "addnode",                &addnode,                true,  {"node","command"}, false },
+    { "network",            "disconnectnode",         &disconnectnode,         true,  {"address"}, false },
+    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,  {"node"}, false },
+    { "network",            "getnettotals",           &getnettotals,           true,  {}, false },
+    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,  {}, false },
+    { "network",            "setban",                 &setban,                 true,  {"subnet", "command", "bantime", "absolute"}, false },
+    { "network",            "listbanned",             &listbanned,             true,  {}, false },
+    { "network",            "clearbanned",            &clearbanned,            true,  {}, false },
+    { "network",            "setnetworkactive",       &setnetworkactive,       true,  {"state"}, false },
 };
 
 void RegisterNetRPCCommands(CRPCTable &t)
@@ -55,7 +55,7 @@ void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fInclud
 
     UniValue a(UniValue::VARR);
     BOOST_FOREACH(const CTxDestination& addr, addresses)
-        a.push_back(CBitcoinAddress(addr).ToString());
+        a.push_back(EncodeAddress(addr));
     out.push_back(Pair("addresses", a));
 }
 
@@ -69,6 +69,20 @@ void TxToJSONExpanded(const CTransactionRef& ptx, const uint256 hashBlock, UniVa
     entry.push_back(Pair("size", (int)::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION)));
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
+
+    // Spent index entries of all inputs, then all outputs, looked up together
+    std::vector<CSpentIndexKey> vSpentKeys;
+    std::vector<CSpentIndexValue> vSpentInfo;
+    if (!tx.IsCoinBase()) {
+        for (const CTxIn& txin : tx.vin)
+            vSpentKeys.push_back(CSpentIndexKey(txin.prevout.hash, txin.prevout.n));
+    }
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        vSpentKeys.push_back(CSpentIndexKey(txid, i));
+    if (!GetSpentIndexes(vSpentKeys, vSpentInfo))
+        vSpentInfo.assign(vSpentKeys.size(), CSpentIndexValue());
+    size_t nSpentPos = 0;
+
     UniValue vin(UniValue::VARR);
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
         UniValue in(UniValue::VOBJ);
@@ -83,15 +97,14 @@ void TxToJSONExpanded(const CTransactionRef& ptx, const uint256 hashBlock, UniVa
             in.push_back(Pair("scriptSig", o));
 
             // Add address and value info if spentindex enabled
-            CSpentIndexValue spentInfo;
-            CSpentIndexKey spentKey(txin.prevout.hash, txin.prevout.n);
-            if (GetSpentIndex(spentKey, spentInfo)) {
+            const CSpentIndexValue& spentInfo = vSpentInfo[nSpentPos++];
+            if (!spentInfo.IsNull()) {
                 in.push_back(Pair("value", ValueFromAmount(spentInfo.satoshis)));
                 in.push_back(Pair("valueSat", spentInfo.satoshis));
                 if (spentInfo.addressType == 1) {
-                    in.push_back(Pair("address", CBitcoinAddress(CKeyID(spentInfo.addressHash)).ToString()));
+                    in.push_back(Pair("address", EncodeAddress(CKeyID(spentInfo.addressHash))));
                 } else if (spentInfo.addressType == 2)  {
-                    in.push_back(Pair("address", CBitcoinAddress(CScriptID(spentInfo.addressHash)).ToString()));
+                    in.push_back(Pair("address", EncodeAddress(CScriptID(spentInfo.addressHash))));
                 }
             }
 
@@ -112,9 +125,8 @@ void TxToJSONExpanded(const CTransactionRef& ptx, const uint256 hashBlock, UniVa
         out.push_back(Pair("scriptPubKey", o));
 
         // Add spent information if spentindex is enabled
-        CSpentIndexValue spentInfo;
-        CSpentIndexKey spentKey(txid, i);
-        if (GetSpentIndex(spentKey, spentInfo)) {
+        const CSpentIndexValue& spentInfo = vSpentInfo[nSpentPos++];
+        if (!spentInfo.IsNull()) {
             out.push_back(Pair("spentTxId", spentInfo.txid.GetHex()));
             out.push_back(Pair("spentIndex", (int)spentInfo.inputIndex));
             out.push_back(Pair("spentHeight", spentInfo.blockHeight));
@@ -386,9 +398,9 @@ UniValue gettxoutproof(const JSONRPCRequest& request)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
         pblockindex = mapBlockIndex[hashBlock];
     } else {
-        CCoins coins;
-        if (pcoinsTip->GetCoins(oneTxid, coins) && coins.nHeight > 0 && coins.nHeight <= chainActive.Height())
-            pblockindex = chainActive[coins.nHeight];
+        const Coin& coin = AccessByTxid(*pcoinsTip, oneTxid);
+        if (!coin.IsSpent() && coin.nHeight > 0 && coin.nHeight <= chainActive.Height())
+            pblockindex = chainActive[coin.nHeight];
     }
 
     if (pblockindex == NULL)
@@ -795,9 +807,7 @@ UniValue signrawtransaction(const JSONRPCRequest& request)
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
         BOOST_FOREACH(const CTxIn& txin, mergedTx.vin) {
-            const uint256& prevHash = txin.prevout.hash;
-            CCoins coins;
-            view.AccessCoins(prevHash); // this is certainly allowed to fail
+            view.AccessCoin(txin.prevout); // Load entries from viewChain into view; can fail.
         }
 
         view.SetBackend(viewDummy); // switch back to avoid locking mempool for too long
@@ -851,21 +861,23 @@ UniValue signrawtransaction(const JSONRPCRequest& request)
             vector<unsigned char> pkData(ParseHexO(prevOut, "scriptPubKey"));
             CScript scriptPubKey(pkData.begin(), pkData.end());
 
+            COutPoint out(txid, nOut);
             {
-                CCoinsModifier coins = view.ModifyCoins(txid);
-                if (coins->IsAvailable(nOut) && coins->vout[nOut].scriptPubKey != scriptPubKey) {
+                const Coin& coin = view.AccessCoin(out);
+                if (!coin.IsSpent() && coin.out.scriptPubKey != scriptPubKey) {
                     string err("Previous output scriptPubKey mismatch:\n");
-                    err = err + ScriptToAsmStr(coins->vout[nOut].scriptPubKey) + "\nvs:\n"+
+                    err = err + ScriptToAsmStr(coin.out.scriptPubKey) + "\nvs:\n"+
                         ScriptToAsmStr(scriptPubKey);
                     throw JSONRPCError(RPC_DESERIALIZATION_ERROR, err);
                 }
-                if ((unsigned int)nOut >= coins->vout.size())
-                    coins->vout.resize(nOut+1);
-                coins->vout[nOut].scriptPubKey = scriptPubKey;
-                coins->vout[nOut].nValue = 0;
+                Coin newcoin;
+                newcoin.out.scriptPubKey = scriptPubKey;
+                newcoin.out.nValue = 0;
                 if (prevOut.exists("amount")) {
-                    coins->vout[nOut].nValue = AmountFromValue(find_value(prevOut, "amount"));
+                    newcoin.out.nValue = AmountFromValue(find_value(prevOut, "amount"));
                 }
+                newcoin.nHeight = 1;
+                view.AddCoin(out, std::move(newcoin), true);
             }
 
             // if redeemScript given and not using the local wallet (private keys
@@ -918,36 +930,52 @@ UniValue signrawtransaction(const JSONRPCRequest& request)
     UniValue vErrors(UniValue::VARR);
 
     // Use CTransaction for the constant parts of the
-    // transaction to avoid rehashing.
+    // transaction to avoid rehashing. Signatures do not change what the
+    // signature hashes cover, so every input is signed against it.
     const CTransaction txConst(mergedTx);
-    // Sign what we can:
+    const PrecomputedTransactionData txdata(txConst);
+
+    // The outputs spent, fetched up front as the view is not thread safe
+    std::vector<CTxOut> vPrevOuts(mergedTx.vin.size());
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
-        CTxIn& txin = mergedTx.vin[i];
-        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
-            TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
-            continue;
-        }
-        const CScript& prevPubKey = coins->vout[txin.prevout.n].scriptPubKey;
-        const CAmount& amount = coins->vout[txin.prevout.n].nValue;
+        const Coin& coin = view.AccessCoin(mergedTx.vin[i].prevout);
+        if (!coin.IsSpent())
+            vPrevOuts[i] = coin.out;
+    }
 
-        SignatureData sigdata;
+    // Sign what we can, on several threads for large transactions:
+    std::vector<SignatureData> vSigData(mergedTx.vin.size());
+    std::vector<ScriptError> vScriptErrors(mergedTx.vin.size(), SCRIPT_ERR_OK);
+    ParallelFor(mergedTx.vin.size(), mergedTx.vin.size() >= PARALLEL_SIGNING_MIN_INPUTS ? GetNumCores() : 1, [&](size_t i) {
+        if (vPrevOuts[i].IsNull())
+            return;
+        const CScript& prevPubKey = vPrevOuts[i].scriptPubKey;
+        const CAmount& amount = vPrevOuts[i].nValue;
+
+        SignatureData& sigdata = vSigData[i];
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            ProduceSignature(MutableTransactionSignatureCreator(&keystore, &mergedTx, i, amount, nHashType), prevPubKey, sigdata);
+            ProduceSignature(TransactionSignatureCreator(&keystore, &txConst, i, amount, nHashType, &txdata), prevPubKey, sigdata);
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CMutableTransaction& txv, txVariants) {
             if (txv.vin.size() > i) {
-                sigdata = CombineSignatures(prevPubKey, TransactionSignatureChecker(&txConst, i, amount), sigdata, DataFromTransaction(txv, i));
+                sigdata = CombineSignatures(prevPubKey, TransactionSignatureChecker(&txConst, i, amount, txdata), sigdata, DataFromTransaction(txv, i));
             }
         }
 
-        UpdateTransaction(mergedTx, i, sigdata);
+        VerifyScript(sigdata.scriptSig, prevPubKey, &sigdata.scriptWitness, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txConst, i, amount, txdata), &vScriptErrors[i]);
+    });
 
-        ScriptError serror = SCRIPT_ERR_OK;
-        if (!VerifyScript(txin.scriptSig, prevPubKey, &txin.scriptWitness, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txConst, i, amount), &serror)) {
-            TxInErrorToJSON(txin, vErrors, ScriptErrorString(serror));
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
+        CTxIn& txin = mergedTx.vin[i];
+        if (vPrevOuts[i].IsNull()) {
+            TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
+            continue;
+        }
+        UpdateTransaction(mergedTx, i, vSigData[i]);
+        if (vScriptErrors[i] != SCRIPT_ERR_OK) {
+            TxInErrorToJSON(txin, vErrors, ScriptErrorString(vScriptErrors[i]));
         }
     }
     bool fComplete = vErrors.empty();
@@ -1001,9 +1029,12 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
         nMaxRawTxFee = 0;
 
     CCoinsViewCache &view = *pcoinsTip;
-    const CCoins* existingCoins = view.AccessCoins(hashTx);
+    bool fHaveChain = false;
+    for (size_t o = 0; !fHaveChain && o < tx->vout.size(); o++) {
+        const Coin& existingCoin = view.AccessCoin(COutPoint(hashTx, o));
+        fHaveChain = !existingCoin.IsSpent();
+    }
     bool fHaveMempool = mempool.exists(hashTx);
-    bool fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
     if (!fHaveMempool && !fHaveChain) {
         // push to local node and sync with wallets
         CValidationState state;
@@ -1032,18 +1063,127 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     return hashTx.GetHex();
 }
 
+UniValue sendrawtransactions(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw runtime_error(
+            "sendrawtransactions [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits many raw transactions (serialized, hex-encoded) to local node and network at once.\n"
+            "They are accepted in the given order, so a transaction may spend an earlier one in the same call.\n"
+            "This is much cheaper than one sendrawtransaction call per transaction.\n"
+            "\nArguments:\n"
+            "1. [\"hexstring\",...] (array, required) The hex strings of the raw transactions\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[                   (array) One entry per transaction, in the given order\n"
+            "  {\n"
+            "    \"txid\": \"hex\",   (string) The transaction hash, if the transaction could be decoded\n"
+            "    \"accepted\": true|false, (boolean) Whether the transaction is in the mempool now\n"
+            "    \"error\": \"str\"   (string) Why it was not accepted, if it was not\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendrawtransactions", "\"[\\\"signedhex\\\",\\\"signedhex\\\"]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendrawtransactions", "[\"signedhex\",\"signedhex\"]")
+        );
+
+    RPCTypeCheck(request.params, boost::assign::list_of(UniValue::VARR)(UniValue::VBOOL));
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    CAmount nMaxRawTxFee = maxTxFee;
+    if (request.params.size() > 1 && request.params[1].get_bool())
+        nMaxRawTxFee = 0;
+
+    // Decode everything before taking cs_main
+    const UniValue& hexstrings = request.params[0].get_array();
+    std::vector<UniValue> vResult(hexstrings.size(), UniValue(UniValue::VOBJ));
+    std::vector<CTransactionRef> vtx;
+    std::vector<size_t> vIndex; // position in vResult of each entry of vtx
+    for (size_t i = 0; i < hexstrings.size(); i++) {
+        CMutableTransaction mtx;
+        if (!hexstrings[i].isStr() || !DecodeHexTx(mtx, hexstrings[i].get_str())) {
+            vResult[i].push_back(Pair("accepted", false));
+            vResult[i].push_back(Pair("error", "TX decode failed"));
+            continue;
+        }
+        vtx.push_back(MakeTransactionRef(std::move(mtx)));
+        vIndex.push_back(i);
+        vResult[i].push_back(Pair("txid", vtx.back()->GetHash().GetHex()));
+    }
+
+    std::vector<CInv> vInv;
+    {
+        LOCK(cs_main);
+        // Same as sendrawtransaction: known transactions are relayed again,
+        // confirmed ones are an error
+        std::vector<CTransactionRef> vtxSubmit;
+        std::vector<size_t> vSubmitIndex;
+        for (size_t n = 0; n < vtx.size(); n++) {
+            const uint256& hashTx = vtx[n]->GetHash();
+            UniValue& result = vResult[vIndex[n]];
+            bool fHaveChain = false;
+            for (size_t o = 0; !fHaveChain && o < vtx[n]->vout.size(); o++)
+                fHaveChain = !pcoinsTip->AccessCoin(COutPoint(hashTx, o)).IsSpent();
+            if (fHaveChain) {
+                result.push_back(Pair("accepted", false));
+                result.push_back(Pair("error", "transaction already in block chain"));
+            } else if (mempool.exists(hashTx)) {
+                result.push_back(Pair("accepted", true));
+                vInv.push_back(CInv(MSG_TX, hashTx));
+            } else {
+                vtxSubmit.push_back(vtx[n]);
+                vSubmitIndex.push_back(vIndex[n]);
+            }
+        }
+
+        std::vector<CValidationState> vState;
+        std::vector<bool> vfMissingInputs;
+        AcceptToMemoryPoolBatch(mempool, vtxSubmit, vState, vfMissingInputs, false, nMaxRawTxFee);
+        for (size_t n = 0; n < vtxSubmit.size(); n++) {
+            UniValue& result = vResult[vSubmitIndex[n]];
+            if (vState[n].IsValid()) {
+                result.push_back(Pair("accepted", true));
+                vInv.push_back(CInv(MSG_TX, vtxSubmit[n]->GetHash()));
+            } else {
+                result.push_back(Pair("accepted", false));
+                if (vState[n].IsInvalid())
+                    result.push_back(Pair("error", strprintf("%i: %s", vState[n].GetRejectCode(), vState[n].GetRejectReason())));
+                else if (vfMissingInputs[n])
+                    result.push_back(Pair("error", "Missing inputs"));
+                else
+                    result.push_back(Pair("error", vState[n].GetRejectReason()));
+            }
+        }
+    }
+
+    g_connman->ForEachNode([&vInv](CNode* pnode)
+    {
+        for (const CInv& inv : vInv)
+            pnode->PushInventory(inv);
+    });
+
+    UniValue ret(UniValue::VARR);
+    for (const UniValue& result : vResult)
+        ret.push_back(result);
+    return ret;
+}
+
 static const CRPCCommand commands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
-    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,  {"txid","verbose"} },
-    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,  {"inputs","outputs","locktime"} },
-    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,  {"hexstring"} },
-    { "rawtransactions",    "decodescript",           &decodescript,           true,  {"hexstring"} },
-    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false, {"hexstring","allowhighfees"} },
-    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false, {"hexstring","prevtxs","privkeys","sighashtype"} }, /* uses wallet if enabled */
-
-    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,  {"txids", "blockhash"} },
-    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true,  {"proof"} },
+{ //  category              name                      actor (function)         okSafeMode argNames  parallelSafe
+  //  --------------------- ------------------------  -----------------------  ---------- --------  ------------
+    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,  {"txid","verbose"}, true },
+    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,  {"inputs","outputs","locktime"}, false },
+    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,  {"hexstring"}, true },
+    { "rawtransactions",    "decodescript",           &decodescript,           true,  {"hexstring"}, true },
+    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false, {"hexstring","allowhighfees"}, false },
+    { "rawtransactions",    "sendrawtransactions",    &sendrawtransactions,    false, {"hexstrings","allowhighfees"}, false },
+    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false, {"hexstring","prevtxs","privkeys","sighashtype"}, false }, /* uses wallet if enabled */
+
+    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,  {"txids", "blockhash"}, true },
+    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true,  {"proof"}, true },
 };
 
 void RegisterRawTransactionRPCCommands(CRPCTable &t)
@@ -12,6 +12,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "validationinterface.h"
 
 #include <univalue.h>
 
@@ -23,7 +24,10 @@
 #include <boost/thread.hpp>
 #include <boost/algorithm/string/case_conv.hpp> // for to_upper()
 
+#include <atomic>
+#include <condition_variable>
 #include <memory> // for unique_ptr
+#include <mutex>
 #include <unordered_map>
 
 using namespace RPCServer;
@@ -33,6 +37,8 @@ static bool fRPCRunning = false;
 static bool fRPCInWarmup = true;
 static std::string rpcWarmupStatus("RPC server started");
 static CCriticalSection cs_rpcWarmup;
+static CCriticalSection cs_rpcStats;
+static std::map<std::string, CRPCMethodStats> mapRPCStats;
 /* Timer-creating functions */
 static RPCTimerInterface* timerInterface = NULL;
 /* Map of name to timer. */
@@ -162,12 +168,11 @@ uint256 ParseHashO(const UniValue& o, string strKey)
 }
 vector<unsigned char> ParseHexV(const UniValue& v, string strName)
 {
-    string strHex;
-    if (v.isStr())
-        strHex = v.get_str();
-    if (!IsHex(strHex))
-        throw JSONRPCError(RPC_INVALID_PARAMETER, strName+" must be hexadecimal string (not '"+strHex+"')");
-    return ParseHex(strHex);
+    // Decoded straight from the parsed string, which may be large
+    vector<unsigned char> vch;
+    if (!v.isStr() || !DecodeHex(v.get_str(), vch))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strName+" must be hexadecimal string (not '"+(v.isStr() ? v.get_str() : "")+"')");
+    return vch;
 }
 vector<unsigned char> ParseHexO(const UniValue& o, string strKey)
 {
@@ -271,11 +276,11 @@ UniValue stop(const JSONRPCRequest& jsonRequest)
  * Call Table
  */
 static const CRPCCommand vRPCCommands[] =
-{ //  category              name                      actor (function)         okSafe argNames
-  //  --------------------- ------------------------  -----------------------  ------ ----------
+{ //  category              name                      actor (function)         okSafe argNames  parallelSafe
+  //  --------------------- ------------------------  -----------------------  ------ ----------  ------------
     /* Overall control/query calls */
-    { "control",            "help",                   &help,                   true,  {"command"}  },
-    { "control",            "stop",                   &stop,                   true,  {}  },
+    { "control",            "help",                   &help,                   true,  {"command"}, false  },
+    { "control",            "stop",                   &stop,                   true,  {}, false  },
 };
 
 CRPCTable::CRPCTable()
@@ -415,11 +420,77 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
-std::string JSONRPCExecBatch(const UniValue& vReq)
+/**
+ * A run of parallel safe batch requests. The thread executing the batch
+ * works through it itself, so the run completes even if none of the helpers
+ * it dispatched ever starts; helpers that start late find nothing left and
+ * return. Shared, as helpers may outlive JSONRPCExecBatch.
+ */
+struct RPCBatchRun
+{
+    std::vector<UniValue> vReq;
+    std::vector<UniValue> vReply;
+    std::atomic<size_t> nNext;
+    std::mutex cs;
+    std::condition_variable cond;
+    size_t nDone;
+
+    RPCBatchRun() : nNext(0), nDone(0) {}
+
+    void Work()
+    {
+        size_t n;
+        while ((n = nNext++) < vReq.size()) {
+            UniValue reply = JSONRPCExecOne(vReq[n]);
+            std::lock_guard<std::mutex> lock(cs);
+            vReply[n] = std::move(reply);
+            if (++nDone == vReq.size())
+                cond.notify_all();
+        }
+    }
+};
+
+static bool IsParallelSafe(const UniValue& req)
+{
+    if (!req.isObject())
+        return false;
+    const UniValue& valMethod = find_value(req, "method");
+    if (!valMethod.isStr())
+        return false;
+    const CRPCCommand* pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->parallelSafe;
+}
+
+std::string JSONRPCExecBatch(const UniValue& vReq, const RPCWorkDispatcher& dispatch, int nMaxWorkers)
 {
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        unsigned int reqEnd = reqIdx;
+        while (reqEnd < vReq.size() && IsParallelSafe(vReq[reqEnd]))
+            reqEnd++;
+        if (!dispatch || nMaxWorkers <= 0 || reqEnd - reqIdx < 2) {
+            ret.push_back(JSONRPCExecOne(vReq[reqIdx++]));
+            continue;
+        }
+
+        std::shared_ptr<RPCBatchRun> run = std::make_shared<RPCBatchRun>();
+        run->vReq.assign(vReq.getValues().begin() + reqIdx, vReq.getValues().begin() + reqEnd);
+        run->vReply.resize(run->vReq.size());
+        int nHelpers = std::min<int>(nMaxWorkers, run->vReq.size() - 1);
+        for (int i = 0; i < nHelpers; i++) {
+            if (!dispatch([run]() { run->Work(); }))
+                break;
+        }
+        run->Work();
+        {
+            std::unique_lock<std::mutex> lock(run->cs);
+            run->cond.wait(lock, [&run]() { return run->nDone == run->vReq.size(); });
+        }
+        for (UniValue& reply : run->vReply)
+            ret.push_back(reply);
+        reqIdx = reqEnd;
+    }
 
     return ret.write() + "\n";
 }
@@ -466,6 +537,48 @@ static inline JSONRPCRequest transformNamedArguments(const JSONRPCRequest& in, c
     return out;
 }
 
+void RecordRPCCall(const std::string& strMethod, int64_t nMicros, int64_t nLockWaitMicros, bool fError)
+{
+    size_t nBucket = 0;
+    while (nBucket < RPC_LATENCY_BUCKET_COUNT - 1 && nMicros > RPC_LATENCY_BUCKETS[nBucket])
+        nBucket++;
+
+    LOCK(cs_rpcStats);
+    CRPCMethodStats& stats = mapRPCStats[strMethod];
+    stats.nCalls++;
+    if (fError)
+        stats.nErrors++;
+    stats.nTotalMicros += nMicros;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+    stats.nLockWaitMicros += nLockWaitMicros;
+    stats.vBuckets[nBucket]++;
+}
+
+std::map<std::string, CRPCMethodStats> GetRPCStats()
+{
+    LOCK(cs_rpcStats);
+    return mapRPCStats;
+}
+
+/** Times an RPC call, including its waits for cs_main, and records it when it goes out of scope */
+class CRPCCallTimer
+{
+public:
+    bool fError;
+
+    CRPCCallTimer(const std::string& strMethodIn) : fError(true), strMethod(strMethodIn), nStart(GetTimeMicros()) {}
+
+    ~CRPCCallTimer()
+    {
+        RecordRPCCall(strMethod, GetTimeMicros() - nStart, lockWait.nWaitMicros, fError);
+    }
+
+private:
+    const std::string& strMethod;
+    int64_t nStart;
+    CLockWaitTimer lockWait;
+};
+
 UniValue CRPCTable::execute(const JSONRPCRequest &request) const
 {
     // Return immediately if in warmup
@@ -482,14 +595,22 @@ UniValue CRPCTable::execute(const JSONRPCRequest &request) const
 
     g_rpcSignals.PreCommand(*pcmd);
 
+    // Let wallet calls see every block and transaction validated before them
+    if (pcmd->category == "wallet")
+        SyncWithValidationInterfaceQueue();
+
+    CRPCCallTimer timer(request.strMethod);
     try
     {
         // Execute, convert arguments to array if necessary
+        UniValue result;
         if (request.params.isObject()) {
-            return pcmd->actor(transformNamedArguments(request, pcmd->argNames));
+            result = pcmd->actor(transformNamedArguments(request, pcmd->argNames));
         } else {
-            return pcmd->actor(request);
+            result = pcmd->actor(request);
         }
+        timer.fError = false;
+        return result;
     }
     catch (const std::exception& e)
     {
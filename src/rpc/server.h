@@ -142,6 +142,8 @@ public:
     rpcfn_type actor;
     bool okSafeMode;
     std::vector<std::string> argNames;
+    //! Read-only call that may run concurrently with the other calls of a batch
+    bool parallelSafe;
 };
 
 /**
@@ -203,10 +205,42 @@ extern void EnsureWalletIsUnlocked();
 bool StartRPC();
 void InterruptRPC();
 void StopRPC();
-std::string JSONRPCExecBatch(const UniValue& vReq);
+/** Queues a function to run on another thread, returning false if it could not be queued */
+typedef std::function<bool(const std::function<void()>&)> RPCWorkDispatcher;
+/**
+ * Execute a batch of requests, replying in request order. Runs of
+ * consecutive parallelSafe calls are shared with up to nMaxWorkers threads
+ * obtained through dispatch; other calls run alone, in order.
+ */
+std::string JSONRPCExecBatch(const UniValue& vReq, const RPCWorkDispatcher& dispatch = RPCWorkDispatcher(), int nMaxWorkers = 0);
 void RPCNotifyBlockChange(bool ibd, const CBlockIndex *);
 
 // Retrieves any serialization flags requested in command line argument
 int RPCSerializationFlags();
 
+/** Upper bounds of the RPC latency histogram buckets in microseconds. Slower calls go in one more bucket. */
+static const int64_t RPC_LATENCY_BUCKETS[] = {1000, 5000, 25000, 100000, 500000, 2500000, 10000000};
+static const size_t RPC_LATENCY_BUCKET_COUNT = sizeof(RPC_LATENCY_BUCKETS) / sizeof(RPC_LATENCY_BUCKETS[0]) + 1;
+
+/** Calls to one RPC method since startup */
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    //! Time spent blocked waiting for cs_main
+    int64_t nLockWaitMicros;
+    //! Calls per latency bucket, not cumulative
+    uint64_t vBuckets[RPC_LATENCY_BUCKET_COUNT];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0), nLockWaitMicros(0), vBuckets() {}
+};
+
+/** Record one call of strMethod, as CRPCTable::execute does for every call */
+void RecordRPCCall(const std::string& strMethod, int64_t nMicros, int64_t nLockWaitMicros, bool fError);
+
+/** The statistics of every method called since startup */
+std::map<std::string, CRPCMethodStats> GetRPCStats();
+
 #endif // BITCOIN_RPCSERVER_H
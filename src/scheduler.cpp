@@ -5,12 +5,15 @@
 #include "scheduler.h"
 
 #include "reverselock.h"
+#include "util.h"
+#include "utiltime.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <boost/bind.hpp>
 #include <utility>
 
-CScheduler::CScheduler() : nThreadsServicingQueue(0), stopRequested(false), stopWhenEmpty(false)
+CScheduler::CScheduler() : nThreadsServicingQueue(0), nThreadsRunningBackground(0), stopRequested(false), stopWhenEmpty(false)
 {
 }
 
@@ -27,6 +30,36 @@ static boost::system_time toPosixTime(const boost::chrono::system_clock::time_po
 }
 #endif
 
+bool CScheduler::empty() const
+{
+    for (int i = 0; i < NUM_PRIORITIES; i++)
+        if (!taskQueue[i].empty())
+            return false;
+    return true;
+}
+
+bool CScheduler::popTask(boost::chrono::system_clock::time_point now, Task& task, Priority& priority, boost::chrono::system_clock::time_point& due,
+                         boost::chrono::system_clock::time_point& tWake, bool& fWake)
+{
+    fWake = false;
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        if (taskQueue[i].empty() || (i != PRIORITY_HIGH && !canRunBackground()))
+            continue;
+        TaskQueue::iterator it = taskQueue[i].begin();
+        if (it->first <= now) {
+            priority = (Priority)i;
+            due = it->first;
+            task = it->second;
+            taskQueue[i].erase(it);
+            return true;
+        }
+        if (!fWake || it->first < tWake)
+            tWake = it->first;
+        fWake = true;
+    }
+    return false;
+}
+
 void CScheduler::serviceQueue()
 {
     boost::unique_lock<boost::mutex> lock(newTaskMutex);
@@ -36,51 +69,67 @@ void CScheduler::serviceQueue()
     // when the thread is waiting or when the user's function
     // is called.
     while (!shouldStop()) {
+        bool fBackground = false;
         try {
-            while (!shouldStop() && taskQueue.empty()) {
-                // Wait until there is something to do.
-                newTaskScheduled.wait(lock);
-            }
-
-            // Wait until either there is a new task, or until
-            // the time of the first item on the queue:
-
+            // Wait until a task this thread may run is due. With several
+            // threads, another one may take the task we were waiting on.
+            Task task;
+            Priority priority;
+            boost::chrono::system_clock::time_point due, tWake;
+            bool fWake;
+            if (!popTask(boost::chrono::system_clock::now(), task, priority, due, tWake, fWake)) {
+                if (!fWake) {
+                    newTaskScheduled.wait(lock);
+                } else {
 // wait_until needs boost 1.50 or later; older versions have timed_wait:
 #if BOOST_VERSION < 105000
-            while (!shouldStop() && !taskQueue.empty() &&
-                   newTaskScheduled.timed_wait(lock, toPosixTime(taskQueue.begin()->first))) {
-                // Keep waiting until timeout
-            }
+                    newTaskScheduled.timed_wait(lock, toPosixTime(tWake));
 #else
-            // Some boost versions have a conflicting overload of wait_until that returns void.
-            // Explicitly use a template here to avoid hitting that overload.
-            while (!shouldStop() && !taskQueue.empty()) {
-                boost::chrono::system_clock::time_point timeToWaitFor = taskQueue.begin()->first;
-                if (newTaskScheduled.wait_until<>(lock, timeToWaitFor) == boost::cv_status::timeout)
-                    break; // Exit loop after timeout, it means we reached the time of the event
-            }
+                    // Some boost versions have a conflicting overload of wait_until that returns void.
+                    // Explicitly use a template here to avoid hitting that overload.
+                    newTaskScheduled.wait_until<>(lock, tWake);
 #endif
-            // If there are multiple threads, the queue can empty while we're waiting (another
-            // thread may service the task we were waiting on).
-            if (shouldStop() || taskQueue.empty())
+                }
                 continue;
+            }
 
-            Function f = taskQueue.begin()->second;
-            taskQueue.erase(taskQueue.begin());
-
+            fBackground = priority != PRIORITY_HIGH;
+            if (fBackground)
+                nThreadsRunningBackground++;
+            int64_t nStart = GetTimeMicros();
+            int64_t nDelay = boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::system_clock::now() - due).count();
             {
                 // Unlock before calling f, so it can reschedule itself or another task
                 // without deadlocking:
                 reverse_lock<boost::unique_lock<boost::mutex> > rlock(lock);
-                f();
+                task.f();
+            }
+            int64_t nTime = GetTimeMicros() - nStart;
+
+            const std::string& strName = task.strName.empty() ? std::string("unnamed") : task.strName;
+            CSchedulerTaskStats& stats = mapTaskStats[strName];
+            stats.nRuns++;
+            stats.nTotalMicros += nTime;
+            stats.nMaxMicros = std::max(stats.nMaxMicros, nTime);
+            stats.nTotalDelayMicros += std::max<int64_t>(0, nDelay);
+            if (!task.strName.empty())
+                LogPrint("bench", "- Scheduler task %s: %.2fms, started %.2fms late [%.2fs over %u runs]\n", strName,
+                    nTime * 0.001, std::max<int64_t>(0, nDelay) * 0.001, stats.nTotalMicros * 0.000001, stats.nRuns);
+
+            if (fBackground) {
+                nThreadsRunningBackground--;
+                // A thread held back for PRIORITY_HIGH may take background work now
+                newTaskScheduled.notify_all();
             }
         } catch (...) {
+            if (fBackground)
+                --nThreadsRunningBackground;
             --nThreadsServicingQueue;
             throw;
         }
     }
     --nThreadsServicingQueue;
-    newTaskScheduled.notify_one();
+    newTaskScheduled.notify_all();
 }
 
 void CScheduler::stop(bool drain)
@@ -95,39 +144,131 @@ void CScheduler::stop(bool drain)
     newTaskScheduled.notify_all();
 }
 
-void CScheduler::schedule(CScheduler::Function f, boost::chrono::system_clock::time_point t)
+void CScheduler::schedule(CScheduler::Function f, boost::chrono::system_clock::time_point t, Priority priority, const std::string& strName)
 {
+    assert(priority >= 0 && priority < NUM_PRIORITIES);
     {
         boost::unique_lock<boost::mutex> lock(newTaskMutex);
-        taskQueue.insert(std::make_pair(t, f));
+        Task task;
+        task.f = f;
+        task.strName = strName;
+        taskQueue[priority].insert(std::make_pair(t, task));
     }
-    newTaskScheduled.notify_one();
+    // Wake every idle thread: the one woken by notify_one may be held back
+    // from a background task another could run
+    newTaskScheduled.notify_all();
 }
 
-void CScheduler::scheduleFromNow(CScheduler::Function f, int64_t deltaSeconds)
+void CScheduler::scheduleFromNow(CScheduler::Function f, int64_t deltaSeconds, Priority priority, const std::string& strName)
 {
-    schedule(f, boost::chrono::system_clock::now() + boost::chrono::seconds(deltaSeconds));
+    schedule(f, boost::chrono::system_clock::now() + boost::chrono::seconds(deltaSeconds), priority, strName);
 }
 
-static void Repeat(CScheduler* s, CScheduler::Function f, int64_t deltaSeconds)
+static void Repeat(CScheduler* s, CScheduler::Function f, int64_t deltaSeconds, CScheduler::Priority priority, const std::string& strName)
 {
     f();
-    s->scheduleFromNow(boost::bind(&Repeat, s, f, deltaSeconds), deltaSeconds);
+    s->scheduleFromNow(boost::bind(&Repeat, s, f, deltaSeconds, priority, strName), deltaSeconds, priority, strName);
 }
 
-void CScheduler::scheduleEvery(CScheduler::Function f, int64_t deltaSeconds)
+void CScheduler::scheduleEvery(CScheduler::Function f, int64_t deltaSeconds, Priority priority, const std::string& strName)
 {
-    scheduleFromNow(boost::bind(&Repeat, this, f, deltaSeconds), deltaSeconds);
+    scheduleFromNow(boost::bind(&Repeat, this, f, deltaSeconds, priority, strName), deltaSeconds, priority, strName);
 }
 
 size_t CScheduler::getQueueInfo(boost::chrono::system_clock::time_point &first,
                              boost::chrono::system_clock::time_point &last) const
 {
     boost::unique_lock<boost::mutex> lock(newTaskMutex);
-    size_t result = taskQueue.size();
-    if (!taskQueue.empty()) {
-        first = taskQueue.begin()->first;
-        last = taskQueue.rbegin()->first;
+    size_t result = 0;
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        if (taskQueue[i].empty())
+            continue;
+        if (result == 0 || taskQueue[i].begin()->first < first)
+            first = taskQueue[i].begin()->first;
+        if (result == 0 || taskQueue[i].rbegin()->first > last)
+            last = taskQueue[i].rbegin()->first;
+        result += taskQueue[i].size();
     }
     return result;
 }
+
+bool CScheduler::AreThreadsServicingQueue() const
+{
+    boost::unique_lock<boost::mutex> lock(newTaskMutex);
+    return nThreadsServicingQueue > 0;
+}
+
+std::map<std::string, CSchedulerTaskStats> CScheduler::getTaskStats() const
+{
+    boost::unique_lock<boost::mutex> lock(newTaskMutex);
+    return mapTaskStats;
+}
+
+
+void CSerialSchedulerClient::MaybeScheduleProcessQueue()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // Scheduling ProcessQueue twice is harmless, the second copy finds
+        // the queue busy or empty and returns
+        if (fCallbacksRunning || callbacksPending.empty())
+            return;
+    }
+    pscheduler->schedule(boost::bind(&CSerialSchedulerClient::ProcessQueue, this), boost::chrono::system_clock::now(), CScheduler::PRIORITY_HIGH);
+}
+
+void CSerialSchedulerClient::ProcessQueue()
+{
+    CScheduler::Function callback;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fCallbacksRunning || callbacksPending.empty())
+            return;
+        fCallbacksRunning = true;
+        callback = callbacksPending.front();
+        callbacksPending.pop_front();
+    }
+
+    // Hand the next function to the scheduler even if this one throws
+    struct RAIICallbacksRunning {
+        CSerialSchedulerClient* instance;
+        explicit RAIICallbacksRunning(CSerialSchedulerClient* instanceIn) : instance(instanceIn) {}
+        ~RAIICallbacksRunning()
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(instance->mutex);
+                instance->fCallbacksRunning = false;
+            }
+            instance->MaybeScheduleProcessQueue();
+        }
+    } raiicallbacksrunning(this);
+
+    callback();
+}
+
+void CSerialSchedulerClient::AddToProcessQueue(CScheduler::Function func)
+{
+    assert(pscheduler);
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        callbacksPending.push_back(func);
+    }
+    MaybeScheduleProcessQueue();
+}
+
+void CSerialSchedulerClient::EmptyQueue()
+{
+    assert(!pscheduler->AreThreadsServicingQueue());
+    bool fMore = true;
+    while (fMore) {
+        ProcessQueue();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fMore = !callbacksPending.empty();
+    }
+}
+
+size_t CSerialSchedulerClient::CallbacksPending()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return callbacksPending.size();
+}
@@ -13,7 +13,13 @@
 #include <boost/function.hpp>
 #include <boost/chrono/chrono.hpp>
 #include <boost/thread.hpp>
+#include <list>
 #include <map>
+#include <string>
+
+//! Threads servicing the node's scheduler
+static const int DEFAULT_SCHEDULER_THREADS = 2;
+static const int MAX_SCHEDULER_THREADS = 16;
 
 //
 // Simple class for background tasks that should be run
@@ -26,6 +32,11 @@
 // s->scheduleFromNow(boost::bind(Class::func, this, argument), 3);
 // boost::thread* t = new boost::thread(boost::bind(CScheduler::serviceQueue, s));
 //
+// Several threads may run serviceQueue. Due tasks run in priority order, and
+// while more than one thread services the queue, one is always kept free of
+// PRIORITY_NORMAL and PRIORITY_LOW tasks, so that PRIORITY_HIGH tasks never
+// wait behind a slow periodic job.
+//
 // ... then at program shutdown, clean up the thread running serviceQueue:
 // t->interrupt();
 // t->join();
@@ -33,6 +44,18 @@
 // delete s; // Must be done after thread is interrupted/joined.
 //
 
+/** Time spent running the tasks of one name */
+struct CSchedulerTaskStats
+{
+    uint64_t nRuns;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    //! Time tasks became due before a thread started them
+    int64_t nTotalDelayMicros;
+
+    CSchedulerTaskStats() : nRuns(0), nTotalMicros(0), nMaxMicros(0), nTotalDelayMicros(0) {}
+};
+
 class CScheduler
 {
 public:
@@ -41,18 +64,26 @@ public:
 
     typedef boost::function<void(void)> Function;
 
-    // Call func at/after time t
-    void schedule(Function f, boost::chrono::system_clock::time_point t);
+    enum Priority {
+        PRIORITY_HIGH,   //!< Latency sensitive, e.g. validation callbacks
+        PRIORITY_NORMAL,
+        PRIORITY_LOW,    //!< Periodic flushes and dumps
+        NUM_PRIORITIES
+    };
+
+    // Call func at/after time t. Tasks are timed under strName, or
+    // "unnamed" if it is empty.
+    void schedule(Function f, boost::chrono::system_clock::time_point t, Priority priority = PRIORITY_NORMAL, const std::string& strName = "");
 
     // Convenience method: call f once deltaSeconds from now
-    void scheduleFromNow(Function f, int64_t deltaSeconds);
+    void scheduleFromNow(Function f, int64_t deltaSeconds, Priority priority = PRIORITY_NORMAL, const std::string& strName = "");
 
     // Another convenience method: call f approximately
     // every deltaSeconds forever, starting deltaSeconds from now.
     // To be more precise: every time f is finished, it
     // is rescheduled to run deltaSeconds later. If you
     // need more accurate scheduling, don't use this method.
-    void scheduleEvery(Function f, int64_t deltaSeconds);
+    void scheduleEvery(Function f, int64_t deltaSeconds, Priority priority = PRIORITY_NORMAL, const std::string& strName = "");
 
     // To keep things as simple as possible, there is no unschedule.
 
@@ -70,14 +101,66 @@ public:
     size_t getQueueInfo(boost::chrono::system_clock::time_point &first,
                         boost::chrono::system_clock::time_point &last) const;
 
+    // Returns true if any thread is currently running serviceQueue
+    bool AreThreadsServicingQueue() const;
+
+    // Timing of the tasks run so far, by name
+    std::map<std::string, CSchedulerTaskStats> getTaskStats() const;
+
 private:
-    std::multimap<boost::chrono::system_clock::time_point, Function> taskQueue;
+    struct Task {
+        Function f;
+        std::string strName;
+    };
+    typedef std::multimap<boost::chrono::system_clock::time_point, Task> TaskQueue;
+
+    TaskQueue taskQueue[NUM_PRIORITIES];
+    std::map<std::string, CSchedulerTaskStats> mapTaskStats;
     boost::condition_variable newTaskScheduled;
     mutable boost::mutex newTaskMutex;
     int nThreadsServicingQueue;
+    //! Threads running a task below PRIORITY_HIGH
+    int nThreadsRunningBackground;
     bool stopRequested;
     bool stopWhenEmpty;
-    bool shouldStop() { return stopRequested || (stopWhenEmpty && taskQueue.empty()); }
+    bool empty() const;
+    bool shouldStop() { return stopRequested || (stopWhenEmpty && empty()); }
+    bool canRunBackground() const { return nThreadsServicingQueue <= 1 || nThreadsRunningBackground + 1 < nThreadsServicingQueue; }
+    // Take the most urgent due task this thread may run, or set tWake to
+    // when one becomes due (fWake false if none will by itself)
+    bool popTask(boost::chrono::system_clock::time_point now, Task& task, Priority& priority, boost::chrono::system_clock::time_point& due,
+                 boost::chrono::system_clock::time_point& tWake, bool& fWake);
+};
+
+/**
+ * A queue of functions run one at a time, in the order they were added, by
+ * the threads servicing a CScheduler. Only one of them is ever handed to the
+ * scheduler at a time, so the order holds however many threads service it.
+ */
+class CSerialSchedulerClient
+{
+public:
+    explicit CSerialSchedulerClient(CScheduler* pschedulerIn) : pscheduler(pschedulerIn), fCallbacksRunning(false) {}
+
+    // Run func after everything added before it
+    void AddToProcessQueue(CScheduler::Function func);
+
+    // Run everything still queued on the calling thread. Only for when no
+    // thread services the scheduler any more, e.g. at shutdown.
+    void EmptyQueue();
+
+    size_t CallbacksPending();
+
+    bool IsServiced() const { return pscheduler->AreThreadsServicingQueue(); }
+
+private:
+    CScheduler* pscheduler;
+    boost::mutex mutex;
+    std::list<CScheduler::Function> callbacksPending;
+    bool fCallbacksRunning;
+
+    void MaybeScheduleProcessQueue();
+    void ProcessQueue();
 };
 
 #endif
@@ -11,6 +11,7 @@
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 #include "version.h"
 
@@ -1171,6 +1172,9 @@ uint256 GetOutputsHash(const CTransaction& txTo) {
     return ss.GetHash();
 }
 
+/** Serialized size of an input with its script blanked: prevout, empty script, nSequence */
+const size_t LEGACY_BLANK_INPUT_SIZE = 32 + 4 + 1 + 4;
+
 } // anon namespace
 
 PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
@@ -1178,6 +1182,23 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
     hashPrevouts = GetPrevoutHash(txTo);
     hashSequence = GetSequenceHash(txTo);
     hashOutputs = GetOutputsHash(txTo);
+
+    // With a single input there is nothing to share between signature hashes
+    if (txTo.vin.size() > 1) {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << txTo.nVersion << txTo.nTime;
+        WriteCompactSize(ss, txTo.vin.size());
+        vLegacyPrefix.reserve(txTo.vin.size());
+        vchLegacySuffix.reserve(txTo.vin.size() * LEGACY_BLANK_INPUT_SIZE);
+        CVectorWriter suffix(SER_GETHASH, 0, vchLegacySuffix, 0);
+        for (const CTxIn& txin : txTo.vin) {
+            vLegacyPrefix.push_back(ss);
+            size_t nPos = vchLegacySuffix.size();
+            suffix << txin.prevout << CScriptBase() << txin.nSequence;
+            ss.write((const char*)&vchLegacySuffix[nPos], LEGACY_BLANK_INPUT_SIZE);
+        }
+        suffix << txTo.vout << txTo.nLockTime;
+    }
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1246,6 +1267,19 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // Resume from the precomputed state when all inputs and outputs are signed
+    if (cache && nIn < cache->vLegacyPrefix.size() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        CHashWriter ss(cache->vLegacyPrefix[nIn]);
+        ss << txTo.vin[nIn].prevout;
+        txTmp.SerializeScriptCode(ss);
+        ss << txTo.vin[nIn].nSequence;
+        size_t nSkip = LEGACY_BLANK_INPUT_SIZE * (nIn + 1);
+        ss.write((const char*)&cache->vchLegacySuffix[nSkip], cache->vchLegacySuffix.size() - nSkip);
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1413,7 +1447,141 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
     return true;
 }
 
+namespace {
+
+/**
+ * Verdict of the standard template fast path. UNDECIDED leaves the script
+ * to the interpreter, which then reports whatever error it finds.
+ */
+enum class TemplateResult { UNDECIDED, VALID, INVALID };
+
+/**
+ * The stack a scriptSig of data pushes leaves, as EvalScript would build
+ * it. False for anything else, small-number opcodes included, and for
+ * pushes EvalScript would reject.
+ */
+bool GetScriptPushes(const CScript& script, unsigned int flags, std::vector<valtype>& vPushes)
+{
+    if (script.size() > MAX_SCRIPT_SIZE)
+        return false;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    valtype vch;
+    while (pc < script.end()) {
+        if (!script.GetOp(pc, opcode, vch) || opcode > OP_PUSHDATA4 || vch.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        if ((flags & SCRIPT_VERIFY_MINIMALDATA) != 0 && !CheckMinimalPush(vch, opcode))
+            return false;
+        // EvalScript's stack size limit
+        if (vPushes.size() >= 1000)
+            return false;
+        vPushes.push_back(std::move(vch));
+    }
+    return true;
+}
+
+/** <pubkey> OP_CHECKSIG, with a compressed or uncompressed pubkey */
+bool MatchPayToPubKey(const CScript& script)
+{
+    return ((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65)) && script.back() == OP_CHECKSIG;
+}
+
+/**
+ * The single CHECKSIG of a pay-to-pubkey or pay-to-pubkey-hash script as
+ * EvalScript runs it, scriptCode being the whole script. A signature that
+ * does not verify leaves false on the stack, which fails the script.
+ */
+TemplateResult CheckTemplateSig(const valtype& vchSig, const valtype& vchPubKey, const CScript& scriptCode, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+{
+    if (vchSig.empty() || !CheckSignatureEncoding(vchSig, flags, NULL) || !CheckPubKeyEncoding(vchPubKey, flags, SIGVERSION_BASE, NULL))
+        return TemplateResult::UNDECIDED;
+    CScript scriptCodeNoSig(scriptCode);
+    scriptCodeNoSig.FindAndDelete(CScript(vchSig));
+    if (checker.CheckSig(vchSig, vchPubKey, scriptCodeNoSig, SIGVERSION_BASE))
+        return TemplateResult::VALID;
+    set_error(serror, (flags & SCRIPT_VERIFY_NULLFAIL) != 0 ? SCRIPT_ERR_SIG_NULLFAIL : SCRIPT_ERR_EVAL_FALSE);
+    return TemplateResult::INVALID;
+}
+
+/** Run script on the pushes of its spend if it is pay-to-pubkey or pay-to-pubkey-hash */
+TemplateResult VerifyPubKeyTemplate(const std::vector<valtype>& vPushes, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+{
+    if (MatchPayToPubKey(script)) {
+        if (vPushes.size() != 1)
+            return TemplateResult::UNDECIDED;
+        return CheckTemplateSig(vPushes[0], valtype(script.begin() + 1, script.end() - 1), script, flags, checker, serror);
+    }
+    if (script.IsPayToPublicKeyHash()) {
+        if (vPushes.size() != 2)
+            return TemplateResult::UNDECIDED;
+        uint160 hash;
+        CHash160().Write(vPushes[1].data(), vPushes[1].size()).Finalize(hash.begin());
+        if (memcmp(hash.begin(), &script[3], 20) != 0)
+            return TemplateResult::UNDECIDED;
+        return CheckTemplateSig(vPushes[0], vPushes[1], script, flags, checker, serror);
+    }
+    return TemplateResult::UNDECIDED;
+}
+
+/**
+ * VerifyScript for the standard spends, most of all the pay-to-pubkey
+ * outputs of coinstakes and pay-to-pubkey-hash: the pushes of the
+ * scriptSig are matched with the template and the signature checked
+ * directly, without the opcode loop. For pay-to-script-hash the redeem
+ * script is matched the same way, or else run by EvalScript on the
+ * remaining pushes. Anything unusual is left UNDECIDED, and so is every
+ * failure other than a signature that does not verify.
+ */
+TemplateResult VerifyStandardTemplate(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness& witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+{
+    std::vector<valtype> vPushes;
+    if (!witness.IsNull() || !GetScriptPushes(scriptSig, flags, vPushes))
+        return TemplateResult::UNDECIDED;
+    if (!(flags & SCRIPT_VERIFY_P2SH) || !scriptPubKey.IsPayToScriptHash())
+        return VerifyPubKeyTemplate(vPushes, scriptPubKey, flags, checker, serror);
+
+    if (vPushes.empty())
+        return TemplateResult::UNDECIDED;
+    uint160 hash;
+    CHash160().Write(vPushes.back().data(), vPushes.back().size()).Finalize(hash.begin());
+    if (memcmp(hash.begin(), &scriptPubKey[2], 20) != 0)
+        return TemplateResult::UNDECIDED;
+    const CScript redeemScript(vPushes.back().begin(), vPushes.back().end());
+    vPushes.pop_back();
+    int witnessversion;
+    valtype witnessprogram;
+    if ((flags & SCRIPT_VERIFY_WITNESS) != 0 && redeemScript.IsWitnessProgram(witnessversion, witnessprogram))
+        return TemplateResult::UNDECIDED;
+
+    TemplateResult result = VerifyPubKeyTemplate(vPushes, redeemScript, flags, checker, serror);
+    if (result != TemplateResult::UNDECIDED)
+        return result;
+    if (!EvalScript(vPushes, redeemScript, flags, checker, SIGVERSION_BASE, NULL) || vPushes.empty() || !CastToBool(vPushes.back()) ||
+        ((flags & SCRIPT_VERIFY_CLEANSTACK) != 0 && vPushes.size() != 1))
+        return TemplateResult::UNDECIDED;
+    return TemplateResult::VALID;
+}
+
+} // anon namespace
+
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
+{
+    static const CScriptWitness emptyWitness;
+    set_error(serror, SCRIPT_ERR_UNKNOWN_ERROR);
+
+    switch (VerifyStandardTemplate(scriptSig, scriptPubKey, witness ? *witness : emptyWitness, flags, checker, serror)) {
+    case TemplateResult::VALID:
+        return set_success(serror);
+    case TemplateResult::INVALID:
+        // serror is set
+        return false;
+    case TemplateResult::UNDECIDED:
+        break;
+    }
+    return VerifyScriptGeneric(scriptSig, scriptPubKey, witness, flags, checker, serror);
+}
+
+bool VerifyScriptGeneric(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
 {
     static const CScriptWitness emptyWitness;
     if (witness == NULL) {
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -114,6 +115,13 @@ struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
 
+    //! Legacy signature hashes of hash types that sign all inputs and outputs differ only in
+    //! the script of the input being signed. For transactions with several inputs,
+    //! vLegacyPrefix[i] has hashed everything before input i, with the other scripts blanked,
+    //! and vchLegacySuffix holds every blanked input followed by the outputs and nLockTime.
+    std::vector<CHashWriter> vLegacyPrefix;
+    std::vector<unsigned char> vchLegacySuffix;
+
     PrecomputedTransactionData(const CTransaction& tx);
 };
 
@@ -176,6 +184,8 @@ public:
 
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* error = NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror = NULL);
+/** VerifyScript without its fast path for the standard templates, always running the scripts through EvalScript */
+bool VerifyScriptGeneric(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror = NULL);
 
 size_t CountWitnessSigOps(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags);
 
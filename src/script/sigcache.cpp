@@ -5,38 +5,20 @@
 
 #include "sigcache.h"
 
+#include "clientversion.h"
 #include "memusage.h"
 #include "pubkey.h"
 #include "random.h"
+#include "streams.h"
 #include "uint256.h"
 #include "util.h"
+#include "utiltime.h"
 
 #include "cuckoocache.h"
 #include <boost/thread.hpp>
 
 namespace {
 
-/**
- * We're hashing a nonce into the entries themselves, so we don't need extra
- * blinding in the set hash computation.
- *
- * This may exhibit platform endian dependent behavior but because these are
- * nonced hashes (random) and this state is only ever used locally it is safe.
- * All that matters is local consistency.
- */
-class SignatureCacheHasher
-{
-public:
-    template <uint8_t hash_select>
-    uint32_t operator()(const uint256& key) const
-    {
-        static_assert(hash_select <8, "SignatureCacheHasher only has 8 hashes available.");
-        uint32_t u;
-        std::memcpy(&u, key.begin()+4*hash_select, 4);
-        return u;
-    }
-};
-
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
@@ -79,6 +61,27 @@ public:
     {
         return setValid.setup_bytes(n);
     }
+
+    size_t memory_usage() const
+    {
+        return setValid.memory_usage();
+    }
+
+    //! Entries are only meaningful with the nonce they were computed with
+    uint256 GetEntries(std::vector<uint256>& vEntries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        setValid.for_each([&vEntries](const uint256& entry) { vEntries.push_back(entry); });
+        return nonce;
+    }
+
+    void SetEntries(const uint256& nonceIn, std::vector<uint256>& vEntries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        nonce = nonceIn;
+        for (uint256& entry : vEntries)
+            setValid.insert(entry);
+    }
 };
 
 /* In previous versions of this code, signatureCache was a local static variable
@@ -95,12 +98,73 @@ void InitSignatureCache()
 {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
     // setup_bytes creates the minimum possible cache (2 elements).
-    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    // The other half of -maxsigcachesize goes to the script execution cache.
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
     size_t nElems = signatureCache.setup_bytes(nMaxCacheSize);
     LogPrintf("Using %zu MiB out of %zu requested for signature cache, able to store %zu elements\n",
             (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
 }
 
+size_t GetSignatureCacheMemoryUsage()
+{
+    return signatureCache.memory_usage();
+}
+
+static const uint64_t SIGCACHE_DUMP_VERSION = 1;
+
+bool LoadSignatureCache()
+{
+    FILE* filestr = fopen((GetDataDir() / "sigcache.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return false;
+
+    uint256 nonce;
+    std::vector<uint256> vEntries;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != SIGCACHE_DUMP_VERSION)
+            return false;
+        file >> nonce;
+        file >> vEntries;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize signature cache on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    // Entries only say that a signature is valid for a hash and key, which
+    // never changes, so they stay good however old the file is
+    signatureCache.SetEntries(nonce, vEntries);
+    LogPrintf("Imported %u signature cache entries from disk\n", vEntries.size());
+    return true;
+}
+
+void DumpSignatureCache()
+{
+    int64_t start = GetTimeMicros();
+
+    std::vector<uint256> vEntries;
+    uint256 nonce = signatureCache.GetEntries(vEntries);
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "sigcache.dat.new").string().c_str(), "wb");
+        if (!filestr)
+            return;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file << SIGCACHE_DUMP_VERSION;
+        file << nonce;
+        file << vEntries;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "sigcache.dat.new", GetDataDir() / "sigcache.dat");
+        LogPrintf("Dumped %u signature cache entries: %gs\n", vEntries.size(), (GetTimeMicros() - start) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump signature cache: %s. Continuing anyway.\n", e.what());
+    }
+}
+
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
     uint256 entry;
@@ -7,11 +7,14 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
+#include <cstring>
 #include <vector>
 
 // DoS prevention: limit cache size to 32MB (over 1000000 entries on 64-bit
-// systems). Due to how we count cache size, actual memory usage is slightly
+// systems), split between the signature cache and the script execution
+// cache. Due to how we count cache size, actual memory usage is slightly
 // more (~32.25 MB)
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
 // Maximum sig cache size allowed
@@ -19,6 +22,27 @@ static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
 
 class CPubKey;
 
+/**
+ * We're hashing a nonce into the entries themselves, so we don't need extra
+ * blinding in the set hash computation.
+ *
+ * This may exhibit platform endian dependent behavior but because these are
+ * nonced hashes (random) and this state is only ever used locally it is safe.
+ * All that matters is local consistency.
+ */
+class SignatureCacheHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select <8, "SignatureCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        std::memcpy(&u, key.begin()+4*hash_select, 4);
+        return u;
+    }
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -31,5 +55,11 @@ public:
 };
 
 void InitSignatureCache();
+/** Memory taken by the signature cache, which is allocated whole at startup */
+size_t GetSignatureCacheMemoryUsage();
+/** Load the signature cache saved at the last shutdown, if any */
+bool LoadSignatureCache();
+/** Save the valid signature cache, so blocks connected after a restart need not verify the signatures again */
+void DumpSignatureCache();
 
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -11,6 +11,7 @@
 #include "primitives/transaction.h"
 #include "script/standard.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <boost/foreach.hpp>
 
@@ -18,7 +19,8 @@ using namespace std;
 
 typedef std::vector<unsigned char> valtype;
 
-TransactionSignatureCreator::TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, int nHashTypeIn) : BaseSignatureCreator(keystoreIn), txTo(txToIn), nIn(nInIn), nHashType(nHashTypeIn), amount(amountIn), checker(txTo, nIn, amountIn) {}
+TransactionSignatureCreator::TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, int nHashTypeIn, const PrecomputedTransactionData* txdataIn) : BaseSignatureCreator(keystoreIn), txTo(txToIn), nIn(nInIn), nHashType(nHashTypeIn), amount(amountIn),
+    checker(txdataIn ? TransactionSignatureChecker(txTo, nIn, amountIn, *txdataIn) : TransactionSignatureChecker(txTo, nIn, amountIn)), txdata(txdataIn) {}
 
 bool TransactionSignatureCreator::CreateSig(std::vector<unsigned char>& vchSig, const CKeyID& address, const CScript& scriptCode, SigVersion sigversion) const
 {
@@ -30,7 +32,7 @@ bool TransactionSignatureCreator::CreateSig(std::vector<unsigned char>& vchSig,
     if (sigversion == SIGVERSION_WITNESS_V0 && !key.IsCompressed())
         return false;
 
-    uint256 hash = SignatureHash(scriptCode, *txTo, nIn, nHashType, amount, sigversion);
+    uint256 hash = SignatureHash(scriptCode, *txTo, nIn, nHashType, amount, sigversion, txdata);
     if (!key.Sign(hash, vchSig))
         return false;
     vchSig.push_back((unsigned char)nHashType);
@@ -205,6 +207,27 @@ void UpdateTransaction(CMutableTransaction& tx, unsigned int nIn, const Signatur
     tx.vin[nIn].scriptWitness = data.scriptWitness;
 }
 
+bool ProduceSignatures(const CKeyStore& keystore, CMutableTransaction& tx, const std::vector<CTxOut>& vPrevOuts, int nHashType)
+{
+    assert(vPrevOuts.size() == tx.vin.size());
+    // Signatures leave what the signature hashes cover unchanged, so every
+    // input is signed against the unsigned transaction
+    const CTransaction txConst(tx);
+    const PrecomputedTransactionData txdata(txConst);
+    std::vector<SignatureData> vSigData(tx.vin.size());
+    std::vector<char> vSigned(tx.vin.size());
+    ParallelFor(tx.vin.size(), tx.vin.size() >= PARALLEL_SIGNING_MIN_INPUTS ? GetNumCores() : 1, [&](size_t i) {
+        TransactionSignatureCreator creator(&keystore, &txConst, i, vPrevOuts[i].nValue, nHashType, &txdata);
+        vSigned[i] = ProduceSignature(creator, vPrevOuts[i].scriptPubKey, vSigData[i]);
+    });
+    bool fSigned = true;
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        UpdateTransaction(tx, i, vSigData[i]);
+        fSigned &= (bool)vSigned[i];
+    }
+    return fSigned;
+}
+
 bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, const CAmount& amount, int nHashType)
 {
     assert(nIn < txTo.vin.size());
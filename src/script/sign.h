@@ -12,6 +12,7 @@ class CKeyID;
 class CKeyStore;
 class CScript;
 class CTransaction;
+class CTxOut;
 
 struct CMutableTransaction;
 
@@ -37,9 +38,11 @@ class TransactionSignatureCreator : public BaseSignatureCreator {
     int nHashType;
     CAmount amount;
     const TransactionSignatureChecker checker;
+    const PrecomputedTransactionData* txdata;
 
 public:
-    TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, int nHashTypeIn=SIGHASH_ALL);
+    /** txdataIn, if given, is shared by the creators for the inputs of txToIn */
+    TransactionSignatureCreator(const CKeyStore* keystoreIn, const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, int nHashTypeIn=SIGHASH_ALL, const PrecomputedTransactionData* txdataIn=NULL);
     const BaseSignatureChecker& Checker() const { return checker; }
     bool CreateSig(std::vector<unsigned char>& vchSig, const CKeyID& keyid, const CScript& scriptCode, SigVersion sigversion) const;
 };
@@ -70,6 +73,17 @@ struct SignatureData {
 /** Produce a script signature using a generic signature creator. */
 bool ProduceSignature(const BaseSignatureCreator& creator, const CScript& scriptPubKey, SignatureData& sigdata);
 
+/** Number of inputs from which ProduceSignatures signs on several threads */
+static const size_t PARALLEL_SIGNING_MIN_INPUTS = 16;
+
+/**
+ * Sign every input of tx, input i spending vPrevOuts[i], with nHashType. The
+ * inputs are signed in parallel (from PARALLEL_SIGNING_MIN_INPUTS on) sharing
+ * one PrecomputedTransactionData; the result does not depend on the number of
+ * threads. Returns whether all inputs could be signed.
+ */
+bool ProduceSignatures(const CKeyStore& keystore, CMutableTransaction& tx, const std::vector<CTxOut>& vPrevOuts, int nHashType = SIGHASH_ALL);
+
 /** Produce a script signature for a transaction. */
 bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, const CAmount& amount, int nHashType);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType);
@@ -526,6 +526,8 @@ template<typename Stream, typename K, typename Pred, typename A> void Unserializ
  */
 template<typename Stream, typename T> void Serialize(Stream& os, const std::shared_ptr<const T>& p);
 template<typename Stream, typename T> void Unserialize(Stream& os, std::shared_ptr<const T>& p);
+template<typename Stream> class ArenaStream;
+template<typename Stream, typename T> void Unserialize(ArenaStream<Stream>& is, std::shared_ptr<const T>& p);
 
 /**
  * unique_ptr
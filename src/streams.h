@@ -6,6 +6,7 @@
 #ifndef BITCOIN_STREAMS_H
 #define BITCOIN_STREAMS_H
 
+#include "support/allocators/arena.h"
 #include "support/allocators/zeroafterfree.h"
 #include "serialize.h"
 
@@ -14,6 +15,7 @@
 #include <ios>
 #include <limits>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <stdio.h>
@@ -69,6 +71,51 @@ OverrideStream<S> WithOrVersion(S* s, int nVersionFlag)
     return OverrideStream<S>(s, s->GetType(), s->GetVersion() | nVersionFlag);
 }
 
+/**
+ * Reads from another stream, creating the shared objects it deserializes
+ * (a block's transactions) in one CMonotonicArena instead of one heap
+ * allocation each. The arena is freed once the last of them is released.
+ */
+template<typename Stream>
+class ArenaStream
+{
+    Stream* stream;
+    std::shared_ptr<CMonotonicArena> arena;
+
+public:
+    explicit ArenaStream(Stream* stream_) : stream(stream_), arena(std::make_shared<CMonotonicArena>()) {}
+
+    template<typename T>
+    ArenaStream<Stream>& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+
+    void read(char* pch, size_t nSize)
+    {
+        stream->read(pch, nSize);
+    }
+
+    int GetVersion() const { return stream->GetVersion(); }
+    int GetType() const { return stream->GetType(); }
+
+    const std::shared_ptr<CMonotonicArena>& GetArena() const { return arena; }
+};
+
+template<typename S>
+ArenaStream<S> WithArena(S* s)
+{
+    return ArenaStream<S>(s);
+}
+
+template<typename Stream, typename T>
+void Unserialize(ArenaStream<Stream>& is, std::shared_ptr<const T>& p)
+{
+    p = std::allocate_shared<const T>(arena_allocator<T>(is.GetArena()), deserialize, is);
+}
+
 /* Minimal stream for overwriting and/or appending to an existing byte vector
  *
  * The referenced vector will grow as necessary
@@ -138,6 +185,52 @@ private:
     size_t nPos;
 };
 
+/** Minimal stream for deserializing from a borrowed range of bytes, such as
+ * a memory mapped file, without copying it first.
+ *
+ * The bytes must outlive the reader.
+ */
+class CSpanReader
+{
+private:
+    const int nType;
+    const int nVersion;
+    const char* pbegin;
+    const char* pend;
+
+public:
+    CSpanReader(int nTypeIn, int nVersionIn, const unsigned char* pbeginIn, size_t nSize) : nType(nTypeIn), nVersion(nVersionIn), pbegin((const char*)pbeginIn), pend((const char*)pbeginIn + nSize) {}
+
+    int GetVersion() const { return nVersion; }
+    int GetType() const { return nType; }
+
+    size_t size() const { return pend - pbegin; }
+    bool empty() const { return pbegin == pend; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::ignore(): end of data");
+        pbegin += nSize;
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+};
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -241,6 +334,8 @@ public:
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
+    //! Exchange the underlying buffer with another, e.g. to reuse its capacity
+    void swap(CSerializeData& vchOther)              { vch.swap(vchOther); nReadPos = 0; }
     iterator insert(iterator it, const char& x=char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
     value_type* data()                               { return vch.data() + nReadPos; }
@@ -0,0 +1,88 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
+#define BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
+
+#include <algorithm>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Monotonic buffer: hands out memory from large chunks and frees nothing
+ * until it is destroyed. Not thread safe; fill it from one thread.
+ */
+class CMonotonicArena
+{
+public:
+    static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    explicit CMonotonicArena(size_t nChunkSizeIn = DEFAULT_CHUNK_SIZE) : nChunkSize(nChunkSizeIn), pFree(NULL), nFree(0) {}
+
+    void* Allocate(size_t nSize, size_t nAlign)
+    {
+        size_t nPad = (nAlign - ((uintptr_t)pFree & (nAlign - 1))) & (nAlign - 1);
+        if (pFree == NULL || nPad + nSize > nFree) {
+            // Chunks come from new[], which is aligned for any fundamental type
+            size_t nAlloc = std::max(nChunkSize, nSize);
+            vChunks.emplace_back(new char[nAlloc]);
+            pFree = vChunks.back().get();
+            nFree = nAlloc;
+            nPad = 0;
+        }
+        char* p = pFree + nPad;
+        pFree = p + nSize;
+        nFree -= nPad + nSize;
+        return p;
+    }
+
+    size_t ChunkCount() const { return vChunks.size(); }
+
+private:
+    const size_t nChunkSize;
+    std::vector<std::unique_ptr<char[]> > vChunks;
+    char* pFree;
+    size_t nFree;
+
+    CMonotonicArena(const CMonotonicArena&);
+    CMonotonicArena& operator=(const CMonotonicArena&);
+};
+
+/**
+ * Allocator drawing from a shared CMonotonicArena. Every copy keeps the
+ * arena alive, so objects created with std::allocate_shared may outlive
+ * whatever filled it: the arena goes away in one piece with the last of them.
+ */
+template <typename T>
+struct arena_allocator {
+    typedef T value_type;
+
+    std::shared_ptr<CMonotonicArena> arena;
+
+    explicit arena_allocator(const std::shared_ptr<CMonotonicArena>& arenaIn) : arena(arenaIn) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& a) : arena(a.arena)
+    {
+    }
+    template <typename U>
+    struct rebind {
+        typedef arena_allocator<U> other;
+    };
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {}
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.arena == b.arena; }
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.arena != b.arena; }
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_ARENA_H
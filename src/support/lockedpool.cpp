@@ -27,6 +27,10 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <boost/thread/tss.hpp>
 
 LockedPoolManager* LockedPoolManager::_instance = NULL;
 std::once_flag LockedPoolManager::init_flag;
@@ -257,22 +261,123 @@ size_t PosixLockedPageAllocator::GetLimit()
 /*******************************************************************************/
 // Implementation: LockedPool
 
+/** The free chunks one thread keeps for a pool */
+struct LockedPool::ThreadCache
+{
+    /** Pool the chunks are from, or nullptr if there is none (yet or any more) */
+    LockedPool* pool;
+    /** Chunks by size, bins[i] holding those of (i + 1) * ARENA_ALIGN bytes */
+    std::vector<void*> bins[THREAD_CACHE_MAX_SIZE / ARENA_ALIGN];
+    /** Totals of the bins, which stats() reads from other threads */
+    std::atomic<size_t> bytes;
+    std::atomic<size_t> chunks;
+
+    ThreadCache() : pool(nullptr), bytes(0), chunks(0) {}
+};
+
 LockedPool::LockedPool(std::unique_ptr<LockedPageAllocator> allocator_in, LockingFailed_Callback lf_cb_in):
-    allocator(std::move(allocator_in)), lf_cb(lf_cb_in), cumulative_bytes_locked(0)
+    allocator(std::move(allocator_in)), lf_cb(lf_cb_in), cumulative_bytes_locked(0), thread_caching(false)
 {
 }
 
 LockedPool::~LockedPool()
 {
+    // The cached chunks go away with the arenas; the caches themselves stay
+    // with their threads, free to serve another pool
+    std::lock_guard<std::mutex> lock(mutex);
+    for (ThreadCache* cache: thread_caches) {
+        cache->pool = nullptr;
+        for (auto& bin: cache->bins)
+            bin.clear();
+        cache->bytes = 0;
+        cache->chunks = 0;
+    }
 }
-void* LockedPool::alloc(size_t size)
+
+void LockedPool::enable_thread_cache()
 {
     std::lock_guard<std::mutex> lock(mutex);
+    thread_caching = true;
+}
+
+LockedPool::ThreadCache* LockedPool::thread_cache()
+{
+    // Never destroyed, as secure allocations may still be freed while statics are torn down
+    static boost::thread_specific_ptr<ThreadCache>* caches = new boost::thread_specific_ptr<ThreadCache>(&LockedPool::release_thread_cache);
+    ThreadCache* cache = caches->get();
+    if (!cache) {
+        cache = new ThreadCache();
+        caches->reset(cache);
+    }
+    if (cache->pool == this)
+        return cache;
+    if (cache->pool)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    cache->pool = this;
+    thread_caches.insert(cache);
+    return cache;
+}
+
+void LockedPool::release_thread_cache(ThreadCache* cache)
+{
+    if (LockedPool* pool = cache->pool) {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->trim_locked(*cache, 0);
+        pool->thread_caches.erase(cache);
+    }
+    delete cache;
+}
+
+void LockedPool::trim_locked(ThreadCache& cache, size_t keep)
+{
+    for (size_t i = 0; i < THREAD_CACHE_MAX_SIZE / ARENA_ALIGN; i++) {
+        std::vector<void*>& bin = cache.bins[i];
+        while (bin.size() > keep) {
+            free_locked(bin.back());
+            bin.pop_back();
+            cache.bytes -= (i + 1) * ARENA_ALIGN;
+            cache.chunks--;
+        }
+    }
+}
 
+void* LockedPool::alloc(size_t size)
+{
     // Don't handle impossible sizes
     if (size == 0 || size > ARENA_SIZE)
         return nullptr;
 
+    ThreadCache* cache = thread_caching && size <= THREAD_CACHE_MAX_SIZE ? thread_cache() : nullptr;
+    if (!cache) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return alloc_locked(size);
+    }
+
+    size = align_up(size, ARENA_ALIGN);
+    std::vector<void*>& bin = cache->bins[size / ARENA_ALIGN - 1];
+    if (bin.empty()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t n = 0; n < THREAD_CACHE_REFILL; n++) {
+            void* addr = alloc_locked(size);
+            if (!addr)
+                break;
+            bin.push_back(addr);
+            cache->bytes += size;
+            cache->chunks++;
+        }
+        if (bin.empty())
+            return nullptr;
+    }
+    void* addr = bin.back();
+    bin.pop_back();
+    cache->bytes -= size;
+    cache->chunks--;
+    return addr;
+}
+
+void* LockedPool::alloc_locked(size_t size)
+{
     // Try allocating from each current arena
     for (auto &arena: arenas) {
         void *addr = arena.alloc(size);
@@ -290,6 +395,35 @@ void* LockedPool::alloc(size_t size)
 void LockedPool::free(void *ptr)
 {
     std::lock_guard<std::mutex> lock(mutex);
+    free_locked(ptr);
+}
+
+void LockedPool::free(void *ptr, size_t size)
+{
+    ThreadCache* cache = ptr && thread_caching && size > 0 && size <= THREAD_CACHE_MAX_SIZE ? thread_cache() : nullptr;
+    if (!cache) {
+        free(ptr);
+        return;
+    }
+
+    size = align_up(size, ARENA_ALIGN);
+    std::vector<void*>& bin = cache->bins[size / ARENA_ALIGN - 1];
+    bin.push_back(ptr);
+    cache->bytes += size;
+    cache->chunks++;
+    if (bin.size() > THREAD_CACHE_MAX_CHUNKS) {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (bin.size() > THREAD_CACHE_REFILL) {
+            free_locked(bin.back());
+            bin.pop_back();
+            cache->bytes -= size;
+            cache->chunks--;
+        }
+    }
+}
+
+void LockedPool::free_locked(void *ptr)
+{
     // TODO we can do better than this linear search by keeping a map of arena
     // extents to arena, and looking up the address.
     for (auto &arena: arenas) {
@@ -313,6 +447,14 @@ LockedPool::Stats LockedPool::stats() const
         r.chunks_used += i.chunks_used;
         r.chunks_free += i.chunks_free;
     }
+    for (const ThreadCache* cache: thread_caches) {
+        const size_t bytes = cache->bytes;
+        const size_t chunks = cache->chunks;
+        r.used -= bytes;
+        r.free += bytes;
+        r.chunks_used -= chunks;
+        r.chunks_free += chunks;
+    }
     return r;
 }
 
@@ -360,6 +502,7 @@ LockedPool::LockedPageArena::~LockedPageArena()
 LockedPoolManager::LockedPoolManager(std::unique_ptr<LockedPageAllocator> allocator):
     LockedPool(std::move(allocator), &LockedPoolManager::LockingFailed)
 {
+    enable_thread_cache();
 }
 
 bool LockedPoolManager::LockingFailed()
@@ -10,6 +10,7 @@
 #include <map>
 #include <mutex>
 #include <memory>
+#include <set>
 
 /**
  * OS-dependent allocation and deallocation of locked/pinned memory pages.
@@ -113,6 +114,11 @@ private:
  * memory. This has been done as the sizes and bases of objects are not in themselves sensitive
  * information, as to conserve precious locked memory. In some operating systems
  * the amount of memory that can be locked is small.
+ *
+ * With the thread cache enabled, each thread keeps a few free chunks of each small size,
+ * taken from the arenas THREAD_CACHE_REFILL at a time, and serves small allocations and
+ * sized frees from them without taking the pool's mutex. Threads signing, topping up the
+ * key pool or staking at once then no longer queue on that mutex for every key.
  */
 class LockedPool
 {
@@ -127,6 +133,12 @@ public:
      * memory, setting it too low will facilitate fragmentation.
      */
     static const size_t ARENA_ALIGN = 16;
+    /** Largest allocation served from the thread caches. */
+    static const size_t THREAD_CACHE_MAX_SIZE = 256;
+    /** Chunks a thread cache takes from the arenas at once when it has none of a size. */
+    static const size_t THREAD_CACHE_REFILL = 8;
+    /** Chunks of one size a thread cache keeps before handing some back to the arenas. */
+    static const size_t THREAD_CACHE_MAX_CHUNKS = 16;
 
     /** Callback when allocation succeeds but locking fails.
      */
@@ -165,12 +177,36 @@ public:
      */
     void free(void *ptr);
 
-    /** Get pool usage statistics */
+    /** Free a chunk allocated by alloc(size), with the same size.
+     * With the thread cache enabled, a small chunk goes to the calling thread's
+     * cache without being checked, so it must be valid and freed only once.
+     */
+    void free(void *ptr, size_t size);
+
+    /** Serve small allocations and sized frees from per-thread caches.
+     * A thread only caches chunks for the first pool it uses with the cache
+     * enabled; for any other pool it takes the mutex as usual.
+     */
+    void enable_thread_cache();
+
+    /** Get pool usage statistics. Chunks held by thread caches count as free. */
     Stats stats() const;
+
+    struct ThreadCache;
 private:
     LockedPool(const LockedPool& other) = delete; // non construction-copyable
     LockedPool& operator=(const LockedPool&) = delete; // non copyable
 
+    /** alloc() and free() with the mutex held */
+    void* alloc_locked(size_t size);
+    void free_locked(void *ptr);
+    /** The calling thread's cache if it caches chunks for this pool, or nullptr */
+    ThreadCache* thread_cache();
+    /** Hand the chunks of a thread cache back to the arenas, down to keep of each size */
+    void trim_locked(ThreadCache& cache, size_t keep);
+    /** Called as a thread with a cache exits */
+    static void release_thread_cache(ThreadCache* cache);
+
     std::unique_ptr<LockedPageAllocator> allocator;
 
     /** Create an arena from locked pages */
@@ -190,6 +226,9 @@ private:
     std::list<LockedPageArena> arenas;
     LockingFailed_Callback lf_cb;
     size_t cumulative_bytes_locked;
+    bool thread_caching;
+    /** The thread caches holding chunks of this pool */
+    std::set<ThreadCache*> thread_caches;
     /** Mutex protects access to this pool's data structures, including arenas.
      */
     mutable std::mutex mutex;
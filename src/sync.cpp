@@ -6,12 +6,153 @@
 
 #include "util.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 
+#include <algorithm>
+#include <map>
+#include <memory>
 #include <stdio.h>
+#include <string.h>
+#include <tuple>
 
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+static void NoCleanup(CLockWaitTimer*) {}
+
+//! The innermost CLockWaitTimer of each thread, owned by its scope
+static boost::thread_specific_ptr<CLockWaitTimer> lockWaitTimer(NoCleanup);
+
+CLockWaitTimer::CLockWaitTimer() : nWaitMicros(0), pprev(lockWaitTimer.get())
+{
+    lockWaitTimer.reset(this);
+}
+
+CLockWaitTimer::~CLockWaitTimer()
+{
+    lockWaitTimer.reset(pprev);
+}
+
+// LOCK() passes the expression naming the lock, which may be qualified
+static bool IsTimedWait(const char* pszName)
+{
+    return lockWaitTimer.get() && strstr(pszName, "cs_main") != NULL;
+}
+
+int64_t LockWaitStart(const char* pszName)
+{
+    if (!fLockStats.load(std::memory_order_relaxed) && !IsTimedWait(pszName))
+        return 0;
+    return GetTimeMicros();
+}
+
+int64_t LockWaitEnd(const char* pszName, int64_t nStart)
+{
+    int64_t nWaitMicros = GetTimeMicros() - nStart;
+    if (IsTimedWait(pszName))
+        lockWaitTimer.get()->nWaitMicros += nWaitMicros;
+    return nWaitMicros;
+}
+
+std::atomic<bool> fLockStats(DEFAULT_LOCKSTATS);
+
+void CLockSiteStats::Add(const CLockSiteStats& other)
+{
+    nAcquired += other.nAcquired;
+    nContended += other.nContended;
+    nWaitMicros += other.nWaitMicros;
+    nMaxWaitMicros = std::max(nMaxWaitMicros, other.nMaxWaitMicros);
+    nHoldMicros += other.nHoldMicros;
+    nMaxHoldMicros = std::max(nMaxHoldMicros, other.nMaxHoldMicros);
+}
+
+/**
+ * The lock statistics of one thread, keyed by the name, file and line
+ * literals of the call site. Only GetLockStats and ResetLockStats take its
+ * mutex from another thread; entries are never erased, so the statistics a
+ * held lock points to stay valid.
+ */
+struct CThreadLockStats
+{
+    boost::mutex mutex;
+    std::map<std::tuple<const char*, const char*, int>, CLockSiteStats> mapSites;
+};
+
+static boost::mutex csLockStatsThreads;
+//! Every thread that recorded statistics; kept after it exits, for its statistics
+static std::vector<std::unique_ptr<CThreadLockStats> > vLockStatsThreads;
+static void KeepThreadLockStats(CThreadLockStats*) {}
+static boost::thread_specific_ptr<CThreadLockStats> threadLockStats(KeepThreadLockStats);
+
+CLockSiteStats* LockStatsAcquired(const char* pszName, const char* pszFile, int nLine, bool fAcquired, bool fContended, int64_t nWaitMicros, int64_t& nAcquiredTime)
+{
+    CThreadLockStats* pthread = threadLockStats.get();
+    if (!pthread) {
+        pthread = new CThreadLockStats();
+        boost::unique_lock<boost::mutex> lock(csLockStatsThreads);
+        vLockStatsThreads.emplace_back(pthread);
+        threadLockStats.reset(pthread);
+    }
+
+    boost::unique_lock<boost::mutex> lock(pthread->mutex);
+    CLockSiteStats& stats = pthread->mapSites[std::make_tuple(pszName, pszFile, nLine)];
+    if (fContended)
+        stats.nContended++;
+    if (!fAcquired)
+        return NULL;
+    stats.nAcquired++;
+    stats.nWaitMicros += nWaitMicros;
+    stats.nMaxWaitMicros = std::max(stats.nMaxWaitMicros, nWaitMicros);
+    nAcquiredTime = GetTimeMicros();
+    return &stats;
+}
+
+void LockStatsReleased(CLockSiteStats* pstats, int64_t nAcquiredTime)
+{
+    int64_t nHoldMicros = GetTimeMicros() - nAcquiredTime;
+    // Released on the thread that acquired it, so pstats belongs to this thread
+    boost::unique_lock<boost::mutex> lock(threadLockStats.get()->mutex);
+    pstats->nHoldMicros += nHoldMicros;
+    pstats->nMaxHoldMicros = std::max(pstats->nMaxHoldMicros, nHoldMicros);
+}
+
+std::vector<CLockSiteInfo> GetLockStats()
+{
+    // Literals of the same site may have different addresses in different
+    // translation units, so sum by their text
+    std::map<std::tuple<std::string, std::string, int>, CLockSiteStats> mapSites;
+    {
+        boost::unique_lock<boost::mutex> lockThreads(csLockStatsThreads);
+        for (const std::unique_ptr<CThreadLockStats>& pthread : vLockStatsThreads) {
+            boost::unique_lock<boost::mutex> lock(pthread->mutex);
+            for (const auto& site : pthread->mapSites)
+                mapSites[std::make_tuple(std::string(std::get<0>(site.first)), std::string(std::get<1>(site.first)), std::get<2>(site.first))].Add(site.second);
+        }
+    }
+
+    std::vector<CLockSiteInfo> vSites;
+    vSites.reserve(mapSites.size());
+    for (const auto& site : mapSites) {
+        CLockSiteInfo info;
+        info.strName = std::get<0>(site.first);
+        info.strFile = std::get<1>(site.first);
+        info.nLine = std::get<2>(site.first);
+        info.stats = site.second;
+        vSites.push_back(info);
+    }
+    return vSites;
+}
+
+void ResetLockStats()
+{
+    boost::unique_lock<boost::mutex> lockThreads(csLockStatsThreads);
+    for (const std::unique_ptr<CThreadLockStats>& pthread : vLockStatsThreads) {
+        boost::unique_lock<boost::mutex> lock(pthread->mutex);
+        for (auto& site : pthread->mapSites)
+            site.second = CLockSiteStats();
+    }
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -8,6 +8,11 @@
 
 #include "threadsafety.h"
 
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -108,6 +113,70 @@ typedef boost::condition_variable CConditionVariable;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * While alive, adds up the time the current thread spends blocked waiting
+ * for cs_main, so RPC calls can report their lock waits. An inner timer
+ * takes over from an outer one until it goes away.
+ */
+class CLockWaitTimer
+{
+public:
+    CLockWaitTimer();
+    ~CLockWaitTimer();
+
+    int64_t nWaitMicros;
+
+private:
+    CLockWaitTimer* pprev;
+};
+
+/** Start timing a blocked wait for the lock named pszName, or return 0 if it is not being timed */
+int64_t LockWaitStart(const char* pszName);
+/** End a wait LockWaitStart timed and return how long it took */
+int64_t LockWaitEnd(const char* pszName, int64_t nStart);
+
+static const bool DEFAULT_LOCKSTATS = false;
+
+/** Whether LOCK, LOCK2 and TRY_LOCK record contention statistics (-lockstats) */
+extern std::atomic<bool> fLockStats;
+
+/** Contention statistics of one LOCK, LOCK2 or TRY_LOCK call site */
+struct CLockSiteStats
+{
+    uint64_t nAcquired;
+    //! Acquisitions that had to wait, and TRY_LOCKs that found the lock taken
+    uint64_t nContended;
+    int64_t nWaitMicros;
+    int64_t nMaxWaitMicros;
+    int64_t nHoldMicros;
+    int64_t nMaxHoldMicros;
+
+    CLockSiteStats() : nAcquired(0), nContended(0), nWaitMicros(0), nMaxWaitMicros(0), nHoldMicros(0), nMaxHoldMicros(0) {}
+
+    void Add(const CLockSiteStats& other);
+};
+
+struct CLockSiteInfo
+{
+    //! The expression passed to LOCK, e.g. "pwallet->cs_wallet"
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    CLockSiteStats stats;
+};
+
+/**
+ * Record an acquisition of pszName at pszFile:nLine. Returns the statistics
+ * to pass to LockStatsReleased with nAcquiredTime once it is released, or
+ * NULL for a failed TRY_LOCK. Statistics are kept per thread, so recording
+ * only takes a lock no other thread normally wants.
+ */
+CLockSiteStats* LockStatsAcquired(const char* pszName, const char* pszFile, int nLine, bool fAcquired, bool fContended, int64_t nWaitMicros, int64_t& nAcquiredTime);
+void LockStatsReleased(CLockSiteStats* pstats, int64_t nAcquiredTime);
+/** Statistics of every call site recorded, summed over all threads */
+std::vector<CLockSiteInfo> GetLockStats();
+void ResetLockStats();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class SCOPED_LOCKABLE CMutexLock
@@ -115,17 +184,25 @@ class SCOPED_LOCKABLE CMutexLock
 private:
     boost::unique_lock<Mutex> lock;
 
+    CLockSiteStats* pLockStats;
+    int64_t nLockAcquired;
+
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        bool fContended = !lock.try_lock();
+        int64_t nWaitMicros = 0;
+        if (fContended) {
 #ifdef DEBUG_LOCKCONTENTION
-        if (!lock.try_lock()) {
             PrintLockContention(pszName, pszFile, nLine);
 #endif
+            int64_t nWaitStart = LockWaitStart(pszName);
             lock.lock();
-#ifdef DEBUG_LOCKCONTENTION
+            if (nWaitStart)
+                nWaitMicros = LockWaitEnd(pszName, nWaitStart);
         }
-#endif
+        if (fLockStats.load(std::memory_order_relaxed))
+            pLockStats = LockStatsAcquired(pszName, pszFile, nLine, true, fContended, nWaitMicros, nLockAcquired);
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
@@ -134,11 +211,13 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        if (fLockStats.load(std::memory_order_relaxed))
+            pLockStats = LockStatsAcquired(pszName, pszFile, nLine, lock.owns_lock(), !lock.owns_lock(), 0, nLockAcquired);
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : lock(mutexIn, boost::defer_lock), pLockStats(NULL), nLockAcquired(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -146,7 +225,7 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn)
+    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn) : pLockStats(NULL), nLockAcquired(0)
     {
         if (!pmutexIn) return;
 
@@ -159,8 +238,11 @@ public:
 
     ~CMutexLock() UNLOCK_FUNCTION()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
             LeaveCritical();
+            if (pLockStats)
+                LockStatsReleased(pLockStats, nLockAcquired);
+        }
     }
 
     operator bool()
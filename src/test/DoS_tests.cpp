@@ -11,6 +11,7 @@
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanage.h"
 #include "util.h"
 #include "validation.h"
 
@@ -23,17 +24,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests these internal-to-net_processing.cpp methods:
-extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -126,13 +116,22 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!connman->IsBanned(addr));
 }
 
-CTransactionRef RandomOrphan()
+CTransactionRef RandomOrphan(const std::vector<CTransactionRef>& vOrphans)
+{
+    return vOrphans[GetRand(vOrphans.size())];
+}
+
+CTransactionRef OrphanSpending(const uint256& hashPrev, CKey& key)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    return MakeTransactionRef(tx);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -142,25 +141,21 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    CTxOrphanage orphanage(1000, 100000000);
+    std::vector<CTransactionRef> vOrphans;
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
-        CMutableTransaction tx;
-        tx.vin.resize(1);
-        tx.vin[0].prevout.n = 0;
-        tx.vin[0].prevout.hash = GetRandHash();
-        tx.vin[0].scriptSig << OP_1;
-        tx.vout.resize(1);
-        tx.vout[0].nValue = 1*CENT;
-        tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
-
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        CTransactionRef tx = OrphanSpending(GetRandHash(), key);
+        BOOST_CHECK(orphanage.AddTx(tx, i));
+        vOrphans.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -171,13 +166,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        BOOST_CHECK(orphanage.AddTx(MakeTransactionRef(tx), i));
     }
+    BOOST_CHECK_EQUAL(orphanage.Size(), 100U);
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -195,24 +191,102 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
+        BOOST_CHECK(!orphanage.AddTx(MakeTransactionRef(tx), i));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanage.Size();
+        orphanage.EraseForPeer(i);
+        BOOST_CHECK(orphanage.Size() < sizeBefore);
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+    // Test LimitOrphans() by count:
+    orphanage.SetLimits(40, 100000000);
+    orphanage.LimitOrphans();
+    BOOST_CHECK(orphanage.Size() <= 40);
+    orphanage.SetLimits(10, 100000000);
+    orphanage.LimitOrphans();
+    BOOST_CHECK(orphanage.Size() <= 10);
+
+    // ... and by size:
+    size_t nSizeBefore = orphanage.TotalSize();
+    orphanage.SetLimits(10, nSizeBefore / 2);
+    orphanage.LimitOrphans();
+    BOOST_CHECK(orphanage.TotalSize() <= nSizeBefore / 2);
+
+    orphanage.SetLimits(0, 100000000);
+    orphanage.LimitOrphans();
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanage.TotalSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanQuota)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    // A peer may use a quarter of the pool
+    CTxOrphanage orphanage(8, 100000000);
+    BOOST_CHECK(orphanage.AddTx(OrphanSpending(GetRandHash(), key), 1));
+    BOOST_CHECK(orphanage.AddTx(OrphanSpending(GetRandHash(), key), 1));
+    BOOST_CHECK(!orphanage.AddTx(OrphanSpending(GetRandHash(), key), 1));
+    BOOST_CHECK(orphanage.AddTx(OrphanSpending(GetRandHash(), key), 2));
+    BOOST_CHECK_EQUAL(orphanage.Size(), 3U);
+
+    // Erasing one of its orphans frees up the quota again
+    orphanage.EraseForPeer(1);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 1U);
+    BOOST_CHECK(orphanage.AddTx(OrphanSpending(GetRandHash(), key), 1));
+
+    // The size quota holds even when the count would allow more
+    CTransactionRef tx = OrphanSpending(GetRandHash(), key);
+    size_t nSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
+    CTxOrphanage orphanageBySize(100, nSize * 4);
+    BOOST_CHECK(orphanageBySize.AddTx(tx, 1));
+    BOOST_CHECK(!orphanageBySize.AddTx(OrphanSpending(GetRandHash(), key), 1));
+    BOOST_CHECK(orphanageBySize.AddTx(OrphanSpending(GetRandHash(), key), 2));
+
+    // The memory counted covers the transactions and goes down as they go
+    size_t nUsage = orphanageBySize.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 2 * nSize);
+    orphanageBySize.EraseForPeer(2);
+    BOOST_CHECK(orphanageBySize.DynamicMemoryUsage() < nUsage);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanWorkSet)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CTxOrphanage orphanage(100, 100000000);
+    CTransactionRef parent = OrphanSpending(GetRandHash(), key);
+    CTransactionRef child = OrphanSpending(parent->GetHash(), key);
+    BOOST_CHECK(orphanage.AddTx(child, 3));
+    BOOST_CHECK(orphanage.HaveTx(child->GetHash()));
+
+    // Accepting the parent from peer 5 queues the child on peer 5's behalf
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(5));
+    orphanage.AddChildrenToWorkSet(*parent, 5);
+    BOOST_CHECK(orphanage.HaveTxToReconsider(5));
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(3));
+
+    NodeId fromPeer = -1;
+    CTransactionRef tx = orphanage.GetTxToReconsider(5, fromPeer);
+    BOOST_CHECK(tx == child);
+    BOOST_CHECK_EQUAL(fromPeer, 3);
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(5));
+
+    // Orphans erased in the meantime are skipped
+    orphanage.AddChildrenToWorkSet(*parent, 5);
+    orphanage.EraseTx(child->GetHash());
+    BOOST_CHECK(!orphanage.GetTxToReconsider(5, fromPeer));
+
+    // A block spending the same input drops the orphan
+    BOOST_CHECK(orphanage.AddTx(child, 3));
+    BOOST_CHECK_EQUAL(orphanage.EraseForBlockTx(*OrphanSpending(parent->GetHash(), key)), 1);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addresssubscription.h"
+
+#include "addressindex.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include "test/test_bitcoin.h"
+
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addresssubscription_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(addresssubscription_deltas)
+{
+    CAddressSubscriptions subscriptions;
+    uint160 hashA(std::vector<unsigned char>(20, 1)), hashB(std::vector<unsigned char>(20, 2)), hashC(std::vector<unsigned char>(20, 3));
+    uint256 txid = uint256S("aa");
+
+    std::string id = subscriptions.Subscribe(std::vector<std::pair<uint160, int> >(1, std::make_pair(hashA, 1)));
+    BOOST_CHECK(!id.empty());
+    BOOST_CHECK_EQUAL(subscriptions.Count(), 1U);
+
+    // Only the subscribed address is delivered
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    addressIndex.push_back(std::make_pair(CAddressIndexKey(1, hashA, 10, 1, txid, 0, false), 50));
+    addressIndex.push_back(std::make_pair(CAddressIndexKey(1, hashB, 10, 1, txid, 1, false), 60));
+    subscriptions.NotifyBlock(addressIndex, false);
+
+    std::vector<CAddressSubscriptionDelta> vDeltas;
+    bool fOverflow = true;
+    BOOST_CHECK(subscriptions.Wait(id, 0, 100, vDeltas, fOverflow));
+    BOOST_CHECK(!fOverflow);
+    BOOST_CHECK_EQUAL(vDeltas.size(), 1U);
+    BOOST_CHECK(vDeltas[0].hashBytes == hashA);
+    BOOST_CHECK_EQUAL(vDeltas[0].satoshis, 50);
+    BOOST_CHECK_EQUAL(vDeltas[0].blockHeight, 10);
+    BOOST_CHECK(!vDeltas[0].fDisconnected);
+
+    // Addresses can be added later, and an address of another type does not match
+    BOOST_CHECK(subscriptions.AddAddresses(id, std::vector<std::pair<uint160, int> >(1, std::make_pair(hashC, 2))));
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > mempoolDeltas;
+    mempoolDeltas.push_back(std::make_pair(CMempoolAddressDeltaKey(2, hashC, txid, 0, 1), CMempoolAddressDelta(1000, -30, txid, 5)));
+    mempoolDeltas.push_back(std::make_pair(CMempoolAddressDeltaKey(1, hashC, txid, 1, 0), CMempoolAddressDelta(1000, 30)));
+    subscriptions.NotifyMempool(mempoolDeltas);
+    BOOST_CHECK(subscriptions.Wait(id, 0, 100, vDeltas, fOverflow));
+    BOOST_CHECK_EQUAL(vDeltas.size(), 1U);
+    BOOST_CHECK_EQUAL(vDeltas[0].blockHeight, -1);
+    BOOST_CHECK_EQUAL(vDeltas[0].satoshis, -30);
+    BOOST_CHECK_EQUAL(vDeltas[0].prevout, 5U);
+
+    // Nothing pending returns empty once the timeout passes
+    BOOST_CHECK(subscriptions.Wait(id, 10, 100, vDeltas, fOverflow));
+    BOOST_CHECK(vDeltas.empty());
+
+    // Disconnecting the block is reported too, and count limits a poll
+    addressIndex.push_back(std::make_pair(CAddressIndexKey(1, hashA, 10, 2, txid, 2, true), -50));
+    subscriptions.NotifyBlock(addressIndex, true);
+    BOOST_CHECK(subscriptions.Wait(id, 0, 1, vDeltas, fOverflow));
+    BOOST_CHECK_EQUAL(vDeltas.size(), 1U);
+    BOOST_CHECK(vDeltas[0].fDisconnected);
+    BOOST_CHECK(subscriptions.Wait(id, 0, 100, vDeltas, fOverflow));
+    BOOST_CHECK_EQUAL(vDeltas.size(), 1U);
+    BOOST_CHECK_EQUAL(vDeltas[0].satoshis, -50);
+
+    BOOST_CHECK(subscriptions.Unsubscribe(id));
+    BOOST_CHECK(!subscriptions.Unsubscribe(id));
+    BOOST_CHECK(!subscriptions.Wait(id, 0, 100, vDeltas, fOverflow));
+    BOOST_CHECK_EQUAL(subscriptions.Count(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(addresssubscription_wait)
+{
+    CAddressSubscriptions subscriptions;
+    uint160 hashA(std::vector<unsigned char>(20, 1));
+    std::string id = subscriptions.Subscribe(std::vector<std::pair<uint160, int> >(1, std::make_pair(hashA, 1)));
+
+    // A waiter is woken by a matching delta well before its timeout
+    std::thread notifier([&subscriptions, hashA] {
+        MilliSleep(50);
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        addressIndex.push_back(std::make_pair(CAddressIndexKey(1, hashA, 1, 0, uint256S("aa"), 0, false), 1));
+        subscriptions.NotifyBlock(addressIndex, false);
+    });
+    int64_t nStart = GetTimeMillis();
+    std::vector<CAddressSubscriptionDelta> vDeltas;
+    bool fOverflow;
+    BOOST_CHECK(subscriptions.Wait(id, 60000, 100, vDeltas, fOverflow));
+    notifier.join();
+    BOOST_CHECK_EQUAL(vDeltas.size(), 1U);
+    BOOST_CHECK(GetTimeMillis() - nStart < 30000);
+
+    // Interrupting wakes waiters and makes later polls return at once
+    subscriptions.Interrupt();
+    BOOST_CHECK(subscriptions.Wait(id, 60000, 100, vDeltas, fOverflow));
+    BOOST_CHECK(vDeltas.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -540,4 +540,60 @@ BOOST_AUTO_TEST_CASE(caddrinfo_get_new_bucket)
     //  than 64 buckets.
     BOOST_CHECK(buckets.size() > 64);
 }
+
+BOOST_AUTO_TEST_CASE(addrman_journal)
+{
+    CAddrManTest addrman;
+    CNetAddr source = ResolveIP("252.2.2.2");
+    CService addr1 = ResolveService("250.1.1.1", 8333);
+    CService addr2 = ResolveService("250.1.1.2", 9999);
+    CService addr3 = ResolveService("251.255.2.1", 8333);
+    addrman.Add(CAddress(addr1, NODE_NONE), source);
+    addrman.Add(CAddress(addr2, NODE_NONE), source);
+    BOOST_CHECK_EQUAL(addrman.JournalSize(), 2);
+
+    // Snapshot, as CAddrDB::Write does
+    addrman.ClearJournal();
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    ssPeers << addrman;
+    CAddrManTest addrman2;
+    ssPeers >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), 2);
+    BOOST_CHECK_EQUAL(addrman.JournalSize(), 0);
+
+    // Adding a known address without news changes nothing
+    addrman.Add(CAddress(addr1, NODE_NONE), source);
+    BOOST_CHECK_EQUAL(addrman.JournalSize(), 0);
+
+    addrman.Good(addr1);
+    addrman.SetServices(addr2, NODE_NETWORK);
+    int nId;
+    addrman.Create(CAddress(addr3, NODE_NONE), source, &nId);
+    addrman.Delete(nId);
+
+    std::vector<CAddrJournalEntry> vEntries = addrman.GetJournal();
+    BOOST_CHECK_EQUAL(vEntries.size(), 3);
+    BOOST_CHECK_EQUAL(addrman.JournalSize(), 0);
+
+    // Journal entries survive serialization
+    CDataStream ssJournal(SER_DISK, CLIENT_VERSION);
+    ssJournal << vEntries;
+    std::vector<CAddrJournalEntry> vEntries2;
+    ssJournal >> vEntries2;
+    BOOST_CHECK_EQUAL(vEntries2.size(), 3);
+
+    addrman2.ApplyJournal(vEntries2);
+    BOOST_CHECK_EQUAL(addrman2.size(), 2);
+    BOOST_CHECK(addrman2.Find(addr3) == NULL);
+    CAddrInfo* pinfo2 = addrman2.Find(addr2);
+    BOOST_CHECK(pinfo2 != NULL && pinfo2->nServices == NODE_NETWORK);
+    // addr1 moved to tried, so addr2 is the only new entry left
+    BOOST_CHECK(addrman2.Select(true).ToStringIPPort() == "250.1.1.2:9999");
+
+    // Replaying the same journal again is harmless
+    addrman2.ApplyJournal(vEntries2);
+    BOOST_CHECK_EQUAL(addrman2.size(), 2);
+    BOOST_CHECK(addrman2.Select(true).ToStringIPPort() == "250.1.1.2:9999");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
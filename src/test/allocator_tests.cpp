@@ -4,9 +4,13 @@
 
 #include "util.h"
 
+#include "memusage.h"
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
+#include <thread>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
@@ -204,6 +208,66 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_mock)
     BOOST_CHECK(pool.stats().used == 0);
 }
 
+BOOST_AUTO_TEST_CASE(lockedpool_tests_thread_cache)
+{
+    std::unique_ptr<LockedPageAllocator> x(new TestLockedPageAllocator(1, 1));
+    LockedPool pool(std::move(x));
+    pool.enable_thread_cache();
+
+    // On a new thread, so that its cache is for this pool
+    std::thread thread([&pool]() {
+        // The cache takes several chunks at once, but they only count as used once handed out
+        void *a0 = pool.alloc(32);
+        BOOST_CHECK(a0);
+        BOOST_CHECK(pool.stats().used == 32);
+        void *a1 = pool.alloc(20);
+        BOOST_CHECK(a1 && a1 != a0);
+        BOOST_CHECK(pool.stats().used == 64);
+        void *a2 = pool.alloc(LockedPool::THREAD_CACHE_MAX_SIZE + 1);
+        BOOST_CHECK(a2);
+        BOOST_CHECK(pool.stats().used == 64 + LockedPool::THREAD_CACHE_MAX_SIZE + 16);
+
+        // A chunk freed with its size is the next one of that size handed out
+        pool.free(a0, 32);
+        BOOST_CHECK(pool.stats().used == 32 + LockedPool::THREAD_CACHE_MAX_SIZE + 16);
+        BOOST_CHECK(pool.alloc(17) == a0);
+        pool.free(a0, 17);
+        pool.free(a1, 20);
+        pool.free(a2, LockedPool::THREAD_CACHE_MAX_SIZE + 1);
+        BOOST_CHECK(pool.stats().used == 0);
+
+        // More frees of one size than the cache keeps go back to the arenas
+        std::vector<void*> chunks;
+        for (size_t i = 0; i < 2 * LockedPool::THREAD_CACHE_MAX_CHUNKS; i++)
+            chunks.push_back(pool.alloc(64));
+        for (void *ptr: chunks)
+            pool.free(ptr, 64);
+        BOOST_CHECK(pool.stats().used == 0);
+        BOOST_CHECK(pool.stats().chunks_used == 0);
+    });
+    thread.join();
+    // Whatever the thread's cache held went back to the arenas as it exited
+    BOOST_CHECK(pool.stats().used == 0);
+    BOOST_CHECK(pool.stats().chunks_used == 0);
+    BOOST_CHECK(pool.stats().free == LockedPool::ARENA_SIZE);
+
+    // Chunks handed out on one thread and freed on another
+    std::vector<void*> chunks;
+    size_t used = 0;
+    std::thread producer([&pool, &chunks, &used]() {
+        for (int i = 0; i < 100; i++) {
+            chunks.push_back(pool.alloc(1 + i));
+            used += (i + LockedPool::ARENA_ALIGN) / LockedPool::ARENA_ALIGN * LockedPool::ARENA_ALIGN;
+        }
+    });
+    producer.join();
+    BOOST_CHECK(pool.stats().used == used);
+    for (int i = 0; i < 100; i++)
+        pool.free(chunks[i], 1 + i);
+    BOOST_CHECK(pool.stats().used == 0);
+    BOOST_CHECK(pool.stats().total == LockedPool::ARENA_SIZE);
+}
+
 // These tests used the live LockedPoolManager object, this is also used
 // by other tests so the conditions are somewhat less controllable and thus the
 // tests are somewhat more error-prone.
@@ -231,4 +295,75 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
     BOOST_CHECK(pool.stats().used == initial.used);
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource_tests)
+{
+    PoolResource<128, 8> resource(1024);
+    BOOST_CHECK(resource.NumAllocatedChunks() == 0); // Nothing until first use
+    BOOST_CHECK(resource.ChunkSizeBytes() == 1024);
+
+    void *a0 = resource.Allocate(8, 8);
+    void *a1 = resource.Allocate(8, 8);
+    BOOST_CHECK(resource.NumAllocatedChunks() == 1);
+    BOOST_CHECK(static_cast<char*>(a1) == static_cast<char*>(a0) + 8); // Packed together
+
+    // A freed block is handed out again for the same size, not another one
+    resource.Deallocate(a0, 8, 8);
+    void *a2 = resource.Allocate(16, 8);
+    BOOST_CHECK(a2 != a0);
+    void *a3 = resource.Allocate(7, 8); // Rounds up to the same size
+    BOOST_CHECK(a3 == a0);
+
+    // Filling up the chunk takes another one
+    std::vector<void*> blocks;
+    for (int i = 0; i < 64; i++)
+        blocks.push_back(resource.Allocate(128, 8));
+    BOOST_CHECK(resource.NumAllocatedChunks() > 1);
+
+    // Too large for the pool: comes from operator new, no chunk is used
+    size_t nChunks = resource.NumAllocatedChunks();
+    void *big = resource.Allocate(4096, 8);
+    BOOST_CHECK(big);
+    BOOST_CHECK(resource.NumAllocatedChunks() == nChunks);
+    resource.Deallocate(big, 4096, 8);
+
+    for (void *p : blocks)
+        resource.Deallocate(p, 128, 8);
+    resource.Deallocate(a1, 8, 8);
+    resource.Deallocate(a2, 16, 8);
+    resource.Deallocate(a3, 8, 8);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_map_tests)
+{
+    typedef std::pair<const uint64_t, uint64_t> value_type;
+    typedef PoolAllocator<value_type, sizeof(value_type) + sizeof(void*) * 4> Alloc;
+    typedef boost::unordered_map<uint64_t, uint64_t, boost::hash<uint64_t>, std::equal_to<uint64_t>, Alloc> Map;
+
+    Map m;
+    BOOST_CHECK(m.get_allocator().resource().NumAllocatedChunks() == 0);
+    for (uint64_t i = 0; i < 100000; i++)
+        m[i] = i * 2;
+    size_t nChunks = m.get_allocator().resource().NumAllocatedChunks();
+    BOOST_CHECK(nChunks > 0);
+    // All nodes are in the pool's chunks, which the usage accounts for whole
+    BOOST_CHECK(memusage::DynamicUsage(m) >= nChunks * m.get_allocator().resource().ChunkSizeBytes());
+
+    // Erasing keeps the chunks around, and inserting again reuses them
+    for (uint64_t i = 0; i < 100000; i++)
+        m.erase(i);
+    for (uint64_t i = 0; i < 100000; i++)
+        m[i + 100000] = i;
+    BOOST_CHECK(m.get_allocator().resource().NumAllocatedChunks() == nChunks);
+
+    // A copy gets a pool of its own, a swap takes the pool along
+    Map copy(m);
+    BOOST_CHECK(copy.get_allocator() != m.get_allocator());
+    BOOST_CHECK(copy.size() == m.size() && copy[100005] == 5);
+    Map empty;
+    Alloc alloc = m.get_allocator();
+    empty.swap(m);
+    BOOST_CHECK(empty.get_allocator() == alloc);
+    BOOST_CHECK(m.empty() && m.get_allocator().resource().NumAllocatedChunks() == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -266,6 +266,39 @@ BOOST_AUTO_TEST_CASE(base58_keys_invalid)
     }
 }
 
+BOOST_AUTO_TEST_CASE(base58_EncodeAddress)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<CTxDestination> vDests;
+    for (int i = 0; i < 50; i++) {
+        uint160 hash = uint160(std::vector<unsigned char>(20, i));
+        vDests.push_back(CKeyID(hash));
+        vDests.push_back(CScriptID(hash));
+    }
+
+    // Cached or not, the same as the address's own encoding, on each network
+    CAddressEncoder encoder;
+    for (int nPass = 0; nPass < 2; nPass++) {
+        for (const CTxDestination& dest : vDests) {
+            BOOST_CHECK_EQUAL(EncodeAddress(dest), CBitcoinAddress(dest).ToString());
+            BOOST_CHECK_EQUAL(encoder.Encode(dest), CBitcoinAddress(dest).ToString());
+        }
+    }
+    SelectParams(CBaseChainParams::TESTNET);
+    for (const CTxDestination& dest : vDests)
+        BOOST_CHECK_EQUAL(EncodeAddress(dest), CBitcoinAddress(dest).ToString());
+    SelectParams(CBaseChainParams::MAIN);
+    for (const CTxDestination& dest : vDests)
+        BOOST_CHECK_EQUAL(EncodeAddress(dest), CBitcoinAddress(dest).ToString());
+
+    // More addresses than the shared cache keeps
+    for (unsigned int i = 0; i < ADDRESS_ENCODING_CACHE_SIZE + 100; i++) {
+        uint160 hash;
+        memcpy(hash.begin(), &i, sizeof(i));
+        BOOST_CHECK_EQUAL(EncodeAddress(CKeyID(hash)), CBitcoinAddress(CKeyID(hash)).ToString());
+    }
+    BOOST_CHECK_EQUAL(EncodeAddress(CNoDestination()), CBitcoinAddress(CNoDestination()).ToString());
+}
 
 BOOST_AUTO_TEST_SUITE_END()
 
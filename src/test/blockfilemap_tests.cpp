@@ -0,0 +1,87 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "streams.h"
+#include "validation.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilemap_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockfilemap_read)
+{
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    CDiskBlockPos pos = pindex->GetBlockPos();
+
+    // Read through a mapping of blk00000.dat
+    blockFileMap.SetMaxFiles(1);
+    CBlock mapped;
+    BOOST_CHECK(ReadBlockFromDisk(mapped, pindex, consensusParams));
+    BOOST_CHECK_EQUAL(blockFileMap.Count(), 1U);
+    CBlockFileMap::MappingRef mapping = blockFileMap.Get(pos.nFile, pos.nPos);
+    BOOST_REQUIRE(mapping);
+    BOOST_CHECK(!blockFileMap.Get(pos.nFile, mapping->size() + 1));
+
+    // Mapped and ordinary reads agree
+    blockFileMap.SetMaxFiles(0);
+    BOOST_CHECK_EQUAL(blockFileMap.Count(), 0U);
+    CBlock read;
+    BOOST_CHECK(ReadBlockFromDisk(read, pindex, consensusParams));
+    BOOST_CHECK(mapped.GetHash() == read.GetHash());
+    BOOST_CHECK(mapped.vtx.size() == read.vtx.size());
+
+    // The evicted mapping stays valid for its holder
+    CSpanReader reader(SER_DISK, CLIENT_VERSION, mapping->data() + pos.nPos, mapping->size() - pos.nPos);
+    CBlockHeader header;
+    reader >> header;
+    BOOST_CHECK(header.GetHash() == read.GetHash());
+
+    blockFileMap.SetMaxFiles(DEFAULT_MAPPED_BLOCK_FILES);
+}
+
+BOOST_AUTO_TEST_CASE(readrawblock)
+{
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+
+    // Stored bytes are the wire serialization, mapped or not
+    for (unsigned int nMaxFiles : {1, 0}) {
+        blockFileMap.SetMaxFiles(nMaxFiles);
+        std::vector<unsigned char> vchBlock;
+        BOOST_CHECK(ReadRawBlockFromDisk(vchBlock, pindex, Params().MessageStart()));
+        BOOST_CHECK(std::vector<unsigned char>(ss.begin(), ss.end()) == vchBlock);
+        BOOST_CHECK(!ReadRawBlockFromDisk(vchBlock, pindex, CMessageHeader::MessageStartChars{0, 0, 0, 0}));
+    }
+    BOOST_CHECK(IsRawBlockSerialization(pindex, 0, Params().GetConsensus()));
+
+    blockFileMap.SetMaxFiles(DEFAULT_MAPPED_BLOCK_FILES);
+}
+
+BOOST_AUTO_TEST_CASE(spanreader_end)
+{
+    const unsigned char data[] = {0x01, 0x02, 0x03, 0x04, 0x05};
+    CSpanReader reader(SER_DISK, CLIENT_VERSION, data, sizeof(data));
+    uint32_t n;
+    reader >> n;
+    BOOST_CHECK_EQUAL(n, 0x04030201U);
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    reader.ignore(1);
+    BOOST_CHECK(reader.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
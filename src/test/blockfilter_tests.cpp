@@ -0,0 +1,97 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockfilter_tests, BasicTestingSetup)
+
+static CBlockFilter::Element ScriptElement(const CScript& script)
+{
+    return CBlockFilter::Element(script.begin(), script.end());
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_match)
+{
+    CBlockFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        included.insert(ScriptElement(CScript() << i << OP_DROP << OP_TRUE));
+        excluded.insert(ScriptElement(CScript() << i << OP_DROP << OP_FALSE));
+    }
+
+    CBlockFilter filter(uint256S("0123"), included);
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 100U);
+    for (const CBlockFilter::Element& element : included)
+        BOOST_CHECK(filter.Match(element));
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // A false positive among 100 is unlikely with M = 784931
+    int nFalsePositives = 0;
+    for (const CBlockFilter::Element& element : excluded)
+        nFalsePositives += filter.Match(element);
+    BOOST_CHECK(nFalsePositives <= 1);
+
+    CBlockFilter::ElementSet mixed(excluded);
+    mixed.insert(*included.rbegin());
+    BOOST_CHECK(filter.MatchAny(mixed));
+
+    // The same scripts hash differently under another block
+    CBlockFilter other(uint256S("4567"), included);
+    BOOST_CHECK(other.GetEncoded() != filter.GetEncoded());
+
+    // Round trip
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << filter;
+    CBlockFilter read;
+    ss >> read;
+    BOOST_CHECK(read.GetBlockHash() == filter.GetBlockHash());
+    BOOST_CHECK(read.GetEncoded() == filter.GetEncoded());
+    BOOST_CHECK(read.MatchAny(included));
+
+    // Nothing matches an empty filter
+    CBlockFilter empty(uint256S("0123"), CBlockFilter::ElementSet());
+    BOOST_CHECK(!empty.MatchAny(included));
+    BOOST_CHECK(!CBlockFilter().Match(*included.begin()));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_block)
+{
+    CScript scriptPaid = CScript() << OP_1 << OP_DROP << OP_TRUE;
+    CScript scriptSpent = CScript() << OP_2 << OP_DROP << OP_TRUE;
+    CScript scriptData = CScript() << OP_RETURN << std::vector<unsigned char>(4, 0x42);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = scriptPaid;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(uint256S("89ab"), 0);
+    spend.vout.resize(1);
+    spend.vout[0].scriptPubKey = scriptData;
+
+    CBlock block;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    block.vtx.push_back(MakeTransactionRef(spend));
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(Coin(CTxOut(1, scriptSpent), 1, false, false, 0));
+
+    // Paid and spent scripts are both in the filter, data outputs are not
+    CBlockFilter filter(uint256S("cdef"), block, blockundo);
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 2U);
+    BOOST_CHECK(filter.Match(ScriptElement(scriptPaid)));
+    BOOST_CHECK(filter.Match(ScriptElement(scriptSpent)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -391,4 +391,32 @@ BOOST_AUTO_TEST_CASE(cuckoocache_generations)
     test_cache_generations<CuckooCache::cache<uint256, uint256Hasher>>();
 }
 
+/* Test that for_each visits the elements that were not erased, so that a
+ * cache saved with it and inserted into a new one holds the same elements.
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_for_each)
+{
+    insecure_rand = FastRandomContext(true);
+    CuckooCache::cache<uint256, uint256Hasher> cc{};
+    cc.setup_bytes(1 << 20);
+    std::vector<uint256> hashes(1000);
+    for (uint256& h : hashes) {
+        insecure_GetRandHash(h);
+        cc.insert(h);
+    }
+    for (size_t i = 0; i < hashes.size(); i += 2)
+        cc.contains(hashes[i], true);
+
+    std::vector<uint256> saved;
+    cc.for_each([&saved](const uint256& h) { saved.push_back(h); });
+    BOOST_CHECK_EQUAL(saved.size(), hashes.size() / 2);
+
+    CuckooCache::cache<uint256, uint256Hasher> cc2{};
+    cc2.setup_bytes(1 << 20);
+    for (uint256& h : saved)
+        cc2.insert(h);
+    for (size_t i = 0; i < hashes.size(); i++)
+        BOOST_CHECK_EQUAL(cc2.contains(hashes[i], false), i % 2 == 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
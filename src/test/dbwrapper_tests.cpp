@@ -5,7 +5,12 @@
 #include "dbwrapper.h"
 #include "uint256.h"
 #include "random.h"
+#include "replication.h"
+#include "pubkey.h"
+#include "script/standard.h"
 #include "test/test_bitcoin.h"
+#include "txdb.h"
+#include "validation.h"
 
 #include <boost/assign/std/vector.hpp> // for 'operator+=()'
 #include <boost/assert.hpp>
@@ -36,6 +41,7 @@ BOOST_AUTO_TEST_CASE(dbwrapper)
 
         // Ensure that we're doing real obfuscation when obfuscate=true
         BOOST_CHECK(obfuscate != is_null_key(dbwrapper_private::GetObfuscateKey(dbw)));
+        BOOST_CHECK_EQUAL(dbwrapper_private::IsObfuscated(dbw), obfuscate);
 
         BOOST_CHECK(dbw.Write(key, in));
         BOOST_CHECK(dbw.Read(key, res));
@@ -122,6 +128,38 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_snapshot)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, true);
+    char key = 'j';
+    uint256 in = GetRandHash();
+    BOOST_CHECK(dbw.Write(key, in));
+
+    CDBSnapshot snapshot(dbw);
+    char key2 = 'k';
+    uint256 in2 = GetRandHash();
+    BOOST_CHECK(dbw.Write(key2, in2));
+    BOOST_CHECK(dbw.Write(key, in2));
+
+    // Reads through the snapshot see neither the overwrite nor the new key
+    uint256 res;
+    BOOST_CHECK(dbw.Read(key, res, &snapshot));
+    BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+    BOOST_CHECK(!dbw.Read(key2, res, &snapshot));
+    BOOST_CHECK(dbw.Read(key, res));
+    BOOST_CHECK_EQUAL(res.ToString(), in2.ToString());
+
+    std::unique_ptr<CDBIterator> it(dbw.NewIterator(snapshot));
+    it->Seek(key);
+    char key_res;
+    BOOST_CHECK(it->Valid() && it->GetKey(key_res) && it->GetValue(res));
+    BOOST_CHECK_EQUAL(key_res, key);
+    BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+    it->Next();
+    BOOST_CHECK(!it->Valid());
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
@@ -320,4 +358,782 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
 
 
 
+// Index entries left in the block tree by older versions move to the indexes database
+BOOST_FIXTURE_TEST_CASE(dbwrapper_indexes_migration, TestingSetup)
+{
+    uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x42));
+    uint256 txid = GetRandHash();
+    CAddressIndexKey addressKey(2, addressHash, 10, 1, txid, 0, false);
+    CSpentIndexKey spentKey(txid, 1);
+    CSpentIndexValue spentValue(GetRandHash(), 0, 11, 5 * COIN, 2, addressHash);
+
+    BOOST_CHECK(pblocktree->Write(std::make_pair('a', addressKey), (CAmount)(5 * COIN)));
+    BOOST_CHECK(pblocktree->Write(std::make_pair('p', spentKey), spentValue));
+    BOOST_CHECK(pblocktree->Write(std::make_pair('z', CTimestampBlockIndexKey(txid)), CTimestampBlockIndexValue(1234)));
+    BOOST_CHECK(pblocktree->WriteFlag("addressindex", true));
+
+    BOOST_CHECK(pindexesdb->MigrateFromBlockTree(*pblocktree));
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(pindexesdb->ReadAddressIndex(addressHash, 2, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    BOOST_CHECK_EQUAL(addressIndex[0].second, 5 * COIN);
+    BOOST_CHECK(addressIndex[0].first.txhash == txid);
+
+    CSpentIndexValue spentRead;
+    BOOST_CHECK(pindexesdb->ReadSpentIndex(spentKey, spentRead));
+    BOOST_CHECK(spentRead.txid == spentValue.txid);
+    BOOST_CHECK_EQUAL(spentRead.blockHeight, 11);
+
+    unsigned int logicalTS = 0;
+    BOOST_CHECK(pindexesdb->ReadTimestampBlockIndex(txid, logicalTS));
+    BOOST_CHECK_EQUAL(logicalTS, 1234U);
+
+    // The old copies are gone, the block tree's own records stay
+    BOOST_CHECK(!pblocktree->Exists(std::make_pair('a', addressKey)));
+    BOOST_CHECK(!pblocktree->Exists(std::make_pair('p', spentKey)));
+    bool fValue = false;
+    BOOST_CHECK(pblocktree->ReadFlag("addressindex", fValue) && fValue);
+
+    // A second run has nothing left to move
+    BOOST_CHECK(pindexesdb->MigrateFromBlockTree(*pblocktree));
+    addressIndex.clear();
+    BOOST_CHECK(pindexesdb->ReadAddressIndex(addressHash, 2, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+}
+
+// Queued index updates are visible to reads before the writer stores them
+BOOST_FIXTURE_TEST_CASE(dbwrapper_indexes_queue, TestingSetup)
+{
+    uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x17));
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+    uint256 txid = GetRandHash();
+
+    std::shared_ptr<CIndexUpdate> update1 = std::make_shared<CIndexUpdate>(hashBlock1);
+    update1->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, 1, 0, txid, 0, false), (CAmount)COIN));
+    update1->vTimestampBlockIndex.push_back(std::make_pair(CTimestampBlockIndexKey(hashBlock1), CTimestampBlockIndexValue(100)));
+    std::shared_ptr<CIndexUpdate> update2 = std::make_shared<CIndexUpdate>(hashBlock2);
+    update2->vAddressIndexErase = update1->vAddressIndex;
+    BOOST_CHECK(pindexesdb->QueueUpdate(update1));
+    BOOST_CHECK_EQUAL(pindexesdb->GetQueuedCount(), 1U);
+
+    // Point lookups come straight from the queue
+    unsigned int logicalTS = 0;
+    BOOST_CHECK(pindexesdb->ReadTimestampBlockIndex(hashBlock1, logicalTS));
+    BOOST_CHECK_EQUAL(logicalTS, 100U);
+    BOOST_CHECK_EQUAL(pindexesdb->GetQueuedCount(), 1U);
+
+    // Scans write out the queue first
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(pindexesdb->ReadAddressIndex(addressHash, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    BOOST_CHECK_EQUAL(pindexesdb->GetQueuedCount(), 0U);
+    uint256 hashIndexed;
+    BOOST_CHECK(pindexesdb->ReadBestBlock(hashIndexed));
+    BOOST_CHECK(hashIndexed == hashBlock1);
+
+    // Several updates share one batch and apply in order
+    BOOST_CHECK(pindexesdb->QueueUpdate(update2));
+    BOOST_CHECK(pindexesdb->QueueUpdate(update1));
+    BOOST_CHECK(pindexesdb->QueueUpdate(update2));
+    BOOST_CHECK(pindexesdb->Flush(true));
+    BOOST_CHECK_EQUAL(pindexesdb->GetQueuedCount(), 0U);
+    addressIndex.clear();
+    BOOST_CHECK(pindexesdb->ReadAddressIndex(addressHash, 1, addressIndex));
+    BOOST_CHECK(addressIndex.empty());
+    BOOST_CHECK(pindexesdb->ReadBestBlock(hashIndexed));
+    BOOST_CHECK(hashIndexed == hashBlock2);
+}
+
+// Address totals follow connects and disconnects, and can be rebuilt from the address index
+BOOST_FIXTURE_TEST_CASE(dbwrapper_address_balance, TestingSetup)
+{
+    uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x23));
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+
+    // Receive twice in one transaction, then spend one of them with change
+    std::shared_ptr<CIndexUpdate> update1 = std::make_shared<CIndexUpdate>(GetRandHash());
+    update1->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, 5, 1, txid1, 0, false), (CAmount)(3 * COIN)));
+    update1->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, 5, 1, txid1, 1, false), (CAmount)(2 * COIN)));
+    std::shared_ptr<CIndexUpdate> update2 = std::make_shared<CIndexUpdate>(GetRandHash());
+    update2->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, 6, 1, txid2, 0, true), (CAmount)(-3 * COIN)));
+    update2->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, 6, 1, txid2, 0, false), (CAmount)COIN));
+    BOOST_CHECK(pindexesdb->QueueUpdate(update1));
+    BOOST_CHECK(pindexesdb->QueueUpdate(update2));
+
+    CAddressBalance balance;
+    BOOST_CHECK(pindexesdb->ReadAddressBalance(addressHash, 1, balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 3 * COIN);
+    BOOST_CHECK_EQUAL(balance.nReceived, 6 * COIN);
+    BOOST_CHECK_EQUAL(balance.nTxCount, 2U);
+
+    // Rebuilding from scratch gives the same totals
+    BOOST_CHECK(pindexesdb->Erase(std::make_pair('w', CAddressIndexIteratorKey(1, addressHash))));
+    BOOST_CHECK(pindexesdb->BuildAddressBalances());
+    BOOST_CHECK(pindexesdb->ReadAddressBalance(addressHash, 1, balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 3 * COIN);
+    BOOST_CHECK_EQUAL(balance.nReceived, 6 * COIN);
+    BOOST_CHECK_EQUAL(balance.nTxCount, 2U);
+
+    // Reconnecting a block the indexes already hold, as after a crash, leaves the totals alone
+    std::shared_ptr<CIndexUpdate> replay2 = std::make_shared<CIndexUpdate>(*update2);
+    replay2->fBalancesApplied = true;
+    BOOST_CHECK(pindexesdb->QueueUpdate(replay2));
+    BOOST_CHECK(pindexesdb->ReadAddressBalance(addressHash, 1, balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 3 * COIN);
+    BOOST_CHECK_EQUAL(balance.nReceived, 6 * COIN);
+    BOOST_CHECK_EQUAL(balance.nTxCount, 2U);
+
+    // Disconnect the spend, then the receive
+    std::shared_ptr<CIndexUpdate> undo2 = std::make_shared<CIndexUpdate>(update1->hashBlock);
+    undo2->vAddressIndexErase = update2->vAddressIndex;
+    BOOST_CHECK(pindexesdb->QueueUpdate(undo2));
+    BOOST_CHECK(pindexesdb->ReadAddressBalance(addressHash, 1, balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 5 * COIN);
+    BOOST_CHECK_EQUAL(balance.nReceived, 5 * COIN);
+    BOOST_CHECK_EQUAL(balance.nTxCount, 1U);
+
+    std::shared_ptr<CIndexUpdate> undo1 = std::make_shared<CIndexUpdate>(uint256());
+    undo1->vAddressIndexErase = update1->vAddressIndex;
+    BOOST_CHECK(pindexesdb->QueueUpdate(undo1));
+    BOOST_CHECK(pindexesdb->ReadAddressBalance(addressHash, 1, balance));
+    BOOST_CHECK(balance.IsNull());
+    BOOST_CHECK(!pindexesdb->Exists(std::make_pair('w', CAddressIndexIteratorKey(1, addressHash))));
+}
+
+// Several addresses scan merged into chain order and resume after any key
+BOOST_FIXTURE_TEST_CASE(dbwrapper_address_index_scan, TestingSetup)
+{
+    uint160 addressHash1 = uint160(std::vector<unsigned char>(20, 0x31));
+    uint160 addressHash2 = uint160(std::vector<unsigned char>(20, 0x32));
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+    uint256 txid3 = GetRandHash();
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vect;
+    vect.push_back(std::make_pair(CAddressIndexKey(1, addressHash2, 7, 1, txid1, 0, false), (CAmount)COIN));
+    vect.push_back(std::make_pair(CAddressIndexKey(1, addressHash1, 7, 1, txid1, 1, false), (CAmount)COIN));
+    vect.push_back(std::make_pair(CAddressIndexKey(1, addressHash1, 8, 2, txid2, 0, true), (CAmount)-COIN));
+    vect.push_back(std::make_pair(CAddressIndexKey(1, addressHash2, 9, 1, txid3, 0, false), (CAmount)COIN));
+    BOOST_CHECK(pindexesdb->WriteAddressIndex(vect));
+
+    std::vector<std::pair<uint160, int> > addresses;
+    addresses.push_back(std::make_pair(addressHash2, 1));
+    addresses.push_back(std::make_pair(addressHash1, 1));
+
+    std::vector<CAddressIndexKey> keys;
+    auto collect = [&keys](const CAddressIndexKey& key, CAmount value) { keys.push_back(key); return true; };
+    BOOST_CHECK(pindexesdb->ScanAddressIndex(addresses, 0, 0, NULL, collect));
+    BOOST_CHECK_EQUAL(keys.size(), 4U);
+    BOOST_CHECK(keys[0].hashBytes == addressHash1 && keys[0].blockHeight == 7);
+    BOOST_CHECK(keys[1].hashBytes == addressHash2 && keys[1].blockHeight == 7);
+    BOOST_CHECK(keys[2].txhash == txid2);
+    BOOST_CHECK(keys[3].txhash == txid3);
+
+    // Stop after two entries, then continue from the second
+    std::vector<CAddressIndexKey> page;
+    auto collectTwo = [&page](const CAddressIndexKey& key, CAmount value) {
+        if (page.size() == 2)
+            return false;
+        page.push_back(key);
+        return true;
+    };
+    BOOST_CHECK(pindexesdb->ScanAddressIndex(addresses, 0, 0, NULL, collectTwo));
+    BOOST_CHECK_EQUAL(page.size(), 2U);
+    CAddressIndexKey keyAfter = page.back();
+    page.clear();
+    BOOST_CHECK(pindexesdb->ScanAddressIndex(addresses, 0, 0, &keyAfter, collectTwo));
+    BOOST_CHECK_EQUAL(page.size(), 2U);
+    BOOST_CHECK(page[0].txhash == txid2);
+    BOOST_CHECK(page[1].txhash == txid3);
+
+    // Height ranges still apply
+    keys.clear();
+    BOOST_CHECK(pindexesdb->ScanAddressIndex(addresses, 8, 8, NULL, collect));
+    BOOST_CHECK_EQUAL(keys.size(), 1U);
+    BOOST_CHECK(keys[0].txhash == txid2);
+
+    // Seeking on several threads does not change the order
+    keys.clear();
+    BOOST_CHECK(pindexesdb->ScanAddressIndex(addresses, 0, 0, &keyAfter, collect, 2));
+    BOOST_CHECK_EQUAL(keys.size(), 2U);
+    BOOST_CHECK(keys[0].txhash == txid2);
+    BOOST_CHECK(keys[1].txhash == txid3);
+}
+
+// Multi-address lookups shared between threads keep the order of the addresses
+BOOST_FIXTURE_TEST_CASE(dbwrapper_address_parallel_reads, TestingSetup)
+{
+    std::vector<std::pair<uint160, int> > addresses;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    for (unsigned char i = 0; i < 5; i++) {
+        uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x40 + i));
+        addresses.push_back(std::make_pair(addressHash, 1));
+        CAddressUnspentKey key(1, addressHash, GetRandHash(), 0);
+        vUnspent.push_back(std::make_pair(key, CAddressUnspentValue((i + 1) * COIN, CScript(), 10 + i, 0)));
+    }
+    BOOST_CHECK(pindexesdb->UpdateAddressUnspentIndex(vUnspent));
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    BOOST_CHECK(pindexesdb->ReadAddressUnspentIndex(addresses, unspentOutputs, 3));
+    BOOST_CHECK_EQUAL(unspentOutputs.size(), 5U);
+    for (size_t i = 0; i < unspentOutputs.size(); i++) {
+        BOOST_CHECK(unspentOutputs[i].first.hashBytes == addresses[i].first);
+        BOOST_CHECK_EQUAL(unspentOutputs[i].second.satoshis, (CAmount)((i + 1) * COIN));
+    }
+
+    // Every address but the last receives in two transactions and spends some of it
+    std::shared_ptr<CIndexUpdate> update = std::make_shared<CIndexUpdate>(GetRandHash());
+    for (size_t i = 0; i < 4; i++) {
+        uint256 txidReceive = GetRandHash();
+        uint256 txidSpend = GetRandHash();
+        update->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addresses[i].first, 20, 1, txidReceive, 0, false), (CAmount)((i + 1) * COIN)));
+        update->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addresses[i].first, 21, 1, txidSpend, 0, true), (CAmount)(-(CAmount)(i + 1) * COIN)));
+        update->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addresses[i].first, 21, 1, txidSpend, 1, false), (CAmount)COIN));
+    }
+    BOOST_CHECK(pindexesdb->QueueUpdate(update));
+
+    std::vector<CAddressBalance> balances;
+    BOOST_CHECK(pindexesdb->ReadAddressBalances(addresses, balances, 3));
+    BOOST_CHECK_EQUAL(balances.size(), 5U);
+    for (size_t i = 0; i < 4; i++) {
+        BOOST_CHECK_EQUAL(balances[i].nBalance, COIN);
+        BOOST_CHECK_EQUAL(balances[i].nReceived, (CAmount)((i + 2) * COIN));
+        BOOST_CHECK_EQUAL(balances[i].nTxCount, 2U);
+    }
+    BOOST_CHECK(balances[4].IsNull());
+}
+
+// Cached address runs are served until an update touches their address and height range
+BOOST_FIXTURE_TEST_CASE(dbwrapper_address_index_cache, TestingSetup)
+{
+    CIndexesDB indexesdb(1 << 20, true, false, 1 << 20);
+    uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x51));
+    CAddressIndexKey key1(1, addressHash, 3, 1, GetRandHash(), 0, false);
+    CAddressIndexKey key2(1, addressHash, 10, 1, GetRandHash(), 0, false);
+
+    std::shared_ptr<CIndexUpdate> update1 = std::make_shared<CIndexUpdate>(GetRandHash());
+    update1->vAddressIndex.push_back(std::make_pair(key1, (CAmount)COIN));
+    BOOST_CHECK(indexesdb.QueueUpdate(update1));
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex, 1, 5));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    std::vector<std::pair<uint160, int> > addresses(1, std::make_pair(addressHash, 1));
+    size_t nScanned = 0;
+    BOOST_CHECK(indexesdb.ScanAddressIndex(addresses, 0, 0, NULL, [&nScanned](const CAddressIndexKey& key, CAmount value) { nScanned++; return true; }));
+    BOOST_CHECK_EQUAL(nScanned, 1U);
+
+    // A write behind the cache's back is not seen while the runs are cached
+    BOOST_CHECK(indexesdb.Write(std::make_pair('a', CAddressIndexKey(1, addressHash, 4, 1, GetRandHash(), 0, false)), (CAmount)COIN));
+    addressIndex.clear();
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex, 1, 5));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+
+    // An update above the range keeps it, but drops the unbounded run
+    std::shared_ptr<CIndexUpdate> update2 = std::make_shared<CIndexUpdate>(GetRandHash());
+    update2->vAddressIndex.push_back(std::make_pair(key2, (CAmount)COIN));
+    BOOST_CHECK(indexesdb.QueueUpdate(update2));
+    addressIndex.clear();
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex, 1, 5));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    nScanned = 0;
+    BOOST_CHECK(indexesdb.ScanAddressIndex(addresses, 0, 0, NULL, [&nScanned](const CAddressIndexKey& key, CAmount value) { nScanned++; return true; }));
+    BOOST_CHECK_EQUAL(nScanned, 3U);
+
+    // Disconnecting inside the range drops it
+    std::shared_ptr<CIndexUpdate> undo1 = std::make_shared<CIndexUpdate>(GetRandHash());
+    undo1->vAddressIndexErase = update1->vAddressIndex;
+    BOOST_CHECK(indexesdb.QueueUpdate(undo1));
+    addressIndex.clear();
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex, 1, 5));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    BOOST_CHECK_EQUAL(addressIndex[0].first.blockHeight, 4);
+}
+
+BOOST_FIXTURE_TEST_CASE(dbwrapper_address_index_compact, TestingSetup)
+{
+    CIndexesDB indexesdb(1 << 20, true, false);
+    uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x52));
+    CAddressIndexKey key1(1, addressHash, 100, 2, GetRandHash(), 1, false);
+    CAddressIndexKey key2(1, addressHash, 200, 0, GetRandHash(), 0, false);
+    CAddressIndexKey key3(1, addressHash, 70000, 300, GetRandHash(), 0, true);
+    BOOST_CHECK(indexesdb.Write(std::make_pair('a', key1), (CAmount)5 * COIN));
+    BOOST_CHECK(indexesdb.Write(std::make_pair('a', key2), (CAmount)123456789));
+    BOOST_CHECK(indexesdb.Write(std::make_pair('a', key3), (CAmount)-5 * COIN));
+
+    CScript scriptP2PKH = GetScriptForDestination(CKeyID(addressHash));
+    CScript scriptP2PK = CScript() << std::vector<unsigned char>(33, 0x02) << OP_CHECKSIG;
+    CAddressUnspentKey unspent1(1, addressHash, key1.txhash, 1);
+    CAddressUnspentKey unspent2(1, addressHash, key2.txhash, 0);
+    BOOST_CHECK(indexesdb.Write(std::make_pair('u', unspent1), CAddressUnspentValue(5 * COIN, scriptP2PKH, 100, 1500000000)));
+    BOOST_CHECK(indexesdb.Write(std::make_pair('u', unspent2), CAddressUnspentValue(123456789, scriptP2PK, 200, 1500001000)));
+
+    BOOST_CHECK(indexesdb.UpgradeAddressIndex(false));
+    BOOST_CHECK(!indexesdb.IsAddressIndexCompact());
+    BOOST_CHECK(indexesdb.UpgradeAddressIndex(true));
+    BOOST_CHECK(indexesdb.IsAddressIndexCompact());
+    BOOST_CHECK(!indexesdb.Exists(std::make_pair('a', key1)));
+    BOOST_CHECK(!indexesdb.Exists(std::make_pair('u', unspent1)));
+
+    // Entries come back whole, in chain order, and height seeks still work
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 3U);
+    BOOST_CHECK(addressIndex[0].first.txhash == key1.txhash);
+    BOOST_CHECK_EQUAL(addressIndex[0].first.index, 1U);
+    BOOST_CHECK_EQUAL(addressIndex[0].second, 5 * COIN);
+    BOOST_CHECK(addressIndex[1].first.txhash == key2.txhash);
+    BOOST_CHECK_EQUAL(addressIndex[1].second, 123456789);
+    BOOST_CHECK(addressIndex[2].first.txhash == key3.txhash);
+    BOOST_CHECK_EQUAL(addressIndex[2].first.blockHeight, 70000);
+    BOOST_CHECK_EQUAL(addressIndex[2].first.txindex, 300U);
+    BOOST_CHECK(addressIndex[2].first.spending);
+    BOOST_CHECK_EQUAL(addressIndex[2].second, -5 * COIN);
+    addressIndex.clear();
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex, 150, 80000));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 2U);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+    BOOST_CHECK(indexesdb.ReadAddressUnspentIndex(addressHash, 1, unspentOutputs));
+    BOOST_CHECK_EQUAL(unspentOutputs.size(), 2U);
+    for (size_t i = 0; i < unspentOutputs.size(); i++) {
+        const CAddressUnspentValue &value = unspentOutputs[i].second;
+        if (unspentOutputs[i].first.txhash == key1.txhash) {
+            BOOST_CHECK(value.script == scriptP2PKH);
+            BOOST_CHECK_EQUAL(value.nTime, 1500000000U);
+        } else {
+            BOOST_CHECK(value.script == scriptP2PK);
+            BOOST_CHECK_EQUAL(value.satoshis, 123456789);
+            BOOST_CHECK_EQUAL(value.blockHeight, 200);
+        }
+    }
+
+    // New entries go straight to the compact format and erase cleanly
+    CAddressIndexKey key4(1, addressHash, 300, 1, GetRandHash(), 0, false);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAdd(1, std::make_pair(key4, (CAmount)COIN));
+    BOOST_CHECK(indexesdb.WriteAddressIndex(vAdd));
+    BOOST_CHECK(!indexesdb.Exists(std::make_pair('a', key4)));
+    BOOST_CHECK(indexesdb.EraseAddressIndex(std::vector<std::pair<CAddressIndexKey, CAmount> >(1, std::make_pair(key1, (CAmount)5 * COIN))));
+    addressIndex.clear();
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 3U);
+    BOOST_CHECK(addressIndex[1].first.txhash == key4.txhash);
+}
+
+BOOST_FIXTURE_TEST_CASE(dbwrapper_index_build, TestingSetup)
+{
+    CIndexesDB indexesdb(1 << 20, true, false);
+    uint160 addressHash = uint160(std::vector<unsigned char>(20, 0x53));
+    CAddressIndexKey keyStale(1, addressHash, 5, 0, GetRandHash(), 0, false);
+    BOOST_CHECK(indexesdb.Write(std::make_pair('a', keyStale), (CAmount)COIN));
+
+    CIndexBuildState build;
+    BOOST_CHECK(indexesdb.ReadIndexBuild(build));
+    BOOST_CHECK(build.IsNull());
+
+    // Starting a build clears what the index held before
+    build.fAddressIndex = true;
+    BOOST_CHECK(indexesdb.StartIndexBuild(build));
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex));
+    BOOST_CHECK(addressIndex.empty());
+
+    uint256 hashBlock = GetRandHash();
+    std::shared_ptr<CIndexUpdate> update = std::make_shared<CIndexUpdate>(hashBlock);
+    update->vAddressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, 7, 1, GetRandHash(), 0, false), (CAmount)2 * COIN));
+    build.hashBlock = hashBlock;
+    BOOST_CHECK(indexesdb.WriteIndexBuild(std::vector<std::shared_ptr<const CIndexUpdate> >(1, update), build));
+
+    CIndexBuildState buildRead;
+    BOOST_CHECK(indexesdb.ReadIndexBuild(buildRead));
+    BOOST_CHECK(buildRead.fAddressIndex && !buildRead.fSpentIndex);
+    BOOST_CHECK(buildRead.hashBlock == hashBlock);
+    BOOST_CHECK(indexesdb.ReadAddressIndex(addressHash, 1, addressIndex));
+    BOOST_CHECK_EQUAL(addressIndex.size(), 1U);
+    CAddressBalance balance;
+    BOOST_CHECK(indexesdb.ReadAddressBalance(addressHash, 1, balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, 2 * COIN);
+
+    // Finishing drops the record and marks the indexes written up to the tip
+    uint256 hashTip = GetRandHash();
+    BOOST_CHECK(indexesdb.FinishIndexBuild(hashTip));
+    BOOST_CHECK(indexesdb.ReadIndexBuild(buildRead));
+    BOOST_CHECK(buildRead.IsNull());
+    uint256 hashBest;
+    BOOST_CHECK(indexesdb.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == hashTip);
+}
+
+// Updates queued under a WriteHold stay queued until it ends, unless the flush is synced
+BOOST_FIXTURE_TEST_CASE(dbwrapper_index_write_hold, TestingSetup)
+{
+    CIndexesDB indexesdb(1 << 20, true, false);
+    CSpentIndexKey spentKey(GetRandHash(), 0);
+    std::shared_ptr<CIndexUpdate> update1 = std::make_shared<CIndexUpdate>(GetRandHash());
+    update1->vSpentIndex.push_back(std::make_pair(spentKey, CSpentIndexValue(GetRandHash(), 0, 10, COIN, 1, uint160())));
+    std::shared_ptr<CIndexUpdate> undo1 = std::make_shared<CIndexUpdate>(GetRandHash());
+    undo1->vSpentIndex.push_back(std::make_pair(spentKey, CSpentIndexValue()));
+    std::shared_ptr<CIndexUpdate> update2 = std::make_shared<CIndexUpdate>(GetRandHash());
+
+    BOOST_CHECK(indexesdb.QueueUpdate(update1));
+    uint256 hashBest;
+    CSpentIndexValue spentValue;
+    {
+        CIndexesDB::WriteHold hold(&indexesdb);
+        BOOST_CHECK(indexesdb.QueueUpdate(undo1));
+        BOOST_CHECK(indexesdb.QueueUpdate(update2));
+        BOOST_CHECK(indexesdb.Flush());
+        BOOST_CHECK_EQUAL(indexesdb.GetQueuedCount(), 2U);
+        BOOST_CHECK(indexesdb.ReadBestBlock(hashBest));
+        BOOST_CHECK(hashBest == update1->hashBlock);
+    }
+    BOOST_CHECK(indexesdb.Flush());
+    BOOST_CHECK_EQUAL(indexesdb.GetQueuedCount(), 0U);
+    BOOST_CHECK(indexesdb.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == update2->hashBlock);
+    BOOST_CHECK(!indexesdb.ReadSpentIndex(spentKey, spentValue));
+
+    // Reads write the held updates rather than miss them
+    {
+        CIndexesDB::WriteHold hold(&indexesdb);
+        BOOST_CHECK(indexesdb.QueueUpdate(update1));
+        BOOST_CHECK(indexesdb.ReadSpentIndex(spentKey, spentValue));
+        BOOST_CHECK_EQUAL(indexesdb.GetQueuedCount(), 0U);
+        BOOST_CHECK(indexesdb.QueueUpdate(undo1));
+    }
+
+    CIndexesDB::WriteHold hold(&indexesdb);
+    BOOST_CHECK(indexesdb.QueueUpdate(update1));
+    BOOST_CHECK(indexesdb.Flush(true));
+    BOOST_CHECK_EQUAL(indexesdb.GetQueuedCount(), 0U);
+    BOOST_CHECK(indexesdb.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == update1->hashBlock);
+}
+
+// A batched spent index read finds the same entries as one read per key, whatever their order
+BOOST_FIXTURE_TEST_CASE(dbwrapper_spent_index_batch, TestingSetup)
+{
+    CIndexesDB indexesdb(1 << 20, true, false);
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+    std::shared_ptr<CIndexUpdate> update = std::make_shared<CIndexUpdate>(GetRandHash());
+    // Output 256 sorts before output 1 on disk, being stored little-endian
+    const unsigned int vSpent[] = {0, 1, 256, 3};
+    for (unsigned int n : vSpent)
+        update->vSpentIndex.push_back(std::make_pair(CSpentIndexKey(txid1, n), CSpentIndexValue(GetRandHash(), n, 10, COIN, 1, uint160())));
+    update->vSpentIndex.push_back(std::make_pair(CSpentIndexKey(txid2, 7), CSpentIndexValue(GetRandHash(), 0, 11, COIN, 2, uint160())));
+    BOOST_CHECK(indexesdb.QueueUpdate(update));
+
+    std::vector<CSpentIndexKey> keys;
+    keys.push_back(CSpentIndexKey(txid2, 7));
+    keys.push_back(CSpentIndexKey(txid1, 256));
+    keys.push_back(CSpentIndexKey(txid1, 2));
+    keys.push_back(CSpentIndexKey(txid1, 0));
+    keys.push_back(CSpentIndexKey(GetRandHash(), 0));
+    keys.push_back(CSpentIndexKey(txid1, 1));
+    keys.push_back(CSpentIndexKey(txid2, 8));
+    keys.push_back(CSpentIndexKey(txid1, 3));
+    std::vector<CSpentIndexValue> values;
+    BOOST_CHECK(indexesdb.ReadSpentIndexes(keys, values));
+    BOOST_CHECK_EQUAL(values.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        CSpentIndexValue value;
+        bool fFound = indexesdb.ReadSpentIndex(keys[i], value);
+        BOOST_CHECK_EQUAL(fFound, !values[i].IsNull());
+        if (fFound) {
+            BOOST_CHECK(values[i].txid == value.txid);
+            BOOST_CHECK_EQUAL(values[i].blockHeight, value.blockHeight);
+        }
+    }
+    BOOST_CHECK(values[2].IsNull() && values[4].IsNull() && values[6].IsNull());
+    BOOST_CHECK_EQUAL(values[1].inputIndex, 256U);
+}
+
+BOOST_AUTO_TEST_CASE(block_index_snapshot)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(ph / "blocks");
+    ClearDatadirCache();
+    ForceSetArg("-datadir", ph.string());
+
+    // A short chain with one fork
+    std::vector<uint256> hashes;
+    std::map<uint256, CBlockIndex*> mapIn;
+    std::vector<const CBlockIndex*> vIn;
+    for (int i = 0; i < 10; i++) {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->pprev = i == 0 ? NULL : i == 9 ? mapIn[hashes[5]] : mapIn[hashes[i - 1]];
+        pindex->nHeight = pindex->pprev ? pindex->pprev->nHeight + 1 : 0;
+        pindex->nVersion = 4;
+        pindex->hashMerkleRoot = GetRandHash();
+        pindex->nTime = 1500000000 + i;
+        pindex->nBits = 0x1e0fffff;
+        pindex->nNonce = i;
+        pindex->nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+        pindex->nFile = i / 4;
+        pindex->nDataPos = 1000 * i;
+        pindex->nTx = i + 1;
+        pindex->nMoneySupply = 50 * COIN * i;
+        pindex->nStakeModifier = GetRandHash();
+        hashes.push_back(CDiskBlockIndex(pindex).GetBlockHash());
+        mapIn[hashes.back()] = pindex;
+        pindex->phashBlock = &mapIn.find(hashes.back())->first;
+        vIn.push_back(pindex);
+    }
+
+    std::map<uint256, CBlockIndex*> mapOut;
+    auto insert = [&mapOut](const uint256& hash) -> CBlockIndex* {
+        if (hash.IsNull())
+            return NULL;
+        CBlockIndex*& pindex = mapOut[hash];
+        if (!pindex) {
+            pindex = new CBlockIndex();
+            pindex->phashBlock = &mapOut.find(hash)->first;
+        }
+        return pindex;
+    };
+
+    {
+        CBlockTreeDB blocktree(1 << 20, true);
+        std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+        BOOST_CHECK(blocktree.WriteBatchSync(vFiles, 0, vIn));
+        BOOST_CHECK(blocktree.WriteIndexSnapshot(vIn));
+        BOOST_CHECK(boost::filesystem::exists(ph / "blocks" / "index.snapshot"));
+
+        // Loaded from the snapshot, which is used up by it
+        BOOST_CHECK(blocktree.LoadBlockIndexGuts(insert));
+        BOOST_CHECK(!boost::filesystem::exists(ph / "blocks" / "index.snapshot"));
+        BOOST_CHECK_EQUAL(mapOut.size(), mapIn.size());
+        for (const std::pair<const uint256, CBlockIndex*>& item : mapIn) {
+            const CBlockIndex* pin = item.second;
+            const CBlockIndex* pout = mapOut[item.first];
+            BOOST_CHECK(pout->GetBlockHash() == pin->GetBlockHash());
+            BOOST_CHECK(pout->pprev == (pin->pprev ? mapOut[pin->pprev->GetBlockHash()] : NULL));
+            BOOST_CHECK_EQUAL(pout->nHeight, pin->nHeight);
+            BOOST_CHECK_EQUAL(pout->nFile, pin->nFile);
+            BOOST_CHECK_EQUAL(pout->nDataPos, pin->nDataPos);
+            BOOST_CHECK_EQUAL(pout->nStatus, pin->nStatus);
+            BOOST_CHECK_EQUAL(pout->nTx, pin->nTx);
+            BOOST_CHECK_EQUAL(pout->nMoneySupply, pin->nMoneySupply);
+            BOOST_CHECK(pout->nStakeModifier == pin->nStakeModifier);
+        }
+
+        // A snapshot that does not match the database is ignored
+        BOOST_CHECK(blocktree.WriteIndexSnapshot(std::vector<const CBlockIndex*>(vIn.begin(), vIn.begin() + 3)));
+        {
+            FILE* file = fopen((ph / "blocks" / "index.snapshot").string().c_str(), "rb+");
+            BOOST_REQUIRE(file);
+            fseek(file, 60, SEEK_SET);
+            fputc(0xff, file);
+            fclose(file);
+        }
+        for (std::pair<const uint256, CBlockIndex*>& item : mapOut)
+            delete item.second;
+        mapOut.clear();
+        BOOST_CHECK(blocktree.LoadBlockIndexGuts(insert));
+        BOOST_CHECK_EQUAL(mapOut.size(), mapIn.size());
+    }
+
+    for (std::pair<const uint256, CBlockIndex*>& item : mapOut)
+        delete item.second;
+    for (std::pair<const uint256, CBlockIndex*>& item : mapIn)
+        delete item.second;
+    ClearDatadirCache();
+    boost::filesystem::remove_all(ph);
+}
+
+BOOST_AUTO_TEST_CASE(compact_txindex)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+
+    // Two txids sharing the 8 bytes the compact index is keyed by
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+    memcpy(txid2.begin(), txid1.begin(), 8);
+    uint256 txid3 = GetRandHash();
+    std::vector<CBlockTxPos> vPos;
+    BOOST_CHECK(!blocktree.ReadCompactTxIndex(txid1, vPos));
+
+    std::vector<std::pair<uint256, unsigned int> > list;
+    list.push_back(std::make_pair(txid1, 1U));
+    list.push_back(std::make_pair(txid3, 200U));
+    BOOST_CHECK(blocktree.WriteCompactTxIndex(10, list));
+    list.clear();
+    list.push_back(std::make_pair(txid2, 300U));
+    BOOST_CHECK(blocktree.WriteCompactTxIndex(12, list));
+
+    // Both colliding txids are candidates, in the order they were written
+    BOOST_CHECK(blocktree.ReadCompactTxIndex(txid2, vPos));
+    BOOST_REQUIRE_EQUAL(vPos.size(), 2U);
+    BOOST_CHECK_EQUAL(vPos[0].nHeight, 10);
+    BOOST_CHECK_EQUAL(vPos[0].nTxOffset, 1U);
+    BOOST_CHECK_EQUAL(vPos[1].nHeight, 12);
+    BOOST_CHECK_EQUAL(vPos[1].nTxOffset, 300U);
+    BOOST_CHECK(blocktree.ReadCompactTxIndex(txid3, vPos));
+    BOOST_REQUIRE_EQUAL(vPos.size(), 1U);
+    BOOST_CHECK_EQUAL(vPos[0].nTxOffset, 200U);
+
+    // A block replacing height 12 after a reorg drops the entry left behind
+    list.clear();
+    list.push_back(std::make_pair(txid1, 5U));
+    BOOST_CHECK(blocktree.WriteCompactTxIndex(12, list));
+    BOOST_CHECK(blocktree.ReadCompactTxIndex(txid1, vPos));
+    BOOST_REQUIRE_EQUAL(vPos.size(), 2U);
+    BOOST_CHECK_EQUAL(vPos[0].nHeight, 10);
+    BOOST_CHECK_EQUAL(vPos[1].nHeight, 12);
+    BOOST_CHECK_EQUAL(vPos[1].nTxOffset, 5U);
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    const char* argv[] = {"ignored", "-dboption=indexes.compression=1", "-dboption=indexes.maxopenfiles=500",
+                          "-dboption=chainstate.bloombits=0", "-dboption=blockindex.writebuffer=1"};
+    ParseParameters(5, (char**)argv);
+    std::string strError;
+    CDBOptions indexes, chainstate, blockindex;
+    BOOST_CHECK(indexes.ParseArgs("indexes", strError));
+    BOOST_CHECK(indexes.fCompression);
+    BOOST_CHECK_EQUAL(indexes.nMaxOpenFiles, 500);
+    BOOST_CHECK_EQUAL(indexes.nBloomBitsPerKey, 10);
+    BOOST_CHECK(chainstate.ParseArgs("chainstate", strError));
+    BOOST_CHECK_EQUAL(chainstate.nBloomBitsPerKey, 0);
+    BOOST_CHECK(!chainstate.fCompression);
+    BOOST_CHECK(blockindex.ParseArgs("blockindex", strError));
+    BOOST_CHECK_EQUAL(blockindex.nWriteBufferSize, 1U << 20);
+
+    // Write buffers are bounded by half the cache, the rest is block cache
+    BOOST_CHECK_EQUAL(blockindex.GetWriteBufferSize(8 << 20), 1U << 20);
+    BOOST_CHECK_EQUAL(blockindex.GetBlockCacheSize(8 << 20), 6U << 20);
+    BOOST_CHECK_EQUAL(blockindex.GetWriteBufferSize(1 << 20), 1U << 18);
+
+    const char* argvBad[] = {"ignored", "-dboption=indexes.cache=1"};
+    ParseParameters(2, (char**)argvBad);
+    BOOST_CHECK(!CDBOptions().ParseArgs("indexes", strError));
+    ParseParameters(0, (char**)argv);
+
+    // Databases sharing a block cache can be closed independently
+    CDBOptions shared;
+    shared.sharedBlockCache = NewSharedBlockCache(1 << 20);
+    shared.fCompression = true;
+    uint256 in = GetRandHash(), res;
+    CDBWrapper* pdbw1 = new CDBWrapper(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path(), 1 << 20, true, false, false, shared);
+    CDBWrapper dbw2(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path(), 1 << 20, true, false, false, shared);
+    BOOST_CHECK(pdbw1->Write('k', in));
+    BOOST_CHECK(dbw2.Write('k', in));
+    delete pdbw1;
+    shared.sharedBlockCache.reset();
+    BOOST_CHECK(dbw2.Read('k', res));
+    BOOST_CHECK(res == in);
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_stats)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, false);
+    uint256 in = GetRandHash(), res;
+
+    CDBBatch batch(dbw);
+    batch.Write('a', in);
+    batch.Erase('b');
+    // Header and length bytes, a one byte key and a 32 byte value; the erase has no value
+    BOOST_CHECK_EQUAL(batch.SizeEstimate(), 3U + 1 + 32 + 2 + 1);
+    BOOST_CHECK(dbw.WriteBatch(batch));
+    BOOST_CHECK(dbw.Read('a', res));
+    BOOST_CHECK(!dbw.Exists('b'));
+
+    CDBStats stats = dbw.GetStats();
+    BOOST_CHECK_EQUAL(stats.nReads, 2U);
+    BOOST_CHECK_EQUAL(stats.nBatches, 1U);
+    BOOST_CHECK_EQUAL(stats.nBatchBytes, batch.SizeEstimate());
+    BOOST_CHECK(stats.nStallMicros <= stats.nWriteMicros);
+
+    BOOST_CHECK(!dbw.GetProperty("leveldb.stats").empty());
+    BOOST_CHECK(dbw.GetProperty("leveldb.nonexistent").empty());
+}
+
+/** Replay what reader has on db, returning how many records there were */
+static int ApplyReplicationLog(CReplicationLogReader& reader, CDBWrapper& db, std::string& strError)
+{
+    int nRecords = 0;
+    CReplicationRecord record;
+    while (reader.Next(record, strError)) {
+        CDBBatch batch(db);
+        for (const CReplicationOp& op : record.vOps) {
+            if (op.fErase)
+                batch.EraseRaw(op.strKey);
+            else
+                batch.WriteRaw(op.strKey, op.strValue);
+        }
+        db.WriteBatch(batch);
+        nRecords++;
+    }
+    return nRecords;
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_replication)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::path pathLog = ph / "replication";
+    boost::filesystem::create_directories(ph);
+    CDBWrapper primary(ph / "primary", (1 << 20), true, false, false);
+    CDBWrapper replica(ph / "replica", (1 << 20), true, false, false);
+    std::vector<std::pair<std::string, CDBWrapper*> > vDBs;
+    vDBs.push_back(std::make_pair(std::string("db"), &primary));
+    std::string strError;
+    int nValue = 0;
+
+    {
+        CReplicationLog log(pathLog, 1 << 20);
+        BOOST_CHECK(log.Open(vDBs));
+        BOOST_CHECK(primary.Write('a', 1));
+        CDBBatch batch(primary);
+        batch.Write('b', 2);
+        batch.Write('c', 3);
+        batch.Erase('a');
+        BOOST_CHECK(primary.WriteBatch(batch));
+        BOOST_CHECK_EQUAL(GetReplicationSeq(primary), 2U);
+
+        CReplicationLogReader reader(pathLog, 0);
+        BOOST_CHECK_EQUAL(ApplyReplicationLog(reader, replica, strError), 2);
+        BOOST_CHECK(strError.empty());
+        BOOST_CHECK(!replica.Exists('a'));
+        BOOST_CHECK(replica.Read('c', nValue) && nValue == 3);
+        BOOST_CHECK_EQUAL(GetReplicationSeq(replica), 2U);
+
+        // Records are there for the reader as soon as they are written
+        BOOST_CHECK(primary.Write('d', 4));
+        BOOST_CHECK_EQUAL(ApplyReplicationLog(reader, replica, strError), 1);
+        BOOST_CHECK(strError.empty());
+        BOOST_CHECK(replica.Read('d', nValue) && nValue == 4);
+        primary.SetReplicationLog(NULL, "");
+    }
+
+    {
+        // Reopened, the log goes on after the highest record the databases
+        // hold, in a segment of its own that readers move on to
+        CReplicationLog log(pathLog, 1 << 20);
+        BOOST_CHECK(log.Open(vDBs));
+        BOOST_CHECK(primary.Write('e', 5));
+        BOOST_CHECK_EQUAL(GetReplicationSeq(primary), 4U);
+        primary.SetReplicationLog(NULL, "");
+    }
+    BOOST_CHECK(boost::filesystem::exists(pathLog / "0000000000000004.log"));
+    CReplicationLogReader readerAll(pathLog, 0);
+    CDBWrapper replica2(ph / "replica2", (1 << 20), true, false, false);
+    BOOST_CHECK_EQUAL(ApplyReplicationLog(readerAll, replica2, strError), 4);
+    BOOST_CHECK(strError.empty());
+    BOOST_CHECK(replica2.Read('e', nValue) && nValue == 5);
+    BOOST_CHECK(!replica2.Exists('a'));
+
+    // A replica that needs records the log no longer has cannot go on
+    boost::filesystem::remove(pathLog / "0000000000000001.log");
+    CReplicationLogReader readerBehind(pathLog, 2);
+    BOOST_CHECK_EQUAL(ApplyReplicationLog(readerBehind, replica2, strError), 0);
+    BOOST_CHECK(!strError.empty());
+    boost::filesystem::remove_all(ph);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "primitives/block.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -45,6 +46,20 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3x4)
+{
+    // Each lane agrees with MurmurHash3 for every length of tail
+    std::vector<unsigned char> vData = ParseHex("00112233445566778899aabbccddeeff00");
+    for (size_t nLen = 0; nLen <= vData.size(); nLen++) {
+        uint32_t nSeeds[4] = {0x00000000, 0xFBA4C795, 0xffffffff, 0x12345678};
+        uint32_t nHashes[4];
+        MurmurHash3x4(nSeeds, vData.data(), nLen, nHashes);
+        std::vector<unsigned char> vPrefix(vData.begin(), vData.begin() + nLen);
+        for (int j = 0; j < 4; j++)
+            BOOST_CHECK_EQUAL(nHashes[j], MurmurHash3(nSeeds[j], vPrefix));
+    }
+}
+
 /*
    SipHash-2-4 output with
    k = 00 01 02 ...
@@ -104,6 +119,7 @@ BOOST_AUTO_TEST_CASE(siphash)
     BOOST_CHECK_EQUAL(hasher.Finalize(),  0xe612a3cb9ecba951ull);
 
     BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100"), 0x23222120), siphash_4_2_testvec[36]);
 
     // Check test vectors from spec, one byte at a time
     CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
@@ -130,4 +146,23 @@ BOOST_AUTO_TEST_CASE(siphash)
     BOOST_CHECK_EQUAL(SipHashUint256(1, 2, ss.GetHash()), 0x79751e980c2a0a35ULL);
 }
 
+BOOST_AUTO_TEST_CASE(serializehashfixed)
+{
+    CBlockHeader header;
+    header.nVersion = 7;
+    header.hashPrevBlock = uint256S("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+    header.hashMerkleRoot = uint256S("fedcba9876543210fedcba9876543210fedcba9876543210fedcba9876543210");
+    header.nTime = 1500000000;
+    header.nBits = 0x1d00ffff;
+    header.nNonce = 42;
+    BOOST_CHECK(header.GetHash() == SerializeHash(header));
+    BOOST_CHECK(SerializeHashFixed<80>(header) == SerializeHash(header));
+
+    COutPoint prevout(header.hashPrevBlock, 3);
+    BOOST_CHECK(SerializeHashFixed<36>(prevout) == SerializeHash(prevout));
+    // A larger buffer is fine, a smaller one is not
+    BOOST_CHECK(SerializeHashFixed<64>(prevout) == SerializeHash(prevout));
+    BOOST_CHECK_THROW(SerializeHashFixed<35>(prevout), std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -98,4 +98,47 @@ BOOST_AUTO_TEST_CASE(limitedmap_test)
     BOOST_CHECK(map.empty());
 }
 
+/** Puts every key in one of two probe sequences */
+struct CollidingHasher {
+    size_t operator()(int k) const { return k & 1; }
+};
+
+BOOST_AUTO_TEST_CASE(limitedmap_value_order)
+{
+    limitedmap<int, int, CollidingHasher> map(100);
+    for (int i = 0; i < 100; i++)
+        map.insert(std::make_pair(i, 1000 - i));
+
+    // Erasing from the middle of the probe sequences keeps the rest findable
+    for (int i = 0; i < 100; i += 3)
+        map.erase(i);
+    BOOST_CHECK_EQUAL(map.size(), 66U);
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK_EQUAL(map.count(i), i % 3 ? 1U : 0U);
+        if (i % 3)
+            BOOST_CHECK_EQUAL(map.find(i)->second, 1000 - i);
+    }
+
+    // Iteration is by value, so highest key first
+    int nLast = 0;
+    for (limitedmap<int, int, CollidingHasher>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        BOOST_CHECK(it->second > nLast);
+        nLast = it->second;
+    }
+    BOOST_CHECK_EQUAL(map.begin()->first, 98);
+
+    // Raising a value moves its entry away from being dropped
+    map.update(map.find(98), 2000);
+    map.max_size(65);
+    BOOST_CHECK_EQUAL(map.count(98), 1U);
+    BOOST_CHECK_EQUAL(map.count(97), 0U);
+    BOOST_CHECK_EQUAL(map.begin()->first, 95);
+
+    // Full, a new entry drops the lowest even when it is lower itself
+    map.insert(std::make_pair(1000, 0));
+    BOOST_CHECK_EQUAL(map.size(), 65U);
+    BOOST_CHECK_EQUAL(map.count(95), 0U);
+    BOOST_CHECK_EQUAL(map.begin()->first, 1000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
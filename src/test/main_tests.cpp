@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "checkpoints.h"
 #include "validation.h"
 #include "net.h"
 
@@ -11,6 +12,8 @@
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
+extern CBlockIndex* AddToBlockIndex(const CBlockHeader& block);
+
 BOOST_FIXTURE_TEST_SUITE(main_tests, TestingSetup)
 
 // static void TestBlockSubsidyHalvings(const Consensus::Params& consensusParams)
@@ -73,4 +76,139 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+BOOST_AUTO_TEST_CASE(chain_timestamp_index)
+{
+    // Two blocks share a time, so the second gets a logical time one later;
+    // the genesis block is left out
+    unsigned int nTimes[] = {1000, 1010, 1010, 1030, 1040};
+    std::vector<CBlockIndex> vIndex(5);
+    std::vector<uint256> vHashes(5);
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vHashes[i] = GetRandHash();
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].nHeight = i;
+        vIndex[i].nTime = nTimes[i];
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+    }
+    CChain chain;
+    chain.SetTip(&vIndex[4]);
+
+    CChainTimestampIndex index;
+    index.Sync(chain);
+    BOOST_CHECK_EQUAL(index.size(), 4U);
+    std::vector<std::pair<uint256, unsigned int> > hashes;
+    index.Find(1031, 1011, hashes);
+    BOOST_CHECK_EQUAL(hashes.size(), 2U);
+    BOOST_CHECK(hashes[0].first == vHashes[2]);
+    BOOST_CHECK_EQUAL(hashes[0].second, 1011U);
+    BOOST_CHECK(hashes[1].first == vHashes[3]);
+
+    // Pages of one, each resuming after the last block of the one before
+    hashes.clear();
+    index.Find(2000, 0, hashes, 1);
+    BOOST_CHECK_EQUAL(hashes.size(), 1U);
+    BOOST_CHECK(hashes[0].first == vHashes[1]);
+    CTimestampIndexKey keyAfter(hashes[0].second, hashes[0].first);
+    hashes.clear();
+    index.Find(2000, 0, hashes, 2, &keyAfter);
+    BOOST_CHECK_EQUAL(hashes.size(), 2U);
+    BOOST_CHECK(hashes[0].first == vHashes[2]);
+    BOOST_CHECK(hashes[1].first == vHashes[3]);
+    keyAfter = CTimestampIndexKey(hashes[1].second, hashes[1].first);
+    hashes.clear();
+    index.Find(2000, 0, hashes, 2, &keyAfter);
+    BOOST_CHECK_EQUAL(hashes.size(), 1U);
+    BOOST_CHECK(hashes[0].first == vHashes[4]);
+
+    // A reorg to a fork at height 3 replaces the old tip
+    CBlockIndex fork;
+    uint256 hashFork = GetRandHash();
+    fork.phashBlock = &hashFork;
+    fork.nHeight = 3;
+    fork.nTime = 1050;
+    fork.pprev = &vIndex[2];
+    chain.SetTip(&fork);
+    index.Sync(chain);
+    BOOST_CHECK_EQUAL(index.size(), 3U);
+    hashes.clear();
+    index.Find(2000, 1030, hashes);
+    BOOST_CHECK_EQUAL(hashes.size(), 1U);
+    BOOST_CHECK(hashes[0].first == hashFork);
+}
+
+BOOST_AUTO_TEST_CASE(checkpoint_stake_modifiers)
+{
+    uint256 hash10 = GetRandHash(), hash20 = GetRandHash(), nModifier10 = GetRandHash();
+    CCheckpointData data;
+    data.mapCheckpoints[10] = hash10;
+    data.mapCheckpoints[20] = hash20;
+    data.mapStakeModifiers[10] = nModifier10;
+
+    BOOST_CHECK_EQUAL(Checkpoints::GetLastCheckpointHeight(data), 20);
+    BOOST_CHECK(Checkpoints::CheckBlock(data, 10, hash10));
+    BOOST_CHECK(!Checkpoints::CheckBlock(data, 10, hash20));
+    BOOST_CHECK(Checkpoints::CheckBlock(data, 11, hash20));
+
+    // Only heights with a modifier given are held to one
+    BOOST_CHECK(Checkpoints::CheckStakeModifier(data, 10, nModifier10));
+    BOOST_CHECK(!Checkpoints::CheckStakeModifier(data, 10, GetRandHash()));
+    BOOST_CHECK(Checkpoints::CheckStakeModifier(data, 20, GetRandHash()));
+
+    BOOST_CHECK_EQUAL(Checkpoints::GetLastCheckpointHeight(CCheckpointData()), 0);
+}
+
+BOOST_FIXTURE_TEST_CASE(block_connect_stats, TestChain100Setup)
+{
+    LOCK(cs_main);
+    std::vector<CBlockConnectStats> vStats = GetRecentBlockConnectStats(5);
+    BOOST_CHECK_EQUAL(vStats.size(), 5U);
+    for (size_t i = 0; i < vStats.size(); i++) {
+        BOOST_CHECK_EQUAL(vStats[i].nHeight, chainActive.Height() - 4 + (int)i);
+        BOOST_CHECK(vStats[i].hash == chainActive[vStats[i].nHeight]->GetBlockHash());
+        BOOST_CHECK(vStats[i].nTx >= 1);
+        BOOST_CHECK(vStats[i].nTimeTotal >= vStats[i].nTimeConnectTotal);
+    }
+    BOOST_CHECK(GetRecentBlockConnectStats(BLOCK_CONNECT_STATS_SIZE + 1).size() <= BLOCK_CONNECT_STATS_SIZE);
+
+    CBlockConnectStats stats;
+    BOOST_CHECK(GetBlockConnectStats(chainActive.Tip()->GetBlockHash(), stats));
+    BOOST_CHECK_EQUAL(stats.nHeight, chainActive.Height());
+    BOOST_CHECK(!GetBlockConnectStats(GetRandHash(), stats));
+}
+
+BOOST_FIXTURE_TEST_CASE(chain_tips_maintained, TestChain100Setup)
+{
+    LOCK(cs_main);
+    std::vector<std::pair<const CBlockIndex*, const CBlockIndex*> > vTips = GetChainTips();
+    BOOST_CHECK_EQUAL(vTips.size(), 1U);
+    BOOST_CHECK(vTips[0].first == chainActive.Tip());
+    BOOST_CHECK(vTips[0].second == chainActive.Tip());
+
+    // A two block fork off height 90: only its second block is a tip
+    const CBlockIndex* pindexFork = chainActive[90];
+    CBlockHeader header;
+    header.nVersion = chainActive.Tip()->nVersion;
+    header.hashPrevBlock = pindexFork->GetBlockHash();
+    header.nTime = pindexFork->nTime + 1;
+    header.nBits = pindexFork->nBits;
+    header.nNonce = GetRandInt(1 << 30);
+    CBlockIndex* pindex1 = AddToBlockIndex(header);
+    header.hashPrevBlock = pindex1->GetBlockHash();
+    header.nTime++;
+    CBlockIndex* pindex2 = AddToBlockIndex(header);
+
+    for (int i = 0; i < 2; i++) {
+        // The second time round the fork points come from the cache
+        vTips = GetChainTips();
+        BOOST_CHECK_EQUAL(vTips.size(), 2U);
+        for (const std::pair<const CBlockIndex*, const CBlockIndex*>& tip : vTips) {
+            BOOST_CHECK(tip.first != pindex1);
+            if (tip.first == pindex2)
+                BOOST_CHECK(tip.second == pindexFork);
+            else
+                BOOST_CHECK(tip.first == chainActive.Tip() && tip.second == chainActive.Tip());
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -429,6 +429,103 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     CheckSort<ancestor_score>(pool, sortedOrder);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolChainReaddTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A chain of 25 transactions, each spending the previous one
+    const int nChain = 25;
+    std::vector<CMutableTransaction> vChain(nChain);
+    for (int i = 0; i < nChain; i++) {
+        vChain[i].vin.resize(1);
+        vChain[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0) {
+            vChain[i].vin[0].prevout.hash = vChain[i - 1].GetHash();
+            vChain[i].vin[0].prevout.n = 0;
+        }
+        vChain[i].vout.resize(1);
+        vChain[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vChain[i].vout[0].nValue = (100 - i) * COIN;
+    }
+
+    // The tail is in the mempool first, as after a block with the head is
+    // disconnected, and the head is re-added after it
+    const int nReadd = 5;
+    for (int i = nReadd; i < nChain; i++)
+        pool.addUnchecked(vChain[i].GetHash(), entry.Fee(1000).FromTx(vChain[i]));
+    std::vector<uint256> vHashesToUpdate;
+    for (int i = 0; i < nReadd; i++) {
+        pool.addUnchecked(vChain[i].GetHash(), entry.Fee(1000).FromTx(vChain[i]));
+        vHashesToUpdate.push_back(vChain[i].GetHash());
+    }
+    BOOST_CHECK_EQUAL(pool.mapTx.find(vChain[0].GetHash())->GetCountWithDescendants(), nReadd);
+
+    pool.UpdateTransactionsFromBlock(vHashesToUpdate);
+    for (int i = 0; i < nChain; i++) {
+        CTxMemPool::txiter it = pool.mapTx.find(vChain[i].GetHash());
+        BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), nChain - i);
+        BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), i + 1);
+        BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), (nChain - i) * it->GetTxSize());
+    }
+
+    CTxMemPool::setEntries setAncestors, setDescendants;
+    std::string dummy;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*pool.mapTx.find(vChain[nChain - 1].GetHash()), setAncestors, nChain, 1000000, nChain, 1000000, dummy));
+    BOOST_CHECK_EQUAL(setAncestors.size(), nChain - 1);
+    // One more ancestor than the limit allows
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*pool.mapTx.find(vChain[nChain - 1].GetHash()), setAncestors, nChain - 1, 1000000, nChain, 1000000, dummy));
+    pool.CalculateDescendants(pool.mapTx.find(vChain[0].GetHash()), setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), nChain);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPriorityIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // tx1 has a fixed priority, tx2 has none yet but spends in-chain coins
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Priority(1000.0).Height(1).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Priority(0.0).Height(1).FromTx(tx2, &pool));
+
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    pool.UpdatePriorities(1);
+    CheckSort<priority_score>(pool, sortedOrder);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2.GetHash())->GetCachedPriority(), 0.0);
+
+    // One block later tx2 has aged past tx1
+    pool.UpdatePriorities(2);
+    const CTxMemPoolEntry& entry2 = *pool.mapTx.find(tx2.GetHash());
+    BOOST_CHECK_EQUAL(entry2.GetCachedPriority(), entry2.GetPriority(2));
+    std::swap(sortedOrder[0], sortedOrder[1]);
+    CheckSort<priority_score>(pool, sortedOrder);
+
+    // A priority delta moves tx1 back in front
+    pool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 1e12, 0);
+    std::swap(sortedOrder[0], sortedOrder[1]);
+    CheckSort<priority_score>(pool, sortedOrder);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx1.GetHash())->GetCachedPriority(), 1000.0 + 1e12);
+
+    // New entries join at the height the pool is at
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_13 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Priority(0.0).Height(1).FromTx(tx3, &pool));
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx3.GetHash())->GetCachedPriorityHeight(), 2U);
+}
 
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
@@ -584,4 +681,320 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // txA and its child txB are old, txB's child txC is new but goes with them;
+    // txD is new and stays
+    std::vector<CMutableTransaction> txs(4);
+    for (size_t i = 0; i < txs.size(); i++) {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].scriptSig = CScript() << (int)i;
+        if (i > 0 && i < 3)
+            txs[i].vin[0].prevout = COutPoint(txs[i - 1].GetHash(), 0);
+        txs[i].vout.resize(1);
+        txs[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i].vout[0].nValue = COIN;
+        pool.addUnchecked(txs[i].GetHash(), entry.Fee(1000).Time(i < 2 ? 100 : 200).FromTx(txs[i], &pool));
+    }
+    BOOST_CHECK_EQUAL(pool.Expire(150), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txs[3].GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(150), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolBlockRemovalTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // txA is mined, its child txB stays
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(1);
+    txA.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txA.vout[0].nValue = 10 * COIN;
+    CMutableTransaction txB;
+    txB.vin.resize(1);
+    txB.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txB.vout.resize(1);
+    txB.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txB.vout[0].nValue = 9 * COIN;
+
+    // txC is double spent by txE in the block, which takes its child txD too
+    CMutableTransaction txC;
+    txC.vin.resize(1);
+    txC.vin[0].scriptSig = CScript() << OP_12;
+    txC.vin[0].prevout = COutPoint(uint256S("0x01"), 0);
+    txC.vout.resize(1);
+    txC.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    txC.vout[0].nValue = 10 * COIN;
+    CMutableTransaction txD;
+    txD.vin.resize(1);
+    txD.vin[0].prevout = COutPoint(txC.GetHash(), 0);
+    txD.vout.resize(1);
+    txD.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    txD.vout[0].nValue = 9 * COIN;
+    CMutableTransaction txE = txC;
+    txE.vout[0].nValue = 8 * COIN;
+
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000).FromTx(txA));
+    pool.addUnchecked(txB.GetHash(), entry.Fee(1000).FromTx(txB));
+    pool.addUnchecked(txC.GetHash(), entry.Fee(1000).FromTx(txC));
+    pool.addUnchecked(txD.GetHash(), entry.Fee(1000).FromTx(txD));
+    pool.PrioritiseTransaction(txC.GetHash(), txC.GetHash().ToString(), 0, 5000);
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(txA));
+    vtx.push_back(MakeTransactionRef(txE));
+    pool.removeForBlock(vtx, 1);
+
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txB.GetHash()));
+    CTxMemPool::txiter it = pool.mapTx.find(txB.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), it->GetTxSize());
+    BOOST_CHECK(pool.GetMemPoolParents(it).empty());
+
+    // The conflict's prioritisation is gone with it
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    pool.ApplyDeltas(txC.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSigOpCostsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(1);
+    txA.vout[0].scriptPubKey = CScript() << OP_CHECKSIG;
+    txA.vout[0].nValue = 10 * COIN;
+    BOOST_CHECK_EQUAL(CTransaction(txA).GetLegacySigOpCount(), 1U);
+    CMutableTransaction txB = txA;
+    txB.vin[0].scriptSig = CScript() << OP_12;
+    txB.vin[0].scriptWitness.stack.push_back(std::vector<unsigned char>(1, 1));
+    CMutableTransaction txC = txA;
+    txC.vout[0].nValue = 9 * COIN;
+
+    CTransactionRef ptxB = MakeTransactionRef(txB);
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000).SigOpsCost(4).FromTx(txA));
+    pool.addUnchecked(ptxB->GetHash(), CTxMemPoolEntry(ptxB, 1000, 0, 0.0, 1, 0, false, 8, LockPoints()));
+
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(txA));
+    vtx.push_back(ptxB);
+    vtx.push_back(MakeTransactionRef(txC));
+    std::vector<int64_t> vCosts = pool.GetSigOpCosts(vtx);
+    BOOST_CHECK_EQUAL(vCosts.size(), 3U);
+    BOOST_CHECK_EQUAL(vCosts[0], 4);
+    BOOST_CHECK_EQUAL(vCosts[1], 8);
+    BOOST_CHECK_EQUAL(vCosts[2], -1);
+
+    // The same txid with another witness is counted afresh
+    CMutableTransaction txB2 = txB;
+    txB2.vin[0].scriptWitness.stack[0][0] = 2;
+    vtx.assign(1, MakeTransactionRef(txB2));
+    BOOST_CHECK(vtx[0]->GetHash() == ptxB->GetHash());
+    BOOST_CHECK_EQUAL(pool.GetSigOpCosts(vtx)[0], -1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolCoinsOverlayTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CCoinsView viewEmpty;
+
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txA.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txA.vout[i].nValue = 10 * COIN;
+    }
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000).FromTx(txA));
+    COutPoint outpoint(txA.GetHash(), 1);
+
+    // A coin looked up once stays for the next transaction
+    uint256 hashTip = uint256S("0x01");
+    CCoinsViewMemPoolOverlay& overlay = pool.GetCoinsOverlay(hashTip);
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(&viewEmpty, pool);
+        overlay.Attach(viewMemPool);
+        BOOST_CHECK(overlay.HaveCoin(outpoint));
+        overlay.Detach();
+    }
+    BOOST_CHECK(pool.GetCoinsOverlay(hashTip).HaveCoinInCache(outpoint));
+    BOOST_CHECK_EQUAL(overlay.AccessCoin(outpoint).nHeight, MEMPOOL_HEIGHT);
+
+    // A new tip starts it afresh, as does running over its memory limit
+    BOOST_CHECK(!pool.GetCoinsOverlay(uint256S("0x02")).HaveCoinInCache(outpoint));
+    overlay.Attach(viewEmpty);
+    BOOST_CHECK(!overlay.HaveCoin(outpoint));
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(&viewEmpty, pool);
+        overlay.Attach(viewMemPool);
+        BOOST_CHECK(overlay.HaveCoin(outpoint));
+        overlay.Detach();
+    }
+    BOOST_CHECK(!pool.GetCoinsOverlay(uint256S("0x02"), 0).HaveCoinInCache(outpoint));
+
+    // The outputs of a transaction leaving the pool go with it
+    {
+        LOCK(pool.cs);
+        CCoinsViewMemPool viewMemPool(&viewEmpty, pool);
+        overlay.Attach(viewMemPool);
+        BOOST_CHECK(overlay.HaveCoin(outpoint));
+        overlay.Detach();
+    }
+    pool.removeRecursive(txA);
+    BOOST_CHECK(!overlay.HaveCoinInCache(outpoint));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAddressIndexTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CCoinsView coinsDummy;
+    CCoinsViewCache view(&coinsDummy);
+
+    uint160 hashA(std::vector<unsigned char>(20, 0x61));
+    uint160 hashB(std::vector<unsigned char>(20, 0x62));
+    CScript scriptA = CScript() << OP_DUP << OP_HASH160 << ToByteVector(hashA) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptB = CScript() << OP_HASH160 << ToByteVector(hashB) << OP_EQUAL;
+
+    CMutableTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vout.resize(1);
+    txPrev.vout[0].scriptPubKey = scriptA;
+    txPrev.vout[0].nValue = 10 * COIN;
+    AddCoins(view, txPrev, 1);
+
+    // Pays B and sends change back to A
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx1.vout.resize(2);
+    tx1.vout[0].scriptPubKey = scriptB;
+    tx1.vout[0].nValue = 4 * COIN;
+    tx1.vout[1].scriptPubKey = scriptA;
+    tx1.vout[1].nValue = 5 * COIN;
+    AddCoins(view, tx1, 2);
+
+    // Spends the change to B
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 1);
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = scriptB;
+    tx2.vout[0].nValue = 3 * COIN;
+
+    size_t nUsageEmpty = pool.DynamicMemoryUsage();
+    pool.addAddressIndex(entry.FromTx(tx1), view);
+    size_t nUsageOne = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsageOne > nUsageEmpty);
+    pool.addAddressIndex(entry.FromTx(tx2), view);
+    size_t nUsageTwo = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsageTwo > nUsageOne);
+
+    // The breakdown accounts for all of the usage, most of it in the index here
+    MemPoolMemoryUsage usage = pool.GetMemoryUsage();
+    BOOST_CHECK_EQUAL(usage.tx.nUsage + usage.links.nUsage + usage.nextTx.nUsage + usage.deltas.nUsage +
+                      usage.txHashes.nUsage + usage.addressIndex.nUsage + usage.spentIndex.nUsage, nUsageTwo);
+    BOOST_CHECK_EQUAL(usage.addressIndex.nCount, 5U);
+    BOOST_CHECK_EQUAL(usage.addressIndex.nAdded, 5U);
+    BOOST_CHECK(usage.addressIndex.nUsage > 0);
+
+    std::vector<std::pair<uint160, int> > addressesA(1, std::make_pair(hashA, 1));
+    std::vector<std::pair<uint160, int> > addressesB(1, std::make_pair(hashB, 2));
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > results;
+    BOOST_CHECK(pool.getAddressIndex(addressesA, results));
+    BOOST_CHECK_EQUAL(results.size(), 3U);
+    results.clear();
+    BOOST_CHECK(pool.getAddressIndex(addressesB, results));
+    BOOST_CHECK_EQUAL(results.size(), 2U);
+
+    BOOST_CHECK(pool.removeAddressIndex(tx1.GetHash()));
+    results.clear();
+    BOOST_CHECK(pool.getAddressIndex(addressesA, results));
+    BOOST_CHECK_EQUAL(results.size(), 1U);
+    BOOST_CHECK(results[0].first.txhash == tx2.GetHash());
+    BOOST_CHECK_EQUAL(results[0].second.amount, -5 * COIN);
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsageTwo);
+
+    BOOST_CHECK(pool.removeAddressIndex(tx2.GetHash()));
+    results.clear();
+    BOOST_CHECK(pool.getAddressIndex(addressesB, results));
+    BOOST_CHECK(results.empty());
+
+    usage = pool.GetMemoryUsage();
+    BOOST_CHECK_EQUAL(usage.addressIndex.nCount, 0U);
+    BOOST_CHECK_EQUAL(usage.addressIndex.nRemoved, 5U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSequenceTest)
+{
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<uint256> vAdded, vRemoved;
+
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11 << i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL;
+    }
+
+    const uint64_t nStart = pool.GetSequence();
+    BOOST_CHECK(pool.GetChangesSince(nStart, vAdded, vRemoved));
+    BOOST_CHECK(vAdded.empty() && vRemoved.empty());
+    // Nothing before the pool was last cleared is known
+    BOOST_CHECK(!pool.GetChangesSince(nStart - 1, vAdded, vRemoved));
+    BOOST_CHECK(!pool.GetChangesSince(nStart + 1, vAdded, vRemoved));
+
+    pool.addUnchecked(tx[0].GetHash(), entry.FromTx(tx[0]));
+    pool.addUnchecked(tx[1].GetHash(), entry.FromTx(tx[1]));
+    BOOST_CHECK_EQUAL(pool.GetSequence(), nStart + 2);
+    const uint64_t nMiddle = pool.GetSequence();
+    pool.removeRecursive(tx[0]);
+    pool.addUnchecked(tx[2].GetHash(), entry.FromTx(tx[2]));
+    BOOST_CHECK_EQUAL(pool.GetSequence(), nStart + 4);
+
+    // tx[0] came and went, so only its removal shows
+    BOOST_CHECK(pool.GetChangesSince(nStart, vAdded, vRemoved));
+    BOOST_REQUIRE_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK(vAdded[0] == tx[1].GetHash());
+    BOOST_CHECK(vAdded[1] == tx[2].GetHash());
+    BOOST_REQUIRE_EQUAL(vRemoved.size(), 1U);
+    BOOST_CHECK(vRemoved[0] == tx[0].GetHash());
+
+    BOOST_CHECK(pool.GetChangesSince(nMiddle, vAdded, vRemoved));
+    BOOST_REQUIRE_EQUAL(vAdded.size(), 1U);
+    BOOST_CHECK(vAdded[0] == tx[2].GetHash());
+    BOOST_REQUIRE_EQUAL(vRemoved.size(), 1U);
+
+    // Re-added after its removal, it counts as added
+    pool.addUnchecked(tx[0].GetHash(), entry.FromTx(tx[0]));
+    BOOST_CHECK(pool.GetChangesSince(nMiddle, vAdded, vRemoved));
+    BOOST_CHECK_EQUAL(vAdded.size(), 2U);
+    BOOST_CHECK(vRemoved.empty());
+
+    pool.clear();
+    BOOST_CHECK(!pool.GetChangesSince(nMiddle, vAdded, vRemoved));
+    BOOST_CHECK(pool.GetChangesSince(pool.GetSequence(), vAdded, vRemoved));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
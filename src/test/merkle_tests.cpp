@@ -117,6 +117,16 @@ BOOST_AUTO_TEST_CASE(merkle_test)
             BOOST_CHECK(newMutated == !!mutate);
             // If no mutation was done (once for every ntx value), try up to 16 branches.
             if (mutate == 0) {
+                // Every level of the tree matches the old mechanism too
+                std::vector<uint256> leaves(block.vtx.size());
+                for (size_t pos = 0; pos < block.vtx.size(); pos++) {
+                    leaves[pos] = block.vtx[pos]->GetHash();
+                }
+                std::vector<uint256> flatLevels;
+                for (const std::vector<uint256>& level : ComputeMerkleLevels(leaves)) {
+                    flatLevels.insert(flatLevels.end(), level.begin(), level.end());
+                }
+                BOOST_CHECK(flatLevels == merkleTree);
                 for (int loop = 0; loop < std::min(ntx, 16); loop++) {
                     // If ntx <= 16, try all branches. Otherise, try 16 random ones.
                     int mtx = loop;
@@ -10,6 +10,7 @@
 #include "validation.h"
 #include "miner.h"
 #include "policy/policy.h"
+#include "pow.h"
 #include "pubkey.h"
 #include "script/standard.h"
 #include "txmempool.h"
@@ -115,6 +116,13 @@ void TestPackageSelection(const CChainParams& chainparams, CScript scriptPubKey,
     BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == hashHighFeeTx);
     BOOST_CHECK(pblocktemplate->block.vtx[3]->GetHash() == hashMediumFeeTx);
 
+    // The template's transactions are remembered under its id, for getblocktemplate deltas
+    std::vector<uint256> vTemplateTx;
+    BOOST_CHECK(BlockAssembler::GetTemplateTransactions(pblocktemplate->nTemplateId, vTemplateTx));
+    BOOST_CHECK(vTemplateTx.size() == 3);
+    BOOST_CHECK(vTemplateTx[0] == hashParentTx);
+    BOOST_CHECK(!BlockAssembler::GetTemplateTransactions(pblocktemplate->nTemplateId + 1, vTemplateTx));
+
     // Test that a package below the block min tx fee doesn't get included
     tx.vin[0].prevout.hash = hashHighFeeTx;
     tx.vout[0].nValue = 5000000000LL - 1000 - 50000; // 0 fee
@@ -493,4 +501,26 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(ScanPoWNonces_threads)
+{
+    const Consensus::Params& consensusParams = Params(CBaseChainParams::REGTEST).GetConsensus();
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.nTime = 1500000000;
+    header.nBits = 0x207fffff;
+
+    // About every other hash meets this target, so a small range always has a solution
+    for (int nThreads = 1; nThreads <= 4; nThreads++) {
+        header.nNonce = 0;
+        BOOST_CHECK(ScanPoWNonces(&header, 64, nThreads, consensusParams));
+        BOOST_CHECK(header.nNonce < 64);
+        BOOST_CHECK(CheckProofOfWork(header.GetPoWHash(), header.nBits, consensusParams));
+    }
+
+    // An exhausted range leaves the nonce at its end
+    header.nNonce = 10;
+    BOOST_CHECK(!ScanPoWNonces(&header, 10, 2, consensusParams));
+    BOOST_CHECK_EQUAL(header.nNonce, 10U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
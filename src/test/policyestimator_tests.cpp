@@ -10,6 +10,8 @@
 
 #include "test/test_bitcoin.h"
 
+#include <list>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(policyestimator_tests, BasicTestingSetup)
@@ -197,4 +199,62 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesJournal)
+{
+    CBlockPolicyEstimator estimator(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0;
+
+    // Transactions of ten feerates, the higher ones confirming sooner.
+    // The last blocks add none, so none are left unconfirmed at the end.
+    std::list<std::pair<unsigned int, CTxMemPoolEntry> > pending;
+    CAutoFile snapshot(tmpfile(), SER_DISK, CLIENT_VERSION);
+    unsigned int blocknum = 0;
+    while (blocknum < 204) {
+        for (int j = 0; blocknum < 200 && j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000 * blocknum + 100 * j + k;
+                pending.push_back(std::make_pair(blocknum + 1 + (9 - j) / 3, entry.Fee(2000 * (j + 1)).Height(blocknum).FromTx(tx)));
+                estimator.processTransaction(pending.back().second, true);
+            }
+        }
+        std::vector<const CTxMemPoolEntry*> vBlock;
+        for (const auto& p : pending) {
+            if (p.first == blocknum + 1)
+                vBlock.push_back(&p.second);
+        }
+        estimator.processBlock(++blocknum, vBlock);
+        pending.remove_if([blocknum](const std::pair<unsigned int, CTxMemPoolEntry>& p) { return p.first == blocknum; });
+        if (blocknum == 150)
+            estimator.Write(snapshot);
+    }
+    BOOST_CHECK(pending.empty());
+
+    // Only the blocks after the snapshot are in the journal
+    std::vector<CFeeEstimatorBlock> vJournal;
+    BOOST_CHECK(estimator.TakeJournal(vJournal));
+    BOOST_CHECK_EQUAL(vJournal.size(), 54U);
+    BOOST_CHECK_EQUAL(vJournal.front().nHeight, 151U);
+    CAutoFile journal(tmpfile(), SER_DISK, CLIENT_VERSION);
+    journal << vJournal;
+
+    // Replaying it on top of the snapshot gets the same estimates back
+    CBlockPolicyEstimator replayed(CFeeRate(1000));
+    rewind(snapshot.Get());
+    replayed.Read(snapshot, CLIENT_VERSION);
+    rewind(journal.Get());
+    replayed.ReadJournal(journal);
+    for (int i = 2; i < 10; i++) {
+        BOOST_CHECK(abs(estimator.estimateFee(i).GetFeePerK() - replayed.estimateFee(i).GetFeePerK()) <= 1);
+    }
+    BOOST_CHECK(estimator.estimateFee(5).GetFeePerK() > 0);
+
+    // Nothing new since the last take
+    BOOST_CHECK(estimator.TakeJournal(vJournal));
+    BOOST_CHECK(vJournal.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
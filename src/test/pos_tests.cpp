@@ -0,0 +1,286 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "pos.h"
+#include "random.h"
+#include "validation.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pos_tests, BasicTestingSetup)
+
+/* The in-place kernel and modifier hashes must match the serialized form */
+BOOST_AUTO_TEST_CASE(kernel_hash_matches_serialization)
+{
+    CBlockIndex indexPrev;
+    for (int i = 0; i < 20; i++) {
+        indexPrev.nStakeModifier = GetRandHash();
+        uint32_t nTxPrevTime = insecure_rand();
+        uint32_t nTimeTx = insecure_rand();
+        COutPoint prevout(GetRandHash(), insecure_rand());
+
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << indexPrev.nStakeModifier << nTxPrevTime << prevout.hash << prevout.n << nTimeTx;
+        BOOST_CHECK(GetStakeKernelHash(&indexPrev, nTxPrevTime, prevout, nTimeTx) == ss.GetHash());
+
+        uint256 kernel = GetRandHash();
+        CHashWriter ssModifier(SER_GETHASH, 0);
+        ssModifier << kernel << indexPrev.nStakeModifier;
+        BOOST_CHECK(ComputeStakeModifier(&indexPrev, kernel) == ssModifier.GetHash());
+    }
+}
+
+/* CKernelSearch must agree with CheckStakeKernelHash on every timestamp, searching back or forward */
+BOOST_AUTO_TEST_CASE(kernel_search_matches_check)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    const unsigned int vBits[] = {0x1d00ffff, 0x1e0fffff, 0x1f00ffff, 0x2000ffff, 0x207fffff};
+
+    CBlockIndex indexPrev;
+    for (int i = 0; i < 50; i++) {
+        indexPrev.nStakeModifier = GetRandHash();
+        COutPoint prevout(GetRandHash(), insecure_rand() % 8);
+        uint32_t nBlockTime = 1500000000 + insecure_rand() % 1000000;
+        uint32_t nTxTime = nBlockTime - insecure_rand() % 100;
+        CAmount nValue = (i % 10 == 0) ? 0 : (CAmount)(insecure_rand() % 100000) * COIN + insecure_rand();
+        unsigned int nBits = vBits[i % 5];
+        CStakeCache stake(nBlockTime, nTxTime, nValue);
+        CKernelSearch search(&indexPrev, nBits, stake, prevout);
+
+        // Include timestamps before the minimum stake age
+        uint32_t nTimeFrom = nBlockTime + params.nStakeMinAge + 30;
+        for (uint32_t nTimeTx = nTimeFrom - 60; nTimeTx <= nTimeFrom; nTimeTx++) {
+            bool fExpected = CheckStakeKernelHash(&indexPrev, nBits, nBlockTime, nTxTime, nValue, prevout, nTimeTx);
+            BOOST_CHECK_EQUAL(search.Check(nTimeTx), fExpected);
+        }
+
+        uint32_t nTimeFound = 0;
+        bool fFound = search.Search(nTimeFrom, 60, nTimeFound);
+        uint32_t nTimeExpected = 0;
+        bool fExpected = false;
+        for (unsigned int n = 0; n < 60 && !fExpected; n++) {
+            if (CheckStakeKernelHash(&indexPrev, nBits, nBlockTime, nTxTime, nValue, prevout, nTimeFrom - n)) {
+                fExpected = true;
+                nTimeExpected = nTimeFrom - n;
+            }
+        }
+        BOOST_CHECK_EQUAL(fFound, fExpected);
+        if (fExpected)
+            BOOST_CHECK_EQUAL(nTimeFound, nTimeExpected);
+
+        // Forward over masked timestamps, starting before the minimum stake age
+        uint32_t nStep = 1 + insecure_rand() % 16;
+        fFound = search.SearchForward(nTimeFrom - 60, nTimeFrom, nStep, nTimeFound);
+        fExpected = false;
+        for (uint32_t nTimeTx = nTimeFrom - 60; nTimeTx <= nTimeFrom && !fExpected; nTimeTx += nStep) {
+            if (CheckStakeKernelHash(&indexPrev, nBits, nBlockTime, nTxTime, nValue, prevout, nTimeTx)) {
+                fExpected = true;
+                nTimeExpected = nTimeTx;
+            }
+        }
+        BOOST_CHECK_EQUAL(fFound, fExpected);
+        if (fExpected)
+            BOOST_CHECK_EQUAL(nTimeFound, nTimeExpected);
+    }
+}
+
+/* The coins-view kernel check takes the block time from the ancestor at coins.nHeight */
+BOOST_AUTO_TEST_CASE(kernel_check_from_coins)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    std::vector<CBlockIndex> vBlocks(100);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nTime = 1500000000 + i * 64;
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].BuildSkip();
+    }
+    CBlockIndex* pindexPrev = &vBlocks.back();
+    pindexPrev->nStakeModifier = GetRandHash();
+
+    CMutableTransaction txPrev;
+    txPrev.nTime = vBlocks[10].nTime - 5;
+    txPrev.vin.resize(1);
+    txPrev.vout.resize(2);
+    txPrev.vout[1].nValue = 5000 * COIN;
+    Coin coin(txPrev.vout[1], 10, false, false, txPrev.nTime);
+    COutPoint prevout(txPrev.GetHash(), 1);
+
+    const unsigned int nBits = 0x1f00ffff;
+    uint32_t nTimeFrom = vBlocks[10].nTime + params.nStakeMinAge;
+    for (uint32_t nTimeTx = nTimeFrom - 16; nTimeTx < nTimeFrom + 256; nTimeTx++) {
+        bool fExpected = CheckStakeKernelHash(pindexPrev, nBits, vBlocks[10].nTime, txPrev.nTime, txPrev.vout[1].nValue, prevout, nTimeTx);
+        BOOST_CHECK_EQUAL(CheckStakeKernelHash(pindexPrev, nBits, coin, prevout, nTimeTx), fExpected);
+    }
+
+    // The coin is 89 blocks back from the tip
+    int nDepth = -1;
+    BOOST_CHECK(IsConfirmedInNPrevBlocks(coin, pindexPrev, 90, nDepth));
+    BOOST_CHECK_EQUAL(nDepth, 89);
+    BOOST_CHECK(!IsConfirmedInNPrevBlocks(coin, pindexPrev, 89, nDepth));
+    BOOST_CHECK(!IsConfirmedInNPrevBlocks(coin, &vBlocks[9], 100, nDepth));
+
+    // Spent outputs never stake
+    coin.Clear();
+    BOOST_CHECK(!CheckStakeKernelHash(pindexPrev, 0x207fffff, coin, prevout, nTimeFrom + 1));
+}
+
+/* Coin age comes from the spent coins and the block index, without txindex or block files */
+BOOST_AUTO_TEST_CASE(coin_age_from_coins)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    std::vector<CBlockIndex> vBlocks(100);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nTime = 1500000000 + i * 64;
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].BuildSkip();
+    }
+    const CBlockIndex* pindexPrev = &vBlocks.back();
+
+    CMutableTransaction tx;
+    tx.nTime = vBlocks[10].nTime + params.nStakeMinAge + 32;
+    tx.vin.resize(3);
+    std::vector<Coin> vCoins;
+    // Old enough: counts
+    vCoins.push_back(Coin(CTxOut(1000 * COIN, CScript()), 10, false, false, vBlocks[10].nTime - 5));
+    // Confirmed too recently: skipped
+    vCoins.push_back(Coin(CTxOut(1000 * COIN, CScript()), 99, false, false, vBlocks[99].nTime));
+    // Not found: skipped
+    vCoins.push_back(Coin());
+
+    uint64_t nCoinAge = 0;
+    BOOST_CHECK(GetCoinAge(tx, vCoins, pindexPrev, nCoinAge));
+    BOOST_CHECK_EQUAL(nCoinAge, GetCoinAgeByTime(tx.nTime - vCoins[0].nTime, vCoins[0].out.nValue));
+    BOOST_CHECK(nCoinAge > 0);
+
+    // An input younger than the transaction is a timestamp violation
+    vCoins[1].nTime = tx.nTime + 1;
+    BOOST_CHECK(!GetCoinAge(tx, vCoins, pindexPrev, nCoinAge));
+}
+
+/* Walk back from pindex the way GetPoSKernelPS() used to */
+static double NaiveKernelsPerSecond(const CBlockIndex* pindex, unsigned int nWindow)
+{
+    double dKernelsTried = 0;
+    unsigned int nStakesHandled = 0;
+    int64_t nStakesTime = 0;
+    const CBlockIndex* pindexPrevStake = NULL;
+    for (; pindex && nStakesHandled < nWindow; pindex = pindex->pprev) {
+        if (!pindex->IsProofOfStake())
+            continue;
+        if (pindexPrevStake) {
+            int nShift = (pindexPrevStake->nBits >> 24) & 0xff;
+            double dDiff = (double)0x0000ffff / (double)(pindexPrevStake->nBits & 0x00ffffff);
+            for (; nShift < 29; nShift++) dDiff *= 256.0;
+            for (; nShift > 29; nShift--) dDiff /= 256.0;
+            dKernelsTried += dDiff * 4294967296.0;
+            nStakesTime += pindexPrevStake->nTime - pindex->nTime;
+            nStakesHandled++;
+        }
+        pindexPrevStake = pindex;
+    }
+    return nStakesTime ? dKernelsTried / nStakesTime * 16 : 0;
+}
+
+/* The rolling stake weight window must track a full walk across connects, disconnects and reorgs */
+BOOST_AUTO_TEST_CASE(stake_weight_window)
+{
+    const unsigned int nWindow = 8;
+    std::vector<CBlockIndex> vBlocks(200);
+    std::vector<CBlockIndex> vFork(20);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nTime = 1500000000 + i * 64 + insecure_rand() % 32;
+        vBlocks[i].nBits = 0x1e00ffff + (insecure_rand() % 0x100);
+        if (i % 3)
+            vBlocks[i].SetProofOfStake();
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+    }
+    for (unsigned int i = 0; i < vFork.size(); i++) {
+        vFork[i] = vBlocks[150 + i];
+        vFork[i].nTime += 7;
+        vFork[i].SetProofOfStake();
+        vFork[i].pprev = i ? &vFork[i - 1] : &vBlocks[149];
+    }
+
+    // Connect, rewind, reconnect and switch to the fork one block at a time
+    std::vector<const CBlockIndex*> vTips;
+    for (unsigned int i = 0; i < 180; i++)
+        vTips.push_back(&vBlocks[i]);
+    for (unsigned int i = 178; i >= 140; i--)
+        vTips.push_back(&vBlocks[i]);
+    for (unsigned int i = 141; i < 150; i++)
+        vTips.push_back(&vBlocks[i]);
+    for (unsigned int i = 0; i < vFork.size(); i++)
+        vTips.push_back(&vFork[i]);
+
+    CStakeWeightWindow window(nWindow);
+    for (unsigned int i = 0; i < vTips.size(); i++) {
+        window.SetTip(vTips[i]);
+        BOOST_CHECK_CLOSE(window.GetKernelsPerSecond() + 1, NaiveKernelsPerSecond(vTips[i], nWindow) + 1, 1e-6);
+    }
+
+    // Jump back to the main chain in one step
+    window.SetTip(&vBlocks[170]);
+    BOOST_CHECK_CLOSE(window.GetKernelsPerSecond() + 1, NaiveKernelsPerSecond(&vBlocks[170], nWindow) + 1, 1e-6);
+
+    window.SetWindow(3);
+    BOOST_CHECK_EQUAL(window.GetWindow(), 3U);
+    BOOST_CHECK_CLOSE(window.GetKernelsPerSecond() + 1, NaiveKernelsPerSecond(&vBlocks[170], 3) + 1, 1e-6);
+}
+
+/* A context-free check that skipped the block signature must still check it when asked to later */
+BOOST_AUTO_TEST_CASE(check_block_signature_skipped)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    CKey key;
+    key.MakeNewKey(true);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+
+    CMutableTransaction coinstake;
+    coinstake.nTime = 1500000000;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 5000 * COIN;
+    coinstake.vout[1].scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    CBlock block;
+    block.nTime = coinstake.nTime;
+    block.vtx.push_back(MakeTransactionRef(std::move(coinbase)));
+    block.vtx.push_back(MakeTransactionRef(std::move(coinstake)));
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    BOOST_CHECK(block.IsProofOfStake());
+    block.vchBlockSig.assign(72, 0x30);
+
+    CValidationState state;
+    BOOST_CHECK(CheckBlock(block, state, params, true, true, false));
+    BOOST_CHECK(block.fChecked && !block.fCheckedSig);
+    BOOST_CHECK(!CheckBlock(block, state, params, true, true, true));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-block-signature");
+    // The signature is not covered by the block hash, so the block itself is not marked invalid
+    BOOST_CHECK(state.CorruptionPossible());
+
+    BOOST_CHECK(key.Sign(block.GetHash(), block.vchBlockSig));
+    CValidationState stateSigned;
+    BOOST_CHECK(CheckBlock(block, stateSigned, params, true, true, true));
+    BOOST_CHECK(block.fCheckedSig);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
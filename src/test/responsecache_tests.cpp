@@ -0,0 +1,45 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "responsecache.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(responsecache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(responsecache_lru)
+{
+    // Room for two 1000 byte entries but not three
+    CResponseCache cache(2500);
+    CResponseCache::Value value = std::make_shared<const std::string>(1000, 'x');
+
+    cache.Put("a", value);
+    cache.Put("b", value);
+    BOOST_CHECK_EQUAL(cache.Count(), 2U);
+    BOOST_CHECK(cache.DynamicSize() <= 2500);
+
+    // Using a makes b the least recently used entry
+    BOOST_CHECK(cache.Get("a") == value);
+    cache.Put("c", value);
+    BOOST_CHECK_EQUAL(cache.Count(), 2U);
+    BOOST_CHECK(cache.Get("a"));
+    BOOST_CHECK(!cache.Get("b"));
+    BOOST_CHECK(cache.Get("c"));
+
+    // An entry larger than the whole cache is not stored
+    cache.Put("d", std::make_shared<const std::string>(3000, 'x'));
+    BOOST_CHECK(!cache.Get("d"));
+    BOOST_CHECK_EQUAL(cache.Count(), 2U);
+
+    // Evicted values stay valid for readers holding them
+    CResponseCache::Value held = cache.Get("c");
+    cache.SetMaxSize(0);
+    BOOST_CHECK_EQUAL(cache.Count(), 0U);
+    BOOST_CHECK_EQUAL(cache.DynamicSize(), 0U);
+    BOOST_CHECK_EQUAL(held->size(), 1000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,8 @@
 
 #include "rpc/server.h"
 #include "rpc/client.h"
+#include "rpc/cbor.h"
+#include "rpc/jsonstream.h"
 
 #include "base58.h"
 #include "netbase.h"
@@ -16,6 +18,10 @@
 
 #include <univalue.h>
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 UniValue CallRPC(std::string args)
 {
     std::vector<std::string> vArgs;
@@ -343,4 +349,219 @@ BOOST_AUTO_TEST_CASE(rpc_convert_values_generatetoaddress)
     BOOST_CHECK_EQUAL(result[2].get_int(), 9);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_batch_parallel)
+{
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+
+    // Read-only calls around one that is not parallel safe, which splits them in two runs
+    UniValue batch(UniValue::VARR);
+    for (int i = 0; i < 12; i++) {
+        UniValue req(UniValue::VOBJ);
+        req.push_back(Pair("method", i == 5 ? "getmempoolinfo" : "getblockcount"));
+        req.push_back(Pair("params", UniValue(UniValue::VARR)));
+        req.push_back(Pair("id", i));
+        batch.push_back(req);
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex cs;
+    RPCWorkDispatcher dispatch = [&threads, &cs](const std::function<void()>& func) {
+        std::lock_guard<std::mutex> lock(cs);
+        threads.emplace_back(func);
+        return true;
+    };
+    std::string strReply = JSONRPCExecBatch(batch, dispatch, 3);
+    for (std::thread& t : threads)
+        t.join();
+
+    // Replies come back in request order, whichever thread ran them
+    UniValue reply;
+    BOOST_CHECK(reply.read(strReply));
+    BOOST_CHECK_EQUAL(reply.size(), 12U);
+    for (int i = 0; i < 12; i++) {
+        BOOST_CHECK_EQUAL(find_value(reply[i], "id").get_int(), i);
+        BOOST_CHECK(find_value(reply[i], "error").isNull());
+    }
+    BOOST_CHECK(find_value(reply[5], "result").isObject());
+    BOOST_CHECK_EQUAL(find_value(reply[0], "result").get_int(), find_value(reply[11], "result").get_int());
+
+    // Without a dispatcher the batch runs serially with the same result
+    BOOST_CHECK_EQUAL(JSONRPCExecBatch(batch), strReply);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_json_stream)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("str", "quote \" and\ttab"));
+    obj.push_back(Pair("num", 42));
+    obj.push_back(Pair("null", NullUniValue));
+    obj.push_back(Pair("empty", UniValue(UniValue::VARR)));
+    UniValue arr(UniValue::VARR);
+    for (int i = 0; i < 5000; i++) {
+        UniValue elem(UniValue::VOBJ);
+        elem.push_back(Pair("i", i));
+        elem.push_back(Pair("flag", i % 2 == 0));
+        arr.push_back(elem);
+    }
+    obj.push_back(Pair("arr", arr));
+
+    // Streamed output matches write() however it is split up
+    std::string strStreamed;
+    int nPieces = 0;
+    JSONStreamWriter writer([&](const std::string& strData) { strStreamed += strData; nPieces++; });
+    writer.Value(obj);
+    writer.Flush();
+    BOOST_CHECK_EQUAL(strStreamed, obj.write());
+    BOOST_CHECK(nPieces > 1);
+
+    // Building the same document by hand
+    strStreamed.clear();
+    JSONStreamWriter writer2([&](const std::string& strData) { strStreamed += strData; });
+    writer2.BeginObject();
+    writer2.Key("str");
+    writer2.Value(obj["str"]);
+    writer2.Key("num");
+    writer2.Value(42);
+    writer2.Key("null");
+    writer2.Value(NullUniValue);
+    writer2.Key("empty");
+    writer2.BeginArray();
+    writer2.EndArray();
+    writer2.Key("arr");
+    writer2.BeginArray();
+    for (const UniValue& elem : arr.getValues())
+        writer2.Value(elem);
+    writer2.EndArray();
+    writer2.EndObject();
+    writer2.Flush();
+    BOOST_CHECK_EQUAL(strStreamed, obj.write());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_cbor)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("a", 1));
+    obj.push_back(Pair("b", -2));
+    UniValue arr(UniValue::VARR);
+    arr.push_back(true);
+    arr.push_back(NullUniValue);
+    obj.push_back(Pair("c", arr));
+    obj.push_back(Pair("hex", "00ff"));
+    obj.push_back(Pair("s", "x"));
+    obj.push_back(Pair("f", 0.5));
+    obj.push_back(Pair("big", 1000));
+
+    std::string strOut;
+    CBORWriter writer([&](const std::string& strData) { strOut += strData; });
+    writer.Value(obj);
+    writer.Flush();
+    BOOST_CHECK_EQUAL(HexStr(strOut.begin(), strOut.end()),
+        "a7" "616101" "616221" "616382f5f6" "6368657842" "00ff" "61736178"
+        "6166fb3fe0000000000000" "63626967" "1903e8");
+
+    // Raw results become byte strings, anything that is not hex stays text
+    strOut.clear();
+    writer.Value(UniValue("abcd"), true);
+    writer.Value(UniValue("xyz"), true);
+    writer.Flush();
+    BOOST_CHECK_EQUAL(HexStr(strOut.begin(), strOut.end()), "42abcd" "6378797a");
+
+    BOOST_CHECK(AcceptsCBOR("application/cbor"));
+    BOOST_CHECK(AcceptsCBOR("application/json;q=0.5, application/cbor"));
+    BOOST_CHECK(!AcceptsCBOR("application/json"));
+    BOOST_CHECK(!AcceptsCBOR("*/*"));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stats)
+{
+    RecordRPCCall("teststats", 500, 0, false);
+    RecordRPCCall("teststats", 30000, 100, true);
+
+    UniValue stats = find_value(find_value(CallRPC("getrpcstats").get_obj(), "methods").get_obj(), "teststats");
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "calls").get_int(), 2);
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "errors").get_int(), 1);
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "time_us").get_int(), 30500);
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "max_us").get_int(), 30000);
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "cs_main_wait_us").get_int(), 100);
+    const UniValue& histogram = find_value(stats.get_obj(), "latency_histogram");
+    BOOST_CHECK_EQUAL(histogram.size(), RPC_LATENCY_BUCKET_COUNT);
+    BOOST_CHECK_EQUAL(histogram[0].get_int(), 1);
+    BOOST_CHECK_EQUAL(histogram[3].get_int(), 1);
+
+    // Only a timed thread blocked on cs_main accumulates wait time
+    CLockWaitTimer timer;
+    {
+        LOCK(cs_main);
+    }
+    BOOST_CHECK_EQUAL(timer.nWaitMicros, 0);
+    std::atomic<bool> fHeld(false);
+    std::thread holder([&]() {
+        LOCK(cs_main);
+        fHeld = true;
+        MilliSleep(20);
+    });
+    while (!fHeld)
+        MilliSleep(1);
+    {
+        LOCK(cs_main);
+    }
+    holder.join();
+    BOOST_CHECK(timer.nWaitMicros > 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(rpc_getlockstats)
+{
+    static CCriticalSection cs_lockstats_test;
+    fLockStats = true;
+    CallRPC("getlockstats true");
+
+    std::atomic<bool> fHeld(false);
+    std::thread holder([&]() {
+        LOCK(cs_lockstats_test);
+        fHeld = true;
+        MilliSleep(20);
+    });
+    while (!fHeld)
+        MilliSleep(1);
+    {
+        LOCK(cs_lockstats_test);
+    }
+    holder.join();
+    {
+        TRY_LOCK(cs_lockstats_test, lockTry);
+        bool fLocked = lockTry;
+        BOOST_CHECK(fLocked);
+    }
+    fLockStats = false;
+
+    UniValue result = CallRPC("getlockstats");
+    BOOST_CHECK(!find_value(result.get_obj(), "enabled").get_bool());
+    const UniValue& lock = find_value(find_value(result.get_obj(), "locks").get_obj(), "cs_lockstats_test");
+    BOOST_CHECK_EQUAL(find_value(lock.get_obj(), "acquisitions").get_int(), 3);
+    BOOST_CHECK_EQUAL(find_value(lock.get_obj(), "contentions").get_int(), 1);
+    BOOST_CHECK(find_value(lock.get_obj(), "wait_us").get_int64() > 0);
+    // The holder slept 20ms with the lock taken
+    BOOST_CHECK(find_value(lock.get_obj(), "max_hold_us").get_int64() >= 20000);
+
+    // Three call sites, the contended one first
+    int nSites = 0;
+    const UniValue& sites = find_value(result.get_obj(), "sites");
+    for (size_t i = 0; i < sites.size(); i++) {
+        if (find_value(sites[i].get_obj(), "lock").get_str() != "cs_lockstats_test")
+            continue;
+        if (nSites++ == 0)
+            BOOST_CHECK_EQUAL(find_value(sites[i].get_obj(), "contentions").get_int(), 1);
+        BOOST_CHECK(find_value(sites[i].get_obj(), "file").get_str().find("rpc_tests.cpp") != std::string::npos);
+    }
+    BOOST_CHECK_EQUAL(nSites, 3);
+
+    // Reading with reset clears them
+    CallRPC("getlockstats true");
+    result = CallRPC("getlockstats");
+    const UniValue& lockReset = find_value(find_value(result.get_obj(), "locks").get_obj(), "cs_lockstats_test");
+    BOOST_CHECK_EQUAL(find_value(lockReset.get_obj(), "acquisitions").get_int(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -13,6 +13,8 @@
 #include <boost/thread.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <vector>
+
 BOOST_AUTO_TEST_SUITE(scheduler_tests)
 
 static void microTask(CScheduler& s, boost::mutex& mutex, int& counter, int delta, boost::chrono::system_clock::time_point rescheduleTime)
@@ -114,4 +116,126 @@ BOOST_AUTO_TEST_CASE(manythreads)
     BOOST_CHECK_EQUAL(counterSum, 200);
 }
 
+
+BOOST_AUTO_TEST_CASE(serial_scheduler_client)
+{
+    CScheduler scheduler;
+    CSerialSchedulerClient queue(&scheduler);
+
+    // Several threads service the scheduler, yet the callbacks run one at a
+    // time and in the order they were queued
+    boost::mutex mutex;
+    std::vector<int> vOrder;
+    int nRunning = 0;
+    bool fOverlapped = false;
+    for (int i = 0; i < 100; i++) {
+        queue.AddToProcessQueue([&, i] {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fOverlapped |= nRunning++ > 0;
+            }
+            MicroSleep(100);
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nRunning--;
+            vOrder.push_back(i);
+        });
+    }
+    BOOST_CHECK_EQUAL(queue.CallbacksPending(), 100U);
+
+    boost::thread_group threads;
+    for (int i = 0; i < 5; i++)
+        threads.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    scheduler.stop(true);
+    threads.join_all();
+    BOOST_CHECK(!scheduler.AreThreadsServicingQueue());
+
+    BOOST_CHECK(!fOverlapped);
+    BOOST_CHECK_EQUAL(queue.CallbacksPending(), 0U);
+    BOOST_CHECK_EQUAL(vOrder.size(), 100U);
+    for (int i = 0; i < (int)vOrder.size(); i++)
+        BOOST_CHECK_EQUAL(vOrder[i], i);
+
+    // With nothing servicing the scheduler, EmptyQueue delivers on this thread
+    int nCalls = 0;
+    queue.AddToProcessQueue([&nCalls] { nCalls++; });
+    queue.AddToProcessQueue([&nCalls] { nCalls += 10; });
+    BOOST_CHECK_EQUAL(nCalls, 0);
+    queue.EmptyQueue();
+    BOOST_CHECK_EQUAL(nCalls, 11);
+    BOOST_CHECK_EQUAL(queue.CallbacksPending(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(scheduler_priorities)
+{
+    CScheduler scheduler;
+    boost::chrono::system_clock::time_point now = boost::chrono::system_clock::now();
+
+    // Of the tasks due, the most urgent runs first
+    std::vector<int> vOrder;
+    scheduler.schedule([&vOrder] { vOrder.push_back(CScheduler::PRIORITY_LOW); }, now, CScheduler::PRIORITY_LOW, "low");
+    scheduler.schedule([&vOrder] { vOrder.push_back(CScheduler::PRIORITY_NORMAL); }, now, CScheduler::PRIORITY_NORMAL);
+    scheduler.schedule([&vOrder] { vOrder.push_back(CScheduler::PRIORITY_HIGH); }, now, CScheduler::PRIORITY_HIGH, "high");
+    boost::thread thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    scheduler.stop(true);
+    thread.join();
+    BOOST_CHECK_EQUAL(vOrder.size(), 3U);
+    for (int i = 0; i < (int)vOrder.size(); i++)
+        BOOST_CHECK_EQUAL(vOrder[i], i);
+
+    std::map<std::string, CSchedulerTaskStats> mapStats = scheduler.getTaskStats();
+    BOOST_CHECK_EQUAL(mapStats.size(), 3U);
+    BOOST_CHECK_EQUAL(mapStats["high"].nRuns, 1U);
+    BOOST_CHECK_EQUAL(mapStats["low"].nRuns, 1U);
+    BOOST_CHECK_EQUAL(mapStats["unnamed"].nRuns, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(scheduler_reserved_thread)
+{
+    CScheduler scheduler;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fLowStarted = false, fHighDone = false, fRelease = false;
+    int nBackgroundRuns = 0;
+
+    // A slow background task occupies one of two threads...
+    scheduler.scheduleFromNow([&] {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fLowStarted = true;
+        cond.notify_all();
+        while (!fRelease)
+            cond.wait(lock);
+    }, 0, CScheduler::PRIORITY_NORMAL);
+    // ...and another background task has to wait for it, leaving the other
+    // thread to a high priority task scheduled after both
+    scheduler.scheduleFromNow([&] {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nBackgroundRuns++;
+    }, 0, CScheduler::PRIORITY_LOW);
+
+    boost::thread_group threads;
+    for (int i = 0; i < 2; i++)
+        threads.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fLowStarted)
+            cond.wait(lock);
+    }
+    scheduler.scheduleFromNow([&] {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fHighDone = true;
+        cond.notify_all();
+    }, 0, CScheduler::PRIORITY_HIGH);
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fHighDone)
+            cond.wait(lock);
+        BOOST_CHECK_EQUAL(nBackgroundRuns, 0);
+        fRelease = true;
+        cond.notify_all();
+    }
+    scheduler.stop(true);
+    threads.join_all();
+    BOOST_CHECK_EQUAL(nBackgroundRuns, 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
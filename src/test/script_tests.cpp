@@ -10,6 +10,7 @@
 #include "script/script.h"
 #include "script/script_error.h"
 #include "script/sign.h"
+#include "script/standard.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -167,6 +168,9 @@ void DoTest(const CScript& scriptPubKey, const CScript& scriptSig, const CScript
     CMutableTransaction tx2 = tx;
     BOOST_CHECK_MESSAGE(VerifyScript(scriptSig, scriptPubKey, &scriptWitness, flags, MutableTransactionSignatureChecker(&tx, 0, txCredit.vout[0].nValue), &err) == expect, message);
     BOOST_CHECK_MESSAGE(err == scriptError, std::string(FormatScriptError(err)) + " where " + std::string(FormatScriptError((ScriptError_t)scriptError)) + " expected: " + message);
+    ScriptError errGeneric;
+    BOOST_CHECK_MESSAGE(VerifyScriptGeneric(scriptSig, scriptPubKey, &scriptWitness, flags, MutableTransactionSignatureChecker(&tx, 0, txCredit.vout[0].nValue), &errGeneric) == expect, message);
+    BOOST_CHECK_MESSAGE(errGeneric == scriptError, std::string(FormatScriptError(errGeneric)) + " from the interpreter where " + std::string(FormatScriptError((ScriptError_t)scriptError)) + " expected: " + message);
 #if defined(HAVE_CONSENSUS_LIB)
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
     stream << tx2;
@@ -993,6 +997,129 @@ BOOST_AUTO_TEST_CASE(script_json_test)
     }
 }
 
+static std::vector<unsigned char> SignTemplate(const CKey& key, const CScript& scriptCode, const CMutableTransaction& txSpend, int nHashType)
+{
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(SignatureHash(scriptCode, txSpend, 0, nHashType, 0, SIGVERSION_BASE), vchSig));
+    vchSig.push_back(static_cast<unsigned char>(nHashType));
+    return vchSig;
+}
+
+/*
+ * VerifyScript decides P2PK, P2PKH and P2SH spends without running the
+ * scripts; it has to agree with the interpreter on the result and the
+ * error for good and bad spends of them, under every combination of flags.
+ */
+BOOST_AUTO_TEST_CASE(script_standard_templates)
+{
+    CKey key, keyUncompressed, keyOther;
+    key.Set(vchKey0, vchKey0 + 32, true);
+    keyUncompressed.Set(vchKey1, vchKey1 + 32, false);
+    keyOther.Set(vchKey2, vchKey2 + 32, true);
+    const std::vector<unsigned char> vchPubKey = ToByteVector(key.GetPubKey());
+    const std::vector<unsigned char> vchPubKeyOther = ToByteVector(keyOther.GetPubKey());
+
+    enum Template { P2PK, P2PKH, MULTISIG };
+    std::vector<std::pair<Template, const CKey*> > vScripts;
+    vScripts.push_back(std::make_pair(P2PK, &key));
+    vScripts.push_back(std::make_pair(P2PK, &keyUncompressed));
+    vScripts.push_back(std::make_pair(P2PKH, &key));
+    vScripts.push_back(std::make_pair(P2PKH, &keyUncompressed));
+    vScripts.push_back(std::make_pair(MULTISIG, &key));
+
+    const unsigned int vFlags[] = {SCRIPT_VERIFY_P2SH, SCRIPT_VERIFY_STRICTENC, SCRIPT_VERIFY_DERSIG, SCRIPT_VERIFY_LOW_S, SCRIPT_VERIFY_NULLFAIL,
+                                   SCRIPT_VERIFY_MINIMALDATA, SCRIPT_VERIFY_SIGPUSHONLY, SCRIPT_VERIFY_CLEANSTACK, SCRIPT_VERIFY_WITNESS};
+    const unsigned int nFlagCount = sizeof(vFlags) / sizeof(vFlags[0]);
+
+    for (const std::pair<Template, const CKey*>& item : vScripts) {
+        const CKey& keySpend = *item.second;
+        const std::vector<unsigned char> vchPubKeySpend = ToByteVector(keySpend.GetPubKey());
+        CScript script;
+        if (item.first == P2PK)
+            script << vchPubKeySpend << OP_CHECKSIG;
+        else if (item.first == P2PKH)
+            script << OP_DUP << OP_HASH160 << ToByteVector(keySpend.GetPubKey().GetID()) << OP_EQUALVERIFY << OP_CHECKSIG;
+        else
+            script = GetScriptForMultisig(1, std::vector<CPubKey>{keySpend.GetPubKey(), keyOther.GetPubKey()});
+
+        for (int fP2SH = 0; fP2SH < 2; fP2SH++) {
+            const CScript scriptPubKey = fP2SH ? GetScriptForDestination(CScriptID(script)) : script;
+            const CMutableTransaction txCredit = BuildCreditingTransaction(scriptPubKey);
+            const CMutableTransaction txSpend = BuildSpendingTransaction(CScript(), CScriptWitness(), txCredit);
+
+            std::vector<std::vector<unsigned char> > vSigs;
+            vSigs.push_back(SignTemplate(keySpend, script, txSpend, SIGHASH_ALL));
+            vSigs.push_back(SignTemplate(keySpend, script, txSpend, SIGHASH_NONE));
+            vSigs.push_back(SignTemplate(keyOther, script, txSpend, SIGHASH_ALL));
+            vSigs.push_back(SignTemplate(keySpend, script, txSpend, 0x05)); // undefined hash type
+            std::vector<unsigned char> vchSigHighS = vSigs[0];
+            vchSigHighS.pop_back();
+            NegateSignatureS(vchSigHighS);
+            vchSigHighS.push_back(SIGHASH_ALL);
+            vSigs.push_back(vchSigHighS);
+            std::vector<unsigned char> vchSigPadded = vSigs[0];
+            vchSigPadded.insert(vchSigPadded.end() - 1, 0x00); // not strict DER
+            vSigs.push_back(vchSigPadded);
+            vSigs.push_back(std::vector<unsigned char>());
+
+            std::vector<CScript> vScriptSigs;
+            for (const std::vector<unsigned char>& vchSig : vSigs) {
+                CScript scriptSig;
+                if (item.first == MULTISIG)
+                    scriptSig << OP_0;
+                scriptSig << vchSig;
+                if (item.first == P2PKH)
+                    scriptSig << vchPubKeySpend;
+                vScriptSigs.push_back(scriptSig);
+            }
+            // The wrong pubkey, an extra push, a non-push opcode and a push that is not minimal
+            vScriptSigs.push_back(CScript() << vSigs[0] << (item.first == P2PKH ? vchPubKeyOther : vchPubKey));
+            vScriptSigs.push_back((CScript() << OP_1) + vScriptSigs[0]);
+            vScriptSigs.push_back((CScript() << OP_NOP) + vScriptSigs[0]);
+            CScript scriptSigNonMinimal;
+            scriptSigNonMinimal.push_back(OP_PUSHDATA1);
+            scriptSigNonMinimal.push_back(vSigs[0].size());
+            scriptSigNonMinimal.insert(scriptSigNonMinimal.end(), vSigs[0].begin(), vSigs[0].end());
+            if (item.first == P2PKH)
+                scriptSigNonMinimal << vchPubKeySpend;
+            vScriptSigs.push_back(scriptSigNonMinimal);
+            vScriptSigs.push_back(CScript());
+
+            if (fP2SH) {
+                const CScript scriptOther = CScript() << vchPubKeyOther << OP_CHECKSIG;
+                size_t nScriptSigs = vScriptSigs.size();
+                for (size_t i = 0; i < nScriptSigs; i++)
+                    vScriptSigs[i] << std::vector<unsigned char>(script.begin(), script.end());
+                vScriptSigs.push_back(CScript() << vSigs[0] << std::vector<unsigned char>(scriptOther.begin(), scriptOther.end()));
+            }
+            ScriptError errGood;
+            BOOST_CHECK_MESSAGE(VerifyScript(vScriptSigs[0], scriptPubKey, NULL, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, MutableTransactionSignatureChecker(&txSpend, 0, txCredit.vout[0].nValue), &errGood), FormatScriptError(errGood));
+
+            for (const CScript& scriptSig : vScriptSigs) {
+                for (unsigned int nMask = 0; nMask < (1U << nFlagCount); nMask++) {
+                    unsigned int nFlags = 0;
+                    for (unsigned int i = 0; i < nFlagCount; i++) {
+                        if (nMask & (1U << i))
+                            nFlags |= vFlags[i];
+                    }
+                    // VerifyScript requires these to come with P2SH, and CLEANSTACK with WITNESS
+                    if ((nFlags & (SCRIPT_VERIFY_CLEANSTACK | SCRIPT_VERIFY_WITNESS)) && !(nFlags & SCRIPT_VERIFY_P2SH))
+                        continue;
+                    if ((nFlags & SCRIPT_VERIFY_CLEANSTACK) && !(nFlags & SCRIPT_VERIFY_WITNESS))
+                        continue;
+                    const MutableTransactionSignatureChecker checker(&txSpend, 0, txCredit.vout[0].nValue);
+                    ScriptError err, errGeneric;
+                    bool fResult = VerifyScript(scriptSig, scriptPubKey, NULL, nFlags, checker, &err);
+                    bool fResultGeneric = VerifyScriptGeneric(scriptSig, scriptPubKey, NULL, nFlags, checker, &errGeneric);
+                    const std::string strCase = ScriptToAsmStr(scriptSig) + " / " + ScriptToAsmStr(scriptPubKey) + " / " + FormatScriptFlags(nFlags);
+                    BOOST_CHECK_MESSAGE(fResult == fResultGeneric, strCase);
+                    BOOST_CHECK_MESSAGE(err == errGeneric, std::string(FormatScriptError(err)) + " where the interpreter gives " + FormatScriptError(errGeneric) + ": " + strCase);
+                }
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(script_PushData)
 {
     // Check that PUSHDATA1, PUSHDATA2, and PUSHDATA4 create the same value on
@@ -30,6 +30,20 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
         scrypt_1024_1_1_256_sp_generic((const char*)&inputbytes[0], BEGIN(scrypthash), scratchpad);
         BOOST_CHECK_EQUAL(scrypthash.ToString().c_str(), expected[i]);
     }
+
+    // Batches, in all the sizes that split between eight lanes and single hashes
+    (void) scrypt_detect_avx2();
+    std::vector<char> vInput;
+    for (int i = 0; i < 4 * HASHCOUNT; i++) {
+        inputbytes = ParseHex(inputhex[i % HASHCOUNT]);
+        vInput.insert(vInput.end(), inputbytes.begin(), inputbytes.end());
+    }
+    for (int nCount = 1; nCount <= 4 * HASHCOUNT; nCount++) {
+        std::vector<uint256> vHashes(nCount);
+        scrypt_1024_1_1_256_multi(vInput.data(), BEGIN(vHashes[0]), nCount);
+        for (int i = 0; i < nCount; i++)
+            BOOST_CHECK_EQUAL(vHashes[i].ToString().c_str(), expected[i % HASHCOUNT]);
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
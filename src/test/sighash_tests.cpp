@@ -144,6 +144,10 @@ BOOST_AUTO_TEST_CASE(sighash_test)
         uint256 sh, sho;
         sho = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
         sh = SignatureHash(scriptCode, txTo, nIn, nHashType, 0, SIGVERSION_BASE);
+        // The precomputed legacy state must not change the result
+        const CTransaction txToConst(txTo);
+        PrecomputedTransactionData txdata(txToConst);
+        BOOST_CHECK(SignatureHash(scriptCode, txToConst, nIn, nHashType, 0, SIGVERSION_BASE, &txdata) == sh);
         #if defined(PRINT_SIGHASH_JSON)
         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
         ss << txTo;
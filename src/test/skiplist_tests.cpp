@@ -3,7 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chain.h"
+#include "chainsnapshot.h"
+#include "headerscache.h"
+#include "streams.h"
 #include "util.h"
+#include "validation.h"
 #include "test/test_bitcoin.h"
 #include "test/test_random.h"
 
@@ -143,4 +147,222 @@ BOOST_AUTO_TEST_CASE(findearliestatleast_test)
         BOOST_CHECK(vBlocksMain[r].GetAncestor(ret->nHeight) == ret);
     }
 }
+
+static const CBlockIndex* NaiveLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
+{
+    while (pindex->pprev && pindex->IsProofOfStake() != fProofOfStake)
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(lastblockindex_test)
+{
+    // Every block arrives as a header, which is taken as proof-of-work, and
+    // only the first 3000 are connected and learn their type
+    std::vector<CBlockIndex> vBlocksMain(5000);
+    std::vector<bool> vProofOfStake(vBlocksMain.size());
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+        vProofOfStake[i] = i >= 100 && insecure_rand() % 500;
+    }
+    for (unsigned int i=0; i<3000; i++) {
+        if (vProofOfStake[i])
+            vBlocksMain[i].SetProofOfStake();
+        vBlocksMain[i].BuildSkip();
+        vBlocksMain[i].RaiseValidity(BLOCK_VALID_SCRIPTS);
+    }
+
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        BOOST_CHECK(GetLastBlockIndex(&vBlocksMain[i], false) == NaiveLastBlockIndex(&vBlocksMain[i], false));
+        BOOST_CHECK(GetLastBlockIndex(&vBlocksMain[i], true) == NaiveLastBlockIndex(&vBlocksMain[i], true));
+    }
+    BOOST_CHECK(GetLastBlockIndex(&vBlocksMain[50], true) == &vBlocksMain[0]);
+}
+
+BOOST_AUTO_TEST_CASE(lastcommonancestor_test)
+{
+    // A main chain of 1000 blocks with a branch off block 499
+    std::vector<CBlockIndex> vBlocksMain(1000);
+    for (unsigned int i = 0; i < vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vBlocksSide(100);
+    for (unsigned int i = 0; i < vBlocksSide.size(); i++) {
+        vBlocksSide[i].nHeight = i + 500;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[499];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    for (int n = 0; n < 100; n++) {
+        const CBlockIndex* pmain = &vBlocksMain[insecure_rand() % vBlocksMain.size()];
+        const CBlockIndex* pside = &vBlocksSide[insecure_rand() % vBlocksSide.size()];
+        const CBlockIndex* pexpected = pmain->nHeight < 500 ? pmain : &vBlocksMain[499];
+        BOOST_CHECK(LastCommonAncestor(pmain, pside) == pexpected);
+        BOOST_CHECK(LastCommonAncestor(pside, pmain) == pexpected);
+        const CBlockIndex* pother = &vBlocksMain[insecure_rand() % vBlocksMain.size()];
+        BOOST_CHECK(LastCommonAncestor(pmain, pother) == (pmain->nHeight < pother->nHeight ? pmain : pother));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(chainsnapshot_test)
+{
+    // A main chain of 1000 blocks with a branch off block 499
+    std::vector<CBlockIndex> vBlocksMain(1000);
+    for (unsigned int i = 0; i < vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vBlocksSide(100);
+    for (unsigned int i = 0; i < vBlocksSide.size(); i++) {
+        vBlocksSide[i].nHeight = i + 500;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[499];
+        vBlocksSide[i].BuildSkip();
+    }
+    vBlocksMain.back().nMoneySupply = 12345;
+
+    CChain chain;
+    chain.SetTip(&vBlocksMain.back());
+    CChainSnapshot snapshot(&vBlocksMain.back());
+    BOOST_CHECK_EQUAL(snapshot.Height(), chain.Height());
+    BOOST_CHECK_EQUAL(snapshot.MoneySupply(), 12345);
+
+    // The snapshot agrees with the CChain it was taken from
+    for (int n = 0; n < 100; n++) {
+        int r = insecure_rand() % 1100;
+        const CBlockIndex* pindex = (r < 1000) ? &vBlocksMain[r] : &vBlocksSide[r - 1000];
+        BOOST_CHECK_EQUAL(snapshot.Contains(pindex), chain.Contains(pindex));
+        BOOST_CHECK(snapshot.Next(pindex) == chain.Next(pindex));
+        BOOST_CHECK(snapshot[pindex->nHeight] == chain[pindex->nHeight]);
+    }
+    BOOST_CHECK(snapshot[-1] == NULL);
+    BOOST_CHECK(snapshot[1000] == NULL);
+    BOOST_CHECK_EQUAL(snapshot.Confirmations(&vBlocksMain[990]), 10);
+    BOOST_CHECK_EQUAL(snapshot.Confirmations(&vBlocksSide[0]), -1);
+
+    // Before the chain is loaded
+    CChainSnapshot empty(NULL);
+    BOOST_CHECK_EQUAL(empty.Height(), -1);
+    BOOST_CHECK(empty[0] == NULL);
+    BOOST_CHECK(!empty.Contains(&vBlocksMain[0]));
+}
+
+
+BOOST_AUTO_TEST_CASE(findforkinsnapshot_test)
+{
+    // A main chain of 1000 blocks with a branch off block 499, in mapBlockIndex
+    std::vector<uint256> vHashMain(1000);
+    std::vector<CBlockIndex> vBlocksMain(1000);
+    for (unsigned int i = 0; i < vBlocksMain.size(); i++) {
+        vHashMain[i] = ArithToUint256(i);
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].phashBlock = &vHashMain[i];
+        vBlocksMain[i].BuildSkip();
+        mapBlockIndex[vHashMain[i]] = &vBlocksMain[i];
+    }
+    std::vector<uint256> vHashSide(100);
+    std::vector<CBlockIndex> vBlocksSide(100);
+    for (unsigned int i = 0; i < vBlocksSide.size(); i++) {
+        vHashSide[i] = ArithToUint256(i + 500 + (arith_uint256(1) << 128));
+        vBlocksSide[i].nHeight = i + 500;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[499];
+        vBlocksSide[i].phashBlock = &vHashSide[i];
+        vBlocksSide[i].BuildSkip();
+        mapBlockIndex[vHashSide[i]] = &vBlocksSide[i];
+    }
+
+    CChain chain;
+    chain.SetTip(&vBlocksMain.back());
+    CChainSnapshot snapshot(&vBlocksMain.back());
+
+    BOOST_CHECK(LookupBlockIndex(vHashSide[7]) == &vBlocksSide[7]);
+    BOOST_CHECK(LookupBlockIndex(ArithToUint256(5000)) == NULL);
+
+    // Without cs_main, the snapshot finds the same fork as chainActive would
+    for (int n = 0; n < 100; n++) {
+        int r = insecure_rand() % 1100;
+        const CBlockIndex* tip = (r < 1000) ? &vBlocksMain[r] : &vBlocksSide[r - 1000];
+        CBlockLocator locator = chain.GetLocator(tip);
+        BOOST_CHECK(FindForkInSnapshot(snapshot, locator) == FindForkInGlobalIndex(chain, locator));
+    }
+    CBlockLocator unknown(std::vector<uint256>(1, ArithToUint256(5000)));
+    BOOST_CHECK(FindForkInSnapshot(snapshot, unknown) == &vBlocksMain[0]);
+
+    for (const uint256& hash : vHashMain)
+        mapBlockIndex.erase(hash);
+    for (const uint256& hash : vHashSide)
+        mapBlockIndex.erase(hash);
+}
+
+BOOST_AUTO_TEST_CASE(headerscache_test)
+{
+    // A main chain of 5000 blocks with a branch off block 2499
+    std::vector<uint256> vHashMain(5000);
+    std::vector<CBlockIndex> vBlocksMain(5000);
+    for (unsigned int i = 0; i < vBlocksMain.size(); i++) {
+        vHashMain[i] = ArithToUint256(i);
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].nTime = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].phashBlock = &vHashMain[i];
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<uint256> vHashSide(3000);
+    std::vector<CBlockIndex> vBlocksSide(3000);
+    for (unsigned int i = 0; i < vBlocksSide.size(); i++) {
+        vHashSide[i] = ArithToUint256(i + 2500 + (arith_uint256(1) << 128));
+        vBlocksSide[i].nHeight = i + 2500;
+        vBlocksSide[i].nTime = i + 1000000;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[2499];
+        vBlocksSide[i].phashBlock = &vHashSide[i];
+        vBlocksSide[i].BuildSkip();
+    }
+    CChainSnapshot snapshotMain(&vBlocksMain.back());
+    CChainSnapshot snapshotSide(&vBlocksSide.back());
+
+    // What the loop over the chain getheaders used to run sent
+    auto expected = [](const CChainSnapshot& chain, const CBlockIndex* pindex, const CBlockIndex* pindexStop, int nLimit) {
+        std::vector<CBlock> vHeaders;
+        for (; pindex && nLimit > 0; pindex = chain.Next(pindex)) {
+            vHeaders.push_back(pindex->GetBlockHeader());
+            if (--nLimit <= 0 || pindex == pindexStop)
+                break;
+        }
+        std::vector<unsigned char> vData;
+        CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, vData, 0, vHeaders);
+        return vData;
+    };
+
+    CHeadersCache cache;
+    std::vector<unsigned char> vData;
+    for (int n = 0; n < 200; n++) {
+        const CChainSnapshot& chain = (n % 2) ? snapshotSide : snapshotMain;
+        const CBlockIndex* pindexStart = chain[insecure_rand() % (chain.Height() + 1)];
+        const CBlockIndex* pindexStop = (n % 3) ? NULL : chain[insecure_rand() % (chain.Height() + 1)];
+        int nLimit = (n % 5) ? 2000 : insecure_rand() % 2500;
+        const CBlockIndex* pindexLast = cache.WriteHeaders(chain, pindexStart, pindexStop, nLimit, vData);
+        BOOST_CHECK(vData == expected(chain, pindexStart, pindexStop, nLimit));
+        if (nLimit > 0) {
+            BOOST_CHECK(chain.Contains(pindexLast));
+            BOOST_CHECK(pindexLast->nHeight >= pindexStart->nHeight);
+        }
+    }
+    // Only the chunks below either tip are kept; those above the fork are redone for the other chain
+    BOOST_CHECK(cache.GetChunkCount() <= 2);
+
+    // A block off the chain is sent on its own, nothing past the tip
+    BOOST_CHECK(cache.WriteHeaders(snapshotMain, &vBlocksSide[10], NULL, 2000, vData) == &vBlocksSide[10]);
+    BOOST_CHECK(vData == expected(snapshotSide, &vBlocksSide[10], &vBlocksSide[10], 1));
+    BOOST_CHECK(cache.WriteHeaders(snapshotMain, NULL, NULL, 2000, vData) == NULL);
+    BOOST_CHECK(vData == std::vector<unsigned char>(1, 0));
+
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.GetChunkCount(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
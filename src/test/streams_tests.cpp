@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "streams.h"
+#include "primitives/block.h"
+#include "random.h"
 #include "support/allocators/zeroafterfree.h"
 #include "test/test_bitcoin.h"
 
@@ -121,4 +123,42 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_arena_block)
+{
+    CBlock block;
+    for (int i = 0; i < 100; i++) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        mtx.vout.resize(2);
+        mtx.vout[0].nValue = i;
+        mtx.vout[1].scriptPubKey = CScript() << std::vector<unsigned char>(100, i);
+        block.vtx.push_back(MakeTransactionRef(mtx));
+    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+
+    CTransactionRef ptx;
+    std::weak_ptr<CMonotonicArena> arena;
+    {
+        CBlock blockRead;
+        ArenaStream<CDataStream> ssArena(&ss);
+        arena = ssArena.GetArena();
+        ssArena >> blockRead;
+        BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+        BOOST_CHECK_EQUAL(blockRead.vtx.size(), block.vtx.size());
+        for (size_t i = 0; i < block.vtx.size(); i++)
+            BOOST_CHECK(*blockRead.vtx[i] == *block.vtx[i]);
+        // All 100 transactions fit in a few chunks
+        BOOST_CHECK(arena.lock()->ChunkCount() < 10);
+        ptx = blockRead.vtx[42];
+    }
+
+    // A transaction still held keeps the arena alive; releasing it frees the lot
+    BOOST_CHECK(!arena.expired());
+    BOOST_CHECK(*ptx == *block.vtx[42]);
+    ptx.reset();
+    BOOST_CHECK(arena.expired());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -304,14 +304,14 @@ SetupDummyInputs(CBasicKeyStore& keystoreRet, CCoinsViewCache& coinsRet)
     dummyTransactions[0].vout[0].scriptPubKey << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
     dummyTransactions[0].vout[1].nValue = 50*CENT;
     dummyTransactions[0].vout[1].scriptPubKey << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG;
-    coinsRet.ModifyCoins(dummyTransactions[0].GetHash())->FromTx(dummyTransactions[0], 0);
+    AddCoins(coinsRet, dummyTransactions[0], 0);
 
     dummyTransactions[1].vout.resize(2);
     dummyTransactions[1].vout[0].nValue = 21*CENT;
     dummyTransactions[1].vout[0].scriptPubKey = GetScriptForDestination(key[2].GetPubKey().GetID());
     dummyTransactions[1].vout[1].nValue = 22*CENT;
     dummyTransactions[1].vout[1].scriptPubKey = GetScriptForDestination(key[3].GetPubKey().GetID());
-    coinsRet.ModifyCoins(dummyTransactions[1].GetHash())->FromTx(dummyTransactions[1], 0);
+    AddCoins(coinsRet, dummyTransactions[1], 0);
 
     return dummyTransactions;
 }
@@ -467,19 +467,13 @@ BOOST_AUTO_TEST_CASE(test_big_witness_transaction) {
     for (int i=0; i<20; i++)
         threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, boost::ref(scriptcheckqueue)));
 
-    CCoins coins;
-    coins.nVersion = 1;
-    coins.fCoinBase = false;
-    for(uint32_t i = 0; i < mtx.vin.size(); i++) {
-        CTxOut txout;
-        txout.nValue = 1000;
-        txout.scriptPubKey = scriptPubKey;
-        coins.vout.push_back(txout);
-    }
+    CTxOut txout;
+    txout.nValue = 1000;
+    txout.scriptPubKey = scriptPubKey;
 
     for(uint32_t i = 0; i < mtx.vin.size(); i++) {
         std::vector<CScriptCheck> vChecks;
-        CScriptCheck check(coins, tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS, false, &txdata);
+        CScriptCheck check(txout, tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS, false, &txdata);
         vChecks.push_back(CScriptCheck());
         check.swap(vChecks.back());
         control.Add(vChecks);
@@ -492,6 +486,77 @@ BOOST_AUTO_TEST_CASE(test_big_witness_transaction) {
     threadGroup.join_all();
 }
 
+BOOST_AUTO_TEST_CASE(test_parallel_signing)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKeyPubKey(key, key.GetPubKey());
+    CKeyID hash = key.GetPubKey().GetID();
+    std::vector<CScript> scriptPubKeys;
+    scriptPubKeys.push_back(GetScriptForDestination(hash));
+    scriptPubKeys.push_back(CScript() << OP_0 << std::vector<unsigned char>(hash.begin(), hash.end()));
+
+    // A consolidation of legacy and witness outputs, enough to be signed on several threads
+    CMutableTransaction mtx;
+    std::vector<CTxOut> vPrevOuts;
+    for (uint32_t i = 0; i < 3 * PARALLEL_SIGNING_MIN_INPUTS; i++) {
+        mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), i)));
+        vPrevOuts.push_back(CTxOut(1000 + i, scriptPubKeys[i % 2]));
+    }
+    mtx.vout.push_back(CTxOut(1000, CScript() << OP_1));
+
+    CMutableTransaction mtxSequential = mtx;
+    for (uint32_t i = 0; i < mtx.vin.size(); i++)
+        BOOST_CHECK(SignSignature(keystore, vPrevOuts[i].scriptPubKey, mtxSequential, i, vPrevOuts[i].nValue, SIGHASH_ALL));
+    BOOST_CHECK(ProduceSignatures(keystore, mtx, vPrevOuts));
+
+    // Signatures are deterministic, so the result matches signing one input after the other
+    BOOST_CHECK(CTransaction(mtx).GetWitnessHash() == CTransaction(mtxSequential).GetWitnessHash());
+    const CTransaction tx(mtx);
+    PrecomputedTransactionData txdata(tx);
+    for (uint32_t i = 0; i < tx.vin.size(); i++) {
+        ScriptError serror;
+        BOOST_CHECK(VerifyScript(tx.vin[i].scriptSig, vPrevOuts[i].scriptPubKey, &tx.vin[i].scriptWitness, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, i, vPrevOuts[i].nValue, txdata), &serror));
+    }
+
+    // An input we have no key for fails the whole
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    vPrevOuts[5].scriptPubKey = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    BOOST_CHECK(!ProduceSignatures(keystore, mtx, vPrevOuts));
+}
+
+BOOST_AUTO_TEST_CASE(test_block_signature_check)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hashBlock = uint256S("0123456789abcdef");
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hashBlock, vchSig));
+
+    // Block signature checks go through the queue next to script checks
+    boost::thread_group threadGroup;
+    CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+    for (int i = 0; i < 2; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, boost::ref(scriptcheckqueue)));
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        std::vector<CScriptCheck> vChecks(1, CScriptCheck(key.GetPubKey(), hashBlock, vchSig));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        std::vector<CScriptCheck> vChecks(1, CScriptCheck(key.GetPubKey(), uint256S("fedcba9876543210"), vchSig));
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
 BOOST_AUTO_TEST_CASE(test_witness)
 {
     CBasicKeyStore keystore, keystore2;
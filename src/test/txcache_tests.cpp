@@ -0,0 +1,67 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txcache.h"
+
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txcache_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(unsigned int nScriptSize)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(nScriptSize, 0x42);
+    return MakeTransactionRef(std::move(tx));
+}
+
+BOOST_AUTO_TEST_CASE(txcache_lru)
+{
+    CTransactionRef txA = MakeTx(1000), txB = MakeTx(1000), txC = MakeTx(1000);
+    uint256 hashBlock = GetRandHash();
+
+    // Size the cache for two of the transactions but not three
+    CTxCache probe(1 << 20);
+    probe.Put(txA, hashBlock);
+    CTxCache cache(probe.DynamicSize() * 5 / 2);
+
+    cache.Put(txA, hashBlock);
+    cache.Put(txB, hashBlock);
+    BOOST_CHECK_EQUAL(cache.Count(), 2U);
+
+    // Using A makes B the least recently used entry
+    CTransactionRef tx;
+    uint256 hashBlockOut;
+    BOOST_CHECK(cache.Get(txA->GetHash(), tx, hashBlockOut));
+    BOOST_CHECK(tx == txA);
+    BOOST_CHECK(hashBlockOut == hashBlock);
+    cache.Put(txC, hashBlock);
+    BOOST_CHECK_EQUAL(cache.Count(), 2U);
+    BOOST_CHECK(cache.Get(txA->GetHash(), tx, hashBlockOut));
+    BOOST_CHECK(!cache.Get(txB->GetHash(), tx, hashBlockOut));
+    BOOST_CHECK(cache.Get(txC->GetHash(), tx, hashBlockOut));
+
+    // A transaction larger than the whole cache is not stored
+    CTransactionRef txD = MakeTx(10000);
+    cache.Put(txD, hashBlock);
+    BOOST_CHECK(!cache.Get(txD->GetHash(), tx, hashBlockOut));
+
+    // Erasing, as for a disconnected block, releases the entry's size
+    size_t nSize = cache.DynamicSize();
+    cache.Erase(txA->GetHash());
+    BOOST_CHECK(!cache.Get(txA->GetHash(), tx, hashBlockOut));
+    BOOST_CHECK_EQUAL(cache.Count(), 1U);
+    BOOST_CHECK(cache.DynamicSize() < nSize);
+
+    cache.SetMaxSize(0);
+    BOOST_CHECK_EQUAL(cache.Count(), 0U);
+    BOOST_CHECK_EQUAL(cache.DynamicSize(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
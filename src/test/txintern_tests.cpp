@@ -0,0 +1,60 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txintern.h"
+
+#include "random.h"
+#include "script/script.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txintern_tests, BasicTestingSetup)
+
+static CMutableTransaction RandomTransaction()
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1000;
+    mtx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return mtx;
+}
+
+BOOST_AUTO_TEST_CASE(txintern_shares)
+{
+    CMutableTransaction mtx = RandomTransaction();
+    CTransactionRef ptx = InternTransaction(MakeTransactionRef(mtx));
+
+    // Copies of the same transaction become the interned one
+    CTransactionRef ptxCopy = MakeTransactionRef(mtx);
+    BOOST_CHECK(ptxCopy != ptx);
+    BOOST_CHECK(InternTransaction(ptxCopy) == ptx);
+    BOOST_CHECK(InternTransaction(CTransaction(mtx)) == ptx);
+
+    // A different witness is not swapped for it
+    CMutableTransaction mtxWitness(mtx);
+    mtxWitness.vin[0].scriptWitness.stack.push_back(std::vector<unsigned char>(1, 1));
+    CTransactionRef ptxWitness = InternTransaction(MakeTransactionRef(mtxWitness));
+    BOOST_CHECK(ptxWitness != ptx);
+    BOOST_CHECK(ptxWitness->GetWitnessHash() != ptx->GetWitnessHash());
+
+    // Once nobody holds it, a new copy takes its place
+    ptx.reset();
+    ptxCopy.reset();
+    CTransactionRef ptxNew = MakeTransactionRef(mtx);
+    BOOST_CHECK(InternTransaction(ptxNew) == ptxNew);
+    BOOST_CHECK(InternTransaction(CTransaction(mtx)) == ptxNew);
+}
+
+BOOST_AUTO_TEST_CASE(txintern_sweeps)
+{
+    // Entries of released transactions are swept as the table grows
+    for (int i = 0; i < 20000; i++)
+        InternTransaction(MakeTransactionRef(RandomTransaction()));
+    BOOST_CHECK(InternedTransactionCount() < 20000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
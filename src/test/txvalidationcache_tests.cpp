@@ -84,4 +84,51 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_execution_cache, TestChain100Setup)
+{
+    // Scripts that passed with the same flags are not run again
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    LOCK(cs_main);
+    const CTransaction tx(spend);
+    PrecomputedTransactionData txdata(tx);
+    CValidationState state;
+    std::vector<CScriptCheck> vChecks;
+
+    // Not cached yet, so the script check is handed out
+    BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, SCRIPT_VERIFY_P2SH, true, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+    vChecks.clear();
+
+    // Run inline and stored
+    BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, SCRIPT_VERIFY_P2SH, true, true, txdata));
+    BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, SCRIPT_VERIFY_P2SH, true, true, txdata, &vChecks));
+    BOOST_CHECK(vChecks.empty());
+
+    // Other flags miss the cache
+    BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, true, true, txdata, &vChecks));
+    BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+    vChecks.clear();
+
+    // A hit without cacheFullScriptStore, as when connecting a block, uses up the entry
+    BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, SCRIPT_VERIFY_P2SH, true, false, txdata, &vChecks));
+    BOOST_CHECK(vChecks.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -330,4 +330,32 @@ BOOST_AUTO_TEST_CASE(univalue_readwrite)
     BOOST_CHECK(!v.read("{} 42"));
 }
 
+BOOST_AUTO_TEST_CASE(univalue_read_long_strings)
+{
+    // Plain runs are copied in blocks; escapes, UTF-8 and invalid bytes at
+    // every offset within a block must still be seen
+    std::string strHex(1000, '0');
+    for (size_t i = 0; i < strHex.size(); i++)
+        strHex[i] = "0123456789abcdef"[i % 16];
+    UniValue v;
+    BOOST_CHECK(v.read("[\"" + strHex + "\"]"));
+    BOOST_CHECK_EQUAL(v[0].get_str(), strHex);
+
+    for (size_t nPos = 0; nPos < 20; nPos++) {
+        std::string strPrefix = strHex.substr(0, nPos);
+        BOOST_CHECK(v.read("[\"" + strPrefix + "\\n" + strHex.substr(0, 20) + "\"]"));
+        BOOST_CHECK_EQUAL(v[0].get_str(), strPrefix + "\n" + strHex.substr(0, 20));
+        BOOST_CHECK(v.read("[\"" + strPrefix + "\xc3\xa9" + strHex.substr(0, 20) + "\"]"));
+        BOOST_CHECK_EQUAL(v[0].get_str(), strPrefix + "\xc3\xa9" + strHex.substr(0, 20));
+        BOOST_CHECK(!v.read("[\"" + strPrefix + "\t" + strHex.substr(0, 20) + "\"]"));
+        BOOST_CHECK(!v.read("[\"" + strPrefix + "\xc3" + strHex.substr(0, 20) + "\"]"));
+        BOOST_CHECK(!v.read("[\"" + strPrefix + strHex.substr(0, 20) + "]"));
+        BOOST_CHECK(!v.read(std::string("[\"") + strPrefix + '\0' + strHex.substr(0, 20) + "\"]"));
+    }
+
+    BOOST_CHECK(v.read("{\"hex\": \"" + strHex + "\", \"n\": -12.5e+3}"));
+    BOOST_CHECK_EQUAL(v["hex"].get_str(), strHex);
+    BOOST_CHECK_EQUAL(v["n"].getValStr(), "-12.5e+3");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
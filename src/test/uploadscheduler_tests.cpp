@@ -0,0 +1,116 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "uploadscheduler.h"
+#include "net.h"
+#include "netmessagemaker.h"
+#include "protocol.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(uploadscheduler_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(upload_scheduler_allocate)
+{
+    std::vector<std::pair<SendPriority, uint64_t> > vPeers;
+    vPeers.push_back(std::make_pair(SEND_PRIORITY_HISTORICAL, 100000));
+    vPeers.push_back(std::make_pair(SEND_PRIORITY_TX, 300));
+    vPeers.push_back(std::make_pair(SEND_PRIORITY_BLOCK, 5000));
+    vPeers.push_back(std::make_pair(SEND_PRIORITY_TX, 5000));
+    vPeers.push_back(std::make_pair(SEND_PRIORITY_HISTORICAL, 100000));
+
+    // Without a rate everyone sends all they have
+    CUploadScheduler unlimited;
+    BOOST_CHECK(!unlimited.IsLimited());
+    std::vector<uint64_t> vAllowance = unlimited.Allocate(vPeers);
+    for (size_t i = 0; i < vPeers.size(); i++)
+        BOOST_CHECK_EQUAL(vAllowance[i], vPeers[i].second);
+
+    // 10000 tokens: the block goes first, then the two transaction peers,
+    // the smaller one in full, and the syncing peers split the rest
+    CUploadScheduler scheduler(10000);
+    vAllowance = scheduler.Allocate(vPeers);
+    BOOST_CHECK_EQUAL(vAllowance[2], 5000U);
+    BOOST_CHECK_EQUAL(vAllowance[1], 300U);
+    BOOST_CHECK_EQUAL(vAllowance[3], 4700U);
+    BOOST_CHECK_EQUAL(vAllowance[0], 0U);
+    BOOST_CHECK_EQUAL(vAllowance[4], 0U);
+
+    vPeers[3].second = 1000;
+    vAllowance = scheduler.Allocate(vPeers);
+    BOOST_CHECK_EQUAL(vAllowance[3], 1000U);
+    BOOST_CHECK_EQUAL(vAllowance[0], 1850U);
+    BOOST_CHECK_EQUAL(vAllowance[4], 1850U);
+
+    // Blocks run the bucket into debt, which holds back the other classes
+    // until it has refilled
+    scheduler.Refill(1000000);
+    scheduler.Consume(15000);
+    BOOST_CHECK(scheduler.MaySend(SEND_PRIORITY_BLOCK));
+    BOOST_CHECK(!scheduler.MaySend(SEND_PRIORITY_TX));
+    vAllowance = scheduler.Allocate(vPeers);
+    BOOST_CHECK_EQUAL(vAllowance[2], 5000U);
+    BOOST_CHECK_EQUAL(vAllowance[1] + vAllowance[3] + vAllowance[0] + vAllowance[4], 0U);
+    scheduler.Refill(1400000);
+    BOOST_CHECK(!scheduler.MaySend(SEND_PRIORITY_TX));
+    scheduler.Refill(1600000);
+    BOOST_CHECK(scheduler.MaySend(SEND_PRIORITY_TX));
+
+    // The bucket holds at most a second's worth
+    scheduler.Refill(60000000);
+    vPeers.clear();
+    vPeers.push_back(std::make_pair(SEND_PRIORITY_HISTORICAL, 1000000));
+    BOOST_CHECK_EQUAL(scheduler.Allocate(vPeers)[0], 10000U);
+}
+
+BOOST_AUTO_TEST_CASE(send_queue_priority_order)
+{
+    CConnman connman(0x1337, 0x1337);
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    const CNetMsgMaker msgMaker(INIT_PROTO_VERSION);
+
+    std::vector<unsigned char> vPayload(100);
+    connman.PushMessage(&node, msgMaker.Make(NetMsgType::BLOCK, vPayload), SEND_PRIORITY_HISTORICAL);
+    connman.PushMessage(&node, msgMaker.Make(NetMsgType::TX, vPayload));
+    connman.PushMessage(&node, msgMaker.Make(NetMsgType::VERACK));
+    connman.PushMessage(&node, msgMaker.Make(NetMsgType::HEADERS, vPayload));
+    connman.PushMessage(&node, msgMaker.Make(NetMsgType::TX, vPayload));
+
+    // Each class in the order it was pushed, payloads right after their headers
+    const uint8_t vExpected[] = {
+        SEND_PRIORITY_BLOCK,
+        SEND_PRIORITY_BLOCK, SEND_PRIORITY_BLOCK | SEND_PAYLOAD,
+        SEND_PRIORITY_TX, SEND_PRIORITY_TX | SEND_PAYLOAD,
+        SEND_PRIORITY_TX, SEND_PRIORITY_TX | SEND_PAYLOAD,
+        SEND_PRIORITY_HISTORICAL, SEND_PRIORITY_HISTORICAL | SEND_PAYLOAD,
+    };
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), node.vSendMsgPriority.size());
+    BOOST_CHECK_EQUAL_COLLECTIONS(node.vSendMsgPriority.begin(), node.vSendMsgPriority.end(), vExpected, vExpected + sizeof(vExpected));
+    BOOST_CHECK_EQUAL(node.vSendMsg[0].size(), (size_t)CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(node.vSendMsg[2].size(), vPayload.size() + 1);
+
+    // Nothing goes ahead of a message that has started going out
+    CNode node2(1, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    connman.PushMessage(&node2, msgMaker.Make(NetMsgType::TX, vPayload));
+    node2.nSendOffset = 1;
+    connman.PushMessage(&node2, msgMaker.Make(NetMsgType::PING, (uint64_t)1));
+    BOOST_CHECK_EQUAL(node2.vSendMsgPriority[2], SEND_PRIORITY_BLOCK);
+
+    // Nor ahead of the payload of one whose header has gone out
+    CNode node3(2, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    connman.PushMessage(&node3, msgMaker.Make(NetMsgType::TX, vPayload));
+    node3.vSendMsg.pop_front();
+    node3.vSendMsgPriority.pop_front();
+    connman.PushMessage(&node3, msgMaker.Make(NetMsgType::PING, (uint64_t)2));
+    BOOST_CHECK_EQUAL(node3.vSendMsgPriority.size(), 3U);
+    BOOST_CHECK_EQUAL(node3.vSendMsgPriority[0], SEND_PRIORITY_TX | SEND_PAYLOAD);
+    BOOST_CHECK_EQUAL(node3.vSendMsgPriority[1], SEND_PRIORITY_BLOCK);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
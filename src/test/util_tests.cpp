@@ -7,12 +7,14 @@
 #include "clientversion.h"
 #include "primitives/transaction.h"
 #include "sync.h"
+#include "threadplacement.h"
 #include "utilstrencodings.h"
 #include "utilmoneystr.h"
 #include "test/test_bitcoin.h"
 #include "test/test_random.h"
 
 #include <stdint.h>
+#include <thread>
 #include <vector>
 
 #include <boost/test/unit_test.hpp>
@@ -69,6 +71,22 @@ BOOST_AUTO_TEST_CASE(util_ParseHex)
     BOOST_CHECK(result.size() == 2 && result[0] == 0x12 && result[1] == 0x34);
 }
 
+BOOST_AUTO_TEST_CASE(util_DecodeHex)
+{
+    std::vector<unsigned char> result;
+    std::vector<unsigned char> expected(ParseHex_expected, ParseHex_expected + sizeof(ParseHex_expected));
+    BOOST_CHECK(DecodeHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f", result));
+    BOOST_CHECK_EQUAL_COLLECTIONS(result.begin(), result.end(), expected.begin(), expected.end());
+    BOOST_CHECK(DecodeHex("0aFf", result) && result.size() == 2 && result[0] == 0x0a && result[1] == 0xff);
+
+    // Only what IsHex accepts
+    BOOST_CHECK(!DecodeHex("", result));
+    BOOST_CHECK(!DecodeHex("123", result));
+    BOOST_CHECK(!DecodeHex("12 34", result));
+    BOOST_CHECK(!DecodeHex("123g", result));
+    BOOST_CHECK(!DecodeHex(std::string("12\0" "34", 5), result));
+}
+
 BOOST_AUTO_TEST_CASE(util_HexStr)
 {
     BOOST_CHECK_EQUAL(
@@ -566,4 +584,41 @@ BOOST_AUTO_TEST_CASE(test_ParseFixedPoint)
     BOOST_CHECK(!ParseFixedPoint("1.", 8, &amount));
 }
 
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(test_ThreadPlacement)
+{
+    std::string strError;
+    BOOST_CHECK(!InitThreadPlacement({"scriptcheck"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"nosuchclass:0"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"net:"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"net:3-1"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"net:a"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"net:0", "net:1"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"net:nodex"}, strError));
+    BOOST_CHECK(!InitThreadPlacement({"net:node1023"}, strError));
+
+    BOOST_CHECK(InitThreadPlacement({"msghand:4-6,1,5", "http:0"}, strError));
+    std::vector<CThreadPlacementInfo> vInfo = GetThreadPlacementInfo();
+    BOOST_CHECK_EQUAL(vInfo.size(), GetThreadClasses().size());
+    for (const CThreadPlacementInfo& info : vInfo) {
+        BOOST_CHECK_EQUAL(info.nNode, -1);
+        if (info.strClass == "msghand")
+            BOOST_CHECK(info.vCPUs == std::vector<int>({1, 4, 5, 6}));
+        else if (info.strClass == "http")
+            BOOST_CHECK(info.vCPUs == std::vector<int>(1, 0));
+        else
+            BOOST_CHECK(info.vCPUs.empty());
+    }
+
+    // A thread of a placed class is counted, placed or not; others are left alone
+    std::thread([]() { PlaceThread("http"); PlaceThread("stake"); }).join();
+    for (const CThreadPlacementInfo& info : GetThreadPlacementInfo())
+        BOOST_CHECK_EQUAL(info.nPlaced + info.nFailed, info.strClass == "http" ? 1 : 0);
+
+    BOOST_CHECK(InitThreadPlacement({}, strError));
+    for (const CThreadPlacementInfo& info : GetThreadPlacementInfo())
+        BOOST_CHECK(info.vCPUs.empty());
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
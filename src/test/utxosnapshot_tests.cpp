@@ -0,0 +1,94 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "coins.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+#include "txdb.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(utxosnapshot_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_roundtrip)
+{
+    CCoinsViewDB dbSource(1 << 20, true);
+    std::map<COutPoint, Coin> mapCoins;
+    {
+        CCoinsViewCache cache(&dbSource);
+        for (int i = 0; i < 20; i++) {
+            uint256 txid = GetRandHash();
+            // Several outputs of some transactions, to exercise the grouping
+            for (uint32_t n = 0; n < (uint32_t)(i % 3 + 1); n++) {
+                CTxOut out(insecure_rand() % 1000000, CScript() << std::vector<unsigned char>(20, i) << OP_CHECKSIG);
+                Coin coin(out, 100 + i, i == 0, i == 1, 1500000000 + i);
+                mapCoins[COutPoint(txid, n * 7)] = coin;
+                cache.AddCoin(COutPoint(txid, n * 7), std::move(coin), false);
+            }
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    std::vector<CSnapshotBlockInfo> vBlocks(3);
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nTx = i + 1;
+        vBlocks[i].fProofOfStake = i > 1;
+        vBlocks[i].nStakeModifier = GetRandHash();
+        vBlocks[i].nMoneySupply = 1000 * i;
+    }
+
+    boost::filesystem::path path = pathTemp / "utxo.dat";
+    CUTXOSnapshotMetadata metadata;
+    std::string strError;
+    std::unique_ptr<CCoinsViewCursor> pcursor(dbSource.Cursor());
+    BOOST_CHECK(WriteUTXOSnapshot(path, pcursor.get(), vBlocks, metadata, strError));
+    BOOST_CHECK(metadata.hashBase == dbSource.GetBestBlock());
+    BOOST_CHECK_EQUAL(metadata.nHeight, 2);
+    BOOST_CHECK_EQUAL(metadata.nCoins, mapCoins.size());
+
+    // Only the hash the snapshot was published with is accepted
+    BOOST_CHECK(!CUTXOSnapshotReader(path).Open(GetRandHash(), strError));
+
+    CUTXOSnapshotReader reader(path);
+    BOOST_CHECK(reader.Open(metadata.hashSnapshot, strError));
+    BOOST_CHECK(reader.GetMetadata().hashBase == metadata.hashBase);
+    BOOST_CHECK_EQUAL(reader.GetMetadata().nCoins, metadata.nCoins);
+    BOOST_CHECK_EQUAL(reader.GetBlocks().size(), vBlocks.size());
+    BOOST_CHECK(reader.GetBlocks()[2].fProofOfStake);
+    BOOST_CHECK(reader.GetBlocks()[2].nStakeModifier == vBlocks[2].nStakeModifier);
+    BOOST_CHECK_EQUAL(reader.GetBlocks()[1].nMoneySupply, vBlocks[1].nMoneySupply);
+
+    // A cache limit of zero flushes after every transaction
+    CCoinsViewDB dbTarget(1 << 20, true);
+    CCoinsViewCache cache(&dbTarget);
+    BOOST_CHECK(reader.LoadCoins(cache, 0, strError));
+    for (const auto& item : mapCoins) {
+        Coin coin;
+        BOOST_CHECK(cache.GetCoin(item.first, coin));
+        BOOST_CHECK(coin.out == item.second.out);
+        BOOST_CHECK_EQUAL(coin.nHeight, item.second.nHeight);
+        BOOST_CHECK_EQUAL(coin.fCoinBase, item.second.fCoinBase);
+        BOOST_CHECK_EQUAL(coin.fCoinStake, item.second.fCoinStake);
+        BOOST_CHECK_EQUAL(coin.nTime, item.second.nTime);
+    }
+
+    // Any change to the file breaks its hash
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_CHECK(file);
+    fseek(file, 100, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, 100, SEEK_SET);
+    fputc(c ^ 1, file);
+    fclose(file);
+    BOOST_CHECK(!CUTXOSnapshotReader(path).Open(metadata.hashSnapshot, strError));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
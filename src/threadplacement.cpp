@@ -0,0 +1,178 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "threadplacement.h"
+
+#include "tinyformat.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <map>
+#include <mutex>
+#include <string.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/** NUMA nodes the memory policy mask covers */
+static const int MAX_NUMA_NODES = 1024;
+
+struct ThreadClassPlacement
+{
+    std::vector<int> vCPUs;
+    int nNode;
+    int nPlaced;
+    int nFailed;
+
+    ThreadClassPlacement() : nNode(-1), nPlaced(0), nFailed(0) {}
+};
+
+static std::mutex csThreadPlacement;
+static std::map<std::string, ThreadClassPlacement> mapThreadPlacement;
+
+const std::vector<std::string>& GetThreadClasses()
+{
+    static const std::vector<std::string> vClasses = {"scriptcheck", "msghand", "net", "http", "stake"};
+    return vClasses;
+}
+
+/** Parse a CPU list as the kernel writes them, like 0-7,16,18-19 */
+static bool ParseCPUList(const std::string& str, std::vector<int>& vCPUs)
+{
+    std::vector<std::string> vRanges;
+    boost::split(vRanges, str, boost::is_any_of(","));
+    for (const std::string& strRange : vRanges) {
+        size_t nDash = strRange.find('-');
+        int32_t nFirst, nLast;
+        if (!ParseInt32(strRange.substr(0, nDash), &nFirst))
+            return false;
+        if (nDash == std::string::npos)
+            nLast = nFirst;
+        else if (!ParseInt32(strRange.substr(nDash + 1), &nLast))
+            return false;
+#ifdef __linux__
+        if (nFirst < 0 || nLast < nFirst || nLast >= CPU_SETSIZE)
+            return false;
+#endif
+        for (int nCPU = nFirst; nCPU <= nLast; nCPU++)
+            vCPUs.push_back(nCPU);
+    }
+    std::sort(vCPUs.begin(), vCPUs.end());
+    vCPUs.erase(std::unique(vCPUs.begin(), vCPUs.end()), vCPUs.end());
+    return !vCPUs.empty();
+}
+
+bool InitThreadPlacement(const std::vector<std::string>& vArgs, std::string& strError)
+{
+#ifndef __linux__
+    if (!vArgs.empty()) {
+        strError = "thread placement is only supported on Linux";
+        return false;
+    }
+    return true;
+#else
+    std::map<std::string, ThreadClassPlacement> mapPlacement;
+    for (const std::string& strArg : vArgs) {
+        size_t nColon = strArg.find(':');
+        const std::string strClass = strArg.substr(0, nColon);
+        const std::vector<std::string>& vClasses = GetThreadClasses();
+        if (nColon == std::string::npos || std::find(vClasses.begin(), vClasses.end(), strClass) == vClasses.end()) {
+            strError = strprintf("'%s' does not start with one of %s, then a colon", strArg, boost::algorithm::join(vClasses, ", "));
+            return false;
+        }
+        if (mapPlacement.count(strClass)) {
+            strError = strprintf("%s threads are placed more than once", strClass);
+            return false;
+        }
+        std::string strCPUs = strArg.substr(nColon + 1);
+        ThreadClassPlacement& placement = mapPlacement[strClass];
+        if (boost::algorithm::starts_with(strCPUs, "node")) {
+            int32_t nNode;
+            if (!ParseInt32(strCPUs.substr(4), &nNode) || nNode < 0 || nNode >= MAX_NUMA_NODES) {
+                strError = strprintf("'%s' is not a valid NUMA node", strCPUs);
+                return false;
+            }
+            boost::filesystem::ifstream file(strprintf("/sys/devices/system/node/node%d/cpulist", nNode));
+            std::string strNodeCPUs;
+            if (!std::getline(file, strNodeCPUs)) {
+                strError = strprintf("there is no NUMA node %d", nNode);
+                return false;
+            }
+            strCPUs = strNodeCPUs;
+            placement.nNode = nNode;
+        }
+        if (!ParseCPUList(boost::algorithm::trim_copy(strCPUs), placement.vCPUs)) {
+            strError = strprintf("'%s' is not a list of CPUs", strCPUs);
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> lock(csThreadPlacement);
+    mapThreadPlacement.swap(mapPlacement);
+    return true;
+#endif
+}
+
+void PlaceThread(const char* pszClass)
+{
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(csThreadPlacement);
+    std::map<std::string, ThreadClassPlacement>::iterator it = mapThreadPlacement.find(pszClass);
+    if (it == mapThreadPlacement.end())
+        return;
+    ThreadClassPlacement& placement = it->second;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int nCPU : placement.vCPUs)
+        CPU_SET(nCPU, &cpus);
+    int nErr = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (nErr == 0 && placement.nNode >= 0) {
+        // Pages this thread touches first come from the node's memory while
+        // it has any left. The kernel reads one bit less than maxnode says.
+        std::vector<unsigned long> vNodeMask(MAX_NUMA_NODES / (8 * sizeof(unsigned long)));
+        vNodeMask[placement.nNode / (8 * sizeof(unsigned long))] |= 1UL << (placement.nNode % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, vNodeMask.data(), (unsigned long)MAX_NUMA_NODES + 1) != 0)
+            nErr = errno;
+    }
+    if (nErr == 0) {
+        placement.nPlaced++;
+    } else {
+        placement.nFailed++;
+        LogPrintf("Could not place a %s thread: %s\n", pszClass, strerror(nErr));
+    }
+#endif
+}
+
+std::vector<CThreadPlacementInfo> GetThreadPlacementInfo()
+{
+    std::vector<CThreadPlacementInfo> vInfo;
+    std::lock_guard<std::mutex> lock(csThreadPlacement);
+    for (const std::string& strClass : GetThreadClasses()) {
+        CThreadPlacementInfo info;
+        info.strClass = strClass;
+        std::map<std::string, ThreadClassPlacement>::const_iterator it = mapThreadPlacement.find(strClass);
+        if (it != mapThreadPlacement.end()) {
+            info.vCPUs = it->second.vCPUs;
+            info.nNode = it->second.nNode;
+            info.nPlaced = it->second.nPlaced;
+            info.nFailed = it->second.nFailed;
+        }
+        vInfo.push_back(info);
+    }
+    return vInfo;
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_THREADPLACEMENT_H
+#define BITCOIN_THREADPLACEMENT_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Thread placement (-threadaffinity=<class>:<cpus>, Linux only).
+ *
+ * The busy threads are grouped in classes: "scriptcheck" (the script and
+ * block check queue workers), "msghand" (the message handlers), "net" (the
+ * socket handler), "http" (the HTTP event loop and workers) and "stake" (the
+ * stake miner and the threads it searches coins with). The threads of a
+ * placed class only run on the CPUs given for it, so for instance the check
+ * queue workers can be kept on one socket instead of bouncing the queue's
+ * cache lines between sockets. Given as node<n>, the CPUs are those of NUMA
+ * node n, and the threads also prefer that node's memory for what they
+ * allocate. Classes not given are left to the scheduler.
+ */
+
+/** Names of the thread classes that can be placed */
+const std::vector<std::string>& GetThreadClasses();
+
+/** Parse the -threadaffinity arguments. Returns false, with strError set, on a bad one */
+bool InitThreadPlacement(const std::vector<std::string>& vArgs, std::string& strError);
+
+/** Place the calling thread as configured for its class; does nothing for a class that is not placed */
+void PlaceThread(const char* pszClass);
+
+/** How a class is placed, for getthreadplacement */
+struct CThreadPlacementInfo
+{
+    std::string strClass;
+    //! CPUs the class runs on, empty if it is not placed
+    std::vector<int> vCPUs;
+    //! NUMA node its memory comes from, -1 if none
+    int nNode;
+    //! Threads placed, and those that could not be
+    int nPlaced;
+    int nFailed;
+
+    CThreadPlacementInfo() : nNode(-1), nPlaced(0), nFailed(0) {}
+};
+
+std::vector<CThreadPlacementInfo> GetThreadPlacementInfo();
+
+#endif // BITCOIN_THREADPLACEMENT_H
@@ -0,0 +1,86 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txcache.h"
+
+#include "core_memusage.h"
+
+CTxCache txCache(DEFAULT_TX_CACHE_SIZE << 20);
+
+CTxCache::CTxCache(size_t nMaxSizeIn) : nSize(0), nMaxSize(nMaxSizeIn)
+{
+}
+
+void CTxCache::LimitSize()
+{
+    AssertLockHeld(cs);
+    while (nSize > nMaxSize && !lru.empty()) {
+        nSize -= lru.back().nSize;
+        mapEntries.erase(lru.back().txid);
+        lru.pop_back();
+    }
+}
+
+void CTxCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    LimitSize();
+}
+
+bool CTxCache::Get(const uint256& txid, CTransactionRef& tx, uint256& hashBlock)
+{
+    LOCK(cs);
+    auto it = mapEntries.find(txid);
+    if (it == mapEntries.end())
+        return false;
+    lru.splice(lru.begin(), lru, it->second);
+    tx = it->second->tx;
+    hashBlock = it->second->hashBlock;
+    return true;
+}
+
+void CTxCache::Put(const CTransactionRef& tx, const uint256& hashBlock)
+{
+    // Rough allowance for the list and map nodes
+    size_t nEntrySize = memusage::DynamicUsage(tx) + RecursiveDynamicUsage(*tx) + 128;
+    LOCK(cs);
+    if (nEntrySize > nMaxSize || mapEntries.count(tx->GetHash()))
+        return;
+    lru.push_front(Entry{tx->GetHash(), tx, hashBlock, nEntrySize});
+    mapEntries.emplace(tx->GetHash(), lru.begin());
+    nSize += nEntrySize;
+    LimitSize();
+}
+
+void CTxCache::Erase(const uint256& txid)
+{
+    LOCK(cs);
+    auto it = mapEntries.find(txid);
+    if (it == mapEntries.end())
+        return;
+    nSize -= it->second->nSize;
+    lru.erase(it->second);
+    mapEntries.erase(it);
+}
+
+void CTxCache::Clear()
+{
+    LOCK(cs);
+    lru.clear();
+    mapEntries.clear();
+    nSize = 0;
+}
+
+size_t CTxCache::Count() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+size_t CTxCache::DynamicSize() const
+{
+    LOCK(cs);
+    return nSize;
+}
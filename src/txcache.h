@@ -0,0 +1,73 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXCACHE_H
+#define BITCOIN_TXCACHE_H
+
+#include "coins.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <unordered_map>
+
+/** Default for -txcachesize, in MiB */
+static const unsigned int DEFAULT_TX_CACHE_SIZE = 16;
+
+/**
+ * Least recently used cache of confirmed transactions fetched from block
+ * files by GetTransaction, with the hash of the block holding each, bounded
+ * by the memory usage of the entries.
+ *
+ * Entries of a block must be erased when it is disconnected, so that a
+ * cached hashBlock is always in the active chain. The cache has its own
+ * lock and may be used with or without cs_main held.
+ */
+class CTxCache
+{
+public:
+    CTxCache(size_t nMaxSizeIn);
+
+    /** Set the size bound, evicting as needed. 0 disables the cache. */
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    /** Look up txid; fills tx and hashBlock and returns true if cached */
+    bool Get(const uint256& txid, CTransactionRef& tx, uint256& hashBlock);
+
+    /** Store tx as confirmed in hashBlock, unless it alone exceeds the size bound */
+    void Put(const CTransactionRef& tx, const uint256& hashBlock);
+
+    void Erase(const uint256& txid);
+
+    void Clear();
+
+    /** Number of entries */
+    size_t Count() const;
+
+    /** Accounted size of all entries, in bytes */
+    size_t DynamicSize() const;
+
+private:
+    struct Entry {
+        uint256 txid;
+        CTransactionRef tx;
+        uint256 hashBlock;
+        size_t nSize;
+    };
+    typedef std::list<Entry> EntryList;
+
+    void LimitSize();
+
+    mutable CCriticalSection cs;
+    //! Most recently used first
+    EntryList lru;
+    std::unordered_map<uint256, EntryList::iterator, SaltedTxidHasher> mapEntries;
+    size_t nSize;
+    size_t nMaxSize;
+};
+
+extern CTxCache txCache;
+
+#endif // BITCOIN_TXCACHE_H
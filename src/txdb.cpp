@@ -5,76 +5,405 @@
 
 #include "txdb.h"
 
+#include "blockfilter.h"
 #include "chainparams.h"
+#include "compressor.h"
+#include "core_memusage.h"
 #include "hash.h"
+#include "init.h"
+#include "memusage.h"
 #include "pow.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 #include "dbwrapper.h"
 #include "validation.h"
 #include <stdint.h>
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <set>
+
+#include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
+static const char DB_TXINDEX_COMPACT = 'x';
 static const char DB_ADDRESSINDEX = 'a';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_BLOCKHASHINDEX = 'z';
 static const char DB_SPENTINDEX = 'p';
+static const char DB_ADDRESSBALANCE = 'w';
+static const char DB_ADDRESSINDEX_COMPACT = 'A';
+static const char DB_ADDRESSUNSPENTINDEX_COMPACT = 'U';
+static const char DB_TXNUM = 'T';
+static const char DB_INDEXBUILD = 'I';
+static const char DB_BLOCKFILTER = 'g';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_COINS_TOTALS = 'V';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_SNAPSHOT = 'S';
+static const char DB_POW_HASH = 'W';
+static const char DB_VERIFIED_BLOCK = 'v';
+
+//! Key prefixes of the records with enough entries to be worth sizing
+static const char DB_SIZED_PREFIXES[] = {
+    DB_COIN, DB_COINS, DB_BLOCK_FILES, DB_TXINDEX, DB_TXINDEX_COMPACT, DB_ADDRESSINDEX, DB_ADDRESSUNSPENTINDEX,
+    DB_TIMESTAMPINDEX, DB_BLOCKHASHINDEX, DB_SPENTINDEX, DB_ADDRESSBALANCE, DB_ADDRESSINDEX_COMPACT,
+    DB_ADDRESSUNSPENTINDEX_COMPACT, DB_TXNUM, DB_BLOCKFILTER, DB_BLOCK_INDEX, DB_POW_HASH,
+};
+
+/** Block index snapshot file, next to the block tree database */
+static const char *INDEX_SNAPSHOT_FILENAME = "index.snapshot";
+static const uint32_t INDEX_SNAPSHOT_MAGIC = 0x5349424a;
+static const uint32_t INDEX_SNAPSHOT_VERSION = 2;
+//! Header: magic, version, id, record count
+static const size_t INDEX_SNAPSHOT_HEADER_SIZE = 4 + 4 + 32 + 8;
+static const size_t INDEX_SNAPSHOT_RECORD_SIZE = 176;
+
+
+namespace {
+
+/** Key of a per-output coin record: DB_COIN, txid, VARINT(output index) */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+/**
+ * Fixed width snapshot record of a block index entry. Unlike CDiskBlockIndex
+ * it carries the block hash, so loading it needs no header hashing.
+ */
+struct IndexSnapshotRecord {
+    uint256 hash;
+    CDiskBlockIndex* index;
+    IndexSnapshotRecord(CDiskBlockIndex* ptr) : index(ptr) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(index->hashPrev);
+        READWRITE(index->nHeight);
+        READWRITE(index->nStatus);
+        READWRITE(index->nStakeModifier);
+        READWRITE(index->nTx);
+        READWRITE(index->nFile);
+        READWRITE(index->nDataPos);
+        READWRITE(index->nUndoPos);
+        READWRITE(index->nVersion);
+        READWRITE(index->hashMerkleRoot);
+        READWRITE(index->nTime);
+        READWRITE(index->nBits);
+        READWRITE(index->nNonce);
+        READWRITE(index->nMoneySupply);
+    }
+};
+
+boost::filesystem::path GetIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / INDEX_SNAPSHOT_FILENAME;
+}
+
+void RemoveIndexSnapshot()
+{
+    try {
+        boost::filesystem::remove(GetIndexSnapshotPath());
+    } catch (const boost::filesystem::filesystem_error& e) {
+        LogPrintf("%s: Unable to remove block index snapshot: %s\n", __func__, e.what());
+    }
+}
 
+}
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbOptions) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, dbOptions), fQueueWrites(false)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(std::make_pair(DB_COINS, txid), coins);
+CCoinsViewDB::~CCoinsViewDB() {
+    FlushQueued();
+}
+
+std::shared_ptr<const CCoinsMap> CCoinsViewDB::GetQueued() const {
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    return pcoinsQueued;
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    std::shared_ptr<const CCoinsMap> pcoins = GetQueued();
+    if (pcoins) {
+        CCoinsMap::const_iterator it = pcoins->find(outpoint);
+        if (it != pcoins->end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
+}
+
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    std::shared_ptr<const CCoinsMap> pcoins = GetQueued();
+    if (pcoins) {
+        CCoinsMap::const_iterator it = pcoins->find(outpoint);
+        if (it != pcoins->end())
+            return !it->second.coin.IsSpent();
+    }
+    return db.Exists(CoinEntry(&outpoint));
+}
+
+// A coin key as LevelDB orders it
+static std::string CoinDiskKey(const COutPoint &outpoint) {
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << CoinEntry(&outpoint);
+    return std::string(ssKey.begin(), ssKey.end());
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(std::make_pair(DB_COINS, txid));
+void CCoinsViewDB::GetCoins(const std::vector<COutPoint> &vOutPoints, std::vector<Coin> &vCoins) const {
+    vCoins.assign(vOutPoints.size(), Coin());
+    std::shared_ptr<const CCoinsMap> pcoins = GetQueued();
+    std::vector<std::pair<std::string, size_t> > vSorted;
+    vSorted.reserve(vOutPoints.size());
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        if (pcoins) {
+            CCoinsMap::const_iterator it = pcoins->find(vOutPoints[i]);
+            if (it != pcoins->end()) {
+                vCoins[i] = it->second.coin;
+                continue;
+            }
+        }
+        vSorted.push_back(std::make_pair(CoinDiskKey(vOutPoints[i]), i));
+    }
+    std::sort(vSorted.begin(), vSorted.end());
+
+    // As CIndexesDB::ReadSpentIndexes: the outputs of one transaction are
+    // neighbours, so the cursor mostly only has to step to the next key
+    std::unique_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    bool fSeeked = false;
+    COutPoint keyCursor;
+    CoinEntry entry(&keyCursor);
+    for (const std::pair<std::string, size_t>& item : vSorted) {
+        bool fValid = fSeeked && pcursor->Valid() && pcursor->GetKey(entry) && entry.key == DB_COIN;
+        if (fValid && CoinDiskKey(keyCursor) < item.first) {
+            pcursor->Next();
+            fValid = pcursor->Valid() && pcursor->GetKey(entry) && entry.key == DB_COIN;
+        }
+        if (!fValid || CoinDiskKey(keyCursor) < item.first) {
+            pcursor->Seek(CoinEntry(&vOutPoints[item.second]));
+            fSeeked = true;
+            if (!pcursor->Valid() || !pcursor->GetKey(entry) || entry.key != DB_COIN)
+                break;
+        }
+        if (keyCursor == vOutPoints[item.second] && !pcursor->GetValue(vCoins[item.second]))
+            vCoins[item.second].Clear();
+    }
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queue);
+        if (pcoinsQueued && !hashBlockQueued.IsNull())
+            return hashBlockQueued;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(std::make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(std::make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
+    // The marker goes in the same batch, so it never claims more than is on disk
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    // Keep a single flush in flight, so a slow disk cannot pile up copies of the cache
+    if (!FlushQueued())
+        return false;
+    if (!fQueueWrites) {
+        LOCK(cs_write);
+        return WriteCoins(mapCoins, hashBlock);
+    }
+
+    std::shared_ptr<CCoinsMap> pcoins = std::make_shared<CCoinsMap>();
+    pcoins->swap(mapCoins);
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queue);
+        pcoinsQueued = pcoins;
+        hashBlockQueued = hashBlock;
+    }
+    condQueue.notify_one();
+    return true;
+}
+
+bool CCoinsViewDB::FlushQueued() {
+    LOCK(cs_write);
+    std::shared_ptr<const CCoinsMap> pcoins;
+    uint256 hashBlock;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queue);
+        pcoins = pcoinsQueued;
+        hashBlock = hashBlockQueued;
+    }
+    if (!pcoins)
+        return true;
+
+    int64_t nStart = GetTimeMicros();
+    if (!WriteCoins(*pcoins, hashBlock))
+        return false;
+    LogPrint("bench", "    - Write queued coins: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    pcoinsQueued.reset();
+    hashBlockQueued.SetNull();
+    return true;
+}
+
+void CCoinsViewDB::WaitForQueued() {
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    while (!pcoinsQueued)
+        condQueue.wait(lock);
+}
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView *viewIn, size_t nMaxUsageIn) : CCoinsViewBacked(viewIn), cachedCoinsUsage(0), nMaxUsage(nMaxUsageIn), nGeneration(0)
+{
+}
+
+size_t CCoinsViewPrefetch::DynamicMemoryUsage() const {
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
+bool CCoinsViewPrefetch::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_prefetch);
+        boost::unordered_map<COutPoint, Coin, SaltedOutpointHasher>::iterator it = cacheCoins.find(outpoint);
+        if (it != cacheCoins.end()) {
+            // The cache above keeps it from here on
+            cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+            coin = std::move(it->second);
+            cacheCoins.erase(it);
+            return true;
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewPrefetch::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_prefetch);
+        if (cacheCoins.count(outpoint))
+            return true;
+    }
+    return base->HaveCoin(outpoint);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    bool fOk = base->BatchWrite(mapCoins, hashBlock);
+    // Only after the write: a lookup that read the old state meanwhile sees the generation change
+    boost::unique_lock<boost::mutex> lock(cs_prefetch);
+    nGeneration++;
+    cacheCoins.clear();
+    cachedCoinsUsage = 0;
+    return fOk;
+}
+
+void CCoinsViewPrefetch::Prefetch(const std::shared_ptr<const CBlock> &pblock) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_prefetch);
+        if (queue.size() >= MAX_PREFETCH_BLOCKS_QUEUED)
+            return;
+        queue.push_back(pblock);
+    }
+    condQueue.notify_one();
+}
+
+void CCoinsViewPrefetch::Thread() {
+    while (true) {
+        std::shared_ptr<const CBlock> pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_prefetch);
+            while (queue.empty())
+                condQueue.wait(lock);
+            pblock = queue.front();
+            queue.pop_front();
+        }
+
+        for (const CTransactionRef &tx : pblock->vtx) {
+            if (tx->IsCoinBase())
+                continue;
+            for (const CTxIn &txin : tx->vin) {
+                uint64_t nGenerationRead;
+                {
+                    boost::unique_lock<boost::mutex> lock(cs_prefetch);
+                    if (DynamicMemoryUsage() >= nMaxUsage)
+                        break;
+                    if (cacheCoins.count(txin.prevout))
+                        continue;
+                    nGenerationRead = nGeneration;
+                }
+                // Outputs of blocks not yet connected are simply not found
+                Coin coin;
+                if (!base->GetCoin(txin.prevout, coin))
+                    continue;
+                boost::unique_lock<boost::mutex> lock(cs_prefetch);
+                if (nGenerationRead != nGeneration)
+                    continue;
+                std::pair<boost::unordered_map<COutPoint, Coin, SaltedOutpointHasher>::iterator, bool> ret = cacheCoins.emplace(txin.prevout, std::move(coin));
+                if (ret.second)
+                    cachedCoinsUsage += ret.first->second.DynamicMemoryUsage();
+            }
+            boost::this_thread::interruption_point();
+        }
+    }
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbOptions) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, dbOptions) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -97,31 +426,169 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+namespace {
+
+/** What one txid range contributes to CCoinsStats */
+struct CCoinsRangeStats
+{
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    uint64_t nBogoSize;
+    CAmount nTotalAmount;
+    uint256 hash;
+    bool fOk;
+
+    CCoinsRangeStats() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nBogoSize(0), nTotalAmount(0), fOk(false) {}
+};
+
+void ApplyStats(CCoinsRangeStats& stats, CHashWriter* pss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    stats.nTransactions++;
+    if (pss)
+        *pss << hash;
+    for (const auto& output : outputs) {
+        if (pss) {
+            *pss << VARINT(output.first + 1);
+            *pss << output.second.out;
+        }
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += output.second.out.nValue;
+        stats.nBogoSize += GetBogoSize(output.second.out);
+    }
+    if (pss)
+        *pss << VARINT(0);
+}
+
+/** Scan the coins whose txid begins with a byte in range nRange of COINS_STATS_PARTITIONS */
+void GetRangeStats(const CDBWrapper& db, const CDBSnapshot& snapshot, int nRange, bool fHash, CCoinsRangeStats& stats)
+{
+    const int nRangeWidth = 256 / COINS_STATS_PARTITIONS;
+    try {
+        std::unique_ptr<CDBIterator> pcursor(db.NewIterator(snapshot));
+        COutPoint key;
+        *key.hash.begin() = nRange * nRangeWidth;
+        key.n = 0;
+        pcursor->Seek(CoinEntry(&key));
+
+        std::unique_ptr<CHashWriter> pss;
+        if (fHash)
+            pss.reset(new CHashWriter(SER_GETHASH, PROTOCOL_VERSION));
+        // Outputs are stored sorted by txid, so the ones of a transaction are
+        // gathered and hashed together as in the per-transaction format
+        uint256 prevkey;
+        std::map<uint32_t, Coin> outputs;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            CoinEntry entry(&key);
+            if (!pcursor->GetKey(entry) || entry.key != DB_COIN || *key.hash.begin() / nRangeWidth != nRange)
+                break;
+            Coin coin;
+            if (!pcursor->GetValue(coin))
+                return;
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, pss.get(), prevkey, outputs);
+                outputs.clear();
+            }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
+            stats.nSerializedSize += 32 + pcursor->GetValueSize();
+        }
+        if (!outputs.empty())
+            ApplyStats(stats, pss.get(), prevkey, outputs);
+        if (pss)
+            stats.hash = pss->GetHash();
+        stats.fOk = true;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+}
+
+} // anon namespace
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats, bool fHash, int nThreads) const
+{
+    CDBSnapshot snapshot(db);
+    stats.hashBlock.SetNull();
+    db.Read(DB_BEST_BLOCK, stats.hashBlock, &snapshot);
+
+    std::vector<CCoinsRangeStats> vRangeStats(COINS_STATS_PARTITIONS);
+    std::atomic<int> nNextRange(0);
+    auto worker = [&]() {
+        for (int nRange; (nRange = nNextRange++) < COINS_STATS_PARTITIONS; )
+            GetRangeStats(db, snapshot, nRange, fHash, vRangeStats[nRange]);
+    };
+    boost::thread_group threadGroup;
+    for (int i = 1; i < std::min(nThreads, COINS_STATS_PARTITIONS); i++)
+        threadGroup.create_thread(worker);
+    worker();
+    threadGroup.join_all();
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << stats.hashBlock;
+    for (const CCoinsRangeStats& range : vRangeStats) {
+        if (!range.fOk)
+            return error("%s: unable to read coin database", __func__);
+        stats.nTransactions += range.nTransactions;
+        stats.nTransactionOutputs += range.nTransactionOutputs;
+        stats.nSerializedSize += range.nSerializedSize;
+        stats.nBogoSize += range.nBogoSize;
+        stats.nTotalAmount += range.nTotalAmount;
+        ss << range.hash;
+    }
+    if (fHash)
+        stats.hashSerialized = ss.GetHash();
+    else
+        stats.hashSerialized.SetNull();
+    return true;
+}
+
+bool CCoinsViewDB::ReadTotals(uint256& hashBlock, CCoinsTotals& totals) const
+{
+    std::pair<uint256, CCoinsTotals> record;
+    if (!db.Read(DB_COINS_TOTALS, record))
+        return false;
+    hashBlock = record.first;
+    totals = record.second;
+    return true;
+}
+
+bool CCoinsViewDB::WriteTotals(const uint256& hashBlock, const CCoinsTotals& totals)
+{
+    return db.Write(DB_COINS_TOTALS, std::make_pair(hashBlock, totals));
+}
+
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
     CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -131,14 +598,151 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
+}
+
+namespace {
+
+/** Legacy class to deserialize pre-pertxout database entries without reindex. */
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+    bool fCoinStake;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    unsigned int nTime;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nTime(0) {}
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        fCoinStake = nCode & 8;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+        ::Unserialize(s, VARINT(nTime));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model (0.14 and older) to the
+ * per-txout model. Each output is written under its own key, so spending one
+ * output no longer rewrites the remaining outputs of its transaction.
+ */
+bool CCoinsViewDB::Upgrade() {
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 16;
+    CDBBatch batch(db);
+    size_t nBatch = 0;
+    int reportDone = 0;
+    std::pair<unsigned char, uint256> key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase, old_coins.fCoinStake, old_coins.nTime);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                    nBatch++;
+                }
+            }
+            batch.Erase(key);
+            // Write in chunks so that an interrupted upgrade resumes where it stopped
+            if (++nBatch >= batch_size) {
+                if (!db.WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatch = 0;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -164,98 +768,224 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
-    return Read(std::make_pair(DB_SPENTINDEX, key), value);
+bool CBlockTreeDB::ReadCompactTxIndex(const uint256 &txid, std::vector<CBlockTxPos> &vPos) {
+    return Read(std::make_pair(DB_TXINDEX_COMPACT, txid.GetCheapHash()), vPos);
 }
 
-bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
-        if (it->second.IsNull()) {
-            batch.Erase(std::make_pair(DB_SPENTINDEX, it->first));
-        } else {
-            batch.Write(std::make_pair(DB_SPENTINDEX, it->first), it->second);
+bool CBlockTreeDB::WriteCompactTxIndex(int nHeight, const std::vector<std::pair<uint256, unsigned int> > &list) {
+    std::map<uint64_t, std::vector<CBlockTxPos> > mapPos;
+    for (std::vector<std::pair<uint256, unsigned int> >::const_iterator it = list.begin(); it != list.end(); it++) {
+        const uint64_t nKey = it->first.GetCheapHash();
+        std::map<uint64_t, std::vector<CBlockTxPos> >::iterator mi = mapPos.find(nKey);
+        if (mi == mapPos.end()) {
+            mi = mapPos.insert(std::make_pair(nKey, std::vector<CBlockTxPos>())).first;
+            // Hardly any key is taken yet, and the bloom filter answers most of these reads
+            if (Read(std::make_pair(DB_TXINDEX_COMPACT, nKey), mi->second)) {
+                std::vector<CBlockTxPos> &vPos = mi->second;
+                vPos.erase(std::remove_if(vPos.begin(), vPos.end(), [nHeight](const CBlockTxPos &pos) { return pos.nHeight >= nHeight; }), vPos.end());
+            }
         }
+        mi->second.push_back(CBlockTxPos(nHeight, it->second));
     }
+    CDBBatch batch(*this);
+    for (std::map<uint64_t, std::vector<CBlockTxPos> >::const_iterator mi = mapPos.begin(); mi != mapPos.end(); mi++)
+        batch.Write(std::make_pair(DB_TXINDEX_COMPACT, mi->first), mi->second);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
-	CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
-        if (it->second.IsNull()) {
-            batch.Erase(std::make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
-        } else {
-            batch.Write(std::make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
+bool CBlockTreeDB::ReadBlockFilter(const uint256 &hash, CBlockFilter &filter) {
+    return Read(std::make_pair(DB_BLOCKFILTER, hash), filter);
+}
+
+bool CBlockTreeDB::WriteBlockFilter(const CBlockFilter &filter) {
+    return Write(std::make_pair(DB_BLOCKFILTER, filter.GetBlockHash()), filter);
+}
+
+bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
+    return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
+}
+
+bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
+    char ch;
+    if (!Read(std::make_pair(DB_FLAG, name), ch))
+        return false;
+    fValue = ch == '1';
+    return true;
+}
+
+bool CBlockTreeDB::ReadVerifiedBlock(uint256 &hash) {
+    return Read(DB_VERIFIED_BLOCK, hash);
+}
+
+bool CBlockTreeDB::WriteVerifiedBlock(const uint256 &hash) {
+    return Write(DB_VERIFIED_BLOCK, hash);
+}
+
+/** Fill in a block index entry from its on-disk form */
+static void InsertDiskBlockIndex(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, const uint256 &hash, const CDiskBlockIndex &diskindex)
+{
+    CBlockIndex* pindexNew = insertBlockIndex(hash);
+    pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nDataPos       = diskindex.nDataPos;
+    pindexNew->nUndoPos       = diskindex.nUndoPos;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+    pindexNew->nStatus        = diskindex.nStatus;
+    pindexNew->nTx            = diskindex.nTx;
+    pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    // JBCoin: Disable PoW Sanity check while loading block index from disk.
+    // We use the sha256 hash for the block index for performance reasons, which is recorded for later use.
+    // CheckProofOfWork() uses the scrypt hash which is discarded after a block is accepted.
+    // While it is technically feasible to verify the PoW, doing so takes several minutes as it
+    // requires recomputing every PoW hash during every JBCoin startup.
+    // We opt instead to simply trust the data that is on your local disk here, and let
+    // ThreadPoWVerifier check it in the background once loading is done.
+    //if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
+    //    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+}
+
+bool CBlockTreeDB::WriteIndexSnapshot(const std::vector<const CBlockIndex*>& blockinfo)
+{
+    // Invalidate any older snapshot before its file is replaced
+    if (Exists(DB_INDEX_SNAPSHOT) && !Erase(DB_INDEX_SNAPSHOT, true))
+        return error("%s: failed to erase snapshot marker", __func__);
+
+    uint256 id = GetRandHash();
+    boost::filesystem::path pathTmp = GetIndexSnapshotPath();
+    pathTmp += ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        uint64_t nCount = blockinfo.size();
+        fileout << INDEX_SNAPSHOT_MAGIC << INDEX_SNAPSHOT_VERSION << id << nCount;
+        hasher << INDEX_SNAPSHOT_MAGIC << INDEX_SNAPSHOT_VERSION << id << nCount;
+        for (const CBlockIndex* pindex : blockinfo) {
+            CDiskBlockIndex diskindex(pindex);
+            IndexSnapshotRecord record(&diskindex);
+            record.hash = pindex->GetBlockHash();
+            fileout << record;
+            hasher << record;
         }
+        fileout << hasher.GetHash();
+        FileCommit(fileout.Get());
+        fileout.fclose();
+    } catch (const std::exception& e) {
+        return error("%s: failed to write snapshot: %s", __func__, e.what());
     }
-    return WriteBatch(batch);
-}
 
-bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
-                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    if (!RenameOver(pathTmp, GetIndexSnapshotPath()))
+        return error("%s: failed to rename %s", __func__, pathTmp.string());
 
-    pcursor->Seek(std::make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    // Only now does the snapshot describe the database
+    return Write(DB_INDEX_SNAPSHOT, id, true);
+}
 
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        std::pair<char,CAddressUnspentKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.hashBytes == addressHash) {
-            CAddressUnspentValue nValue;
-            if (pcursor->GetValue(nValue)) {
-                unspentOutputs.push_back(std::make_pair(key.second, nValue));
-                pcursor->Next();
-            } else {
-                return error("failed to get address unspent value");
-            }
-        } else {
-            break;
+bool CBlockTreeDB::LoadIndexSnapshot(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    uint256 id;
+    if (!Read(DB_INDEX_SNAPSHOT, id)) {
+        RemoveIndexSnapshot();
+        return false;
+    }
+    // Any block index write from here on makes the snapshot stale, so it is
+    // good for this one load only
+    if (!Erase(DB_INDEX_SNAPSHOT, true))
+        return false;
+
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    {
+        FILE *file = fopen(GetIndexSnapshotPath().string().c_str(), "rb");
+        if (!file)
+            return error("%s: snapshot file missing", __func__);
+        bool fReadOk = fseek(file, 0, SEEK_END) == 0;
+        long nSize = fReadOk ? ftell(file) : -1;
+        fReadOk = nSize >= (long)(INDEX_SNAPSHOT_HEADER_SIZE + 32) && fseek(file, 0, SEEK_SET) == 0;
+        if (fReadOk) {
+            ssSnapshot.resize(nSize);
+            fReadOk = fread(&ssSnapshot[0], 1, nSize, file) == (size_t)nSize;
         }
+        fclose(file);
+        RemoveIndexSnapshot();
+        if (!fReadOk)
+            return error("%s: failed to read snapshot file", __func__);
     }
 
+    // Check everything before touching the block index, so falling back leaves nothing behind
+    uint256 hashChecksum;
+    memcpy(hashChecksum.begin(), &ssSnapshot[ssSnapshot.size() - 32], 32);
+    if (Hash(ssSnapshot.begin(), ssSnapshot.end() - 32) != hashChecksum)
+        return error("%s: snapshot checksum mismatch", __func__);
+
+    uint32_t nMagic, nVersion;
+    uint256 idFile;
+    uint64_t nCount;
+    ssSnapshot >> nMagic >> nVersion >> idFile >> nCount;
+    if (nMagic != INDEX_SNAPSHOT_MAGIC || nVersion != INDEX_SNAPSHOT_VERSION || idFile != id)
+        return error("%s: snapshot does not belong to this database", __func__);
+    if (ssSnapshot.size() - 32 != nCount * INDEX_SNAPSHOT_RECORD_SIZE)
+        return error("%s: snapshot size mismatch", __func__);
+
+    CDiskBlockIndex diskindex;
+    IndexSnapshotRecord record(&diskindex);
+    for (uint64_t i = 0; i < nCount; i++) {
+        if (i % 1024 == 0)
+            boost::this_thread::interruption_point();
+        ssSnapshot >> record;
+        InsertDiskBlockIndex(insertBlockIndex, record.hash, diskindex);
+    }
+    LogPrintf("%s: loaded %u block index entries from snapshot\n", __func__, nCount);
     return true;
 }
 
-bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(std::make_pair(DB_ADDRESSINDEX, it->first), it->second);
-    return WriteBatch(batch);
+bool CBlockTreeDB::LoadBlockIndexEntries(const std::vector<uint256>& vHashes, boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    for (const uint256& hash : vHashes) {
+        CDiskBlockIndex diskindex;
+        if (!Read(std::make_pair(DB_BLOCK_INDEX, hash), diskindex))
+            return error("%s: failed to read block index entry %s", __func__, hash.ToString());
+        InsertDiskBlockIndex(insertBlockIndex, hash, diskindex);
+    }
+    return true;
 }
 
-bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Erase(std::make_pair(DB_ADDRESSINDEX, it->first));
-    return WriteBatch(batch);
+bool CBlockTreeDB::ParseBlockIndexKey(const std::string& strKey, uint256& hash)
+{
+    if (strKey.size() != 1 + hash.size() || strKey[0] != DB_BLOCK_INDEX)
+        return false;
+    memcpy(hash.begin(), strKey.data() + 1, hash.size());
+    return true;
 }
 
-bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
-                                    std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                                    int start, int end) {
+bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    if (LoadIndexSnapshot(insertBlockIndex))
+        return true;
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
 
-    if (start > 0 && end > 0) {
-        pcursor->Seek(std::make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
-    } else {
-        pcursor->Seek(std::make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
-    }
+    pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, uint256()));
 
+    // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char,CAddressIndexKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && key.second.hashBytes == addressHash) {
-            if (end > 0 && key.second.blockHeight > end) {
-                break;
-            }
-            CAmount nValue;
-            if (pcursor->GetValue(nValue)) {
-                addressIndex.push_back(std::make_pair(key.second, nValue));
+        std::pair<char, uint256> key;
+        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+            CDiskBlockIndex diskindex;
+            if (pcursor->GetValue(diskindex)) {
+                InsertDiskBlockIndex(insertBlockIndex, diskindex.GetBlockHash(), diskindex);
                 pcursor->Next();
             } else {
-                return error("failed to get address index value");
+                return error("LoadBlockIndex() : failed to read value");
             }
         } else {
             break;
@@ -265,31 +995,909 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
-    CDBBatch batch(*this);
-    batch.Write(std::make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
+bool CBlockTreeDB::ReadPoWHashes(std::vector<std::pair<uint256, uint256> > &vPoWHash)
+{
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(std::make_pair(DB_POW_HASH, uint256()));
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != DB_POW_HASH)
+            break;
+        uint256 hashPoW;
+        if (!pcursor->GetValue(hashPoW))
+            return error("%s: failed to read value", __func__);
+        vPoWHash.push_back(std::make_pair(key.second, hashPoW));
+        pcursor->Next();
+    }
+    return true;
+}
+
+bool CBlockTreeDB::WritePoWHashes(const std::vector<std::pair<uint256, uint256> > &vPoWHash)
+{
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<uint256, uint256> >::const_iterator it = vPoWHash.begin(); it != vPoWHash.end(); it++)
+        batch.Write(std::make_pair(DB_POW_HASH, it->first), it->second);
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
+/** Order-preserving variable-length integer: the leading one bits of the
+ *  first byte count the bytes that follow, so shorter encodings sort first
+ *  and encodings of equal length compare as big-endian numbers */
+template<typename Stream>
+static void WriteOrderedVarInt(Stream &s, uint32_t n)
+{
+    int nExtra = n < 0x80 ? 0 : n < 0x4000 ? 1 : n < 0x200000 ? 2 : n < 0x10000000 ? 3 : 4;
+    uint8_t chPrefix = ~(0xff >> nExtra);
+    ser_writedata8(s, chPrefix | (nExtra < 4 ? n >> (8 * nExtra) : 0));
+    for (int i = nExtra - 1; i >= 0; i--)
+        ser_writedata8(s, (n >> (8 * i)) & 0xff);
+}
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+template<typename Stream>
+static uint32_t ReadOrderedVarInt(Stream &s)
+{
+    uint8_t chFirst = ser_readdata8(s);
+    int nExtra = 0;
+    while (nExtra < 5 && (chFirst & (0x80 >> nExtra)))
+        nExtra++;
+    if (nExtra > 4)
+        throw std::ios_base::failure("ReadOrderedVarInt(): invalid prefix");
+    uint32_t n = chFirst & (0x7f >> nExtra);
+    for (int i = 0; i < nExtra; i++)
+        n = (n << 8) | ser_readdata8(s);
+    return n;
+}
+
+namespace {
+/** Compact on-disk key of the address index. The txid is left out: the
+ *  height and position of the transaction identify it, and a DB_TXNUM record
+ *  per transaction maps them back to the txid. */
+struct CAddressIndexCompactKey {
+    CAddressIndexKey key;
+
+    CAddressIndexCompactKey() {}
+    explicit CAddressIndexCompactKey(const CAddressIndexKey &keyIn) : key(keyIn) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ser_writedata8(s, key.type);
+        key.hashBytes.Serialize(s);
+        WriteOrderedVarInt(s, key.blockHeight);
+        WriteOrderedVarInt(s, key.txindex);
+        WriteOrderedVarInt(s, key.index);
+        ser_writedata8(s, key.spending);
+    }
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        key.type = ser_readdata8(s);
+        key.hashBytes.Unserialize(s);
+        key.blockHeight = ReadOrderedVarInt(s);
+        key.txindex = ReadOrderedVarInt(s);
+        key.index = ReadOrderedVarInt(s);
+        key.spending = ser_readdata8(s);
+        key.txhash.SetNull();
+    }
+};
+
+/** Seek position of an address from a height on, in the compact format */
+struct CAddressIndexCompactHeightKey {
+    unsigned int type;
+    uint160 hashBytes;
+    int blockHeight;
+
+    CAddressIndexCompactHeightKey(unsigned int typeIn, const uint160 &hashBytesIn, int blockHeightIn) :
+        type(typeIn), hashBytes(hashBytesIn), blockHeight(blockHeightIn) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ser_writedata8(s, type);
+        hashBytes.Serialize(s);
+        WriteOrderedVarInt(s, blockHeight);
+    }
+};
+
+/** Amount of a compact address index entry: the compressed magnitude, with
+ *  the sign in the lowest bit */
+struct CAddressIndexCompactValue {
+    CAmount nValue;
+
+    CAddressIndexCompactValue() : nValue(0) {}
+    explicit CAddressIndexCompactValue(CAmount nValueIn) : nValue(nValueIn) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        uint64_t n = CTxOutCompressor::CompressAmount(nValue < 0 ? -nValue : nValue) * 2 + (nValue < 0);
+        s << VARINT(n);
+    }
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        uint64_t n = 0;
+        s >> VARINT(n);
+        nValue = CTxOutCompressor::DecompressAmount(n / 2);
+        if (n & 1)
+            nValue = -nValue;
+    }
+};
+
+/** Position of a transaction in the chain, the key of the DB_TXNUM records */
+struct CTxNumKey {
+    int blockHeight;
+    unsigned int txindex;
+
+    CTxNumKey(int blockHeightIn, unsigned int txindexIn) : blockHeight(blockHeightIn), txindex(txindexIn) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ser_writedata32be(s, blockHeight);
+        ser_writedata32be(s, txindex);
+    }
+};
+
+/** Compact value of the address unspent index. The script is only stored
+ *  when it is not the standard one of the address (pay-to-pubkey outputs). */
+struct CAddressUnspentCompactValue {
+    CAmount satoshis;
+    int blockHeight;
+    uint64_t nTime;
+    bool fImpliedScript;
+    CScript script;
+
+    CAddressUnspentCompactValue() : satoshis(0), blockHeight(0), nTime(0), fImpliedScript(true) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        uint64_t nAmount = CTxOutCompressor::CompressAmount(satoshis);
+        uint32_t nHeight = blockHeight;
+        s << VARINT(nAmount) << VARINT(nHeight) << VARINT(nTime);
+        ser_writedata8(s, fImpliedScript);
+        if (!fImpliedScript)
+            s << CScriptCompressor(REF(script));
+    }
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        uint64_t nAmount = 0;
+        uint32_t nHeight = 0;
+        s >> VARINT(nAmount) >> VARINT(nHeight) >> VARINT(nTime);
+        satoshis = CTxOutCompressor::DecompressAmount(nAmount);
+        blockHeight = nHeight;
+        fImpliedScript = ser_readdata8(s);
+        script.clear();
+        if (!fImpliedScript) {
+            CScriptCompressor compressor(script);
+            s >> compressor;
+        }
+    }
+};
+}
+
+//! The script an address index type and hash stand for
+static CScript GetAddressScript(unsigned int type, const uint160 &hashBytes)
+{
+    if (type == 2)
+        return GetScriptForDestination(CScriptID(hashBytes));
+    if (type == 1)
+        return GetScriptForDestination(CKeyID(hashBytes));
+    return CScript();
+}
+
+void CIndexesDB::WriteAddressIndexEntry(CDBBatch &batch, const CAddressIndexKey &key, CAmount nValue) const {
+    if (fCompactAddressIndex) {
+        batch.Write(std::make_pair(DB_ADDRESSINDEX_COMPACT, CAddressIndexCompactKey(key)), CAddressIndexCompactValue(nValue));
+        batch.Write(std::make_pair(DB_TXNUM, CTxNumKey(key.blockHeight, key.txindex)), key.txhash);
+    } else {
+        batch.Write(std::make_pair(DB_ADDRESSINDEX, key), nValue);
+    }
+}
+
+void CIndexesDB::EraseAddressIndexEntry(CDBBatch &batch, const CAddressIndexKey &key) const {
+    if (fCompactAddressIndex) {
+        batch.Erase(std::make_pair(DB_ADDRESSINDEX_COMPACT, CAddressIndexCompactKey(key)));
+        batch.Erase(std::make_pair(DB_TXNUM, CTxNumKey(key.blockHeight, key.txindex)));
+    } else {
+        batch.Erase(std::make_pair(DB_ADDRESSINDEX, key));
+    }
+}
+
+void CIndexesDB::WriteAddressUnspentEntry(CDBBatch &batch, const CAddressUnspentKey &key, const CAddressUnspentValue &value) const {
+    if (!fCompactAddressIndex) {
+        if (value.IsNull())
+            batch.Erase(std::make_pair(DB_ADDRESSUNSPENTINDEX, key));
+        else
+            batch.Write(std::make_pair(DB_ADDRESSUNSPENTINDEX, key), value);
+        return;
+    }
+
+    if (value.IsNull()) {
+        batch.Erase(std::make_pair(DB_ADDRESSUNSPENTINDEX_COMPACT, key));
+        return;
+    }
+    CAddressUnspentCompactValue compact;
+    compact.satoshis = value.satoshis;
+    compact.blockHeight = value.blockHeight;
+    compact.nTime = value.nTime;
+    compact.fImpliedScript = value.script == GetAddressScript(key.type, key.hashBytes);
+    if (!compact.fImpliedScript)
+        compact.script = value.script;
+    batch.Write(std::make_pair(DB_ADDRESSUNSPENTINDEX_COMPACT, key), compact);
+}
+
+namespace {
+/** Walks address index entries in either on-disk format, giving back the
+ *  full keys; in the compact format txids are looked up once per transaction */
+class CAddressIndexCursor
+{
+private:
+    CDBWrapper &db;
+    const bool fCompact;
+    const char chPrefix;
+    std::unique_ptr<CDBIterator> pcursor;
+    int nLastHeight;
+    unsigned int nLastTxIndex;
+    uint256 txhashLast;
+
+public:
+    CAddressIndexCursor(CDBWrapper &dbIn, bool fCompactIn) :
+        db(dbIn), fCompact(fCompactIn), chPrefix(fCompactIn ? DB_ADDRESSINDEX_COMPACT : DB_ADDRESSINDEX),
+        pcursor(dbIn.NewIterator()), nLastHeight(-1), nLastTxIndex(0) {}
+
+    //! Position at the first entry of the whole index
+    void SeekToFirst()
+    {
+        pcursor->Seek(chPrefix);
+    }
+
+    //! Position at the first entry of an address at or above nHeight
+    void Seek(unsigned int type, const uint160 &hashBytes, int nHeight)
+    {
+        if (nHeight <= 0)
+            pcursor->Seek(std::make_pair(chPrefix, CAddressIndexIteratorKey(type, hashBytes)));
+        else if (fCompact)
+            pcursor->Seek(std::make_pair(chPrefix, CAddressIndexCompactHeightKey(type, hashBytes, nHeight)));
+        else
+            pcursor->Seek(std::make_pair(chPrefix, CAddressIndexIteratorHeightKey(type, hashBytes, nHeight)));
+    }
+
+    //! Key of the current entry; false past the last address index entry
+    bool GetKey(CAddressIndexKey &key)
+    {
+        if (!pcursor->Valid())
+            return false;
+        if (!fCompact) {
+            std::pair<char, CAddressIndexKey> dbkey;
+            if (!pcursor->GetKey(dbkey) || dbkey.first != chPrefix)
+                return false;
+            key = dbkey.second;
+            return true;
+        }
+
+        std::pair<char, CAddressIndexCompactKey> dbkey;
+        if (!pcursor->GetKey(dbkey) || dbkey.first != chPrefix)
+            return false;
+        key = dbkey.second.key;
+        if (key.blockHeight != nLastHeight || key.txindex != nLastTxIndex) {
+            txhashLast.SetNull();
+            if (!db.Read(std::make_pair(DB_TXNUM, CTxNumKey(key.blockHeight, key.txindex)), txhashLast))
+                LogPrintf("%s: no txid for transaction %d:%u\n", __func__, key.blockHeight, key.txindex);
+            nLastHeight = key.blockHeight;
+            nLastTxIndex = key.txindex;
+        }
+        key.txhash = txhashLast;
+        return true;
+    }
+
+    bool GetValue(CAmount &nValue)
+    {
+        if (!fCompact)
+            return pcursor->GetValue(nValue);
+        CAddressIndexCompactValue value;
+        if (!pcursor->GetValue(value))
+            return false;
+        nValue = value.nValue;
+        return true;
+    }
+
+    void Next()
+    {
+        pcursor->Next();
+    }
+};
+}
+
+static size_t RunUsage(const CAddressIndexCache::IndexRun &run)
+{
+    return memusage::DynamicUsage(run);
+}
+
+static size_t RunUsage(const CAddressIndexCache::UnspentRun &run)
+{
+    size_t nUsage = memusage::DynamicUsage(run);
+    for (CAddressIndexCache::UnspentRun::const_iterator it = run.begin(); it != run.end(); it++)
+        nUsage += RecursiveDynamicUsage(it->second.script);
+    return nUsage;
+}
+
+CAddressIndexCache::CAddressIndexCache(size_t nMaxUsageIn) : nMaxUsage(nMaxUsageIn), nUsage(0), nGeneration(0) {
+}
+
+uint64_t CAddressIndexCache::GetGeneration() const {
+    LOCK(cs);
+    return nGeneration;
+}
+
+std::shared_ptr<const CAddressIndexCache::IndexRun> CAddressIndexCache::GetIndex(unsigned int type, const uint160 &hashBytes, int start, int end) {
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(CacheKey(std::make_pair(type, hashBytes), std::make_pair(start, end)));
+    if (it == mapEntries.end())
+        return std::shared_ptr<const IndexRun>();
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    return it->second->pindex;
+}
+
+std::shared_ptr<const CAddressIndexCache::UnspentRun> CAddressIndexCache::GetUnspent(unsigned int type, const uint160 &hashBytes) {
+    LOCK(cs);
+    EntryMap::iterator it = mapEntries.find(CacheKey(std::make_pair(type, hashBytes), std::make_pair(-1, -1)));
+    if (it == mapEntries.end())
+        return std::shared_ptr<const UnspentRun>();
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    return it->second->punspent;
+}
+
+void CAddressIndexCache::PutIndex(unsigned int type, const uint160 &hashBytes, int start, int end,
+                                  const std::shared_ptr<const IndexRun> &run, uint64_t nGenerationIn) {
+    CacheEntry entry;
+    entry.key = CacheKey(std::make_pair(type, hashBytes), std::make_pair(start, end));
+    entry.pindex = run;
+    entry.nUsage = RunUsage(*run);
+    Put(entry, nGenerationIn);
+}
+
+void CAddressIndexCache::PutUnspent(unsigned int type, const uint160 &hashBytes,
+                                    const std::shared_ptr<const UnspentRun> &run, uint64_t nGenerationIn) {
+    CacheEntry entry;
+    entry.key = CacheKey(std::make_pair(type, hashBytes), std::make_pair(-1, -1));
+    entry.punspent = run;
+    entry.nUsage = RunUsage(*run);
+    Put(entry, nGenerationIn);
+}
+
+void CAddressIndexCache::Put(CacheEntry &entry, uint64_t nGenerationIn) {
+    // Add the map and list nodes holding the entry
+    entry.nUsage += sizeof(CacheEntry) + 96;
+    if (entry.nUsage > MaxEntryUsage())
+        return;
+
+    LOCK(cs);
+    if (nGenerationIn != nGeneration)
+        return;
+    EntryMap::iterator it = mapEntries.find(entry.key);
+    if (it != mapEntries.end())
+        Erase(it);
+    while (nUsage + entry.nUsage > nMaxUsage && !listEntries.empty())
+        Erase(mapEntries.find(listEntries.back().key));
+    listEntries.push_front(entry);
+    mapEntries.insert(std::make_pair(entry.key, listEntries.begin()));
+    nUsage += entry.nUsage;
+}
+
+void CAddressIndexCache::Erase(EntryMap::iterator it) {
+    nUsage -= it->second->nUsage;
+    listEntries.erase(it->second);
+    mapEntries.erase(it);
+}
+
+void CAddressIndexCache::InvalidateIndex(unsigned int type, const uint160 &hashBytes, int nHeight) {
+    LOCK(cs);
+    nGeneration++;
+    // The entries of one address are adjacent in the map, its unspent outputs first
+    std::pair<unsigned int, uint160> address(type, hashBytes);
+    EntryMap::iterator it = mapEntries.lower_bound(CacheKey(address, std::make_pair(0, 0)));
+    while (it != mapEntries.end() && it->first.first == address) {
+        const std::pair<int, int> &range = it->first.second;
+        if ((range.first == 0 && range.second == 0) || (range.first <= nHeight && nHeight <= range.second))
+            Erase(it++);
+        else
+            it++;
+    }
+}
+
+void CAddressIndexCache::InvalidateUnspent(unsigned int type, const uint160 &hashBytes) {
+    LOCK(cs);
+    nGeneration++;
+    EntryMap::iterator it = mapEntries.find(CacheKey(std::make_pair(type, hashBytes), std::make_pair(-1, -1)));
+    if (it != mapEntries.end())
+        Erase(it);
+}
+
+void CAddressIndexCache::Clear() {
+    LOCK(cs);
+    nGeneration++;
+    listEntries.clear();
+    mapEntries.clear();
+    nUsage = 0;
+}
+
+size_t CAddressIndexCache::DynamicMemoryUsage() const {
+    LOCK(cs);
+    return nUsage;
+}
+
+// Index reads are mostly prefix scans that bypass the bloom filter, so give a
+// larger share of the cache to write buffers to cut down on level-0 compactions
+CDBOptions CIndexesDB::DefaultOptions(size_t nCacheSize)
+{
+    CDBOptions dbOptions;
+    dbOptions.nWriteBufferSize = nCacheSize * 3 / 8;
+    return dbOptions;
+}
+
+CIndexesDB::CIndexesDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nAddressCacheSize) :
+    CIndexesDB(nCacheSize, fMemory, fWipe, nAddressCacheSize, DefaultOptions(nCacheSize)) {
+}
+
+CIndexesDB::CIndexesDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nAddressCacheSize, const CDBOptions& dbOptions) :
+    CDBWrapper(GetDataDir() / "indexes", nCacheSize, fMemory, fWipe, false, dbOptions), nHolds(0), nQueuedHeld(0), addressCache(nAddressCacheSize) {
+    fCompactAddressIndex = Exists(std::make_pair(DB_FLAG, std::string("addresscompact")));
+}
+
+CIndexesDB::~CIndexesDB() {
+    Flush(true);
+}
+
+bool CIndexesDB::QueueUpdate(const std::shared_ptr<const CIndexUpdate>& update) {
+    size_t nQueued;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queue);
+        listQueued.push_back(update);
+        if (nHolds > 0)
+            nQueuedHeld++;
+        nQueued = listQueued.size();
+
+        // Only once the update is queued, so a reader that takes the new
+        // generation and then flushes is sure to read past it
+        if (addressCache.IsEnabled()) {
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = update->vAddressIndex.begin(); it != update->vAddressIndex.end(); it++)
+                addressCache.InvalidateIndex(it->first.type, it->first.hashBytes, it->first.blockHeight);
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = update->vAddressIndexErase.begin(); it != update->vAddressIndexErase.end(); it++)
+                addressCache.InvalidateIndex(it->first.type, it->first.hashBytes, it->first.blockHeight);
+            for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = update->vAddressUnspentIndex.begin(); it != update->vAddressUnspentIndex.end(); it++)
+                addressCache.InvalidateUnspent(it->first.type, it->first.hashBytes);
+        }
+    }
+    condQueue.notify_one();
+    // Do not let a slow disk grow the queue without bound
+    if (nQueued >= MAX_INDEX_UPDATES_QUEUED)
+        return Flush();
+    return true;
+}
+
+typedef std::map<std::pair<unsigned int, uint160>, CAddressBalance> AddressBalanceMap;
+
+/** Fold the address index entries of one block into the running totals;
+ *  nSign is -1 when the block is disconnected */
+static void ApplyAddressBalances(CDBWrapper &db, AddressBalanceMap &balances,
+                                 const std::vector<std::pair<CAddressIndexKey, CAmount> > &entries, int nSign)
+{
+    std::set<std::pair<std::pair<unsigned int, uint160>, uint256> > setTxSeen;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = entries.begin(); it != entries.end(); it++) {
+        std::pair<unsigned int, uint160> address(it->first.type, it->first.hashBytes);
+        AddressBalanceMap::iterator itBalance = balances.find(address);
+        if (itBalance == balances.end()) {
+            itBalance = balances.insert(std::make_pair(address, CAddressBalance())).first;
+            db.Read(std::make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(address.first, address.second)), itBalance->second);
+        }
+        CAddressBalance &balance = itBalance->second;
+        balance.nBalance += nSign * it->second;
+        if (it->second > 0)
+            balance.nReceived += nSign * it->second;
+        if (setTxSeen.insert(std::make_pair(address, it->first.txhash)).second)
+            balance.nTxCount += nSign;
+    }
+}
+
+void CIndexesDB::BatchUpdates(CDBBatch &batch, const std::vector<std::shared_ptr<const CIndexUpdate> > &vUpdates) {
+    AddressBalanceMap balances;
+    for (const auto& update : vUpdates) {
+        if (!update->fBalancesApplied) {
+            ApplyAddressBalances(*this, balances, update->vAddressIndexErase, -1);
+            ApplyAddressBalances(*this, balances, update->vAddressIndex, 1);
+        }
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = update->vAddressIndexErase.begin(); it != update->vAddressIndexErase.end(); it++)
+            EraseAddressIndexEntry(batch, it->first);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = update->vAddressIndex.begin(); it != update->vAddressIndex.end(); it++)
+            WriteAddressIndexEntry(batch, it->first, it->second);
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = update->vAddressUnspentIndex.begin(); it != update->vAddressUnspentIndex.end(); it++)
+            WriteAddressUnspentEntry(batch, it->first, it->second);
+        for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = update->vSpentIndex.begin(); it != update->vSpentIndex.end(); it++) {
+            if (it->second.IsNull())
+                batch.Erase(std::make_pair(DB_SPENTINDEX, it->first));
+            else
+                batch.Write(std::make_pair(DB_SPENTINDEX, it->first), it->second);
+        }
+        for (std::vector<CTimestampIndexKey>::const_iterator it = update->vTimestampIndex.begin(); it != update->vTimestampIndex.end(); it++)
+            batch.Write(std::make_pair(DB_TIMESTAMPINDEX, *it), 0);
+        for (std::vector<std::pair<CTimestampBlockIndexKey, CTimestampBlockIndexValue> >::const_iterator it = update->vTimestampBlockIndex.begin(); it != update->vTimestampBlockIndex.end(); it++)
+            batch.Write(std::make_pair(DB_BLOCKHASHINDEX, it->first), it->second);
+    }
+    for (AddressBalanceMap::const_iterator it = balances.begin(); it != balances.end(); it++) {
+        std::pair<char, CAddressIndexIteratorKey> key(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(it->first.first, it->first.second));
+        if (it->second.IsNull())
+            batch.Erase(key);
+        else
+            batch.Write(key, it->second);
+    }
+}
+
+bool CIndexesDB::Flush(bool fSync) {
+    return WriteQueued(fSync, fSync);
+}
+
+bool CIndexesDB::WriteQueued(bool fSync, bool fHeld) {
+    LOCK(cs_write);
+    std::vector<std::shared_ptr<const CIndexUpdate> > vUpdates;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_queue);
+        size_t nWritable = listQueued.size();
+        if (fHeld || nQueuedHeld >= MAX_INDEX_UPDATES_QUEUED)
+            nQueuedHeld = 0;
+        else
+            nWritable -= nQueuedHeld;
+        vUpdates.assign(listQueued.begin(), std::next(listQueued.begin(), nWritable));
+    }
+    if (vUpdates.empty())
+        return true;
+
+    CDBBatch batch(*this);
+    BatchUpdates(batch, vUpdates);
+    // The marker goes in the same batch, so it never claims more than is on disk
+    batch.Write(DB_BEST_BLOCK, vUpdates.back()->hashBlock);
+    if (!WriteBatch(batch, fSync))
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    for (size_t i = 0; i < vUpdates.size(); i++)
+        listQueued.pop_front();
+    return true;
+}
+
+void CIndexesDB::WaitForQueued() {
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    while (listQueued.size() == nQueuedHeld)
+        condQueue.wait(lock);
+}
+
+CIndexesDB::WriteHold::WriteHold(CIndexesDB* pdbIn) : pdb(pdbIn) {
+    boost::unique_lock<boost::mutex> lock(pdb->cs_queue);
+    pdb->nHolds++;
+}
+
+CIndexesDB::WriteHold::~WriteHold() {
+    {
+        boost::unique_lock<boost::mutex> lock(pdb->cs_queue);
+        if (--pdb->nHolds > 0)
+            return;
+        pdb->nQueuedHeld = 0;
+    }
+    pdb->condQueue.notify_one();
+}
+
+size_t CIndexesDB::GetQueuedCount() const {
+    boost::unique_lock<boost::mutex> lock(cs_queue);
+    return listQueued.size();
+}
+
+bool CIndexesDB::ReadBestBlock(uint256 &hashBlock) {
+    return Read(DB_BEST_BLOCK, hashBlock);
+}
+
+bool CIndexesDB::ReadIndexBuild(CIndexBuildState &state) {
+    state.SetNull();
+    if (!Exists(DB_INDEXBUILD))
+        return true;
+    return Read(DB_INDEXBUILD, state);
+}
+
+namespace {
+//! Whatever follows the prefix of a key, passed through as is
+struct CKeyTail {
+    std::vector<char> vch;
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        if (!vch.empty())
+            s.write(vch.data(), vch.size());
+    }
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        vch.resize(s.size());
+        if (!vch.empty())
+            s.read(vch.data(), vch.size());
+    }
+};
+}
+
+//! Erase every record of one prefix, 10000 at a time
+static bool EraseIndexEntries(CDBWrapper &db, char chType)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(chType);
+
+    bool fMore = true;
+    while (fMore) {
+        CDBBatch batch(db);
+        size_t nBatch = 0;
+        fMore = false;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            std::pair<char, CKeyTail> key;
+            if (!pcursor->GetKey(key) || key.first != chType)
+                break;
+            batch.Erase(key);
+            pcursor->Next();
+            if (++nBatch == 10000) {
+                fMore = true;
+                break;
+            }
+        }
+        if (!db.WriteBatch(batch))
+            return false;
+    }
+    return true;
+}
+
+bool CIndexesDB::StartIndexBuild(const CIndexBuildState &state) {
+    LOCK(cs_write);
+    std::vector<char> vTypes;
+    if (state.fAddressIndex) {
+        const char chAddress[] = {DB_ADDRESSINDEX, DB_ADDRESSUNSPENTINDEX, DB_ADDRESSINDEX_COMPACT,
+                                  DB_ADDRESSUNSPENTINDEX_COMPACT, DB_TXNUM, DB_ADDRESSBALANCE};
+        vTypes.insert(vTypes.end(), chAddress, chAddress + sizeof(chAddress));
+    }
+    if (state.fSpentIndex)
+        vTypes.push_back(DB_SPENTINDEX);
+    if (state.fTimestampIndex) {
+        vTypes.push_back(DB_TIMESTAMPINDEX);
+        vTypes.push_back(DB_BLOCKHASHINDEX);
+    }
+    for (char chType : vTypes) {
+        if (!EraseIndexEntries(*this, chType))
+            return false;
+    }
+    addressCache.Clear();
+
+    CDBBatch batch(*this);
+    // The build keeps the address totals itself, starting from nothing
+    if (state.fAddressIndex)
+        batch.Write(std::make_pair(DB_FLAG, std::string("addressbalance")), '1');
+    batch.Write(DB_INDEXBUILD, state);
+    return WriteBatch(batch, true);
+}
+
+bool CIndexesDB::WriteIndexBuild(const std::vector<std::shared_ptr<const CIndexUpdate> > &vUpdates, const CIndexBuildState &state) {
+    LOCK(cs_write);
+    CDBBatch batch(*this);
+    BatchUpdates(batch, vUpdates);
+    batch.Write(DB_INDEXBUILD, state);
+    return WriteBatch(batch);
+}
+
+bool CIndexesDB::FinishIndexBuild(const uint256 &hashTip) {
+    LOCK(cs_write);
+    addressCache.Clear();
+    CDBBatch batch(*this);
+    batch.Erase(DB_INDEXBUILD);
+    batch.Write(DB_BEST_BLOCK, hashTip);
+    return WriteBatch(batch, true);
+}
+
+template <typename K, typename V>
+static bool MoveIndexEntries(CBlockTreeDB &from, CDBWrapper &to, char chType, size_t &nMoved)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(from.NewIterator());
+    pcursor->Seek(chType);
+
+    bool fMore = true;
+    while (fMore) {
+        CDBBatch batchTo(to);
+        CDBBatch batchFrom(from);
+        size_t nBatch = 0;
+        fMore = false;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            std::pair<char, K> key;
+            if (!pcursor->GetKey(key) || key.first != chType)
+                break;
+            V value;
+            if (!pcursor->GetValue(value))
+                return error("%s: failed to read index entry of type %c", __func__, chType);
+            batchTo.Write(key, value);
+            batchFrom.Erase(key);
+            pcursor->Next();
+            if (++nBatch == 10000) {
+                fMore = true;
+                break;
+            }
+        }
+        // Write the new copy before dropping the old one
+        if (!to.WriteBatch(batchTo, true) || !from.WriteBatch(batchFrom))
+            return false;
+        nMoved += nBatch;
+    }
+    return true;
+}
+
+bool CIndexesDB::MigrateFromBlockTree(CBlockTreeDB &blocktree) {
+    addressCache.Clear();
+    size_t nMoved = 0;
+    if (!MoveIndexEntries<CAddressIndexKey, CAmount>(blocktree, *this, DB_ADDRESSINDEX, nMoved) ||
+        !MoveIndexEntries<CAddressUnspentKey, CAddressUnspentValue>(blocktree, *this, DB_ADDRESSUNSPENTINDEX, nMoved) ||
+        !MoveIndexEntries<CSpentIndexKey, CSpentIndexValue>(blocktree, *this, DB_SPENTINDEX, nMoved) ||
+        !MoveIndexEntries<CTimestampIndexKey, int>(blocktree, *this, DB_TIMESTAMPINDEX, nMoved) ||
+        !MoveIndexEntries<CTimestampBlockIndexKey, CTimestampBlockIndexValue>(blocktree, *this, DB_BLOCKHASHINDEX, nMoved))
+        return false;
+    if (nMoved > 0) {
+        LogPrintf("Moved %u index entries from the block tree database to %s\n", nMoved, (GetDataDir() / "indexes").string());
+    }
+    return true;
+}
+
+bool CIndexesDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
+    if (!WriteQueued(false, true))
+        return false;
+    return Read(std::make_pair(DB_SPENTINDEX, key), value);
+}
+
+// A spent index key as LevelDB orders it: the output number is stored little-endian
+static std::string SpentIndexDiskKey(const CSpentIndexKey &key) {
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << std::make_pair(DB_SPENTINDEX, key);
+    return std::string(ssKey.begin(), ssKey.end());
+}
+
+bool CIndexesDB::ReadSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values) {
+    if (!WriteQueued(false, true))
+        return false;
+
+    values.assign(keys.size(), CSpentIndexValue());
+    std::vector<std::pair<std::string, size_t> > vSorted;
+    vSorted.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        vSorted.push_back(std::make_pair(SpentIndexDiskKey(keys[i]), i));
+    std::sort(vSorted.begin(), vSorted.end());
+
+    // The cursor rests on the first entry at or after the previous key; the
+    // outputs of one transaction are neighbours, so mostly a step will do
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    bool fSeeked = false;
+    for (const std::pair<std::string, size_t>& item : vSorted) {
+        const CSpentIndexKey &key = keys[item.second];
+        std::pair<char, CSpentIndexKey> keyCursor;
+        bool fValid = fSeeked && pcursor->Valid() && pcursor->GetKey(keyCursor) && keyCursor.first == DB_SPENTINDEX;
+        if (fValid && SpentIndexDiskKey(keyCursor.second) < item.first) {
+            pcursor->Next();
+            fValid = pcursor->Valid() && pcursor->GetKey(keyCursor) && keyCursor.first == DB_SPENTINDEX;
+        }
+        if (!fValid || SpentIndexDiskKey(keyCursor.second) < item.first) {
+            pcursor->Seek(std::make_pair(DB_SPENTINDEX, key));
+            fSeeked = true;
+            // Nothing at or after this key, so nothing after the keys still to come either
+            if (!pcursor->Valid() || !pcursor->GetKey(keyCursor) || keyCursor.first != DB_SPENTINDEX)
+                break;
+        }
+        if (keyCursor.second.txid == key.txid && keyCursor.second.outputIndex == key.outputIndex && !pcursor->GetValue(values[item.second]))
+            return error("failed to get spent index value");
+    }
+    return true;
+}
 
-    pcursor->Seek(std::make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)));
+bool CIndexesDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull()) {
+            batch.Erase(std::make_pair(DB_SPENTINDEX, it->first));
+        } else {
+            batch.Write(std::make_pair(DB_SPENTINDEX, it->first), it->second);
+        }
+    }
+    return WriteBatch(batch);
+}
+
+bool CIndexesDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
+	CDBBatch batch(*this);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        addressCache.InvalidateUnspent(it->first.type, it->first.hashBytes);
+        WriteAddressUnspentEntry(batch, it->first, it->second);
+    }
+    return WriteBatch(batch);
+}
+
+/** Run fn for each of nCount addresses, sharded across up to nThreads threads;
+ *  the calling thread takes the first shard. Stops at the first failure, and
+ *  rethrows the first exception of any shard. */
+static bool ForEachAddressParallel(size_t nCount, int nThreads, boost::function<bool(size_t)> fn)
+{
+    size_t nShards = std::max(1, std::min(nThreads, (int)nCount));
+    std::atomic<bool> fOk(true);
+    auto runShard = [&](size_t nShard) {
+        for (size_t i = nShard; i < nCount && fOk; i += nShards) {
+            if (!fn(i))
+                fOk = false;
+        }
+    };
+
+    boost::thread_group threadGroup;
+    boost::mutex csException;
+    std::exception_ptr pexception;
+    try {
+        for (size_t nShard = 1; nShard < nShards; nShard++) {
+            threadGroup.create_thread([&, nShard]() {
+                RenameThread("bitcoin-addridx");
+                try {
+                    runShard(nShard);
+                } catch (const boost::thread_interrupted&) {
+                } catch (...) {
+                    // Rethrown by the caller once all shards are joined
+                    fOk = false;
+                    boost::unique_lock<boost::mutex> lock(csException);
+                    if (!pexception)
+                        pexception = std::current_exception();
+                }
+            });
+        }
+        runShard(0);
+    } catch (...) {
+        // The workers use this frame, so join them before unwinding it
+        fOk = false;
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+    threadGroup.join_all();
+    if (pexception)
+        std::rethrow_exception(pexception);
+
+    return fOk;
+}
+
+static bool ReadAddressUnspentRun(CDBWrapper &db, bool fCompact, uint160 addressHash, int type,
+                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
+    const char chPrefix = fCompact ? DB_ADDRESSUNSPENTINDEX_COMPACT : DB_ADDRESSUNSPENTINDEX;
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+
+    pcursor->Seek(std::make_pair(chPrefix, CAddressIndexIteratorKey(type, addressHash)));
 
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, CTimestampIndexKey> key;
-        if (pcursor->GetKey(key) && key.first == DB_TIMESTAMPINDEX && key.second.timestamp < high) {
-            if (fActiveOnly) {
-                if (blockOnchainActive(key.second.blockHash)) {
-                    hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
-                }
+        std::pair<char,CAddressUnspentKey> key;
+        if (pcursor->GetKey(key) && key.first == chPrefix && key.second.hashBytes == addressHash) {
+            CAddressUnspentValue nValue;
+            bool fRead;
+            if (fCompact) {
+                CAddressUnspentCompactValue compact;
+                fRead = pcursor->GetValue(compact);
+                nValue.satoshis = compact.satoshis;
+                nValue.blockHeight = compact.blockHeight;
+                nValue.nTime = compact.nTime;
+                nValue.script = compact.fImpliedScript ? GetAddressScript(key.second.type, key.second.hashBytes) : compact.script;
             } else {
-                hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
+                fRead = pcursor->GetValue(nValue);
+            }
+            if (fRead) {
+                unspentOutputs.push_back(std::make_pair(key.second, nValue));
+                pcursor->Next();
+            } else {
+                return error("failed to get address unspent value");
             }
-
-            pcursor->Next();
         } else {
             break;
         }
@@ -298,77 +1906,461 @@ bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned i
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
+bool CIndexesDB::ReadAddressUnspentFromDisk(uint160 addressHash, int type,
+                                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                            uint64_t nGeneration) {
+    std::shared_ptr<CAddressIndexCache::UnspentRun> prun = std::make_shared<CAddressIndexCache::UnspentRun>();
+    if (!ReadAddressUnspentRun(*this, fCompactAddressIndex, addressHash, type, *prun))
+        return false;
+    if (addressCache.IsEnabled())
+        addressCache.PutUnspent(type, addressHash, prun, nGeneration);
+    unspentOutputs.insert(unspentOutputs.end(), prun->begin(), prun->end());
+    return true;
+}
+
+bool CIndexesDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
+                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
+    // Taken before flushing, so a run read across an invalidation is not cached
+    uint64_t nGeneration = addressCache.GetGeneration();
+    std::shared_ptr<const CAddressIndexCache::UnspentRun> pcached = addressCache.GetUnspent(type, addressHash);
+    if (pcached) {
+        unspentOutputs.insert(unspentOutputs.end(), pcached->begin(), pcached->end());
+        return true;
+    }
+
+    if (!WriteQueued(false, true))
+        return false;
+
+    return ReadAddressUnspentFromDisk(addressHash, type, unspentOutputs, nGeneration);
+}
+
+bool CIndexesDB::ReadAddressUnspentIndex(const std::vector<std::pair<uint160, int> > &addresses,
+                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs, int nThreads) {
+    uint64_t nGeneration = addressCache.GetGeneration();
+    std::vector<std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > vRuns(addresses.size());
+    std::vector<size_t> vMissing;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        std::shared_ptr<const CAddressIndexCache::UnspentRun> pcached = addressCache.GetUnspent(addresses[i].second, addresses[i].first);
+        if (pcached)
+            vRuns[i] = *pcached;
+        else
+            vMissing.push_back(i);
+    }
+
+    if (!vMissing.empty()) {
+        if (!WriteQueued(false, true))
+            return false;
+        bool fOk = ForEachAddressParallel(vMissing.size(), nThreads, [&](size_t i) {
+            const std::pair<uint160, int> &address = addresses[vMissing[i]];
+            return ReadAddressUnspentFromDisk(address.first, address.second, vRuns[vMissing[i]], nGeneration);
+        });
+        if (!fOk)
+            return false;
+    }
+
+    for (size_t i = 0; i < vRuns.size(); i++)
+        unspentOutputs.insert(unspentOutputs.end(), vRuns[i].begin(), vRuns[i].end());
+
+    return true;
+}
+
+bool CIndexesDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
     CDBBatch batch(*this);
-    batch.Write(std::make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        addressCache.InvalidateIndex(it->first.type, it->first.hashBytes, it->first.blockHeight);
+        WriteAddressIndexEntry(batch, it->first, it->second);
+    }
     return WriteBatch(batch);
 }
 
-bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
+bool CIndexesDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+    CDBBatch batch(*this);
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        addressCache.InvalidateIndex(it->first.type, it->first.hashBytes, it->first.blockHeight);
+        EraseAddressIndexEntry(batch, it->first);
+    }
+    return WriteBatch(batch);
+}
 
-    CTimestampBlockIndexValue(lts);
-    if (!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
-	return false;
+bool CIndexesDB::ReadAddressIndex(uint160 addressHash, int type,
+                                    std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                    int start, int end) {
+    int nRangeStart = start > 0 && end > 0 ? start : 0;
+    int nRangeEnd = end > 0 ? end : 0;
+    uint64_t nGeneration = addressCache.GetGeneration();
+    std::shared_ptr<const CAddressIndexCache::IndexRun> pcached = addressCache.GetIndex(type, addressHash, nRangeStart, nRangeEnd);
+    if (pcached) {
+        addressIndex.insert(addressIndex.end(), pcached->begin(), pcached->end());
+        return true;
+    }
+
+    if (!WriteQueued(false, true))
+        return false;
+
+    std::shared_ptr<CAddressIndexCache::IndexRun> prun = std::make_shared<CAddressIndexCache::IndexRun>();
+    CAddressIndexCursor cursor(*this, fCompactAddressIndex);
+    cursor.Seek(type, addressHash, nRangeStart);
+
+    while (true) {
+        boost::this_thread::interruption_point();
+        CAddressIndexKey key;
+        if (cursor.GetKey(key) && key.hashBytes == addressHash) {
+            if (end > 0 && key.blockHeight > end) {
+                break;
+            }
+            CAmount nValue;
+            if (cursor.GetValue(nValue)) {
+                prun->push_back(std::make_pair(key, nValue));
+                cursor.Next();
+            } else {
+                return error("failed to get address index value");
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (addressCache.IsEnabled())
+        addressCache.PutIndex(type, addressHash, nRangeStart, nRangeEnd, prun, nGeneration);
+    addressIndex.insert(addressIndex.end(), prun->begin(), prun->end());
 
-    ltimestamp = lts.ltimestamp;
     return true;
 }
-bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
-    return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
+
+/** Order of entries across addresses: by position in the chain, then by
+ *  address. Within one address this agrees with the key order on disk. */
+static bool AddressIndexChainOrder(const CAddressIndexKey &a, const CAddressIndexKey &b)
+{
+    if (a.blockHeight != b.blockHeight)
+        return a.blockHeight < b.blockHeight;
+    if (a.txindex != b.txindex)
+        return a.txindex < b.txindex;
+    if (a.type != b.type)
+        return a.type < b.type;
+    if (a.hashBytes != b.hashBytes)
+        return a.hashBytes < b.hashBytes;
+    if (a.index != b.index)
+        return a.index < b.index;
+    return a.spending < b.spending;
 }
 
-bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
-    char ch;
-    if (!Read(std::make_pair(DB_FLAG, name), ch))
+namespace {
+/** One address's run of the address index, read from disk or from the cache */
+struct CAddressIndexRun {
+    std::unique_ptr<CAddressIndexCursor> pcursor;
+    std::shared_ptr<const CAddressIndexCache::IndexRun> pcached;
+    size_t nPos;
+    //! Copy of a run read from disk from its start, for the cache
+    std::shared_ptr<CAddressIndexCache::IndexRun> pfill;
+    unsigned int type;
+    uint160 hashBytes;
+    int end;
+    bool fValid;
+    CAddressIndexKey key;
+
+    //! Load the current entry, marking the run finished past its end
+    bool Load()
+    {
+        if (pcached) {
+            fValid = nPos < pcached->size();
+            if (fValid)
+                key = (*pcached)[nPos].first;
+            return fValid;
+        }
+        fValid = pcursor->GetKey(key) && key.type == type && key.hashBytes == hashBytes &&
+                 (end <= 0 || key.blockHeight <= end);
+        return fValid;
+    }
+
+    bool GetValue(CAmount &nValue)
+    {
+        if (pcached) {
+            nValue = (*pcached)[nPos].second;
+            return true;
+        }
+        return pcursor->GetValue(nValue);
+    }
+
+    void Next()
+    {
+        if (pcached)
+            nPos++;
+        else
+            pcursor->Next();
+    }
+};
+}
+
+bool CIndexesDB::ScanAddressIndex(const std::vector<std::pair<uint160, int> > &addresses, int start, int end,
+                                  const CAddressIndexKey *pkeyAfter,
+                                  boost::function<bool(const CAddressIndexKey&, CAmount)> fn, int nThreads) {
+    int nRangeStart = start > 0 && end > 0 ? start : 0;
+    int nRangeEnd = start > 0 && end > 0 ? end : 0;
+    uint64_t nGeneration = addressCache.GetGeneration();
+
+    std::set<std::pair<unsigned int, uint160> > setSeen;
+    std::vector<CAddressIndexRun> vRuns;
+    std::vector<size_t> vMissing;
+    vRuns.reserve(addresses.size());
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = addresses.begin(); it != addresses.end(); it++) {
+        if (!setSeen.insert(std::make_pair((unsigned int)it->second, it->first)).second)
+            continue;
+        vRuns.push_back(CAddressIndexRun());
+        CAddressIndexRun &run = vRuns.back();
+        run.type = it->second;
+        run.hashBytes = it->first;
+        run.end = nRangeEnd;
+        run.nPos = 0;
+        run.pcached = addressCache.GetIndex(run.type, run.hashBytes, nRangeStart, nRangeEnd);
+        if (run.pcached) {
+            // Cached runs are in chain order too
+            if (pkeyAfter)
+                run.nPos = std::upper_bound(run.pcached->begin(), run.pcached->end(), std::make_pair(*pkeyAfter, (CAmount)0),
+                    [](const std::pair<CAddressIndexKey, CAmount> &a, const std::pair<CAddressIndexKey, CAmount> &b) {
+                        return AddressIndexChainOrder(a.first, b.first);
+                    }) - run.pcached->begin();
+            run.Load();
+        } else {
+            run.pcursor.reset(new CAddressIndexCursor(*this, fCompactAddressIndex));
+            if (addressCache.IsEnabled() && !pkeyAfter)
+                run.pfill = std::make_shared<CAddressIndexCache::IndexRun>();
+            vMissing.push_back(vRuns.size() - 1);
+        }
+    }
+
+    if (!vMissing.empty()) {
+        if (!WriteQueued(false, true))
+            return false;
+
+        // Resuming only needs the entries at the height of the last key skipped
+        int nSeekHeight = nRangeStart;
+        if (pkeyAfter && pkeyAfter->blockHeight > nSeekHeight)
+            nSeekHeight = pkeyAfter->blockHeight;
+
+        // The seeks are the random reads of a scan, so the runs position themselves in parallel
+        ForEachAddressParallel(vMissing.size(), nThreads, [&](size_t i) {
+            CAddressIndexRun &run = vRuns[vMissing[i]];
+            run.pcursor->Seek(run.type, run.hashBytes, nSeekHeight);
+            while (run.Load() && pkeyAfter && !AddressIndexChainOrder(*pkeyAfter, run.key))
+                run.pcursor->Next();
+            return true;
+        });
+    }
+
+    size_t nMaxFillEntries = addressCache.MaxEntryUsage() / sizeof(std::pair<CAddressIndexKey, CAmount>);
+    while (true) {
+        boost::this_thread::interruption_point();
+        CAddressIndexRun *pnext = NULL;
+        for (std::vector<CAddressIndexRun>::iterator it = vRuns.begin(); it != vRuns.end(); it++) {
+            if (it->fValid && (!pnext || AddressIndexChainOrder(it->key, pnext->key)))
+                pnext = &*it;
+        }
+        if (!pnext)
+            break;
+
+        CAmount nValue;
+        if (!pnext->GetValue(nValue))
+            return error("failed to get address index value");
+        if (!fn(pnext->key, nValue))
+            break;
+        if (pnext->pfill) {
+            if (pnext->pfill->size() < nMaxFillEntries)
+                pnext->pfill->push_back(std::make_pair(pnext->key, nValue));
+            else
+                pnext->pfill.reset();
+        }
+        pnext->Next();
+        pnext->Load();
+    }
+
+    // Runs read to their end are complete and can serve the next query
+    for (std::vector<CAddressIndexRun>::iterator it = vRuns.begin(); it != vRuns.end(); it++) {
+        if (it->pfill && !it->fValid)
+            addressCache.PutIndex(it->type, it->hashBytes, nRangeStart, nRangeEnd, it->pfill, nGeneration);
+    }
+
+    return true;
+}
+
+bool CIndexesDB::ReadAddressBalance(uint160 addressHash, int type, CAddressBalance &balance) {
+    if (!WriteQueued(false, true))
         return false;
-    fValue = ch == '1';
+
+    balance.SetNull();
+    Read(std::make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(type, addressHash)), balance);
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
-{
-    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+bool CIndexesDB::ReadAddressBalances(const std::vector<std::pair<uint160, int> > &addresses,
+                                     std::vector<CAddressBalance> &balances, int nThreads) {
+    if (!WriteQueued(false, true))
+        return false;
 
-    pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, uint256()));
+    balances.assign(addresses.size(), CAddressBalance());
+    return ForEachAddressParallel(addresses.size(), nThreads, [&](size_t i) {
+        Read(std::make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(addresses[i].second, addresses[i].first)), balances[i]);
+        return true;
+    });
+}
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+bool CIndexesDB::BuildAddressBalances() {
+    const std::pair<char, std::string> flag(DB_FLAG, "addressbalance");
+    if (!Flush(true))
+        return false;
+    if (Exists(flag))
+        return true;
+
+    LogPrintf("Building address balances from the address index...\n");
+    CAddressIndexCursor cursor(*this, fCompactAddressIndex);
+    CDBBatch batch(*this);
+    size_t nBatch = 0;
+    size_t nAddresses = 0;
+    std::pair<unsigned int, uint160> address;
+    uint256 txhashLast;
+    CAddressBalance balance;
+
+    // Entries are sorted by address, then height and position in the block,
+    // so each address and each of its transactions is one contiguous run
+    cursor.SeekToFirst();
+    while (true) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake   = diskindex.prevoutStake;
-                pindexNew->vchBlockSig    = diskindex.vchBlockSig; 
-                // JBCoin: Disable PoW Sanity check while loading block index from disk.
-                // We use the sha256 hash for the block index for performance reasons, which is recorded for later use.
-                // CheckProofOfWork() uses the scrypt hash which is discarded after a block is accepted.
-                // While it is technically feasible to verify the PoW, doing so takes several minutes as it
-                // requires recomputing every PoW hash during every JBCoin startup.
-                // We opt instead to simply trust the data that is on your local disk.
-                //if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                //    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+        CAddressIndexKey key;
+        bool fValid = cursor.GetKey(key);
+        std::pair<unsigned int, uint160> addressNext = fValid ? std::make_pair(key.type, key.hashBytes) : std::make_pair(0U, uint160());
+        if (!balance.IsNull() && (!fValid || addressNext != address)) {
+            batch.Write(std::make_pair(DB_ADDRESSBALANCE, CAddressIndexIteratorKey(address.first, address.second)), balance);
+            nAddresses++;
+            if (++nBatch == 10000) {
+                if (!WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatch = 0;
+            }
+            balance.SetNull();
+        }
+        if (!fValid)
+            break;
 
-                pcursor->Next();
+        CAmount nValue;
+        if (!cursor.GetValue(nValue))
+            return error("%s: failed to get address index value", __func__);
+        if (balance.IsNull() || key.txhash != txhashLast)
+            balance.nTxCount++;
+        balance.nBalance += nValue;
+        if (nValue > 0)
+            balance.nReceived += nValue;
+        address = addressNext;
+        txhashLast = key.txhash;
+        cursor.Next();
+    }
+    batch.Write(flag, '1');
+    if (!WriteBatch(batch, true))
+        return false;
+    LogPrintf("Built balances of %u addresses\n", nAddresses);
+    return true;
+}
+
+/** Rewrite the records of one prefix in the compact format, 10000 at a time */
+template<typename K, typename V>
+static bool ConvertIndexEntries(CDBWrapper &db, char chType, size_t &nConverted,
+                                boost::function<void(CDBBatch&, const K&, const V&)> writeCompact)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(chType);
+
+    bool fMore = true;
+    while (fMore) {
+        CDBBatch batch(db);
+        size_t nBatch = 0;
+        fMore = false;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            std::pair<char, K> key;
+            if (!pcursor->GetKey(key) || key.first != chType)
+                break;
+            V value;
+            if (!pcursor->GetValue(value))
+                return error("%s: failed to read index entry of type %c", __func__, chType);
+            writeCompact(batch, key.second, value);
+            batch.Erase(key);
+            pcursor->Next();
+            if (++nBatch == 10000) {
+                fMore = true;
+                break;
+            }
+        }
+        if (!db.WriteBatch(batch, true))
+            return false;
+        nConverted += nBatch;
+    }
+    return true;
+}
+
+bool CIndexesDB::UpgradeAddressIndex(bool fCompact) {
+    const std::pair<char, std::string> flag(DB_FLAG, "addresscompact");
+    if (!fCompact && !fCompactAddressIndex)
+        return true;
+    if (!Flush(true))
+        return false;
+
+    // Once the flag is set new entries are written compactly, and an
+    // interrupted conversion carries on at the next start
+    if (!fCompactAddressIndex) {
+        if (!Write(flag, '1', true))
+            return false;
+        fCompactAddressIndex = true;
+        LogPrintf("Converting the address index to the compact format...\n");
+    }
+
+    addressCache.Clear();
+    size_t nConverted = 0;
+    if (!ConvertIndexEntries<CAddressIndexKey, CAmount>(*this, DB_ADDRESSINDEX, nConverted,
+            [this](CDBBatch &batch, const CAddressIndexKey &key, const CAmount &nValue) { WriteAddressIndexEntry(batch, key, nValue); }) ||
+        !ConvertIndexEntries<CAddressUnspentKey, CAddressUnspentValue>(*this, DB_ADDRESSUNSPENTINDEX, nConverted,
+            [this](CDBBatch &batch, const CAddressUnspentKey &key, const CAddressUnspentValue &value) { WriteAddressUnspentEntry(batch, key, value); }))
+        return false;
+    if (nConverted > 0)
+        LogPrintf("Converted %u address index entries to the compact format\n", nConverted);
+    return true;
+}
+
+bool CIndexesDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
+    CDBBatch batch(*this);
+    batch.Write(std::make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
+    return WriteBatch(batch);
+}
+
+bool CIndexesDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes,
+                                    size_t nLimit, const CTimestampIndexKey *pkeyAfter) {
+    if (!WriteQueued(false, true))
+        return false;
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    // A cursor inside the range resumes at the entry it names, which was already returned
+    if (pkeyAfter && pkeyAfter->timestamp >= low) {
+        pcursor->Seek(std::make_pair(DB_TIMESTAMPINDEX, *pkeyAfter));
+        std::pair<char, CTimestampIndexKey> key;
+        if (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_TIMESTAMPINDEX &&
+            key.second.timestamp == pkeyAfter->timestamp && key.second.blockHash == pkeyAfter->blockHash)
+            pcursor->Next();
+    } else {
+        pcursor->Seek(std::make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)));
+    }
+
+    while (pcursor->Valid() && (nLimit == 0 || hashes.size() < nLimit)) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CTimestampIndexKey> key;
+        if (pcursor->GetKey(key) && key.first == DB_TIMESTAMPINDEX && key.second.timestamp < high) {
+            if (fActiveOnly) {
+                if (blockOnchainActive(key.second.blockHash)) {
+                    hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
+                }
             } else {
-                return error("LoadBlockIndex() : failed to read value");
+                hashes.push_back(std::make_pair(key.second.blockHash, key.second.timestamp));
             }
+
+            pcursor->Next();
         } else {
             break;
         }
@@ -377,13 +2369,51 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
     return true;
 }
 
+bool CIndexesDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
+    CDBBatch batch(*this);
+    batch.Write(std::make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
+    return WriteBatch(batch);
+}
+
+bool CIndexesDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
+    {
+        // Connecting a block looks up its parent, which is usually still queued
+        boost::unique_lock<boost::mutex> lock(cs_queue);
+        for (std::list<std::shared_ptr<const CIndexUpdate> >::const_reverse_iterator it = listQueued.rbegin(); it != listQueued.rend(); it++) {
+            for (const auto& entry : (*it)->vTimestampBlockIndex) {
+                if (entry.first.blockHash == hash) {
+                    ltimestamp = entry.second.ltimestamp;
+                    return true;
+                }
+            }
+        }
+    }
+
+    CTimestampBlockIndexValue(lts);
+    if (!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
+	return false;
 
-bool CBlockTreeDB::blockOnchainActive(const uint256 &hash) {
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    ltimestamp = lts.ltimestamp;
+    return true;
+}
 
-    if (!chainActive.Contains(pblockindex)) {
+bool CIndexesDB::blockOnchainActive(const uint256 &hash) {
+    BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
 	return false;
     }
 
     return true;
 }
+
+std::vector<std::pair<char, uint64_t> > GetDBPrefixSizes(const CDBWrapper& db)
+{
+    std::vector<std::pair<char, uint64_t> > vSizes;
+    for (char chPrefix : DB_SIZED_PREFIXES) {
+        // Every key of a record type starts with its prefix byte
+        uint64_t nSize = db.EstimateSize(chPrefix, (char)(chPrefix + 1));
+        if (nSize > 0)
+            vSizes.push_back(std::make_pair(chPrefix, nSize));
+    }
+    return vSizes;
+}
@@ -9,14 +9,21 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "sync.h"
 
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
 
+class CBlock;
+class CBlockFilter;
 class CBlockIndex;
 class CCoinsViewDBCursor;
 
@@ -32,6 +39,9 @@ struct CTimestampBlockIndexKey;
 struct CTimestampBlockIndexValue;
 struct CSpentIndexKey;
 struct CSpentIndexValue;
+struct CIndexUpdate;
+struct CIndexBuildState;
+struct CAddressBalance;
 class uint256;
 
 //! Compensate for extra memory peak (x1.5-x1.9) at flush time.
@@ -54,6 +64,22 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Whether the databases pool their LevelDB block caches by default
+static const bool DEFAULT_DB_SHARED_CACHE = true;
+//! Max memory held by coins looked up ahead of block connection (MiB)
+static const int64_t nMaxCoinsPrefetchCache = 32;
+//! Blocks queued for input lookup before further ones are skipped
+static const unsigned int MAX_PREFETCH_BLOCKS_QUEUED = 64;
+//! Max memory allocated to the explorer indexes DB specific cache, if no index is enabled (MiB)
+static const int64_t nMaxIndexesDBCache = 2;
+//! Blocks worth of explorer index updates queued before block connection writes them itself
+static const unsigned int MAX_INDEX_UPDATES_QUEUED = 512;
+//! Time the index writer waits for more updates to coalesce into one batch (ms)
+static const unsigned int INDEX_WRITER_INTERVAL = 250;
+//! Blocks a background index build reads and writes per batch
+static const int INDEX_BUILD_BATCH = 1000;
+//! Blocks short of the tip from which a background index build finishes holding cs_main
+static const int INDEX_BUILD_FINAL_BLOCKS = 100;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -80,19 +106,106 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/**
+ * Where the compact transaction index (-compacttxindex) puts a transaction:
+ * the height of its block in the active chain and its offset after the
+ * block header, which with the block index make up its CDiskTxPos.
+ */
+struct CBlockTxPos
+{
+    int nHeight;
+    unsigned int nTxOffset;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(VARINT(nHeight));
+        READWRITE(VARINT(nTxOffset));
+    }
+
+    CBlockTxPos(int nHeightIn, unsigned int nTxOffsetIn) : nHeight(nHeightIn), nTxOffset(nTxOffsetIn) {}
+    CBlockTxPos() : nHeight(0), nTxOffset(0) {}
+};
+
+/** Number of txid ranges CCoinsViewDB::GetStats scans separately; part of the definition of hashSerialized */
+static const int COINS_STATS_PARTITIONS = 16;
+
+/** Statistics of the UTXO set, from a scan of the coin database */
+struct CCoinsStats
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    uint64_t nBogoSize;
+    uint256 hashSerialized;
+    CAmount nTotalAmount;
+
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nBogoSize(0), nTotalAmount(0) {}
+};
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+private:
+    //! Serializes batch writes so a queued flush reaches disk before a later one
+    CCriticalSection cs_write;
+    mutable CWaitableCriticalSection cs_queue;
+    CConditionVariable condQueue;
+    //! Hand flushes over to the writer thread instead of writing them in BatchWrite
+    bool fQueueWrites;
+    //! Flushed entries not yet on disk, and the best block they belong to; never modified once queued
+    std::shared_ptr<const CCoinsMap> pcoinsQueued;
+    uint256 hashBlockQueued;
+
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    std::shared_ptr<const CCoinsMap> GetQueued() const;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbOptions = CDBOptions());
+    ~CCoinsViewDB();
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    /** GetCoin for many outputs at once, read in key order in one sweep of
+     *  the database; vCoins[i] is spent where vOutPoints[i] is not found */
+    void GetCoins(const std::vector<COutPoint> &vOutPoints, std::vector<Coin> &vCoins) const;
     uint256 GetBestBlock() const;
+    /** With queued writes on, this takes over the entries of mapCoins and
+     *  returns right away. Reads see them immediately; the writer thread
+     *  stores them, with the best block, in one batch. */
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Iterates what is on disk; call FlushQueued first to include a pending flush
     CCoinsViewCursor *Cursor() const;
+
+    void SetQueueWrites(bool fQueue) { fQueueWrites = fQueue; }
+    //! Write the pending flush, if there is one
+    bool FlushQueued();
+    //! Block until there is a flush to write (interruptible)
+    void WaitForQueued();
+
+    /**
+     * Scan what is on disk, as of one moment, in COINS_STATS_PARTITIONS txid
+     * ranges spread over up to nThreads threads. hashSerialized hashes the
+     * best block and the hash of each range in order; it is left null
+     * without fHash. Sets everything but nHeight.
+     */
+    bool GetStats(CCoinsStats& stats, bool fHash, int nThreads) const;
+
+    //! Running totals of the coins, and the best block they were stored for
+    bool ReadTotals(uint256& hashBlock, CCoinsTotals& totals) const;
+    bool WriteTotals(const uint256& hashBlock, const CCoinsTotals& totals);
+
+    //! Convert per-transaction records of an older database format to per-output ones.
+    //! Returns false on failure or when interrupted by a shutdown request.
+    bool Upgrade();
+
+    //! The underlying database, for statistics and replication
+    const CDBWrapper& GetDB() const { return db; }
+    CDBWrapper& GetDB() { return db; }
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -101,8 +214,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -112,16 +225,50 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     std::unique_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
 
+/**
+ * CCoinsView in front of the coin database that looks up the inputs of
+ * accepted blocks ahead of their connection. Worker threads read the coins
+ * of queued blocks from the view below into a side cache, where the cache
+ * above finds them without waiting on a disk read. An entry is handed over,
+ * and dropped, on first use; every write below discards the side cache.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    mutable CWaitableCriticalSection cs_prefetch;
+    CConditionVariable condQueue;
+    std::deque<std::shared_ptr<const CBlock> > queue;
+    mutable boost::unordered_map<COutPoint, Coin, SaltedOutpointHasher> cacheCoins;
+    //! Dynamic memory usage of the coins in cacheCoins
+    mutable size_t cachedCoinsUsage;
+    size_t nMaxUsage;
+    //! Bumped on every write below, so reads that raced one are not cached
+    uint64_t nGeneration;
+
+    size_t DynamicMemoryUsage() const;
+public:
+    CCoinsViewPrefetch(CCoinsView *viewIn, size_t nMaxUsageIn);
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Queue the inputs of a block for lookup; dropped when the workers are too far behind
+    void Prefetch(const std::shared_ptr<const CBlock> &pblock);
+    //! Worker thread loop (interruptible)
+    void Thread();
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbOptions = CDBOptions());
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
@@ -133,30 +280,227 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    /**
+     * The compact transaction index is keyed by the first 8 bytes of the
+     * txid. All transactions sharing them are listed under one key, so
+     * vPos holds the candidates, which the caller tells apart by reading
+     * them. Entries of blocks at nHeight or above, which a reorg left
+     * behind, are dropped when a block at nHeight writes its own.
+     */
+    bool ReadCompactTxIndex(const uint256 &txid, std::vector<CBlockTxPos> &vPos);
+    bool WriteCompactTxIndex(int nHeight, const std::vector<std::pair<uint256, unsigned int> > &list);
+    //! Compact filter of a block, written when it is connected with -blockfilterindex
+    bool ReadBlockFilter(const uint256 &hash, CBlockFilter &filter);
+    bool WriteBlockFilter(const CBlockFilter &filter);
+    bool WriteFlag(const std::string &name, bool fValue);
+    bool ReadFlag(const std::string &name, bool &fValue);
+    //! Last block of the active chain ThreadVerifyDB checked
+    bool ReadVerifiedBlock(uint256 &hash);
+    bool WriteVerifiedBlock(const uint256 &hash);
+    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! Load the given entries again, as a replica does after its primary changed them
+    bool LoadBlockIndexEntries(const std::vector<uint256>& vHashes, boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! The block hash of a block index entry's database key; false for keys of other records
+    static bool ParseBlockIndexKey(const std::string& strKey, uint256& hash);
+    //! Scrypt proof-of-work hashes of blocks, by block hash, recorded once their proof of work is verified
+    bool ReadPoWHashes(std::vector<std::pair<uint256, uint256> > &vPoWHash);
+    bool WritePoWHashes(const std::vector<std::pair<uint256, uint256> > &vPoWHash);
+    //! Write a flat snapshot of the whole block index, used by the next LoadBlockIndexGuts instead of the database
+    bool WriteIndexSnapshot(const std::vector<const CBlockIndex*>& blockinfo);
+private:
+    bool LoadIndexSnapshot(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+};
+
+/**
+ * Size-bounded LRU cache of whole address index runs, keyed by address and
+ * height range, and of address unspent outputs, keyed by address. Entries are
+ * dropped when an index update touches their address (and, for runs, their
+ * height range), so a hit is always current and needs no disk access.
+ */
+class CAddressIndexCache
+{
+public:
+    typedef std::vector<std::pair<CAddressIndexKey, CAmount> > IndexRun;
+    typedef std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > UnspentRun;
+
+    explicit CAddressIndexCache(size_t nMaxUsageIn);
+
+    bool IsEnabled() const { return nMaxUsage > 0; }
+    //! Largest single run worth storing
+    size_t MaxEntryUsage() const { return nMaxUsage / 8; }
+    //! Bumped by every invalidation; runs read under an older value are not stored
+    uint64_t GetGeneration() const;
+
+    std::shared_ptr<const IndexRun> GetIndex(unsigned int type, const uint160 &hashBytes, int start, int end);
+    std::shared_ptr<const UnspentRun> GetUnspent(unsigned int type, const uint160 &hashBytes);
+    void PutIndex(unsigned int type, const uint160 &hashBytes, int start, int end,
+                  const std::shared_ptr<const IndexRun> &run, uint64_t nGeneration);
+    void PutUnspent(unsigned int type, const uint160 &hashBytes,
+                    const std::shared_ptr<const UnspentRun> &run, uint64_t nGeneration);
+
+    //! Drop the runs of an address whose height range contains nHeight
+    void InvalidateIndex(unsigned int type, const uint160 &hashBytes, int nHeight);
+    void InvalidateUnspent(unsigned int type, const uint160 &hashBytes);
+    void Clear();
+
+    size_t DynamicMemoryUsage() const;
+
+private:
+    //! Address, then height range; unspent outputs use the range (-1, -1)
+    typedef std::pair<std::pair<unsigned int, uint160>, std::pair<int, int> > CacheKey;
+    struct CacheEntry {
+        CacheKey key;
+        std::shared_ptr<const IndexRun> pindex;
+        std::shared_ptr<const UnspentRun> punspent;
+        size_t nUsage;
+    };
+    typedef std::map<CacheKey, std::list<CacheEntry>::iterator> EntryMap;
+
+    mutable CCriticalSection cs;
+    const size_t nMaxUsage;
+    size_t nUsage;
+    uint64_t nGeneration;
+    //! Most recently used first
+    std::list<CacheEntry> listEntries;
+    EntryMap mapEntries;
+
+    void Put(CacheEntry &entry, uint64_t nGenerationIn);
+    void Erase(EntryMap::iterator it);
+};
+
+/** Access to the explorer indexes (address, unspent, spent and timestamp),
+ *  kept apart from the block index so their compactions and cache do not
+ *  compete with block connection */
+class CIndexesDB : public CDBWrapper
+{
+public:
+    CIndexesDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, size_t nAddressCacheSize = 0);
+    CIndexesDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nAddressCacheSize, const CDBOptions& dbOptions);
+    /** Default tuning: large write buffers for the bulk writes of index building */
+    static CDBOptions DefaultOptions(size_t nCacheSize);
+    ~CIndexesDB();
+private:
+    CIndexesDB(const CIndexesDB&);
+    void operator=(const CIndexesDB&);
+
+    //! Serializes batch writes so queued updates reach disk in order
+    CCriticalSection cs_write;
+    mutable CWaitableCriticalSection cs_queue;
+    CConditionVariable condQueue;
+    //! Updates not yet written, oldest first; entries are only removed once on disk
+    std::list<std::shared_ptr<const CIndexUpdate> > listQueued;
+    //! Open WriteHolds, and the updates at the end of listQueued queued since the first was taken
+    int nHolds;
+    size_t nQueuedHeld;
+    //! Recently read address index runs and unspent outputs
+    CAddressIndexCache addressCache;
+    //! Address and unspent index entries are in the compact format
+    bool fCompactAddressIndex;
+
+    void WriteAddressIndexEntry(CDBBatch &batch, const CAddressIndexKey &key, CAmount nValue) const;
+    void EraseAddressIndexEntry(CDBBatch &batch, const CAddressIndexKey &key) const;
+    //! Write an unspent output, or erase it if the value is null
+    void WriteAddressUnspentEntry(CDBBatch &batch, const CAddressUnspentKey &key, const CAddressUnspentValue &value) const;
+    //! Add the entries of block updates, and the address totals they change, to a batch
+    void BatchUpdates(CDBBatch &batch, const std::vector<std::shared_ptr<const CIndexUpdate> > &vUpdates);
+
+    //! Write the queued updates, those a WriteHold keeps back too if fHeld; reads do so to see everything queued
+    bool WriteQueued(bool fSync, bool fHeld);
+
+    //! Read the unspent outputs of an address from disk and offer them to the cache
+    bool ReadAddressUnspentFromDisk(uint160 addressHash, int type,
+                                    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                    uint64_t nGeneration);
+public:
+    /** Queue the index changes of a connected or disconnected block. Reads
+     *  see them immediately; the writer thread stores them in one batch with
+     *  whatever else is queued. */
+    bool QueueUpdate(const std::shared_ptr<const CIndexUpdate>& update);
+    /** Write the queued updates and the indexed tip marker in a single batch.
+     *  A synced flush writes them all; otherwise updates held by a WriteHold
+     *  stay queued, unless MAX_INDEX_UPDATES_QUEUED of them piled up or an
+     *  index read needs them. */
+    bool Flush(bool fSync = false);
+    //! Block until there is something to write that no WriteHold keeps back (interruptible)
+    void WaitForQueued();
+
+    /**
+     * Keeps the updates queued during its lifetime from the index writer, so
+     * the blocks a reorg disconnects and connects reach disk in one batch
+     * when it ends instead of a few at a time in between.
+     */
+    class WriteHold
+    {
+    private:
+        CIndexesDB* pdb;
+        WriteHold(const WriteHold&);
+        void operator=(const WriteHold&);
+    public:
+        explicit WriteHold(CIndexesDB* pdbIn);
+        ~WriteHold();
+    };
+    size_t GetQueuedCount() const;
+    //! Forget the cached address runs, after the database changed underneath them
+    void ClearCache() { addressCache.Clear(); }
+    //! Memory taken by the cached address runs
+    size_t GetAddressCacheUsage() const { return addressCache.DynamicMemoryUsage(); }
+    //! Block the indexes are written up to
+    bool ReadBestBlock(uint256 &hashBlock);
+
+    //! Background index build in progress; a null state if there is none
+    bool ReadIndexBuild(CIndexBuildState &state);
+    //! Clear out whatever the indexes of a new build hold and record it
+    bool StartIndexBuild(const CIndexBuildState &state);
+    //! Write the updates of a stretch of built blocks together with the progress they make
+    bool WriteIndexBuild(const std::vector<std::shared_ptr<const CIndexUpdate> > &vUpdates, const CIndexBuildState &state);
+    //! Drop the build record once its indexes are live, marking them written up to hashTip
+    bool FinishIndexBuild(const uint256 &hashTip);
 
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
+    /** Look up many outputs in one sweep of a single iterator; values[i] is left null where keys[i] has no entry */
+    bool ReadSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values);
     bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    //! Unspent outputs of several addresses, in the order given, read by up to nThreads threads
+    bool ReadAddressUnspentIndex(const std::vector<std::pair<uint160, int> > &addresses,
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect, int nThreads = 1);
     bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                           int start = 0, int end = 0);
+    /** Visit the address index entries of several addresses merged into chain
+     *  order, starting after pkeyAfter when given. Stops early, without
+     *  consuming the entry, when fn returns false. */
+    bool ScanAddressIndex(const std::vector<std::pair<uint160, int> > &addresses, int start, int end,
+                          const CAddressIndexKey *pkeyAfter,
+                          boost::function<bool(const CAddressIndexKey&, CAmount)> fn, int nThreads = 1);
+    //! Totals of an address; a null balance if it was never seen
+    bool ReadAddressBalance(uint160 addressHash, int type, CAddressBalance &balance);
+    bool ReadAddressBalances(const std::vector<std::pair<uint160, int> > &addresses,
+                             std::vector<CAddressBalance> &balances, int nThreads = 1);
+    //! Compute the address totals from the address index if an older version left them out
+    bool BuildAddressBalances();
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
-    bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect);
+    //! Entries with low <= logical time < high, after *pkeyAfter if given, and at most nLimit of them if nonzero
+    bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect,
+                            size_t nLimit = 0, const CTimestampIndexKey *pkeyAfter = NULL);
     bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
-
-
-
-    bool WriteFlag(const std::string &name, bool fValue);
-    bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
     bool blockOnchainActive(const uint256 &hash);
+
+    //! Move index entries written by older versions out of the block tree database
+    bool MigrateFromBlockTree(CBlockTreeDB &blocktree);
+    /** Switch the address and unspent indexes to the compact format, which
+     *  leaves out txids and standard scripts, if asked to or if an earlier
+     *  conversion was interrupted. There is no way back short of a reindex. */
+    bool UpgradeAddressIndex(bool fCompact);
+    bool IsAddressIndexCompact() const { return fCompactAddressIndex; }
 };
 
 
-bool GetTimestampIndex(const unsigned int& high, const unsigned int& low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& hashes);
+/** Approximate space on disk under each record type key prefix of db, for the prefixes it has data under */
+std::vector<std::pair<char, uint64_t> > GetDBPrefixSizes(const CDBWrapper& db);
 #endif // BITCOIN_TXDB_H
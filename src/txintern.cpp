@@ -0,0 +1,77 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txintern.h"
+
+#include "coins.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/** The table is swept of dead entries once it grows past this, or twice its size after the last sweep */
+static const size_t TXINTERN_MIN_SWEEP_SIZE = 4096;
+
+typedef std::unordered_map<uint256, std::weak_ptr<const CTransaction>, SaltedTxidHasher> InternMap;
+
+static std::mutex cs_txintern;
+static InternMap mapInterned;
+static size_t nSweepSize = TXINTERN_MIN_SWEEP_SIZE;
+
+static bool SameWitness(const CTransaction& a, const CTransaction& b)
+{
+    if (!a.HasWitness() && !b.HasWitness())
+        return true;
+    return a.GetWitnessHash() == b.GetWitnessHash();
+}
+
+static void SweepInterned()
+{
+    for (InternMap::iterator it = mapInterned.begin(); it != mapInterned.end();) {
+        if (it->second.expired())
+            it = mapInterned.erase(it);
+        else
+            ++it;
+    }
+    nSweepSize = std::max(TXINTERN_MIN_SWEEP_SIZE, 2 * mapInterned.size());
+}
+
+/** Find the live copy of tx, or make the entry of tx point to ptxNew if it is set */
+static CTransactionRef Intern(const CTransaction& tx, const CTransactionRef& ptxNew)
+{
+    std::lock_guard<std::mutex> lock(cs_txintern);
+    std::pair<InternMap::iterator, bool> ret = mapInterned.emplace(tx.GetHash(), std::weak_ptr<const CTransaction>());
+    if (!ret.second) {
+        CTransactionRef ptxLive = ret.first->second.lock();
+        if (ptxLive) {
+            if (SameWitness(*ptxLive, tx))
+                return ptxLive;
+            // A different witness of the same transaction stays a copy
+            return ptxNew ? ptxNew : MakeTransactionRef(tx);
+        }
+    }
+
+    CTransactionRef ptx = ptxNew ? ptxNew : MakeTransactionRef(tx);
+    ret.first->second = ptx;
+    if (mapInterned.size() >= nSweepSize)
+        SweepInterned();
+    return ptx;
+}
+
+CTransactionRef InternTransaction(const CTransactionRef& tx)
+{
+    return Intern(*tx, tx);
+}
+
+CTransactionRef InternTransaction(const CTransaction& tx)
+{
+    return Intern(tx, CTransactionRef());
+}
+
+size_t InternedTransactionCount()
+{
+    std::lock_guard<std::mutex> lock(cs_txintern);
+    return mapInterned.size();
+}
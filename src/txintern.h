@@ -0,0 +1,32 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXINTERN_H
+#define BITCOIN_TXINTERN_H
+
+#include "primitives/transaction.h"
+
+#include <stddef.h>
+
+/**
+ * Table of the transactions alive in the node, so that the mempool, the
+ * relay and orphan maps and the wallets share one allocation of each. A
+ * transaction read from the network, the mempool file or a wallet is
+ * swapped for the copy already alive, if there is one.
+ *
+ * The table only holds weak references, keyed by txid; a copy with a
+ * different witness is not swapped. Entries of transactions nobody holds
+ * any more are swept out as the table grows.
+ */
+
+/** The live copy of tx, or tx itself, which others then get */
+CTransactionRef InternTransaction(const CTransactionRef& tx);
+
+/** The live copy of tx, or a new one made from it */
+CTransactionRef InternTransaction(const CTransaction& tx);
+
+/** Entries in the table, including those not swept yet */
+size_t InternedTransactionCount();
+
+#endif // BITCOIN_TXINTERN_H
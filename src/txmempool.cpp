@@ -5,14 +5,17 @@
 
 #include "txmempool.h"
 
+#include "addresssubscription.h"
 #include "clientversion.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "hash.h"
 #include "validation.h"
 #include "policy/policy.h"
 #include "policy/fees.h"
 #include "streams.h"
 #include "timedata.h"
+#include "trace.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utiltime.h"
@@ -24,9 +27,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
                                  int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                                  CAmount _inChainInputValue,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
-    tx(_tx), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority), entryHeight(_entryHeight),
-    inChainInputValue(_inChainInputValue),
-    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
+    tx(_tx), nFee(_nFee), nTime(_nTime), entryPriority(_entryPriority),
+    inChainInputValue(_inChainInputValue), lockPoints(lp), entryHeight(_entryHeight),
+    sigOpCost(_sigOpsCost), spendsCoinbase(_spendsCoinbase)
 {
     nTxWeight = GetTransactionWeight(*tx);
     nModSize = tx->CalculateModifiedSize(GetTxSize());
@@ -39,6 +42,10 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     assert(inChainInputValue <= nValueIn);
 
     feeDelta = 0;
+    priorityDelta = 0;
+    cachedPriority = entryPriority;
+    cachedPriorityHeight = entryHeight;
+    nEpoch = 0;
 
     nCountWithAncestors = 1;
     nSizeWithAncestors = GetTxSize();
@@ -54,7 +61,7 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    double deltaPriority = ((double)(currentHeight-entryHeight)*inChainInputValue)/nModSize;
+    double deltaPriority = ((double)((int64_t)currentHeight-entryHeight)*inChainInputValue)/nModSize;
     double dResult = entryPriority + deltaPriority;
     if (dResult < 0) // This should only happen if it was called with a height below entry height
         dResult = 0;
@@ -73,49 +80,90 @@ void CTxMemPoolEntry::UpdateLockPoints(const LockPoints& lp)
     lockPoints = lp;
 }
 
+void CTxMemPoolEntry::UpdatePriorityDelta(double newPriorityDelta)
+{
+    cachedPriority += newPriorityDelta - priorityDelta;
+    priorityDelta = newPriorityDelta;
+}
+
+void CTxMemPoolEntry::UpdateCachedPriority(unsigned int height)
+{
+    cachedPriority = GetPriority(height) + priorityDelta;
+    cachedPriorityHeight = height;
+}
+
 size_t CTxMemPoolEntry::GetTxSize() const
 {
     return GetVirtualTransactionSize(nTxWeight, sigOpCost);
 }
 
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& in) : pool(in)
+{
+    assert(!pool.fHasEpochGuard);
+    ++pool.nEpoch;
+    pool.fHasEpochGuard = true;
+}
+
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    // Entries visited in this epoch must not count as visited in the next one
+    ++pool.nEpoch;
+    pool.fHasEpochGuard = false;
+}
+
+bool CTxMemPool::Visited(txiter it) const
+{
+    assert(fHasEpochGuard);
+    bool fVisited = it->nEpoch >= nEpoch;
+    it->nEpoch = std::max(it->nEpoch, nEpoch);
+    return fVisited;
+}
+
 // Update the given tx for any in-mempool descendants.
 // Assumes that setMemPoolChildren is correct for the given tx and all
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
-
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH(const txiter childEntry, setChildren) {
-            cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
-            if (cacheIt != cachedDescendants.end()) {
-                // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
-                BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+    std::vector<txiter> vStage, vAllDescendants;
+    {
+        const EpochGuard epoch(*this);
+        for (txiter childEntry : GetMemPoolChildren(updateIt)) {
+            if (!Visited(childEntry))
+                vStage.push_back(childEntry);
+        }
+
+        while (!vStage.empty()) {
+            const txiter cit = vStage.back();
+            vStage.pop_back();
+            vAllDescendants.push_back(cit);
+            for (const txiter childEntry : GetMemPoolChildren(cit)) {
+                cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
+                if (cacheIt != cachedDescendants.end()) {
+                    // We've already calculated this one, just add the entries for this set
+                    // but don't traverse again.
+                    for (const txiter cacheEntry : cacheIt->second) {
+                        if (!Visited(cacheEntry))
+                            vAllDescendants.push_back(cacheEntry);
+                    }
+                } else if (!Visited(childEntry)) {
+                    // Schedule for later processing
+                    vStage.push_back(childEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
-                // Schedule for later processing
-                stageEntries.insert(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    std::vector<txiter>& vCached = cachedDescendants[updateIt];
+    for (txiter cit : vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            vCached.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -175,8 +223,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 {
     LOCK(cs);
 
-    setEntries parentHashes;
+    // Entries staged for a visit, all distinct and not in setAncestors yet
+    std::vector<txiter> parentHashes;
     const CTransaction &tx = entry.GetTx();
+    const EpochGuard epoch(*this);
 
     if (fSearchForParents) {
         // Get parents of this transaction that are in the mempool
@@ -184,8 +234,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
+            if (piter != mapTx.end() && !Visited(piter)) {
+                parentHashes.push_back(piter);
                 if (parentHashes.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
@@ -196,16 +246,23 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        for (txiter piter : GetMemPoolParents(it)) {
+            if (!Visited(piter))
+                parentHashes.push_back(piter);
+        }
     }
 
+    // Whatever the caller already had in setAncestors is not staged again
+    for (txiter ancestor : setAncestors)
+        Visited(ancestor);
+
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
     while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+        txiter stageit = parentHashes.back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
+        parentHashes.pop_back();
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -222,8 +279,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
         BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!Visited(phash)) {
+                parentHashes.push_back(phash);
             }
             if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
@@ -335,8 +392,8 @@ void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFe
     nSizeWithDescendants += modifySize;
     assert(int64_t(nSizeWithDescendants) > 0);
     nModFeesWithDescendants += modifyFee;
+    assert(int64_t(nCountWithDescendants) + modifyCount > 0);
     nCountWithDescendants += modifyCount;
-    assert(int64_t(nCountWithDescendants) > 0);
 }
 
 void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount, int modifySigOps)
@@ -344,14 +401,17 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     nSizeWithAncestors += modifySize;
     assert(int64_t(nSizeWithAncestors) > 0);
     nModFeesWithAncestors += modifyFee;
+    assert(int64_t(nCountWithAncestors) + modifyCount > 0);
     nCountWithAncestors += modifyCount;
-    assert(int64_t(nCountWithAncestors) > 0);
     nSigOpCostWithAncestors += modifySigOps;
-    assert(int(nSigOpCostWithAncestors) >= 0);
+    assert(nSigOpCostWithAncestors >= 0);
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0),
+    nTxAdded(0), nTxRemoved(0), nNextTxAdded(0), nNextTxRemoved(0),
+    nAddressDeltasAdded(0), nAddressDeltasRemoved(0), nSpentAdded(0), nSpentRemoved(0),
+    nPriorityHeight(0), nMempoolSequence(0), nSequenceLogFirst(1), nEpoch(0), fHasEpochGuard(false)
 {
     _clear(); //lock free clear
 
@@ -368,17 +428,10 @@ CTxMemPool::~CTxMemPool()
     delete minerPolicyEstimator;
 }
 
-void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
+bool CTxMemPool::isSpent(const COutPoint& outpoint)
 {
     LOCK(cs);
-
-    auto it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first->hash == hashTx) {
-        coins.Spend(it->first->n); // and remove those outputs from coins
-        it++;
-    }
+    return mapNextTx.count(outpoint);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -393,6 +446,46 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+void CTxMemPool::LogSequence(const uint256& hash, bool fAdded)
+{
+    vSequenceLog.push_back(hash);
+    if (vSequenceLog.size() > MEMPOOL_SEQUENCE_LOG_SIZE) {
+        vSequenceLog.pop_front();
+        nSequenceLogFirst++;
+    }
+    NotifyEntrySequence(hash, fAdded, ++nMempoolSequence);
+}
+
+uint64_t CTxMemPool::GetSequence() const
+{
+    LOCK(cs);
+    return nMempoolSequence;
+}
+
+bool CTxMemPool::GetChangesSince(uint64_t nSequence, std::vector<uint256>& vAdded, std::vector<uint256>& vRemoved) const
+{
+    LOCK(cs);
+    vAdded.clear();
+    vRemoved.clear();
+    if (nSequence > nMempoolSequence || nSequence + 1 < nSequenceLogFirst)
+        return false;
+
+    // Newest first, so each txid is taken at its last change
+    std::set<uint256> setSeen;
+    for (uint64_t n = nMempoolSequence; n > nSequence; n--) {
+        const uint256& hash = vSequenceLog[n - nSequenceLogFirst];
+        if (!setSeen.insert(hash).second)
+            continue;
+        if (mapTx.count(hash))
+            vAdded.push_back(hash);
+        else
+            vRemoved.push_back(hash);
+    }
+    std::reverse(vAdded.begin(), vAdded.end());
+    std::reverse(vRemoved.begin(), vRemoved.end());
+    return true;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool validFeeEstimate)
 {
     NotifyEntryAdded(entry.GetSharedTx());
@@ -412,14 +505,22 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
         if (deltas.second) {
             mapTx.modify(newit, update_fee_delta(deltas.second));
         }
+        if (deltas.first) {
+            mapTx.modify(newit, update_priority_delta(deltas.first));
+        }
+    }
+    if (newit->GetHeight() != nPriorityHeight) {
+        mapTx.modify(newit, update_cached_priority(nPriorityHeight));
     }
 
     // Update cachedInnerUsage to include contained transaction's usage.
     // (When we update the entry for in-mempool parents, memory usage will be
     // further updated.)
     cachedInnerUsage += entry.DynamicMemoryUsage();
+    nTxAdded++;
 
     const CTransaction& tx = newit->GetTx();
+    nNextTxAdded += tx.vin.size();
     std::set<uint256> setParentTransactions;
     for (unsigned int i = 0; i < tx.vin.size(); i++) {
         mapNextTx.insert(std::make_pair(&tx.vin[i].prevout, &tx));
@@ -448,32 +549,40 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
 
     vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
+    LogSequence(hash, true);
 
     return true;
 }
 
+MempoolAddressHasher::MempoolAddressHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t MempoolAddressHasher::operator()(const std::pair<int, uint160>& address) const
+{
+    return CSipHasher(k0, k1 ^ address.first).Write(address.second.begin(), address.second.size()).Finalize();
+}
+
 void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
 {
     LOCK(cs);
     const CTransaction& tx = entry.GetTx();
-    std::vector<CMempoolAddressDeltaKey> inserted;
-
     uint256 txhash = tx.GetHash();
+    if (mapAddressInserted.count(txhash))
+        return;
+
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > deltas;
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
         const CTxIn input = tx.vin[j];
-        const CTxOut &prevout = view.GetOutputFor(input);
+        const CTxOut &prevout = view.AccessCoin(input.prevout).out;
         if (prevout.scriptPubKey.IsPayToScriptHash()) {
             vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
             CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
+            deltas.push_back(make_pair(key, delta));
         } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
             vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
             CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
+            deltas.push_back(make_pair(key, delta));
         }
     }
 
@@ -482,18 +591,34 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewC
         if (out.scriptPubKey.IsPayToScriptHash()) {
             vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
             CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+            deltas.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
             vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-            std::pair<addressDeltaMap::iterator,bool> ret;
             CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+            deltas.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         }
     }
 
-    mapAddressInserted.insert(make_pair(txhash, inserted));
+    // The per-address vectors count towards the mempool's memory usage
+    std::vector<std::pair<int, uint160> > inserted;
+    for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::const_iterator it = deltas.begin(); it != deltas.end(); it++) {
+        std::pair<int, uint160> address(it->first.type, it->first.addressBytes);
+        addressDeltaVector& vDeltas = mapAddress[address];
+        if (vDeltas.empty() || vDeltas.back().first.txhash != txhash)
+            inserted.push_back(address);
+        cachedAddressIndexUsage -= memusage::DynamicUsage(vDeltas);
+        vDeltas.push_back(*it);
+        cachedAddressIndexUsage += memusage::DynamicUsage(vDeltas);
+    }
+    nAddressDeltas += deltas.size();
+    nAddressDeltasAdded += deltas.size();
+
+    std::sort(inserted.begin(), inserted.end());
+    inserted.erase(std::unique(inserted.begin(), inserted.end()), inserted.end());
+    cachedAddressIndexUsage += memusage::DynamicUsage(inserted);
+    mapAddressInserted[txhash].swap(inserted);
+
+    addressSubscriptions.NotifyMempool(deltas);
 }
 
 bool CTxMemPool::getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
@@ -501,29 +626,64 @@ bool CTxMemPool::getAddressIndex(std::vector<std::pair<uint160, int> > &addresse
 {
     LOCK(cs);
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        addressDeltaMap::iterator ait = mapAddress.lower_bound(CMempoolAddressDeltaKey((*it).second, (*it).first));
-        while (ait != mapAddress.end() && (*ait).first.addressBytes == (*it).first && (*ait).first.type == (*it).second) {
-            results.push_back(*ait);
-            ait++;
-        }
+        addressDeltaMap::const_iterator ait = mapAddress.find(std::make_pair((*it).second, (*it).first));
+        if (ait != mapAddress.end())
+            results.insert(results.end(), ait->second.begin(), ait->second.end());
     }
     return true;
 }
 
 bool CTxMemPool::removeAddressIndex(const uint256 txhash)
+{
+    removeAddressIndex(std::vector<uint256>(1, txhash));
+    return true;
+}
+
+void CTxMemPool::removeAddressIndex(const std::vector<uint256>& vHashes)
 {
     LOCK(cs);
-    addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
+    if (mapAddressInserted.empty())
+        return;
 
-    if (it != mapAddressInserted.end()) {
-        std::vector<CMempoolAddressDeltaKey> keys = (*it).second;
-        for (std::vector<CMempoolAddressDeltaKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapAddress.erase(*mit);
-        }
+    // Collect the addresses first, so an address many of the transactions
+    // pay to is filtered once rather than once per transaction
+    std::vector<uint256> vRemoved;
+    std::vector<std::pair<int, uint160> > vAddresses;
+    for (const uint256& txhash : vHashes) {
+        addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
+        if (it == mapAddressInserted.end())
+            continue;
+        vRemoved.push_back(txhash);
+        vAddresses.insert(vAddresses.end(), it->second.begin(), it->second.end());
+        cachedAddressIndexUsage -= memusage::DynamicUsage(it->second);
         mapAddressInserted.erase(it);
     }
+    std::sort(vRemoved.begin(), vRemoved.end());
+    std::sort(vAddresses.begin(), vAddresses.end());
+    vAddresses.erase(std::unique(vAddresses.begin(), vAddresses.end()), vAddresses.end());
 
-    return true;
+    for (const std::pair<int, uint160>& address : vAddresses) {
+        addressDeltaMap::iterator mit = mapAddress.find(address);
+        if (mit == mapAddress.end())
+            continue;
+        addressDeltaVector& vDeltas = mit->second;
+        cachedAddressIndexUsage -= memusage::DynamicUsage(vDeltas);
+        size_t nDeltasBefore = vDeltas.size();
+        vDeltas.erase(std::remove_if(vDeltas.begin(), vDeltas.end(),
+            [&vRemoved](const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& delta) {
+                return std::binary_search(vRemoved.begin(), vRemoved.end(), delta.first.txhash);
+            }),
+            vDeltas.end());
+        nAddressDeltas -= nDeltasBefore - vDeltas.size();
+        nAddressDeltasRemoved += nDeltasBefore - vDeltas.size();
+        if (vDeltas.empty()) {
+            mapAddress.erase(mit);
+        } else {
+            if (vDeltas.size() * 2 < vDeltas.capacity())
+                vDeltas.shrink_to_fit();
+            cachedAddressIndexUsage += memusage::DynamicUsage(vDeltas);
+        }
+    }
 }
 
 void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view)
@@ -536,7 +696,7 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
     uint256 txhash = tx.GetHash();
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
         const CTxIn input = tx.vin[j];
-        const CTxOut &prevout = view.GetOutputFor(input);
+        const CTxOut &prevout = view.AccessCoin(input.prevout).out;
         uint160 addressHash;
         int addressType;
 
@@ -559,7 +719,9 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
 
     }
 
-    mapSpentInserted.insert(make_pair(txhash, inserted));
+    if (mapSpentInserted.insert(make_pair(txhash, inserted)).second)
+        cachedSpentIndexUsage += memusage::DynamicUsage(inserted);
+    nSpentAdded += inserted.size();
 }
 
 bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
@@ -575,20 +737,38 @@ bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     return false;
 }
 
+void CTxMemPool::getSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values)
+{
+    LOCK(cs);
+    for (size_t i = 0; i < keys.size(); i++) {
+        mapSpentIndex::const_iterator it = mapSpent.find(keys[i]);
+        if (it != mapSpent.end())
+            values[i] = it->second;
+    }
+}
+
 bool CTxMemPool::removeSpentIndex(const uint256 txhash)
+{
+    removeSpentIndex(std::vector<uint256>(1, txhash));
+    return true;
+}
+
+void CTxMemPool::removeSpentIndex(const std::vector<uint256>& vHashes)
 {
     LOCK(cs);
-    mapSpentIndexInserted::iterator it = mapSpentInserted.find(txhash);
+    if (mapSpentInserted.empty())
+        return;
 
-    if (it != mapSpentInserted.end()) {
-        std::vector<CSpentIndexKey> keys = (*it).second;
-        for (std::vector<CSpentIndexKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapSpent.erase(*mit);
+    for (const uint256& txhash : vHashes) {
+        mapSpentIndexInserted::iterator it = mapSpentInserted.find(txhash);
+        if (it == mapSpentInserted.end())
+            continue;
+        for (const CSpentIndexKey& key : it->second) {
+            nSpentRemoved += mapSpent.erase(key);
         }
+        cachedSpentIndexUsage -= memusage::DynamicUsage(it->second);
         mapSpentInserted.erase(it);
     }
-
-    return true;
 }
 void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 {
@@ -596,6 +776,9 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
+    nNextTxRemoved += it->GetTx().vin.size();
+    for (size_t i = 0; i < it->GetTx().vout.size(); i++)
+        coinsOverlay.Uncache(COutPoint(hash, i));
 
     if (vTxHashes.size() > 1) {
         vTxHashes[it->vTxHashesIdx] = std::move(vTxHashes.back());
@@ -611,10 +794,10 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
     mapLinks.erase(it);
     mapTx.erase(it);
+    nTxRemoved++;
     nTransactionsUpdated++;
     minerPolicyEstimator->removeTx(hash);
-    removeAddressIndex(hash);
-    removeSpentIndex(hash);
+    LogSequence(hash, false);
 }
 
 // Calculates descendants of entry that are not already in setDescendants, and adds to
@@ -625,22 +808,23 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    // Entries are added to setDescendants as soon as they are staged, so the
+    // stage needs no lookups of its own.
+    std::vector<txiter> stage;
+    if (setDescendants.insert(entryit).second) {
+        stage.push_back(entryit);
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
+        txiter it = stage.back();
+        stage.pop_back();
 
         const setEntries &setChildren = GetMemPoolChildren(it);
         BOOST_FOREACH(const txiter &childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+            if (setDescendants.insert(childiter).second) {
+                stage.push_back(childiter);
             }
         }
     }
@@ -696,9 +880,9 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
                 if (it2 != mapTx.end())
                     continue;
-                const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
-                if (nCheckFrequency != 0) assert(coins);
-                if (!coins || ( (coins->IsCoinBase() || coins->IsCoinStake()) && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
+                const Coin &coin = pcoins->AccessCoin(txin.prevout);
+                if (nCheckFrequency != 0) assert(!coin.IsSpent());
+                if (coin.IsSpent() || ((coin.IsCoinBase() || coin.IsCoinStake()) && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
                     txToRemove.insert(it);
                     break;
                 }
@@ -749,15 +933,34 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
     }
     // Before the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries);
+
+    // Work out everything the block removes before removing anything, so
+    // the in-block transactions go in one pass and so do their conflicts
+    // and the descendants of those
+    setEntries stage;
+    setEntries setConflicts;
     for (const auto& tx : vtx)
     {
         txiter it = mapTx.find(tx->GetHash());
-        if (it != mapTx.end()) {
-            setEntries stage;
+        if (it != mapTx.end())
             stage.insert(it);
-            RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
+        BOOST_FOREACH(const CTxIn &txin, tx->vin) {
+            auto itNext = mapNextTx.find(txin.prevout);
+            if (itNext != mapNextTx.end() && *itNext->second != *tx)
+                setConflicts.insert(mapTx.find(itNext->second->GetHash()));
         }
-        removeConflicts(*tx);
+    }
+    setEntries stageConflicts;
+    BOOST_FOREACH(txiter conflictIt, setConflicts) {
+        ClearPrioritisation(conflictIt->GetTx().GetHash());
+        CalculateDescendants(conflictIt, stageConflicts);
+    }
+
+    RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
+    RemoveStaged(stageConflicts, false, MemPoolRemovalReason::CONFLICT);
+    TRACE4(mempool, removed_for_block, nBlockHeight, stage.size(), stageConflicts.size(), mapTx.size());
+    for (const auto& tx : vtx)
+    {
         ClearPrioritisation(tx->GetHash());
     }
     lastRollingFeeUpdate = GetTime();
@@ -766,15 +969,26 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
+    coinsOverlay.Reset(uint256());
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapAddress.clear();
+    mapAddressInserted.clear();
+    mapSpent.clear();
+    mapSpentInserted.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    cachedAddressIndexUsage = 0;
+    cachedSpentIndexUsage = 0;
+    nAddressDeltas = 0;
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    // Nothing is logged for what the pool held, so no earlier sequence can be caught up from
+    vSequenceLog.clear();
+    nSequenceLogFirst = ++nMempoolSequence + 1;
 }
 
 void CTxMemPool::clear()
@@ -826,8 +1040,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                     parentSigOpCost += it2->GetSigOpCost();
                 }
             } else {
-                const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
-                assert(coins && coins->IsAvailable(txin.prevout.n));
+                assert(pcoins->HaveCoin(txin.prevout));
             }
             // Check whether its inputs are marked in mapNextTx.
             auto it3 = mapNextTx.find(txin.prevout);
@@ -998,6 +1211,22 @@ CTransactionRef CTxMemPool::get(const uint256& hash) const
     return i->GetSharedTx();
 }
 
+std::vector<int64_t> CTxMemPool::GetSigOpCosts(const std::vector<CTransactionRef>& vtx) const
+{
+    std::vector<int64_t> vCosts(vtx.size(), -1);
+    LOCK(cs);
+    for (size_t i = 0; i < vtx.size(); i++) {
+        indexed_transaction_set::const_iterator it = mapTx.find(vtx[i]->GetHash());
+        if (it == mapTx.end())
+            continue;
+        // The txid does not commit to the witness, which witness sigops are
+        // counted in; take the cost only for the very same transaction
+        if (it->GetSharedTx() == vtx[i] || (!vtx[i]->HasWitness() && !it->GetTx().HasWitness()))
+            vCosts[i] = it->GetSigOpCost();
+    }
+    return vCosts;
+}
+
 TxMempoolInfo CTxMemPool::info(const uint256& hash) const
 {
     LOCK(cs);
@@ -1009,12 +1238,11 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
 
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
-    LOCK(cs);
+    // The estimator has its own lock
     return minerPolicyEstimator->estimateFee(nBlocks);
 }
 CFeeRate CTxMemPool::estimateSmartFee(int nBlocks, int *answerFoundAtBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateSmartFee(nBlocks, answerFoundAtBlocks, *this);
 }
 double CTxMemPool::estimatePriority(int nBlocks) const
@@ -1032,7 +1260,6 @@ bool
 CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
 {
     try {
-        LOCK(cs);
         fileout << 139900; // version required to read: 0.13.99 or later
         fileout << CLIENT_VERSION; // version that wrote the file
         minerPolicyEstimator->Write(fileout);
@@ -1052,7 +1279,6 @@ CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
         filein >> nVersionRequired >> nVersionThatWrote;
         if (nVersionRequired > CLIENT_VERSION)
             return error("CTxMemPool::ReadFeeEstimates(): up-version (%d) fee estimate file", nVersionRequired);
-        LOCK(cs);
         minerPolicyEstimator->Read(filein, nVersionThatWrote);
     }
     catch (const std::exception&) {
@@ -1062,6 +1288,16 @@ CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
     return true;
 }
 
+bool CTxMemPool::TakeFeeEstimatesJournal(std::vector<CFeeEstimatorBlock>& vBlocks) const
+{
+    return minerPolicyEstimator->TakeJournal(vBlocks);
+}
+
+void CTxMemPool::ReadFeeEstimatesJournal(CAutoFile& filein)
+{
+    minerPolicyEstimator->ReadJournal(filein);
+}
+
 void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta)
 {
     {
@@ -1072,6 +1308,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
             mapTx.modify(it, update_fee_delta(deltas.second));
+            mapTx.modify(it, update_priority_delta(deltas.first));
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -1103,6 +1340,20 @@ void CTxMemPool::ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount
     nFeeDelta += deltas.second;
 }
 
+void CTxMemPool::UpdatePriorities(unsigned int nHeight)
+{
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    // Priority grows linearly with height at a rate set by the in-chain
+    // input value, so entries without any never need to move
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it) {
+        if (it->GetCachedPriorityHeight() != nHeight && it->GetInChainInputValue() != 0)
+            mapTx.modify(it, update_cached_priority(nHeight));
+    }
+}
+
 void CTxMemPool::ClearPrioritisation(const uint256 hash)
 {
     LOCK(cs);
@@ -1117,50 +1368,116 @@ bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
     return true;
 }
 
+void CCoinsViewMemPoolOverlay::Reset(const uint256& hashTip)
+{
+    Discard();
+    hashBlock = hashTip;
+}
+
+CCoinsViewMemPoolOverlay& CTxMemPool::GetCoinsOverlay(const uint256& hashTip, size_t nMaxUsage)
+{
+    // A lookup that returned early may have left the overlay attached to its view
+    coinsOverlay.Detach();
+    if (coinsOverlay.GetBestBlock() != hashTip || coinsOverlay.DynamicMemoryUsage() > nMaxUsage)
+        coinsOverlay.Reset(hashTip);
+    return coinsOverlay;
+}
+
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
-bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) const {
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    CTransactionRef ptx = mempool.get(txid);
+    CTransactionRef ptx = mempool.get(outpoint.hash);
     if (ptx) {
-        coins = CCoins(*ptx, MEMPOOL_HEIGHT);
-        return true;
+        if (outpoint.n < ptx->vout.size()) {
+            coin = Coin(ptx->vout[outpoint.n], MEMPOOL_HEIGHT, false, ptx->IsCoinStake(), ptx->nTime);
+            return true;
+        } else {
+            return false;
+        }
     }
-    return (base->GetCoins(txid, coins) && !coins.IsPruned());
+    return (base->GetCoin(outpoint, coin) && !coin.IsSpent());
 }
 
-bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
-    return mempool.exists(txid) || base->HaveCoins(txid);
+bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) const {
+    return mempool.exists(outpoint) || base->HaveCoin(outpoint);
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) +
+           memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapAddressInserted) + memusage::DynamicUsage(mapSpent) + memusage::DynamicUsage(mapSpentInserted) +
+           cachedInnerUsage + cachedAddressIndexUsage + cachedSpentIndexUsage;
+}
+
+MemPoolMemoryUsage CTxMemPool::GetMemoryUsage() const {
+    LOCK(cs);
+    MemPoolMemoryUsage usage;
+
+    // cachedInnerUsage covers both the entries and their link sets; only the
+    // latter need a walk to tell apart
+    size_t nLinksInnerUsage = 0;
+    for (const auto& links : mapLinks)
+        nLinksInnerUsage += memusage::DynamicUsage(links.second.parents) + memusage::DynamicUsage(links.second.children);
+
+    usage.tx.nCount = mapTx.size();
+    usage.tx.nUsage = memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + cachedInnerUsage - nLinksInnerUsage;
+    usage.tx.nAdded = nTxAdded;
+    usage.tx.nRemoved = nTxRemoved;
+
+    usage.links.nCount = mapLinks.size();
+    usage.links.nUsage = memusage::DynamicUsage(mapLinks) + nLinksInnerUsage;
+
+    usage.nextTx.nCount = mapNextTx.size();
+    usage.nextTx.nUsage = memusage::DynamicUsage(mapNextTx);
+    usage.nextTx.nAdded = nNextTxAdded;
+    usage.nextTx.nRemoved = nNextTxRemoved;
+
+    usage.deltas.nCount = mapDeltas.size();
+    usage.deltas.nUsage = memusage::DynamicUsage(mapDeltas);
+
+    usage.txHashes.nCount = vTxHashes.size();
+    usage.txHashes.nUsage = memusage::DynamicUsage(vTxHashes);
+
+    usage.addressIndex.nCount = nAddressDeltas;
+    usage.addressIndex.nUsage = memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapAddressInserted) + cachedAddressIndexUsage;
+    usage.addressIndex.nAdded = nAddressDeltasAdded;
+    usage.addressIndex.nRemoved = nAddressDeltasRemoved;
+
+    usage.spentIndex.nCount = mapSpent.size();
+    usage.spentIndex.nUsage = memusage::DynamicUsage(mapSpent) + memusage::DynamicUsage(mapSpentInserted) + cachedSpentIndexUsage;
+    usage.spentIndex.nAdded = nSpentAdded;
+    usage.spentIndex.nRemoved = nSpentRemoved;
+
+    return usage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
+    std::vector<uint256> vRemoved;
+    vRemoved.reserve(stage.size());
     BOOST_FOREACH(const txiter& it, stage) {
+        vRemoved.push_back(it->GetTx().GetHash());
         removeUnchecked(it, reason);
     }
+    removeAddressIndex(vRemoved);
+    removeSpentIndex(vRemoved);
 }
 
 int CTxMemPool::Expire(int64_t time) {
     LOCK(cs);
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
-    setEntries toremove;
+    // Descendants of an expired transaction that expire themselves are
+    // already staged when the walk reaches them, and are not walked again
+    setEntries stage;
     while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
-        toremove.insert(mapTx.project<0>(it));
+        CalculateDescendants(mapTx.project<0>(it), stage);
         it++;
     }
-    setEntries stage;
-    BOOST_FOREACH(txiter removeit, toremove) {
-        CalculateDescendants(removeit, stage);
-    }
     RemoveStaged(stage, false, MemPoolRemovalReason::EXPIRY);
     return stage.size();
 }
@@ -1243,42 +1560,70 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
-void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining) {
+size_t CTxMemPool::RemovalMemoryUsage(txiter it) const {
+    AssertLockHeld(cs);
+    size_t nUsage = memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) + it->DynamicMemoryUsage() +
+                    it->GetTx().vin.size() * memusage::IncrementalDynamicUsage(mapNextTx) +
+                    memusage::IncrementalDynamicUsage(mapLinks);
+    txlinksMap::const_iterator itLinks = mapLinks.find(it);
+    if (itLinks != mapLinks.end())
+        nUsage += memusage::DynamicUsage(itLinks->second.parents) + memusage::DynamicUsage(itLinks->second.children);
+    return nUsage;
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
-
-        // We set the new mempool min fee to the feerate of the removed set, plus the
-        // "minimum reasonable fee rate" (ie some value under which we consider txn
-        // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
-        // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
-        removed += incrementalRelayFee;
-        trackPackageRemoved(removed);
-        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
-
+    size_t nUsage;
+    while (!mapTx.empty() && (nUsage = DynamicMemoryUsage()) > sizelimit) {
+        // Stage the packages with the lowest descendant scores until they
+        // make up the excess, and remove them all at once. The scores are the
+        // ones from before the batch; removing a package can raise the score
+        // of its ancestors, which a batch does not see, so batches are kept
+        // to the excess and the loop looks at the scores again after each.
+        size_t nExcess = nUsage - sizelimit;
+        size_t nFreed = 0;
         setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        while (it != mapTx.get<descendant_score>().end() && nFreed < nExcess) {
+            txiter txit = mapTx.project<0>(it++);
+            if (stage.count(txit))
+                continue;
+
+            // We set the new mempool min fee to the feerate of the removed set, plus the
+            // "minimum reasonable fee rate" (ie some value under which we consider txn
+            // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
+            // equal to txn which were removed with no block in between.
+            CFeeRate removed(txit->GetModFeesWithDescendants(), txit->GetSizeWithDescendants());
+            removed += incrementalRelayFee;
+            trackPackageRemoved(removed);
+            maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+            setEntries package;
+            CalculateDescendants(txit, package);
+            BOOST_FOREACH(txiter iter, package) {
+                if (stage.insert(iter).second)
+                    nFreed += RemovalMemoryUsage(iter);
+            }
+        }
         nTxnRemoved += stage.size();
 
-        std::vector<CTransaction> txn;
+        std::vector<CTransactionRef> txn;
         if (pvNoSpendsRemaining) {
             txn.reserve(stage.size());
             BOOST_FOREACH(txiter iter, stage)
-                txn.push_back(iter->GetTx());
+                txn.push_back(iter->GetSharedTx());
         }
         RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
         if (pvNoSpendsRemaining) {
-            BOOST_FOREACH(const CTransaction& tx, txn) {
-                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                    if (exists(txin.prevout.hash))
+            BOOST_FOREACH(const CTransactionRef& tx, txn) {
+                BOOST_FOREACH(const CTxIn& txin, tx->vin) {
+                    if (mapTx.count(txin.prevout.hash))
                         continue;
-                    auto iter = mapNextTx.lower_bound(COutPoint(txin.prevout.hash, 0));
-                    if (iter == mapNextTx.end() || iter->first->hash != txin.prevout.hash)
-                        pvNoSpendsRemaining->push_back(txin.prevout.hash);
+                    if (!mapNextTx.count(txin.prevout))
+                        pvNoSpendsRemaining->push_back(txin.prevout);
                 }
             }
         }
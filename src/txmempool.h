@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <deque>
 #include <memory>
 #include <set>
 #include <map>
@@ -24,6 +25,7 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include <boost/unordered_map.hpp>
 
 #include <boost/signals2/signal.hpp>
 #include "addressindex.h"
@@ -45,7 +47,7 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 struct LockPoints
@@ -85,18 +87,17 @@ class CTxMemPool;
 class CTxMemPoolEntry
 {
 private:
+    // The size of this class counts against -maxmempool for every entry, so
+    // the 64-bit fields come first and sizes, counts and heights that fit in
+    // 32 bits are packed in pairs after them.
     CTransactionRef tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
-    size_t nTxWeight;          //!< ... and avoid recomputing tx weight (also used for GetTxSize())
-    size_t nModSize;           //!< ... and modified size for priority
-    size_t nUsageSize;         //!< ... and total memory usage
     int64_t nTime;             //!< Local time when entering the mempool
     double entryPriority;      //!< Priority when entering the mempool
-    unsigned int entryHeight;  //!< Chain height when entering the mempool
     CAmount inChainInputValue; //!< Sum of all txin values that are already in blockchain
-    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
-    int64_t sigOpCost;         //!< Total sigop cost
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
+    double priorityDelta;      //!< Coin age priority added by PrioritiseTransaction
+    double cachedPriority;     //!< Priority (including priorityDelta) at cachedPriorityHeight
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
 
     // Information about descendants of this transaction that are in the
@@ -104,15 +105,23 @@ private:
     // descendants as well.  if nCountWithDescendants is 0, treat this entry as
     // dirty, and nSizeWithDescendants and nModFeesWithDescendants will not be
     // correct.
-    uint64_t nCountWithDescendants;  //!< number of descendant transactions
     uint64_t nSizeWithDescendants;   //!< ... and size
     CAmount nModFeesWithDescendants; //!< ... and total fees (all including us)
 
     // Analogous statistics for ancestor transactions
-    uint64_t nCountWithAncestors;
     uint64_t nSizeWithAncestors;
     CAmount nModFeesWithAncestors;
-    int64_t nSigOpCostWithAncestors;
+
+    uint32_t nTxWeight;        //!< ... and avoid recomputing tx weight (also used for GetTxSize())
+    uint32_t nModSize;         //!< ... and modified size for priority
+    uint32_t nUsageSize;       //!< ... and total memory usage
+    uint32_t entryHeight;      //!< Chain height when entering the mempool
+    uint32_t cachedPriorityHeight;
+    int32_t sigOpCost;         //!< Total sigop cost
+    uint32_t nCountWithDescendants;  //!< number of descendant transactions
+    uint32_t nCountWithAncestors;
+    int32_t nSigOpCostWithAncestors;
+    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
 
 public:
     CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
@@ -129,6 +138,10 @@ public:
      * from entry priority. Only inputs that were originally in-chain will age.
      */
     double GetPriority(unsigned int currentHeight) const;
+    /** Priority including any delta, as of the height it was last updated to */
+    double GetCachedPriority() const { return cachedPriority; }
+    unsigned int GetCachedPriorityHeight() const { return cachedPriorityHeight; }
+    const CAmount& GetInChainInputValue() const { return inChainInputValue; }
     const CAmount& GetFee() const { return nFee; }
     size_t GetTxSize() const;
     size_t GetTxWeight() const { return nTxWeight; }
@@ -148,6 +161,10 @@ public:
     void UpdateFeeDelta(int64_t feeDelta);
     // Update the LockPoints after a reorg
     void UpdateLockPoints(const LockPoints& lp);
+    // Updates the priority delta used for the cached priority
+    void UpdatePriorityDelta(double newPriorityDelta);
+    // Moves the cached priority to another height
+    void UpdateCachedPriority(unsigned int height);
 
     uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
     uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
@@ -160,7 +177,8 @@ public:
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
-    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint32_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last traversal epoch that visited this entry, see CTxMemPool::Visited()
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -205,6 +223,26 @@ private:
     int64_t feeDelta;
 };
 
+struct update_priority_delta
+{
+    update_priority_delta(double _priorityDelta) : priorityDelta(_priorityDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdatePriorityDelta(priorityDelta); }
+
+private:
+    double priorityDelta;
+};
+
+struct update_cached_priority
+{
+    update_cached_priority(unsigned int _height) : height(_height) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateCachedPriority(height); }
+
+private:
+    unsigned int height;
+};
+
 struct update_lock_points
 {
     update_lock_points(const LockPoints& _lp) : lp(_lp) { }
@@ -280,6 +318,22 @@ public:
     }
 };
 
+/** \class CompareTxMemPoolEntryByPriority
+ *
+ *  Sort by cached coin age priority in descending order, then by score
+ */
+class CompareTxMemPoolEntryByPriority
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
+    {
+        if (a.GetCachedPriority() == b.GetCachedPriority()) {
+            return CompareTxMemPoolEntryByScore()(a, b);
+        }
+        return a.GetCachedPriority() > b.GetCachedPriority();
+    }
+};
+
 class CompareTxMemPoolEntryByEntryTime
 {
 public:
@@ -317,8 +371,10 @@ struct descendant_score {};
 struct entry_time {};
 struct mining_score {};
 struct ancestor_score {};
+struct priority_score {};
 
 class CBlockPolicyEstimator;
+struct CFeeEstimatorBlock;
 
 /**
  * Information about a mempool transaction.
@@ -338,6 +394,29 @@ struct TxMempoolInfo
     int64_t nFeeDelta;
 };
 
+/** Size of one of the mempool's data structures */
+struct MemPoolComponentUsage
+{
+    size_t nCount;     //!< Number of elements
+    size_t nUsage;     //!< Estimated dynamic memory usage in bytes
+    uint64_t nAdded;   //!< Elements inserted since startup, where tracked
+    uint64_t nRemoved; //!< Elements erased since startup, where tracked
+
+    MemPoolComponentUsage() : nCount(0), nUsage(0), nAdded(0), nRemoved(0) {}
+};
+
+/** Memory usage of the mempool broken down by structure, see CTxMemPool::GetMemoryUsage() */
+struct MemPoolMemoryUsage
+{
+    MemPoolComponentUsage tx;           //!< mapTx nodes and the entries' own allocations
+    MemPoolComponentUsage links;        //!< mapLinks and the parent/child sets
+    MemPoolComponentUsage nextTx;       //!< mapNextTx
+    MemPoolComponentUsage deltas;       //!< mapDeltas
+    MemPoolComponentUsage txHashes;     //!< vTxHashes
+    MemPoolComponentUsage addressIndex; //!< mapAddress and mapAddressInserted, counted in deltas
+    MemPoolComponentUsage spentIndex;   //!< mapSpent and mapSpentInserted, counted in spent outputs
+};
+
 /** Reason why a transaction was removed from the mempool,
  * this is passed to the notification signal.
  */
@@ -351,6 +430,48 @@ enum class MemPoolRemovalReason {
     REPLACED     //! Removed for replacement
 };
 
+/** Salted hash of an address (type and hash) of the mempool address index */
+class MempoolAddressHasher
+{
+private:
+    const uint64_t k0, k1;
+
+public:
+    MempoolAddressHasher();
+
+    size_t operator()(const std::pair<int, uint160>& address) const;
+};
+
+/** Memory the coins overlay may use before AcceptToMemoryPool starts it afresh */
+static const size_t MAX_MEMPOOL_COINS_OVERLAY_USAGE = 32 << 20;
+
+/** Additions and removals the mempool remembers for GetChangesSince, about 40 bytes each */
+static const size_t MEMPOOL_SEQUENCE_LOG_SIZE = 100000;
+
+/**
+ * Coins cache that AcceptToMemoryPool looks inputs up through, kept from one
+ * transaction to the next so a coin shared by several (a parent's outputs,
+ * or coins of the same wallet) is fetched and copied once. It caches what a
+ * CCoinsViewMemPool attached with Attach() returns, so it only holds for the
+ * chain tip it was started at; the pool drops the outputs of transactions
+ * that leave it. Never written anywhere.
+ */
+class CCoinsViewMemPoolOverlay : public CCoinsViewCache
+{
+private:
+    CCoinsView viewNull;
+
+public:
+    CCoinsViewMemPoolOverlay() : CCoinsViewCache(&viewNull) {}
+
+    /** Look missing coins up in view until Detach() */
+    void Attach(CCoinsView& view) { SetBackend(view); }
+    void Detach() { SetBackend(viewNull); }
+
+    /** Drop everything and start over at hashTip */
+    void Reset(const uint256& hashTip);
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain transactions
  * that may be included in the next block.
@@ -366,11 +487,13 @@ enum class MemPoolRemovalReason {
  *
  * CTxMemPool::mapTx, and CTxMemPoolEntry bookkeeping:
  *
- * mapTx is a boost::multi_index that sorts the mempool on 4 criteria:
+ * mapTx is a boost::multi_index that sorts the mempool on 6 criteria:
  * - transaction hash
  * - feerate [we use max(feerate of tx, feerate of tx with all descendants)]
  * - time in mempool
  * - mining score (feerate modified by any fee deltas from PrioritiseTransaction)
+ * - feerate with all ancestors
+ * - coin age priority, as of the height of the last UpdatePriorities() call
  *
  * Note: the term "descendant" refers to in-mempool transactions that depend on
  * this one, while "ancestor" refers to in-mempool transactions that a given
@@ -440,6 +563,23 @@ private:
 
     uint64_t totalTxSize;      //!< sum of all mempool tx's virtual sizes. Differs from serialized tx size since witness data is discounted. Defined in BIP 141.
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    uint64_t cachedAddressIndexUsage; //!< sum of dynamic memory usage of the address index vectors
+    uint64_t cachedSpentIndexUsage;   //!< sum of dynamic memory usage of the spent index vectors
+    uint64_t nAddressDeltas;          //!< number of deltas in mapAddress
+
+    // Elements inserted into and erased from the mempool structures since startup
+    uint64_t nTxAdded, nTxRemoved;
+    uint64_t nNextTxAdded, nNextTxRemoved;
+    uint64_t nAddressDeltasAdded, nAddressDeltasRemoved;
+    uint64_t nSpentAdded, nSpentRemoved;
+    unsigned int nPriorityHeight; //!< height the cached priorities of all entries are at
+
+    uint64_t nMempoolSequence;   //!< bumped by every transaction added or removed, and by clear()
+    uint64_t nSequenceLogFirst;  //!< sequence of the first change in vSequenceLog
+    //! The txids of the latest additions and removals, the last one at nMempoolSequence
+    std::deque<uint256> vSequenceLog;
+
+    void LogSequence(const uint256& hash, bool fAdded);
 
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
@@ -479,6 +619,12 @@ public:
                 boost::multi_index::tag<ancestor_score>,
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByAncestorFee
+            >,
+            // sorted by coin age priority
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<priority_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByPriority
             >
         >
     > indexed_transaction_set;
@@ -499,7 +645,27 @@ public:
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
+
+    //! Current traversal epoch, see Visited(). Protected by cs.
+    mutable uint64_t nEpoch;
+    mutable bool fHasEpochGuard;
+
+    /**
+     * Scopes a traversal of the transaction graph: while an EpochGuard is
+     * alive, Visited() tells whether an entry was already seen, without
+     * building a set of the visited entries. Traversals cannot nest.
+     * Requires cs.
+     */
+    class EpochGuard {
+        const CTxMemPool& pool;
+    public:
+        EpochGuard(const CTxMemPool& in);
+        ~EpochGuard();
+    };
+
+    /** Mark an entry visited in the current traversal, returning whether it was already. */
+    bool Visited(txiter it) const;
 
     struct TxLinks {
         setEntries parents;
@@ -508,10 +674,13 @@ private:
 
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
-    typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
+    //! Address index deltas of each address, in the order their transactions arrived
+    typedef std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > addressDeltaVector;
+    typedef boost::unordered_map<std::pair<int, uint160>, addressDeltaVector, MempoolAddressHasher> addressDeltaMap;
     addressDeltaMap mapAddress;
 
-    typedef std::map<uint256, std::vector<CMempoolAddressDeltaKey> > addressDeltaMapInserted;
+    //! Addresses each transaction has deltas at
+    typedef std::map<uint256, std::vector<std::pair<int, uint160> > > addressDeltaMapInserted;
     addressDeltaMapInserted mapAddressInserted;
 
     typedef std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpentIndex;
@@ -554,10 +723,15 @@ public:
     bool getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                          std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results);
     bool removeAddressIndex(const uint256 txhash);
+    /** Remove the address index records of many transactions, touching each address once */
+    void removeAddressIndex(const std::vector<uint256>& vHashes);
 
     void addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCache &view);
     bool getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
+    /** Fill values[i] for each keys[i] a mempool transaction spends, under one lock; the others are left alone */
+    void getSpentIndexes(const std::vector<CSpentIndexKey> &keys, std::vector<CSpentIndexValue> &values);
     bool removeSpentIndex(const uint256 txhash);
+    void removeSpentIndex(const std::vector<uint256>& vHashes);
 
     
     void removeRecursive(const CTransaction &tx, MemPoolRemovalReason reason = MemPoolRemovalReason::UNKNOWN);
@@ -569,9 +743,19 @@ public:
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /** The mempool sequence, bumped by every transaction added to or removed from the pool */
+    uint64_t GetSequence() const;
+    /**
+     * The transactions added to and removed from the pool after nSequence,
+     * net of each other: those in the pool now are in vAdded, the others in
+     * vRemoved, each in the order of its last change. Returns false if the
+     * log does not reach back to nSequence, when the caller has to start
+     * over from the whole pool.
+     */
+    bool GetChangesSince(uint64_t nSequence, std::vector<uint256>& vAdded, std::vector<uint256>& vRemoved) const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
@@ -581,6 +765,13 @@ public:
     /** Affect CreateNewBlock prioritisation of transactions */
     void PrioritiseTransaction(const uint256 hash, const std::string strHash, double dPriorityDelta, const CAmount& nFeeDelta);
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta) const;
+    /**
+     * Bring the cached priority of all entries to nHeight, so the
+     * priority_score index is ordered by priority at that height. Only
+     * entries whose priority ages are touched, and nothing at all if the
+     * height has not changed since the last call.
+     */
+    void UpdatePriorities(unsigned int nHeight);
     void ClearPrioritisation(const uint256 hash);
 
 public:
@@ -632,8 +823,10 @@ public:
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
       *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
       *  which are not in mempool which no longer have any spends in this mempool.
+      *  Packages are picked by descendant score and removed in batches, each
+      *  one just big enough to make up the excess it was picked for.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining=NULL);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
@@ -659,7 +852,20 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    bool exists(const COutPoint& outpoint) const
+    {
+        LOCK(cs);
+        auto it = mapTx.find(outpoint.hash);
+        return (it != mapTx.end() && outpoint.n < it->GetTx().vout.size());
+    }
+
     CTransactionRef get(const uint256& hash) const;
+    /**
+     * The sigop costs the entries of the transactions of vtx were added with,
+     * -1 for those not in the mempool or whose witness may differ from the
+     * one there.
+     */
+    std::vector<int64_t> GetSigOpCosts(const std::vector<CTransactionRef>& vtx) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
@@ -684,13 +890,34 @@ public:
     /** Write/Read estimates to disk */
     bool WriteFeeEstimates(CAutoFile& fileout) const;
     bool ReadFeeEstimates(CAutoFile& filein);
+    /**
+     * Take the estimator input from the blocks since the last write, to
+     * append to the journal. False means a full WriteFeeEstimates() is needed.
+     */
+    bool TakeFeeEstimatesJournal(std::vector<CFeeEstimatorBlock>& vBlocks) const;
+    /** Replay the journal on top of the estimates read by ReadFeeEstimates() */
+    void ReadFeeEstimatesJournal(CAutoFile& filein);
 
     size_t DynamicMemoryUsage() const;
+    /** DynamicMemoryUsage() broken down by structure, with insertion and removal counts */
+    MemPoolMemoryUsage GetMemoryUsage() const;
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
+    /** Every addition (true) and removal (false), with the mempool sequence it took; fired holding cs */
+    boost::signals2::signal<void (const uint256&, bool, uint64_t)> NotifyEntrySequence;
+
+    /**
+     * The coins overlay for a transaction entering the pool while hashTip is
+     * the chain tip, detached and started afresh if the tip has changed or it
+     * has grown past nMaxUsage. Requires cs_main, which guards the overlay.
+     */
+    CCoinsViewMemPoolOverlay& GetCoinsOverlay(const uint256& hashTip, size_t nMaxUsage = MAX_MEMPOOL_COINS_OVERLAY_USAGE);
 
 private:
+    CCoinsViewMemPoolOverlay coinsOverlay;
+
+
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
      *  the descendants for a single transaction that has been added to the
      *  mempool but may have child transactions in the mempool, eg during a
@@ -724,9 +951,14 @@ private:
      *  CTxMemPoolEntry's setMemPoolParents in order to walk ancestors of a
      *  given transaction that is removed, so we can't remove intermediate
      *  transactions in a chain before we've updated all the state for the
-     *  removal.
+     *  removal. The address and spent index records are left to the caller,
+     *  to be removed for the whole set at once.
      */
     void removeUnchecked(txiter entry, MemPoolRemovalReason reason = MemPoolRemovalReason::UNKNOWN);
+    /** Memory that removing an entry frees, as DynamicMemoryUsage() counts
+     *  it: the entry, its transaction, its spends and its links. Its address
+     *  and spent index records are not counted. */
+    size_t RemovalMemoryUsage(txiter it) const;
 };
 
 /** 
@@ -740,8 +972,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
 };
 
 // We want to sort transactions by coin age priority
@@ -0,0 +1,272 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanage.h"
+
+#include "consensus/validation.h"
+#include "core_memusage.h"
+#include "memusage.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+CTxOrphanage::CTxOrphanage(unsigned int nMaxOrphansIn, size_t nMaxSizeIn) :
+    nTotalSize(0), nMaxOrphans(nMaxOrphansIn), nMaxSize(nMaxSizeIn), nNextSweep(0)
+{
+}
+
+void CTxOrphanage::SetLimits(unsigned int nMaxOrphansIn, size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxOrphans = nMaxOrphansIn;
+    nMaxSize = nMaxSizeIn;
+}
+
+bool CTxOrphanage::AddTx(const CTransactionRef& tx, NodeId peer)
+{
+    LOCK(cs);
+    const uint256& hash = tx->GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = GetTransactionWeight(*tx);
+    if (sz >= MAX_STANDARD_TX_WEIGHT)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    // Keep a peer from pushing everybody else's orphans out
+    size_t nSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
+    CPeerUsage& usage = mapPeerUsage[peer];
+    if (usage.nCount + 1 > std::max(1u, nMaxOrphans / ORPHAN_TX_PEER_SHARE) ||
+            usage.nSize + nSize > std::max(nSize, nMaxSize / ORPHAN_TX_PEER_SHARE)) {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d is over its orphan quota (%u tx, %u bytes)\n",
+                 hash.ToString(), peer, usage.nCount, usage.nSize);
+        if (usage.nCount == 0)
+            mapPeerUsage.erase(peer);
+        return false;
+    }
+
+    auto ret = mapOrphans.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, nSize, vOrphanList.size()});
+    assert(ret.second);
+    vOrphanList.push_back(hash);
+    for (const CTxIn& txin : tx->vin) {
+        mapOrphansByPrev[txin.prevout].insert(hash);
+    }
+    usage.nCount++;
+    usage.nSize += nSize;
+    nTotalSize += nSize;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
+             mapOrphans.size(), mapOrphansByPrev.size());
+    return true;
+}
+
+bool CTxOrphanage::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) > 0;
+}
+
+int CTxOrphanage::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    return EraseTxLocked(hash);
+}
+
+int CTxOrphanage::EraseTxLocked(const uint256& hash)
+{
+    AssertLockHeld(cs);
+    auto it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return 0;
+    for (const CTxIn& txin : it->second.tx->vin) {
+        auto itPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    // Move the last entry of the list into the freed slot
+    size_t nListPos = it->second.nListPos;
+    if (nListPos != vOrphanList.size() - 1) {
+        const uint256& hashLast = vOrphanList.back();
+        mapOrphans.find(hashLast)->second.nListPos = nListPos;
+        vOrphanList[nListPos] = hashLast;
+    }
+    vOrphanList.pop_back();
+
+    auto itUsage = mapPeerUsage.find(it->second.fromPeer);
+    if (itUsage != mapPeerUsage.end()) {
+        itUsage->second.nCount--;
+        itUsage->second.nSize -= it->second.nSize;
+        if (itUsage->second.nCount == 0)
+            mapPeerUsage.erase(itUsage);
+    }
+    nTotalSize -= it->second.nSize;
+    mapOrphans.erase(it);
+    return 1;
+}
+
+void CTxOrphanage::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    mapWorkSet.erase(peer);
+    if (!mapPeerUsage.count(peer))
+        return;
+
+    int nErased = 0;
+    std::vector<uint256> vErase;
+    for (const auto& entry : mapOrphans) {
+        if (entry.second.fromPeer == peer)
+            vErase.push_back(entry.first);
+    }
+    for (const uint256& hash : vErase) {
+        nErased += EraseTxLocked(hash);
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer=%d\n", nErased, peer);
+}
+
+int CTxOrphanage::EraseForBlockTx(const CTransaction& tx)
+{
+    LOCK(cs);
+    std::vector<uint256> vOrphanErase;
+    // Which orphan pool entries must we evict?
+    for (const CTxIn& txin : tx.vin) {
+        auto itByPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itByPrev == mapOrphansByPrev.end()) continue;
+        vOrphanErase.insert(vOrphanErase.end(), itByPrev->second.begin(), itByPrev->second.end());
+    }
+
+    int nErased = 0;
+    for (const uint256& hash : vOrphanErase) {
+        nErased += EraseTxLocked(hash);
+    }
+    return nErased;
+}
+
+unsigned int CTxOrphanage::LimitOrphans()
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        std::vector<uint256> vErase;
+        for (const auto& entry : mapOrphans) {
+            if (entry.second.nTimeExpire <= nNow) {
+                vErase.push_back(entry.first);
+            } else {
+                nMinExpTime = std::min(entry.second.nTimeExpire, nMinExpTime);
+            }
+        }
+        for (const uint256& hash : vErase) {
+            nErased += EraseTxLocked(hash);
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    }
+    FastRandomContext rng;
+    while (mapOrphans.size() > nMaxOrphans || nTotalSize > nMaxSize)
+    {
+        // Evict a random orphan:
+        uint256 hash = vOrphanList[rng.rand32() % vOrphanList.size()];
+        EraseTxLocked(hash);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+void CTxOrphanage::AddChildrenToWorkSet(const CTransaction& tx, NodeId peer)
+{
+    LOCK(cs);
+    std::set<uint256>* pWorkSet = NULL;
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        auto itByPrev = mapOrphansByPrev.find(COutPoint(tx.GetHash(), i));
+        if (itByPrev == mapOrphansByPrev.end())
+            continue;
+        if (!pWorkSet)
+            pWorkSet = &mapWorkSet[peer];
+        pWorkSet->insert(itByPrev->second.begin(), itByPrev->second.end());
+    }
+}
+
+CTransactionRef CTxOrphanage::GetTxToReconsider(NodeId peer, NodeId& fromPeer)
+{
+    LOCK(cs);
+    auto itWorkSet = mapWorkSet.find(peer);
+    if (itWorkSet == mapWorkSet.end())
+        return CTransactionRef();
+
+    CTransactionRef tx;
+    std::set<uint256>& setWork = itWorkSet->second;
+    while (!tx && !setWork.empty()) {
+        // Orphans may have been erased since they were queued
+        auto it = mapOrphans.find(*setWork.begin());
+        setWork.erase(setWork.begin());
+        if (it != mapOrphans.end()) {
+            tx = it->second.tx;
+            fromPeer = it->second.fromPeer;
+        }
+    }
+    if (setWork.empty())
+        mapWorkSet.erase(itWorkSet);
+    return tx;
+}
+
+bool CTxOrphanage::HaveTxToReconsider(NodeId peer) const
+{
+    LOCK(cs);
+    return mapWorkSet.count(peer) > 0;
+}
+
+size_t CTxOrphanage::Size() const
+{
+    LOCK(cs);
+    return mapOrphans.size();
+}
+
+size_t CTxOrphanage::TotalSize() const
+{
+    LOCK(cs);
+    return nTotalSize;
+}
+
+size_t CTxOrphanage::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    size_t nUsage = memusage::DynamicUsage(mapOrphans) + memusage::DynamicUsage(mapOrphansByPrev) +
+                    memusage::DynamicUsage(vOrphanList) + memusage::DynamicUsage(mapPeerUsage) + memusage::DynamicUsage(mapWorkSet);
+    for (const auto& orphan : mapOrphans)
+        nUsage += memusage::DynamicUsage(orphan.second.tx) + RecursiveDynamicUsage(*orphan.second.tx);
+    for (const auto& prev : mapOrphansByPrev)
+        nUsage += memusage::DynamicUsage(prev.second);
+    for (const auto& workset : mapWorkSet)
+        nUsage += memusage::DynamicUsage(workset.second);
+    return nUsage;
+}
+
+void CTxOrphanage::Clear()
+{
+    LOCK(cs);
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    vOrphanList.clear();
+    mapPeerUsage.clear();
+    mapWorkSet.clear();
+    nTotalSize = 0;
+}
@@ -0,0 +1,123 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANAGE_H
+#define BITCOIN_TXORPHANAGE_H
+
+#include "coins.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** A single peer may fill at most 1/ORPHAN_TX_PEER_SHARE of the orphan pool limits */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 4;
+
+/**
+ * Transactions whose inputs we cannot find yet, kept until a parent shows up.
+ *
+ * The pool is bounded both in number of transactions and in their total
+ * serialized size, and no single peer may take more than its share of
+ * either, so one peer flooding orphans can only push out its own. Entries
+ * are hash indexed and eviction picks a random entry in constant time.
+ *
+ * Once a parent is accepted, the orphans spending it are queued on the
+ * work set of the peer that gave us the parent, to be reconsidered one at a
+ * time by that peer's message handler rather than all at once.
+ *
+ * All methods are thread safe and take the pool's own lock, which must
+ * never be held while taking cs_main.
+ */
+class CTxOrphanage
+{
+public:
+    CTxOrphanage(unsigned int nMaxOrphansIn, size_t nMaxSizeIn);
+
+    /** Set the limits that LimitOrphans() enforces and the per-peer quotas derive from */
+    void SetLimits(unsigned int nMaxOrphansIn, size_t nMaxSizeIn);
+
+    /**
+     * Add an orphan transaction received from peer. Fails if we already have
+     * it, if it is too large, or if peer is over its quota.
+     */
+    bool AddTx(const CTransactionRef& tx, NodeId peer);
+
+    /** Whether we have this orphan */
+    bool HaveTx(const uint256& hash) const;
+
+    /** Erase an orphan by hash, returning the number erased (0 or 1) */
+    int EraseTx(const uint256& hash);
+
+    /** Erase all orphans from peer, and its work set */
+    void EraseForPeer(NodeId peer);
+
+    /** Erase the orphans that spend an input of tx, which is now in a block */
+    int EraseForBlockTx(const CTransaction& tx);
+
+    /** Erase expired orphans, then random ones until within the limits. Returns the number of random evictions. */
+    unsigned int LimitOrphans();
+
+    /** Queue the orphans that spend an output of tx for reconsideration on behalf of peer */
+    void AddChildrenToWorkSet(const CTransaction& tx, NodeId peer);
+
+    /**
+     * Take the next orphan queued for reconsideration on behalf of peer, or
+     * NULL if there is none. fromPeer is set to the peer that sent us the
+     * orphan.
+     */
+    CTransactionRef GetTxToReconsider(NodeId peer, NodeId& fromPeer);
+
+    /** Whether orphans are queued for reconsideration on behalf of peer */
+    bool HaveTxToReconsider(NodeId peer) const;
+
+    /** Number of orphans */
+    size_t Size() const;
+
+    /** Total serialized size of the orphans */
+    size_t TotalSize() const;
+
+    /** Memory used by the orphans and the maps holding them */
+    size_t DynamicMemoryUsage() const;
+
+    void Clear();
+
+private:
+    struct COrphanTx {
+        CTransactionRef tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        size_t nSize;
+        //! Position in vOrphanList
+        size_t nListPos;
+    };
+
+    struct CPeerUsage {
+        unsigned int nCount;
+        size_t nSize;
+    };
+
+    int EraseTxLocked(const uint256& hash);
+
+    mutable CCriticalSection cs;
+    std::unordered_map<uint256, COrphanTx, SaltedTxidHasher> mapOrphans;
+    std::unordered_map<COutPoint, std::set<uint256>, SaltedOutpointHasher> mapOrphansByPrev;
+    //! The hashes of all orphans, for picking a random one to evict
+    std::vector<uint256> vOrphanList;
+    std::map<NodeId, CPeerUsage> mapPeerUsage;
+    std::map<NodeId, std::set<uint256>> mapWorkSet;
+    size_t nTotalSize;
+    unsigned int nMaxOrphans;
+    size_t nMaxSize;
+    int64_t nNextSweep;
+};
+
+#endif // BITCOIN_TXORPHANAGE_H
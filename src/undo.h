@@ -6,66 +6,101 @@
 #ifndef BITCOIN_UNDO_H
 #define BITCOIN_UNDO_H
 
+#include "coins.h"
 #include "compressor.h"
+#include "consensus/consensus.h"
 #include "primitives/transaction.h"
 #include "serialize.h"
 
+#include <map>
+
 /** Undo information for a CTxIn
  *
- *  Contains the prevout's CTxOut being spent, and if this was the
- *  last output of the affected transaction, its metadata as well
- *  (coinbase or not, height, transaction version)
+ *  Contains the prevout's CTxOut being spent, and its metadata as well
+ *  (coinbase or coinstake, height, time). The serialization contains a dummy
+ *  value of zero. This is compatible with older versions which expect to see
+ *  the transaction version there.
  */
-class CTxInUndo
+class TxInUndoSerializer
 {
-public:
-    CTxOut txout;         // the txout data before being spent
-    bool fCoinBase;       // if the outpoint was the last unspent: whether it belonged to a coinbase
-    bool fCoinStake;      // if the outpoint was the last unspent: whether it belonged to a coinstake
-    unsigned int nHeight; // if the outpoint was the last unspent: its height
-    int nVersion;         // if the outpoint was the last unspent: its version
-    unsigned int nTime;   // if the outpoint was the last unspent: its time
-    CTxInUndo() : txout(), fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0), nTime(0) {}
-    CTxInUndo(const CTxOut& txoutIn, bool fCoinBaseIn = false, bool fCoinStakeIn = false, unsigned int nHeightIn = 0, int nVersionIn = 0, unsigned int nTimeIn = 0) : txout(txoutIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn), nVersion(nVersionIn), nTime(nTimeIn) {}
+    const Coin* txout;
 
+public:
     template <typename Stream>
     void Serialize(Stream& s) const
     {
-        ::Serialize(s, VARINT(nHeight * 4 + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0)));
-        if (nHeight > 0)
-            ::Serialize(s, VARINT(this->nVersion));
-        ::Serialize(s, this->nTime);
-        ::Serialize(s, CTxOutCompressor(REF(txout)));
+        unsigned int nHeight = txout->nHeight;
+        ::Serialize(s, VARINT(nHeight * 4 + (txout->fCoinBase ? 1 : 0) + (txout->fCoinStake ? 2 : 0)));
+        if (nHeight > 0) {
+            // Required to maintain compatibility with older undo format.
+            int nVersionDummy = 0;
+            ::Serialize(s, VARINT(nVersionDummy));
+        }
+        ::Serialize(s, txout->nTime);
+        ::Serialize(s, CTxOutCompressor(REF(txout->out)));
     }
 
+    TxInUndoSerializer(const Coin* coin) : txout(coin) {}
+};
+
+class TxInUndoDeserializer
+{
+    Coin* txout;
+
+public:
     template <typename Stream>
     void Unserialize(Stream& s)
     {
         unsigned int nCode = 0;
         ::Unserialize(s, VARINT(nCode));
-        nHeight = nCode / 4;
-        fCoinBase = nCode & 1;
-        fCoinStake = nCode & 2;
-        if (nHeight > 0)
-            ::Unserialize(s, VARINT(this->nVersion));
-        ::Unserialize(s, this->nTime);
-        ::Unserialize(s, REF(CTxOutCompressor(REF(txout))));
+        txout->nHeight = nCode / 4;
+        txout->fCoinBase = nCode & 1;
+        txout->fCoinStake = nCode & 2;
+        if (txout->nHeight > 0) {
+            // Old versions stored the version number for the last spend of
+            // a transaction's outputs. Non-final spends were indicated with
+            // height = 0.
+            int nVersionDummy;
+            ::Unserialize(s, VARINT(nVersionDummy));
+        }
+        ::Unserialize(s, txout->nTime);
+        ::Unserialize(s, REF(CTxOutCompressor(REF(txout->out))));
     }
+
+    TxInUndoDeserializer(Coin* coin) : txout(coin) {}
 };
 
+static const size_t MAX_INPUTS_PER_BLOCK = MAX_BLOCK_BASE_SIZE / ::GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION);
+
 /** Undo information for a CTransaction */
 class CTxUndo
 {
 public:
     // undo information for all txins
-    std::vector<CTxInUndo> vprevout;
+    std::vector<Coin> vprevout;
 
-    ADD_SERIALIZE_METHODS;
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        uint64_t count = vprevout.size();
+        ::Serialize(s, COMPACTSIZE(REF(count)));
+        for (const Coin& prevout : vprevout) {
+            ::Serialize(s, REF(TxInUndoSerializer(&prevout)));
+        }
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action)
+    template <typename Stream>
+    void Unserialize(Stream& s)
     {
-        READWRITE(vprevout);
+        uint64_t count = 0;
+        ::Unserialize(s, COMPACTSIZE(count));
+        if (count > MAX_INPUTS_PER_BLOCK) {
+            throw std::ios_base::failure("Too many input undo records");
+        }
+        vprevout.resize(count);
+        for (Coin& prevout : vprevout) {
+            ::Unserialize(s, REF(TxInUndoDeserializer(&prevout)));
+        }
     }
 };
 
@@ -84,4 +119,124 @@ public:
     }
 };
 
+/** First byte of a compact undo record. A legacy record starts with its
+ *  transaction count, which is never encoded with a leading 0xff. */
+static const unsigned char UNDO_COMPACT_MARKER = 0xff;
+static const unsigned char UNDO_COMPACT_VERSION = 1;
+
+/**
+ * Columnar encoding of a CBlockUndo for rev?????.dat: after the marker and
+ * version, the number of inputs of each transaction, then one column each
+ * for the heights and flags, times, amounts and scripts of all spent
+ * outputs. Scripts are kept once per block in a dictionary and referenced
+ * by index, as outputs of one address are often spent together, and the
+ * legacy version placeholder is left out.
+ */
+class CompactBlockUndo
+{
+    CBlockUndo& undo;
+
+public:
+    explicit CompactBlockUndo(CBlockUndo& undoIn) : undo(undoIn) {}
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ::Serialize(s, UNDO_COMPACT_MARKER);
+        ::Serialize(s, UNDO_COMPACT_VERSION);
+        WriteCompactSize(s, undo.vtxundo.size());
+        for (const CTxUndo& txundo : undo.vtxundo)
+            WriteCompactSize(s, txundo.vprevout.size());
+        for (const CTxUndo& txundo : undo.vtxundo) {
+            for (const Coin& coin : txundo.vprevout) {
+                unsigned int nCode = (unsigned int)coin.nHeight * 4 + (coin.fCoinBase ? 1 : 0) + (coin.fCoinStake ? 2 : 0);
+                ::Serialize(s, VARINT(nCode));
+            }
+        }
+        for (const CTxUndo& txundo : undo.vtxundo) {
+            for (const Coin& coin : txundo.vprevout)
+                ::Serialize(s, coin.nTime);
+        }
+        for (const CTxUndo& txundo : undo.vtxundo) {
+            for (const Coin& coin : txundo.vprevout) {
+                uint64_t nAmount = CTxOutCompressor::CompressAmount(coin.out.nValue);
+                ::Serialize(s, VARINT(nAmount));
+            }
+        }
+        std::map<CScript, uint64_t> mapScriptIndex;
+        std::vector<const CScript*> vScripts;
+        std::vector<uint64_t> vIndexes;
+        for (const CTxUndo& txundo : undo.vtxundo) {
+            for (const Coin& coin : txundo.vprevout) {
+                auto it = mapScriptIndex.emplace(coin.out.scriptPubKey, vScripts.size()).first;
+                if (it->second == vScripts.size())
+                    vScripts.push_back(&it->first);
+                vIndexes.push_back(it->second);
+            }
+        }
+        WriteCompactSize(s, vScripts.size());
+        for (const CScript* pscript : vScripts)
+            ::Serialize(s, CScriptCompressor(REF(*pscript)));
+        for (uint64_t nIndex : vIndexes)
+            ::Serialize(s, VARINT(nIndex));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        unsigned char chMarker, nVersion;
+        ::Unserialize(s, chMarker);
+        ::Unserialize(s, nVersion);
+        if (chMarker != UNDO_COMPACT_MARKER || nVersion != UNDO_COMPACT_VERSION)
+            throw std::ios_base::failure("Unknown compact undo format");
+        uint64_t nTx = ReadCompactSize(s);
+        if (nTx > MAX_INPUTS_PER_BLOCK)
+            throw std::ios_base::failure("Too many transaction undo records");
+        undo.vtxundo.resize(nTx);
+        uint64_t nCoins = 0;
+        for (CTxUndo& txundo : undo.vtxundo) {
+            uint64_t nInputs = ReadCompactSize(s);
+            nCoins += nInputs;
+            if (nCoins > MAX_INPUTS_PER_BLOCK)
+                throw std::ios_base::failure("Too many input undo records");
+            txundo.vprevout.resize(nInputs);
+        }
+        for (CTxUndo& txundo : undo.vtxundo) {
+            for (Coin& coin : txundo.vprevout) {
+                unsigned int nCode = 0;
+                ::Unserialize(s, VARINT(nCode));
+                coin.nHeight = nCode / 4;
+                coin.fCoinBase = nCode & 1;
+                coin.fCoinStake = nCode & 2;
+            }
+        }
+        for (CTxUndo& txundo : undo.vtxundo) {
+            for (Coin& coin : txundo.vprevout)
+                ::Unserialize(s, coin.nTime);
+        }
+        for (CTxUndo& txundo : undo.vtxundo) {
+            for (Coin& coin : txundo.vprevout) {
+                uint64_t nAmount = 0;
+                ::Unserialize(s, VARINT(nAmount));
+                coin.out.nValue = CTxOutCompressor::DecompressAmount(nAmount);
+            }
+        }
+        uint64_t nScripts = ReadCompactSize(s);
+        if (nScripts > nCoins)
+            throw std::ios_base::failure("Too many undo scripts");
+        std::vector<CScript> vScripts(nScripts);
+        for (CScript& script : vScripts)
+            ::Unserialize(s, REF(CScriptCompressor(script)));
+        for (CTxUndo& txundo : undo.vtxundo) {
+            for (Coin& coin : txundo.vprevout) {
+                uint64_t nIndex = 0;
+                ::Unserialize(s, VARINT(nIndex));
+                if (nIndex >= vScripts.size())
+                    throw std::ios_base::failure("Undo script index out of range");
+                coin.out.scriptPubKey = vScripts[nIndex];
+            }
+        }
+    }
+};
+
 #endif // BITCOIN_UNDO_H
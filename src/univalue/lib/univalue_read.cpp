@@ -42,8 +42,46 @@ static const char *hatoui(const char *first, const char *last,
     return first;
 }
 
+static const uint64_t ONES = 0x0101010101010101ULL;
+static const uint64_t HIGHS = 0x8080808080808080ULL;
+
+// Length of the run of 7-bit ASCII chars at the start of [first, last) that
+// can be copied into a string as they are: no control chars, quotes or
+// backslashes. Checks eight bytes at a time where it can.
+static size_t plainRunLength(const char *first, const char *last)
+{
+    const char *p = first;
+    while (last - p >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        // A byte is flagged if it is below 0x20, has its top bit set, or
+        // matches '"' or '\\'; the flags are exact as a whole.
+        uint64_t q = v ^ (ONES * '"');
+        uint64_t b = v ^ (ONES * '\\');
+        uint64_t special = ((v - ONES * 0x20) & ~v) | v |
+                           ((q - ONES) & ~q) | ((b - ONES) & ~b);
+        if (special & HIGHS)
+            break;
+        p += 8;
+    }
+    while (p != last) {
+        unsigned char ch = *p;
+        if (ch < 0x20 || ch >= 0x80 || ch == '"' || ch == '\\')
+            break;
+        p++;
+    }
+    return p - first;
+}
+
 enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
                             const char *raw)
+{
+    return getJsonToken(tokenVal, consumed, raw, raw + strlen(raw));
+}
+
+// raw must be NUL-terminated at end (which the scanner does not read past)
+enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
+                            const char *raw, const char *end)
 {
     tokenVal.clear();
     consumed = 0;
@@ -114,8 +152,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '8':
     case '9': {
         // part 1: int
-        string numStr;
-
         const char *first = raw;
 
         const char *firstDigit = first;
@@ -124,49 +160,38 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
         if ((*firstDigit == '0') && json_isdigit(firstDigit[1]))
             return JTOK_ERR;
 
-        numStr += *raw;                       // copy first char
-        raw++;
+        raw++;                                // first char
 
         if ((*first == '-') && (!json_isdigit(*raw)))
             return JTOK_ERR;
 
-        while ((*raw) && json_isdigit(*raw)) {     // copy digits
-            numStr += *raw;
+        while (json_isdigit(*raw))            // digits
             raw++;
-        }
 
         // part 2: frac
         if (*raw == '.') {
-            numStr += *raw;                   // copy .
-            raw++;
+            raw++;                            // .
 
             if (!json_isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && json_isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while (json_isdigit(*raw))        // digits
                 raw++;
-            }
         }
 
         // part 3: exp
         if (*raw == 'e' || *raw == 'E') {
-            numStr += *raw;                   // copy E
-            raw++;
+            raw++;                            // E
 
-            if (*raw == '-' || *raw == '+') { // copy +/-
-                numStr += *raw;
+            if (*raw == '-' || *raw == '+')   // +/-
                 raw++;
-            }
 
             if (!json_isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && json_isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while (json_isdigit(*raw))        // digits
                 raw++;
-            }
         }
 
-        tokenVal = numStr;
+        tokenVal.assign(first, raw);
         consumed = (raw - rawStart);
         return JTOK_NUMBER;
         }
@@ -174,10 +199,17 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '"': {
         raw++;                                // skip "
 
-        string valStr;
-        JSONUTF8StringFilter writer(valStr);
+        JSONUTF8StringFilter writer(tokenVal);
 
         while (*raw) {
+            // Copy runs of plain chars, like hex, in one go
+            size_t run = plainRunLength(raw, end);
+            if (run) {
+                writer.append(raw, raw + run);
+                raw += run;
+                continue;
+            }
+
             if ((unsigned char)*raw < 0x20)
                 return JTOK_ERR;
 
@@ -224,7 +256,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
 
         if (!writer.finalize())
             return JTOK_ERR;
-        tokenVal = valStr;
         consumed = (raw - rawStart);
         return JTOK_STRING;
         }
@@ -247,9 +278,17 @@ enum expect_bits {
 #define clearExpect(bit) (expectMask &= ~EXP_##bit)
 
 bool UniValue::read(const char *raw)
+{
+    return read(raw, strlen(raw));
+}
+
+// raw must be NUL-terminated at raw + len, and is read up to the first NUL
+bool UniValue::read(const char *raw, size_t len)
 {
     clear();
 
+    const char *end = raw + len;
+
     uint32_t expectMask = 0;
     vector<UniValue*> stack;
 
@@ -260,7 +299,7 @@ bool UniValue::read(const char *raw)
     do {
         last_tok = tok;
 
-        tok = getJsonToken(tokenVal, consumed, raw);
+        tok = getJsonToken(tokenVal, consumed, raw, end);
         if (tok == JTOK_NONE || tok == JTOK_ERR)
             return false;
         raw += consumed;
@@ -399,9 +438,10 @@ bool UniValue::read(const char *raw)
             if (!stack.size())
                 return false;
 
-            UniValue tmpVal(VNUM, tokenVal);
+            // Swapped in rather than copied, tokenVal is reset by the next token
             UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
+            top->values.push_back(UniValue(VNUM));
+            top->values.back().val.swap(tokenVal);
 
             setExpect(NOT_VALUE);
             break;
@@ -414,12 +454,13 @@ bool UniValue::read(const char *raw)
             UniValue *top = stack.back();
 
             if (expect(OBJ_NAME)) {
-                top->keys.push_back(tokenVal);
+                top->keys.push_back(string());
+                top->keys.back().swap(tokenVal);
                 clearExpect(OBJ_NAME);
                 setExpect(COLON);
             } else {
-                UniValue tmpVal(VSTR, tokenVal);
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(VSTR));
+                top->values.back().val.swap(tokenVal);
             }
 
             setExpect(NOT_VALUE);
@@ -432,7 +473,7 @@ bool UniValue::read(const char *raw)
     } while (!stack.empty ());
 
     /* Check that nothing follows the initial construct (parsed above).  */
-    tok = getJsonToken(tokenVal, consumed, raw);
+    tok = getJsonToken(tokenVal, consumed, raw, end);
     if (tok != JTOK_NONE)
         return false;
 
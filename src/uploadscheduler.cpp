@@ -0,0 +1,103 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "uploadscheduler.h"
+
+#include "protocol.h"
+
+#include <algorithm>
+
+SendPriority GetSendPriority(const std::string& strCommand)
+{
+    // Historical blocks are only known as such to whoever serves them
+    if (strCommand == NetMsgType::TX)
+        return SEND_PRIORITY_TX;
+    return SEND_PRIORITY_BLOCK;
+}
+
+CUploadScheduler::CUploadScheduler(uint64_t nBytesPerSecondIn) : nBytesPerSecond(nBytesPerSecondIn), nTokens(nBytesPerSecondIn), nLastRefillMicros(0)
+{
+}
+
+void CUploadScheduler::SetRate(uint64_t nBytesPerSecondIn)
+{
+    LOCK(cs);
+    nBytesPerSecond = nBytesPerSecondIn;
+    nTokens = std::min(nTokens, (int64_t)nBytesPerSecond);
+}
+
+uint64_t CUploadScheduler::GetRate() const
+{
+    LOCK(cs);
+    return nBytesPerSecond;
+}
+
+bool CUploadScheduler::IsLimited() const
+{
+    LOCK(cs);
+    return nBytesPerSecond > 0;
+}
+
+void CUploadScheduler::Refill(int64_t nTimeMicros)
+{
+    LOCK(cs);
+    if (nLastRefillMicros > 0 && nTimeMicros > nLastRefillMicros) {
+        // At most a second's worth, which also keeps the product in range
+        int64_t nElapsed = std::min(nTimeMicros - nLastRefillMicros, (int64_t)1000000);
+        nTokens = std::min(nTokens + (int64_t)(nBytesPerSecond * nElapsed / 1000000), (int64_t)nBytesPerSecond);
+    }
+    nLastRefillMicros = nTimeMicros;
+}
+
+void CUploadScheduler::Consume(uint64_t nBytes)
+{
+    LOCK(cs);
+    if (nBytesPerSecond > 0)
+        nTokens -= nBytes;
+}
+
+bool CUploadScheduler::MaySend(SendPriority nPriority) const
+{
+    LOCK(cs);
+    return nBytesPerSecond == 0 || nPriority == SEND_PRIORITY_BLOCK || nTokens > 0;
+}
+
+std::vector<uint64_t> CUploadScheduler::Allocate(const std::vector<std::pair<SendPriority, uint64_t> >& vPeers) const
+{
+    std::vector<uint64_t> vAllowance(vPeers.size(), 0);
+    int64_t nBudget;
+    {
+        LOCK(cs);
+        if (nBytesPerSecond == 0) {
+            for (size_t i = 0; i < vPeers.size(); i++)
+                vAllowance[i] = vPeers[i].second;
+            return vAllowance;
+        }
+        nBudget = nTokens;
+    }
+
+    for (int nPriority = SEND_PRIORITY_BLOCK; nPriority < SEND_PRIORITY_COUNT; nPriority++) {
+        // The peers of this class, wanting least first
+        std::vector<std::pair<uint64_t, size_t> > vWanting;
+        for (size_t i = 0; i < vPeers.size(); i++) {
+            if (vPeers[i].first == nPriority)
+                vWanting.push_back(std::make_pair(vPeers[i].second, i));
+        }
+        if (nPriority == SEND_PRIORITY_BLOCK) {
+            for (const std::pair<uint64_t, size_t>& peer : vWanting) {
+                vAllowance[peer.second] = peer.first;
+                nBudget -= peer.first;
+            }
+            continue;
+        }
+        std::sort(vWanting.begin(), vWanting.end());
+        for (size_t n = 0; n < vWanting.size() && nBudget > 0; n++) {
+            uint64_t nShare = std::max((uint64_t)1, (uint64_t)nBudget / (vWanting.size() - n));
+            uint64_t nAllowance = std::min(vWanting[n].first, nShare);
+            vAllowance[vWanting[n].second] = nAllowance;
+            nBudget -= nAllowance;
+        }
+    }
+    return vAllowance;
+}
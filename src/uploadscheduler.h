@@ -0,0 +1,74 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UPLOADSCHEDULER_H
+#define BITCOIN_UPLOADSCHEDULER_H
+
+#include "sync.h"
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** Classes of outgoing messages, most urgent first */
+enum SendPriority {
+    //! New blocks, compact blocks, headers, announcements and the small control messages
+    SEND_PRIORITY_BLOCK = 0,
+    //! Transaction relay
+    SEND_PRIORITY_TX = 1,
+    //! Blocks served to peers that are syncing the chain
+    SEND_PRIORITY_HISTORICAL = 2,
+    SEND_PRIORITY_COUNT = 3,
+};
+
+/** The class a message goes out in unless its sender picks one */
+SendPriority GetSendPriority(const std::string& strCommand);
+
+/**
+ * Token bucket that -maxuploadrate limits sends through.
+ *
+ * The bucket fills at the configured rate and holds at most one second of
+ * it. Block class messages always go out and may run it into debt, so new
+ * blocks are never held back; the lower classes only get what is left, in
+ * order, each split evenly over the peers waiting in it (peers wanting less
+ * than an even split leave the rest to the others). With no rate set the
+ * scheduler lets everything through.
+ *
+ * All methods are thread safe.
+ */
+class CUploadScheduler
+{
+public:
+    explicit CUploadScheduler(uint64_t nBytesPerSecondIn = 0);
+
+    /** Change the rate; 0 lifts the limit */
+    void SetRate(uint64_t nBytesPerSecondIn);
+    uint64_t GetRate() const;
+    bool IsLimited() const;
+
+    /** Add the tokens earned up to nTimeMicros */
+    void Refill(int64_t nTimeMicros);
+
+    /** Take nBytes that went out from the bucket */
+    void Consume(uint64_t nBytes);
+
+    /** Whether a message of class nPriority may start going out now */
+    bool MaySend(SendPriority nPriority) const;
+
+    /**
+     * Share the bucket out over the peers that have data to send, each given
+     * as the class of its next message and the bytes it has queued. Returns
+     * the bytes each may send now, in the same order.
+     */
+    std::vector<uint64_t> Allocate(const std::vector<std::pair<SendPriority, uint64_t> >& vPeers) const;
+
+private:
+    mutable CCriticalSection cs;
+    uint64_t nBytesPerSecond;
+    int64_t nTokens;
+    int64_t nLastRefillMicros;
+};
+
+#endif // BITCOIN_UPLOADSCHEDULER_H
@@ -726,6 +726,21 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+void FileStartWriteback(FILE *file, int64_t offset, int64_t length)
+{
+    fflush(file);
+#if defined(__linux__)
+    sync_file_range(fileno(file), offset, length, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+void FileDropCache(FILE *file, int64_t offset, int64_t length)
+{
+#if !defined(WIN32) && defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fileno(file), offset, length, POSIX_FADV_DONTNEED);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Amount of debug.log to save at end when shrinking (must fit in memory)
@@ -858,6 +873,20 @@ int GetNumCores()
 #endif
 }
 
+void ParallelFor(size_t n, int nThreads, const std::function<void(size_t)>& fn)
+{
+    std::atomic<size_t> nNext(0);
+    auto worker = [&]() {
+        for (size_t i; (i = nNext++) < n; )
+            fn(i);
+    };
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads && (size_t)i < n; i++)
+        threadGroup.create_thread(worker);
+    worker();
+    threadGroup.join_all();
+}
+
 std::string CopyrightHolders(const std::string& strPrefix)
 {
     std::string strCopyrightHolders = strPrefix + strprintf(_(COPYRIGHT_HOLDERS), _(COPYRIGHT_HOLDERS_SUBSTITUTION));
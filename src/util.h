@@ -20,6 +20,7 @@
 
 #include <atomic>
 #include <exception>
+#include <functional>
 #include <map>
 #include <stdint.h>
 #include <string>
@@ -113,6 +114,10 @@ void FileCommit(FILE *file);
 bool TruncateFile(FILE *file, unsigned int length);
 int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
+/** Start writing back [offset, offset + length) of file, length 0 meaning to its end, without waiting for it; advisory, Linux only */
+void FileStartWriteback(FILE *file, int64_t offset, int64_t length);
+/** Drop the clean cached pages of [offset, offset + length) of file; advisory */
+void FileDropCache(FILE *file, int64_t offset, int64_t length);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 bool TryCreateDirectory(const boost::filesystem::path& p);
 boost::filesystem::path GetDefaultDataDir();
@@ -231,6 +236,13 @@ std::string CopyrightHolders(const std::string& strPrefix);
  */
 int GetNumCores();
 
+/**
+ * Call fn(i) for each i in [0, n), spread over up to nThreads threads (the
+ * calling one included), and return once all calls are done. fn must not
+ * throw, and must be safe to call concurrently for different i.
+ */
+void ParallelFor(size_t n, int nThreads, const std::function<void(size_t)>& fn);
+
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
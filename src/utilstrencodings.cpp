@@ -66,6 +66,22 @@ bool IsHex(const string& str)
     return (str.size() > 0) && (str.size()%2 == 0);
 }
 
+bool DecodeHex(const string& str, vector<unsigned char>& vch)
+{
+    if (str.empty() || str.size() % 2 != 0)
+        return false;
+    vch.resize(str.size() / 2);
+    const char* psz = str.data();
+    for (size_t i = 0; i < vch.size(); i++) {
+        signed char hi = HexDigit(psz[2 * i]);
+        signed char lo = HexDigit(psz[2 * i + 1]);
+        if ((hi | lo) < 0)
+            return false;
+        vch[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
 vector<unsigned char> ParseHex(const char* psz)
 {
     // convert hex dump to vector
@@ -41,6 +41,8 @@ std::vector<unsigned char> ParseHex(const char* psz);
 std::vector<unsigned char> ParseHex(const std::string& str);
 signed char HexDigit(char c);
 bool IsHex(const std::string& str);
+/** IsHex and ParseHex in one pass: decode str into vch, or return false if it is not IsHex. */
+bool DecodeHex(const std::string& str, std::vector<unsigned char>& vch);
 std::vector<unsigned char> DecodeBase64(const char* p, bool* pfInvalid = NULL);
 std::string DecodeBase64(const std::string& str);
 std::string EncodeBase64(const unsigned char* pch, size_t len);
@@ -0,0 +1,342 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "checkpoints.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "hash.h"
+#include "streams.h"
+#include "sync.h"
+#include "tinyformat.h"
+#include "txdb.h"
+#include "util.h"
+#include "validation.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+const unsigned char UTXO_SNAPSHOT_MAGIC[5] = {'u', 't', 'x', 'o', 0xff};
+//! Magic, version, network magic, base hash and height
+const uint64_t UTXO_SNAPSHOT_HEADER_SIZE = sizeof(UTXO_SNAPSHOT_MAGIC) + 2 + CMessageHeader::MESSAGE_START_SIZE + 32 + 4;
+//! Null txid ending the coins, coin count and hash
+const uint64_t UTXO_SNAPSHOT_TRAILER_SIZE = 32 + 8 + 32;
+
+/** Writes serialized data to a file and hashes all of it */
+class CHashingFileWriter
+{
+private:
+    CAutoFile& file;
+    CHashWriter hasher;
+
+public:
+    CHashingFileWriter(CAutoFile& fileIn) : file(fileIn), hasher(SER_GETHASH, 0) {}
+
+    int GetType() const { return file.GetType(); }
+    int GetVersion() const { return file.GetVersion(); }
+
+    void write(const char* pch, size_t nSize)
+    {
+        file.write(pch, nSize);
+        hasher.write(pch, nSize);
+    }
+
+    template<typename T>
+    CHashingFileWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj);
+        return *this;
+    }
+
+    uint256 GetHash() { return hasher.GetHash(); }
+};
+
+void WriteOutputs(CHashingFileWriter& writer, const uint256& txid, std::vector<std::pair<uint32_t, Coin> >& outputs)
+{
+    writer << txid;
+    WriteCompactSize(writer, outputs.size());
+    for (std::pair<uint32_t, Coin>& output : outputs)
+        writer << VARINT(output.first) << output.second;
+}
+
+} // anon namespace
+
+bool WriteUTXOSnapshot(const boost::filesystem::path& path, CCoinsViewCursor* pcursor, const std::vector<CSnapshotBlockInfo>& vBlocks, CUTXOSnapshotMetadata& metadata, std::string& strError)
+{
+    assert(!vBlocks.empty());
+    CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        strError = strprintf("Unable to open %s for writing", path.string());
+        return false;
+    }
+    metadata.hashBase = pcursor->GetBestBlock();
+    metadata.nHeight = vBlocks.size() - 1;
+    metadata.nCoins = 0;
+    try {
+        CHashingFileWriter writer(fileout);
+        writer.write((const char*)UTXO_SNAPSHOT_MAGIC, sizeof(UTXO_SNAPSHOT_MAGIC));
+        writer << UTXO_SNAPSHOT_VERSION;
+        writer.write((const char*)Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+        writer << metadata.hashBase << metadata.nHeight << vBlocks;
+
+        // Outputs are stored sorted by txid, so the ones of a transaction
+        // are adjacent and share one copy of it
+        uint256 txidPrev;
+        std::vector<std::pair<uint32_t, Coin> > outputs;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            COutPoint key;
+            Coin coin;
+            if (!pcursor->GetKey(key) || !pcursor->GetValue(coin)) {
+                strError = "Unable to read UTXO set";
+                return false;
+            }
+            if (!outputs.empty() && key.hash != txidPrev) {
+                WriteOutputs(writer, txidPrev, outputs);
+                outputs.clear();
+            }
+            txidPrev = key.hash;
+            outputs.emplace_back(key.n, std::move(coin));
+            metadata.nCoins++;
+            pcursor->Next();
+        }
+        if (!outputs.empty())
+            WriteOutputs(writer, txidPrev, outputs);
+        writer << uint256() << metadata.nCoins;
+        metadata.hashSnapshot = writer.GetHash();
+        fileout << metadata.hashSnapshot;
+        FileCommit(fileout.Get());
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to write %s: %s", path.string(), e.what());
+        return false;
+    }
+    return true;
+}
+
+CUTXOSnapshotReader::CUTXOSnapshotReader(const boost::filesystem::path& pathIn) : path(pathIn)
+{
+}
+
+CUTXOSnapshotReader::~CUTXOSnapshotReader()
+{
+}
+
+bool CUTXOSnapshotReader::Open(const uint256& hashExpected, std::string& strError)
+{
+    pfile.reset(new CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION));
+    if (pfile->IsNull()) {
+        strError = strprintf("Unable to open %s", path.string());
+        return false;
+    }
+    try {
+        uint64_t nSize = boost::filesystem::file_size(path);
+        if (nSize < UTXO_SNAPSHOT_HEADER_SIZE + UTXO_SNAPSHOT_TRAILER_SIZE) {
+            strError = "Snapshot file is truncated";
+            return false;
+        }
+
+        // Hash the whole file before trusting anything in it
+        CHashWriter hasher(SER_GETHASH, 0);
+        std::vector<char> vBuf(1 << 20);
+        for (uint64_t nLeft = nSize - 32; nLeft > 0; ) {
+            size_t nRead = std::min<uint64_t>(nLeft, vBuf.size());
+            pfile->read(vBuf.data(), nRead);
+            hasher.write(vBuf.data(), nRead);
+            nLeft -= nRead;
+            boost::this_thread::interruption_point();
+        }
+        uint256 hashStored;
+        *pfile >> hashStored;
+        metadata.hashSnapshot = hasher.GetHash();
+        if (hashStored != metadata.hashSnapshot) {
+            strError = "Snapshot file is corrupt";
+            return false;
+        }
+        if (metadata.hashSnapshot != hashExpected) {
+            strError = strprintf("Snapshot hash %s does not match the expected %s", metadata.hashSnapshot.GetHex(), hashExpected.GetHex());
+            return false;
+        }
+
+        if (fseek(pfile->Get(), nSize - 40, SEEK_SET) != 0) {
+            strError = "Unable to seek in snapshot file";
+            return false;
+        }
+        *pfile >> metadata.nCoins;
+        if (fseek(pfile->Get(), 0, SEEK_SET) != 0) {
+            strError = "Unable to seek in snapshot file";
+            return false;
+        }
+
+        unsigned char pchMagic[sizeof(UTXO_SNAPSHOT_MAGIC)];
+        pfile->read((char*)pchMagic, sizeof(pchMagic));
+        uint16_t nVersion;
+        *pfile >> nVersion;
+        if (memcmp(pchMagic, UTXO_SNAPSHOT_MAGIC, sizeof(pchMagic)) != 0 || nVersion != UTXO_SNAPSHOT_VERSION) {
+            strError = "Not a snapshot file or of an unknown version";
+            return false;
+        }
+        unsigned char pchMessageStart[CMessageHeader::MESSAGE_START_SIZE];
+        pfile->read((char*)pchMessageStart, sizeof(pchMessageStart));
+        if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)) != 0) {
+            strError = "Snapshot is of a different network";
+            return false;
+        }
+        *pfile >> metadata.hashBase >> metadata.nHeight >> vBlocks;
+        if (metadata.nHeight < 0 || vBlocks.size() != (size_t)metadata.nHeight + 1) {
+            strError = "Snapshot block records do not match its height";
+            return false;
+        }
+        for (const CSnapshotBlockInfo& info : vBlocks) {
+            if (info.nTx == 0) {
+                strError = "Snapshot has a block record without transactions";
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to read %s: %s", path.string(), e.what());
+        return false;
+    }
+    return true;
+}
+
+bool CUTXOSnapshotReader::LoadCoins(CCoinsViewCache& view, size_t nMaxCacheUsage, std::string& strError)
+{
+    assert(pfile && !vBlocks.empty());
+    uint64_t nCoins = 0;
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+            uint256 txid;
+            *pfile >> txid;
+            if (txid.IsNull())
+                break;
+            uint64_t nOutputs = ReadCompactSize(*pfile);
+            if (nOutputs == 0) {
+                strError = "Snapshot has a transaction without outputs";
+                return false;
+            }
+            for (uint64_t i = 0; i < nOutputs; i++) {
+                uint32_t n;
+                Coin coin;
+                *pfile >> VARINT(n) >> coin;
+                totals.Add(coin.out);
+                view.AddCoin(COutPoint(txid, n), std::move(coin), false);
+            }
+            nCoins += nOutputs;
+            if (view.DynamicMemoryUsage() > nMaxCacheUsage && !view.Flush()) {
+                strError = "Failed to write coins to the database";
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        strError = strprintf("Failed to read %s: %s", path.string(), e.what());
+        return false;
+    }
+    if (nCoins != metadata.nCoins) {
+        strError = strprintf("Snapshot holds %u coins, not the %u it claims", nCoins, metadata.nCoins);
+        return false;
+    }
+    return true;
+}
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotMetadata& metadata, std::string& strError)
+{
+    if (boost::filesystem::exists(path)) {
+        strError = strprintf("%s already exists", path.string());
+        return false;
+    }
+
+    std::unique_ptr<CCoinsViewCursor> pcursor;
+    std::vector<CSnapshotBlockInfo> vBlocks;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+        // The cursor reads a database snapshot, so blocks connected while
+        // it is written out do not change it
+        pcursor.reset(pcoinsdbview->Cursor());
+        BlockMap::const_iterator it = mapBlockIndex.find(pcursor->GetBestBlock());
+        if (it == mapBlockIndex.end()) {
+            strError = "Best block of the UTXO set is not in the block index";
+            return false;
+        }
+        vBlocks.resize(it->second->nHeight + 1);
+        for (const CBlockIndex* pindex = it->second; pindex; pindex = pindex->pprev) {
+            CSnapshotBlockInfo& info = vBlocks[pindex->nHeight];
+            info.nTx = pindex->nTx;
+            info.fProofOfStake = pindex->IsProofOfStake();
+            info.nStakeModifier = pindex->nStakeModifier;
+            info.nMoneySupply = pindex->nMoneySupply;
+        }
+    }
+
+    boost::filesystem::path pathTmp(path.string() + ".incomplete");
+    if (!WriteUTXOSnapshot(pathTmp, pcursor.get(), vBlocks, metadata, strError)) {
+        boost::filesystem::remove(pathTmp);
+        return false;
+    }
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("Unable to rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+    LogPrintf("%s: wrote %u coins at height %d to %s\n", __func__, metadata.nCoins, metadata.nHeight, path.string());
+    return true;
+}
+
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CUTXOSnapshotMetadata& metadata, std::string& strError)
+{
+    // Hashing a large file takes a while; do it before taking cs_main
+    CUTXOSnapshotReader reader(path);
+    if (!reader.Open(hashExpected, strError))
+        return false;
+    metadata = reader.GetMetadata();
+
+    LOCK(cs_main);
+    if (!CanLoadUTXOSnapshot(strError))
+        return false;
+    BlockMap::iterator it = mapBlockIndex.find(metadata.hashBase);
+    if (it == mapBlockIndex.end()) {
+        strError = strprintf("Snapshot base block %s is not known yet; wait for the headers to sync", metadata.hashBase.GetHex());
+        return false;
+    }
+    CBlockIndex* pindexBase = it->second;
+    if (pindexBase->nHeight != metadata.nHeight) {
+        strError = strprintf("Snapshot base block is at height %d, not %d", pindexBase->nHeight, metadata.nHeight);
+        return false;
+    }
+    if (pindexBase->nStatus & BLOCK_FAILED_MASK) {
+        strError = "Snapshot base block is marked invalid";
+        return false;
+    }
+    // The modifiers are taken on trust from here on, so hold them to the checkpoints
+    if (fCheckpointsEnabled) {
+        const std::vector<CSnapshotBlockInfo>& vBlocks = reader.GetBlocks();
+        for (const MapStakeModifierCheckpoints::value_type& i : Params().Checkpoints().mapStakeModifiers) {
+            if (i.first <= pindexBase->nHeight && !Checkpoints::CheckStakeModifier(Params().Checkpoints(), i.first, vBlocks[i.first].nStakeModifier)) {
+                strError = strprintf("Snapshot stake modifier at height %d does not match its checkpoint", i.first);
+                return false;
+            }
+        }
+    }
+
+    LogPrintf("%s: loading %u coins at height %d from %s\n", __func__, metadata.nCoins, metadata.nHeight, path.string());
+    // Coins written before a failure leave the chainstate inconsistent with
+    // its best block; the flag makes startup refuse it until -reindex
+    if (!pblocktree->WriteFlag("utxosnapshotload", true)) {
+        strError = "Failed to write to the block index database";
+        return false;
+    }
+    if (!reader.LoadCoins(*pcoinsTip, nCoinCacheUsage, strError))
+        return false;
+    if (!ActivateUTXOSnapshot(pindexBase, reader.GetBlocks(), strError))
+        return false;
+    SetCoinsTipTotals(reader.GetTotals(), pindexBase->GetBlockHash());
+    return true;
+}
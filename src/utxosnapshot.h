@@ -0,0 +1,113 @@
+// Copyright (c) 2017 The JBCoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSNAPSHOT_H
+#define BITCOIN_UTXOSNAPSHOT_H
+
+#include "amount.h"
+#include "coins.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+class CAutoFile;
+
+/** Format version written by dumptxoutset */
+static const uint16_t UTXO_SNAPSHOT_VERSION = 1;
+
+/**
+ * The part of a block's index entry that headers alone do not give: a node
+ * loading a snapshot needs it for every block up to the snapshot base to
+ * compute stake modifiers and money supply of the blocks that follow.
+ */
+struct CSnapshotBlockInfo
+{
+    unsigned int nTx;
+    bool fProofOfStake;
+    uint256 nStakeModifier;
+    CAmount nMoneySupply;
+
+    CSnapshotBlockInfo() : nTx(0), fProofOfStake(false), nMoneySupply(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(VARINT(nTx));
+        READWRITE(fProofOfStake);
+        READWRITE(nStakeModifier);
+        READWRITE(nMoneySupply);
+    }
+};
+
+/** What a snapshot file describes, as reported by dumptxoutset and loadtxoutset */
+struct CUTXOSnapshotMetadata
+{
+    uint256 hashBase;
+    int nHeight;
+    uint64_t nCoins;
+    //! Double SHA256 of the file up to the hash itself, which ends it
+    uint256 hashSnapshot;
+
+    CUTXOSnapshotMetadata() : nHeight(-1), nCoins(0) {}
+};
+
+/**
+ * Write the coins of pcursor, whose best block is the chain entry of
+ * vBlocks.size() - 1, to path: a header naming the network and base block,
+ * vBlocks, the coins grouped by transaction, their count and a hash of all
+ * that. Does not need cs_main.
+ */
+bool WriteUTXOSnapshot(const boost::filesystem::path& path, CCoinsViewCursor* pcursor, const std::vector<CSnapshotBlockInfo>& vBlocks, CUTXOSnapshotMetadata& metadata, std::string& strError);
+
+/** Reads a file written by WriteUTXOSnapshot */
+class CUTXOSnapshotReader
+{
+public:
+    CUTXOSnapshotReader(const boost::filesystem::path& pathIn);
+    ~CUTXOSnapshotReader();
+
+    /**
+     * Check the hash of the whole file against the one that ends it and
+     * against hashExpected, then read its header and block records.
+     */
+    bool Open(const uint256& hashExpected, std::string& strError);
+
+    /**
+     * Add the coins of an opened snapshot to view, flushing it to its
+     * backing view whenever its memory usage passes nMaxCacheUsage.
+     */
+    bool LoadCoins(CCoinsViewCache& view, size_t nMaxCacheUsage, std::string& strError);
+
+    const CUTXOSnapshotMetadata& GetMetadata() const { return metadata; }
+    const std::vector<CSnapshotBlockInfo>& GetBlocks() const { return vBlocks; }
+    //! Totals of the coins LoadCoins added
+    const CCoinsTotals& GetTotals() const { return totals; }
+
+private:
+    boost::filesystem::path path;
+    std::unique_ptr<CAutoFile> pfile;
+    CUTXOSnapshotMetadata metadata;
+    std::vector<CSnapshotBlockInfo> vBlocks;
+    CCoinsTotals totals;
+};
+
+/** Flush the chainstate and write a snapshot of it to path, which must not exist yet */
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotMetadata& metadata, std::string& strError);
+
+/**
+ * Replace the empty chainstate of a pruned node with the snapshot at path,
+ * whose hash must be hashExpected, and make its base block the tip. The
+ * blocks before it are trusted, not validated, and are never downloaded.
+ */
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const uint256& hashExpected, CUTXOSnapshotMetadata& metadata, std::string& strError);
+
+#endif // BITCOIN_UTXOSNAPSHOT_H
@@ -5,15 +5,25 @@
 
 #include "validation.h"
 
+#include "addresssubscription.h"
 #include "arith_uint256.h"
+#include "blockfilemap.h"
+#include "blockfilter.h"
 #include "chainparams.h"
+#include "chainsnapshot.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
+#include "crypto/scrypt.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "hash.h"
+#include "headerscache.h"
 #include "init.h"
+#include "memusage.h"
 #include "policy/fees.h"
 #include "policy/policy.h"
 #include "pow.h"
@@ -22,18 +32,24 @@
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "random.h"
+#include "replication.h"
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
+#include "threadplacement.h"
 #include "timedata.h"
 #include "tinyformat.h"
+#include "trace.h"
+#include "txcache.h"
 #include "txdb.h"
+#include "txintern.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utilstrencodings.h"
+#include "utxosnapshot.h"
 #include "validationinterface.h"
 #include "versionbits.h"
 #include "warnings.h"
@@ -59,6 +75,13 @@
 
 CCriticalSection cs_main;
 
+/**
+ * Guards the structure of mapBlockIndex for LookupBlockIndex, which does not
+ * hold cs_main: code adding or removing entries holds it exclusively as
+ * well as cs_main, so readers holding cs_main need not take it.
+ */
+static boost::shared_mutex csBlockIndexMap;
+
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
@@ -70,14 +93,17 @@ std::atomic_bool fImporting(false);
 bool fTimestampIndex = false;
 bool fAddressIndex = false;
 bool fSpentIndex = false;
+bool fBlockFilterIndex = DEFAULT_BLOCKFILTERINDEX;
 
 bool fReindex = false;
 bool fTxIndex = false;
+bool fCompactTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+bool fCompactUndo = DEFAULT_COMPACT_UNDO;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -134,6 +160,12 @@ namespace {
      * Pruned nodes may have entries where B is missing data.
      */
     std::multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+    /**
+     * The entries of mapBlockIndex no other entry builds on, kept up to date as
+     * blocks are added, each with the block its branch last forked from
+     * chainActive at, or NULL until GetChainTips has looked for it.
+     */
+    std::map<const CBlockIndex*, const CBlockIndex*> mapBlockIndexLeaves;
 
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
@@ -161,6 +193,13 @@ namespace {
 
     /** Dirty block file entries. */
     std::set<int> setDirtyFileInfo;
+
+    /**
+     * The best block of the explorer indexes when they were found ahead of the
+     * chainstate at startup. Its ancestors are already counted in the address
+     * balances, so they are not counted again while they are reconnected.
+     */
+    const CBlockIndex* pindexIndexedAhead = NULL;
 } // anon namespace
 
 /* Use this class to start tracking transactions that are removed from the
@@ -190,12 +229,45 @@ public:
     ~MemPoolConflictRemovalTracker() {
         pool.NotifyEntryRemoved.disconnect(boost::bind(&MemPoolConflictRemovalTracker::NotifyEntryRemoved, this, _1, _2));
         for (const auto& tx : conflictedTxs) {
-            GetMainSignals().SyncTransaction(*tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+            GetMainSignals().SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
         }
         conflictedTxs.clear();
     }
 };
 
+CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    boost::shared_lock<boost::shared_mutex> lock(csBlockIndexMap);
+    BlockMap::const_iterator it = mapBlockIndex.find(hash);
+    return it == mapBlockIndex.end() ? NULL : it->second;
+}
+
+size_t GetBlockIndexMemoryUsage()
+{
+    AssertLockHeld(cs_main);
+    // The entries have no allocations of their own
+    size_t nUsage = memusage::DynamicUsage(mapBlockIndex) + mapBlockIndex.size() * memusage::MallocUsage(sizeof(CBlockIndex));
+    nUsage += memusage::MallocUsage(sizeof(CBlockIndex*) * (chainActive.Height() + 1));
+    nUsage += memusage::DynamicUsage(setBlockIndexCandidates) + memusage::DynamicUsage(mapBlockIndexLeaves) +
+              memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<CBlockIndex* const, CBlockIndex*> >)) * mapBlocksUnlinked.size();
+    return nUsage;
+}
+
+const CBlockIndex* FindForkInSnapshot(const CChainSnapshot& chain, const CBlockLocator& locator)
+{
+    // Find the first block the caller has in the snapshot's chain
+    for (const uint256& hash : locator.vHave) {
+        const CBlockIndex* pindex = LookupBlockIndex(hash);
+        if (pindex) {
+            if (chain.Contains(pindex))
+                return pindex;
+            if (pindex->GetAncestor(chain.Height()) == chain.Tip())
+                return chain.Tip();
+        }
+    }
+    return chain[0];
+}
+
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
 {
     // Find the first block the caller has in the main chain
@@ -215,7 +287,14 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewPrefetch *pcoinsprefetch = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CIndexesDB *pindexesdb = NULL;
+
+/** Totals of the UTXO set at chainActive.Tip(), when fCoinsTipTotals (protected by cs_main) */
+static CCoinsTotals coinsTipTotals;
+static bool fCoinsTipTotals = false;
 
 enum FlushStateMode {
     FLUSH_STATE_NONE,
@@ -403,15 +482,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -447,16 +526,8 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
 
 unsigned int GetLegacySigOpCount(const CTransaction& tx)
 {
-    unsigned int nSigOps = 0;
-    for (const auto& txin : tx.vin)
-    {
-        nSigOps += txin.scriptSig.GetSigOpCount(false);
-    }
-    for (const auto& txout : tx.vout)
-    {
-        nSigOps += txout.scriptPubKey.GetSigOpCount(false);
-    }
-    return nSigOps;
+    // Counted once, when the transaction was constructed
+    return tx.GetLegacySigOpCount();
 }
 
 unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& inputs)
@@ -467,7 +538,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     unsigned int nSigOps = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         if (prevout.scriptPubKey.IsPayToScriptHash())
             nSigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
     }
@@ -487,7 +558,7 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         nSigOps += CountWitnessSigOps(tx.vin[i].scriptSig, prevout.scriptPubKey, &tx.vin[i].scriptWitness, flags);
     }
     return nSigOps;
@@ -552,9 +623,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -579,9 +650,51 @@ static bool IsCurrentForFeeEstimation()
     return true;
 }
 
+static bool CheckInputsParallel(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs,
+                                unsigned int flags, PrecomputedTransactionData& txdata);
+
+/** The script verification flags of the block at pindex */
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams)
+{
+    AssertLockHeld(cs_main);
+
+    // BIP16 didn't become active until Oct 1 2012
+    int64_t nBIP16SwitchTime = 1349049600;
+    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rule
+    if (pindex->nHeight >= consensusparams.BIP66Height) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
+    if (pindex->nHeight >= consensusparams.BIP65Height) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindex->pprev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindex->pprev, consensusparams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+        flags |= SCRIPT_VERIFY_NULLDUMMY;
+    }
+
+    return flags;
+}
+
+// With fParallelScripts, the input scripts are checked on the script check
+// threads. With pvAccepted, the transaction is appended to it once accepted
+// instead of being passed to SyncTransaction right away.
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool fOverrideMempoolLimit, const CAmount& nAbsurdFee, std::vector<uint256>& vHashTxnToUncache)
+                              bool fOverrideMempoolLimit, const CAmount& nAbsurdFee, std::vector<COutPoint>& vCoinsToUncache,
+                              bool fParallelScripts = false, std::vector<CTransactionRef>* pvAccepted = NULL)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -666,31 +779,40 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     }
 
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
+        // Coins looked up for earlier transactions are still there, so only
+        // the new ones are fetched and copied
+        CCoinsViewMemPoolOverlay& view = pool.GetCoinsOverlay(pcoinsTip->GetBestBlock());
 
         CAmount nValueIn = 0;
         LockPoints lp;
         {
         LOCK(pool.cs);
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
-        view.SetBackend(viewMemPool);
+        view.Attach(viewMemPool);
 
         // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            COutPoint outpoint(hash, out);
+            bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(outpoint);
+            if (view.HaveCoin(outpoint)) {
+                if (!fHadCoinInCache)
+                    vCoinsToUncache.push_back(outpoint);
+                return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+            }
         }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                vCoinsToUncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return state.Invalid(false, REJECT_DUPLICATE, "txn-already-known");
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
@@ -701,13 +823,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         if (!view.HaveInputs(tx))
             return state.Invalid(false, REJECT_DUPLICATE, "bad-txns-inputs-spent");
 
-        // Bring the best block into scope
-        view.GetBestBlock();
-
         nValueIn = view.GetValueIn(tx);
 
-        // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-        view.SetBackend(dummy);
+        // we have all inputs cached now, so detach the mempool, so we don't need to keep lock on mempool
+        view.Detach();
 
         // Only accept BIP68 sequence locked transactions that can be mined in the next
         // block; we don't want our mempool filled up with transactions that can't
@@ -742,8 +861,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -961,13 +1080,14 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (fParallelScripts ? !CheckInputsParallel(tx, state, view, scriptVerifyFlags, txdata) :
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
             CValidationState stateDummy; // Want reported failures to be from first CheckInputs
-            if (!tx.HasWitness() && CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
-                !CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+            if (!tx.HasWitness() && CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+                !CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
                 // Only the witness is missing, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
@@ -983,12 +1103,22 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false, txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
+        // Check once more with the flags of the next block, to store the
+        // result in the script execution cache for when it is connected. The
+        // signatures are in the signature cache by now, so this is cheap.
+        unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, currentBlockScriptVerifyFlags, true, true, txdata))
+        {
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against latest-block but not STANDARD flags %s, %s",
+                __func__, hash.ToString(), FormatStateMessage(state));
+        }
+
         // Remove conflicting transactions from the mempool
         BOOST_FOREACH(const CTxMemPool::txiter it, allConflicting)
         {
@@ -1010,6 +1140,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
+        TRACE3(mempool, added, hash.begin(), nSize, nFees);
         // Add memory address index
         if (fAddressIndex) {
             pool.addAddressIndex(entry, view);
@@ -1028,7 +1159,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         }
     }
 
-    GetMainSignals().SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    if (pvAccepted)
+        pvAccepted->push_back(ptx);
+    else
+        GetMainSignals().SyncTransaction(ptx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
 
     return true;
 }
@@ -1037,11 +1171,12 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const
                         bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
                         bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee, vCoinsToUncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        TRACE2(mempool, rejected, tx->GetHash().begin(), state.GetRejectReason().c_str());
+        BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
     }
     // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
     CValidationState stateDummy;
@@ -1056,12 +1191,101 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee);
 }
 
-bool GetTimestampIndex(const unsigned int& high, const unsigned int& low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& hashes)
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, std::vector<CValidationState>& vState,
+                                     std::vector<bool>& vfMissingInputs, bool fLimitFree, const CAmount nAbsurdFee)
+{
+    LOCK(cs_main);
+    vState.assign(vtx.size(), CValidationState());
+    vfMissingInputs.assign(vtx.size(), false);
+
+    int64_t nAcceptTime = GetTime();
+    std::vector<CTransactionRef> vAccepted;
+    for (size_t i = 0; i < vtx.size(); i++) {
+        std::vector<COutPoint> vCoinsToUncache;
+        bool fMissingInputs = false;
+        // The mempool is trimmed once for the whole batch below
+        if (!AcceptToMemoryPoolWorker(pool, vState[i], vtx[i], fLimitFree, &fMissingInputs, nAcceptTime, NULL,
+                                      true, nAbsurdFee, vCoinsToUncache, true, &vAccepted)) {
+            TRACE2(mempool, rejected, vtx[i]->GetHash().begin(), vState[i].GetRejectReason().c_str());
+            BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+                pcoinsTip->Uncache(outpoint);
+        }
+        vfMissingInputs[i] = fMissingInputs;
+    }
+
+    LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    unsigned int nAccepted = 0;
+    for (size_t i = 0; i < vtx.size(); i++) {
+        if (!vState[i].IsValid())
+            continue;
+        if (!pool.exists(vtx[i]->GetHash())) {
+            vState[i].DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+            continue;
+        }
+        nAccepted++;
+    }
+    for (const CTransactionRef& tx : vAccepted) {
+        if (pool.exists(tx->GetHash()))
+            GetMainSignals().SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    }
+
+    CValidationState stateDummy;
+    FlushStateToDisk(stateDummy, FLUSH_STATE_PERIODIC);
+    return nAccepted;
+}
+
+void CChainTimestampIndex::Sync(const CChain& chain)
+{
+    while (!vBlocks.empty() && !chain.Contains(vBlocks.back().first))
+        vBlocks.pop_back();
+
+    // The genesis block is never connected, so it has no logical timestamp
+    vBlocks.reserve(std::max(chain.Height(), 0));
+    for (int nHeight = vBlocks.size() + 1; nHeight <= chain.Height(); nHeight++) {
+        // Same rule ConnectBlock applies when writing the timestamp index
+        const CBlockIndex* pindex = chain[nHeight];
+        unsigned int nLogicalTime = pindex->nTime;
+        if (!vBlocks.empty() && nLogicalTime <= vBlocks.back().second)
+            nLogicalTime = vBlocks.back().second + 1;
+        vBlocks.push_back(std::make_pair(pindex, nLogicalTime));
+    }
+}
+
+static bool TimestampBefore(const std::pair<const CBlockIndex*, unsigned int>& entry, unsigned int nTime)
+{
+    return entry.second < nTime;
+}
+
+void CChainTimestampIndex::Find(unsigned int high, unsigned int low, std::vector<std::pair<uint256, unsigned int> >& hashes,
+                                size_t nLimit, const CTimestampIndexKey* pkeyAfter) const
+{
+    // No two blocks of a chain share a logical timestamp, so a cursor only needs its own
+    if (pkeyAfter && pkeyAfter->timestamp >= low)
+        low = pkeyAfter->timestamp + 1;
+    if (pkeyAfter && low == 0)
+        return;
+    std::vector<std::pair<const CBlockIndex*, unsigned int> >::const_iterator it = std::lower_bound(vBlocks.begin(), vBlocks.end(), low, TimestampBefore);
+    size_t nFound = 0;
+    for (; it != vBlocks.end() && it->second < high && (nLimit == 0 || nFound++ < nLimit); it++)
+        hashes.push_back(std::make_pair(it->first->GetBlockHash(), it->second));
+}
+
+static CChainTimestampIndex chainTimestampIndex;
+
+bool GetTimestampIndex(const unsigned int& high, const unsigned int& low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& hashes,
+                       size_t nLimit, const CTimestampIndexKey* pkeyAfter)
 {
     if (!fTimestampIndex)
         return error("Timestamp index not enabled");
 
-    if (!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes))
+    if (fActiveOnly) {
+        LOCK(cs_main);
+        chainTimestampIndex.Sync(chainActive);
+        chainTimestampIndex.Find(high, low, hashes, nLimit, pkeyAfter);
+        return true;
+    }
+
+    if (!pindexesdb->ReadTimestampIndex(high, low, fActiveOnly, hashes, nLimit, pkeyAfter))
         return error("Unable to get hashes for timestamps");
 
     return true;
@@ -1075,8 +1299,37 @@ bool GetSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value)
     if (mempool.getSpentIndex(key, value))
         return true;
 
-    if (!pblocktree->ReadSpentIndex(key, value))
+    if (!pindexesdb->ReadSpentIndex(key, value))
+        return false;
+
+    return true;
+}
+
+bool GetSpentIndexes(const std::vector<CSpentIndexKey>& keys, std::vector<CSpentIndexValue>& values)
+{
+    if (!fSpentIndex)
+        return false;
+
+    values.assign(keys.size(), CSpentIndexValue());
+    mempool.getSpentIndexes(keys, values);
+
+    // Whatever the mempool does not spend is looked up on disk
+    std::vector<CSpentIndexKey> vDiskKeys;
+    std::vector<size_t> vDiskPos;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (values[i].IsNull()) {
+            vDiskKeys.push_back(keys[i]);
+            vDiskPos.push_back(i);
+        }
+    }
+    if (vDiskKeys.empty())
+        return true;
+
+    std::vector<CSpentIndexValue> vDiskValues;
+    if (!pindexesdb->ReadSpentIndexes(vDiskKeys, vDiskValues))
         return false;
+    for (size_t i = 0; i < vDiskPos.size(); i++)
+        values[vDiskPos[i]] = vDiskValues[i];
 
     return true;
 }
@@ -1086,22 +1339,89 @@ bool GetAddressIndex(uint160 addressHash, int type, std::vector<std::pair<CAddre
     if (!fAddressIndex)
         return error("[%s:%d] address index not enabled",__FILE__,__LINE__);
 
-    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+    if (!pindexesdb->ReadAddressIndex(addressHash, type, addressIndex, start, end))
         return error("unable to get txids for address");
 
     return true;
 }
 
-bool GetAddressUnspent(uint160 addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+bool ScanAddressIndex(const std::vector<std::pair<uint160, int> >& addresses, int start, int end,
+                      const CAddressIndexKey* pkeyAfter, boost::function<bool(const CAddressIndexKey&, CAmount)> fn)
 {
     if (!fAddressIndex)
         return error("[%s:%d] address index not enabled",__FILE__,__LINE__);
 
-    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+    if (!pindexesdb->ScanAddressIndex(addresses, start, end, pkeyAfter, fn, (int)GetArg("-addressindexthreads", DEFAULT_ADDRESSINDEX_THREADS)))
         return error("unable to get txids for address");
 
     return true;
 }
+
+bool GetAddressUnspent(uint160 addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("[%s:%d] address index not enabled",__FILE__,__LINE__);
+
+    if (!pindexesdb->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+        return error("unable to get unspent outputs for address");
+
+    return true;
+}
+
+bool GetAddressUnspent(const std::vector<std::pair<uint160, int> >& addresses, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("[%s:%d] address index not enabled",__FILE__,__LINE__);
+
+    if (!pindexesdb->ReadAddressUnspentIndex(addresses, unspentOutputs, (int)GetArg("-addressindexthreads", DEFAULT_ADDRESSINDEX_THREADS)))
+        return error("unable to get unspent outputs for address");
+
+    return true;
+}
+
+bool GetAddressBalances(const std::vector<std::pair<uint160, int> >& addresses, std::vector<CAddressBalance>& balances)
+{
+    if (!fAddressIndex)
+        return error("[%s:%d] address index not enabled",__FILE__,__LINE__);
+
+    if (!pindexesdb->ReadAddressBalances(addresses, balances, (int)GetArg("-addressindexthreads", DEFAULT_ADDRESSINDEX_THREADS)))
+        return error("unable to get balance for address");
+
+    return true;
+}
+static bool ReadTransactionFromDisk(const CDiskTxPos& postx, CTransactionRef& txOut, uint256& hashBlock);
+
+/**
+ * Look hash up in the transaction index and read it from disk. The compact
+ * index only narrows it down to the transactions sharing the first 8 bytes
+ * of the txid, at positions relative to the active chain, so the one asked
+ * for is the candidate that reads back with this hash.
+ */
+static bool ReadIndexedTransaction(CBlockTreeDB& txdb, const uint256& hash, CDiskTxPos& postx, CTransactionRef& txOut, uint256& hashBlock)
+{
+    if (!fCompactTxIndex) {
+        if (!txdb.ReadTxIndex(hash, postx) || !ReadTransactionFromDisk(postx, txOut, hashBlock))
+            return false;
+        if (txOut->GetHash() != hash)
+            return error("%s: txid mismatch", __func__);
+        return true;
+    }
+
+    AssertLockHeld(cs_main);
+    std::vector<CBlockTxPos> vPos;
+    if (!txdb.ReadCompactTxIndex(hash, vPos))
+        return false;
+    for (const CBlockTxPos& pos : vPos) {
+        const CBlockIndex* pindex = chainActive[pos.nHeight];
+        if (!pindex || !(pindex->nStatus & BLOCK_HAVE_DATA))
+            continue;
+        postx = CDiskTxPos(pindex->GetBlockPos(), pos.nTxOffset);
+        if (ReadTransactionFromDisk(postx, txOut, hashBlock) && txOut->GetHash() == hash)
+            return true;
+    }
+    return false;
+}
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1116,37 +1436,21 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
         return true;
     }
 
+    if (txCache.Get(hash, txOut, hashBlock))
+        return true;
+
     if (fTxIndex) {
         CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-            }
-            hashBlock = header.GetHash();
-            if (txOut->GetHash() != hash)
-                return error("%s: txid mismatch", __func__);
+        if (ReadIndexedTransaction(*pblocktree, hash, postx, txOut, hashBlock)) {
+            txCache.Put(txOut, hashBlock);
             return true;
         }
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-        int nHeight = -1;
-        {
-            const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
-        }
-        if (nHeight > 0)
-            pindexSlow = chainActive[nHeight];
+        const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+        if (!coin.IsSpent() && coin.nHeight > 0)
+            pindexSlow = chainActive[coin.nHeight];
     }
 
     if (pindexSlow) {
@@ -1156,6 +1460,7 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
                 if (tx->GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
+                    txCache.Put(txOut, hashBlock);
                     return true;
                 }
             }
@@ -1175,6 +1480,53 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
 // CBlock and CBlockIndex
 //
 
+/**
+ * Background writeback of the blk or rev file being appended to. Without
+ * it every byte written since the last flush is still dirty when
+ * FlushBlockFile syncs, and the block file, undo file and block index
+ * syncs of that flush stall for all of it. During initial block download
+ * the cached pages of data already written back and not about to be read
+ * are dropped too, so the sequential stream of new blocks does not evict
+ * the coins database from the page cache.
+ */
+class CFileWriteback
+{
+private:
+    int nFile;
+    unsigned int nStarted; //!< writeback started below this offset
+    unsigned int nDropped; //!< cached pages dropped below this offset
+
+public:
+    CFileWriteback() : nFile(-1), nStarted(0), nDropped(0) {}
+
+    /**
+     * Record that [nBegin, nEnd) of file nFileIn was just written. Pages
+     * are dropped only below nDropLimit and when fDropCache is set.
+     */
+    void Written(FILE* file, int nFileIn, unsigned int nBegin, unsigned int nEnd, unsigned int nDropLimit, bool fDropCache)
+    {
+        if (nFileIn != nFile) {
+            // Earlier data of the file is left to the next flush
+            nFile = nFileIn;
+            nStarted = nDropped = nBegin;
+        }
+        if (nEnd < nStarted + FILE_WRITEBACK_SIZE)
+            return;
+        // The previous range had a whole window of writes to complete
+        unsigned int nDropEnd = std::min(nStarted, nDropLimit);
+        FileStartWriteback(file, nStarted, nEnd - nStarted);
+        nStarted = nEnd;
+        if (fDropCache && nDropEnd > nDropped) {
+            FileDropCache(file, nDropped, nDropEnd - nDropped);
+            nDropped = nDropEnd;
+        }
+    }
+};
+
+//! Protected by cs_main
+static CFileWriteback blockWriteback;
+static CFileWriteback undoWriteback;
+
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
@@ -1193,6 +1545,45 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     pos.nPos = (unsigned int)fileOutPos;
     fileout << block;
 
+    // Blocks stored before the tip's block were connected and are rarely read again
+    LOCK(cs_main);
+    unsigned int nDropLimit = 0;
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip && (pindexTip->nStatus & BLOCK_HAVE_DATA) && pindexTip->nFile == pos.nFile)
+        nDropLimit = pindexTip->nDataPos;
+    blockWriteback.Written(fileout.Get(), pos.nFile, pos.nPos - CMessageHeader::MESSAGE_START_SIZE - sizeof(nSize), pos.nPos + nSize, nDropLimit, IsInitialBlockDownload());
+
+    return true;
+}
+
+/**
+ * Deserialize the block at pos from a memory mapping of its file, using the
+ * size field WriteBlockToDisk stores in front of it. Returns false if the
+ * file cannot be mapped, so the caller reads it the ordinary way.
+ */
+static CBlockFileMap::MappingRef MapBlock(const CDiskBlockPos& pos, uint32_t& nSizeRet)
+{
+    if (pos.nPos < sizeof(uint32_t))
+        return CBlockFileMap::MappingRef();
+    CBlockFileMap::MappingRef mapping = blockFileMap.Get(pos.nFile, pos.nPos);
+    if (!mapping)
+        return mapping;
+    nSizeRet = ReadLE32(mapping->data() + pos.nPos - sizeof(uint32_t));
+    if (nSizeRet > MAX_BLOCK_SERIALIZED_SIZE)
+        return CBlockFileMap::MappingRef();
+    if ((size_t)pos.nPos + nSizeRet > mapping->size())
+        mapping = blockFileMap.Get(pos.nFile, (size_t)pos.nPos + nSizeRet);
+    return mapping;
+}
+
+static bool ReadBlockFromMappedFile(CBlock& block, const CDiskBlockPos& pos)
+{
+    uint32_t nSize;
+    CBlockFileMap::MappingRef mapping = MapBlock(pos, nSize);
+    if (!mapping)
+        return false;
+    CSpanReader reader(SER_DISK, CLIENT_VERSION, mapping->data() + pos.nPos, nSize);
+    WithArena(&reader) >> block;
     return true;
 }
 
@@ -1200,6 +1591,15 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 {
     block.SetNull();
 
+    try {
+        if (ReadBlockFromMappedFile(block, pos))
+            return true;
+    }
+    catch (const std::exception&) {
+        // A size field that does not match the block; the file read below decides
+        block.SetNull();
+    }
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1207,7 +1607,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 
     // Read block
     try {
-        filein >> block;
+        WithArena(&filein) >> block;
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1232,15 +1632,105 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+/**
+ * Read the transaction at postx and the hash of the block holding it: the
+ * header is read, the preceding transactions skipped using the offset the
+ * txindex stores, and only this transaction deserialized.
+ */
+static bool ReadTransactionFromDisk(const CDiskTxPos& postx, CTransactionRef& txOut, uint256& hashBlock)
+{
+    CBlockHeader header;
+    try {
+        uint32_t nSize;
+        CBlockFileMap::MappingRef mapping = MapBlock(postx, nSize);
+        if (mapping) {
+            CSpanReader reader(SER_DISK, CLIENT_VERSION, mapping->data() + postx.nPos, nSize);
+            reader >> header;
+            reader.ignore(postx.nTxOffset);
+            reader >> txOut;
+            hashBlock = header.GetHash();
+            return true;
+        }
+    }
+    catch (const std::exception&) {
+        // A size field that does not match the block; the file read below decides
+    }
+
+    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: OpenBlockFile failed", __func__);
+    try {
+        file >> header;
+        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+        file >> txOut;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    hashBlock = header.GetHash();
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    vchBlock.clear();
+    static const unsigned int nHeaderSize = CMessageHeader::MESSAGE_START_SIZE + sizeof(uint32_t);
+    if (pos.nPos < nHeaderSize)
+        return error("%s: no block header before %s", __func__, pos.ToString());
+
+    uint32_t nSize;
+    CBlockFileMap::MappingRef mapping = MapBlock(pos, nSize);
+    if (mapping && memcmp(mapping->data() + pos.nPos - nHeaderSize, messageStart, CMessageHeader::MESSAGE_START_SIZE) == 0) {
+        vchBlock.assign(mapping->data() + pos.nPos, mapping->data() + pos.nPos + nSize);
+        return true;
+    }
+
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - nHeaderSize), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        filein >> FLATDATA(blkStart) >> nSize;
+        if (memcmp(blkStart, messageStart, CMessageHeader::MESSAGE_START_SIZE))
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SERIALIZED_SIZE)
+            return error("%s: block size %u too large at %s", __func__, nSize, pos.ToString());
+        vchBlock.resize(nSize);
+        filein.read((char*)vchBlock.data(), nSize);
+    }
+    catch (const std::exception& e) {
+        vchBlock.clear();
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    if (!ReadRawBlockFromDisk(vchBlock, pindex->GetBlockPos(), messageStart))
+        return false;
+    // The header leads the block; hashing it is all the checking the bytes get
+    if (vchBlock.size() < 80 || Hash(vchBlock.begin(), vchBlock.begin() + 80) != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk(CBlockIndex*): header hash doesn't match index for %s at %s",
+                pindex->ToString(), pindex->GetBlockPos().ToString());
+    return true;
+}
+
+bool IsRawBlockSerialization(const CBlockIndex* pindex, int nSerializeFlags, const Consensus::Params& params)
+{
+    return !(nSerializeFlags & SERIALIZE_TRANSACTION_NO_WITNESS) || !IsWitnessEnabled(pindex->pprev, params);
+}
+
 bool ReadFromDisk(CMutableTransaction& tx, CDiskTxPos& txindex, CBlockTreeDB& txdb, COutPoint prevout)
 {
-    if (!txdb.ReadTxIndex(prevout.hash, txindex)){
+    CTransactionRef ptx;
+    uint256 hashBlock;
+    if (!ReadIndexedTransaction(txdb, prevout.hash, txindex, ptx, hashBlock)) {
     	LogPrintf("no tx index %s \n", prevout.hash.ToString());
     	return false;
     }
-    
-    if (!ReadFromDisk(tx, txindex))
-        return false;
+    tx = CMutableTransaction(*ptx);
     if (prevout.n >= tx.vout.size())
     {
         return false;
@@ -1456,26 +1946,14 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.fCoinStake = coins->fCoinStake;
-                undo.nVersion = coins->nVersion;
-                undo.nTime = coins->nTime;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1485,6 +1963,15 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
 }
 
 bool CScriptCheck::operator()() {
+    if (blockcheck.size())
+        return blockcheck();
+    if (!ptxTo) {
+        if (!pubkeyBlock.Verify(hashBlock, vchBlockSig)) {
+            error = SCRIPT_ERR_EVAL_FALSE;
+            return false;
+        }
+        return true;
+    }
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     const CScriptWitness *witness = &ptxTo->vin[nIn].scriptWitness;
     if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata), &error)) {
@@ -1513,24 +2000,24 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         const COutPoint &prevout = tx.vin[i].prevout;
-        const CCoins *coins = inputs.AccessCoins(prevout.hash);
-        assert(coins);
+        const Coin& coin = inputs.AccessCoin(prevout);
+        assert(!coin.IsSpent());
 
         // If prev is coinbase, check that it's matured
-        if (coins->IsCoinBase() || coins->IsCoinStake()) {
-            if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+        if (coin.IsCoinBase() || coin.IsCoinStake()) {
+            if (nSpendHeight - coin.nHeight < COINBASE_MATURITY)
                 return state.Invalid(false,
                     REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                    strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                    strprintf("tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight));
         }
         // Check transaction timestamp
-        if (coins->nTime > tx.nTime) { 
+        if (coin.nTime > tx.nTime) { 
             return state.DoS(100, error("CheckInputs() : transaction timestamp earlier than input transaction"),
                         REJECT_INVALID, "bad-txns-time-earlier-than-input");
         }
         // Check for negative or overflow input values
-        nValueIn += coins->vout[prevout.n].nValue;
-        if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+        nValueIn += coin.out.nValue;
+        if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
             return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
     }
@@ -1551,8 +2038,30 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
+/**
+ * Transactions whose scripts all passed, keyed by SHA256(nonce || wtxid || flags).
+ * AcceptToMemoryPool fills it with the flags of the next block, so ConnectBlock
+ * need not run the scripts of transactions it has seen in the mempool.
+ * Guarded by cs_main, as CheckInputs is always called with it held.
+ */
+static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce(GetRandHash());
+
+void InitScriptExecutionCache() {
+    // Half of -maxsigcachesize, the signature cache takes the other half
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %zu elements\n",
+              (nElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, nElems);
+}
+
+size_t GetScriptExecutionCacheMemoryUsage()
+{
+    return scriptExecutionCache.memory_usage();
+}
+
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, 
-    bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
+    bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -1573,13 +2082,22 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // Of course, if an assumed valid block is invalid due to false scriptSigs
         // this optimization would allow an invalid chain to be accepted.
         if (fScriptChecks) {
+            // The entry commits to the transaction but not to the coins it
+            // spends, which the prevouts fix for all but the coins of
+            // duplicate transactions, long unspendable
+            uint256 hashCacheEntry;
+            CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            AssertLockHeld(cs_main);
+            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheSigStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1591,8 +2109,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                        CScriptCheck check2(coin.out, tx, i,
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1606,6 +2124,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Only scripts run here are known to have passed
+            if (cacheFullScriptStore && !pvChecks)
+                scriptExecutionCache.insert(hashCacheEntry);
         }
     }
 
@@ -1614,15 +2136,32 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
 
 namespace {
 
-bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
-{
+/** Number of blocks whose undo data a reorg reads at once */
+static const size_t MAX_DISCONNECT_UNDO_BATCH = 32;
+
+//! Network magic and record size in front of each rev?????.dat record
+static const unsigned int UNDO_HEADER_SIZE = CMessageHeader::MESSAGE_START_SIZE + sizeof(uint32_t);
+
+/** Serialize undo data as stored in rev?????.dat, in the compact format if fCompact */
+void EncodeBlockUndo(CBlockUndo& blockundo, bool fCompact, std::vector<unsigned char>& vchUndo)
+{
+    vchUndo.clear();
+    CVectorWriter writer(SER_DISK, CLIENT_VERSION, vchUndo, 0);
+    if (fCompact)
+        writer << CompactBlockUndo(blockundo);
+    else
+        writer << blockundo;
+}
+
+bool UndoWriteToDisk(const std::vector<unsigned char>& vchUndo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
+{
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("%s: OpenUndoFile failed", __func__);
 
     // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, blockundo);
+    unsigned int nSize = vchUndo.size();
     fileout << FLATDATA(messageStart) << nSize;
 
     // Write undo data
@@ -1630,41 +2169,121 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     if (fileOutPos < 0)
         return error("%s: ftell failed", __func__);
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << blockundo;
+    fileout.write((const char*)vchUndo.data(), vchUndo.size());
 
-    // calculate & write checksum
+    // calculate & write checksum; for the legacy format this is the hash of
+    // the block hash and the serialized CBlockUndo, as it always was
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
-    hasher << blockundo;
+    hasher.write((const char*)vchUndo.data(), vchUndo.size());
     fileout << hasher.GetHash();
 
+    // Undo data is only read again on reorgs
+    LOCK(cs_main);
+    undoWriteback.Written(fileout.Get(), pos.nFile, pos.nPos - UNDO_HEADER_SIZE, pos.nPos + nSize + 32, std::numeric_limits<unsigned int>::max(), IsInitialBlockDownload());
+
     return true;
 }
 
-bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
+/** Read the undo record whose header filein is positioned at */
+bool ReadUndoRecord(CAutoFile& filein, std::vector<unsigned char>& vchUndo, uint256& hashChecksum)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
-
-    // Read block
-    uint256 hashChecksum;
     try {
-        filein >> blockundo;
+        CMessageHeader::MessageStartChars messageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(messageStart) >> nSize;
+        if (memcmp(messageStart, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE) != 0)
+            return error("%s: Invalid undo record header", __func__);
+        if (nSize > MAX_SIZE)
+            return error("%s: Undo record too large", __func__);
+        vchUndo.resize(nSize);
+        filein.read((char*)vchUndo.data(), nSize);
         filein >> hashChecksum;
     }
     catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        return error("%s: I/O error - %s", __func__, e.what());
     }
+    return true;
+}
 
+/** Verify and parse undo data of either format */
+bool DecodeBlockUndo(CBlockUndo& blockundo, const std::vector<unsigned char>& vchUndo, const uint256& hashChecksum, const uint256& hashBlock)
+{
     // Verify checksum
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
-    hasher << blockundo;
+    hasher.write((const char*)vchUndo.data(), vchUndo.size());
     if (hashChecksum != hasher.GetHash()){
         return error("%s: Checksum mismatch", __func__);
     }
+
+    try {
+        CSpanReader reader(SER_DISK, CLIENT_VERSION, vchUndo.data(), vchUndo.size());
+        if (!vchUndo.empty() && vchUndo[0] == UNDO_COMPACT_MARKER)
+            reader >> REF(CompactBlockUndo(blockundo));
+        else
+            reader >> blockundo;
+        if (!reader.empty())
+            return error("%s: Trailing bytes after undo data", __func__);
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    if (pos.nPos < UNDO_HEADER_SIZE)
+        return error("%s: Invalid undo position", __func__);
+
+    // Open history file to read
+    CAutoFile filein(OpenUndoFile(CDiskBlockPos(pos.nFile, pos.nPos - UNDO_HEADER_SIZE), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenUndoFile failed", __func__);
+
+    std::vector<unsigned char> vchUndo;
+    uint256 hashChecksum;
+    if (!ReadUndoRecord(filein, vchUndo, hashChecksum))
+        return false;
+    return DecodeBlockUndo(blockundo, vchUndo, hashChecksum, hashBlock);
+}
+
+/**
+ * Read the undo data of several blocks, visiting the records in file order
+ * and opening each rev file once. vblockundo[i] belongs to vpindex[i].
+ */
+bool UndoReadFromDisk(std::vector<CBlockUndo>& vblockundo, const std::vector<const CBlockIndex*>& vpindex)
+{
+    vblockundo.assign(vpindex.size(), CBlockUndo());
+    std::vector<size_t> vOrder;
+    vOrder.reserve(vpindex.size());
+    for (size_t i = 0; i < vpindex.size(); i++) {
+        CDiskBlockPos pos = vpindex[i]->GetUndoPos();
+        if (pos.IsNull() || pos.nPos < UNDO_HEADER_SIZE || !vpindex[i]->pprev)
+            return error("%s: no undo data available for %s", __func__, vpindex[i]->GetBlockHash().ToString());
+        vOrder.push_back(i);
+    }
+    std::sort(vOrder.begin(), vOrder.end(), [&vpindex](size_t a, size_t b) {
+        return std::make_pair(vpindex[a]->nFile, vpindex[a]->nUndoPos) < std::make_pair(vpindex[b]->nFile, vpindex[b]->nUndoPos);
+    });
+
+    std::vector<unsigned char> vchUndo;
+    for (size_t i = 0; i < vOrder.size(); ) {
+        int nFile = vpindex[vOrder[i]]->nFile;
+        CAutoFile filein(OpenUndoFile(CDiskBlockPos(nFile, 0), true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenUndoFile failed", __func__);
+        for (; i < vOrder.size() && vpindex[vOrder[i]]->nFile == nFile; i++) {
+            const CBlockIndex* pindex = vpindex[vOrder[i]];
+            if (fseek(filein.Get(), pindex->nUndoPos - UNDO_HEADER_SIZE, SEEK_SET))
+                return error("%s: fseek failed", __func__);
+            uint256 hashChecksum;
+            if (!ReadUndoRecord(filein, vchUndo, hashChecksum) ||
+                !DecodeBlockUndo(vblockundo[vOrder[i]], vchUndo, hashChecksum, pindex->pprev->GetBlockHash()))
+                return error("%s: failure reading undo data of %s", __func__, pindex->GetBlockHash().ToString());
+        }
+    }
     return true;
 }
 
@@ -1688,41 +2307,47 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 
 } // anon namespace
 
+bool ReadBlockUndoFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (pos.IsNull() || !pindex->pprev)
+        return error("%s: no undo data available for %s", __func__, pindex->GetBlockHash().ToString());
+    return UndoReadFromDisk(blockundo, pos, pindex->pprev->GetBlockHash());
+}
+
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the coin spent by a tx input from its undo data.
+ * @param undo The undo data of the spent coin.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
- * @return True on success.
+ * @param fClean Set to false if the restored coin overwrote an unspent one.
+ * @return False if the coin's metadata is missing and cannot be recovered.
  */
-bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+bool ApplyTxInUndo(Coin undo, CCoinsViewCache& view, const COutPoint& out, bool& fClean)
 {
-    bool fClean = true;
-
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-        coins->nTime = undo.nTime;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
 
-    return fClean;
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height, coinbase, coinstake and time). Older
+        // versions included this information only in undo records for the last
+        // spend of a transaction's outputs. This implies that it must be present
+        // for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+        undo.fCoinStake = alternate.fCoinStake;
+        undo.nTime = alternate.nTime;
+    }
+    bool fCoinBase = undo.fCoinBase;
+    view.AddCoin(out, std::move(undo), fCoinBase);
+
+    return true;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, const CBlockUndo* pblockundo, CCoinsTotals* pdelta)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1732,11 +2357,15 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     bool fClean = true;
 
     CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock(): no undo data available");
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock(): failure reading undo data");
+    if (pblockundo) {
+        blockUndo = *pblockundo;
+    } else {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock(): no undo data available");
+        if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock(): failure reading undo data");
+    }
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
@@ -1786,21 +2415,16 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         }
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock) { 
-                fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool fSpent = view.SpendCoin(out, &coin);
+                if (!fSpent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight ||
+                    tx.IsCoinBase() != coin.IsCoinBase() || tx.IsCoinStake() != coin.IsCoinStake() || tx.nTime != coin.nTime) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
             }
-            // remove outputs
-            outs->Clear();
         }
 
         // restore inputs
@@ -1810,10 +2434,9 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out)) {
-                    fClean = false;
-                }
+                if (!ApplyTxInUndo(txundo.vprevout[j], view, out, fClean))
+                    return error("DisconnectBlock(): failed to restore spent output %s", out.ToString());
+                const Coin &undo = view.AccessCoin(out);
                 const CTxIn input = tx.vin[j];
                     
                 if (fSpentIndex) {
@@ -1822,7 +2445,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                 }
 
                 if (fAddressIndex) {
-                    const CTxOut& prevout = view.GetOutputFor(tx.vin[j]);
+                    const CTxOut& prevout = undo.out;
                     if (prevout.scriptPubKey.IsPayToScriptHash()) {
                         vector<unsigned char> hashBytes(prevout.scriptPubKey.begin() + 2, prevout.scriptPubKey.begin() + 22);
 
@@ -1862,17 +2485,35 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    if (pdelta) {
+        *pdelta = CCoinsTotals();
+        for (const CTxUndo& txundo : blockUndo.vtxundo)
+            for (const Coin& coin : txundo.vprevout)
+                pdelta->Add(coin.out);
+        for (const auto& tx : block.vtx)
+            for (const CTxOut& out : tx->vout)
+                if (!out.scriptPubKey.IsUnspendable())
+                    pdelta->Remove(out);
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
     }
 
-    if (fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to delete address index");
+    // Queued even with only the timestamp index, so the indexed tip marker follows the chain
+    if (fAddressIndex || fSpentIndex || fTimestampIndex) {
+        pindexIndexedAhead = NULL;
+        std::shared_ptr<CIndexUpdate> update = std::make_shared<CIndexUpdate>(pindex->pprev ? pindex->pprev->GetBlockHash() : uint256());
+        if (fAddressIndex) {
+            addressSubscriptions.NotifyBlock(addressIndex, true);
+            update->vAddressIndexErase.swap(addressIndex);
+            update->vAddressUnspentIndex.swap(addressUnspentIndex);
         }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
+        if (fSpentIndex)
+            update->vSpentIndex.swap(spentIndex);
+        if (!pindexesdb->QueueUpdate(update)) {
+            return AbortNode(state, "Failed to write explorer indexes");
         }
     }
     return fClean;
@@ -1884,20 +2525,28 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
-    FILE *fileOld = OpenBlockFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
-    }
-
-    fileOld = OpenUndoFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
+    FILE *fileBlock = OpenBlockFile(posOld);
+    FILE *fileUndo = OpenUndoFile(posOld);
+    if (fileBlock && fFinalize) {
+        blockFileMap.Invalidate(nLastBlockFile);
+        TruncateFile(fileBlock, vinfoBlockFile[nLastBlockFile].nSize);
+    }
+    if (fileUndo && fFinalize)
+        TruncateFile(fileUndo, vinfoBlockFile[nLastBlockFile].nUndoSize);
+
+    // Queue the writeback of both files before waiting on either, so the
+    // device sees them as one batch
+    if (fileBlock)
+        FileStartWriteback(fileBlock, 0, 0);
+    if (fileUndo)
+        FileStartWriteback(fileUndo, 0, 0);
+    if (fileBlock) {
+        FileCommit(fileBlock);
+        fclose(fileBlock);
+    }
+    if (fileUndo) {
+        FileCommit(fileUndo);
+        fclose(fileUndo);
     }
 }
 
@@ -1905,11 +2554,481 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
+/** CheckInputs with fScriptChecks and cacheStore, spreading the script checks over the script check threads */
+static bool CheckInputsParallel(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs,
+                                unsigned int flags, PrecomputedTransactionData& txdata)
+{
+    if (!nScriptCheckThreads || tx.vin.size() < 2)
+        return CheckInputs(tx, state, inputs, true, flags, true, false, txdata);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, inputs, true, flags, true, false, txdata, &vChecks))
+        return false;
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+    // Check again one by one, for the state to tell which input failed and why
+    return CheckInputs(tx, state, inputs, true, flags, true, false, txdata);
+}
+
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
+    PlaceThread("scriptcheck");
     scriptcheckqueue.Thread();
 }
 
+void ThreadCoinsWriter() {
+    RenameThread("bitcoin-coinswr");
+    while (true) {
+        pcoinsdbview->WaitForQueued();
+        if (!pcoinsdbview->FlushQueued()) {
+            AbortNode("Failed to write to coin database");
+            return;
+        }
+    }
+}
+
+void ThreadCoinsPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    pcoinsprefetch->Thread();
+}
+
+void ThreadIndexWriter() {
+    RenameThread("bitcoin-indexwr");
+    while (true) {
+        pindexesdb->WaitForQueued();
+        // Let a few more blocks queue up so they share one batch
+        MilliSleep(INDEX_WRITER_INTERVAL);
+        if (!pindexesdb->Flush()) {
+            AbortNode("Failed to write to index database");
+            return;
+        }
+    }
+}
+
+namespace {
+/** A block a background index build reads, with its positions on disk taken under cs_main */
+struct CIndexBuildBlock {
+    const CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CDiskBlockPos posUndo;
+    uint256 hashPrev;
+    std::shared_ptr<CIndexUpdate> update;
+
+    explicit CIndexBuildBlock(const CBlockIndex* pindexIn) :
+        pindex(pindexIn), pos(pindexIn->GetBlockPos()), posUndo(pindexIn->GetUndoPos()),
+        hashPrev(pindexIn->pprev ? pindexIn->pprev->GetBlockHash() : uint256()) {}
+};
+}
+
+void GetIndexAddress(const CScript& script, int& type, uint160& hashBytes)
+{
+    if (script.IsPayToScriptHash()) {
+        hashBytes = uint160(vector<unsigned char>(script.begin() + 2, script.begin() + 22));
+        type = 2;
+    } else if (script.IsPayToPublicKeyHash()) {
+        hashBytes = uint160(vector<unsigned char>(script.begin() + 3, script.begin() + 23));
+        type = 1;
+    } else if (script.IsPayToPublicKey()) {
+        hashBytes = Hash160(script.begin() + 1, script.begin() + 34);
+        type = 1;
+    } else {
+        hashBytes.SetNull();
+        type = 0;
+    }
+}
+
+/**
+ * The address and spent index entries ConnectBlock makes for a block on
+ * disk, with the spent outputs taken from its undo data. With fDisconnect,
+ * the entries DisconnectBlock makes to take it back out again.
+ */
+static void GetIndexBuildEntries(const CBlock& block, const CBlockUndo& blockundo, int nHeight,
+                                 const CIndexBuildState& build, bool fDisconnect, CIndexUpdate& update)
+{
+    std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex = fDisconnect ? update.vAddressIndexErase : update.vAddressIndex;
+
+    for (unsigned int n = 0; n < block.vtx.size(); n++) {
+        // Disconnecting goes backwards, so outputs spent in the same block are restored before they are removed
+        const unsigned int i = fDisconnect ? block.vtx.size() - 1 - n : n;
+        const CTransaction &tx = *(block.vtx[i]);
+        const uint256 txhash = tx.GetHash();
+
+        for (int nPass = 0; nPass < 2; nPass++) {
+            if ((nPass == 0) == fDisconnect) {
+                if (!build.fAddressIndex)
+                    continue;
+                for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                    const CTxOut& out = tx.vout[k];
+                    int type;
+                    uint160 hashBytes;
+                    GetIndexAddress(out.scriptPubKey, type, hashBytes);
+                    if (type == 0)
+                        continue;
+                    addressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, nHeight, i, txhash, k, false), out.nValue));
+                    update.vAddressUnspentIndex.push_back(make_pair(CAddressUnspentKey(type, hashBytes, txhash, k),
+                        fDisconnect ? CAddressUnspentValue() : CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight, tx.nTime)));
+                }
+            } else if (i > 0) {
+                const CTxUndo &txundo = blockundo.vtxundo[i - 1];
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const COutPoint &prevout = tx.vin[j].prevout;
+                    const Coin &undo = txundo.vprevout[j];
+                    int type;
+                    uint160 hashBytes;
+                    GetIndexAddress(undo.out.scriptPubKey, type, hashBytes);
+                    if (build.fAddressIndex && type > 0) {
+                        addressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, nHeight, i, txhash, j, true), undo.out.nValue * -1));
+                        update.vAddressUnspentIndex.push_back(make_pair(CAddressUnspentKey(type, hashBytes, prevout.hash, prevout.n),
+                            fDisconnect ? CAddressUnspentValue(undo.out.nValue, undo.out.scriptPubKey, undo.nHeight, tx.nTime) : CAddressUnspentValue()));
+                    }
+                    if (build.fSpentIndex) {
+                        update.vSpentIndex.push_back(make_pair(CSpentIndexKey(prevout.hash, prevout.n),
+                            fDisconnect ? CSpentIndexValue() : CSpentIndexValue(txhash, j, nHeight, undo.out.nValue, type, hashBytes)));
+                    }
+                }
+            }
+        }
+    }
+}
+
+static bool ReadIndexBuildBlock(CIndexBuildBlock& item, const CIndexBuildState& build, bool fDisconnect)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, item.pos, Params().GetConsensus()))
+        return error("%s: failed to read block %s", __func__, item.pindex->GetBlockHash().ToString());
+    CBlockUndo blockundo;
+    if (item.posUndo.IsNull() || !UndoReadFromDisk(blockundo, item.posUndo, item.hashPrev))
+        return error("%s: failed to read undo data of block %s", __func__, item.pindex->GetBlockHash().ToString());
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s: block %s and undo data inconsistent", __func__, item.pindex->GetBlockHash().ToString());
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        if (blockundo.vtxundo[i - 1].vprevout.size() != block.vtx[i]->vin.size())
+            return error("%s: transaction and undo data inconsistent in block %s", __func__, item.pindex->GetBlockHash().ToString());
+    }
+
+    item.update = std::make_shared<CIndexUpdate>(fDisconnect ? item.hashPrev : item.pindex->GetBlockHash());
+    GetIndexBuildEntries(block, blockundo, item.pindex->nHeight, build, fDisconnect, *item.update);
+    return true;
+}
+
+/** Read a stretch of consecutive blocks on nThreads threads and write their
+ *  index entries, in chain order, in one batch */
+static bool BuildIndexRange(std::vector<CIndexBuildBlock>& vItems, CIndexBuildState& build, int nThreads)
+{
+    if (vItems.empty())
+        return true;
+
+    size_t nShards = std::max(1, std::min(nThreads, (int)vItems.size()));
+    std::atomic<bool> fOk(true);
+    auto runShard = [&](size_t nShard) {
+        for (size_t i = nShard; i < vItems.size() && fOk; i += nShards) {
+            if (!ReadIndexBuildBlock(vItems[i], build, false))
+                fOk = false;
+        }
+    };
+
+    boost::thread_group threadGroup;
+    for (size_t nShard = 1; nShard < nShards; nShard++) {
+        threadGroup.create_thread([&, nShard]() {
+            RenameThread("bitcoin-idxread");
+            try {
+                runShard(nShard);
+            } catch (const boost::thread_interrupted&) {
+                fOk = false;
+            }
+        });
+    }
+    try {
+        runShard(0);
+    } catch (const boost::thread_interrupted&) {
+        fOk = false;
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+    threadGroup.join_all();
+    if (!fOk)
+        return false;
+
+    // Logical timestamps depend on the previous block, so they are assigned in order
+    std::vector<std::shared_ptr<const CIndexUpdate> > vUpdates;
+    vUpdates.reserve(vItems.size());
+    for (CIndexBuildBlock& item : vItems) {
+        if (build.fTimestampIndex) {
+            unsigned int nLogicalTime = item.pindex->nTime;
+            if (nLogicalTime <= build.nLogicalTime)
+                nLogicalTime = build.nLogicalTime + 1;
+            item.update->vTimestampIndex.push_back(CTimestampIndexKey(nLogicalTime, item.pindex->GetBlockHash()));
+            item.update->vTimestampBlockIndex.push_back(std::make_pair(CTimestampBlockIndexKey(item.pindex->GetBlockHash()), CTimestampBlockIndexValue(nLogicalTime)));
+            build.nLogicalTime = nLogicalTime;
+        }
+        vUpdates.push_back(item.update);
+    }
+    build.hashBlock = vItems.back().pindex->GetBlockHash();
+    return pindexesdb->WriteIndexBuild(vUpdates, build);
+}
+
+/** Take the blocks a reorganization removed from the active chain back out
+ *  of the indexes being built */
+static bool RewindIndexBuild(CIndexBuildState& build)
+{
+    AssertLockHeld(cs_main);
+    if (build.hashBlock.IsNull())
+        return true;
+    BlockMap::const_iterator mi = mapBlockIndex.find(build.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return error("%s: index build stopped at unknown block %s", __func__, build.hashBlock.ToString());
+
+    for (const CBlockIndex* pindex = mi->second; !chainActive.Contains(pindex); pindex = pindex->pprev) {
+        CIndexBuildBlock item(pindex);
+        if (!ReadIndexBuildBlock(item, build, true))
+            return false;
+        build.hashBlock = item.hashPrev;
+        // Timestamp entries of blocks off the active chain stay, as with DisconnectBlock
+        if (!build.fTimestampIndex || !pindexesdb->ReadTimestampBlockIndex(build.hashBlock, build.nLogicalTime))
+            build.nLogicalTime = 0;
+        if (!pindexesdb->WriteIndexBuild(std::vector<std::shared_ptr<const CIndexUpdate> >(1, item.update), build))
+            return false;
+    }
+    return true;
+}
+
+//! Switch on the built indexes; the block index and chainActive must not move meanwhile
+static bool FinishIndexBuild(const CIndexBuildState& build)
+{
+    AssertLockHeld(cs_main);
+    // Live index updates for other indexes go out first, so the marker below is not ahead of them
+    if (!pindexesdb->Flush(true))
+        return false;
+    if (build.fAddressIndex) {
+        if (!pblocktree->WriteFlag("addressindex", true))
+            return false;
+        fAddressIndex = true;
+    }
+    if (build.fSpentIndex) {
+        if (!pblocktree->WriteFlag("spentindex", true))
+            return false;
+        fSpentIndex = true;
+    }
+    if (build.fTimestampIndex) {
+        if (!pblocktree->WriteFlag("timestampindex", true))
+            return false;
+        fTimestampIndex = true;
+    }
+    if (!pindexesdb->FinishIndexBuild(chainActive.Tip()->GetBlockHash()))
+        return false;
+    LogPrintf("Background index build complete at height %d\n", chainActive.Height());
+    return true;
+}
+
+bool PrepareIndexBuild(bool fAddress, bool fSpent, bool fTimestamp)
+{
+    LOCK(cs_main);
+    CIndexBuildState build;
+    if (!pindexesdb->ReadIndexBuild(build))
+        return error("%s: failed to read the index build state", __func__);
+
+    if (!build.IsNull()) {
+        // Stopped after the flags were written but before the build record was dropped
+        if ((!build.fAddressIndex || fAddressIndex) && (!build.fSpentIndex || fSpentIndex) && (!build.fTimestampIndex || fTimestampIndex))
+            return pindexesdb->FinishIndexBuild(chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : build.hashBlock);
+        LogPrintf("%s: resuming the background index build\n", __func__);
+        return true;
+    }
+
+    build.fAddressIndex = fAddress && !fAddressIndex;
+    build.fSpentIndex = fSpent && !fSpentIndex;
+    build.fTimestampIndex = fTimestamp && !fTimestampIndex;
+    if (build.IsNull() || chainActive.Tip() == NULL)
+        return true;
+    if (fHavePruned || fPruneMode)
+        return error("%s: the explorer indexes cannot be built from pruned block files; use -reindex", __func__);
+
+    LogPrintf("%s: building the address index %s, spent index %s and timestamp index %s in the background\n", __func__,
+        build.fAddressIndex ? "yes" : "no", build.fSpentIndex ? "yes" : "no", build.fTimestampIndex ? "yes" : "no");
+    return pindexesdb->StartIndexBuild(build);
+}
+
+void ThreadIndexBuilder() {
+    RenameThread("bitcoin-idxbuild");
+    CIndexBuildState build;
+    {
+        LOCK(cs_main);
+        if (!pindexesdb->ReadIndexBuild(build)) {
+            AbortNode("Failed to read the index build state");
+            return;
+        }
+    }
+    if (build.IsNull())
+        return;
+
+    const int nThreads = std::max(1, (int)GetArg("-indexbuildthreads", DEFAULT_INDEXBUILD_THREADS));
+    int64_t nStart = GetTimeMillis();
+    while (true) {
+        boost::this_thread::interruption_point();
+        std::vector<CIndexBuildBlock> vItems;
+        {
+            LOCK(cs_main);
+            if (!RewindIndexBuild(build)) {
+                AbortNode("Failed to rewind the index build after a reorganization");
+                return;
+            }
+            int nHeight = 1;
+            if (!build.hashBlock.IsNull())
+                nHeight = mapBlockIndex[build.hashBlock]->nHeight + 1;
+            int nEnd = std::min(chainActive.Height(), nHeight + INDEX_BUILD_BATCH - 1);
+            for (int i = nHeight; i <= nEnd; i++)
+                vItems.push_back(CIndexBuildBlock(chainActive[i]));
+
+            // Close to the tip, finish without letting another block in
+            if (nEnd == chainActive.Height() && (int)vItems.size() <= INDEX_BUILD_FINAL_BLOCKS) {
+                if (!BuildIndexRange(vItems, build, nThreads) || !FinishIndexBuild(build)) {
+                    AbortNode("Failed to complete the background index build");
+                    return;
+                }
+                LogPrint("bench", "Background index build took %.2fs\n", (GetTimeMillis() - nStart) * 0.001);
+                return;
+            }
+            LogPrintf("Background index build: blocks %d to %d of %d\n", nHeight, nEnd, chainActive.Height());
+        }
+        if (!BuildIndexRange(vItems, build, nThreads)) {
+            AbortNode("Failed to write the background index build");
+            return;
+        }
+    }
+}
+
+/** Hash consecutive blocks of vpindex on nThreads threads, each several at a time */
+static std::vector<uint256> GetPoWHashesParallel(const std::vector<const CBlockIndex*>& vpindex, int nThreads)
+{
+    std::vector<uint256> vHashes(vpindex.size());
+    size_t nShards = std::max(1, std::min(nThreads, (int)vpindex.size()));
+    auto runShard = [&](size_t nShard) {
+        size_t nBegin = vpindex.size() * nShard / nShards, nEnd = vpindex.size() * (nShard + 1) / nShards;
+        std::vector<CBlockHeader> vHeader;
+        vHeader.reserve(nEnd - nBegin);
+        for (size_t i = nBegin; i < nEnd; i++)
+            vHeader.push_back(vpindex[i]->GetBlockHeader());
+        std::vector<const CBlockHeader*> vpheader;
+        for (const CBlockHeader& header : vHeader)
+            vpheader.push_back(&header);
+        std::vector<uint256> vShard = GetPoWHashes(vpheader);
+        std::copy(vShard.begin(), vShard.end(), vHashes.begin() + nBegin);
+    };
+
+    // The workers use this frame, so it must not unwind before they are joined
+    boost::this_thread::disable_interruption di;
+    boost::thread_group threadGroup;
+    for (size_t nShard = 1; nShard < nShards; nShard++) {
+        threadGroup.create_thread([&, nShard]() {
+            RenameThread("bitcoin-powcheck");
+            runShard(nShard);
+        });
+    }
+    runShard(0);
+    threadGroup.join_all();
+    return vHashes;
+}
+
+void ThreadPoWVerifier() {
+    RenameThread("bitcoin-powcheck");
+    const int nThreads = GetArg("-powverifythreads", DEFAULT_POW_VERIFY_THREADS);
+    if (nThreads <= 0)
+        return;
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+
+    std::vector<std::pair<uint256, uint256> > vRecorded;
+    if (!pblocktree->ReadPoWHashes(vRecorded)) {
+        AbortNode("Failed to read the recorded proof-of-work hashes");
+        return;
+    }
+
+    std::vector<const CBlockIndex*> vPending;
+    {
+        LOCK(cs_main);
+        std::set<const CBlockIndex*> setRecorded;
+        for (const std::pair<uint256, uint256>& record : vRecorded) {
+            BlockMap::const_iterator mi = mapBlockIndex.find(record.first);
+            if (mi == mapBlockIndex.end())
+                continue;
+            if (!CheckProofOfWork(record.second, mi->second->nBits, consensusParams)) {
+                AbortNode(strprintf("Proof of work check failed for block %s in the block index, which is corrupt; restart with -reindex", record.first.ToString()));
+                return;
+            }
+            setRecorded.insert(mi->second);
+        }
+        for (const BlockMap::value_type& item : mapBlockIndex) {
+            const CBlockIndex* pindex = item.second;
+            // Whether a block is proof of stake is only known once it is connected
+            if (pindex->pprev == NULL || !pindex->IsValid(BLOCK_VALID_SCRIPTS) || !pindex->IsProofOfWork() || setRecorded.count(pindex))
+                continue;
+            vPending.push_back(pindex);
+        }
+        if (vPending.empty())
+            return;
+        std::sort(vPending.begin(), vPending.end(), [](const CBlockIndex* a, const CBlockIndex* b) { return a->nHeight < b->nHeight; });
+        LogPrintf("Checking the proof of work of %u blocks in the background (%u checked before)\n", vPending.size(), setRecorded.size());
+    }
+
+    int64_t nStart = GetTimeMillis();
+    for (size_t nPos = 0; nPos < vPending.size(); nPos += POW_VERIFY_BATCH) {
+        boost::this_thread::interruption_point();
+        std::vector<const CBlockIndex*> vBatch(vPending.begin() + nPos, vPending.begin() + std::min(vPending.size(), (size_t)(nPos + POW_VERIFY_BATCH)));
+        std::vector<uint256> vHashPoW = GetPoWHashesParallel(vBatch, nThreads);
+
+        std::vector<std::pair<uint256, uint256> > vRecord;
+        for (size_t i = 0; i < vBatch.size(); i++) {
+            if (!CheckProofOfWork(vHashPoW[i], vBatch[i]->nBits, consensusParams)) {
+                AbortNode(strprintf("Proof of work check failed for block %s in the block index, which is corrupt; restart with -reindex", vBatch[i]->GetBlockHash().ToString()));
+                return;
+            }
+            vRecord.push_back(std::make_pair(vBatch[i]->GetBlockHash(), vHashPoW[i]));
+        }
+        if (!pblocktree->WritePoWHashes(vRecord)) {
+            AbortNode("Failed to record verified proof-of-work hashes");
+            return;
+        }
+    }
+    LogPrintf("Background proof-of-work check of %u blocks done in %.2fs\n", vPending.size(), (GetTimeMillis() - nStart) * 0.001);
+}
+
+bool CBlockCheck::operator()() {
+    std::vector<const CBlockHeader*> vpheader;
+    for (const CBlock* pblock : vpblock) {
+        if (pblock->IsProofOfWork())
+            vpheader.push_back(pblock);
+    }
+    std::vector<uint256> vHashPoW = GetPoWHashes(vpheader);
+
+    bool fOk = true;
+    size_t nPoW = 0;
+    for (size_t i = 0; i < vpblock.size(); i++) {
+        const CBlock& block = *vpblock[i];
+        if (block.IsProofOfWork() && !CheckProofOfWork(vHashPoW[nPoW++], block.nBits, *pparams)) {
+            fOk = false;
+            continue;
+        }
+        // The proof of work is verified above, so CheckBlock skips it and
+        // does not mark the block; do that here
+        CValidationState state;
+        if (!CheckBlock(block, state, *pparams, false, true)) {
+            fOk = false;
+            continue;
+        }
+        block.fChecked = true;
+        block.fCheckedSig = true;
+    }
+    return fOk;
+}
+
+/**
+ * Blocks read from disk and checked by PrecheckBlocks, waiting for their
+ * ConnectTip. Protected by cs_main.
+ */
+static std::map<const CBlockIndex*, std::shared_ptr<const CBlock> > mapBlocksPrechecked;
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1955,6 +3074,42 @@ public:
 // Protected by cs_main
 static ThresholdConditionCache warningcache[VERSIONBITS_NUM_BITS];
 
+/**
+ * Whether pindex is buried deep enough in the -assumevalid chain for its
+ * scripts to be taken as valid. The block signature is not covered by the
+ * block hash, so it is checked all the same.
+ */
+static bool IsAssumedValid(const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    AssertLockHeld(cs_main);
+    if (hashAssumeValid.IsNull() || pindexBestHeader == NULL)
+        return false;
+    // We've been configured with the hash of a block which has been externally verified to have a valid history.
+    // A suitable default value is included with the software and updated from time to time.  Because validity
+    //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
+    // This setting doesn't force the selection of any particular chain but makes validating some faster by
+    //  effectively caching the result of part of the verification.
+    BlockMap::const_iterator  it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+    if (it->second->GetAncestor(pindex->nHeight) != pindex ||
+        pindexBestHeader->GetAncestor(pindex->nHeight) != pindex ||
+        pindexBestHeader->nChainWork < UintToArith256(consensusParams.nMinimumChainWork))
+        return false;
+    // This block is a member of the assumed verified chain and an ancestor of the best header.
+    // The equivalent time check discourages hashpower from extorting the network via DOS attack
+    //  into accepting an invalid block through telling users they must manually set assumevalid.
+    //  Requiring a software change or burying the invalid block, regardless of the setting, makes
+    //  it hard to hide the implication of the demand.  This also avoids having release candidates
+    //  that are hardly doing any signature verification at all in testing without having to
+    //  artificially set the default assumed verified block further back.
+    // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
+    //  least as good as the expected chain.
+    return GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) > 60 * 60 * 24 * 7 * 2;
+}
+
+static bool CheckBlockSignatureFormat(const CBlock& block, CPubKey& pubkeyRet, bool& fVerifyRet);
+
 static int64_t nTimeCheck = 0;
 static int64_t nTimeForks = 0;
 static int64_t nTimeVerify = 0;
@@ -1964,23 +3119,34 @@ static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CCoinsTotals* pdelta, CBlockConnectStats* pstats)
 {
     
     AssertLockHeld(cs_main);
+    if (pdelta)
+        *pdelta = CCoinsTotals();
 
     int64_t nTimeStart = GetTimeMicros();
     if (block.IsProofOfStake())
-    {
         pindex->SetProofOfStake();
-        pindex->prevoutStake = block.vtx[1]->vin[0].prevout;
-    }else{
-        pindex->prevoutStake.SetNull();
-    }
-    
+    // The ancestors are all connected now, so their types are final
+    pindex->UpdatePrevTypes();
+
+    // Scripts of assumed-valid blocks are not checked
+    bool fScriptChecks = !IsAssumedValid(pindex, chainparams.GetConsensus());
+
+    // With script check threads the ECDSA verification of a proof-of-stake block
+    // signature is queued with the script checks below, rather than done here
+    bool fQueueBlockSig = nScriptCheckThreads && block.IsProofOfStake() && !block.fCheckedSig;
+    CPubKey pubkeyBlock;
+    bool fVerifyBlockSig = false;
+
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck))
+    if (!CheckBlock(block, state, chainparams.GetConsensus(), !fJustCheck, !fJustCheck, !fQueueBlockSig))
         return error("%s: Consensus::CheckBlock: %s", __func__, FormatStateMessage(state));
+    if (fQueueBlockSig && !CheckBlockSignatureFormat(block, pubkeyBlock, fVerifyBlockSig))
+        return state.DoS(100, error("ConnectBlock(): bad proof-of-online block signature"),
+                         REJECT_INVALID, "bad-block-signature");
 
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == NULL ? uint256() : pindex->pprev->GetBlockHash();
@@ -1996,56 +3162,26 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     
     if(!fJustCheck) { 
         pindex->nStakeModifier = ComputeStakeModifier(pindex->pprev, block.IsProofOfStake() ? block.vtx[1]->vin[0].prevout.hash : pindex->GetBlockHash());
+        if (fCheckpointsEnabled && !Checkpoints::CheckStakeModifier(chainparams.Checkpoints(), pindex->nHeight, pindex->nStakeModifier))
+            return state.DoS(100, error("%s: stake modifier of block %s does not match its checkpoint", __func__, pindex->GetBlockHash().ToString()),
+                             REJECT_INVALID, "bad-stake-modifier");
     }
     // Check proof-of-stake
     if (block.IsProofOfStake() ) {
-         const COutPoint &prevout = block.vtx[1]->vin[0].prevout;
+        const COutPoint &prevout = block.vtx[1]->vin[0].prevout;
 
-         const CCoins *coins = view.AccessCoins(prevout.hash);
-          if (!coins)
-              return state.DoS(100, error("%s: kernel input unavailable", __func__),
-                                REJECT_INVALID, "bad-cs-kernel");
+        const Coin& coin = view.AccessCoin(prevout);
+        if (coin.IsSpent())
+            return state.DoS(100, error("%s: kernel input unavailable", __func__),
+                             REJECT_INVALID, "bad-cs-kernel");
 
-        
-        const CTxIn& txin = block.vtx[1]->vin[0];
-        CTransactionRef txPrev;
-        uint256 hashBlock = uint256();
-        if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
-            return error("CheckProofOfStake() : INFO: read txPrev failed %s",txin.prevout.hash.GetHex());
-        
-        CBlockIndex* pblockindex = mapBlockIndex[hashBlock];
-         if (!CheckStakeKernelHash(pindex->pprev, block.nBits,*pblockindex, coins, prevout, block.vtx[1]->nTime))
-              return state.DoS(100, error("%s: proof-of-stake hash doesn't match nBits", __func__),
-                                 REJECT_INVALID, "bad-cs-proofhash");
-    }
-
-    bool fScriptChecks = true;
-    if (!hashAssumeValid.IsNull()) {
-        // We've been configured with the hash of a block which has been externally verified to have a valid history.
-        // A suitable default value is included with the software and updated from time to time.  Because validity
-        //  relative to a piece of software is an objective fact these defaults can be easily reviewed.
-        // This setting doesn't force the selection of any particular chain but makes validating some faster by
-        //  effectively caching the result of part of the verification.
-        BlockMap::const_iterator  it = mapBlockIndex.find(hashAssumeValid);
-        if (it != mapBlockIndex.end()) {
-            if (it->second->GetAncestor(pindex->nHeight) == pindex &&
-                pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
-                pindexBestHeader->nChainWork >= UintToArith256(chainparams.GetConsensus().nMinimumChainWork)) {
-                // This block is a member of the assumed verified chain and an ancestor of the best header.
-                // The equivalent time check discourages hashpower from extorting the network via DOS attack
-                //  into accepting an invalid block through telling users they must manually set assumevalid.
-                //  Requiring a software change or burying the invalid block, regardless of the setting, makes
-                //  it hard to hide the implication of the demand.  This also avoids having release candidates
-                //  that are hardly doing any signature verification at all in testing without having to
-                //  artificially set the default assumed verified block further back.
-                // The test against nMinimumChainWork prevents the skipping when denied access to any chain at
-                //  least as good as the expected chain.
-                fScriptChecks = (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, chainparams.GetConsensus()) <= 60 * 60 * 24 * 7 * 2);
-            }
-        }
+        if (!CheckStakeKernelHash(pindex->pprev, block.nBits, coin, prevout, block.vtx[1]->nTime))
+            return state.DoS(100, error("%s: proof-of-stake hash doesn't match nBits", __func__),
+                             REJECT_INVALID, "bad-cs-proofhash");
     }
 
     int64_t nTime1 = GetTimeMicros(); nTimeCheck += nTime1 - nTimeStart;
+    if (pstats) pstats->nTimeCheck = nTime1 - nTimeStart;
     LogPrint("bench", "    - Sanity checks: %.2fms [%.2fs]\n", 0.001 * (nTime1 - nTimeStart), nTimeCheck * 0.000001);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
@@ -2077,48 +3213,33 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         for (const auto& tx : block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx->GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx->vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx->GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
-    // BIP16 didn't become active until Oct 1 2012
-    int64_t nBIP16SwitchTime = 1349049600;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
+    unsigned int flags = GetBlockScriptFlags(pindex, chainparams.GetConsensus());
 
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rule
-    if (pindex->nHeight >= chainparams.GetConsensus().BIP66Height) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
-    if (pindex->nHeight >= chainparams.GetConsensus().BIP65Height) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
-
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // Start enforcing BIP68 (sequence locks) using versionbits logic.
     int nLockTimeFlags = 0;
     if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-        flags |= SCRIPT_VERIFY_NULLDUMMY;
-    }
-
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
+    if (pstats) pstats->nTimeForks = nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CScriptCheck> control((fScriptChecks || fQueueBlockSig) && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    if (fVerifyBlockSig) {
+        std::vector<CScriptCheck> vChecks(1, CScriptCheck(pubkeyBlock, block.GetHash(), block.vchBlockSig));
+        control.Add(vChecks);
+    }
 
     std::vector<int> prevheights;
     CAmount nFees = 0;
@@ -2138,6 +3259,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
 
+    // Transactions the mempool accepted had their sigop cost counted then,
+    // with P2SH and witness counting on; once both are enforced here as well
+    // it need not be counted again. Blocks that are only checked (templates
+    // and the like) count everything.
+    std::vector<int64_t> vMempoolSigOpsCost;
+    if (!fJustCheck && (flags & SCRIPT_VERIFY_P2SH) && (flags & SCRIPT_VERIFY_WITNESS))
+        vMempoolSigOpsCost = mempool.GetSigOpCosts(block.vtx);
+
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = *(block.vtx[i]);
@@ -2154,7 +3283,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (fAddressIndex || fSpentIndex) {
                 for (size_t j = 0; j < tx.vin.size(); j++) {
                     const CTxIn input = tx.vin[j];
-                    const CTxOut& prevout = view.GetOutputFor(tx.vin[j]);
+                    const CTxOut& prevout = view.AccessCoin(tx.vin[j].prevout).out;
                     uint160 hashBytes;
                     int addressType;
 
@@ -2194,7 +3323,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
@@ -2207,7 +3336,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         // * legacy (always)
         // * p2sh (when P2SH enabled in flags and excludes coinbase)
         // * witness (when witness enabled in flags and excludes coinbase)
-        nSigOpsCost += GetTransactionSigOpCost(tx, view, flags);
+        if (!vMempoolSigOpsCost.empty() && vMempoolSigOpsCost[i] >= 0)
+            nSigOpsCost += vMempoolSigOpsCost[i];
+        else
+            nSigOpsCost += GetTransactionSigOpCost(tx, view, flags);
         if (nSigOpsCost > MAX_BLOCK_SIGOPS_COST)
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
@@ -2223,7 +3355,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             }   
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2275,6 +3407,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
+    if (pstats) {
+        pstats->nTimeConnect = nTime3 - nTime2;
+        pstats->nInputs = nInputs;
+    }
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
 
     if (block.IsProofOfWork())
@@ -2290,7 +3426,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     {
         // ppcoin: coin stake tx earns reward instead of paying fee
         uint64_t nCoinAge;
-        if (!TransactionGetCoinAge(const_cast<CTransaction&>(*block.vtx[1]), nCoinAge))
+        if (!GetCoinAge(*block.vtx[1], blockundo.vtxundo[0].vprevout, pindex->pprev, nCoinAge))
             return error("ConnectBlock() : %s unable to get coin age for coinstake", block.vtx[1]->GetHash().ToString());
 
         CAmount blockReward = GetProofOfStakeReward( pindex->pprev,nCoinAge, nFees);
@@ -2299,9 +3435,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return state.DoS(100, error("ConnectBlock() : coinstake pays too much(actual=%d vs calculated=%d)", nStakeReward, blockReward));
         pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + ( nStakeReward<0?0:blockReward -nFees)  ;            
     }
-    if (!control.Wait()){}
+    if (!control.Wait()){
         // return state.DoS(100, false);
+        // Failed script checks do not reject the block, but a bad block signature does
+        if (fVerifyBlockSig && !pubkeyBlock.Verify(block.GetHash(), block.vchBlockSig))
+            return state.DoS(100, error("ConnectBlock(): bad proof-of-online block signature"),
+                             REJECT_INVALID, "bad-block-signature");
+    }
+    if (fQueueBlockSig)
+        block.fCheckedSig = true;
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
+    if (pstats) pstats->nTimeVerify = nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
     
     
@@ -2317,10 +3461,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS))
     {
         if (pindex->GetUndoPos().IsNull()) {
+            std::vector<unsigned char> vchUndo;
+            EncodeBlockUndo(blockundo, fCompactUndo, vchUndo);
             CDiskBlockPos _pos;
-            if (!FindUndoPos(state, pindex->nFile, _pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            if (!FindUndoPos(state, pindex->nFile, _pos, vchUndo.size() + 40))
                 return error("ConnectBlock(): FindUndoPos failed");
-            if (!UndoWriteToDisk(blockundo, _pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
+            if (!UndoWriteToDisk(vchUndo, _pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
                 return AbortNode(state, "Failed to write undo data");
 
             // update nUndoPos in block index
@@ -2333,49 +3479,80 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     
-    if (fTxIndex)
+    if (fTxIndex && !fCompactTxIndex)
     if (!pblocktree->WriteTxIndex(vPos))
         return AbortNode(state, "Failed to write transaction index");
 
-    if (fAddressIndex) {
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to write address index");
-        }
+    if (fTxIndex && fCompactTxIndex) {
+        std::vector<std::pair<uint256, unsigned int> > vTxOffset;
+        vTxOffset.reserve(vPos.size());
+        for (const auto& txpos : vPos)
+            vTxOffset.push_back(std::make_pair(txpos.first, txpos.second.nTxOffset));
+        if (!pblocktree->WriteCompactTxIndex(pindex->nHeight, vTxOffset))
+            return AbortNode(state, "Failed to write transaction index");
+    }
 
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
+    if (fBlockFilterIndex && !pblocktree->WriteBlockFilter(CBlockFilter(pindex->GetBlockHash(), block, blockundo)))
+        return AbortNode(state, "Failed to write block filter");
+
+    // Explorer indexes are written by the index writer thread, off the critical path
+    if (fAddressIndex || fSpentIndex || fTimestampIndex) {
+        std::shared_ptr<CIndexUpdate> update = std::make_shared<CIndexUpdate>(pindex->GetBlockHash());
+        if (pindexIndexedAhead) {
+            update->fBalancesApplied = pindexIndexedAhead->GetAncestor(pindex->nHeight) == pindex;
+            if (!update->fBalancesApplied || pindexIndexedAhead == pindex)
+                pindexIndexedAhead = NULL;
+        }
+        if (fAddressIndex) {
+            addressSubscriptions.NotifyBlock(addressIndex, false);
+            update->vAddressIndex.swap(addressIndex);
+            update->vAddressUnspentIndex.swap(addressUnspentIndex);
         }
-    }
 
-    if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
-            return AbortNode(state, "Failed to write transaction index");
+        if (fSpentIndex)
+            update->vSpentIndex.swap(spentIndex);
 
-    if (fTimestampIndex) {
-        unsigned int logicalTS = pindex->nTime;
-        unsigned int prevLogicalTS = 0;
+        if (fTimestampIndex) {
+            unsigned int logicalTS = pindex->nTime;
+            unsigned int prevLogicalTS = 0;
 
-        // retrieve logical timestamp of the previous block
-        if (pindex->pprev)
-            if (!pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
-                LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
+            // retrieve logical timestamp of the previous block, from the index
+            // only if it was connected before this session
+            if (pindex->pprev) {
+                prevLogicalTS = pindex->pprev->nLogicalTime;
+                if (prevLogicalTS == 0 && !pindexesdb->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
+                    LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
+            }
 
-        if (logicalTS <= prevLogicalTS) {
-            logicalTS = prevLogicalTS + 1;
-            LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
+            if (logicalTS <= prevLogicalTS) {
+                logicalTS = prevLogicalTS + 1;
+                LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
+            }
+
+            update->vTimestampIndex.push_back(CTimestampIndexKey(logicalTS, pindex->GetBlockHash()));
+            update->vTimestampBlockIndex.push_back(std::make_pair(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)));
+            pindex->nLogicalTime = logicalTS;
         }
 
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
-            return AbortNode(state, "Failed to write timestamp index");
+        if (!pindexesdb->QueueUpdate(update))
+            return AbortNode(state, "Failed to write explorer indexes");
+    }
 
-        if (!pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
-            return AbortNode(state, "Failed to write blockhash index");
+    if (pdelta) {
+        for (const CTxUndo& txundo : blockundo.vtxundo)
+            for (const Coin& coin : txundo.vprevout)
+                pdelta->Remove(coin.out);
+        for (const auto& tx : block.vtx)
+            for (const CTxOut& out : tx->vout)
+                if (!out.scriptPubKey.IsUnspendable())
+                    pdelta->Add(out);
     }
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
     int64_t nTime5 = GetTimeMicros(); nTimeIndex += nTime5 - nTime4;
+    if (pstats) pstats->nTimeIndex = nTime5 - nTime4;
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime5 - nTime4), nTimeIndex * 0.000001);
 
     // Watch for changes to the previous coinbase transaction.
@@ -2385,7 +3562,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
 
     int64_t nTime6 = GetTimeMicros(); nTimeCallbacks += nTime6 - nTime5;
+    if (pstats) pstats->nTimeCallbacks = nTime6 - nTime5;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), nTimeCallbacks * 0.000001);
+    TRACE9(validation, block_connected, pindex->phashBlock->begin(), pindex->nHeight, block.vtx.size(), nInputs,
+           nTime1 - nTimeStart, nTime3 - nTime2, nTime4 - nTime2, nTime5 - nTime4, nTime6 - nTime5);
 
     return true;
 }
@@ -2478,16 +3658,30 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int n
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
-        // Flush the chainstate (which may refer to block index entries).
+        // The explorer indexes go first, so the chainstate is never ahead of them.
+        if (!pindexesdb->Flush(true))
+            return AbortNode(state, "Failed to write to index database");
+        // Flush the chainstate (which may refer to block index entries). With
+        // -asyncflush the coins database only takes over the cache contents
+        // here, and the writer thread stores them while blocks keep connecting.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Tagged with the best block, so totals that got ahead of or fell
+        // behind the coins written are recognized and not loaded
+        if (fCoinsTipTotals && !pcoinsdbview->WriteTotals(pcoinsTip->GetBestBlock(), coinsTipTotals))
+            return AbortNode(state, "Failed to write to coin database");
+        // Callers of FLUSH_STATE_ALWAYS expect the chainstate on disk when it
+        // returns, and after pruning it must not lag behind the block files
+        // that are left.
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->FlushQueued())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -2506,6 +3700,22 @@ void FlushStateToDisk() {
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void WriteBlockIndexSnapshot() {
+    AssertLockHeld(cs_main);
+    // Entries not yet in the database would make the snapshot disagree with it
+    if (!setDirtyBlockIndex.empty())
+        return;
+    std::vector<const CBlockIndex*> vBlocks;
+    vBlocks.reserve(mapBlockIndex.size());
+    for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex)
+        vBlocks.push_back(item.second);
+    int64_t nStart = GetTimeMillis();
+    if (!pblocktree->WriteIndexSnapshot(vBlocks))
+        LogPrintf("%s: failed to write block index snapshot\n", __func__);
+    else
+        LogPrint("bench", "Wrote block index snapshot of %u entries (%dms)\n", vBlocks.size(), GetTimeMillis() - nStart);
+}
+
 void PruneAndFlush() {
     CValidationState state;
     fCheckForPruning = true;
@@ -2515,6 +3725,9 @@ void PruneAndFlush() {
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
     chainActive.SetTip(pindexNew);
+    UpdateChainSnapshot(pindexNew);
+    stakeWeightWindow.SetTip(pindexNew);
+    stakingStatus.nNetworkWeight = stakeWeightWindow.GetKernelsPerSecond();
 
     // New best block
     mempool.AddTransactionsUpdated(1);
@@ -2575,24 +3788,30 @@ void static UpdateTip(CBlockIndex *pindexNew, const CChainParams& chainParams) {
 
 }
 
-/** Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and manually re-limit mempool size after this, with cs_main held. */
-bool static DisconnectTip(CValidationState& state, const CChainParams& chainparams, bool fBare = false)
+/** Disconnect chainActive's tip. You probably want to call mempool.removeForReorg and manually re-limit mempool size after this, with cs_main held.
+ *  pblockundo, if given, is the tip's undo data already read from disk. */
+bool static DisconnectTip(CValidationState& state, const CChainParams& chainparams, bool fBare = false, const CBlockUndo* pblockundo = NULL)
 {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
     // Read block from disk.
-    CBlock block;
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    CBlock& block = *pblock;
     if (!ReadBlockFromDisk(block, pindexDelete, chainparams.GetConsensus()))
         return AbortNode(state, "Failed to read block");
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
     {
-        CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        CCoinsViewCache view(pcoinsTip, true);
+        CCoinsTotals delta;
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, pblockundo, &delta))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         bool flushed = view.Flush();
         assert(flushed);
+        coinsTipTotals += delta;
     }
+    for (const auto& tx : block.vtx)
+        txCache.Erase(tx->GetHash());
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
@@ -2624,8 +3843,9 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     for (const auto& tx : block.vtx) {
-        GetMainSignals().SyncTransaction(*tx, pindexDelete->pprev, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+        GetMainSignals().SyncTransaction(tx, pindexDelete->pprev, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
     }
+    GetMainSignals().BlockDisconnected(pblock);
     return true;
 }
 
@@ -2635,6 +3855,45 @@ static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
 static int64_t nTimePostConnect = 0;
 
+/** Ring buffer of the CBlockConnectStats of the last BLOCK_CONNECT_STATS_SIZE blocks connected */
+static CCriticalSection cs_blockConnectStats;
+static std::vector<CBlockConnectStats> vBlockConnectStats;
+static size_t nBlockConnectStatsNext = 0;
+
+static void RecordBlockConnectStats(const CBlockConnectStats& stats)
+{
+    LOCK(cs_blockConnectStats);
+    if (vBlockConnectStats.size() < BLOCK_CONNECT_STATS_SIZE)
+        vBlockConnectStats.push_back(stats);
+    else
+        vBlockConnectStats[nBlockConnectStatsNext] = stats;
+    nBlockConnectStatsNext = (nBlockConnectStatsNext + 1) % BLOCK_CONNECT_STATS_SIZE;
+}
+
+std::vector<CBlockConnectStats> GetRecentBlockConnectStats(size_t nCount)
+{
+    LOCK(cs_blockConnectStats);
+    nCount = std::min(nCount, vBlockConnectStats.size());
+    std::vector<CBlockConnectStats> vStats;
+    vStats.reserve(nCount);
+    // Until the buffer fills up, nBlockConnectStatsNext is also its size
+    for (size_t i = vBlockConnectStats.size() + nBlockConnectStatsNext - nCount; vStats.size() < nCount; i++)
+        vStats.push_back(vBlockConnectStats[i % vBlockConnectStats.size()]);
+    return vStats;
+}
+
+bool GetBlockConnectStats(const uint256& hash, CBlockConnectStats& stats)
+{
+    LOCK(cs_blockConnectStats);
+    for (const CBlockConnectStats& record : vBlockConnectStats) {
+        if (record.hash == hash) {
+            stats = record;
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * Used to track blocks whose transactions were applied to the UTXO state as a
  * part of a single ActivateBestChainStep call.
@@ -2656,7 +3915,11 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     assert(pindexNew->pprev == chainActive.Tip());
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
-    if (!pblock) {
+    std::map<const CBlockIndex*, std::shared_ptr<const CBlock> >::iterator itPrechecked = mapBlocksPrechecked.find(pindexNew);
+    if (!pblock && itPrechecked != mapBlocksPrechecked.end()) {
+        connectTrace.blocksConnected.emplace_back(pindexNew, itPrechecked->second);
+        mapBlocksPrechecked.erase(itPrechecked);
+    } else if (!pblock) {
         std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
         connectTrace.blocksConnected.emplace_back(pindexNew, pblockNew);
         if (!ReadBlockFromDisk(*pblockNew, pindexNew, chainparams.GetConsensus()))
@@ -2669,9 +3932,18 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    CBlockConnectStats stats;
+    stats.hash = pindexNew->GetBlockHash();
+    stats.nHeight = pindexNew->nHeight;
+    stats.nTx = blockConnecting.vtx.size();
+    stats.nTimeReadFromDisk = nTime2 - nTime1;
     {
-        CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams);
+        CCoinsViewCache view(pcoinsTip, true);
+        CCoinsTotals delta;
+        uint64_t nHitsBefore = pcoinsTip->GetFetchHits(), nMissesBefore = pcoinsTip->GetFetchMisses();
+        bool rv = ConnectBlock(blockConnecting, state, pindexNew, view, chainparams, false, &delta, &stats);
+        stats.nCacheHits = pcoinsTip->GetFetchHits() - nHitsBefore;
+        stats.nCacheMisses = pcoinsTip->GetFetchMisses() - nMissesBefore;
         GetMainSignals().BlockChecked(blockConnecting, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2679,16 +3951,20 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
+        stats.nTimeConnectTotal = nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         bool flushed = view.Flush();
         assert(flushed);
+        coinsTipTotals += delta;
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
+    stats.nTimeFlush = nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
+    stats.nTimeChainState = nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.;
     mempool.removeForBlock(blockConnecting.vtx, pindexNew->nHeight);
@@ -2698,9 +3974,32 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
     LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
+    stats.nTimePostConnect = nTime6 - nTime5;
+    stats.nTimeTotal = nTime6 - nTime1;
+    stats.nTime = GetTime();
+    RecordBlockConnectStats(stats);
     return true;
 }
 
+CBlockConnectTimes GetBlockConnectTimes()
+{
+    LOCK(cs_main);
+    CBlockConnectTimes times;
+    times.nCheck = nTimeCheck;
+    times.nForks = nTimeForks;
+    times.nConnect = nTimeConnect;
+    times.nVerify = nTimeVerify;
+    times.nIndex = nTimeIndex;
+    times.nCallbacks = nTimeCallbacks;
+    times.nReadFromDisk = nTimeReadFromDisk;
+    times.nConnectTotal = nTimeConnectTotal;
+    times.nFlush = nTimeFlush;
+    times.nChainState = nTimeChainState;
+    times.nPostConnect = nTimePostConnect;
+    times.nTotal = nTimeTotal;
+    return times;
+}
+
 /**
  * Return the tip of the chain with the most work in it, that isn't
  * known to be invalid (it's however far from certain to be valid).
@@ -2776,18 +4075,112 @@ static void PruneBlockIndexCandidates() {
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
  */
+/**
+ * Read the next blocks on the way to the best chain from disk and run their
+ * context-free checks on the script check threads, several blocks per check
+ * where scrypt hashes them in one batch. Only the choice of blocks and the
+ * stash of the results take cs_main, so the reads and checks do not hold up
+ * other threads waiting for it. Kernel hashes cannot be checked this early:
+ * they need the stake modifier of the parent, which is only known once the
+ * parent is connected.
+ */
+static void PrecheckBlocks(const CChainParams& chainparams, const CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblockKnown)
+{
+    if (!nScriptCheckThreads)
+        return;
+
+    std::vector<std::pair<const CBlockIndex*, CDiskBlockPos> > vToRead;
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindexTarget = pindexMostWork ? pindexMostWork : FindMostWorkChain();
+        if (!pindexTarget)
+            return;
+        const CBlockIndex* pindexFork = chainActive.FindFork(pindexTarget);
+        const int nForkHeight = pindexFork ? pindexFork->nHeight : -1;
+
+        // Drop blocks a reorg has taken off the path to the best chain
+        for (std::map<const CBlockIndex*, std::shared_ptr<const CBlock> >::iterator it = mapBlocksPrechecked.begin(); it != mapBlocksPrechecked.end(); ) {
+            if (it->first->nHeight > nForkHeight && pindexTarget->GetAncestor(it->first->nHeight) == it->first)
+                ++it;
+            else
+                mapBlocksPrechecked.erase(it++);
+        }
+        if (pindexTarget->nHeight - nForkHeight < 2 || !mapBlocksPrechecked.empty())
+            return;
+
+        // With multi-lane scrypt each thread can take several blocks for the
+        // price of about one. The block already in memory is not read again.
+        const uint256 hashKnown = pblockKnown ? pblockKnown->GetHash() : uint256();
+        const int nMaxHeight = std::min(pindexTarget->nHeight, nForkHeight + (int)(nScriptCheckThreads * scrypt_multi_lanes()));
+        for (int nHeight = nForkHeight + 1; nHeight <= nMaxHeight; nHeight++) {
+            const CBlockIndex* pindex = pindexTarget->GetAncestor(nHeight);
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->GetBlockHash() == hashKnown)
+                continue;
+            vToRead.push_back(std::make_pair(pindex, pindex->GetBlockPos()));
+        }
+    }
+
+    std::vector<std::pair<const CBlockIndex*, std::shared_ptr<CBlock> > > vBlocks;
+    for (size_t i = 0; i < vToRead.size(); i++) {
+        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        // A block pruned or rewritten meanwhile is left to ConnectTip, which reports a failure
+        if (!ReadBlockFromDisk(*pblock, vToRead[i].second, chainparams.GetConsensus()) || pblock->GetHash() != vToRead[i].first->GetBlockHash())
+            break;
+        vBlocks.push_back(std::make_pair(vToRead[i].first, pblock));
+    }
+    if (vBlocks.empty())
+        return;
+
+    // Spread the blocks evenly over the threads
+    size_t nPerCheck = (vBlocks.size() + nScriptCheckThreads - 1) / nScriptCheckThreads;
+    std::vector<CScriptCheck> vChecks;
+    for (size_t i = 0; i < vBlocks.size(); ) {
+        CBlockCheck check(chainparams.GetConsensus());
+        for (size_t nEnd = std::min(vBlocks.size(), i + nPerCheck); i < nEnd; i++)
+            check.Add(*vBlocks[i].second);
+        vChecks.push_back(CScriptCheck(check));
+    }
+
+    // A failing block is simply left unchecked; ConnectBlock runs CheckBlock
+    // again and rejects it with the proper state
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    LOCK(cs_main);
+    for (size_t i = 0; i < vBlocks.size(); i++)
+        mapBlocksPrechecked[vBlocks[i].first] = vBlocks[i].second;
+}
+
 static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace)
 {
     AssertLockHeld(cs_main);
     const CBlockIndex *pindexOldTip = chainActive.Tip();
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
-    // Disconnect active blocks which are no longer in the best chain.
+    // The explorer indexes of a reorg go to disk in one batch once it is done
+    std::unique_ptr<CIndexesDB::WriteHold> indexHold;
+    if ((fAddressIndex || fSpentIndex || fTimestampIndex) && pindexFork != pindexOldTip)
+        indexHold.reset(new CIndexesDB::WriteHold(pindexesdb));
+
+    // Disconnect active blocks which are no longer in the best chain, reading
+    // the undo data of deep reorgs a batch at a time.
     bool fBlocksDisconnected = false;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state, chainparams))
-            return false;
-        fBlocksDisconnected = true;
+        std::vector<const CBlockIndex*> vpindexDisconnect;
+        for (const CBlockIndex* pindex = chainActive.Tip(); pindex != pindexFork && vpindexDisconnect.size() < MAX_DISCONNECT_UNDO_BATCH; pindex = pindex->pprev)
+            vpindexDisconnect.push_back(pindex);
+        std::vector<CBlockUndo> vblockundo;
+        // On failure each block reads and reports its own undo data
+        if (vpindexDisconnect.size() < 2 || !UndoReadFromDisk(vblockundo, vpindexDisconnect))
+            vblockundo.clear();
+        for (size_t i = 0; i < vpindexDisconnect.size(); i++) {
+            if (!DisconnectTip(state, chainparams, false, vblockundo.empty() ? NULL : &vblockundo[i]))
+                return false;
+            fBlocksDisconnected = true;
+        }
     }
 
     // Build list of new blocks to connect.
@@ -2889,6 +4282,8 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
         if (ShutdownRequested())
             break;
 
+        PrecheckBlocks(chainparams, pindexMostWork, pblock);
+
         const CBlockIndex *pindexFork;
         ConnectTrace connectTrace;
         bool fInitialDownload;
@@ -2933,7 +4328,8 @@ bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams,
                 assert(pair.second);
                 const CBlock& block = *(pair.second);
                 for (unsigned int i = 0; i < block.vtx.size(); i++)
-                    GetMainSignals().SyncTransaction(*block.vtx[i], pair.first, i);
+                    GetMainSignals().SyncTransaction(block.vtx[i], pair.first, i);
+                GetMainSignals().BlockConnected(pair.second, pair.first);
             }
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -3061,6 +4457,26 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     return true;
 }
 
+std::vector<std::pair<const CBlockIndex*, const CBlockIndex*> > GetChainTips()
+{
+    AssertLockHeld(cs_main);
+    std::vector<std::pair<const CBlockIndex*, const CBlockIndex*> > vTips;
+    vTips.reserve(mapBlockIndexLeaves.size() + 1);
+    for (std::pair<const CBlockIndex* const, const CBlockIndex*>& leaf : mapBlockIndexLeaves) {
+        // A fork point found before stays one while chainActive holds it and
+        // does not go on up the same branch
+        const CBlockIndex* pfork = leaf.second;
+        const CBlockIndex* pnext = pfork && chainActive.Contains(pfork) ? chainActive.Next(pfork) : NULL;
+        if (!pfork || !chainActive.Contains(pfork) || (pnext && leaf.first->GetAncestor(pnext->nHeight) == pnext))
+            leaf.second = pfork = chainActive.FindFork(leaf.first);
+        vTips.push_back(std::make_pair(leaf.first, pfork));
+    }
+    // The active tip may have children, that are headers only or invalid
+    if (chainActive.Tip() && !mapBlockIndexLeaves.count(chainActive.Tip()))
+        vTips.push_back(std::make_pair(chainActive.Tip(), chainActive.Tip()));
+    return vTips;
+}
+
 CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 {
     // Check for duplicate
@@ -3076,18 +4492,24 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
     pindexNew->nSequenceId = 0;
-    BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
-    if (miPrev != mapBlockIndex.end())
     {
-        pindexNew->pprev = (*miPrev).second;
-        pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
-        pindexNew->BuildSkip();
+        // LookupBlockIndex must not find the entry before it is linked into the tree
+        boost::unique_lock<boost::shared_mutex> lock(csBlockIndexMap);
+        BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+        BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+        if (miPrev != mapBlockIndex.end())
+        {
+            pindexNew->pprev = (*miPrev).second;
+            pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+            pindexNew->BuildSkip();
+        }
+        pindexNew->nTimeMax = (pindexNew->pprev ? std::max(pindexNew->pprev->nTimeMax, pindexNew->nTime) : pindexNew->nTime);
+        pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
+        pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     }
-    pindexNew->nTimeMax = (pindexNew->pprev ? std::max(pindexNew->pprev->nTimeMax, pindexNew->nTime) : pindexNew->nTime);
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
-    pindexNew->RaiseValidity(BLOCK_VALID_TREE);
+    mapBlockIndexLeaves.erase(pindexNew->pprev);
+    mapBlockIndexLeaves.insert(std::make_pair(pindexNew, (const CBlockIndex*)NULL));
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
@@ -3097,6 +4519,35 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 }
 
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
+/**
+ * Set nChainTx of the blocks in queue, whose parents have it set, and of the
+ * descendants with transactions that they link to the chain, making them
+ * candidates for the tip.
+ */
+static void LinkChainTransactions(std::deque<CBlockIndex*>& queue)
+{
+    // Recursively process any descendant blocks that now may be eligible to be connected.
+    while (!queue.empty()) {
+        CBlockIndex *pindex = queue.front();
+        queue.pop_front();
+        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+}
+
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
     
@@ -3109,40 +4560,147 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
     if (IsWitnessEnabled(pindexNew->pprev, Params().GetConsensus())) {
         pindexNew->nStatus |= BLOCK_OPT_WITNESS;
     }
-    pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
-    setDirtyBlockIndex.insert(pindexNew);
+    pindexNew->RaiseValidity(BLOCK_VALID_TRANSACTIONS);
+    setDirtyBlockIndex.insert(pindexNew);
+
+    if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
+        // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
+        std::deque<CBlockIndex*> queue;
+        queue.push_back(pindexNew);
+        LinkChainTransactions(queue);
+    } else {
+        if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
+            mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
+        }
+    }
+
+    return true;
+}
+
+bool CanLoadUTXOSnapshot(std::string& strError)
+{
+    AssertLockHeld(cs_main);
+    if (!fPruneMode) {
+        strError = "Loading a snapshot requires -prune, as the blocks before it are never downloaded";
+        return false;
+    }
+    if (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex || fBlockFilterIndex) {
+        strError = "Indexes cannot be built for the blocks before a snapshot; restart with them disabled";
+        return false;
+    }
+    if (chainActive.Height() != 0) {
+        strError = "Snapshots can only be loaded into a chainstate that has not connected any block past genesis";
+        return false;
+    }
+    return true;
+}
+
+bool ActivateUTXOSnapshot(CBlockIndex* pindexBase, const std::vector<CSnapshotBlockInfo>& vBlocks, std::string& strError)
+{
+    AssertLockHeld(cs_main);
+    assert(vBlocks.size() == (size_t)pindexBase->nHeight + 1);
+    const CChainParams& chainparams = Params();
+
+    // Genesis is connected already; the blocks after it up to the base are
+    // taken as valid without their data, as on a node that pruned them
+    std::deque<CBlockIndex*> queue;
+    for (CBlockIndex* pindex = pindexBase; pindex->pprev; pindex = pindex->pprev)
+        queue.push_front(pindex);
+    for (CBlockIndex* pindex : queue) {
+        const CSnapshotBlockInfo& info = vBlocks[pindex->nHeight];
+        pindex->nTx = info.nTx;
+        pindex->nStakeModifier = info.nStakeModifier;
+        pindex->nMoneySupply = info.nMoneySupply;
+        if (info.fProofOfStake)
+            pindex->SetProofOfStake();
+        pindex->UpdatePrevTypes();
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+    }
+    LinkChainTransactions(queue);
+
+    pcoinsTip->SetBestBlock(pindexBase->GetBlockHash());
+    fCoinsTipTotals = false;
+    UpdateTip(pindexBase, chainparams);
+    PruneBlockIndexCandidates();
+
+    fHavePruned = true;
+    CValidationState state;
+    if (!pblocktree->WriteFlag("prunedblockfiles", true) || !FlushStateToDisk(state, FLUSH_STATE_ALWAYS) ||
+        !pblocktree->WriteFlag("utxosnapshotload", false)) {
+        strError = "Failed to write the snapshot chainstate to disk";
+        return false;
+    }
+    LogPrintf("%s: tip is now snapshot base %s at height %d\n", __func__, pindexBase->GetBlockHash().ToString(), pindexBase->nHeight);
+    return true;
+}
+
+bool UpdateReplicaState(const std::set<uint256>& setBlockIndexChanged, CBlockIndex*& pindexNewTip, const CBlockIndex*& pindexFork)
+{
+    AssertLockHeld(cs_main);
+    pindexNewTip = NULL;
+    pindexFork = NULL;
+
+    std::set<uint256> setNew;
+    for (const uint256& hash : setBlockIndexChanged) {
+        if (!mapBlockIndex.count(hash))
+            setNew.insert(hash);
+    }
+    if (!pblocktree->LoadBlockIndexEntries(std::vector<uint256>(setBlockIndexChanged.begin(), setBlockIndexChanged.end()), InsertBlockIndex))
+        return false;
+
+    // As LoadBlockIndexDB does for all of them; parents are written before
+    // their children, so only the entries that changed need it
+    std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
+    for (const uint256& hash : setBlockIndexChanged) {
+        CBlockIndex* pindex = mapBlockIndex[hash];
+        vSortedByHeight.push_back(std::make_pair(pindex->nHeight, pindex));
+    }
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    for (const std::pair<int, CBlockIndex*>& item : vSortedByHeight) {
+        CBlockIndex* pindex = item.second;
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        pindex->nTimeMax = (pindex->pprev ? std::max(pindex->pprev->nTimeMax, pindex->nTime) : pindex->nTime);
+        if (pindex->nTx > 0)
+            pindex->nChainTx = pindex->pprev ? (pindex->pprev->nChainTx ? pindex->pprev->nChainTx + pindex->nTx : 0) : pindex->nTx;
+        // Entries already in the tree keep their skiplist pointer
+        if (setNew.count(pindex->GetBlockHash()))
+            pindex->BuildSkip();
+        else
+            pindex->UpdatePrevTypes();
+        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
+            pindexBestInvalid = pindex;
+        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+            pindexBestHeader = pindex;
+        if (setNew.count(pindex->GetBlockHash())) {
+            mapBlockIndexLeaves.erase(pindex->pprev);
+            mapBlockIndexLeaves.insert(std::make_pair(pindex, (const CBlockIndex*)NULL));
+        }
+    }
 
-    if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
-        // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
-        std::deque<CBlockIndex*> queue;
-        queue.push_back(pindexNew);
+    // The chainstate can be written before the block index entry of its best
+    // block reaches the replica; the tip moves once both are there
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsdbview->GetBestBlock());
+    if (it == mapBlockIndex.end() || it->second == chainActive.Tip())
+        return true;
+    CBlockIndex* pindexNew = it->second;
+    pindexFork = chainActive.FindFork(pindexNew);
+    if (pindexFork != chainActive.Tip())
+        txCache.Clear();
 
-        // Recursively process any descendant blocks that now may be eligible to be connected.
-        while (!queue.empty()) {
-            CBlockIndex *pindex = queue.front();
-            queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-            {
-                LOCK(cs_nBlockSequenceId);
-                pindex->nSequenceId = nBlockSequenceId++;
-            }
-            if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
-                setBlockIndexCandidates.insert(pindex);
-            }
-            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
-            while (range.first != range.second) {
-                std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
-                queue.push_back(it->second);
-                range.first++;
-                mapBlocksUnlinked.erase(it);
-            }
-        }
-    } else {
-        if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
-            mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
-        }
-    }
+    // Nothing is written through pcoinsTip on a replica, so it only holds
+    // what it read before the primary's changes
+    pcoinsTip->Discard();
+    uint256 hashTotals;
+    fCoinsTipTotals = pcoinsdbview->ReadTotals(hashTotals, coinsTipTotals) && hashTotals == pindexNew->GetBlockHash();
 
+    chainActive.SetTip(pindexNew);
+    UpdateChainSnapshot(pindexNew);
+    stakeWeightWindow.SetTip(pindexNew);
+    stakingStatus.nNetworkWeight = stakeWeightWindow.GetKernelsPerSecond();
+    cvBlockChange.notify_all();
+    pindexNewTip = pindexNew;
+    LogPrint("replica", "%s: new best=%s height=%d\n", __func__, pindexNew->GetBlockHash().ToString(), pindexNew->nHeight);
     return true;
 }
 
@@ -3235,8 +4793,9 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 // TODO
-static bool CheckBlockSignature(const CBlock& block)//, const uint256& hash)
+static bool CheckBlockSignatureFormat(const CBlock& block, CPubKey& pubkeyRet, bool& fVerifyRet)
 {
+    fVerifyRet = false;
     if (block.IsProofOfWork()){
         
         return block.vchBlockSig.empty();
@@ -3261,7 +4820,9 @@ static bool CheckBlockSignature(const CBlock& block)//, const uint256& hash)
     if (whichType == TX_PUBKEY)
     {
         vector<unsigned char>& vchPubKey = vSolutions[0];
-        return CPubKey(vchPubKey).Verify(block.GetHash(), block.vchBlockSig);
+        pubkeyRet = CPubKey(vchPubKey);
+        fVerifyRet = true;
+        return true;
       
     }
     else
@@ -3290,6 +4851,15 @@ static bool CheckBlockSignature(const CBlock& block)//, const uint256& hash)
     return false;
 }
 
+static bool CheckBlockSignature(const CBlock& block)
+{
+    CPubKey pubkey;
+    bool fVerify;
+    if (!CheckBlockSignatureFormat(block, pubkey, fVerify))
+        return false;
+    return !fVerify || pubkey.Verify(block.GetHash(), block.vchBlockSig);
+}
+
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     
@@ -3309,8 +4879,16 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
 {
     // These are checks that are independent of context.
 
-    if (block.fChecked)
+    if (block.fChecked) {
+        // An earlier pass may have left the signature to the script check threads
+        if (fCheckSig && !block.fCheckedSig) {
+            if (!CheckBlockSignature(block))
+                return state.DoS(100, error("CheckBlock(): bad proof-of-online block signature"),
+                                 REJECT_INVALID, "bad-block-signature", true);
+            block.fCheckedSig = true;
+        }
         return true;
+    }
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
@@ -3372,10 +4950,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
                 return state.DoS(100, error("CheckBlock(): more than one coinstake"),
                                     REJECT_INVALID, "bad-cs-multiple");
     }
-    // Check proof-of-online block signature
+    // Check proof-of-online block signature. The block hash does not cover
+    // it, so a bad one may be a valid block with its signature mangled.
     if (fCheckSig && !CheckBlockSignature(block ))
             return state.DoS(100, error("CheckBlock(): bad proof-of-online block signature"),
-            		REJECT_INVALID, "bad-block-signature");
+            		REJECT_INVALID, "bad-block-signature", true);
     // Check transactions
     for (const auto& tx : block.vtx) { 
         if (!CheckTransaction(*tx, state, true)) {
@@ -3390,8 +4969,10 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
     }
     if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
         return state.DoS(100, false, REJECT_INVALID, "bad-blk-sigops", false, "out-of-bounds SigOpCount");
-    if (fCheckPOW && fCheckMerkleRoot)
+    if (fCheckPOW && fCheckMerkleRoot) {
         block.fChecked = true;
+        block.fCheckedSig = fCheckSig;
+    }
     return true;
 }
 
@@ -3624,7 +5205,14 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         if (fCheckpointsEnabled && !CheckIndexAgainstCheckpoint(pindexPrev, state, chainparams, hash))
             return error("%s: CheckIndexAgainstCheckpoint(): %s", __func__, state.GetRejectReason().c_str());
 
-        if (!ContextualCheckBlockHeader(block, state, chainparams.GetConsensus(), pindexPrev, GetAdjustedTime()))
+        // Headers up to the last checkpoint are pinned by the checkpoints: one
+        // off their chain can never lead to the next, so its contextual checks
+        // are left to AcceptBlock, which makes them once the block arrives
+        const int nHeight = pindexPrev->nHeight + 1;
+        if (fCheckpointsEnabled && !Checkpoints::CheckBlock(chainparams.Checkpoints(), nHeight, hash))
+            return state.DoS(100, error("%s: rejected by checkpoint at height %d", __func__, nHeight), REJECT_CHECKPOINT, "checkpoint mismatch");
+        bool fCheckpointed = fCheckpointsEnabled && nHeight <= Checkpoints::GetLastCheckpointHeight(chainparams.Checkpoints());
+        if (!fCheckpointed && !ContextualCheckBlockHeader(block, state, chainparams.GetConsensus(), pindexPrev, GetAdjustedTime()))
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     if (pindex == NULL)
@@ -3728,6 +5316,9 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
                 AbortNode(state, "Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
+        // Warm the inputs while the block waits for, or goes through, its checks
+        if (pcoinsprefetch)
+            pcoinsprefetch->Prefetch(pblock);
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error: ") + e.what());
     }
@@ -3850,6 +5441,7 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileMap.Invalidate(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3977,7 +5569,8 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
 
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix)
 {
-    return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+    // A replica reads the files its primary writes
+    return (IsReplica() ? GetReplicaPrimaryDir() : GetDataDir()) / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
 }
 
 CBlockIndex * InsertBlockIndex(uint256 hash)
@@ -3994,6 +5587,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     CBlockIndex* pindexNew = new CBlockIndex();
     if (!pindexNew)
         throw std::runtime_error(std::string(__func__) + ": new CBlockIndex failed");
+    boost::unique_lock<boost::shared_mutex> lock(csBlockIndexMap);
     mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -4043,6 +5637,9 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
+        // Parents come first, so a parent is never added back after its child removed it
+        mapBlockIndexLeaves.erase(pindex->pprev);
+        mapBlockIndexLeaves.insert(std::make_pair(pindex, (const CBlockIndex*)NULL));
     }
 
     // Load block file info
@@ -4093,7 +5690,8 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("txindexcompact", fCompactTxIndex);
+    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? (fCompactTxIndex ? "enabled (compact)" : "enabled") : "disabled");
 
     // Check whether we have an address index
     pblocktree->ReadFlag("addressindex", fAddressIndex);
@@ -4112,6 +5710,9 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    UpdateChainSnapshot(it->second);
+    stakeWeightWindow.SetTip(it->second);
+    stakingStatus.nNetworkWeight = stakeWeightWindow.GetKernelsPerSecond();
 
     PruneBlockIndexCandidates();
 
@@ -4120,6 +5721,24 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
         GuessVerificationProgress(chainparams.TxData(), chainActive.Tip()));
 
+    // The chainstate is only flushed after the explorer indexes, so they can
+    // be ahead of it after a crash but never behind it. Reconnecting rewrites
+    // the same index entries, but the address balances are running totals, so
+    // remember which blocks they already include.
+    uint256 hashIndexed;
+    pindexIndexedAhead = NULL;
+    if ((fAddressIndex || fSpentIndex || fTimestampIndex) && pindexesdb->ReadBestBlock(hashIndexed)) {
+        BlockMap::iterator itIndexed = mapBlockIndex.find(hashIndexed);
+        if (itIndexed != mapBlockIndex.end() && itIndexed->second != chainActive.Tip()) {
+            if (chainActive.Contains(itIndexed->second))
+                return error("%s: explorer indexes only reach height %d of %d", __func__, itIndexed->second->nHeight, chainActive.Height());
+            if (itIndexed->second->GetAncestor(chainActive.Height()) == chainActive.Tip()) {
+                pindexIndexedAhead = itIndexed->second;
+                LogPrintf("%s: explorer indexes are ahead of the chainstate, at height %d\n", __func__, pindexIndexedAhead->nHeight);
+            }
+        }
+    }
+
     return true;
 }
 
@@ -4229,6 +5848,91 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     return true;
 }
 
+void ThreadVerifyDB(const CChainParams& chainparams, int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("jbcoin-verifydb");
+    // Where the I/O scheduler supports priorities, a thread's follows its nice value
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+    nCheckLevel = std::max(0, std::min(2, nCheckLevel));
+    int nHeight, nTipHeight;
+    {
+        LOCK(cs_main);
+        nTipHeight = chainActive.Height();
+        nHeight = nCheckDepth <= 0 ? 1 : std::max(1, nTipHeight - nCheckDepth + 1);
+        uint256 hashVerified;
+        if (pblocktree->ReadVerifiedBlock(hashVerified)) {
+            BlockMap::const_iterator mi = mapBlockIndex.find(hashVerified);
+            if (mi != mapBlockIndex.end()) {
+                // After a reorg only the blocks up to the fork stay verified
+                const CBlockIndex* pindexFork = chainActive.FindFork(mi->second);
+                if (pindexFork)
+                    nHeight = std::max(nHeight, pindexFork->nHeight + 1);
+            }
+        }
+    }
+    if (nHeight > nTipHeight) {
+        LogPrintf("%s: no blocks to verify up to height %d\n", __func__, nTipHeight);
+        return;
+    }
+    LogPrintf("%s: verifying blocks %d to %d at level %d\n", __func__, nHeight, nTipHeight, nCheckLevel);
+
+    int64_t nStart = GetTimeMillis();
+    uint256 hashLast;
+    for (; nHeight <= nTipHeight; nHeight++) {
+        boost::this_thread::interruption_point();
+        uint256 hashBlock, hashPrev;
+        CDiskBlockPos pos, posUndo;
+        {
+            LOCK(cs_main);
+            const CBlockIndex* pindex = chainActive[nHeight];
+            if (!pindex)
+                break; // A reorg shortened the chain
+            if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA))
+                continue;
+            hashBlock = pindex->GetBlockHash();
+            hashPrev = pindex->pprev->GetBlockHash();
+            pos = pindex->GetBlockPos();
+            posUndo = pindex->GetUndoPos();
+        }
+
+        CBlock block;
+        CValidationState state;
+        std::string strFailure;
+        if (!ReadBlockFromDisk(block, pos, chainparams.GetConsensus()) || block.GetHash() != hashBlock)
+            strFailure = "unreadable block";
+        else if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus()))
+            strFailure = "bad block (" + FormatStateMessage(state) + ")";
+        else if (nCheckLevel >= 2 && !posUndo.IsNull()) {
+            CBlockUndo undo;
+            if (!UndoReadFromDisk(undo, posUndo, hashPrev))
+                strFailure = "bad undo data";
+        }
+        if (!strFailure.empty()) {
+            {
+                LOCK(cs_main);
+                // A block pruned or disconnected meanwhile was not necessarily bad
+                const CBlockIndex* pindex = chainActive[nHeight];
+                if (!pindex || pindex->GetBlockHash() != hashBlock || (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)))
+                    continue;
+            }
+            error("%s: *** %s at %d, hash=%s", __func__, strFailure, nHeight, hashBlock.ToString());
+            SetMiscWarning(strprintf(_("Warning: block verification found %s at height %d; rebuild the block database with -reindex"), strFailure, nHeight));
+            uiInterface.NotifyAlertChanged();
+            break;
+        }
+
+        hashLast = hashBlock;
+        if (nHeight % VERIFYDB_CHECKPOINT_INTERVAL == 0) {
+            pblocktree->WriteVerifiedBlock(hashLast);
+            LogPrint("bench", "%s: verified up to height %d\n", __func__, nHeight);
+        }
+    }
+    if (!hashLast.IsNull())
+        pblocktree->WriteVerifiedBlock(hashLast);
+    LogPrintf("%s: done at height %d in %dms\n", __func__, nHeight - 1, GetTimeMillis() - nStart);
+}
+
 bool RewindBlockIndex(const CChainParams& params)
 {
     LOCK(cs_main);
@@ -4321,11 +6025,21 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    UpdateChainSnapshot(NULL);
+    // Its chunks point into the block index about to be freed
+    headersCache.Clear();
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexIndexedAhead = NULL;
     mempool.clear();
     mapBlocksUnlinked.clear();
+    mapBlockIndexLeaves.clear();
+    mapBlocksPrechecked.clear();
     vinfoBlockFile.clear();
+    blockFileMap.Clear();
+    txCache.Clear();
+    coinsTipTotals = CCoinsTotals();
+    fCoinsTipTotals = false;
     nLastBlockFile = 0;
     nBlockSequenceId = 1;
     setDirtyBlockIndex.clear();
@@ -4335,10 +6049,13 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(csBlockIndexMap);
+        BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
+            delete entry.second;
+        }
+        mapBlockIndex.clear();
     }
-    mapBlockIndex.clear();
     fHavePruned = false;
 }
 
@@ -4349,9 +6066,39 @@ bool LoadBlockIndex(const CChainParams& chainparams)
         exit(0);
         return false;
     }
+
+    // Running UTXO set totals are only good for the best block they were
+    // stored with; an empty chainstate starts from zero
+    uint256 hashTotals;
+    if (pcoinsTip->GetBestBlock().IsNull()) {
+        coinsTipTotals = CCoinsTotals();
+        fCoinsTipTotals = true;
+    } else {
+        fCoinsTipTotals = pcoinsdbview->ReadTotals(hashTotals, coinsTipTotals) && hashTotals == pcoinsTip->GetBestBlock();
+    }
+    LogPrintf("%s: UTXO set totals %s\n", __func__, fCoinsTipTotals ? "loaded" : "unknown until the next full scan");
+    return true;
+}
+
+bool GetCoinsTipTotals(CCoinsTotals& totals, uint256& hashBlock)
+{
+    AssertLockHeld(cs_main);
+    if (!fCoinsTipTotals || !chainActive.Tip())
+        return false;
+    totals = coinsTipTotals;
+    hashBlock = chainActive.Tip()->GetBlockHash();
     return true;
 }
 
+void SetCoinsTipTotals(const CCoinsTotals& totals, const uint256& hashBlock)
+{
+    AssertLockHeld(cs_main);
+    if (!chainActive.Tip() || chainActive.Tip()->GetBlockHash() != hashBlock)
+        return;
+    coinsTipTotals = totals;
+    fCoinsTipTotals = true;
+}
+
 bool InitBlockIndex(const CChainParams& chainparams)
 {
     
@@ -4364,6 +6111,8 @@ bool InitBlockIndex(const CChainParams& chainparams)
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fCompactTxIndex = GetBoolArg("-compacttxindex", DEFAULT_COMPACT_TXINDEX);
+    pblocktree->WriteFlag("txindexcompact", fCompactTxIndex);
 
     // Use the provided setting for -addressindex in the new database
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
@@ -4403,13 +6152,12 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
-{
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+// Map of disk positions for blocks with unknown parent (only used for reindex)
+static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
 
-    int nLoaded = 0;
+void ScanExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp,
+                           const std::function<bool(const std::shared_ptr<CBlock>&, const uint256&)>& fn)
+{
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
@@ -4445,69 +6193,11 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
                 std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
+                WithArena(&blkdat) >> *pblock;
                 nRewind = blkdat.GetPos();
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
-
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (AcceptBlock(pblock, state, chainparams, NULL, true, dbp, NULL))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
-
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
-                    }
-                }
-
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (AcceptBlock(pblockrecursive, dummy, chainparams, NULL, true, &it->second, NULL))
-                            {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
-                    }
-                }
+                if (!fn(pblock, pblock->GetHash()))
+                    break;
             } catch (const std::exception& e) {
                 LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
@@ -4515,11 +6205,238 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
+}
+
+/** Accept one block read from an external file. Returns false on a system error. */
+static bool ProcessExternalBlock(const CChainParams& chainparams, const std::shared_ptr<CBlock>& pblock, const uint256& hash, CDiskBlockPos *dbp, int& nLoaded)
+{
+    const CBlock& block = *pblock;
+
+    // detect out of order blocks, and store them for later
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        LOCK(cs_main);
+        CValidationState state;
+        if (AcceptBlock(pblock, state, chainparams, NULL, true, dbp, NULL))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Activate the genesis block so normal node progress can continue
+    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams)) {
+            return false;
+        }
+    }
+
+    NotifyHeaderTip();
+
+    // Recursively process earlier encountered successors of this block
+    std::deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+            if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+            {
+                LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
+                        head.ToString());
+                LOCK(cs_main);
+                CValidationState dummy;
+                if (AcceptBlock(pblockrecursive, dummy, chainparams, NULL, true, &it->second, NULL))
+                {
+                    nLoaded++;
+                    queue.push_back(pblockrecursive->GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+            NotifyHeaderTip();
+        }
+    }
+    return true;
+}
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    ScanExternalBlockFile(chainparams, fileIn, dbp, [&](const std::shared_ptr<CBlock>& pblock, const uint256& hash) {
+        return ProcessExternalBlock(chainparams, pblock, hash, dbp, nLoaded);
+    });
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
 
+namespace {
+
+/** A block of a block file, deserialized and checked ahead of its AcceptBlock */
+struct CReindexBlock {
+    std::shared_ptr<CBlock> pblock;
+    uint256 hash;
+    unsigned int nPos;
+};
+
+/** The blocks of one parsed block file, and their deserialized size */
+struct CReindexParsedFile {
+    std::vector<CReindexBlock> vBlocks;
+    size_t nBytes;
+};
+
+/**
+ * Block files being parsed for -reindex. Parser threads claim files in
+ * order and hand their blocks back here; the import thread takes them out
+ * again, also in order. The blocks parsed but not yet taken are bounded by
+ * their deserialized size: past nMaxBytes only the file the import thread
+ * waits for keeps being parsed.
+ */
+class CReindexFiles
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    const size_t nMaxBytes;
+    //! Next file for a parser to claim, and next file for the import thread
+    int nNextParse;
+    int nNextLoad;
+    //! First file that does not exist, once a parser has found it
+    int nEnd;
+    //! Deserialized size of the blocks parsed and not yet taken
+    size_t nBytesAhead;
+    std::map<int, CReindexParsedFile> mapParsed;
+
+    //! Whether a parser of nFile has to wait for the import thread to catch up
+    bool IsFull(int nFile) const
+    {
+        return nBytesAhead >= nMaxBytes && nFile != nNextLoad;
+    }
+
+public:
+    explicit CReindexFiles(size_t nMaxBytesIn) : nMaxBytes(nMaxBytesIn), nNextParse(0), nNextLoad(0), nEnd(std::numeric_limits<int>::max()), nBytesAhead(0) {}
+
+    void Parser(const CChainParams& chainparams)
+    {
+        while (true) {
+            int nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nNextParse < nEnd && IsFull(nNextParse))
+                    cond.wait(lock);
+                if (nNextParse >= nEnd)
+                    return;
+                nFile = nNextParse++;
+            }
+
+            CDiskBlockPos pos(nFile, 0);
+            FILE *file = boost::filesystem::exists(GetBlockPosFilename(pos, "blk")) ? OpenBlockFile(pos, true) : NULL;
+            if (!file) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nEnd = std::min(nEnd, nFile);
+                cond.notify_all();
+                return;
+            }
+
+            CReindexParsedFile parsed;
+            parsed.nBytes = 0;
+            ScanExternalBlockFile(chainparams, file, &pos, [&](const std::shared_ptr<CBlock>& pblock, const uint256& hash) {
+                // Context-free checks, cached in the block; a failure is
+                // left for AcceptBlock to report with the proper state
+                CValidationState state;
+                CheckBlock(*pblock, state, chainparams.GetConsensus());
+                CReindexBlock block = {pblock, hash, pos.nPos};
+                parsed.vBlocks.push_back(block);
+
+                size_t nBytes = RecursiveDynamicUsage(*pblock);
+                parsed.nBytes += nBytes;
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nBytesAhead += nBytes;
+                while (IsFull(nFile))
+                    cond.wait(lock);
+                return true;
+            });
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapParsed[nFile] = std::move(parsed);
+            cond.notify_all();
+        }
+    }
+
+    //! Wait for the blocks of the next file; false once all files are done
+    bool Next(int& nFile, std::vector<CReindexBlock>& vBlocks)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nNextLoad < nEnd && !mapParsed.count(nNextLoad))
+            cond.wait(lock);
+        if (nNextLoad >= nEnd)
+            return false;
+        nFile = nNextLoad++;
+        std::map<int, CReindexParsedFile>::iterator it = mapParsed.find(nFile);
+        vBlocks.swap(it->second.vBlocks);
+        nBytesAhead -= it->second.nBytes;
+        mapParsed.erase(it);
+        cond.notify_all();
+        return true;
+    }
+};
+
+}
+
+void ReindexBlockFiles(const CChainParams& chainparams)
+{
+    int nParsers = std::max(1, std::min(nScriptCheckThreads, MAX_REINDEX_THREADS));
+    CReindexFiles files(MAX_REINDEX_READAHEAD);
+    boost::thread_group parsers;
+    for (int i = 0; i < nParsers; i++)
+        parsers.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "reindex",
+                                          boost::function<void()>(boost::bind(&CReindexFiles::Parser, &files, boost::cref(chainparams)))));
+
+    try {
+        int nFile;
+        std::vector<CReindexBlock> vBlocks;
+        while (files.Next(nFile, vBlocks)) {
+            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+            int64_t nStart = GetTimeMillis();
+            int nLoaded = 0;
+            for (const CReindexBlock& block : vBlocks) {
+                boost::this_thread::interruption_point();
+                CDiskBlockPos pos(nFile, block.nPos);
+                try {
+                    if (!ProcessExternalBlock(chainparams, block.pblock, block.hash, &pos, nLoaded))
+                        break;
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: I/O error - %s\n", __func__, e.what());
+                }
+            }
+            vBlocks.clear();
+            if (nLoaded > 0)
+                LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+        }
+    } catch (...) {
+        parsers.interrupt_all();
+        parsers.join_all();
+        throw;
+    }
+    parsers.join_all();
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -4726,7 +6643,70 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+//! Dumps without the validation state of the entries, still readable
+static const uint64_t MEMPOOL_DUMP_VERSION_NOSTATE = 1;
+
+/**
+ * Add a transaction from a mempool dump taken at the current tip, reusing
+ * the fee, priority and sigop cost it was accepted with instead of
+ * validating its scripts again. Inputs, conflicts, finality and package
+ * limits are still checked, as the mempool may have changed since; false
+ * means the caller should fall back to AcceptToMemoryPool.
+ */
+static bool AcceptDumpedToMemoryPool(CTxMemPool& pool, const CTransactionRef& ptx, int64_t nTime, const CAmount& nFee,
+                                     double dPriority, unsigned int nHeight, const CAmount& inChainInputValue,
+                                     bool fSpendsCoinbase, int64_t nSigOpsCost)
+{
+    AssertLockHeld(cs_main);
+    const CTransaction& tx = *ptx;
+    const uint256& hash = tx.GetHash();
+    if (pool.exists(hash) || !CheckFinalTx(tx, STANDARD_LOCKTIME_VERIFY_FLAGS))
+        return false;
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    {
+        LOCK(pool.cs);
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            if (pool.mapNextTx.count(txin.prevout))
+                return false;
+        }
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        if (!view.HaveInputs(tx))
+            return false;
+        // Block validation takes the sigop cost of a transaction from its
+        // mempool entry, so the one in the file has to be right
+        if (GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS) != nSigOpsCost)
+            return false;
+        view.SetBackend(dummy);
+    }
+
+    LockPoints lp;
+    if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
+        return false;
+
+    CTxMemPoolEntry entry(ptx, nFee, nTime, dPriority, nHeight, inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
+    CTxMemPool::setEntries setAncestors;
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+        return false;
+
+    pool.addUnchecked(hash, entry, setAncestors, false);
+    if (fAddressIndex) {
+        pool.addAddressIndex(entry, view);
+    }
+    if (fSpentIndex) {
+        pool.addSpentIndex(entry, view);
+    }
+    GetMainSignals().SyncTransaction(ptx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    return true;
+}
 
 bool LoadMempool(void)
 {
@@ -4739,6 +6719,7 @@ bool LoadMempool(void)
     }
 
     int64_t count = 0;
+    int64_t reused = 0;
     int64_t skipped = 0;
     int64_t failed = 0;
     int64_t nNow = GetTime();
@@ -4746,9 +6727,22 @@ bool LoadMempool(void)
     try {
         uint64_t version;
         file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+        if (version != MEMPOOL_DUMP_VERSION && version != MEMPOOL_DUMP_VERSION_NOSTATE) {
             return false;
         }
+        bool fWithState = version == MEMPOOL_DUMP_VERSION;
+        // The saved state is only good against the chain and script flags
+        // it was computed with
+        bool fReuseState = false;
+        if (fWithState) {
+            uint256 hashBestBlock;
+            uint32_t nScriptFlags;
+            file >> hashBestBlock;
+            file >> nScriptFlags;
+            LOCK(cs_main);
+            fReuseState = chainActive.Tip() && chainActive.Tip()->GetBlockHash() == hashBestBlock &&
+                          nScriptFlags == (uint32_t)STANDARD_SCRIPT_VERIFY_FLAGS;
+        }
         uint64_t num;
         file >> num;
         double prioritydummy = 0;
@@ -4759,6 +6753,22 @@ bool LoadMempool(void)
             file >> tx;
             file >> nTime;
             file >> nFeeDelta;
+            // Wallets are loaded first; share their copies
+            tx = InternTransaction(tx);
+            CAmount nFee = 0;
+            double dPriority = 0;
+            unsigned int nHeight = 0;
+            CAmount inChainInputValue = 0;
+            bool fSpendsCoinbase = false;
+            int64_t nSigOpsCost = 0;
+            if (fWithState) {
+                file >> nFee;
+                file >> dPriority;
+                file >> nHeight;
+                file >> inChainInputValue;
+                file >> fSpendsCoinbase;
+                file >> nSigOpsCost;
+            }
 
             CAmount amountdelta = nFeeDelta;
             if (amountdelta) {
@@ -4767,11 +6777,17 @@ bool LoadMempool(void)
             CValidationState state;
             if (nTime + nExpiryTimeout > nNow) {
                 LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
-                if (state.IsValid()) {
+                if (fReuseState && AcceptDumpedToMemoryPool(mempool, tx, nTime, nFee, dPriority, nHeight,
+                                                            inChainInputValue, fSpendsCoinbase, nSigOpsCost)) {
                     ++count;
+                    ++reused;
                 } else {
-                    ++failed;
+                    AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
+                    if (state.IsValid()) {
+                        ++count;
+                    } else {
+                        ++failed;
+                    }
                 }
             } else {
                 ++skipped;
@@ -4790,7 +6806,13 @@ bool LoadMempool(void)
         return false;
     }
 
-    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
+    // Reused entries were not trimmed on the way in
+    if (reused) {
+        LOCK(cs_main);
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, nExpiryTimeout);
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes (%i without revalidation), %i failed, %i expired\n", count, reused, failed, skipped);
     return true;
 }
 
@@ -4799,18 +6821,30 @@ void DumpMempool(void)
     int64_t start = GetTimeMicros();
 
     std::map<uint256, CAmount> mapDeltas;
-    std::vector<TxMempoolInfo> vinfo;
+    std::vector<CTxMemPoolEntry> vEntries;
+    uint256 hashBestBlock;
 
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
+        if (chainActive.Tip())
+            hashBestBlock = chainActive.Tip()->GetBlockHash();
         for (const auto &i : mempool.mapDeltas) {
             mapDeltas[i.first] = i.second.second;
         }
-        vinfo = mempool.infoAll();
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it) {
+            vEntries.push_back(*it);
+        }
     }
 
     int64_t mid = GetTimeMicros();
 
+    // Parents have fewer ancestors than their children, so this puts them
+    // first and the entries can be added back without reordering
+    std::sort(vEntries.begin(), vEntries.end(), [](const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) {
+        return a.GetCountWithAncestors() < b.GetCountWithAncestors();
+    });
+
     try {
         FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
         if (!filestr) {
@@ -4821,13 +6855,21 @@ void DumpMempool(void)
 
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
-
-        file << (uint64_t)vinfo.size();
-        for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
-            mapDeltas.erase(i.tx->GetHash());
+        file << hashBestBlock;
+        file << (uint32_t)STANDARD_SCRIPT_VERIFY_FLAGS;
+
+        file << (uint64_t)vEntries.size();
+        for (const CTxMemPoolEntry& e : vEntries) {
+            file << e.GetTx();
+            file << (int64_t)e.GetTime();
+            file << (int64_t)(e.GetModifiedFee() - e.GetFee());
+            file << e.GetFee();
+            file << e.GetPriority(e.GetHeight());
+            file << e.GetHeight();
+            file << e.GetInChainInputValue();
+            file << e.GetSpendsCoinbase();
+            file << e.GetSigOpCost();
+            mapDeltas.erase(e.GetTx().GetHash());
         }
 
         file << mapDeltas;
@@ -4880,101 +6922,52 @@ uint64_t GetCoinAgeByTime(int64_t timespan, int64_t nValue  ){
     return bnCoinDay.GetLow64();
 }
 // ppcoin: total coin age spent in transaction, in the unit of coin-days.
-// Only those coins meeting minimum age requirement counts. As those
-// transactions not in main chain are not currently indexed so we
-// might not find out about their coin age. Older transactions are
-// guaranteed to be in main chain by sync-checkpoint. This rule is
-// introduced to help nodes establish a consistent view of the coin
-// age (trust score) of competing branches.
-bool GetCoinAge(const CTransaction& tx,  uint64_t& nCoinAge)
-{
-	arith_uint256 bnCentSecond = 0;  // coin age in the unit of cent-seconds
-    nCoinAge = 0;
-
-    if (tx.IsCoinBase())
-        return true;
-
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        // First try finding the previous transaction in database
-        
-        CDiskTxPos txindex;
-        CMutableTransaction txPrevMu;
-        if (!ReadFromDisk(txPrevMu, txindex, *pblocktree, txin.prevout))
-            continue;  // previous transaction not in main chain
-        CTransaction txPrev(txPrevMu);
-        if (tx.nTime < txPrev.nTime)
-            return false;  // Transaction timestamp violation
-
-        
-        // Read block header
-        CBlock block;
-        const CDiskBlockPos& pos = CDiskBlockPos(txindex.nFile, txindex.nPos);
-        if (!ReadBlockFromDisk(block, pos, Params().GetConsensus()))
-            return false; // unable to read block of previous transaction
-        if (block.GetBlockTime() + Params().GetConsensus().nStakeMinAge > tx.nTime){ 
-            DbgMsg(" block: %d + %d > tx:%d  , gap %d" ,
-                block.GetBlockTime() ,
-                Params().GetConsensus().nStakeMinAge , 
-                tx.nTime ,
-               ( block.GetBlockTime() + Params().GetConsensus().nStakeMinAge) - tx.nTime);
-             
-            continue; // only count coins meeting min age requirement
-        }
-
-        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-        bnCentSecond += arith_uint256(nValueIn) * (tx.nTime-txPrev.nTime) / CENT;
-
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d- bnCentSecond=%s\n", nValueIn, tx.nTime - txPrev.nTime, bnCentSecond.ToString());
-    }
-
-    arith_uint256 bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
-    LogPrint("coinage", "coin age bnCoinDay=%s  bnCoinSecond=%s  \n", 
-        bnCoinDay.ToString() ,
-        bnCentSecond.ToString() );
-    nCoinAge = bnCoinDay.GetLow64();
-    return true;
-}
-
-bool TransactionGetCoinAge(CTransaction& transaction, uint64_t& nCoinAge)
+// Only those coins meeting minimum age requirement counts. The spent coins
+// carry the value and time of the transaction that created them and the
+// height of the block that confirmed it, so neither -txindex nor block
+// files are needed and pruned nodes compute the same coin age.
+bool GetCoinAge(const CTransaction& tx, const std::vector<Coin>& vCoins, const CBlockIndex* pindexPrev, uint64_t& nCoinAge)
 {
     arith_uint256 bnCentSecond = 0;  // coin age in the unit of cent-seconds
     nCoinAge = 0;
 
-    if (transaction.IsCoinBase())
+    if (tx.IsCoinBase())
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, transaction.vin)
+    assert(vCoins.size() == tx.vin.size());
+    for (const Coin& coin : vCoins)
     {
-        // First try finding the previous transaction in database
-        CTransactionRef txPrev;
-        uint256 hashBlock = uint256();
-
-        if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock, true))
+        if (coin.IsSpent())
             continue;  // previous transaction not in main chain
 
-        if (transaction.nTime < txPrev->nTime)
+        if (tx.nTime < coin.nTime)
             return false;  // Transaction timestamp violation
 
-        if (mapBlockIndex.count(hashBlock) == 0)
+        const CBlockIndex* pindexFrom = pindexPrev ? pindexPrev->GetAncestor(coin.nHeight) : NULL;
+        if (!pindexFrom)
             return false; //Block not found
 
-        CBlockIndex* pblockindex = mapBlockIndex[hashBlock];
-
-        if (pblockindex->nTime + Params().GetConsensus().nStakeMinAge > transaction.nTime)
+        if (pindexFrom->GetBlockTime() + Params().GetConsensus().nStakeMinAge > tx.nTime)
             continue; // only count coins meeting min age requirement
 
-        int64_t nValueIn = txPrev->vout[txin.prevout.n].nValue;
-        bnCentSecond += arith_uint256(nValueIn) * (transaction.nTime-txPrev->nTime) / CENT;
+        int64_t nValueIn = coin.out.nValue;
+        bnCentSecond += arith_uint256(nValueIn) * (tx.nTime - coin.nTime) / CENT;
 
-
-        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, transaction.nTime - txPrev->nTime, bnCentSecond.ToString());
+        LogPrint("coinage", "coin age nValueIn=%d nTimeDiff=%d bnCentSecond=%s\n", nValueIn, tx.nTime - coin.nTime, bnCentSecond.ToString());
     }
 
-
-    arith_uint256 bnCoinDay = ((bnCentSecond * CENT) / COIN) / (24 * 60 * 60);
+    arith_uint256 bnCoinDay = bnCentSecond * CENT / COIN / (24 * 60 * 60);
     LogPrint("coinage", "coin age bnCoinDay=%s\n", bnCoinDay.ToString());
     nCoinAge = bnCoinDay.GetLow64();
-
     return true;
 }
+
+bool GetCoinAge(const CTransaction& tx, uint64_t& nCoinAge)
+{
+    LOCK(cs_main);
+    std::vector<Coin> vCoins;
+    vCoins.reserve(tx.vin.size());
+    for (const CTxIn& txin : tx.vin)
+        vCoins.push_back(pcoinsTip->AccessCoin(txin.prevout));
+    return GetCoinAge(tx, vCoins, chainActive.Tip(), nCoinAge);
+}
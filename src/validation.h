@@ -14,13 +14,16 @@
 #include "chain.h"
 #include "coins.h"
 #include "protocol.h" // For CMessageHeader::MessageStartChars
+#include "pubkey.h"
 #include "script/script_error.h"
 #include "sync.h"
 #include "versionbits.h"
 #include "txdb.h"
 #include <algorithm>
 #include <exception>
+#include <functional>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -33,16 +36,24 @@
 #include <boost/filesystem/path.hpp>
 
 class CBlockIndex;
+class CCoinsViewDB;
+class CCoinsViewPrefetch;
 class CBlockTreeDB;
+class CBlockUndo;
+class CIndexesDB;
 class CBloomFilter;
 class CChainParams;
+class CChainSnapshot;
 class CInv;
 class CConnman;
+class CBlockCheck;
 class CScriptCheck;
 class CTxMemPool;
 class CValidationInterface;
 class CValidationState;
 struct ChainTxData;
+struct CCoinsTotals;
+struct CSnapshotBlockInfo;
 
 struct PrecomputedTransactionData;
 struct LockPoints;
@@ -75,15 +86,27 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Bytes appended to a blk or rev file after which their writeback is started in the background */
+static const unsigned int FILE_WRITEBACK_SIZE = 0x800000; // 8 MiB
 
 /** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
+static const int MAX_SCRIPTCHECK_THREADS = 64;
+/** Maximum number of block file parsing threads for -reindex */
+static const int MAX_REINDEX_THREADS = 4;
+/** Deserialized size of the blocks -reindex parses ahead of the block file being imported */
+static const size_t MAX_REINDEX_READAHEAD = 256 * 1024 * 1024;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Upper bound for the number of blocks in transit from a single peer that has shown enough throughput for more. */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE = 256;
+/** Maximum amount of block data (estimated from the average block size) to have in transit from a single peer. */
+static const unsigned int MAX_BLOCK_BYTES_IN_TRANSIT_PER_PEER = 16 * 1000 * 1000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Time in microseconds a peer may stall block download progress before an idle, faster peer takes over the block it holds up. */
+static const int64_t BLOCK_STALLING_REASSIGN_TIMEOUT = 500000;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
@@ -95,8 +118,16 @@ static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
- *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
+ *  harder). This is the minimum; when blocks are small the window grows to span BLOCK_DOWNLOAD_WINDOW_BYTES. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Amount of block data (estimated from the average block size) the block download window spans at least. */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW_BYTES = 64 * 1000 * 1000;
+/** Maximum size of the block download window, however small blocks are. */
+static const unsigned int MAX_BLOCK_DOWNLOAD_WINDOW = 16384;
+/** Amount of serialized block data we keep in memory for requested blocks that arrive before their parent. */
+static const unsigned int MAX_BLOCK_DOWNLOAD_BUFFER_BYTES = 32 * 1000 * 1000;
+/** Time in seconds a buffered block waits for its parent before it is stored without it. */
+static const unsigned int BLOCK_DOWNLOAD_BUFFER_TIMEOUT = 10;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -113,6 +144,10 @@ static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
 /** Maximum number of inventory items to send per transmission.
  *  Limits the impact of low-fee transaction floods. */
 static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Interval in seconds at which relayed transactions are sorted and queued for announcement to all peers. */
+static const unsigned int INVENTORY_BROADCAST_BATCH_INTERVAL = 1;
+/** Maximum number of queued transaction announcements kept for peers that fall behind. */
+static const unsigned int MAX_INVENTORY_BROADCAST_QUEUE = 50000;
 /** Average delay between feefilter broadcasts in seconds. */
 static const unsigned int AVG_FEEFILTER_BROADCAST_INTERVAL = 10 * 60;
 /** Maximum feefilter broadcast delay after significant change. */
@@ -132,9 +167,27 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = true;// For POS
+static const bool DEFAULT_COMPACT_TXINDEX = false;
 static const bool DEFAULT_ADDRESSINDEX = false;
 static const bool DEFAULT_TIMESTAMPINDEX = false;
 static const bool DEFAULT_SPENTINDEX = false;
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+/** Default for -addressindexthreads, the threads sharing the lookups of a multi-address query */
+static const int DEFAULT_ADDRESSINDEX_THREADS = 4;
+static const bool DEFAULT_COMPACT_ADDRESSINDEX = false;
+/** Default for -compactundo */
+static const bool DEFAULT_COMPACT_UNDO = false;
+/** Default for -indexbuildthreads, the threads reading blocks for a background index build */
+static const int DEFAULT_INDEXBUILD_THREADS = 4;
+/** Default for -powverifythreads, the threads re-checking proof of work over the block index after startup */
+static const int DEFAULT_POW_VERIFY_THREADS = 2;
+/** Blocks the background proof-of-work check hashes and records at a time */
+static const unsigned int POW_VERIFY_BATCH = 1024;
+/** Default for -asyncflush, writing chainstate flushes on a background thread */
+static const bool DEFAULT_ASYNC_FLUSH = true;
+/** Default for -prefetchthreads, the threads looking up block inputs ahead of connection */
+static const int DEFAULT_PREFETCH_THREADS = 2;
+static const int MAX_PREFETCH_THREADS = 16;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 /** Default for -mempoolreplacement */
@@ -170,13 +223,23 @@ extern std::atomic_bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+/** Whether the transaction index is kept in the compact format (-compacttxindex) */
+extern bool fCompactTxIndex;
+/** Whether the address index is live */
+extern bool fAddressIndex;
+/** Whether the spent index is live, as for fAddressIndex */
+extern bool fSpentIndex;
+/** Whether compact filters are written for blocks as they are connected */
+extern bool fBlockFilterIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+/** Whether new undo records are written in the compact columnar format */
+extern bool fCompactUndo;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
 
-extern int64_t nLastCoinStakeSearchInterval;
+extern std::atomic<int64_t> nLastCoinStakeSearchInterval;
 
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
@@ -207,6 +270,10 @@ static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
 
 static const signed int DEFAULT_CHECKBLOCKS = 6 * 4;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+//! Verify -checkblocks on a background thread after startup instead of during it
+static const bool DEFAULT_CHECKBLOCKS_BACKGROUND = false;
+//! Blocks the background verification checks between records of its progress
+static const int VERIFYDB_CHECKPOINT_INTERVAL = 1000;
 
 
 struct CTimestampIndexIteratorKey {
@@ -553,6 +620,37 @@ struct CAddressIndexIteratorKey {
     }
 };
 
+/** Running totals of an address, kept next to the address index */
+struct CAddressBalance {
+    CAmount nBalance;
+    //! Sum of all positive deltas, change included
+    CAmount nReceived;
+    uint64_t nTxCount;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+        READWRITE(nTxCount);
+    }
+
+    CAddressBalance() {
+        SetNull();
+    }
+
+    void SetNull() {
+        nBalance = 0;
+        nReceived = 0;
+        nTxCount = 0;
+    }
+
+    bool IsNull() const {
+        return nBalance == 0 && nReceived == 0 && nTxCount == 0;
+    }
+};
+
 struct CAddressIndexIteratorHeightKey {
     unsigned int type;
     uint160 hashBytes;
@@ -683,6 +781,63 @@ struct CSpentIndexKeyCompare
         }
     }
 };
+
+/** Explorer index changes made by connecting or disconnecting one block,
+ *  queued for the background index writer */
+struct CIndexUpdate {
+    //! Tip of the indexed chain once this update is applied
+    uint256 hashBlock;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndexErase;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+    std::vector<CTimestampIndexKey> vTimestampIndex;
+    std::vector<std::pair<CTimestampBlockIndexKey, CTimestampBlockIndexValue> > vTimestampBlockIndex;
+    //! The address balances already include this block, which is being
+    //! reconnected after a crash left the indexes ahead of the chainstate
+    bool fBalancesApplied;
+
+    CIndexUpdate(const uint256& hashBlockIn) : hashBlock(hashBlockIn), fBalancesApplied(false) {}
+};
+
+/** Explorer indexes being built in the background for a chain that was
+ *  connected without them, and how far the build has got */
+struct CIndexBuildState {
+    bool fAddressIndex;
+    bool fSpentIndex;
+    bool fTimestampIndex;
+    //! Last block written, null before the first
+    uint256 hashBlock;
+    //! Logical timestamp of that block
+    unsigned int nLogicalTime;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(fAddressIndex);
+        READWRITE(fSpentIndex);
+        READWRITE(fTimestampIndex);
+        READWRITE(hashBlock);
+        READWRITE(nLogicalTime);
+    }
+
+    CIndexBuildState() {
+        SetNull();
+    }
+
+    void SetNull() {
+        fAddressIndex = false;
+        fSpentIndex = false;
+        fTimestampIndex = false;
+        hashBlock.SetNull();
+        nLogicalTime = 0;
+    }
+
+    bool IsNull() const {
+        return !fAddressIndex && !fSpentIndex && !fTimestampIndex;
+    }
+};
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
 // Add 15% for Undo data = 331MB
@@ -734,8 +889,17 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
+/**
+ * Find and deserialize the blocks of a file in block file format, calling fn
+ * for each with dbp (if given) pointing at it. fn returning false ends the
+ * scan. Takes over fileIn.
+ */
+void ScanExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp,
+                           const std::function<bool(const std::shared_ptr<CBlock>&, const uint256&)>& fn);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Import all blk?????.dat files for -reindex, parsing and checking them on several threads */
+void ReindexBlockFiles(const CChainParams& chainparams);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
@@ -744,6 +908,26 @@ bool LoadBlockIndex(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run the background writer of the explorer indexes database */
+void ThreadIndexWriter();
+/** Run the background writer of chainstate flushes (-asyncflush) */
+void ThreadCoinsWriter();
+/** Run an instance of the block input lookahead thread (-prefetchthreads) */
+void ThreadCoinsPrefetch();
+/**
+ * Arrange for the requested explorer indexes the chain was connected without
+ * to be built in the background, or pick up an interrupted build. Call with
+ * the block index loaded and not while reindexing.
+ */
+bool PrepareIndexBuild(bool fAddress, bool fSpent, bool fTimestamp);
+/** Build the explorer indexes set up by PrepareIndexBuild and turn them on once they reach the tip */
+void ThreadIndexBuilder();
+/**
+ * Check the proof of work of the connected proof-of-work blocks in the block
+ * index, which loading trusts. Each verified scrypt hash is recorded in the
+ * block tree database, so later runs only compare it with the target.
+ */
+void ThreadPoWVerifier();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -795,6 +979,8 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Write the block index to a snapshot file for a fast next startup. Call after FlushStateToDisk. */
+void WriteBlockIndexSnapshot();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 /** Prune block files up to a given height */
@@ -811,6 +997,14 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const
                         bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced = NULL,
                         bool fOverrideMempoolLimit=false, const CAmount nAbsurdFee=0);
 
+/** (try to) add transactions to memory pool, in order, taking cs_main once for all of them.
+ *  vState and vfMissingInputs receive the outcome for each transaction. The input scripts of
+ *  each transaction are checked on the script check threads, the mempool is trimmed once at
+ *  the end, and SyncTransaction is sent for the accepted transactions once all are processed.
+ *  Returns the number of transactions accepted. **/
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, std::vector<CValidationState>& vState,
+                                     std::vector<bool>& vfMissingInputs, bool fLimitFree, const CAmount nAbsurdFee=0);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -845,13 +1039,22 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
  */
 int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& inputs, int flags);
 
+/** Initialize the script execution cache, to be called once like InitSignatureCache */
+void InitScriptExecutionCache();
+/** Memory taken by the script execution cache, which is allocated whole at startup */
+size_t GetScriptExecutionCacheMemoryUsage();
+
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
  * instead of being performed inline.
+ * Transactions whose scripts all passed with the same flags before are found in the script
+ * execution cache and not run again; cacheFullScriptStore adds them to it, when the scripts are
+ * run inline, and otherwise a hit is erased from the cache as it is not needed again.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata,
+                 std::vector<CScriptCheck> *pvChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -911,9 +1114,43 @@ bool SequenceLocks(const CTransaction &tx, int flags, std::vector<int>* prevHeig
  */
 bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp = NULL, bool useExistingLockPoints = false);
 
+/**
+ * Closure running the context-free CheckBlock() of blocks that are about to
+ * be connected, so that block signatures, merkle roots and transaction
+ * sanity checks of the next blocks are verified in parallel ahead of the
+ * serial ConnectBlock. The scrypt hashes of the proof-of-work blocks among
+ * them are computed in one batch. On success a block is marked fChecked.
+ * Runs on the script check threads, wrapped in a CScriptCheck.
+ */
+class CBlockCheck
+{
+private:
+    std::vector<const CBlock*> vpblock;
+    const Consensus::Params *pparams;
+
+public:
+    CBlockCheck(): pparams(0) {}
+    CBlockCheck(const Consensus::Params& paramsIn) : pparams(&paramsIn) { }
+
+    void Add(const CBlock& block) {
+        vpblock.push_back(&block);
+    }
+    size_t size() const { return vpblock.size(); }
+
+    bool operator()();
+
+    void swap(CBlockCheck &check) {
+        vpblock.swap(check.vpblock);
+        std::swap(pparams, check.pparams);
+    }
+};
+
 /**
  * Closure representing one script verification
  * Note that this stores references to the spending transaction 
+ * Without a spending transaction it instead verifies the signature of a
+ * proof-of-stake block, or runs a CBlockCheck, so that these run on the
+ * script check threads too.
  */
 class CScriptCheck
 {
@@ -926,12 +1163,22 @@ private:
     bool cacheStore;
     ScriptError error;
     PrecomputedTransactionData *txdata;
+    CPubKey pubkeyBlock;
+    uint256 hashBlock;
+    std::vector<unsigned char> vchBlockSig;
+    CBlockCheck blockcheck;
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
+    CScriptCheck(const CPubKey& pubkeyBlockIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vchBlockSigIn) :
+        amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0),
+        pubkeyBlock(pubkeyBlockIn), hashBlock(hashBlockIn), vchBlockSig(vchBlockSigIn) { }
+    //! Takes over the blocks of blockcheckIn
+    explicit CScriptCheck(CBlockCheck& blockcheckIn) :
+        amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0) { blockcheck.swap(blockcheckIn); }
 
     bool operator()();
 
@@ -944,21 +1191,66 @@ public:
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
         std::swap(txdata, check.txdata);
+        std::swap(pubkeyBlock, check.pubkeyBlock);
+        std::swap(hashBlock, check.hashBlock);
+        vchBlockSig.swap(check.vchBlockSig);
+        blockcheck.swap(check.blockcheck);
     }
 
     ScriptError GetScriptError() const { return error; }
 };
 
-bool GetTimestampIndex(const unsigned int& high, const unsigned int& low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& hashes);
+/**
+ * Logical timestamps of the active chain above the genesis block, by height. They strictly increase
+ * along a chain, so an active-only timestamp range is a binary search, with
+ * no database reads. Brought up to date with the chain on each query.
+ */
+class CChainTimestampIndex
+{
+private:
+    std::vector<std::pair<const CBlockIndex*, unsigned int> > vBlocks;
+
+public:
+    //! Drop blocks no longer in chain and add the new ones (cs_main must be held for chainActive)
+    void Sync(const CChain& chain);
+    //! Blocks with low <= logical timestamp < high, oldest first, after *pkeyAfter if given and at most nLimit of them if nonzero
+    void Find(unsigned int high, unsigned int low, std::vector<std::pair<uint256, unsigned int> >& hashes,
+              size_t nLimit = 0, const CTimestampIndexKey* pkeyAfter = NULL) const;
+    size_t size() const { return vBlocks.size(); }
+};
+
+/** Hashes and logical timestamps of the blocks with low <= logical timestamp < high, in timestamp order; a page
+ *  of at most nLimit of them if nonzero, starting after the one pkeyAfter names */
+bool GetTimestampIndex(const unsigned int& high, const unsigned int& low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> >& hashes,
+                       size_t nLimit = 0, const CTimestampIndexKey* pkeyAfter = NULL);
 bool GetSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value);
+/** GetSpentIndex() for many outputs: one mempool pass and one sweep of the index; values[i] is null where keys[i] is unspent or unknown */
+bool GetSpentIndexes(const std::vector<CSpentIndexKey>& keys, std::vector<CSpentIndexValue>& values);
+/** Address index type and hash of a script, as ConnectBlock assigns them; type 0 if it has none */
+void GetIndexAddress(const CScript& script, int& type, uint160& hashBytes);
 bool GetAddressIndex(uint160 addressHash, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start = 0, int end = 0);
+bool ScanAddressIndex(const std::vector<std::pair<uint160, int> >& addresses, int start, int end,
+                      const CAddressIndexKey* pkeyAfter, boost::function<bool(const CAddressIndexKey&, CAmount)> fn);
 bool GetAddressUnspent(uint160 addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+bool GetAddressUnspent(const std::vector<std::pair<uint160, int> >& addresses, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+bool GetAddressBalances(const std::vector<std::pair<uint160, int> >& addresses, std::vector<CAddressBalance>& balances);
 
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block at pos as the bytes stored on disk, which are its serialization with witness data */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
+/** Read the undo data of pindex, which has some once it has been connected; false if it has none */
+bool ReadBlockUndoFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
+/**
+ * Whether the stored bytes of the block at pindex are also its serialization
+ * under nSerializeFlags: always with witness data, and without it for
+ * blocks connected before segwit activation, which cannot carry any.
+ */
+bool IsRawBlockSerialization(const CBlockIndex* pindex, int nSerializeFlags, const Consensus::Params& params);
 bool ReadFromDisk(CMutableTransaction& tx, CDiskTxPos& txindex, CBlockTreeDB& txdb, COutPoint prevout);
 bool ReadFromDisk(CMutableTransaction& tx, CDiskTxPos& txindex);
 /** Functions for validating blocks and updating the block tree */
@@ -973,17 +1265,27 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev, int64_t nAdjustedTime);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+struct CBlockConnectStats;
+
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
- *  can fail if those validity checks fail (among other reasons). */
+ *  can fail if those validity checks fail (among other reasons). pdelta, if
+ *  given, receives the change the block makes to the UTXO set totals, and
+ *  pstats the input count and the time taken by each phase. */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
-                  const CChainParams& chainparams, bool fJustCheck = false);
+                  const CChainParams& chainparams, bool fJustCheck = false, CCoinsTotals* pdelta = NULL, CBlockConnectStats* pstats = NULL);
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. pdelta is as for ConnectBlock. */
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, const CBlockUndo* pblockundo = NULL, CCoinsTotals* pdelta = NULL);
+
+/** Running totals of the UTXO set at the tip and the tip's hash; false if not known (requires cs_main) */
+bool GetCoinsTipTotals(CCoinsTotals& totals, uint256& hashBlock);
+
+/** Keep running totals from ones counted at hashBlock, unless the tip has moved on since (requires cs_main) */
+void SetCoinsTipTotals(const CCoinsTotals& totals, const uint256& hashBlock);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
@@ -1000,7 +1302,10 @@ void UpdateUncommittedBlockStructures(CBlock& block, const CBlockIndex* pindexPr
 /** Produce the necessary coinbase commitment for a block (modifies the hash, don't call for mined blocks). */
 std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBlockIndex* pindexPrev, const Consensus::Params& consensusParams);
 uint64_t GetCoinAgeByTime(int64_t timespan, int64_t nValue  );
-bool GetCoinAge(const CTransaction& tx,  uint64_t& nCoinAge);
+/** Coin age of tx given the coins its inputs spend (spent entries are skipped), confirmed on the chain of pindexPrev */
+bool GetCoinAge(const CTransaction& tx, const std::vector<Coin>& vCoins, const CBlockIndex* pindexPrev, uint64_t& nCoinAge);
+/** Coin age of tx from the UTXO set of the active chain */
+bool GetCoinAge(const CTransaction& tx, uint64_t& nCoinAge);
 /** RAII wrapper for VerifyDB: Verify consistency of the block and coin databases */
 class CVerifyDB {
 public:
@@ -1009,9 +1314,133 @@ public:
     bool VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview, int nCheckLevel, int nCheckDepth);
 };
 
+/**
+ * -checkblocksbackground: verify the last nCheckDepth blocks of the active
+ * chain, oldest first, at low CPU and I/O priority and without holding
+ * cs_main while reading. Levels above 2 need the coins of the tip and are
+ * left to the startup check. The last block verified is recorded in the
+ * block tree database, so a later run only checks the blocks after it.
+ */
+void ThreadVerifyDB(const CChainParams& chainparams, int nCheckLevel, int nCheckDepth);
+
+/** Microseconds spent in each phase of connecting blocks since startup, as logged under -debug=bench */
+struct CBlockConnectTimes
+{
+    //! ConnectBlock: sanity checks, fork checks, transaction connection, script verification, index writes, callbacks
+    int64_t nCheck;
+    int64_t nForks;
+    int64_t nConnect;
+    int64_t nVerify;
+    int64_t nIndex;
+    int64_t nCallbacks;
+    //! ConnectTip: block read, ConnectBlock, coins cache flush, chainstate write, postprocessing, and all of it
+    int64_t nReadFromDisk;
+    int64_t nConnectTotal;
+    int64_t nFlush;
+    int64_t nChainState;
+    int64_t nPostConnect;
+    int64_t nTotal;
+};
+
+CBlockConnectTimes GetBlockConnectTimes();
+
+/** Number of recently connected blocks whose CBlockConnectStats are kept */
+static const unsigned int BLOCK_CONNECT_STATS_SIZE = 1000;
+
+/** How long one block took to connect to the active chain, phase by phase as in CBlockConnectTimes, in microseconds */
+struct CBlockConnectStats
+{
+    uint256 hash;
+    int nHeight;
+    //! When it was connected
+    int64_t nTime;
+    unsigned int nTx;
+    unsigned int nInputs;
+    int64_t nTimeCheck;
+    int64_t nTimeForks;
+    int64_t nTimeConnect;
+    int64_t nTimeVerify;
+    int64_t nTimeIndex;
+    int64_t nTimeCallbacks;
+    int64_t nTimeReadFromDisk;
+    int64_t nTimeConnectTotal;
+    int64_t nTimeFlush;
+    int64_t nTimeChainState;
+    int64_t nTimePostConnect;
+    int64_t nTimeTotal;
+    //! Coin lookups of the block that pcoinsTip answered from memory, and those it passed to the database
+    uint64_t nCacheHits;
+    uint64_t nCacheMisses;
+
+    CBlockConnectStats() { SetNull(); }
+
+    void SetNull()
+    {
+        hash.SetNull();
+        nHeight = -1;
+        nTime = 0;
+        nTx = nInputs = 0;
+        nTimeCheck = nTimeForks = nTimeConnect = nTimeVerify = nTimeIndex = nTimeCallbacks = 0;
+        nTimeReadFromDisk = nTimeConnectTotal = nTimeFlush = nTimeChainState = nTimePostConnect = nTimeTotal = 0;
+        nCacheHits = nCacheMisses = 0;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(hash);
+        READWRITE(nHeight);
+        READWRITE(nTime);
+        READWRITE(nTx);
+        READWRITE(nInputs);
+        READWRITE(nTimeCheck);
+        READWRITE(nTimeForks);
+        READWRITE(nTimeConnect);
+        READWRITE(nTimeVerify);
+        READWRITE(nTimeIndex);
+        READWRITE(nTimeCallbacks);
+        READWRITE(nTimeReadFromDisk);
+        READWRITE(nTimeConnectTotal);
+        READWRITE(nTimeFlush);
+        READWRITE(nTimeChainState);
+        READWRITE(nTimePostConnect);
+        READWRITE(nTimeTotal);
+        READWRITE(nCacheHits);
+        READWRITE(nCacheMisses);
+    }
+};
+
+/** The last nCount (at most BLOCK_CONNECT_STATS_SIZE) blocks connected, oldest first */
+std::vector<CBlockConnectStats> GetRecentBlockConnectStats(size_t nCount);
+/** Those of the block hash, if it is among them */
+bool GetBlockConnectStats(const uint256& hash, CBlockConnectStats& stats);
+
 /** Find the last common block between the parameter chain and a locator. */
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator);
 
+/**
+ * The tips of the block tree: the blocks nothing builds on, and the tip of
+ * chainActive. Each comes with the block its branch forks from chainActive
+ * at, which is itself for the active tip. cs_main must be held.
+ */
+std::vector<std::pair<const CBlockIndex*, const CBlockIndex*> > GetChainTips();
+
+/**
+ * The block index entry of hash, or NULL. Unlike mapBlockIndex it may be used
+ * without cs_main, for the fields that do not change once a block is linked
+ * into the tree (header, height, pprev, pskip, chain work); the others, like
+ * nStatus, still need cs_main.
+ */
+CBlockIndex* LookupBlockIndex(const uint256& hash);
+
+/** Memory taken by the block index: mapBlockIndex, its entries and the sets of entries kept beside it. Requires cs_main. */
+size_t GetBlockIndexMemoryUsage();
+
+/** FindForkInGlobalIndex for a chain snapshot, without cs_main */
+const CBlockIndex* FindForkInSnapshot(const CChainSnapshot& chain, const CBlockLocator& locator);
+
 /** Mark a block as precious and reorganize. */
 bool PreciousBlock(CValidationState& state, const CChainParams& params, CBlockIndex *pindex);
 
@@ -1021,15 +1450,44 @@ bool InvalidateBlock(CValidationState& state, const CChainParams& chainparams, C
 /** Remove invalidity status from a block and its descendants. */
 bool ResetBlockFailureFlags(CBlockIndex *pindex);
 
+/** Whether a UTXO snapshot can be loaded, setting strError if not (requires cs_main) */
+bool CanLoadUTXOSnapshot(std::string& strError);
+
+/**
+ * Make pindexBase the tip of a chainstate that had only genesis connected
+ * and now holds the coins of a snapshot at pindexBase, setting the index
+ * entries of its ancestors from vBlocks. Flushes everything to disk.
+ */
+bool ActivateUTXOSnapshot(CBlockIndex* pindexBase, const std::vector<CSnapshotBlockInfo>& vBlocks, std::string& strError);
+
+/**
+ * Bring the block index, chainActive and the caches in front of the
+ * databases up to date on a replica after its primary's batches were
+ * replayed (see replication.h). setBlockIndexChanged holds the block index
+ * entries the batches wrote. If the best block changed, pindexNewTip and
+ * pindexFork are set for the tip notifications, which the caller sends
+ * after releasing cs_main.
+ */
+bool UpdateReplicaState(const std::set<uint256>& setBlockIndexChanged, CBlockIndex*& pindexNewTip, const CBlockIndex*& pindexFork);
+
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database under pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Global variable that points to the input lookahead between pcoinsTip and the database, if enabled */
+extern CCoinsViewPrefetch *pcoinsprefetch;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the explorer indexes database (protected by cs_main) */
+extern CIndexesDB *pindexesdb;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -1065,7 +1523,5 @@ void DumpMempool();
 /** Load the mempool from disk. */
 bool LoadMempool();
 
-bool TransactionGetCoinAge(CTransaction& transaction, uint64_t& nCoinAge);
-
 
 #endif // BITCOIN_VALIDATION_H
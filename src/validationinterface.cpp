@@ -5,48 +5,221 @@
 
 #include "validationinterface.h"
 
+#include "primitives/block.h"
+#include "scheduler.h"
+
+#include <boost/thread.hpp>
+
+struct MainSignalsInstance {
+    boost::signals2::signal<void (const CBlockIndex *, const CBlockIndex *, bool fInitialDownload)> UpdatedBlockTip;
+    boost::signals2::signal<void (const CTransaction &, const CBlockIndex *pindex, int posInBlock)> SyncTransaction;
+    boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
+    boost::signals2::signal<void (const CBlockLocator &)> SetBestChain;
+    boost::signals2::signal<void (const uint256 &)> Inventory;
+    boost::signals2::signal<void (int64_t nBestBlockTime, CConnman* connman)> Broadcast;
+    boost::signals2::signal<void (const CBlock&, const CValidationState&)> BlockChecked;
+    boost::signals2::signal<void (boost::shared_ptr<CReserveScript>&)> ScriptForMining;
+    boost::signals2::signal<void (const uint256 &)> BlockFound;
+    boost::signals2::signal<void (const CBlockIndex *, const std::shared_ptr<const CBlock>&)> NewPoWValidBlock;
+    boost::signals2::signal<void (const std::shared_ptr<const CBlock>&, const CBlockIndex *)> BlockConnected;
+    boost::signals2::signal<void (const std::shared_ptr<const CBlock>&)> BlockDisconnected;
+
+    //! Delivers the queued events; NULL while they are delivered synchronously
+    std::unique_ptr<CSerialSchedulerClient> pcallbacks;
+
+    /** Run func on the queue if there is one, right away otherwise */
+    void Enqueue(CScheduler::Function func)
+    {
+        if (pcallbacks)
+            pcallbacks->AddToProcessQueue(func);
+        else
+            func();
+    }
+};
+
 static CMainSignals g_signals;
 
+CMainSignals::CMainSignals() : m_internals(new MainSignalsInstance()) {}
+
+CMainSignals::~CMainSignals() {}
+
+void CMainSignals::RegisterBackgroundSignalScheduler(CScheduler& scheduler)
+{
+    assert(!m_internals->pcallbacks);
+    m_internals->pcallbacks.reset(new CSerialSchedulerClient(&scheduler));
+}
+
+void CMainSignals::UnregisterBackgroundSignalScheduler()
+{
+    m_internals->pcallbacks.reset();
+}
+
+void CMainSignals::FlushBackgroundCallbacks()
+{
+    if (m_internals->pcallbacks)
+        m_internals->pcallbacks->EmptyQueue();
+}
+
+size_t CMainSignals::CallbacksPending()
+{
+    if (!m_internals->pcallbacks)
+        return 0;
+    return m_internals->pcallbacks->CallbacksPending();
+}
+
 CMainSignals& GetMainSignals()
 {
     return g_signals;
 }
 
+void CMainSignals::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    MainSignalsInstance* internals = m_internals.get();
+    internals->Enqueue([internals, pindexNew, pindexFork, fInitialDownload] {
+        internals->UpdatedBlockTip(pindexNew, pindexFork, fInitialDownload);
+    });
+}
+
+void CMainSignals::SyncTransaction(const CTransactionRef &ptx, const CBlockIndex *pindex, int posInBlock)
+{
+    MainSignalsInstance* internals = m_internals.get();
+    internals->Enqueue([internals, ptx, pindex, posInBlock] {
+        internals->SyncTransaction(*ptx, pindex, posInBlock);
+    });
+}
+
+void CMainSignals::UpdatedTransaction(const uint256 &hash)
+{
+    MainSignalsInstance* internals = m_internals.get();
+    internals->Enqueue([internals, hash] {
+        internals->UpdatedTransaction(hash);
+    });
+}
+
+void CMainSignals::SetBestChain(const CBlockLocator &locator)
+{
+    MainSignalsInstance* internals = m_internals.get();
+    internals->Enqueue([internals, locator] {
+        internals->SetBestChain(locator);
+    });
+}
+
+void CMainSignals::Inventory(const uint256 &hash)
+{
+    m_internals->Inventory(hash);
+}
+
+void CMainSignals::Broadcast(int64_t nBestBlockTime, CConnman* connman)
+{
+    m_internals->Broadcast(nBestBlockTime, connman);
+}
+
+void CMainSignals::BlockChecked(const CBlock& block, const CValidationState& state)
+{
+    m_internals->BlockChecked(block, state);
+}
+
+void CMainSignals::ScriptForMining(boost::shared_ptr<CReserveScript>& script)
+{
+    m_internals->ScriptForMining(script);
+}
+
+void CMainSignals::BlockFound(const uint256 &hash)
+{
+    m_internals->BlockFound(hash);
+}
+
+void CMainSignals::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& block)
+{
+    m_internals->NewPoWValidBlock(pindex, block);
+}
+
+void CMainSignals::BlockConnected(const std::shared_ptr<const CBlock>& block, const CBlockIndex *pindex)
+{
+    MainSignalsInstance* internals = m_internals.get();
+    internals->Enqueue([internals, block, pindex] {
+        internals->BlockConnected(block, pindex);
+    });
+}
+
+void CMainSignals::BlockDisconnected(const std::shared_ptr<const CBlock>& block)
+{
+    MainSignalsInstance* internals = m_internals.get();
+    internals->Enqueue([internals, block] {
+        internals->BlockDisconnected(block);
+    });
+}
+
+/** Set once the function queued by SyncWithValidationInterfaceQueue ran */
+struct CQueueMarker {
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fReached;
+
+    CQueueMarker() : fReached(false) {}
+};
+
+void SyncWithValidationInterfaceQueue()
+{
+    CSerialSchedulerClient* pcallbacks = g_signals.m_internals->pcallbacks.get();
+    if (!pcallbacks)
+        return;
+    // Shared, as a caller giving up on a scheduler that stopped leaves the marker queued
+    std::shared_ptr<CQueueMarker> marker = std::make_shared<CQueueMarker>();
+    pcallbacks->AddToProcessQueue([marker] {
+        boost::unique_lock<boost::mutex> lock(marker->mutex);
+        marker->fReached = true;
+        marker->cond.notify_all();
+    });
+    boost::unique_lock<boost::mutex> lock(marker->mutex);
+    while (!marker->fReached) {
+        // Nothing will deliver the queue once the scheduler thread stopped at shutdown
+        if (!marker->cond.timed_wait(lock, boost::posix_time::milliseconds(100)) && !pcallbacks->IsServiced())
+            return;
+    }
+}
+
 void RegisterValidationInterface(CValidationInterface* pwalletIn) {
-    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2, _3));
-    g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
-    g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
-    g_signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
-    g_signals.Inventory.connect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
-    g_signals.Broadcast.connect(boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn, _1, _2));
-    g_signals.BlockChecked.connect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
-    g_signals.ScriptForMining.connect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
-    g_signals.BlockFound.connect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
-    g_signals.NewPoWValidBlock.connect(boost::bind(&CValidationInterface::NewPoWValidBlock, pwalletIn, _1, _2));
+    g_signals.m_internals->UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2, _3));
+    g_signals.m_internals->SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
+    g_signals.m_internals->UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
+    g_signals.m_internals->SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
+    g_signals.m_internals->Inventory.connect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
+    g_signals.m_internals->Broadcast.connect(boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn, _1, _2));
+    g_signals.m_internals->BlockChecked.connect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
+    g_signals.m_internals->ScriptForMining.connect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
+    g_signals.m_internals->BlockFound.connect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
+    g_signals.m_internals->NewPoWValidBlock.connect(boost::bind(&CValidationInterface::NewPoWValidBlock, pwalletIn, _1, _2));
+    g_signals.m_internals->BlockConnected.connect(boost::bind(&CValidationInterface::BlockConnected, pwalletIn, _1, _2));
+    g_signals.m_internals->BlockDisconnected.connect(boost::bind(&CValidationInterface::BlockDisconnected, pwalletIn, _1));
 }
 
 void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
-    g_signals.BlockFound.disconnect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
-    g_signals.ScriptForMining.disconnect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
-    g_signals.BlockChecked.disconnect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
-    g_signals.Broadcast.disconnect(boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn, _1, _2));
-    g_signals.Inventory.disconnect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
-    g_signals.SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
-    g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
-    g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
-    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2, _3));
-    g_signals.NewPoWValidBlock.disconnect(boost::bind(&CValidationInterface::NewPoWValidBlock, pwalletIn, _1, _2));
+    g_signals.m_internals->BlockFound.disconnect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
+    g_signals.m_internals->ScriptForMining.disconnect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
+    g_signals.m_internals->BlockChecked.disconnect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
+    g_signals.m_internals->Broadcast.disconnect(boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn, _1, _2));
+    g_signals.m_internals->Inventory.disconnect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
+    g_signals.m_internals->SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
+    g_signals.m_internals->UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
+    g_signals.m_internals->SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2, _3));
+    g_signals.m_internals->UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1, _2, _3));
+    g_signals.m_internals->NewPoWValidBlock.disconnect(boost::bind(&CValidationInterface::NewPoWValidBlock, pwalletIn, _1, _2));
+    g_signals.m_internals->BlockConnected.disconnect(boost::bind(&CValidationInterface::BlockConnected, pwalletIn, _1, _2));
+    g_signals.m_internals->BlockDisconnected.disconnect(boost::bind(&CValidationInterface::BlockDisconnected, pwalletIn, _1));
 }
 
 void UnregisterAllValidationInterfaces() {
-    g_signals.BlockFound.disconnect_all_slots();
-    g_signals.ScriptForMining.disconnect_all_slots();
-    g_signals.BlockChecked.disconnect_all_slots();
-    g_signals.Broadcast.disconnect_all_slots();
-    g_signals.Inventory.disconnect_all_slots();
-    g_signals.SetBestChain.disconnect_all_slots();
-    g_signals.UpdatedTransaction.disconnect_all_slots();
-    g_signals.SyncTransaction.disconnect_all_slots();
-    g_signals.UpdatedBlockTip.disconnect_all_slots();
-    g_signals.NewPoWValidBlock.disconnect_all_slots();
+    g_signals.m_internals->BlockFound.disconnect_all_slots();
+    g_signals.m_internals->ScriptForMining.disconnect_all_slots();
+    g_signals.m_internals->BlockChecked.disconnect_all_slots();
+    g_signals.m_internals->Broadcast.disconnect_all_slots();
+    g_signals.m_internals->Inventory.disconnect_all_slots();
+    g_signals.m_internals->SetBestChain.disconnect_all_slots();
+    g_signals.m_internals->UpdatedTransaction.disconnect_all_slots();
+    g_signals.m_internals->SyncTransaction.disconnect_all_slots();
+    g_signals.m_internals->UpdatedBlockTip.disconnect_all_slots();
+    g_signals.m_internals->NewPoWValidBlock.disconnect_all_slots();
+    g_signals.m_internals->BlockConnected.disconnect_all_slots();
+    g_signals.m_internals->BlockDisconnected.disconnect_all_slots();
 }
@@ -6,6 +6,8 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include "primitives/transaction.h" // CTransactionRef
+
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 #include <memory>
@@ -13,9 +15,9 @@
 class CBlock;
 class CBlockIndex;
 struct CBlockLocator;
-class CBlockIndex;
 class CConnman;
 class CReserveScript;
+class CScheduler;
 class CTransaction;
 class CValidationInterface;
 class CValidationState;
@@ -29,6 +31,12 @@ void RegisterValidationInterface(CValidationInterface* pwalletIn);
 void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
+/**
+ * Wait until every event queued so far has been delivered, so that e.g. the
+ * wallet has seen the blocks and transactions validated before the call.
+ * Must not be called with cs_main held, the listeners may need it.
+ */
+void SyncWithValidationInterfaceQueue();
 
 class CValidationInterface {
 protected:
@@ -42,14 +50,44 @@ protected:
     virtual void GetScriptForMining(boost::shared_ptr<CReserveScript>&) {};
     virtual void ResetRequestCount(const uint256 &hash) {};
     virtual void NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& block) {};
+    virtual void BlockConnected(const std::shared_ptr<const CBlock>& block, const CBlockIndex *pindex) {}
+    virtual void BlockDisconnected(const std::shared_ptr<const CBlock>& block) {}
     friend void ::RegisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterAllValidationInterfaces();
 };
 
-struct CMainSignals {
-    /** Notifies listeners of updated block chain tip */
-    boost::signals2::signal<void (const CBlockIndex *, const CBlockIndex *, bool fInitialDownload)> UpdatedBlockTip;
+struct MainSignalsInstance;
+
+/**
+ * Dispatches validation events to the registered interfaces. Once a
+ * scheduler is registered, the events marked "queued" below are delivered
+ * in order on its thread instead of on the one that called them, usually
+ * under cs_main; the others still run before the call returns.
+ */
+class CMainSignals {
+private:
+    std::unique_ptr<MainSignalsInstance> m_internals;
+
+    friend void ::RegisterValidationInterface(CValidationInterface*);
+    friend void ::UnregisterValidationInterface(CValidationInterface*);
+    friend void ::UnregisterAllValidationInterfaces();
+    friend void ::SyncWithValidationInterfaceQueue();
+
+public:
+    CMainSignals();
+    ~CMainSignals();
+
+    /** Deliver the queued events on the threads servicing scheduler from now on */
+    void RegisterBackgroundSignalScheduler(CScheduler& scheduler);
+    /** Go back to delivering every event synchronously; call FlushBackgroundCallbacks first */
+    void UnregisterBackgroundSignalScheduler();
+    /** Deliver what is still queued on this thread, once the scheduler is no longer serviced */
+    void FlushBackgroundCallbacks();
+    size_t CallbacksPending();
+
+    /** Notifies listeners of updated block chain tip (queued) */
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload);
     /** A posInBlock value for SyncTransaction calls for tranactions not
      * included in connected blocks such as transactions removed from mempool,
      * accepted to mempool or appearing in disconnected blocks.*/
@@ -59,26 +97,30 @@ struct CMainSignals {
      * transaction is included in a connected block, and without block data when
      * transaction was accepted to mempool, removed from mempool (only when
      * removal was due to conflict from connected block), or appeared in a
-     * disconnected block.*/
-    boost::signals2::signal<void (const CTransaction &, const CBlockIndex *pindex, int posInBlock)> SyncTransaction;
-    /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
-    boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
-    /** Notifies listeners of a new active block chain. */
-    boost::signals2::signal<void (const CBlockLocator &)> SetBestChain;
+     * disconnected block. (queued) */
+    void SyncTransaction(const CTransactionRef &ptx, const CBlockIndex *pindex, int posInBlock);
+    /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). (queued) */
+    void UpdatedTransaction(const uint256 &hash);
+    /** Notifies listeners of a new active block chain. (queued) */
+    void SetBestChain(const CBlockLocator &locator);
     /** Notifies listeners about an inventory item being seen on the network. */
-    boost::signals2::signal<void (const uint256 &)> Inventory;
+    void Inventory(const uint256 &hash);
     /** Tells listeners to broadcast their data. */
-    boost::signals2::signal<void (int64_t nBestBlockTime, CConnman* connman)> Broadcast;
+    void Broadcast(int64_t nBestBlockTime, CConnman* connman);
     /** Notifies listeners of a block validation result */
-    boost::signals2::signal<void (const CBlock&, const CValidationState&)> BlockChecked;
+    void BlockChecked(const CBlock&, const CValidationState&);
     /** Notifies listeners that a key for mining is required (coinbase) */
-    boost::signals2::signal<void (boost::shared_ptr<CReserveScript>&)> ScriptForMining;
+    void ScriptForMining(boost::shared_ptr<CReserveScript>&);
     /** Notifies listeners that a block has been successfully mined */
-    boost::signals2::signal<void (const uint256 &)> BlockFound;
+    void BlockFound(const uint256 &hash);
     /**
      * Notifies listeners that a block which builds directly on our current tip
      * has been received and connected to the headers tree, though not validated yet */
-    boost::signals2::signal<void (const CBlockIndex *, const std::shared_ptr<const CBlock>&)> NewPoWValidBlock;
+    void NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& block);
+    /** Notifies listeners of a block connected to the active chain, after its transactions went through SyncTransaction (queued) */
+    void BlockConnected(const std::shared_ptr<const CBlock>& block, const CBlockIndex *pindex);
+    /** Notifies listeners of a block disconnected from the active chain (queued) */
+    void BlockDisconnected(const std::shared_ptr<const CBlock>& block);
 };
 
 CMainSignals& GetMainSignals();
@@ -162,6 +162,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapDecryptedKeys.clear();
     }
     
     NotifyStatusChanged(this);
@@ -250,14 +251,33 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
         {
+            if (fCacheKeys && !vMasterKey.empty()) {
+                KeyMap::const_iterator it = mapDecryptedKeys.find(address);
+                if (it != mapDecryptedKeys.end()) {
+                    keyOut = it->second;
+                    return true;
+                }
+            }
             const CPubKey &vchPubKey = (*mi).second.first;
             const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            return DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut);
+            if (!DecryptKey(vMasterKey, vchCryptedSecret, vchPubKey, keyOut))
+                return false;
+            if (fCacheKeys)
+                mapDecryptedKeys[address] = keyOut;
+            return true;
         }
     }
     return false;
 }
 
+void CCryptoKeyStore::SetCacheKeys(bool fCache)
+{
+    LOCK(cs_KeyStore);
+    fCacheKeys = fCache;
+    if (!fCacheKeys)
+        mapDecryptedKeys.clear();
+}
+
 bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const
 {
     {
@@ -126,6 +126,11 @@ private:
     //! keeps track of whether Unlock has run a thorough check before
     bool fDecryptionThoroughlyChecked;
 
+    //! keys GetKey decrypted since the last Unlock, kept while fCacheKeys;
+    //! CKey holds its secret in locked memory
+    bool fCacheKeys;
+    mutable KeyMap mapDecryptedKeys;
+
 protected:
     bool SetCrypted();
 
@@ -135,10 +140,14 @@ protected:
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
 public:
-    CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
+    CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false), fCacheKeys(false)
     {
     }
 
+    //! Keep keys decrypted once while unlocked, so that a staking wallet
+    //! signs each coinstake and block without decrypting the kernel's key
+    void SetCacheKeys(bool fCache);
+
     bool IsCrypted() const
     {
         return fUseCrypto;
@@ -51,7 +51,7 @@ void CDBEnv::Reset()
     fMockDb = false;
 }
 
-CDBEnv::CDBEnv() : dbenv(NULL)
+CDBEnv::CDBEnv() : dbenv(NULL), nFlushBatchDepth(0), fFlushDeferred(false)
 {
     Reset();
 }
@@ -236,6 +236,33 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
     dbenv->lsn_reset(strFile.c_str(), 0);
 }
 
+void CDBEnv::BeginFlushBatch()
+{
+    LOCK(cs_db);
+    nFlushBatchDepth++;
+}
+
+void CDBEnv::EndFlushBatch()
+{
+    {
+        LOCK(cs_db);
+        assert(nFlushBatchDepth > 0);
+        if (--nFlushBatchDepth > 0 || !fFlushDeferred)
+            return;
+        fFlushDeferred = false;
+    }
+    dbenv->txn_checkpoint(0, 0, 0);
+}
+
+bool CDBEnv::DeferFlush()
+{
+    LOCK(cs_db);
+    if (nFlushBatchDepth == 0)
+        return false;
+    fFlushDeferred = true;
+    return true;
+}
+
 
 CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
 {
@@ -305,6 +332,8 @@ void CDB::Flush()
     unsigned int nMinutes = 0;
     if (fReadOnly)
         nMinutes = 1;
+    else if (bitdb.DeferFlush())
+        return;
 
     bitdb.dbenv->txn_checkpoint(nMinutes ? GetArg("-dblogsize", DEFAULT_WALLET_DBLOGSIZE) * 1024 : 0, nMinutes, 0);
 }
@@ -39,6 +39,9 @@ public:
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    //! Nesting depth of open flush batches, and whether one deferred a checkpoint
+    int nFlushBatchDepth;
+    bool fFlushDeferred;
 
     CDBEnv();
     ~CDBEnv();
@@ -72,6 +75,16 @@ public:
     void Flush(bool fShutdown);
     void CheckpointLSN(const std::string& strFile);
 
+    /**
+     * While a flush batch is open, closing a writable CDB handle does not
+     * checkpoint the log; ending the outermost batch checkpoints once for
+     * all of them. Writes are still logged as they happen.
+     */
+    void BeginFlushBatch();
+    void EndFlushBatch();
+    //! Whether a checkpoint should wait for the end of the open batch
+    bool DeferFlush();
+
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
@@ -87,6 +100,18 @@ public:
 
 extern CDBEnv bitdb;
 
+/** RAII scope of a flush batch of the wallet environment */
+class CDBFlushBatch
+{
+public:
+    CDBFlushBatch() { bitdb.BeginFlushBatch(); }
+    ~CDBFlushBatch() { bitdb.EndFlushBatch(); }
+
+private:
+    CDBFlushBatch(const CDBFlushBatch&);
+    void operator=(const CDBFlushBatch&);
+};
+
 
 /** RAII class that provides access to a Berkeley database */
 class CDB
@@ -155,6 +155,18 @@ UniValue importprivkey(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+/**
+ * Find the history of newly watched scripts: in the address index with
+ * -watchonlyindex, and otherwise, or if the index does not cover them, by
+ * a rescan.
+ */
+static void RescanForScripts(const std::vector<CScript>& vScripts)
+{
+    if (!pwalletMain->UseIndexForWatchOnly() || !pwalletMain->AddIndexedTransactions(vScripts, 0))
+        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+    pwalletMain->ReacceptWalletTransactions();
+}
+
 void ImportAddress(const CBitcoinAddress& address, const string& strLabel);
 void ImportScript(const CScript& script, const string& strLabel, bool isRedeemScript)
 {
@@ -234,23 +246,26 @@ UniValue importaddress(const JSONRPCRequest& request)
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
+    std::vector<CScript> vScripts;
     CBitcoinAddress address(request.params[0].get_str());
     if (address.IsValid()) {
         if (fP2SH)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Cannot use the p2sh flag with an address - use a script instead");
         ImportAddress(address, strLabel);
+        vScripts.push_back(GetScriptForDestination(address.Get()));
     } else if (IsHex(request.params[0].get_str())) {
         std::vector<unsigned char> data(ParseHex(request.params[0].get_str()));
-        ImportScript(CScript(data.begin(), data.end()), strLabel, fP2SH);
+        CScript script(data.begin(), data.end());
+        ImportScript(script, strLabel, fP2SH);
+        vScripts.push_back(script);
+        if (fP2SH)
+            vScripts.push_back(GetScriptForDestination(CScriptID(script)));
     } else {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid JBCoin address or script");
     }
 
     if (fRescan)
-    {
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+        RescanForScripts(vScripts);
 
     return NullUniValue;
 }
@@ -399,15 +414,62 @@ UniValue importpubkey(const JSONRPCRequest& request)
     ImportScript(GetScriptForRawPubKey(pubKey), strLabel, false);
 
     if (fRescan)
-    {
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+        RescanForScripts({GetScriptForDestination(pubKey.GetID()), GetScriptForRawPubKey(pubKey)});
 
     return NullUniValue;
 }
 
 
+/** Keys importwallet reads, derives and writes at a time, and importmulti requests per database transaction */
+static const unsigned int IMPORT_BATCH_KEYS = 1000;
+/** Most threads importwallet derives public keys on */
+static const int MAX_IMPORT_THREADS = 8;
+
+namespace {
+/** A key line of a wallet dump */
+struct CDumpedKey
+{
+    std::string strLine;
+    bool fValid;
+    CKey key;
+    CPubKey pubkey;
+    int64_t nTime;
+    std::string strLabel;
+    bool fLabel;
+
+    CDumpedKey() : fValid(false), nTime(0), fLabel(true) {}
+};
+}
+
+/** Parse a key line and derive its public key, which needs no lock */
+static void ParseDumpedKey(CDumpedKey& dumped)
+{
+    std::vector<std::string> vstr;
+    boost::split(vstr, dumped.strLine, boost::is_any_of(" "));
+    if (vstr.size() < 2)
+        return;
+    CBitcoinSecret vchSecret;
+    if (!vchSecret.SetString(vstr[0]))
+        return;
+    dumped.key = vchSecret.GetKey();
+    dumped.pubkey = dumped.key.GetPubKey();
+    assert(dumped.key.VerifyPubKey(dumped.pubkey));
+    dumped.nTime = DecodeDumpTime(vstr[1]);
+    for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
+        if (boost::algorithm::starts_with(vstr[nStr], "#"))
+            break;
+        if (vstr[nStr] == "change=1")
+            dumped.fLabel = false;
+        if (vstr[nStr] == "reserve=1")
+            dumped.fLabel = false;
+        if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
+            dumped.strLabel = DecodeDumpString(vstr[nStr].substr(6));
+            dumped.fLabel = true;
+        }
+    }
+    dumped.fValid = true;
+}
+
 UniValue importwallet(const JSONRPCRequest& request)
 {
     if (!EnsureWalletIsAvailable(request.fHelp))
@@ -432,8 +494,11 @@ UniValue importwallet(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_WALLET_ERROR, "Importing wallets is disabled in pruned mode");
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
+    // One log checkpoint for all the imported keys rather than one per write
+    CDBFlushBatch batch;
 
     EnsureWalletIsUnlocked();
+    CWalletWriteBatch writeBatch(pwalletMain);
 
     ifstream file;
     file.open(request.params[0].get_str().c_str(), std::ios::in | std::ios::ate);
@@ -447,56 +512,51 @@ UniValue importwallet(const JSONRPCRequest& request)
     int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
     file.seekg(0, file.beg);
 
+    // The dump is read a batch of keys at a time: their public keys are
+    // derived on several threads, then they are added to the wallet in one
+    // database transaction
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_IMPORT_THREADS));
+    unsigned int nImported = 0;
+    std::vector<CDumpedKey> vKeys;
     pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
     while (file.good()) {
         pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
-        std::string line;
-        std::getline(file, line);
-        if (line.empty() || line[0] == '#')
-            continue;
-
-        std::vector<std::string> vstr;
-        boost::split(vstr, line, boost::is_any_of(" "));
-        if (vstr.size() < 2)
-            continue;
-        CBitcoinSecret vchSecret;
-        if (!vchSecret.SetString(vstr[0]))
-            continue;
-        CKey key = vchSecret.GetKey();
-        CPubKey pubkey = key.GetPubKey();
-        assert(key.VerifyPubKey(pubkey));
-        CKeyID keyid = pubkey.GetID();
-        if (pwalletMain->HaveKey(keyid)) {
-            LogPrintf("Skipping import of %s (key already present)\n", CBitcoinAddress(keyid).ToString());
-            continue;
+        vKeys.clear();
+        while (vKeys.size() < IMPORT_BATCH_KEYS && file.good()) {
+            std::string line;
+            std::getline(file, line);
+            if (line.empty() || line[0] == '#')
+                continue;
+            vKeys.emplace_back();
+            vKeys.back().strLine.swap(line);
         }
-        int64_t nTime = DecodeDumpTime(vstr[1]);
-        std::string strLabel;
-        bool fLabel = true;
-        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
-            if (boost::algorithm::starts_with(vstr[nStr], "#"))
-                break;
-            if (vstr[nStr] == "change=1")
-                fLabel = false;
-            if (vstr[nStr] == "reserve=1")
-                fLabel = false;
-            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-                strLabel = DecodeDumpString(vstr[nStr].substr(6));
-                fLabel = true;
+        ParallelFor(vKeys.size(), nThreads, [&vKeys](size_t i) { ParseDumpedKey(vKeys[i]); });
+
+        for (const CDumpedKey& dumped : vKeys) {
+            if (!dumped.fValid)
+                continue;
+            CKeyID keyid = dumped.pubkey.GetID();
+            if (pwalletMain->HaveKey(keyid)) {
+                LogPrintf("Skipping import of %s (key already present)\n", CBitcoinAddress(keyid).ToString());
+                continue;
             }
+            // Set before adding the key, so it is written with its time
+            pwalletMain->mapKeyMetadata[keyid].nCreateTime = dumped.nTime;
+            if (!pwalletMain->AddKeyPubKey(dumped.key, dumped.pubkey)) {
+                fGood = false;
+                continue;
+            }
+            if (dumped.fLabel)
+                pwalletMain->SetAddressBook(keyid, dumped.strLabel, "receive");
+            nTimeBegin = std::min(nTimeBegin, dumped.nTime);
+            nImported++;
         }
-        LogPrintf("Importing %s...\n", CBitcoinAddress(keyid).ToString());
-        if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
+        if (!writeBatch.Flush())
             fGood = false;
-            continue;
-        }
-        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
-        if (fLabel)
-            pwalletMain->SetAddressBook(keyid, strLabel, "receive");
-        nTimeBegin = std::min(nTimeBegin, nTime);
     }
     file.close();
     pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+    LogPrintf("Imported %u keys on %d threads\n", nImported, nThreads);
     pwalletMain->UpdateTimeFirstKey(nTimeBegin);
 
     CBlockIndex *pindex = chainActive.FindEarliestAtLeast(nTimeBegin - 7200);
@@ -1031,7 +1091,9 @@ UniValue importmulti(const JSONRPCRequest& mainRequest)
     }
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
+    CDBFlushBatch batch;
     EnsureWalletIsUnlocked();
+    CWalletWriteBatch writeBatch(pwalletMain);
 
     // Verify all timestamps are present before importing any keys.
     const int64_t now = chainActive.Tip() ? chainActive.Tip()->GetMedianTimePast() : 0;
@@ -1055,6 +1117,8 @@ UniValue importmulti(const JSONRPCRequest& mainRequest)
         const int64_t timestamp = std::max(GetImportTimestamp(data, now), minimumTimestamp);
         const UniValue result = ProcessImport(data, timestamp);
         response.push_back(result);
+        if (response.size() % IMPORT_BATCH_KEYS == 0)
+            writeBatch.Flush();
 
         if (!fRescan) {
             continue;
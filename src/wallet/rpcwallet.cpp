@@ -721,6 +721,15 @@ UniValue getbalance(const JSONRPCRequest& request)
         // TxIns spending from the wallet. This also has fewer restrictions on
         // which unconfirmed transactions are considered trusted.
         CAmount nBalance = 0;
+        std::vector<CIndexedOutput> vIndexed;
+        if ((filter & ISMINE_WATCH_ONLY) && pwalletMain->GetIndexedWatchOnlyOutputs(vIndexed)) {
+            // The watch-only part is what the address index has unspent
+            filter = ISMINE_SPENDABLE;
+            for (const CIndexedOutput& output : vIndexed) {
+                if (output.nHeight >= 0 && !output.fImmature && chainActive.Height() - output.nHeight + 1 >= nMinDepth)
+                    nBalance += output.txout.nValue;
+            }
+        }
         for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
@@ -1464,15 +1473,18 @@ UniValue listtransactions(const JSONRPCRequest& request)
     if (!EnsureWalletIsAvailable(request.fHelp))
         return NullUniValue;
 
-    if (request.fHelp || request.params.size() > 4)
+    if (request.fHelp || request.params.size() > 5)
         throw runtime_error(
-            "listtransactions ( \"account\" count skip include_watchonly)\n"
+            "listtransactions ( \"account\" count skip include_watchonly cursor )\n"
             "\nReturns up to 'count' most recent transactions skipping the first 'from' transactions for account 'account'.\n"
             "\nArguments:\n"
             "1. \"account\"    (string, optional) DEPRECATED. The account name. Should be \"*\".\n"
             "2. count          (numeric, optional, default=10) The number of transactions to return\n"
             "3. skip           (numeric, optional, default=0) The number of transactions to skip\n"
             "4. include_watchonly (bool, optional, default=false) Include transactions to watch-only addresses (see 'importaddress')\n"
+            "5. cursor         (numeric, optional) Only list entries older than this, the \"cursor\" of the oldest entry a previous call\n"
+            "                  returned. A page never ends partway through a transaction, so it may hold more than 'count' entries.\n"
+            "                  Cannot be combined with skip.\n"
             "\nResult:\n"
             "[\n"
             "  {\n"
@@ -1512,6 +1524,7 @@ UniValue listtransactions(const JSONRPCRequest& request)
             "                                                     may be unknown for unconfirmed transactions not in the mempool\n"
             "    \"abandoned\": xxx          (bool) 'true' if the transaction has been abandoned (inputs are respendable). Only available for the \n"
             "                                         'send' category of transactions.\n"
+            "    \"cursor\": n               (numeric) The position of the entry in the wallet's transaction order, for the cursor argument\n"
             "  }\n"
             "]\n"
 
@@ -1520,6 +1533,8 @@ UniValue listtransactions(const JSONRPCRequest& request)
             + HelpExampleCli("listtransactions", "") +
             "\nList transactions 100 to 120\n"
             + HelpExampleCli("listtransactions", "\"*\" 20 100") +
+            "\nList the 20 transactions before the entry with cursor 1234\n"
+            + HelpExampleCli("listtransactions", "\"*\" 20 0 false 1234") +
             "\nAs a json rpc call\n"
             + HelpExampleRpc("listtransactions", "\"*\", 20, 100")
         );
@@ -1544,25 +1559,40 @@ UniValue listtransactions(const JSONRPCRequest& request)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+    bool fCursor = request.params.size() > 4 && !request.params[4].isNull();
+    int64_t nCursor = fCursor ? request.params[4].get_int64() : 0;
+    if (fCursor && nFrom > 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot combine skip and cursor");
 
     UniValue ret(UniValue::VARR);
 
     const CWallet::TxItems & txOrdered = pwalletMain->wtxOrdered;
+    CWallet::TxItems::const_reverse_iterator itStart = fCursor ? CWallet::TxItems::const_reverse_iterator(txOrdered.lower_bound(nCursor)) : txOrdered.rbegin();
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = itStart; it != txOrdered.rend(); ++it)
     {
+        UniValue entries(UniValue::VARR);
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
+            ListTransactions(*pwtx, strAccount, 0, true, entries, filter);
         CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+            AcentryToJSON(*pacentry, strAccount, entries);
+        for (size_t i = 0; i < entries.size(); i++) {
+            UniValue entry = entries[i];
+            entry.push_back(Pair("cursor", (*it).first));
+            ret.push_back(entry);
+        }
 
         if ((int)ret.size() >= (nCount+nFrom)) break;
     }
     // ret is newest to oldest
 
+    // Keep the last transaction of a cursor page whole
+    if (fCursor && nCount > 0)
+        nCount = ret.size();
+
     if (nFrom > (int)ret.size())
         nFrom = ret.size();
     if ((nFrom + nCount) > (int)ret.size())
@@ -1754,12 +1784,13 @@ UniValue listsinceblock(const JSONRPCRequest& request)
 
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    // Only the transactions in later blocks or in none are visited
+    std::vector<const CWalletTx*> vtx;
+    pwalletMain->GetWalletTxsSince(pindex, vtx);
+    for (const CWalletTx* pwtx : vtx)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        if (depth == -1 || pwtx->GetDepthInMainChain() < depth)
+            ListTransactions(*pwtx, "*", 0, true, transactions, filter);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1893,6 +1924,43 @@ UniValue abandontransaction(const JSONRPCRequest& request)
 }
 
 
+UniValue removeorphanedtxs(const JSONRPCRequest& request)
+{
+    if (!EnsureWalletIsAvailable(request.fHelp))
+        return NullUniValue;
+
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "removeorphanedtxs ( include_abandoned )\n"
+            "\nDeletes the coinstakes and coinbases of blocks that are not in the active chain, and the conflicted\n"
+            "transactions, together with their unconfirmed in-wallet descendants, from the wallet.\n"
+            "This runs without a restart or rescan and writes the wallet file once.\n"
+            "\nArguments:\n"
+            "1. include_abandoned    (boolean, optional, default=false) Also delete abandoned transactions\n"
+            "\nResult:\n"
+            "[                       (json array) The ids of the deleted transactions\n"
+            "  \"txid\",\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("removeorphanedtxs", "")
+            + HelpExampleCli("removeorphanedtxs", "true")
+            + HelpExampleRpc("removeorphanedtxs", "")
+        );
+
+    bool fIncludeAbandoned = request.params.size() > 0 && request.params[0].get_bool();
+
+    std::vector<uint256> vRemoved;
+    if (!pwalletMain->RemoveOrphanedTxs(fIncludeAbandoned, vRemoved))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Could not write the wallet file, nothing was deleted");
+
+    UniValue result(UniValue::VARR);
+    for (const uint256& hash : vRemoved)
+        result.push_back(hash.GetHex());
+    return result;
+}
+
+
 UniValue backupwallet(const JSONRPCRequest& request)
 {
     if (!EnsureWalletIsAvailable(request.fHelp))
@@ -2488,6 +2556,16 @@ UniValue listunspent(const JSONRPCRequest& request)
     assert(pwalletMain != NULL);
     LOCK2(cs_main, pwalletMain->cs_wallet);
     pwalletMain->AvailableCoins(vecOutputs, !include_unsafe, NULL, true);
+
+    // With -watchonlyindex, the watch-only outputs come from the address index instead
+    std::vector<CIndexedOutput> vIndexed;
+    bool fIndexed = pwalletMain->GetIndexedWatchOnlyOutputs(vIndexed);
+    if (fIndexed) {
+        vecOutputs.erase(std::remove_if(vecOutputs.begin(), vecOutputs.end(), [](const COutput& out) {
+            return (pwalletMain->IsMine(out.tx->tx->vout[out.i]) & ISMINE_WATCH_ONLY) != 0;
+        }), vecOutputs.end());
+    }
+
     BOOST_FOREACH(const COutput& out, vecOutputs) {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
             continue;
@@ -2525,6 +2603,49 @@ UniValue listunspent(const JSONRPCRequest& request)
         results.push_back(entry);
     }
 
+    for (const CIndexedOutput& output : vIndexed) {
+        int nDepth = output.nHeight < 0 ? 0 : chainActive.Height() - output.nHeight + 1;
+        if (nDepth < nMinDepth || nDepth > nMaxDepth || output.fImmature)
+            continue;
+        // Unconfirmed outputs of watched scripts are from others, so never safe
+        if (nDepth == 0 && !include_unsafe)
+            continue;
+        if (pwalletMain->IsLockedCoin(output.outpoint.hash, output.outpoint.n))
+            continue;
+
+        CTxDestination address;
+        const CScript& scriptPubKey = output.txout.scriptPubKey;
+        bool fValidAddress = ExtractDestination(scriptPubKey, address);
+
+        if (setAddress.size() && (!fValidAddress || !setAddress.count(address)))
+            continue;
+
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("txid", output.outpoint.hash.GetHex()));
+        entry.push_back(Pair("vout", (int)output.outpoint.n));
+
+        if (fValidAddress) {
+            entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
+
+            if (pwalletMain->mapAddressBook.count(address))
+                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address].name));
+
+            if (scriptPubKey.IsPayToScriptHash()) {
+                const CScriptID& hash = boost::get<CScriptID>(address);
+                CScript redeemScript;
+                if (pwalletMain->GetCScript(hash, redeemScript))
+                    entry.push_back(Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
+            }
+        }
+
+        entry.push_back(Pair("scriptPubKey", HexStr(scriptPubKey.begin(), scriptPubKey.end())));
+        entry.push_back(Pair("amount", ValueFromAmount(output.txout.nValue)));
+        entry.push_back(Pair("confirmations", nDepth));
+        entry.push_back(Pair("spendable", false));
+        entry.push_back(Pair("solvable", (pwalletMain->IsMine(output.txout) & ISMINE_WATCH_SOLVABLE) != 0));
+        results.push_back(entry);
+    }
+
     return results;
 }
 
@@ -2946,6 +3067,7 @@ UniValue bumpfee(const JSONRPCRequest& request)
 
     // sign the new tx
     CTransaction txNewConst(tx);
+    PrecomputedTransactionData txdata(txNewConst);
     int nIn = 0;
     for (auto& input : tx.vin) {
         std::map<uint256, CWalletTx>::const_iterator mi = pwalletMain->mapWallet.find(input.prevout.hash);
@@ -2953,7 +3075,7 @@ UniValue bumpfee(const JSONRPCRequest& request)
         const CScript& scriptPubKey = mi->second.tx->vout[input.prevout.n].scriptPubKey;
         const CAmount& amount = mi->second.tx->vout[input.prevout.n].nValue;
         SignatureData sigdata;
-        if (!ProduceSignature(TransactionSignatureCreator(pwalletMain, &txNewConst, nIn, amount, SIGHASH_ALL), scriptPubKey, sigdata)) {
+        if (!ProduceSignature(TransactionSignatureCreator(pwalletMain, &txNewConst, nIn, amount, SIGHASH_ALL, &txdata), scriptPubKey, sigdata)) {
             throw JSONRPCError(RPC_WALLET_ERROR, "Can't sign transaction.");
         }
         UpdateTransaction(tx, nIn, sigdata);
@@ -3011,56 +3133,57 @@ extern UniValue removeprunedfunds(const JSONRPCRequest& request);
 extern UniValue importmulti(const JSONRPCRequest& request);
 
 static const CRPCCommand commands[] =
-{ //  category              name                        actor (function)           okSafeMode
-    //  --------------------- ------------------------    -----------------------    ----------
-    { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false,  {"hexstring","options"} },
-    { "hidden",             "resendwallettransactions", &resendwallettransactions, true,   {} },
-    { "wallet",             "abandontransaction",       &abandontransaction,       false,  {"txid"} },
-    { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true,   {"nrequired","keys","account"} },
-    { "wallet",             "addwitnessaddress",        &addwitnessaddress,        true,   {"address"} },
-    { "wallet",             "backupwallet",             &backupwallet,             true,   {"destination"} },
-    { "wallet",             "bumpfee",                  &bumpfee,                  true,   {"txid", "options"} },
-    { "wallet",             "dumpprivkey",              &dumpprivkey,              true,   {"address"}  },
-    { "wallet",             "dumpwallet",               &dumpwallet,               true,   {"filename"} },
-    { "wallet",             "encryptwallet",            &encryptwallet,            true,   {"passphrase"} },
-    { "wallet",             "getaccountaddress",        &getaccountaddress,        true,   {"account"} },
-    { "wallet",             "getaccount",               &getaccount,               true,   {"address"} },
-    { "wallet",             "getaddressesbyaccount",    &getaddressesbyaccount,    true,   {"account"} },
-    { "wallet",             "getbalance",               &getbalance,               false,  {"account","minconf","include_watchonly"} },
-    { "wallet",             "getnewaddress",            &getnewaddress,            true,   {"account"} },
-    { "wallet",             "getrawchangeaddress",      &getrawchangeaddress,      true,   {} },
-    { "wallet",             "getreceivedbyaccount",     &getreceivedbyaccount,     false,  {"account","minconf"} },
-    { "wallet",             "getreceivedbyaddress",     &getreceivedbyaddress,     false,  {"address","minconf"} },
-    { "wallet",             "gettransaction",           &gettransaction,           false,  {"txid","include_watchonly"} },
-    { "wallet",             "getunconfirmedbalance",    &getunconfirmedbalance,    false,  {} },
-    { "wallet",             "getwalletinfo",            &getwalletinfo,            false,  {} },
-    { "wallet",             "importmulti",              &importmulti,              true,   {"requests","options"} },
-    { "wallet",             "importprivkey",            &importprivkey,            true,   {"privkey","label","rescan"} },
-    { "wallet",             "importwallet",             &importwallet,             true,   {"filename"} },
-    { "wallet",             "importaddress",            &importaddress,            true,   {"address","label","rescan","p2sh"} },
-    { "wallet",             "importprunedfunds",        &importprunedfunds,        true,   {"rawtransaction","txoutproof"} },
-    { "wallet",             "importpubkey",             &importpubkey,             true,   {"pubkey","label","rescan"} },
-    { "wallet",             "keypoolrefill",            &keypoolrefill,            true,   {"newsize"} },
-    { "wallet",             "listaccounts",             &listaccounts,             false,  {"minconf","include_watchonly"} },
-    { "wallet",             "listaddressgroupings",     &listaddressgroupings,     false,  {} },
-    { "wallet",             "listlockunspent",          &listlockunspent,          false,  {} },
-    { "wallet",             "listreceivedbyaccount",    &listreceivedbyaccount,    false,  {"minconf","include_empty","include_watchonly"} },
-    { "wallet",             "listreceivedbyaddress",    &listreceivedbyaddress,    false,  {"minconf","include_empty","include_watchonly"} },
-    { "wallet",             "listsinceblock",           &listsinceblock,           false,  {"blockhash","target_confirmations","include_watchonly"} },
-    { "wallet",             "listtransactions",         &listtransactions,         false,  {"account","count","skip","include_watchonly"} },
-    { "wallet",             "listunspent",              &listunspent,              false,  {"minconf","maxconf","addresses","include_unsafe"} },
-    { "wallet",             "lockunspent",              &lockunspent,              true,   {"unlock","transactions"} },
-    { "wallet",             "move",                     &movecmd,                  false,  {"fromaccount","toaccount","amount","minconf","comment"} },
-    { "wallet",             "sendfrom",                 &sendfrom,                 false,  {"fromaccount","toaddress","amount","minconf","comment","comment_to"} },
-    { "wallet",             "sendmany",                 &sendmany,                 false,  {"fromaccount","amounts","minconf","comment","subtractfeefrom"} },
-    { "wallet",             "sendtoaddress",            &sendtoaddress,            false,  {"address","amount","comment","comment_to","subtractfeefromamount"} },
-    { "wallet",             "setaccount",               &setaccount,               true,   {"address","account"} },
-    { "wallet",             "settxfee",                 &settxfee,                 true,   {"amount"} },
-    { "wallet",             "signmessage",              &signmessage,              true,   {"address","message"} },
-    { "wallet",             "walletlock",               &walletlock,               true,   {} },
-    { "wallet",             "walletpassphrasechange",   &walletpassphrasechange,   true,   {"oldpassphrase","newpassphrase"} },
-    { "wallet",             "walletpassphrase",         &walletpassphrase,         true,   {"passphrase","timeout"} },
-    { "wallet",             "removeprunedfunds",        &removeprunedfunds,        true,   {"txid"} },
+{ //  category              name                        actor (function)           okSafeMode argNames  parallelSafe
+    //  --------------------- ------------------------    -----------------------    ---------- --------  ------------
+    { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false,  {"hexstring","options"}, false },
+    { "hidden",             "resendwallettransactions", &resendwallettransactions, true,   {}, false },
+    { "wallet",             "abandontransaction",       &abandontransaction,       false,  {"txid"}, false },
+    { "wallet",             "removeorphanedtxs",        &removeorphanedtxs,        false,  {"include_abandoned"}, false },
+    { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true,   {"nrequired","keys","account"}, false },
+    { "wallet",             "addwitnessaddress",        &addwitnessaddress,        true,   {"address"}, false },
+    { "wallet",             "backupwallet",             &backupwallet,             true,   {"destination"}, false },
+    { "wallet",             "bumpfee",                  &bumpfee,                  true,   {"txid", "options"}, false },
+    { "wallet",             "dumpprivkey",              &dumpprivkey,              true,   {"address"}, false  },
+    { "wallet",             "dumpwallet",               &dumpwallet,               true,   {"filename"}, false },
+    { "wallet",             "encryptwallet",            &encryptwallet,            true,   {"passphrase"}, false },
+    { "wallet",             "getaccountaddress",        &getaccountaddress,        true,   {"account"}, false },
+    { "wallet",             "getaccount",               &getaccount,               true,   {"address"}, false },
+    { "wallet",             "getaddressesbyaccount",    &getaddressesbyaccount,    true,   {"account"}, false },
+    { "wallet",             "getbalance",               &getbalance,               false,  {"account","minconf","include_watchonly"}, false },
+    { "wallet",             "getnewaddress",            &getnewaddress,            true,   {"account"}, false },
+    { "wallet",             "getrawchangeaddress",      &getrawchangeaddress,      true,   {}, false },
+    { "wallet",             "getreceivedbyaccount",     &getreceivedbyaccount,     false,  {"account","minconf"}, false },
+    { "wallet",             "getreceivedbyaddress",     &getreceivedbyaddress,     false,  {"address","minconf"}, false },
+    { "wallet",             "gettransaction",           &gettransaction,           false,  {"txid","include_watchonly"}, false },
+    { "wallet",             "getunconfirmedbalance",    &getunconfirmedbalance,    false,  {}, false },
+    { "wallet",             "getwalletinfo",            &getwalletinfo,            false,  {}, false },
+    { "wallet",             "importmulti",              &importmulti,              true,   {"requests","options"}, false },
+    { "wallet",             "importprivkey",            &importprivkey,            true,   {"privkey","label","rescan"}, false },
+    { "wallet",             "importwallet",             &importwallet,             true,   {"filename"}, false },
+    { "wallet",             "importaddress",            &importaddress,            true,   {"address","label","rescan","p2sh"}, false },
+    { "wallet",             "importprunedfunds",        &importprunedfunds,        true,   {"rawtransaction","txoutproof"}, false },
+    { "wallet",             "importpubkey",             &importpubkey,             true,   {"pubkey","label","rescan"}, false },
+    { "wallet",             "keypoolrefill",            &keypoolrefill,            true,   {"newsize"}, false },
+    { "wallet",             "listaccounts",             &listaccounts,             false,  {"minconf","include_watchonly"}, false },
+    { "wallet",             "listaddressgroupings",     &listaddressgroupings,     false,  {}, false },
+    { "wallet",             "listlockunspent",          &listlockunspent,          false,  {}, false },
+    { "wallet",             "listreceivedbyaccount",    &listreceivedbyaccount,    false,  {"minconf","include_empty","include_watchonly"}, false },
+    { "wallet",             "listreceivedbyaddress",    &listreceivedbyaddress,    false,  {"minconf","include_empty","include_watchonly"}, false },
+    { "wallet",             "listsinceblock",           &listsinceblock,           false,  {"blockhash","target_confirmations","include_watchonly"}, false },
+    { "wallet",             "listtransactions",         &listtransactions,         false,  {"account","count","skip","include_watchonly","cursor"}, false },
+    { "wallet",             "listunspent",              &listunspent,              false,  {"minconf","maxconf","addresses","include_unsafe"}, false },
+    { "wallet",             "lockunspent",              &lockunspent,              true,   {"unlock","transactions"}, false },
+    { "wallet",             "move",                     &movecmd,                  false,  {"fromaccount","toaccount","amount","minconf","comment"}, false },
+    { "wallet",             "sendfrom",                 &sendfrom,                 false,  {"fromaccount","toaddress","amount","minconf","comment","comment_to"}, false },
+    { "wallet",             "sendmany",                 &sendmany,                 false,  {"fromaccount","amounts","minconf","comment","subtractfeefrom"}, false },
+    { "wallet",             "sendtoaddress",            &sendtoaddress,            false,  {"address","amount","comment","comment_to","subtractfeefromamount"}, false },
+    { "wallet",             "setaccount",               &setaccount,               true,   {"address","account"}, false },
+    { "wallet",             "settxfee",                 &settxfee,                 true,   {"amount"}, false },
+    { "wallet",             "signmessage",              &signmessage,              true,   {"address","message"}, false },
+    { "wallet",             "walletlock",               &walletlock,               true,   {}, false },
+    { "wallet",             "walletpassphrasechange",   &walletpassphrasechange,   true,   {"oldpassphrase","newpassphrase"}, false },
+    { "wallet",             "walletpassphrase",         &walletpassphrase,         true,   {"passphrase","timeout"}, false },
+    { "wallet",             "removeprunedfunds",        &removeprunedfunds,        true,   {"txid"}, false },
 };
 
 void RegisterWalletRPCCommands(CRPCTable &t)
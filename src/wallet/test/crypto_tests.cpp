@@ -235,4 +235,40 @@ BOOST_AUTO_TEST_CASE(decrypt) {
     }
 }
 
+/** Exposes unlocking for the key cache test */
+class TestKeyStore : public CCryptoKeyStore
+{
+public:
+    using CCryptoKeyStore::EncryptKeys;
+    using CCryptoKeyStore::Unlock;
+};
+
+BOOST_AUTO_TEST_CASE(key_cache) {
+    TestKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID id = key.GetPubKey().GetID();
+    BOOST_CHECK(keystore.AddKeyPubKey(key, key.GetPubKey()));
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetStrongRandBytes(&vMasterKey[0], vMasterKey.size());
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    keystore.SetCacheKeys(true);
+
+    CKey keyOut;
+    BOOST_CHECK(!keystore.GetKey(id, keyOut));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+    for (int i = 0; i < 2; i++) {
+        BOOST_CHECK(keystore.GetKey(id, keyOut));
+        BOOST_CHECK(keyOut == key);
+    }
+
+    // Locking drops the decrypted keys
+    BOOST_CHECK(keystore.Lock());
+    BOOST_CHECK(!keystore.GetKey(id, keyOut));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+    keystore.SetCacheKeys(false);
+    BOOST_CHECK(keystore.GetKey(id, keyOut));
+    BOOST_CHECK(keyOut == key);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
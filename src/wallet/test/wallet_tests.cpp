@@ -490,4 +490,161 @@ BOOST_FIXTURE_TEST_CASE(importwallet_rescan, TestChain100Setup)
     ::pwalletMain = pwalletMainBackup;
 }
 
+BOOST_AUTO_TEST_CASE(wallet_flush_batch)
+{
+    // Outside a batch checkpoints happen at once
+    BOOST_CHECK(!bitdb.DeferFlush());
+    {
+        CDBFlushBatch batch;
+        {
+            CDBFlushBatch inner;
+            CWalletDB walletdb(pwalletMain->strWalletFile);
+            BOOST_CHECK(walletdb.WriteOrderPosNext(1));
+        }
+        // The closed handle left its checkpoint to the outer batch
+        BOOST_CHECK(bitdb.fFlushDeferred);
+        BOOST_CHECK_EQUAL(bitdb.nFlushBatchDepth, 1);
+    }
+    BOOST_CHECK(!bitdb.fFlushDeferred);
+    BOOST_CHECK_EQUAL(bitdb.nFlushBatchDepth, 0);
+    BOOST_CHECK(!bitdb.DeferFlush());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_topup_keypool)
+{
+    LOCK(pwalletMain->cs_wallet);
+    BOOST_CHECK(pwalletMain->SetHDMasterKey(pwalletMain->GenerateNewHDMasterKey()));
+
+    // More than one batch, each on several threads
+    unsigned int nTarget = KEYPOOL_TOPUP_BATCH + 200;
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetHDChain().nExternalChainCounter, nTarget + 1);
+
+    // The keys are the consecutive children of m/0'/0', as derived one by one
+    CKey masterKey;
+    BOOST_CHECK(pwalletMain->GetKey(pwalletMain->GetHDChain().masterKeyID, masterKey));
+    const uint32_t nHardened = 0x80000000;
+    CExtKey extKey, accountKey, chainKey;
+    extKey.SetMaster(masterKey.begin(), masterKey.size());
+    extKey.Derive(accountKey, nHardened);
+    accountKey.Derive(chainKey, nHardened);
+    for (uint32_t n : {0U, 1U, KEYPOOL_TOPUP_BATCH - 1, KEYPOOL_TOPUP_BATCH, nTarget}) {
+        CExtKey childKey;
+        chainKey.Derive(childKey, n | nHardened);
+        CKeyID keyID = childKey.key.GetPubKey().GetID();
+        BOOST_CHECK(pwalletMain->HaveKey(keyID));
+        BOOST_CHECK_EQUAL(pwalletMain->mapKeyMetadata[keyID].hdKeypath, "m/0'/0'/" + std::to_string(n) + "'");
+    }
+
+    // A key generated afterwards continues the chain
+    CPubKey pubkey = pwalletMain->GenerateNewKey();
+    BOOST_CHECK_EQUAL(pwalletMain->mapKeyMetadata[pubkey.GetID()].hdKeypath, "m/0'/0'/" + std::to_string(nTarget + 1) + "'");
+}
+
+BOOST_FIXTURE_TEST_CASE(wallet_txs_since, TestChain100Setup)
+{
+    LOCK(cs_main);
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+
+    // coinbaseTxns[i] is in block i + 1; the last one is left unconfirmed
+    std::vector<uint256> vHashes;
+    for (int nHeight : {11, 51, 91, 0}) {
+        CWalletTx wtx(&wallet, MakeTransactionRef(coinbaseTxns[nHeight > 0 ? nHeight - 1 : 99]));
+        if (nHeight > 0) {
+            wtx.hashBlock = chainActive[nHeight]->GetBlockHash();
+            wtx.nIndex = 0;
+        }
+        wallet.LoadToWallet(wtx);
+        vHashes.push_back(wtx.GetHash());
+    }
+
+    auto since = [&wallet](const CBlockIndex* pindex) {
+        std::vector<const CWalletTx*> vtx;
+        wallet.GetWalletTxsSince(pindex, vtx);
+        std::set<uint256> setHashes;
+        for (const CWalletTx* pwtx : vtx)
+            setHashes.insert(pwtx->GetHash());
+        return setHashes;
+    };
+
+    BOOST_CHECK(since(NULL) == std::set<uint256>(vHashes.begin(), vHashes.end()));
+    BOOST_CHECK(since(chainActive[50]) == std::set<uint256>({vHashes[1], vHashes[2], vHashes[3]}));
+    BOOST_CHECK(since(chainActive[51]) == std::set<uint256>({vHashes[2], vHashes[3]}));
+    BOOST_CHECK(since(chainActive.Tip()) == std::set<uint256>({vHashes[3]}));
+
+    // A transaction whose block leaves the active chain, or that confirms
+    // later, moves once it is marked dirty
+    CWalletTx& wtxOld = wallet.mapWallet[vHashes[0]];
+    wtxOld.hashBlock = uint256S("0123");
+    wtxOld.MarkDirty();
+    CWalletTx& wtxNew = wallet.mapWallet[vHashes[3]];
+    wtxNew.hashBlock = chainActive[60]->GetBlockHash();
+    wtxNew.nIndex = 1;
+    wtxNew.MarkDirty();
+    BOOST_CHECK(since(chainActive[70]) == std::set<uint256>({vHashes[0], vHashes[2]}));
+    BOOST_CHECK(since(chainActive[55]) == std::set<uint256>({vHashes[0], vHashes[2], vHashes[3]}));
+
+    // Abandoned transactions are always listed
+    wtxNew.setAbandoned();
+    wtxNew.MarkDirty();
+    BOOST_CHECK(since(chainActive.Tip()) == std::set<uint256>({vHashes[0], vHashes[3]}));
+}
+
+BOOST_FIXTURE_TEST_CASE(wallet_remove_orphaned, TestChain100Setup)
+{
+    LOCK(cs_main);
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+
+    auto spend = [](const CTransaction& txPrev) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+        mtx.vout.resize(1);
+        mtx.vout[0].nValue = txPrev.vout[0].nValue / 2;
+        return MakeTransactionRef(mtx);
+    };
+
+    // A confirmed coinbase, a coinbase of a block that left the chain, a
+    // conflicted transaction and its unconfirmed child, and an unconfirmed
+    // transaction
+    CWalletTx wtxConfirmed(&wallet, MakeTransactionRef(coinbaseTxns[10]));
+    wtxConfirmed.hashBlock = chainActive[11]->GetBlockHash();
+    wtxConfirmed.nIndex = 0;
+    CWalletTx wtxOrphan(&wallet, MakeTransactionRef(coinbaseTxns[20]));
+    wtxOrphan.hashBlock = uint256S("0123");
+    wtxOrphan.nIndex = 0;
+    CWalletTx wtxConflicted(&wallet, spend(coinbaseTxns[30]));
+    wtxConflicted.hashBlock = chainActive[40]->GetBlockHash();
+    wtxConflicted.nIndex = -1;
+    CWalletTx wtxChild(&wallet, spend(*wtxConflicted.tx));
+    CWalletTx wtxUnconfirmed(&wallet, spend(coinbaseTxns[10]));
+    for (const CWalletTx* pwtx : {&wtxConfirmed, &wtxOrphan, &wtxChild, &wtxConflicted, &wtxUnconfirmed})
+        wallet.LoadToWallet(*pwtx);
+    BOOST_CHECK(wallet.IsSpent(wtxConfirmed.GetHash(), 0));
+
+    std::vector<uint256> vRemoved;
+    BOOST_CHECK(wallet.RemoveOrphanedTxs(false, vRemoved));
+    std::set<uint256> setRemoved(vRemoved.begin(), vRemoved.end());
+    BOOST_CHECK(setRemoved == std::set<uint256>({wtxOrphan.GetHash(), wtxConflicted.GetHash(), wtxChild.GetHash()}));
+    BOOST_CHECK_EQUAL(wallet.mapWallet.size(), 2U);
+    BOOST_CHECK_EQUAL(wallet.wtxOrdered.size(), 2U);
+    BOOST_CHECK(wallet.IsSpent(wtxConfirmed.GetHash(), 0));
+
+    // Abandoned transactions only on request; what they spent is unspent again
+    wallet.mapWallet[wtxUnconfirmed.GetHash()].setAbandoned();
+    BOOST_CHECK(wallet.RemoveOrphanedTxs(false, vRemoved));
+    BOOST_CHECK(vRemoved.empty());
+    BOOST_CHECK(wallet.RemoveOrphanedTxs(true, vRemoved));
+    BOOST_CHECK(vRemoved == std::vector<uint256>(1, wtxUnconfirmed.GetHash()));
+    BOOST_CHECK_EQUAL(wallet.mapWallet.count(wtxConfirmed.GetHash()), 1U);
+    BOOST_CHECK_EQUAL(wallet.wtxOrdered.size(), 1U);
+
+    // Loading a removed transaction again works as before
+    wallet.LoadToWallet(wtxUnconfirmed);
+    BOOST_CHECK(wallet.IsSpent(wtxConfirmed.GetHash(), 0));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
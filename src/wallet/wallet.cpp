@@ -6,21 +6,29 @@
 #include "wallet/wallet.h"
 
 #include "base58.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "chain.h"
+#include "chainsnapshot.h"
 #include "wallet/coincontrol.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "key.h"
 #include "keystore.h"
 #include "validation.h"
 #include "net.h"
+#include "notifypipe.h"
 #include "policy/policy.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "script/sign.h"
+#include "threadplacement.h"
 #include "timedata.h"
+#include "trace.h"
+#include "txdb.h"
+#include "txintern.h"
 #include "txmempool.h"
 #include "util.h"
 #include "ui_interface.h"
@@ -29,6 +37,10 @@
 #include "script/interpreter.h"
 
 #include <assert.h>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <thread>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -37,26 +49,18 @@
 using namespace std;
 
 CWallet* pwalletMain = NULL;
+std::vector<CWallet*> vpwallets;
 /** Transaction fee set by the user */
 CFeeRate payTxFee(DEFAULT_TRANSACTION_FEE);
 unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
 bool bSpendZeroConfChange = DEFAULT_SPEND_ZEROCONF_CHANGE;
 bool fSendFreeTransactions = DEFAULT_SEND_FREE_TRANSACTIONS;
 bool fWalletRbf = DEFAULT_WALLET_RBF;
+bool fWatchOnlyIndex = DEFAULT_WATCHONLY_INDEX;
 
 const char * DEFAULT_WALLET_DAT = "wallet.dat";
 const uint32_t BIP32_HARDENED_KEY_LIMIT = 0x80000000;
 
-/**
- * min split tx 
- * 50만 이상의 tx 는 stake시 추가로 넣지 않는다.
- * 
- */
-static int64_t GetStakeCombineThreshold() { return 500000 * COIN; }
-/**
- *  100만 이하의 입력은 나누지 않는다.
- */
-static int64_t GetStakeSplitThreshold() { return 2 * GetStakeCombineThreshold(); }
 /**
  * Fees smaller than this (in satoshi) are considered zero fee (for transaction creation)
  * Override with -mintxfee
@@ -68,6 +72,16 @@ CFeeRate CWallet::minTxFee = CFeeRate(DEFAULT_TRANSACTION_MINFEE);
  * Override with -fallbackfee
  */
 CFeeRate CWallet::fallbackFee = CFeeRate(DEFAULT_FALLBACK_FEE);
+/**
+ * Outputs at least this large are not added as extra coinstake inputs.
+ * Override with -stakecombinethreshold
+ */
+CAmount CWallet::nStakeCombineThreshold = DEFAULT_STAKE_COMBINE_THRESHOLD;
+/**
+ * Coinstakes crediting at least this much are split into two outputs.
+ * Override with -stakesplitthreshold
+ */
+CAmount CWallet::nStakeSplitThreshold = DEFAULT_STAKE_SPLIT_THRESHOLD;
 
 const uint256 CMerkleTx::ABANDON_HASH(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
 CAmount nReserveBalance = 0;
@@ -125,22 +139,26 @@ CPubKey CWallet::GenerateNewKey()
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
 
+    AddGeneratedKey(secret, pubkey, metadata);
+    return pubkey;
+}
+
+void CWallet::AddGeneratedKey(const CKey& secret, const CPubKey& pubkey, const CKeyMetadata& metadata)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
     mapKeyMetadata[pubkey.GetID()] = metadata;
-    UpdateTimeFirstKey(nCreationTime);
+    UpdateTimeFirstKey(metadata.nCreateTime);
 
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error(std::string(__func__) + ": AddKey failed");
-    return pubkey;
 }
 
-void CWallet::DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret)
+void CWallet::DeriveExternalChainKey(CExtKey& externalChainChildKey) const
 {
     // for now we use a fixed keypath scheme of m/0'/0'/k
     CKey key;                      //master key seed (256bit)
     CExtKey masterKey;             //hd master key
     CExtKey accountKey;            //key at m/0'
-    CExtKey externalChainChildKey; //key at m/0'/0'
-    CExtKey childKey;              //key at m/0'/0'/<n>'
 
     // try to get the master key
     if (!GetKey(hdChain.masterKeyID, key))
@@ -154,6 +172,14 @@ void CWallet::DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret)
 
     // derive m/0'/0'
     accountKey.Derive(externalChainChildKey, BIP32_HARDENED_KEY_LIMIT);
+}
+
+void CWallet::DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret)
+{
+    CExtKey externalChainChildKey; //key at m/0'/0'
+    CExtKey childKey;              //key at m/0'/0'/<n>'
+
+    DeriveExternalChainKey(externalChainChildKey);
 
     // derive child key at next index, skip keys already known to the wallet
     do {
@@ -191,6 +217,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbBatch)
+            return pwalletdbBatch->WriteKey(pubkey,
+                                            secret.GetPrivKey(),
+                                            mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey,
                                                  secret.GetPrivKey(),
                                                  mapKeyMetadata[pubkey.GetID()]);
@@ -211,6 +241,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbBatch)
+            return pwalletdbBatch->WriteCryptedKey(vchPubKey,
+                                                   vchCryptedSecret,
+                                                   mapKeyMetadata[vchPubKey.GetID()]);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
                                                             vchCryptedSecret,
@@ -250,6 +284,9 @@ bool CWallet::AddCScript(const CScript& redeemScript)
         return false;
     if (!fFileBacked)
         return true;
+    LOCK(cs_wallet);
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteCScript(Hash160(redeemScript), redeemScript);
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
@@ -278,6 +315,9 @@ bool CWallet::AddWatchOnly(const CScript& dest)
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
+    LOCK(cs_wallet);
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteWatchOnly(dest, meta);
     return CWalletDB(strWalletFile).WriteWatchOnly(dest, meta);
 }
 
@@ -378,6 +418,16 @@ void CWallet::SetBestChain(const CBlockLocator& loc)
     walletdb.WriteBestBlock(loc);
 }
 
+void CWallet::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
+{
+    // The stake miner refreshes the weight on every search; this keeps it
+    // current for the staking status while it does not search
+    if (!fInitialDownload) {
+        nLastStakeWeight = GetStakeWeight();
+        UpdateStakingWeight();
+    }
+}
+
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
 {
     LOCK(cs_wallet); // nWalletVersion
@@ -452,6 +502,14 @@ void CWallet::Flush(bool shutdown)
     bitdb.Flush(shutdown);
 }
 
+/** Wallet files given with -stakewallet, which are loaded next to the main one only to stake */
+static std::vector<std::string> GetStakeWalletFiles()
+{
+    if (!mapMultiArgs.count("-stakewallet"))
+        return std::vector<std::string>();
+    return mapMultiArgs.at("-stakewallet");
+}
+
 bool CWallet::Verify()
 {
     if (GetBoolArg("-disablewallet", DEFAULT_DISABLE_WALLET))
@@ -459,13 +517,21 @@ bool CWallet::Verify()
 
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
     std::string walletFile = GetArg("-wallet", DEFAULT_WALLET_DAT);
+    std::vector<std::string> vWalletFiles(1, walletFile);
+    for (const std::string& strStakeWallet : GetStakeWalletFiles()) {
+        if (std::find(vWalletFiles.begin(), vWalletFiles.end(), strStakeWallet) != vWalletFiles.end())
+            return InitError(strprintf(_("Wallet %s is loaded more than once"), strStakeWallet));
+        vWalletFiles.push_back(strStakeWallet);
+    }
 
     LogPrintf("Using wallet %s\n", walletFile);
     uiInterface.InitMessage(_("Verifying wallet..."));
 
-    // Wallet file must be a plain filename without a directory
-    if (walletFile != boost::filesystem::basename(walletFile) + boost::filesystem::extension(walletFile))
-        return InitError(strprintf(_("Wallet %s resides outside data directory %s"), walletFile, GetDataDir().string()));
+    // Wallet files must be plain filenames without a directory
+    for (const std::string& strWalletFile : vWalletFiles) {
+        if (strWalletFile != boost::filesystem::basename(strWalletFile) + boost::filesystem::extension(strWalletFile))
+            return InitError(strprintf(_("Wallet %s resides outside data directory %s"), strWalletFile, GetDataDir().string()));
+    }
 
     if (!bitdb.Open(GetDataDir()))
     {
@@ -486,28 +552,30 @@ bool CWallet::Verify()
         }
     }
     
-    if (GetBoolArg("-salvagewallet", false))
-    {
-        // Recover readable keypairs:
-        if (!CWalletDB::Recover(bitdb, walletFile, true))
-            return false;
-    }
-    
-    if (boost::filesystem::exists(GetDataDir() / walletFile))
-    {
-        CDBEnv::VerifyResult r = bitdb.Verify(walletFile, CWalletDB::Recover);
-        if (r == CDBEnv::RECOVER_OK)
+    for (const std::string& strWalletFile : vWalletFiles) {
+        if (GetBoolArg("-salvagewallet", false))
         {
-            InitWarning(strprintf(_("Warning: Wallet file corrupt, data salvaged!"
-                                         " Original %s saved as %s in %s; if"
-                                         " your balance or transactions are incorrect you should"
-                                         " restore from a backup."),
-                walletFile, "wallet.{timestamp}.bak", GetDataDir()));
+            // Recover readable keypairs:
+            if (!CWalletDB::Recover(bitdb, strWalletFile, true))
+                return false;
+        }
+
+        if (boost::filesystem::exists(GetDataDir() / strWalletFile))
+        {
+            CDBEnv::VerifyResult r = bitdb.Verify(strWalletFile, CWalletDB::Recover);
+            if (r == CDBEnv::RECOVER_OK)
+            {
+                InitWarning(strprintf(_("Warning: Wallet file corrupt, data salvaged!"
+                                             " Original %s saved as %s in %s; if"
+                                             " your balance or transactions are incorrect you should"
+                                             " restore from a backup."),
+                    strWalletFile, "wallet.{timestamp}.bak", GetDataDir()));
+            }
+            if (r == CDBEnv::RECOVER_FAIL)
+                return InitError(strprintf(_("%s corrupt, salvage failed"), strWalletFile));
         }
-        if (r == CDBEnv::RECOVER_FAIL)
-            return InitError(strprintf(_("%s corrupt, salvage failed"), walletFile));
     }
-    
+
     return true;
 }
 
@@ -552,7 +620,7 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
  * Outpoint is spent if any non-conflicted transaction
  * spends it:
  */
-bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
+bool CWallet::IsSpent(const uint256& hash, unsigned int n, const CChainSnapshot* pchain) const
 {
     const COutPoint outpoint(hash, n);
     pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
@@ -563,7 +631,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
         const uint256& wtxid = it->second;
         std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
         if (mit != mapWallet.end()) {
-            int depth = mit->second.GetDepthInMainChain();
+            int depth = pchain ? mit->second.GetDepthInChain(*pchain) : mit->second.GetDepthInMainChain();
             if (depth > 0  || (depth == 0 && !mit->second.isAbandoned()))
                 return true; // Spent
         }
@@ -857,6 +925,11 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        // Rebuild the balance totals, unspent coins and transaction block
+        // index rather than tracking every transaction
+        fBalancesInit = false;
+        fUnspentCoinsInit = false;
+        fTxBlocksInit = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
@@ -995,6 +1068,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
     // Break debit/credit balance caches:
     wtx.MarkDirty();
 
+    // A new or newly confirmed spend changes which of our coins can stake
+    UpdateStakeCandidates(hash);
+    UpdateUnspentCoins(hash);
+    BOOST_FOREACH(const CTxIn& txin, wtx.tx->vin) {
+        UpdateStakeCandidates(txin.prevout.hash);
+        UpdateUnspentCoins(txin.prevout.hash);
+    }
+
     // Notify UI of new or updated transaction
     NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -1006,6 +1087,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
         boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
         boost::thread t(runCommand, strCmd); // thread runs free
     }
+    PushNotifyPipe("wallettx " + wtxIn.GetHash().GetHex());
 
     return true;
 }
@@ -1066,7 +1148,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlockIndex
         if (fExisted && !fUpdate) return false;
         if (fExisted || IsMine(tx) || IsFromMe(tx))
         {
-            CWalletTx wtx(this, MakeTransactionRef(tx));
+            CWalletTx wtx(this, InternTransaction(tx));
 
             // Get merkle branch if transaction was found in a block
             if (posInBlock != -1)
@@ -1128,10 +1210,110 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             {
                 if (mapWallet.count(txin.prevout.hash))
                     mapWallet[txin.prevout.hash].MarkDirty();
+                UpdateStakeCandidates(txin.prevout.hash);
+                UpdateUnspentCoins(txin.prevout.hash);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool CWallet::RemoveOrphanedTxs(bool fIncludeAbandoned, std::vector<uint256>& vRemoved)
+{
+    LOCK2(cs_main, cs_wallet);
+
+    std::vector<uint256> vTodo;
+    for (const PAIRTYPE(const uint256, CWalletTx)& item : mapWallet) {
+        const CWalletTx& wtx = item.second;
+        int nDepth = wtx.GetDepthInMainChain();
+        // A coinstake or coinbase can't go back to the mempool once its block is gone
+        if (nDepth < 0 || (nDepth == 0 && (wtx.IsCoinStake() || wtx.IsCoinBase())) ||
+            (fIncludeAbandoned && wtx.isAbandoned()))
+            vTodo.push_back(item.first);
+    }
+
+    // Their spenders in the wallet go with them, unless somehow confirmed
+    std::set<uint256> setRemove;
+    while (!vTodo.empty()) {
+        uint256 hash = vTodo.back();
+        vTodo.pop_back();
+        const CWalletTx& wtx = mapWallet.at(hash);
+        if (wtx.GetDepthInMainChain() > 0 || wtx.InMempool() || !setRemove.insert(hash).second)
+            continue;
+        for (TxSpends::const_iterator it = mapTxSpends.lower_bound(COutPoint(hash, 0)); it != mapTxSpends.end() && it->first.hash == hash; ++it)
+            vTodo.push_back(it->second);
+    }
+
+    if (!EraseWalletTxs(setRemove))
+        return false;
+    vRemoved.assign(setRemove.begin(), setRemove.end());
+    LogPrintf("%s: removed %u transactions\n", __func__, vRemoved.size());
+    return true;
+}
+
+bool CWallet::EraseWalletTxs(const std::set<uint256>& setHashes)
+{
+    AssertLockHeld(cs_wallet);
+    if (setHashes.empty())
+        return true;
+
+    if (fFileBacked) {
+        CWalletDB walletdb(strWalletFile, "r+");
+        if (!walletdb.TxnBegin())
+            return false;
+        for (const uint256& hash : setHashes) {
+            if (!walletdb.EraseTx(hash)) {
+                walletdb.TxnAbort();
+                return false;
+            }
+        }
+        if (!walletdb.TxnCommit())
+            return false;
+    }
+
+    std::set<uint256> setParents;
+    for (const uint256& hash : setHashes) {
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = mi->second;
+        for (const CTxIn& txin : wtx.tx->vin) {
+            std::pair<TxSpends::iterator, TxSpends::iterator> range = mapTxSpends.equal_range(txin.prevout);
+            for (TxSpends::iterator it = range.first; it != range.second; ) {
+                if (it->second == hash)
+                    mapTxSpends.erase(it++);
+                else
+                    ++it;
+            }
+            setParents.insert(txin.prevout.hash);
+        }
+        std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(wtx.nOrderPos);
+        for (TxItems::iterator it = range.first; it != range.second; ++it) {
+            if (it->second.first == &wtx) {
+                wtxOrdered.erase(it);
+                break;
             }
         }
+        mapRequestCount.erase(hash);
+        mapWallet.erase(mi);
     }
 
+    for (const uint256& hash : setHashes) {
+        MarkTxDirty(hash);
+        UpdateStakeCandidates(hash);
+        UpdateUnspentCoins(hash);
+        NotifyTransactionChanged(this, hash, CT_DELETED);
+    }
+    // What the removed transactions spent is unspent again
+    for (const uint256& hash : setParents) {
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        mi->second.MarkDirty();
+        UpdateStakeCandidates(hash);
+        UpdateUnspentCoins(hash);
+    }
     return true;
 }
 
@@ -1189,6 +1371,8 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             {
                 if (mapWallet.count(txin.prevout.hash))
                     mapWallet[txin.prevout.hash].MarkDirty();
+                UpdateStakeCandidates(txin.prevout.hash);
+                UpdateUnspentCoins(txin.prevout.hash);
             }
         }
     }
@@ -1243,6 +1427,8 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
         BOOST_FOREACH(const CTxIn& txin, tx.vin)
         {
             mapTxSpends.erase(txin.prevout);
+            UpdateStakeCandidates(txin.prevout.hash);
+            UpdateUnspentCoins(txin.prevout.hash);
         }
     }
 }
@@ -1594,11 +1780,168 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
     }
 }
 
+namespace {
+
+/**
+ * A copy of the public half of a wallet's keys, scripts and watch-only
+ * scripts, for rescan worker threads to match outputs against without
+ * taking the wallet's locks. Its answers are exactly the wallet's as long
+ * as no keys are added meanwhile.
+ */
+class CRescanKeyStore : public CKeyStore
+{
+private:
+    std::map<CKeyID, CPubKey> mapPubKeys;
+    ScriptMap mapScripts;
+    WatchOnlySet setWatchOnly;
+
+public:
+    void AddPubKey(const CPubKey& pubkey) { mapPubKeys[pubkey.GetID()] = pubkey; }
+    void AddScript(const CScript& script) { mapScripts[CScriptID(script)] = script; }
+    void AddWatchOnlyScript(const CScript& script) { setWatchOnly.insert(script); }
+
+    bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey) { return false; }
+    bool HaveKey(const CKeyID& address) const { return mapPubKeys.count(address) > 0; }
+    bool GetKey(const CKeyID& address, CKey& keyOut) const { return false; }
+    void GetKeys(std::set<CKeyID>& setAddress) const
+    {
+        setAddress.clear();
+        for (const auto& entry : mapPubKeys)
+            setAddress.insert(entry.first);
+    }
+    bool GetPubKey(const CKeyID& address, CPubKey& vchPubKeyOut) const
+    {
+        std::map<CKeyID, CPubKey>::const_iterator it = mapPubKeys.find(address);
+        if (it == mapPubKeys.end())
+            return false;
+        vchPubKeyOut = it->second;
+        return true;
+    }
+
+    bool AddCScript(const CScript& redeemScript) { return false; }
+    bool HaveCScript(const CScriptID& hash) const { return mapScripts.count(hash) > 0; }
+    bool GetCScript(const CScriptID& hash, CScript& redeemScriptOut) const
+    {
+        ScriptMap::const_iterator it = mapScripts.find(hash);
+        if (it == mapScripts.end())
+            return false;
+        redeemScriptOut = it->second;
+        return true;
+    }
+
+    bool AddWatchOnly(const CScript& dest) { return false; }
+    bool RemoveWatchOnly(const CScript& dest) { return false; }
+    bool HaveWatchOnly(const CScript& dest) const { return setWatchOnly.count(dest) > 0; }
+    bool HaveWatchOnly() const { return !setWatchOnly.empty(); }
+};
+
+/** A block read ahead for a rescan, with which of its transactions pay the wallet */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    bool fRead;
+    //! Its filter shows it touches none of the wallet's scripts, so it was not read
+    bool fSkipped;
+    CBlock block;
+    std::vector<bool> vPaysWallet;
+
+    explicit CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fRead(false), fSkipped(false) {}
+};
+
+/**
+ * Read and match a batch of blocks on nThreads threads. With pscripts, a
+ * block whose compact filter matches none of those scripts is skipped.
+ */
+void ReadRescanBlocks(std::vector<CRescanBlock>& blocks, const CKeyStore& keystore, const CBlockFilter::ElementSet* pscripts, int nThreads)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    std::atomic<size_t> nNext(0);
+    auto worker = [&blocks, &keystore, pscripts, &consensusParams, &nNext] {
+        for (size_t i = nNext++; i < blocks.size(); i = nNext++) {
+            CRescanBlock& entry = blocks[i];
+            CBlockFilter filter;
+            if (pscripts && pblocktree->ReadBlockFilter(entry.pindex->GetBlockHash(), filter) && !filter.MatchAny(*pscripts)) {
+                entry.fSkipped = true;
+                continue;
+            }
+            entry.fRead = ReadBlockFromDisk(entry.block, entry.pindex, consensusParams);
+            if (!entry.fRead)
+                continue;
+            entry.vPaysWallet.assign(entry.block.vtx.size(), false);
+            for (size_t posInBlock = 0; posInBlock < entry.block.vtx.size(); ++posInBlock) {
+                for (const CTxOut& txout : entry.block.vtx[posInBlock]->vout) {
+                    if (::IsMine(keystore, txout.scriptPubKey) != ISMINE_NO) {
+                        entry.vPaysWallet[posInBlock] = true;
+                        break;
+                    }
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads && i < (int)blocks.size(); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+} // anonymous namespace
+
+bool CWallet::GetRescanHeights(int nStartHeight, std::set<int>& setHeights) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::set<std::pair<uint160, int> > setAddresses;
+    {
+        LOCK(cs_KeyStore);
+        std::set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        for (const CKeyID& keyID : setKeys)
+            setAddresses.insert(std::make_pair(uint160(keyID), 1));
+        for (const auto& entry : mapScripts) {
+            // Native witness outputs are not in the address index
+            int nVersion;
+            std::vector<unsigned char> program;
+            if (entry.second.IsWitnessProgram(nVersion, program))
+                return false;
+            setAddresses.insert(std::make_pair(uint160(entry.first), 2));
+        }
+        for (const CScript& script : setWatchOnly) {
+            int type;
+            uint160 hashBytes;
+            GetIndexAddress(script, type, hashBytes);
+            if (type == 0)
+                return false;
+            setAddresses.insert(std::make_pair(hashBytes, type));
+        }
+    }
+
+    // Outputs to and spends from an address are both indexed under it
+    for (const std::pair<uint160, int>& address : setAddresses) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        if (!GetAddressIndex(address.first, address.second, addressIndex, nStartHeight, chainActive.Height()))
+            return false;
+        for (const std::pair<CAddressIndexKey, CAmount>& entry : addressIndex)
+            setHeights.insert(entry.first.blockHeight);
+    }
+    return true;
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  *
+ * Blocks are read and their outputs matched against a copy of the wallet's
+ * keys on worker threads, a batch ahead of the blocks being added, and only
+ * transactions that pay, spend from or are already in the wallet go through
+ * AddToWalletIfInvolvingMe. With -addressindex, only the blocks the index
+ * lists for the wallet's addresses are read; with -blockfilterindex, blocks
+ * whose filters match none of the wallet's scripts are skipped unread.
+ *
  * Returns pointer to the first block in the last contiguous range that was
  * successfully scanned.
  *
@@ -1621,26 +1964,113 @@ CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool f
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
         double dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
-        while (pindex)
+
+        std::vector<CBlockIndex*> vBlocks;
+        std::set<int> setHeights;
+        if (pindex && fAddressIndex && GetRescanHeights(pindex->nHeight, setHeights)) {
+            LogPrintf("Rescanning %u blocks found in the address index\n", setHeights.size());
+            for (int nHeight : setHeights)
+                vBlocks.push_back(chainActive[nHeight]);
+            // The blocks skipped over hold nothing for us
+            ret = pindex;
+        } else {
+            for (; pindex; pindex = chainActive.Next(pindex))
+                vBlocks.push_back(pindex);
+        }
+
+        CRescanKeyStore keystore;
+        {
+            LOCK(cs_KeyStore);
+            std::set<CKeyID> setKeys;
+            GetKeys(setKeys);
+            for (const CKeyID& keyID : setKeys) {
+                CPubKey pubkey;
+                if (GetPubKey(keyID, pubkey))
+                    keystore.AddPubKey(pubkey);
+            }
+            for (const auto& entry : mapScripts)
+                keystore.AddScript(entry.second);
+            for (const CScript& script : setWatchOnly)
+                keystore.AddWatchOnlyScript(script);
+        }
+
+        // Every script the wallet can be paid to, which a block must pay or
+        // spend for any of its transactions to involve the wallet. Bare
+        // multisig outputs to keys not added as a script are not listed, so
+        // those are only found in blocks without filters.
+        CBlockFilter::ElementSet setScripts;
+        if (fBlockFilterIndex) {
+            std::set<CKeyID> setKeys;
+            keystore.GetKeys(setKeys);
+            for (const CKeyID& keyID : setKeys) {
+                CPubKey pubkey;
+                keystore.GetPubKey(keyID, pubkey);
+                CScript scriptKeyHash = GetScriptForDestination(keyID);
+                CScript scriptKey = GetScriptForRawPubKey(pubkey);
+                setScripts.insert(CBlockFilter::Element(scriptKeyHash.begin(), scriptKeyHash.end()));
+                setScripts.insert(CBlockFilter::Element(scriptKey.begin(), scriptKey.end()));
+            }
+            LOCK(cs_KeyStore);
+            for (const auto& entry : mapScripts) {
+                CScript scriptHash = GetScriptForDestination(entry.first);
+                setScripts.insert(CBlockFilter::Element(scriptHash.begin(), scriptHash.end()));
+                setScripts.insert(CBlockFilter::Element(entry.second.begin(), entry.second.end()));
+            }
+            for (const CScript& script : setWatchOnly)
+                setScripts.insert(CBlockFilter::Element(script.begin(), script.end()));
+        }
+
+        int nThreads = std::max(1, std::min(GetNumCores(), MAX_RESCAN_THREADS));
+        size_t nBatchSize = RESCAN_BATCH_BLOCKS_PER_THREAD * nThreads;
+        std::vector<CRescanBlock> batch, nextBatch;
+        std::future<void> readAhead;
+        size_t nQueued = 0;
+        auto startBatch = [&](std::vector<CRescanBlock>& blocks) {
+            blocks.clear();
+            blocks.reserve(nBatchSize);
+            for (; nQueued < vBlocks.size() && blocks.size() < nBatchSize; nQueued++)
+                blocks.emplace_back(vBlocks[nQueued]);
+            if (!blocks.empty())
+                readAhead = std::async(std::launch::async, ReadRescanBlocks, std::ref(blocks), std::cref(keystore),
+                                       fBlockFilterIndex ? &setScripts : NULL, nThreads);
+        };
+
+        startBatch(nextBatch);
+        while (readAhead.valid())
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            readAhead.get();
+            batch.swap(nextBatch);
+            startBatch(nextBatch);
 
-            CBlock block;
-            if (ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
-                for (size_t posInBlock = 0; posInBlock < block.vtx.size(); ++posInBlock) {
-                    AddToWalletIfInvolvingMe(*block.vtx[posInBlock], pindex, posInBlock, fUpdate);
+            for (CRescanBlock& entry : batch)
+            {
+                pindex = entry.pindex;
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                if (entry.fSkipped) {
+                    if (!ret) {
+                        ret = pindex;
+                    }
+                } else if (entry.fRead) {
+                    for (size_t posInBlock = 0; posInBlock < entry.block.vtx.size(); ++posInBlock) {
+                        const CTransaction& tx = *entry.block.vtx[posInBlock];
+                        bool fInvolvesWallet = entry.vPaysWallet[posInBlock] || mapWallet.count(tx.GetHash());
+                        for (size_t i = 0; i < tx.vin.size() && !fInvolvesWallet; i++)
+                            fInvolvesWallet = mapWallet.count(tx.vin[i].prevout.hash) || mapTxSpends.count(tx.vin[i].prevout);
+                        if (fInvolvesWallet)
+                            AddToWalletIfInvolvingMe(tx, pindex, posInBlock, fUpdate);
+                    }
+                    if (!ret) {
+                        ret = pindex;
+                    }
+                } else {
+                    ret = nullptr;
                 }
-                if (!ret) {
-                    ret = pindex;
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
                 }
-            } else {
-                ret = nullptr;
-            }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
             }
         }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
@@ -1715,6 +2145,21 @@ set<uint256> CWalletTx::GetConflicts() const
     return result;
 }
 
+void CWalletTx::MarkDirty()
+{
+    fCreditCached = false;
+    fAvailableCreditCached = false;
+    fImmatureCreditCached = false;
+    fWatchDebitCached = false;
+    fWatchCreditCached = false;
+    fAvailableWatchCreditCached = false;
+    fImmatureWatchCreditCached = false;
+    fDebitCached = false;
+    fChangeCached = false;
+    if (pwallet)
+        pwallet->MarkTxDirty(GetHash());
+}
+
 CAmount CWalletTx::GetDebit(const isminefilter& filter) const
 {
     if (tx->vin.empty())
@@ -1984,172 +2429,518 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::MarkTxDirty(const uint256& hashTx) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted()) {
-                nTotal += pcoin->GetAvailableCredit();
-            }
-        }
-    }
-
-    return nTotal;
+    LOCK(cs_wallet);
+    if (fBalancesInit)
+        setBalanceDirty.insert(hashTx);
+    if (fTxBlocksInit)
+        setTxBlocksDirty.insert(hashTx);
 }
 
-CAmount CWallet::GetUnconfirmedBalance() const
+void CWallet::UpdateBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fBalancesInit) {
+        cachedBalances.SetNull();
+        mapBalanceContributions.clear();
+        setBalanceVolatile.clear();
+        setBalanceDirty.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
+            setBalanceDirty.insert(it->first);
+        fBalancesInit = true;
+    }
+
+    // Whether unconfirmed transactions count follows their parents and the
+    // mempool, and maturity follows the tip, without either marking them
+    // dirty, so those few are always looked at again
+    setBalanceDirty.insert(setBalanceVolatile.begin(), setBalanceVolatile.end());
+
+    for (const uint256& hash : setBalanceDirty) {
+        std::map<uint256, CWalletBalances>::iterator itContrib = mapBalanceContributions.find(hash);
+        if (itContrib != mapBalanceContributions.end()) {
+            cachedBalances -= itContrib->second;
+            mapBalanceContributions.erase(itContrib);
+        }
+        setBalanceVolatile.erase(hash);
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &mi->second;
+
+        CWalletBalances contribution;
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (pcoin->IsTrusted()) {
+            contribution.nBalance = pcoin->GetAvailableCredit();
+            contribution.nWatchOnlyBalance = pcoin->GetAvailableWatchOnlyCredit();
+        } else if (nDepth == 0 && pcoin->InMempool()) {
+            contribution.nUnconfirmed = pcoin->GetAvailableCredit();
+            contribution.nUnconfirmedWatchOnly = pcoin->GetAvailableWatchOnlyCredit();
+        }
+        contribution.nImmature = pcoin->GetImmatureCredit();
+        contribution.nImmatureWatchOnly = pcoin->GetImmatureWatchOnlyCredit();
+        bool fImmature = nDepth > 0 && pcoin->GetBlocksToMaturity() > 0;
+        if (pcoin->IsCoinStake() && fImmature) {
+            contribution.nStake = CWallet::GetCredit(*pcoin, ISMINE_SPENDABLE);
+            contribution.nWatchOnlyStake = CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
+        }
+
+        if (!contribution.IsNull()) {
+            cachedBalances += contribution;
+            mapBalanceContributions[hash] = contribution;
         }
+        if (nDepth == 0 || fImmature)
+            setBalanceVolatile.insert(hash);
     }
-    return nTotal;
+    setBalanceDirty.clear();
 }
 
-CAmount CWallet::GetImmatureBalance() const
+void CWallet::UpdateTxBlocks() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fTxBlocksInit) {
+        mapTxsByBlock.clear();
+        mapTxBlock.clear();
+        setFloatingTxs.clear();
+        setTxBlocksDirty.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+            setTxBlocksDirty.insert(it->first);
+        fTxBlocksInit = true;
+    }
+
+    for (const uint256& hash : setTxBlocksDirty) {
+        std::map<uint256, uint256>::iterator itBlock = mapTxBlock.find(hash);
+        if (itBlock != mapTxBlock.end()) {
+            if (itBlock->second.IsNull()) {
+                setFloatingTxs.erase(hash);
+            } else {
+                std::pair<std::multimap<uint256, uint256>::iterator, std::multimap<uint256, uint256>::iterator> range = mapTxsByBlock.equal_range(itBlock->second);
+                for (std::multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+                    if (it->second == hash) {
+                        mapTxsByBlock.erase(it);
+                        break;
+                    }
+                }
+            }
+            mapTxBlock.erase(itBlock);
+        }
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = mi->second;
+
+        // Conflicted transactions carry the conflicting block with nIndex -1
+        uint256 hashBlock;
+        if (!wtx.hashUnset() && !wtx.isAbandoned() && wtx.nIndex != -1) {
+            BlockMap::const_iterator itIndex = mapBlockIndex.find(wtx.hashBlock);
+            if (itIndex != mapBlockIndex.end() && chainActive.Contains(itIndex->second))
+                hashBlock = wtx.hashBlock;
         }
+        mapTxBlock[hash] = hashBlock;
+        if (hashBlock.IsNull())
+            setFloatingTxs.insert(hash);
+        else
+            mapTxsByBlock.insert(std::make_pair(hashBlock, hash));
     }
-    return nTotal;
+    setTxBlocksDirty.clear();
 }
 
-CAmount CWallet::GetWatchOnlyBalance() const
+void CWallet::GetWalletTxsSince(const CBlockIndex* pindexFrom, std::vector<const CWalletTx*>& vtx) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
+    LOCK2(cs_main, cs_wallet);
+    UpdateTxBlocks();
+
+    vtx.clear();
+    std::set<uint256> setHashes(setFloatingTxs);
+    CBlockIndex* pindex = pindexFrom ? chainActive.Next(pindexFrom) : chainActive.Genesis();
+    for (; pindex; pindex = chainActive.Next(pindex)) {
+        std::pair<std::multimap<uint256, uint256>::const_iterator, std::multimap<uint256, uint256>::const_iterator> range = mapTxsByBlock.equal_range(pindex->GetBlockHash());
+        for (std::multimap<uint256, uint256>::const_iterator it = range.first; it != range.second; ++it)
+            setHashes.insert(it->second);
+    }
+    vtx.reserve(setHashes.size());
+    for (const uint256& hash : setHashes) {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            vtx.push_back(&mi->second);
     }
-
-    return nTotal;
 }
 
-CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    CWalletBalances balances = cachedBalances;
+    std::vector<CIndexedOutput> vOutputs;
+    if (GetIndexedWatchOnlyOutputs(vOutputs)) {
+        balances.nWatchOnlyBalance = balances.nUnconfirmedWatchOnly = 0;
+        balances.nImmatureWatchOnly = balances.nWatchOnlyStake = 0;
+        for (const CIndexedOutput& output : vOutputs) {
+            if (output.nHeight < 0) {
+                balances.nUnconfirmedWatchOnly += output.txout.nValue;
+            } else if (output.fImmature) {
+                balances.nImmatureWatchOnly += output.txout.nValue;
+                if (output.fCoinStake)
+                    balances.nWatchOnlyStake += output.txout.nValue;
+            } else {
+                balances.nWatchOnlyBalance += output.txout.nValue;
+            }
         }
     }
-    return nTotal;
+    return balances;
 }
 
-CAmount CWallet::GetImmatureWatchOnlyBalance() const
+bool CWallet::UseIndexForWatchOnly() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
+    return fWatchOnlyIndex && fAddressIndex;
+}
+
+/** The addresses the address index lists scripts under; false if it does not index one of them */
+static bool GetIndexAddresses(const std::set<CScript>& setScripts, std::vector<std::pair<uint160, int> >& vAddresses)
+{
+    std::set<std::pair<uint160, int> > setAddresses;
+    for (const CScript& script : setScripts) {
+        int type;
+        uint160 hashBytes;
+        GetIndexAddress(script, type, hashBytes);
+        if (type == 0)
+            return false;
+        setAddresses.insert(std::make_pair(hashBytes, type));
     }
-    return nTotal;
+    vAddresses.assign(setAddresses.begin(), setAddresses.end());
+    return true;
 }
 
-void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
+bool CWallet::GetIndexedWatchOnlyOutputs(std::vector<CIndexedOutput>& vOutputs) const
 {
-    vCoins.clear();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    if (!UseIndexForWatchOnly())
+        return false;
 
+    // Watched scripts the wallet also has the keys for count as its own coins
+    std::set<CScript> setScripts;
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        LOCK(cs_KeyStore);
+        for (const CScript& script : setWatchOnly) {
+            if (::IsMine(*this, script) != ISMINE_SPENDABLE)
+                setScripts.insert(script);
+        }
+    }
+    std::vector<std::pair<uint160, int> > vAddresses;
+    if (!GetIndexAddresses(setScripts, vAddresses))
+        return false;
+    if (vAddresses.empty())
+        return true;
 
-            if (!CheckFinalTx(*pcoin))
-                continue;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    if (!GetAddressUnspent(vAddresses, vUnspent))
+        return false;
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > vMempool;
+    mempool.getAddressIndex(vAddresses, vMempool);
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+    std::set<COutPoint> setSpentInMempool;
+    for (const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& entry : vMempool) {
+        if (entry.first.spending)
+            setSpentInMempool.insert(COutPoint(entry.second.prevhash, entry.second.prevout));
+    }
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+    // A pay-to-pubkey script and its pay-to-pubkey-hash one are indexed under
+    // the same address, so each output's own script is checked too
+    for (const std::pair<CAddressUnspentKey, CAddressUnspentValue>& entry : vUnspent) {
+        COutPoint outpoint(entry.first.txhash, entry.first.index);
+        if (!setScripts.count(entry.second.script) || setSpentInMempool.count(outpoint))
+            continue;
+        const Coin& coin = pcoinsTip->AccessCoin(outpoint);
+        CIndexedOutput output;
+        output.outpoint = outpoint;
+        output.txout = CTxOut(entry.second.satoshis, entry.second.script);
+        output.nHeight = entry.second.blockHeight;
+        output.fCoinStake = coin.IsCoinStake();
+        output.fImmature = (coin.IsCoinBase() || coin.IsCoinStake()) && chainActive.Height() - output.nHeight + 1 <= COINBASE_MATURITY;
+        vOutputs.push_back(output);
+    }
+    for (const std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta>& entry : vMempool) {
+        COutPoint outpoint(entry.first.txhash, entry.first.index);
+        if (entry.first.spending || setSpentInMempool.count(outpoint))
+            continue;
+        CTransactionRef ptx = mempool.get(outpoint.hash);
+        if (!ptx || outpoint.n >= ptx->vout.size() || !setScripts.count(ptx->vout[outpoint.n].scriptPubKey))
+            continue;
+        CIndexedOutput output;
+        output.outpoint = outpoint;
+        output.txout = ptx->vout[outpoint.n];
+        vOutputs.push_back(output);
+    }
+    return true;
+}
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+bool CWallet::AddIndexedTransactions(const std::vector<CScript>& vScripts, int nStartHeight)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    std::vector<std::pair<uint160, int> > vAddresses;
+    if (!fAddressIndex || !GetIndexAddresses(std::set<CScript>(vScripts.begin(), vScripts.end()), vAddresses))
+        return false;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
-                continue;
+    std::map<int, std::set<uint256> > mapBlockTxs;
+    auto addTx = [&mapBlockTxs](const CAddressIndexKey& key, CAmount satoshis) -> bool {
+        mapBlockTxs[key.blockHeight].insert(key.txhash);
+        return true;
+    };
+    if (!vAddresses.empty() && !ScanAddressIndex(vAddresses, nStartHeight, chainActive.Height(), NULL, addTx))
+        return false;
 
-            // We should not consider coins from transactions that are replacing
-            // other transactions.
-            //
-            // Example: There is a transaction A which is replaced by bumpfee
-            // transaction B. In this case, we want to prevent creation of
-            // a transaction B' which spends an output of B.
-            //
-            // Reason: If transaction A were initially confirmed, transactions B
-            // and B' would no longer be valid, so the user would have to create
-            // a new transaction C to replace B'. However, in the case of a
-            // one-block reorg, transactions B' and C might BOTH be accepted,
-            // when the user only wanted one of them. Specifically, there could
-            // be a 1-block reorg away from the chain where transactions A and C
-            // were accepted to another chain where B, B', and C were all
-            // accepted.
-            if (nDepth == 0 && fOnlyConfirmed && pcoin->mapValue.count("replaces_txid")) {
-                continue;
-            }
+    // Only the transactions the index lists are looked at, in chain order
+    size_t nTxs = 0;
+    for (const auto& entry : mapBlockTxs) {
+        CBlockIndex* pindex = chainActive[entry.first];
+        CBlock block;
+        if (!pindex || !ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+            return false;
+        for (size_t posInBlock = 0; posInBlock < block.vtx.size(); posInBlock++) {
+            if (entry.second.count(block.vtx[posInBlock]->GetHash()) && AddToWalletIfInvolvingMe(*block.vtx[posInBlock], pindex, posInBlock, true))
+                nTxs++;
+        }
+    }
+    LogPrintf("Added %u transactions from %u blocks found in the address index\n", nTxs, mapBlockTxs.size());
+    return true;
+}
 
-            // Similarly, we should not consider coins from transactions that
-            // have been replaced. In the example above, we would want to prevent
-            // creation of a transaction A' spending an output of A, because if
-            // transaction B were initially confirmed, conflicting with A and
-            // A', we wouldn't want to the user to create a transaction D
-            // intending to replace A', but potentially resulting in a scenario
-            // where A, A', and D could all be accepted (instead of just B and
-            // D, or just A and A' like the user would want).
-            if (nDepth == 0 && fOnlyConfirmed && pcoin->mapValue.count("replaced_by_txid")) {
-                continue;
-            }
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nBalance;
+}
+
+CAmount CWallet::GetUnconfirmedBalance() const
+{
+    return GetBalances().nUnconfirmed;
+}
+
+CAmount CWallet::GetImmatureBalance() const
+{
+    return GetBalances().nImmature;
+}
+
+CAmount CWallet::GetWatchOnlyBalance() const
+{
+    return GetBalances().nWatchOnlyBalance;
+}
+
+CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
+{
+    return GetBalances().nUnconfirmedWatchOnly;
+}
+
+CAmount CWallet::GetImmatureWatchOnlyBalance() const
+{
+    return GetBalances().nImmatureWatchOnly;
+}
+
+/** Whether the outputs of a wallet transaction at depth nDepth may be spent, before checking each output */
+static bool IsAvailableCoinSource(const CWalletTx* pcoin, int nDepth, bool fOnlyConfirmed)
+{
+    if (!CheckFinalTx(*pcoin))
+        return false;
+
+    if (fOnlyConfirmed && !pcoin->IsTrusted())
+        return false;
+
+    if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+
+    if (nDepth < 0)
+        return false;
+
+    // We should not consider coins which aren't at least in our mempool
+    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+    if (nDepth == 0 && !pcoin->InMempool())
+        return false;
 
-            for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->tx->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->tx->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint((*it).first, i))))
-                        vCoins.push_back(COutput(pcoin, i, nDepth,
-                                                 ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
-                                                  (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
-                                                 (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
+    // We should not consider coins from transactions that are replacing
+    // other transactions.
+    //
+    // Example: There is a transaction A which is replaced by bumpfee
+    // transaction B. In this case, we want to prevent creation of
+    // a transaction B' which spends an output of B.
+    //
+    // Reason: If transaction A were initially confirmed, transactions B
+    // and B' would no longer be valid, so the user would have to create
+    // a new transaction C to replace B'. However, in the case of a
+    // one-block reorg, transactions B' and C might BOTH be accepted,
+    // when the user only wanted one of them. Specifically, there could
+    // be a 1-block reorg away from the chain where transactions A and C
+    // were accepted to another chain where B, B', and C were all
+    // accepted.
+    if (nDepth == 0 && fOnlyConfirmed && pcoin->mapValue.count("replaces_txid")) {
+        return false;
+    }
+
+    // Similarly, we should not consider coins from transactions that
+    // have been replaced. In the example above, we would want to prevent
+    // creation of a transaction A' spending an output of A, because if
+    // transaction B were initially confirmed, conflicting with A and
+    // A', we wouldn't want to the user to create a transaction D
+    // intending to replace A', but potentially resulting in a scenario
+    // where A, A', and D could all be accepted (instead of just B and
+    // D, or just A and A' like the user would want).
+    if (nDepth == 0 && fOnlyConfirmed && pcoin->mapValue.count("replaced_by_txid")) {
+        return false;
+    }
+
+    return true;
+}
+
+void CWallet::UpdateUnspentCoins(const uint256& hashTx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fUnspentCoinsInit)
+        return;
+
+    std::map<COutPoint, isminetype>::iterator it = mapUnspentCoins.lower_bound(COutPoint(hashTx, 0));
+    while (it != mapUnspentCoins.end() && it->first.hash == hashTx)
+        mapUnspentCoins.erase(it++);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = mi->second;
+    for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+        isminetype mine = IsMine(wtx.tx->vout[i]);
+        if (mine != ISMINE_NO && !IsSpent(hashTx, i))
+            mapUnspentCoins[COutPoint(hashTx, i)] = mine;
+    }
+}
+
+void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
+{
+    vCoins.clear();
+
+    {
+        LOCK2(cs_main, cs_wallet);
+        if (!fUnspentCoinsInit) {
+            fUnspentCoinsInit = true;
+            mapUnspentCoins.clear();
+            for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+                UpdateUnspentCoins(it->first);
+        }
+
+        // Outputs of one transaction are adjacent, so its checks run once for all of them
+        const CWalletTx* pcoin = NULL;
+        int nDepth = 0;
+        bool fAvailable = false;
+        for (std::map<COutPoint, isminetype>::const_iterator it = mapUnspentCoins.begin(); it != mapUnspentCoins.end(); ++it)
+        {
+            const uint256& wtxid = it->first.hash;
+            unsigned int i = it->first.n;
+            if (!pcoin || pcoin->GetHash() != wtxid) {
+                std::map<uint256, CWalletTx>::const_iterator itTx = mapWallet.find(wtxid);
+                if (itTx == mapWallet.end()) {
+                    // Skip an entry whose transaction has already left mapWallet
+                    pcoin = NULL;
+                    continue;
+                }
+                pcoin = &itTx->second;
+                nDepth = pcoin->GetDepthInMainChain();
+                fAvailable = IsAvailableCoinSource(pcoin, nDepth, fOnlyConfirmed);
             }
+            if (!fAvailable)
+                continue;
+
+            isminetype mine = it->second;
+            if (!(IsSpent(wtxid, i)) &&
+                !IsLockedCoin(wtxid, i) && (pcoin->tx->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(it->first)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth,
+                                             ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
+                                              (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
+                                             (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+/** Most steps the branch and bound search for an exact coin subset takes */
+static const int SELECT_COINS_BNB_MAX_TRIES = 100000;
+/** Coins the stochastic subset search visits at most, over all its iterations */
+static const int64_t SELECT_COINS_APPROXIMATE_BUDGET = 10000000;
+static const int SELECT_COINS_APPROXIMATE_MIN_ITERATIONS = 10;
+
+/**
+ * Depth-first branch and bound search for a subset of vValue, which is sorted
+ * by decreasing value, adding up to exactly nTargetValue. Coins of equal
+ * value form one bucket and the search only decides how many of each bucket
+ * to take, largest first, so the many same-sized outputs of a staking
+ * wallet leave it few choices. Gives up after nMaxTries steps.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           vector<char>& vfBest, int nMaxTries)
+{
+    struct CoinBucket {
+        CAmount nValue;
+        size_t nFirst;
+        size_t nCount;
+    };
+    vector<CoinBucket> vBuckets;
+    for (size_t i = 0; i < vValue.size(); i++) {
+        if (vValue[i].first <= 0)
+            continue;
+        if (vBuckets.empty() || vBuckets.back().nValue != vValue[i].first)
+            vBuckets.push_back(CoinBucket{vValue[i].first, i, 0});
+        vBuckets.back().nCount++;
+    }
+
+    // What all buckets from each one on add up to
+    vector<CAmount> vRemaining(vBuckets.size() + 1, 0);
+    for (size_t b = vBuckets.size(); b > 0; b--)
+        vRemaining[b - 1] = vRemaining[b] + vBuckets[b - 1].nValue * (CAmount)vBuckets[b - 1].nCount;
+
+    vector<size_t> vTake(vBuckets.size(), 0);
+    size_t b = 0;
+    CAmount nTotal = 0;
+    for (int nTries = 0; nTries < nMaxTries; nTries++) {
+        if (nTotal == nTargetValue) {
+            vfBest.assign(vValue.size(), false);
+            for (size_t j = 0; j < vBuckets.size(); j++)
+                for (size_t k = 0; k < vTake[j]; k++)
+                    vfBest[vBuckets[j].nFirst + k] = true;
+            return true;
+        }
+
+        if (b < vBuckets.size() && nTotal + vRemaining[b] >= nTargetValue) {
+            // Take as many of this bucket as fit, never overshooting
+            vTake[b] = std::min(vBuckets[b].nCount, (size_t)((nTargetValue - nTotal) / vBuckets[b].nValue));
+            nTotal += vBuckets[b].nValue * (CAmount)vTake[b];
+            b++;
+            continue;
+        }
+
+        // Backtrack: take one fewer of the last bucket taken from, unless the
+        // buckets after it could then no longer make up the difference
+        while (true) {
+            while (b > 0 && vTake[b - 1] == 0)
+                b--;
+            if (b == 0)
+                return false;
+            size_t j = b - 1;
+            vTake[j]--;
+            nTotal -= vBuckets[j].nValue;
+            if (nTotal + vRemaining[j + 1] >= nTargetValue)
+                break;
+            nTotal -= vBuckets[j].nValue * (CAmount)vTake[j];
+            vTake[j] = 0;
+            b = j;
+        }
+    }
+    return false;
+}
+
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -2197,32 +2988,16 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
 
 CAmount CWallet::GetWatchOnlyStake() const
 {
-    CAmount nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyStake;
 }
 
 // ppcoin: total coins staked (non-spendable until maturity)
 CAmount CWallet::GetStake() const
 {
-    CAmount nTotal = 0;
-    LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_SPENDABLE);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
@@ -2235,10 +3010,15 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Shuffle positions rather than the coins themselves
+    vector<size_t> vOrder(vCoins.size());
+    for (size_t i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    random_shuffle(vOrder.begin(), vOrder.end(), GetRandInt);
 
-    BOOST_FOREACH(const COutput &output, vCoins)
+    BOOST_FOREACH(size_t nPos, vOrder)
     {
+        const COutput &output = vCoins[nPos];
         if (!output.fSpendable)
             continue;
 
@@ -2291,15 +3071,22 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
     std::sort(vValue.begin(), vValue.end(), CompareValueOnly());
     std::reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    // An exact match needs no change, so look for one systematically first,
+    // then solve subset sum by stochastic approximation, with fewer
+    // iterations when there are so many coins that each one is costly
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest, SELECT_COINS_BNB_MAX_TRIES)) {
+        nBest = nTargetValue;
+    } else {
+        int nIterations = std::max<int64_t>(SELECT_COINS_APPROXIMATE_MIN_ITERATIONS, std::min<int64_t>(1000, SELECT_COINS_APPROXIMATE_BUDGET / std::max<size_t>(1, vValue.size())));
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest, nIterations);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -2776,22 +3563,15 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
 
         if (sign)
         {
-            CTransaction txNewConst(txNew);
-            int nIn = 0;
+            std::vector<CTxOut> vPrevOuts;
+            vPrevOuts.reserve(setCoins.size());
             for (const auto& coin : setCoins)
-            {
-                const CScript& scriptPubKey = coin.first->tx->vout[coin.second].scriptPubKey;
-                SignatureData sigdata;
+                vPrevOuts.push_back(coin.first->tx->vout[coin.second]);
 
-                if (!ProduceSignature(TransactionSignatureCreator(this, &txNewConst, nIn, coin.first->tx->vout[coin.second].nValue, SIGHASH_ALL), scriptPubKey, sigdata))
-                {
-                    strFailReason = _("Signing transaction failed");
-                    return false;
-                } else {
-                    UpdateTransaction(txNew, nIn, sigdata);
-                }
-
-                nIn++;
+            if (!ProduceSignatures(*this, txNew, vPrevOuts))
+            {
+                strFailReason = _("Signing transaction failed");
+                return false;
             }
         }
 
@@ -2834,6 +3614,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, CCon
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.tx->ToString());
         {
+            // The key pool and transaction writes share one log checkpoint
+            CDBFlushBatch batch;
+
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
 
@@ -2955,26 +3738,16 @@ DBErrors CWallet::ZapSelectTx(vector<uint256>& vHashIn, vector<uint256>& vHashOu
 {
     if (!fFileBacked)
         return DB_LOAD_OK;
-    DBErrors nZapSelectTxRet = CWalletDB(strWalletFile,"cr+").ZapSelectTx(this, vHashIn, vHashOut);
-    if (nZapSelectTxRet == DB_NEED_REWRITE)
-    {
-        if (CDB::Rewrite(strWalletFile, "\x04pool"))
-        {
-            LOCK(cs_wallet);
-            setKeyPool.clear();
-            // Note: can't top-up keypool here, because wallet is locked.
-            // User will be prompted to unlock wallet the next operation
-            // that requires a new key.
-        }
-    }
-
-    if (nZapSelectTxRet != DB_LOAD_OK)
-        return nZapSelectTxRet;
-
-    MarkDirty();
-
+    LOCK(cs_wallet);
+    std::set<uint256> setHashes;
+    BOOST_FOREACH(const uint256& hash, vHashIn) {
+        if (mapWallet.count(hash))
+            setHashes.insert(hash);
+    }
+    if (!EraseWalletTxs(setHashes))
+        return DB_CORRUPT;
+    vHashOut.insert(vHashOut.end(), setHashes.begin(), setHashes.end());
     return DB_LOAD_OK;
-
 }
 
 DBErrors CWallet::ZapWalletTx(std::vector<CWalletTx>& vWtx)
@@ -3016,9 +3789,16 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+    LOCK(cs_wallet);
+    std::unique_ptr<CWalletDB> pwalletdbNew;
+    CWalletDB* pwalletdb = pwalletdbBatch;
+    if (!pwalletdb) {
+        pwalletdbNew.reset(new CWalletDB(strWalletFile));
+        pwalletdb = pwalletdbNew.get();
+    }
+    if (!strPurpose.empty() && !pwalletdb->WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return pwalletdb->WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -3046,6 +3826,19 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
     return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
 }
 
+size_t CWallet::GetWalletTxMemoryUsage() const
+{
+    AssertLockHeld(cs_wallet);
+    size_t nUsage = memusage::DynamicUsage(mapWallet);
+    for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+        const CWalletTx& wtx = item.second;
+        if (wtx.tx)
+            nUsage += memusage::DynamicUsage(wtx.tx) + RecursiveDynamicUsage(*wtx.tx);
+        nUsage += memusage::DynamicUsage(wtx.mapValue) + memusage::DynamicUsage(wtx.vOrderForm);
+    }
+    return nUsage;
+}
+
 bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
 {
     if (fFileBacked)
@@ -3085,6 +3878,43 @@ bool CWallet::NewKeyPool()
     return true;
 }
 
+namespace {
+
+/**
+ * Generate vKeys.size() keys and their public keys on nThreads threads:
+ * the hardened children of pchainKey from nFirstChild on, or random keys
+ * when pchainKey is NULL. The public key computation and check is what
+ * makes a key expensive, so all of it happens here.
+ */
+void GenerateKeys(std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys, const CExtKey* pchainKey, uint32_t nFirstChild, bool fCompressed, int nThreads)
+{
+    std::atomic<size_t> nNext(0);
+    std::atomic<bool> fFailed(false);
+    auto generate = [&]() {
+        for (size_t i = nNext++; i < vKeys.size(); i = nNext++) {
+            if (pchainKey) {
+                CExtKey childKey;
+                pchainKey->Derive(childKey, (nFirstChild + i) | BIP32_HARDENED_KEY_LIMIT);
+                vKeys[i] = childKey.key;
+            } else {
+                vKeys[i].MakeNewKey(fCompressed);
+            }
+            vPubKeys[i] = vKeys[i].GetPubKey();
+            if (!vKeys[i].VerifyPubKey(vPubKeys[i]))
+                fFailed = true;
+        }
+    };
+    std::vector<std::thread> vThreads;
+    for (int i = 1; i < nThreads; i++)
+        vThreads.emplace_back(generate);
+    generate();
+    for (std::thread& thread : vThreads)
+        thread.join();
+    assert(!fFailed);
+}
+
+} // anonymous namespace
+
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
     {
@@ -3094,6 +3924,8 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
             return false;
 
         CWalletDB walletdb(strWalletFile);
+        // Checkpoint the log once for the whole top-up
+        CDBFlushBatch batch;
 
         // Top up key pool
         unsigned int nTargetSize;
@@ -3102,15 +3934,55 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+
+        bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        bool fHD = IsHDEnabled();
+        CExtKey externalChainChildKey;
+        if (fHD)
+            DeriveExternalChainKey(externalChainChildKey);
+
         while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error(std::string(__func__) + ": writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            unsigned int nKeys = std::min<unsigned int>(nTargetSize + 1 - setKeyPool.size(), KEYPOOL_TOPUP_BATCH);
+            int nThreads = std::max(1, std::min<int>(std::min(GetNumCores(), MAX_KEYPOOL_THREADS), nKeys / KEYPOOL_KEYS_PER_THREAD));
+            std::vector<CKey> vKeys(nKeys);
+            std::vector<CPubKey> vPubKeys(nKeys);
+            uint32_t nFirstChild = hdChain.nExternalChainCounter;
+            GenerateKeys(vKeys, vPubKeys, fHD ? &externalChainChildKey : NULL, nFirstChild, fCompressed, nThreads);
+
+            // Claim the whole batch of child indexes before using any of them
+            if (fHD) {
+                hdChain.nExternalChainCounter += nKeys;
+                if (!walletdb.WriteHDChain(hdChain))
+                    throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
+            }
+            if (fCompressed)
+                SetMinVersion(FEATURE_COMPRPUBKEY);
+
+            int64_t nCreationTime = GetTime();
+            unsigned int nAdded = 0;
+            for (unsigned int i = 0; i < nKeys; i++) {
+                CKeyMetadata metadata(nCreationTime);
+                if (fHD) {
+                    // skip keys already known to the wallet, as DeriveNewChildKey does
+                    if (HaveKey(vPubKeys[i].GetID()))
+                        continue;
+                    metadata.hdKeypath = "m/0'/0'/" + std::to_string(nFirstChild + i) + "'";
+                    metadata.hdMasterKeyID = hdChain.masterKeyID;
+                }
+                AddGeneratedKey(vKeys[i], vPubKeys[i], metadata);
+
+                int64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!walletdb.WritePool(nEnd, CKeyPool(vPubKeys[i])))
+                    throw runtime_error(std::string(__func__) + ": writing generated key failed");
+                setKeyPool.insert(nEnd);
+                nAdded++;
+            }
+            LogPrintf("keypool added %u keys on %d threads, size=%u\n", nAdded, nThreads, setKeyPool.size());
         }
     }
     return true;
@@ -3122,6 +3994,7 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     keypool.vchPubKey = CPubKey();
     {
         LOCK(cs_wallet);
+        CDBFlushBatch batch;
 
         if (!IsLocked())
             TopUpKeyPool();
@@ -3379,6 +4252,45 @@ std::set<CTxDestination> CWallet::GetAccountAddresses(const std::string& strAcco
     return result;
 }
 
+CWalletWriteBatch::CWalletWriteBatch(CWallet* pwalletIn) : pwallet(pwalletIn), pwalletdb(NULL)
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    // Nested in another batch, the writes simply go to the outer one
+    if (!pwallet->fFileBacked || pwallet->pwalletdbBatch)
+        return;
+    pwalletdb = new CWalletDB(pwallet->strWalletFile);
+    if (!pwalletdb->TxnBegin()) {
+        // Then each write is committed on its own, as without a batch
+        delete pwalletdb;
+        pwalletdb = NULL;
+        return;
+    }
+    pwallet->pwalletdbBatch = pwalletdb;
+}
+
+CWalletWriteBatch::~CWalletWriteBatch()
+{
+    if (!pwalletdb)
+        return;
+    pwallet->pwalletdbBatch = NULL;
+    if (!pwalletdb->TxnCommit())
+        LogPrintf("%s: committing wallet writes failed\n", __func__);
+    delete pwalletdb;
+}
+
+bool CWalletWriteBatch::Flush()
+{
+    if (!pwalletdb)
+        return true;
+    bool fCommitted = pwalletdb->TxnCommit();
+    if (!pwalletdb->TxnBegin()) {
+        pwallet->pwalletdbBatch = NULL;
+        delete pwalletdb;
+        pwalletdb = NULL;
+    }
+    return fCommitted;
+}
+
 bool CReserveKey::GetReservedKey(CPubKey& pubkey)
 {
     if (nIndex == -1)
@@ -3636,9 +4548,18 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     if (showDebug)
         strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), DEFAULT_SEND_FREE_TRANSACTIONS));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), DEFAULT_SPEND_ZEROCONF_CHANGE));
+    strUsage += HelpMessageOpt("-stakecache", strprintf(_("Cache kernel inputs of staking coins between stake search cycles (default: %u)"), DEFAULT_STAKE_CACHE));
+    strUsage += HelpMessageOpt("-stakecombinethreshold=<amt>", strprintf(_("Do not add outputs of at least this value (in %s) to a coinstake (default: %s)"),
+                                                                         CURRENCY_UNIT, FormatMoney(DEFAULT_STAKE_COMBINE_THRESHOLD)));
+    strUsage += HelpMessageOpt("-stakemaintenance=<n>", strprintf(_("Every <n> minutes, merge staking outputs too small to stake and split very large ones (0 to disable, default: %u)"), DEFAULT_STAKE_MAINTENANCE));
+    strUsage += HelpMessageOpt("-stakesplitthreshold=<amt>", strprintf(_("Split coinstakes crediting at least this value (in %s) into two outputs (default: %s)"),
+                                                                       CURRENCY_UNIT, FormatMoney(DEFAULT_STAKE_SPLIT_THRESHOLD)));
+    strUsage += HelpMessageOpt("-stakewallet=<file>", _("Also load this wallet file (within data directory) and stake its coins together with the main wallet's; RPC and the GUI only act on the main wallet. Can be specified multiple times"));
+    strUsage += HelpMessageOpt("-stakingkeycache", strprintf(_("Keep private keys decrypted in locked memory once used while an encrypted wallet is unlocked, so that staking does not decrypt them for every block (default: %u)"), DEFAULT_STAKING_KEY_CACHE));
     strUsage += HelpMessageOpt("-txconfirmtarget=<n>", strprintf(_("If paytxfee is not set, include enough fee so transactions begin confirmation on average within n blocks (default: %u)"), DEFAULT_TX_CONFIRM_TARGET));
     strUsage += HelpMessageOpt("-usehd", _("Use hierarchical deterministic key generation (HD) after BIP32. Only has effect during wallet creation/first start") + " " + strprintf(_("(default: %u)"), DEFAULT_USE_HD_WALLET));
     strUsage += HelpMessageOpt("-walletrbf", strprintf(_("Send transactions with full-RBF opt-in enabled (default: %u)"), DEFAULT_WALLET_RBF));
+    strUsage += HelpMessageOpt("-watchonlyindex", strprintf(_("With -addressindex, take watch-only balances and unspent outputs from the address index, and find the history of imported addresses in it rather than by a rescan (default: %u)"), DEFAULT_WATCHONLY_INDEX));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_DAT));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), DEFAULT_WALLETBROADCAST));
@@ -3659,6 +4580,28 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     return strUsage;
 }
 
+// The wallet read by PreloadWallet, for CreateWalletFromFile to take over
+static CCriticalSection cs_preload;
+static CWallet* pwalletPreloaded = NULL;
+static DBErrors nPreloadRet = DB_LOAD_OK;
+static bool fPreloadFirstRun = true;
+
+void CWallet::PreloadWallet()
+{
+    if (GetBoolArg("-disablewallet", DEFAULT_DISABLE_WALLET) || GetBoolArg("-zapwallettxes", false))
+        return;
+
+    CWallet* pwallet = new CWallet(GetArg("-wallet", DEFAULT_WALLET_DAT));
+    bool fFirstRun = true;
+    DBErrors nLoadWalletRet = pwallet->LoadWallet(fFirstRun);
+
+    LOCK(cs_preload);
+    assert(!pwalletPreloaded);
+    pwalletPreloaded = pwallet;
+    nPreloadRet = nLoadWalletRet;
+    fPreloadFirstRun = fFirstRun;
+}
+
 CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
 {
     // needed to restore wallet transaction meta data after -zapwallettxes
@@ -3682,8 +4625,23 @@ CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
 
     int64_t nStart = GetTimeMillis();
     bool fFirstRun = true;
-    CWallet *walletInstance = new CWallet(walletFile);
-    DBErrors nLoadWalletRet = walletInstance->LoadWallet(fFirstRun);
+    CWallet *walletInstance = NULL;
+    DBErrors nLoadWalletRet = DB_LOAD_OK;
+    {
+        LOCK(cs_preload);
+        if (pwalletPreloaded && pwalletPreloaded->strWalletFile == walletFile) {
+            walletInstance = pwalletPreloaded;
+            nLoadWalletRet = nPreloadRet;
+            fFirstRun = fPreloadFirstRun;
+        } else {
+            delete pwalletPreloaded;
+        }
+        pwalletPreloaded = NULL;
+    }
+    if (!walletInstance) {
+        walletInstance = new CWallet(walletFile);
+        nLoadWalletRet = walletInstance->LoadWallet(fFirstRun);
+    }
     if (nLoadWalletRet != DB_LOAD_OK)
     {
         if (nLoadWalletRet == DB_CORRUPT) {
@@ -3762,8 +4720,6 @@ CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
         }
     }
 
-    LogPrintf(" wallet      %15dms\n", GetTimeMillis() - nStart);
-
     RegisterValidationInterface(walletInstance);
 
     CBlockIndex *pindexRescan = chainActive.Tip();
@@ -3829,6 +4785,8 @@ CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
         }
     }
     walletInstance->SetBroadcastTransactions(GetBoolArg("-walletbroadcast", DEFAULT_WALLETBROADCAST));
+    walletInstance->SetCacheKeys(GetBoolArg("-stakingkeycache", DEFAULT_STAKING_KEY_CACHE));
+    walletInstance->nLastStakeWeight = walletInstance->GetStakeWeight();
 
     {
         LOCK(walletInstance->cs_wallet);
@@ -3855,6 +4813,15 @@ bool CWallet::InitLoadWallet()
         return false;
     }
     pwalletMain = pwallet;
+    vpwallets.push_back(pwallet);
+
+    for (const std::string& strStakeWallet : GetStakeWalletFiles()) {
+        CWallet * const pwalletStake = CreateWalletFromFile(strStakeWallet);
+        if (!pwalletStake)
+            return false;
+        vpwallets.push_back(pwalletStake);
+    }
+    UpdateStakingWeight();
 
     return true;
 }
@@ -3921,6 +4888,23 @@ bool CWallet::ParameterInteraction()
                         _("This is the transaction fee you may pay when fee estimates are not available."));
         CWallet::fallbackFee = CFeeRate(nFeePerK);
     }
+    if (IsArgSet("-stakecombinethreshold"))
+    {
+        CAmount n = 0;
+        if (!ParseMoney(GetArg("-stakecombinethreshold", ""), n) || n <= 0)
+            return InitError(AmountErrMsg("stakecombinethreshold", GetArg("-stakecombinethreshold", "")));
+        CWallet::nStakeCombineThreshold = n;
+    }
+    if (IsArgSet("-stakesplitthreshold"))
+    {
+        CAmount n = 0;
+        if (!ParseMoney(GetArg("-stakesplitthreshold", ""), n) || n <= 0)
+            return InitError(AmountErrMsg("stakesplitthreshold", GetArg("-stakesplitthreshold", "")));
+        CWallet::nStakeSplitThreshold = n;
+    }
+    if (CWallet::nStakeSplitThreshold < CWallet::nStakeCombineThreshold)
+        return InitError(strprintf(_("-stakesplitthreshold (%s) may not be below -stakecombinethreshold (%s)"),
+                                   FormatMoney(CWallet::nStakeSplitThreshold), FormatMoney(CWallet::nStakeCombineThreshold)));
     if (IsArgSet("-paytxfee"))
     {
         CAmount nFeePerK = 0;
@@ -3955,6 +4939,7 @@ bool CWallet::ParameterInteraction()
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", DEFAULT_SPEND_ZEROCONF_CHANGE);
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", DEFAULT_SEND_FREE_TRANSACTIONS);
     fWalletRbf = GetBoolArg("-walletrbf", DEFAULT_WALLET_RBF);
+    fWatchOnlyIndex = GetBoolArg("-watchonlyindex", DEFAULT_WATCHONLY_INDEX);
 
     if (fSendFreeTransactions && GetArg("-limitfreerelay", DEFAULT_LIMITFREERELAY) <= 0)
         return InitError("Creation of free transactions with their relay disabled is not supported.");
@@ -4047,6 +5032,18 @@ int CMerkleTx::GetDepthInMainChain(const CBlockIndex* &pindexRet) const
     return ((nIndex == -1) ? (-1) : 1) * (chainActive.Height() - pindex->nHeight + 1);
 }
 
+int CMerkleTx::GetDepthInChain(const CChainSnapshot& chain) const
+{
+    if (hashUnset())
+        return 0;
+
+    const CBlockIndex* pindex = LookupBlockIndex(hashBlock);
+    if (!chain.Contains(pindex))
+        return 0;
+
+    return ((nIndex == -1) ? (-1) : 1) * chain.Confirmations(pindex);
+}
+
 int CMerkleTx::GetBlocksToMaturity() const
 {
     if (!(IsCoinBase() || IsCoinStake()))
@@ -4061,38 +5058,72 @@ bool CMerkleTx::AcceptToMemoryPool(const CAmount& nAbsurdFee, CValidationState&
 }
 
 
+void CWallet::UpdateStakeCandidates(const uint256& hashTx, const CChainSnapshot* pchain) const
+{
+    AssertLockHeld(cs_wallet);
+    if (!fStakeCandidatesInit)
+        return;
+
+    std::map<COutPoint, int64_t>::iterator it = mapStakeCandidates.lower_bound(COutPoint(hashTx, 0));
+    while (it != mapStakeCandidates.end() && it->first.hash == hashTx) {
+        setStakeCandidates.erase(make_pair(it->second, it->first));
+        mapStakeCandidates.erase(it++);
+    }
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = mi->second;
+    int64_t nTimeMature = wtx.GetTxTime() + Params().GetConsensus().nStakeMinAge;
+    for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+        if (wtx.tx->vout[i].nValue > 0 && IsMine(wtx.tx->vout[i]) != ISMINE_NO && !IsSpent(hashTx, i, pchain)) {
+            COutPoint prevout(hashTx, i);
+            mapStakeCandidates[prevout] = nTimeMature;
+            setStakeCandidates.insert(make_pair(nTimeMature, prevout));
+        }
+    }
+}
+
 void CWallet::AvailableCoinsForStaking(std::vector<COutput>& vCoins) const
 {
     vCoins.clear();
     int64_t nSpendTime = GetTime();
+    // Depths come from a snapshot of the chain rather than chainActive, so
+    // the stake miner polling this does not wait for block validation
+    ChainSnapshotRef chain = GetChainSnapshot();
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK(cs_wallet);
+        if (!fStakeCandidatesInit) {
+            fStakeCandidatesInit = true;
+            for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+                UpdateStakeCandidates(it->first, chain.get());
+        }
+
+        // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+        for (std::set<std::pair<int64_t, COutPoint> >::const_iterator it = setStakeCandidates.begin();
+             it != setStakeCandidates.end() && it->first <= nSpendTime; ++it)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const COutPoint& prevout = it->second;
+            std::map<uint256, CWalletTx>::const_iterator itTx = mapWallet.find(prevout.hash);
+            if (itTx == mapWallet.end())
+                continue;
+            const CWalletTx* pcoin = &itTx->second;
 
-            int nDepth = pcoin->GetDepthInMainChain();
+            int nDepth = pcoin->GetDepthInChain(*chain);
             if (nDepth < 1)
                 continue;
-            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
-            if (pcoin->GetTxTime() + Params().GetConsensus().nStakeMinAge > nSpendTime)
-                continue;
-			
-            if (pcoin->GetBlocksToMaturity() > 0)
+            // GetBlocksToMaturity() > 0, at this depth
+            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && nDepth < COINBASE_MATURITY + 1)
                 continue;
             if (pcoin->isAbandoned())
                 continue;
-            for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->tx->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->tx->vout[i].nValue > 0)) { 
-                	vCoins.push_back(COutput(pcoin, i, nDepth,
-                                            ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
-                                            (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO,
-                                            (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
-                }
-            }
+            if (IsSpent(prevout.hash, prevout.n, chain.get()) || IsLockedCoin(prevout.hash, prevout.n))
+                continue;
+            isminetype mine = IsMine(pcoin->tx->vout[prevout.n]);
+            vCoins.push_back(COutput(pcoin, prevout.n, nDepth,
+                                    ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
+                                    (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO,
+                                    (mine & (ISMINE_SPENDABLE | ISMINE_WATCH_SOLVABLE)) != ISMINE_NO));
         }
     }
 }
@@ -4116,7 +5147,7 @@ bool CWallet::SelectCoinsForStaking(CAmount& nTargetValue,   std::set<std::pair<
             break;
 
         int64_t n = pcoin->tx->vout[i].nValue;
-        if(n < 1 *COIN){
+        if(n < MIN_STAKE_INPUT_VALUE){
             continue;
         }
         int64_t current = GetTime();
@@ -4162,6 +5193,99 @@ bool CWallet::HaveAvailableCoinsForStaking() const
     return vCoins.size() > 0;
 }
 
+static bool CommitStakeMaintenance(CWallet* pwallet, const std::vector<CRecipient>& vecSend, const CCoinControl& coinControl, CConnman* connman, const char* pszAction)
+{
+    CWalletTx wtx;
+    CReserveKey reservekey(pwallet);
+    CAmount nFee;
+    int nChangePos = -1;
+    std::string strError;
+    if (!pwallet->CreateTransaction(vecSend, wtx, reservekey, nFee, nChangePos, strError, &coinControl)) {
+        LogPrintf("Stake maintenance: cannot %s: %s\n", pszAction, strError);
+        return false;
+    }
+    CValidationState state;
+    if (!pwallet->CommitTransaction(wtx, reservekey, connman, state)) {
+        LogPrintf("Stake maintenance: cannot %s: %s\n", pszAction, state.GetRejectReason());
+        return false;
+    }
+    LogPrintf("Stake maintenance: %s, %d inputs, %d outputs, fee %s, txid %s\n", pszAction,
+              wtx.tx->vin.size(), wtx.tx->vout.size(), FormatMoney(nFee), wtx.GetHash().ToString());
+    return true;
+}
+
+void CWallet::MaintainStakeOutputs(CConnman* connman)
+{
+    // A wallet unlocked for staking only may sign coinstakes, not transactions
+    if (IsLocked() || (this == pwalletMain && fWalletUnlockStakingOnly) || IsInitialBlockDownload())
+        return;
+
+    // Stakeable outputs too small to stake, by script, and the largest one
+    // worth splitting
+    std::map<CScript, std::vector<std::pair<COutPoint, CAmount> > > mapSmall;
+    std::pair<COutPoint, CAmount> largest(COutPoint(), 0);
+    CScript scriptLargest;
+    {
+        LOCK2(cs_main, cs_wallet);
+        std::vector<COutput> vCoins;
+        AvailableCoinsForStaking(vCoins);
+        for (const COutput& output : vCoins) {
+            const CTxOut& txout = output.tx->tx->vout[output.i];
+            if (!(IsMine(txout) & ISMINE_SPENDABLE))
+                continue;
+            COutPoint outpoint(output.tx->GetHash(), output.i);
+            if (txout.nValue < MIN_STAKE_INPUT_VALUE)
+                mapSmall[txout.scriptPubKey].push_back(std::make_pair(outpoint, txout.nValue));
+            else if (txout.nValue >= 2 * nStakeSplitThreshold && txout.nValue > largest.second) {
+                largest = std::make_pair(outpoint, txout.nValue);
+                scriptLargest = txout.scriptPubKey;
+            }
+        }
+    }
+
+    // Merge the script with the most small outputs back into itself
+    std::map<CScript, std::vector<std::pair<COutPoint, CAmount> > >::const_iterator itMerge = mapSmall.end();
+    for (std::map<CScript, std::vector<std::pair<COutPoint, CAmount> > >::const_iterator it = mapSmall.begin(); it != mapSmall.end(); ++it)
+        if (itMerge == mapSmall.end() || it->second.size() > itMerge->second.size())
+            itMerge = it;
+    if (itMerge != mapSmall.end() && itMerge->second.size() >= 2) {
+        CCoinControl coinControl;
+        CAmount nTotal = 0;
+        for (size_t i = 0; i < itMerge->second.size() && i < MAX_STAKE_MAINTENANCE_IO; i++) {
+            coinControl.Select(itMerge->second[i].first);
+            nTotal += itMerge->second[i].second;
+        }
+        CommitStakeMaintenance(this, std::vector<CRecipient>(1, CRecipient{itMerge->first, nTotal, true}), coinControl, connman, "merge small outputs");
+    }
+
+    // Split into pieces of half the split threshold: a coinstake of one
+    // piece credits less than the threshold and, unless the thresholds are
+    // set otherwise, the piece is not small enough to be combined either
+    if (largest.second > 0) {
+        CAmount nPiece = nStakeSplitThreshold / 2;
+        size_t nPieces = std::min<CAmount>(largest.second / nPiece, MAX_STAKE_MAINTENANCE_IO);
+        std::vector<CRecipient> vecSend(nPieces - 1, CRecipient{scriptLargest, nPiece, false});
+        // The last piece takes the remainder and pays the fee
+        vecSend.push_back(CRecipient{scriptLargest, largest.second - (CAmount)(nPieces - 1) * nPiece, true});
+        CCoinControl coinControl;
+        coinControl.Select(largest.first);
+        CommitStakeMaintenance(this, vecSend, coinControl, connman, "split large output");
+    }
+}
+
+// Weight of the coins old enough to stake
+static uint64_t GetCoinsStakeWeight(const set<pair<const CWalletTx*,unsigned int> >& setCoins)
+{
+    uint64_t nWeight = 0;
+    int64_t nCurrentTime = GetTime();
+    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    {
+        if (nCurrentTime - pcoin.first->GetTxTime() > Params().GetConsensus().nStakeMinAge)
+            nWeight += pcoin.first->tx->vout[pcoin.second].nValue;
+    }
+    return nWeight;
+}
+
 uint64_t CWallet::GetStakeWeight() const
 {
     // Choose coins to use
@@ -4182,27 +5306,350 @@ uint64_t CWallet::GetStakeWeight() const
     if (setCoins.empty())
         return 0;
 
-    uint64_t nWeight = 0;
-    int64_t nCurrentTime = GetTime();
     LOCK2(cs_main, cs_wallet);
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    return GetCoinsStakeWeight(setCoins);
+}
+
+
+void CWallet::UpdateStakeCache(const CBlockIndex* pindexPrev, const std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // Cached block times stay valid while the chain only grows on top of the
+    // tip the cache was built against. On a reorg only the prevouts confirmed
+    // above the fork may now be in different blocks (or not at all); the rest
+    // are kept, so a short reorg costs a few lookups instead of all of them.
+    if (pindexPrev != pindexStakeCache) {
+        if (!pindexStakeCache || !pindexPrev) {
+            mapStakeCache.clear();
+        } else {
+            const CBlockIndex* pindexFork = LastCommonAncestor(pindexPrev, pindexStakeCache);
+            if (pindexFork != pindexStakeCache) {
+                size_t nCached = mapStakeCache.size();
+                for (std::map<COutPoint, CStakeCache>::iterator it = mapStakeCache.begin(); it != mapStakeCache.end(); ) {
+                    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->first.hash);
+                    const CBlockIndex* pindex = mi == mapWallet.end() ? NULL : LookupBlockIndex(mi->second.hashBlock);
+                    if (pindex && pindexFork->GetAncestor(pindex->nHeight) == pindex)
+                        ++it;
+                    else
+                        mapStakeCache.erase(it++);
+                }
+                LogPrint("coinstake", "UpdateStakeCache : reorg to %s forked at height %d, kept %u of %u cached kernels\n",
+                    pindexPrev->GetBlockHash().ToString(), pindexFork->nHeight, mapStakeCache.size(), nCached);
+            }
+        }
+        pindexStakeCache = pindexPrev;
+    }
+
+    std::set<COutPoint> setPrevouts;
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
     {
-		if (!mapWallet.count(pcoin.first->GetHash()))
+        COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+        CacheKernel(mapStakeCache, prevout);
+        setPrevouts.insert(prevout);
+    }
+
+    // Drop coins that were spent or are no longer staking candidates
+    if (mapStakeCache.size() > setPrevouts.size()) {
+        for (std::map<COutPoint, CStakeCache>::iterator it = mapStakeCache.begin(); it != mapStakeCache.end(); ) {
+            if (setPrevouts.count(it->first))
+                ++it;
+            else
+                mapStakeCache.erase(it++);
+        }
+    }
+}
+
+// Output script paying the stake back to the owner of scriptPubKeyKernel, and the key to sign it with
+static bool GetStakeKernelScript(const CKeyStore& keystore, const CScript& scriptPubKeyKernel, CScript& scriptPubKeyOut, CKey& key)
+{
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+    {
+        LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+        return false;
+    }
+    LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+    if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+    {
+        LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+        return false;  // only support pay to public key and pay to address
+    }
+    if (whichType == TX_PUBKEYHASH) // pay to address type
+    {
+        // convert to pay to public key type
+        if (!keystore.GetKey(uint160(vSolutions[0]), key))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+
+        scriptPubKeyOut = CScript() << key.GetPubKey().getvch() << OP_CHECKSIG;
+    }
+    if (whichType == TX_PUBKEY)
+    {
+        if (!keystore.GetKey(Hash160(vSolutions[0]), key))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+            return false;  // unable to find corresponding public key
+        }
+
+        if (key.GetPubKey() != vSolutions[0])
+        {
+            LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+            return false; // keys mismatch
+        }
+
+        scriptPubKeyOut = scriptPubKeyKernel;
+    }
+    return true;
+}
+
+/** A staking output, with the wallet and the stake cache it belongs to */
+struct CStakeCandidate
+{
+    CWallet* pwallet;
+    const std::map<COutPoint, CStakeCache>* pcache;
+    const CWalletTx* pcoin;
+    unsigned int nOut;
+};
+
+// Search every nShards-th coin starting at nShard until any shard finds a kernel
+static void SearchStakeKernelShard(const std::vector<CStakeCandidate>& vCoins, size_t nShard, size_t nShards,
+                                   CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, unsigned int nCount,
+                                   std::atomic<bool>& fFound, CCriticalSection& cs, CStakeKernel& kernelRet)
+{
+    for (size_t i = nShard; i < vCoins.size() && !fFound && pindexPrev == pindexBestHeader; i += nShards)
+    {
+        boost::this_thread::interruption_point();
+        const CStakeCandidate& candidate = vCoins[i];
+        const CWalletTx* pcoin = candidate.pcoin;
+        unsigned int nOut = candidate.nOut;
+        uint32_t nTimeKernel;
+        unsigned int nHashes = 0;
+        bool fKernel = SearchKernel(pindexPrev, nBits, nTimeFrom, nCount, COutPoint(pcoin->GetHash(), nOut), *candidate.pcache, nTimeKernel, &nHashes);
+        stakingStats.nCoinsEvaluated++;
+        stakingStats.nKernelsHashed += nHashes;
+        TRACE5(staking, coinstake_iteration, pcoin->GetHash().begin(), nOut, pindexPrev->nHeight + 1, nHashes, fKernel);
+        if (!fKernel)
             continue;
 
-        if (nCurrentTime - pcoin.first->GetTxTime() > Params().GetConsensus().nStakeMinAge)
-            nWeight += pcoin.first->tx->vout[pcoin.second].nValue;
+        // Found a kernel
+        LogPrintf("CreateCoinStake : kernel found\n");
+        CScript scriptPubKeyOut;
+        CKey key;
+        if (!GetStakeKernelScript(*candidate.pwallet, pcoin->tx->vout[nOut].scriptPubKey, scriptPubKeyOut, key))
+            continue;
+
+        LOCK(cs);
+        if (!fFound) {
+            kernelRet.pwallet = candidate.pwallet;
+            kernelRet.pcoin = pcoin;
+            kernelRet.nOut = nOut;
+            kernelRet.nTime = nTimeKernel;
+            fFound = true;
+        }
+        return;
     }
+}
 
-    return nWeight;
+// Search every nShards-th coin starting at nShard for its earliest kernel, keeping the earliest of all shards
+static void ForecastStakeKernelShard(const std::vector<CStakeCandidate>& vCoins, size_t nShard, size_t nShards,
+                                     CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep,
+                                     std::atomic<bool>& fFound, CCriticalSection& cs, CStakeKernel& kernelRet)
+{
+    for (size_t i = nShard; i < vCoins.size() && pindexPrev == pindexBestHeader; i += nShards)
+    {
+        boost::this_thread::interruption_point();
+        const CStakeCandidate& candidate = vCoins[i];
+        const CWalletTx* pcoin = candidate.pcoin;
+        unsigned int nOut = candidate.nOut;
+        // Only a kernel earlier than the best so far is of use
+        uint32_t nTimeLast = nTimeTo;
+        {
+            LOCK(cs);
+            if (fFound) {
+                if (kernelRet.nTime <= nTimeFrom)
+                    return;
+                nTimeLast = kernelRet.nTime - nStep;
+            }
+        }
+        uint32_t nTimeKernel;
+        unsigned int nHashes = 0;
+        bool fKernel = SearchKernelForward(pindexPrev, nBits, nTimeFrom, nTimeLast, nStep, COutPoint(pcoin->GetHash(), nOut), *candidate.pcache, nTimeKernel, &nHashes);
+        stakingStats.nCoinsEvaluated++;
+        stakingStats.nKernelsHashed += nHashes;
+        if (!fKernel)
+            continue;
+
+        CScript scriptPubKeyOut;
+        CKey key;
+        if (!GetStakeKernelScript(*candidate.pwallet, pcoin->tx->vout[nOut].scriptPubKey, scriptPubKeyOut, key))
+            continue;
+
+        LOCK(cs);
+        if (!fFound || nTimeKernel < kernelRet.nTime) {
+            kernelRet.pwallet = candidate.pwallet;
+            kernelRet.pcoin = pcoin;
+            kernelRet.nOut = nOut;
+            kernelRet.nTime = nTimeKernel;
+            fFound = true;
+        }
+    }
 }
 
+bool CWallet::SelectStakeCandidates(const std::vector<CWallet*>& vpwalletsIn, const CBlockIndex* pindexPrev, std::vector<CStakeCandidate>& vCoins)
+{
+    for (CWallet* pwallet : vpwalletsIn) {
+        std::vector<std::pair<const CWalletTx*,unsigned int> > vWalletCoins;
+        if (pwallet->IsLocked() || !pwallet->SelectStakeKernelCoins(pindexPrev, vWalletCoins))
+            continue;
+        for (const std::pair<const CWalletTx*,unsigned int>& coin : vWalletCoins)
+            vCoins.push_back(CStakeCandidate{pwallet, &pwallet->mapStakeCache, coin.first, coin.second});
+    }
+    UpdateStakingWeight();
+    return !vCoins.empty();
+}
+
+// Run shard(n) for n in [0, nShards), shard 0 on this thread
+static void RunStakeShards(size_t nShards, const std::function<void(size_t)>& shard)
+{
+    boost::thread_group threadGroup;
+    for (size_t nShard = 1; nShard < nShards; nShard++) {
+        threadGroup.create_thread([&, nShard]() {
+            RenameThread("bitcoin-stake");
+            PlaceThread("stake");
+            try {
+                shard(nShard);
+            } catch (const boost::thread_interrupted&) {}
+        });
+    }
+    try {
+        shard(0);
+    } catch (const boost::thread_interrupted&) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+    threadGroup.join_all();
+}
+
+bool CWallet::SelectStakeKernelCoins(const CBlockIndex* pindexPrev, std::vector<std::pair<const CWalletTx*,unsigned int> >& vCoins)
+{
+    // Choose coins to use
+    CAmount nBalance = GetBalance();
+    if (nBalance <= nReserveBalance) {
+        nLastStakeWeight = 0;
+        return false;
+    }
+
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    CAmount nValueIn = 0;
+    CAmount nTargetValue = nBalance - nReserveBalance;
+    if (!SelectCoinsForStaking(nTargetValue, setCoins, nValueIn) || setCoins.empty()) {
+        nLastStakeWeight = 0;
+        return false;
+    }
+    nLastStakeWeight = GetCoinsStakeWeight(setCoins);
+
+    if (GetBoolArg("-stakecache", DEFAULT_STAKE_CACHE)) {
+        LOCK2(cs_main, cs_wallet);
+        UpdateStakeCache(pindexPrev, setCoins);
+    } else {
+        mapStakeCache.clear();
+    }
+    vCoins.assign(setCoins.begin(), setCoins.end());
+    return true;
+}
+
+void CWallet::UpdateStakingWeight()
+{
+    uint64_t nWeight = 0;
+    for (const CWallet* pwallet : vpwallets)
+        nWeight += pwallet->nLastStakeWeight;
+    stakingStatus.nWeight = nWeight;
+}
+
+bool CWallet::FindStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, int64_t nSearchInterval, CStakeKernel& kernelRet, int nThreads)
+{
+    return FindStakeKernel(std::vector<CWallet*>(1, this), pindexPrev, nBits, nTimeFrom, nSearchInterval, kernelRet, nThreads);
+}
+
+bool CWallet::FindStakeKernel(const std::vector<CWallet*>& vpwalletsIn, CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, int64_t nSearchInterval, CStakeKernel& kernelRet, int nThreads)
+{
+    static const int64_t nMaxStakeSearchInterval = 60;
+
+    int64_t nTimeStart = GetTimeMicros();
+    std::vector<CStakeCandidate> vCoins;
+    if (!SelectStakeCandidates(vpwalletsIn, pindexPrev, vCoins))
+        return false;
+    int64_t nTimeSelected = GetTimeMicros();
+    stakingStats.nSelectCoinsMicros += nTimeSelected - nTimeStart;
+    uint64_t nHashesBefore = stakingStats.nKernelsHashed;
+
+    unsigned int nCount = std::min(nSearchInterval, nMaxStakeSearchInterval);
+    size_t nShards = std::max(1, std::min(nThreads, (int)vCoins.size()));
+    std::atomic<bool> fFound(false);
+    CCriticalSection cs;
+
+    RunStakeShards(nShards, [&](size_t nShard) {
+        SearchStakeKernelShard(vCoins, nShard, nShards, pindexPrev, nBits, nTimeFrom, nCount, fFound, cs, kernelRet);
+    });
+
+    int64_t nTimeSearched = GetTimeMicros();
+    stakingStats.nSearches++;
+    stakingStats.nHashMicros += nTimeSearched - nTimeSelected;
+    stakingStats.nLastSearchMicros = nTimeSearched - nTimeSelected;
+    stakingStats.nLastSearchHashes = stakingStats.nKernelsHashed - nHashesBefore;
+    if (fFound)
+        stakingStats.nKernelsFound++;
+
+    return fFound;
+}
+
+bool CWallet::ForecastStakeKernel(const std::vector<CWallet*>& vpwalletsIn, CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep, CStakeKernel& kernelRet, int nThreads)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    std::vector<CStakeCandidate> vCoins;
+    if (!SelectStakeCandidates(vpwalletsIn, pindexPrev, vCoins))
+        return false;
+    int64_t nTimeSelected = GetTimeMicros();
+    stakingStats.nSelectCoinsMicros += nTimeSelected - nTimeStart;
+    uint64_t nHashesBefore = stakingStats.nKernelsHashed;
+
+    size_t nShards = std::max(1, std::min(nThreads, (int)vCoins.size()));
+    std::atomic<bool> fFound(false);
+    CCriticalSection cs;
+
+    RunStakeShards(nShards, [&](size_t nShard) {
+        ForecastStakeKernelShard(vCoins, nShard, nShards, pindexPrev, nBits, nTimeFrom, nTimeTo, nStep, fFound, cs, kernelRet);
+    });
+
+    int64_t nTimeSearched = GetTimeMicros();
+    stakingStats.nSearches++;
+    stakingStats.nHashMicros += nTimeSearched - nTimeSelected;
+    stakingStats.nLastSearchMicros = nTimeSearched - nTimeSelected;
+    stakingStats.nLastSearchHashes = stakingStats.nKernelsHashed - nHashesBefore;
+    if (fFound)
+        stakingStats.nKernelsFound++;
+
+    return fFound;
+}
 
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key)
+{
+    CStakeKernel kernel;
+    if (!FindStakeKernel(pindexBestHeader, nBits, tx.nTime, nSearchInterval, kernel))
+        return false;
+
+    return CreateCoinStake(keystore, kernel, nFees, tx, key);
+}
+
+bool CWallet::CreateCoinStake(const CKeyStore& keystore, const CStakeKernel& kernel, CAmount& nFees, CMutableTransaction& tx, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBestHeader;
-    arith_uint256 bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
 
     struct CMutableTransaction txNew(tx);
     txNew.vin.clear();
@@ -4227,7 +5674,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     // Select coins with suitable depth
     CAmount nTargetValue = nBalance - nReserveBalance;
-    //DbgMsg("스태이킹할 코인 선택 targetValue %d = %d - %d" , nTargetValue , nBalance , nReserveBalance);
     if (!SelectCoinsForStaking(nTargetValue, setCoins, nValueIn)) { 
     	return false;
     }
@@ -4235,87 +5681,19 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
     	return false;
 
-     
-
     int64_t nCredit = 0;
-    CScript scriptPubKeyKernel;
-    
-    int idx1 = 0;
-    // enum wallet tx..
-    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& pcoin, setCoins)
-    {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        // find wallet tx nounce
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBestHeader; n++)
-        {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            uint32_t nBlockTime;
-            //LogPrintf("looking for coinstake \n");
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrintf("CreateCoinStake : kernel found\n");
-                vector<vector<unsigned char> > vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->tx->vout[pcoin.second].scriptPubKey;
-                
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    scriptPubKeyOut << key.GetPubKey().getvch() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    if (!keystore.GetKey(Hash160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
+    CScript scriptPubKeyKernel = kernel.pcoin->tx->vout[kernel.nOut].scriptPubKey;
+    CScript scriptPubKeyOut;
+    if (!GetStakeKernelScript(keystore, scriptPubKeyKernel, scriptPubKeyOut, key))
+        return false;
 
-                    if (key.GetPubKey() != vSolutions[0])
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+    txNew.nTime = kernel.nTime;
+    txNew.vin.push_back(CTxIn(kernel.pcoin->GetHash(), kernel.nOut));
+    nCredit += kernel.pcoin->tx->vout[kernel.nOut].nValue;
+    vwtxPrev.push_back(kernel.pcoin);
+    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+    LogPrint("coinstake", "CreateCoinStake : added kernel\n");
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->tx->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            } 
-        }
-
-        if (fKernelFound)
-            break; // if kernel is found stop searching
-    }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
@@ -4333,7 +5711,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             if (nCredit + pcoin.first->tx->vout[pcoin.second].nValue > nBalance - nReserveBalance)
                 break;
             // Do not add additional significant input
-            if (pcoin.first->tx->vout[pcoin.second].nValue >= GetStakeCombineThreshold())
+            if (pcoin.first->tx->vout[pcoin.second].nValue >= nStakeCombineThreshold)
                 continue;
 
             txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
@@ -4356,7 +5734,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     }
 
 
-    if (nCredit >= GetStakeSplitThreshold())
+    if (nCredit >= nStakeSplitThreshold)
     	txNew.vout.push_back(CTxOut(0, txNew.vout[1].scriptPubKey)); //split stake
 
     // Set output amount
@@ -4369,12 +5747,13 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     	txNew.vout[1].nValue = nCredit;
 
     // Sign
+    std::vector<CTxOut> vPrevOuts;
+    vPrevOuts.reserve(vwtxPrev.size());
     int nIn = 0;
     BOOST_FOREACH(const CWalletTx* pcoin, vwtxPrev)
-    {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL))
-            return error("CreateCoinStake : failed to sign coinstake");
-    }
+        vPrevOuts.push_back(pcoin->tx->vout[txNew.vin[nIn++].prevout.n]);
+    if (!ProduceSignatures(*this, txNew, vPrevOuts))
+        return error("CreateCoinStake : failed to sign coinstake");
 
         
     unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
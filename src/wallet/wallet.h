@@ -7,6 +7,7 @@
 #define BITCOIN_WALLET_WALLET_H
 
 #include "amount.h"
+#include "pos.h"
 #include "streams.h"
 #include "tinyformat.h"
 #include "ui_interface.h"
@@ -32,6 +33,8 @@
 #include <boost/thread.hpp>
 
 extern CWallet* pwalletMain;
+//! All loaded wallets: pwalletMain, which RPC and the GUI act on, then the -stakewallet ones, which only stake
+extern std::vector<CWallet*> vpwallets;
 
 /**
  * Settings
@@ -42,6 +45,7 @@ extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
 extern bool fWalletUnlockStakingOnly;
 extern bool fWalletRbf;
+extern bool fWatchOnlyIndex;
 extern CAmount nReserveBalance;
 extern CAmount nMinimumInputValue;
 
@@ -68,16 +72,49 @@ static const bool DEFAULT_WALLET_REJECT_LONG_CHAINS = false;
 static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 6;
 //! -walletrbf default
 static const bool DEFAULT_WALLET_RBF = false;
+//! -watchonlyindex default
+static const bool DEFAULT_WATCHONLY_INDEX = false;
+//! -stakecache default
+static const bool DEFAULT_STAKE_CACHE = true;
+//! -stakingkeycache default
+static const bool DEFAULT_STAKING_KEY_CACHE = false;
+//! -stakecombinethreshold default: outputs this large are not added to a coinstake
+static const CAmount DEFAULT_STAKE_COMBINE_THRESHOLD = 500000 * COIN;
+//! -stakesplitthreshold default: coinstakes crediting this much are split in two
+static const CAmount DEFAULT_STAKE_SPLIT_THRESHOLD = 2 * DEFAULT_STAKE_COMBINE_THRESHOLD;
+//! Outputs smaller than this do not stake
+static const CAmount MIN_STAKE_INPUT_VALUE = 1 * COIN;
+//! -stakemaintenance default, in minutes (0 = off)
+static const int64_t DEFAULT_STAKE_MAINTENANCE = 0;
+//! Most inputs or outputs of a stake maintenance transaction
+static const unsigned int MAX_STAKE_MAINTENANCE_IO = 50;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000; // Fee
 static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
+//! Most threads a rescan reads and matches blocks on
+static const int MAX_RESCAN_THREADS = 8;
+//! Blocks a rescan reads ahead per thread
+static const size_t RESCAN_BATCH_BLOCKS_PER_THREAD = 8;
+//! Most threads a key pool top-up generates keys on
+static const int MAX_KEYPOOL_THREADS = 8;
+//! Keys a top-up generates and writes at a time
+static const unsigned int KEYPOOL_TOPUP_BATCH = 1000;
+//! Fewest keys worth starting another generator thread for
+static const unsigned int KEYPOOL_KEYS_PER_THREAD = 50;
+//! Most threads wallet loading decodes transaction records on
+static const int MAX_WALLET_LOAD_THREADS = 8;
+//! Transaction records decoded at a time while loading the wallet
+static const size_t WALLET_LOAD_TX_BATCH = 4096;
+//! Fewest transaction records worth starting another decoding thread for
+static const size_t WALLET_LOAD_TXS_PER_THREAD = 256;
 
 extern const char * DEFAULT_WALLET_DAT;
 
 class CBlockIndex;
+class CChainSnapshot;
 class CCoinControl;
 class COutput;
 class CReserveKey;
@@ -238,6 +275,8 @@ public:
     int GetDepthInMainChain(const CBlockIndex* &pindexRet) const;
     int GetDepthInMainChain() const { const CBlockIndex *pindexRet; return GetDepthInMainChain(pindexRet); }
     bool IsInMainChain() const { const CBlockIndex *pindexRet; return GetDepthInMainChain(pindexRet) > 0; }
+    /** GetDepthInMainChain against a snapshot of the chain, which needs no cs_main */
+    int GetDepthInChain(const CChainSnapshot& chain) const;
     int GetBlocksToMaturity() const;
     /** Pass this transaction to the mempool. Fails if absolute fee exceeds absurd fee. */
     bool AcceptToMemoryPool(const CAmount& nAbsurdFee, CValidationState& state);
@@ -385,18 +424,8 @@ public:
     }
 
     //! make sure balances are recalculated
-    void MarkDirty()
-    {
-        fCreditCached = false;
-        fAvailableCreditCached = false;
-        fImmatureCreditCached = false;
-        fWatchDebitCached = false;
-        fWatchCreditCached = false;
-        fAvailableWatchCreditCached = false;
-        fImmatureWatchCreditCached = false;
-        fDebitCached = false;
-        fChangeCached = false;
-    }
+    //! Break the credit/debit caches, and the wallet's balance totals for this transaction
+    void MarkDirty();
 
     void BindWallet(CWallet *pwalletIn)
     {
@@ -460,6 +489,33 @@ public:
     std::string ToString() const;
 };
 
+/** An unspent watch-only output as the address index has it, rather than from a wallet transaction */
+struct CIndexedOutput
+{
+    COutPoint outpoint;
+    CTxOut txout;
+    //! Height of its block, or -1 while it is in the mempool
+    int nHeight;
+    bool fCoinStake;
+    bool fImmature;
+
+    CIndexedOutput() : nHeight(-1), fCoinStake(false), fImmature(false) {}
+};
+
+/** A staking output whose kernel meets the target at nTime */
+struct CStakeCandidate;
+
+struct CStakeKernel
+{
+    //! Wallet of the staking output, to build and sign the coinstake with
+    CWallet* pwallet;
+    const CWalletTx* pcoin;
+    unsigned int nOut;
+    uint32_t nTime;
+
+    CStakeKernel() : pwallet(NULL), pcoin(NULL), nOut(0), nTime(0) {}
+};
+
 
 
 
@@ -573,6 +629,59 @@ private:
 };
 
 
+/** What one transaction, or the whole wallet, adds to each kind of balance */
+struct CWalletBalances
+{
+    CAmount nBalance;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nStake;
+    CAmount nWatchOnlyBalance;
+    CAmount nUnconfirmedWatchOnly;
+    CAmount nImmatureWatchOnly;
+    CAmount nWatchOnlyStake;
+
+    CWalletBalances() { SetNull(); }
+
+    void SetNull()
+    {
+        nBalance = nUnconfirmed = nImmature = nStake = 0;
+        nWatchOnlyBalance = nUnconfirmedWatchOnly = nImmatureWatchOnly = nWatchOnlyStake = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nBalance == 0 && nUnconfirmed == 0 && nImmature == 0 && nStake == 0 &&
+               nWatchOnlyBalance == 0 && nUnconfirmedWatchOnly == 0 && nImmatureWatchOnly == 0 && nWatchOnlyStake == 0;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nBalance += b.nBalance;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nStake += b.nStake;
+        nWatchOnlyBalance += b.nWatchOnlyBalance;
+        nUnconfirmedWatchOnly += b.nUnconfirmedWatchOnly;
+        nImmatureWatchOnly += b.nImmatureWatchOnly;
+        nWatchOnlyStake += b.nWatchOnlyStake;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nBalance -= b.nBalance;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nStake -= b.nStake;
+        nWatchOnlyBalance -= b.nWatchOnlyBalance;
+        nUnconfirmedWatchOnly -= b.nUnconfirmedWatchOnly;
+        nImmatureWatchOnly -= b.nImmatureWatchOnly;
+        nWatchOnlyStake -= b.nWatchOnlyStake;
+        return *this;
+    }
+};
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -590,6 +699,9 @@ private:
     bool SelectCoins(const std::vector<COutput>& vAvailableCoins, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
+    //! Handle of the open CWalletWriteBatch, which keystore and address book writes go through
+    CWalletDB *pwalletdbBatch;
+    friend class CWalletWriteBatch;
 
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
@@ -616,6 +728,13 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Erase transactions from the wallet file in one database transaction,
+     * then from mapWallet, mapTxSpends, wtxOrdered and the indexes kept
+     * next to them. Returns false, erasing nothing, if the write failed.
+     */
+    bool EraseWalletTxs(const std::set<uint256>& setHashes);
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -692,11 +811,18 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        pindexStakeCache = NULL;
+        nLastStakeWeight = 0;
+        fStakeCandidatesInit = false;
+        fUnspentCoinsInit = false;
+        fBalancesInit = false;
+        fTxBlocksInit = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -727,13 +853,15 @@ public:
 
     /**
      * Shuffle and select coins until nTargetValue is reached while avoiding
-     * small change; This method is stochastic for some inputs and upon
+     * small change; an exact match is searched for by branch and bound first,
+     * then this method is stochastic for some inputs and upon
      * completion the coin set and corresponding actual target value is
      * assembled
      */
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
-    bool IsSpent(const uint256& hash, unsigned int n) const;
+    /** Whether a wallet transaction spends the output; with pchain, judged against it instead of chainActive, without cs_main */
+    bool IsSpent(const uint256& hash, unsigned int n, const CChainSnapshot* pchain = NULL) const;
 
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(const COutPoint& output);
@@ -747,6 +875,10 @@ public:
      */
     CPubKey GenerateNewKey();
     void DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret);
+    //! The HD key at m/0'/0' that the external keys are derived from
+    void DeriveExternalChainKey(CExtKey& externalChainChildKey) const;
+    //! Record the metadata of a generated key and add it to the store
+    void AddGeneratedKey(const CKey& secret, const CPubKey& pubkey, const CKeyMetadata& metadata);
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey) override;
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
@@ -811,6 +943,34 @@ public:
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+    //! All the balances above at once
+    CWalletBalances GetBalances() const;
+    //! Whether watch-only balances and outputs are taken from the address index (-watchonlyindex)
+    bool UseIndexForWatchOnly() const;
+    /**
+     * The unspent outputs of the watch-only scripts, read from the address
+     * index and the mempool's instead of from the wallet's transactions.
+     * Returns false if that mode is off or the index does not cover every
+     * watch-only script.
+     */
+    bool GetIndexedWatchOnlyOutputs(std::vector<CIndexedOutput>& vOutputs) const;
+    /**
+     * Add the transactions in blocks from nStartHeight on that pay or spend
+     * from vScripts, found by looking the scripts up in the address index
+     * rather than by a rescan. Returns false if the index does not cover
+     * them or a block could not be read.
+     */
+    bool AddIndexedTransactions(const std::vector<CScript>& vScripts, int nStartHeight);
+    //! Have the balance totals and the block index of wallet transactions
+    //! look at hashTx again on their next read
+    void MarkTxDirty(const uint256& hashTx) const;
+    /**
+     * The wallet transactions that are not in the active chain at or below
+     * pindexFrom: those confirmed in later active blocks, and the
+     * unconfirmed, conflicted and abandoned ones, or all of them if
+     * pindexFrom is NULL. In txid order.
+     */
+    void GetWalletTxsSince(const CBlockIndex* pindexFrom, std::vector<const CWalletTx*>& vtx) const;
 
     /**
      * Insert additional inputs into the transaction by
@@ -835,6 +995,8 @@ public:
 
     static CFeeRate minTxFee;
     static CFeeRate fallbackFee;
+    static CAmount nStakeCombineThreshold;
+    static CAmount nStakeSplitThreshold;
     /**
      * Estimate the minimum fee considering user set parameters
      * and the required fee
@@ -886,6 +1048,7 @@ public:
     CAmount GetCredit(const CTransaction& tx, const isminefilter& filter) const;
     CAmount GetChange(const CTransaction& tx) const;
     void SetBestChain(const CBlockLocator& loc) override;
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload) override;
 
     DBErrors LoadWallet(bool& fFirstRunRet);
     DBErrors ZapWalletTx(std::vector<CWalletTx>& vWtx);
@@ -920,6 +1083,9 @@ public:
         return setKeyPool.size();
     }
 
+    //! Memory taken by mapWallet and its transactions, not counting their metadata strings
+    size_t GetWalletTxMemoryUsage() const;
+
     bool SetDefaultKey(const CPubKey &vchPubKey);
 
     //! signify that a particular wallet feature is now used. this may change nWalletVersion and nWalletMaxVersion if those are lower
@@ -973,6 +1139,15 @@ public:
     /* Mark a transaction (and it in-wallet descendants) as abandoned so its inputs may be respent. */
     bool AbandonTransaction(const uint256& hashTx);
 
+    /**
+     * Remove the coinstakes and coinbases no active block holds, the
+     * conflicted transactions and, with fIncludeAbandoned, the abandoned
+     * ones, together with their unconfirmed in-wallet descendants. Runs on
+     * a loaded wallet in one pass, as one database transaction. Returns
+     * false if the wallet file could not be written.
+     */
+    bool RemoveOrphanedTxs(bool fIncludeAbandoned, std::vector<uint256>& vRemoved);
+
     /** Mark a transaction as replaced by another transaction (e.g., BIP 125). */
     bool MarkReplaced(const uint256& originalHash, const uint256& newHash);
 
@@ -982,6 +1157,12 @@ public:
     /* Initializes the wallet, returns a new CWallet instance or a null pointer in case of an error */
     static CWallet* CreateWalletFromFile(const std::string walletFile);
     static bool InitLoadWallet();
+    /**
+     * Read the -wallet file ahead of InitLoadWallet, which then picks up
+     * from there. Needs no chain state, so it can run on another thread
+     * while the block index loads. Does nothing with -zapwallettxes.
+     */
+    static void PreloadWallet();
 
     /**
      * Wallet post-init setup
@@ -1007,12 +1188,147 @@ public:
     /* Set the current HD master key (will reset the chain child index counters) */
     bool SetHDMasterKey(const CPubKey& key);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CAmount& nFees, CMutableTransaction& tx, CKey& key);
+    /** Build and sign the coinstake spending an already found kernel */
+    bool CreateCoinStake(const CKeyStore& keystore, const CStakeKernel& kernel, CAmount& nFees, CMutableTransaction& tx, CKey& key);
+    /**
+     * Search the staking coins for a kernel at nTimeFrom and up to
+     * nSearchInterval - 1 seconds before it, splitting the coins across
+     * nThreads threads. Only kernels the wallet can sign for are returned.
+     */
+    bool FindStakeKernel(CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, int64_t nSearchInterval, CStakeKernel& kernelRet, int nThreads = 1);
+    /**
+     * The same over the staking coins of all of vpwalletsIn in one pass, so
+     * many small wallets share the threads like the coins of one would.
+     * Locked wallets are skipped.
+     */
+    static bool FindStakeKernel(const std::vector<CWallet*>& vpwalletsIn, CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, int64_t nSearchInterval, CStakeKernel& kernelRet, int nThreads = 1);
+    /**
+     * Search the staking coins of all of vpwalletsIn for the earliest kernel
+     * among the timestamps nTimeFrom, nTimeFrom + nStep, ... up to nTimeTo,
+     * so the stake miner can forecast a whole window on a new tip.
+     */
+    static bool ForecastStakeKernel(const std::vector<CWallet*>& vpwalletsIn, CBlockIndex* pindexPrev, unsigned int nBits, uint32_t nTimeFrom, uint32_t nTimeTo, uint32_t nStep, CStakeKernel& kernelRet, int nThreads = 1);
+    //! Set stakingStatus.nWeight to the weight all of vpwallets last found
+    static void UpdateStakingWeight();
     bool SelectCoinsForStaking(CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins) const;
     bool HaveAvailableCoinsForStaking() const;
     uint64_t GetStakeWeight() const;
-    static const bool DEFAULT_STAKE_CACHE = true;
+    /**
+     * Reshape the staking outputs: merge the outputs of one script that are
+     * too small to stake into one, and split an output far above the split
+     * threshold into pieces a coinstake neither combines nor splits again.
+     * Does at most one of each per call; run from the scheduler.
+     */
+    void MaintainStakeOutputs(CConnman* connman);
+
+private:
+    /**
+     * Kernel inputs of the staking candidates, filled once per prevout so that
+     * a stake search cycle does no txindex or block file reads after warm-up.
+     * Only touched from CreateCoinStake on the staking thread; refreshed under
+     * cs_main and cs_wallet, read without locks during the kernel search.
+     */
+    std::map<COutPoint, CStakeCache> mapStakeCache;
+    //! Tip mapStakeCache was last validated against
+    const CBlockIndex* pindexStakeCache;
+    void UpdateStakeCache(const CBlockIndex* pindexPrev, const std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins);
+    //! Select the coins to search for a kernel and refresh their stake cache; false if there are none
+    bool SelectStakeKernelCoins(const CBlockIndex* pindexPrev, std::vector<std::pair<const CWalletTx*,unsigned int> >& vCoins);
+    //! The staking coins of all unlocked wallets of vpwalletsIn, for FindStakeKernel and ForecastStakeKernel
+    static bool SelectStakeCandidates(const std::vector<CWallet*>& vpwalletsIn, const CBlockIndex* pindexPrev, std::vector<CStakeCandidate>& vCoins);
+    //! Stake weight of the coins the last search or tip update selected
+    std::atomic<uint64_t> nLastStakeWeight;
+
+    /**
+     * Outputs that may be staked once old enough, ordered by the time their
+     * transaction reaches nStakeMinAge, so AvailableCoinsForStaking does not
+     * have to walk all of mapWallet. Kept in step with mapWallet and
+     * mapTxSpends after a full build on first use. Guarded by cs_wallet.
+     */
+    mutable std::set<std::pair<int64_t, COutPoint> > setStakeCandidates;
+    mutable std::map<COutPoint, int64_t> mapStakeCandidates;
+    mutable bool fStakeCandidatesInit;
+    //! Re-evaluate the staking candidates among the outputs of hashTx
+    void UpdateStakeCandidates(const uint256& hashTx, const CChainSnapshot* pchain = NULL) const;
 
+    /**
+     * The wallet's unspent outputs and whether they are ours to spend or
+     * watch, so AvailableCoins visits those rather than every output of
+     * mapWallet. Kept in step with mapWallet and mapTxSpends like the staking
+     * candidates, and rebuilt on first use and after MarkDirty(), which key
+     * imports call. Guarded by cs_wallet.
+     */
+    mutable std::map<COutPoint, isminetype> mapUnspentCoins;
+    mutable bool fUnspentCoinsInit;
+    //! Re-evaluate which outputs of hashTx are unspent and ours
+    void UpdateUnspentCoins(const uint256& hashTx) const;
+
+    /**
+     * Balance totals, kept as the sum of what each transaction contributes
+     * so reading them does not walk mapWallet. A transaction's contribution
+     * is recomputed when it is marked dirty, and those of unconfirmed and
+     * immature transactions, which change with the chain and the mempool
+     * without the transaction itself changing, on every read. Built in full
+     * on first use and after MarkDirty(). Guarded by cs_wallet.
+     */
+    mutable CWalletBalances cachedBalances;
+    //! Nonzero contributions to cachedBalances, by transaction
+    mutable std::map<uint256, CWalletBalances> mapBalanceContributions;
+    mutable std::set<uint256> setBalanceDirty;
+    //! Unconfirmed and immature transactions
+    mutable std::set<uint256> setBalanceVolatile;
+    mutable bool fBalancesInit;
+    //! Bring cachedBalances up to date
+    void UpdateBalances() const;
+
+    /**
+     * Wallet transactions by the active block that confirms them, and the
+     * set of those no active block confirms, so listsinceblock visits the
+     * blocks it asks about rather than all of mapWallet. Entries are
+     * re-evaluated against the active chain when their transaction is
+     * marked dirty, which a block disconnect does for each transaction in
+     * it, and rebuilt on first use and after MarkDirty(). Guarded by
+     * cs_wallet.
+     */
+    mutable std::multimap<uint256, uint256> mapTxsByBlock;
+    //! The block each indexed transaction is filed under, null if floating
+    mutable std::map<uint256, uint256> mapTxBlock;
+    mutable std::set<uint256> setFloatingTxs;
+    mutable std::set<uint256> setTxBlocksDirty;
+    mutable bool fTxBlocksInit;
+    //! Bring mapTxsByBlock and setFloatingTxs up to date
+    void UpdateTxBlocks() const;
+
+    /**
+     * Heights from nStartHeight on of the blocks the address index lists
+     * for the wallet's keys and scripts. Returns false if the index is off
+     * or the wallet has scripts it does not cover.
+     */
+    bool GetRescanHeights(int nStartHeight, std::set<int>& setHeights) const;
+
+};
+
+/**
+ * Groups the key, script, watch-only and address book writes of a wallet
+ * into database transactions while it lives, rather than committing each
+ * on its own, for imports of many keys. Flush() commits what was written
+ * so far and starts the next transaction, so a long import can keep each
+ * one to a size the database's lock table takes. cs_wallet must be held
+ * for its lifetime.
+ */
+class CWalletWriteBatch
+{
+public:
+    explicit CWalletWriteBatch(CWallet* pwalletIn);
+    ~CWalletWriteBatch();
+
+    /** Commit the writes so far; false if that failed */
+    bool Flush();
+
+private:
+    CWallet* pwallet;
+    CWalletDB* pwalletdb;
 };
 
 /** A key allocated from the key pool. */
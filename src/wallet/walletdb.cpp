@@ -11,11 +11,13 @@
 #include "protocol.h"
 #include "serialize.h"
 #include "sync.h"
+#include "txintern.h"
 #include "util.h"
 #include "utiltime.h"
 #include "wallet/wallet.h"
 
 #include <atomic>
+#include <thread>
 
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
@@ -278,6 +280,118 @@ public:
     }
 };
 
+/** Decode and check a "tx" record whose key stream is past the type */
+static bool ReadWalletTx(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    wtx.SetTx(InternTransaction(wtx.tx));
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static void LoadWalletTx(CWallet* pwallet, const CWalletTx& wtx, bool fUpgraded, CWalletScanState& wss)
+{
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(wtx.GetHash());
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->LoadToWallet(wtx);
+}
+
+/** A "tx" record waiting to be decoded with the rest of its batch */
+struct CWalletTxRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    CWalletTx wtx;
+    bool fValid;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletTxRecord(const CDataStream& ssKeyIn, const CDataStream& ssValueIn) : ssKey(ssKeyIn), ssValue(ssValueIn), fValid(false), fUpgraded(false) {}
+};
+
+static bool IsTxRecord(const CDataStream& ssKey)
+{
+    try {
+        CDataStream ssType(ssKey);
+        string strType;
+        ssType >> strType;
+        return strType == "tx";
+    } catch (...) {
+        return false;
+    }
+}
+
+/**
+ * Decode and check a batch of "tx" records on several threads, which is
+ * most of the work of loading a large wallet, then add them to the wallet
+ * in record order.
+ */
+static void LoadWalletTxBatch(CWallet* pwallet, std::vector<CWalletTxRecord>& vRecords, CWalletScanState& wss, bool& fNoncriticalErrors)
+{
+    std::atomic<size_t> nNext(0);
+    auto decode = [&vRecords, &nNext]() {
+        for (size_t i = nNext++; i < vRecords.size(); i = nNext++) {
+            CWalletTxRecord& record = vRecords[i];
+            try {
+                string strType;
+                record.ssKey >> strType;
+                record.fValid = ReadWalletTx(record.ssKey, record.ssValue, record.wtx, record.fUpgraded, record.strErr);
+            } catch (...) {
+                record.fValid = false;
+            }
+        }
+    };
+    int nThreads = std::max(1, std::min<int>(std::min(GetNumCores(), MAX_WALLET_LOAD_THREADS), vRecords.size() / WALLET_LOAD_TXS_PER_THREAD));
+    std::vector<std::thread> vThreads;
+    for (int i = 1; i < nThreads; i++)
+        vThreads.emplace_back(decode);
+    decode();
+    for (std::thread& thread : vThreads)
+        thread.join();
+
+    for (const CWalletTxRecord& record : vRecords) {
+        if (record.fValid) {
+            LoadWalletTx(pwallet, record.wtx, record.fUpgraded, wss);
+        } else {
+            fNoncriticalErrors = true;
+            // Rescan if there is a bad transaction record:
+            SoftSetBoolArg("-rescan", true);
+        }
+        if (!record.strErr.empty())
+            LogPrintf("%s\n", record.strErr);
+    }
+    vRecords.clear();
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -301,38 +415,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!ReadWalletTx(ssKey, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->LoadToWallet(wtx);
+            LoadWalletTx(pwallet, wtx, fUpgraded, wss);
         }
         else if (strType == "acentry")
         {
@@ -577,6 +664,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
+        std::vector<CWalletTxRecord> vTxRecords;
         while (true)
         {
             // Read next record
@@ -591,6 +679,14 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
+            // Transactions are decoded in parallel batches
+            if (IsTxRecord(ssKey)) {
+                vTxRecords.push_back(CWalletTxRecord(ssKey, ssValue));
+                if (vTxRecords.size() >= WALLET_LOAD_TX_BATCH)
+                    LoadWalletTxBatch(pwallet, vTxRecords, wss, fNoncriticalErrors);
+                continue;
+            }
+
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
@@ -611,6 +707,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
+        LoadWalletTxBatch(pwallet, vTxRecords, wss, fNoncriticalErrors);
         pcursor->close();
     }
     catch (const boost::thread_interrupted&) {
@@ -725,45 +822,6 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
     return result;
 }
 
-DBErrors CWalletDB::ZapSelectTx(CWallet* pwallet, vector<uint256>& vTxHashIn, vector<uint256>& vTxHashOut)
-{
-    // build list of wallet TXs and hashes
-    vector<uint256> vTxHash;
-    vector<CWalletTx> vWtx;
-    DBErrors err = FindWalletTx(pwallet, vTxHash, vWtx);
-    if (err != DB_LOAD_OK) {
-        return err;
-    }
-
-    std::sort(vTxHash.begin(), vTxHash.end());
-    std::sort(vTxHashIn.begin(), vTxHashIn.end());
-
-    // erase each matching wallet TX
-    bool delerror = false;
-    vector<uint256>::iterator it = vTxHashIn.begin();
-    BOOST_FOREACH (uint256 hash, vTxHash) {
-        while (it < vTxHashIn.end() && (*it) < hash) {
-            it++;
-        }
-        if (it == vTxHashIn.end()) {
-            break;
-        }
-        else if ((*it) == hash) {
-            pwallet->mapWallet.erase(hash);
-            if(!EraseTx(hash)) {
-                LogPrint("db", "Transaction was found for deletion but returned database error: %s\n", hash.GetHex());
-                delerror = true;
-            }
-            vTxHashOut.push_back(hash);
-        }
-    }
-
-    if (delerror) {
-        return DB_CORRUPT;
-    }
-    return DB_LOAD_OK;
-}
-
 DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet, vector<CWalletTx>& vWtx)
 {
     // build list of wallet TXs
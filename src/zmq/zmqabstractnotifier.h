@@ -7,8 +7,11 @@
 
 #include "zmqconfig.h"
 
+#include <memory>
+
 class CBlockIndex;
 class CZMQAbstractNotifier;
+class uint256;
 
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
 
@@ -32,8 +35,16 @@ public:
     virtual bool Initialize(void *pcontext) = 0;
     virtual void Shutdown() = 0;
 
-    virtual bool NotifyBlock(const CBlockIndex *pindex);
+    /**
+     * Notify of a new tip. pblock is the tip's block if it is still in
+     * memory from connecting it, otherwise NULL.
+     */
+    virtual bool NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    /** Notify of each block connected to the active chain, including during initial download */
+    virtual bool NotifyBlockConnected(const CBlockIndex *pindex);
+    /** Notify of a transaction added to (fAdded) or removed from the mempool, with the mempool sequence it took */
+    virtual bool NotifyMempoolSequence(const uint256 &hash, bool fAdded, uint64_t nMempoolSequence);
 
 protected:
     void *psocket;
@@ -5,6 +5,7 @@
 #include "zmqnotificationinterface.h"
 #include "zmqpublishnotifier.h"
 
+#include "txmempool.h"
 #include "version.h"
 #include "validation.h"
 #include "streams.h"
@@ -15,7 +16,7 @@ void zmqError(const char *str)
     LogPrint("zmq", "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
 }
 
-CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL)
+CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL), pindexLastConnected(NULL)
 {
 }
 
@@ -39,6 +40,10 @@ CZMQNotificationInterface* CZMQNotificationInterface::Create()
     factories["pubhashtx"] = CZMQAbstractNotifier::Create<CZMQPublishHashTransactionNotifier>;
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
+    factories["pubhashstake"] = CZMQAbstractNotifier::Create<CZMQPublishHashStakeNotifier>;
+    factories["pubrawtxdelta"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionDeltaNotifier>;
+    factories["pubconnectstats"] = CZMQAbstractNotifier::Create<CZMQPublishConnectStatsNotifier>;
+    factories["pubsequence"] = CZMQAbstractNotifier::Create<CZMQPublishSequenceNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -103,6 +108,9 @@ bool CZMQNotificationInterface::Initialize()
         return false;
     }
 
+    CZMQAbstractPublishNotifier::StartSender(std::max<int64_t>(GetArg("-zmqqueuesize", DEFAULT_ZMQ_QUEUE_SIZE), 1));
+    mempool.NotifyEntrySequence.connect(boost::bind(&CZMQNotificationInterface::MempoolSequence, this, _1, _2, _3));
+
     return true;
 }
 
@@ -112,6 +120,9 @@ void CZMQNotificationInterface::Shutdown()
     LogPrint("zmq", "zmq: Shutdown notification interface\n");
     if (pcontext)
     {
+        mempool.NotifyEntrySequence.disconnect(boost::bind(&CZMQNotificationInterface::MempoolSequence, this, _1, _2, _3));
+        // Flush the queued messages while their sockets are still open
+        CZMQAbstractPublishNotifier::StopSender();
         for (std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin(); i!=notifiers.end(); ++i)
         {
             CZMQAbstractNotifier *notifier = *i;
@@ -126,13 +137,45 @@ void CZMQNotificationInterface::Shutdown()
 
 void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload)
 {
+    std::shared_ptr<const CBlock> pblock;
+    {
+        std::lock_guard<std::mutex> lock(csLastConnected);
+        if (pindexLastConnected == pindexNew)
+            pblock = pblockLastConnected;
+        pblockLastConnected.reset();
+        pindexLastConnected = NULL;
+    }
+
     if (fInitialDownload || pindexNew == pindexFork) // In IBD or blocks were disconnected without any new ones
         return;
 
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyBlock(pindexNew))
+        if (notifier->NotifyBlock(pindexNew, pblock))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
+
+void CZMQNotificationInterface::BlockConnected(const std::shared_ptr<const CBlock>& block, const CBlockIndex *pindex)
+{
+    {
+        std::lock_guard<std::mutex> lock(csLastConnected);
+        pblockLastConnected = block;
+        pindexLastConnected = pindex;
+    }
+
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyBlockConnected(pindex))
         {
             i++;
         }
@@ -160,3 +203,20 @@ void CZMQNotificationInterface::SyncTransaction(const CTransaction& tx, const CB
         }
     }
 }
+
+void CZMQNotificationInterface::MempoolSequence(const uint256& hash, bool fAdded, uint64_t nMempoolSequence)
+{
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyMempoolSequence(hash, fAdded, nMempoolSequence))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
@@ -6,12 +6,18 @@
 #define BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 
 #include "validationinterface.h"
-#include <string>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
+/** Default for -zmqqueuesize, the number of messages that may wait for the sender thread */
+static const unsigned int DEFAULT_ZMQ_QUEUE_SIZE = 1000;
+
 class CZMQNotificationInterface : public CValidationInterface
 {
 public:
@@ -26,12 +32,21 @@ protected:
     // CValidationInterface
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, int posInBlock);
     void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork, bool fInitialDownload);
+    void BlockConnected(const std::shared_ptr<const CBlock>& block, const CBlockIndex *pindex);
+
+    //! Connected to mempool.NotifyEntrySequence
+    void MempoolSequence(const uint256& hash, bool fAdded, uint64_t nMempoolSequence);
 
 private:
     CZMQNotificationInterface();
 
     void *pcontext;
     std::list<CZMQAbstractNotifier*> notifiers;
+
+    //! The last block connected, handed to the notifiers if it becomes the tip
+    std::mutex csLastConnected;
+    std::shared_ptr<const CBlock> pblockLastConnected;
+    const CBlockIndex *pindexLastConnected;
 };
 
 #endif // BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
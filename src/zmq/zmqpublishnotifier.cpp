@@ -9,12 +9,21 @@
 #include "util.h"
 #include "rpc/server.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
 
-static const char *MSG_HASHBLOCK = "hashblock";
-static const char *MSG_HASHTX    = "hashtx";
-static const char *MSG_RAWBLOCK  = "rawblock";
-static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_HASHBLOCK  = "hashblock";
+static const char *MSG_HASHTX     = "hashtx";
+static const char *MSG_RAWBLOCK   = "rawblock";
+static const char *MSG_RAWTX      = "rawtx";
+static const char *MSG_HASHSTAKE  = "hashstake";
+static const char *MSG_RAWTXDELTA = "rawtxdelta";
+static const char *MSG_CONNECTSTATS = "connectstats";
+static const char *MSG_SEQUENCE   = "sequence";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -56,6 +65,114 @@ static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
     return 0;
 }
 
+namespace {
+
+struct CZMQQueuedMessage
+{
+    void *psocket;
+    const char *command;
+    std::vector<unsigned char> data;
+    uint32_t nSequence;
+};
+
+/**
+ * Messages waiting to be written to their sockets by the sender thread, so
+ * the validation callbacks that produce them never block on ZMQ. Once the
+ * thread is running every send goes through it, which also keeps each socket
+ * on a single thread as ZMQ requires.
+ */
+class CZMQSendQueue
+{
+private:
+    std::mutex cs;
+    std::condition_variable cond;
+    std::deque<CZMQQueuedMessage> queue;
+    size_t nMaxQueued;
+    bool fRunning;
+    uint64_t nDropped;
+    std::thread thread;
+
+    void Run()
+    {
+        RenameThread("bitcoin-zmqpub");
+        std::unique_lock<std::mutex> lock(cs);
+        while (true) {
+            while (fRunning && queue.empty())
+                cond.wait(lock);
+            if (queue.empty())
+                break;
+            CZMQQueuedMessage msg = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+
+            unsigned char msgseq[sizeof(uint32_t)];
+            WriteLE32(&msgseq[0], msg.nSequence);
+            const unsigned char *data = msg.data.empty() ? NULL : &msg.data[0];
+            zmq_send_multipart(msg.psocket, msg.command, strlen(msg.command), data, msg.data.size(), msgseq, (size_t)sizeof(uint32_t), (void*)0);
+
+            lock.lock();
+        }
+    }
+
+public:
+    CZMQSendQueue() : nMaxQueued(0), fRunning(false), nDropped(0) { }
+
+    void Start(size_t nMaxQueuedIn)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        assert(!fRunning);
+        nMaxQueued = std::max<size_t>(nMaxQueuedIn, 1);
+        nDropped = 0;
+        fRunning = true;
+        thread = std::thread(&CZMQSendQueue::Run, this);
+    }
+
+    /** Drains the queue before returning, so the sockets can be closed afterwards */
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            if (!fRunning)
+                return;
+            fRunning = false;
+            cond.notify_one();
+        }
+        thread.join();
+        if (nDropped > 0)
+            LogPrint("zmq", "zmq: %u messages were dropped because the send queue was full\n", nDropped);
+    }
+
+    /** Returns false if the sender is not running; a full queue drops the message instead */
+    bool Push(CZMQQueuedMessage&& msg)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (!fRunning)
+            return false;
+        if (queue.size() >= nMaxQueued) {
+            if (nDropped++ == 0)
+                LogPrint("zmq", "zmq: Send queue full, dropping %s message %u\n", msg.command, msg.nSequence);
+            return true;
+        }
+        queue.push_back(std::move(msg));
+        cond.notify_one();
+        return true;
+    }
+};
+
+CZMQSendQueue sendQueue;
+
+}
+
+void CZMQAbstractPublishNotifier::StartSender(size_t nMaxQueued)
+{
+    sendQueue.Start(nMaxQueued);
+}
+
+void CZMQAbstractPublishNotifier::StopSender()
+{
+    sendQueue.Stop();
+}
+
 bool CZMQAbstractPublishNotifier::Initialize(void *pcontext)
 {
     assert(!psocket);
@@ -129,20 +246,43 @@ bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* d
 {
     assert(psocket);
 
-    /* send three parts, command & data & a LE 4byte sequence number */
-    unsigned char msgseq[sizeof(uint32_t)];
-    WriteLE32(&msgseq[0], nSequence);
-    int rc = zmq_send_multipart(psocket, command, strlen(command), data, size, msgseq, (size_t)sizeof(uint32_t), (void*)0);
-    if (rc == -1)
+    /* the sender thread sends three parts, command & data & a LE 4byte sequence number */
+    CZMQQueuedMessage msg;
+    msg.psocket = psocket;
+    msg.command = command;
+    msg.data.assign((const unsigned char*)data, (const unsigned char*)data + size);
+    msg.nSequence = nSequence;
+    if (!sendQueue.Push(std::move(msg)))
         return false;
 
-    /* increment memory only sequence number after sending */
+    /* increment memory only sequence number, whether or not the message fit */
     nSequence++;
 
     return true;
 }
 
-bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+/** The new tip's block, taken from pblock if the caller still has it in memory */
+static bool GetNotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock, std::shared_ptr<const CBlock>& blockOut)
+{
+    if (pblock) {
+        blockOut = pblock;
+        return true;
+    }
+
+    std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+    {
+        LOCK(cs_main);
+        if (!ReadBlockFromDisk(*pblockRead, pindex, Params().GetConsensus()))
+        {
+            zmqError("Can't read block from disk");
+            return false;
+        }
+    }
+    blockOut = pblockRead;
+    return true;
+}
+
+bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& /*pblock*/)
 {
     uint256 hash = pindex->GetBlockHash();
     LogPrint("zmq", "zmq: Publish hashblock %s\n", hash.GetHex());
@@ -162,27 +302,78 @@ bool CZMQPublishHashTransactionNotifier::NotifyTransaction(const CTransaction &t
     return SendMessage(MSG_HASHTX, data, 32);
 }
 
-bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQPublishSequenceNotifier::NotifyMempoolSequence(const uint256 &hash, bool fAdded, uint64_t nMempoolSequence)
+{
+    LogPrint("zmq", "zmq: Publish sequence %s %c %u\n", hash.GetHex(), fAdded ? 'A' : 'R', nMempoolSequence);
+    unsigned char data[32 + 1 + sizeof(uint64_t)];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    data[32] = fAdded ? 'A' : 'R';
+    WriteLE64(&data[33], nMempoolSequence);
+    return SendMessage(MSG_SEQUENCE, data, sizeof(data));
+}
+
+bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock)
 {
     LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-    const Consensus::Params& consensusParams = Params().GetConsensus();
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
-    {
-        LOCK(cs_main);
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex, consensusParams))
+    // A block no longer in memory is sent as stored, if that is its serialization
+    if (!pblock && IsRawBlockSerialization(pindex, RPCSerializationFlags(), Params().GetConsensus())) {
+        std::vector<unsigned char> vchBlock;
         {
-            zmqError("Can't read block from disk");
-            return false;
+            LOCK(cs_main);
+            if (!ReadRawBlockFromDisk(vchBlock, pindex, Params().MessageStart()))
+            {
+                zmqError("Can't read block from disk");
+                return false;
+            }
         }
-
-        ss << block;
+        return SendMessage(MSG_RAWBLOCK, vchBlock.data(), vchBlock.size());
     }
 
+    std::shared_ptr<const CBlock> block;
+    if (!GetNotifyBlock(pindex, pblock, block))
+        return false;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+    ss << *block;
+
     return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
 }
 
+bool CZMQPublishHashStakeNotifier::NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock)
+{
+    if (!pindex->IsProofOfStake())
+        return true;
+
+    std::shared_ptr<const CBlock> block;
+    if (!GetNotifyBlock(pindex, pblock, block))
+        return false;
+    if (block->vtx.size() < 2 || !block->vtx[1]->IsCoinStake())
+        return true;
+
+    uint256 hash = block->vtx[1]->GetHash();
+    uint256 hashBlock = pindex->GetBlockHash();
+    LogPrint("zmq", "zmq: Publish hashstake %s\n", hash.GetHex());
+    char data[64];
+    for (unsigned int i = 0; i < 32; i++) {
+        data[31 - i] = hash.begin()[i];
+        data[63 - i] = hashBlock.begin()[i];
+    }
+    return SendMessage(MSG_HASHSTAKE, data, 64);
+}
+
+bool CZMQPublishConnectStatsNotifier::NotifyBlockConnected(const CBlockIndex *pindex)
+{
+    CBlockConnectStats stats;
+    if (!GetBlockConnectStats(pindex->GetBlockHash(), stats))
+        return true; // Connected too long ago, or by VerifyDB
+    LogPrint("zmq", "zmq: Publish connectstats %s\n", stats.hash.GetHex());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << stats;
+    return SendMessage(MSG_CONNECTSTATS, &(*ss.begin()), ss.size());
+}
+
 bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
 {
     uint256 hash = transaction.GetHash();
@@ -191,3 +382,41 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishRawTransactionDeltaNotifier::NotifyTransaction(const CTransaction &transaction)
+{
+    // Net amount per address, in address index terms. Spent outputs are
+    // only known through the spent index.
+    std::map<std::pair<int, uint160>, CAmount> mapDeltas;
+    if (!transaction.IsCoinBase()) {
+        for (const CTxIn& txin : transaction.vin) {
+            CSpentIndexKey key(txin.prevout.hash, txin.prevout.n);
+            CSpentIndexValue value;
+            if (GetSpentIndex(key, value) && value.addressType > 0)
+                mapDeltas[std::make_pair(value.addressType, value.addressHash)] -= value.satoshis;
+        }
+    }
+    for (const CTxOut& txout : transaction.vout) {
+        int type;
+        uint160 hashBytes;
+        GetIndexAddress(txout.scriptPubKey, type, hashBytes);
+        if (type > 0)
+            mapDeltas[std::make_pair(type, hashBytes)] += txout.nValue;
+    }
+    if (mapDeltas.empty())
+        return true;
+
+    LogPrint("zmq", "zmq: Publish rawtxdelta %s for %u addresses\n", transaction.GetHash().GetHex(), mapDeltas.size());
+
+    /* address type (1 byte) & address hash (20 bytes) & LE 8byte signed delta & raw transaction */
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | RPCSerializationFlags());
+    ss << (unsigned char)0 << uint160() << (int64_t)0 << transaction;
+    for (const auto& delta : mapDeltas) {
+        ss[0] = (char)delta.first.first;
+        memcpy(&ss[1], delta.first.second.begin(), 20);
+        WriteLE64((unsigned char*)&ss[21], (uint64_t)delta.second);
+        if (!SendMessage(MSG_RAWTXDELTA, &(*ss.begin()), ss.size()))
+            return false;
+    }
+    return true;
+}
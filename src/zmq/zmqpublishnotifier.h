@@ -15,23 +15,32 @@ private:
     uint32_t nSequence; //!< upcounting per message sequence number
 
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0) { }
 
-    /* send zmq multipart message
+    /* queue zmq multipart message for the sender thread
        parts:
           * command
           * data
           * message sequence number
+       A message that does not fit in the queue is dropped, but still
+       takes its sequence number so subscribers can see the gap.
+       Fails only if the sender thread is not running.
     */
     bool SendMessage(const char *command, const void* data, size_t size);
 
     bool Initialize(void *pcontext);
     void Shutdown();
+
+    /** Start the thread that sends queued messages, with room for nMaxQueued of them */
+    static void StartSender(size_t nMaxQueued);
+    /** Send whatever is still queued, then stop the sender thread */
+    static void StopSender();
 };
 
 class CZMQPublishHashBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock);
 };
 
 class CZMQPublishHashTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -43,7 +52,7 @@ public:
 class CZMQPublishRawBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock);
 };
 
 class CZMQPublishRawTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -52,4 +61,32 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+/** Publishes the coinstake txid and block hash of each new proof-of-stake tip */
+class CZMQPublishHashStakeNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock);
+};
+
+/** Publishes the CBlockConnectStats of every block connected */
+class CZMQPublishConnectStatsNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlockConnected(const CBlockIndex *pindex);
+};
+
+/** Publishes each mempool addition and removal with its mempool sequence, as getmempoolchanges reports them */
+class CZMQPublishSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyMempoolSequence(const uint256 &hash, bool fAdded, uint64_t nMempoolSequence);
+};
+
+/** Publishes one message per address a transaction pays to or spends from */
+class CZMQPublishRawTransactionDeltaNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyTransaction(const CTransaction &transaction);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H